@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "kll.h"
+
+namespace dist_proc {
+namespace aggregation {
+
+namespace {
+
+enum ValueOrder { RANDOM, SORTED, REVERSED };
+
+// Latency-like values: mostly small, with a long tail.
+std::vector<int64_t> createValues(int count, ValueOrder order) {
+    std::mt19937_64 gen(42);
+    std::lognormal_distribution<double> dis(10, 2);
+    std::vector<int64_t> values(count);
+    for (int64_t& value : values) {
+        value = static_cast<int64_t>(dis(gen));
+    }
+    if (order == SORTED) {
+        std::sort(values.begin(), values.end());
+    } else if (order == REVERSED) {
+        std::sort(values.rbegin(), values.rend());
+    }
+    return values;
+}
+
+// Adds one value at a time.
+void BM_KllAdd(benchmark::State& state, ValueOrder order) {
+    const std::vector<int64_t> values = createValues(state.range(0), order);
+    for (auto _ : state) {
+        std::unique_ptr<KllQuantile> kll = KllQuantile::Create();
+        for (const int64_t value : values) {
+            kll->Add(value);
+        }
+        benchmark::DoNotOptimize(kll->num_stored_values());
+    }
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK_CAPTURE(BM_KllAdd, random, RANDOM)->Range(1 << 10, 1 << 20);
+BENCHMARK_CAPTURE(BM_KllAdd, sorted, SORTED)->Range(1 << 10, 1 << 20);
+BENCHMARK_CAPTURE(BM_KllAdd, reversed, REVERSED)->Range(1 << 10, 1 << 20);
+
+// Adds all values with one AddBatch call.
+void BM_KllAddBatch(benchmark::State& state, ValueOrder order) {
+    const std::vector<int64_t> values = createValues(state.range(0), order);
+    for (auto _ : state) {
+        std::unique_ptr<KllQuantile> kll = KllQuantile::Create();
+        kll->AddBatch(values);
+        benchmark::DoNotOptimize(kll->num_stored_values());
+    }
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK_CAPTURE(BM_KllAddBatch, random, RANDOM)->Range(1 << 10, 1 << 20);
+BENCHMARK_CAPTURE(BM_KllAddBatch, sorted, SORTED)->Range(1 << 10, 1 << 20);
+BENCHMARK_CAPTURE(BM_KllAddBatch, reversed, REVERSED)->Range(1 << 10, 1 << 20);
+
+// Serializes a sketch, with the full or the compact encoding. Reports the serialized size.
+void BM_KllSerialize(benchmark::State& state, bool compact) {
+    const std::vector<int64_t> values = createValues(state.range(0), RANDOM);
+    std::unique_ptr<KllQuantile> kll = KllQuantile::Create();
+    kll->AddBatch(values);
+    size_t bytes = 0;
+    for (auto _ : state) {
+        const zetasketch::android::AggregatorStateProto proto =
+                compact ? kll->SerializeToCompactProto() : kll->SerializeToProto();
+        bytes = proto.ByteSizeLong();
+    }
+    state.counters["bytes"] = bytes;
+}
+BENCHMARK_CAPTURE(BM_KllSerialize, full, false)->Range(1 << 10, 1 << 20);
+BENCHMARK_CAPTURE(BM_KllSerialize, compact, true)->Range(1 << 10, 1 << 20);
+
+}  // namespace
+
+}  // namespace aggregation
+}  // namespace dist_proc
+
+BENCHMARK_MAIN();
@@ -28,12 +28,25 @@ namespace dist_proc {
 namespace aggregation {
 namespace internal {
 
+namespace {
+
+// Copies every second item of in, starting at offset, to out. Kept free of branches and
+// bounds checks, so that the compiler turns it into strided vector loads.
+void CopyAlternateItems(const int64_t* in, size_t count, size_t offset, int64_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = in[2 * i + offset];
+    }
+}
+
+}  // namespace
+
 CompactorStack::CompactorStack(int64_t inv_eps, int64_t inv_delta, RandomGenerator* random)
     : CompactorStack(inv_eps, inv_delta, 0, random) {
 }
 
-CompactorStack::CompactorStack(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random)
-    : random_(random) {
+CompactorStack::CompactorStack(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random,
+                               std::shared_ptr<CompactorBufferPool> buffer_pool)
+    : random_(random), buffer_pool_(std::move(buffer_pool)) {
     if (k != 0) {
         k_ = k;
     } else {
@@ -58,14 +71,41 @@ void CompactorStack::Reset() {
 
 void CompactorStack::Add(const int64_t value) {
     if (sampler_ == nullptr) {
-        compactors_[0].push_back(value);
-        num_items_in_compactors_++;
+        AppendToLevel(0, value);
         CompactStack();
     } else {
         sampler_->Add(value);
     }
 }
 
+void CompactorStack::AddBatch(std::span<const int64_t> values) {
+    while (!values.empty()) {
+        if (sampler_ != nullptr) {
+            for (const int64_t value : values) {
+                sampler_->Add(value);
+            }
+            return;
+        }
+        // Add calls CompactStack after every item, which only does work once the compactors
+        // reach overall_capacity_. Copy the items up to that point at once.
+        const size_t num_items_until_full = static_cast<size_t>(
+                std::max(overall_capacity_ - num_items_in_compactors_, 1));
+        const std::span<const int64_t> run = values.first(std::min(num_items_until_full,
+                                                                   values.size()));
+        EnsureLevelBuffer(0);
+        std::vector<int64_t>& compactor = compactors_[0];
+        if (sorted_prefix_sizes_[0] == compactor.size() &&
+            std::is_sorted(run.begin(), run.end()) &&
+            (compactor.empty() || compactor.back() <= run.front())) {
+            sorted_prefix_sizes_[0] += run.size();
+        }
+        compactor.insert(compactor.end(), run.begin(), run.end());
+        num_items_in_compactors_ += run.size();
+        CompactStack();
+        values = values.subspan(run.size());
+    }
+}
+
 // Adds an item to the compactor stack with weight >= 1.
 // Does nothing if weight <= 0.
 void CompactorStack::AddWithWeight(int64_t value, int weight) {
@@ -82,8 +122,7 @@ void CompactorStack::AddWithWeight(int64_t value, int weight) {
                 AddLevel();
             }
             if ((remaining_weight & 1) != 0) {
-                compactors_[level_to_add].push_back(value);
-                num_items_in_compactors_++;
+                AppendToLevel(level_to_add, value);
             }
             remaining_weight >>= 1;
             level_to_add++;
@@ -92,19 +131,103 @@ void CompactorStack::AddWithWeight(int64_t value, int weight) {
     }
 }
 
+void CompactorStack::Merge(const CompactorStack& other) {
+    // Add the levels first: adding a level may replace the lowest levels by the sampler, which
+    // must happen before items are placed on them.
+    while (compactors_.size() < other.compactors_.size()) {
+        AddLevel();
+    }
+    for (size_t level = 0; level < other.compactors_.size(); level++) {
+        const std::vector<int64_t>& items = other.compactors_[level];
+        if (items.empty()) {
+            continue;
+        }
+        if (static_cast<int>(level) < lowest_active_level()) {
+            // The level is replaced by the sampler here, so the items go through it with the
+            // weight of their level.
+            for (const int64_t item : items) {
+                AddWithWeight(item, 1 << level);
+            }
+            continue;
+        }
+        EnsureLevelBuffer(level);
+        compactors_[level].insert(compactors_[level].end(), items.begin(), items.end());
+        num_items_in_compactors_ += items.size();
+    }
+    const auto sampled_item_and_weight = other.sampled_item_and_weight();
+    if (sampled_item_and_weight.has_value()) {
+        AddWithWeight(sampled_item_and_weight->first, sampled_item_and_weight->second);
+    }
+    CompactStack();
+}
+
 void CompactorStack::SortCompactorContents() {
-    for (std::vector<int64_t>& compactor : compactors_) {
-        std::sort(compactor.begin(), compactor.end());
+    for (size_t level = 0; level < compactors_.size(); level++) {
+        SortLevel(level);
+    }
+}
+
+void CompactorStack::CompactTo(int max_num_items) {
+    while (num_stored_items() > max_num_items) {
+        size_t level = lowest_active_level();
+        while (level < compactors_.size() && compactors_[level].size() < 2) {
+            level++;
+        }
+        if (level == compactors_.size()) {
+            return;
+        }
+        // Halving the level removes at least one item, so this terminates.
+        CompactLevel(level);
     }
 }
 
 void CompactorStack::ClearCompactors() {
+    for (size_t level = 0; level < compactors_.size(); level++) {
+        ReleaseLevel(level);
+    }
     compactors_.clear();
+    sorted_prefix_sizes_.clear();
     num_items_in_compactors_ = 0;
 }
 
+void CompactorStack::EnsureLevelBuffer(size_t level) {
+    if (buffer_pool_ != nullptr && compactors_[level].capacity() == 0) {
+        compactors_[level] = buffer_pool_->Acquire();
+    }
+}
+
+void CompactorStack::ReleaseLevel(size_t level) {
+    if (buffer_pool_ != nullptr) {
+        buffer_pool_->Release(std::move(compactors_[level]));
+    }
+    std::vector<int64_t>().swap(compactors_[level]);
+    sorted_prefix_sizes_[level] = 0;
+}
+
+void CompactorStack::AppendToLevel(size_t level, int64_t value) {
+    EnsureLevelBuffer(level);
+    std::vector<int64_t>& compactor = compactors_[level];
+    if (sorted_prefix_sizes_[level] == compactor.size() &&
+        (compactor.empty() || compactor.back() <= value)) {
+        sorted_prefix_sizes_[level]++;
+    }
+    compactor.push_back(value);
+    num_items_in_compactors_++;
+}
+
+void CompactorStack::SortLevel(size_t level) {
+    std::vector<int64_t>& compactor = compactors_[level];
+    const auto sorted_end = compactor.begin() + sorted_prefix_sizes_[level];
+    if (sorted_end != compactor.end()) {
+        std::sort(sorted_end, compactor.end());
+        std::inplace_merge(compactor.begin(), sorted_end, compactor.end());
+    }
+    sorted_prefix_sizes_[level] = compactor.size();
+}
+
 void CompactorStack::AddLevel() {
     compactors_.resize(compactors_.size() + 1);
+    sorted_prefix_sizes_.resize(compactors_.size());
 
     int cap_at_lowest_active_level = TargetCapacityAtLevel(lowest_active_level());
     // All levels i get capacity that previously level i-1 had, except the
@@ -150,30 +273,40 @@ void CompactorStack::CompactLevel(int level) {
     if (level == static_cast<int>(compactors_.size()) - 1) {
         AddLevel();
     }
-    Halve(&compactors_[level], &compactors_[level + 1]);
-    std::vector<int64_t>().swap(compactors_[level]);
+    EnsureLevelBuffer(level + 1);
+    Halve(level);
+    ReleaseLevel(level);
 }
 
 // To compact the items in a compactor to roughly half the size,
 // sorts the items and adds every even or odd item (determined randomly)
-// to the up_compactor.
-void CompactorStack::Halve(std::vector<int64_t>* down_compactor,
-                           std::vector<int64_t>* up_compactor) {
-    std::sort(down_compactor->begin(), down_compactor->end());
-    double half_of_items = down_compactor->size() / static_cast<double>(2);
+// to the compactor one level up.
+void CompactorStack::Halve(size_t level) {
+    SortLevel(level);
+    std::vector<int64_t>& down_compactor = compactors_[level];
+    std::vector<int64_t>& up_compactor = compactors_[level + 1];
+    double half_of_items = down_compactor.size() / static_cast<double>(2);
     bool keep_even_items = (random_->UnbiasedUniform(2) == 0);
-    num_items_in_compactors_ -= static_cast<int>(keep_even_items ? std::floor(half_of_items)
-                                                                 : std::ceil(half_of_items));
+    const size_t num_kept_items = static_cast<size_t>(keep_even_items ? std::ceil(half_of_items)
+                                                                      : std::floor(half_of_items));
+    num_items_in_compactors_ -= static_cast<int>(down_compactor.size() - num_kept_items);
 
-    bool even = true;
+    const size_t up_size = up_compactor.size();
+    up_compactor.resize(up_size + num_kept_items);
+    CopyAlternateItems(down_compactor.data(), num_kept_items, keep_even_items ? 0 : 1,
+                       up_compactor.data() + up_size);
+    down_compactor.clear();
+    sorted_prefix_sizes_[level] = 0;
 
-    for (size_t i = 0; i < down_compactor->size(); i++) {
-        if (even == keep_even_items) {
-            up_compactor->push_back((*down_compactor)[i]);
+    // The kept items are sorted. If the upper compactor was sorted before, merge them into it
+    // while both runs are at hand, so that halving it later does not need to sort.
+    if (sorted_prefix_sizes_[level + 1] == up_size) {
+        const auto run_begin = up_compactor.begin() + up_size;
+        if (up_size > 0 && run_begin != up_compactor.end() && *(run_begin - 1) > *run_begin) {
+            std::inplace_merge(up_compactor.begin(), run_begin, up_compactor.end());
         }
-        even = !even;
+        sorted_prefix_sizes_[level + 1] = up_compactor.size();
     }
-    down_compactor->clear();
 }
 
 int CompactorStack::TargetCapacityAtLevel(int h) const {
@@ -62,6 +62,20 @@ void Encoder::SerializeToPackedStringAll(std::vector<int64_t>::const_iterator be
     }
 }
 
+void Encoder::SerializeToDiffEncodedPackedStringAll(std::vector<int64_t>::const_iterator begin,
+                                                    std::vector<int64_t>::const_iterator end,
+                                                    std::string* dst) {
+    dst->clear();
+    uint64_t previous = 0;
+    for (; begin != end; ++begin) {
+        // Computed unsigned, so that the difference of items far apart wraps around instead of
+        // overflowing.
+        const uint64_t current = static_cast<uint64_t>(*begin);
+        Encoder::AppendToString(static_cast<int64_t>(current - previous), dst);
+        previous = current;
+    }
+}
+
 }  // namespace encoding
 }  // namespace aggregation
 }  // namespace dist_proc
\ No newline at end of file
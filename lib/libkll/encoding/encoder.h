@@ -35,6 +35,12 @@ public:
                                            std::vector<int64_t>::const_iterator end,
                                            std::string* dst);
 
+    // Like SerializeToPackedStringAll, but encodes each item after the first as its difference
+    // to the item before. The items must be sorted, so that the differences are small.
+    static void SerializeToDiffEncodedPackedStringAll(std::vector<int64_t>::const_iterator begin,
+                                                      std::vector<int64_t>::const_iterator end,
+                                                      std::string* dst);
+
 private:
     // Max number of bytes needed to encode 64 bits as a varint (= ceil(64 / 7)).
     static const int8_t kMaxLength = 10;
@@ -136,6 +136,22 @@ TEST(EncoderTest, SerializeToPackedStringAllClearsPrepopulatedString) {
     EXPECT_EQ(empty, prepopulated);
 }
 
+TEST(EncoderTest, SerializeToDiffEncodedPackedStringAll) {
+    std::string packed = "some leftovers";
+    std::vector<int64_t> v = {3, 3, 5, 0x83, 0x200083};
+    Encoder::SerializeToDiffEncodedPackedStringAll(v.begin(), v.end(), &packed);
+    // 3, then the differences 0, 2, 0x7E and 0x200000.
+    EXPECT_EQ(packed, std::string_view("\x3\0\x2\x7E\x80\x80\x80\x1", 8));
+
+    // Differences wrap around instead of overflowing.
+    v = {std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+    Encoder::SerializeToDiffEncodedPackedStringAll(v.begin(), v.end(), &packed);
+    std::string expected;
+    Encoder::AppendToString(std::numeric_limits<int64_t>::min(), &expected);
+    Encoder::AppendToString(-1, &expected);
+    EXPECT_EQ(packed, expected);
+}
+
 }  // namespace
 
 }  // namespace encoding
@@ -44,3 +44,18 @@ char* Varint::Encode64(char* sptr, uint64_t v) {
         }
     }
 }
+
+const char* Varint::Parse64(const char* sptr, const char* limit, uint64_t* v) {
+    const unsigned char* ptr = reinterpret_cast<const unsigned char*>(sptr);
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(limit);
+    uint64_t result = 0;
+    for (int shift = 0; shift < 7 * kMax64 && ptr < end; shift += 7) {
+        const uint64_t byte = *(ptr++);
+        result |= (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *v = result;
+            return reinterpret_cast<const char*>(ptr);
+        }
+    }
+    return nullptr;
+}
@@ -30,6 +30,13 @@ public:
     static char* Encode32(char* ptr, uint32_t v);
     static char* Encode64(char* ptr, uint64_t v);
 
+    // REQUIRES   "ptr" points to a varint encoded by Encode32 or Encode64, and
+    //            "limit" just past the last byte it may read.
+    // EFFECTS    Decodes the varint at "ptr" into "*v" and returns a pointer to
+    //            the byte just past it, or nullptr if it runs past "limit" or is
+    //            longer than kMax64 bytes.
+    static const char* Parse64(const char* ptr, const char* limit, uint64_t* v);
+
     // EFFECTS    Returns the encoding length of the specified value.
     static int Length64(uint64_t v);
 
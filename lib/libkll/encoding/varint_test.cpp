@@ -17,6 +17,7 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cstdint>
 
 // A straightforward implementation of Length64 for testing
@@ -84,3 +85,24 @@ TEST(VarintTest, Encode64) {
     *end_s = '\0';  // terminate the string
     ASSERT_EQ(std::string(s), std::string(reinterpret_cast<char*>(n_encrypt)));
 }
+
+TEST(VarintTest, Parse64) {
+    char s[Varint::kMax64];
+    for (int i = 0; i < 64; i++) {
+        for (uint64_t n : {(1ull << i) - 1, 1ull << i, (1ull << i) + 1, ~0ull >> i}) {
+            char* end_s = Varint::Encode64(s, n);
+            uint64_t decoded = 0;
+            ASSERT_EQ(Varint::Parse64(s, end_s, &decoded), end_s);
+            ASSERT_EQ(decoded, n);
+            // A varint cut short is rejected.
+            ASSERT_EQ(Varint::Parse64(s, end_s - 1, &decoded), nullptr);
+        }
+    }
+
+    // Longer than kMax64 bytes.
+    char overlong[Varint::kMax64 + 1];
+    std::fill(overlong, overlong + Varint::kMax64, '\x80');
+    overlong[Varint::kMax64] = 0;
+    uint64_t decoded = 0;
+    ASSERT_EQ(Varint::Parse64(overlong, overlong + sizeof(overlong), &decoded), nullptr);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dist_proc {
+namespace aggregation {
+
+// Pool of compactor level buffers that can be shared by the compactor stacks of many sketches.
+// A level that gets compacted hands its buffer back to the pool, and the next level of any
+// sketch that starts filling up again takes it, so that many sketches with mostly idle levels do
+// not each hold on to their own allocations.
+//
+// Not thread-safe: all the sketches sharing a pool must be used from the same thread or under the
+// same lock.
+class CompactorBufferPool {
+public:
+    static constexpr size_t kDefaultMaxPooledBuffers = 64;
+
+    explicit CompactorBufferPool(size_t max_pooled_buffers = kDefaultMaxPooledBuffers)
+        : max_pooled_buffers_(max_pooled_buffers) {
+    }
+
+    // Returns an empty buffer, with the capacity of a released one if there are any.
+    std::vector<int64_t> Acquire();
+
+    // Gives buffer back to the pool. Buffers without capacity, and buffers released while the
+    // pool is full, are dropped.
+    void Release(std::vector<int64_t>&& buffer);
+
+    // Number of buffers currently held by the pool.
+    size_t size() const {
+        return buffers_.size();
+    }
+
+private:
+    const size_t max_pooled_buffers_;
+    std::vector<std::vector<int64_t>> buffers_;
+
+    CompactorBufferPool(const CompactorBufferPool&) = delete;
+    CompactorBufferPool& operator=(const CompactorBufferPool&) = delete;
+};
+
+}  // namespace aggregation
+}  // namespace dist_proc
@@ -20,9 +20,11 @@
 #include <cmath>
 #include <cstdint>
 #include <memory>
+#include <span>
 #include <utility>
 #include <vector>
 
+#include "compactor_buffer_pool.h"
 #include "random_generator.h"
 #include "sampler.h"
 
@@ -38,7 +40,9 @@ class KllSampler;
 class CompactorStack {
 public:
     CompactorStack(int64_t inv_eps, int64_t inv_delta, RandomGenerator* random);
-    CompactorStack(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random);
+    // If buffer_pool is set, the compactor level buffers are drawn from and returned to it.
+    CompactorStack(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random,
+                   std::shared_ptr<CompactorBufferPool> buffer_pool = nullptr);
     ~CompactorStack();
 
     // Initialize or reset the compactor stack and all counters and thresholds.
@@ -46,13 +50,25 @@ public:
 
     void Add(const int64_t value);
 
+    // Adds the values one after another, with the same results as calling Add for each of them,
+    // but copying them into the lowest compactor in runs while no compaction is due.
+    void AddBatch(std::span<const int64_t> values);
+
     // Adds an item to the compactor stack with weight >= 1.
     // Does nothing if weight <= 0.
     void AddWithWeight(int64_t value, int weight);
 
+    // Adds the items of other to this compactor stack, each at its level in other, i.e. with
+    // the weight it carries there. Other must not be this compactor stack.
+    void Merge(const CompactorStack& other);
+
     // Ensures that the contents of each compactor are sorted.
     void SortCompactorContents();
 
+    // Compacts levels, lowest first, until at most max_num_items items are stored or no level
+    // holds more than one item.
+    void CompactTo(int max_num_items);
+
     // Target capacity of compactor with index h. If this capacity is exceeded,
     // the compactor will be lazily compacted in one of the next CompactStack()
     // runs. I.e., this capacity can be temorarily exceeded.
@@ -90,6 +106,19 @@ public:
 private:
     void ClearCompactors();
 
+    // Gives the compactor at level a buffer from buffer_pool_ if it does not have one.
+    void EnsureLevelBuffer(size_t level);
+
+    // Empties the compactor at level and gives its buffer back to buffer_pool_, or frees it.
+    void ReleaseLevel(size_t level);
+
+    // Appends value to the compactor at level, keeping track of its sorted prefix.
+    void AppendToLevel(size_t level, int64_t value);
+
+    // Sorts the compactor at level. Only the items past its sorted prefix are sorted, and then
+    // merged into it.
+    void SortLevel(size_t level);
+
     // Adds a new compactor at the highest level. To be called when the currently
     // topmost compactor is full.
     void AddLevel();
@@ -102,18 +131,23 @@ private:
 
     void CompactLevel(int level);
 
-    // To compact the items in a compactor to roughly half the size,
+    // To compact the items in the compactor at level to roughly half the size,
     // sorts the items and adds every even or odd item (determined randomly)
-    // to the up_compactor.
-    void Halve(std::vector<int64_t>* down_compactor, std::vector<int64_t>* up_compactor);
+    // to the compactor one level up. The added items form a sorted run, which
+    // is merged into the upper compactor if that one is sorted as well.
+    void Halve(size_t level);
 
     std::vector<std::vector<int64_t>> compactors_;
+    // Parallel to compactors_: the number of leading items of each compactor that are known to
+    // be sorted. Halving only sorts the items after that prefix.
+    std::vector<size_t> sorted_prefix_sizes_;
     int k_;
     const double c_ = 2.0 / 3.0;
     int overall_capacity_;
     int num_items_in_compactors_;
     RandomGenerator* random_;
     std::unique_ptr<KllSampler> sampler_;
+    std::shared_ptr<CompactorBufferPool> buffer_pool_;
 };
 
 }  // namespace internal
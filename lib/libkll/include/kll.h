@@ -52,6 +52,9 @@ public:
     void Reset();
     void Add(int64_t value);
 
+    // Adds all values, with the same result as calling Add for each of them.
+    void AddBatch(std::span<const int64_t> values);
+
     // Adds a value to the aggregator with multiplicity 'weight' (same as adding
     // the value with Add(value) 'weight' times). Does nothing if weight <= 0.
     //
@@ -65,22 +68,41 @@ public:
     // downscaling and randomized rounding is negligible.
     void AddWeighted(int64_t value, int weight);
 
+    // Merges the values aggregated by other into this aggregator. The compactors of other are
+    // added level by level with the weight their items carry, so the values are not sampled
+    // again. Both aggregators must have the same inv_eps and k. Returns false and leaves this
+    // aggregator unchanged otherwise, or if other is this aggregator.
+    bool Merge(const KllQuantile& other, std::string* error = nullptr);
+
     // Not safe to be called concurrently.
     zetasketch::android::AggregatorStateProto SerializeToProto();
 
+    // Like SerializeToProto, but smaller: the sorted compactors are diff-encoded, and the fields
+    // that all aggregators created with the same options share (type, value_type, k and
+    // inv_eps) are left unset, for the reader to take from elsewhere. Not safe to be called
+    // concurrently.
+    zetasketch::android::AggregatorStateProto SerializeToCompactProto();
+
+    // Compacts the aggregator until it stores at most max_stored_values values, or as few as it
+    // can. Quantiles become less accurate, in exchange for a smaller serialized aggregator.
+    void CompactTo(int64_t max_stored_values);
+
     bool IsSamplerOn() const {
         return compactor_stack_.IsSamplerOn();
     }
 
 private:
     // Constructor.
-    KllQuantile(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random)
+    KllQuantile(int64_t inv_eps, int64_t inv_delta, int k, RandomGenerator* random,
+                std::shared_ptr<CompactorBufferPool> buffer_pool)
         : inv_eps_(inv_eps),
           owned_random_(random != nullptr ? nullptr : std::make_unique<MTRandomGenerator>()),
           compactor_stack_(inv_eps_, inv_delta, k,
-                           random != nullptr ? random : owned_random_.get()) {
+                           random != nullptr ? random : owned_random_.get(),
+                           std::move(buffer_pool)) {
         Reset();
     }
+    zetasketch::android::AggregatorStateProto Serialize(bool compact);
     void UpdateMin(const int64_t value);
     void UpdateMax(const int64_t value);
     int64_t inv_eps_;
@@ -142,11 +164,22 @@ public:
         return random_;
     }
 
+    // Set the pool that the compactor level buffers are drawn from. Aggregators sharing a pool
+    // keep it alive, and must not be used concurrently. Default is no pool.
+    void set_buffer_pool(std::shared_ptr<CompactorBufferPool> buffer_pool) {
+        buffer_pool_ = std::move(buffer_pool);
+    }
+
+    const std::shared_ptr<CompactorBufferPool>& buffer_pool() const {
+        return buffer_pool_;
+    }
+
 private:
     int64_t inv_eps_ = 1000;
     int64_t inv_delta_ = 100000;
     int k_ = 0;
     RandomGenerator* random_ = nullptr;
+    std::shared_ptr<CompactorBufferPool> buffer_pool_;
 };
 
 }  // namespace aggregation
@@ -16,7 +16,9 @@
 
 #include "kll.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <memory>
 
 #include "aggregator.pb.h"
@@ -42,7 +44,8 @@ std::unique_ptr<KllQuantile> KllQuantile::Create(const KllQuantileOptions& optio
         return nullptr;
     }
     return std::unique_ptr<KllQuantile>(
-            new KllQuantile(options.inv_eps(), options.inv_delta(), options.k(), options.random()));
+            new KllQuantile(options.inv_eps(), options.inv_delta(), options.k(), options.random(),
+                            options.buffer_pool()));
 }
 
 void KllQuantile::Add(const int64_t value) {
@@ -52,6 +55,17 @@ void KllQuantile::Add(const int64_t value) {
     num_values_++;
 }
 
+void KllQuantile::AddBatch(std::span<const int64_t> values) {
+    if (values.empty()) {
+        return;
+    }
+    compactor_stack_.AddBatch(values);
+    const auto [min, max] = std::minmax_element(values.begin(), values.end());
+    UpdateMin(*min);
+    UpdateMax(*max);
+    num_values_ += values.size();
+}
+
 void KllQuantile::AddWeighted(int64_t value, int weight) {
     if (weight > 0) {
         compactor_stack_.AddWithWeight(value, weight);
@@ -61,18 +75,58 @@ void KllQuantile::AddWeighted(int64_t value, int weight) {
     }
 }
 
+bool KllQuantile::Merge(const KllQuantile& other, std::string* error) {
+    if (&other == this) {
+        if (error != nullptr) {
+            *error = "cannot merge an aggregator into itself";
+        }
+        return false;
+    }
+    if (other.inv_eps_ != inv_eps_ || other.k() != k()) {
+        if (error != nullptr) {
+            *error = "inv_eps and k have to match";
+        }
+        return false;
+    }
+    if (other.num_values_ == 0) {
+        return true;
+    }
+    compactor_stack_.Merge(other.compactor_stack_);
+    UpdateMin(other.min_);
+    UpdateMax(other.max_);
+    num_values_ += other.num_values_;
+    return true;
+}
+
 AggregatorStateProto KllQuantile::SerializeToProto() {
+    return Serialize(/*compact=*/false);
+}
+
+AggregatorStateProto KllQuantile::SerializeToCompactProto() {
+    return Serialize(/*compact=*/true);
+}
+
+void KllQuantile::CompactTo(int64_t max_stored_values) {
+    compactor_stack_.CompactTo(static_cast<int>(
+            std::min<int64_t>(max_stored_values, std::numeric_limits<int>::max())));
+}
+
+AggregatorStateProto KllQuantile::Serialize(bool compact) {
     AggregatorStateProto aggregator_state;
 
-    aggregator_state.set_type(zetasketch::android::KLL_QUANTILES);
     aggregator_state.set_num_values(num_values_);
-    aggregator_state.set_value_type(zetasketch::android::DefaultOpsType::INT64);
+    if (!compact) {
+        aggregator_state.set_type(zetasketch::android::KLL_QUANTILES);
+        aggregator_state.set_value_type(zetasketch::android::DefaultOpsType::INT64);
+    }
 
     zetasketch::android::KllQuantilesStateProto* quantile_state =
             aggregator_state.MutableExtension(zetasketch::android::kll_quantiles_state);
 
-    quantile_state->set_k(compactor_stack_.k());
-    quantile_state->set_inv_eps(inv_eps_);
+    if (!compact) {
+        quantile_state->set_k(compactor_stack_.k());
+        quantile_state->set_inv_eps(inv_eps_);
+    }
 
     if (num_values_ == 0) {
         return aggregator_state;
@@ -92,11 +146,17 @@ AggregatorStateProto KllQuantile::SerializeToProto() {
     quantile_state->mutable_compactors()->Reserve(compactors.size());
 
     for (const auto& compactor : compactors) {
-        encoding::Encoder::SerializeToPackedStringAll(
-                compactor.begin(), compactor.end(),
-                quantile_state
-                        ->add_compactors()  // Adds one compactor to the compactors field.
-                        ->mutable_packed_values());
+        // Adds one compactor to the compactors field.
+        zetasketch::android::KllQuantilesStateProto::Compactor* compactor_state =
+                quantile_state->add_compactors();
+        if (compact) {
+            encoding::Encoder::SerializeToDiffEncodedPackedStringAll(
+                    compactor.begin(), compactor.end(),
+                    compactor_state->mutable_diff_encoded_packed_values());
+        } else {
+            encoding::Encoder::SerializeToPackedStringAll(compactor.begin(), compactor.end(),
+                                                          compactor_state->mutable_packed_values());
+        }
     }
 
     // Encode sampler.
@@ -15,8 +15,11 @@
  */
 #include "compactor_stack.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <random>
+#include <span>
 #include <type_traits>
 #include <vector>
 
@@ -317,6 +320,98 @@ INSTANTIATE_TEST_SUITE_P(AddWithSamplerTestCases, AddWithSamplerTest,
                                  {100, 100, 1250000},
                                  {100, 1000, 2000000}}));
 
+class AddBatchTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(AddBatchTest, AddBatchMatchesAdd) {
+    std::mt19937_64 gen(GetParam());
+    std::vector<int64_t> values(200000);
+    for (int64_t& value : values) {
+        value = static_cast<int64_t>(gen() % 1000000);
+    }
+    // Sorted stretches exercise the tracking of sorted prefixes.
+    std::sort(values.begin() + 1000, values.begin() + 50000);
+
+    MTRandomGenerator random(GetParam());
+    CompactorStack compactor_stack(100, 100000, &random);
+    for (const int64_t value : values) {
+        compactor_stack.Add(value);
+    }
+    MTRandomGenerator batch_random(GetParam());
+    CompactorStack batch_compactor_stack(100, 100000, &batch_random);
+    const std::span<const int64_t> all_values(values);
+    batch_compactor_stack.AddBatch(all_values.first(7));
+    batch_compactor_stack.AddBatch(all_values.subspan(7, 70000));
+    batch_compactor_stack.AddBatch(all_values.subspan(70007));
+
+    ASSERT_EQ(batch_compactor_stack.num_stored_items(), compactor_stack.num_stored_items());
+    EXPECT_EQ(batch_compactor_stack.sampled_item_and_weight(),
+              compactor_stack.sampled_item_and_weight());
+    compactor_stack.SortCompactorContents();
+    batch_compactor_stack.SortCompactorContents();
+    EXPECT_EQ(batch_compactor_stack.compactors(), compactor_stack.compactors());
+}
+
+TEST_P(AddBatchTest, HalvedLevelsStaySorted) {
+    std::mt19937_64 gen(GetParam());
+    MTRandomGenerator random(GetParam());
+    CompactorStack compactor_stack(1000, 100000, &random);
+    for (int i = 0; i < 100000; i++) {
+        compactor_stack.Add(static_cast<int64_t>(gen()));
+    }
+    // All levels but the lowest are only filled by halving, which keeps them sorted.
+    const std::vector<std::vector<int64_t>>& compactors = compactor_stack.compactors();
+    ASSERT_GT(compactors.size(), 2u);
+    for (size_t level = 1; level < compactors.size(); level++) {
+        EXPECT_TRUE(std::is_sorted(compactors[level].begin(), compactors[level].end()))
+                << "level " << level;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(AddBatchTestCases, AddBatchTest, ::testing::Values(1, 2, 3));
+
+TEST(CompactToTest, CompactsToTargetSize) {
+    MTRandomGenerator random(1);
+    CompactorStack compactor_stack(1000, 100000, &random);
+    for (int i = 0; i < 100000; i++) {
+        compactor_stack.Add(i);
+    }
+    ASSERT_GT(compactor_stack.num_stored_items(), 500);
+
+    const std::vector<std::vector<int64_t>> compactors = compactor_stack.compactors();
+    compactor_stack.CompactTo(500);
+    EXPECT_LE(compactor_stack.num_stored_items(), 500);
+    EXPECT_GT(compactor_stack.num_stored_items(), 250);
+
+    // The weight of the stored items still adds up to roughly the number of added items.
+    int64_t total_weight = 0;
+    for (size_t level = 0; level < compactor_stack.compactors().size(); level++) {
+        total_weight += compactor_stack.compactors()[level].size() << level;
+    }
+    EXPECT_NEAR(total_weight, 100000, 100000 * 0.1);
+
+    // A target above the number of stored items leaves them as they are.
+    MTRandomGenerator other_random(1);
+    CompactorStack other_compactor_stack(1000, 100000, &other_random);
+    for (int i = 0; i < 100000; i++) {
+        other_compactor_stack.Add(i);
+    }
+    other_compactor_stack.CompactTo(other_compactor_stack.num_stored_items());
+    EXPECT_EQ(other_compactor_stack.compactors(), compactors);
+}
+
+TEST(CompactToTest, StopsWhenNoLevelCanBeHalved) {
+    MTRandomGenerator random(1);
+    CompactorStack compactor_stack(100, 100000, &random);
+    for (int i = 0; i < 1000; i++) {
+        compactor_stack.Add(i);
+    }
+    compactor_stack.CompactTo(0);
+    EXPECT_GT(compactor_stack.num_stored_items(), 0);
+    for (const std::vector<int64_t>& compactor : compactor_stack.compactors()) {
+        EXPECT_LE(compactor.size(), 1u);
+    }
+}
+
 }  // namespace
 
 }  // namespace internal
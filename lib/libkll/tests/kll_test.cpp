@@ -171,6 +171,142 @@ TEST(KllQuantileSerializationTest, EmptyQuantilesProto) {
     EXPECT_EQ(quantiles_state.compactors_size(), 0);
     ASSERT_FALSE(quantiles_state.has_sampler());
 }
+
+TEST(KllQuantileSerializationTest, CompactProtoOmitsSharedFieldsAndDiffEncodes) {
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create();
+    for (int i = 10; i >= 1; i--) {
+        aggregator->Add(i * 100);
+    }
+
+    AggregatorStateProto aggregator_state = aggregator->SerializeToCompactProto();
+    EXPECT_EQ(aggregator_state.num_values(), 10);
+    EXPECT_FALSE(aggregator_state.has_type());
+    EXPECT_FALSE(aggregator_state.has_value_type());
+
+    ASSERT_TRUE(aggregator_state.HasExtension(kll_quantiles_state));
+    const KllQuantilesStateProto& quantiles_state =
+            aggregator_state.GetExtension(kll_quantiles_state);
+    EXPECT_FALSE(quantiles_state.has_k());
+    EXPECT_FALSE(quantiles_state.has_inv_eps());
+    EXPECT_EQ(quantiles_state.min(), "\x64");
+    EXPECT_EQ(quantiles_state.max(), "\xE8\a");
+
+    // 100, then nine differences of 100.
+    ASSERT_EQ(quantiles_state.compactors_size(), 1);
+    const KllQuantilesStateProto::Compactor& compactor = quantiles_state.compactors(0);
+    ASSERT_TRUE(compactor.has_diff_encoded_packed_values());
+    EXPECT_EQ(compactor.diff_encoded_packed_values(), std::string(10, '\x64'));
+
+    // The full encoding needs two bytes for most of the values.
+    EXPECT_LT(aggregator_state.ByteSizeLong(), aggregator->SerializeToProto().ByteSizeLong());
+}
+
+TEST(KllQuantileSerializationTest, CompactToBoundsStoredValues) {
+    MTRandomGenerator random(42);
+    KllQuantileOptions options;
+    options.set_random(&random);
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create(options);
+    for (int i = 0; i < 100000; i++) {
+        aggregator->Add(i);
+    }
+    ASSERT_GT(aggregator->num_stored_values(), 1000);
+
+    aggregator->CompactTo(1000);
+    EXPECT_LE(aggregator->num_stored_values(), 1000);
+    EXPECT_EQ(aggregator->num_values(), 100000);
+
+    // Min and max stay exact.
+    const AggregatorStateProto aggregator_state = aggregator->SerializeToProto();
+    const KllQuantilesStateProto& quantiles_state =
+            aggregator_state.GetExtension(kll_quantiles_state);
+    EXPECT_EQ(quantiles_state.min(), std::string(1, '\0'));
+    EXPECT_EQ(quantiles_state.max(), "\x9F\x8D\x6");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ---------------------------- Tests for Merge ----------------------------- //
+
+TEST(KllQuantileMergeTest, MergeOfSmallAggregatorsKeepsAllValues) {
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create();
+    std::unique_ptr<KllQuantile> other = KllQuantile::Create();
+    for (int i = 1; i <= 10; i++) {
+        aggregator->Add(i);
+        other->Add(1000 - i);
+    }
+    other->AddWeighted(5, 2);
+
+    ASSERT_TRUE(other->Merge(*aggregator));
+    ASSERT_TRUE(aggregator->Merge(*other));
+    EXPECT_EQ(aggregator->num_values(), 10 + 22);
+    EXPECT_EQ(aggregator->num_stored_values(), 10 + 21);
+
+    const AggregatorStateProto aggregator_state = aggregator->SerializeToProto();
+    const KllQuantilesStateProto& quantiles_state =
+            aggregator_state.GetExtension(kll_quantiles_state);
+    EXPECT_EQ(quantiles_state.min(), "\x1");
+    EXPECT_EQ(quantiles_state.max(), "\xE7\a");
+}
+
+TEST(KllQuantileMergeTest, MergeOfLargeAggregatorsStaysCompact) {
+    MTRandomGenerator random(42);
+    KllQuantileOptions options;
+    options.set_random(&random);
+    options.set_inv_eps(100);
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create(options);
+    std::unique_ptr<KllQuantile> other = KllQuantile::Create(options);
+    std::unique_ptr<KllQuantile> reference = KllQuantile::Create(options);
+    for (int i = 0; i < 100000; i++) {
+        aggregator->Add(i);
+        other->Add(-i);
+        reference->Add(i);
+        reference->Add(-i);
+    }
+
+    ASSERT_TRUE(aggregator->Merge(*other));
+    EXPECT_EQ(aggregator->num_values(), 200000);
+    EXPECT_LE(aggregator->num_stored_values(), 2 * reference->num_stored_values());
+    EXPECT_EQ(aggregator->IsSamplerOn(), reference->IsSamplerOn());
+
+    // Merging an empty aggregator changes nothing.
+    const int64_t num_stored_values = aggregator->num_stored_values();
+    ASSERT_TRUE(aggregator->Merge(*KllQuantile::Create(options)));
+    EXPECT_EQ(aggregator->num_values(), 200000);
+    EXPECT_EQ(aggregator->num_stored_values(), num_stored_values);
+}
+
+TEST(KllQuantileMergeTest, MergeRejectsIncompatibleAggregators) {
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create();
+    aggregator->Add(1);
+    KllQuantileOptions options;
+    options.set_inv_eps(10);
+    std::unique_ptr<KllQuantile> other = KllQuantile::Create(options);
+    other->Add(2);
+
+    std::string error;
+    EXPECT_FALSE(aggregator->Merge(*other, &error));
+    EXPECT_FALSE(error.empty());
+    EXPECT_FALSE(aggregator->Merge(*aggregator));
+    EXPECT_EQ(aggregator->num_values(), 1);
+}
+
+TEST(KllQuantileMergeTest, AggregatorsShareBufferPool) {
+    std::shared_ptr<CompactorBufferPool> buffer_pool = std::make_shared<CompactorBufferPool>();
+    KllQuantileOptions options;
+    options.set_buffer_pool(buffer_pool);
+    std::unique_ptr<KllQuantile> aggregator = KllQuantile::Create(options);
+    for (int i = 0; i < 10000; i++) {
+        aggregator->Add(i);
+    }
+    // Destroying the aggregator hands its compactor buffers to the pool, where the next
+    // aggregator picks them up.
+    aggregator.reset();
+    const size_t pooled_buffers = buffer_pool->size();
+    EXPECT_GT(pooled_buffers, 0u);
+    std::unique_ptr<KllQuantile> other = KllQuantile::Create(options);
+    other->Add(1);
+    EXPECT_EQ(buffer_pool->size(), pooled_buffers - 1);
+}
+
 }  // namespace
 
 }  // namespace aggregation
@@ -22,6 +22,10 @@
 #define __STATSD_SUBS_MIN_API__ __ANDROID_API_U__
 #endif
 
+#ifndef __STATSD_SUBS_SHARED_MEMORY_MIN_API__
+#define __STATSD_SUBS_SHARED_MEMORY_MIN_API__ __ANDROID_API_V__
+#endif
+
 __BEGIN_DECLS
 
 /**
@@ -95,6 +99,36 @@ int32_t AStatsManager_addSubscription(const uint8_t* _Nonnull subscription_confi
                                       void* _Nullable cookie)
         __INTRODUCED_IN(__STATSD_SUBS_MIN_API__);
 
+/**
+ * Adds a new subscription whose data is delivered through shared memory.
+ *
+ * Same as AStatsManager_addSubscription, except that stats service writes the subscription data
+ * into a shared memory ring instead of sending it in binder transactions. This lets stats service
+ * batch more data per callback than fits in a binder transaction. When the ring is full because
+ * earlier callbacks have not returned, or it cannot be created, the data is sent through binder.
+ * The payload passed to the callback is only valid until the callback returns.
+ *
+ * Requires caller is in the traced_probes selinux domain.
+ *
+ * \param subscription_config encoded ShellSubscription proto containing parameters for a new
+ *        subscription. Cannot be null.
+ * \param num_bytes size in bytes of the subscription_config.
+ * \param ring_size_bytes size in bytes of the shared memory ring. Clamped to [16 KB, 4 MB].
+ * \param callback function called to deliver subscription data back to the subscriber. Each
+ *        callback can be used for more than one subscription. Cannot be null.
+ * \param cookie opaque pointer to associate with the subscription. The provided callback will be
+ *        invoked with this cookie as an argument when delivering data for this subscription. Can be
+ *        null.
+ * \return subscription ID for the new subscription. Subscription ID is a positive integer. A
+ * negative value indicates an error.
+ *
+ * Introduced in API 35.
+ */
+int32_t AStatsManager_addSubscriptionWithSharedMemory(
+        const uint8_t* _Nonnull subscription_config, size_t num_bytes, size_t ring_size_bytes,
+        const AStatsManager_SubscriptionCallback _Nonnull callback, void* _Nullable cookie)
+        __INTRODUCED_IN(__STATSD_SUBS_SHARED_MEMORY_MIN_API__);
+
 /**
  * Removes an existing subscription.
  * This will trigger a flush of the remaining subscription data through
@@ -28,21 +28,27 @@ StatsProvider::~StatsProvider() {
 }
 
 std::shared_ptr<IStatsd> StatsProvider::getStatsService() {
+    std::shared_ptr<IStatsd> statsd = std::atomic_load(&mStatsd);
+    if (statsd) {
+        return statsd;
+    }
     std::lock_guard<std::mutex> lock(mMutex);
-    if (!mStatsd) {
+    statsd = std::atomic_load(&mStatsd);
+    if (!statsd) {
         // Fetch statsd
         ::ndk::SpAIBinder binder(AServiceManager_getService("stats"));
-        mStatsd = IStatsd::fromBinder(binder);
-        if (mStatsd) {
+        statsd = IStatsd::fromBinder(binder);
+        if (statsd) {
             AIBinder_linkToDeath(binder.get(), mDeathRecipient.get(), this);
+            std::atomic_store(&mStatsd, statsd);
         }
     }
-    return mStatsd;
+    return statsd;
 }
 
 void StatsProvider::resetStatsService() {
     std::lock_guard<std::mutex> lock(mMutex);
-    mStatsd = nullptr;
+    std::atomic_store(&mStatsd, std::shared_ptr<IStatsd>());
 }
 
 void StatsProvider::binderDied(void* cookie) {
@@ -17,6 +17,9 @@
 #include <aidl/android/os/IStatsd.h>
 #include <android/binder_auto_utils.h>
 
+#include <memory>
+#include <mutex>
+
 using StatsProviderBinderDiedCallback = void (*)(void);
 
 /**
@@ -37,6 +40,8 @@ private:
 
     void resetStatsService();
 
+    // Guards fetching and resetting mStatsd. Once cached, mStatsd is read with std::atomic_load
+    // without taking the lock.
     std::mutex mMutex;
     std::shared_ptr<aidl::android::os::IStatsd> mStatsd;
     const ::ndk::ScopedAIBinder_DeathRecipient mDeathRecipient;
@@ -17,6 +17,7 @@
 #include <aidl/android/os/BnPullAtomCallback.h>
 #include <aidl/android/os/IPullAtomResultReceiver.h>
 #include <aidl/android/os/IStatsd.h>
+#include <aidl/android/os/PullAtomCallbackRegistration.h>
 #include <aidl/android/util/StatsEventParcel.h>
 #include <android/binder_auto_utils.h>
 #include <android/binder_ibinder.h>
@@ -24,7 +25,9 @@
 #include <stats_event.h>
 #include <stats_pull_atom_callback.h>
 
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <queue>
 #include <thread>
 #include <vector>
@@ -33,6 +36,7 @@ using Status = ::ndk::ScopedAStatus;
 using aidl::android::os::BnPullAtomCallback;
 using aidl::android::os::IPullAtomResultReceiver;
 using aidl::android::os::IStatsd;
+using aidl::android::os::PullAtomCallbackRegistration;
 using aidl::android::util::StatsEventParcel;
 using ::ndk::SharedRefBase;
 
@@ -123,6 +127,7 @@ class StatsPullAtomCallbackInternal : public BnPullAtomCallback {
 
         // Resolves fuzz build failure in b/161575591.
 #if defined(__ANDROID_APEX__) || defined(LIB_STATS_PULL_TESTS_FLAG)
+        parcels.reserve(statsEventList.data.size());
         for (int i = 0; i < statsEventList.data.size(); i++) {
             size_t size;
             uint8_t* buffer = AStatsEvent_getBuffer(statsEventList.data[i], &size);
@@ -132,7 +137,12 @@ class StatsPullAtomCallbackInternal : public BnPullAtomCallback {
             // stats_event.h/c uses a vector as opposed to a buffer.
             p.buffer.assign(buffer, buffer + size);
             parcels.push_back(std::move(p));
+
+            // Each event's buffer is at least 4 KB, release it as soon as it has been copied so
+            // that large pulls don't hold all the events and all the parcels at once.
+            AStatsEvent_release(statsEventList.data[i]);
         }
+        statsEventList.data.clear();
 #endif
 
         Status status = resultReceiver->pullFinished(atomTag, success, parcels);
@@ -170,6 +180,21 @@ static std::mutex pullersMutex;
 
 static std::map<int32_t, std::shared_ptr<StatsPullAtomCallbackInternal>> pullers;
 
+// The most callbacks registered in one binder call, which keeps the transaction far below the
+// size of the binder buffer.
+constexpr size_t kMaxRegistrationsPerCall = 100;
+
+static PullAtomCallbackRegistration toRegistration(
+        int32_t atomTag, const std::shared_ptr<StatsPullAtomCallbackInternal>& callback) {
+    PullAtomCallbackRegistration registration;
+    registration.atomTag = atomTag;
+    registration.coolDownMillis = callback->getCoolDownMillis();
+    registration.timeoutMillis = callback->getTimeoutMillis();
+    registration.additiveFields = callback->getAdditiveFields();
+    registration.pullerCallback = callback;
+    return registration;
+}
+
 class StatsdProvider {
 public:
     StatsdProvider() : mDeathRecipient(AIBinder_DeathRecipient_new(binderDied)) {
@@ -184,22 +209,30 @@ public:
         // Since we do not have statsd on host - the getStatsService() is no-op and
         // should return nullptr
 #ifdef __ANDROID__
+        std::shared_ptr<IStatsd> statsd = std::atomic_load(&mStatsd);
+        if (statsd) {
+            return statsd;
+        }
         std::lock_guard<std::mutex> lock(mStatsdMutex);
-        if (!mStatsd) {
+        statsd = std::atomic_load(&mStatsd);
+        if (!statsd) {
             // Fetch statsd
             ::ndk::SpAIBinder binder(AServiceManager_getService("stats"));
-            mStatsd = IStatsd::fromBinder(binder);
-            if (mStatsd) {
+            statsd = IStatsd::fromBinder(binder);
+            if (statsd) {
                 AIBinder_linkToDeath(binder.get(), mDeathRecipient.get(), this);
+                std::atomic_store(&mStatsd, statsd);
             }
         }
+        return statsd;
+#else
+        return nullptr;
 #endif  //  __ANDROID__
-        return mStatsd;
     }
 
     void resetStatsService() {
         std::lock_guard<std::mutex> lock(mStatsdMutex);
-        mStatsd = nullptr;
+        std::atomic_store(&mStatsd, std::shared_ptr<IStatsd>());
     }
 
     static void binderDied(void* cookie) {
@@ -218,18 +251,25 @@ public:
             std::lock_guard<std::mutex> lock(pullersMutex);
             pullersCopy = pullers;
         }
+        std::vector<PullAtomCallbackRegistration> registrations;
         for (const auto& it : pullersCopy) {
-            statsService->registerNativePullAtomCallback(it.first, it.second->getCoolDownMillis(),
-                                                         it.second->getTimeoutMillis(),
-                                                         it.second->getAdditiveFields(), it.second);
+            registrations.push_back(toRegistration(it.first, it.second));
+            if (registrations.size() == kMaxRegistrationsPerCall) {
+                statsService->registerNativePullAtomCallbacks(registrations);
+                registrations.clear();
+            }
+        }
+        if (!registrations.empty()) {
+            statsService->registerNativePullAtomCallbacks(registrations);
         }
     }
 
 private:
     /**
-     * @brief mStatsdMutex is used to guard simultaneous access to mStatsd from below threads:
+     * @brief mStatsdMutex is used to guard fetching and resetting mStatsd from below threads.
+     * Once cached, mStatsd is read with std::atomic_load without taking the lock:
      * Work thread
-     * - registerStatsPullAtomCallbackBlocking()
+     * - registerStatsPullAtomCallbacksBlocking()
      * - unregisterStatsPullAtomCallbackBlocking()
      * Binder thread:
      * - StatsdProvider::binderDied()
@@ -241,17 +281,16 @@ private:
 
 static std::shared_ptr<StatsdProvider> statsProvider = std::make_shared<StatsdProvider>();
 
-void registerStatsPullAtomCallbackBlocking(int32_t atomTag,
-                                           std::shared_ptr<StatsdProvider> statsProvider,
-                                           std::shared_ptr<StatsPullAtomCallbackInternal> cb) {
+void registerStatsPullAtomCallbacksBlocking(
+        const std::vector<PullAtomCallbackRegistration>& registrations,
+        std::shared_ptr<StatsdProvider> statsProvider) {
     const std::shared_ptr<IStatsd> statsService = statsProvider->getStatsService();
     if (statsService == nullptr) {
         // Statsd not available
         return;
     }
 
-    statsService->registerNativePullAtomCallback(
-            atomTag, cb->getCoolDownMillis(), cb->getTimeoutMillis(), cb->getAdditiveFields(), cb);
+    statsService->registerNativePullAtomCallbacks(registrations);
 }
 
 void unregisterStatsPullAtomCallbackBlocking(int32_t atomTag,
@@ -350,6 +389,7 @@ private:
 
         while (true) {
             std::unique_ptr<Cmd> cmd = nullptr;
+            std::vector<PullAtomCallbackRegistration> registrations;
             {
                 /**
                  * To guarantee sequential commands processing we need to lock mutex queue
@@ -362,12 +402,23 @@ private:
 
                 cmd = std::move(mCmdQueue.front());
                 mCmdQueue.pop();
+
+                // Processes register most of their pullers at start, while this thread waits for
+                // statsd. Consecutive registrations are sent to statsd in one call.
+                if (cmd->type == Cmd::CMD_REGISTER) {
+                    registrations.push_back(toRegistration(cmd->atomTag, cmd->callback));
+                    while (!mCmdQueue.empty() && mCmdQueue.front()->type == Cmd::CMD_REGISTER &&
+                           registrations.size() < kMaxRegistrationsPerCall) {
+                        registrations.push_back(toRegistration(mCmdQueue.front()->atomTag,
+                                                               mCmdQueue.front()->callback));
+                        mCmdQueue.pop();
+                    }
+                }
             }
 
             switch (cmd->type) {
                 case Cmd::CMD_REGISTER: {
-                    registerStatsPullAtomCallbackBlocking(cmd->atomTag, statsProvider,
-                                                          cmd->callback);
+                    registerStatsPullAtomCallbacksBlocking(registrations, statsProvider);
                     break;
                 }
                 case Cmd::CMD_UNREGISTER: {
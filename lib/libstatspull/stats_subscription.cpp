@@ -18,19 +18,32 @@
 #include <aidl/android/os/IStatsd.h>
 #include <aidl/android/os/StatsSubscriptionCallbackReason.h>
 #include <android/binder_auto_utils.h>
+#include <fcntl.h>
 #include <stats_provider.h>
 #include <stats_subscription.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <map>
+#include <optional>
 #include <vector>
 
 using Status = ::ndk::ScopedAStatus;
 using aidl::android::os::BnStatsSubscriptionCallback;
 using aidl::android::os::IStatsd;
 using aidl::android::os::StatsSubscriptionCallbackReason;
+using ::ndk::ScopedFileDescriptor;
 using ::ndk::SharedRefBase;
 
+// Layout of the shared memory ring, see SubscriptionRing in statsd. The ring header starts with
+// the read position of the subscriber and the data follows it.
+constexpr size_t kRingHeaderSize = 64;
+constexpr size_t kMinRingSizeBytes = 16 * 1024;         // 16 KB
+constexpr size_t kMaxRingSizeBytes = 4 * 1024 * 1024;  // 4 MB
+
 class Subscription;
 
 // Mutex for accessing subscriptions map.
@@ -50,12 +63,88 @@ public:
           mCookie(cookie) {
     }
 
+    ~Subscription() {
+        if (mRing != nullptr) {
+            munmap(mRing, mRingSize);
+        }
+    }
+
+    // Creates the shared memory ring that statsd writes the subscription data into. Returns
+    // false if it could not be created, in which case the data comes through binder.
+    bool createRing(size_t ringSizeBytes) {
+        ringSizeBytes = std::clamp(ringSizeBytes, kMinRingSizeBytes, kMaxRingSizeBytes);
+        ScopedFileDescriptor ringFd(
+                memfd_create("statsd_subscription", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+        if (ringFd.get() < 0 || ftruncate(ringFd.get(), ringSizeBytes) != 0 ||
+            fcntl(ringFd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+            return false;
+        }
+        void* ring = mmap(nullptr, ringSizeBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          ringFd.get(), /*offset=*/0);
+        if (ring == MAP_FAILED) {
+            return false;
+        }
+        mRing = static_cast<uint8_t*>(ring);
+        mRingSize = ringSizeBytes;
+        mRingFd = std::move(ringFd);
+        return true;
+    }
+
+    // Adds this subscription to statsd, through the ring if it has one.
+    void addTo(const std::shared_ptr<IStatsd>& statsService) {
+        if (mRing == nullptr) {
+            statsService->addSubscription(mSubscriptionParamsBytes, ref<Subscription>());
+        } else {
+            statsService->addSubscriptionWithSharedMemory(mSubscriptionParamsBytes,
+                                                          ref<Subscription>(), mRingFd);
+        }
+    }
+
     Status onSubscriptionData(const StatsSubscriptionCallbackReason reason,
                               const std::vector<uint8_t>& subscriptionPayload) override {
         std::vector<uint8_t> mutablePayload = subscriptionPayload;
         mCallback(mSubscriptionId, static_cast<AStatsManager_SubscriptionCallbackReason>(reason),
                   mutablePayload.data(), mutablePayload.size(), mCookie);
 
+        onDataDelivered(reason);
+        return Status::ok();
+    }
+
+    Status onSubscriptionDataInRing(const StatsSubscriptionCallbackReason reason,
+                                    const int64_t position, const int32_t numBytes) override {
+        const size_t capacity = mRingSize - kRingHeaderSize;
+        if (mRing == nullptr || position < 0 || numBytes < 0 || (size_t)numBytes > capacity) {
+            return Status::ok();
+        }
+        uint8_t* const data = mRing + kRingHeaderSize;
+        const size_t offset = position % capacity;
+        if (offset + numBytes <= capacity) {
+            // Hand out the ring memory directly, statsd does not write over it until the read
+            // position moves past it.
+            mCallback(mSubscriptionId,
+                      static_cast<AStatsManager_SubscriptionCallbackReason>(reason),
+                      data + offset, numBytes, mCookie);
+        } else {
+            // The payload wraps around the end of the ring.
+            std::vector<uint8_t> payload(data + offset, data + capacity);
+            payload.insert(payload.end(), data, data + numBytes - payload.size());
+            mCallback(mSubscriptionId,
+                      static_cast<AStatsManager_SubscriptionCallbackReason>(reason),
+                      payload.data(), payload.size(), mCookie);
+        }
+        reinterpret_cast<std::atomic<uint64_t>*>(mRing)->store(position + numBytes,
+                                                               std::memory_order_release);
+
+        onDataDelivered(reason);
+        return Status::ok();
+    }
+
+    const std::vector<uint8_t>& getSubscriptionParamsBytes() const {
+        return mSubscriptionParamsBytes;
+    }
+
+private:
+    void onDataDelivered(const StatsSubscriptionCallbackReason reason) {
         std::shared_ptr<Subscription> thisSubscription;
         if (reason == StatsSubscriptionCallbackReason::SUBSCRIPTION_ENDED) {
             std::lock_guard<std::mutex> lock(subscriptionsMutex);
@@ -69,19 +158,17 @@ public:
                 subscriptions.erase(subscriptionsIt);
             }
         }
-
-        return Status::ok();
     }
 
-    const std::vector<uint8_t>& getSubscriptionParamsBytes() const {
-        return mSubscriptionParamsBytes;
-    }
-
-private:
     const int32_t mSubscriptionId;
     const std::vector<uint8_t> mSubscriptionParamsBytes;
     const AStatsManager_SubscriptionCallback mCallback;
     void* mCookie;
+
+    // The shared memory ring, if the subscription was added with one.
+    ScopedFileDescriptor mRingFd;
+    uint8_t* mRing = nullptr;
+    size_t mRingSize = 0;
 };
 
 // forward declare so it can be referenced in StatsProvider constructor.
@@ -104,7 +191,7 @@ static void onStatsBinderRestart() {
         subscriptionsCopy = subscriptions;
     }
     for (const auto& [_, subscription] : subscriptionsCopy) {
-        statsService->addSubscription(subscription->getSubscriptionParamsBytes(), subscription);
+        subscription->addTo(statsService);
     }
 }
 
@@ -123,14 +210,18 @@ static std::shared_ptr<Subscription> getBinderCallbackForSubscription(
     return subscriptionsIt->second;
 }
 
-int32_t AStatsManager_addSubscription(const uint8_t* subscription_config, const size_t num_bytes,
-                                      const AStatsManager_SubscriptionCallback callback,
-                                      void* cookie) {
+static int32_t addSubscription(const uint8_t* subscription_config, const size_t num_bytes,
+                               const std::optional<size_t> ring_size_bytes,
+                               const AStatsManager_SubscriptionCallback callback, void* cookie) {
     const std::vector<uint8_t> subscriptionConfig(subscription_config,
                                                   subscription_config + num_bytes);
     const int32_t subscriptionId(getNextSubscriptionId());
     std::shared_ptr<Subscription> subscription =
             SharedRefBase::make<Subscription>(subscriptionId, subscriptionConfig, callback, cookie);
+    if (ring_size_bytes.has_value()) {
+        // Without a ring, the subscription data comes through binder.
+        subscription->createRing(*ring_size_bytes);
+    }
 
     {
         std::lock_guard<std::mutex> lock(subscriptionsMutex);
@@ -141,12 +232,25 @@ int32_t AStatsManager_addSubscription(const uint8_t* subscription_config, const
     // TODO(b/270648168): Queue the binder call to not block on binder
     const std::shared_ptr<IStatsd> statsService = statsProvider->getStatsService();
     if (statsService != nullptr) {
-        statsService->addSubscription(subscriptionConfig, subscription);
+        subscription->addTo(statsService);
     }
 
     return subscriptionId;
 }
 
+int32_t AStatsManager_addSubscription(const uint8_t* subscription_config, const size_t num_bytes,
+                                      const AStatsManager_SubscriptionCallback callback,
+                                      void* cookie) {
+    return addSubscription(subscription_config, num_bytes, /*ring_size_bytes=*/std::nullopt,
+                           callback, cookie);
+}
+
+int32_t AStatsManager_addSubscriptionWithSharedMemory(
+        const uint8_t* subscription_config, const size_t num_bytes, const size_t ring_size_bytes,
+        const AStatsManager_SubscriptionCallback callback, void* cookie) {
+    return addSubscription(subscription_config, num_bytes, ring_size_bytes, callback, cookie);
+}
+
 void AStatsManager_removeSubscription(const int32_t subscription_id) {
     std::shared_ptr<Subscription> subscription = getBinderCallbackForSubscription(subscription_id);
     if (subscription == nullptr) {
@@ -307,6 +307,68 @@ TEST_F(SubscriptionTest, TestSubscription) {
     }
 }
 
+TEST_F(SubscriptionTest, TestSubscriptionWithSharedMemory) {
+    if (__builtin_available(android __STATSD_SUBS_SHARED_MEMORY_MIN_API__, *)) {
+        ShellSubscription config;
+        config.add_pushed()->set_atom_id(SCREEN_BRIGHTNESS_CHANGED);
+
+        string configBytes;
+        config.SerializeToString(&configBytes);
+
+        CallbackData callbackData{/*subId=*/0,
+                                  ASTATSMANAGER_SUBSCRIPTION_CALLBACK_REASON_SUBSCRIPTION_ENDED,
+                                  /*payload=*/{},
+                                  /*count=*/0};
+
+        // Add subscription.
+        subId = AStatsManager_addSubscriptionWithSharedMemory(
+                reinterpret_cast<const uint8_t*>(configBytes.data()), configBytes.size(),
+                /*ring_size_bytes=*/64 * 1024, &callback, &callbackData);
+        ASSERT_GT(subId, 0);
+        sleep_for(std::chrono::milliseconds(WAIT_MS));
+
+        stats_write(SCREEN_BRIGHTNESS_CHANGED, 100);
+        sleep_for(std::chrono::milliseconds(WAIT_MS));
+        EXPECT_EQ(callbackData.count, 0);
+
+        // Flush subscription. The data is read from the ring.
+        AStatsManager_flushSubscription(subId);
+        sleep_for(std::chrono::milliseconds(WAIT_MS));
+
+        EXPECT_EQ(callbackData.subId, subId);
+        EXPECT_EQ(callbackData.reason, ASTATSMANAGER_SUBSCRIPTION_CALLBACK_REASON_FLUSH_REQUESTED);
+        EXPECT_EQ(callbackData.count, 1);
+        ASSERT_GT(callbackData.payload.size(), 0);
+
+        ShellData actualShellData;
+        ASSERT_TRUE(actualShellData.ParseFromArray(callbackData.payload.data(),
+                                                   callbackData.payload.size()));
+        ASSERT_GE(actualShellData.atom_size(), 1);
+
+        Atom expectedAtom;
+        expectedAtom.mutable_screen_brightness_changed()->set_level(100);
+        EXPECT_THAT(actualShellData.atom(0), EqAtom(expectedAtom));
+
+        // End subscription. Final callback should occur.
+        stats_write(SCREEN_BRIGHTNESS_CHANGED, 99);
+        sleep_for(std::chrono::milliseconds(WAIT_MS));
+        AStatsManager_removeSubscription(subId);
+        sleep_for(std::chrono::milliseconds(WAIT_MS));
+
+        EXPECT_EQ(callbackData.reason,
+                  ASTATSMANAGER_SUBSCRIPTION_CALLBACK_REASON_SUBSCRIPTION_ENDED);
+        EXPECT_EQ(callbackData.count, 2);
+        ASSERT_TRUE(actualShellData.ParseFromArray(callbackData.payload.data(),
+                                                   callbackData.payload.size()));
+        ASSERT_GE(actualShellData.atom_size(), 1);
+
+        expectedAtom.mutable_screen_brightness_changed()->set_level(99);
+        EXPECT_THAT(actualShellData.atom(0), EqAtom(expectedAtom));
+    } else {
+        GTEST_SKIP();
+    }
+}
+
 }  // namespace
 
 #else
@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /**
  * Helpers to manage the statsd socket.
  **/
@@ -28,6 +31,57 @@ extern "C" {
  * Closes the statsd socket file descriptor.
  **/
 void AStatsSocket_close();
+
+/**
+ * How AStatsEvent_write() hands atoms to statsd.
+ **/
+enum AStatsSocket_WriteMode {
+    /**
+     * Atoms logged by system_server are queued, atoms of other processes are written
+     * synchronously.
+     **/
+    ASTATSSOCKET_WRITE_MODE_DEFAULT = 0,
+    /**
+     * Atoms are written to the socket from the logging thread and are dropped if the socket is
+     * full.
+     **/
+    ASTATSSOCKET_WRITE_MODE_SYNC = 1,
+    /**
+     * Atoms are queued and written to the socket from a background thread, which retries while
+     * the socket is full.
+     **/
+    ASTATSSOCKET_WRITE_MODE_ASYNC = 2,
+};
+
+/**
+ * Sets the write mode of all atoms logged by this process that have no mode of their own set
+ * with AStatsSocket_setAtomWriteMode().
+ *
+ * \param mode one of AStatsSocket_WriteMode.
+ **/
+void AStatsSocket_setWriteMode(int32_t mode);
+
+/**
+ * Sets the write mode of one atom logged by this process. ASTATSSOCKET_WRITE_MODE_DEFAULT makes
+ * the atom follow the mode set with AStatsSocket_setWriteMode() again.
+ *
+ * \param atomId the atom to set the mode of.
+ * \param mode one of AStatsSocket_WriteMode.
+ * \return false if mode is invalid or if too many atoms already have a mode of their own.
+ **/
+bool AStatsSocket_setAtomWriteMode(uint32_t atomId, int32_t mode);
+
+/**
+ * Sets how many sockets to statsd the threads of this process write to. By default all threads
+ * share one socket, which suits most processes. Processes logging from many threads at once can
+ * ask for more, so that concurrent AStatsEvent_write() calls from different threads send on
+ * different sockets. Each thread keeps writing to the same socket, and a socket is only
+ * connected by the first write that needs it.
+ *
+ * \param count the number of sockets, from 1 to 8.
+ * \return false if count is out of range.
+ **/
+bool AStatsSocket_setSocketCount(int32_t count);
 #ifdef __cplusplus
 }
 #endif  // __CPLUSPLUS
@@ -17,6 +17,7 @@
 #include "include/stats_buffer_writer.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/uio.h>
 
@@ -25,6 +26,9 @@
 #include "statsd_writer.h"
 
 static const uint32_t kStatsEventTag = 1937006964;
+// Tag of a datagram carrying several atoms, each prefixed with its uint16_t size.
+// Must be kept in sync with StatsSocketListener::kStatsEventBatchTag in statsd.
+static const uint32_t kStatsEventBatchTag = 1937006965;
 
 extern struct android_log_transport_write statsdLoggerWrite;
 
@@ -85,6 +89,27 @@ int write_buffer_to_statsd_impl(void* buffer, size_t size, uint32_t atomId, bool
     return ret;
 }
 
+int write_batch_to_statsd_impl(void* buffer, size_t size) {
+    struct iovec vecs[2];
+    vecs[0].iov_base = (void*)&kStatsEventBatchTag;
+    vecs[0].iov_len = sizeof(kStatsEventBatchTag);
+    vecs[1].iov_base = buffer;
+    vecs[1].iov_len = size;
+
+    return __write_to_statsd(vecs, 2);
+}
+
+void wait_for_statsd_writable(int timeoutMs) {
+    const int sock = atomic_load(&statsdLoggerWrite.sock);
+    if (sock < 0) {
+        // not connected, nothing to wait on
+        poll(NULL, 0, timeoutMs);
+        return;
+    }
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT, .revents = 0};
+    poll(&pfd, 1, timeoutMs);
+}
+
 static int __write_to_stats_daemon(struct iovec* vec, size_t nr) {
     int save_errno;
     struct timespec ts;
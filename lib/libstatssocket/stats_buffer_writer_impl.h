@@ -25,4 +25,10 @@ __BEGIN_DECLS
 
 int write_buffer_to_statsd_impl(void* buffer, size_t size, uint32_t atomId, bool doNoteDrop);
 
+// Writes a buffer of size-prefixed atoms as one datagram. Drops are not noted, the caller retries.
+int write_batch_to_statsd_impl(void* buffer, size_t size);
+
+// Waits up to timeoutMs for the statsd socket to have room for another datagram.
+void wait_for_statsd_writable(int timeoutMs);
+
 __END_DECLS
@@ -17,113 +17,120 @@
 #include "stats_buffer_writer_queue.h"
 
 #include <private/android_filesystem_config.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
-#include <queue>
 #include <thread>
 
+#include "include/stats_socket.h"
 #include "stats_buffer_writer_impl.h"
 #include "stats_buffer_writer_queue_impl.h"
 #include "utils.h"
 
-BufferWriterQueue::BufferWriterQueue() : mWorkThread(&BufferWriterQueue::processCommands, this) {
+BufferWriterQueue::BufferWriterQueue(bool batchWrites)
+    : mBatchWrites(batchWrites),
+      mRing(kRingBufferSize),
+      mWorkThread(&BufferWriterQueue::processCommands, this) {
 }
 
 BufferWriterQueue::~BufferWriterQueue() {
     terminate();
-    // at this stage there can be N elements in the queue for which memory needs to be freed
-    // explicitly
     drainQueue();
 }
 
+size_t BufferWriterQueue::alignRecord(size_t size) {
+    return (size + kRecordAlignment - 1) & ~(kRecordAlignment - 1);
+}
+
 bool BufferWriterQueue::write(const uint8_t* buffer, size_t size, uint32_t atomId) {
-    Cmd cmd = createWriteBufferCmd(buffer, size, atomId);
-    if (cmd.buffer == NULL) {
+    const size_t recordSize = alignRecord(sizeof(RecordHeader) + size);
+    if (recordSize > kRingBufferSize) {
         return false;
     }
-    return pushToQueue(cmd);
-}
 
-size_t BufferWriterQueue::getQueueSize() const {
-    std::unique_lock<std::mutex> lock(mMutex);
-    return mCmdQueue.size();
-}
-
-bool BufferWriterQueue::pushToQueue(const Cmd& cmd) {
+    bool wasEmpty;
     {
         std::unique_lock<std::mutex> lock(mMutex);
-        if (mCmdQueue.size() >= kQueueMaxSizeLimit) {
+        if (mRecordCount >= kQueueMaxSizeLimit) {
             // TODO (b/258003151): add logging info about internal queue overflow with appropriate
             // error code
             return false;
         }
-        mCmdQueue.push(cmd);
+
+        // A record never wraps around the end of the ring, the space left there is skipped
+        size_t pos = mHead % kRingBufferSize;
+        const size_t skipSize = pos + recordSize > kRingBufferSize ? kRingBufferSize - pos : 0;
+        if (mHead - mTail + skipSize + recordSize > kRingBufferSize) {
+            return false;
+        }
+        if (skipSize > 0) {
+            const RecordHeader wrapMarker = {0, kWrapMarker};
+            memcpy(&mRing[pos], &wrapMarker, sizeof(wrapMarker));
+            pos = 0;
+        }
+
+        const RecordHeader header = {atomId, (uint32_t)size};
+        memcpy(&mRing[pos], &header, sizeof(header));
+        memcpy(&mRing[pos + sizeof(header)], buffer, size);
+        mHead += skipSize + recordSize;
+        wasEmpty = mRecordCount++ == 0;
+    }
+    // the worker thread only waits while the queue is empty
+    if (wasEmpty) {
+        mCondition.notify_one();
     }
-    mCondition.notify_one();
     return true;
 }
 
-BufferWriterQueue::Cmd BufferWriterQueue::createWriteBufferCmd(const uint8_t* buffer, size_t size,
-                                                               uint32_t atomId) {
-    BufferWriterQueue::Cmd writeCmd;
-    writeCmd.atomId = atomId;
-    writeCmd.buffer = (uint8_t*)malloc(size);
-    if (writeCmd.buffer == NULL) {
-        return writeCmd;
-    }
-    memcpy(writeCmd.buffer, buffer, size);
-    writeCmd.size = size;
-    return writeCmd;
+size_t BufferWriterQueue::getQueueSize() const {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mRecordCount;
 }
 
 void BufferWriterQueue::terminate() {
     if (mWorkThread.joinable()) {
-        mDoTerminate = true;
-        Cmd terminateCmd;
-        terminateCmd.buffer = NULL;
-        pushToQueue(terminateCmd);
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mDoTerminate = true;
+        }
+        mCondition.notify_one();
         mWorkThread.join();
     }
 }
 
 void BufferWriterQueue::drainQueue() {
     std::unique_lock<std::mutex> lock(mMutex);
-    while (!mCmdQueue.empty()) {
-        free(mCmdQueue.front().buffer);
-        mCmdQueue.pop();
-    }
+    mTail = mHead;
+    mRecordCount = 0;
+    mDrainCount++;
 }
 
 void BufferWriterQueue::processCommands() {
+    std::vector<Cmd> batch;
     while (true) {
-        // temporary local thread copy
-        Cmd cmd;
+        batch.clear();
+        uint64_t batchEnd;
+        uint64_t drainCount;
         {
             std::unique_lock<std::mutex> lock(mMutex);
-            if (mCmdQueue.empty()) {
-                mCondition.wait(lock, [this] { return !this->mCmdQueue.empty(); });
+            mCondition.wait(lock, [this] { return mRecordCount > 0 || mDoTerminate; });
+            if (mDoTerminate) {
+                return;
             }
-            cmd = mCmdQueue.front();
+            batchEnd = collectBatchLocked(batch);
+            drainCount = mDrainCount;
         }
 
-        if (cmd.buffer == NULL) {
-            // null buffer ptr used as a marker of the termination request
-            return;
-        }
-
-        const bool writeSuccess = handleCommand(cmd);
+        const bool writeSuccess = batch.size() == 1 ? handleCommand(batch[0]) : handleBatch(batch);
         if (writeSuccess) {
-            // no event drop is observed otherwise command remains in the queue
+            // no event drop is observed otherwise records remain in the queue
             // and worker thread will try to log later on
-
-            // call free() explicitly here to free memory before the mutex lock
-            free(cmd.buffer);
-            {
-                std::unique_lock<std::mutex> lock(mMutex);
-                // this will lead to Cmd destructor call which will be no-op since now the
-                // buffer is NULL
-                mCmdQueue.pop();
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (drainCount == mDrainCount) {
+                mTail = batchEnd;
+                mRecordCount -= batch.size();
             }
         }
         // TODO (b/258003151): add logging info about retry count
@@ -135,10 +142,46 @@ void BufferWriterQueue::processCommands() {
         // attempt to enforce the logging frequency constraints
         // in case of failed write due to socket overflow the sleep can be longer
         // to not overload socket continuously
-        if (!writeSuccess) {
+        if (writeSuccess) {
+            mRetryDelayMs = kDelayOnFailedWriteMs;
+        } else {
             std::this_thread::sleep_for(std::chrono::milliseconds(kDelayOnFailedWriteMs));
+            // consecutive failures back off exponentially, but a socket that drains in the
+            // meantime ends the wait early
+            if (mRetryDelayMs > kDelayOnFailedWriteMs) {
+                waitForSocketWritable(mRetryDelayMs - kDelayOnFailedWriteMs);
+            }
+            mRetryDelayMs = std::min(mRetryDelayMs * 2, kMaxDelayOnFailedWriteMs);
+        }
+    }
+}
+
+uint64_t BufferWriterQueue::collectBatchLocked(std::vector<Cmd>& batch) {
+    // Each atom in a batch is prefixed with its uint16_t size. Only what is already queued is
+    // batched, so a lone atom is written right away in the single-atom format.
+    uint64_t pos = mTail;
+    size_t batchSize = 0;
+    while (batch.size() < mRecordCount) {
+        RecordHeader header;
+        memcpy(&header, &mRing[pos % kRingBufferSize], sizeof(header));
+        if (header.size == kWrapMarker) {
+            pos += kRingBufferSize - pos % kRingBufferSize;
+            continue;
         }
+        if (!batch.empty() &&
+            (!mBatchWrites || batchSize + sizeof(uint16_t) + header.size > kMaxBatchPayloadSize)) {
+            break;
+        }
+
+        Cmd cmd;
+        cmd.buffer = &mRing[pos % kRingBufferSize + sizeof(header)];
+        cmd.atomId = header.atomId;
+        cmd.size = header.size;
+        batch.push_back(cmd);
+        batchSize += sizeof(uint16_t) + header.size;
+        pos += alignRecord(sizeof(header) + header.size);
     }
+    return pos;
 }
 
 bool BufferWriterQueue::handleCommand(const Cmd& cmd) const {
@@ -146,16 +189,90 @@ bool BufferWriterQueue::handleCommand(const Cmd& cmd) const {
     return write_buffer_to_statsd_impl(cmd.buffer, cmd.size, cmd.atomId, /*doNoteDrop*/ false) > 0;
 }
 
+bool BufferWriterQueue::handleBatch(const std::vector<Cmd>& cmds) {
+    mBatchBuffer.clear();
+    for (const Cmd& cmd : cmds) {
+        const uint16_t recordSize = cmd.size;
+        const uint8_t* sizeBytes = reinterpret_cast<const uint8_t*>(&recordSize);
+        mBatchBuffer.insert(mBatchBuffer.end(), sizeBytes, sizeBytes + sizeof(recordSize));
+        mBatchBuffer.insert(mBatchBuffer.end(), cmd.buffer, cmd.buffer + cmd.size);
+    }
+    // drops are not noted since the atoms remain in the queue and the write will be retried
+    return write_batch_to_statsd_impl(mBatchBuffer.data(), mBatchBuffer.size()) > 0;
+}
+
+void BufferWriterQueue::waitForSocketWritable(int timeoutMs) const {
+    wait_for_statsd_writable(timeoutMs);
+}
+
 bool write_buffer_to_statsd_queue(const uint8_t* buffer, size_t size, uint32_t atomId) {
-    static BufferWriterQueue queue;
+    static BufferWriterQueue queue(/*batchWrites=*/true);
     return queue.write(buffer, size, atomId);
 }
 
-#ifdef ENABLE_BENCHMARK_SUPPORT
+namespace {
+
+std::atomic_int32_t sWriteMode = ASTATSSOCKET_WRITE_MODE_DEFAULT;
+
+// Per-atom write modes, each packed as atomId << 32 | mode. Slots are claimed in order and never
+// released, so a lookup stops at the first unused slot.
+constexpr size_t kMaxAtomWriteModes = 64;
+std::atomic_uint64_t sAtomWriteModes[kMaxAtomWriteModes];
+
+bool isValidWriteMode(int32_t mode) {
+    return mode == ASTATSSOCKET_WRITE_MODE_DEFAULT || mode == ASTATSSOCKET_WRITE_MODE_SYNC ||
+           mode == ASTATSSOCKET_WRITE_MODE_ASYNC;
+}
+
+int32_t getAtomWriteMode(uint32_t atomId) {
+    for (size_t i = 0; i < kMaxAtomWriteModes; i++) {
+        const uint64_t entry = sAtomWriteModes[i].load(std::memory_order_relaxed);
+        if (entry == 0) {
+            break;
+        }
+        if ((entry >> 32) == atomId) {
+            return (int32_t)(entry & 0xFFFFFFFF);
+        }
+    }
+    return ASTATSSOCKET_WRITE_MODE_DEFAULT;
+}
+
+}  // namespace
+
+void set_write_mode(int32_t mode) {
+    if (isValidWriteMode(mode)) {
+        sWriteMode.store(mode, std::memory_order_relaxed);
+    }
+}
+
+bool set_atom_write_mode(uint32_t atomId, int32_t mode) {
+    if (atomId == 0 || !isValidWriteMode(mode)) {
+        return false;
+    }
+    const uint64_t newEntry = ((uint64_t)atomId << 32) | (uint32_t)mode;
+    for (size_t i = 0; i < kMaxAtomWriteModes; i++) {
+        uint64_t entry = sAtomWriteModes[i].load(std::memory_order_relaxed);
+        if (entry == 0 && sAtomWriteModes[i].compare_exchange_strong(entry, newEntry)) {
+            return true;
+        }
+        // entry now holds the slot's current value, also if another thread just claimed it
+        if ((entry >> 32) == atomId) {
+            sAtomWriteModes[i].store(newEntry, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
 bool should_write_via_queue(uint32_t atomId) {
-#else
-bool should_write_via_queue(uint32_t /*atomId*/) {
-#endif
+    int32_t writeMode = getAtomWriteMode(atomId);
+    if (writeMode == ASTATSSOCKET_WRITE_MODE_DEFAULT) {
+        writeMode = sWriteMode.load(std::memory_order_relaxed);
+    }
+    if (writeMode != ASTATSSOCKET_WRITE_MODE_DEFAULT) {
+        return writeMode == ASTATSSOCKET_WRITE_MODE_ASYNC;
+    }
+
     const uint32_t appUid = getuid();
 
     // hard-coded push all system server atoms to queue
@@ -27,4 +27,8 @@ bool write_buffer_to_statsd_queue(const uint8_t* buffer, size_t size, uint32_t a
 
 bool should_write_via_queue(uint32_t atomId);
 
+void set_write_mode(int32_t mode);
+
+bool set_atom_write_mode(uint32_t atomId, int32_t mode);
+
 __END_DECLS
@@ -19,15 +19,27 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 class BufferWriterQueue {
 public:
     constexpr static int kDelayOnFailedWriteMs = 5;
+    // Consecutive failed writes double the delay before the next attempt up to this
+    constexpr static int kMaxDelayOnFailedWriteMs = 160;
     constexpr static int kQueueMaxSizeLimit = 4800;  // 2X max_dgram_qlen
+    // LOGGER_ENTRY_MAX_PAYLOAD less the 4-byte batch tag
+    constexpr static size_t kMaxBatchPayloadSize = 4068 - 4;
+    // Queued atoms are copied into a ring of this many bytes allocated once with the queue
+    constexpr static size_t kRingBufferSize = 256 * 1024;
 
-    BufferWriterQueue();
+    // With batchWrites, atoms that are queued together are coalesced into multi-atom datagrams
+    // of up to kMaxBatchPayloadSize bytes, so the worker thread issues one write per batch.
+    explicit BufferWriterQueue(bool batchWrites = false);
     virtual ~BufferWriterQueue();
 
     bool write(const uint8_t* buffer, size_t size, uint32_t atomId);
@@ -36,6 +48,7 @@ public:
 
     void drainQueue();
 
+    // Points into the ring, valid until the command is written successfully or drained
     struct Cmd {
         uint8_t* buffer = NULL;
         int atomId = 0;
@@ -44,18 +57,50 @@ public:
 
     virtual bool handleCommand(const Cmd& cmd) const;
 
+    // Writes commands collected by collectBatchLocked() as one batched datagram.
+    virtual bool handleBatch(const std::vector<Cmd>& cmds);
+
+    // Waits up to timeoutMs for the statsd socket to become writable again.
+    virtual void waitForSocketWritable(int timeoutMs) const;
+
+protected:
+    // Stops the worker thread, queued records are kept until drainQueue().
+    void terminate();
+
 private:
+    // Every record in the ring starts with this header and is padded to kRecordAlignment, so
+    // that the space left before the end of the ring can always hold a wrap marker.
+    struct RecordHeader {
+        uint32_t atomId;
+        uint32_t size;
+    };
+    constexpr static size_t kRecordAlignment = sizeof(RecordHeader);
+    // Record size meaning the next record starts at the beginning of the ring
+    constexpr static uint32_t kWrapMarker = UINT32_MAX;
+
+    const bool mBatchWrites;
     std::condition_variable mCondition;
     mutable std::mutex mMutex;
-    std::queue<Cmd> mCmdQueue;
+    std::vector<uint8_t> mRing;
+    // Monotonic byte positions of the next record to write and of the oldest queued record.
+    // Producers only write to [mHead, mTail + kRingBufferSize), so the worker reads the records
+    // it collected without holding the lock.
+    uint64_t mHead = 0;
+    uint64_t mTail = 0;
+    size_t mRecordCount = 0;
+    // Incremented by drainQueue() so that the worker doesn't release records it no longer owns
+    uint64_t mDrainCount = 0;
+    // Only touched by the worker thread.
+    std::vector<uint8_t> mBatchBuffer;
+    int mRetryDelayMs = kDelayOnFailedWriteMs;
     std::atomic_bool mDoTerminate = false;
     std::thread mWorkThread;
 
-    static Cmd createWriteBufferCmd(const uint8_t* buffer, size_t size, uint32_t atomId);
-
-    bool pushToQueue(const Cmd& cmd);
-
-    void terminate();
+    static size_t alignRecord(size_t size);
 
     void processCommands();
+
+    // Collects the oldest records that fit in one datagram and returns the ring position
+    // right after the last of them.
+    uint64_t collectBatchLocked(std::vector<Cmd>& batch);
 };
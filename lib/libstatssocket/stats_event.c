@@ -16,6 +16,7 @@
 
 #include "include/stats_event.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -83,8 +84,48 @@ struct AStatsEvent {
     size_t bufSize;
 };
 
+// Each thread keeps the last event it released, so that its next AStatsEvent_obtain neither
+// allocates nor zeroes a new buffer. The cached event is freed when the thread exits.
+static pthread_key_t cached_event_key;
+static pthread_once_t cached_event_key_once = PTHREAD_ONCE_INIT;
+static bool cached_event_key_created = false;
+
+static void free_event(AStatsEvent* event) {
+    free(event->buf);
+    free(event);
+}
+
+static void free_cached_event(void* event) {
+    free_event((AStatsEvent*)event);
+}
+
+static void create_cached_event_key(void) {
+    cached_event_key_created = pthread_key_create(&cached_event_key, free_cached_event) == 0;
+}
+
+static AStatsEvent* take_cached_event() {
+    pthread_once(&cached_event_key_once, create_cached_event_key);
+    if (!cached_event_key_created) return NULL;
+
+    AStatsEvent* event = (AStatsEvent*)pthread_getspecific(cached_event_key);
+    if (event != NULL) {
+        pthread_setspecific(cached_event_key, NULL);
+    }
+    return event;
+}
+
+// Returns false if the thread already caches an event, in which case the caller frees this one.
+static bool cache_event(AStatsEvent* event) {
+    if (!cached_event_key_created || pthread_getspecific(cached_event_key) != NULL) return false;
+    return pthread_setspecific(cached_event_key, event) == 0;
+}
+
 AStatsEvent* AStatsEvent_obtain() {
-    AStatsEvent* event = malloc(sizeof(AStatsEvent));
+    AStatsEvent* event = take_cached_event();
+    if (event == NULL) {
+        event = malloc(sizeof(AStatsEvent));
+        event->buf = (uint8_t*)calloc(MAX_PUSH_EVENT_PAYLOAD, 1);
+    }
     event->lastFieldPos = 0;
     event->numBytesWritten = 2;  // reserve first 2 bytes for root event type and number of elements
     event->numElements = 0;
@@ -92,7 +133,6 @@ AStatsEvent* AStatsEvent_obtain() {
     event->errors = 0;
     event->built = false;
     event->bufSize = MAX_PUSH_EVENT_PAYLOAD;
-    event->buf = (uint8_t*)calloc(event->bufSize, 1);
 
     event->buf[0] = OBJECT_TYPE;
     AStatsEvent_writeInt64(event, get_elapsed_realtime_ns());  // write the timestamp
@@ -101,8 +141,9 @@ AStatsEvent* AStatsEvent_obtain() {
 }
 
 void AStatsEvent_release(AStatsEvent* event) {
-    free(event->buf);
-    free(event);
+    // Buffers grown for pulled atoms are not kept, so idle threads don't pin up to 50 KB each.
+    if (event->bufSize == MAX_PUSH_EVENT_PAYLOAD && cache_event(event)) return;
+    free_event(event);
 }
 
 void AStatsEvent_setAtomId(AStatsEvent* event, uint32_t atomId) {
@@ -16,7 +16,21 @@
 
 #include "include/stats_socket.h"
 #include "stats_buffer_writer.h"
+#include "stats_buffer_writer_queue.h"
+#include "statsd_writer.h"
 
 void AStatsSocket_close() {
     stats_log_close();
 }
+
+void AStatsSocket_setWriteMode(int32_t mode) {
+    set_write_mode(mode);
+}
+
+bool AStatsSocket_setAtomWriteMode(uint32_t atomId, int32_t mode) {
+    return set_atom_write_mode(atomId, mode);
+}
+
+bool AStatsSocket_setSocketCount(int32_t count) {
+    return set_socket_count(count);
+}
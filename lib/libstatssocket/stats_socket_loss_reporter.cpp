@@ -18,11 +18,27 @@
 #include <stats_socket_loss_reporter.h>
 #include <unistd.h>
 
+#include <functional>
 #include <vector>
 
 #include "stats_statsdsocketlog.h"
 #include "utils.h"
 
+namespace {
+
+// Packs an [error, tag] pair into a LossTable key.
+constexpr uint64_t makeLossKey(int32_t error, int32_t atomId) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(error)) << 32) |
+           static_cast<uint32_t>(atomId);
+}
+
+// Marks an unused slot of a LossTable. Drops of STATS_SOCKET_LOSS_REPORTED itself are never
+// noted, so no [error, tag] pair maps to this key.
+constexpr uint64_t kEmptyLossKey =
+        makeLossKey(-1, android::os::statsdsocket::STATS_SOCKET_LOSS_REPORTED);
+
+}  // namespace
+
 StatsSocketLossReporter::StatsSocketLossReporter() : mUid(getuid()) {
 }
 
@@ -54,24 +70,22 @@ void StatsSocketLossReporter::noteDrop(int32_t error, int32_t atomId) {
 
     if (atomId == STATS_SOCKET_LOSS_REPORTED) {
         // avoid self counting due to write to socket might fail during dumpAtomsLossStats()
-        // also due to mutex is not re-entrant and is already locked by dumpAtomsLossStats() API,
-        // return to avoid deadlock
-        // alternative is to consider std::recursive_mutex
         return;
     }
 
-    std::unique_lock<std::mutex> lock(mMutex);
-
-    // using unordered_map is more CPU efficient vs vectors, however will require some
-    // postprocessing before writing into the socket
-    const LossInfoKey key = std::make_pair(error, atomId);
-    auto counterIt = mLossInfo.find(key);
-    if (counterIt != mLossInfo.end()) {
-        ++counterIt->second;
-    } else if (mLossInfo.size() < kMaxAtomTagsCount) {
-        mLossInfo[key] = 1;
-    } else {
-        mOverflowCounter++;
+    const uint64_t key = makeLossKey(error, atomId);
+    while (true) {
+        const int32_t tableIndex = mActiveLossTable.load(std::memory_order_seq_cst);
+        LossTable& table = mLossTables[tableIndex];
+        table.writers.fetch_add(1, std::memory_order_seq_cst);
+        // Pairs with the flip in dumpAtomsLossStats(): either the dump sees this writer, or this
+        // writer sees the flip and moves to the other table.
+        if (mActiveLossTable.load(std::memory_order_seq_cst) == tableIndex) {
+            table.add(key, 1, kMaxAtomTagsCount);
+            table.writers.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        table.writers.fetch_sub(1, std::memory_order_release);
     }
 }
 
@@ -88,43 +102,120 @@ void StatsSocketLossReporter::dumpAtomsLossStats(bool forceDump) {
         return;
     }
 
-    // intention to hold mutex here during the stats_write() to avoid data copy overhead
-    std::unique_lock<std::mutex> lock(mMutex);
-    if (mLossInfo.size() == 0) {
+    std::unique_lock<std::mutex> lock(mDumpMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        // Another thread is dumping already.
         return;
     }
 
+    const int32_t tableIndex = mActiveLossTable.load(std::memory_order_relaxed);
+    LossTable& table = mLossTables[tableIndex];
+    if (table.usedSlots.load(std::memory_order_relaxed) == 0 &&
+        table.overflowCounter.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    // New drops go to the other table while this one is written. The writers still updating
+    // this table are only ever a few instructions from done.
+    mActiveLossTable.store(1 - tableIndex, std::memory_order_seq_cst);
+    while (table.writers.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+
     // populate temp vectors to be written into the socket
-    std::vector<int> errors(mLossInfo.size());
-    std::vector<int> tags(mLossInfo.size());
-    std::vector<int> counts(mLossInfo.size());
-
-    auto lossInfoIt = mLossInfo.begin();
-    for (size_t i = 0; i < mLossInfo.size(); i++, lossInfoIt++) {
-        const LossInfoKey& key = lossInfoIt->first;
-        errors[i] = key.first;
-        tags[i] = key.second;
-        counts[i] = lossInfoIt->second;
+    std::vector<int> errors;
+    std::vector<int> tags;
+    std::vector<int> counts;
+    errors.reserve(kMaxAtomTagsCount);
+    tags.reserve(kMaxAtomTagsCount);
+    counts.reserve(kMaxAtomTagsCount);
+    for (size_t i = 0; i < kLossTableSlots; i++) {
+        const uint64_t key = table.keys[i].load(std::memory_order_relaxed);
+        if (key != kEmptyLossKey) {
+            errors.push_back(static_cast<int32_t>(key >> 32));
+            tags.push_back(static_cast<int32_t>(key & UINT32_MAX));
+            counts.push_back(table.counts[i].load(std::memory_order_relaxed));
+        }
     }
+    const int32_t overflowCounter = table.overflowCounter.load(std::memory_order_relaxed);
 
     // below call might lead to socket loss event - intention is to avoid self counting
-    const int ret = stats_write(STATS_SOCKET_LOSS_REPORTED, mUid, mFirstTsNanos, mLastTsNanos,
-                                mOverflowCounter, errors, tags, counts);
+    const int ret = writeLossStats(overflowCounter, errors, tags, counts);
     if (ret > 0) {
-        // Otherwise, in case of failure we preserve all socket loss information between dumps.
-        // When above write failed - the socket loss stats are not discarded
-        // and would be re-send during next attempt.
-        mOverflowCounter = 0;
-        mLossInfo.clear();
-
         mFirstTsNanos.store(0, std::memory_order_relaxed);
         mLastTsNanos.store(0, std::memory_order_relaxed);
+    } else {
+        // When above write failed - the socket loss stats are not discarded
+        // and would be re-send during next attempt, together with the drops noted meanwhile.
+        LossTable& activeTable = mLossTables[1 - tableIndex];
+        for (size_t i = 0; i < errors.size(); i++) {
+            activeTable.add(makeLossKey(errors[i], tags[i]), counts[i], kMaxAtomTagsCount);
+        }
+        activeTable.overflowCounter.fetch_add(overflowCounter, std::memory_order_relaxed);
     }
+    table.reset();
     // since the delay before next attempt is significantly larger than this API call
     // duration it is ok to have correctness of timestamp in a range of 10us
     startCooldownTimer(currentRealtimeTsNanos);
 }
 
+int StatsSocketLossReporter::writeLossStats(int32_t overflowCounter,
+                                            const std::vector<int>& errors,
+                                            const std::vector<int>& tags,
+                                            const std::vector<int>& counts) {
+    using namespace android::os::statsdsocket;
+
+    return stats_write(STATS_SOCKET_LOSS_REPORTED, mUid, mFirstTsNanos, mLastTsNanos,
+                       overflowCounter, errors, tags, counts);
+}
+
+StatsSocketLossReporter::LossTable::LossTable() {
+    reset();
+}
+
+void StatsSocketLossReporter::LossTable::add(uint64_t key, int32_t count, size_t maxKeysCount) {
+    bool slotReserved = false;
+    size_t slot = std::hash<uint64_t>{}(key) % kLossTableSlots;
+    for (size_t probes = 0; probes < kLossTableSlots; probes++) {
+        uint64_t slotKey = keys[slot].load(std::memory_order_acquire);
+        if (slotKey == kEmptyLossKey) {
+            if (!slotReserved) {
+                if (usedSlots.fetch_add(1, std::memory_order_relaxed) >= (int32_t)maxKeysCount) {
+                    usedSlots.fetch_sub(1, std::memory_order_relaxed);
+                    break;
+                }
+                slotReserved = true;
+            }
+            if (keys[slot].compare_exchange_strong(slotKey, key, std::memory_order_acq_rel)) {
+                counts[slot].fetch_add(count, std::memory_order_relaxed);
+                return;
+            }
+            // Another writer claimed the slot, slotKey now holds its key.
+        }
+        if (slotKey == key) {
+            if (slotReserved) {
+                usedSlots.fetch_sub(1, std::memory_order_relaxed);
+            }
+            counts[slot].fetch_add(count, std::memory_order_relaxed);
+            return;
+        }
+        slot = (slot + 1) % kLossTableSlots;
+    }
+    if (slotReserved) {
+        usedSlots.fetch_sub(1, std::memory_order_relaxed);
+    }
+    overflowCounter.fetch_add(1, std::memory_order_relaxed);
+}
+
+void StatsSocketLossReporter::LossTable::reset() {
+    for (size_t i = 0; i < kLossTableSlots; i++) {
+        keys[i].store(kEmptyLossKey, std::memory_order_relaxed);
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    usedSlots.store(0, std::memory_order_relaxed);
+    overflowCounter.store(0, std::memory_order_relaxed);
+}
+
 void StatsSocketLossReporter::startCooldownTimer(int64_t elapsedRealtimeNanos) {
     mCooldownTimerFinishAtNanos = elapsedRealtimeNanos + kCoolDownTimerDurationNanos;
 }
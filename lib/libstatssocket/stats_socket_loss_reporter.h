@@ -20,8 +20,9 @@
 #include <stdint.h>
 
 #include <atomic>
+#include <mutex>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 
 class StatsSocketLossReporter {
 public:
@@ -38,11 +39,17 @@ public:
      */
     void dumpAtomsLossStats(bool forceDump = false);
 
-    ~StatsSocketLossReporter();
+    virtual ~StatsSocketLossReporter();
 
-private:
+protected:
     StatsSocketLossReporter();
 
+    // Writes the STATS_SOCKET_LOSS_REPORTED atom, returns the stats_write() result.
+    virtual int writeLossStats(int32_t overflowCounter, const std::vector<int>& errors,
+                               const std::vector<int>& tags, const std::vector<int>& counts);
+
+private:
+
     void startCooldownTimer(int64_t elapsedRealtimeNanos);
     bool isCooldownTimerActive(int64_t elapsedRealtimeNanos) const;
 
@@ -60,24 +67,41 @@ private:
 
     const int64_t kCoolDownTimerDurationNanos = 10 * 1000 * 1000;  // 10ms
 
-    struct HashPair final {
-        template <class TFirst, class TSecond>
-        size_t operator()(const std::pair<TFirst, TSecond>& p) const noexcept {
-            uintmax_t hash = std::hash<TFirst>{}(p.first);
-            hash <<= sizeof(uintmax_t) * 4;
-            hash ^= std::hash<TSecond>{}(p.second);
-            return std::hash<uintmax_t>{}(hash);
-        }
-    };
+    // Slots of a LossTable. Kept above kMaxAtomTagsCount so that probe sequences stay short.
+    static constexpr size_t kLossTableSlots = 128;
+
+    // Represents loss info as a counter per [error, tag] pair, in an open addressing table of
+    // fixed slots so that noteDrop can update it with atomics only. A slot's key is set once:
+    // slots are only freed when the whole table is reset by dumpAtomsLossStats.
+    struct LossTable {
+        LossTable();
 
-    // guards access to below mLossInfo
-    mutable std::mutex mMutex;
+        // Adds count to the counter of key. Counts a guardrail hit if the table already holds
+        // kMaxAtomTagsCount keys.
+        void add(uint64_t key, int32_t count, size_t maxKeysCount);
 
-    using LossInfoKey = std::pair<int, int>;  // [error, tag]
+        // Requires that no thread is updating the table.
+        void reset();
+
+        std::atomic_uint64_t keys[kLossTableSlots];
+        std::atomic_int32_t counts[kLossTableSlots];
+
+        // Slots claimed by a key, including the ones being claimed.
+        std::atomic_int32_t usedSlots = 0;
+
+        // tracks guardrail kMaxAtomTagsCount hit count
+        std::atomic_int32_t overflowCounter = 0;
+
+        // noteDrop calls updating the table.
+        std::atomic_int32_t writers = 0;
+    };
 
-    // Represents loss info as a counter per [error, tag] pair
-    std::unordered_map<LossInfoKey, int, HashPair> mLossInfo;
+    // noteDrop records into mLossTables[mActiveLossTable]. dumpAtomsLossStats flips
+    // mActiveLossTable, waits for the writers of the previous table to finish and then reads it
+    // on its own, so that dropping an atom never waits for a dump.
+    LossTable mLossTables[2];
+    std::atomic_int32_t mActiveLossTable = 0;
 
-    // tracks guardrail kMaxAtomTagsCount hit count
-    int32_t mOverflowCounter = 0;
+    // Serializes dumpAtomsLossStats calls. Never taken by noteDrop.
+    std::mutex mDumpMutex;
 };
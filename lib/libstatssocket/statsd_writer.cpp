@@ -56,6 +56,14 @@ static atomic_int dropped = 0;
 static atomic_int log_error = 0;
 static atomic_int atom_tag = 0;
 
+// Sockets besides statsdLoggerWrite.sock that threads of the process write to, see
+// set_socket_count(). Only the first socket_count - 1 of them are in use, and each is opened by
+// the first write that needs it.
+static const int kMaxSocketCount = 8;
+static atomic_int pooled_socks[kMaxSocketCount - 1];
+static atomic_int socket_count = 1;
+static atomic_uint next_thread_socket = 0;
+
 void statsd_writer_init_lock() {
     /*
      * If we trigger a signal handler in the middle of locked activity and the
@@ -91,10 +99,10 @@ struct android_log_transport_write statsdLoggerWrite = {
 };
 
 /* log_init_lock assumed */
-static int statsdOpen() {
+static int openSocket(atomic_int* sockPtr) {
     int i, ret = 0;
 
-    i = atomic_load(&statsdLoggerWrite.sock);
+    i = atomic_load(sockPtr);
     if (i < 0) {
         int flags = SOCK_DGRAM;
 #ifdef SOCK_CLOEXEC
@@ -124,14 +132,14 @@ static int statsdOpen() {
                     case -ENOTCONN:
                     case -ECONNREFUSED:
                     case -ENOENT:
-                        i = atomic_exchange(&statsdLoggerWrite.sock, ret);
+                        i = atomic_exchange(sockPtr, ret);
                         break;
                     default:
                         break;
                 }
                 close(sock);
             } else {
-                ret = atomic_exchange(&statsdLoggerWrite.sock, sock);
+                ret = atomic_exchange(sockPtr, sock);
                 if ((ret >= 0) && (ret != sock)) {
                     close(ret);
                 }
@@ -143,15 +151,82 @@ static int statsdOpen() {
     return ret;
 }
 
-static void __statsdClose(int negative_errno) {
-    int sock = atomic_exchange(&statsdLoggerWrite.sock, negative_errno);
+/* log_init_lock assumed */
+static int statsdOpen() {
+    return openSocket(&statsdLoggerWrite.sock);
+}
+
+static void closeSocket(atomic_int* sockPtr, int negative_errno) {
+    int sock = atomic_exchange(sockPtr, negative_errno);
     if (sock >= 0) {
         close(sock);
     }
 }
 
+static void __statsdClose(int negative_errno) {
+    closeSocket(&statsdLoggerWrite.sock, negative_errno);
+}
+
 static void statsdClose() {
     __statsdClose(-EBADF);
+    const int count = atomic_load(&socket_count);
+    for (int i = 0; i < count - 1; i++) {
+        closeSocket(&pooled_socks[i], -EBADF);
+    }
+}
+
+bool set_socket_count(int32_t count) {
+    if (count < 1 || count > kMaxSocketCount) {
+        return false;
+    }
+    statsd_writer_init_lock();
+    const int prevCount = atomic_load(&socket_count);
+    if (count < prevCount) {
+        // Threads assigned to the closed sockets go back to the shared one.
+        atomic_store(&socket_count, count);
+        for (int i = count - 1; i < prevCount - 1; i++) {
+            closeSocket(&pooled_socks[i], -EBADF);
+        }
+    } else {
+        for (int i = prevCount - 1; i < count - 1; i++) {
+            atomic_store(&pooled_socks[i], -EBADF);
+        }
+        atomic_store(&socket_count, count);
+    }
+    statsd_writer_init_unlock();
+    return true;
+}
+
+/*
+ * Returns the socket the calling thread writes to. Threads are spread over the socket_count
+ * sockets in the order they first write. Falls back to statsdLoggerWrite.sock while the thread's
+ * own socket can't be opened.
+ */
+static atomic_int* threadSocket() {
+    const int count = atomic_load_explicit(&socket_count, memory_order_acquire);
+    if (count == 1) {
+        return &statsdLoggerWrite.sock;
+    }
+    static thread_local unsigned threadSocketIndex =
+            atomic_fetch_add_explicit(&next_thread_socket, 1, memory_order_relaxed);
+    const unsigned index = threadSocketIndex % count;
+    if (index == 0 || atomic_load(&statsdLoggerWrite.sock) < 0) {
+        return &statsdLoggerWrite.sock;
+    }
+    atomic_int* sockPtr = &pooled_socks[index - 1];
+    if (atomic_load(sockPtr) < 0) {
+        if (statd_writer_trylock()) {
+            return &statsdLoggerWrite.sock;
+        }
+        // socket_count may have shrunk meanwhile, do not open a socket nobody closes.
+        const bool inUse = (int)index < atomic_load(&socket_count);
+        const bool opened = inUse && openSocket(sockPtr) == 0;
+        statsd_writer_init_unlock();
+        if (!opened) {
+            return &statsdLoggerWrite.sock;
+        }
+    }
+    return sockPtr;
 }
 
 static int statsdAvailable() {
@@ -187,7 +262,8 @@ static int statsdWrite(struct timespec* ts, struct iovec* vec, size_t nr) {
     android_log_header_t header;
     size_t i, payloadSize;
 
-    sock = atomic_load(&statsdLoggerWrite.sock);
+    atomic_int* sockPtr = threadSocket();
+    sock = atomic_load(sockPtr);
     if (sock < 0) switch (sock) {
             case -ENOTCONN:
             case -ECONNREFUSED:
@@ -290,15 +366,15 @@ static int statsdWrite(struct timespec* ts, struct iovec* vec, size_t nr) {
                 return ret; /* in a signal handler? try again when less stressed
                              */
             }
-            __statsdClose(ret);
-            ret = statsdOpen();
+            closeSocket(sockPtr, ret);
+            ret = openSocket(sockPtr);
             statsd_writer_init_unlock();
 
             if (ret < 0) {
                 return ret;
             }
 
-            ret = TEMP_FAILURE_RETRY(writev(atomic_load(&statsdLoggerWrite.sock), newVec, i));
+            ret = TEMP_FAILURE_RETRY(writev(atomic_load(sockPtr), newVec, i));
             if (ret < 0) {
                 ret = -errno;
             }
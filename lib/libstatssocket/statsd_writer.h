@@ -19,6 +19,8 @@
 
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 __BEGIN_DECLS
@@ -32,6 +34,12 @@ void statsd_writer_init_lock();
 int statsd_writer_init_trylock();
 void statsd_writer_init_unlock();
 
+/**
+ * Sets how many sockets the threads of the process share to write to statsd, see
+ * AStatsSocket_setSocketCount().
+ */
+bool set_socket_count(int32_t count);
+
 struct android_log_transport_write {
     const char* name; /* human name to describe the transport */
     atomic_int sock;
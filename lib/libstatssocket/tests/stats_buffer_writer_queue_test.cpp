@@ -150,3 +150,296 @@ TEST(StatsBufferWriterQueueTest, TestTerminateNonEmptyQueue) {
     queue.drainQueue();
     EXPECT_EQ(queue.getQueueSize(), 0);
 }
+
+// Waits out the whole retry delay regardless of the socket state
+class BackoffBufferWriterQueueMock : public BufferWriterQueue {
+public:
+    BackoffBufferWriterQueueMock() = default;
+    MOCK_METHOD(bool, handleCommand, (const BackoffBufferWriterQueueMock::Cmd& cmd),
+                (const override));
+    void waitForSocketWritable(int timeoutMs) const override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+    }
+};
+
+TEST(StatsBufferWriterQueueTest, TestBackoffOnRepeatedFailures) {
+    AStatsEvent* event = generateTestEvent();
+
+    size_t eventBufferSize = 0;
+    const uint8_t* buffer = AStatsEvent_getBuffer(event, &eventBufferSize);
+    const uint32_t atomId = AStatsEvent_getAtomId(event);
+
+    std::vector<int64_t> attemptsTs;
+
+    StrictMock<BackoffBufferWriterQueueMock> queue;
+    EXPECT_CALL(queue, handleCommand(_))
+            .WillRepeatedly([&attemptsTs](const BackoffBufferWriterQueueMock::Cmd&) {
+                attemptsTs.push_back(get_elapsed_realtime_ns());
+                return false;
+            });
+
+    EXPECT_TRUE(queue.write(buffer, eventBufferSize, atomId));
+    AStatsEvent_release(event);
+
+    // to yeld to the queue worker thread
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+
+    // delays double from kDelayOnFailedWriteMs: 5, 10, 20, 40, 80 ms
+    ASSERT_GE(attemptsTs.size(), 4);
+    int64_t expectedDelayNs = BackoffBufferWriterQueueMock::kDelayOnFailedWriteMs * 1000000;
+    for (int i = 0; i < 3; i++) {
+        EXPECT_GE(attemptsTs[i + 1] - attemptsTs[i], expectedDelayNs);
+        expectedDelayNs *= 2;
+    }
+}
+
+class BatchingBufferWriterQueueMock : public BufferWriterQueue {
+public:
+    BatchingBufferWriterQueueMock() : BufferWriterQueue(/*batchWrites=*/true) {
+    }
+    MOCK_METHOD(bool, handleCommand, (const BatchingBufferWriterQueueMock::Cmd& cmd),
+                (const override));
+    MOCK_METHOD(bool, handleBatch, (const std::vector<BatchingBufferWriterQueueMock::Cmd>& cmds),
+                (override));
+};
+
+TEST(StatsBufferWriterQueueTest, TestBatchedWrite) {
+    constexpr int kEventCount = 10;
+    AStatsEvent* event = generateTestEvent();
+
+    size_t eventBufferSize = 0;
+    const uint8_t* buffer = AStatsEvent_getBuffer(event, &eventBufferSize);
+    const uint32_t atomId = AStatsEvent_getAtomId(event);
+
+    // writes fail until all the events are queued, so that they can be written as a batch
+    std::atomic_bool acceptWrites = false;
+    std::atomic_int writtenCount = 0;
+    std::atomic_int batchCount = 0;
+
+    StrictMock<BatchingBufferWriterQueueMock> queue;
+    EXPECT_CALL(queue, handleCommand(_))
+            .WillRepeatedly([&](const BatchingBufferWriterQueueMock::Cmd&) {
+                if (!acceptWrites) return false;
+                writtenCount++;
+                return true;
+            });
+    EXPECT_CALL(queue, handleBatch(_))
+            .WillRepeatedly([&](const std::vector<BatchingBufferWriterQueueMock::Cmd>& cmds) {
+                if (!acceptWrites) return false;
+                writtenCount += cmds.size();
+                batchCount++;
+                return true;
+            });
+
+    for (int i = 0; i < kEventCount; i++) {
+        EXPECT_TRUE(queue.write(buffer, eventBufferSize, atomId));
+    }
+    AStatsEvent_release(event);
+    acceptWrites = true;
+
+    // to yeld to the queue worker thread
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+
+    EXPECT_EQ(queue.getQueueSize(), 0);
+    EXPECT_EQ(writtenCount, kEventCount);
+    EXPECT_GE(batchCount, 1);
+    EXPECT_LT(batchCount, kEventCount);
+}
+
+// Each record in the ring is prefixed with its atom id and size
+constexpr static size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+// Retries failed writes without backing off, so that writes go through as soon as they are
+// accepted again
+class RingBufferWriterQueueMock : public BufferWriterQueue {
+public:
+    RingBufferWriterQueueMock() = default;
+    MOCK_METHOD(bool, handleCommand, (const RingBufferWriterQueueMock::Cmd& cmd),
+                (const override));
+    void waitForSocketWritable(int) const override {
+    }
+    using BufferWriterQueue::terminate;
+};
+
+struct WrittenRecord {
+    int atomId;
+    std::vector<uint8_t> payload;
+};
+
+// Queues a payload of the given size filled with the atom id
+static bool writeRecord(BufferWriterQueue& queue, size_t size, uint32_t atomId) {
+    const std::vector<uint8_t> payload(size, (uint8_t)atomId);
+    return queue.write(payload.data(), payload.size(), atomId);
+}
+
+static bool waitForEmptyQueue(const BufferWriterQueue& queue) {
+    for (int i = 0; i < 10 && queue.getQueueSize() > 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+    }
+    return queue.getQueueSize() == 0;
+}
+
+static void expectRecord(const WrittenRecord& record, int atomId, size_t size) {
+    EXPECT_EQ(record.atomId, atomId);
+    EXPECT_EQ(record.payload, std::vector<uint8_t>(size, (uint8_t)atomId));
+}
+
+// Writes fail until acceptWrites is set, the written records are appended to written
+static void expectRingWrites(StrictMock<RingBufferWriterQueueMock>& queue,
+                             std::atomic_bool& acceptWrites, std::vector<WrittenRecord>& written) {
+    EXPECT_CALL(queue, handleCommand(_))
+            .WillRepeatedly([&](const RingBufferWriterQueueMock::Cmd& cmd) {
+                if (!acceptWrites) return false;
+                written.push_back({cmd.atomId, std::vector<uint8_t>(cmd.buffer,
+                                                                    cmd.buffer + cmd.size)});
+                return true;
+            });
+}
+
+TEST(StatsBufferWriterQueueTest, TestRingWrapAround) {
+    constexpr size_t kPayloadSize = 4000;
+    constexpr int kRecordsPerRing =
+            BufferWriterQueue::kRingBufferSize / (kRecordHeaderSize + kPayloadSize);
+
+    std::atomic_bool acceptWrites = false;
+    std::vector<WrittenRecord> written;
+    StrictMock<RingBufferWriterQueueMock> queue;
+    expectRingWrites(queue, acceptWrites, written);
+
+    for (int i = 1; i <= kRecordsPerRing; i++) {
+        EXPECT_TRUE(writeRecord(queue, kPayloadSize, i));
+    }
+    acceptWrites = true;
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+    ASSERT_EQ(written.size(), kRecordsPerRing);
+
+    // the first of these records doesn't fit before the end of the ring and starts over at the
+    // beginning, the space skipped with it leaves room for exactly kRecordsPerRing records
+    acceptWrites = false;
+    for (int i = 1; i <= kRecordsPerRing; i++) {
+        EXPECT_TRUE(writeRecord(queue, kPayloadSize, kRecordsPerRing + i));
+    }
+    EXPECT_EQ(queue.getQueueSize(), kRecordsPerRing);
+    acceptWrites = true;
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+
+    ASSERT_EQ(written.size(), 2 * kRecordsPerRing);
+    for (int i = 0; i < 2 * kRecordsPerRing; i++) {
+        expectRecord(written[i], i + 1, kPayloadSize);
+    }
+}
+
+TEST(StatsBufferWriterQueueTest, TestRecordExactlyFillingRing) {
+    constexpr size_t kFirstPayloadSize = 1000;
+    constexpr size_t kFullRingPayloadSize = BufferWriterQueue::kRingBufferSize - kRecordHeaderSize;
+    constexpr size_t kLastPayloadSize =
+            kFullRingPayloadSize - (kRecordHeaderSize + kFirstPayloadSize);
+
+    std::atomic_bool acceptWrites = false;
+    std::vector<WrittenRecord> written;
+    StrictMock<RingBufferWriterQueueMock> queue;
+    expectRingWrites(queue, acceptWrites, written);
+
+    EXPECT_FALSE(writeRecord(queue, kFullRingPayloadSize + 1, 1));
+
+    // the second record ends exactly at the end of the ring
+    EXPECT_TRUE(writeRecord(queue, kFirstPayloadSize, 1));
+    EXPECT_TRUE(writeRecord(queue, kLastPayloadSize, 2));
+    EXPECT_FALSE(writeRecord(queue, 1, 3));
+    EXPECT_EQ(queue.getQueueSize(), 2);
+    acceptWrites = true;
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+
+    // a record as large as the ring fits once the ring is empty
+    EXPECT_TRUE(writeRecord(queue, kFullRingPayloadSize, 4));
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+
+    ASSERT_EQ(written.size(), 3);
+    expectRecord(written[0], 1, kFirstPayloadSize);
+    expectRecord(written[1], 2, kLastPayloadSize);
+    expectRecord(written[2], 4, kFullRingPayloadSize);
+}
+
+TEST(StatsBufferWriterQueueTest, TestFullRingDropsRecords) {
+    constexpr size_t kPayloadSize = 4000;
+    constexpr int kRecordsPerRing =
+            BufferWriterQueue::kRingBufferSize / (kRecordHeaderSize + kPayloadSize);
+
+    std::atomic_bool acceptWrites = false;
+    std::vector<WrittenRecord> written;
+    StrictMock<RingBufferWriterQueueMock> queue;
+    expectRingWrites(queue, acceptWrites, written);
+
+    // the ring runs out of bytes long before kQueueMaxSizeLimit records are queued
+    int queuedCount = 0;
+    while (writeRecord(queue, kPayloadSize, queuedCount + 1)) {
+        queuedCount++;
+    }
+    EXPECT_EQ(queuedCount, kRecordsPerRing);
+    EXPECT_FALSE(writeRecord(queue, kPayloadSize, queuedCount + 2));
+    EXPECT_EQ(queue.getQueueSize(), kRecordsPerRing);
+
+    acceptWrites = true;
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+
+    // only the queued records are written, the dropped ones don't overwrite them
+    ASSERT_EQ(written.size(), kRecordsPerRing);
+    for (int i = 0; i < kRecordsPerRing; i++) {
+        expectRecord(written[i], i + 1, kPayloadSize);
+    }
+}
+
+TEST(StatsBufferWriterQueueTest, TestDrainWhileWriteInFlight) {
+    std::atomic_bool writeStarted = false;
+    std::atomic_bool finishWrite = false;
+    std::vector<WrittenRecord> written;
+    StrictMock<RingBufferWriterQueueMock> queue;
+    EXPECT_CALL(queue, handleCommand(_))
+            .WillRepeatedly([&](const RingBufferWriterQueueMock::Cmd& cmd) {
+                writeStarted = true;
+                while (!finishWrite) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                written.push_back({cmd.atomId, std::vector<uint8_t>(cmd.buffer,
+                                                                    cmd.buffer + cmd.size)});
+                return true;
+            });
+
+    EXPECT_TRUE(writeRecord(queue, 10, 1));
+    while (!writeStarted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // the worker no longer owns the record it is writing, so its success must not release the
+    // record queued after the drain
+    queue.drainQueue();
+    EXPECT_TRUE(writeRecord(queue, 20, 2));
+    finishWrite = true;
+    ASSERT_TRUE(waitForEmptyQueue(queue));
+
+    ASSERT_EQ(written.size(), 2);
+    expectRecord(written[0], 1, 10);
+    expectRecord(written[1], 2, 20);
+}
+
+TEST(StatsBufferWriterQueueTest, TestDrainAfterTerminate) {
+    constexpr int kEventCount = 10;
+    StrictMock<RingBufferWriterQueueMock> queue;
+    EXPECT_CALL(queue, handleCommand(_)).WillRepeatedly(Return(false));
+
+    for (int i = 1; i <= kEventCount; i++) {
+        EXPECT_TRUE(writeRecord(queue, 100, i));
+    }
+    queue.terminate();
+    EXPECT_EQ(queue.getQueueSize(), kEventCount);
+
+    queue.drainQueue();
+    EXPECT_EQ(queue.getQueueSize(), 0);
+
+    // without the worker thread records stay queued, starting over from the drained position
+    EXPECT_TRUE(writeRecord(queue, 100, kEventCount + 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+    EXPECT_EQ(queue.getQueueSize(), 1);
+    queue.drainQueue();
+    EXPECT_EQ(queue.getQueueSize(), 0);
+}
@@ -708,3 +708,35 @@ TEST(StatsEventTest, TestListTooLongError) {
     uint32_t errors = AStatsEvent_getErrors(event);
     EXPECT_EQ(errors & ERROR_LIST_TOO_LONG, ERROR_LIST_TOO_LONG);
 }
+
+TEST(StatsEventTest, TestReleasedEventIsReused) {
+    uint32_t atomId = 100;
+    int32_t int32Value = -5;
+
+    // Leave the buffer dirty, including an error, before releasing the event.
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_writeString(event, "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+    AStatsEvent_build(event);
+    EXPECT_NE(AStatsEvent_getErrors(event), 0);
+    AStatsEvent_release(event);
+
+    int64_t startTime = android::elapsedRealtimeNano();
+    AStatsEvent* reusedEvent = AStatsEvent_obtain();
+    EXPECT_EQ(reusedEvent, event);
+    AStatsEvent_setAtomId(reusedEvent, atomId);
+    AStatsEvent_writeInt32(reusedEvent, int32Value);
+    AStatsEvent_build(reusedEvent);
+    int64_t endTime = android::elapsedRealtimeNano();
+
+    size_t bufferSize;
+    uint8_t* buffer = AStatsEvent_getBuffer(reusedEvent, &bufferSize);
+    uint8_t* bufferEnd = buffer + bufferSize;
+
+    checkMetadata(&buffer, /*numElements=*/1, startTime, endTime, atomId);
+    checkTypeHeader(&buffer, INT32_TYPE);
+    checkScalar(&buffer, int32Value);
+
+    EXPECT_EQ(buffer, bufferEnd);  // ensure that we have read the entire buffer
+    EXPECT_EQ(AStatsEvent_getErrors(reusedEvent), 0);
+    AStatsEvent_release(reusedEvent);
+}
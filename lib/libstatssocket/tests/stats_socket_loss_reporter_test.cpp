@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stats_socket_loss_reporter.h>
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "stats_statsdsocketlog.h"
+
+namespace {
+
+// Collects the loss stats instead of writing them to statsd
+class TestStatsSocketLossReporter : public StatsSocketLossReporter {
+public:
+    ~TestStatsSocketLossReporter() {
+        // leaves nothing for the base destructor to write to statsd
+        mFailWrites = false;
+        dumpAtomsLossStats(true);
+    }
+
+    // Counts per [error, tag] pair over all the successful writes
+    std::map<std::pair<int, int>, int> mCounts;
+    int mOverflowCounter = 0;
+    int mWriteCount = 0;
+    bool mFailWrites = false;
+
+protected:
+    int writeLossStats(int32_t overflowCounter, const std::vector<int>& errors,
+                       const std::vector<int>& tags, const std::vector<int>& counts) override {
+        mWriteCount++;
+        if (mFailWrites) {
+            return -1;
+        }
+        for (size_t i = 0; i < errors.size(); i++) {
+            mCounts[{errors[i], tags[i]}] += counts[i];
+        }
+        mOverflowCounter += overflowCounter;
+        return 1;
+    }
+};
+
+}  // namespace
+
+TEST(StatsSocketLossReporterTest, TestDumpNotedDrops) {
+    TestStatsSocketLossReporter reporter;
+    reporter.noteDrop(-EAGAIN, 10);
+    reporter.noteDrop(-EAGAIN, 10);
+    reporter.noteDrop(-EBADF, 10);
+    reporter.noteDrop(-EAGAIN, 11);
+    reporter.dumpAtomsLossStats(true);
+
+    EXPECT_EQ(reporter.mWriteCount, 1);
+    const std::map<std::pair<int, int>, int> expected = {
+            {{-EAGAIN, 10}, 2}, {{-EBADF, 10}, 1}, {{-EAGAIN, 11}, 1}};
+    EXPECT_EQ(reporter.mCounts, expected);
+    EXPECT_EQ(reporter.mOverflowCounter, 0);
+
+    // nothing is left to dump
+    reporter.dumpAtomsLossStats(true);
+    EXPECT_EQ(reporter.mWriteCount, 1);
+}
+
+TEST(StatsSocketLossReporterTest, TestDumpAllOnesKey) {
+    // error and tag of -1 pack into UINT64_MAX, which is not reserved for empty slots
+    TestStatsSocketLossReporter reporter;
+    reporter.noteDrop(-1, -1);
+    reporter.noteDrop(-1, -1);
+    reporter.dumpAtomsLossStats(true);
+
+    const std::map<std::pair<int, int>, int> expected = {{{-1, -1}, 2}};
+    EXPECT_EQ(reporter.mCounts, expected);
+    EXPECT_EQ(reporter.mOverflowCounter, 0);
+}
+
+TEST(StatsSocketLossReporterTest, TestSelfDropsNotCounted) {
+    using namespace android::os::statsdsocket;
+
+    TestStatsSocketLossReporter reporter;
+    reporter.noteDrop(-1, STATS_SOCKET_LOSS_REPORTED);
+    reporter.noteDrop(-EAGAIN, STATS_SOCKET_LOSS_REPORTED);
+    reporter.dumpAtomsLossStats(true);
+    EXPECT_EQ(reporter.mWriteCount, 0);
+}
+
+TEST(StatsSocketLossReporterTest, TestTagsGuardrail) {
+    constexpr int kTagsCount = 130;
+    TestStatsSocketLossReporter reporter;
+    for (int tag = 1; tag <= kTagsCount; tag++) {
+        reporter.noteDrop(-EAGAIN, tag);
+    }
+    // drops of a tag that is already tracked are still counted
+    reporter.noteDrop(-EAGAIN, 1);
+    reporter.dumpAtomsLossStats(true);
+
+    EXPECT_EQ(reporter.mCounts.size(), 100);
+    EXPECT_EQ((reporter.mCounts[{-EAGAIN, 1}]), 2);
+    EXPECT_EQ(reporter.mOverflowCounter, kTagsCount - 100);
+}
+
+TEST(StatsSocketLossReporterTest, TestFailedDumpKeepsStats) {
+    TestStatsSocketLossReporter reporter;
+    reporter.noteDrop(-EAGAIN, 10);
+    reporter.noteDrop(-EAGAIN, 11);
+    reporter.mFailWrites = true;
+    reporter.dumpAtomsLossStats(true);
+    EXPECT_EQ(reporter.mWriteCount, 1);
+    EXPECT_TRUE(reporter.mCounts.empty());
+
+    // the stats that failed to be written are moved to the table noted into meanwhile
+    reporter.noteDrop(-EAGAIN, 10);
+    reporter.mFailWrites = false;
+    reporter.dumpAtomsLossStats(true);
+    EXPECT_EQ(reporter.mWriteCount, 2);
+    const std::map<std::pair<int, int>, int> expected = {{{-EAGAIN, 10}, 2}, {{-EAGAIN, 11}, 1}};
+    EXPECT_EQ(reporter.mCounts, expected);
+
+    // both tables are empty again
+    reporter.dumpAtomsLossStats(true);
+    EXPECT_EQ(reporter.mWriteCount, 2);
+}
+
+TEST(StatsSocketLossReporterTest, TestConcurrentWritersAndDumps) {
+    constexpr int kThreadsCount = 8;
+    constexpr int kDropsPerThread = 20000;
+
+    TestStatsSocketLossReporter reporter;
+    std::atomic_int runningThreads = kThreadsCount;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreadsCount; i++) {
+        threads.emplace_back([&reporter, &runningThreads, i] {
+            for (int j = 0; j < kDropsPerThread; j++) {
+                // one tag per thread and one shared by all of them
+                reporter.noteDrop(-EAGAIN, j % 2 == 0 ? i + 1 : -1);
+                if (j % 3 == 0) {
+                    reporter.noteDrop(-1, -1);
+                }
+            }
+            runningThreads--;
+        });
+    }
+
+    // the tables swap under the writers, some dumps fail and their stats are carried over
+    int dumps = 0;
+    while (runningThreads > 0) {
+        reporter.mFailWrites = dumps++ % 4 == 0;
+        reporter.dumpAtomsLossStats(true);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    reporter.mFailWrites = false;
+    reporter.dumpAtomsLossStats(true);
+    reporter.dumpAtomsLossStats(true);
+
+    std::map<std::pair<int, int>, int> expected;
+    for (int i = 0; i < kThreadsCount; i++) {
+        expected[{-EAGAIN, i + 1}] = kDropsPerThread / 2;
+    }
+    expected[{-EAGAIN, -1}] = kThreadsCount * kDropsPerThread / 2;
+    expected[{-1, -1}] = kThreadsCount * ((kDropsPerThread + 2) / 3);
+    EXPECT_EQ(reporter.mCounts, expected);
+    EXPECT_EQ(reporter.mOverflowCounter, 0);
+}
@@ -15,7 +15,13 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include "stats_buffer_writer.h"
+#include "stats_buffer_writer_queue.h"
 #include "stats_event.h"
 #include "stats_socket.h"
 
@@ -34,3 +40,55 @@ TEST(StatsWriterTest, TestSocketClose) {
 
     EXPECT_TRUE(stats_log_is_closed());
 }
+
+TEST(StatsWriterTest, TestWriteMode) {
+    const uint32_t atomId = 100;
+    const uint32_t otherAtomId = 101;
+    const bool defaultWriteViaQueue = should_write_via_queue(atomId);
+
+    AStatsSocket_setWriteMode(ASTATSSOCKET_WRITE_MODE_ASYNC);
+    EXPECT_TRUE(should_write_via_queue(atomId));
+    EXPECT_TRUE(should_write_via_queue(otherAtomId));
+
+    // the atom's own mode takes precedence over the process mode
+    EXPECT_TRUE(AStatsSocket_setAtomWriteMode(atomId, ASTATSSOCKET_WRITE_MODE_SYNC));
+    EXPECT_FALSE(should_write_via_queue(atomId));
+    EXPECT_TRUE(should_write_via_queue(otherAtomId));
+
+    EXPECT_TRUE(AStatsSocket_setAtomWriteMode(atomId, ASTATSSOCKET_WRITE_MODE_DEFAULT));
+    EXPECT_TRUE(should_write_via_queue(atomId));
+
+    AStatsSocket_setWriteMode(ASTATSSOCKET_WRITE_MODE_DEFAULT);
+    EXPECT_EQ(should_write_via_queue(atomId), defaultWriteViaQueue);
+
+    EXPECT_FALSE(AStatsSocket_setAtomWriteMode(atomId, /*mode=*/3));
+    EXPECT_FALSE(AStatsSocket_setAtomWriteMode(/*atomId=*/0, ASTATSSOCKET_WRITE_MODE_SYNC));
+}
+
+TEST(StatsWriterTest, TestSocketCount) {
+    EXPECT_FALSE(AStatsSocket_setSocketCount(0));
+    EXPECT_FALSE(AStatsSocket_setSocketCount(9));
+
+    ASSERT_TRUE(AStatsSocket_setSocketCount(4));
+    std::vector<std::thread> threads;
+    std::atomic_int successCount = 0;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&successCount] {
+            AStatsEvent* event = AStatsEvent_obtain();
+            AStatsEvent_setAtomId(event, 100);
+            AStatsEvent_writeInt32(event, 5);
+            if (AStatsEvent_write(event) > 0) {
+                successCount++;
+            }
+            AStatsEvent_release(event);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(4, successCount);
+
+    AStatsSocket_close();
+    EXPECT_TRUE(stats_log_is_closed());
+    EXPECT_TRUE(AStatsSocket_setSocketCount(1));
+}
@@ -31,6 +31,7 @@ import android.os.IStatsd;
 import android.os.ParcelFileDescriptor;
 import android.os.PowerManager;
 import android.os.Process;
+import android.os.PullAtomCallbackRegistration;
 import android.os.RemoteException;
 import android.util.ArrayMap;
 import android.util.Log;
@@ -765,12 +766,22 @@ public class StatsManagerService extends IStatsManagerService.Stub {
             pullersCopy = new ArrayMap<>(mPullers);
         }
 
-        for (Map.Entry<PullerKey, PullerValue> entry : pullersCopy.entrySet()) {
-            PullerKey key = entry.getKey();
-            PullerValue value = entry.getValue();
-            statsd.registerPullAtomCallback(key.getUid(), key.getAtom(), value.getCoolDownMillis(),
-                    value.getTimeoutMillis(), value.getAdditiveFields(), value.getCallback());
-        }
+        // Register all the pullers in one call, so that statsd installs them at once.
+        PullAtomCallbackRegistration[] registrations =
+                new PullAtomCallbackRegistration[pullersCopy.size()];
+        for (int i = 0; i < pullersCopy.size(); i++) {
+            PullerKey key = pullersCopy.keyAt(i);
+            PullerValue value = pullersCopy.valueAt(i);
+            PullAtomCallbackRegistration registration = new PullAtomCallbackRegistration();
+            registration.uid = key.getUid();
+            registration.atomTag = key.getAtom();
+            registration.coolDownMillis = value.getCoolDownMillis();
+            registration.timeoutMillis = value.getTimeoutMillis();
+            registration.additiveFields = value.getAdditiveFields();
+            registration.pullerCallback = value.getCallback();
+            registrations[i] = registration;
+        }
+        statsd.registerPullAtomCallbacks(registrations);
         statsd.allPullersFromBootRegistered();
     }
 
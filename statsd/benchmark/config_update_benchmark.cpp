@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+
+#include "benchmark/benchmark.h"
+#include "guardrail/StatsdStats.h"
+#include "metrics/MetricsManager.h"
+#include "tests/statsd_test_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::to_string;
+
+namespace {
+
+// A config of metricCount count metrics spread over 100 atoms.
+StatsdConfig createConfig(int metricCount) {
+    StatsdConfig config;
+    config.add_allowed_log_source("AID_ROOT");
+    for (int atomId = 1000; atomId < 1100; atomId++) {
+        *config.add_atom_matcher() = CreateSimpleAtomMatcher("name" + to_string(atomId), atomId);
+    }
+    for (int i = 0; i < metricCount; i++) {
+        *config.add_count_metric() =
+                createCountMetric("Count" + to_string(i),
+                                  config.atom_matcher(i % config.atom_matcher_size()).id(),
+                                  /*condition=*/nullopt, /*states=*/{});
+    }
+    return config;
+}
+
+// A config of metricCount count metrics over matcherCount matchers, each of its own atom.
+StatsdConfig createConfig(int metricCount, int matcherCount) {
+    StatsdConfig config;
+    config.add_allowed_log_source("AID_ROOT");
+    for (int i = 0; i < matcherCount; i++) {
+        *config.add_atom_matcher() = CreateSimpleAtomMatcher("name" + to_string(i), 1000 + i);
+    }
+    for (int i = 0; i < metricCount; i++) {
+        *config.add_count_metric() = createCountMetric("Count" + to_string(i),
+                                                       config.atom_matcher(i % matcherCount).id(),
+                                                       /*condition=*/nullopt, /*states=*/{});
+    }
+    return config;
+}
+
+}  // anonymous namespace
+
+// Updates a config in which a single metric changes each time.
+static void BM_ConfigUpdateOneMetricChanged(benchmark::State& state) {
+    StatsdConfig config = createConfig(state.range(0));
+    const ConfigKey key(123, 987);
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+    sp<MetricsManager> metricsManager =
+            new MetricsManager(key, config, /*timeBaseNs=*/0, /*currentTimeNs=*/0, uidMap,
+                               pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    int64_t timeNs = 0;
+    for (auto _ : state) {
+        CountMetric* metric = config.mutable_count_metric(0);
+        metric->set_bucket(metric->bucket() == ONE_HOUR ? TEN_MINUTES : ONE_HOUR);
+        timeNs += NS_PER_SEC;
+        benchmark::DoNotOptimize(metricsManager->updateConfig(config, /*timeBaseNs=*/0, timeNs,
+                                                              anomalyAlarmMonitor,
+                                                              periodicAlarmMonitor));
+    }
+}
+BENCHMARK(BM_ConfigUpdateOneMetricChanged)->Arg(200)->Arg(2000);
+
+// Updates a config through StatsLogProcessor::OnConfigUpdated, which holds mMetricsMutex for the
+// whole update and so blocks the processing of events until it returns. The arguments are the
+// number of metrics, the number of matchers and the number of metrics changed by each update.
+// The largest configs are at the kMaxMetricCountPerConfig and kMaxMatcherCountPerConfig
+// guardrails.
+//
+// mean_lock_held_us and max_lock_held_us are the time the mutex is held by an update.
+static void BM_ConfigUpdateLockHeld(benchmark::State& state) {
+    const int metricCount = state.range(0);
+    const int changedMetricCount = std::min<int>(state.range(2), metricCount);
+    StatsdConfig config = createConfig(metricCount, state.range(1));
+    const ConfigKey key(123, 987);
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(/*timeBaseNs=*/0, /*currentTimeNs=*/0, config, key);
+    int64_t timeNs = 0;
+    int64_t totalLockHeldNs = 0;
+    int64_t maxLockHeldNs = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int i = 0; i < changedMetricCount; i++) {
+            CountMetric* metric = config.mutable_count_metric(i);
+            metric->set_bucket(metric->bucket() == ONE_HOUR ? TEN_MINUTES : ONE_HOUR);
+        }
+        timeNs += NS_PER_SEC;
+        state.ResumeTiming();
+
+        const int64_t startNs = getElapsedRealtimeNs();
+        processor->OnConfigUpdated(timeNs, key, config, /*modularUpdate=*/true);
+        const int64_t lockHeldNs = getElapsedRealtimeNs() - startNs;
+        totalLockHeldNs += lockHeldNs;
+        maxLockHeldNs = std::max(maxLockHeldNs, lockHeldNs);
+    }
+    if (state.iterations() > 0) {
+        state.counters["mean_lock_held_us"] = totalLockHeldNs / state.iterations() / 1000;
+    }
+    state.counters["max_lock_held_us"] = maxLockHeldNs / 1000;
+}
+BENCHMARK(BM_ConfigUpdateLockHeld)
+        ->ArgNames({"metrics", "matchers", "changed"})
+        ->Args({200, 250, 1})
+        ->Args({200, 250, 100})
+        ->Args({StatsdStats::kMaxMetricCountPerConfig, StatsdStats::kMaxMatcherCountPerConfig, 1})
+        ->Args({StatsdStats::kMaxMetricCountPerConfig, StatsdStats::kMaxMatcherCountPerConfig,
+                StatsdStats::kMaxMetricCountPerConfig / 2})
+        ->Unit(benchmark::kMillisecond);
+
+}  //  namespace statsd
+}  //  namespace os
+}  //  namespace android
@@ -15,8 +15,12 @@
  */
 #include <cstdlib>
 #include <ctime>
+#include <random>
 #include <vector>
 
+#include "anomaly/AlarmMonitor.h"
+#include "anomaly/AlarmTimerWheel.h"
+#include "anomaly/indexed_priority_queue.h"
 #include "benchmark/benchmark.h"
 
 namespace android {
@@ -56,8 +60,67 @@ void benchmarkStdFillForVector(std::vector<ContainerType>& vec, int capacity) {
     benchmark::DoNotOptimize(resultInt);
 }
 
+using AlarmPriorityQueue = indexed_priority_queue<InternalAlarm, InternalAlarm::SmallerTimestamp>;
+
+// Alarms spread over the next hour, like anomaly alarms of in-progress durations.
+std::vector<sp<const InternalAlarm>> createAlarms(int count, uint32_t nowSec) {
+    std::mt19937 random(count);
+    std::vector<sp<const InternalAlarm>> alarms;
+    for (int i = 0; i < count; i++) {
+        alarms.push_back(new InternalAlarm{nowSec + static_cast<uint32_t>(random() % 3600)});
+    }
+    return alarms;
+}
+
+void popSoonerThan(AlarmTimerWheel& alarms, uint32_t timestampSec,
+                   std::vector<sp<const InternalAlarm>>* popped) {
+    alarms.popSoonerThan(timestampSec, popped);
+}
+
+void popSoonerThan(AlarmPriorityQueue& alarms, uint32_t timestampSec,
+                   std::vector<sp<const InternalAlarm>>* popped) {
+    while (!alarms.empty() && alarms.top()->timestampSec <= timestampSec) {
+        popped->push_back(alarms.top());
+        alarms.pop();
+    }
+}
+
+// Adds every alarm, cancels and re-adds every other one, then fires them a minute at a time.
+template <typename AlarmsType>
+void benchmarkAlarmChurn(benchmark::State& state) {
+    const uint32_t nowSec = 1000000;
+    const std::vector<sp<const InternalAlarm>> alarms = createAlarms(state.range(0), nowSec);
+    std::vector<sp<const InternalAlarm>> popped;
+
+    while (state.KeepRunning()) {
+        AlarmsType queue;
+        for (const auto& alarm : alarms) {
+            queue.push(alarm);
+        }
+        for (size_t i = 0; i < alarms.size(); i += 2) {
+            queue.remove(alarms[i]);
+            queue.push(alarms[i]);
+        }
+        for (uint32_t timestampSec = nowSec; !queue.empty(); timestampSec += 60) {
+            popped.clear();
+            popSoonerThan(queue, timestampSec, &popped);
+        }
+        benchmark::DoNotOptimize(popped);
+    }
+}
+
 }  //  namespace
 
+static void BM_AlarmTimerWheelChurn(benchmark::State& state) {
+    benchmarkAlarmChurn<AlarmTimerWheel>(state);
+}
+BENCHMARK(BM_AlarmTimerWheelChurn)->Args({100})->Args({1000})->Args({10000});
+
+static void BM_AlarmPriorityQueueChurn(benchmark::State& state) {
+    benchmarkAlarmChurn<AlarmPriorityQueue>(state);
+}
+BENCHMARK(BM_AlarmPriorityQueueChurn)->Args({100})->Args({1000})->Args({10000});
+
 static void BM_BasicVectorBoolUsage(benchmark::State& state) {
     const int capacity = state.range(0);
     std::vector<bool> vec(capacity);
@@ -54,6 +54,7 @@ BENCHMARK(BM_insertAtomsIntoDbTablesNewConnection)
         ->Args({1, 50})
         ->Args({1, 100})
         ->Args({1, 500})
+        ->Args({1, 5000})
         ->Args({10, 10})
         ->Args({10, 20});
 
@@ -76,7 +77,7 @@ static void BM_insertAtomsIntoDbTablesReuseConnection(benchmark::State& state) {
             deleteTable(key, metricId);
             createTableIfNeeded(key, metricId, *event.get());
             state.ResumeTiming();
-            insert(key, metricId, logEvents, err);
+            insert(dbHandle, metricId, logEvents, err);
         }
     }
     closeDb(dbHandle);
@@ -88,6 +89,7 @@ BENCHMARK(BM_insertAtomsIntoDbTablesReuseConnection)
         ->Args({1, 50})
         ->Args({1, 100})
         ->Args({1, 500})
+        ->Args({1, 5000})
         ->Args({10, 10})
         ->Args({10, 20});
 
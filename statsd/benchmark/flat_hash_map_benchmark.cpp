@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <unordered_map>
+#include <vector>
+
+#include "HashableDimensionKey.h"
+#include "benchmark/benchmark.h"
+#include "stats_util.h"
+#include "utils/FlatHashMap.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+// Builds dimension keys shaped like a uid + tag dimension of a wakelock metric.
+std::vector<MetricDimensionKey> createDimensionKeys(int count) {
+    std::vector<MetricDimensionKey> keys;
+    keys.reserve(count);
+    int pos1[] = {1, 1, 1};
+    int pos2[] = {2, 1, 1};
+    for (int i = 0; i < count; i++) {
+        HashableDimensionKey dimensionKey;
+        dimensionKey.addValue(FieldValue(Field(10, pos1, 0), Value((int32_t)(10000 + i))));
+        dimensionKey.addValue(
+                FieldValue(Field(10, pos2, 0), Value(std::string("wakelock") + std::to_string(i))));
+        keys.emplace_back(dimensionKey, DEFAULT_DIMENSION_KEY);
+    }
+    return keys;
+}
+
+// Simulates one bucket: every event bumps the counter of its dimension, then the bucket is
+// walked once as it would be on flush.
+template <typename MapType>
+void benchmarkSlicedBucket(benchmark::State& state) {
+    const std::vector<MetricDimensionKey> keys = createDimensionKeys(state.range(0));
+    for (auto _ : state) {
+        MapType map;
+        for (int round = 0; round < 4; round++) {
+            for (const MetricDimensionKey& key : keys) {
+                map[key]++;
+            }
+        }
+        int64_t total = 0;
+        for (const auto& [key, count] : map) {
+            total += count;
+        }
+        benchmark::DoNotOptimize(total);
+    }
+}
+
+template <typename MapType>
+void benchmarkLookup(benchmark::State& state) {
+    const std::vector<MetricDimensionKey> keys = createDimensionKeys(state.range(0));
+    MapType map;
+    for (const MetricDimensionKey& key : keys) {
+        map[key] = 1;
+    }
+    for (auto _ : state) {
+        int64_t total = 0;
+        for (const MetricDimensionKey& key : keys) {
+            auto it = map.find(key);
+            if (it != map.end()) {
+                total += it->second;
+            }
+        }
+        benchmark::DoNotOptimize(total);
+    }
+}
+
+}  //  namespace
+
+static void BM_UnorderedMapSlicedBucket(benchmark::State& state) {
+    benchmarkSlicedBucket<std::unordered_map<MetricDimensionKey, int64_t>>(state);
+}
+BENCHMARK(BM_UnorderedMapSlicedBucket)->Args({1000})->Args({10000})->Args({50000});
+
+static void BM_FlatHashMapSlicedBucket(benchmark::State& state) {
+    benchmarkSlicedBucket<FlatHashMap<MetricDimensionKey, int64_t>>(state);
+}
+BENCHMARK(BM_FlatHashMapSlicedBucket)->Args({1000})->Args({10000})->Args({50000});
+
+static void BM_UnorderedMapLookup(benchmark::State& state) {
+    benchmarkLookup<std::unordered_map<MetricDimensionKey, int64_t>>(state);
+}
+BENCHMARK(BM_UnorderedMapLookup)->Args({1000})->Args({10000})->Args({50000});
+
+static void BM_FlatHashMapLookup(benchmark::State& state) {
+    benchmarkLookup<FlatHashMap<MetricDimensionKey, int64_t>>(state);
+}
+BENCHMARK(BM_FlatHashMapLookup)->Args({1000})->Args({10000})->Args({50000});
+
+}  //  namespace statsd
+}  //  namespace os
+}  //  namespace android
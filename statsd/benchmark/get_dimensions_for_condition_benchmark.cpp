@@ -71,6 +71,33 @@ static void BM_GetDimensionInCondition(benchmark::State& state) {
 
 BENCHMARK(BM_GetDimensionInCondition);
 
+// Links top-level fields 3 and 4 of the event, with the projection compiled if compiled is set.
+static void BM_GetDimensionInConditionTopLevelFields(benchmark::State& state) {
+    Metric2Condition link;
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    createLogEventAndLink(&event, &link);
+
+    FieldMatcher field_matcher;
+    field_matcher.set_field(event.GetTagId());
+    field_matcher.add_child()->set_field(3);
+    field_matcher.add_child()->set_field(4);
+    link.metricFields.clear();
+    link.conditionFields.clear();
+    translateFieldMatcher(field_matcher, &link.metricFields);
+    field_matcher.set_field(event.GetTagId() + 1);
+    translateFieldMatcher(field_matcher, &link.conditionFields);
+    if (state.range(0)) {
+        link.projection = compileLinkProjection(link.metricFields, link.conditionFields);
+    }
+
+    while (state.KeepRunning()) {
+        HashableDimensionKey output;
+        getDimensionForCondition(event.getValues(), link, &output);
+    }
+}
+
+BENCHMARK(BM_GetDimensionInConditionTopLevelFields)->ArgName("compiled")->Arg(0)->Arg(1);
+
 
 }  //  namespace statsd
 }  //  namespace os
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string>
+#include <vector>
+
+#include "HashableDimensionKey.h"
+#include "benchmark/benchmark.h"
+#include "hash.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int32_t kAtomId = 10001;
+
+void addValue(HashableDimensionKey* key, int32_t field, const Value& value) {
+    key->addValue(FieldValue(Field(kAtomId, field), value));
+}
+
+// The shapes of keys seen in practice: a uid, a uid and a package name, two uid and tag pairs
+// and a state, and a uid with a bytes field.
+HashableDimensionKey createKey(int shape) {
+    HashableDimensionKey key;
+    switch (shape) {
+        case 0:
+            addValue(&key, 1, Value((int32_t)10123));
+            break;
+        case 1:
+            addValue(&key, 1, Value((int32_t)10123));
+            addValue(&key, 2, Value(std::string("com.google.android.apps.example")));
+            break;
+        case 2:
+            addValue(&key, 1, Value((int32_t)10123));
+            addValue(&key, 2, Value(std::string("tag1")));
+            addValue(&key, 3, Value((int32_t)1000));
+            addValue(&key, 4, Value(std::string("tag2")));
+            addValue(&key, 5, Value((int32_t)2));
+            break;
+        case 3:
+            addValue(&key, 1, Value((int32_t)10123));
+            addValue(&key, 2, Value(std::vector<uint8_t>(32, 0xAB)));
+            break;
+    }
+    return key;
+}
+
+}  // anonymous namespace
+
+// Hashes a dimension key the way a map lookup does when the cached hash was dropped.
+static void BM_HashDimensionKey(benchmark::State& state) {
+    HashableDimensionKey key = createKey(state.range(0));
+    for (auto _ : state) {
+        // Drops the cached hash.
+        key.mutableValue(0);
+        benchmark::DoNotOptimize(hashDimension(key));
+    }
+}
+BENCHMARK(BM_HashDimensionKey)->ArgName("shape")->DenseRange(0, 3);
+
+// Hashes byte strings of the sizes of serialized config protos.
+static void BM_Hash64(benchmark::State& state) {
+    const std::string data(state.range(0), 'a');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Hash64(data));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Hash64)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_FastHash64(benchmark::State& state) {
+    const std::string data(state.range(0), 'a');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(FastHash64(data));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_FastHash64)->Arg(16)->Arg(256)->Arg(4096);
+
+}  //  namespace statsd
+}  //  namespace os
+}  //  namespace android
@@ -16,6 +16,7 @@
 #include <vector>
 #include "benchmark/benchmark.h"
 #include "logd/LogEvent.h"
+#include "logd/LogEventPool.h"
 #include "stats_event.h"
 
 namespace android {
@@ -206,6 +207,66 @@ static void BM_LogEventCreationExtraLargeWithPrefetchOnly(benchmark::State& stat
 }
 BENCHMARK(BM_LogEventCreationExtraLargeWithPrefetchOnly);
 
+// A batch of events as the socket listener allocates them and the log reader thread frees them.
+static void BM_LogEventBatchAllocated(benchmark::State& state) {
+    uint8_t msg[LOGGER_ENTRY_MAX_PAYLOAD];
+    const size_t size = createStatsEventLarge(msg);
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.reserve(state.range(0));
+    while (state.KeepRunning()) {
+        for (int i = 0; i < state.range(0); i++) {
+            events.push_back(std::make_unique<LogEvent>(/*uid=*/1000, /*pid=*/1001));
+            benchmark::DoNotOptimize(events.back()->parseBuffer(msg, size));
+        }
+        events.clear();
+    }
+}
+BENCHMARK(BM_LogEventBatchAllocated)->Arg(1)->Arg(64);
+
+static void BM_LogEventBatchPooled(benchmark::State& state) {
+    uint8_t msg[LOGGER_ENTRY_MAX_PAYLOAD];
+    const size_t size = createStatsEventLarge(msg);
+    LogEventPool& pool = LogEventPool::getInstance();
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.reserve(state.range(0));
+    while (state.KeepRunning()) {
+        for (int i = 0; i < state.range(0); i++) {
+            events.push_back(pool.obtain(/*uid=*/1000, /*pid=*/1001));
+            benchmark::DoNotOptimize(events.back()->parseBuffer(msg, size));
+        }
+        pool.recycle(events);
+    }
+    pool.clear();
+}
+BENCHMARK(BM_LogEventBatchPooled)->Arg(1)->Arg(64);
+
+// An event with an int32 array and an int64 array of numArrayElements elements each.
+static size_t createStatsEventWithArrays(uint8_t* msg, int numArrayElements) {
+    std::vector<int32_t> int32Array(numArrayElements, 2);
+    std::vector<int64_t> int64Array(numArrayElements, 3L);
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeInt32Array(event, int32Array.data(), int32Array.size());
+    AStatsEvent_writeInt64Array(event, int64Array.data(), int64Array.size());
+    AStatsEvent_build(event);
+
+    size_t size;
+    uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+    memcpy(msg, buf, size);
+    AStatsEvent_release(event);
+    return size;
+}
+
+static void BM_LogEventCreationWithArrays(benchmark::State& state) {
+    uint8_t msg[LOGGER_ENTRY_MAX_PAYLOAD];
+    const size_t size = createStatsEventWithArrays(msg, state.range(0));
+    while (state.KeepRunning()) {
+        LogEvent event(/*uid=*/1000, /*pid=*/1001);
+        benchmark::DoNotOptimize(event.parseBuffer(msg, size));
+    }
+}
+BENCHMARK(BM_LogEventCreationWithArrays)->Arg(4)->Arg(32)->Arg(127);
+
 }  //  namespace statsd
 }  //  namespace os
 }  //  namespace android
@@ -106,6 +106,17 @@ static void BM_LogEventFilterUnorderedSet2Consumers(benchmark::State& state) {
 }
 BENCHMARK(BM_LogEventFilterUnorderedSet2Consumers);
 
+static void BM_LogEventFilterUnorderedSetQueryOnly(benchmark::State& state) {
+    LogEventFilter eventFilter;
+    eventFilter.setAtomIds(kAtomIdsUnorderedSet, nullptr);
+    while (state.KeepRunning()) {
+        for (const auto& atomId : kSampleIdsList) {
+            benchmark::DoNotOptimize(eventFilter.isAtomInUse(atomId));
+        }
+    }
+}
+BENCHMARK(BM_LogEventFilterUnorderedSetQueryOnly);
+
 static void BM_LogEventFilterSet(benchmark::State& state) {
     while (state.KeepRunning()) {
         LogEventFilterGeneric<std::set<int>> eventFilter;
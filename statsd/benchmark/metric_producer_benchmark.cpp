@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for the hot paths of the count, gauge, numeric value, KLL and event metric producers.
+// Every benchmark is run for each producer and takes two arguments: the number of distinct uids,
+// which is the dimension cardinality of the metric, and the Slicing applied to it.
+//
+// To track regressions, write the results out as JSON:
+//   statsd_benchmark --benchmark_filter=BM_MetricProducer --benchmark_format=json
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tests/statsd_test_util.h"
+
+using namespace std;
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int kWhatAtomId = 10001;
+const int kConditionAtomId = 10002;
+
+const int64_t kConfigAddedTimeNs = 10 * NS_PER_SEC;
+const int64_t kBucketSizeNs = TimeUnitToBucketSizeInMillis(TEN_MINUTES) * 1000000LL;
+
+// The flush benchmarks drop their past buckets this often so that memory stays bounded.
+const int kBucketsPerDump = 16;
+
+enum Slicing {
+    NO_SLICING = 0,
+    // Condition on the screen being on.
+    UNSLICED_CONDITION = 1,
+    // Condition sliced by uid, linked to the uid of the metric.
+    SLICED_CONDITION = 2,
+    // Sliced by the process state of the uid of the metric.
+    SLICED_STATE = 3,
+};
+
+const int64_t kWhatMatcherId = StringToId("What");
+const int64_t kConditionStartMatcherId = StringToId("ConditionStart");
+const int64_t kConditionStopMatcherId = StringToId("ConditionStop");
+const int64_t kUidConditionPredicateId = StringToId("UidCondition");
+
+AtomMatcher createConditionAtomMatcher(const string& name, const int value) {
+    AtomMatcher matcher = CreateSimpleAtomMatcher(name, kConditionAtomId);
+    auto fieldValueMatcher = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+    fieldValueMatcher->set_field(2);
+    fieldValueMatcher->set_eq_int(value);
+    return matcher;
+}
+
+// Adds the matchers, predicates and states used by every metric to the config.
+StatsdConfig createConfig() {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateSimpleAtomMatcher("What", kWhatAtomId);
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_atom_matcher() = createConditionAtomMatcher("ConditionStart", 1);
+    *config.add_atom_matcher() = createConditionAtomMatcher("ConditionStop", 0);
+
+    *config.add_predicate() = CreateScreenIsOnPredicate();
+    Predicate uidPredicate;
+    uidPredicate.set_id(kUidConditionPredicateId);
+    uidPredicate.mutable_simple_predicate()->set_start(kConditionStartMatcherId);
+    uidPredicate.mutable_simple_predicate()->set_stop(kConditionStopMatcherId);
+    *uidPredicate.mutable_simple_predicate()->mutable_dimensions() =
+            CreateDimensions(kConditionAtomId, {1 /* uid */});
+    *config.add_predicate() = uidPredicate;
+
+    *config.add_state() = CreateUidProcessState();
+    return config;
+}
+
+template <typename Metric>
+void addCondition(Metric* metric, const Slicing slicing) {
+    if (slicing == UNSLICED_CONDITION) {
+        metric->set_condition(StringToId("ScreenIsOn"));
+    } else if (slicing == SLICED_CONDITION) {
+        metric->set_condition(kUidConditionPredicateId);
+        auto link = metric->add_links();
+        link->set_condition(kUidConditionPredicateId);
+        *link->mutable_fields_in_what() = CreateDimensions(kWhatAtomId, {1 /* uid */});
+        *link->mutable_fields_in_condition() = CreateDimensions(kConditionAtomId, {1 /* uid */});
+    }
+}
+
+template <typename Metric>
+void addDimensionsAndState(Metric* metric, const Slicing slicing) {
+    *metric->mutable_dimensions_in_what() = CreateDimensions(kWhatAtomId, {1 /* uid */});
+    if (slicing == SLICED_STATE) {
+        const State state = CreateUidProcessState();
+        metric->add_slice_by_state(state.id());
+        auto link = metric->add_state_link();
+        link->set_state_atom_id(state.atom_id());
+        *link->mutable_fields_in_what() = CreateDimensions(kWhatAtomId, {1 /* uid */});
+        *link->mutable_fields_in_state() =
+                CreateDimensions(util::UID_PROCESS_STATE_CHANGED, {1 /* uid */});
+    }
+}
+
+void addCountMetric(StatsdConfig* config, const Slicing slicing) {
+    CountMetric* metric = config->add_count_metric();
+    *metric = createCountMetric("Count", kWhatMatcherId, /* condition */ nullopt, /* states */ {});
+    addCondition(metric, slicing);
+    addDimensionsAndState(metric, slicing);
+}
+
+void addGaugeMetric(StatsdConfig* config, const Slicing slicing) {
+    GaugeMetric* metric = config->add_gauge_metric();
+    *metric = createGaugeMetric("Gauge", kWhatMatcherId, GaugeMetric::FIRST_N_SAMPLES,
+                                /* condition */ nullopt, /* triggerEvent */ nullopt);
+    addCondition(metric, slicing);
+    *metric->mutable_dimensions_in_what() = CreateDimensions(kWhatAtomId, {1 /* uid */});
+}
+
+void addValueMetric(StatsdConfig* config, const Slicing slicing) {
+    ValueMetric* metric = config->add_value_metric();
+    *metric = createValueMetric("Value", config->atom_matcher(0), 2 /* data1 */,
+                                /* condition */ nullopt, /* states */ {});
+    addCondition(metric, slicing);
+    addDimensionsAndState(metric, slicing);
+}
+
+void addKllMetric(StatsdConfig* config, const Slicing slicing) {
+    KllMetric* metric = config->add_kll_metric();
+    *metric = createKllMetric("Kll", config->atom_matcher(0), 2 /* data1 */,
+                              /* condition */ nullopt);
+    addCondition(metric, slicing);
+    addDimensionsAndState(metric, slicing);
+}
+
+void addEventMetric(StatsdConfig* config, const Slicing slicing) {
+    EventMetric* metric = config->add_event_metric();
+    *metric = createEventMetric("Event", kWhatMatcherId, /* condition */ nullopt);
+    addCondition(metric, slicing);
+}
+
+using MetricAdder = void (*)(StatsdConfig*, Slicing);
+
+struct MetricProducerFixture {
+    ConfigKey key;
+    sp<StatsLogProcessor> processor;
+    // One event of the metric's atom per uid.
+    vector<shared_ptr<LogEvent>> events;
+};
+
+// Creates a processor running a single metric and makes its condition true and its states known
+// for every uid.
+MetricProducerFixture createFixture(const benchmark::State& state, const MetricAdder addMetric) {
+    const int numUids = state.range(0);
+    const Slicing slicing = static_cast<Slicing>(state.range(1));
+
+    StatsdConfig config = createConfig();
+    addMetric(&config, slicing);
+
+    MetricProducerFixture fixture;
+    fixture.processor = CreateStatsLogProcessor(kConfigAddedTimeNs, kConfigAddedTimeNs, config,
+                                                fixture.key);
+
+    const int64_t eventTimeNs = kConfigAddedTimeNs + 1;
+    unique_ptr<LogEvent> screenOnEvent =
+            CreateScreenStateChangedEvent(eventTimeNs, android::view::DISPLAY_STATE_ON);
+    fixture.processor->OnLogEvent(screenOnEvent.get());
+    for (int i = 0; i < numUids; i++) {
+        const int uid = 1000 + i;
+        shared_ptr<LogEvent> conditionEvent =
+                makeUidLogEvent(kConditionAtomId, eventTimeNs, uid, 1 /* start */, 0);
+        fixture.processor->OnLogEvent(conditionEvent.get());
+        unique_ptr<LogEvent> stateEvent = CreateUidProcessStateChangedEvent(
+                eventTimeNs, uid,
+                i % 2 == 0 ? android::app::ProcessStateEnum::PROCESS_STATE_TOP
+                           : android::app::ProcessStateEnum::PROCESS_STATE_IMPORTANT_BACKGROUND);
+        fixture.processor->OnLogEvent(stateEvent.get());
+        fixture.events.push_back(makeUidLogEvent(kWhatAtomId, eventTimeNs, uid, i, 0));
+    }
+    return fixture;
+}
+
+void logEvents(MetricProducerFixture* fixture, const int64_t eventTimeNs) {
+    for (const shared_ptr<LogEvent>& event : fixture->events) {
+        event->setElapsedTimestampNs(eventTimeNs);
+        fixture->processor->OnLogEvent(event.get());
+    }
+}
+
+void dumpReport(MetricProducerFixture* fixture, const int64_t dumpTimeNs) {
+    vector<uint8_t> buffer;
+    fixture->processor->onDumpReport(fixture->key, dumpTimeNs,
+                                     /* include_current_partial_bucket */ true,
+                                     /* erase_data */ true, ADB_DUMP, FAST, &buffer);
+    benchmark::DoNotOptimize(buffer.data());
+}
+
+void addSlicingArgs(benchmark::internal::Benchmark* benchmark, const Slicing maxSlicing) {
+    benchmark->ArgNames({"uids", "slicing"});
+    for (const int numUids : {1, 10, 100, 400}) {
+        for (int slicing = NO_SLICING; slicing <= maxSlicing; slicing++) {
+            benchmark->Args({numUids, slicing});
+        }
+    }
+}
+
+// Gauge and event metrics cannot be sliced by state.
+void addArgsWithoutState(benchmark::internal::Benchmark* benchmark) {
+    addSlicingArgs(benchmark, SLICED_CONDITION);
+}
+
+void addArgs(benchmark::internal::Benchmark* benchmark) {
+    addSlicingArgs(benchmark, SLICED_STATE);
+}
+
+}  // anonymous namespace
+
+// Logs one event per uid, all within the first bucket.
+static void BM_MetricProducerOnLogEvent(benchmark::State& state, const MetricAdder addMetric) {
+    MetricProducerFixture fixture = createFixture(state, addMetric);
+    for (auto _ : state) {
+        logEvents(&fixture, kConfigAddedTimeNs + 2);
+    }
+}
+
+// Logs one event per uid in every bucket, so that each iteration flushes every dimension.
+static void BM_MetricProducerBucketFlush(benchmark::State& state, const MetricAdder addMetric) {
+    MetricProducerFixture fixture = createFixture(state, addMetric);
+    int64_t bucketNum = 0;
+    for (auto _ : state) {
+        const int64_t eventTimeNs = kConfigAddedTimeNs + bucketNum * kBucketSizeNs + 2;
+        logEvents(&fixture, eventTimeNs);
+        if (++bucketNum % kBucketsPerDump == 0) {
+            state.PauseTiming();
+            dumpReport(&fixture, eventTimeNs + 1);
+            state.ResumeTiming();
+        }
+    }
+}
+
+// Dumps and erases a report holding one bucket with one event per uid.
+static void BM_MetricProducerDumpReport(benchmark::State& state, const MetricAdder addMetric) {
+    MetricProducerFixture fixture = createFixture(state, addMetric);
+    int64_t bucketNum = 0;
+    for (auto _ : state) {
+        const int64_t eventTimeNs = kConfigAddedTimeNs + bucketNum * kBucketSizeNs + 2;
+        state.PauseTiming();
+        logEvents(&fixture, eventTimeNs);
+        state.ResumeTiming();
+        dumpReport(&fixture, eventTimeNs + 1);
+        bucketNum++;
+    }
+}
+
+BENCHMARK_CAPTURE(BM_MetricProducerOnLogEvent, Count, addCountMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerOnLogEvent, Gauge, addGaugeMetric)->Apply(addArgsWithoutState);
+BENCHMARK_CAPTURE(BM_MetricProducerOnLogEvent, Value, addValueMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerOnLogEvent, Kll, addKllMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerOnLogEvent, Event, addEventMetric)->Apply(addArgsWithoutState);
+
+BENCHMARK_CAPTURE(BM_MetricProducerBucketFlush, Count, addCountMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerBucketFlush, Gauge, addGaugeMetric)->Apply(addArgsWithoutState);
+BENCHMARK_CAPTURE(BM_MetricProducerBucketFlush, Value, addValueMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerBucketFlush, Kll, addKllMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerBucketFlush, Event, addEventMetric)
+        ->Apply(addArgsWithoutState);
+
+BENCHMARK_CAPTURE(BM_MetricProducerDumpReport, Count, addCountMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerDumpReport, Gauge, addGaugeMetric)->Apply(addArgsWithoutState);
+BENCHMARK_CAPTURE(BM_MetricProducerDumpReport, Value, addValueMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerDumpReport, Kll, addKllMetric)->Apply(addArgs);
+BENCHMARK_CAPTURE(BM_MetricProducerDumpReport, Event, addEventMetric)->Apply(addArgsWithoutState);
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
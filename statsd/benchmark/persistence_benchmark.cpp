@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for producing and persisting reports: dump reports, writing them to disk, reading
+// them back and encoding the uid map. The configs hold a count and a value metric sliced by uid,
+// filled with one event per uid in each of kNumBuckets hourly buckets, as a day of data would be.
+//
+// Every benchmark reports the bytes it produces and the peak resident memory of the process.
+
+#include <sys/resource.h>
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "storage/StorageManager.h"
+#include "tests/statsd_test_util.h"
+
+using namespace std;
+using android::util::ProtoOutputStream;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int kAtomId = 10001;
+const int kNumBuckets = 24;
+
+const int64_t kConfigAddedTimeNs = 10 * NS_PER_SEC;
+const int64_t kBucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_HOUR) * 1000000LL;
+
+StatsdConfig createConfig() {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateSimpleAtomMatcher("What", kAtomId);
+
+    CountMetric* countMetric = config.add_count_metric();
+    *countMetric = createCountMetric("Count", config.atom_matcher(0).id(), /* condition */ nullopt,
+                                     /* states */ {});
+    countMetric->set_bucket(ONE_HOUR);
+    *countMetric->mutable_dimensions_in_what() = CreateDimensions(kAtomId, {1 /* uid */});
+
+    ValueMetric* valueMetric = config.add_value_metric();
+    *valueMetric = createValueMetric("Value", config.atom_matcher(0), 2 /* data */,
+                                     /* condition */ nullopt, /* states */ {});
+    valueMetric->set_bucket(ONE_HOUR);
+    *valueMetric->mutable_dimensions_in_what() = CreateDimensions(kAtomId, {1 /* uid */});
+    return config;
+}
+
+struct PersistenceFixture {
+    ConfigKey key;
+    sp<StatsLogProcessor> processor;
+    // One event per uid.
+    vector<shared_ptr<LogEvent>> events;
+    // The start of the next bucket to fill.
+    int64_t nextBucketStartNs = kConfigAddedTimeNs;
+};
+
+PersistenceFixture createFixture(int numUids) {
+    PersistenceFixture fixture;
+    fixture.processor = CreateStatsLogProcessor(kConfigAddedTimeNs, kConfigAddedTimeNs,
+                                                createConfig(), fixture.key);
+    for (int i = 0; i < numUids; i++) {
+        fixture.events.push_back(
+                makeUidLogEvent(kAtomId, kConfigAddedTimeNs, 1000 + i, /* data */ i, 0));
+    }
+    return fixture;
+}
+
+// Fills kNumBuckets buckets with one event per uid each. Returns the end of the last bucket.
+int64_t fillBuckets(PersistenceFixture* fixture) {
+    for (int i = 0; i < kNumBuckets; i++) {
+        for (const shared_ptr<LogEvent>& event : fixture->events) {
+            event->setElapsedTimestampNs(fixture->nextBucketStartNs + 1);
+            fixture->processor->OnLogEvent(event.get());
+        }
+        fixture->nextBucketStartNs += kBucketSizeNs;
+    }
+    return fixture->nextBucketStartNs;
+}
+
+// Reads the reports of the fixture's config back from disk. Erasing them leaves the disk as it was
+// before the benchmark.
+size_t readReportsFromDisk(const PersistenceFixture& fixture, bool eraseData) {
+    ProtoOutputStream proto;
+    StorageManager::appendConfigMetricsReport(fixture.key, &proto, eraseData, /* isAdb */ true);
+    return proto.size();
+}
+
+void setCounters(benchmark::State& state, size_t bytes) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    state.counters["bytes"] = bytes;
+    state.counters["peak_rss_kb"] = usage.ru_maxrss;
+}
+
+void addArgs(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"uids"})->Arg(1000)->Arg(5000)->Unit(benchmark::kMillisecond);
+}
+
+}  // anonymous namespace
+
+// Dumps and erases a report of kNumBuckets buckets.
+static void BM_PersistenceDumpReport(benchmark::State& state) {
+    PersistenceFixture fixture = createFixture(state.range(0));
+    size_t bytes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        const int64_t dumpTimeNs = fillBuckets(&fixture) + 1;
+        state.ResumeTiming();
+
+        vector<uint8_t> buffer;
+        fixture.processor->onDumpReport(fixture.key, dumpTimeNs,
+                                        /* include_current_partial_bucket */ false,
+                                        /* erase_data */ true, ADB_DUMP, FAST, &buffer);
+        bytes = buffer.size();
+    }
+    setCounters(state, bytes);
+}
+BENCHMARK(BM_PersistenceDumpReport)->Apply(addArgs);
+
+// Writes a report of kNumBuckets buckets to disk, including the time to write the file.
+static void BM_PersistenceWriteDataToDisk(benchmark::State& state) {
+    PersistenceFixture fixture = createFixture(state.range(0));
+    size_t bytes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        const int64_t writeTimeNs = fillBuckets(&fixture) + 1;
+        state.ResumeTiming();
+
+        // The buckets of an iteration span hours, so writes are never within the cool down.
+        fixture.processor->WriteDataToDisk(DEVICE_SHUTDOWN, NO_TIME_CONSTRAINTS, writeTimeNs,
+                                           getWallClockNs());
+        StorageManager::waitForPendingWrites();
+
+        state.PauseTiming();
+        bytes = readReportsFromDisk(fixture, /* eraseData */ true);
+        state.ResumeTiming();
+    }
+    setCounters(state, bytes);
+}
+BENCHMARK(BM_PersistenceWriteDataToDisk)->Apply(addArgs);
+
+// Reads a report of kNumBuckets buckets back from disk.
+static void BM_PersistenceReadReportFromDisk(benchmark::State& state) {
+    PersistenceFixture fixture = createFixture(state.range(0));
+    fixture.processor->WriteDataToDisk(DEVICE_SHUTDOWN, NO_TIME_CONSTRAINTS,
+                                       fillBuckets(&fixture) + 1, getWallClockNs());
+    StorageManager::waitForPendingWrites();
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        bytes = readReportsFromDisk(fixture, /* eraseData */ false);
+    }
+    readReportsFromDisk(fixture, /* eraseData */ true);
+    setCounters(state, bytes);
+}
+BENCHMARK(BM_PersistenceReadReportFromDisk)->Apply(addArgs);
+
+// Encodes a uid map with one package per uid, as it is added to every report.
+static void BM_PersistenceAppendUidMap(benchmark::State& state) {
+    const int numApps = state.range(0);
+    sp<UidMap> uidMap = new UidMap();
+    UidData uidData;
+    for (int i = 0; i < numApps; i++) {
+        *uidData.add_app_info() = createApplicationInfo(/* uid */ 10000 + i, /* version */ i,
+                                                        "v" + std::to_string(i),
+                                                        "com.example.app" + std::to_string(i));
+    }
+    uidMap->updateMap(1 /* timestamp */, uidData);
+
+    const ConfigKey key(0, 12345);
+    int64_t timestampNs = 2;
+    size_t bytes = 0;
+    for (auto _ : state) {
+        ProtoOutputStream proto;
+        uidMap->appendUidMap(timestampNs++, key, /* includeVersionStrings */ true,
+                             /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0,
+                             /* str_set */ nullptr, &proto);
+        bytes = proto.size();
+    }
+    setCounters(state, bytes);
+}
+BENCHMARK(BM_PersistenceAppendUidMap)->Arg(100)->Arg(1000)->Arg(5000);
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
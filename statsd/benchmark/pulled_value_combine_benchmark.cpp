@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <vector>
+
+#include "FieldValue.h"
+#include "benchmark/benchmark.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::vector;
+
+namespace {
+
+const int kValueFieldCount = 2;
+
+// Builds rows shaped like a cpu time per uid pull: a uid and two int64 times, with each uid
+// repeated rowsPerGroup times in a row.
+vector<vector<FieldValue>> createRows(int groupCount, int rowsPerGroup) {
+    vector<vector<FieldValue>> rows;
+    int pos1[] = {1, 0, 0};
+    int pos2[] = {2, 0, 0};
+    int pos3[] = {3, 0, 0};
+    for (int group = 0; group < groupCount; group++) {
+        for (int i = 0; i < rowsPerGroup; i++) {
+            rows.push_back({FieldValue(Field(10009, pos1, 0), Value((int32_t)(10000 + group))),
+                            FieldValue(Field(10009, pos2, 0), Value((int64_t)(group * 1000 + i))),
+                            FieldValue(Field(10009, pos3, 0), Value((int64_t)(group + i)))});
+        }
+    }
+    return rows;
+}
+
+}  // anonymous namespace
+
+// Sums the value fields of the rows of each group as NumericValueMetricProducer::accumulateEvents
+// does for diffed pulls: the first row of the group is copied, and the values of the later rows
+// are added to it one Value at a time.
+static void BM_CombinePulledValues(benchmark::State& state) {
+    const int groupCount = state.range(0);
+    const int rowsPerGroup = state.range(1);
+    const vector<vector<FieldValue>> rows = createRows(groupCount, rowsPerGroup);
+    const vector<int> valueIndices = {1, 2};
+    while (state.KeepRunning()) {
+        vector<vector<FieldValue>> sums;
+        sums.reserve(groupCount);
+        for (size_t row = 0; row < rows.size(); row++) {
+            if (row % rowsPerGroup == 0) {
+                sums.push_back(rows[row]);
+                continue;
+            }
+            for (int i = 0; i < kValueFieldCount; i++) {
+                sums.back()[valueIndices[i]].mValue += rows[row][valueIndices[i]].mValue;
+            }
+        }
+        benchmark::DoNotOptimize(sums);
+    }
+}
+BENCHMARK(BM_CombinePulledValues)->Args({1, 1000})->Args({100, 10})->Args({1000, 1});
+
+}  //  namespace statsd
+}  //  namespace os
+}  //  namespace android
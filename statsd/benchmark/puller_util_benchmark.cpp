@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "external/puller_util.h"
+#include "logd/LogEvent.h"
+#include "packages/UidMap.h"
+#include "tests/statsd_test_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::shared_ptr;
+using std::vector;
+
+namespace {
+
+const int kAtomId = 10000;
+const vector<int> kAdditiveFields = {3};
+
+// A per-uid pull from hostCount apps that each run isolatedPerHost isolated processes, with one
+// row for the app itself and one for each of its isolated processes.
+vector<shared_ptr<LogEvent>> createPulledData(const sp<UidMap>& uidMap, int hostCount,
+                                              int isolatedPerHost) {
+    vector<shared_ptr<LogEvent>> data;
+    for (int host = 0; host < hostCount; host++) {
+        const int hostUid = 10000 + host;
+        data.push_back(makeUidLogEvent(kAtomId, /*eventTimeNs=*/1, hostUid, /*data1=*/host,
+                                       /*data2=*/1));
+        for (int i = 0; i < isolatedPerHost; i++) {
+            const int isolatedUid = 90000 + host * isolatedPerHost + i;
+            uidMap->assignIsolatedUid(isolatedUid, hostUid);
+            data.push_back(makeUidLogEvent(kAtomId, /*eventTimeNs=*/1, isolatedUid,
+                                           /*data1=*/host, /*data2=*/1));
+        }
+    }
+    return data;
+}
+
+}  // anonymous namespace
+
+static void BM_MapAndMergeIsolatedUids(benchmark::State& state) {
+    const sp<UidMap> uidMap = new UidMap();
+    const vector<shared_ptr<LogEvent>> pulledData =
+            createPulledData(uidMap, state.range(0), state.range(1));
+    for (auto s : state) {
+        state.PauseTiming();
+        vector<shared_ptr<LogEvent>> data;
+        data.reserve(pulledData.size());
+        for (const shared_ptr<LogEvent>& event : pulledData) {
+            data.push_back(std::make_shared<LogEvent>(*event));
+        }
+        state.ResumeTiming();
+        mapAndMergeIsolatedUidsToHostUid(data, uidMap, kAtomId, kAdditiveFields);
+        benchmark::DoNotOptimize(data);
+    }
+}
+BENCHMARK(BM_MapAndMergeIsolatedUids)->Args({1000, 0})->Args({200, 4})->Args({50, 20});
+
+}  //  namespace statsd
+}  //  namespace os
+}  //  namespace android
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "benchmark/benchmark.h"
+#include "logd/LogEventPool.h"
+#include "socket/DatagramRecorder.h"
+#include "socket/StatsSocketListener.h"
+#include "tests/statsd_test_util.h"
+
+using namespace std;
+using android::base::unique_fd;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// Feeds a recorded datagram to the socket listener as if it was just received.
+void replayDatagram(const DatagramRecord& record, const shared_ptr<LogEventFilter>& filter,
+                    vector<unique_ptr<LogEvent>>& events) {
+    // processDatagram() null terminates the datagram.
+    vector<uint8_t> buffer(record.datagram.size() + 1);
+    copy(record.datagram.begin(), record.datagram.end(), buffer.begin());
+
+    uint8_t control[CMSG_SPACE(sizeof(struct ucred))] = {};
+    struct msghdr hdr = {};
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_CREDENTIALS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+    struct ucred cred = {(pid_t)record.pid, (uid_t)record.uid, /*gid=*/0};
+    memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+
+    StatsSocketListener::processDatagram(buffer.data(), record.datagram.size(), &hdr, filter,
+                                         events);
+}
+
+namespace {
+
+bool readConfigs(const string& paths, vector<StatsdConfig>* configs) {
+    for (const string& path : android::base::Split(paths, ":")) {
+        string content;
+        if (!android::base::ReadFileToString(path, &content)) {
+            return false;
+        }
+        StatsdConfig config;
+        if (!config.ParseFromString(content)) {
+            return false;
+        }
+        configs->push_back(config);
+    }
+    return !configs->empty();
+}
+
+int64_t getPercentile(vector<int64_t>& latenciesNs, double percentile) {
+    const size_t index = min(latenciesNs.size() - 1, (size_t)(latenciesNs.size() * percentile));
+    nth_element(latenciesNs.begin(), latenciesNs.begin() + index, latenciesNs.end());
+    return latenciesNs[index];
+}
+
+}  // anonymous namespace
+
+// Replays a trace of real atom traffic through the socket listener and the processor, with real
+// configs. STATSD_REPLAY_TRACE is a trace written by adb exec-out cmd stats record-datagrams and
+// STATSD_REPLAY_CONFIGS a colon separated list of files with binary StatsdConfig protos.
+//
+// The events of a batched datagram share the latency of the datagram evenly.
+static void BM_ReplayTrace(benchmark::State& state) {
+    const char* tracePath = getenv("STATSD_REPLAY_TRACE");
+    const char* configPaths = getenv("STATSD_REPLAY_CONFIGS");
+    if (tracePath == nullptr || configPaths == nullptr) {
+        state.SkipWithError("STATSD_REPLAY_TRACE and STATSD_REPLAY_CONFIGS are not set");
+        return;
+    }
+
+    vector<DatagramRecord> records;
+    unique_fd traceFd(open(tracePath, O_RDONLY | O_CLOEXEC));
+    if (traceFd.get() < 0 || !DatagramRecorder::readTrace(traceFd.get(), &records) ||
+        records.empty()) {
+        state.SkipWithError("Failed to read STATSD_REPLAY_TRACE");
+        return;
+    }
+    vector<StatsdConfig> configs;
+    if (!readConfigs(configPaths, &configs)) {
+        state.SkipWithError("Failed to read STATSD_REPLAY_CONFIGS");
+        return;
+    }
+
+    // Buckets start before the first recorded event.
+    const int64_t timeBaseNs = records.front().elapsedTimestampNs - NS_PER_SEC;
+    vector<int64_t> latenciesNs;
+    int64_t eventCount = 0;
+    vector<unique_ptr<LogEvent>> events;
+    for (auto _ : state) {
+        state.PauseTiming();
+        shared_ptr<LogEventFilter> filter = make_shared<LogEventFilter>();
+        sp<StatsLogProcessor> processor =
+                CreateStatsLogProcessor(timeBaseNs, timeBaseNs, configs[0], ConfigKey(1000, 0),
+                                        nullptr, 0, new UidMap(), filter);
+        for (size_t i = 1; i < configs.size(); i++) {
+            processor->OnConfigUpdated(timeBaseNs, ConfigKey(1000, i), configs[i]);
+        }
+        state.ResumeTiming();
+
+        for (const DatagramRecord& record : records) {
+            const int64_t startNs = getElapsedRealtimeNs();
+            replayDatagram(record, filter, events);
+            processor->OnLogEvents(events);
+            const int64_t latencyNs = getElapsedRealtimeNs() - startNs;
+            for (size_t i = 0; i < events.size(); i++) {
+                latenciesNs.push_back(latencyNs / events.size());
+            }
+            eventCount += events.size();
+            LogEventPool::getInstance().recycle(events);
+        }
+
+        state.PauseTiming();
+        processor.clear();
+        state.ResumeTiming();
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    state.counters["events_per_sec"] = benchmark::Counter(eventCount, benchmark::Counter::kIsRate);
+    if (!latenciesNs.empty()) {
+        state.counters["p50_ns"] = getPercentile(latenciesNs, 0.5);
+        state.counters["p99_ns"] = getPercentile(latenciesNs, 0.99);
+    }
+    state.counters["peak_rss_kb"] = usage.ru_maxrss;
+}
+BENCHMARK(BM_ReplayTrace)->Unit(benchmark::kMillisecond);
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
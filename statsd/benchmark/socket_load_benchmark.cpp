@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <statslog_statsdtest.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/stats_log.pb.h"
+#include "stats_log_util.h"
+
+using namespace std;
+using android::base::unique_fd;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+struct LoadResult {
+    int64_t writes = 0;
+    int64_t writeErrors = 0;
+};
+
+// The statsd side of the load, read from the StatsdStatsReport of the live statsd.
+struct StatsdLoadStats {
+    int64_t socketLosses = 0;
+    int64_t queueOverflows = 0;
+    int64_t queueHighWaterMark = 0;
+};
+
+bool readStatsdLoadStats(StatsdLoadStats* stats) {
+    FILE* pipe = popen("dumpsys stats --metadata --proto", "re");
+    if (pipe == nullptr) {
+        return false;
+    }
+    string output;
+    const bool readOk = android::base::ReadFdToString(fileno(pipe), &output);
+    if (pclose(pipe) != 0 || !readOk) {
+        return false;
+    }
+    StatsdStatsReport report;
+    if (!report.ParseFromString(output)) {
+        return false;
+    }
+
+    // Losses reported by the loggers through STATS_SOCKET_LOSS_REPORTED.
+    const int32_t uid = getuid();
+    for (const auto& lossStats : report.socket_loss_stats().loss_stats_per_uid()) {
+        if (lossStats.uid() != uid) {
+            continue;
+        }
+        for (const auto& atomLossStats : lossStats.atom_id_loss_stats()) {
+            stats->socketLosses += atomLossStats.count();
+        }
+    }
+    stats->queueOverflows = report.queue_overflow().count();
+    stats->queueHighWaterMark = report.event_queue_stats().max_size_observed();
+    return true;
+}
+
+// Logs for durationNs at eventsPerSec, or as fast as possible if it is 0. queuedPercent of the
+// atoms are APP_BREADCRUMB_REPORTED, which libstatssocket writes through its queue, and the rest
+// are written to the socket directly.
+void runLoadThread(int64_t durationNs, int64_t eventsPerSec, int queuedPercent,
+                   LoadResult* result) {
+    std::minstd_rand random(gettid());
+    std::uniform_int_distribution<int> percent(1, 100);
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + std::chrono::nanoseconds(durationNs);
+    const auto interval = std::chrono::nanoseconds(eventsPerSec > 0 ? NS_PER_SEC / eventsPerSec
+                                                                    : 0);
+    auto next = start;
+    int32_t value = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        const int ret = percent(random) <= queuedPercent
+                                ? util::stats_write(util::APP_BREADCRUMB_REPORTED, /*uid=*/0,
+                                                    /*label=*/100, value++)
+                                : util::stats_write(util::ISOLATED_UID_CHANGED, /*parent_uid=*/0,
+                                                    /*isolated_uid=*/100, value++);
+        if (ret < 0) {
+            result->writeErrors++;
+        } else {
+            result->writes++;
+        }
+        if (eventsPerSec > 0) {
+            next += interval;
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+// Runs the threads of one logging process and writes their summed result to fd.
+void runLoadProcess(int fd, int numThreads, int64_t durationNs, int64_t eventsPerSec,
+                    int queuedPercent) {
+    vector<LoadResult> results(numThreads);
+    vector<std::thread> threads;
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back(runLoadThread, durationNs, eventsPerSec, queuedPercent, &results[i]);
+    }
+    LoadResult total;
+    for (int i = 0; i < numThreads; i++) {
+        threads[i].join();
+        total.writes += results[i].writes;
+        total.writeErrors += results[i].writeErrors;
+    }
+    android::base::WriteFully(fd, &total, sizeof(total));
+}
+
+}  // anonymous namespace
+
+// Logs through libstatssocket to the live statsd from several processes and threads, to size the
+// LogEventQueue and the socket buffer. The arguments are the number of processes, the threads
+// per process, the events per second of each thread (0 for as fast as possible) and the percent
+// of atoms written through the libstatssocket queue. Each run lasts STATSD_LOAD_DURATION_SEC
+// seconds, 10 by default.
+//
+// socket_losses and queue_overflows are the loss reports and the LogEventQueue overflows statsd
+// counted during the run. queue_high_water_mark is the largest LogEventQueue size statsd has
+// observed since its stats were last reset. They are only reported if the benchmark may dump the
+// stats of statsd, e.g. when run as root.
+static void BM_SocketLoad(benchmark::State& state) {
+    const int numProcesses = state.range(0);
+    const int numThreads = state.range(1);
+    const int64_t eventsPerSec = state.range(2);
+    const int queuedPercent = state.range(3);
+    const char* durationEnv = getenv("STATSD_LOAD_DURATION_SEC");
+    const int64_t durationNs = (durationEnv != nullptr ? atoll(durationEnv) : 10) * NS_PER_SEC;
+
+    StatsdLoadStats statsBefore;
+    const bool hasStatsdStats = readStatsdLoadStats(&statsBefore);
+    LoadResult total;
+    for (auto _ : state) {
+        vector<pid_t> pids;
+        vector<unique_fd> resultFds;
+        for (int i = 0; i < numProcesses; i++) {
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) != 0) {
+                state.SkipWithError("Failed to create a pipe");
+                return;
+            }
+            const pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                runLoadProcess(fds[1], numThreads, durationNs, eventsPerSec, queuedPercent);
+                _exit(0);
+            }
+            close(fds[1]);
+            if (pid < 0) {
+                close(fds[0]);
+                state.SkipWithError("Failed to fork a logging process");
+                return;
+            }
+            pids.push_back(pid);
+            resultFds.emplace_back(fds[0]);
+        }
+        for (size_t i = 0; i < pids.size(); i++) {
+            LoadResult result;
+            if (android::base::ReadFully(resultFds[i].get(), &result, sizeof(result))) {
+                total.writes += result.writes;
+                total.writeErrors += result.writeErrors;
+            }
+            waitpid(pids[i], nullptr, 0);
+        }
+    }
+
+    state.counters["writes_per_sec"] =
+            benchmark::Counter(total.writes, benchmark::Counter::kIsRate);
+    state.counters["write_errors"] = total.writeErrors;
+    StatsdLoadStats statsAfter;
+    // Statsd reports the losses a bit after they happen.
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (hasStatsdStats && readStatsdLoadStats(&statsAfter)) {
+        state.counters["socket_losses"] = statsAfter.socketLosses - statsBefore.socketLosses;
+        state.counters["queue_overflows"] = statsAfter.queueOverflows - statsBefore.queueOverflows;
+        state.counters["queue_high_water_mark"] = statsAfter.queueHighWaterMark;
+    }
+}
+BENCHMARK(BM_SocketLoad)
+        ->Args({1, 1, 0, 0})
+        ->Args({4, 4, 0, 0})
+        ->Args({8, 4, 1000, 0})
+        ->Args({8, 4, 1000, 50})
+        ->Args({16, 8, 0, 10})
+        ->Iterations(1)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
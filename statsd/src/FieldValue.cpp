@@ -19,6 +19,8 @@
 
 #include "FieldValue.h"
 
+#include <string.h>
+
 #include "HashableDimensionKey.h"
 #include "hash.h"
 #include "math.h"
@@ -144,7 +146,41 @@ bool isPrimitiveRepeatedField(const Field& field) {
     return field.getDepth() == 1;
 }
 
-Value::Value(const Value& from) {
+Value::Value(const Value& from) : type(from.getType()) {
+    constructFrom(from);
+}
+
+Value::Value(Value&& from) noexcept : type(from.getType()) {
+    constructFrom(std::move(from));
+}
+
+void Value::constructFrom(const Value& from) {
+    type = from.getType();
+    switch (type) {
+        case INT:
+            int_value = from.int_value;
+            break;
+        case LONG:
+            long_value = from.long_value;
+            break;
+        case FLOAT:
+            float_value = from.float_value;
+            break;
+        case DOUBLE:
+            double_value = from.double_value;
+            break;
+        case STRING:
+            new (&str_value) InternedString(from.str_value);
+            break;
+        case STORAGE:
+            new (&storage_value) std::vector<uint8_t>(from.storage_value);
+            break;
+        default:
+            break;
+    }
+}
+
+void Value::constructFrom(Value&& from) {
     type = from.getType();
     switch (type) {
         case INT:
@@ -160,10 +196,10 @@ Value::Value(const Value& from) {
             double_value = from.double_value;
             break;
         case STRING:
-            str_value = from.str_value;
+            new (&str_value) InternedString(std::move(from.str_value));
             break;
         case STORAGE:
-            storage_value = from.storage_value;
+            new (&storage_value) std::vector<uint8_t>(std::move(from.storage_value));
             break;
         default:
             break;
@@ -181,7 +217,7 @@ std::string Value::toString() const {
         case DOUBLE:
             return std::to_string(double_value) + "[D]";
         case STRING:
-            return str_value + "[S]";
+            return str_value.str() + "[S]";
         case STORAGE:
             return "bytes of size " + std::to_string(storage_value.size()) + "[ST]";
         default:
@@ -200,7 +236,7 @@ bool Value::isZero() const {
         case DOUBLE:
             return fabs(double_value) <= std::numeric_limits<double>::epsilon();
         case STRING:
-            return str_value.size() == 0;
+            return str_value.empty();
         case STORAGE:
             return storage_value.size() == 0;
         default:
@@ -349,28 +385,28 @@ Value Value::operator-(const Value& that) const {
 
 Value& Value::operator=(const Value& that) {
     if (this != &that) {
-        type = that.type;
-        switch (type) {
-            case INT:
-                int_value = that.int_value;
-                break;
-            case LONG:
-                long_value = that.long_value;
-                break;
-            case FLOAT:
-                float_value = that.float_value;
-                break;
-            case DOUBLE:
-                double_value = that.double_value;
-                break;
-            case STRING:
-                str_value = that.str_value;
-                break;
-            case STORAGE:
-                storage_value = that.storage_value;
-                break;
-            default:
-                break;
+        // Reuse the existing allocation when both sides hold the same container type.
+        if (type == STRING && that.type == STRING) {
+            str_value = that.str_value;
+        } else if (type == STORAGE && that.type == STORAGE) {
+            storage_value = that.storage_value;
+        } else {
+            destroyMembers();
+            constructFrom(that);
+        }
+    }
+    return *this;
+}
+
+Value& Value::operator=(Value&& that) noexcept {
+    if (this != &that) {
+        if (type == STRING && that.type == STRING) {
+            str_value = std::move(that.str_value);
+        } else if (type == STORAGE && that.type == STORAGE) {
+            storage_value = std::move(that.storage_value);
+        } else {
+            destroyMembers();
+            constructFrom(std::move(that));
         }
     }
     return *this;
@@ -559,6 +595,33 @@ size_t getSize(const std::vector<FieldValue>& fieldValues) {
     return totalSize;
 }
 
+uint64_t hashValue(const Value& value) {
+    switch (value.getType()) {
+        case INT:
+            return static_cast<uint32_t>(value.int_value);
+        case LONG:
+            return value.long_value;
+        case STRING:
+            // Interned strings carry their hash, so the string bytes are not rehashed.
+            return value.str_value.hash();
+        case FLOAT: {
+            uint32_t bits;
+            memcpy(&bits, &value.float_value, sizeof(bits));
+            return bits;
+        }
+        case DOUBLE: {
+            uint64_t bits;
+            memcpy(&bits, &value.double_value, sizeof(bits));
+            return bits;
+        }
+        case STORAGE:
+            return FastHash64(reinterpret_cast<const char*>(value.storage_value.data()),
+                              value.storage_value.size());
+        default:
+            return 0;
+    }
+}
+
 bool shouldKeepSample(const FieldValue& sampleFieldValue, int shardOffset, int shardCount) {
     int hashValue = 0;
     switch (sampleFieldValue.mValue.type) {
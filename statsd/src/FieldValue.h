@@ -16,6 +16,7 @@
 #pragma once
 
 #include "src/statsd_config.pb.h"
+#include "utils/StringPool.h"
 
 namespace android {
 namespace os {
@@ -278,56 +279,57 @@ inline Matcher getFirstUidMatcher(int32_t atomId) {
 /**
  * A wrapper for a union type to contain multiple types of values.
  *
+ * The string and storage members share the union with the numeric members, so a numeric Value
+ * does not carry empty containers, and copying or moving it is a plain copy of the union. Only
+ * the member matching type is alive; str_value and storage_value must only be accessed when
+ * type is STRING and STORAGE respectively. Strings are interned in StringPool, so copying a string
+ * Value and comparing two of them for equality does not touch the string bytes.
  */
 struct Value {
     Value() : type(UNKNOWN) {}
 
-    Value(int32_t v) {
-        int_value = v;
-        type = INT;
-    }
+    Value(int32_t v) : int_value(v), type(INT) {}
 
-    Value(int64_t v) {
-        long_value = v;
-        type = LONG;
-    }
+    Value(int64_t v) : long_value(v), type(LONG) {}
 
-    Value(float v) {
-        float_value = v;
-        type = FLOAT;
-    }
+    Value(float v) : float_value(v), type(FLOAT) {}
 
-    Value(double v) {
-        double_value = v;
-        type = DOUBLE;
-    }
+    Value(double v) : double_value(v), type(DOUBLE) {}
 
-    Value(const std::string& v) {
-        str_value = v;
-        type = STRING;
-    }
+    Value(const std::string& v) : str_value(v), type(STRING) {}
+
+    Value(const InternedString& v) : str_value(v), type(STRING) {}
+
+    Value(InternedString&& v) : str_value(std::move(v)), type(STRING) {}
 
-    Value(const std::vector<uint8_t>& v) {
-        storage_value = v;
-        type = STORAGE;
+    Value(const std::vector<uint8_t>& v) : storage_value(v), type(STORAGE) {}
+
+    Value(std::vector<uint8_t>&& v) : storage_value(std::move(v)), type(STORAGE) {}
+
+    ~Value() {
+        destroyMembers();
     }
 
     void setInt(int32_t v) {
+        destroyMembers();
         int_value = v;
         type = INT;
     }
 
     void setLong(int64_t v) {
+        destroyMembers();
         long_value = v;
         type = LONG;
     }
 
     void setFloat(float v) {
+        destroyMembers();
         float_value = v;
         type = FLOAT;
     }
 
     void setDouble(double v) {
+        destroyMembers();
         double_value = v;
         type = DOUBLE;
     }
@@ -337,9 +339,9 @@ struct Value {
         int64_t long_value;
         float float_value;
         double double_value;
+        InternedString str_value;
+        std::vector<uint8_t> storage_value;
     };
-    std::string str_value;
-    std::vector<uint8_t> storage_value;
 
     Type type;
 
@@ -356,6 +358,7 @@ struct Value {
     size_t getSize() const;
 
     Value(const Value& from);
+    Value(Value&& from) noexcept;
 
     bool operator==(const Value& that) const;
     bool operator!=(const Value& that) const;
@@ -366,6 +369,23 @@ struct Value {
     Value operator-(const Value& that) const;
     Value& operator+=(const Value& that);
     Value& operator=(const Value& that);
+    Value& operator=(Value&& that) noexcept;
+
+private:
+    // Ends the lifetime of the string or storage member if it is the active one. type is left
+    // unchanged, callers are expected to set it right after.
+    void destroyMembers() {
+        if (type == STRING) {
+            str_value.~InternedString();
+        } else if (type == STORAGE) {
+            storage_value.~vector();
+        }
+    }
+
+    // Copies or moves the active member of from into this. Any previously active string or
+    // storage member must have been destroyed.
+    void constructFrom(const Value& from);
+    void constructFrom(Value&& from);
 };
 
 class Annotations {
@@ -483,6 +503,10 @@ size_t getSize(const std::vector<FieldValue>& fieldValues);
 
 bool shouldKeepSample(const FieldValue& sampleFieldValue, int shardOffset, int shardCount);
 
+// 64 bit hash of a value, without its type or field. Hashes of dimension keys are combined from
+// these, see DimensionKeyHasher. Like StreamingHash64, they must not be persisted or reported.
+uint64_t hashValue(const Value& value);
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
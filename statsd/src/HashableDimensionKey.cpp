@@ -17,7 +17,11 @@
 #include "Log.h"
 
 #include "HashableDimensionKey.h"
+
+#include <algorithm>
+
 #include "FieldValue.h"
+#include "hash.h"
 
 namespace android {
 namespace os {
@@ -112,44 +116,17 @@ StatsDimensionsValueParcel HashableDimensionKey::toStatsDimensionsValueParcel()
 }
 
 android::hash_t hashDimension(const HashableDimensionKey& value) {
-    android::hash_t hash = 0;
-    for (const auto& fieldValue : value.getValues()) {
-        hash = android::JenkinsHashMix(hash, android::hash_type((int)fieldValue.mField.getField()));
-        hash = android::JenkinsHashMix(hash, android::hash_type((int)fieldValue.mField.getTag()));
-        hash = android::JenkinsHashMix(hash, android::hash_type((int)fieldValue.mValue.getType()));
-        switch (fieldValue.mValue.getType()) {
-            case INT:
-                hash = android::JenkinsHashMix(hash,
-                                               android::hash_type(fieldValue.mValue.int_value));
-                break;
-            case LONG:
-                hash = android::JenkinsHashMix(hash,
-                                               android::hash_type(fieldValue.mValue.long_value));
-                break;
-            case STRING:
-                hash = android::JenkinsHashMix(hash, static_cast<uint32_t>(std::hash<std::string>()(
-                                                             fieldValue.mValue.str_value)));
-                break;
-            case FLOAT: {
-                hash = android::JenkinsHashMix(hash,
-                                               android::hash_type(fieldValue.mValue.float_value));
-                break;
-            }
-            case DOUBLE: {
-                hash = android::JenkinsHashMix(hash,
-                                               android::hash_type(fieldValue.mValue.double_value));
-                break;
-            }
-            case STORAGE: {
-                hash = android::JenkinsHashMixBytes(hash, fieldValue.mValue.storage_value.data(),
-                                                    fieldValue.mValue.storage_value.size());
-                break;
-            }
-            default:
-                break;
-        }
+    return value.getHash();
+}
+
+android::hash_t HashableDimensionKey::hashValues(const vector<FieldValue>& values) {
+    // The type is left out: a field of an atom always has the same type, and values of different
+    // types don't compare equal anyway.
+    DimensionKeyHasher hasher;
+    for (const auto& fieldValue : values) {
+        hasher.add(fieldValue.mField, hashValue(fieldValue.mValue));
     }
-    return JenkinsHashWhiten(hash);
+    return hasher.hash();
 }
 
 bool filterValues(const Matcher& matcherField, const vector<FieldValue>& values,
@@ -166,38 +143,57 @@ bool filterValues(const Matcher& matcherField, const vector<FieldValue>& values,
     return false;
 }
 
-bool filterValues(const vector<Matcher>& matcherFields, const vector<FieldValue>& values,
-                  HashableDimensionKey* output) {
+namespace {
+
+// Appends value to key with the position bits of matcher masked out, and feeds it to hasher if
+// valueHashes holds the value hashes of the values.
+inline void addMatchedValue(const FieldValue& value, const Matcher& matcher,
+                            const vector<uint64_t>* valueHashes, size_t valueIndex,
+                            DimensionKeyHasher* hasher, HashableDimensionKey* key) {
+    FieldValue matched = value;
+    matched.mField.setField(value.mField.getField() & matcher.mMask);
+    if (valueHashes != nullptr) {
+        hasher->add(matched.mField, (*valueHashes)[valueIndex]);
+    }
+    key->addValue(matched);
+}
+
+bool filterDimensionValues(const vector<Matcher>& matcherFields, const vector<FieldValue>& values,
+                           const vector<uint64_t>* valueHashes, HashableDimensionKey* output) {
+    if (!output->getValues().empty()) {
+        valueHashes = nullptr;
+    }
+    DimensionKeyHasher hasher;
     size_t num_matches = 0;
-    for (const auto& value : values) {
-        for (size_t i = 0; i < matcherFields.size(); ++i) {
-            const auto& matcher = matcherFields[i];
-            if (value.mField.matches(matcher)) {
-                output->addValue(value);
-                output->mutableValue(num_matches)->mField.setTag(value.mField.getTag());
-                output->mutableValue(num_matches)->mField.setField(
-                    value.mField.getField() & matcher.mMask);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (const auto& matcher : matcherFields) {
+            if (values[i].mField.matches(matcher)) {
+                addMatchedValue(values[i], matcher, valueHashes, i, &hasher, output);
                 num_matches++;
             }
         }
     }
+    if (valueHashes != nullptr) {
+        output->setHash(hasher.hash());
+    }
     return num_matches > 0;
 }
 
-bool filterValues(const vector<Matcher>& dimKeyMatcherFields,
-                  const vector<Matcher>& valueMatcherFields, const vector<FieldValue>& values,
-                  HashableDimensionKey& key, vector<int>& valueIndices) {
-    size_t key_num_matches = 0;
+bool filterDimensionAndValueIndices(const vector<Matcher>& dimKeyMatcherFields,
+                                    const vector<Matcher>& valueMatcherFields,
+                                    const vector<FieldValue>& values,
+                                    const vector<uint64_t>* valueHashes,
+                                    HashableDimensionKey& key, vector<int>& valueIndices) {
+    if (!key.getValues().empty()) {
+        valueHashes = nullptr;
+    }
+    DimensionKeyHasher hasher;
     size_t value_num_matches = 0;
     for (size_t i = 0; i < values.size(); ++i) {
         const FieldValue& value = values[i];
         for (const auto& matcher : dimKeyMatcherFields) {
             if (value.mField.matches(matcher)) {
-                key.addValue(value);
-                key.mutableValue(key_num_matches)->mField.setTag(value.mField.getTag());
-                key.mutableValue(key_num_matches)
-                        ->mField.setField(value.mField.getField() & matcher.mMask);
-                key_num_matches++;
+                addMatchedValue(value, matcher, valueHashes, i, &hasher, &key);
             }
         }
         for (size_t j = 0; j < valueMatcherFields.size(); ++j) {
@@ -207,9 +203,52 @@ bool filterValues(const vector<Matcher>& dimKeyMatcherFields,
             }
         }
     }
+    if (valueHashes != nullptr) {
+        key.setHash(hasher.hash());
+    }
     return value_num_matches == valueMatcherFields.size();
 }
 
+}  // namespace
+
+bool filterValues(const vector<Matcher>& matcherFields, const vector<FieldValue>& values,
+                  HashableDimensionKey* output) {
+    return filterDimensionValues(matcherFields, values, /*valueHashes=*/nullptr, output);
+}
+
+bool filterValues(const vector<Matcher>& matcherFields, const LogEvent& event,
+                  HashableDimensionKey* output) {
+    return filterDimensionValues(matcherFields, event.getValues(), &event.getValueHashes(),
+                                 output);
+}
+
+bool filterValues(const vector<Matcher>& dimKeyMatcherFields,
+                  const vector<Matcher>& valueMatcherFields, const vector<FieldValue>& values,
+                  HashableDimensionKey& key, vector<int>& valueIndices) {
+    return filterDimensionAndValueIndices(dimKeyMatcherFields, valueMatcherFields, values,
+                                          /*valueHashes=*/nullptr, key, valueIndices);
+}
+
+bool filterValues(const vector<Matcher>& dimKeyMatcherFields,
+                  const vector<Matcher>& valueMatcherFields, const LogEvent& event,
+                  HashableDimensionKey& key, vector<int>& valueIndices) {
+    return filterDimensionAndValueIndices(dimKeyMatcherFields, valueMatcherFields,
+                                          event.getValues(), &event.getValueHashes(), key,
+                                          valueIndices);
+}
+
+HashableDimensionKey getAtomFieldValues(const LogEvent& event) {
+    const vector<FieldValue>& values = event.getValues();
+    const vector<uint64_t>& valueHashes = event.getValueHashes();
+    DimensionKeyHasher hasher;
+    for (size_t i = 0; i < values.size(); i++) {
+        hasher.add(values[i].mField, valueHashes[i]);
+    }
+    HashableDimensionKey key(values);
+    key.setHash(hasher.hash());
+    return key;
+}
+
 bool filterPrimaryKey(const std::vector<FieldValue>& values, HashableDimensionKey* output) {
     size_t num_matches = 0;
     const int32_t simpleFieldMask = 0xff7f0000;
@@ -238,9 +277,83 @@ void filterGaugeValues(const std::vector<Matcher>& matcherFields,
     }
 }
 
+namespace {
+
+// The matcher mask of a top-level field, without position.
+const int32_t kTopLevelFieldMask = static_cast<int32_t>(0xff7f0000);
+
+// Builds the linked key of a position list projection. Returns false, leaving output empty, if
+// the event lacks one of the fields.
+bool projectPositions(const LinkProjection& projection, const vector<FieldValue>& eventValues,
+                      HashableDimensionKey* output) {
+    size_t index = 0;
+    for (size_t i = 0; i < projection.positions.size(); i++) {
+        const Field field(projection.atomTag, getSimpleField(projection.positions[i]));
+        // In atoms without repeated fields, a top-level field is at its position minus one, and
+        // repeated fields before it only move it further on.
+        index = std::max(index, static_cast<size_t>(projection.positions[i] - 1));
+        while (index < eventValues.size() && eventValues[index].mField != field) {
+            index++;
+        }
+        if (index == eventValues.size()) {
+            // Empty repeated fields or missing fields before it moved it back instead.
+            index = 0;
+            while (index < eventValues.size() && eventValues[index].mField != field) {
+                index++;
+            }
+        }
+        if (index == eventValues.size()) {
+            *output = HashableDimensionKey();
+            return false;
+        }
+        FieldValue linked = eventValues[index];
+        linked.mField = projection.linkedFields[i];
+        output->addValue(linked);
+        index++;
+    }
+    return true;
+}
+
+}  // namespace
+
+LinkProjection compileLinkProjection(const vector<Matcher>& metricFields,
+                                     const vector<Matcher>& linkedFields) {
+    LinkProjection projection;
+    if (metricFields.empty() || metricFields.size() != linkedFields.size()) {
+        return projection;
+    }
+    const int32_t atomTag = metricFields[0].mMatcher.getTag();
+    vector<int32_t> positions;
+    for (const Matcher& matcher : metricFields) {
+        const int32_t field = matcher.mMatcher.getField();
+        // A top-level field without position matches exactly one value, the one at its position.
+        if (matcher.mMatcher.getTag() != atomTag || matcher.mMask != kTopLevelFieldMask ||
+            matcher.mMatcher.getDepth() != 0 || (field & ~kTopLevelFieldMask) != 0) {
+            return projection;
+        }
+        positions.push_back(matcher.mMatcher.getPosAtDepth(0));
+    }
+    std::sort(positions.begin(), positions.end());
+    if (std::adjacent_find(positions.begin(), positions.end()) != positions.end()) {
+        return projection;
+    }
+    projection.isPositionList = true;
+    projection.atomTag = atomTag;
+    projection.positions = std::move(positions);
+    for (const Matcher& matcher : linkedFields) {
+        projection.linkedFields.push_back(matcher.mMatcher);
+    }
+    return projection;
+}
+
 void getDimensionForCondition(const std::vector<FieldValue>& eventValues,
                               const Metric2Condition& links,
                               HashableDimensionKey* conditionDimension) {
+    if (links.projection.isPositionList && conditionDimension->getValues().empty() &&
+        projectPositions(links.projection, eventValues, conditionDimension)) {
+        return;
+    }
+
     // Get the dimension first by using dimension from what.
     filterValues(links.metricFields, eventValues, conditionDimension);
 
@@ -257,8 +370,33 @@ void getDimensionForCondition(const std::vector<FieldValue>& eventValues,
     }
 }
 
+bool getLinkedConditionKey(const HashableDimensionKey& conditionKey, const Metric2Condition& links,
+                           HashableDimensionKey* linkedConditionKey) {
+    for (const Matcher& matcher : links.conditionFields) {
+        const Field& field = matcher.mMatcher;
+        bool found = false;
+        for (const FieldValue& value : conditionKey.getValues()) {
+            if (value.mField.getTag() == field.getTag() &&
+                value.mField.getField() == field.getField()) {
+                linkedConditionKey->addValue(value);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void getDimensionForState(const std::vector<FieldValue>& eventValues, const Metric2State& link,
                           HashableDimensionKey* statePrimaryKey) {
+    if (link.projection.isPositionList && statePrimaryKey->getValues().empty() &&
+        projectPositions(link.projection, eventValues, statePrimaryKey)) {
+        return;
+    }
+
     // First, get the dimension from the event using the "what" fields from the
     // MetricStateLinks.
     filterValues(link.metricFields, eventValues, statePrimaryKey);
@@ -370,6 +508,16 @@ bool HashableDimensionKey::contains(const HashableDimensionKey& that) const {
     return true;
 }
 
+size_t HashableDimensionKey::heapByteSize() const {
+    size_t bytes = mValues.capacity() * sizeof(FieldValue);
+    for (const auto& value : mValues) {
+        if (value.mValue.getType() == STORAGE) {
+            bytes += value.mValue.storage_value.capacity();
+        }
+    }
+    return bytes;
+}
+
 string HashableDimensionKey::toString() const {
     std::string output;
     for (const auto& value : mValues) {
@@ -18,9 +18,12 @@
 
 #include <aidl/android/os/StatsDimensionsValueParcel.h>
 #include <utils/JenkinsHash.h>
+
+#include <atomic>
 #include <vector>
 #include "android-base/stringprintf.h"
 #include "FieldValue.h"
+#include "hash.h"
 #include "logd/LogEvent.h"
 
 namespace android {
@@ -38,16 +41,33 @@ inline constexpr int STATS_DIMENSIONS_VALUE_LONG_TYPE = 4;
 inline constexpr int STATS_DIMENSIONS_VALUE_FLOAT_TYPE = 6;
 inline constexpr int STATS_DIMENSIONS_VALUE_TUPLE_TYPE = 7;
 
+// A metric link compiled by compileLinkProjection() at config init. When every metric field of
+// the link is a top-level field of the atom, building the linked key only takes looking up the
+// values at those positions; other links are left to the matchers.
+struct LinkProjection {
+    bool isPositionList = false;
+    int32_t atomTag = 0;
+    // The top-level positions of the metric fields in ascending order, i.e. in the order their
+    // values appear in an event, and the linked field each of them becomes.
+    std::vector<int32_t> positions;
+    std::vector<Field> linkedFields;
+};
+
+LinkProjection compileLinkProjection(const std::vector<Matcher>& metricFields,
+                                     const std::vector<Matcher>& linkedFields);
+
 struct Metric2Condition {
     int64_t conditionId;
     std::vector<Matcher> metricFields;
     std::vector<Matcher> conditionFields;
+    LinkProjection projection;
 };
 
 struct Metric2State {
     int32_t stateAtomId;
     std::vector<Matcher> metricFields;
     std::vector<Matcher> stateFields;
+    LinkProjection projection;
 };
 
 class HashableDimensionKey {
@@ -58,27 +78,74 @@ public:
 
     HashableDimensionKey() {};
 
-    HashableDimensionKey(const HashableDimensionKey& that) : mValues(that.getValues()){};
+    HashableDimensionKey(const HashableDimensionKey& that)
+        : mValues(that.getValues()),
+          mCachedHash(that.mCachedHash.load(std::memory_order_relaxed)){};
+
+    HashableDimensionKey(HashableDimensionKey&& that) noexcept
+        : mValues(std::move(that.mValues)),
+          mCachedHash(that.mCachedHash.exchange(0, std::memory_order_relaxed)) {
+    }
+
+    HashableDimensionKey& operator=(const HashableDimensionKey& from) {
+        if (this != &from) {
+            mValues = from.mValues;
+            mCachedHash.store(from.mCachedHash.load(std::memory_order_relaxed),
+                              std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    HashableDimensionKey& operator=(HashableDimensionKey&& from) noexcept {
+        mValues = std::move(from.mValues);
+        mCachedHash.store(from.mCachedHash.exchange(0, std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+        return *this;
+    }
 
     inline void addValue(const FieldValue& value) {
         mValues.push_back(value);
+        invalidateHash();
     }
 
     inline const std::vector<FieldValue>& getValues() const {
         return mValues;
     }
 
+    // The mutators below drop the cached hash. Callers must not keep the returned pointers
+    // across a hash computation.
     inline std::vector<FieldValue>* mutableValues() {
+        invalidateHash();
         return &mValues;
     }
 
     inline FieldValue* mutableValue(size_t i) {
         if (i >= 0 && i < mValues.size()) {
+            invalidateHash();
             return &(mValues[i]);
         }
         return nullptr;
     }
 
+    // Hash of the values. Computed on first use and cached until the values are modified, so
+    // repeated map lookups with the same key don't rehash every FieldValue. Const keys shared
+    // between threads, such as DEFAULT_DIMENSION_KEY, may be hashed concurrently: every thread
+    // computes the same hash, and the cache is a single relaxed atomic word holding both the
+    // hash and whether it is set, so a thread never sees one without the other.
+    inline android::hash_t getHash() const {
+        uint64_t cachedHash = mCachedHash.load(std::memory_order_relaxed);
+        if (cachedHash == 0) {
+            cachedHash = toCachedHash(hashValues(mValues));
+            mCachedHash.store(cachedHash, std::memory_order_relaxed);
+        }
+        return static_cast<android::hash_t>(static_cast<uint32_t>(cachedHash));
+    }
+
+    // Sets the hash of the current values, as a DimensionKeyHasher fed with them computes it.
+    inline void setHash(android::hash_t hash) {
+        mCachedHash.store(toCachedHash(hash), std::memory_order_relaxed);
+    }
+
     StatsDimensionsValueParcel toStatsDimensionsValueParcel() const;
 
     std::string toString() const;
@@ -91,8 +158,47 @@ public:
 
     bool contains(const HashableDimensionKey& that) const;
 
+    // Heap bytes owned by the key: the values array and byte array values. Strings are interned
+    // and shared between keys, so they are not included.
+    size_t heapByteSize() const;
+
 private:
+    static android::hash_t hashValues(const std::vector<FieldValue>& values);
+
+    static constexpr uint64_t kHashSet = 1ULL << 32;
+
+    static inline uint64_t toCachedHash(android::hash_t hash) {
+        return kHashSet | static_cast<uint32_t>(hash);
+    }
+
+    inline void invalidateHash() {
+        mCachedHash.store(0, std::memory_order_relaxed);
+    }
+
     std::vector<FieldValue> mValues;
+
+    // kHashSet | the hash of mValues, or 0 if it is not computed yet.
+    mutable std::atomic<uint64_t> mCachedHash = 0;
+};
+
+// Combines the hashes of the values of a dimension key, in order, into the hash of the key. The
+// value hashes may come from LogEvent::getValueHashes(), so that building the hash of a key costs
+// a couple of multiplications per value.
+class DimensionKeyHasher {
+public:
+    inline void add(const Field& field, uint64_t valueHash) {
+        mHasher.add(static_cast<uint64_t>(static_cast<uint32_t>(field.getField())) << 32 |
+                    static_cast<uint32_t>(field.getTag()));
+        mHasher.add(valueHash);
+    }
+
+    inline android::hash_t hash() const {
+        const uint64_t hash = mHasher.hash();
+        return static_cast<android::hash_t>(hash ^ hash >> 32);
+    }
+
+private:
+    StreamingHash64 mHasher;
 };
 
 class MetricDimensionKey {
@@ -107,8 +213,12 @@ public:
         : mDimensionKeyInWhat(that.getDimensionKeyInWhat()),
           mStateValuesKey(that.getStateValuesKey()){};
 
+    MetricDimensionKey(MetricDimensionKey&& that) noexcept = default;
+
     MetricDimensionKey& operator=(const MetricDimensionKey& from) = default;
 
+    MetricDimensionKey& operator=(MetricDimensionKey&& from) noexcept = default;
+
     std::string toString() const;
 
     inline const HashableDimensionKey& getDimensionKeyInWhat() const {
@@ -131,6 +241,10 @@ public:
         return mStateValuesKey.getValues().size() > 0;
     }
 
+    inline size_t heapByteSize() const {
+        return mDimensionKeyInWhat.heapByteSize() + mStateValuesKey.heapByteSize();
+    }
+
     bool operator==(const MetricDimensionKey& that) const;
 
     bool operator<(const MetricDimensionKey& that) const;
@@ -185,6 +299,11 @@ bool filterValues(const Matcher& matcherField, const std::vector<FieldValue>& va
 bool filterValues(const std::vector<Matcher>& matcherFields, const std::vector<FieldValue>& values,
                   HashableDimensionKey* output);
 
+// Same as above, from the values of event. The hash of the key is combined from the value hashes
+// of the event when output starts empty.
+bool filterValues(const std::vector<Matcher>& matcherFields, const LogEvent& event,
+                  HashableDimensionKey* output);
+
 /**
  * Filters FieldValues to create HashableDimensionKey using dimensions matcher fields and create
  *  vector of value indices using values matcher fields.
@@ -207,6 +326,15 @@ bool filterValues(const std::vector<Matcher>& dimKeyMatcherFields,
                   const std::vector<FieldValue>& values, HashableDimensionKey& key,
                   std::vector<int>& valueIndices);
 
+// Same as above, from the values of event. The hash of key is combined from the value hashes of
+// the event when key starts empty.
+bool filterValues(const std::vector<Matcher>& dimKeyMatcherFields,
+                  const std::vector<Matcher>& valueMatcherFields, const LogEvent& event,
+                  HashableDimensionKey& key, std::vector<int>& valueIndices);
+
+// All the values of event, with the hash combined from the value hashes of the event.
+HashableDimensionKey getAtomFieldValues(const LogEvent& event);
+
 /**
  * Creating HashableDimensionKeys from State Primary Keys in FieldValues.
  *
@@ -232,6 +360,15 @@ void getDimensionForCondition(const std::vector<FieldValue>& eventValues,
                               const Metric2Condition& links,
                               HashableDimensionKey* conditionDimension);
 
+/**
+ * Takes the values of conditionKey, a key of the condition that links points to, at the condition
+ * fields of links. The result is the condition key that getDimensionForCondition() returns for the
+ * events whose linked values are contained in conditionKey. Returns false if conditionKey is
+ * missing one of the fields.
+ */
+bool getLinkedConditionKey(const HashableDimensionKey& conditionKey, const Metric2Condition& links,
+                           HashableDimensionKey* linkedConditionKey);
+
 /**
  * Get dimension values using metric's "what" fields and fill statePrimaryKey's
  * mField information using "state" fields.
@@ -20,6 +20,7 @@
 #include "StatsLogProcessor.h"
 
 #include <android-base/file.h>
+#include <arpa/inet.h>
 #include <cutils/multiuser.h>
 #include <src/active_config_list.pb.h>
 #include <src/experiment_ids.pb.h>
@@ -29,6 +30,7 @@
 #include "external/StatsPullerManager.h"
 #include "flags/FlagProvider.h"
 #include "guardrail/StatsdStats.h"
+#include "hash.h"
 #include "logd/LogEvent.h"
 #include "metrics/CountMetricProducer.h"
 #include "state/StateManager.h"
@@ -36,6 +38,9 @@
 #include "stats_util.h"
 #include "statslog_statsd.h"
 #include "storage/StorageManager.h"
+#include "utils/DumpBuffer.h"
+#include "utils/ParallelFor.h"
+#include "utils/StatsdTrace.h"
 
 using namespace android;
 using android::base::StringPrintf;
@@ -89,6 +94,10 @@ constexpr const char* kPermissionUsage = "android.permission.PACKAGE_USAGE_STATS
 // Cool down period for writing data to disk to avoid overwriting files.
 #define WRITE_DATA_COOL_DOWN_SEC 15
 
+// Maximum number of threads, the calling one included, that write reports of different configs to
+// disk at the same time.
+#define MAX_WRITE_DATA_THREADS 4
+
 StatsLogProcessor::StatsLogProcessor(
         const sp<UidMap>& uidMap, const sp<StatsPullerManager>& pullerManager,
         const sp<AlarmMonitor>& anomalyAlarmMonitor, const sp<AlarmMonitor>& periodicAlarmMonitor,
@@ -133,6 +142,24 @@ static void flushProtoToBuffer(ProtoOutputStream& proto, vector<uint8_t>* outDat
     }
 }
 
+// Tag and length varints of a length-delimited field.
+static const size_t kMaxLengthDelimitedHeaderSize = 2 * 10;
+
+// Writes the tag and length of a length-delimited field into header, so that the payload can be
+// written separately. Returns the number of bytes written.
+static size_t writeLengthDelimitedHeader(uint32_t fieldId, size_t size, uint8_t* header) {
+    static const uint64_t kWireTypeLengthDelimited = 2;
+    size_t pos = 0;
+    for (uint64_t value : {(uint64_t(fieldId) << 3) | kWireTypeLengthDelimited, uint64_t(size)}) {
+        while (value >= 0x80) {
+            header[pos++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        header[pos++] = value;
+    }
+    return pos;
+}
+
 void StatsLogProcessor::processFiredAnomalyAlarmsLocked(
         const int64_t timestampNs,
         unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet) {
@@ -143,22 +170,26 @@ void StatsLogProcessor::processFiredAnomalyAlarmsLocked(
 void StatsLogProcessor::onPeriodicAlarmFired(
         const int64_t timestampNs,
         unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet) {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
-    for (const auto& itr : mMetricsManagers) {
-        itr.second->onPeriodicAlarmFired(timestampNs, alarmSet);
+    vector<sp<AlarmTracker>> firedTrackers;
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        applyPendingAppChangesLocked();
+        for (const auto& itr : mMetricsManagers) {
+            itr.second->getFiredPeriodicAlarmTrackers(alarmSet, &firedTrackers);
+        }
+    }
+    // Periodic alarms only trigger subscribers and never touch metric state, so the trackers are
+    // informed without holding mMetricsMutex. A tracker of a config removed in the meantime is
+    // kept alive by firedTrackers and informs its subscribers one last time.
+    for (const sp<AlarmTracker>& tracker : firedTrackers) {
+        tracker->informAlarmsFired(timestampNs, alarmSet);
     }
 }
 
 void StatsLogProcessor::mapIsolatedUidToHostUidIfNecessaryLocked(LogEvent* event) const {
     if (std::pair<size_t, size_t> indexRange; event->hasAttributionChain(&indexRange)) {
-        vector<FieldValue>* const fieldValues = event->getMutableValues();
-        for (size_t i = indexRange.first; i <= indexRange.second; i++) {
-            FieldValue& fieldValue = fieldValues->at(i);
-            if (isAttributionUidField(fieldValue)) {
-                const int hostUid = mUidMap->getHostUidOrSelf(fieldValue.mValue.int_value);
-                fieldValue.mValue.setInt(hostUid);
-            }
-        }
+        mUidMap->mapAttributionUidsToHostUids(event->getMutableValues(), indexRange.first,
+                                              indexRange.second);
     } else {
         mapIsolatedUidsToHostUidInLogEvent(mUidMap, *event);
     }
@@ -391,9 +422,140 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event) {
     OnLogEvent(event, getElapsedRealtimeNs());
 }
 
+// Notes the latency stages of a traced event that the processor started on at processStartNs.
+static void noteProcessedEventLatency(const LogEvent& event, int64_t processStartNs) {
+    const int64_t nowNs = getElapsedRealtimeNs();
+    const int atomId = event.GetTagId();
+    const int64_t traceStartNs = event.getLatencyTraceStartNs();
+    const int64_t parseLatencyNs = event.getParseLatencyNs();
+    StatsdStats& stats = StatsdStats::getInstance();
+    stats.noteAtomLatency(atomId, LATENCY_STAGE_QUEUE_WAIT, processStartNs - traceStartNs);
+    STATSD_TRACE_COUNTER("statsd_queue_wait_ns", processStartNs - traceStartNs);
+    if (parseLatencyNs > 0) {
+        stats.noteAtomLatency(atomId, LATENCY_STAGE_PARSE, parseLatencyNs);
+    }
+    stats.noteAtomLatency(atomId, LATENCY_STAGE_PROCESS, nowNs - processStartNs - parseLatencyNs);
+    stats.noteAtomLatency(atomId, LATENCY_STAGE_END_TO_END, nowNs - traceStartNs);
+}
+
 void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
+    widenFieldMaskLocked(event);
+
+    const int64_t processStartNs = event->isLatencyTraced() ? getElapsedRealtimeNs() : 0;
+    if (!preprocessLogEventLocked(event)) {
+        return;
+    }
+
+    if (mMetricsManagers.empty()) {
+        return;
+    }
+
+    if (!mPeriodicHousekeepingScheduled) {
+        runPeriodicHousekeepingLocked(elapsedRealtimeNs);
+    }
+    dispatchLogEventLocked(event, elapsedRealtimeNs);
+    if (event->isLatencyTraced()) {
+        noteProcessedEventLatency(*event, processStartNs);
+    }
+    flushAllIfNecessaryLocked(elapsedRealtimeNs);
+}
+
+uint64_t StatsLogProcessor::widenFieldMasks(const vector<std::unique_ptr<LogEvent>>& events) {
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    for (const std::unique_ptr<LogEvent>& event : events) {
+        widenFieldMaskLocked(event.get());
+    }
+    return mAtomFieldMasksGeneration;
+}
+
+void StatsLogProcessor::OnLogEvents(const vector<std::unique_ptr<LogEvent>>& events,
+                                    std::optional<uint64_t> fieldMasksGeneration) {
+    if (events.empty()) {
+        return;
+    }
+    STATSD_TRACE("StatsLogProcessor::OnLogEvents events=%zu", events.size());
+    const int64_t elapsedRealtimeNs = getElapsedRealtimeNs();
+
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
+    // A config update since widenFieldMasks() may read fields that the bodies parsed without
+    // mMetricsMutex skipped, these are parsed again.
+    if (fieldMasksGeneration != mAtomFieldMasksGeneration) {
+        for (const std::unique_ptr<LogEvent>& event : events) {
+            widenFieldMaskLocked(event.get());
+        }
+    }
+
+    // The periodic checks only depend on the current time, so they run once for the whole
+    // batch, right before the first event that reaches the metrics managers.
+    bool dispatched = false;
+    for (const std::unique_ptr<LogEvent>& event : events) {
+        const int64_t processStartNs = event->isLatencyTraced() ? getElapsedRealtimeNs() : 0;
+        if (!preprocessLogEventLocked(event.get())) {
+            continue;
+        }
 
+        if (mMetricsManagers.empty()) {
+            continue;
+        }
+
+        if (!dispatched && !mPeriodicHousekeepingScheduled) {
+            runPeriodicHousekeepingLocked(elapsedRealtimeNs);
+        }
+        dispatched = true;
+        dispatchLogEventLocked(event.get(), elapsedRealtimeNs);
+        if (event->isLatencyTraced()) {
+            noteProcessedEventLatency(*event, processStartNs);
+        }
+    }
+    if (dispatched) {
+        flushAllIfNecessaryLocked(elapsedRealtimeNs);
+    }
+}
+
+void StatsLogProcessor::runPeriodicHousekeeping(int64_t elapsedRealtimeNs) {
+    // Events keep being processed while the configs whose TTL expired are rebuilt.
+    std::map<ConfigKey, PrebuiltConfig> prebuilt = prebuildExpiredConfigs(elapsedRealtimeNs);
+    // Declared before the lock, so that the replaced MetricsManagers are destroyed after it.
+    std::vector<sp<MetricsManager>> retired;
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
+    if (mMetricsManagers.empty()) {
+        return;
+    }
+    resetIfConfigTtlExpiredLocked(elapsedRealtimeNs, &prebuilt, &retired);
+    runPeriodicHousekeepingLocked(elapsedRealtimeNs);
+}
+
+std::map<ConfigKey, StatsLogProcessor::PrebuiltConfig> StatsLogProcessor::prebuildExpiredConfigs(
+        int64_t timestampNs) {
+    std::map<ConfigKey, PrebuiltConfig> prebuilt;
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        for (const auto& [key, metricsManager] : mMetricsManagers) {
+            if (metricsManager != nullptr && !metricsManager->isInTtl(timestampNs)) {
+                prebuilt[key].replaced = metricsManager;
+            }
+        }
+    }
+    for (auto& [key, entry] : prebuilt) {
+        StatsdConfig config;
+        if (StorageManager::readConfigFromDisk(key, &config)) {
+            entry.metricsManager = buildMetricsManager(key, config, timestampNs);
+            entry.config = std::move(config);
+        }
+    }
+    return prebuilt;
+}
+
+void StatsLogProcessor::setPeriodicHousekeepingScheduled(bool scheduled) {
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    mPeriodicHousekeepingScheduled = scheduled;
+}
+
+bool StatsLogProcessor::preprocessLogEventLocked(LogEvent* event) {
     // Tell StatsdStats about new event
     const int64_t eventElapsedTimeNs = event->GetElapsedTimestampNs();
     const int atomId = event->GetTagId();
@@ -401,7 +563,7 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
                                               event->isParsedHeaderOnly());
     if (!event->isValid()) {
         StatsdStats::getInstance().noteAtomError(atomId);
-        return;
+        return false;
     }
 
     // Hard-coded logic to update train info on disk and fill in any information
@@ -419,7 +581,9 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     if (mPrintAllLogs) {
         ALOGI("%s", event->ToString().c_str());
     }
-    resetIfConfigTtlExpiredLocked(eventElapsedTimeNs);
+    if (!mPeriodicHousekeepingScheduled) {
+        resetIfConfigTtlExpiredLocked(eventElapsedTimeNs);
+    }
 
     // Hard-coded logic to update the isolated uid's in the uid-map.
     // The field numbers need to be currently updated by hand with atoms.proto
@@ -431,11 +595,10 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     }
 
     StateManager::getInstance().onLogEvent(*event);
+    return true;
+}
 
-    if (mMetricsManagers.empty()) {
-        return;
-    }
-
+void StatsLogProcessor::runPeriodicHousekeepingLocked(int64_t elapsedRealtimeNs) {
     bool fireAlarm = false;
     {
         std::lock_guard<std::mutex> anomalyLock(mAnomalyAlarmMutex);
@@ -457,8 +620,32 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     }
 
     flushRestrictedDataIfNecessaryLocked(elapsedRealtimeNs);
-    enforceDataTtlsIfNecessaryLocked(getWallClockNs(), elapsedRealtimeNs);
-    enforceDbGuardrailsIfNecessaryLocked(getWallClockNs(), elapsedRealtimeNs);
+    const int64_t wallClockNs = getWallClockNs();
+    enforceDataTtlsIfNecessaryLocked(wallClockNs, elapsedRealtimeNs);
+    enforceDbGuardrailsIfNecessaryLocked(wallClockNs, elapsedRealtimeNs);
+    checkpointStateIfNecessaryLocked(wallClockNs, elapsedRealtimeNs);
+}
+
+void StatsLogProcessor::checkpointStateIfNecessaryLocked(const int64_t wallClockNs,
+                                                         const int64_t elapsedRealtimeNs) {
+    if (elapsedRealtimeNs - mLastStateCheckpointNs < kStateCheckpointPeriodNs) {
+        return;
+    }
+    mLastStateCheckpointNs = elapsedRealtimeNs;
+    // A checkpoint is only read if statsd does not get to save on its way down, which is not a
+    // reboot, so metrics that activate on boot stay pending.
+    SaveActiveConfigsToDiskLocked(elapsedRealtimeNs, STATSCOMPANION_DIED);
+    SaveMetadataToDiskLocked(wallClockNs, elapsedRealtimeNs);
+}
+
+void StatsLogProcessor::dispatchLogEventLocked(LogEvent* event, int64_t elapsedRealtimeNs) {
+    const auto managersIt = mAtomIdToMetricsManagers.find(event->GetTagId());
+    const MetricsManagerList& metricsManagers = managersIt != mAtomIdToMetricsManagers.end()
+                                                        ? managersIt->second
+                                                        : mMetricsManagersForAllAtoms;
+    if (metricsManagers.empty()) {
+        return;
+    }
 
     if (!validateAppBreadcrumbEvent(*event)) {
         return;
@@ -467,34 +654,80 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     std::unordered_set<int> uidsWithActiveConfigsChanged;
     std::unordered_map<int, std::vector<int64_t>> activeConfigsPerUid;
 
-    // pass the event to metrics managers.
-    for (auto& pair : mMetricsManagers) {
-        if (event->isRestricted() && !pair.second->hasRestrictedMetricsDelegate()) {
-            continue;
-        }
-        int uid = pair.first.GetUid();
-        int64_t configId = pair.first.GetId();
-        bool isPrevActive = pair.second->isActive();
-        pair.second->onLogEvent(*event);
-        bool isCurActive = pair.second->isActive();
+    // Folds the outcome of one metrics manager's onLogEvent into the activation bookkeeping.
+    auto onMetricsManagerDispatched = [&](const ConfigKey& key, MetricsManager& metricsManager,
+                                          bool isPrevActive) {
+        int uid = key.GetUid();
+        bool isCurActive = metricsManager.isActive();
         // Map all active configs by uid.
         if (isCurActive) {
-            auto activeConfigs = activeConfigsPerUid.find(uid);
-            if (activeConfigs != activeConfigsPerUid.end()) {
-                activeConfigs->second.push_back(configId);
-            } else {
-                vector<int64_t> newActiveConfigs;
-                newActiveConfigs.push_back(configId);
-                activeConfigsPerUid[uid] = newActiveConfigs;
-            }
+            activeConfigsPerUid[uid].push_back(key.GetId());
         }
         // The activation state of this config changed.
         if (isPrevActive != isCurActive) {
             VLOG("Active status changed for uid  %d", uid);
             uidsWithActiveConfigsChanged.insert(uid);
-            StatsdStats::getInstance().noteActiveStatusChanged(pair.first, isCurActive);
+            StatsdStats::getInstance().noteActiveStatusChanged(key, isCurActive);
+        }
+        flushIfNecessaryLocked(key, metricsManager);
+    };
+
+    // pass the event to metrics managers.
+    if (mMetricsManagerLanes != nullptr && metricsManagers.size() > 1) {
+        struct Dispatch {
+            const ConfigKey* key;
+            MetricsManager* metricsManager;
+            bool isPrevActive;
+            int64_t latencyNs;
+        };
+        std::vector<Dispatch> dispatches;
+        dispatches.reserve(metricsManagers.size());
+        for (auto* pair : metricsManagers) {
+            if (event->isRestricted() && !pair->second->hasRestrictedMetricsDelegate()) {
+                continue;
+            }
+            dispatches.push_back(
+                    {&pair->first, pair->second.get(), pair->second->isActive(), /*latencyNs=*/0});
+        }
+        // Managers share no mutable state with each other while handling an event, so each lane
+        // takes every numLanes-th of them. Everything that touches processor state runs
+        // afterwards, in the same order as the serial path. The value hashes are computed on
+        // first use, which must not race between the lanes.
+        event->getValueHashes();
+        const size_t numLanes = mMetricsManagerLanes->getNumLanes();
+        mMetricsManagerLanes->runOnEveryLane([&dispatches, event, numLanes](size_t lane) {
+            for (size_t i = lane; i < dispatches.size(); i += numLanes) {
+                const int64_t startNs = event->isLatencyTraced() ? getElapsedRealtimeNs() : 0;
+                dispatches[i].metricsManager->onLogEvent(*event);
+                if (event->isLatencyTraced()) {
+                    dispatches[i].latencyNs = getElapsedRealtimeNs() - startNs;
+                }
+            }
+        });
+        for (const Dispatch& dispatch : dispatches) {
+            if (event->isLatencyTraced()) {
+                StatsdStats::getInstance().noteMetricsManagerLatency(*dispatch.key,
+                                                                     dispatch.latencyNs);
+            }
+            onMetricsManagerDispatched(*dispatch.key, *dispatch.metricsManager,
+                                       dispatch.isPrevActive);
+        }
+    } else {
+        mSharedMatcherResults->startEvent();
+        mSharedConditions->startEvent();
+        for (auto* pair : metricsManagers) {
+            if (event->isRestricted() && !pair->second->hasRestrictedMetricsDelegate()) {
+                continue;
+            }
+            bool isPrevActive = pair->second->isActive();
+            const int64_t startNs = event->isLatencyTraced() ? getElapsedRealtimeNs() : 0;
+            pair->second->onLogEvent(*event);
+            if (event->isLatencyTraced()) {
+                StatsdStats::getInstance().noteMetricsManagerLatency(
+                        pair->first, getElapsedRealtimeNs() - startNs);
+            }
+            onMetricsManagerDispatched(pair->first, *(pair->second), isPrevActive);
         }
-        flushIfNecessaryLocked(pair.first, *(pair.second));
     }
 
     // Don't use the event timestamp for the guardrail.
@@ -525,12 +758,30 @@ void StatsLogProcessor::OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs) {
     }
 }
 
-void StatsLogProcessor::GetActiveConfigs(const int uid, vector<int64_t>& outActiveConfigs) {
+void StatsLogProcessor::setMetricsManagerLaneCount(size_t laneCount) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
-    GetActiveConfigsLocked(uid, outActiveConfigs);
+    if (!mMetricsManagers.empty()) {
+        // The configs already share matcher results and condition states, which lanes would
+        // access concurrently.
+        ALOGE("Metrics manager lanes must be set up before any config is added");
+        return;
+    }
+    laneCount = std::min(laneCount, kMaxMetricsManagerLanes);
+    if (laneCount <= 1) {
+        mMetricsManagerLanes.reset();
+    } else if (mMetricsManagerLanes == nullptr ||
+               mMetricsManagerLanes->getNumLanes() != laneCount) {
+        mMetricsManagerLanes = std::make_unique<LaneExecutor>(laneCount);
+    }
+}
+
+void StatsLogProcessor::setSpillPastBuckets(bool spillPastBuckets) {
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    mSpillPastBuckets = spillPastBuckets;
 }
 
-void StatsLogProcessor::GetActiveConfigsLocked(const int uid, vector<int64_t>& outActiveConfigs) {
+void StatsLogProcessor::GetActiveConfigs(const int uid, vector<int64_t>& outActiveConfigs) {
+    std::shared_lock<std::shared_mutex> lock(mMetricsManagersMapMutex);
     outActiveConfigs.clear();
     for (auto& pair : mMetricsManagers) {
         if (pair.first.GetUid() == uid && pair.second->isActive()) {
@@ -542,9 +793,21 @@ void StatsLogProcessor::GetActiveConfigsLocked(const int uid, vector<int64_t>& o
 void StatsLogProcessor::OnConfigUpdated(const int64_t timestampNs, const int64_t wallClockNs,
                                         const ConfigKey& key, const StatsdConfig& config,
                                         bool modularUpdate) {
+    bool needsNewMetricsManager;
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        needsNewMetricsManager = needsNewMetricsManagerLocked(key, config, modularUpdate);
+    }
+    // The MetricsManager being replaced keeps processing events while the new one is built.
+    // Its data, those events included, is written to disk right before the swap.
+    const sp<MetricsManager> prebuilt =
+            needsNewMetricsManager ? buildMetricsManager(key, config, timestampNs) : nullptr;
+
+    // Declared before the lock, so that the replaced MetricsManager is destroyed after it.
+    std::vector<sp<MetricsManager>> retired;
     std::lock_guard<std::mutex> lock(mMetricsMutex);
     WriteDataToDiskLocked(key, timestampNs, wallClockNs, CONFIG_UPDATED, NO_TIME_CONSTRAINTS);
-    OnConfigUpdatedLocked(timestampNs, key, config, modularUpdate);
+    OnConfigUpdatedLocked(timestampNs, key, config, modularUpdate, prebuilt, &retired);
 }
 
 void StatsLogProcessor::OnConfigUpdated(const int64_t timestampNs, const ConfigKey& key,
@@ -552,29 +815,101 @@ void StatsLogProcessor::OnConfigUpdated(const int64_t timestampNs, const ConfigK
     OnConfigUpdated(timestampNs, getWallClockNs(), key, config, modularUpdate);
 }
 
+bool StatsLogProcessor::estimateConfigCost(const StatsdConfig& config,
+                                           const std::vector<DatagramRecord>& sample,
+                                           ConfigCostEstimate* estimate) {
+    // The estimate touches nothing of the installed configs, so events keep being processed.
+    return ConfigCostEstimator::estimate(config, sample, mUidMap, estimate);
+}
+
+void StatsLogProcessor::OnConfigsUpdated(const int64_t timestampNs,
+                                         const std::map<ConfigKey, StatsdConfig>& configs) {
+    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    const int64_t wallClockNs = getWallClockNs();
+    for (const auto& [key, config] : configs) {
+        WriteDataToDiskLocked(key, timestampNs, wallClockNs, CONFIG_UPDATED, NO_TIME_CONSTRAINTS);
+        installConfigLocked(timestampNs, key, config, /*modularUpdate=*/true);
+    }
+    updateAtomIdToMetricsManagersLocked();
+    updateLogEventFilterLocked();
+}
+
 void StatsLogProcessor::OnConfigUpdatedLocked(const int64_t timestampNs, const ConfigKey& key,
-                                              const StatsdConfig& config, bool modularUpdate) {
+                                              const StatsdConfig& config, bool modularUpdate,
+                                              const sp<MetricsManager>& prebuilt,
+                                              std::vector<sp<MetricsManager>>* retired) {
+    installConfigLocked(timestampNs, key, config, modularUpdate, prebuilt, retired);
+    updateAtomIdToMetricsManagersLocked();
+    updateLogEventFilterLocked();
+}
+
+bool StatsLogProcessor::needsNewMetricsManagerLocked(const ConfigKey& key,
+                                                     const StatsdConfig& config,
+                                                     bool modularUpdate) const {
+    const auto& it = mMetricsManagers.find(key);
+    if (!modularUpdate || it == mMetricsManagers.end()) {
+        return true;
+    }
+    // Not a modular update if has_restricted_metrics_delegate changes
+    return isAtLeastU() && it->second->hasRestrictedMetricsDelegate() !=
+                                   config.has_restricted_metrics_delegate_package_name();
+}
+
+sp<MetricsManager> StatsLogProcessor::buildMetricsManager(const ConfigKey& key,
+                                                          const StatsdConfig& config,
+                                                          int64_t timestampNs) const {
+    return new MetricsManager(key, config, mTimeBaseNs, timestampNs, mUidMap, mPullerManager,
+                              mAnomalyAlarmMonitor, mPeriodicAlarmMonitor,
+                              /*sharedConditions=*/nullptr, /*deferRegistration=*/true);
+}
+
+bool StatsLogProcessor::adoptMetricsManagerLocked(const sp<MetricsManager>& metricsManager,
+                                                  const StatsdConfig& config) {
+    if (mMetricsManagerLanes == nullptr &&
+        !metricsManager->shareConditionStates(mSharedConditions, config)) {
+        return false;
+    }
+    metricsManager->completeRegistration();
+    return true;
+}
+
+void StatsLogProcessor::installConfigLocked(const int64_t timestampNs, const ConfigKey& key,
+                                            const StatsdConfig& config, bool modularUpdate,
+                                            const sp<MetricsManager>& prebuilt,
+                                            std::vector<sp<MetricsManager>>* retired) {
+    applyPendingAppChangesLocked();
     VLOG("Updated configuration for key %s", key.ToString().c_str());
     const auto& it = mMetricsManagers.find(key);
     bool configValid = false;
-    if (isAtLeastU() && it != mMetricsManagers.end()) {
-        if (it->second->hasRestrictedMetricsDelegate() !=
-            config.has_restricted_metrics_delegate_package_name()) {
-            // Not a modular update if has_restricted_metrics_delegate changes
-            modularUpdate = false;
-        }
-        if (!modularUpdate && it->second->hasRestrictedMetricsDelegate()) {
-            StatsdStats::getInstance().noteDbDeletionConfigUpdated(key);
-            // Always delete the old db if restricted metrics config is not a
-            // modular update.
-            dbutils::deleteDb(key);
-        }
-    }
     // Create new config if this is not a modular update or if this is a new config.
-    if (!modularUpdate || it == mMetricsManagers.end()) {
-        sp<MetricsManager> newMetricsManager =
-                new MetricsManager(key, config, mTimeBaseNs, timestampNs, mUidMap, mPullerManager,
-                                   mAnomalyAlarmMonitor, mPeriodicAlarmMonitor);
+    const bool needsNewMetricsManager = needsNewMetricsManagerLocked(key, config, modularUpdate);
+    if (isAtLeastU() && it != mMetricsManagers.end() && needsNewMetricsManager &&
+        it->second->hasRestrictedMetricsDelegate()) {
+        StatsdStats::getInstance().noteDbDeletionConfigUpdated(key);
+        // Always delete the old db if restricted metrics config is not a
+        // modular update.
+        dbutils::deleteDb(key);
+    }
+    if (needsNewMetricsManager) {
+        if (it != mMetricsManagers.end()) {
+            // The replacement starts from scratch, so it must not pick up the condition states it
+            // would otherwise share with the config it replaces.
+            it->second->stopSharingConditionStates();
+        }
+        sp<MetricsManager> newMetricsManager = prebuilt;
+        if (newMetricsManager != nullptr && newMetricsManager->isConfigValid() &&
+            !adoptMetricsManagerLocked(newMetricsManager, config)) {
+            // Another config shares one of its predicates since it was built, so it is rebuilt
+            // here to share the state of that predicate. The discarded MetricsManager was never
+            // registered, and the caller releases it after mMetricsMutex.
+            newMetricsManager = nullptr;
+        }
+        if (newMetricsManager == nullptr) {
+            newMetricsManager = new MetricsManager(
+                    key, config, mTimeBaseNs, timestampNs, mUidMap, mPullerManager,
+                    mAnomalyAlarmMonitor, mPeriodicAlarmMonitor,
+                    mMetricsManagerLanes == nullptr ? mSharedConditions : nullptr);
+        }
         configValid = newMetricsManager->isConfigValid();
         if (configValid) {
             newMetricsManager->init();
@@ -595,6 +930,14 @@ void StatsLogProcessor::OnConfigUpdatedLocked(const int64_t timestampNs, const C
                 mSendRestrictedMetricsBroadcast(key, it->second->getRestrictedMetricsDelegate(),
                                                 {});
             }
+            if (mMetricsManagerLanes == nullptr) {
+                newMetricsManager->setSharedMatcherResults(mSharedMatcherResults);
+            }
+            if (retired != nullptr && it != mMetricsManagers.end()) {
+                it->second->unregisterStateListeners();
+                retired->push_back(it->second);
+            }
+            std::unique_lock<std::shared_mutex> mapLock(mMetricsManagersMapMutex);
             mMetricsManagers[key] = newMetricsManager;
             VLOG("StatsdConfig valid");
         }
@@ -626,11 +969,12 @@ void StatsLogProcessor::OnConfigUpdatedLocked(const int64_t timestampNs, const C
             StatsdStats::getInstance().noteDbConfigInvalid(key);
             dbutils::deleteDb(key);
         }
-        mMetricsManagers.erase(key);
+        {
+            std::unique_lock<std::shared_mutex> mapLock(mMetricsManagersMapMutex);
+            mMetricsManagers.erase(key);
+        }
         mUidMap->OnConfigRemoved(key);
     }
-
-    updateLogEventFilterLocked();
 }
 
 size_t StatsLogProcessor::GetMetricsSize(const ConfigKey& key) const {
@@ -644,11 +988,18 @@ size_t StatsLogProcessor::GetMetricsSize(const ConfigKey& key) const {
 }
 
 void StatsLogProcessor::dumpStates(int out, bool verbose) const {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
-    dprintf(out, "MetricsManager count: %lu\n", (unsigned long)mMetricsManagers.size());
-    for (const auto& metricsManager : mMetricsManagers) {
-        metricsManager.second->dumpStates(out, verbose);
+    // The states are formatted into memory, and only written to out once mMetricsMutex is
+    // released.
+    DumpBuffer buffer(out);
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        dprintf(buffer.fd(), "MetricsManager count: %lu\n",
+                (unsigned long)mMetricsManagers.size());
+        for (const auto& metricsManager : mMetricsManagers) {
+            metricsManager.second->dumpStates(buffer.fd(), verbose);
+        }
     }
+    buffer.flush();
 }
 
 /*
@@ -659,14 +1010,157 @@ void StatsLogProcessor::onDumpReport(const ConfigKey& key, const int64_t dumpTim
                                      const bool include_current_partial_bucket,
                                      const bool erase_data, const DumpReportReason dumpReportReason,
                                      const DumpLatency dumpLatency, ProtoOutputStream* proto) {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
+    STATSD_TRACE("StatsLogProcessor::onDumpReport config=%d:%lld", key.GetUid(),
+                 (long long)key.GetId());
+    ConfigMetricsReportSnapshot snapshot;
+    bool hasReport = false;
+    bool persistLocalHistory = false;
+    int32_t reportNumber;
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        applyPendingAppChangesLocked();
 
-    auto it = mMetricsManagers.find(key);
-    if (it != mMetricsManagers.end() && it->second->hasRestrictedMetricsDelegate()) {
-        VLOG("Unexpected call to StatsLogProcessor::onDumpReport for restricted metrics.");
-        return;
+        auto it = mMetricsManagers.find(key);
+        if (it != mMetricsManagers.end() && it->second->hasRestrictedMetricsDelegate()) {
+            VLOG("Unexpected call to StatsLogProcessor::onDumpReport for restricted metrics.");
+            return;
+        }
+
+        writeDumpReportHeaderLocked(key, erase_data, dumpReportReason, proto);
+
+        if (it != mMetricsManagers.end()) {
+            // This allows another broadcast to be sent within the rate-limit period if we get
+            // close to filling the buffer again soon.
+            mLastBroadcastTimes.erase(key);
+
+            hasReport = takeConfigMetricsReportSnapshotLocked(key, dumpTimeStampNs, wallClockNs,
+                                                              dumpReportReason, &snapshot);
+            it->second->takeDumpReportSnapshot(dumpTimeStampNs, wallClockNs,
+                                               include_current_partial_bucket, erase_data,
+                                               dumpLatency, &snapshot.metrics);
+            persistLocalHistory = it->second->shouldPersistLocalHistory();
+        } else {
+            ALOGW("Config source %s does not exist", key.ToString().c_str());
+        }
+
+        reportNumber = nextDumpReportNumberLocked(key, erase_data);
+    }
+
+    // The report is encoded after mMetricsMutex is released, so that events keep being processed
+    // meanwhile however large it is.
+    if (hasReport) {
+        unique_ptr<ProtoOutputStream> reportProto = mReportProtoPool.acquire(key);
+        writeConfigMetricsReport(key, snapshot, reportProto.get());
+        vector<uint8_t> buffer;
+        flushProtoToBuffer(*reportProto, &buffer);
+        mReportProtoPool.release(key, std::move(reportProto));
+        proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_REPORTS,
+                     reinterpret_cast<char*>(buffer.data()), buffer.size());
+        if (erase_data && persistLocalHistory) {
+            saveLocalHistory(key, buffer);
+        }
+    }
+
+    writeDumpReportTrailer(reportNumber, proto);
+    if (erase_data) {
+        StatsdStats::getInstance().noteMetricsReportSent(key, proto->size(), reportNumber);
     }
+}
+
+/*
+ * onDumpReport writes serialized ConfigMetricsReportList to outFd.
+ */
+bool StatsLogProcessor::onDumpReport(const ConfigKey& key, const int64_t dumpTimeStampNs,
+                                     const int64_t wallClockNs,
+                                     const bool include_current_partial_bucket,
+                                     const bool erase_data, const DumpReportReason dumpReportReason,
+                                     const DumpLatency dumpLatency, const bool writeSizePrefix,
+                                     const int outFd) {
+    ProtoOutputStream headerProto;
+    ConfigMetricsReportSnapshot snapshot;
+    bool hasReport = false;
+    bool persistLocalHistory = false;
+    int32_t reportNumber;
+    {
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        applyPendingAppChangesLocked();
+
+        auto it = mMetricsManagers.find(key);
+        if (it != mMetricsManagers.end() && it->second->hasRestrictedMetricsDelegate()) {
+            VLOG("Unexpected call to StatsLogProcessor::onDumpReport for restricted metrics.");
+            const uint32_t emptySize = 0;
+            return !writeSizePrefix ||
+                   android::base::WriteFully(outFd, &emptySize, sizeof(emptySize));
+        }
 
+        writeDumpReportHeaderLocked(key, erase_data, dumpReportReason, &headerProto);
+
+        if (it != mMetricsManagers.end()) {
+            mLastBroadcastTimes.erase(key);
+            hasReport = takeConfigMetricsReportSnapshotLocked(key, dumpTimeStampNs, wallClockNs,
+                                                              dumpReportReason, &snapshot);
+            it->second->takeDumpReportSnapshot(dumpTimeStampNs, wallClockNs,
+                                               include_current_partial_bucket, erase_data,
+                                               dumpLatency, &snapshot.metrics);
+            persistLocalHistory = it->second->shouldPersistLocalHistory();
+        } else {
+            ALOGW("Config source %s does not exist", key.ToString().c_str());
+        }
+
+        reportNumber = nextDumpReportNumberLocked(key, erase_data);
+    }
+
+    // The report is written to outFd straight from the chunks it was encoded in, instead of being
+    // copied into a flat buffer and then into the report list.
+    unique_ptr<ProtoOutputStream> reportProto = mReportProtoPool.acquire(key);
+    if (hasReport) {
+        writeConfigMetricsReport(key, snapshot, reportProto.get());
+        if (erase_data && persistLocalHistory) {
+            vector<uint8_t> buffer;
+            flushProtoToBuffer(*reportProto, &buffer);
+            saveLocalHistory(key, buffer);
+        }
+    }
+
+    ProtoOutputStream trailerProto;
+    writeDumpReportTrailer(reportNumber, &trailerProto);
+
+    uint8_t reportHeader[kMaxLengthDelimitedHeaderSize];
+    const size_t reportHeaderSize =
+            hasReport ? writeLengthDelimitedHeader(FIELD_ID_REPORTS, reportProto->size(),
+                                                   reportHeader)
+                      : 0;
+    const size_t reportListSize =
+            headerProto.size() + reportHeaderSize + reportProto->size() + trailerProto.size();
+    if (erase_data) {
+        StatsdStats::getInstance().noteMetricsReportSent(key, reportListSize, reportNumber);
+    }
+
+    if (writeSizePrefix) {
+        if (reportListSize >= std::numeric_limits<int32_t>::max()) {
+            ALOGE("Report size is infeasible big and can not be returned");
+            return false;
+        }
+        const uint32_t reportListSizeBE = htonl(static_cast<uint32_t>(reportListSize));
+        if (!android::base::WriteFully(outFd, &reportListSizeBE, sizeof(reportListSizeBE))) {
+            ALOGE("Failed to write the report size of %s", key.ToString().c_str());
+            return false;
+        }
+    }
+    const bool written = headerProto.flush(outFd) &&
+                         android::base::WriteFully(outFd, reportHeader, reportHeaderSize) &&
+                         reportProto->flush(outFd) && trailerProto.flush(outFd);
+    mReportProtoPool.release(key, std::move(reportProto));
+    if (!written) {
+        ALOGE("Failed to write the report of %s", key.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+void StatsLogProcessor::writeDumpReportHeaderLocked(const ConfigKey& key, const bool erase_data,
+                                                    const DumpReportReason dumpReportReason,
+                                                    ProtoOutputStream* proto) {
     // Start of ConfigKey.
     uint64_t configKeyToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_ID_CONFIG_KEY);
     proto->write(FIELD_TYPE_INT32 | FIELD_ID_UID, key.GetUid());
@@ -675,6 +1169,7 @@ void StatsLogProcessor::onDumpReport(const ConfigKey& key, const int64_t dumpTim
     // End of ConfigKey.
 
     bool keepFile = false;
+    auto it = mMetricsManagers.find(key);
     if (it != mMetricsManagers.end() && it->second->shouldPersistLocalHistory()) {
         keepFile = true;
     }
@@ -684,34 +1179,22 @@ void StatsLogProcessor::onDumpReport(const ConfigKey& key, const int64_t dumpTim
     StorageManager::appendConfigMetricsReport(
             key, proto, erase_data && !keepFile /* should remove file after appending it */,
             dumpReportReason == ADB_DUMP /*if caller is adb*/);
+}
 
-    if (it != mMetricsManagers.end()) {
-        // This allows another broadcast to be sent within the rate-limit period if we get close to
-        // filling the buffer again soon.
-        mLastBroadcastTimes.erase(key);
-
-        vector<uint8_t> buffer;
-        onConfigMetricsReportLocked(key, dumpTimeStampNs, wallClockNs,
-                                    include_current_partial_bucket, erase_data, dumpReportReason,
-                                    dumpLatency, false /* is this data going to be saved on disk */,
-                                    &buffer);
-        proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_REPORTS,
-                     reinterpret_cast<char*>(buffer.data()), buffer.size());
-    } else {
-        ALOGW("Config source %s does not exist", key.ToString().c_str());
-    }
-
+int32_t StatsLogProcessor::nextDumpReportNumberLocked(const ConfigKey& key,
+                                                      const bool erase_data) {
     if (erase_data) {
         ++mDumpReportNumbers[key];
     }
-    proto->write(FIELD_TYPE_INT32 | FIELD_ID_REPORT_NUMBER, mDumpReportNumbers[key]);
+    return mDumpReportNumbers[key];
+}
+
+void StatsLogProcessor::writeDumpReportTrailer(const int32_t reportNumber,
+                                               ProtoOutputStream* proto) {
+    proto->write(FIELD_TYPE_INT32 | FIELD_ID_REPORT_NUMBER, reportNumber);
 
     proto->write(FIELD_TYPE_INT32 | FIELD_ID_STATSD_STATS_ID,
                  StatsdStats::getInstance().getStatsdStatsId());
-    if (erase_data) {
-        StatsdStats::getInstance().noteMetricsReportSent(key, proto->size(),
-                                                         mDumpReportNumbers[key]);
-    }
 }
 
 /*
@@ -752,77 +1235,177 @@ void StatsLogProcessor::onConfigMetricsReportLocked(
         const bool include_current_partial_bucket, const bool erase_data,
         const DumpReportReason dumpReportReason, const DumpLatency dumpLatency,
         const bool dataSavedOnDisk, vector<uint8_t>* buffer) {
+    unique_ptr<ProtoOutputStream> tempProto = mReportProtoPool.acquire(key);
+    const bool hasReport = writeConfigMetricsReportLocked(key, dumpTimeStampNs, wallClockNs,
+                                                          include_current_partial_bucket,
+                                                          erase_data, dumpReportReason,
+                                                          dumpLatency, tempProto.get());
+    if (hasReport) {
+        flushProtoToBuffer(*tempProto, buffer);
+    }
+    mReportProtoPool.release(key, std::move(tempProto));
+    if (!hasReport) {
+        return;
+    }
+
+    // save buffer to disk if needed
+    if (erase_data && !dataSavedOnDisk &&
+        mMetricsManagers.find(key)->second->shouldPersistLocalHistory()) {
+        saveLocalHistory(key, *buffer);
+    }
+}
+
+/*
+ * writeConfigMetricsReportLocked writes ConfigMetricsReport into proto.
+ */
+bool StatsLogProcessor::writeConfigMetricsReportLocked(
+        const ConfigKey& key, const int64_t dumpTimeStampNs, const int64_t wallClockNs,
+        const bool include_current_partial_bucket, const bool erase_data,
+        const DumpReportReason dumpReportReason, const DumpLatency dumpLatency,
+        ProtoOutputStream* proto) {
+    ConfigMetricsReportSnapshot snapshot;
+    if (!takeConfigMetricsReportSnapshotLocked(key, dumpTimeStampNs, wallClockNs, dumpReportReason,
+                                               &snapshot)) {
+        return false;
+    }
+
+    StringSet str_set;
+
+    // First, fill in ConfigMetricsReport using current data on memory, which
+    // starts from filling in StatsLogReport's.
+    mMetricsManagers.find(key)->second->onDumpReport(dumpTimeStampNs, wallClockNs,
+                                                     include_current_partial_bucket, erase_data,
+                                                     dumpLatency, &str_set, proto);
+
+    writeConfigMetricsReportFields(key, snapshot, &str_set, proto);
+    return true;
+}
+
+bool StatsLogProcessor::takeConfigMetricsReportSnapshotLocked(
+        const ConfigKey& key, const int64_t dumpTimeStampNs, const int64_t wallClockNs,
+        const DumpReportReason dumpReportReason, ConfigMetricsReportSnapshot* snapshot) {
     // We already checked whether key exists in mMetricsManagers in
     // WriteDataToDisk.
     auto it = mMetricsManagers.find(key);
     if (it == mMetricsManagers.end()) {
-        return;
+        return false;
     }
     if (it->second->hasRestrictedMetricsDelegate()) {
         VLOG("Unexpected call to StatsLogProcessor::onConfigMetricsReportLocked for restricted "
              "metrics.");
         // Do not call onDumpReport for restricted metrics.
-        return;
+        return false;
     }
-    int64_t lastReportTimeNs = it->second->getLastReportTimeNs();
-    int64_t lastReportWallClockNs = it->second->getLastReportWallClockNs();
-
-    std::set<string> str_set;
-
-    ProtoOutputStream tempProto;
-    // First, fill in ConfigMetricsReport using current data on memory, which
-    // starts from filling in StatsLogReport's.
-    it->second->onDumpReport(dumpTimeStampNs, wallClockNs, include_current_partial_bucket,
-                             erase_data, dumpLatency, &str_set, &tempProto);
+    fillConfigMetricsReportSnapshot(*it->second, dumpTimeStampNs, wallClockNs, dumpReportReason,
+                                    snapshot);
+    return true;
+}
 
+void StatsLogProcessor::fillConfigMetricsReportSnapshot(const MetricsManager& metricsManager,
+                                                        const int64_t dumpTimeStampNs,
+                                                        const int64_t wallClockNs,
+                                                        const DumpReportReason dumpReportReason,
+                                                        ConfigMetricsReportSnapshot* snapshot) {
+    snapshot->dumpTimeNs = dumpTimeStampNs;
+    snapshot->wallClockNs = wallClockNs;
+    snapshot->lastReportTimeNs = metricsManager.getLastReportTimeNs();
+    snapshot->lastReportWallClockNs = metricsManager.getLastReportWallClockNs();
+    snapshot->dumpReportReason = dumpReportReason;
+    snapshot->hasMetrics = metricsManager.getNumMetrics() > 0;
+    snapshot->versionStringsInReport = metricsManager.versionStringsInReport();
+    snapshot->installerInReport = metricsManager.installerInReport();
+    snapshot->uidMapDeltaInReport = metricsManager.uidMapDeltaInReport();
+    snapshot->packageCertificateHashSizeBytes = metricsManager.packageCertificateHashSizeBytes();
+    snapshot->hashStringInReport = metricsManager.hashStringInReport();
+}
+
+void StatsLogProcessor::writeConfigMetricsReport(const ConfigKey& key,
+                                                 const ConfigMetricsReportSnapshot& snapshot,
+                                                 ProtoOutputStream* proto) {
+    StringSet str_set;
+    MetricsManager::writeDumpReportSnapshot(snapshot.metrics, &str_set, proto);
+    writeConfigMetricsReportFields(key, snapshot, &str_set, proto);
+}
+
+void StatsLogProcessor::writeConfigMetricsReportFields(const ConfigKey& key,
+                                                       const ConfigMetricsReportSnapshot& snapshot,
+                                                       StringSet* str_set,
+                                                       ProtoOutputStream* proto) {
     // Fill in UidMap if there is at least one metric to report.
     // This skips the uid map if it's an empty config.
-    if (it->second->getNumMetrics() > 0) {
-        uint64_t uidMapToken = tempProto.start(FIELD_TYPE_MESSAGE | FIELD_ID_UID_MAP);
-        mUidMap->appendUidMap(dumpTimeStampNs, key, it->second->versionStringsInReport(),
-                              it->second->installerInReport(),
-                              it->second->packageCertificateHashSizeBytes(),
-                              it->second->hashStringInReport() ? &str_set : nullptr, &tempProto);
-        tempProto.end(uidMapToken);
+    if (snapshot.hasMetrics) {
+        uint64_t uidMapToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_ID_UID_MAP);
+        mUidMap->appendUidMap(snapshot.dumpTimeNs, key, snapshot.versionStringsInReport,
+                              snapshot.installerInReport, snapshot.packageCertificateHashSizeBytes,
+                              snapshot.hashStringInReport ? str_set : nullptr, proto,
+                              snapshot.uidMapDeltaInReport);
+        proto->end(uidMapToken);
     }
 
     // Fill in the timestamps.
-    tempProto.write(FIELD_TYPE_INT64 | FIELD_ID_LAST_REPORT_ELAPSED_NANOS,
-                    (long long)lastReportTimeNs);
-    tempProto.write(FIELD_TYPE_INT64 | FIELD_ID_CURRENT_REPORT_ELAPSED_NANOS,
-                    (long long)dumpTimeStampNs);
-    tempProto.write(FIELD_TYPE_INT64 | FIELD_ID_LAST_REPORT_WALL_CLOCK_NANOS,
-                    (long long)lastReportWallClockNs);
-    tempProto.write(FIELD_TYPE_INT64 | FIELD_ID_CURRENT_REPORT_WALL_CLOCK_NANOS,
-                    (long long)wallClockNs);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_LAST_REPORT_ELAPSED_NANOS,
+                 (long long)snapshot.lastReportTimeNs);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_CURRENT_REPORT_ELAPSED_NANOS,
+                 (long long)snapshot.dumpTimeNs);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_LAST_REPORT_WALL_CLOCK_NANOS,
+                 (long long)snapshot.lastReportWallClockNs);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_CURRENT_REPORT_WALL_CLOCK_NANOS,
+                 (long long)snapshot.wallClockNs);
     // Dump report reason
-    tempProto.write(FIELD_TYPE_INT32 | FIELD_ID_DUMP_REPORT_REASON, dumpReportReason);
+    proto->write(FIELD_TYPE_INT32 | FIELD_ID_DUMP_REPORT_REASON, snapshot.dumpReportReason);
 
-    for (const auto& str : str_set) {
-        tempProto.write(FIELD_TYPE_STRING | FIELD_COUNT_REPEATED | FIELD_ID_STRINGS, str);
+    // Sorted so that the strings are in the same order in every report.
+    vector<const string*> strings;
+    strings.reserve(str_set->size());
+    for (const string& str : *str_set) {
+        strings.push_back(&str);
+    }
+    std::sort(strings.begin(), strings.end(),
+              [](const string* a, const string* b) { return *a < *b; });
+    for (const string* str : strings) {
+        proto->write(FIELD_TYPE_STRING | FIELD_COUNT_REPEATED | FIELD_ID_STRINGS, *str);
     }
 
     // Data corrupted reason
-    writeDataCorruptedReasons(tempProto);
-
-    flushProtoToBuffer(tempProto, buffer);
+    writeDataCorruptedReasons(*proto);
+}
 
-    // save buffer to disk if needed
-    if (erase_data && !dataSavedOnDisk && it->second->shouldPersistLocalHistory()) {
-        VLOG("save history to disk");
-        string file_name = StorageManager::getDataHistoryFileName((long)getWallClockSec(),
-                                                                  key.GetUid(), key.GetId());
-        StorageManager::writeFile(file_name.c_str(), buffer->data(), buffer->size());
-    }
+void StatsLogProcessor::saveLocalHistory(const ConfigKey& key, const vector<uint8_t>& buffer) {
+    VLOG("save history to disk");
+    string file_name = StorageManager::getDataHistoryFileName((long)getWallClockSec(), key.GetUid(),
+                                                              key.GetId());
+    StorageManager::writeFile(file_name.c_str(), buffer.data(), buffer.size());
 }
 
 void StatsLogProcessor::resetConfigsLocked(const int64_t timestampNs,
-                                           const std::vector<ConfigKey>& configs) {
+                                           const std::vector<ConfigKey>& configs,
+                                           std::map<ConfigKey, PrebuiltConfig>* prebuilt,
+                                           std::vector<sp<MetricsManager>>* retired) {
     for (const auto& key : configs) {
+        // A prebuilt config is only used for the MetricsManager it was built to replace.
+        PrebuiltConfig* entry = nullptr;
+        if (prebuilt != nullptr) {
+            const auto prebuiltIt = prebuilt->find(key);
+            const auto it = mMetricsManagers.find(key);
+            if (prebuiltIt != prebuilt->end() && it != mMetricsManagers.end() &&
+                prebuiltIt->second.replaced == it->second) {
+                entry = &prebuiltIt->second;
+            }
+        }
         StatsdConfig config;
-        if (StorageManager::readConfigFromDisk(key, &config)) {
+        bool configRead;
+        if (entry != nullptr) {
+            configRead = entry->config.has_value();
+            if (configRead) {
+                config = std::move(*entry->config);
+            }
+        } else {
+            configRead = StorageManager::readConfigFromDisk(key, &config);
+        }
+        if (configRead) {
             // Force a full update when resetting a config.
-            OnConfigUpdatedLocked(timestampNs, key, config, /*modularUpdate=*/false);
+            OnConfigUpdatedLocked(timestampNs, key, config, /*modularUpdate=*/false,
+                                  entry != nullptr ? entry->metricsManager : nullptr, retired);
             StatsdStats::getInstance().noteConfigReset(key);
         } else {
             ALOGE("Failed to read backup config from disk for : %s", key.ToString().c_str());
@@ -834,7 +1417,9 @@ void StatsLogProcessor::resetConfigsLocked(const int64_t timestampNs,
     }
 }
 
-void StatsLogProcessor::resetIfConfigTtlExpiredLocked(const int64_t eventTimeNs) {
+void StatsLogProcessor::resetIfConfigTtlExpiredLocked(
+        const int64_t eventTimeNs, std::map<ConfigKey, PrebuiltConfig>* prebuilt,
+        std::vector<sp<MetricsManager>>* retired) {
     std::vector<ConfigKey> configKeysTtlExpired;
     for (auto it = mMetricsManagers.begin(); it != mMetricsManagers.end(); it++) {
         if (it->second != nullptr && !it->second->isInTtl(eventTimeNs)) {
@@ -844,12 +1429,13 @@ void StatsLogProcessor::resetIfConfigTtlExpiredLocked(const int64_t eventTimeNs)
     if (configKeysTtlExpired.size() > 0) {
         WriteDataToDiskLocked(CONFIG_RESET, NO_TIME_CONSTRAINTS, getElapsedRealtimeNs(),
                               getWallClockNs());
-        resetConfigsLocked(eventTimeNs, configKeysTtlExpired);
+        resetConfigsLocked(eventTimeNs, configKeysTtlExpired, prebuilt, retired);
     }
 }
 
 void StatsLogProcessor::OnConfigRemoved(const ConfigKey& key) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
     auto it = mMetricsManagers.find(key);
     if (it != mMetricsManagers.end()) {
         WriteDataToDiskLocked(key, getElapsedRealtimeNs(), getWallClockNs(), CONFIG_REMOVED,
@@ -859,7 +1445,10 @@ void StatsLogProcessor::OnConfigRemoved(const ConfigKey& key) {
             dbutils::deleteDb(key);
             mSendRestrictedMetricsBroadcast(key, it->second->getRestrictedMetricsDelegate(), {});
         }
-        mMetricsManagers.erase(it);
+        {
+            std::unique_lock<std::shared_mutex> mapLock(mMetricsManagersMapMutex);
+            mMetricsManagers.erase(it);
+        }
         mUidMap->OnConfigRemoved(key);
     }
     StatsdStats::getInstance().noteConfigRemoved(key);
@@ -867,6 +1456,7 @@ void StatsLogProcessor::OnConfigRemoved(const ConfigKey& key) {
     mLastBroadcastTimes.erase(key);
     mLastByteSizeTimes.erase(key);
     mDumpReportNumbers.erase(key);
+    mReportProtoPool.erase(key);
 
     int uid = key.GetUid();
     bool lastConfigForUid = true;
@@ -884,6 +1474,7 @@ void StatsLogProcessor::OnConfigRemoved(const ConfigKey& key) {
         mPullerManager->ForceClearPullerCache();
     }
 
+    updateAtomIdToMetricsManagersLocked();
     updateLogEventFilterLocked();
 }
 
@@ -914,7 +1505,6 @@ void StatsLogProcessor::querySql(const string& sqlQuery, const int32_t minSqlCli
                                  const shared_ptr<IStatsQueryCallback>& callback,
                                  const int64_t configId, const string& configPackage,
                                  const int32_t callingUid) {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
     string err = "";
 
     if (!isAtLeastU()) {
@@ -948,8 +1538,19 @@ void StatsLogProcessor::querySql(const string& sqlQuery, const int32_t minSqlCli
     }
 
     InvalidQueryReason invalidQueryReason;
-    set<ConfigKey> keysToQuery = getRestrictedConfigKeysToQueryLocked(
-            callingUid, configId, configPackageUids, err, invalidQueryReason);
+    set<ConfigKey> keysToQuery;
+    {
+        // Only resolving the config and flushing its data to the db need the metrics lock. The
+        // query runs on its own read-only connection, so events keep being processed while it
+        // runs and its results are sent.
+        std::lock_guard<std::mutex> lock(mMetricsMutex);
+        keysToQuery = getRestrictedConfigKeysToQueryLocked(callingUid, configId, configPackageUids,
+                                                           err, invalidQueryReason);
+        if (keysToQuery.size() == 1) {
+            flushRestrictedDataLocked(elapsedRealtimeNs);
+            enforceDataTtlsLocked(getWallClockNs(), elapsedRealtimeNs);
+        }
+    }
 
     if (keysToQuery.empty()) {
         callback->sendFailure(err);
@@ -968,9 +1569,6 @@ void StatsLogProcessor::querySql(const string& sqlQuery, const int32_t minSqlCli
         return;
     }
 
-    flushRestrictedDataLocked(elapsedRealtimeNs);
-    enforceDataTtlsLocked(getWallClockNs(), elapsedRealtimeNs);
-
     std::vector<std::vector<std::string>> rows;
     std::vector<int32_t> columnTypes;
     std::vector<string> columnNames;
@@ -1112,6 +1710,7 @@ void StatsLogProcessor::flushIfNecessaryLocked(const ConfigKey& key,
 
     // We suspect that the byteSize() computation is expensive, so we set a rate limit.
     size_t totalBytes = metricsManager.byteSize();
+    metricsManager.noteMemoryUsage();
 
     mLastByteSizeTimes[key] = elapsedRealtimeNs;
     const size_t kBytesPerConfig = metricsManager.hasRestrictedMetricsDelegate()
@@ -1123,12 +1722,17 @@ void StatsLogProcessor::flushIfNecessaryLocked(const ConfigKey& key,
         metricsManager.dropData(elapsedRealtimeNs);
         StatsdStats::getInstance().noteDataDropped(key, totalBytes);
         VLOG("StatsD had to toss out metrics for %s", key.ToString().c_str());
-    } else if ((totalBytes > kBytesPerConfig) ||
-               (mOnDiskDataConfigs.find(key) != mOnDiskDataConfigs.end())) {
+    } else {
+        if (mSpillPastBuckets &&
+            totalBytes > metricsManager.getMaxMetricsBytes() / 100 * kSpillPastBucketsPercent &&
+            spillPastBucketsLocked(key, metricsManager, elapsedRealtimeNs)) {
+            VLOG("StatsD spilled the past buckets of %s to disk", key.ToString().c_str());
+        }
         // Request to dump if:
         // 1. in memory data > threshold   OR
         // 2. config has old data report on disk.
-        requestDump = true;
+        requestDump = (totalBytes > kBytesPerConfig) ||
+                      (mOnDiskDataConfigs.find(key) != mOnDiskDataConfigs.end());
     }
 
     if (requestDump) {
@@ -1159,13 +1763,27 @@ void StatsLogProcessor::WriteDataToDiskLocked(const ConfigKey& key, const int64_
                                               const int64_t wallClockNs,
                                               const DumpReportReason dumpReportReason,
                                               const DumpLatency dumpLatency) {
+    STATSD_TRACE("StatsLogProcessor::WriteDataToDisk config=%d:%lld", key.GetUid(),
+                 (long long)key.GetId());
+    if (writeConfigDataToDiskLocked(key, timestampNs, wallClockNs, dumpReportReason,
+                                    dumpLatency)) {
+        // We were able to write the ConfigMetricsReport to disk, so we should trigger collection
+        // ASAP.
+        mOnDiskDataConfigs.insert(key);
+    }
+}
+
+bool StatsLogProcessor::writeConfigDataToDiskLocked(const ConfigKey& key, const int64_t timestampNs,
+                                                    const int64_t wallClockNs,
+                                                    const DumpReportReason dumpReportReason,
+                                                    const DumpLatency dumpLatency) {
     if (mMetricsManagers.find(key) == mMetricsManagers.end() ||
         !mMetricsManagers.find(key)->second->shouldWriteToDisk()) {
-        return;
+        return false;
     }
     if (mMetricsManagers.find(key)->second->hasRestrictedMetricsDelegate()) {
         mMetricsManagers.find(key)->second->flushRestrictedData();
-        return;
+        return false;
     }
     vector<uint8_t> buffer;
     onConfigMetricsReportLocked(key, timestampNs, wallClockNs,
@@ -1173,10 +1791,40 @@ void StatsLogProcessor::WriteDataToDiskLocked(const ConfigKey& key, const int64_
                                 dumpReportReason, dumpLatency, true, &buffer);
     string file_name =
             StorageManager::getDataFileName((long)getWallClockSec(), key.GetUid(), key.GetId());
-    StorageManager::writeFile(file_name.c_str(), buffer.data(), buffer.size());
+    StorageManager::writeFileAsync(file_name, std::move(buffer));
+    return true;
+}
 
-    // We were able to write the ConfigMetricsReport to disk, so we should trigger collection ASAP.
-    mOnDiskDataConfigs.insert(key);
+bool StatsLogProcessor::spillPastBucketsLocked(const ConfigKey& key,
+                                               MetricsManager& metricsManager,
+                                               int64_t elapsedRealtimeNs) {
+    // Files are kept after the reports of local history configs, so spilled buckets would be
+    // reported twice.
+    if (!metricsManager.shouldWriteToDisk() || metricsManager.shouldPersistLocalHistory() ||
+        metricsManager.hasRestrictedMetricsDelegate()) {
+        return false;
+    }
+    const int64_t wallClockNs = getWallClockNs();
+    ConfigMetricsReportSnapshot snapshot;
+    fillConfigMetricsReportSnapshot(metricsManager, elapsedRealtimeNs, wallClockNs,
+                                    PAST_BUCKETS_SPILLED, &snapshot);
+    // The uid map changes stay pending until the next report, which carries them.
+    snapshot.hasMetrics = false;
+
+    ProtoOutputStream proto;
+    StringSet str_set;
+    metricsManager.onDumpReport(elapsedRealtimeNs, wallClockNs,
+                                false /* include_current_partial_bucket */, true /* erase_data */,
+                                NO_TIME_CONSTRAINTS, &str_set, &proto);
+    writeConfigMetricsReportFields(key, snapshot, &str_set, &proto);
+
+    vector<uint8_t> buffer;
+    flushProtoToBuffer(proto, &buffer);
+    // Spills are at most one per kMinByteSizeCheckPeriodNs, so file names do not collide.
+    StorageManager::writeFileAsync(
+            StorageManager::getDataFileName((long)getWallClockSec(), key.GetUid(), key.GetId()),
+            std::move(buffer));
+    return true;
 }
 
 void StatsLogProcessor::SaveActiveConfigsToDisk(int64_t currentTimeNs) {
@@ -1190,19 +1838,24 @@ void StatsLogProcessor::SaveActiveConfigsToDisk(int64_t currentTimeNs) {
         return;
     }
     mLastActiveMetricsWriteNs = timeNs;
+    SaveActiveConfigsToDiskLocked(currentTimeNs, DEVICE_SHUTDOWN);
+}
 
+void StatsLogProcessor::SaveActiveConfigsToDiskLocked(int64_t currentTimeNs,
+                                                      const DumpReportReason reason) {
     ProtoOutputStream proto;
-    WriteActiveConfigsToProtoOutputStreamLocked(currentTimeNs, DEVICE_SHUTDOWN, &proto);
+    WriteActiveConfigsToProtoOutputStreamLocked(currentTimeNs, reason, &proto);
 
     string file_name = StringPrintf("%s/active_metrics", STATS_ACTIVE_METRIC_DIR);
-    StorageManager::deleteFile(file_name.c_str());
-    android::base::unique_fd fd(
-            open(file_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR));
-    if (fd == -1) {
-        ALOGE("Attempt to write %s but failed", file_name.c_str());
+    vector<uint8_t> buffer;
+    proto.serializeToVector(&buffer);
+    const uint64_t hash = FastHash64(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    if (mLastActiveMetricsHash == hash) {
+        // The file already has this content.
         return;
     }
-    proto.flush(fd.get());
+    mLastActiveMetricsHash = hash;
+    StorageManager::writeFileAsync(file_name, std::move(buffer));
 }
 
 void StatsLogProcessor::SaveMetadataToDisk(int64_t currentWallClockTimeNs,
@@ -1216,22 +1869,33 @@ void StatsLogProcessor::SaveMetadataToDisk(int64_t currentWallClockTimeNs,
         return;
     }
     mLastMetadataWriteNs = systemElapsedTimeNs;
+    SaveMetadataToDiskLocked(currentWallClockTimeNs, systemElapsedTimeNs);
+}
 
+void StatsLogProcessor::SaveMetadataToDiskLocked(int64_t currentWallClockTimeNs,
+                                                 int64_t systemElapsedTimeNs) {
     metadata::StatsMetadataList metadataList;
     WriteMetadataToProtoLocked(
             currentWallClockTimeNs, systemElapsedTimeNs, &metadataList);
 
     string file_name = StringPrintf("%s/metadata", STATS_METADATA_DIR);
-    StorageManager::deleteFile(file_name.c_str());
-
     if (metadataList.stats_metadata_size() == 0) {
         // Skip the write if we have nothing to write.
+        StorageManager::deleteFile(file_name.c_str());
+        mLastMetadataHash = nullopt;
         return;
     }
 
-    std::string data;
-    metadataList.SerializeToString(&data);
-    StorageManager::writeFile(file_name.c_str(), data.c_str(), data.size());
+    vector<uint8_t> buffer(metadataList.ByteSizeLong());
+    metadataList.SerializeToArray(buffer.data(), buffer.size());
+    const uint64_t hash = FastHash64(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    if (mLastMetadataHash == hash) {
+        // The file already has this content.
+        return;
+    }
+    mLastMetadataHash = hash;
+    // The pending write replaces the file.
+    StorageManager::writeFileAsync(file_name, std::move(buffer));
 }
 
 void StatsLogProcessor::WriteMetadataToProto(int64_t currentWallClockTimeNs,
@@ -1258,6 +1922,9 @@ void StatsLogProcessor::WriteMetadataToProtoLocked(int64_t currentWallClockTimeN
 void StatsLogProcessor::LoadMetadataFromDisk(int64_t currentWallClockTimeNs,
                                              int64_t systemElapsedTimeNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    StorageManager::waitForPendingWrites();
+    // The file is deleted below, whether or not it can be read.
+    mLastMetadataHash = nullopt;
     string file_name = StringPrintf("%s/metadata", STATS_METADATA_DIR);
     int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
     if (-1 == fd) {
@@ -1303,6 +1970,12 @@ void StatsLogProcessor::SetMetadataStateLocked(
             ALOGE("No config found for configKey %s", key.ToString().c_str());
             continue;
         }
+        if (metadata.has_config_hash() &&
+            metadata.config_hash() != it->second->getConfigHash()) {
+            ALOGW("Not loading metadata of %s, written for a different config",
+                  key.ToString().c_str());
+            continue;
+        }
         VLOG("Setting metadata %s", key.ToString().c_str());
         it->second->loadMetadata(metadata, currentWallClockTimeNs, systemElapsedTimeNs);
     }
@@ -1319,14 +1992,17 @@ void StatsLogProcessor::WriteActiveConfigsToProtoOutputStreamLocked(
         int64_t currentTimeNs,  const DumpReportReason reason, ProtoOutputStream* proto) {
     for (const auto& pair : mMetricsManagers) {
         const sp<MetricsManager>& metricsManager = pair.second;
-        uint64_t configToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
-                                                     FIELD_ID_ACTIVE_CONFIG_LIST_CONFIG);
-        metricsManager->writeActiveConfigToProtoOutputStream(currentTimeNs, reason, proto);
-        proto->end(configToken);
+        const vector<uint8_t>& activeConfig =
+                metricsManager->getEncodedActiveConfig(currentTimeNs, reason);
+        proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_ACTIVE_CONFIG_LIST_CONFIG,
+                     reinterpret_cast<const char*>(activeConfig.data()), activeConfig.size());
     }
 }
 void StatsLogProcessor::LoadActiveConfigsFromDisk() {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    StorageManager::waitForPendingWrites();
+    // The file is deleted below, whether or not it can be read.
+    mLastActiveMetricsHash = nullopt;
     string file_name = StringPrintf("%s/active_metrics", STATS_ACTIVE_METRIC_DIR);
     int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
     if (-1 == fd) {
@@ -1371,6 +2047,11 @@ void StatsLogProcessor::SetConfigsActiveStateLocked(const ActiveConfigList& acti
             ALOGE("No config found for config %s", key.ToString().c_str());
             continue;
         }
+        if (config.has_config_hash() && config.config_hash() != it->second->getConfigHash()) {
+            ALOGW("Not loading activations of %s, written for a different config",
+                  key.ToString().c_str());
+            continue;
+        }
         VLOG("Setting active config %s", key.ToString().c_str());
         it->second->loadActiveConfig(config, currentTimeNs);
     }
@@ -1391,9 +2072,26 @@ void StatsLogProcessor::WriteDataToDiskLocked(const DumpReportReason dumpReportR
         return;
     }
     mLastWriteTimeNs = elapsedRealtimeNs;
-    for (auto& pair : mMetricsManagers) {
-        WriteDataToDiskLocked(pair.first, elapsedRealtimeNs, wallClockNs, dumpReportReason,
-                              dumpLatency);
+
+    // The reports of different configs share no metric state, so they are built and written on
+    // several threads to shorten the time mMetricsMutex is held. Only the processor's own state is
+    // updated once they are all done.
+    vector<ConfigKey> keys;
+    keys.reserve(mMetricsManagers.size());
+    for (const auto& [key, _] : mMetricsManagers) {
+        keys.push_back(key);
+    }
+    vector<uint8_t> written(keys.size(), false);
+    parallelFor(keys.size(), MAX_WRITE_DATA_THREADS, [&](size_t i) {
+        written[i] = writeConfigDataToDiskLocked(keys[i], elapsedRealtimeNs, wallClockNs,
+                                                 dumpReportReason, dumpLatency);
+    });
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (written[i]) {
+            // We were able to write the ConfigMetricsReport to disk, so we should trigger
+            // collection ASAP.
+            mOnDiskDataConfigs.insert(keys[i]);
+        }
     }
 }
 
@@ -1402,15 +2100,18 @@ void StatsLogProcessor::WriteDataToDisk(const DumpReportReason dumpReportReason,
                                         const int64_t elapsedRealtimeNs,
                                         const int64_t wallClockNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
     WriteDataToDiskLocked(dumpReportReason, dumpLatency, elapsedRealtimeNs, wallClockNs);
 }
 
 void StatsLogProcessor::informPullAlarmFired(const int64_t timestampNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
     mPullerManager->OnAlarmFired(timestampNs);
 }
 
 int64_t StatsLogProcessor::getLastReportTimeNs(const ConfigKey& key) {
+    std::shared_lock<std::shared_mutex> lock(mMetricsManagersMapMutex);
     auto it = mMetricsManagers.find(key);
     if (it == mMetricsManagers.end()) {
         return 0;
@@ -1421,26 +2122,44 @@ int64_t StatsLogProcessor::getLastReportTimeNs(const ConfigKey& key) {
 
 void StatsLogProcessor::notifyAppUpgrade(const int64_t eventTimeNs, const string& apk,
                                          const int uid, const int64_t version) {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
     VLOG("Received app upgrade");
-    StateManager::getInstance().notifyAppChanged(apk, mUidMap);
-    for (const auto& it : mMetricsManagers) {
-        it.second->notifyAppUpgrade(eventTimeNs, apk, uid, version);
-    }
+    queueAppChange({eventTimeNs, apk, uid, version, /* removed */ false});
 }
 
 void StatsLogProcessor::notifyAppRemoved(const int64_t eventTimeNs, const string& apk,
                                          const int uid) {
-    std::lock_guard<std::mutex> lock(mMetricsMutex);
     VLOG("Received app removed");
-    StateManager::getInstance().notifyAppChanged(apk, mUidMap);
+    queueAppChange({eventTimeNs, apk, uid, /* version */ 0, /* removed */ true});
+}
+
+void StatsLogProcessor::queueAppChange(PackageChange change) {
+    std::lock_guard<std::mutex> lock(mPendingAppChangesMutex);
+    mPendingAppChanges.push_back(std::move(change));
+    mHasPendingAppChanges.store(true, std::memory_order_release);
+}
+
+void StatsLogProcessor::applyPendingAppChangesLocked() {
+    if (!mHasPendingAppChanges.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::vector<PackageChange> changes;
+    {
+        std::lock_guard<std::mutex> lock(mPendingAppChangesMutex);
+        changes.swap(mPendingAppChanges);
+        mHasPendingAppChanges.store(false, std::memory_order_relaxed);
+    }
+    STATSD_TRACE("StatsLogProcessor::applyPendingAppChanges changes=%zu", changes.size());
+    for (const PackageChange& change : changes) {
+        StateManager::getInstance().notifyAppChanged(change.apk, mUidMap);
+    }
     for (const auto& it : mMetricsManagers) {
-        it.second->notifyAppRemoved(eventTimeNs, apk, uid);
+        it.second->notifyAppsChanged(changes);
     }
 }
 
 void StatsLogProcessor::onUidMapReceived(const int64_t eventTimeNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
     VLOG("Received uid map");
     StateManager::getInstance().updateLogSources(mUidMap);
     for (const auto& it : mMetricsManagers) {
@@ -1450,6 +2169,7 @@ void StatsLogProcessor::onUidMapReceived(const int64_t eventTimeNs) {
 
 void StatsLogProcessor::onStatsdInitCompleted(const int64_t elapsedTimeNs) {
     std::lock_guard<std::mutex> lock(mMetricsMutex);
+    applyPendingAppChangesLocked();
     VLOG("Received boot completed signal");
     for (const auto& it : mMetricsManagers) {
         it.second->onStatsdInitCompleted(elapsedTimeNs);
@@ -1494,17 +2214,80 @@ LogEventFilter::AtomIdSet StatsLogProcessor::getDefaultAtomIdSet() {
     return allAtomIds;
 }
 
-void StatsLogProcessor::updateLogEventFilterLocked() const {
+void StatsLogProcessor::updateLogEventFilterLocked() {
     VLOG("StatsLogProcessor: Updating allAtomIds");
     LogEventFilter::AtomIdSet allAtomIds = getDefaultAtomIdSet();
+    AtomFieldMasks fieldMasks;
     for (const auto& metricsManager : mMetricsManagers) {
         metricsManager.second->addAllAtomIds(allAtomIds);
+        metricsManager.second->addAllAtomFieldMasks(fieldMasks);
     }
     StateManager::getInstance().addAllAtomIds(allAtomIds);
+    // The processor itself and the state trackers read the whole of their atoms.
+    LogEventFilter::AtomIdSet allFieldsAtomIds = getDefaultAtomIdSet();
+    StateManager::getInstance().addAllAtomIds(allFieldsAtomIds);
+    for (const int atomId : allFieldsAtomIds) {
+        fieldMasks.erase(atomId);
+    }
     VLOG("StatsLogProcessor: Updating allAtomIds done. Total atoms %d", (int)allAtomIds.size());
+    mAtomFieldMasks = fieldMasks;
+    mAtomFieldMasksGeneration++;
+    mLogEventFilter->setAtomFieldMasks(std::move(fieldMasks), this);
+    // Losing one of these atoms corrupts the results after it too, so they are the last ones
+    // the LogEventQueue drops.
+    mLogEventFilter->setCriticalAtomIds(std::move(allFieldsAtomIds), this);
     mLogEventFilter->setAtomIds(std::move(allAtomIds), this);
 }
 
+void StatsLogProcessor::widenFieldMaskLocked(LogEvent* event) const {
+    if (event->getFieldMask() == kAllFieldsMask) {
+        return;
+    }
+    const auto it = mAtomFieldMasks.find(event->GetTagId());
+    event->widenFieldMask(it == mAtomFieldMasks.end() ? kAllFieldsMask : it->second);
+}
+
+void StatsLogProcessor::updateAtomIdToMetricsManagersLocked() {
+    mAtomIdToMetricsManagers.clear();
+    mMetricsManagersForAllAtoms.clear();
+    std::vector<LogEventFilter::AtomIdSet> atomIdsPerManager;
+    atomIdsPerManager.reserve(mMetricsManagers.size());
+    for (const auto& [_, metricsManager] : mMetricsManagers) {
+        LogEventFilter::AtomIdSet& atomIds = atomIdsPerManager.emplace_back();
+        metricsManager->addAllAtomIds(atomIds);
+        for (const int atomId : atomIds) {
+            mAtomIdToMetricsManagers[atomId];
+        }
+    }
+
+    // Every list is created above, so appending in a single pass keeps them all in
+    // mMetricsManagers iteration order.
+    size_t managerIndex = 0;
+    for (auto& pair : mMetricsManagers) {
+        if (pair.second->hasMetricActivations()) {
+            mMetricsManagersForAllAtoms.push_back(&pair);
+            for (auto& [_, metricsManagers] : mAtomIdToMetricsManagers) {
+                metricsManagers.push_back(&pair);
+            }
+        } else {
+            for (const int atomId : atomIdsPerManager[managerIndex]) {
+                mAtomIdToMetricsManagers[atomId].push_back(&pair);
+            }
+        }
+        managerIndex++;
+    }
+}
+
+void StatsLogProcessor::flushAllIfNecessaryLocked(int64_t elapsedRealtimeNs) {
+    if (elapsedRealtimeNs - mLastByteSizeSweepNs < StatsdStats::kMinByteSizeCheckPeriodNs) {
+        return;
+    }
+    mLastByteSizeSweepNs = elapsedRealtimeNs;
+    for (auto& [key, metricsManager] : mMetricsManagers) {
+        flushIfNecessaryLocked(key, *metricsManager);
+    }
+}
+
 void StatsLogProcessor::writeDataCorruptedReasons(ProtoOutputStream& proto) {
     if (StatsdStats::getInstance().hasEventQueueOverflow()) {
         proto.write(FIELD_TYPE_INT32 | FIELD_COUNT_REPEATED | FIELD_ID_DATA_CORRUPTED_REASON,
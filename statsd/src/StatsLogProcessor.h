@@ -20,16 +20,23 @@
 #include <gtest/gtest_prod.h>
 #include <stdio.h>
 
+#include <map>
+#include <optional>
+#include <shared_mutex>
 #include <unordered_map>
 
 #include "config/ConfigListener.h"
 #include "external/StatsPullerManager.h"
 #include "logd/LogEvent.h"
+#include "matchers/SharedMatcherResults.h"
+#include "metrics/ConfigCostEstimator.h"
 #include "metrics/MetricsManager.h"
 #include "packages/UidMap.h"
 #include "socket/LogEventFilter.h"
 #include "src/statsd_config.pb.h"
 #include "src/statsd_metadata.pb.h"
+#include "utils/LaneExecutor.h"
+#include "utils/ProtoOutputStreamPool.h"
 
 namespace android {
 namespace os {
@@ -51,13 +58,40 @@ public:
 
     void OnLogEvent(LogEvent* event);
 
+    /**
+     * Processes a batch of events popped from the LogEventQueue. mMetricsMutex is acquired
+     * once for the whole batch and, unless setPeriodicHousekeepingScheduled(true) was called,
+     * the periodic housekeeping (anomaly alarm, puller cache, restricted metrics flush, TTL and
+     * DB guardrails) runs once per batch instead of once per event.
+     *
+     * fieldMasksGeneration is what widenFieldMasks() returned for the events. Unless the configs
+     * changed since, the field masks of the events are not widened again.
+     */
+    void OnLogEvents(const std::vector<std::unique_ptr<LogEvent>>& events,
+                     std::optional<uint64_t> fieldMasksGeneration = std::nullopt);
+
+    /**
+     * Widens the field masks of events read from the socket to the fields the current configs
+     * read, so that their bodies can be parsed without mMetricsMutex. Returns the generation
+     * of these masks, to be passed to OnLogEvents().
+     */
+    uint64_t widenFieldMasks(const std::vector<std::unique_ptr<LogEvent>>& events);
+
     void OnConfigUpdated(const int64_t timestampNs, int64_t wallClockNs, const ConfigKey& key,
                          const StatsdConfig& config, bool modularUpdate = true);
     // For testing only.
     void OnConfigUpdated(const int64_t timestampNs, const ConfigKey& key,
                          const StatsdConfig& config, bool modularUpdate = true);
+    // Sets up all of the configs before events are matched against any of them.
+    void OnConfigsUpdated(const int64_t timestampNs,
+                          const std::map<ConfigKey, StatsdConfig>& configs) override;
     void OnConfigRemoved(const ConfigKey& key);
 
+    // Estimates the cost of config without adding it, see ConfigCostEstimator. Returns false if
+    // the config is invalid. Does not take mMetricsMutex.
+    bool estimateConfigCost(const StatsdConfig& config, const std::vector<DatagramRecord>& sample,
+                            ConfigCostEstimate* estimate);
+
     size_t GetMetricsSize(const ConfigKey& key) const;
 
     void GetActiveConfigs(const int uid, vector<int64_t>& outActiveConfigs);
@@ -70,6 +104,13 @@ public:
                       const bool include_current_partial_bucket, const bool erase_data,
                       const DumpReportReason dumpReportReason, const DumpLatency dumpLatency,
                       ProtoOutputStream* proto);
+    // Writes the report to outFd as it is serialized, without flattening it into a buffer first.
+    // If writeSizePrefix, the report is preceded by its size as a big-endian uint32, and must be
+    // smaller than INT32_MAX bytes. Returns false if the report could not be written to outFd.
+    bool onDumpReport(const ConfigKey& key, int64_t dumpTimeNs, int64_t wallClockNs,
+                      const bool include_current_partial_bucket, const bool erase_data,
+                      const DumpReportReason dumpReportReason, const DumpLatency dumpLatency,
+                      const bool writeSizePrefix, const int outFd);
     // For testing only.
     void onDumpReport(const ConfigKey& key, int64_t dumpTimeNs,
                       const bool include_current_partial_bucket, const bool erase_data,
@@ -118,11 +159,11 @@ public:
     /* Sets the active status/ttl for all configs and metrics to the status in ActiveConfigList. */
     void SetConfigsActiveState(const ActiveConfigList& activeConfigList, int64_t currentTimeNs);
 
-    /* Notify all MetricsManagers of app upgrades */
+    /* Queue an app upgrade for the MetricsManagers, see mPendingAppChanges */
     void notifyAppUpgrade(int64_t eventTimeNs, const string& apk, int uid,
                           int64_t version) override;
 
-    /* Notify all MetricsManagers of app removals */
+    /* Queue an app removal for the MetricsManagers, see mPendingAppChanges */
     void notifyAppRemoved(int64_t eventTimeNs, const string& apk, int uid) override;
 
     /* Notify all MetricsManagers of uid map snapshots received */
@@ -144,6 +185,7 @@ public:
 
     void informPullAlarmFired(const int64_t timestampNs);
 
+    // Does not wait for mMetricsMutex, see mMetricsManagersMapMutex.
     int64_t getLastReportTimeNs(const ConfigKey& key);
 
     inline void setPrintLogs(bool enabled) {
@@ -172,6 +214,38 @@ public:
     /* Returns pre-defined list of atoms to parse by LogEventFilter */
     static LogEventFilter::AtomIdSet getDefaultAtomIdSet();
 
+    // Upper bound for setMetricsManagerLaneCount. Beyond this the per-event join costs more than
+    // the lanes save, since most events only match a few configs.
+    static constexpr size_t kMaxMetricsManagerLanes = 4;
+
+    // Hands each event to the metrics managers on up to laneCount threads at once. 0 or 1 turns
+    // this off, which is the default: events are then dispatched on the calling thread only.
+    // Must be called before any config is added.
+    void setMetricsManagerLaneCount(size_t laneCount);
+
+    // Share of a config's max metrics bytes above which its closed buckets are spilled to disk,
+    // when spilling is on.
+    static constexpr size_t kSpillPastBucketsPercent = 75;
+
+    // When on, configs nearing their max metrics bytes write their closed buckets to disk instead
+    // of holding them until the next report. The spilled buckets are merged back into the next
+    // report the same way as the reports written at shutdown. Off by default.
+    void setSpillPastBuckets(bool spillPastBuckets);
+
+    // How often the housekeeping checkpoints the activations and the metadata to disk.
+    static constexpr int64_t kStateCheckpointPeriodNs = 15 * 60 * NS_PER_SEC;
+
+    // Cap on the bytes of the report encoders kept across dumps, shared by all configs.
+    static constexpr size_t kMaxPooledReportBytes = 2 * 1024 * 1024;
+
+    // Runs the checks that only depend on the current time: the anomaly alarm, puller cache
+    // clearing, config TTLs, restricted metrics flush and the DB guardrails.
+    void runPeriodicHousekeeping(int64_t elapsedRealtimeNs);
+
+    // When scheduled, the caller runs runPeriodicHousekeeping on a timer and log events only do
+    // metric work. Otherwise, which is the default, the checks run while processing events.
+    void setPeriodicHousekeepingScheduled(bool scheduled);
+
 private:
     // For testing only.
     inline sp<AlarmMonitor> getAnomalyAlarmMonitor() const {
@@ -184,6 +258,14 @@ private:
 
     mutable mutex mMetricsMutex;
 
+    // Package changes not yet applied to the MetricsManagers. Package updates come in bursts, at
+    // boot and when many apps update, so the notifications only queue them here without waiting
+    // for mMetricsMutex. Whoever takes mMetricsMutex next to process events, dump reports, pull
+    // or change the configs applies the whole queue in one pass over the managers first.
+    std::vector<PackageChange> mPendingAppChanges;
+    std::mutex mPendingAppChangesMutex;
+    std::atomic_bool mHasPendingAppChanges = false;
+
     // Guards mNextAnomalyAlarmTime. A separate mutex is needed because alarms are set/cancelled
     // in the onLogEvent code path, which is locked by mMetricsMutex.
     // DO NOT acquire mMetricsMutex while holding mAnomalyAlarmMutex. This can lead to a deadlock.
@@ -191,6 +273,46 @@ private:
 
     std::unordered_map<ConfigKey, sp<MetricsManager>> mMetricsManagers;
 
+    // Lets the metadata queries of binder threads, GetActiveConfigs and getLastReportTimeNs, read
+    // mMetricsManagers without mMetricsMutex, which event processing holds for every event.
+    // Adding or removing a manager holds mMetricsMutex and this lock exclusively, the queries hold
+    // this lock shared and only read the atomic metadata of the managers.
+    mutable std::shared_mutex mMetricsManagersMapMutex;
+
+    // Entries of mMetricsManagers, in its iteration order.
+    using MetricsManagerList = std::vector<std::pair<const ConfigKey, sp<MetricsManager>>*>;
+
+    // Maps each atom id that a config is interested in to the metrics managers that receive it.
+    // Points into mMetricsManagers, so it is rebuilt whenever a config is added, updated or
+    // removed.
+    std::unordered_map<int, MetricsManagerList> mAtomIdToMetricsManagers;
+
+    // The metrics managers that receive every event, including the atoms that no config is
+    // interested in. Also part of every list in mAtomIdToMetricsManagers.
+    MetricsManagerList mMetricsManagersForAllAtoms;
+
+    // Last time the byte sizes of all the metrics managers were checked, including the ones that
+    // the recent events were not dispatched to.
+    int64_t mLastByteSizeSweepNs = 0;
+
+    // Lanes that dispatchLogEventLocked spreads the metrics managers over. Null when events are
+    // dispatched serially.
+    std::unique_ptr<LaneExecutor> mMetricsManagerLanes;
+
+    // See setSpillPastBuckets.
+    bool mSpillPastBuckets = false;
+
+    // The simple matcher results of the current event, reused across the metrics managers so that
+    // matchers that several configs define identically are evaluated once. Only handed to the
+    // managers while events are dispatched serially.
+    const std::shared_ptr<SharedMatcherResults> mSharedMatcherResults =
+            std::make_shared<SharedMatcherResults>();
+
+    // The states of the predicates that several configs define identically. Like the matcher
+    // results, only used while events are dispatched serially.
+    const std::shared_ptr<SharedConditionRegistry> mSharedConditions =
+            std::make_shared<SharedConditionRegistry>();
+
     std::unordered_map<ConfigKey, int64_t> mLastBroadcastTimes;
 
     // Last time we sent a broadcast to this uid that the active configs had changed.
@@ -202,6 +324,10 @@ private:
     // Tracks the number of times a config with a specified config key has been dumped.
     std::unordered_map<ConfigKey, int32_t> mDumpReportNumbers;
 
+    // The encoders of the last report of each config, reused by its next report. Not guarded by
+    // mMetricsMutex, as reports are encoded after it is released.
+    ProtoOutputStreamPool mReportProtoPool{kMaxPooledReportBytes};
+
     // Tracks when we last checked the ttl for restricted metrics.
     int64_t mLastTtlTime;
 
@@ -224,18 +350,108 @@ private:
 
     std::shared_ptr<LogEventFilter> mLogEventFilter;
 
+    // The fields the configs read per atom, as last given to mLogEventFilter. Atoms missing
+    // from it are read whole.
+    AtomFieldMasks mAtomFieldMasks;
+
+    // Counts the updates of mAtomFieldMasks.
+    uint64_t mAtomFieldMasksGeneration = 0;
+
     void OnLogEvent(LogEvent* event, int64_t elapsedRealtimeNs);
 
-    void resetIfConfigTtlExpiredLocked(const int64_t eventTimeNs);
+    // Notes the event in StatsdStats, applies the hard-coded atom handling and updates the
+    // states. Returns false if the event is invalid and must not be dispatched further.
+    bool preprocessLogEventLocked(LogEvent* event);
 
-    void OnConfigUpdatedLocked(const int64_t currentTimestampNs, const ConfigKey& key,
-                               const StatsdConfig& config, bool modularUpdate);
+    // Checks that only depend on the current time and not on the individual event.
+    void runPeriodicHousekeepingLocked(int64_t elapsedRealtimeNs);
+
+    // Passes the event to the metrics managers interested in it and sends the activation
+    // broadcasts.
+    void dispatchLogEventLocked(LogEvent* event, int64_t elapsedRealtimeNs);
+
+    // Checks the byte size of every metrics manager at most once per
+    // kMinByteSizeCheckPeriodNs, so that managers no recent event was dispatched to still hit
+    // their memory guardrails.
+    void flushAllIfNecessaryLocked(int64_t elapsedRealtimeNs);
+
+    void queueAppChange(PackageChange change);
 
-    void GetActiveConfigsLocked(const int uid, vector<int64_t>& outActiveConfigs);
+    // Applies mPendingAppChanges to the MetricsManagers and the StateManager.
+    void applyPendingAppChangesLocked();
+
+    // A config rebuilt without mMetricsMutex when its TTL expired, see prebuildExpiredConfigs().
+    struct PrebuiltConfig {
+        // The MetricsManager the config was rebuilt for. The rebuilt one is dropped if another
+        // config update replaced it meanwhile.
+        sp<MetricsManager> replaced;
+
+        // Unset if the config could not be read from disk.
+        std::optional<StatsdConfig> config;
+
+        sp<MetricsManager> metricsManager;
+    };
+
+    // Reads the configs whose TTL expired at timestampNs from disk and builds their new
+    // MetricsManagers, holding mMetricsMutex only to find them.
+    std::map<ConfigKey, PrebuiltConfig> prebuildExpiredConfigs(int64_t timestampNs);
+
+    // Resets the configs whose TTL expired. The ones in prebuilt are not rebuilt under the lock.
+    // The MetricsManagers they replace are appended to retired if it is set, see
+    // installConfigLocked().
+    void resetIfConfigTtlExpiredLocked(const int64_t eventTimeNs,
+                                       std::map<ConfigKey, PrebuiltConfig>* prebuilt = nullptr,
+                                       std::vector<sp<MetricsManager>>* retired = nullptr);
+
+    void OnConfigUpdatedLocked(const int64_t currentTimestampNs, const ConfigKey& key,
+                               const StatsdConfig& config, bool modularUpdate,
+                               const sp<MetricsManager>& prebuilt = nullptr,
+                               std::vector<sp<MetricsManager>>* retired = nullptr);
+
+    // OnConfigUpdatedLocked without updating the maps built from all the configs, for callers
+    // that set up several configs and then update the maps once.
+    //
+    // prebuilt, if set, is the MetricsManager of config from buildMetricsManager(), used if the
+    // config is installed in a new MetricsManager. If retired is set, the MetricsManager the
+    // config replaces is moved there rather than destroyed, so that the caller can release it
+    // after mMetricsMutex.
+    void installConfigLocked(const int64_t currentTimestampNs, const ConfigKey& key,
+                             const StatsdConfig& config, bool modularUpdate,
+                             const sp<MetricsManager>& prebuilt = nullptr,
+                             std::vector<sp<MetricsManager>>* retired = nullptr);
+
+    // Whether installConfigLocked() puts config in a new MetricsManager rather than updating the
+    // current one of key in place.
+    bool needsNewMetricsManagerLocked(const ConfigKey& key, const StatsdConfig& config,
+                                      bool modularUpdate) const;
+
+    // Builds the MetricsManager of a config without mMetricsMutex, so that events are processed
+    // by the MetricsManager it replaces meanwhile. It is not registered with the StateManager,
+    // the puller manager, the periodic alarm monitor, nor the shared condition states until
+    // adoptMetricsManagerLocked(), so it can be dropped at any time before that.
+    sp<MetricsManager> buildMetricsManager(const ConfigKey& key, const StatsdConfig& config,
+                                           int64_t currentTimestampNs) const;
+
+    // Completes the registration of a MetricsManager from buildMetricsManager(). Returns false if
+    // the MetricsManager can no longer be used, because another config shares the state of one
+    // of its predicates since. installConfigLocked() then builds the config again under
+    // mMetricsMutex, which costs the prebuild but keeps the predicate shared.
+    bool adoptMetricsManagerLocked(const sp<MetricsManager>& metricsManager,
+                                   const StatsdConfig& config);
 
     void WriteActiveConfigsToProtoOutputStreamLocked(
             int64_t currentTimeNs, const DumpReportReason reason, ProtoOutputStream* proto);
 
+    // SaveActiveConfigsToDisk and SaveMetadataToDisk without the cool down, which only applies
+    // to the saves on shutdown.
+    void SaveActiveConfigsToDiskLocked(int64_t currentTimeNs, const DumpReportReason reason);
+    void SaveMetadataToDiskLocked(int64_t currentWallClockTimeNs, int64_t systemElapsedTimeNs);
+
+    // Saves the activations and the metadata every kStateCheckpointPeriodNs, so that a statsd
+    // that dies without saving them restarts from the last checkpoint.
+    void checkpointStateIfNecessaryLocked(const int64_t wallClockNs,
+                                          const int64_t elapsedRealtimeNs);
+
     void SetConfigsActiveStateLocked(const ActiveConfigList& activeConfigList,
                                      int64_t currentTimeNs);
 
@@ -255,6 +471,19 @@ private:
                                const DumpReportReason dumpReportReason,
                                const DumpLatency dumpLatency);
 
+    // Writes the report of key to disk, without updating the state of the processor itself, so
+    // that the reports of different configs can be written concurrently. Returns true if a report
+    // was written.
+    bool writeConfigDataToDiskLocked(const ConfigKey& key, int64_t timestampNs,
+                                     const int64_t wallClockNs,
+                                     const DumpReportReason dumpReportReason,
+                                     const DumpLatency dumpLatency);
+
+    // Writes the closed buckets of key to disk and erases them from memory, leaving the current
+    // buckets and the uid map changes for the next report. Returns true if anything was written.
+    bool spillPastBucketsLocked(const ConfigKey& key, MetricsManager& metricsManager,
+                                int64_t elapsedRealtimeNs);
+
     void onConfigMetricsReportLocked(
             const ConfigKey& key, int64_t dumpTimeStampNs, int64_t wallClockNs,
             const bool include_current_partial_bucket, const bool erase_data,
@@ -263,6 +492,67 @@ private:
              (e.g., before reboot). So no need to further persist local history.*/
             const bool dataSavedToDisk, vector<uint8_t>* proto);
 
+    // Writes the ConfigMetricsReport of key into proto. Returns false if there is no report to
+    // write for key.
+    bool writeConfigMetricsReportLocked(const ConfigKey& key, int64_t dumpTimeStampNs,
+                                        int64_t wallClockNs,
+                                        const bool include_current_partial_bucket,
+                                        const bool erase_data,
+                                        const DumpReportReason dumpReportReason,
+                                        const DumpLatency dumpLatency, ProtoOutputStream* proto);
+
+    // What a ConfigMetricsReport is written from, detached from the MetricsManager so that it can
+    // be written without holding mMetricsMutex.
+    struct ConfigMetricsReportSnapshot {
+        MetricsManager::DumpReportSnapshot metrics;
+        int64_t dumpTimeNs;
+        int64_t wallClockNs;
+        int64_t lastReportTimeNs;
+        int64_t lastReportWallClockNs;
+        DumpReportReason dumpReportReason;
+        bool hasMetrics;
+        bool versionStringsInReport;
+        bool installerInReport;
+        bool uidMapDeltaInReport;
+        uint8_t packageCertificateHashSizeBytes;
+        bool hashStringInReport;
+    };
+
+    // Records the fields of the ConfigMetricsReport of key other than its metrics, which callers
+    // take from the MetricsManager themselves. Returns false if there is no report for key.
+    bool takeConfigMetricsReportSnapshotLocked(const ConfigKey& key, int64_t dumpTimeStampNs,
+                                               int64_t wallClockNs,
+                                               const DumpReportReason dumpReportReason,
+                                               ConfigMetricsReportSnapshot* snapshot);
+
+    static void fillConfigMetricsReportSnapshot(const MetricsManager& metricsManager,
+                                                int64_t dumpTimeStampNs, int64_t wallClockNs,
+                                                const DumpReportReason dumpReportReason,
+                                                ConfigMetricsReportSnapshot* snapshot);
+
+    // Writes the ConfigMetricsReport of a snapshot into proto. Needs no lock.
+    void writeConfigMetricsReport(const ConfigKey& key,
+                                  const ConfigMetricsReportSnapshot& snapshot,
+                                  ProtoOutputStream* proto);
+
+    // Writes the fields of the ConfigMetricsReport that follow its metrics.
+    void writeConfigMetricsReportFields(const ConfigKey& key,
+                                        const ConfigMetricsReportSnapshot& snapshot,
+                                        StringSet* str_set, ProtoOutputStream* proto);
+
+    // Writes the fields of the ConfigMetricsReportList of key that precede the current report.
+    void writeDumpReportHeaderLocked(const ConfigKey& key, const bool erase_data,
+                                     const DumpReportReason dumpReportReason,
+                                     ProtoOutputStream* proto);
+
+    // Returns the number of the report of key, counting it if erase_data is set.
+    int32_t nextDumpReportNumberLocked(const ConfigKey& key, const bool erase_data);
+
+    // Writes the fields of a ConfigMetricsReportList that follow the current report.
+    static void writeDumpReportTrailer(const int32_t reportNumber, ProtoOutputStream* proto);
+
+    static void saveLocalHistory(const ConfigKey& key, const vector<uint8_t>& buffer);
+
     /* Check if it is time enforce data ttls for restricted metrics, and if it is, enforce ttls
      * on all restricted metrics. */
     void enforceDataTtlsIfNecessaryLocked(const int64_t wallClockNs,
@@ -308,8 +598,10 @@ private:
 
     // Reset all configs.
     void resetConfigsLocked(const int64_t timestampNs);
-    // Reset the specified configs.
-    void resetConfigsLocked(const int64_t timestampNs, const std::vector<ConfigKey>& configs);
+    // Reset the specified configs, see resetIfConfigTtlExpiredLocked() for prebuilt and retired.
+    void resetConfigsLocked(const int64_t timestampNs, const std::vector<ConfigKey>& configs,
+                            std::map<ConfigKey, PrebuiltConfig>* prebuilt = nullptr,
+                            std::vector<sp<MetricsManager>>* retired = nullptr);
 
     // An anomaly alarm should have fired.
     // Check with anomaly alarm manager to find the alarms and process the result.
@@ -325,7 +617,15 @@ private:
     void flushRestrictedDataIfNecessaryLocked(const int64_t elapsedRealtimeNs);
 
     /* Tells LogEventFilter about atom ids to parse */
-    void updateLogEventFilterLocked() const;
+    void updateLogEventFilterLocked();
+
+    // Events are read from the socket with the field masks of the configs installed back then.
+    // Widens the mask of a queued event to the fields the current configs read, so that a config
+    // update made while the event was queued reads all of its fields.
+    void widenFieldMaskLocked(LogEvent* event) const;
+
+    /* Rebuilds mAtomIdToMetricsManagers and mMetricsManagersForAllAtoms */
+    void updateAtomIdToMetricsManagersLocked();
 
     void writeDataCorruptedReasons(ProtoOutputStream& proto);
 
@@ -363,13 +663,28 @@ private:
     //Last time we wrote metadata to disk.
     int64_t mLastMetadataWriteNs = 0;
 
+    // Last time the activations and the metadata were checkpointed.
+    int64_t mLastStateCheckpointNs = 0;
+
+    // Hashes of the content last written to the active metrics and metadata files, so that a
+    // save that would write the same content again leaves the file as it is. Reset once the
+    // file is deleted.
+    optional<uint64_t> mLastActiveMetricsHash;
+    optional<uint64_t> mLastMetadataHash;
+
     // The time for the next anomaly alarm for alerts.
     int64_t mNextAnomalyAlarmTime = 0;
 
     bool mPrintAllLogs = false;
 
+    // Whether runPeriodicHousekeeping is called on a timer instead of from OnLogEvent.
+    bool mPeriodicHousekeepingScheduled = false;
+
     friend class StatsLogProcessorTestRestricted;
     FRIEND_TEST(StatsLogProcessorTest, TestOutOfOrderLogs);
+    FRIEND_TEST(StatsLogProcessorTest, TestSpilledPastBucketsMergedIntoReport);
+    FRIEND_TEST(StatsLogProcessorTest, TestAppChangesAppliedInOnePass);
+    FRIEND_TEST(StatsLogProcessorTest, TestMetadataQueriesWithoutMetricsMutex);
     FRIEND_TEST(StatsLogProcessorTest, TestRateLimitByteSize);
     FRIEND_TEST(StatsLogProcessorTest, TestRateLimitBroadcast);
     FRIEND_TEST(StatsLogProcessorTest, TestDropWhenByteSizeTooLarge);
@@ -385,6 +700,8 @@ private:
     FRIEND_TEST(StatsLogProcessorTest, TestEmptyConfigHasNoUidMap);
     FRIEND_TEST(StatsLogProcessorTest, TestReportIncludesSubConfig);
     FRIEND_TEST(StatsLogProcessorTest, TestPullUidProviderSetOnConfigUpdate);
+    FRIEND_TEST(StatsLogProcessorTest, TestPrebuiltConfigSharingLivePredicateRebuilt);
+    FRIEND_TEST(StatsLogProcessorTest, TestLogEventOnlyDispatchedToInterestedConfigs);
     FRIEND_TEST(StatsLogProcessorTestRestricted, TestInconsistentRestrictedMetricsConfigUpdate);
     FRIEND_TEST(StatsLogProcessorTestRestricted, TestRestrictedLogEventPassed);
     FRIEND_TEST(StatsLogProcessorTestRestricted, TestRestrictedLogEventNotPassed);
@@ -441,7 +758,13 @@ private:
     FRIEND_TEST(AnomalyDurationDetectionE2eTest, TestDurationMetric_SUM_long_refractory_period);
 
     FRIEND_TEST(AlarmE2eTest, TestMultipleAlarms);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmFiredWhileConfigRemoved);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmFiredWhileConfigUpdated);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmsFiredDuringConfigChanges);
+    FRIEND_TEST(ConfigCostEstimatorTest, TestEstimateWithoutProcessorLock);
+    FRIEND_TEST(StatsServiceTest, TestEventsQueuedBeforeStopAreProcessed);
     FRIEND_TEST(ConfigTtlE2eTest, TestCountMetric);
+    FRIEND_TEST(ConfigTtlE2eTest, TestTtlCheckedByScheduledHousekeeping);
     FRIEND_TEST(MetricActivationE2eTest, TestCountMetric);
     FRIEND_TEST(MetricActivationE2eTest, TestCountMetricWithOneDeactivation);
     FRIEND_TEST(MetricActivationE2eTest, TestCountMetricWithTwoDeactivations);
@@ -468,6 +791,7 @@ private:
     FRIEND_TEST(DurationMetricE2eTest, TestWithActivation);
     FRIEND_TEST(DurationMetricE2eTest, TestWithCondition);
     FRIEND_TEST(DurationMetricE2eTest, TestWithSlicedCondition);
+    FRIEND_TEST(DurationMetricE2eTest, TestWithPartiallyLinkedSlicedCondition);
     FRIEND_TEST(DurationMetricE2eTest, TestWithActivationAndSlicedCondition);
     FRIEND_TEST(DurationMetricE2eTest, TestWithSlicedState);
     FRIEND_TEST(DurationMetricE2eTest, TestWithConditionAndSlicedState);
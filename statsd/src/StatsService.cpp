@@ -34,15 +34,20 @@
 #include <unistd.h>
 #include <utils/String16.h>
 
+#include <algorithm>
+
 #include "android-base/stringprintf.h"
 #include "config/ConfigKey.h"
 #include "config/ConfigManager.h"
 #include "flags/FlagProvider.h"
 #include "guardrail/StatsdStats.h"
+#include "logd/LogEventPool.h"
+#include "socket/DatagramRecorder.h"
 #include "stats_log_util.h"
 #include "storage/StorageManager.h"
 #include "subscriber/SubscriberReporter.h"
 #include "utils/DbUtils.h"
+#include "utils/ReaderPriorityBooster.h"
 
 using namespace android;
 
@@ -223,13 +228,30 @@ StatsService::StatsService(const sp<UidMap>& uidMap, shared_ptr<LogEventQueue> q
             },
             logEventFilter);
 
+    if (FlagProvider::getInstance().getBootFlagBool(METRICS_MANAGER_LANES_FLAG, FLAG_FALSE)) {
+        mProcessor->setMetricsManagerLaneCount(std::thread::hardware_concurrency());
+    }
+    if (FlagProvider::getInstance().getBootFlagBool(PARSE_LANES_FLAG, FLAG_FALSE)) {
+        const size_t laneCount =
+                std::min<size_t>(std::thread::hardware_concurrency(), kMaxParseLanes);
+        if (laneCount > 1) {
+            mParseLanes = std::make_unique<LaneExecutor>(laneCount);
+        }
+    }
+    mProcessor->setSpillPastBuckets(
+            FlagProvider::getInstance().getBootFlagBool(SPILL_PAST_BUCKETS_FLAG, FLAG_FALSE));
+    StorageManager::setCompressReports(
+            FlagProvider::getInstance().getBootFlagBool(COMPRESSED_REPORTS_FLAG, FLAG_FALSE));
+
     mUidMap->setListener(mProcessor);
     mConfigManager->AddListener(mProcessor);
 
     init_system_properties();
 
     if (mEventQueue != nullptr) {
+        mProcessor->setPeriodicHousekeepingScheduled(true);
         mLogsReaderThread = std::make_unique<std::thread>([this] { readLogs(); });
+        mHousekeepingThread = std::make_unique<std::thread>([this] { runHousekeeping(); });
     }
 }
 
@@ -238,29 +260,111 @@ StatsService::~StatsService() {
     if (mEventQueue != nullptr) {
         stopReadingLogs();
         mLogsReaderThread->join();
+        stopHousekeeping();
+        mHousekeepingThread->join();
+    }
+}
+
+/* Runs on a dedicated thread to do the processor's periodic checks, independent of event rate. */
+void StatsService::runHousekeeping() {
+    std::unique_lock<std::mutex> lk(mHousekeepingStopMutex);
+    while (!mHousekeepingStopFlag.wait_for(lk, kHousekeepingInterval,
+                                           [this] { return mHousekeepingStopRequested; })) {
+        lk.unlock();
+        mProcessor->runPeriodicHousekeeping(getElapsedRealtimeNs());
+        lk.lock();
     }
 }
 
+void StatsService::stopHousekeeping() {
+    {
+        std::lock_guard<std::mutex> lk(mHousekeepingStopMutex);
+        mHousekeepingStopRequested = true;
+    }
+    mHousekeepingStopFlag.notify_all();
+}
+
+std::optional<uint64_t> StatsService::parseBatchBodies(
+        const std::vector<std::unique_ptr<LogEvent>>& events) {
+    if (mParseLanes == nullptr || events.size() < kMinParallelParseBatchSize) {
+        // The bodies are parsed on first access by the processor.
+        return std::nullopt;
+    }
+    // The lanes parse without the lock of the processor, so the events first take the fields
+    // the current configs read.
+    const uint64_t fieldMasksGeneration = mProcessor->widenFieldMasks(events);
+    // Each lane parses a contiguous range of the batch. The batch keeps the order of the
+    // queue, so the processor still sees the events in the order they were read.
+    const size_t numLanes = mParseLanes->getNumLanes();
+    const size_t perLane = (events.size() + numLanes - 1) / numLanes;
+    mParseLanes->runOnEveryLane([&events, perLane](size_t lane) {
+        const size_t end = std::min(events.size(), (lane + 1) * perLane);
+        for (size_t i = lane * perLane; i < end; i++) {
+            events[i]->parseDeferredBodyNow();
+        }
+    });
+    return fieldMasksGeneration;
+}
+
 /* Runs on a dedicated thread to process pushed events. */
 void StatsService::readLogs() {
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.reserve(kMaxLogEventsBatchSize);
+    ReaderPriorityBooster booster(kReaderBoostThresholdNs, kReaderRestoreThresholdNs,
+                                  kBoostedReaderNice);
     // Read forever..... long live statsd
     while (1) {
-        // Block until an event is available.
-        auto event = mEventQueue->waitPop();
+        // Block until at least one event is available, then take everything already queued.
+        events.clear();
+        mEventQueue->waitPopBatch(events, kMaxLogEventsBatchSize);
 
         // Below flag will be set when statsd is exiting and log event will be pushed to break
-        // out of waitPop.
+        // out of waitPopBatch. The events queued before that one are still processed.
+        bool stopping = false;
         if (mIsStopRequested) {
-            break;
+            const LogEvent* stopEvent = mStopEvent;
+            const auto it = std::find_if(events.begin(), events.end(),
+                                         [stopEvent](const std::unique_ptr<LogEvent>& event) {
+                                             return event.get() == stopEvent;
+                                         });
+            // Without the stop event the queue was full, so this batch is the last one.
+            stopping = stopEvent == nullptr || it != events.end();
+            events.erase(it, events.end());
+            if (events.empty()) {
+                break;
+            }
         }
 
-        // Pass it to StatsLogProcess to all configs/metrics
+        // The first event of the batch waited in the queue the longest.
+        const int64_t enqueueTimestampNs = events.front()->getEnqueueTimestampNs();
+        if (enqueueTimestampNs > 0) {
+            const int64_t residencyNs = getElapsedRealtimeNs() - enqueueTimestampNs;
+            StatsdStats::getInstance().noteEventQueueResidency(residencyNs);
+            if (booster.onBatch(residencyNs)) {
+                StatsdStats::getInstance().noteEventQueueReaderBoosted();
+            }
+        }
+
+        // OnLogEvents() parses again the bodies that a config update since needs more fields of.
+        const std::optional<uint64_t> fieldMasksGeneration = parseBatchBodies(events);
+
+        // Pass the batch to StatsLogProcess to all configs/metrics
         // At this point, the LogEventQueue is not blocked, so that the socketListener
         // can read events from the socket and write to buffer to avoid data drop.
-        mProcessor->OnLogEvent(event.get());
-        // The ShellSubscriber is only used by shell for local debugging.
+        mProcessor->OnLogEvents(events, fieldMasksGeneration);
+        // The ShellSubscriber is only used by shell for local debugging. It takes the events
+        // its subscriptions want and delivers them on its own thread.
         if (mShellSubscriber != nullptr) {
-            mShellSubscriber->onLogEvent(*event);
+            for (std::unique_ptr<LogEvent>& event : events) {
+                mShellSubscriber->queueLogEvent(event);
+            }
+        }
+        // Nothing refers to the remaining events past this point, so the socket listener can
+        // reuse them.
+        LogEventPool::getInstance().recycle(events);
+
+        if (stopping) {
+            break;
         }
     }
 }
@@ -331,11 +435,26 @@ void StatsService::dumpStatsdStats(int out, bool verbose, bool proto) {
             dprintf(out, "%c", data[i]);
         }
     } else {
+        if (verbose && !noteVerboseDumpIfAllowed(getElapsedRealtimeNs())) {
+            dprintf(out, "Verbose dump rate limited, at most one per %llds.\n",
+                    (long long)(kMinVerboseDumpIntervalNs / NS_PER_SEC));
+            verbose = false;
+        }
         StatsdStats::getInstance().dumpStats(out);
         mProcessor->dumpStates(out, verbose);
     }
 }
 
+bool StatsService::noteVerboseDumpIfAllowed(int64_t elapsedRealtimeNs) {
+    int64_t lastDumpNs = mLastVerboseDumpNs.load();
+    do {
+        if (lastDumpNs != 0 && elapsedRealtimeNs - lastDumpNs < kMinVerboseDumpIntervalNs) {
+            return false;
+        }
+    } while (!mLastVerboseDumpNs.compare_exchange_weak(lastDumpNs, elapsedRealtimeNs));
+    return true;
+}
+
 /**
  * Write stats report data in StatsDataDumpProto incident section format.
  */
@@ -422,6 +541,14 @@ status_t StatsService::handleShellCommand(int in, int out, int err, const char**
             return cmd_print_logs(out, utf8Args);
         }
 
+        if (!utf8Args[0].compare(String8("record-datagrams"))) {
+            return cmd_record_datagrams(out, utf8Args);
+        }
+
+        if (!utf8Args[0].compare(String8("estimate-config-cost"))) {
+            return cmd_estimate_config_cost(in, out, err, utf8Args);
+        }
+
         if (!utf8Args[0].compare(String8("send-active-configs"))) {
             return cmd_trigger_active_config_broadcast(out, utf8Args);
         }
@@ -560,6 +687,19 @@ void StatsService::print_cmd_help(int out) {
     dprintf(out, "usage: adb shell cmd stats print-logs\n");
     dprintf(out, "  Requires root privileges.\n");
     dprintf(out, "  Can be disabled by calling adb shell cmd stats print-logs 0\n");
+    dprintf(out, "\n");
+    dprintf(out, "usage: adb exec-out cmd stats record-datagrams [SECONDS] > trace\n");
+    dprintf(out, "  Requires root privileges.\n");
+    dprintf(out, "  Writes the datagrams received from the statsd socket in the next SECONDS\n");
+    dprintf(out, "  seconds, 10 by default, as a trace for statsd_benchmark's BM_ReplayTrace.\n");
+    dprintf(out, "  Atoms that no config uses are not filtered out while these are received.\n");
+    dprintf(out, "\n");
+    dprintf(out, "usage: adb shell cmd stats estimate-config-cost [SECONDS] < config\n");
+    dprintf(out, "  Requires root privileges.\n");
+    dprintf(out, "  Estimates the events per second, the cost per event and the memory of the\n");
+    dprintf(out, "  binary StatsdConfig read from stdin, without adding it. The config is run\n");
+    dprintf(out, "  on the datagrams received in the next SECONDS seconds, 10 by default.\n");
+    dprintf(out, "  Atoms that no config uses are not filtered out while these are received.\n");
 }
 
 status_t StatsService::cmd_trigger_broadcast(int out, Vector<String8>& args) {
@@ -757,15 +897,16 @@ status_t StatsService::cmd_dump_report(int out, const Vector<String8>& args) {
             name.assign(args[2].c_str(), args[2].size());
         }
         if (good) {
-            vector<uint8_t> data;
-            mProcessor->onDumpReport(ConfigKey(uid, StrToInt64(name)), getElapsedRealtimeNs(),
-                                     getWallClockNs(), includeCurrentBucket, eraseData, ADB_DUMP,
-                                     NO_TIME_CONSTRAINTS, &data);
             if (proto) {
-                for (size_t i = 0; i < data.size(); i ++) {
-                    dprintf(out, "%c", data[i]);
-                }
+                mProcessor->onDumpReport(ConfigKey(uid, StrToInt64(name)), getElapsedRealtimeNs(),
+                                         getWallClockNs(), includeCurrentBucket, eraseData,
+                                         ADB_DUMP, NO_TIME_CONSTRAINTS,
+                                         /*writeSizePrefix=*/false, out);
             } else {
+                vector<uint8_t> data;
+                mProcessor->onDumpReport(ConfigKey(uid, StrToInt64(name)), getElapsedRealtimeNs(),
+                                         getWallClockNs(), includeCurrentBucket, eraseData,
+                                         ADB_DUMP, NO_TIME_CONSTRAINTS, &data);
                 dprintf(out, "Non-proto stats data dump not currently supported.\n");
             }
             return android::OK;
@@ -959,6 +1100,82 @@ status_t StatsService::cmd_print_logs(int out, const Vector<String8>& args) {
     return NO_ERROR;
 }
 
+status_t StatsService::cmd_record_datagrams(int out, const Vector<String8>& args) {
+    Status status = checkUid(AID_ROOT);
+    if (!status.isOk()) {
+        return PERMISSION_DENIED;
+    }
+
+    int durationSec = 10;
+    if (args.size() >= 2) {
+        durationSec = atoi(args[1].c_str());
+    }
+    if (durationSec <= 0) {
+        return BAD_VALUE;
+    }
+    VLOG("StatsService::cmd_record_datagrams for %d seconds", durationSec);
+    // The trace is replayed against other configs, so it keeps the atoms no config uses.
+    mLogEventFilter->suspendFiltering();
+    const bool recorded = DatagramRecorder::getInstance().record(out, durationSec);
+    mLogEventFilter->resumeFiltering();
+    if (!recorded) {
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+status_t StatsService::cmd_estimate_config_cost(int in, int out, int err,
+                                                const Vector<String8>& args) {
+    Status status = checkUid(AID_ROOT);
+    if (!status.isOk()) {
+        return PERMISSION_DENIED;
+    }
+
+    int durationSec = 10;
+    if (args.size() >= 2) {
+        durationSec = atoi(args[1].c_str());
+    }
+    if (durationSec <= 0) {
+        return BAD_VALUE;
+    }
+
+    string buffer;
+    if (!android::base::ReadFdToString(in, &buffer)) {
+        dprintf(err, "Error reading stream for StatsConfig.\n");
+        return UNKNOWN_ERROR;
+    }
+    StatsdConfig config;
+    if (!config.ParseFromString(buffer)) {
+        dprintf(err, "Error parsing proto stream for StatsConfig.\n");
+        return UNKNOWN_ERROR;
+    }
+
+    VLOG("StatsService::cmd_estimate_config_cost on %d seconds of datagrams", durationSec);
+    vector<DatagramRecord> sample;
+    // The atoms that only the config uses are dropped by the socket filter otherwise.
+    mLogEventFilter->suspendFiltering();
+    const bool recorded = DatagramRecorder::getInstance().recordSample(durationSec, &sample);
+    mLogEventFilter->resumeFiltering();
+    if (!recorded) {
+        dprintf(err, "Error recording the datagrams, is a recording in progress?\n");
+        return UNKNOWN_ERROR;
+    }
+    ConfigCostEstimate estimate;
+    if (mProcessor == nullptr || !mProcessor->estimateConfigCost(config, sample, &estimate)) {
+        dprintf(err, "The config is invalid.\n");
+        return UNKNOWN_ERROR;
+    }
+
+    dprintf(out, "Events per second: %.2f (from the %s)\n", estimate.eventsPerSec,
+            estimate.rateFromSample ? "sample and statsd stats" : "atom counts of statsd stats");
+    dprintf(out, "Sample events: %lld\n", (long long)estimate.sampleEventCount);
+    dprintf(out, "Cost per event: %lld ns\n", (long long)estimate.costPerEventNs);
+    dprintf(out, "CPU load: %.4f%%\n",
+            estimate.eventsPerSec * estimate.costPerEventNs * 100 / NS_PER_SEC);
+    dprintf(out, "Memory: %zu bytes\n", estimate.memoryBytes);
+    return NO_ERROR;
+}
+
 bool StatsService::getUidFromArgs(const Vector<String8>& args, size_t uidArgIndex, int32_t& uid) {
     return getUidFromString(args[uidArgIndex].c_str(), uid);
 }
@@ -1030,15 +1247,14 @@ Status StatsService::informAlarmForSubscriberTriggeringFired() {
     ENFORCE_UID(AID_SYSTEM);
 
     VLOG("StatsService::informAlarmForSubscriberTriggeringFired was called");
-    int64_t currentTimeSec = getElapsedRealtimeSec();
-    std::unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> alarmSet =
-            mPeriodicAlarmMonitor->popSoonerThan(static_cast<uint32_t>(currentTimeSec));
-    if (alarmSet.size() > 0) {
-        VLOG("Found periodic alarm fired.");
-        mProcessor->onPeriodicAlarmFired(currentTimeSec * NS_PER_SEC, alarmSet);
-    } else {
+    if (!firePeriodicAlarms(getElapsedRealtimeSec())) {
         ALOGW("Cannot find an periodic alarm that fired. Perhaps it was recently cancelled.");
     }
+    // Serve a pull alarm that is due too, rather than waiting for its own wakeup.
+    const int64_t elapsedRealtimeNs = getElapsedRealtimeNs();
+    if (mPullerManager->IsPullAlarmDue(elapsedRealtimeNs)) {
+        mProcessor->informPullAlarmFired(elapsedRealtimeNs);
+    }
     return Status::ok();
 }
 
@@ -1047,10 +1263,23 @@ Status StatsService::informPollAlarmFired() {
 
     VLOG("StatsService::informPollAlarmFired was called");
     mProcessor->informPullAlarmFired(getElapsedRealtimeNs());
+    // Serve the periodic alarms that are due too, rather than waiting for their own wakeup.
+    firePeriodicAlarms(getElapsedRealtimeSec());
     VLOG("StatsService::informPollAlarmFired succeeded");
     return Status::ok();
 }
 
+bool StatsService::firePeriodicAlarms(const int64_t currentTimeSec) {
+    std::unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> alarmSet =
+            mPeriodicAlarmMonitor->popSoonerThan(static_cast<uint32_t>(currentTimeSec));
+    if (alarmSet.empty()) {
+        return false;
+    }
+    VLOG("Found periodic alarm fired.");
+    mProcessor->onPeriodicAlarmFired(currentTimeSec * NS_PER_SEC, alarmSet);
+    return true;
+}
+
 Status StatsService::systemRunning() {
     ENFORCE_UID(AID_SYSTEM);
 
@@ -1069,6 +1298,8 @@ Status StatsService::informDeviceShutdown() {
     mProcessor->WriteDataToDisk(DEVICE_SHUTDOWN, FAST, elapsedRealtimeNs, wallClockNs);
     mProcessor->SaveActiveConfigsToDisk(elapsedRealtimeNs);
     mProcessor->SaveMetadataToDisk(wallClockNs, elapsedRealtimeNs);
+    // The device may power off once this returns.
+    StorageManager::waitForPendingWrites();
     return Status::ok();
 }
 
@@ -1149,6 +1380,8 @@ void StatsService::Terminate() {
                                     wallClockNs);
         mProcessor->SaveActiveConfigsToDisk(elapsedRealtimeNs);
         mProcessor->SaveMetadataToDisk(wallClockNs, elapsedRealtimeNs);
+        // The process exits once this returns, so the queued writes must be done by then.
+        StorageManager::waitForPendingWrites();
     }
 }
 
@@ -1177,23 +1410,13 @@ Status StatsService::getData(int64_t key, const int32_t callingUid, vector<uint8
 Status StatsService::getDataFd(int64_t key, const int32_t callingUid,
                                const ScopedFileDescriptor& fd) {
     ENFORCE_UID(AID_SYSTEM);
-    vector<uint8_t> reportData;
-    getDataChecked(key, callingUid, &reportData);
-
-    if (reportData.size() >= std::numeric_limits<int32_t>::max()) {
-        ALOGE("Report size is infeasible big and can not be returned");
-        return exception(EX_ILLEGAL_STATE, "Report size is infeasible big.");
-    }
-
-    const uint32_t bytesToWrite = static_cast<uint32_t>(reportData.size());
-    VLOG("StatsService::getDataFd report size %d", bytesToWrite);
-
-    // write 4 bytes of report size for correct buffer allocation
-    const uint32_t bytesToWriteBE = htonl(bytesToWrite);
-    if (!android::base::WriteFully(fd.get(), &bytesToWriteBE, sizeof(uint32_t))) {
-        return exception(EX_ILLEGAL_STATE, "Failed to write report data size to file descriptor");
-    }
-    if (!android::base::WriteFully(fd.get(), reportData.data(), reportData.size())) {
+    VLOG("StatsService::getDataFd with Uid %i", callingUid);
+    // The report is written to fd as it is encoded, so that it is not also copied into a buffer
+    // and then into fd.
+    if (!mProcessor->onDumpReport(ConfigKey(callingUid, key), getElapsedRealtimeNs(),
+                                  getWallClockNs(), false /* include_current_bucket*/,
+                                  true /* erase_data */, GET_DATA_CALLED, FAST,
+                                  /*writeSizePrefix=*/true, fd.get())) {
         return exception(EX_ILLEGAL_STATE, "Failed to write report data to file descriptor");
     }
 
@@ -1343,6 +1566,14 @@ Status StatsService::registerPullAtomCallback(int32_t uid, int32_t atomTag, int6
     return Status::ok();
 }
 
+Status StatsService::registerPullAtomCallbacks(
+        const vector<PullAtomCallbackRegistration>& registrations) {
+    ENFORCE_UID(AID_SYSTEM);
+    VLOG("StatsService::registerPullAtomCallbacks called.");
+    mPullerManager->RegisterPullAtomCallbacks(registrations);
+    return Status::ok();
+}
+
 Status StatsService::registerNativePullAtomCallback(
         int32_t atomTag, int64_t coolDownMillis, int64_t timeoutMillis,
         const std::vector<int32_t>& additiveFields,
@@ -1361,6 +1592,25 @@ Status StatsService::registerNativePullAtomCallback(
     return Status::ok();
 }
 
+Status StatsService::registerNativePullAtomCallbacks(
+        const vector<PullAtomCallbackRegistration>& registrations) {
+    if (!checkPermission(kPermissionRegisterPullAtom)) {
+        return exception(
+                EX_SECURITY,
+                StringPrintf("Uid %d does not have the %s permission when registering %zu atoms",
+                             AIBinder_getCallingUid(), kPermissionRegisterPullAtom,
+                             registrations.size()));
+    }
+    VLOG("StatsService::registerNativePullAtomCallbacks called.");
+    int32_t uid = AIBinder_getCallingUid();
+    vector<PullAtomCallbackRegistration> callingUidRegistrations = registrations;
+    for (PullAtomCallbackRegistration& registration : callingUidRegistrations) {
+        registration.uid = uid;
+    }
+    mPullerManager->RegisterPullAtomCallbacks(callingUidRegistrations);
+    return Status::ok();
+}
+
 Status StatsService::unregisterPullAtomCallback(int32_t uid, int32_t atomTag) {
     ENFORCE_UID(AID_SYSTEM);
     VLOG("StatsService::unregisterPullAtomCallback called.");
@@ -1504,6 +1754,18 @@ Status StatsService::addSubscription(const vector<uint8_t>& subscriptionConfig,
     return Status::ok();
 }
 
+Status StatsService::addSubscriptionWithSharedMemory(
+        const vector<uint8_t>& subscriptionConfig,
+        const shared_ptr<IStatsSubscriptionCallback>& callback,
+        const ScopedFileDescriptor& ringFd) {
+    ENFORCE_SID(kTracedProbesSid);
+
+    initShellSubscriber();
+
+    mShellSubscriber->startNewSubscription(subscriptionConfig, callback, ringFd.get());
+    return Status::ok();
+}
+
 Status StatsService::removeSubscription(const shared_ptr<IStatsSubscriptionCallback>& callback) {
     ENFORCE_SID(kTracedProbesSid);
 
@@ -1530,11 +1792,14 @@ void StatsService::initShellSubscriber() {
 }
 
 void StatsService::stopReadingLogs() {
-    mIsStopRequested = true;
     // Push this event so that readLogs will process and break out of the loop
     // after the stop is requested.
     std::unique_ptr<LogEvent> logEvent = std::make_unique<LogEvent>(/*uid=*/0, /*pid=*/0);
-    mEventQueue->push(std::move(logEvent));
+    mStopEvent = logEvent.get();
+    mIsStopRequested = true;
+    if (!mEventQueue->push(std::move(logEvent)).success) {
+        mStopEvent = nullptr;
+    }
 }
 
 }  // namespace statsd
@@ -21,20 +21,24 @@
 #include <aidl/android/os/IPendingIntentRef.h>
 #include <aidl/android/os/IPullAtomCallback.h>
 #include <aidl/android/os/IStatsSubscriptionCallback.h>
+#include <aidl/android/os/PullAtomCallbackRegistration.h>
 #include <aidl/android/util/PropertyParcel.h>
 #include <gtest/gtest_prod.h>
 #include <utils/Looper.h>
 
 #include <mutex>
+#include <optional>
 
 #include "StatsLogProcessor.h"
 #include "anomaly/AlarmMonitor.h"
 #include "config/ConfigManager.h"
 #include "external/StatsPullerManager.h"
+#include "guardrail/StatsdStats.h"
 #include "logd/LogEventQueue.h"
 #include "packages/UidMap.h"
 #include "shell/ShellSubscriber.h"
 #include "statscompanion_util.h"
+#include "utils/LaneExecutor.h"
 #include "utils/MultiConditionTrigger.h"
 
 using namespace android;
@@ -48,6 +52,7 @@ using aidl::android::os::IPendingIntentRef;
 using aidl::android::os::IPullAtomCallback;
 using aidl::android::os::IStatsQueryCallback;
 using aidl::android::os::IStatsSubscriptionCallback;
+using aidl::android::os::PullAtomCallbackRegistration;
 using aidl::android::util::PropertyParcel;
 using ::ndk::ScopedAIBinder_DeathRecipient;
 using ::ndk::ScopedFileDescriptor;
@@ -184,6 +189,12 @@ public:
             const vector<int32_t>& additiveFields,
             const shared_ptr<IPullAtomCallback>& pullerCallback) override;
 
+    /**
+     * Binder call to register the callback functions of many pulled atoms.
+     */
+    virtual Status registerPullAtomCallbacks(
+            const vector<PullAtomCallbackRegistration>& registrations) override;
+
     /**
      * Binder call to register a callback function for a pulled atom.
      */
@@ -192,6 +203,12 @@ public:
             const vector<int32_t>& additiveFields,
             const shared_ptr<IPullAtomCallback>& pullerCallback) override;
 
+    /**
+     * Binder call to register the callback functions of many pulled atoms for the calling uid.
+     */
+    virtual Status registerNativePullAtomCallbacks(
+            const vector<PullAtomCallbackRegistration>& registrations) override;
+
     /**
      * Binder call to unregister any existing callback for the given uid and atom.
      */
@@ -245,6 +262,14 @@ public:
     virtual Status addSubscription(const vector<uint8_t>& subscriptionConfig,
                                    const shared_ptr<IStatsSubscriptionCallback>& callback) override;
 
+    /**
+     * Binder call to add a subscription delivering its data through a shared memory ring.
+     */
+    virtual Status addSubscriptionWithSharedMemory(
+            const vector<uint8_t>& subscriptionConfig,
+            const shared_ptr<IStatsSubscriptionCallback>& callback,
+            const ScopedFileDescriptor& ringFd) override;
+
     /**
      * Binder call to remove a subscription.
      */
@@ -281,14 +306,48 @@ private:
      */
     void dumpStatsdStats(int outFd, bool verbose, bool proto);
 
+    // Returns true if a verbose text dump may be taken at elapsedRealtimeNs, and notes it. Verbose
+    // dumps walk every dimension of every metric under the metric locks, so at most one is taken
+    // per kMinVerboseDumpIntervalNs. The others are downgraded to regular dumps.
+    bool noteVerboseDumpIfAllowed(int64_t elapsedRealtimeNs);
+
+    static constexpr int64_t kMinVerboseDumpIntervalNs = 60 * NS_PER_SEC;
+
+    // Elapsed realtime of the last verbose dump, 0 if there was none.
+    std::atomic<int64_t> mLastVerboseDumpNs = 0;
+
     /**
      * Print usage information for the commands
      */
     void print_cmd_help(int out);
 
+    // Fires the periodic alarms due at currentTimeSec. Returns false if none was due.
+    bool firePeriodicAlarms(int64_t currentTimeSec);
+
     /* Runs on its dedicated thread to process pushed stats event from socket. */
     void readLogs();
 
+    // Maximum number of events popped from the LogEventQueue and processed under a single
+    // acquisition of the StatsLogProcessor lock.
+    static constexpr size_t kMaxLogEventsBatchSize = 64;
+
+    // Parses the deferred bodies of a batch on mParseLanes, if the batch is large enough to be
+    // worth the handoff. Returns once every body is parsed, with the generation of the field
+    // masks they were parsed with, see StatsLogProcessor::widenFieldMasks(). Returns nullopt if
+    // the bodies are left to the processor.
+    std::optional<uint64_t> parseBatchBodies(const std::vector<std::unique_ptr<LogEvent>>& events);
+
+    // Batches smaller than this are parsed by the processor as it reads them.
+    static constexpr size_t kMinParallelParseBatchSize = 16;
+    static constexpr size_t kMaxParseLanes = 4;
+
+    // The log reader raises its priority to kBoostedReaderNice while the events it reads have
+    // waited in the LogEventQueue for more than kReaderBoostThresholdNs, and drops back once
+    // they wait less than kReaderRestoreThresholdNs.
+    static constexpr int64_t kReaderBoostThresholdNs = 500 * 1000000LL;
+    static constexpr int64_t kReaderRestoreThresholdNs = 50 * 1000000LL;
+    static constexpr int kBoostedReaderNice = -4;
+
     /**
      * Trigger a broadcast.
      */
@@ -361,6 +420,16 @@ private:
      */
     status_t cmd_print_logs(int outFd, const Vector<String8>& args);
 
+    /**
+     * Write the datagrams received in the next seconds to outFd, see DatagramRecorder.
+     */
+    status_t cmd_record_datagrams(int outFd, const Vector<String8>& args);
+
+    /**
+     * Estimate the cost of the config read from inFd without adding it, see ConfigCostEstimator.
+     */
+    status_t cmd_estimate_config_cost(int inFd, int outFd, int err, const Vector<String8>& args);
+
     /**
      * Implementation for request data for the configuration key.
      */
@@ -420,6 +489,16 @@ private:
      */
     void stopReadingLogs();
 
+    /*
+     * Runs StatsLogProcessor::runPeriodicHousekeeping every kHousekeepingInterval.
+     */
+    void runHousekeeping();
+
+    /*
+     * This method is used to stop the housekeeping thread.
+     */
+    void stopHousekeeping();
+
     /*
      * Notify async StatsdInitCompleted handler about termination event
      */
@@ -427,6 +506,10 @@ private:
 
     std::atomic<bool> mIsStopRequested = false;
 
+    // The event stopReadingLogs() pushed, nullptr if the queue was full. Only compared with the
+    // events readLogs() pops.
+    std::atomic<const LogEvent*> mStopEvent = nullptr;
+
     /**
      * Tracks the uid <--> package name mapping.
      */
@@ -473,6 +556,18 @@ private:
 
     std::unique_ptr<std::thread> mLogsReaderThread;
 
+    // Parses the event bodies of the batches read by mLogsReaderThread. Null if disabled.
+    std::unique_ptr<LaneExecutor> mParseLanes;
+
+    // Matches the interval at which the puller cache is cleared, the most frequent of the checks.
+    static constexpr std::chrono::seconds kHousekeepingInterval{
+            StatsdStats::kPullerCacheClearIntervalSec};
+
+    std::unique_ptr<std::thread> mHousekeepingThread;
+    std::condition_variable mHousekeepingStopFlag;
+    std::mutex mHousekeepingStopMutex;
+    bool mHousekeepingStopRequested = false;
+
     std::condition_variable mStatsdInitCompletedHandlerTerminationFlag;
     std::mutex mStatsdInitCompletedHandlerTerminationFlagMutex;
     /**
@@ -499,15 +594,18 @@ private:
     FRIEND_TEST(StatsServiceTest, TestAddConfig_empty);
     FRIEND_TEST(StatsServiceTest, TestAddConfig_invalid);
     FRIEND_TEST(StatsServiceTest, TestGetUidFromArgs);
+    FRIEND_TEST(StatsServiceTest, TestVerboseDumpRateLimit);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricNoSplitOnNewApp);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricSplitOnBoot);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricSplitOnUpgrade);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricSplitOnRemoval);
+    FRIEND_TEST(PartialBucketE2eTest, TestCountMetricSplitOnceOnUpgradeBurst);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricWithoutSplit);
     FRIEND_TEST(PartialBucketE2eTest, TestCountMetricNoSplitOnUpgradeWhenDisabled);
     FRIEND_TEST(PartialBucketE2eTest, TestValueMetricOnBootWithoutMinPartialBucket);
     FRIEND_TEST(PartialBucketE2eTest, TestValueMetricWithoutMinPartialBucket);
     FRIEND_TEST(PartialBucketE2eTest, TestValueMetricWithMinPartialBucket);
+    FRIEND_TEST(PartialBucketE2eTest, TestValueMetricNoSplitOnUnrelatedUpgrade);
     FRIEND_TEST(PartialBucketE2eTest, TestGaugeMetricOnBootWithoutMinPartialBucket);
     FRIEND_TEST(PartialBucketE2eTest, TestGaugeMetricWithoutMinPartialBucket);
     FRIEND_TEST(PartialBucketE2eTest, TestGaugeMetricWithMinPartialBucket);
@@ -524,6 +622,7 @@ private:
     FRIEND_TEST(AnomalyDurationDetectionE2eTest, TestDurationMetric_SUM_long_refractory_period);
 
     FRIEND_TEST(StatsServiceStatsdInitTest, StatsServiceStatsdInitTest);
+    FRIEND_TEST(StatsServiceTest, TestEventsQueuedBeforeStopAreProcessed);
 };
 
 }  // namespace statsd
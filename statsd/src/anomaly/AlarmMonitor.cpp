@@ -45,7 +45,7 @@ void AlarmMonitor::setStatsCompanionService(
         return;
     }
     VLOG("Creating link to statsCompanionService");
-    const sp<const InternalAlarm> top = mPq.top();
+    const sp<const InternalAlarm> top = mAlarms.top();
     if (top != nullptr) {
         updateRegisteredAlarmTime_l(top->timestampSec);
     }
@@ -64,7 +64,7 @@ void AlarmMonitor::add(const sp<const InternalAlarm>& alarm) {
     }
     // TODO(b/110563466): Ensure that refractory period is respected.
     VLOG("Adding alarm with time %u", alarm->timestampSec);
-    mPq.push(alarm);
+    mAlarms.push(alarm);
     if (mRegisteredAlarmTimeSec < 1 ||
         alarm->timestampSec + mMinUpdateTimeSec < mRegisteredAlarmTimeSec) {
         updateRegisteredAlarmTime_l(alarm->timestampSec);
@@ -78,21 +78,45 @@ void AlarmMonitor::remove(const sp<const InternalAlarm>& alarm) {
         return;
     }
     VLOG("Removing alarm with time %u", alarm->timestampSec);
-    bool wasPresent = mPq.remove(alarm);
+    bool wasPresent = mAlarms.remove(alarm);
     if (!wasPresent) return;
-    if (mPq.empty()) {
+    if (mAlarms.empty()) {
         VLOG("Queue is empty. Cancel any alarm.");
         cancelRegisteredAlarmTime_l();
         return;
     }
-    uint32_t soonestAlarmTimeSec = mPq.top()->timestampSec;
+    uint32_t soonestAlarmTimeSec = mAlarms.top()->timestampSec;
     VLOG("Soonest alarm is %u", soonestAlarmTimeSec);
     if (soonestAlarmTimeSec > mRegisteredAlarmTimeSec + mMinUpdateTimeSec) {
         updateRegisteredAlarmTime_l(soonestAlarmTimeSec);
     }
 }
 
-// More efficient than repeatedly calling remove(mPq.top()) since it batches the
+void AlarmMonitor::replace(const sp<const InternalAlarm>& oldAlarm,
+                           const sp<const InternalAlarm>& newAlarm) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (newAlarm == nullptr || oldAlarm == nullptr) {
+        ALOGW("Asked to replace a null alarm.");
+        return;
+    }
+    if (newAlarm->timestampSec < 1) {
+        // forbidden since a timestamp 0 is used to indicate no alarm registered
+        ALOGW("Asked to add a 0-time alarm.");
+        return;
+    }
+    VLOG("Replacing alarm with time %u by alarm with time %u", oldAlarm->timestampSec,
+         newAlarm->timestampSec);
+    mAlarms.remove(oldAlarm);
+    mAlarms.push(newAlarm);
+    uint32_t soonestAlarmTimeSec = mAlarms.top()->timestampSec;
+    if (mRegisteredAlarmTimeSec < 1 ||
+        soonestAlarmTimeSec + mMinUpdateTimeSec < mRegisteredAlarmTimeSec ||
+        soonestAlarmTimeSec > mRegisteredAlarmTimeSec + mMinUpdateTimeSec) {
+        updateRegisteredAlarmTime_l(soonestAlarmTimeSec);
+    }
+}
+
+// More efficient than repeatedly calling remove(mAlarms.top()) since it batches the
 // updates to the registered alarm.
 unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> AlarmMonitor::popSoonerThan(
         uint32_t timestampSec) {
@@ -100,19 +124,17 @@ unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> AlarmMonitor::popS
     unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> oldAlarms;
     std::lock_guard<std::mutex> lock(mLock);
 
-    for (sp<const InternalAlarm> t = mPq.top(); t != nullptr && t->timestampSec <= timestampSec;
-        t = mPq.top()) {
-        oldAlarms.insert(t);
-        mPq.pop();  // remove t
-    }
+    std::vector<sp<const InternalAlarm>> poppedAlarms;
+    mAlarms.popSoonerThan(timestampSec, &poppedAlarms);
+    oldAlarms.insert(poppedAlarms.begin(), poppedAlarms.end());
     // Always update registered alarm time (if anything has changed).
     if (!oldAlarms.empty()) {
-        if (mPq.empty()) {
+        if (mAlarms.empty()) {
             VLOG("Queue is empty. Cancel any alarm.");
             cancelRegisteredAlarmTime_l();
         } else {
             // Always update the registered alarm in this case (unlike remove()).
-            updateRegisteredAlarmTime_l(mPq.top()->timestampSec);
+            updateRegisteredAlarmTime_l(mAlarms.top()->timestampSec);
         }
     }
     return oldAlarms;
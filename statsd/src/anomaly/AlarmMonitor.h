@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include "anomaly/AlarmTimerWheel.h"
 #include "anomaly/indexed_priority_queue.h"
 
 #include <aidl/android/os/IStatsCompanionService.h>
@@ -91,6 +92,13 @@ public:
      */
     void remove(const sp<const InternalAlarm>& alarm);
 
+    /**
+     * Removes oldAlarm from the queue and adds newAlarm to it. The registered
+     * alarm is updated at most once, and is not cancelled in between when
+     * oldAlarm was the only alarm in the queue.
+     */
+    void replace(const sp<const InternalAlarm>& oldAlarm, const sp<const InternalAlarm>& newAlarm);
+
     /**
      * Returns and removes all alarms whose timestamp <= the given timestampSec.
      * Always updates the registered alarm if return is non-empty.
@@ -113,15 +121,15 @@ private:
     /**
      * Timestamp (seconds since epoch) of the alarm registered with
      * StatsCompanionService. This, in general, may not be equal to the soonest
-     * alarm stored in mPq, but should be within minUpdateTimeSec of it.
+     * alarm stored in mAlarms, but should be within minUpdateTimeSec of it.
      * A value of 0 indicates that no alarm is currently registered.
      */
     uint32_t mRegisteredAlarmTimeSec;
 
     /**
-     * Priority queue of alarms, prioritized by soonest alarm.timestampSec.
+     * Alarms, ordered by soonest alarm.timestampSec.
      */
-    indexed_priority_queue<InternalAlarm, InternalAlarm::SmallerTimestamp> mPq;
+    AlarmTimerWheel mAlarms;
 
     /**
      * Binder interface for communicating with StatsCompanionService.
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "anomaly/AlarmTimerWheel.h"
+
+#include <limits>
+
+#include "anomaly/AlarmMonitor.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::vector;
+
+namespace {
+
+// The index of the highest base-64 digit in which a and b differ, or 0 if they are equal.
+int highestDifferingLevel(uint32_t a, uint32_t b, int slotBits) {
+    const uint32_t diff = a ^ b;
+    return diff == 0 ? 0 : (31 - __builtin_clz(diff)) / slotBits;
+}
+
+}  // anonymous namespace
+
+AlarmTimerWheel::AlarmTimerWheel() : mBaseSec(0), mOccupied(), mSoonestValid(true) {
+}
+
+AlarmTimerWheel::~AlarmTimerWheel() {
+}
+
+vector<sp<const InternalAlarm>>& AlarmTimerWheel::slotAt(int level, int slot) {
+    return level == kOverdueLevel ? mOverdue : mSlots[level][slot];
+}
+
+void AlarmTimerWheel::push(const sp<const InternalAlarm>& alarm) {
+    if (alarm == nullptr || mLocations.find(alarm.get()) != mLocations.end()) {
+        return;
+    }
+    insert(alarm);
+    if (mSoonestValid && (mSoonest == nullptr || alarm->timestampSec < mSoonest->timestampSec)) {
+        mSoonest = alarm;
+    }
+}
+
+void AlarmTimerWheel::insert(const sp<const InternalAlarm>& alarm) {
+    const uint32_t timestampSec = alarm->timestampSec;
+    Location location = {kOverdueLevel, 0, 0};
+    if (timestampSec >= mBaseSec) {
+        location.level = highestDifferingLevel(timestampSec, mBaseSec, kSlotBits);
+        location.slot = (timestampSec >> (location.level * kSlotBits)) & (kSlotCount - 1);
+        mOccupied[location.level] |= uint64_t(1) << location.slot;
+    }
+    vector<sp<const InternalAlarm>>& slot = slotAt(location.level, location.slot);
+    location.position = slot.size();
+    slot.push_back(alarm);
+    mLocations[alarm.get()] = location;
+}
+
+bool AlarmTimerWheel::remove(const sp<const InternalAlarm>& alarm) {
+    if (alarm == nullptr) {
+        return false;
+    }
+    const auto it = mLocations.find(alarm.get());
+    if (it == mLocations.end()) {
+        return false;
+    }
+    erase(it->second);
+    if (mSoonest == alarm) {
+        mSoonest = nullptr;
+        mSoonestValid = false;
+    }
+    return true;
+}
+
+void AlarmTimerWheel::erase(const Location& location) {
+    vector<sp<const InternalAlarm>>& slot = slotAt(location.level, location.slot);
+    mLocations.erase(slot[location.position].get());
+    if (location.position + 1 != slot.size()) {
+        slot[location.position] = std::move(slot.back());
+        mLocations[slot[location.position].get()].position = location.position;
+    }
+    slot.pop_back();
+    if (slot.empty() && location.level != kOverdueLevel) {
+        mOccupied[location.level] &= ~(uint64_t(1) << location.slot);
+    }
+}
+
+sp<const InternalAlarm> AlarmTimerWheel::top() {
+    if (mSoonestValid) {
+        return mSoonest;
+    }
+    const vector<sp<const InternalAlarm>>* soonestSlot = nullptr;
+    if (!mOverdue.empty()) {
+        soonestSlot = &mOverdue;
+    } else {
+        // Alarms at a lower level, or in a lower slot of the same level, are always sooner.
+        for (int level = 0; level < kLevelCount; level++) {
+            if (mOccupied[level] != 0) {
+                soonestSlot = &mSlots[level][__builtin_ctzll(mOccupied[level])];
+                break;
+            }
+        }
+    }
+    mSoonest = nullptr;
+    if (soonestSlot != nullptr) {
+        for (const sp<const InternalAlarm>& alarm : *soonestSlot) {
+            if (mSoonest == nullptr || alarm->timestampSec < mSoonest->timestampSec) {
+                mSoonest = alarm;
+            }
+        }
+    }
+    mSoonestValid = true;
+    return mSoonest;
+}
+
+void AlarmTimerWheel::drainSlot(int level, int slot, vector<sp<const InternalAlarm>>* alarms) {
+    vector<sp<const InternalAlarm>>& entries = mSlots[level][slot];
+    for (sp<const InternalAlarm>& alarm : entries) {
+        mLocations.erase(alarm.get());
+        alarms->push_back(std::move(alarm));
+    }
+    entries.clear();
+    mOccupied[level] &= ~(uint64_t(1) << slot);
+}
+
+void AlarmTimerWheel::popSoonerThan(uint32_t timestampSec, vector<sp<const InternalAlarm>>* alarms) {
+    const size_t previousSize = size();
+
+    for (size_t i = 0; i < mOverdue.size();) {
+        if (mOverdue[i]->timestampSec <= timestampSec) {
+            alarms->push_back(mOverdue[i]);
+            erase({kOverdueLevel, 0, i});
+        } else {
+            i++;
+        }
+    }
+
+    if (timestampSec >= mBaseSec) {
+        int lastLevel = kLevelCount - 1;
+        int newDigit = kSlotCount;
+        const bool popsAll = timestampSec == std::numeric_limits<uint32_t>::max();
+        const uint32_t newBaseSec = popsAll ? timestampSec : timestampSec + 1;
+        if (!popsAll) {
+            // Levels below lastLevel only hold alarms sooner than the new base. At lastLevel,
+            // the slots below the new base's digit are due, and the one at it is refiled.
+            lastLevel = highestDifferingLevel(mBaseSec, newBaseSec, kSlotBits);
+            newDigit = (newBaseSec >> (lastLevel * kSlotBits)) & (kSlotCount - 1);
+        }
+        for (int level = 0; level < lastLevel; level++) {
+            while (mOccupied[level] != 0) {
+                drainSlot(level, __builtin_ctzll(mOccupied[level]), alarms);
+            }
+        }
+        while (mOccupied[lastLevel] != 0 && __builtin_ctzll(mOccupied[lastLevel]) < newDigit) {
+            drainSlot(lastLevel, __builtin_ctzll(mOccupied[lastLevel]), alarms);
+        }
+
+        mBaseSec = newBaseSec;
+        if (newDigit < kSlotCount && (mOccupied[lastLevel] >> newDigit) & 1) {
+            vector<sp<const InternalAlarm>> refiled;
+            drainSlot(lastLevel, newDigit, &refiled);
+            for (sp<const InternalAlarm>& alarm : refiled) {
+                if (alarm->timestampSec <= timestampSec) {
+                    alarms->push_back(std::move(alarm));
+                } else {
+                    insert(alarm);
+                }
+            }
+        }
+    }
+
+    if (size() != previousSize) {
+        mSoonest = nullptr;
+        mSoonestValid = false;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
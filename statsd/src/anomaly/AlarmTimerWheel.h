@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/RefBase.h>
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+struct InternalAlarm;
+
+/**
+ * A hierarchical timing wheel of InternalAlarms, ordered by timestampSec.
+ *
+ * The wheel has kLevelCount levels of kSlotCount slots. An alarm is filed relative to mBaseSec,
+ * the time up to which alarms have been popped: at the level of the highest base-64 digit in
+ * which its timestamp differs from mBaseSec, in the slot given by that digit. Level 0 slots
+ * therefore hold a single second, and level k slots a range of 64^k seconds. Adding and removing
+ * an alarm is O(1). popSoonerThan empties the slots that fall entirely before the new base, and
+ * refiles the alarms of the one slot the new base falls in at lower levels, so every alarm is
+ * refiled at most kLevelCount times.
+ *
+ * Alarms sooner than mBaseSec when added are kept in a separate overdue list.
+ */
+class AlarmTimerWheel {
+public:
+    AlarmTimerWheel();
+    ~AlarmTimerWheel();
+
+    /** Adds alarm. If it is already present or nullptr, does nothing. */
+    void push(const sp<const InternalAlarm>& alarm);
+
+    /**
+     * Removes alarm. If it is not present or nullptr, does nothing.
+     * Returns true if alarm had been present (and is now removed), else false.
+     */
+    bool remove(const sp<const InternalAlarm>& alarm);
+
+    /** Returns the soonest alarm. Returns nullptr iff empty(). */
+    sp<const InternalAlarm> top();
+
+    /** Removes all alarms whose timestamp <= timestampSec and appends them to alarms. */
+    void popSoonerThan(uint32_t timestampSec, std::vector<sp<const InternalAlarm>>* alarms);
+
+    size_t size() const {
+        return mLocations.size();
+    }
+
+    bool empty() const {
+        return mLocations.empty();
+    }
+
+private:
+    static const int kSlotBits = 6;
+    static const int kSlotCount = 1 << kSlotBits;
+    // Enough levels for the 32 bits of timestampSec.
+    static const int kLevelCount = (32 + kSlotBits - 1) / kSlotBits;
+    static const int kOverdueLevel = -1;
+
+    struct Location {
+        int level;
+        int slot;
+        size_t position;
+    };
+
+    // Files alarm relative to mBaseSec. alarm must not already be present.
+    void insert(const sp<const InternalAlarm>& alarm);
+
+    // Removes the alarm at location from its slot, and from mLocations.
+    void erase(const Location& location);
+
+    std::vector<sp<const InternalAlarm>>& slotAt(int level, int slot);
+
+    // Moves every alarm of the slot to alarms.
+    void drainSlot(int level, int slot, std::vector<sp<const InternalAlarm>>* alarms);
+
+    // Every alarm in the wheel is at or after mBaseSec.
+    uint32_t mBaseSec;
+
+    std::vector<sp<const InternalAlarm>> mSlots[kLevelCount][kSlotCount];
+
+    // Bit i of mOccupied[level] is set iff mSlots[level][i] is not empty.
+    uint64_t mOccupied[kLevelCount];
+
+    // Alarms that were already sooner than mBaseSec when added.
+    std::vector<sp<const InternalAlarm>> mOverdue;
+
+    std::unordered_map<const InternalAlarm*, Location> mLocations;
+
+    // The soonest alarm, computed lazily. Adding an alarm keeps it up to date, removing the
+    // soonest alarm or popping invalidates it.
+    sp<const InternalAlarm> mSoonest;
+    bool mSoonestValid;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -32,18 +32,32 @@ namespace statsd {
 AlarmTracker::AlarmTracker(const int64_t startMillis,
                            const int64_t currentMillis,
                            const Alarm& alarm, const ConfigKey& configKey,
-                           const sp<AlarmMonitor>& alarmMonitor)
-    : mAlarmConfig(alarm),
+                           const sp<AlarmMonitor>& alarmMonitor, bool deferAlarm)
+    : mAlarmId(alarm.id()),
+      mPeriodMillis(alarm.period_millis()),
+      mProbabilityOfInforming(alarm.probability_of_informing()),
       mConfigKey(configKey),
-      mAlarmMonitor(alarmMonitor) {
+      mAlarmMonitor(alarmMonitor),
+      mAlarmDeferred(deferAlarm) {
     VLOG("AlarmTracker() called");
-    mAlarmSec = (startMillis + mAlarmConfig.offset_millis()) / MS_PER_SEC;
+    mAlarmSec = (startMillis + alarm.offset_millis()) / MS_PER_SEC;
     // startMillis is the time statsd is created. We need to find the 1st alarm timestamp after
     // the config is added to statsd.
     mAlarmSec = findNextAlarmSec(currentMillis / MS_PER_SEC);  // round up
     mInternalAlarm = new InternalAlarm{static_cast<uint32_t>(mAlarmSec)};
     VLOG("AlarmTracker sets the periodic alarm at: %lld", (long long)mAlarmSec);
-    if (mAlarmMonitor != nullptr) {
+    if (mAlarmMonitor != nullptr && !mAlarmDeferred) {
+        mAlarmMonitor->add(mInternalAlarm);
+    }
+}
+
+void AlarmTracker::registerAlarm() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mAlarmDeferred) {
+        return;
+    }
+    mAlarmDeferred = false;
+    if (mAlarmMonitor != nullptr && mInternalAlarm != nullptr) {
         mAlarmMonitor->add(mInternalAlarm);
     }
 }
@@ -64,35 +78,47 @@ int64_t AlarmTracker::findNextAlarmSec(int64_t currentTimeSec) {
         return mAlarmSec;
     }
     int64_t periodsForward =
-        ((currentTimeSec - mAlarmSec) * MS_PER_SEC) / mAlarmConfig.period_millis() + 1;
-    return mAlarmSec + periodsForward * mAlarmConfig.period_millis() / MS_PER_SEC;
+        ((currentTimeSec - mAlarmSec) * MS_PER_SEC) / mPeriodMillis + 1;
+    return mAlarmSec + periodsForward * mPeriodMillis / MS_PER_SEC;
 }
 
 void AlarmTracker::informAlarmsFired(
         const int64_t timestampNs,
         unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& firedAlarms) {
-    if (firedAlarms.empty() || mInternalAlarm == nullptr ||
-        firedAlarms.find(mInternalAlarm) == firedAlarms.end()) {
-        return;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (firedAlarms.empty() || mInternalAlarm == nullptr ||
+            firedAlarms.find(mInternalAlarm) == firedAlarms.end()) {
+            return;
+        }
+        firedAlarms.erase(mInternalAlarm);
+        mAlarmSec = findNextAlarmSec((timestampNs - 1) / NS_PER_SEC + 1);  // round up
+        mInternalAlarm = new InternalAlarm{static_cast<uint32_t>(mAlarmSec)};
+        VLOG("AlarmTracker sets the periodic alarm at: %lld", (long long)mAlarmSec);
+        if (mAlarmMonitor != nullptr) {
+            mAlarmMonitor->add(mInternalAlarm);
+        }
     }
+
+    // The subscriptions are not modified once the tracker is initialized, so the subscribers are
+    // triggered without holding mMutex.
     if (!mSubscriptions.empty() &&
-        (mAlarmConfig.probability_of_informing() >= 1 ||
-         (mAlarmConfig.probability_of_informing() < 1 &&
-          ((float)rand() / (float)RAND_MAX) < mAlarmConfig.probability_of_informing()))) {
+        (mProbabilityOfInforming >= 1 ||
+         (mProbabilityOfInforming < 1 &&
+          ((float)rand() / (float)RAND_MAX) < mProbabilityOfInforming))) {
         // Note that due to float imprecision, 0.0 and 1.0 might not truly mean never/always.
         // The config writer was advised to use -0.1 and 1.1 for never/always.
 
         ALOGI("Fate decided that an alarm will trigger subscribers.");
-        triggerSubscribers(mAlarmConfig.id(), 0 /*metricId N/A*/, DEFAULT_METRIC_DIMENSION_KEY,
+        triggerSubscribers(mAlarmId, 0 /*metricId N/A*/, DEFAULT_METRIC_DIMENSION_KEY,
                            0 /* metricValue N/A */, mConfigKey, mSubscriptions);
     }
-    firedAlarms.erase(mInternalAlarm);
-    mAlarmSec = findNextAlarmSec((timestampNs-1) / NS_PER_SEC + 1); // round up
-    mInternalAlarm = new InternalAlarm{static_cast<uint32_t>(mAlarmSec)};
-    VLOG("AlarmTracker sets the periodic alarm at: %lld", (long long)mAlarmSec);
-    if (mAlarmMonitor != nullptr) {
-        mAlarmMonitor->add(mInternalAlarm);
-    }
+}
+
+bool AlarmTracker::hasFired(
+        const unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& firedAlarms) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mInternalAlarm != nullptr && firedAlarms.find(mInternalAlarm) != firedAlarms.end();
 }
 
 }  // namespace statsd
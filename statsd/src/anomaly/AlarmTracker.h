@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <utils/RefBase.h>
 
+#include <mutex>
+
 namespace android {
 namespace os {
 namespace statsd {
@@ -34,28 +36,41 @@ public:
     AlarmTracker(const int64_t startMillis,
                  const int64_t currentMillis,
                  const Alarm& alarm, const ConfigKey& configKey,
-                 const sp<AlarmMonitor>& subscriberAlarmMonitor);
+                 const sp<AlarmMonitor>& subscriberAlarmMonitor, bool deferAlarm = false);
 
     virtual ~AlarmTracker();
 
+    // Sets the first alarm, for a tracker created with deferAlarm.
+    void registerAlarm();
+
     void onAlarmFired();
 
     void addSubscription(const Subscription& subscription);
 
+    // Triggers the subscribers and sets the next alarm if the current alarm is in firedAlarms.
+    // Safe to call without holding the lock of the MetricsManager that owns this tracker.
     void informAlarmsFired(
             int64_t timestampNs,
             unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& firedAlarms);
 
+    // Returns true if the current alarm is in firedAlarms.
+    bool hasFired(
+            const unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& firedAlarms);
+
 protected:
     // For test only. Returns the alarm timestamp in seconds. Otherwise returns 0.
-    inline int32_t getAlarmTimestampSec() const {
+    inline int32_t getAlarmTimestampSec() {
+        std::lock_guard<std::mutex> lock(mMutex);
         return mInternalAlarm == nullptr ? 0 : mInternalAlarm->timestampSec;
     }
 
     int64_t findNextAlarmSec(int64_t currentTimeMillis);
 
-    // statsd_config.proto Alarm message that defines this tracker.
-    const Alarm mAlarmConfig;
+    // The fields of the statsd_config.proto Alarm message that defines this tracker. The message
+    // itself is not kept once the tracker is created.
+    const int64_t mAlarmId;
+    const int64_t mPeriodMillis;
+    const float mProbabilityOfInforming;
 
     // A reference to the Alarm's config key.
     const ConfigKey mConfigKey;
@@ -66,14 +81,22 @@ protected:
     // Alarm monitor.
     sp<AlarmMonitor> mAlarmMonitor;
 
+    // Guards mAlarmSec and mInternalAlarm, which are updated when the alarm fires.
+    std::mutex mMutex;
+
     // The current expected alarm time in seconds.
     int64_t mAlarmSec;
 
     // The current alarm.
     sp<const InternalAlarm> mInternalAlarm;
 
+    // Whether mInternalAlarm waits for registerAlarm() to be set.
+    bool mAlarmDeferred;
+
     FRIEND_TEST(AlarmTrackerTest, TestTriggerTimestamp);
+    FRIEND_TEST(AlarmTrackerTest, TestDeferredAlarm);
     FRIEND_TEST(AlarmE2eTest, TestMultipleAlarms);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmFiredWhileConfigRemoved);
     FRIEND_TEST(ConfigUpdateTest, TestUpdateAlarms);
 };
 
@@ -34,8 +34,34 @@ namespace android {
 namespace os {
 namespace statsd {
 
+namespace {
+
+std::pair<optional<InvalidConfigReason>, uint64_t> hashAlert(const Alert& alert) {
+    string serializedAlert;
+    if (!alert.SerializeToString(&serializedAlert)) {
+        ALOGW("Unable to serialize alert %lld", (long long)alert.id());
+        return {createInvalidConfigReasonWithAlert(INVALID_CONFIG_REASON_ALERT_SERIALIZATION_FAILED,
+                                                   alert.metric_id(), alert.id()),
+                0};
+    }
+    return {nullopt, FastHash64(serializedAlert)};
+}
+
+}  // namespace
+
 AnomalyTracker::AnomalyTracker(const Alert& alert, const ConfigKey& configKey)
-        : mAlert(alert), mConfigKey(configKey), mNumOfPastBuckets(mAlert.num_buckets() - 1) {
+    : mAlertId(alert.id()),
+      mMetricId(alert.metric_id()),
+      mRefractoryPeriodSecs(alert.has_refractory_period_secs()
+                                    ? std::make_optional(alert.refractory_period_secs())
+                                    : std::nullopt),
+      mTriggerIfSumGt(alert.has_trigger_if_sum_gt()
+                              ? std::make_optional(alert.trigger_if_sum_gt())
+                              : std::nullopt),
+      mProbabilityOfInforming(alert.probability_of_informing()),
+      mProtoHash(hashAlert(alert)),
+      mConfigKey(configKey),
+      mNumOfPastBuckets(alert.num_buckets() - 1) {
     VLOG("AnomalyTracker() called");
     resetStorage();  // initialization
 }
@@ -48,12 +74,39 @@ void AnomalyTracker::onConfigUpdated() {
     mSubscriptions.clear();
 }
 
+namespace {
+
+// Calls visit(slot) for every non-empty slot of window that holds a bucket that is no longer one
+// of the numPastBuckets buckets up to mostRecentBucketNum. Only the slots of the buckets that
+// expired since the window was last synced are looked at.
+template <typename Window, typename Visit>
+void forEachExpiredSlot(Window& window, const int64_t mostRecentBucketNum,
+                        const int numPastBuckets, Visit visit) {
+    const int64_t lastExpiredBucketNum = mostRecentBucketNum - numPastBuckets;
+    if (mostRecentBucketNum - window.syncedBucketNum >= numPastBuckets) {
+        // Every bucket the window held at its last sync has expired.
+        for (auto& slot : window.slots) {
+            if (slot.bucketNum >= 0) {
+                visit(slot);
+            }
+        }
+        return;
+    }
+    for (int64_t bucketNum = std::max(window.syncedBucketNum - numPastBuckets + 1, (int64_t)0);
+         bucketNum <= lastExpiredBucketNum; bucketNum++) {
+        auto& slot = window.slots[bucketNum % numPastBuckets];
+        if (slot.bucketNum == bucketNum) {
+            visit(slot);
+        }
+    }
+}
+
+}  // namespace
+
 void AnomalyTracker::resetStorage() {
     VLOG("resetStorage() called.");
-    mPastBuckets.clear();
-    // Excludes the current bucket.
-    mPastBuckets.resize(mNumOfPastBuckets);
-    mSumOverPastBuckets.clear();
+    mPastBucketWindows.clear();
+    mLastSweptBucketNum = mMostRecentBucketNum;
 }
 
 size_t AnomalyTracker::index(int64_t bucketNum) const {
@@ -75,18 +128,70 @@ void AnomalyTracker::advanceMostRecentBucketTo(const int64_t bucketNum) {
     }
     // If in the future (i.e. buckets are ancient), just empty out all past info.
     if (bucketNum >= mMostRecentBucketNum + mNumOfPastBuckets) {
-        resetStorage();
         mMostRecentBucketNum = bucketNum;
+        resetStorage();
         return;
     }
 
-    // Clear out space by emptying out old mPastBuckets[i] values and update mSumOverPastBuckets.
-    for (int64_t i = mMostRecentBucketNum + 1; i <= bucketNum; i++) {
-        const int idx = index(i);
-        subtractBucketFromSum(mPastBuckets[idx]);
-        mPastBuckets[idx] = nullptr;  // release (but not clear) the old bucket.
-    }
+    // The windows drop the buckets that are now too old when they are next used.
     mMostRecentBucketNum = bucketNum;
+    if (mMostRecentBucketNum - mLastSweptBucketNum >= mNumOfPastBuckets) {
+        sweepExpiredWindows();
+    }
+}
+
+void AnomalyTracker::sweepExpiredWindows() {
+    for (auto it = mPastBucketWindows.begin(); it != mPastBucketWindows.end();) {
+        if (it->second.latestBucketNum <= mMostRecentBucketNum - mNumOfPastBuckets) {
+            it = mPastBucketWindows.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    mLastSweptBucketNum = mMostRecentBucketNum;
+}
+
+void AnomalyTracker::syncWindow(PastBucketWindow& window) {
+    if (window.syncedBucketNum == mMostRecentBucketNum) {
+        return;
+    }
+    forEachExpiredSlot(window, mMostRecentBucketNum, mNumOfPastBuckets,
+                       [&window](PastBucketSlot& slot) {
+                           window.sum -= slot.value;
+                           slot = PastBucketSlot();
+                       });
+    window.syncedBucketNum = mMostRecentBucketNum;
+}
+
+int64_t AnomalyTracker::getWindowSum(const PastBucketWindow& window) const {
+    int64_t sum = window.sum;
+    if (window.syncedBucketNum != mMostRecentBucketNum) {
+        forEachExpiredSlot(window, mMostRecentBucketNum, mNumOfPastBuckets,
+                           [&sum](const PastBucketSlot& slot) { sum -= slot.value; });
+    }
+    return sum;
+}
+
+void AnomalyTracker::setPastBucketValue(const MetricDimensionKey& key, const int64_t bucketValue,
+                                        const int64_t bucketNum) {
+    auto it = mPastBucketWindows.find(key);
+    if (it == mPastBucketWindows.end()) {
+        PastBucketWindow window;
+        window.slots.resize(mNumOfPastBuckets);
+        window.syncedBucketNum = mMostRecentBucketNum;
+        it = mPastBucketWindows.insert({key, std::move(window)}).first;
+    }
+    PastBucketWindow& window = it->second;
+    syncWindow(window);
+    // After syncing, the slot is either empty or already holds bucketNum.
+    PastBucketSlot& slot = window.slots[index(bucketNum)];
+    if (slot.bucketNum == bucketNum) {
+        window.sum -= slot.value;
+    }
+    slot.bucketNum = bucketNum;
+    slot.value = bucketValue;
+    window.sum += bucketValue;
+    window.latestBucketNum = std::max(window.latestBucketNum, bucketNum);
 }
 
 void AnomalyTracker::addPastBucket(const MetricDimensionKey& key, const int64_t bucketValue,
@@ -97,25 +202,11 @@ void AnomalyTracker::addPastBucket(const MetricDimensionKey& key, const int64_t
         return;
     }
 
-    const int bucketIndex = index(bucketNum);
-    if (bucketNum <= mMostRecentBucketNum && (mPastBuckets[bucketIndex] != nullptr)) {
-        // We need to insert into an already existing past bucket.
-        std::shared_ptr<DimToValMap>& bucket = mPastBuckets[bucketIndex];
-        auto itr = bucket->find(key);
-        if (itr != bucket->end()) {
-            // Old entry already exists; update it.
-            subtractValueFromSum(key, itr->second);
-            itr->second = bucketValue;
-        } else {
-            bucket->insert({key, bucketValue});
-        }
-        mSumOverPastBuckets[key] += bucketValue;
-    } else {
-        // Bucket does not exist yet (in future or was never made), so we must make it.
-        std::shared_ptr<DimToValMap> bucket = std::make_shared<DimToValMap>();
-        bucket->insert({key, bucketValue});
-        addPastBucket(bucket, bucketNum);
+    if (bucketNum > mMostRecentBucketNum) {
+        // Bucket does not exist yet, so we must make room for it.
+        advanceMostRecentBucketTo(bucketNum);
     }
+    setPastBucketValue(key, bucketValue, bucketNum);
 }
 
 void AnomalyTracker::addPastBucket(const std::shared_ptr<DimToValMap>& bucket,
@@ -127,44 +218,26 @@ void AnomalyTracker::addPastBucket(const std::shared_ptr<DimToValMap>& bucket,
     }
 
     if (bucketNum <= mMostRecentBucketNum) {
-        // We are updating an old bucket, not adding a new one.
-        subtractBucketFromSum(mPastBuckets[index(bucketNum)]);
+        // We are replacing an old bucket, not adding a new one. The dimensions that are not in
+        // the new bucket lose their value for it. This is the only path that visits every
+        // dimension, and no metric replaces whole buckets on its regular flushes.
+        const size_t bucketIndex = index(bucketNum);
+        for (auto& [key, window] : mPastBucketWindows) {
+            PastBucketSlot& slot = window.slots[bucketIndex];
+            if (slot.bucketNum == bucketNum) {
+                window.sum -= slot.value;
+                slot = PastBucketSlot();
+            }
+        }
     } else {
         // Clear space for the new bucket to be at bucketNum.
         advanceMostRecentBucketTo(bucketNum);
     }
-    mPastBuckets[index(bucketNum)] = bucket;
-    addBucketToSum(bucket);
-}
-
-void AnomalyTracker::subtractBucketFromSum(const shared_ptr<DimToValMap>& bucket) {
-    if (bucket == nullptr) {
-        return;
-    }
-    for (const auto& keyValuePair : *bucket) {
-        subtractValueFromSum(keyValuePair.first, keyValuePair.second);
-    }
-}
-
-void AnomalyTracker::subtractValueFromSum(const MetricDimensionKey& key,
-                                          const int64_t bucketValue) {
-    auto itr = mSumOverPastBuckets.find(key);
-    if (itr == mSumOverPastBuckets.end()) {
-        return;
-    }
-    itr->second -= bucketValue;
-    if (itr->second == 0) {
-        mSumOverPastBuckets.erase(itr);
-    }
-}
-
-void AnomalyTracker::addBucketToSum(const shared_ptr<DimToValMap>& bucket) {
     if (bucket == nullptr) {
         return;
     }
-    // For each dimension present in the bucket, add its value to its corresponding sum.
-    for (const auto& keyValuePair : *bucket) {
-        mSumOverPastBuckets[keyValuePair.first] += keyValuePair.second;
+    for (const auto& [key, value] : *bucket) {
+        setPastBucketValue(key, value, bucketNum);
     }
 }
 
@@ -176,30 +249,49 @@ int64_t AnomalyTracker::getPastBucketValue(const MetricDimensionKey& key,
         return 0;
     }
 
-    const auto& bucket = mPastBuckets[index(bucketNum)];
-    if (bucket == nullptr) {
+    const auto& itr = mPastBucketWindows.find(key);
+    if (itr == mPastBucketWindows.end()) {
         return 0;
     }
-    const auto& itr = bucket->find(key);
-    return itr == bucket->end() ? 0 : itr->second;
+    const PastBucketSlot& slot = itr->second.slots[index(bucketNum)];
+    return slot.bucketNum == bucketNum ? slot.value : 0;
 }
 
 int64_t AnomalyTracker::getSumOverPastBuckets(const MetricDimensionKey& key) const {
-    const auto& itr = mSumOverPastBuckets.find(key);
-    if (itr != mSumOverPastBuckets.end()) {
-        return itr->second;
+    const auto& itr = mPastBucketWindows.find(key);
+    if (itr != mPastBucketWindows.end()) {
+        return getWindowSum(itr->second);
     }
     return 0;
 }
 
+size_t AnomalyTracker::getNumDimensionsWithPastData() const {
+    size_t numDimensions = 0;
+    for (const auto& [key, window] : mPastBucketWindows) {
+        if (getWindowSum(window) != 0) {
+            numDimensions++;
+        }
+    }
+    return numDimensions;
+}
+
 bool AnomalyTracker::detectAnomaly(const int64_t currentBucketNum, const MetricDimensionKey& key,
                                    const int64_t currentBucketValue) {
     // currentBucketNum should be the next bucket after pastBuckets. If not, advance so that it is.
     if (currentBucketNum > mMostRecentBucketNum + 1) {
         advanceMostRecentBucketTo(currentBucketNum - 1);
     }
-    return mAlert.has_trigger_if_sum_gt() &&
-           getSumOverPastBuckets(key) + currentBucketValue > mAlert.trigger_if_sum_gt();
+    if (!mTriggerIfSumGt.has_value()) {
+        return false;
+    }
+    int64_t sumOverPastBuckets = 0;
+    auto itr = mPastBucketWindows.find(key);
+    if (itr != mPastBucketWindows.end()) {
+        // Sync so that the following events of this dimension read the sum in O(1).
+        syncWindow(itr->second);
+        sumOverPastBuckets = itr->second.sum;
+    }
+    return sumOverPastBuckets + currentBucketValue > *mTriggerIfSumGt;
 }
 
 void AnomalyTracker::declareAnomaly(const int64_t timestampNs, int64_t metricId,
@@ -212,10 +304,10 @@ void AnomalyTracker::declareAnomaly(const int64_t timestampNs, int64_t metricId,
     }
 
     // TODO(b/110564268): This should also take in the const MetricDimensionKey& key?
-    util::stats_write(util::ANOMALY_DETECTED, mConfigKey.GetUid(), mConfigKey.GetId(), mAlert.id());
+    util::stats_write(util::ANOMALY_DETECTED, mConfigKey.GetUid(), mConfigKey.GetId(), mAlertId);
 
-    if (mAlert.probability_of_informing() < 1 &&
-        ((float)rand() / (float)RAND_MAX) >= mAlert.probability_of_informing()) {
+    if (mProbabilityOfInforming < 1 &&
+        ((float)rand() / (float)RAND_MAX) >= mProbabilityOfInforming) {
         // Note that due to float imprecision, 0.0 and 1.0 might not truly mean never/always.
         // The config writer was advised to use -0.1 and 1.1 for never/always.
         ALOGI("Fate decided that an alert will not trigger subscribers or start the refactory "
@@ -223,23 +315,24 @@ void AnomalyTracker::declareAnomaly(const int64_t timestampNs, int64_t metricId,
         return;
     }
 
-    if (mAlert.has_refractory_period_secs()) {
+    if (mRefractoryPeriodSecs.has_value()) {
         mRefractoryPeriodEndsSec[key] = ((timestampNs + NS_PER_SEC - 1) / NS_PER_SEC) // round up
-                                        + mAlert.refractory_period_secs();
+                                        + *mRefractoryPeriodSecs;
+        mRefractoryGeneration++;
         // TODO(b/110563466): If we had access to the bucket_size_millis, consider
         // calling resetStorage()
-        // if (mAlert.refractory_period_secs() > mNumOfPastBuckets * bucketSizeNs) {resetStorage();}
+        // if (mRefractoryPeriodSecs > mNumOfPastBuckets * bucketSizeNs) {resetStorage();}
     }
 
     if (!mSubscriptions.empty()) {
         ALOGI("An anomaly (%" PRId64 ") %s has occurred! Informing subscribers.",
-                mAlert.id(), key.toString().c_str());
+                mAlertId, key.toString().c_str());
         informSubscribers(key, metricId, metricValue);
     } else {
         ALOGI("An anomaly has occurred! (But no subscriber for that alert.)");
     }
 
-    StatsdStats::getInstance().noteAnomalyDeclared(mConfigKey, mAlert.id());
+    StatsdStats::getInstance().noteAnomalyDeclared(mConfigKey, mAlertId);
 }
 
 void AnomalyTracker::detectAndDeclareAnomaly(const int64_t timestampNs, const int64_t currBucketNum,
@@ -259,20 +352,9 @@ bool AnomalyTracker::isInRefractoryPeriod(const int64_t timestampNs,
     return false;
 }
 
-std::pair<optional<InvalidConfigReason>, uint64_t> AnomalyTracker::getProtoHash() const {
-    string serializedAlert;
-    if (!mAlert.SerializeToString(&serializedAlert)) {
-        ALOGW("Unable to serialize alert %lld", (long long)mAlert.id());
-        return {createInvalidConfigReasonWithAlert(INVALID_CONFIG_REASON_ALERT_SERIALIZATION_FAILED,
-                                                   mAlert.metric_id(), mAlert.id()),
-                0};
-    }
-    return {nullopt, Hash64(serializedAlert)};
-}
-
 void AnomalyTracker::informSubscribers(const MetricDimensionKey& key, int64_t metric_id,
                                        int64_t metricValue) {
-    triggerSubscribers(mAlert.id(), metric_id, key, metricValue, mConfigKey, mSubscriptions);
+    triggerSubscribers(mAlertId, metric_id, key, metricValue, mConfigKey, mSubscriptions);
 }
 
 bool AnomalyTracker::writeAlertMetadataToProto(int64_t currentWallClockTimeNs,
@@ -284,15 +366,30 @@ bool AnomalyTracker::writeAlertMetadataToProto(int64_t currentWallClockTimeNs,
         return false;
     }
 
+    const int64_t elapsedSec = systemElapsedTimeNs / NS_PER_SEC;
+    const int64_t clockOffsetSec = currentWallClockTimeNs / NS_PER_SEC - elapsedSec;
+    if (mWrittenAlertMetadata.has_value() &&
+        mWrittenAlertMetadata->refractoryGeneration == mRefractoryGeneration &&
+        mWrittenAlertMetadata->clockOffsetSec == clockOffsetSec &&
+        mWrittenAlertMetadata->elapsedSec <= elapsedSec &&
+        elapsedSec <= mWrittenAlertMetadata->earliestEndSec) {
+        if (mWrittenAlertMetadata->written) {
+            *alertMetadata = mWrittenAlertMetadata->alertMetadata;
+        }
+        return mWrittenAlertMetadata->written;
+    }
+
+    int64_t earliestEndSec = INT64_MAX;
     for (const auto& it: mRefractoryPeriodEndsSec) {
         // Do not write the timestamp to disk if it has already expired
-        if (it.second < systemElapsedTimeNs / NS_PER_SEC) {
+        if (it.second < elapsedSec) {
             continue;
         }
 
         metadataWritten = true;
+        earliestEndSec = std::min(earliestEndSec, (int64_t)it.second);
         if (alertMetadata->alert_dim_keyed_data_size() == 0) {
-            alertMetadata->set_alert_id(mAlert.id());
+            alertMetadata->set_alert_id(mAlertId);
         }
 
         metadata::AlertDimensionKeyedData* keyedData = alertMetadata->add_alert_dim_keyed_data();
@@ -306,6 +403,9 @@ bool AnomalyTracker::writeAlertMetadataToProto(int64_t currentWallClockTimeNs,
                 it.first, keyedData->mutable_dimension_key());
     }
 
+    mWrittenAlertMetadata = WrittenAlertMetadata{
+            mRefractoryGeneration, clockOffsetSec, elapsedSec, earliestEndSec, metadataWritten,
+            *alertMetadata};
     return metadataWritten;
 }
 
@@ -324,6 +424,7 @@ void AnomalyTracker::loadAlertMetadata(
         int32_t refractoryPeriodEndsSec = (int32_t) keyedData.last_refractory_ends_sec() -
                 currentWallClockTimeNs / NS_PER_SEC + systemElapsedTimeNs / NS_PER_SEC;
         mRefractoryPeriodEndsSec[metricKey] = refractoryPeriodEndsSec;
+        mRefractoryGeneration++;
     }
 }
 
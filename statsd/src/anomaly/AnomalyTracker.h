@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <utils/RefBase.h>
 
+#include <optional>
+
 #include "AlarmMonitor.h"
 #include "config/ConfigKey.h"
 #include "guardrail/StatsdStats.h"
@@ -54,7 +56,7 @@ public:
     // Adds a bucket for the given bucketNum (index starting at 0).
     // If a bucket for bucketNum already exists, it will be replaced.
     // Also, advances to bucketNum (if not in the past), effectively filling any intervening
-    // buckets with 0s.
+    // buckets with 0s. The values are copied, the bucket itself is not kept.
     void addPastBucket(const std::shared_ptr<DimToValMap>& bucket, const int64_t bucketNum);
 
     // Inserts (or replaces) the bucket entry for the given bucketNum at the given key to be the
@@ -93,7 +95,7 @@ public:
 
     // Returns the anomaly threshold set in the configuration.
     inline int64_t getAnomalyThreshold() const {
-        return mAlert.trigger_if_sum_gt();
+        return mTriggerIfSumGt.value_or(0);
     }
 
     // Returns the refractory period ending timestamp (in seconds) for the given key.
@@ -109,7 +111,10 @@ public:
         return mNumOfPastBuckets;
     }
 
-    std::pair<optional<InvalidConfigReason>, uint64_t> getProtoHash() const;
+    // Hash of the Alert this tracker was created from, computed once at creation.
+    inline const std::pair<optional<InvalidConfigReason>, uint64_t>& getProtoHash() const {
+        return mProtoHash;
+    }
 
     // Sets an alarm for the given timestamp.
     // Replaces previous alarm if one already exists.
@@ -149,6 +154,33 @@ public:
             int64_t systemElapsedTimeNs);
 
 protected:
+    // One past bucket value of a dimension.
+    struct PastBucketSlot {
+        // The bucket the value belongs to, or -1 if the slot is empty.
+        int64_t bucketNum = -1;
+        int64_t value = 0;
+    };
+
+    // The past bucket values of a single dimension. Slot index(bucketNum) holds the value for
+    // bucketNum, so that adding a bucket and reading the sum are O(1) for the dimension.
+    struct PastBucketWindow {
+        std::vector<PastBucketSlot> slots;
+
+        // Sum of the values in slots, as of syncedBucketNum.
+        int64_t sum = 0;
+
+        // mMostRecentBucketNum when the slots that fell out of the past buckets were last
+        // dropped from sum.
+        int64_t syncedBucketNum = -1;
+
+        // The most recent bucket that has a value in slots.
+        int64_t latestBucketNum = -1;
+    };
+
+    // For testing only.
+    // Returns the number of dimensions whose sum over the past buckets is not 0.
+    size_t getNumDimensionsWithPastData() const;
+
     // For testing only.
     // Returns the alarm timestamp in seconds for the query dimension if it exists. Otherwise
     // returns 0.
@@ -156,8 +188,14 @@ protected:
         return 0;   // The base AnomalyTracker class doesn't have alarms.
     }
 
-    // statsd_config.proto Alert message that defines this tracker.
-    const Alert mAlert;
+    // The fields of the statsd_config.proto Alert message that defines this tracker. The message
+    // itself is not kept once the tracker is created.
+    const int64_t mAlertId;
+    const int64_t mMetricId;
+    const std::optional<int32_t> mRefractoryPeriodSecs;
+    const std::optional<double> mTriggerIfSumGt;
+    const float mProbabilityOfInforming;
+    const std::pair<optional<InvalidConfigReason>, uint64_t> mProtoHash;
 
     // The subscriptions that depend on this alert.
     std::vector<Subscription> mSubscriptions;
@@ -169,37 +207,57 @@ protected:
     // for the anomaly detection (since the current bucket is not in the past).
     const int mNumOfPastBuckets;
 
-    // Values for each of the past mNumOfPastBuckets buckets. Always of size mNumOfPastBuckets.
-    // mPastBuckets[i] can be null, meaning that no data is present in that bucket.
-    std::vector<shared_ptr<DimToValMap>> mPastBuckets;
-
-    // Cached sum over all existing buckets in mPastBuckets.
-    // Its buckets never contain entries of 0.
-    DimToValMap mSumOverPastBuckets;
+    // Values of the past mNumOfPastBuckets buckets for each dimension that has any.
+    // Advancing the buckets does not touch the windows; each window drops its expired slots the
+    // next time it is used. Windows whose slots have all expired are erased every
+    // mNumOfPastBuckets buckets.
+    FlatHashMap<MetricDimensionKey, PastBucketWindow> mPastBucketWindows;
 
     // The bucket number of the last added bucket.
     int64_t mMostRecentBucketNum = -1;
 
+    // mMostRecentBucketNum when mPastBucketWindows was last swept of expired windows.
+    int64_t mLastSweptBucketNum = -1;
+
     // Map from each dimension to the timestamp that its refractory period (if this anomaly was
     // declared for that dimension) ends, in seconds. From this moment and onwards, anomalies
     // can be declared again.
     // Entries may be, but are not guaranteed to be, removed after the period is finished.
     unordered_map<MetricDimensionKey, uint32_t> mRefractoryPeriodEndsSec;
 
+    // Bumped whenever an entry of mRefractoryPeriodEndsSec is set.
+    uint64_t mRefractoryGeneration = 0;
+
+    // The output of the last writeAlertMetadataToProto, reused while it is what the call would
+    // write again: no refractory period was set since, none of the written ones has ended and
+    // the offset between wall clock and elapsed time, in seconds, is the same.
+    struct WrittenAlertMetadata {
+        uint64_t refractoryGeneration;
+        int64_t clockOffsetSec;
+        int64_t elapsedSec;
+        int64_t earliestEndSec;
+        bool written;
+        metadata::AlertMetadata alertMetadata;
+    };
+    std::optional<WrittenAlertMetadata> mWrittenAlertMetadata;
+
     // Advances mMostRecentBucketNum to bucketNum, deleting any data that is now too old.
     // Specifically, since it is now too old, removes the data for
     //   [mMostRecentBucketNum - mNumOfPastBuckets + 1, bucketNum - mNumOfPastBuckets].
     void advanceMostRecentBucketTo(int64_t bucketNum);
 
-    // Add the information in the given bucket to mSumOverPastBuckets.
-    void addBucketToSum(const shared_ptr<DimToValMap>& bucket);
+    // Sets the value of key for bucketNum, which must be one of the past buckets.
+    void setPastBucketValue(const MetricDimensionKey& key, int64_t bucketValue,
+                            int64_t bucketNum);
+
+    // Drops the slots of window that are no longer past buckets from its sum.
+    void syncWindow(PastBucketWindow& window);
 
-    // Subtract the information in the given bucket from mSumOverPastBuckets
-    // and remove any items with value 0.
-    void subtractBucketFromSum(const shared_ptr<DimToValMap>& bucket);
+    // Returns the sum of window over the past buckets, without syncing it.
+    int64_t getWindowSum(const PastBucketWindow& window) const;
 
-    // From mSumOverPastBuckets[key], subtracts bucketValue, removing it if it is now 0.
-    void subtractValueFromSum(const MetricDimensionKey& key, int64_t bucketValue);
+    // Erases the windows that have no value in any of the past buckets.
+    void sweepExpiredWindows();
 
     // Returns true if in the refractory period, else false.
     bool isInRefractoryPeriod(int64_t timestampNs, const MetricDimensionKey& key) const;
@@ -216,6 +274,7 @@ protected:
 
     FRIEND_TEST(AnomalyTrackerTest, TestConsecutiveBuckets);
     FRIEND_TEST(AnomalyTrackerTest, TestSparseBuckets);
+    FRIEND_TEST(AnomalyTrackerTest, TestSlidingWindowMatchesBucketSums);
     FRIEND_TEST(CountMetricProducerTest, TestAnomalyDetectionUnSliced);
     FRIEND_TEST(AnomalyDurationDetectionE2eTest, TestDurationMetric_SUM_single_bucket);
     FRIEND_TEST(AnomalyDurationDetectionE2eTest, TestDurationMetric_SUM_partial_bucket);
@@ -45,11 +45,19 @@ void DurationAnomalyTracker::startAlarm(const MetricDimensionKey& dimensionKey,
     }
 
     auto itr = mAlarms.find(dimensionKey);
-    if (itr != mAlarms.end() && mAlarmMonitor != nullptr) {
-        mAlarmMonitor->remove(itr->second);
+    if (itr != mAlarms.end() && itr->second->timestampSec == timestampSec) {
+        // The prediction moved within the alarm's second: keep the alarm already queued.
+        return;
     }
 
     sp<const InternalAlarm> alarm = new InternalAlarm{timestampSec};
+    if (itr != mAlarms.end()) {
+        if (mAlarmMonitor != nullptr) {
+            mAlarmMonitor->replace(itr->second, alarm);
+        }
+        itr->second = alarm;
+        return;
+    }
     mAlarms[dimensionKey] = alarm;
     if (mAlarmMonitor != nullptr) {
         mAlarmMonitor->add(alarm);
@@ -65,8 +73,8 @@ void DurationAnomalyTracker::stopAlarm(const MetricDimensionKey& dimensionKey,
 
     // If the alarm is set in the past but hasn't fired yet (due to lag), catch it now.
     if (itr->second != nullptr && timestampNs >= (int64_t)NS_PER_SEC * itr->second->timestampSec) {
-        declareAnomaly(timestampNs, mAlert.metric_id(), dimensionKey,
-                       mAlert.trigger_if_sum_gt() + (timestampNs / NS_PER_SEC) -
+        declareAnomaly(timestampNs, mMetricId, dimensionKey,
+                       mTriggerIfSumGt.value_or(0) + (timestampNs / NS_PER_SEC) -
                                itr->second->timestampSec);
     }
     if (mAlarmMonitor != nullptr) {
@@ -103,8 +111,8 @@ void DurationAnomalyTracker::informAlarmsFired(
     // Now declare each of these alarms to have fired.
     for (const auto& kv : matchedAlarms) {
         declareAnomaly(
-                timestampNs, mAlert.metric_id(), kv.first,
-                mAlert.trigger_if_sum_gt() + (timestampNs / NS_PER_SEC) - kv.second->timestampSec);
+                timestampNs, mMetricId, kv.first,
+                mTriggerIfSumGt.value_or(0) + (timestampNs / NS_PER_SEC) - kv.second->timestampSec);
         mAlarms.erase(kv.first);
         firedAlarms.erase(kv.second);  // No one else can also own it, so we're done with it.
     }
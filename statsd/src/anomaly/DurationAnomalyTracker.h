@@ -33,7 +33,7 @@ public:
     virtual ~DurationAnomalyTracker();
 
     // Sets an alarm for the given timestamp.
-    // Replaces previous alarm if one already exists.
+    // Replaces previous alarm if one already exists, unless it is set for the same second.
     void startAlarm(const MetricDimensionKey& dimensionKey, int64_t eventTime) override;
 
     // Stops the alarm.
@@ -75,6 +75,7 @@ protected:
     FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyDetection);
     FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp);
     FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp_UpdatedOnStop);
+    FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp_UpdatedOnConditionChange);
 };
 
 }  // namespace statsd
@@ -20,13 +20,172 @@
 #include "subscriber_util.h"
 
 #include "external/Perfetto.h"
+#include "stats_log_util.h"
 #include "subscriber/IncidentdReporter.h"
 #include "subscriber/SubscriberReporter.h"
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
 namespace android {
 namespace os {
 namespace statsd {
 
+namespace {
+
+// Incident reports and perfetto traces asked again for the same trigger within this window are
+// not started again. Alerts on noisy metrics can fire in bursts, and one report or trace covers
+// the whole burst.
+const int64_t kTriggerCoalesceWindowNs = 1 * NS_PER_SEC;
+
+// Past this many triggers waiting for the dispatcher thread, new ones are dropped rather than
+// holding up the thread that declared the anomaly.
+const size_t kMaxPendingTriggers = 100;
+
+// Identifies the triggers that are coalesced together.
+struct TriggerKey {
+    ConfigKey configKey;
+    int64_t subscriptionId;
+    int64_t ruleId;
+    int64_t metricId;
+    // Only set for incident reports, whose header includes the dimension. Perfetto traces do not
+    // depend on it.
+    MetricDimensionKey dimensionKey;
+
+    bool operator==(const TriggerKey& that) const {
+        return configKey == that.configKey && subscriptionId == that.subscriptionId &&
+               ruleId == that.ruleId && metricId == that.metricId &&
+               dimensionKey == that.dimensionKey;
+    }
+};
+
+struct PendingTrigger {
+    Subscription subscription;
+    int64_t ruleId;
+    ConfigKey configKey;
+    // Encoded on the calling thread for incident reports.
+    std::vector<uint8_t> incidentHeader;
+    // Converted on the calling thread for broadcasts, once for all the subscriptions of an alert.
+    std::shared_ptr<const StatsDimensionsValueParcel> dimensionsValueParcel;
+};
+
+// Runs the incident report and broadcast binder calls and the perfetto fork/exec off the metrics
+// thread.
+// Never destroyed, since the thread is never joined and may still be waiting on it while the
+// process exits.
+struct SubscriberDispatcher {
+    std::mutex mMutex;
+    // Notified whenever a trigger is queued or done.
+    std::condition_variable mCondition;
+    std::deque<PendingTrigger> mTriggers;
+    // Whether the thread is running triggers it took from mTriggers.
+    bool mDispatching = false;
+    bool mStarted = false;
+    // The triggers accepted within the last kTriggerCoalesceWindowNs, with the time they were.
+    std::deque<std::pair<TriggerKey, int64_t>> mRecentTriggers;
+};
+
+SubscriberDispatcher& getSubscriberDispatcher() {
+    static SubscriberDispatcher* dispatcher = new SubscriberDispatcher();
+    return *dispatcher;
+}
+
+void runTrigger(const PendingTrigger& trigger) {
+    const Subscription& subscription = trigger.subscription;
+    switch (subscription.subscriber_information_case()) {
+        case Subscription::SubscriberInformationCase::kIncidentdDetails:
+            if (!GenerateIncidentReport(subscription.incidentd_details(), trigger.ruleId,
+                                        trigger.configKey, trigger.incidentHeader)) {
+                ALOGW("Failed to generate incident report.");
+            }
+            break;
+        case Subscription::SubscriberInformationCase::kPerfettoDetails:
+            if (!CollectPerfettoTraceAndUploadToDropbox(subscription.perfetto_details(),
+                                                        subscription.id(), trigger.ruleId,
+                                                        trigger.configKey)) {
+                ALOGW("Failed to generate perfetto traces.");
+            }
+            break;
+        case Subscription::SubscriberInformationCase::kBroadcastSubscriberDetails:
+            SubscriberReporter::getInstance().alertBroadcastSubscriber(
+                    trigger.configKey, subscription, *trigger.dimensionsValueParcel);
+            break;
+        default:
+            break;
+    }
+}
+
+void runPendingTriggers() {
+    SubscriberDispatcher& dispatcher = getSubscriberDispatcher();
+    std::unique_lock<std::mutex> lock(dispatcher.mMutex);
+    while (true) {
+        dispatcher.mCondition.wait(lock, [&dispatcher] { return !dispatcher.mTriggers.empty(); });
+        // Take every trigger queued so far, so that a burst is run with one wakeup.
+        std::deque<PendingTrigger> triggers;
+        triggers.swap(dispatcher.mTriggers);
+        dispatcher.mDispatching = true;
+        lock.unlock();
+
+        for (const PendingTrigger& trigger : triggers) {
+            runTrigger(trigger);
+        }
+
+        lock.lock();
+        dispatcher.mDispatching = false;
+        dispatcher.mCondition.notify_all();
+    }
+}
+
+void queueTriggerLocked(SubscriberDispatcher& dispatcher, PendingTrigger trigger) {
+    dispatcher.mTriggers.push_back(std::move(trigger));
+    if (!dispatcher.mStarted) {
+        dispatcher.mStarted = true;
+        std::thread(runPendingTriggers).detach();
+    }
+    dispatcher.mCondition.notify_all();
+}
+
+// Queues the trigger unless the same one was queued within kTriggerCoalesceWindowNs.
+void dispatchTrigger(TriggerKey key, PendingTrigger trigger, int64_t nowNs) {
+    SubscriberDispatcher& dispatcher = getSubscriberDispatcher();
+    std::lock_guard<std::mutex> lock(dispatcher.mMutex);
+    while (!dispatcher.mRecentTriggers.empty() &&
+           nowNs - dispatcher.mRecentTriggers.front().second >= kTriggerCoalesceWindowNs) {
+        dispatcher.mRecentTriggers.pop_front();
+    }
+    for (const auto& [recentKey, _] : dispatcher.mRecentTriggers) {
+        if (recentKey == key) {
+            VLOG("Coalesced trigger of subscription %lld", (long long)key.subscriptionId);
+            return;
+        }
+    }
+    if (dispatcher.mTriggers.size() >= kMaxPendingTriggers) {
+        ALOGW("Too many pending subscriber triggers, dropping subscription %lld",
+              (long long)key.subscriptionId);
+        return;
+    }
+    dispatcher.mRecentTriggers.emplace_back(std::move(key), nowNs);
+    queueTriggerLocked(dispatcher, std::move(trigger));
+}
+
+// Queues a broadcast. Broadcasts are never coalesced, since each one reaches the subscriber.
+void dispatchBroadcast(PendingTrigger trigger) {
+    SubscriberDispatcher& dispatcher = getSubscriberDispatcher();
+    std::lock_guard<std::mutex> lock(dispatcher.mMutex);
+    if (dispatcher.mTriggers.size() >= kMaxPendingTriggers) {
+        ALOGW("Too many pending subscriber triggers, dropping subscription %lld",
+              (long long)trigger.subscription.id());
+        return;
+    }
+    queueTriggerLocked(dispatcher, std::move(trigger));
+}
+
+}  // anonymous namespace
+
 void triggerSubscribers(const int64_t ruleId, const int64_t metricId,
                         const MetricDimensionKey& dimensionKey, int64_t metricValue,
                         const ConfigKey& configKey,
@@ -37,6 +196,8 @@ void triggerSubscribers(const int64_t ruleId, const int64_t metricId,
         return;
     }
 
+    const int64_t nowNs = getElapsedRealtimeNs();
+    std::shared_ptr<const StatsDimensionsValueParcel> dimensionsValueParcel;
     for (const Subscription& subscription : subscriptions) {
         if (subscription.probability_of_informing() < 1
                 && ((float)rand() / (float)RAND_MAX) >= subscription.probability_of_informing()) {
@@ -46,21 +207,34 @@ void triggerSubscribers(const int64_t ruleId, const int64_t metricId,
             continue;
         }
         switch (subscription.subscriber_information_case()) {
-            case Subscription::SubscriberInformationCase::kIncidentdDetails:
-                if (!GenerateIncidentReport(subscription.incidentd_details(), ruleId, metricId,
-                                            dimensionKey, metricValue, configKey)) {
+            case Subscription::SubscriberInformationCase::kIncidentdDetails: {
+                const IncidentdDetails& details = subscription.incidentd_details();
+                if (details.section_size() == 0) {
+                    VLOG("The alert %lld contains zero section in config(%d,%lld)",
+                         (unsigned long long)ruleId, configKey.GetUid(),
+                         (long long)configKey.GetId());
                     ALOGW("Failed to generate incident report.");
+                    break;
                 }
+                dispatchTrigger({configKey, subscription.id(), ruleId, metricId, dimensionKey},
+                                {subscription, ruleId, configKey,
+                                 GetIncidentReportHeader(details, ruleId, metricId, dimensionKey,
+                                                         metricValue, configKey)},
+                                nowNs);
                 break;
+            }
             case Subscription::SubscriberInformationCase::kPerfettoDetails:
-                if (!CollectPerfettoTraceAndUploadToDropbox(subscription.perfetto_details(),
-                                                            subscription.id(), ruleId, configKey)) {
-                    ALOGW("Failed to generate perfetto traces.");
-                }
+                dispatchTrigger({configKey, subscription.id(), ruleId, metricId,
+                                 MetricDimensionKey()},
+                                {subscription, ruleId, configKey, /*incidentHeader=*/{}}, nowNs);
                 break;
             case Subscription::SubscriberInformationCase::kBroadcastSubscriberDetails:
-                SubscriberReporter::getInstance().alertBroadcastSubscriber(configKey, subscription,
-                                                                           dimensionKey);
+                if (dimensionsValueParcel == nullptr) {
+                    dimensionsValueParcel = std::make_shared<const StatsDimensionsValueParcel>(
+                            dimensionKey.getDimensionKeyInWhat().toStatsDimensionsValueParcel());
+                }
+                dispatchBroadcast({subscription, ruleId, configKey, /*incidentHeader=*/{},
+                                   dimensionsValueParcel});
                 break;
             default:
                 break;
@@ -68,6 +242,14 @@ void triggerSubscribers(const int64_t ruleId, const int64_t metricId,
     }
 }
 
+void waitForSubscriberTriggers() {
+    SubscriberDispatcher& dispatcher = getSubscriberDispatcher();
+    std::unique_lock<std::mutex> lock(dispatcher.mMutex);
+    dispatcher.mCondition.wait(lock, [&dispatcher] {
+        return dispatcher.mTriggers.empty() && !dispatcher.mDispatching;
+    });
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -24,10 +24,16 @@ namespace android {
 namespace os {
 namespace statsd {
 
+// Informs the subscribers of an alert. Incident reports, perfetto traces and broadcasts are
+// started on a dispatcher thread, since they make binder calls and fork processes.
 void triggerSubscribers(const int64_t ruleId, int64_t metricId,
                         const MetricDimensionKey& dimensionKey, int64_t metricValue,
                         const ConfigKey& configKey, const std::vector<Subscription>& subscriptions);
 
+// Blocks until the incident reports, perfetto traces and broadcasts triggered so far have been
+// started.
+void waitForSubscriberTriggers();
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
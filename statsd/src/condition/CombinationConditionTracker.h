@@ -53,6 +53,16 @@ public:
                         const bool isPartialLink,
                         std::vector<ConditionState>& conditionCache) const override;
 
+    // The children's versions only increase, so their sum increases whenever any of them does.
+    uint64_t getStateVersion(
+            const std::vector<sp<ConditionTracker>>& allConditions) const override {
+        uint64_t version = 0;
+        for (const int child : mChildren) {
+            version += allConditions[child]->getStateVersion(allConditions);
+        }
+        return version;
+    }
+
     // Only one child predicate can have dimension.
     const std::set<HashableDimensionKey>* getChangedToTrueDimensions(
             const std::vector<sp<ConditionTracker>>& allConditions) const override {
@@ -77,6 +87,10 @@ public:
         return nullptr;
     }
 
+    const std::vector<int>& getChildren() const override {
+        return mChildren;
+    }
+
     bool IsSimpleCondition() const  override { return false; }
 
     bool IsChangedDimensionTrackable() const  override {
@@ -87,7 +101,7 @@ public:
         const std::vector<sp<ConditionTracker>>& allConditions,
         const vector<Matcher>& dimensions) const override;
 
-    const std::map<HashableDimensionKey, int>* getSlicedDimensionMap(
+    const std::unordered_map<HashableDimensionKey, int>* getSlicedDimensionMap(
             const std::vector<sp<ConditionTracker>>& allConditions) const override {
         if (mSlicedChildren.size() == 1) {
             return allConditions[mSlicedChildren.front()]->getSlicedDimensionMap(allConditions);
@@ -111,11 +111,23 @@ public:
             const bool isPartialLink,
             std::vector<ConditionState>& conditionCache) const = 0;
 
+    // Returns a number that increases whenever the result of isConditionMet may change, for any
+    // parameters. Used to tell when memoized query results are stale.
+    virtual uint64_t getStateVersion(
+            const std::vector<sp<ConditionTracker>>& allConditions) const = 0;
+
     // return the list of AtomMatchingTracker index that this ConditionTracker uses.
     virtual const std::set<int>& getAtomMatchingTrackerIndex() const {
         return mTrackerIndex;
     }
 
+    // return the indices of the ConditionTrackers that evaluateCondition may evaluate on behalf of
+    // this ConditionTracker.
+    virtual const std::vector<int>& getChildren() const {
+        static const std::vector<int> kNoChildren;
+        return kNoChildren;
+    }
+
     virtual void setSliced(bool sliced) {
         mSliced = mSliced | sliced;
     }
@@ -137,7 +149,7 @@ public:
         return mProtoHash;
     }
 
-    virtual const std::map<HashableDimensionKey, int>* getSlicedDimensionMap(
+    virtual const std::unordered_map<HashableDimensionKey, int>* getSlicedDimensionMap(
             const std::vector<sp<ConditionTracker>>& allConditions) const = 0;
 
     virtual bool IsChangedDimensionTrackable() const = 0;
@@ -21,14 +21,57 @@ namespace statsd {
 
 using std::vector;
 
+size_t ConditionWizard::ConditionKeyHash::operator()(const ConditionKey& key) const {
+    android::hash_t hash = 0;
+    for (const auto& [conditionId, dimensionKey] : key) {
+        hash = android::JenkinsHashMix(hash, android::hash_type(conditionId));
+        hash = android::JenkinsHashMix(hash, hashDimension(dimensionKey));
+    }
+    return android::JenkinsHashWhiten(hash);
+}
+
 ConditionState ConditionWizard::query(const int index, const ConditionKey& parameters,
                                       const bool isPartialLink) {
-    vector<ConditionState> cache(mAllConditions.size(), ConditionState::kNotEvaluated);
+    if (mQueryMemos.size() != mAllConditions.size()) {
+        mQueryMemos.resize(mAllConditions.size());
+        mQueryCache.assign(mAllConditions.size(), ConditionState::kNotEvaluated);
+    }
+
+    QueryMemo& memo = mQueryMemos[index];
+    const uint64_t stateVersion = mAllConditions[index]->getStateVersion(mAllConditions);
+    if (memo.stateVersion != stateVersion) {
+        memo.stateVersion = stateVersion;
+        memo.results[0].clear();
+        memo.results[1].clear();
+    }
+    auto& results = memo.results[isPartialLink];
+    const auto it = results.find(parameters);
+    if (it != results.end()) {
+        return it->second;
+    }
 
-    mAllConditions[index]->isConditionMet(
-        parameters, mAllConditions, isPartialLink,
-        cache);
-    return cache[index];
+    mAllConditions[index]->isConditionMet(parameters, mAllConditions, isPartialLink, mQueryCache);
+    const ConditionState result = mQueryCache[index];
+    resetQueryCache(index);
+
+    if (results.size() >= kMaxMemoizedQueries) {
+        results.clear();
+    }
+    results.emplace(parameters, result);
+    return result;
+}
+
+void ConditionWizard::resetQueryCache(const int index) {
+    // isConditionMet writes a condition's entry after evaluating all of its children, so a
+    // condition that is still kNotEvaluated was not reached, and neither were its descendants
+    // through it.
+    if (mQueryCache[index] == ConditionState::kNotEvaluated) {
+        return;
+    }
+    mQueryCache[index] = ConditionState::kNotEvaluated;
+    for (const int childIndex : mAllConditions[index]->getChildren()) {
+        resetQueryCache(childIndex);
+    }
 }
 
 const set<HashableDimensionKey>* ConditionWizard::getChangedToTrueDimensions(
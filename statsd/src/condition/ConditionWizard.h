@@ -17,6 +17,10 @@
 #ifndef CONDITION_WIZARD_H
 #define CONDITION_WIZARD_H
 
+#include <gtest/gtest_prod.h>
+
+#include <unordered_map>
+
 #include "ConditionTracker.h"
 #include "condition_util.h"
 #include "stats_util.h"
@@ -39,6 +43,8 @@ public:
     //                       condition.
     // The ConditionTracker at [conditionIndex] can be a CombinationConditionTracker. In this case,
     // the conditionParameters contains the parameters for it's children SimpleConditionTrackers.
+    // Results are memoized until the state of the condition changes, so metrics that link to the
+    // same condition slice while handling one event only evaluate it once.
     virtual ConditionState query(const int conditionIndex, const ConditionKey& conditionParameters,
                                  const bool isPartialLink);
 
@@ -54,12 +60,37 @@ public:
         return mAllConditions[index]->getUnSlicedPartConditionState();
     }
 
-    const std::map<HashableDimensionKey, int>* getSlicedDimensionMap(const int index) const {
+    const std::unordered_map<HashableDimensionKey, int>* getSlicedDimensionMap(const int index) const {
         return mAllConditions[index]->getSlicedDimensionMap(mAllConditions);
     }
 
 private:
+    struct ConditionKeyHash {
+        size_t operator()(const ConditionKey& key) const;
+    };
+
+    // The memoized query results of one condition, computed at mStateVersion.
+    struct QueryMemo {
+        uint64_t stateVersion = 0;
+        // Indexed by isPartialLink.
+        std::unordered_map<ConditionKey, ConditionState, ConditionKeyHash> results[2];
+    };
+
+    // Drops the memoized results once there are this many for one condition.
+    static const size_t kMaxMemoizedQueries = 1000;
+
+    // Resets the entries of mQueryCache written when querying the condition at index.
+    void resetQueryCache(int index);
+
     std::vector<sp<ConditionTracker>> mAllConditions;
+
+    std::vector<QueryMemo> mQueryMemos;
+
+    // Scratch cache passed to isConditionMet. Reset to kNotEvaluated after each query.
+    std::vector<ConditionState> mQueryCache;
+
+    FRIEND_TEST(ConditionWizardTest, TestQueryMemoizedUntilStateChanges);
+    FRIEND_TEST(ConditionWizardTest, TestCombinationQueryTracksChildState);
 };
 
 }  // namespace statsd
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "condition/SharedConditionRegistry.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+std::shared_ptr<SimpleConditionState> SharedConditionRegistry::acquire(
+        uint64_t key, ConditionState initialValue) {
+    std::weak_ptr<SimpleConditionState>& weakState = mStates[key];
+    std::shared_ptr<SimpleConditionState> state = weakState.lock();
+    if (state == nullptr) {
+        // Drop the states of removed configs while at it, so mStates does not grow with every
+        // config ever added.
+        std::erase_if(mStates, [](const auto& entry) { return entry.second.expired(); });
+        state = std::make_shared<SimpleConditionState>(initialValue);
+        state->registry = shared_from_this();
+        mStates[key] = state;
+    }
+    return state;
+}
+
+bool SharedConditionRegistry::isShared(uint64_t key) const {
+    const auto it = mStates.find(key);
+    return it != mStates.end() && !it->second.expired();
+}
+
+size_t SharedConditionRegistry::size() const {
+    size_t count = 0;
+    for (const auto& [key, state] : mStates) {
+        if (!state.expired()) {
+            count++;
+        }
+    }
+    return count;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "condition/condition_util.h"
+#include "config/ConfigKey.h"
+#include "HashableDimensionKey.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+class SharedConditionRegistry;
+
+// The mutable state of a SimpleConditionTracker. Trackers of identical predicates in different
+// configs can share one, so that the predicate's sliced state is kept, and updated, only once.
+struct SimpleConditionState {
+    explicit SimpleConditionState(ConditionState initialValue) : initialValue(initialValue) {
+    }
+
+    ConditionState initialValue;
+
+    // The start count of each output key.
+    std::unordered_map<HashableDimensionKey, int> slicedConditionState;
+
+    // The number of keys in slicedConditionState with a positive start count, so the overall
+    // sliced condition is known without scanning every key.
+    size_t trueSliceCount = 0;
+
+    // Bumped on every change to slicedConditionState or initialValue.
+    uint64_t stateVersion = 0;
+
+    // The keys whose condition changed on the last evaluated event.
+    std::set<HashableDimensionKey> lastChangedToTrueDimensions;
+    std::set<HashableDimensionKey> lastChangedToFalseDimensions;
+
+    // The config and predicate id of every tracker using the state. The dimension guardrail is
+    // noted for each of them, whichever tracker applies the event.
+    std::vector<std::pair<ConfigKey, int64_t>> users;
+
+    // Set if the state is shared. The first tracker to evaluate an event applies it to the state
+    // and records its outcome here for the other trackers.
+    std::shared_ptr<const SharedConditionRegistry> registry;
+    uint64_t lastEventGeneration = 0;
+    ConditionState lastEventCondition = ConditionState::kNotEvaluated;
+    bool lastEventChanged = false;
+};
+
+/**
+ * Hands out the states of simple predicates that are defined identically in several configs.
+ * States are kept alive by the trackers that use them; the registry only refers to them weakly,
+ * so a state goes away with the last config that needs it.
+ *
+ * Not thread-safe. The owner calls startEvent() before dispatching each event to the configs.
+ */
+class SharedConditionRegistry : public std::enable_shared_from_this<SharedConditionRegistry> {
+public:
+    // Returns the state shared under key, creating it if no live tracker uses one yet.
+    std::shared_ptr<SimpleConditionState> acquire(uint64_t key, ConditionState initialValue);
+
+    void startEvent() {
+        mEventGeneration++;
+    }
+
+    uint64_t getEventGeneration() const {
+        return mEventGeneration;
+    }
+
+    // Whether a live tracker uses the state shared under key.
+    bool isShared(uint64_t key) const;
+
+    // The number of states still in use.
+    size_t size() const;
+
+private:
+    std::unordered_map<uint64_t, std::weak_ptr<SimpleConditionState>> mStates;
+
+    // Identifies the event being dispatched. States start at 0, before any event.
+    uint64_t mEventGeneration = 0;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
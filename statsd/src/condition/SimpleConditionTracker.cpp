@@ -20,6 +20,8 @@
 #include "SimpleConditionTracker.h"
 #include "guardrail/StatsdStats.h"
 
+#include <algorithm>
+
 namespace android {
 namespace os {
 namespace statsd {
@@ -46,14 +48,42 @@ SimpleConditionTracker::SimpleConditionTracker(
         mContainANYPositionInInternalDimensions = HasPositionANY(simplePredicate.dimensions());
     }
     // If an initial value isn't specified, default to false if sliced and unknown if not sliced.
-    mInitialValue = simplePredicate.has_initial_value()
-                            ? convertInitialValue(simplePredicate.initial_value())
-                            : mSliced ? ConditionState::kFalse : ConditionState::kUnknown;
+    mState = std::make_shared<SimpleConditionState>(
+            simplePredicate.has_initial_value()
+                    ? convertInitialValue(simplePredicate.initial_value())
+                    : mSliced ? ConditionState::kFalse : ConditionState::kUnknown);
+    mState->users.emplace_back(mConfigKey, mConditionId);
     mInitialized = true;
 }
 
+void SimpleConditionTracker::shareState(SharedConditionRegistry& registry, uint64_t key) {
+    mState = registry.acquire(key, mState->initialValue);
+    mState->users.emplace_back(mConfigKey, mConditionId);
+    mSharedStateKey = key;
+}
+
+void SimpleConditionTracker::keepSharingState(const optional<uint64_t>& key) {
+    if (!mSharedStateKey.has_value() || mSharedStateKey == key) {
+        return;
+    }
+    removeStateUser();
+    mState = std::make_shared<SimpleConditionState>(*mState);
+    mState->registry = nullptr;
+    mState->users = {{mConfigKey, mConditionId}};
+    mSharedStateKey = nullopt;
+}
+
+void SimpleConditionTracker::removeStateUser() {
+    auto& users = mState->users;
+    const auto it = std::find(users.begin(), users.end(), std::make_pair(mConfigKey, mConditionId));
+    if (it != users.end()) {
+        users.erase(it);
+    }
+}
+
 SimpleConditionTracker::~SimpleConditionTracker() {
     VLOG("~SimpleConditionTracker()");
+    removeStateUser();
 }
 
 optional<InvalidConfigReason> SimpleConditionTracker::init(
@@ -129,50 +159,59 @@ void SimpleConditionTracker::setMatcherIndices(
 }
 
 void SimpleConditionTracker::dumpState() {
+    SimpleConditionState& state = *mState;
     VLOG("%lld DUMP:", (long long)mConditionId);
-    for (const auto& pair : mSlicedConditionState) {
+    for (const auto& pair : state.slicedConditionState) {
         VLOG("\t%s : %d", pair.first.toString().c_str(), pair.second);
     }
 
     VLOG("Changed to true keys: \n");
-    for (const auto& key : mLastChangedToTrueDimensions) {
+    for (const auto& key : state.lastChangedToTrueDimensions) {
         VLOG("%s", key.toString().c_str());
     }
     VLOG("Changed to false keys: \n");
-    for (const auto& key : mLastChangedToFalseDimensions) {
+    for (const auto& key : state.lastChangedToFalseDimensions) {
         VLOG("%s", key.toString().c_str());
     }
 }
 
 void SimpleConditionTracker::handleStopAll(std::vector<ConditionState>& conditionCache,
                                            std::vector<uint8_t>& conditionChangedCache) {
+    SimpleConditionState& state = *mState;
     // Unless the default condition is false, and there was nothing started, otherwise we have
     // triggered a condition change.
     conditionChangedCache[mIndex] =
-            (mInitialValue == ConditionState::kFalse && mSlicedConditionState.empty()) ? false
-                                                                                           : true;
+            (state.initialValue == ConditionState::kFalse && state.slicedConditionState.empty())
+                    ? false
+                    : true;
 
-    for (const auto& cond : mSlicedConditionState) {
+    for (const auto& cond : state.slicedConditionState) {
         if (cond.second > 0) {
-            mLastChangedToFalseDimensions.insert(cond.first);
+            state.lastChangedToFalseDimensions.insert(cond.first);
         }
     }
 
     // After StopAll, we know everything has stopped. From now on, default condition is false.
-    mInitialValue = ConditionState::kFalse;
-    mSlicedConditionState.clear();
+    state.initialValue = ConditionState::kFalse;
+    state.slicedConditionState.clear();
+    state.trueSliceCount = 0;
+    state.stateVersion++;
     conditionCache[mIndex] = ConditionState::kFalse;
 }
 
 bool SimpleConditionTracker::hitGuardRail(const HashableDimensionKey& newKey) const {
-    if (!mSliced || mSlicedConditionState.find(newKey) != mSlicedConditionState.end()) {
+    const SimpleConditionState& state = *mState;
+    if (!mSliced || state.slicedConditionState.find(newKey) != state.slicedConditionState.end()) {
         // if the condition is not sliced or the key is not new, we are good!
         return false;
     }
     // 1. Report the tuple count if the tuple count > soft limit
-    if (mSlicedConditionState.size() >= StatsdStats::kDimensionKeySizeSoftLimit) {
-        size_t newTupleCount = mSlicedConditionState.size() + 1;
-        StatsdStats::getInstance().noteConditionDimensionSize(mConfigKey, mConditionId, newTupleCount);
+    if (state.slicedConditionState.size() >= StatsdStats::kDimensionKeySizeSoftLimit) {
+        size_t newTupleCount = state.slicedConditionState.size() + 1;
+        for (const auto& [configKey, conditionId] : state.users) {
+            StatsdStats::getInstance().noteConditionDimensionSize(configKey, conditionId,
+                                                                  newTupleCount);
+        }
         // 2. Don't add more tuples, we are above the allowed threshold. Drop the data.
         if (newTupleCount > StatsdStats::kDimensionKeySizeHardLimit) {
             ALOGE("Predicate %lld dropping data for dimension key %s",
@@ -186,8 +225,9 @@ bool SimpleConditionTracker::hitGuardRail(const HashableDimensionKey& newKey) co
 void SimpleConditionTracker::handleConditionEvent(const HashableDimensionKey& outputKey,
                                                   bool matchStart, ConditionState* conditionCache,
                                                   bool* conditionChangedCache) {
+    SimpleConditionState& state = *mState;
     bool changed = false;
-    auto outputIt = mSlicedConditionState.find(outputKey);
+    auto outputIt = state.slicedConditionState.find(outputKey);
     ConditionState newCondition;
     if (hitGuardRail(outputKey)) {
         (*conditionChangedCache) = false;
@@ -195,18 +235,22 @@ void SimpleConditionTracker::handleConditionEvent(const HashableDimensionKey& ou
         (*conditionCache) = ConditionState::kUnknown;
         return;
     }
-    if (outputIt == mSlicedConditionState.end()) {
+    // Start counts may change below. Not every change is visible to isConditionMet, but bumping
+    // unconditionally keeps this simple, and at worst recomputes a memoized query.
+    state.stateVersion++;
+    if (outputIt == state.slicedConditionState.end()) {
         // We get a new output key.
         newCondition = matchStart ? ConditionState::kTrue : ConditionState::kFalse;
-        if (matchStart && mInitialValue != ConditionState::kTrue) {
-            mSlicedConditionState[outputKey] = 1;
+        if (matchStart && state.initialValue != ConditionState::kTrue) {
+            state.slicedConditionState[outputKey] = 1;
+            state.trueSliceCount++;
             changed = true;
-            mLastChangedToTrueDimensions.insert(outputKey);
-        } else if (mInitialValue != ConditionState::kFalse) {
+            state.lastChangedToTrueDimensions.insert(outputKey);
+        } else if (state.initialValue != ConditionState::kFalse) {
             // it's a stop and we don't have history about it.
             // If the default condition is not false, it means this stop is valuable to us.
-            mSlicedConditionState[outputKey] = 0;
-            mLastChangedToFalseDimensions.insert(outputKey);
+            state.slicedConditionState[outputKey] = 0;
+            state.lastChangedToFalseDimensions.insert(outputKey);
             changed = true;
         }
     } else {
@@ -216,7 +260,8 @@ void SimpleConditionTracker::handleConditionEvent(const HashableDimensionKey& ou
         newCondition = startedCount > 0 ? ConditionState::kTrue : ConditionState::kFalse;
         if (matchStart) {
             if (startedCount == 0) {
-                mLastChangedToTrueDimensions.insert(outputKey);
+                state.trueSliceCount++;
+                state.lastChangedToTrueDimensions.insert(outputKey);
                 // This condition for this output key will change from false -> true
                 changed = true;
             }
@@ -240,14 +285,15 @@ void SimpleConditionTracker::handleConditionEvent(const HashableDimensionKey& ou
                 }
                 // if everything has stopped for this output key, condition true -> false;
                 if (startedCount == 0) {
-                    mLastChangedToFalseDimensions.insert(outputKey);
+                    state.trueSliceCount--;
+                    state.lastChangedToFalseDimensions.insert(outputKey);
                     changed = true;
                 }
             }
 
             // if default condition is false, it means we don't need to keep the false values.
-            if (mInitialValue == ConditionState::kFalse && startedCount == 0) {
-                mSlicedConditionState.erase(outputIt);
+            if (state.initialValue == ConditionState::kFalse && startedCount == 0) {
+                state.slicedConditionState.erase(outputIt);
                 VLOG("erase key %s", outputKey.toString().c_str());
             }
         }
@@ -276,8 +322,30 @@ void SimpleConditionTracker::evaluateCondition(const LogEvent& event,
             (long long)mConditionId, conditionCache[mIndex]);
         return;
     }
-    mLastChangedToTrueDimensions.clear();
-    mLastChangedToFalseDimensions.clear();
+    if (mState->registry == nullptr) {
+        applyEvent(event, eventMatcherValues, conditionCache, conditionChangedCache);
+        return;
+    }
+    const uint64_t eventGeneration = mState->registry->getEventGeneration();
+    if (mState->lastEventGeneration == eventGeneration) {
+        // The tracker of another config already applied this event to the shared state.
+        conditionCache[mIndex] = mState->lastEventCondition;
+        conditionChangedCache[mIndex] = mState->lastEventChanged;
+        return;
+    }
+    applyEvent(event, eventMatcherValues, conditionCache, conditionChangedCache);
+    mState->lastEventGeneration = eventGeneration;
+    mState->lastEventCondition = conditionCache[mIndex];
+    mState->lastEventChanged = conditionChangedCache[mIndex];
+}
+
+void SimpleConditionTracker::applyEvent(const LogEvent& event,
+                                        const vector<MatchingState>& eventMatcherValues,
+                                        vector<ConditionState>& conditionCache,
+                                        vector<uint8_t>& conditionChangedCache) {
+    SimpleConditionState& state = *mState;
+    state.lastChangedToTrueDimensions.clear();
+    state.lastChangedToFalseDimensions.clear();
 
     if (mStopAllLogMatcherIndex >= 0 && mStopAllLogMatcherIndex < int(eventMatcherValues.size()) &&
         eventMatcherValues[mStopAllLogMatcherIndex] == MatchingState::kMatched) {
@@ -304,19 +372,14 @@ void SimpleConditionTracker::evaluateCondition(const LogEvent& event,
         if (mSliced) {
             // if the condition result is sliced. The overall condition is true if any of the sliced
             // condition is true
-            conditionCache[mIndex] = mInitialValue;
-            for (const auto& slicedCondition : mSlicedConditionState) {
-                if (slicedCondition.second > 0) {
-                    conditionCache[mIndex] = ConditionState::kTrue;
-                    break;
-                }
-            }
+            conditionCache[mIndex] =
+                    state.trueSliceCount > 0 ? ConditionState::kTrue : state.initialValue;
         } else {
-            const auto& itr = mSlicedConditionState.find(DEFAULT_DIMENSION_KEY);
-            if (itr == mSlicedConditionState.end()) {
+            const auto& itr = state.slicedConditionState.find(DEFAULT_DIMENSION_KEY);
+            if (itr == state.slicedConditionState.end()) {
                 // condition not sliced, but we haven't seen the matched start or stop yet. so
                 // return initial value.
-                conditionCache[mIndex] = mInitialValue;
+                conditionCache[mIndex] = state.initialValue;
             } else {
                 // return the cached condition.
                 conditionCache[mIndex] =
@@ -326,7 +389,7 @@ void SimpleConditionTracker::evaluateCondition(const LogEvent& event,
         return;
     }
 
-    ConditionState overallState = mInitialValue;
+    ConditionState overallState = state.initialValue;
     bool overallChanged = false;
 
     if (mOutputDimensions.size() == 0) {
@@ -334,7 +397,7 @@ void SimpleConditionTracker::evaluateCondition(const LogEvent& event,
                              &overallChanged);
     } else if (!mContainANYPositionInInternalDimensions) {
         HashableDimensionKey outputValue;
-        filterValues(mOutputDimensions, event.getValues(), &outputValue);
+        filterValues(mOutputDimensions, event, &outputValue);
 
         // If this event has multiple nodes in the attribution chain,  this log event probably will
         // generate multiple dimensions. If so, we will find if the condition changes for any
@@ -354,6 +417,7 @@ void SimpleConditionTracker::isConditionMet(
         const ConditionKey& conditionParameters, const vector<sp<ConditionTracker>>& allConditions,
         const bool isPartialLink,
         vector<ConditionState>& conditionCache) const {
+    const SimpleConditionState& state = *mState;
 
     if (conditionCache[mIndex] != ConditionState::kNotEvaluated) {
         // it has been evaluated.
@@ -365,10 +429,10 @@ void SimpleConditionTracker::isConditionMet(
 
     if (pair == conditionParameters.end()) {
         ConditionState conditionState = ConditionState::kNotEvaluated;
-        conditionState = conditionState | mInitialValue;
+        conditionState = conditionState | state.initialValue;
         if (!mSliced) {
-            const auto& itr = mSlicedConditionState.find(DEFAULT_DIMENSION_KEY);
-            if (itr != mSlicedConditionState.end()) {
+            const auto& itr = state.slicedConditionState.find(DEFAULT_DIMENSION_KEY);
+            if (itr != state.slicedConditionState.end()) {
                 ConditionState sliceState =
                     itr->second > 0 ? ConditionState::kTrue : ConditionState::kFalse;
                 conditionState = conditionState | sliceState;
@@ -383,8 +447,8 @@ void SimpleConditionTracker::isConditionMet(
     if (isPartialLink) {
         // For unseen key, check whether the require dimensions are subset of sliced condition
         // output.
-        conditionState = conditionState | mInitialValue;
-        for (const auto& slice : mSlicedConditionState) {
+        conditionState = conditionState | state.initialValue;
+        for (const auto& slice : state.slicedConditionState) {
             ConditionState sliceState =
                 slice.second > 0 ? ConditionState::kTrue : ConditionState::kFalse;
             if (slice.first.contains(key)) {
@@ -392,9 +456,9 @@ void SimpleConditionTracker::isConditionMet(
             }
         }
     } else {
-        auto startedCountIt = mSlicedConditionState.find(key);
-        conditionState = conditionState | mInitialValue;
-        if (startedCountIt != mSlicedConditionState.end()) {
+        auto startedCountIt = state.slicedConditionState.find(key);
+        conditionState = conditionState | state.initialValue;
+        if (startedCountIt != state.slicedConditionState.end()) {
             ConditionState sliceState =
                 startedCountIt->second > 0 ? ConditionState::kTrue : ConditionState::kFalse;
             conditionState = conditionState | sliceState;
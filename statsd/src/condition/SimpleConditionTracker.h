@@ -19,6 +19,7 @@
 
 #include <gtest/gtest_prod.h>
 #include "ConditionTracker.h"
+#include "condition/SharedConditionRegistry.h"
 #include "config/ConfigKey.h"
 #include "src/statsd_config.pb.h"
 #include "stats_util.h"
@@ -58,10 +59,15 @@ public:
                         const bool isPartialLink,
                         std::vector<ConditionState>& conditionCache) const override;
 
+    uint64_t getStateVersion(
+            const std::vector<sp<ConditionTracker>>& allConditions) const override {
+        return mState->stateVersion;
+    }
+
     virtual const std::set<HashableDimensionKey>* getChangedToTrueDimensions(
             const std::vector<sp<ConditionTracker>>& allConditions) const {
         if (mSliced) {
-            return &mLastChangedToTrueDimensions;
+            return &mState->lastChangedToTrueDimensions;
         } else {
             return nullptr;
         }
@@ -70,17 +76,26 @@ public:
     virtual const std::set<HashableDimensionKey>* getChangedToFalseDimensions(
             const std::vector<sp<ConditionTracker>>& allConditions) const {
         if (mSliced) {
-            return &mLastChangedToFalseDimensions;
+            return &mState->lastChangedToFalseDimensions;
         } else {
             return nullptr;
         }
     }
 
-    const std::map<HashableDimensionKey, int>* getSlicedDimensionMap(
+    const std::unordered_map<HashableDimensionKey, int>* getSlicedDimensionMap(
             const std::vector<sp<ConditionTracker>>& allConditions) const override {
-        return &mSlicedConditionState;
+        return &mState->slicedConditionState;
     }
 
+    // Makes this tracker use the state that registry keeps under key for identical predicates of
+    // other configs. Must be called before the tracker sees any event.
+    void shareState(SharedConditionRegistry& registry, uint64_t key);
+
+    // Called when a config update preserves this tracker, with the key it would be shared under
+    // now. If that is not the key its state is shared under, e.g. because the log sources of the
+    // config changed, the tracker continues with a private copy of the state.
+    void keepSharingState(const optional<uint64_t>& key);
+
     bool IsChangedDimensionTrackable() const  override { return true; }
 
     bool IsSimpleCondition() const  override { return true; }
@@ -105,20 +120,23 @@ private:
     // The index of the LogEventMatcher which defines the stop all.
     int mStopAllLogMatcherIndex;
 
-    ConditionState mInitialValue;
-
     std::vector<Matcher> mOutputDimensions;
 
     bool mContainANYPositionInInternalDimensions;
 
-    std::set<HashableDimensionKey> mLastChangedToTrueDimensions;
-    std::set<HashableDimensionKey> mLastChangedToFalseDimensions;
+    // Private to this tracker unless shareState was called.
+    std::shared_ptr<SimpleConditionState> mState;
 
-    std::map<HashableDimensionKey, int> mSlicedConditionState;
+    // The key mState is shared under, if it is shared.
+    optional<uint64_t> mSharedStateKey;
 
     void setMatcherIndices(const SimplePredicate& predicate,
                            const std::unordered_map<int64_t, int>& logTrackerMap);
 
+    void applyEvent(const LogEvent& event, const std::vector<MatchingState>& eventMatcherValues,
+                    std::vector<ConditionState>& conditionCache,
+                    std::vector<uint8_t>& changedCache);
+
     void handleStopAll(std::vector<ConditionState>& conditionCache,
                        std::vector<uint8_t>& changedCache);
 
@@ -127,6 +145,9 @@ private:
 
     bool hitGuardRail(const HashableDimensionKey& newKey) const;
 
+    // Removes this tracker from the users of mState.
+    void removeStateUser();
+
     void dumpState();
 
     FRIEND_TEST(SimpleConditionTrackerTest, TestSlicedCondition);
@@ -134,6 +155,9 @@ private:
     FRIEND_TEST(SimpleConditionTrackerTest, TestStopAll);
     FRIEND_TEST(SimpleConditionTrackerTest, TestGuardrailNotHitWhenDefaultFalse);
     FRIEND_TEST(SimpleConditionTrackerTest, TestGuardrailHitWhenDefaultUnknown);
+    FRIEND_TEST(SimpleConditionTrackerTest, TestSharedState);
+    FRIEND_TEST(SimpleConditionTrackerTest, TestSharedStateGuardrailNotedForEveryConfig);
+    FRIEND_TEST(StatsLogProcessorTest, TestPrebuiltConfigSharingLivePredicateRebuilt);
     FRIEND_TEST(ConfigUpdateTest, TestUpdateConditions);
 };
 
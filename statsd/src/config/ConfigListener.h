@@ -20,6 +20,8 @@
 
 #include <utils/RefBase.h>
 
+#include <map>
+
 namespace android {
 namespace os {
 namespace statsd {
@@ -39,6 +41,17 @@ public:
     virtual void OnConfigUpdated(int64_t timestampNs, const ConfigKey& key,
                                  const StatsdConfig& config, bool modularUpdate = true) = 0;
 
+    /**
+     * Configurations were added or updated together, such as those loaded from disk at startup.
+     * Listeners that can take them in one go override this.
+     */
+    virtual void OnConfigsUpdated(int64_t timestampNs,
+                                  const std::map<ConfigKey, StatsdConfig>& configs) {
+        for (const auto& [key, config] : configs) {
+            OnConfigUpdated(timestampNs, key, config);
+        }
+    }
+
     /**
      * A configuration was removed.
      */
@@ -49,11 +49,32 @@ ConfigManager::~ConfigManager() {
 }
 
 void ConfigManager::Startup() {
+    const int64_t startNs = getElapsedRealtimeNs();
     map<ConfigKey, StatsdConfig> configsFromDisk;
     StorageManager::readConfigFromDisk(configsFromDisk);
-    for (const auto& config : configsFromDisk) {
-        UpdateConfig(config.first, config.second);
+    const int64_t readEndNs = getElapsedRealtimeNs();
+
+    vector<sp<ConfigListener>> broadcastList;
+    {
+        lock_guard<mutex> lock(mMutex);
+        for (auto it = configsFromDisk.begin(); it != configsFromDisk.end();) {
+            if (updateConfigLocked(it->first, it->second)) {
+                it++;
+            } else {
+                it = configsFromDisk.erase(it);
+            }
+        }
+        broadcastList = mListeners;
     }
+
+    // All the configs are handed over at once, so that events are not matched against some of
+    // them while the others are still being set up.
+    const int64_t timestampNs = getElapsedRealtimeNs();
+    for (const sp<ConfigListener>& listener : broadcastList) {
+        listener->OnConfigsUpdated(timestampNs, configsFromDisk);
+    }
+    StatsdStats::getInstance().noteConfigsLoadedAtStartup(
+            configsFromDisk.size(), readEndNs - startNs, getElapsedRealtimeNs() - readEndNs);
 }
 
 void ConfigManager::StartupForTest() {
@@ -69,39 +90,9 @@ void ConfigManager::UpdateConfig(const ConfigKey& key, const StatsdConfig& confi
     vector<sp<ConfigListener>> broadcastList;
     {
         lock_guard <mutex> lock(mMutex);
-
-        const int numBytes = config.ByteSize();
-        vector<uint8_t> buffer(numBytes);
-        config.SerializeToArray(buffer.data(), numBytes);
-
-        auto uidIt = mConfigs.find(key.GetUid());
-        // GuardRail: Limit the number of configs per uid.
-        if (uidIt != mConfigs.end()) {
-            auto it = uidIt->second.find(key);
-            if (it == uidIt->second.end() &&
-                uidIt->second.size() >= StatsdStats::kMaxConfigCountPerUid) {
-                ALOGE("ConfigManager: uid %d has exceeded the config count limit", key.GetUid());
-                return;
-            }
-        }
-
-        // Check if it's a duplicate config.
-        if (uidIt != mConfigs.end() && uidIt->second.find(key) != uidIt->second.end() &&
-            StorageManager::hasIdenticalConfig(key, buffer)) {
-            // This is a duplicate config.
-            ALOGI("ConfigManager This is a duplicate config %s", key.ToString().c_str());
-            // Update saved file on disk. We still update timestamp of file when
-            // there exists a duplicate configuration to avoid garbage collection.
-            update_saved_configs_locked(key, buffer, numBytes);
+        if (!updateConfigLocked(key, config)) {
             return;
         }
-
-        // Update saved file on disk.
-        update_saved_configs_locked(key, buffer, numBytes);
-
-        // Add to set.
-        mConfigs[key.GetUid()].insert(key);
-
         broadcastList = mListeners;
     }
 
@@ -112,6 +103,41 @@ void ConfigManager::UpdateConfig(const ConfigKey& key, const StatsdConfig& confi
     }
 }
 
+bool ConfigManager::updateConfigLocked(const ConfigKey& key, const StatsdConfig& config) {
+    const int numBytes = config.ByteSize();
+    vector<uint8_t> buffer(numBytes);
+    config.SerializeToArray(buffer.data(), numBytes);
+
+    auto uidIt = mConfigs.find(key.GetUid());
+    // GuardRail: Limit the number of configs per uid.
+    if (uidIt != mConfigs.end()) {
+        auto it = uidIt->second.find(key);
+        if (it == uidIt->second.end() &&
+            uidIt->second.size() >= StatsdStats::kMaxConfigCountPerUid) {
+            ALOGE("ConfigManager: uid %d has exceeded the config count limit", key.GetUid());
+            return false;
+        }
+    }
+
+    // Check if it's a duplicate config.
+    if (uidIt != mConfigs.end() && uidIt->second.find(key) != uidIt->second.end() &&
+        StorageManager::hasIdenticalConfig(key, buffer)) {
+        // This is a duplicate config.
+        ALOGI("ConfigManager This is a duplicate config %s", key.ToString().c_str());
+        // Update saved file on disk. We still update timestamp of file when
+        // there exists a duplicate configuration to avoid garbage collection.
+        update_saved_configs_locked(key, buffer, numBytes);
+        return false;
+    }
+
+    // Update saved file on disk.
+    update_saved_configs_locked(key, buffer, numBytes);
+
+    // Add to set.
+    mConfigs[key.GetUid()].insert(key);
+    return true;
+}
+
 void ConfigManager::SetConfigReceiver(const ConfigKey& key,
                                       const shared_ptr<IPendingIntentRef>& pir) {
     lock_guard<mutex> lock(mMutex);
@@ -159,6 +159,12 @@ public:
 private:
     mutable std::mutex mMutex;
 
+    /**
+     * Records the configuration and saves it to disk. Returns false if listeners need not hear
+     * about it, because it is over the guardrail or identical to the one already set.
+     */
+    bool updateConfigLocked(const ConfigKey& key, const StatsdConfig& config);
+
     /**
      * Save the configs to disk.
      */
@@ -42,44 +42,30 @@ StatsCallbackPuller::StatsCallbackPuller(int tagId, const shared_ptr<IPullAtomCa
     VLOG("StatsCallbackPuller created for tag %d", tagId);
 }
 
-PullErrorCode StatsCallbackPuller::PullInternal(vector<shared_ptr<LogEvent>>* data) {
-    VLOG("StatsCallbackPuller called for tag %d", mTagId);
-    if(mCallback == nullptr) {
+PullErrorCode StatsCallbackPuller::PullAsync(const PullFinishedCallback& onPullFinished) {
+    if (mCallback == nullptr) {
         ALOGW("No callback registered");
         return PULL_FAIL;
     }
 
-    // Shared variables needed in the result receiver.
-    shared_ptr<mutex> cv_mutex = make_shared<mutex>();
-    shared_ptr<condition_variable> cv = make_shared<condition_variable>();
-    shared_ptr<bool> pullFinish = make_shared<bool>(false);
-    shared_ptr<bool> pullSuccess = make_shared<bool>(false);
-    shared_ptr<vector<shared_ptr<LogEvent>>> sharedData =
-            make_shared<vector<shared_ptr<LogEvent>>>();
-
     shared_ptr<PullResultReceiver> resultReceiver = SharedRefBase::make<PullResultReceiver>(
-            [cv_mutex, cv, pullFinish, pullSuccess, sharedData](
-                    int32_t atomTag, bool success, const vector<StatsEventParcel>& output) {
+            [onPullFinished](int32_t atomTag, bool success,
+                             const vector<StatsEventParcel>& output) {
                 // This is the result of the pull, executing in a statsd binder thread.
-                // The pull could have taken a long time, and we should only modify
-                // data (the output param) if the pointer is in scope and the pull did not time out.
-                {
-                    lock_guard<mutex> lk(*cv_mutex);
-                    for (const StatsEventParcel& parcel: output) {
-                        shared_ptr<LogEvent> event = make_shared<LogEvent>(/*uid=*/-1, /*pid=*/-1);
-                        bool valid = event->parseBuffer((uint8_t*)parcel.buffer.data(),
-                                                        parcel.buffer.size());
-                        if (valid) {
-                            sharedData->push_back(event);
-                        } else {
-                            StatsdStats::getInstance().noteAtomError(event->GetTagId(),
-                                                                     /*pull=*/true);
-                        }
+                vector<shared_ptr<LogEvent>> events;
+                events.reserve(output.size());
+                for (const StatsEventParcel& parcel : output) {
+                    shared_ptr<LogEvent> event = make_shared<LogEvent>(/*uid=*/-1, /*pid=*/-1);
+                    bool valid = event->parseBuffer((uint8_t*)parcel.buffer.data(),
+                                                    parcel.buffer.size());
+                    if (valid) {
+                        events.push_back(std::move(event));
+                    } else {
+                        StatsdStats::getInstance().noteAtomError(event->GetTagId(),
+                                                                 /*pull=*/true);
                     }
-                    *pullSuccess = success;
-                    *pullFinish = true;
                 }
-                cv->notify_one();
+                onPullFinished(success, events);
             });
 
     // Initiate the pull. This is a oneway call to a different process, except
@@ -93,6 +79,37 @@ PullErrorCode StatsCallbackPuller::PullInternal(vector<shared_ptr<LogEvent>>* da
         }
         return PULL_FAIL;
     }
+    return PULL_SUCCESS;
+}
+
+PullErrorCode StatsCallbackPuller::PullInternal(vector<shared_ptr<LogEvent>>* data) {
+    VLOG("StatsCallbackPuller called for tag %d", mTagId);
+
+    // Shared variables needed in the result callback.
+    shared_ptr<mutex> cv_mutex = make_shared<mutex>();
+    shared_ptr<condition_variable> cv = make_shared<condition_variable>();
+    shared_ptr<bool> pullFinish = make_shared<bool>(false);
+    shared_ptr<bool> pullSuccess = make_shared<bool>(false);
+    shared_ptr<vector<shared_ptr<LogEvent>>> sharedData =
+            make_shared<vector<shared_ptr<LogEvent>>>();
+
+    PullErrorCode status = PullAsync([cv_mutex, cv, pullFinish, pullSuccess, sharedData](
+                                             bool success, vector<shared_ptr<LogEvent>>& events) {
+        // The pull could have taken a long time, and we should only modify
+        // data (the output param) if the pointer is in scope and the pull did not time out.
+        // The events were parsed before taking the lock, which is only needed to hand
+        // them over.
+        {
+            lock_guard<mutex> lk(*cv_mutex);
+            *sharedData = std::move(events);
+            *pullSuccess = success;
+            *pullFinish = true;
+        }
+        cv->notify_one();
+    });
+    if (status != PULL_SUCCESS) {
+        return status;
+    }
 
     {
         unique_lock<mutex> unique_lk(*cv_mutex);
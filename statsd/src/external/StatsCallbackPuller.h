@@ -17,6 +17,9 @@
 #pragma once
 
 #include <aidl/android/os/IPullAtomCallback.h>
+
+#include <functional>
+
 #include "StatsPuller.h"
 
 using aidl::android::os::IPullAtomCallback;
@@ -32,6 +35,17 @@ public:
                                  const int64_t coolDownNs, int64_t timeoutNs,
                                  const std::vector<int>& additiveFields);
 
+    // Called with the parsed events once the client answers an asynchronous pull.
+    using PullFinishedCallback =
+            std::function<void(bool success, vector<std::shared_ptr<LogEvent>>& data)>;
+
+    // Asks the client for the atom and returns without waiting for the answer, so one thread can
+    // have many callback pulls outstanding. onPullFinished runs exactly once on the binder
+    // thread that receives the result, or never if the client does not answer; the caller owns
+    // the timeout. The returned code only reflects issuing the binder call. Unlike Pull(), this
+    // bypasses the cache and isolated uid merging.
+    PullErrorCode PullAsync(const PullFinishedCallback& onPullFinished);
+
 private:
     PullErrorCode PullInternal(vector<std::shared_ptr<LogEvent>>* data) override;
     const shared_ptr<IPullAtomCallback> mCallback;
@@ -22,6 +22,7 @@
 #include "guardrail/StatsdStats.h"
 #include "puller_util.h"
 #include "stats_log_util.h"
+#include "utils/StatsdTrace.h"
 
 namespace android {
 namespace os {
@@ -44,17 +45,33 @@ StatsPuller::StatsPuller(const int tagId, const int64_t coolDownNs, const int64_
 
 PullErrorCode StatsPuller::Pull(const int64_t eventTimeNs,
                                 std::vector<std::shared_ptr<LogEvent>>* data) {
+    PullSnapshot snapshot;
+    PullErrorCode status = Pull(eventTimeNs, &snapshot);
+    if (status == PULL_SUCCESS) {
+        (*data) = *snapshot;
+    }
+    return status;
+}
+
+PullErrorCode StatsPuller::Pull(const int64_t eventTimeNs, PullSnapshot* snapshot) {
+    STATSD_TRACE("StatsPuller::Pull atom=%d", mTagId);
+    static const PullSnapshot kEmptySnapshot =
+            std::make_shared<const std::vector<std::shared_ptr<LogEvent>>>();
+    *snapshot = kEmptySnapshot;
+
     lock_guard<std::mutex> lock(mLock);
     const int64_t elapsedTimeNs = getElapsedRealtimeNs();
     const int64_t systemUptimeMillis = getSystemUptimeMillis();
     StatsdStats::getInstance().notePull(mTagId);
     const bool shouldUseCache =
-            (mLastEventTimeNs == eventTimeNs) || (elapsedTimeNs - mLastPullTimeNs < mCoolDownNs);
+            (mLastEventTimeNs == eventTimeNs) ||
+            (elapsedTimeNs - mLastPullTimeNs < getCoolDownNsLocked());
     if (shouldUseCache) {
         if (mHasGoodData) {
-            (*data) = mCachedData;
+            if (mCachedData != nullptr) {
+                *snapshot = mCachedData;
+            }
             StatsdStats::getInstance().notePullFromCache(mTagId);
-
         }
         return mHasGoodData ? PULL_SUCCESS : PULL_FAIL;
     }
@@ -62,21 +79,23 @@ PullErrorCode StatsPuller::Pull(const int64_t eventTimeNs,
         StatsdStats::getInstance().updateMinPullIntervalSec(
                 mTagId, (elapsedTimeNs - mLastPullTimeNs) / NS_PER_SEC);
     }
-    mCachedData.clear();
+    mCachedData = nullptr;
+    mLastPullDurationNs = 0;
     mLastPullTimeNs = elapsedTimeNs;
     mLastEventTimeNs = eventTimeNs;
-    PullErrorCode status = PullInternal(&mCachedData);
+    std::vector<std::shared_ptr<LogEvent>> pulledData;
+    PullErrorCode status = PullInternal(&pulledData);
+    const int64_t pullElapsedDurationNs = getElapsedRealtimeNs() - elapsedTimeNs;
+    mRecentPullDurationNs.store(pullElapsedDurationNs, std::memory_order_relaxed);
     mHasGoodData = (status == PULL_SUCCESS);
     if (!mHasGoodData) {
         return status;
     }
-    const int64_t pullElapsedDurationNs = getElapsedRealtimeNs() - elapsedTimeNs;
     const int64_t pullSystemUptimeDurationMillis = getSystemUptimeMillis() - systemUptimeMillis;
     StatsdStats::getInstance().notePullTime(mTagId, pullElapsedDurationNs);
     const bool pullTimeOut = pullElapsedDurationNs > mPullTimeoutNs;
     if (pullTimeOut) {
         // Something went wrong. Discard the data.
-        mCachedData.clear();
         mHasGoodData = false;
         StatsdStats::getInstance().notePullTimeout(
                 mTagId, pullSystemUptimeDurationMillis, NanoToMillis(pullElapsedDurationNs));
@@ -85,16 +104,19 @@ PullErrorCode StatsPuller::Pull(const int64_t eventTimeNs,
         return PULL_FAIL;
     }
 
-    if (mCachedData.size() > 0) {
-        mapAndMergeIsolatedUidsToHostUid(mCachedData, mUidMap, mTagId, mAdditiveFields);
+    if (pulledData.size() > 0) {
+        mapAndMergeIsolatedUidsToHostUid(pulledData, mUidMap, mTagId, mAdditiveFields);
     }
 
-    if (mCachedData.empty()) {
+    if (pulledData.empty()) {
         VLOG("Data pulled is empty");
         StatsdStats::getInstance().noteEmptyData(mTagId);
     }
 
-    (*data) = mCachedData;
+    mCachedData = std::make_shared<const std::vector<std::shared_ptr<LogEvent>>>(
+            std::move(pulledData));
+    mLastPullDurationNs = pullElapsedDurationNs;
+    *snapshot = mCachedData;
     return PULL_SUCCESS;
 }
 
@@ -108,21 +130,28 @@ int StatsPuller::clearCache() {
 }
 
 int StatsPuller::clearCacheLocked() {
-    int ret = mCachedData.size();
-    mCachedData.clear();
+    int ret = mCachedData != nullptr ? mCachedData->size() : 0;
+    mCachedData = nullptr;
     mLastPullTimeNs = 0;
     mLastEventTimeNs = 0;
+    mLastPullDurationNs = 0;
     return ret;
 }
 
 int StatsPuller::ClearCacheIfNecessary(int64_t timestampNs) {
-    if (timestampNs - mLastPullTimeNs > mCoolDownNs) {
-        return clearCache();
+    lock_guard<std::mutex> lock(mLock);
+    if (timestampNs - mLastPullTimeNs > getCoolDownNsLocked()) {
+        return clearCacheLocked();
     } else {
         return 0;
     }
 }
 
+int64_t StatsPuller::getCoolDownNsLocked() const {
+    return std::max(mCoolDownNs,
+                    std::min(kPullCostCoolDownFactor * mLastPullDurationNs, kMaxAdaptiveCoolDownNs));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
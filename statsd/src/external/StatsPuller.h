@@ -18,6 +18,7 @@
 
 #include <aidl/android/os/IStatsCompanionService.h>
 #include <utils/RefBase.h>
+#include <atomic>
 #include <mutex>
 #include <vector>
 #include "packages/UidMap.h"
@@ -39,6 +40,10 @@ enum PullErrorCode {
     PULL_DEAD_OBJECT = 2,
 };
 
+// The result of a pull. Immutable once published, so the cache and every consumer of a pull can
+// share it by pointer instead of copying the event list.
+using PullSnapshot = std::shared_ptr<const std::vector<std::shared_ptr<LogEvent>>>;
+
 class StatsPuller : public virtual RefBase {
 public:
     explicit StatsPuller(const int tagId, int64_t coolDownNs = NS_PER_SEC,
@@ -59,6 +64,16 @@ public:
     // should make a copy as this data may be shared with multiple metrics.
     PullErrorCode Pull(const int64_t eventTimeNs, std::vector<std::shared_ptr<LogEvent>>* data);
 
+    // Same as above, but shares the pulled data instead of copying it. *snapshot is never null
+    // after this returns.
+    PullErrorCode Pull(const int64_t eventTimeNs, PullSnapshot* snapshot);
+
+    // How long the last pull that reached the puller took, whether it succeeded or not, or 0 if
+    // there was none. Pulls served from the cache leave it unchanged.
+    int64_t getRecentPullDurationNs() const {
+        return mRecentPullDurationNs.load(std::memory_order_relaxed);
+    }
+
     // Clear cache immediately
     int ForceClearCache();
 
@@ -94,6 +109,21 @@ private:
     // will be returned.
     const int64_t mCoolDownNs = 1 * NS_PER_SEC;
 
+    // Expensive pulls are reused for longer: the cache is served for up to this many times the
+    // duration of the pull that filled it, if that exceeds mCoolDownNs, but never for longer
+    // than kMaxAdaptiveCoolDownNs. Cheap pulls keep mCoolDownNs.
+    static constexpr int64_t kPullCostCoolDownFactor = 2;
+    static constexpr int64_t kMaxAdaptiveCoolDownNs = 5 * NS_PER_SEC;
+
+    // How long the pull that filled the cache took, or 0 if there is no good data.
+    int64_t mLastPullDurationNs = 0;
+
+    // Read without mLock, so that it can be read while a pull is running.
+    std::atomic<int64_t> mRecentPullDurationNs = 0;
+
+    // Returns how long after the last pull its data may be reused.
+    int64_t getCoolDownNsLocked() const;
+
     // The field numbers of the fields that need to be summed when merging
     // isolated uid with host uid.
     const std::vector<int> mAdditiveFields;
@@ -111,7 +141,8 @@ private:
     //   1) A pull fails
     //   2) A new pull request comes after cooldown time.
     //   3) clearCache is called.
-    std::vector<std::shared_ptr<LogEvent>> mCachedData;
+    // Null when there is nothing cached.
+    PullSnapshot mCachedData;
 
     int clearCache();
 
@@ -24,7 +24,10 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <thread>
 
 #include "../StatsService.h"
 #include "../logd/LogEvent.h"
@@ -67,6 +70,14 @@ bool StatsPullerManager::Pull(int tagId, const vector<int32_t>& uids, const int6
 bool StatsPullerManager::PullLocked(int tagId, const ConfigKey& configKey,
                                     const int64_t eventTimeNs, vector<shared_ptr<LogEvent>>* data) {
     vector<int32_t> uids;
+    if (!getPullAtomUidsLocked(tagId, configKey, &uids)) {
+        return false;
+    }
+    return PullLocked(tagId, uids, eventTimeNs, data);
+}
+
+bool StatsPullerManager::getPullAtomUidsLocked(int tagId, const ConfigKey& configKey,
+                                               vector<int32_t>* uids) {
     const auto& uidProviderIt = mPullUidProviders.find(configKey);
     if (uidProviderIt == mPullUidProviders.end()) {
         ALOGE("Error pulling tag %d. No pull uid provider for config key %s", tagId,
@@ -81,36 +92,164 @@ bool StatsPullerManager::PullLocked(int tagId, const ConfigKey& configKey,
         StatsdStats::getInstance().notePullUidProviderNotFound(tagId);
         return false;
     }
-    uids = pullUidProvider->getPullAtomUids(tagId);
-    return PullLocked(tagId, uids, eventTimeNs, data);
+    *uids = pullUidProvider->getPullAtomUids(tagId);
+    return true;
 }
 
 bool StatsPullerManager::PullLocked(int tagId, const vector<int32_t>& uids,
                                     const int64_t eventTimeNs, vector<shared_ptr<LogEvent>>* data) {
     VLOG("Initiating pulling %d", tagId);
+    const auto pullerIt = findPullerLocked(tagId, uids);
+    if (pullerIt == kAllPullAtomInfo.end()) {
+        return false;  // Return early since we don't know what to pull.
+    }
+    PullErrorCode status = pullerIt->second->Pull(eventTimeNs, data);
+    VLOG("pulled %zu items", data->size());
+    return onPullDoneLocked(tagId, pullerIt->first.uid, status);
+}
+
+std::map<const PullerKey, sp<StatsPuller>>::const_iterator StatsPullerManager::findPullerLocked(
+        int tagId, const vector<int32_t>& uids) const {
     for (int32_t uid : uids) {
         PullerKey key = {.uid = uid, .atomTag = tagId};
         auto pullerIt = kAllPullAtomInfo.find(key);
         if (pullerIt != kAllPullAtomInfo.end()) {
-            PullErrorCode status = pullerIt->second->Pull(eventTimeNs, data);
-            VLOG("pulled %zu items", data->size());
-            if (status != PULL_SUCCESS) {
-                StatsdStats::getInstance().notePullFailed(tagId);
-            }
-            // If we received a dead object exception, it means the client process has died.
-            // We can remove the puller from the map.
-            if (status == PULL_DEAD_OBJECT) {
-                StatsdStats::getInstance().notePullerCallbackRegistrationChanged(
-                        tagId,
-                        /*registered=*/false);
-                kAllPullAtomInfo.erase(pullerIt);
-            }
-            return status == PULL_SUCCESS;
+            return pullerIt;
         }
     }
     StatsdStats::getInstance().notePullerNotFound(tagId);
     ALOGW("StatsPullerManager: Unknown tagId %d", tagId);
-    return false;  // Return early since we don't know what to pull.
+    return kAllPullAtomInfo.end();
+}
+
+bool StatsPullerManager::onPullDoneLocked(int tagId, int pullerUid, PullErrorCode status) {
+    if (status != PULL_SUCCESS) {
+        StatsdStats::getInstance().notePullFailed(tagId);
+    }
+    // If we received a dead object exception, it means the client process has died.
+    // We can remove the puller from the map. Erasing by key keeps this safe when several
+    // concurrent alarm pulls of the same puller saw the process die.
+    if (status == PULL_DEAD_OBJECT &&
+        kAllPullAtomInfo.erase({.uid = pullerUid, .atomTag = tagId}) > 0) {
+        StatsdStats::getInstance().notePullerCallbackRegistrationChanged(tagId,
+                                                                         /*registered=*/false);
+    }
+    return status == PULL_SUCCESS;
+}
+
+void StatsPullerManager::runAlarmPulls(vector<AlarmPull>& pulls, int64_t elapsedTimeNs,
+                                       const std::function<void(AlarmPull&)>& onPullDone) {
+    const auto runPull = [&pulls, elapsedTimeNs](size_t i) {
+        AlarmPull& pull = pulls[i];
+        if (pull.puller != nullptr) {
+            pull.status = pull.puller->Pull(elapsedTimeNs, &pull.data);
+        }
+    };
+
+    const size_t numThreads = std::min(pulls.size(), kMaxConcurrentAlarmPulls);
+    if (numThreads <= 1) {
+        for (size_t i = 0; i < pulls.size(); i++) {
+            runPull(i);
+            onPullDone(pulls[i]);
+        }
+        return;
+    }
+
+    // The pulls that took the longest last time start first, so that they overlap with the
+    // others and with the delivery of their results instead of running last on their own.
+    vector<size_t> order(pulls.size());
+    vector<int64_t> expectedDurationsNs(pulls.size(), 0);
+    for (size_t i = 0; i < pulls.size(); i++) {
+        order[i] = i;
+        if (pulls[i].puller != nullptr) {
+            expectedDurationsNs[i] = pulls[i].puller->getRecentPullDurationNs();
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&expectedDurationsNs](size_t a, size_t b) {
+        return expectedDurationsNs[a] > expectedDurationsNs[b];
+    });
+
+    // Each worker takes the next pull that has not started yet, so a slow puller only holds up
+    // its own thread. Finished pulls are handed back in completion order.
+    std::atomic<size_t> nextPull(0);
+    std::mutex doneLock;
+    std::condition_variable doneCv;
+    vector<size_t> done;
+    done.reserve(pulls.size());
+
+    vector<std::thread> workers;
+    workers.reserve(numThreads);
+    for (size_t t = 0; t < numThreads; t++) {
+        workers.emplace_back([&] {
+            for (size_t next = nextPull++; next < pulls.size(); next = nextPull++) {
+                const size_t i = order[next];
+                runPull(i);
+                {
+                    std::lock_guard<std::mutex> lock(doneLock);
+                    done.push_back(i);
+                }
+                doneCv.notify_one();
+            }
+        });
+    }
+
+    for (size_t delivered = 0; delivered < pulls.size(); delivered++) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(doneLock);
+            doneCv.wait(lock, [&] { return done.size() > delivered; });
+            i = done[delivered];
+        }
+        onPullDone(pulls[i]);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void StatsPullerManager::PrefetchPulls(const vector<int>& tagIds, const ConfigKey& configKey,
+                                       const int64_t eventTimeNs) {
+    std::lock_guard<std::mutex> _l(mLock);
+    const auto uidProviderIt = mPullUidProviders.find(configKey);
+    if (uidProviderIt == mPullUidProviders.end()) {
+        return;
+    }
+    const sp<PullUidProvider> pullUidProvider = uidProviderIt->second.promote();
+    if (pullUidProvider == nullptr) {
+        return;
+    }
+
+    // The lookups are repeated by Pull(), so they are done here without noting failures.
+    vector<ReceiverKey> keys;
+    keys.reserve(tagIds.size());
+    vector<AlarmPull> pulls;
+    pulls.reserve(tagIds.size());
+    for (const int tagId : tagIds) {
+        for (const int32_t uid : pullUidProvider->getPullAtomUids(tagId)) {
+            const auto pullerIt = kAllPullAtomInfo.find({.uid = uid, .atomTag = tagId});
+            if (pullerIt != kAllPullAtomInfo.end()) {
+                keys.push_back({.atomTag = tagId, .configKey = configKey});
+                AlarmPull pull;
+                pull.receiverKey = &keys.back();
+                pull.puller = pullerIt->second;
+                pull.pullerUid = uid;
+                pulls.push_back(std::move(pull));
+                break;
+            }
+        }
+    }
+    if (pulls.size() < 2) {
+        // A single pull is just as fast when the metric does it.
+        return;
+    }
+
+    runAlarmPulls(pulls, eventTimeNs, [this](AlarmPull& pull) {
+        // Drop dead pullers now, as the cached failure hides the dead object from Pull().
+        if (pull.status == PULL_DEAD_OBJECT) {
+            onPullDoneLocked(pull.receiverKey->atomTag, pull.pullerUid, pull.status);
+        }
+        pull.data = nullptr;
+    });
 }
 
 bool StatsPullerManager::PullerForMatcherExists(int tagId) const {
@@ -119,6 +258,22 @@ bool StatsPullerManager::PullerForMatcherExists(int tagId) const {
     return isVendorPulledAtom(tagId) || isPulledAtom(tagId);
 }
 
+int64_t StatsPullerManager::getCoalescedAlarmTimeNsLocked() const {
+    if (mNextPullTimeNs == NO_ALARM_UPDATE) {
+        return mNextPullTimeNs;
+    }
+    const int64_t windowEndNs = mNextPullTimeNs + kPullAlarmCoalescingWindowNs;
+    int64_t alarmTimeNs = mNextPullTimeNs;
+    for (const auto& [receiverKey, receivers] : mReceivers) {
+        for (const ReceiverInfo& receiverInfo : receivers) {
+            if (receiverInfo.nextPullTimeNs <= windowEndNs) {
+                alarmTimeNs = std::max(alarmTimeNs, receiverInfo.nextPullTimeNs);
+            }
+        }
+    }
+    return alarmTimeNs;
+}
+
 void StatsPullerManager::updateAlarmLocked() {
     if (mNextPullTimeNs == NO_ALARM_UPDATE) {
         VLOG("No need to set alarms. Skipping");
@@ -127,7 +282,7 @@ void StatsPullerManager::updateAlarmLocked() {
 
     // TODO(b/151045771): do not hold a lock while making a binder call
     if (mStatsCompanionService != nullptr) {
-        mStatsCompanionService->setPullingAlarm(mNextPullTimeNs / 1000000);
+        mStatsCompanionService->setPullingAlarm(getCoalescedAlarmTimeNsLocked() / 1000000);
     } else {
         VLOG("StatsCompanionService not available. Alarm not set.");
     }
@@ -250,12 +405,44 @@ void StatsPullerManager::OnAlarmFired(int64_t elapsedTimeNs) {
             }
         }
     }
-    for (const auto& pullInfo : needToPull) {
-        vector<shared_ptr<LogEvent>> data;
+    vector<AlarmPull> pulls;
+    pulls.reserve(needToPull.size());
+    for (auto& pullInfo : needToPull) {
+        AlarmPull pull;
+        pull.receiverKey = pullInfo.first;
+        pull.receivers = std::move(pullInfo.second);
+        vector<int32_t> uids;
+        if (getPullAtomUidsLocked(pull.receiverKey->atomTag, pull.receiverKey->configKey, &uids)) {
+            const auto pullerIt = findPullerLocked(pull.receiverKey->atomTag, uids);
+            if (pullerIt != kAllPullAtomInfo.end()) {
+                pull.puller = pullerIt->second;
+                pull.pullerUid = pullerIt->first.uid;
+            }
+        }
+        // Configs pulling the same atom from the same puller share one pull.
+        auto sharedPull = std::find_if(pulls.begin(), pulls.end(), [&pull](const AlarmPull& p) {
+            return pull.puller != nullptr && p.puller == pull.puller;
+        });
+        if (sharedPull != pulls.end()) {
+            sharedPull->receivers.insert(sharedPull->receivers.end(), pull.receivers.begin(),
+                                         pull.receivers.end());
+        } else {
+            pulls.push_back(std::move(pull));
+        }
+    }
+
+    // Pulls of different atoms are independent, so run them concurrently rather than letting
+    // each wait for the ones before it. Results are still delivered on this thread with mLock
+    // held, so receivers see the same locking as before.
+    runAlarmPulls(pulls, elapsedTimeNs, [&](AlarmPull& pull) {
+        static const vector<shared_ptr<LogEvent>> kNoData;
+        const int tagId = pull.receiverKey->atomTag;
+        const bool success =
+                pull.puller != nullptr && onPullDoneLocked(tagId, pull.pullerUid, pull.status);
+        const vector<shared_ptr<LogEvent>>& data = success ? *pull.data : kNoData;
+        VLOG("pulled %zu items", data.size());
         PullResult pullResult =
-                PullLocked(pullInfo.first->atomTag, pullInfo.first->configKey, elapsedTimeNs, &data)
-                        ? PullResult::PULL_RESULT_SUCCESS
-                        : PullResult::PULL_RESULT_FAIL;
+                success ? PullResult::PULL_RESULT_SUCCESS : PullResult::PULL_RESULT_FAIL;
         if (pullResult == PullResult::PULL_RESULT_FAIL) {
             VLOG("pull failed at %lld, will try again later", (long long)elapsedTimeNs);
         }
@@ -267,12 +454,12 @@ void StatsPullerManager::OnAlarmFired(int64_t elapsedTimeNs) {
         // Here the triggering event is alarm fired from AlarmManager.
         // In ValueMetricProducer and GaugeMetricProducer we do same thing
         // when pull on condition change, etc.
-        for (auto& event : data) {
+        for (const shared_ptr<LogEvent>& event : data) {
             event->setElapsedTimestampNs(elapsedTimeNs);
             event->setLogdWallClockTimestampNs(wallClockNs);
         }
 
-        for (const auto& receiverInfo : pullInfo.second) {
+        for (const auto& receiverInfo : pull.receivers) {
             sp<PullDataReceiver> receiverPtr = receiverInfo->receiver.promote();
             if (receiverPtr != nullptr) {
                 receiverPtr->onDataPulled(data, pullResult, elapsedTimeNs);
@@ -285,7 +472,9 @@ void StatsPullerManager::OnAlarmFired(int64_t elapsedTimeNs) {
                 VLOG("receiver already gone.");
             }
         }
-    }
+        // Release the data as soon as it is delivered instead of after all pulls are done.
+        pull.data = nullptr;
+    });
 
     VLOG("mNextPullTimeNs: %lld updated to %lld", (long long)mNextPullTimeNs,
          (long long)minNextPullTimeNs);
@@ -293,6 +482,11 @@ void StatsPullerManager::OnAlarmFired(int64_t elapsedTimeNs) {
     updateAlarmLocked();
 }
 
+bool StatsPullerManager::IsPullAlarmDue(const int64_t elapsedTimeNs) {
+    std::lock_guard<std::mutex> _l(mLock);
+    return mNextPullTimeNs != NO_ALARM_UPDATE && mNextPullTimeNs <= elapsedTimeNs;
+}
+
 int StatsPullerManager::ForceClearPullerCache() {
     std::lock_guard<std::mutex> _l(mLock);
     int totalCleared = 0;
@@ -316,6 +510,23 @@ void StatsPullerManager::RegisterPullAtomCallback(const int uid, const int32_t a
                                                   const vector<int32_t>& additiveFields,
                                                   const shared_ptr<IPullAtomCallback>& callback) {
     std::lock_guard<std::mutex> _l(mLock);
+    registerPullAtomCallbackLocked(uid, atomTag, coolDownNs, timeoutNs, additiveFields, callback);
+}
+
+void StatsPullerManager::RegisterPullAtomCallbacks(
+        const vector<PullAtomCallbackRegistration>& registrations) {
+    std::lock_guard<std::mutex> _l(mLock);
+    for (const PullAtomCallbackRegistration& registration : registrations) {
+        registerPullAtomCallbackLocked(registration.uid, registration.atomTag,
+                                       MillisToNano(registration.coolDownMillis),
+                                       MillisToNano(registration.timeoutMillis),
+                                       registration.additiveFields, registration.pullerCallback);
+    }
+}
+
+void StatsPullerManager::registerPullAtomCallbackLocked(
+        const int uid, const int32_t atomTag, const int64_t coolDownNs, const int64_t timeoutNs,
+        const vector<int32_t>& additiveFields, const shared_ptr<IPullAtomCallback>& callback) {
     VLOG("RegisterPullerCallback: adding puller for tag %d", atomTag);
 
     if (callback == nullptr) {
@@ -18,8 +18,10 @@
 
 #include <aidl/android/os/IPullAtomCallback.h>
 #include <aidl/android/os/IStatsCompanionService.h>
+#include <aidl/android/os/PullAtomCallbackRegistration.h>
 #include <utils/RefBase.h>
 
+#include <functional>
 #include <list>
 #include <vector>
 
@@ -32,6 +34,7 @@
 
 using aidl::android::os::IPullAtomCallback;
 using aidl::android::os::IStatsCompanionService;
+using aidl::android::os::PullAtomCallbackRegistration;
 using std::shared_ptr;
 
 namespace android {
@@ -91,6 +94,10 @@ public:
 
     void OnAlarmFired(int64_t elapsedTimeNs);
 
+    // Returns whether a pull alarm is due at elapsedTimeNs, so that the other alarms of statsd
+    // can serve it when they wake it up first.
+    bool IsPullAlarmDue(int64_t elapsedTimeNs);
+
     // Pulls the most recent data.
     // The data may be served from cache if consecutive pulls come within
     // mCoolDownNs.
@@ -109,6 +116,12 @@ public:
     virtual bool Pull(int tagId, const vector<int32_t>& uids, int64_t eventTimeNs,
                       vector<std::shared_ptr<LogEvent>>* data);
 
+    // Pulls each of tagIds once for configKey, concurrently, so that the Pull() calls of the
+    // metrics handling the event at eventTimeNs are served from the pullers' caches. Failures
+    // are only noted by those calls.
+    void PrefetchPulls(const vector<int>& tagIds, const ConfigKey& configKey,
+                       int64_t eventTimeNs);
+
     // Clear pull data cache immediately.
     int ForceClearPullerCache();
 
@@ -121,6 +134,10 @@ public:
                                   const int64_t timeoutNs, const vector<int32_t>& additiveFields,
                                   const shared_ptr<IPullAtomCallback>& callback);
 
+    // Registers the callbacks of many atoms, in order, with one acquisition of the lock. The cool
+    // downs and timeouts of the registrations are in milliseconds.
+    void RegisterPullAtomCallbacks(const vector<PullAtomCallbackRegistration>& registrations);
+
     void UnregisterPullAtomCallback(const int uid, const int32_t atomTag);
 
     std::map<const PullerKey, sp<StatsPuller>> kAllPullAtomInfo;
@@ -152,17 +169,62 @@ private:
     // mapping from Config Key to the PullUidProvider for that config
     std::map<ConfigKey, wp<PullUidProvider>> mPullUidProviders;
 
+    // Pulls due within this long after the earliest one are done by the same alarm, so receivers
+    // whose buckets start at slightly different times share a single wakeup and pull. Well below
+    // the default max_pull_delay_sec of 30 seconds.
+    static constexpr int64_t kPullAlarmCoalescingWindowNs = 5 * NS_PER_SEC;
+
+    // Returns the time the alarm should fire at to serve the pull due at mNextPullTimeNs: the
+    // latest pull due within kPullAlarmCoalescingWindowNs of it.
+    int64_t getCoalescedAlarmTimeNsLocked() const;
+
+    // Maximum number of atoms an alarm pulls at the same time.
+    static constexpr size_t kMaxConcurrentAlarmPulls = 4;
+
+    // One atom pulled on an alarm, and the receivers its data is delivered to.
+    struct AlarmPull {
+        const ReceiverKey* receiverKey;
+        vector<ReceiverInfo*> receivers;
+        // Null if no puller could be found, in which case the pull fails.
+        sp<StatsPuller> puller;
+        int pullerUid = -1;
+        // Shared by all the receivers, and with the puller's cache.
+        PullSnapshot data;
+        PullErrorCode status = PULL_FAIL;
+    };
+
     bool PullLocked(int tagId, const ConfigKey& configKey, int64_t eventTimeNs,
                     vector<std::shared_ptr<LogEvent>>* data);
 
     bool PullLocked(int tagId, const vector<int32_t>& uids, int64_t eventTimeNs,
                     vector<std::shared_ptr<LogEvent>>* data);
 
+    // Returns false if the config has no pull uid provider.
+    bool getPullAtomUidsLocked(int tagId, const ConfigKey& configKey, vector<int32_t>* uids);
+
+    // Returns the puller registered for tagId by the first of uids that has one.
+    std::map<const PullerKey, sp<StatsPuller>>::const_iterator findPullerLocked(
+            int tagId, const vector<int32_t>& uids) const;
+
+    // Notes the status of a pull done by the puller registered by pullerUid for tagId and
+    // returns whether the pull succeeded.
+    bool onPullDoneLocked(int tagId, int pullerUid, PullErrorCode status);
+
+    // Runs the pulls on up to kMaxConcurrentAlarmPulls threads and calls onPullDone on the
+    // calling thread for each of them in the order they finish.
+    static void runAlarmPulls(vector<AlarmPull>& pulls, int64_t elapsedTimeNs,
+                              const std::function<void(AlarmPull&)>& onPullDone);
+
     // locks for data receiver and StatsCompanionService changes
     std::mutex mLock;
 
     void updateAlarmLocked();
 
+    void registerPullAtomCallbackLocked(const int uid, const int32_t atomTag, int64_t coolDownNs,
+                                        const int64_t timeoutNs,
+                                        const vector<int32_t>& additiveFields,
+                                        const shared_ptr<IPullAtomCallback>& callback);
+
     int64_t mNextPullTimeNs;
 
     FRIEND_TEST(GaugeMetricE2ePulledTest, TestFirstNSamplesPulledNoTrigger);
@@ -177,6 +239,8 @@ private:
 
     FRIEND_TEST(StatsLogProcessorTest, TestPullUidProviderSetOnConfigUpdate);
 
+    FRIEND_TEST(StatsPullerManagerTest, TestAlarmCoalescesNearbyPulls);
+
     FRIEND_TEST(ConfigUpdateE2eTest, TestGaugeMetric);
     FRIEND_TEST(ConfigUpdateE2eTest, TestValueMetric);
 };
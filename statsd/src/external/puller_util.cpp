@@ -18,6 +18,11 @@
 #include "Log.h"
 
 #include "puller_util.h"
+
+#include <utils/JenkinsHash.h>
+
+#include <unordered_map>
+
 #include "stats_log_util.h"
 
 namespace android {
@@ -26,6 +31,86 @@ namespace statsd {
 
 using namespace std;
 
+namespace {
+
+// Repeated additive fields are treated as non-additive fields.
+bool isAdditiveField(const FieldValue& fieldValue, const set<int>& additiveFields) {
+    return !isPrimitiveRepeatedField(fieldValue.mField) &&
+           additiveFields.find(fieldValue.mField.getPosAtDepth(0)) != additiveFields.end();
+}
+
+// Hashes what two rows must share to be merged: their fields, and the values of their
+// non-additive fields.
+android::hash_t hashMergeKey(const LogEvent& event, const set<int>& additiveFields) {
+    android::hash_t hash = android::JenkinsHashMix(0, android::hash_type(event.size()));
+    for (const FieldValue& fieldValue : event.getValues()) {
+        hash = android::JenkinsHashMix(hash, android::hash_type(fieldValue.mField.getField()));
+        if (isAdditiveField(fieldValue, additiveFields)) {
+            continue;
+        }
+        const Value& value = fieldValue.mValue;
+        hash = android::JenkinsHashMix(hash, android::hash_type((int)value.getType()));
+        switch (value.getType()) {
+            case INT:
+                hash = android::JenkinsHashMix(hash, android::hash_type(value.int_value));
+                break;
+            case LONG:
+                hash = android::JenkinsHashMix(hash, android::hash_type(value.long_value));
+                break;
+            case FLOAT:
+                hash = android::JenkinsHashMix(hash, android::hash_type(value.float_value));
+                break;
+            case DOUBLE:
+                hash = android::JenkinsHashMix(hash, android::hash_type(value.double_value));
+                break;
+            case STRING:
+                hash = android::JenkinsHashMix(hash,
+                                               static_cast<uint32_t>(value.str_value.hash()));
+                break;
+            case STORAGE:
+                hash = android::JenkinsHashMixBytes(hash, value.storage_value.data(),
+                                                    value.storage_value.size());
+                break;
+            default:
+                break;
+        }
+    }
+    return android::JenkinsHashWhiten(hash);
+}
+
+// Two rows can be merged if they have the same fields and only differ on additive fields.
+// A different length means different attribution chains or repeated fields.
+bool canMerge(const LogEvent& lhs, const LogEvent& rhs, const set<int>& additiveFields) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    const vector<FieldValue>& lhsValues = lhs.getValues();
+    const vector<FieldValue>& rhsValues = rhs.getValues();
+    for (size_t p = 0; p < lhsValues.size(); p++) {
+        if (lhsValues[p].mField != rhsValues[p].mField) {
+            return false;
+        }
+        if (lhsValues[p].mValue != rhsValues[p].mValue &&
+            !isAdditiveField(lhsValues[p], additiveFields)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds the additive fields of from onto those of to. The rows must be mergeable.
+void mergeAdditiveFields(const LogEvent& from, const set<int>& additiveFields, LogEvent* to) {
+    const vector<FieldValue>& fromValues = from.getValues();
+    vector<FieldValue>* toValues = to->getMutableValues();
+    for (size_t p = 0; p < fromValues.size(); p++) {
+        if (isAdditiveField(fromValues[p], additiveFields)) {
+            (*toValues)[p].mValue += fromValues[p].mValue;
+        }
+    }
+}
+
+}  // anonymous namespace
+
 /**
  * Process all data and merge isolated with host if necessary.
  * For example:
@@ -67,21 +152,38 @@ void mapAndMergeIsolatedUidsToHostUid(vector<shared_ptr<LogEvent>>& data, const
             return;
         }
         if (hasAttributionChain) {
-            vector<FieldValue>* const fieldValues = event->getMutableValues();
-            for (size_t i = attrIndexRange.first; i <= attrIndexRange.second; i++) {
-                FieldValue& fieldValue = fieldValues->at(i);
-                if (isAttributionUidField(fieldValue)) {
-                    const int hostUid = uidMap->getHostUidOrSelf(fieldValue.mValue.int_value);
-                    fieldValue.mValue.setInt(hostUid);
-                }
-            }
+            uidMap->mapAttributionUidsToHostUids(event->getMutableValues(), attrIndexRange.first,
+                                                 attrIndexRange.second);
         } else {
             mapIsolatedUidsToHostUidInLogEvent(uidMap, *event);
         }
     }
 
-    // 2. sort the data, bit-wise
-    sort(data.begin(), data.end(),
+    // 2. Group the rows that only differ on additive fields, by hashing the fields they must
+    // agree on, and sum them into the first row of their group. Rows are only compared in full
+    // when their hashes collide.
+    const set<int> additiveFields(additiveFieldsVec.begin(), additiveFieldsVec.end());
+    vector<shared_ptr<LogEvent>> mergedData;
+    std::unordered_map<android::hash_t, vector<size_t>> mergedIndicesByHash;
+    mergedIndicesByHash.reserve(data.size());
+    for (shared_ptr<LogEvent>& event : data) {
+        vector<size_t>& candidates = mergedIndicesByHash[hashMergeKey(*event, additiveFields)];
+        bool merged = false;
+        for (size_t index : candidates) {
+            if (canMerge(*mergedData[index], *event, additiveFields)) {
+                mergeAdditiveFields(*event, additiveFields, mergedData[index].get());
+                merged = true;
+                break;
+            }
+        }
+        if (!merged) {
+            candidates.push_back(mergedData.size());
+            mergedData.push_back(std::move(event));
+        }
+    }
+
+    // 3. Sort the merged rows, bit-wise, so that the order does not depend on the pull.
+    sort(mergedData.begin(), mergedData.end(),
          [](const shared_ptr<LogEvent>& lhs, const shared_ptr<LogEvent>& rhs) {
              if (lhs->size() != rhs->size()) {
                  return lhs->size() < rhs->size();
@@ -96,61 +198,7 @@ void mapAndMergeIsolatedUidsToHostUid(vector<shared_ptr<LogEvent>>& data, const
              return false;
          });
 
-    vector<shared_ptr<LogEvent>> mergedData;
-    const set<int> additiveFields(additiveFieldsVec.begin(), additiveFieldsVec.end());
-    bool needMerge = true;
-
-    // 3. do the merge.
-    // The loop invariant is this: for every event,
-    // - check if it has a different length (means different attribution chains or repeated fields)
-    // - check if fields are different
-    // - check if non-additive field values are different (non-additive is default for repeated
-    // fields)
-    // If any are true, no need to merge, add itself to the result. Otherwise, merge the
-    // value onto the one immediately next to it.
-    for (int i = 0; i < (int)data.size() - 1; i++) {
-        // Size different, must be different chains or repeated fields.
-        if (data[i]->size() != data[i + 1]->size()) {
-            mergedData.push_back(data[i]);
-            continue;
-        }
-        vector<FieldValue>* lhsValues = data[i]->getMutableValues();
-        vector<FieldValue>* rhsValues = data[i + 1]->getMutableValues();
-        needMerge = true;
-        for (int p = 0; p < (int)lhsValues->size(); p++) {
-            if ((*lhsValues)[p].mField != (*rhsValues)[p].mField) {
-                needMerge = false;
-                break;
-            }
-            if ((*lhsValues)[p].mValue != (*rhsValues)[p].mValue) {
-                int pos = (*lhsValues)[p].mField.getPosAtDepth(0);
-                // Differ on non-additive field, abort.
-                // Repeated additive fields are treated as non-additive fields.
-                if (isPrimitiveRepeatedField((*lhsValues)[p].mField) ||
-                    (additiveFields.find(pos) == additiveFields.end())) {
-                    needMerge = false;
-                    break;
-                }
-            }
-        }
-        if (!needMerge) {
-            mergedData.push_back(data[i]);
-            continue;
-        }
-        // This should be infrequent operation.
-        for (int p = 0; p < (int)lhsValues->size(); p++) {
-            int pos = (*lhsValues)[p].mField.getPosAtDepth(0);
-            // Don't merge repeated fields.
-            if (!isPrimitiveRepeatedField((*lhsValues)[p].mField) &&
-                (additiveFields.find(pos) != additiveFields.end())) {
-                (*rhsValues)[p].mValue += (*lhsValues)[p].mValue;
-            }
-        }
-    }
-    mergedData.push_back(data.back());
-
-    data.clear();
-    data = mergedData;
+    data = std::move(mergedData);
 }
 
 }  // namespace statsd
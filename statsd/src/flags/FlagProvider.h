@@ -40,6 +40,18 @@ const std::string STATSD_NATIVE_BOOT_NAMESPACE = "statsd_native_boot";
 
 const std::string STATSD_INIT_COMPLETED_NO_DELAY_FLAG = "statsd_init_completed_no_delay";
 
+const std::string METRICS_MANAGER_LANES_FLAG = "metrics_manager_lanes";
+
+const std::string COMPRESSED_REPORTS_FLAG = "compressed_reports";
+
+const std::string PARSE_LANES_FLAG = "parse_lanes";
+
+const std::string SPILL_PAST_BUCKETS_FLAG = "spill_past_buckets";
+
+// Atoms per second and burst size each app uid may log, see UidRateLimiter. Unlimited if empty.
+const std::string SOCKET_UID_RATE_LIMIT_FLAG = "socket_uid_rate_limit";
+const std::string SOCKET_UID_BURST_SIZE_FLAG = "socket_uid_burst_size";
+
 const std::string FLAG_TRUE = "true";
 const std::string FLAG_FALSE = "false";
 const std::string FLAG_EMPTY = "";
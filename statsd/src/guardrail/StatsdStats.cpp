@@ -19,11 +19,13 @@
 #include "StatsdStats.h"
 
 #include <android/util/ProtoOutputStream.h>
+#include <kll.h>
 
 #include "../stats_log_util.h"
 #include "shell/ShellSubscriber.h"
 #include "statslog_statsd.h"
 #include "storage/StorageManager.h"
+#include "utils/DumpBuffer.h"
 #include "utils/ShardOffsetProvider.h"
 
 namespace android {
@@ -32,6 +34,7 @@ namespace statsd {
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BOOL;
+using android::util::FIELD_TYPE_BYTES;
 using android::util::FIELD_TYPE_ENUM;
 using android::util::FIELD_TYPE_FLOAT;
 using android::util::FIELD_TYPE_INT32;
@@ -40,11 +43,14 @@ using android::util::FIELD_TYPE_MESSAGE;
 using android::util::FIELD_TYPE_STRING;
 using android::util::FIELD_TYPE_UINT32;
 using android::util::ProtoOutputStream;
+using dist_proc::aggregation::KllQuantile;
+using dist_proc::aggregation::KllQuantileOptions;
 using std::lock_guard;
 using std::shared_ptr;
 using std::string;
 using std::to_string;
 using std::vector;
+using zetasketch::android::AggregatorStateProto;
 
 const int FIELD_ID_BEGIN_TIME = 1;
 const int FIELD_ID_END_TIME = 2;
@@ -63,6 +69,8 @@ const int FIELD_ID_STATSD_STATS_ID = 22;
 const int FIELD_ID_SUBSCRIPTION_STATS = 23;
 const int FIELD_ID_SOCKET_LOSS_STATS = 24;
 const int FIELD_ID_QUEUE_STATS = 25;
+const int FIELD_ID_STARTUP_CONFIG_STATS = 26;
+const int FIELD_ID_ATOM_LATENCY_STATS = 27;
 
 const int FIELD_ID_RESTRICTED_METRIC_QUERY_STATS_CALLING_UID = 1;
 const int FIELD_ID_RESTRICTED_METRIC_QUERY_STATS_CONFIG_ID = 2;
@@ -93,9 +101,28 @@ const int FIELD_ID_LOG_LOSS_STATS_PID = 6;
 const int FIELD_ID_OVERFLOW_COUNT = 1;
 const int FIELD_ID_OVERFLOW_MAX_HISTORY = 2;
 const int FIELD_ID_OVERFLOW_MIN_HISTORY = 3;
+const int FIELD_ID_OVERFLOW_LOW_PRIORITY_COUNT = 4;
+const int FIELD_ID_OVERFLOW_NORMAL_PRIORITY_COUNT = 5;
+const int FIELD_ID_OVERFLOW_CRITICAL_PRIORITY_COUNT = 6;
 
 const int FIELD_ID_QUEUE_MAX_SIZE_OBSERVED = 1;
 const int FIELD_ID_QUEUE_MAX_SIZE_OBSERVED_ELAPSED_NANOS = 2;
+const int FIELD_ID_QUEUE_RESIDENCY = 3;
+const int FIELD_ID_QUEUE_READER_BOOST_COUNT = 4;
+
+const int FIELD_ID_STARTUP_CONFIG_COUNT = 1;
+const int FIELD_ID_STARTUP_CONFIG_READ_LATENCY_NS = 2;
+const int FIELD_ID_STARTUP_CONFIG_INIT_LATENCY_NS = 3;
+
+const int FIELD_ID_ATOM_LATENCY_STATS_ATOM_ID = 1;
+const int FIELD_ID_ATOM_LATENCY_STATS_STAGE = 2;
+const int FIELD_ID_ATOM_LATENCY_STATS_LATENCY = 3;
+
+// for LatencyStats proto
+const int FIELD_ID_LATENCY_STATS_COUNT = 1;
+const int FIELD_ID_LATENCY_STATS_SUM_NS = 2;
+const int FIELD_ID_LATENCY_STATS_MAX_NS = 3;
+const int FIELD_ID_LATENCY_STATS_KLL_SKETCH = 4;
 
 const int FIELD_ID_CONFIG_STATS_UID = 1;
 const int FIELD_ID_CONFIG_STATS_ID = 2;
@@ -136,6 +163,10 @@ const int FIELD_ID_DB_DELETION_CONFIG_INVALID = 34;
 const int FIELD_ID_DB_DELETION_TOO_OLD = 35;
 const int FIELD_ID_DB_DELETION_CONFIG_REMOVED = 36;
 const int FIELD_ID_DB_DELETION_CONFIG_UPDATED = 37;
+const int FIELD_ID_CONFIG_STATS_METRICS_MANAGER_LATENCY = 38;
+const int FIELD_ID_CONFIG_STATS_CPU_TIME_STATS = 39;
+const int FIELD_ID_CONFIG_STATS_METRIC_CPU_TIME_STATS = 40;
+const int FIELD_ID_CONFIG_STATS_METRIC_MEMORY_STATS = 41;
 
 const int FIELD_ID_INVALID_CONFIG_REASON_ENUM = 1;
 const int FIELD_ID_INVALID_CONFIG_REASON_METRIC_ID = 2;
@@ -154,6 +185,14 @@ const int FIELD_ID_METRIC_STATS_ID = 1;
 const int FIELD_ID_METRIC_STATS_COUNT = 2;
 const int FIELD_ID_ALERT_STATS_ID = 1;
 const int FIELD_ID_ALERT_STATS_COUNT = 2;
+const int FIELD_ID_CPU_TIME_STATS_LOG_EVENT = 1;
+const int FIELD_ID_CPU_TIME_STATS_DUMP_REPORT = 2;
+const int FIELD_ID_CPU_TIME_STATS_PULL = 3;
+const int FIELD_ID_METRIC_CPU_TIME_STATS_ID = 1;
+const int FIELD_ID_METRIC_CPU_TIME_STATS_CPU_TIME = 2;
+const int FIELD_ID_METRIC_MEMORY_STATS_ID = 1;
+const int FIELD_ID_METRIC_MEMORY_STATS_PAST_BUCKET_BYTES = 2;
+const int FIELD_ID_METRIC_MEMORY_STATS_CURRENT_STATE_BYTES = 3;
 
 const int FIELD_ID_UID_MAP_CHANGES = 1;
 const int FIELD_ID_UID_MAP_BYTES_USED = 2;
@@ -192,6 +231,7 @@ const int FIELD_ID_RESTRICTED_STATS_CATEGORY_CHANGED_COUNT = 6;
 
 const int FIELD_ID_SUBSCRIPTION_STATS_PER_SUBSCRIPTION_STATS = 1;
 const int FIELD_ID_SUBSCRIPTION_STATS_PULL_THREAD_WAKEUP_COUNT = 2;
+const int FIELD_ID_SUBSCRIPTION_STATS_DROPPED_EVENT_COUNT = 3;
 
 const int FIELD_ID_PER_SUBSCRIPTION_STATS_ID = 1;
 const int FIELD_ID_PER_SUBSCRIPTION_STATS_PUSHED_ATOM_COUNT = 2;
@@ -206,8 +246,49 @@ const std::map<int, std::pair<size_t, size_t>> StatsdStats::kAtomDimensionKeySiz
         {util::CPU_TIME_PER_UID_FREQ, {6000, 10000}},
 };
 
-StatsdStats::StatsdStats() : mStatsdStatsId(rand()) {
-    mPushedAtomStats.resize(kMaxPushedAtomId + 1);
+LatencyStats::LatencyStats() = default;
+
+LatencyStats::~LatencyStats() = default;
+
+void LatencyStats::add(int64_t latencyNs) {
+    count++;
+    sumNs += latencyNs;
+    maxNs = std::max(maxNs, latencyNs);
+    if (!sketch) {
+        sketch = KllQuantile::Create(KllQuantileOptions());
+    }
+    sketch->Add(latencyNs);
+}
+
+void LatencyStats::clear() {
+    count = 0;
+    sumNs = 0;
+    maxNs = 0;
+    sketch.reset();
+}
+
+ScopedCpuTimer::ScopedCpuTimer(std::atomic<int64_t>* configCounter,
+                               std::atomic<int64_t>* metricCounter, int64_t multiplier)
+    : mConfigCounter(configCounter),
+      mMetricCounter(metricCounter),
+      mMultiplier(multiplier),
+      mStartNs(configCounter != nullptr || metricCounter != nullptr ? getThreadCpuTimeNs() : 0) {
+}
+
+ScopedCpuTimer::~ScopedCpuTimer() {
+    if (mConfigCounter == nullptr && mMetricCounter == nullptr) {
+        return;
+    }
+    const int64_t cpuTimeNs = (getThreadCpuTimeNs() - mStartNs) * mMultiplier;
+    if (mConfigCounter != nullptr) {
+        mConfigCounter->fetch_add(cpuTimeNs, std::memory_order_relaxed);
+    }
+    if (mMetricCounter != nullptr) {
+        mMetricCounter->fetch_add(cpuTimeNs, std::memory_order_relaxed);
+    }
+}
+
+StatsdStats::StatsdStats() : mStatsdStatsId(rand()), mPushedAtomStats(kMaxPushedAtomId + 1) {
     mStartTimeSec = getWallClockSec();
 }
 
@@ -283,6 +364,16 @@ void StatsdStats::noteConfigReset(const ConfigKey& key) {
     noteConfigResetInternalLocked(key);
 }
 
+void StatsdStats::noteUidRateLimited(int32_t uid) {
+    lock_guard<std::mutex> lock(mLock);
+    auto it = mRateLimitedAtomCounts.find(uid);
+    if (it != mRateLimitedAtomCounts.end()) {
+        it->second++;
+    } else if (mRateLimitedAtomCounts.size() < kMaxRateLimitedUids) {
+        mRateLimitedAtomCounts[uid] = 1;
+    }
+}
+
 void StatsdStats::noteLogLost(int32_t wallClockTimeSec, int32_t count, int32_t lastError,
                               int32_t lastTag, int32_t uid, int32_t pid) {
     lock_guard<std::mutex> lock(mLock);
@@ -346,10 +437,11 @@ void StatsdStats::noteDataDropped(const ConfigKey& key, const size_t totalBytes)
 }
 
 void StatsdStats::noteEventQueueOverflow(int64_t oldestEventTimestampNs, int32_t atomId,
-                                         bool isSkipped) {
+                                         bool isSkipped, EventPriority priority) {
     lock_guard<std::mutex> lock(mLock);
 
     mOverflowCount++;
+    mOverflowCountPerPriority[priority]++;
 
     int64_t history = getElapsedRealtimeNs() - oldestEventTimestampNs;
 
@@ -366,6 +458,9 @@ void StatsdStats::noteEventQueueOverflow(int64_t oldestEventTimestampNs, int32_t
 }
 
 void StatsdStats::noteEventQueueSize(int32_t size, int64_t eventTimestampNs) {
+    if (size <= mEventQueueMaxSizeObserved.load(std::memory_order_relaxed)) {
+        return;
+    }
     lock_guard<std::mutex> lock(mLock);
 
     if (mEventQueueMaxSizeObserved < size) {
@@ -374,6 +469,52 @@ void StatsdStats::noteEventQueueSize(int32_t size, int64_t eventTimestampNs) {
     }
 }
 
+void StatsdStats::noteEventQueueResidency(int64_t residencyNs) {
+    if (mQueueResidencyCounter.fetch_add(1, std::memory_order_relaxed) %
+                kQueueResidencySamplingRate !=
+        0) {
+        return;
+    }
+    lock_guard<std::mutex> lock(mLock);
+    mEventQueueResidency.add(residencyNs);
+}
+
+void StatsdStats::noteEventQueueReaderBoosted() {
+    lock_guard<std::mutex> lock(mLock);
+    mEventQueueReaderBoostCount++;
+}
+
+bool StatsdStats::shouldTraceLatency() {
+    return mLatencyTraceCounter.fetch_add(1, std::memory_order_relaxed) %
+                   kLatencyTraceSamplingRate ==
+           0;
+}
+
+void StatsdStats::noteAtomLatency(int32_t atomId, LatencyStage stage, int64_t latencyNs) {
+    lock_guard<std::mutex> lock(mLock);
+    const std::pair<int32_t, LatencyStage> key(atomId, stage);
+    auto it = mAtomLatencyStats.find(key);
+    if (it == mAtomLatencyStats.end()) {
+        if (mAtomLatencyStats.size() >= kMaxAtomLatencyStatsSize) {
+            return;
+        }
+        it = mAtomLatencyStats.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                       std::forward_as_tuple())
+                     .first;
+    }
+    it->second.add(latencyNs);
+}
+
+void StatsdStats::noteMetricsManagerLatency(const ConfigKey& key, int64_t latencyNs) {
+    lock_guard<std::mutex> lock(mLock);
+    auto it = mConfigStats.find(key);
+    if (it == mConfigStats.end()) {
+        ALOGE("Config key %s not found!", key.ToString().c_str());
+        return;
+    }
+    it->second->metrics_manager_latency.add(latencyNs);
+}
+
 void StatsdStats::noteAtomDroppedLocked(int32_t atomId) {
     constexpr int kMaxPushedAtomDroppedStatsSize = kMaxPushedAtomId + kMaxNonPlatformPushedAtoms;
     if (mPushedAtomDropsStats.size() < kMaxPushedAtomDroppedStatsSize ||
@@ -593,7 +734,66 @@ void StatsdStats::noteMatcherMatched(const ConfigKey& key, const int64_t id) {
     if (statsIt == mConfigStats.end()) {
         return;
     }
-    statsIt->second->matcher_stats[id]++;
+    shared_ptr<std::atomic<int>>& counter = statsIt->second->matcher_stats[id];
+    if (counter == nullptr) {
+        counter = std::make_shared<std::atomic<int>>(0);
+    }
+    counter->fetch_add(1, std::memory_order_relaxed);
+}
+
+shared_ptr<std::atomic<int>> StatsdStats::getMatcherMatchedCounter(const ConfigKey& key,
+                                                                   const int64_t id) {
+    lock_guard<std::mutex> lock(mLock);
+
+    auto statsIt = mConfigStats.find(key);
+    if (statsIt == mConfigStats.end()) {
+        return nullptr;
+    }
+    shared_ptr<std::atomic<int>>& counter = statsIt->second->matcher_stats[id];
+    if (counter == nullptr) {
+        counter = std::make_shared<std::atomic<int>>(0);
+    }
+    return counter;
+}
+
+shared_ptr<CpuTimeStats> StatsdStats::getCpuTimeStats(const ConfigKey& key) {
+    lock_guard<std::mutex> lock(mLock);
+
+    auto statsIt = mConfigStats.find(key);
+    if (statsIt == mConfigStats.end()) {
+        return nullptr;
+    }
+    return statsIt->second->cpu_time_stats;
+}
+
+shared_ptr<std::atomic<int64_t>> StatsdStats::getMetricCpuTimeCounter(const ConfigKey& key,
+                                                                      const int64_t id) {
+    lock_guard<std::mutex> lock(mLock);
+
+    auto statsIt = mConfigStats.find(key);
+    if (statsIt == mConfigStats.end()) {
+        return nullptr;
+    }
+    shared_ptr<std::atomic<int64_t>>& counter = statsIt->second->metric_cpu_time_stats[id];
+    if (counter == nullptr) {
+        counter = std::make_shared<std::atomic<int64_t>>(0);
+    }
+    return counter;
+}
+
+shared_ptr<MetricMemoryStats> StatsdStats::getMetricMemoryStats(const ConfigKey& key,
+                                                                const int64_t id) {
+    lock_guard<std::mutex> lock(mLock);
+
+    auto statsIt = mConfigStats.find(key);
+    if (statsIt == mConfigStats.end()) {
+        return nullptr;
+    }
+    shared_ptr<MetricMemoryStats>& stats = statsIt->second->metric_memory_stats[id];
+    if (stats == nullptr) {
+        stats = std::make_shared<MetricMemoryStats>();
+    }
+    return stats;
 }
 
 void StatsdStats::noteAnomalyDeclared(const ConfigKey& key, const int64_t id) {
@@ -675,15 +875,47 @@ void StatsdStats::notePullExceedMaxDelay(int pullAtomId) {
 }
 
 void StatsdStats::noteAtomLogged(int atomId, int32_t /*timeSec*/, bool isSkipped) {
+    if (atomId >= 0 && atomId <= kMaxPushedAtomId) {
+        notePushedAtomLogged(atomId, isSkipped);
+        return;
+    }
     lock_guard<std::mutex> lock(mLock);
 
     noteAtomLoggedLocked(atomId, isSkipped);
 }
 
+void StatsdStats::noteAtomsDroppedBySocketFilter(int atomId, int count) {
+    if (atomId < 0) {
+        return;
+    }
+    if (atomId <= kMaxPushedAtomId) {
+        mPushedAtomStats[atomId].logCount.fetch_add(count, std::memory_order_relaxed);
+        mPushedAtomStats[atomId].skipCount.fetch_add(count, std::memory_order_relaxed);
+        return;
+    }
+    lock_guard<std::mutex> lock(mLock);
+    if (mNonPlatformPushedAtomStats.size() < kMaxNonPlatformPushedAtoms ||
+        mNonPlatformPushedAtomStats.find(atomId) != mNonPlatformPushedAtomStats.end()) {
+        mNonPlatformPushedAtomStats[atomId].logCount += count;
+        mNonPlatformPushedAtomStats[atomId].skipCount += count;
+    }
+}
+
+void StatsdStats::notePushedAtomLogged(int atomId, bool isSkipped) {
+    mPushedAtomStats[atomId].logCount.fetch_add(1, std::memory_order_relaxed);
+    if (isSkipped) {
+        mPushedAtomStats[atomId].skipCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+StatsdStats::PushedAtomStats StatsdStats::getPushedAtomStatsLocked(size_t atomId) const {
+    return {mPushedAtomStats[atomId].logCount.load(std::memory_order_relaxed),
+            mPushedAtomStats[atomId].skipCount.load(std::memory_order_relaxed)};
+}
+
 void StatsdStats::noteAtomLoggedLocked(int atomId, bool isSkipped) {
     if (atomId >= 0 && atomId <= kMaxPushedAtomId) {
-        mPushedAtomStats[atomId].logCount++;
-        mPushedAtomStats[atomId].skipCount += isSkipped;
+        notePushedAtomLogged(atomId, isSkipped);
     } else {
         if (atomId < 0) {
             android_errorWriteLog(0x534e4554, "187957589");
@@ -705,6 +937,15 @@ void StatsdStats::noteSystemServerRestart(int32_t timeSec) {
     mSystemServerRestartSec.push_back(timeSec);
 }
 
+void StatsdStats::noteConfigsLoadedAtStartup(int32_t configCount, int64_t readLatencyNs,
+                                             int64_t initLatencyNs) {
+    lock_guard<std::mutex> lock(mLock);
+    mConfigsLoadedAtStartup = true;
+    mStartupConfigCount = configCount;
+    mStartupConfigReadLatencyNs = readLatencyNs;
+    mStartupConfigInitLatencyNs = initLatencyNs;
+}
+
 void StatsdStats::notePullFailed(int atomId) {
     lock_guard<std::mutex> lock(mLock);
     mPulledAtomStats[atomId].pullFailed++;
@@ -1015,6 +1256,11 @@ void StatsdStats::noteSubscriptionPullThreadWakeup() {
     mSubscriptionPullThreadWakeupCount++;
 }
 
+void StatsdStats::noteSubscriptionEventDropped() {
+    lock_guard<std::mutex> lock(mLock);
+    mSubscriptionDroppedEventCount++;
+}
+
 StatsdStats::AtomMetricStats& StatsdStats::getAtomMetricStats(int64_t metricId) {
     auto atomMetricStatsIter = mAtomMetricStats.find(metricId);
     if (atomMetricStatsIter != mAtomMetricStats.end()) {
@@ -1033,17 +1279,24 @@ void StatsdStats::resetInternalLocked() {
     // Reset the historical data, but keep the active ConfigStats
     mStartTimeSec = getWallClockSec();
     mIceBox.clear();
-    std::fill(mPushedAtomStats.begin(), mPushedAtomStats.end(), PushedAtomStats());
+    for (AtomicPushedAtomStats& atomStats : mPushedAtomStats) {
+        atomStats.logCount.store(0, std::memory_order_relaxed);
+        atomStats.skipCount.store(0, std::memory_order_relaxed);
+    }
     mNonPlatformPushedAtomStats.clear();
     mAnomalyAlarmRegisteredStats = 0;
     mPeriodicAlarmRegisteredStats = 0;
     mSystemServerRestartSec.clear();
     mLogLossStats.clear();
     mOverflowCount = 0;
+    std::fill(std::begin(mOverflowCountPerPriority), std::end(mOverflowCountPerPriority), 0);
     mMinQueueHistoryNs = kInt64Max;
     mMaxQueueHistoryNs = 0;
     mEventQueueMaxSizeObserved = 0;
     mEventQueueMaxSizeObservedElapsedNanos = 0;
+    mEventQueueResidency.clear();
+    mEventQueueReaderBoostCount = 0;
+    mAtomLatencyStats.clear();
     for (auto& config : mConfigStats) {
         config.second->broadcast_sent_time_sec.clear();
         config.second->activation_time_sec.clear();
@@ -1052,7 +1305,9 @@ void StatsdStats::resetInternalLocked() {
         config.second->data_drop_bytes.clear();
         config.second->dump_report_stats.clear();
         config.second->annotations.clear();
-        config.second->matcher_stats.clear();
+        for (auto& [_, counter] : config.second->matcher_stats) {
+            counter->store(0, std::memory_order_relaxed);
+        }
         config.second->condition_stats.clear();
         config.second->metric_stats.clear();
         config.second->metric_dimension_in_condition_stats.clear();
@@ -1068,6 +1323,14 @@ void StatsdStats::resetInternalLocked() {
         config.second->db_deletion_too_old = 0;
         config.second->db_deletion_config_removed = 0;
         config.second->db_deletion_config_updated = 0;
+        config.second->metrics_manager_latency.clear();
+        config.second->cpu_time_stats->logEventNs.store(0, std::memory_order_relaxed);
+        config.second->cpu_time_stats->dumpReportNs.store(0, std::memory_order_relaxed);
+        config.second->cpu_time_stats->pullNs.store(0, std::memory_order_relaxed);
+        for (auto& [_, counter] : config.second->metric_cpu_time_stats) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        // Memory stats are a snapshot of the current usage rather than a count, so they are kept.
     }
     for (auto& pullStats : mPulledAtomStats) {
         pullStats.second.totalPull = 0;
@@ -1097,9 +1360,11 @@ void StatsdStats::resetInternalLocked() {
     mPushedAtomErrorStats.clear();
     mSocketLossStats.clear();
     mSocketLossStatsOverflowCounters.clear();
+    mRateLimitedAtomCounts.clear();
     mPushedAtomDropsStats.clear();
     mRestrictedMetricQueryStats.clear();
     mSubscriptionPullThreadWakeupCount = 0;
+    mSubscriptionDroppedEventCount = 0;
 
     for (auto it = mSubscriptionStats.begin(); it != mSubscriptionStats.end();) {
         if (it->second.end_time_sec > 0) {
@@ -1156,8 +1421,37 @@ bool StatsdStats::hasSocketLoss() const {
     return !mLogLossStats.empty();
 }
 
-void StatsdStats::dumpStats(int out) const {
+double StatsdStats::getPushedAtomLogRate(const std::unordered_set<int>& atomIds,
+                                         int32_t timeSec) const {
     lock_guard<std::mutex> lock(mLock);
+    if (timeSec <= mStartTimeSec) {
+        return 0;
+    }
+    int64_t logCount = 0;
+    for (const int atomId : atomIds) {
+        if (atomId >= 0 && atomId <= kMaxPushedAtomId) {
+            logCount += getPushedAtomStatsLocked(atomId).logCount;
+            continue;
+        }
+        const auto it = mNonPlatformPushedAtomStats.find(atomId);
+        if (it != mNonPlatformPushedAtomStats.end()) {
+            logCount += it->second.logCount;
+        }
+    }
+    return (double)logCount / (timeSec - mStartTimeSec);
+}
+
+void StatsdStats::dumpStats(int out) const {
+    // Formatted into memory under mLock, so that the stats are not locked while out is written.
+    DumpBuffer buffer(out);
+    {
+        lock_guard<std::mutex> lock(mLock);
+        dumpStatsLocked(buffer.fd());
+    }
+    buffer.flush();
+}
+
+void StatsdStats::dumpStatsLocked(int out) const {
     time_t t = mStartTimeSec;
     struct tm* tm = localtime(&t);
     char timeBuffer[80];
@@ -1296,8 +1590,12 @@ void StatsdStats::dumpStats(int out) const {
                     dump.mDumpReportNumber);
         }
 
-        for (const auto& stats : pair.second->matcher_stats) {
-            dprintf(out, "matcher %lld matched %d times\n", (long long)stats.first, stats.second);
+        for (const auto& [matcherId, counter] : pair.second->matcher_stats) {
+            const int matchedCount = counter->load(std::memory_order_relaxed);
+            if (matchedCount > 0) {
+                dprintf(out, "matcher %lld matched %d times\n", (long long)matcherId,
+                        matchedCount);
+            }
         }
 
         for (const auto& stats : pair.second->condition_stats) {
@@ -1337,17 +1635,44 @@ void StatsdStats::dumpStats(int out) const {
         for (const int64_t dbSize : configStats->total_db_sizes) {
             dprintf(out, "\tdb size: %lld\n", (long long)dbSize);
         }
+
+        const LatencyStats& latency = configStats->metrics_manager_latency;
+        if (latency.count > 0) {
+            dprintf(out, "metrics manager latency: count %lld, mean %lld ns, max %lld ns\n",
+                    (long long)latency.count, (long long)(latency.sumNs / latency.count),
+                    (long long)latency.maxNs);
+        }
+
+        const CpuTimeStats& cpuTime = *configStats->cpu_time_stats;
+        dprintf(out, "cpu time ns: log events ~%lld, dump reports %lld, pulls %lld\n",
+                (long long)cpuTime.logEventNs.load(std::memory_order_relaxed),
+                (long long)cpuTime.dumpReportNs.load(std::memory_order_relaxed),
+                (long long)cpuTime.pullNs.load(std::memory_order_relaxed));
+        for (const auto& [metricId, counter] : configStats->metric_cpu_time_stats) {
+            const int64_t cpuTimeNs = counter->load(std::memory_order_relaxed);
+            if (cpuTimeNs > 0) {
+                dprintf(out, "metric %lld cpu time %lld ns\n", (long long)metricId,
+                        (long long)cpuTimeNs);
+            }
+        }
+        for (const auto& [metricId, memory] : configStats->metric_memory_stats) {
+            dprintf(out, "metric %lld memory: past buckets %lld bytes, current state %lld bytes\n",
+                    (long long)metricId,
+                    (long long)memory->pastBucketBytes.load(std::memory_order_relaxed),
+                    (long long)memory->currentStateBytes.load(std::memory_order_relaxed));
+        }
     }
     dprintf(out, "********Disk Usage stats***********\n");
     StorageManager::printStats(out);
     dprintf(out, "********Pushed Atom stats***********\n");
     const size_t atomCounts = mPushedAtomStats.size();
     for (size_t i = 2; i < atomCounts; i++) {
-        if (mPushedAtomStats[i].logCount > 0) {
+        const PushedAtomStats atomStats = getPushedAtomStatsLocked(i);
+        if (atomStats.logCount > 0) {
             dprintf(out,
                     "Atom %zu->(total count)%d, (error count)%d, (drop count)%d, (skip count)%d\n",
-                    i, mPushedAtomStats[i].logCount, getPushedAtomErrorsLocked((int)i),
-                    getPushedAtomDropsLocked((int)i), mPushedAtomStats[i].skipCount);
+                    i, atomStats.logCount, getPushedAtomErrorsLocked((int)i),
+                    getPushedAtomDropsLocked((int)i), atomStats.skipCount);
         }
     }
     for (const auto& pair : mNonPlatformPushedAtomStats) {
@@ -1440,11 +1765,46 @@ void StatsdStats::dumpStats(int out) const {
         }
     }
 
+    if (mRateLimitedAtomCounts.size()) {
+        dprintf(out, "********RateLimitedAtomCounts stats***********\n");
+        for (const auto& [uid, count] : mRateLimitedAtomCounts) {
+            dprintf(out, "Rate limited atoms for %d uid: %lld\n", uid, (long long)count);
+        }
+    }
+
     dprintf(out, "********EventQueueOverflow stats***********\n");
     dprintf(out, "Event queue overflow: %d; MaxHistoryNs: %lld; MinHistoryNs: %lld\n",
             mOverflowCount, (long long)mMaxQueueHistoryNs, (long long)mMinQueueHistoryNs);
-    dprintf(out, "Event queue max size: %d; Observed at : %lld\n", mEventQueueMaxSizeObserved,
+    dprintf(out, "Event queue overflow per priority: low %d; normal %d; critical %d\n",
+            mOverflowCountPerPriority[EVENT_PRIORITY_LOW],
+            mOverflowCountPerPriority[EVENT_PRIORITY_NORMAL],
+            mOverflowCountPerPriority[EVENT_PRIORITY_CRITICAL]);
+    dprintf(out, "Event queue max size: %d; Observed at : %lld\n",
+            mEventQueueMaxSizeObserved.load(),
             (long long)mEventQueueMaxSizeObservedElapsedNanos);
+    if (mEventQueueResidency.count > 0) {
+        dprintf(out,
+                "Event queue residency (1 in %u batches): count %lld, mean %lld ns, max %lld ns\n",
+                kQueueResidencySamplingRate, (long long)mEventQueueResidency.count,
+                (long long)(mEventQueueResidency.sumNs / mEventQueueResidency.count),
+                (long long)mEventQueueResidency.maxNs);
+    }
+    dprintf(out, "Event queue reader boosts: %d\n", mEventQueueReaderBoostCount);
+    if (mConfigsLoadedAtStartup) {
+        dprintf(out, "Configs loaded at startup: %d; ReadLatencyNs: %lld; InitLatencyNs: %lld\n",
+                mStartupConfigCount, (long long)mStartupConfigReadLatencyNs,
+                (long long)mStartupConfigInitLatencyNs);
+    }
+
+    if (!mAtomLatencyStats.empty()) {
+        dprintf(out, "********Atom latency stats (1 in %u events)***********\n",
+                kLatencyTraceSamplingRate);
+        for (const auto& [key, stats] : mAtomLatencyStats) {
+            dprintf(out, "Atom %d, %s: count %lld, mean %lld ns, max %lld ns\n", key.first,
+                    LatencyStage_Name(key.second).c_str(), (long long)stats.count,
+                    (long long)(stats.sumNs / stats.count), (long long)stats.maxNs);
+        }
+    }
 
     if (mActivationBroadcastGuardrailStats.size() > 0) {
         dprintf(out, "********mActivationBroadcastGuardrail stats***********\n");
@@ -1459,6 +1819,7 @@ void StatsdStats::dumpStats(int out) const {
 
     dprintf(out, "********Atom Subscription stats***********\n");
     dprintf(out, "Pull thread wakeup count: %d\n", mSubscriptionPullThreadWakeupCount);
+    dprintf(out, "Dropped event count: %d\n", mSubscriptionDroppedEventCount);
     for (const auto& [id, subStats] : mSubscriptionStats) {
         dprintf(out,
                 "Subscription %d: pushed_atom_count=%d, pulled_atom_count=%d, flush_count=%d\n", id,
@@ -1493,9 +1854,25 @@ void StatsdStats::dumpStats(int out) const {
     dprintf(out, "Shard Offset: %u\n", ShardOffsetProvider::getInstance().getShardOffset());
 }
 
-void addConfigStatsToProto(const ConfigStats& configStats, ProtoOutputStream* proto) {
-    uint64_t token =
-            proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_CONFIG_STATS);
+void writeLatencyStatsToProto(const LatencyStats& stats, const uint64_t fieldId,
+                              ProtoOutputStream* proto) {
+    if (stats.count == 0) {
+        return;
+    }
+    uint64_t token = proto->start(FIELD_TYPE_MESSAGE | fieldId);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_LATENCY_STATS_COUNT, (long long)stats.count);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_LATENCY_STATS_SUM_NS, (long long)stats.sumNs);
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_LATENCY_STATS_MAX_NS, (long long)stats.maxNs);
+    const AggregatorStateProto& aggProto = stats.sketch->SerializeToProto();
+    const size_t numBytes = aggProto.ByteSizeLong();
+    const std::unique_ptr<char[]> buffer(new char[numBytes]);
+    aggProto.SerializeToArray(&buffer[0], numBytes);
+    proto->write(FIELD_TYPE_BYTES | FIELD_ID_LATENCY_STATS_KLL_SKETCH, &buffer[0], numBytes);
+    proto->end(token);
+}
+
+// Writes the fields of the ConfigStats message of configStats.
+void writeConfigStatsFieldsToProto(const ConfigStats& configStats, ProtoOutputStream* proto) {
     proto->write(FIELD_TYPE_INT32 | FIELD_ID_CONFIG_STATS_UID, configStats.uid);
     proto->write(FIELD_TYPE_INT64 | FIELD_ID_CONFIG_STATS_ID, (long long)configStats.id);
     proto->write(FIELD_TYPE_INT32 | FIELD_ID_CONFIG_STATS_CREATION, configStats.creation_time_sec);
@@ -1604,11 +1981,15 @@ void addConfigStatsToProto(const ConfigStats& configStats, ProtoOutputStream* pr
         proto->end(token);
     }
 
-    for (const auto& pair : configStats.matcher_stats) {
+    for (const auto& [matcherId, counter] : configStats.matcher_stats) {
+        const int matchedCount = counter->load(std::memory_order_relaxed);
+        if (matchedCount == 0) {
+            continue;
+        }
         uint64_t tmpToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
                                           FIELD_ID_CONFIG_STATS_MATCHER_STATS);
-        proto->write(FIELD_TYPE_INT64 | FIELD_ID_MATCHER_STATS_ID, (long long)pair.first);
-        proto->write(FIELD_TYPE_INT32 | FIELD_ID_MATCHER_STATS_COUNT, pair.second);
+        proto->write(FIELD_TYPE_INT64 | FIELD_ID_MATCHER_STATS_ID, (long long)matcherId);
+        proto->write(FIELD_TYPE_INT32 | FIELD_ID_MATCHER_STATS_COUNT, matchedCount);
         proto->end(tmpToken);
     }
 
@@ -1697,18 +2078,82 @@ void addConfigStatsToProto(const ConfigStats& configStats, ProtoOutputStream* pr
                              FIELD_COUNT_REPEATED,
                      dbSize);
     }
+    writeLatencyStatsToProto(configStats.metrics_manager_latency,
+                             FIELD_ID_CONFIG_STATS_METRICS_MANAGER_LATENCY, proto);
+
+    const CpuTimeStats& cpuTime = *configStats.cpu_time_stats;
+    const int64_t logEventNs = cpuTime.logEventNs.load(std::memory_order_relaxed);
+    const int64_t dumpReportNs = cpuTime.dumpReportNs.load(std::memory_order_relaxed);
+    const int64_t pullNs = cpuTime.pullNs.load(std::memory_order_relaxed);
+    if (logEventNs > 0 || dumpReportNs > 0 || pullNs > 0) {
+        uint64_t tmpToken =
+                proto->start(FIELD_TYPE_MESSAGE | FIELD_ID_CONFIG_STATS_CPU_TIME_STATS);
+        writeNonZeroStatToStream(FIELD_TYPE_INT64 | FIELD_ID_CPU_TIME_STATS_LOG_EVENT,
+                                 (long long)logEventNs, proto);
+        writeNonZeroStatToStream(FIELD_TYPE_INT64 | FIELD_ID_CPU_TIME_STATS_DUMP_REPORT,
+                                 (long long)dumpReportNs, proto);
+        writeNonZeroStatToStream(FIELD_TYPE_INT64 | FIELD_ID_CPU_TIME_STATS_PULL,
+                                 (long long)pullNs, proto);
+        proto->end(tmpToken);
+    }
+
+    for (const auto& [metricId, counter] : configStats.metric_cpu_time_stats) {
+        const int64_t cpuTimeNs = counter->load(std::memory_order_relaxed);
+        if (cpuTimeNs == 0) {
+            continue;
+        }
+        uint64_t tmpToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
+                                         FIELD_ID_CONFIG_STATS_METRIC_CPU_TIME_STATS);
+        proto->write(FIELD_TYPE_INT64 | FIELD_ID_METRIC_CPU_TIME_STATS_ID, (long long)metricId);
+        proto->write(FIELD_TYPE_INT64 | FIELD_ID_METRIC_CPU_TIME_STATS_CPU_TIME,
+                     (long long)cpuTimeNs);
+        proto->end(tmpToken);
+    }
+
+    for (const auto& [metricId, memory] : configStats.metric_memory_stats) {
+        const int64_t pastBucketBytes = memory->pastBucketBytes.load(std::memory_order_relaxed);
+        const int64_t currentStateBytes =
+                memory->currentStateBytes.load(std::memory_order_relaxed);
+        if (pastBucketBytes == 0 && currentStateBytes == 0) {
+            continue;
+        }
+        uint64_t tmpToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
+                                         FIELD_ID_CONFIG_STATS_METRIC_MEMORY_STATS);
+        proto->write(FIELD_TYPE_INT64 | FIELD_ID_METRIC_MEMORY_STATS_ID, (long long)metricId);
+        writeNonZeroStatToStream(FIELD_TYPE_INT64 | FIELD_ID_METRIC_MEMORY_STATS_PAST_BUCKET_BYTES,
+                                 (long long)pastBucketBytes, proto);
+        writeNonZeroStatToStream(
+                FIELD_TYPE_INT64 | FIELD_ID_METRIC_MEMORY_STATS_CURRENT_STATE_BYTES,
+                (long long)currentStateBytes, proto);
+        proto->end(tmpToken);
+    }
+}
+
+void addConfigStatsToProto(const ConfigStats& configStats, ProtoOutputStream* proto) {
+    uint64_t token =
+            proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_CONFIG_STATS);
+    writeConfigStatsFieldsToProto(configStats, proto);
     proto->end(token);
 }
 
 void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
-    lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
 
     ProtoOutputStream proto;
     proto.write(FIELD_TYPE_INT32 | FIELD_ID_BEGIN_TIME, mStartTimeSec);
     proto.write(FIELD_TYPE_INT32 | FIELD_ID_END_TIME, (int32_t)getWallClockSec());
 
     for (const auto& configStats : mIceBox) {
-        addConfigStatsToProto(*configStats, &proto);
+        // The stats of a config in the ice box no longer change, so they are encoded by the
+        // first dump only.
+        if (configStats->encoded_proto.empty()) {
+            ProtoOutputStream configProto;
+            writeConfigStatsFieldsToProto(*configStats, &configProto);
+            configProto.serializeToVector(&configStats->encoded_proto);
+        }
+        proto.write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_CONFIG_STATS,
+                    reinterpret_cast<const char*>(configStats->encoded_proto.data()),
+                    configStats->encoded_proto.size());
     }
 
     for (auto& pair : mConfigStats) {
@@ -1717,11 +2162,12 @@ void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
 
     const size_t atomCounts = mPushedAtomStats.size();
     for (size_t i = 2; i < atomCounts; i++) {
-        if (mPushedAtomStats[i].logCount > 0) {
+        const PushedAtomStats atomStats = getPushedAtomStatsLocked(i);
+        if (atomStats.logCount > 0) {
             uint64_t token =
                     proto.start(FIELD_TYPE_MESSAGE | FIELD_ID_ATOM_STATS | FIELD_COUNT_REPEATED);
             proto.write(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_TAG, (int32_t)i);
-            proto.write(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_COUNT, mPushedAtomStats[i].logCount);
+            proto.write(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_COUNT, atomStats.logCount);
             const int errors = getPushedAtomErrorsLocked(i);
             writeNonZeroStatToStream(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_ERROR_COUNT, errors,
                                      &proto);
@@ -1729,7 +2175,7 @@ void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
             writeNonZeroStatToStream(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_DROPS_COUNT, drops,
                                      &proto);
             writeNonZeroStatToStream(FIELD_TYPE_INT32 | FIELD_ID_ATOM_STATS_SKIP_COUNT,
-                                     mPushedAtomStats[i].skipCount, &proto);
+                                     atomStats.skipCount, &proto);
             proto.end(token);
         }
     }
@@ -1797,16 +2243,46 @@ void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
                     (long long)mMaxQueueHistoryNs);
         proto.write(FIELD_TYPE_INT64 | FIELD_ID_OVERFLOW_MIN_HISTORY,
                     (long long)mMinQueueHistoryNs);
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_OVERFLOW_LOW_PRIORITY_COUNT,
+                    mOverflowCountPerPriority[EVENT_PRIORITY_LOW]);
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_OVERFLOW_NORMAL_PRIORITY_COUNT,
+                    mOverflowCountPerPriority[EVENT_PRIORITY_NORMAL]);
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_OVERFLOW_CRITICAL_PRIORITY_COUNT,
+                    mOverflowCountPerPriority[EVENT_PRIORITY_CRITICAL]);
         proto.end(token);
     }
 
     uint64_t queueStatsToken = proto.start(FIELD_TYPE_MESSAGE | FIELD_ID_QUEUE_STATS);
     proto.write(FIELD_TYPE_INT32 | FIELD_ID_QUEUE_MAX_SIZE_OBSERVED,
-                (int32_t)mEventQueueMaxSizeObserved);
+                mEventQueueMaxSizeObserved.load());
     proto.write(FIELD_TYPE_INT64 | FIELD_ID_QUEUE_MAX_SIZE_OBSERVED_ELAPSED_NANOS,
                 (long long)mEventQueueMaxSizeObservedElapsedNanos);
+    writeLatencyStatsToProto(mEventQueueResidency, FIELD_ID_QUEUE_RESIDENCY, &proto);
+    if (mEventQueueReaderBoostCount > 0) {
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_QUEUE_READER_BOOST_COUNT,
+                    mEventQueueReaderBoostCount);
+    }
     proto.end(queueStatsToken);
 
+    if (mConfigsLoadedAtStartup) {
+        uint64_t startupToken = proto.start(FIELD_TYPE_MESSAGE | FIELD_ID_STARTUP_CONFIG_STATS);
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_STARTUP_CONFIG_COUNT, mStartupConfigCount);
+        proto.write(FIELD_TYPE_INT64 | FIELD_ID_STARTUP_CONFIG_READ_LATENCY_NS,
+                    (long long)mStartupConfigReadLatencyNs);
+        proto.write(FIELD_TYPE_INT64 | FIELD_ID_STARTUP_CONFIG_INIT_LATENCY_NS,
+                    (long long)mStartupConfigInitLatencyNs);
+        proto.end(startupToken);
+    }
+
+    for (const auto& [key, stats] : mAtomLatencyStats) {
+        uint64_t token = proto.start(FIELD_TYPE_MESSAGE | FIELD_ID_ATOM_LATENCY_STATS |
+                                     FIELD_COUNT_REPEATED);
+        proto.write(FIELD_TYPE_INT32 | FIELD_ID_ATOM_LATENCY_STATS_ATOM_ID, key.first);
+        proto.write(FIELD_TYPE_ENUM | FIELD_ID_ATOM_LATENCY_STATS_STAGE, key.second);
+        writeLatencyStatsToProto(stats, FIELD_ID_ATOM_LATENCY_STATS_LATENCY, &proto);
+        proto.end(token);
+    }
+
     for (const auto& restart : mSystemServerRestartSec) {
         proto.write(FIELD_TYPE_INT32 | FIELD_ID_SYSTEM_SERVER_RESTART | FIELD_COUNT_REPEATED,
                     restart);
@@ -1887,6 +2363,8 @@ void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
     writeNonZeroStatToStream(
             FIELD_TYPE_INT32 | FIELD_ID_SUBSCRIPTION_STATS_PULL_THREAD_WAKEUP_COUNT,
             mSubscriptionPullThreadWakeupCount, &proto);
+    writeNonZeroStatToStream(FIELD_TYPE_INT32 | FIELD_ID_SUBSCRIPTION_STATS_DROPPED_EVENT_COUNT,
+                             mSubscriptionDroppedEventCount, &proto);
     proto.end(token);
 
     // libstatssocket specific stats
@@ -1930,12 +2408,14 @@ void StatsdStats::dumpStats(std::vector<uint8_t>* output, bool reset) {
 
     proto.end(socketLossStatsToken);
 
-    output->clear();
-    proto.serializeToVector(output);
-
     if (reset) {
         resetInternalLocked();
     }
+    // The report is complete, so it is flattened without blocking the stats.
+    lock.unlock();
+
+    output->clear();
+    proto.serializeToVector(output);
 
     VLOG("reset=%d, returned proto size %lu", reset, (unsigned long)output->size());
 }
@@ -19,19 +19,46 @@
 #include <log/log_time.h>
 #include <src/guardrail/stats_log_enums.pb.h>
 
+#include <atomic>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "config/ConfigKey.h"
 #include "logd/logevent_util.h"
 
+namespace dist_proc {
+namespace aggregation {
+class KllQuantile;
+}  // namespace aggregation
+}  // namespace dist_proc
+
 namespace android {
 namespace os {
 namespace statsd {
 
+// Distribution of the latencies of sampled events, see StatsdStats::noteAtomLatency.
+struct LatencyStats {
+    LatencyStats();
+    ~LatencyStats();
+
+    void add(int64_t latencyNs);
+
+    void clear();
+
+    int64_t count = 0;
+    int64_t sumNs = 0;
+    int64_t maxNs = 0;
+
+    // Created with the first latency.
+    std::unique_ptr<dist_proc::aggregation::KllQuantile> sketch;
+};
+
 struct InvalidConfigReason {
     InvalidConfigReasonEnum reason;
     std::optional<int64_t> metricId;
@@ -72,6 +99,41 @@ struct DumpReportStats {
     int32_t mDumpReportNumber = 0;
 };
 
+// Thread CPU time a config spent, see StatsdStats::getCpuTimeStats(). The time spent on log
+// events is estimated from a sample of them.
+struct CpuTimeStats {
+    std::atomic<int64_t> logEventNs = 0;
+    std::atomic<int64_t> dumpReportNs = 0;
+    std::atomic<int64_t> pullNs = 0;
+};
+
+// Memory a metric holds, see StatsdStats::getMetricMemoryStats(). Past buckets are the data
+// waiting for the next report, current state is the dimension maps and trackers of the current
+// bucket, including their hash tables.
+struct MetricMemoryStats {
+    std::atomic<int64_t> pastBucketBytes = 0;
+    std::atomic<int64_t> currentStateBytes = 0;
+};
+
+// Adds the thread CPU time between its construction and its destruction, times multiplier, to
+// the counters that are not nullptr.
+class ScopedCpuTimer {
+public:
+    ScopedCpuTimer(std::atomic<int64_t>* configCounter, std::atomic<int64_t>* metricCounter,
+                   int64_t multiplier = 1);
+
+    ScopedCpuTimer(const ScopedCpuTimer&) = delete;
+    ScopedCpuTimer& operator=(const ScopedCpuTimer&) = delete;
+
+    ~ScopedCpuTimer();
+
+private:
+    std::atomic<int64_t>* const mConfigCounter;
+    std::atomic<int64_t>* const mMetricCounter;
+    const int64_t mMultiplier;
+    const int64_t mStartNs;
+};
+
 struct ConfigStats {
     int32_t uid;
     int64_t id;
@@ -95,6 +157,9 @@ struct ConfigStats {
     // Stores reasons for why config is valid or not
     std::optional<InvalidConfigReason> reason;
 
+    // The fields of the ConfigStats proto, encoded once the config is in the ice box.
+    std::vector<uint8_t> encoded_proto;
+
     std::list<int32_t> broadcast_sent_time_sec;
 
     // Times at which this config is activated.
@@ -110,7 +175,10 @@ struct ConfigStats {
     std::list<DumpReportStats> dump_report_stats;
 
     // Stores how many times a matcher have been matched. The map size is capped by kMaxConfigCount.
-    std::map<const int64_t, int> matcher_stats;
+    // The counters are shared with the config's MetricsManager, which resolves them once per
+    // config load and increments them without taking StatsdStats' lock. Resets zero them
+    // instead of dropping them, and matchers that never matched are not reported.
+    std::map<const int64_t, std::shared_ptr<std::atomic<int>>> matcher_stats;
 
     // Stores the number of output tuple of condition trackers when it's bigger than
     // kDimensionKeySizeSoftLimit. When you see the number is kDimensionKeySizeHardLimit +1,
@@ -145,6 +213,20 @@ struct ConfigStats {
 
     // Stores the last 20 sizes of the sqlite db.
     std::list<int64_t> total_db_sizes;
+
+    // Time spent in the MetricsManager of this config by sampled events.
+    LatencyStats metrics_manager_latency;
+
+    // CPU time spent on this config, shared with its MetricsManager like matcher_stats.
+    std::shared_ptr<CpuTimeStats> cpu_time_stats = std::make_shared<CpuTimeStats>();
+
+    // CPU time spent on the metrics of this config, by metric id. Shared with the metrics like
+    // matcher_stats, metrics that took no CPU time are not reported.
+    std::map<const int64_t, std::shared_ptr<std::atomic<int64_t>>> metric_cpu_time_stats;
+
+    // Memory held by the metrics of this config, by metric id. Shared with the MetricsManager like
+    // matcher_stats, which updates it when it checks the config's byte size.
+    std::map<const int64_t, std::shared_ptr<MetricMemoryStats>> metric_memory_stats;
 };
 
 struct UidMapStats {
@@ -275,6 +357,22 @@ public:
     // Maximum number of socket loss stats to track.
     static const int kMaxSocketLossStatsSize = 50;
 
+    // Maximum number of uids to track the rate limited atoms of.
+    static const int kMaxRateLimitedUids = 50;
+
+    // One in this many pushed events has its latency traced, see shouldTraceLatency().
+    static const uint32_t kLatencyTraceSamplingRate = 128;
+
+    // One in this many batches read from the event queue has its residency recorded, see
+    // noteEventQueueResidency().
+    static const uint32_t kQueueResidencySamplingRate = 16;
+
+    // One in this many log events has the CPU time its MetricsManager spent on it measured.
+    static const uint32_t kCpuTimeSamplingRate = 64;
+
+    // Maximum number of (atom id, latency stage) pairs latencies are tracked for.
+    static const int kMaxAtomLatencyStatsSize = 300;
+
     // Maximum atom id value that we consider a platform pushed atom.
     // This should be updated once highest pushed atom id in atoms.proto approaches this value.
     static const int kMaxPushedAtomId = 900;
@@ -429,6 +527,41 @@ public:
      */
     void noteMatcherMatched(const ConfigKey& key, int64_t id);
 
+    /**
+     * Returns the counter behind noteMatcherMatched for the given matcher, for callers that match
+     * on every event. Incrementing it has the effect of noteMatcherMatched. Returns nullptr if
+     * there are no stats for the config, i.e. the config is invalid or was removed.
+     *
+     * [key]: The config key that this matcher belongs to.
+     * [id]: The id of the matcher.
+     */
+    std::shared_ptr<std::atomic<int>> getMatcherMatchedCounter(const ConfigKey& key, int64_t id);
+
+    /**
+     * Returns the CPU time counters of the config, which its MetricsManager adds to without
+     * taking StatsdStats' lock. Returns nullptr if there are no stats for the config.
+     */
+    std::shared_ptr<CpuTimeStats> getCpuTimeStats(const ConfigKey& key);
+
+    /**
+     * Returns the CPU time counter of a metric, which the metric adds to without taking
+     * StatsdStats' lock. Returns nullptr if there are no stats for the config.
+     *
+     * [key]: The config key that this metric belongs to.
+     * [id]: The id of the metric.
+     */
+    std::shared_ptr<std::atomic<int64_t>> getMetricCpuTimeCounter(const ConfigKey& key,
+                                                                  int64_t id);
+
+    /**
+     * Returns the memory stats of a metric, which its MetricsManager updates without taking
+     * StatsdStats' lock. Returns nullptr if there are no stats for the config.
+     *
+     * [key]: The config key that this metric belongs to.
+     * [id]: The id of the metric.
+     */
+    std::shared_ptr<MetricMemoryStats> getMetricMemoryStats(const ConfigKey& key, int64_t id);
+
     /**
      * Report that an anomaly detection alert has been declared.
      *
@@ -438,10 +571,16 @@ public:
     void noteAnomalyDeclared(const ConfigKey& key, int64_t id);
 
     /**
-     * Report an atom event has been logged.
+     * Report an atom event has been logged. Does not take the lock for platform atoms.
      */
     void noteAtomLogged(int atomId, int32_t timeSec, bool isSkipped);
 
+    /**
+     * Report that count atom events were logged and dropped by the filter of the statsd socket,
+     * before statsd received them. They are counted as logged and skipped.
+     */
+    void noteAtomsDroppedBySocketFilter(int atomId, int count);
+
     /**
      * Report that statsd modified the anomaly alarm registered with StatsCompanionService.
      */
@@ -515,6 +654,18 @@ public:
      */
     void noteSystemServerRestart(int32_t timeSec);
 
+    /**
+     * Records the configs loaded from disk at startup: how many were set up, how long reading
+     * and parsing them took, and how long setting them up took after that.
+     */
+    void noteConfigsLoadedAtStartup(int32_t configCount, int64_t readLatencyNs,
+                                    int64_t initLatencyNs);
+
+    /**
+     * Records that the socket listener dropped an atom of an app uid over its rate limit.
+     */
+    void noteUidRateLimited(int32_t uid);
+
     /**
      * Records statsd skipped an event.
      */
@@ -612,11 +763,30 @@ public:
 
     /* Reports one event id has been dropped due to queue overflow, and the oldest event timestamp
      * in the queue */
-    void noteEventQueueOverflow(int64_t oldestEventTimestampNs, int32_t atomId, bool isSkipped);
+    void noteEventQueueOverflow(int64_t oldestEventTimestampNs, int32_t atomId, bool isSkipped,
+                                EventPriority priority);
 
-    /* Notes queue max size seen so far and associated timestamp */
+    /* Notes queue max size seen so far and associated timestamp. Only takes the lock when a new
+     * max is seen. */
     void noteEventQueueSize(int32_t size, int64_t eventTimestampNs);
 
+    /* Notes the time the oldest event of a batch read from the event queue spent in the queue.
+     * Only one in kQueueResidencySamplingRate calls is recorded, the others don't take the lock. */
+    void noteEventQueueResidency(int64_t residencyNs);
+
+    /* Notes that the log reader thread raised its priority to catch up with the event queue. */
+    void noteEventQueueReaderBoosted();
+
+    /* Returns whether the caller should trace the latency of the next event through the stages
+     * of LatencyStage. True once every kLatencyTraceSamplingRate calls, without the lock. */
+    bool shouldTraceLatency();
+
+    /* Notes the time a sampled event of atomId spent in stage. */
+    void noteAtomLatency(int32_t atomId, LatencyStage stage, int64_t latencyNs);
+
+    /* Notes the time the MetricsManager of a config spent on a sampled event. */
+    void noteMetricsManagerLatency(const ConfigKey& key, int64_t latencyNs);
+
     /**
      * Reports that the activation broadcast guardrail was hit for this uid. Namely, the broadcast
      * should have been sent, but instead was skipped due to hitting the guardrail.
@@ -706,6 +876,11 @@ public:
      */
     void noteSubscriptionPullThreadWakeup();
 
+    /**
+     * Report an event was dropped because the subscriptions were too far behind.
+     */
+    void noteSubscriptionEventDropped();
+
     /**
      * Reset the historical stats. Including all stats in icebox, and the tracked stats about
      * metrics, matchers, and atoms. The active configs will be kept and StatsdStats will continue
@@ -758,6 +933,12 @@ public:
      */
     bool hasSocketLoss() const;
 
+    /**
+     * Returns how many times per second the given pushed atoms were logged, on average, between
+     * the last reset of the stats and timeSec, in wall clock seconds.
+     */
+    double getPushedAtomLogRate(const std::unordered_set<int>& atomIds, int32_t timeSec) const;
+
     typedef struct PullTimeoutMetadata {
         int64_t pullTimeoutUptimeMillis;
         int64_t pullTimeoutElapsedMillis;
@@ -807,6 +988,8 @@ public:
     } AtomMetricStats;
 
 private:
+    void dumpStatsLocked(int outFd) const;
+
     StatsdStats();
 
     mutable std::mutex mLock;
@@ -833,12 +1016,18 @@ private:
     // The size of the vector is the largest pushed atom id in atoms.proto + 1. Atoms
     // out of that range will be put in mNonPlatformPushedAtomStats.
     // This is a vector, not a map because it will be accessed A LOT -- for each stats log.
+    // Its counters are relaxed atomics, so logging a platform atom does not take mLock.
     struct PushedAtomStats {
         int logCount = 0;
         int skipCount = 0;
     };
 
-    std::vector<PushedAtomStats> mPushedAtomStats;
+    struct AtomicPushedAtomStats {
+        std::atomic<int> logCount = 0;
+        std::atomic<int> skipCount = 0;
+    };
+
+    std::vector<AtomicPushedAtomStats> mPushedAtomStats;
 
     // Stores the number of times a pushed atom is logged and skipped for atom ids above
     // kMaxPushedAtomId. The max size of the map is kMaxNonPlatformPushedAtoms.
@@ -888,6 +1077,10 @@ private:
     // The max size of this map is kMaxSocketLossStatsSize.
     std::map<int32_t, int32_t> mSocketLossStatsOverflowCounters;
 
+    // Number of atoms dropped by the socket listener per app uid over its rate limit.
+    // The max size of this map is kMaxRateLimitedUids.
+    std::map<int32_t, int64_t> mRateLimitedAtomCounts;
+
     // Maps metric ID to its stats. The size is capped by the number of metrics.
     std::map<int64_t, AtomMetricStats> mAtomMetricStats;
 
@@ -925,17 +1118,44 @@ private:
     // Total number of events that are lost due to queue overflow.
     int32_t mOverflowCount = 0;
 
-    // Max number of events stored into the queue seen so far.
-    int32_t mEventQueueMaxSizeObserved = 0;
+    // Events lost due to queue overflow per EventPriority.
+    int32_t mOverflowCountPerPriority[EVENT_PRIORITY_COUNT] = {};
+
+    // Max number of events stored into the queue seen so far. Atomic so that sizes below it are
+    // rejected without the lock; only written with mLock held.
+    std::atomic<int32_t> mEventQueueMaxSizeObserved = 0;
 
     // Event timestamp for associated max size hit.
     int64_t mEventQueueMaxSizeObservedElapsedNanos = 0;
 
+    // Counts the noteEventQueueResidency() calls.
+    std::atomic<uint32_t> mQueueResidencyCounter = 0;
+
+    // Sampled residencies of the batches read from the event queue.
+    LatencyStats mEventQueueResidency;
+
+    // Number of times the log reader thread was boosted, see ReaderPriorityBooster.
+    int32_t mEventQueueReaderBoostCount = 0;
+
+    // Counts the shouldTraceLatency() calls.
+    std::atomic<uint32_t> mLatencyTraceCounter = 0;
+
+    // Latencies of sampled events per atom id and stage. The max size of this map is
+    // kMaxAtomLatencyStatsSize.
+    std::map<std::pair<int32_t, LatencyStage>, LatencyStats> mAtomLatencyStats;
+
     // Timestamps when we detect log loss, and the number of logs lost.
     std::list<LogLossStats> mLogLossStats;
 
     std::list<int32_t> mSystemServerRestartSec;
 
+    // Set by noteConfigsLoadedAtStartup. Kept across resets, since startup happens once per
+    // process.
+    bool mConfigsLoadedAtStartup = false;
+    int32_t mStartupConfigCount = 0;
+    int64_t mStartupConfigReadLatencyNs = 0;
+    int64_t mStartupConfigInitLatencyNs = 0;
+
     struct RestrictedMetricQueryStats {
         RestrictedMetricQueryStats(int32_t callingUid, int64_t configId,
                                    const string& configPackage, std::optional<int32_t> configUid,
@@ -972,6 +1192,8 @@ private:
 
     int32_t mSubscriptionPullThreadWakeupCount = 0;
 
+    int32_t mSubscriptionDroppedEventCount = 0;
+
     // Maps Subscription ID to the corresponding SubscriptionStats struct object.
     // Size of this map is capped by ShellSubscriber::kMaxSubscriptions.
     std::map<int32_t, SubscriptionStats> mSubscriptionStats;
@@ -991,6 +1213,12 @@ private:
 
     void noteAtomLoggedLocked(int atomId, bool isSkipped);
 
+    // Counts a log of the atom in mPushedAtomStats. Needs no lock. atomId must be in
+    // [0, kMaxPushedAtomId].
+    void notePushedAtomLogged(int atomId, bool isSkipped);
+
+    PushedAtomStats getPushedAtomStatsLocked(size_t atomId) const;
+
     void noteAtomDroppedLocked(int atomId);
 
     void noteDataDropped(const ConfigKey& key, const size_t totalBytes, int32_t timeSec);
@@ -1021,20 +1249,27 @@ private:
     FRIEND_TEST(LogEventQueue_test, TestQueueMaxSize);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessage);
     FRIEND_TEST(StatsLogProcessorTest, InvalidConfigRemoved);
+    FRIEND_TEST(StatsdStatsTest, TestIcedConfigStatsEncodedOnce);
     FRIEND_TEST(StatsdStatsTest, TestActivationBroadcastGuardrailHit);
     FRIEND_TEST(StatsdStatsTest, TestAnomalyMonitor);
     FRIEND_TEST(StatsdStatsTest, TestAtomDroppedStats);
     FRIEND_TEST(StatsdStatsTest, TestAtomErrorStats);
+    FRIEND_TEST(StatsdStatsTest, TestAtomLatencyStats);
+    FRIEND_TEST(StatsdStatsTest, TestEventQueueOverflowPerPriority);
+    FRIEND_TEST(StatsdStatsTest, TestEventQueueResidency);
     FRIEND_TEST(StatsdStatsTest, TestAtomLog);
     FRIEND_TEST(StatsdStatsTest, TestAtomLoggedAndDroppedAndSkippedStats);
     FRIEND_TEST(StatsdStatsTest, TestAtomLoggedAndDroppedStats);
     FRIEND_TEST(StatsdStatsTest, TestAtomMetricsStats);
     FRIEND_TEST(StatsdStatsTest, TestAtomSkippedStats);
     FRIEND_TEST(StatsdStatsTest, TestConfigRemove);
+    FRIEND_TEST(StatsdStatsTest, TestCpuTimeStats);
+    FRIEND_TEST(StatsdStatsTest, TestMetricMemoryStats);
     FRIEND_TEST(StatsdStatsTest, TestHasHitDimensionGuardrail);
     FRIEND_TEST(StatsdStatsTest, TestInvalidConfigAdd);
     FRIEND_TEST(StatsdStatsTest, TestInvalidConfigMissingMetricId);
     FRIEND_TEST(StatsdStatsTest, TestInvalidConfigOnlyMetricId);
+    FRIEND_TEST(StatsdStatsTest, TestMatcherMatchedCounter);
     FRIEND_TEST(StatsdStatsTest, TestNonPlatformAtomLog);
     FRIEND_TEST(StatsdStatsTest, TestPullAtomStats);
     FRIEND_TEST(StatsdStatsTest, TestQueueStats);
@@ -1047,6 +1282,7 @@ private:
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionAtomPulled);
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionEnded);
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionFlushed);
+    FRIEND_TEST(StatsdStatsTest, TestSubscriptionEventDropped);
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionPullThreadWakeup);
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionStarted);
     FRIEND_TEST(StatsdStatsTest, TestSubscriptionStartedMaxActiveSubscriptions);
@@ -1054,6 +1290,9 @@ private:
     FRIEND_TEST(StatsdStatsTest, TestSystemServerCrash);
     FRIEND_TEST(StatsdStatsTest, TestTimestampThreshold);
     FRIEND_TEST(StatsdStatsTest, TestValidConfigAdd);
+    FRIEND_TEST(ConfigCostEstimatorTest, TestEstimateAtomNotInUse);
+    FRIEND_TEST(SocketAtomFilterTest, TestSampledAtomsNotInUse);
+    FRIEND_TEST(StatsServiceTest, TestEventsQueuedBeforeStopAreProcessed);
 };
 
 InvalidConfigReason createInvalidConfigReasonWithMatcher(const InvalidConfigReasonEnum reason,
@@ -16,6 +16,8 @@
 
 #include "hash.h"
 
+#include <string.h>
+
 #ifndef FALLTHROUGH_INTENDED
 #define FALLTHROUGH_INTENDED [[fallthrough]]
 #endif
@@ -137,6 +139,24 @@ uint64_t Hash64(const char* data, size_t n, uint64_t seed) {
 
   return h;
 }
+
+void StreamingHash64::addBytes(const char* data, size_t n) {
+    // The length keeps strings that only differ by trailing zero bytes apart.
+    add(n);
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        add(word);
+        data += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        uint64_t word = 0;
+        memcpy(&word, data, n);
+        add(word);
+    }
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
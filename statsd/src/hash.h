@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 
 namespace android {
@@ -42,6 +44,58 @@ inline uint64_t Hash64(const std::string& str) {
   return Hash64(str.data(), str.size());
 }
 
+// A word at a time hash for hash tables and change detection within statsd, fed one typed value
+// at a time so that callers don't have to serialize values to bytes first, e.g.
+//     StreamingHash64 hasher;
+//     hasher.add(uid);
+//     hasher.addBytes(name.data(), name.size());
+//     uint64_t hash = hasher.hash();
+// Its values may differ across devices and releases, so unlike Hash32 and Hash64 they must not be
+// persisted or reported.
+class StreamingHash64 {
+public:
+    explicit StreamingHash64(uint64_t seed = 0x9E3779B97F4A7C15) : mState(seed) {
+    }
+
+    inline void add(uint64_t word) {
+        // Feeding the state back keeps it when the product is 0, i.e. when word is kSecret1.
+        mState ^= mix(mState ^ kSecret0, word ^ kSecret1);
+        mWordCount++;
+    }
+
+    void addBytes(const char* data, size_t n);
+
+    inline uint64_t hash() const {
+        return mix(mState ^ kSecret2, mWordCount ^ kSecret3);
+    }
+
+private:
+    static constexpr uint64_t kSecret0 = 0xA0761D6478BD642F;
+    static constexpr uint64_t kSecret1 = 0xE7037ED1A0B428DB;
+    static constexpr uint64_t kSecret2 = 0x8EBC6AF09C88C6E3;
+    static constexpr uint64_t kSecret3 = 0x589965CC75374CC3;
+
+    // Folds the 128 bit product of a and b.
+    static inline uint64_t mix(uint64_t a, uint64_t b) {
+        const __uint128_t product = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    uint64_t mState;
+    uint64_t mWordCount = 0;
+};
+
+// StreamingHash64 of a byte string.
+inline uint64_t FastHash64(const char* data, size_t n) {
+    StreamingHash64 hasher;
+    hasher.addBytes(data, n);
+    return hasher.hash();
+}
+
+inline uint64_t FastHash64(const std::string& str) {
+    return FastHash64(str.data(), str.size());
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -23,10 +23,14 @@
 #include <android/binder_ibinder.h>
 #include <private/android_filesystem_config.h>
 
+#include <array>
+#include <atomic>
+
 #include "flags/FlagProvider.h"
 #include "stats_annotations.h"
 #include "stats_log_util.h"
 #include "statslog_statsd.h"
+#include "utils/StatsdTrace.h"
 
 namespace android {
 namespace os {
@@ -51,6 +55,37 @@ uint8_t getNumAnnotations(uint8_t typeInfo) {
     return (typeInfo >> 4) & 0x0F;  // num annotations in upper 4 bytes
 }
 
+// Remembers how many FieldValues the last valid event of an atom decoded into. Attribution chains
+// and repeated fields make the top-level element count an underestimate, so the next event of the
+// same atom reserves from this instead. Entries are direct-mapped by atom id and pack the atom id
+// with the count, so a collision or a race between parsing threads only costs an imprecise hint.
+class ValueCountCache {
+public:
+    size_t get(int32_t atomId) const {
+        const uint64_t entry = mEntries[slot(atomId)].load(std::memory_order_relaxed);
+        return (entry >> 32) == (uint32_t)atomId ? (size_t)(uint32_t)entry : 0;
+    }
+
+    void put(int32_t atomId, size_t count) {
+        const uint64_t entry = ((uint64_t)(uint32_t)atomId << 32) | (uint32_t)count;
+        mEntries[slot(atomId)].store(entry, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kNumSlots = 1024;
+
+    static size_t slot(int32_t atomId) {
+        return (uint32_t)atomId % kNumSlots;
+    }
+
+    std::array<std::atomic<uint64_t>, kNumSlots> mEntries{};
+};
+
+ValueCountCache& getValueCountCache() {
+    static ValueCountCache cache;
+    return cache;
+}
+
 }  // namespace
 
 LogEvent::LogEvent(int32_t uid, int32_t pid)
@@ -111,7 +146,8 @@ void LogEvent::parseString(int32_t* pos, int32_t depth, bool* last, uint8_t numA
         return;
     }
 
-    string value = string((char*)mBuf, numBytes);
+    // Intern straight from the buffer so repeated strings don't allocate.
+    InternedString value(std::string_view((char*)mBuf, numBytes));
     mBuf += numBytes;
     mRemainingLen -= numBytes;
     addToValues(pos, depth, value, last);
@@ -145,6 +181,22 @@ void LogEvent::parseByteArray(int32_t* pos, int32_t depth, bool* last, uint8_t n
     parseAnnotations(numAnnotations);
 }
 
+bool LogEvent::isFieldProjectedOut(int32_t pos, uint8_t numAnnotations) const {
+    // Annotations apply to the value before them, so annotated fields are always decoded.
+    return numAnnotations == 0 && pos < 64 && (mFieldMask & (uint64_t(1) << pos)) == 0;
+}
+
+void LogEvent::skipLengthPrefixedValue() {
+    int32_t numBytes = readNextValue<int32_t>();
+    if ((uint32_t)numBytes > mRemainingLen) {
+        mValid = false;
+        return;
+    }
+
+    mBuf += numBytes;
+    mRemainingLen -= numBytes;
+}
+
 void LogEvent::parseKeyValuePairs(int32_t* pos, int32_t depth, bool* last, uint8_t numAnnotations) {
     int32_t numPairs = readNextValue<uint8_t>();
 
@@ -231,32 +283,32 @@ void LogEvent::parseArray(int32_t* pos, int32_t depth, bool* last, uint8_t numAn
 
     if (numElements > INT8_MAX) mValid = false;
 
-    for (pos[1] = 1; pos[1] <= numElements; pos[1]++) {
-        last[1] = (pos[1] == numElements);
-
-        // The top-level array is at depth 0, and all of its elements are at depth 1.
-        // Once nested fields are supported, array elements will be at top-level depth + 1.
-
-        switch (typeId) {
-            case INT32_TYPE:
-                parseInt32(pos, /*depth=*/1, last, /*numAnnotations=*/0);
-                break;
-            case INT64_TYPE:
-                parseInt64(pos, /*depth=*/1, last, /*numAnnotations=*/0);
-                break;
-            case FLOAT_TYPE:
-                parseFloat(pos, /*depth=*/1, last, /*numAnnotations=*/0);
-                break;
-            case BOOL_TYPE:
-                parseBool(pos, /*depth=*/1, last, /*numAnnotations=*/0);
-                break;
-            case STRING_TYPE:
+    // The top-level array is at depth 0, and all of its elements are at depth 1.
+    // Once nested fields are supported, array elements will be at top-level depth + 1.
+    // Elements carry no per-element type byte, so fixed-width types decode as one run.
+    switch (typeId) {
+        case INT32_TYPE:
+            parseFixedWidthArrayElements<int32_t>(pos, last, numElements);
+            break;
+        case INT64_TYPE:
+            parseFixedWidthArrayElements<int64_t>(pos, last, numElements);
+            break;
+        case FLOAT_TYPE:
+            parseFixedWidthArrayElements<float>(pos, last, numElements);
+            break;
+        case BOOL_TYPE:
+            // cast to int32_t because FieldValue does not support bools
+            parseFixedWidthArrayElements<uint8_t, int32_t>(pos, last, numElements);
+            break;
+        case STRING_TYPE:
+            for (pos[1] = 1; pos[1] <= numElements; pos[1]++) {
+                last[1] = (pos[1] == numElements);
                 parseString(pos, /*depth=*/1, last, /*numAnnotations=*/0);
-                break;
-            default:
-                mValid = false;
-                break;
-        }
+            }
+            break;
+        default:
+            if (numElements > 0) mValid = false;
+            break;
     }
 
     parseAnnotations(numAnnotations, numElements);
@@ -543,10 +595,11 @@ bool LogEvent::parseBody(const BodyBufferInfo& bodyInfo) {
     int32_t pos[] = {1, 1, 1};
     bool last[] = {false, false, false};
 
-    // While this number is not guaranteed to be correct due to repeated fields and
-    // attribution chains, it still positively affects performance and reduces the number
-    // of vector buffer reallocations.
-    mValues.reserve(bodyInfo.numElements);
+    // The element count is not guaranteed to be correct due to repeated fields and
+    // attribution chains, so prefer the number of values the previous event of this atom
+    // decoded into. Either way this reduces the number of vector buffer reallocations.
+    ValueCountCache& valueCountCache = getValueCountCache();
+    mValues.reserve(std::max<size_t>(bodyInfo.numElements, valueCountCache.get(mTagId)));
 
     for (pos[0] = 1; pos[0] <= bodyInfo.numElements && mValid; pos[0]++) {
         last[0] = (pos[0] == bodyInfo.numElements);
@@ -568,10 +621,18 @@ bool LogEvent::parseBody(const BodyBufferInfo& bodyInfo) {
                 parseFloat(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
                 break;
             case BYTE_ARRAY_TYPE:
-                parseByteArray(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
+                if (isFieldProjectedOut(pos[0], getNumAnnotations(typeInfo))) {
+                    skipLengthPrefixedValue();
+                } else {
+                    parseByteArray(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
+                }
                 break;
             case STRING_TYPE:
-                parseString(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
+                if (isFieldProjectedOut(pos[0], getNumAnnotations(typeInfo))) {
+                    skipLengthPrefixedValue();
+                } else {
+                    parseString(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
+                }
                 break;
             case KEY_VALUE_PAIRS_TYPE:
                 parseKeyValuePairs(pos, /*depth=*/0, last, getNumAnnotations(typeInfo));
@@ -594,9 +655,68 @@ bool LogEvent::parseBody(const BodyBufferInfo& bodyInfo) {
 
     if (mRemainingLen != 0) mValid = false;
     mBuf = nullptr;
+    if (mValid) {
+        valueCountCache.put(mTagId, mValues.size());
+    }
     return mValid;
 }
 
+void LogEvent::reset(int32_t uid, int32_t pid) {
+    std::vector<FieldValue> values = std::move(mValues);
+    std::vector<uint8_t> deferredBody = std::move(mDeferredBody);
+    std::vector<uint64_t> valueHashes = std::move(mValueHashes);
+    *this = LogEvent(uid, pid);
+    values.clear();
+    deferredBody.clear();
+    valueHashes.clear();
+    mValues = std::move(values);
+    mDeferredBody = std::move(deferredBody);
+    mValueHashes = std::move(valueHashes);
+}
+
+void LogEvent::computeValueHashes() const {
+    mValueHashes.clear();
+    mValueHashes.reserve(mValues.size());
+    for (const FieldValue& fieldValue : mValues) {
+        mValueHashes.push_back(hashValue(fieldValue.mValue));
+    }
+}
+
+void LogEvent::deferBody(const BodyBufferInfo& bodyInfo) {
+    mParsedHeaderOnly = false;
+    mDeferredBody.assign(bodyInfo.buffer, bodyInfo.buffer + bodyInfo.bufferSize);
+    mDeferredNumElements = bodyInfo.numElements;
+    mHasDeferredBody = true;
+}
+
+void LogEvent::materializeDeferredBody() {
+    STATSD_TRACE("LogEvent::parseBody atom=%d", mTagId);
+    mHasDeferredBody = false;
+    BodyBufferInfo bodyInfo;
+    bodyInfo.buffer = mDeferredBody.data();
+    bodyInfo.bufferSize = mDeferredBody.size();
+    bodyInfo.numElements = mDeferredNumElements;
+    const int64_t parseStartNs = isLatencyTraced() ? getElapsedRealtimeNs() : 0;
+    parseBody(bodyInfo);
+    if (isLatencyTraced()) {
+        mParseLatencyNs = getElapsedRealtimeNs() - parseStartNs;
+    }
+}
+
+void LogEvent::widenFieldMask(uint64_t fieldMask) {
+    if ((mFieldMask | fieldMask) == mFieldMask) {
+        return;
+    }
+    mFieldMask |= fieldMask;
+    if (mHasDeferredBody || mDeferredBody.empty() || !mValid) {
+        return;
+    }
+    // The values are decoded again, and the annotations of the body set what they set before.
+    mValues.clear();
+    mValueHashes.clear();
+    mHasDeferredBody = true;
+}
+
 // This parsing logic is tied to the encoding scheme used in StatsEvent.java and
 // stats_event.c
 bool LogEvent::parseBuffer(const uint8_t* buf, size_t len) {
@@ -616,6 +736,7 @@ bool LogEvent::parseBuffer(const uint8_t* buf, size_t len) {
 }
 
 int64_t LogEvent::GetLong(size_t key, status_t* err) const {
+    parseDeferredBody();
     // TODO(b/110561208): encapsulate the magical operations in Field struct as static functions
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
@@ -639,6 +760,7 @@ int64_t LogEvent::GetLong(size_t key, status_t* err) const {
 }
 
 int LogEvent::GetInt(size_t key, status_t* err) const {
+    parseDeferredBody();
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
         if (value.mField.getField() == field) {
@@ -659,6 +781,7 @@ int LogEvent::GetInt(size_t key, status_t* err) const {
 }
 
 const char* LogEvent::GetString(size_t key, status_t* err) const {
+    parseDeferredBody();
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
         if (value.mField.getField() == field) {
@@ -679,6 +802,7 @@ const char* LogEvent::GetString(size_t key, status_t* err) const {
 }
 
 bool LogEvent::GetBool(size_t key, status_t* err) const {
+    parseDeferredBody();
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
         if (value.mField.getField() == field) {
@@ -701,6 +825,7 @@ bool LogEvent::GetBool(size_t key, status_t* err) const {
 }
 
 float LogEvent::GetFloat(size_t key, status_t* err) const {
+    parseDeferredBody();
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
         if (value.mField.getField() == field) {
@@ -721,6 +846,7 @@ float LogEvent::GetFloat(size_t key, status_t* err) const {
 }
 
 std::vector<uint8_t> LogEvent::GetStorage(size_t key, status_t* err) const {
+    parseDeferredBody();
     int field = getSimpleField(key);
     for (const auto& value : mValues) {
         if (value.mField.getField() == field) {
@@ -741,6 +867,7 @@ std::vector<uint8_t> LogEvent::GetStorage(size_t key, status_t* err) const {
 }
 
 string LogEvent::ToString() const {
+    parseDeferredBody();
     string result;
     result += StringPrintf("{ uid(%d) %lld %lld (%d)", mLogUid, (long long)mLogdTimestampNs,
                            (long long)mElapsedTimestampNs, mTagId);
@@ -773,6 +900,7 @@ void LogEvent::ToProto(ProtoOutputStream& protoOutput) const {
 }
 
 bool LogEvent::hasAttributionChain(std::pair<size_t, size_t>* indexRange) const {
+    parseDeferredBody();
     if (!mAttributionChainStartIndex || !mAttributionChainEndIndex) {
         return false;
     }
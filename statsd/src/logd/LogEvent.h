@@ -70,6 +70,20 @@ struct InstallTrainInfo {
     bool requiresLowLatencyMonitor;
 };
 
+/**
+ * How important it is to keep an event when the LogEventQueue fills up, see LogEventQueue.
+ */
+enum EventPriority : uint8_t {
+    // Atoms that no consumer uses, which are only counted.
+    EVENT_PRIORITY_LOW = 0,
+    // Atoms used by metrics.
+    EVENT_PRIORITY_NORMAL = 1,
+    // Atoms the processor itself handles, e.g. binary pushes and isolated uid changes, and atoms
+    // that configs track the state of. Losing one of them corrupts later results too.
+    EVENT_PRIORITY_CRITICAL = 2,
+    EVENT_PRIORITY_COUNT = 3,
+};
+
 /**
  * This class decodes the structured, serialized encoding of an atom into a
  * vector of FieldValues.
@@ -82,6 +96,12 @@ public:
      */
     explicit LogEvent(int32_t uid, int32_t pid);
 
+    /**
+     * Puts the event back in the state of LogEvent(uid, pid), but keeps the capacity of its
+     * buffers, see LogEventPool.
+     */
+    void reset(int32_t uid, int32_t pid);
+
     /**
      * Parses the atomId, timestamp, and vector of values from a buffer
      * containing the StatsEvent/AStatsEvent encoding of an atom.
@@ -115,6 +135,77 @@ public:
      */
     bool parseBody(const BodyBufferInfo& bodyInfo);
 
+    /**
+     * @brief Like parseBody(), but only copies the body out of bodyInfo.buffer. The copy is
+     * parsed on the first access to anything derived from it, i.e. everything but the header
+     * fields, so that the socket thread does not pay for the parsing.
+     * Should be called only with BodyBufferInfo if when logEvent.isValid() == true
+     */
+    void deferBody(const BodyBufferInfo& bodyInfo);
+
+    /**
+     * @brief Sets the top-level fields parseBody() decodes the values of, see FieldMask in
+     * socket/LogEventFilter.h. String and byte array fields outside of the mask are only
+     * checked for their length. Fields with annotations are always decoded.
+     */
+    inline void setFieldMask(uint64_t fieldMask) {
+        mFieldMask = fieldMask;
+    }
+
+    /**
+     * @brief Adds fields to the ones parseBody() decodes the values of. A body copied by
+     * deferBody() that was already parsed without some of them is parsed again on the next
+     * access.
+     */
+    void widenFieldMask(uint64_t fieldMask);
+
+    inline uint64_t getFieldMask() const {
+        return mFieldMask;
+    }
+
+    /**
+     * @brief Marks the event as sampled for latency tracing, see
+     * StatsdStats::shouldTraceLatency(). startNs is the elapsed realtime the event was read
+     * from the socket at.
+     */
+    inline void setLatencyTraceStartNs(int64_t startNs) {
+        mLatencyTraceStartNs = startNs;
+    }
+
+    inline bool isLatencyTraced() const {
+        return mLatencyTraceStartNs != 0;
+    }
+
+    inline int64_t getLatencyTraceStartNs() const {
+        return mLatencyTraceStartNs;
+    }
+
+    /**
+     * @brief Sets the elapsed realtime the event was pushed to the LogEventQueue at, see
+     * LogEventQueue::push().
+     */
+    inline void setEnqueueTimestampNs(int64_t timestampNs) {
+        mEnqueueTimestampNs = timestampNs;
+    }
+
+    // 0 if the event did not go through the LogEventQueue.
+    inline int64_t getEnqueueTimestampNs() const {
+        return mEnqueueTimestampNs;
+    }
+
+    inline void setPriority(EventPriority priority) {
+        mPriority = priority;
+    }
+
+    inline EventPriority getPriority() const {
+        return mPriority;
+    }
+
+    // Time spent parsing the deferred body of a latency traced event, 0 if it was not deferred.
+    inline int64_t getParseLatencyNs() const {
+        return mParseLatencyNs;
+    }
+
     // Constructs a BinaryPushStateChanged LogEvent from API call.
     explicit LogEvent(const std::string& trainName, int64_t trainVersionCode, bool requiresStaging,
                       bool rollbackEnabled, bool requiresLowLatencyMonitor, int32_t state,
@@ -154,6 +245,7 @@ public:
      * Returns BAD_INDEX if the index is larger than the number of elements.
      * Returns BAD_TYPE if the index is available but the data is the wrong type.
      */
+    // The getters below parse a deferred body first, see deferBody().
     int64_t GetLong(size_t key, status_t* err) const;
     int GetInt(size_t key, status_t* err) const;
     const char* GetString(size_t key, status_t* err) const;
@@ -185,24 +277,47 @@ public:
         mLogdTimestampNs = timestampNs;
     }
 
+    // Parses the body copied by deferBody() now rather than on first access, so that the cost
+    // can be paid on another thread. Keeps the same event from being touched concurrently.
+    inline void parseDeferredBodyNow() const {
+        parseDeferredBody();
+    }
+
     inline int size() const {
+        parseDeferredBody();
         return mValues.size();
     }
 
     const std::vector<FieldValue>& getValues() const {
+        parseDeferredBody();
         return mValues;
     }
 
     std::vector<FieldValue>* getMutableValues() {
+        parseDeferredBody();
+        mValueHashes.clear();
         return &mValues;
     }
 
+    // hashValue() of each of getValues(), computed on first use so that the metrics slicing
+    // this event hash its fields only once between them. The first call is not thread safe: make
+    // it before sharing the event between threads.
+    const std::vector<uint64_t>& getValueHashes() const {
+        parseDeferredBody();
+        if (mValueHashes.size() != mValues.size()) {
+            computeValueHashes();
+        }
+        return mValueHashes;
+    }
+
     // Default value = false
     inline bool shouldTruncateTimestamp() const {
+        parseDeferredBody();
         return mTruncateTimestamp;
     }
 
     inline uint8_t getNumUidFields() const {
+        parseDeferredBody();
         return mNumUidFields;
     }
 
@@ -222,22 +337,26 @@ public:
     //    }
     // Note that atomIndex is 1-indexed.
     inline std::optional<size_t> getExclusiveStateFieldIndex() const {
+        parseDeferredBody();
         return mExclusiveStateFieldIndex;
     }
 
     // If a reset state is not sent in the StatsEvent, returns -1. Note that a
     // reset state is sent if and only if a reset should be triggered.
     inline int getResetState() const {
+        parseDeferredBody();
         return mResetState;
     }
 
     template <class T>
     status_t updateValue(size_t key, T& value, Type type) {
+        parseDeferredBody();
         int field = getSimpleField(key);
         for (auto& fieldValue : mValues) {
             if (fieldValue.mField.getField() == field) {
                 if (fieldValue.mValue.getType() == type) {
                     fieldValue.mValue = Value(value);
+                    mValueHashes.clear();
                    return OK;
                } else {
                    return BAD_TYPE;
@@ -248,6 +367,7 @@ public:
     }
 
     bool isValid() const {
+        parseDeferredBody();
         return mValid;
     }
 
@@ -264,10 +384,12 @@ public:
     LogEvent(const LogEvent&) = default;
 
     inline StatsdRestrictionCategory getRestrictionCategory() const {
+        parseDeferredBody();
         return mRestrictionCategory;
     }
 
     inline bool isRestricted() const {
+        parseDeferredBody();
         return mRestrictionCategory != CATEGORY_NO_RESTRICTION;
     }
 
@@ -281,6 +403,8 @@ private:
     void parseKeyValuePairs(int32_t* pos, int32_t depth, bool* last, uint8_t numAnnotations);
     void parseAttributionChain(int32_t* pos, int32_t depth, bool* last, uint8_t numAnnotations);
     void parseArray(int32_t* pos, int32_t depth, bool* last, uint8_t numAnnotations);
+    bool isFieldProjectedOut(int32_t pos, uint8_t numAnnotations) const;
+    void skipLengthPrefixedValue();
 
     void parseAnnotations(uint8_t numAnnotations, std::optional<uint8_t> numElements = std::nullopt,
                           std::optional<size_t> firstUidInChainIndex = std::nullopt);
@@ -299,6 +423,18 @@ private:
     bool checkPreviousValueType(Type expected);
     bool getRestrictedMetricsFlag();
 
+    // Parses the body copied by deferBody(), if it has not been parsed yet. The parsed body is
+    // what the event held all along as far as the callers can tell, hence const.
+    inline void parseDeferredBody() const {
+        if (mHasDeferredBody) {
+            const_cast<LogEvent*>(this)->materializeDeferredBody();
+        }
+    }
+
+    void materializeDeferredBody();
+
+    void computeValueHashes() const;
+
     /**
      * The below two variables are only valid during the execution of
      * parseBuffer. There are no guarantees about the state of these variables
@@ -311,6 +447,24 @@ private:
 
     bool mParsedHeaderOnly = false;  // stores whether the only header was parsed skipping the body
 
+    // Whether the body copied by deferBody() is not parsed yet. The copy is kept once parsed,
+    // see widenFieldMask().
+    bool mHasDeferredBody = false;
+    uint8_t mDeferredNumElements = 0;
+    std::vector<uint8_t> mDeferredBody;
+
+    // Top-level fields that parseBody() decodes, see setFieldMask().
+    uint64_t mFieldMask = ~uint64_t(0);
+
+    // 0 if the event is not latency traced, see setLatencyTraceStartNs().
+    int64_t mLatencyTraceStartNs = 0;
+
+    int64_t mEnqueueTimestampNs = 0;
+
+    EventPriority mPriority = EVENT_PRIORITY_NORMAL;
+
+    int64_t mParseLatencyNs = 0;
+
     /**
      * Side-effects:
      *    If there is enough space in buffer to read value of type T
@@ -351,10 +505,33 @@ private:
         mValues.push_back(FieldValue(f, v));
     }
 
+    // Decodes a run of numElements packed array elements of wire type T, stored as V, with a
+    // single bounds check for the whole run instead of one per element.
+    template <class T, class V = T>
+    void parseFixedWidthArrayElements(int32_t* pos, bool* last, uint8_t numElements) {
+        const uint32_t runLen = (uint32_t)numElements * sizeof(T);
+        if (mRemainingLen < runLen) {
+            mValid = false;
+            return;
+        }
+        for (pos[1] = 1; pos[1] <= numElements; pos[1]++) {
+            last[1] = (pos[1] == numElements);
+            T value;
+            memcpy(&value, mBuf, sizeof(T));
+            mBuf += sizeof(T);
+            V storedValue = value;
+            addToValues(pos, /*depth=*/1, storedValue, last);
+        }
+        mRemainingLen -= runLen;
+    }
+
     // The items are naturally sorted in DFS order as we read them. this allows us to do fast
     // matching.
     std::vector<FieldValue> mValues;
 
+    // See getValueHashes(). Empty until first used.
+    mutable std::vector<uint64_t> mValueHashes;
+
     // The timestamp set by the logd.
     int64_t mLogdTimestampNs;
 
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LogEventPool.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::unique_ptr;
+using std::vector;
+
+LogEventPool& LogEventPool::getInstance() {
+    static LogEventPool sLogEventPool;
+    return sLogEventPool;
+}
+
+unique_ptr<LogEvent> LogEventPool::obtain(int32_t uid, int32_t pid) {
+    unique_ptr<LogEvent> event;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mEvents.empty()) {
+            event = std::move(mEvents.back());
+            mEvents.pop_back();
+        }
+    }
+    if (event == nullptr) {
+        return std::make_unique<LogEvent>(uid, pid);
+    }
+    event->reset(uid, pid);
+    return event;
+}
+
+void LogEventPool::recycle(vector<unique_ptr<LogEvent>>& events) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (unique_ptr<LogEvent>& event : events) {
+            if (mEvents.size() >= kMaxPooledEvents) {
+                break;
+            }
+            if (event != nullptr) {
+                mEvents.push_back(std::move(event));
+            }
+        }
+    }
+    // Frees the events that did not fit, outside of the lock.
+    events.clear();
+}
+
+size_t LogEventPool::size() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEvents.size();
+}
+
+void LogEventPool::clear() {
+    vector<unique_ptr<LogEvent>> events;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        events.swap(mEvents);
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "LogEvent.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Recycles the LogEvents of pushed atoms, so that the socket listener does not allocate an event
+ * for every datagram and the events keep the capacity of their buffers across uses.
+ *
+ * Thread safe: events are obtained by the socket listener thread and recycled by the log reader
+ * thread once the whole batch was processed.
+ */
+class LogEventPool {
+public:
+    static LogEventPool& getInstance();
+
+    // Returns an event for the given logging caller, in the state of a newly constructed one.
+    std::unique_ptr<LogEvent> obtain(int32_t uid, int32_t pid);
+
+    // Takes back events that nothing refers to anymore, and clears events. Events beyond
+    // kMaxPooledEvents are freed.
+    void recycle(std::vector<std::unique_ptr<LogEvent>>& events);
+
+    size_t size() const;
+
+    // Frees all the pooled events.
+    void clear();
+
+    // A few batches of the log reader thread, see StatsService::kMaxLogEventsBatchSize.
+    static constexpr size_t kMaxPooledEvents = 256;
+
+private:
+    LogEventPool() = default;
+
+    mutable std::mutex mMutex;
+
+    std::vector<std::unique_ptr<LogEvent>> mEvents;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
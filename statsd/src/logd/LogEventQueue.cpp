@@ -19,45 +19,222 @@
 
 #include "LogEventQueue.h"
 
+#include <algorithm>
+
+#include "stats_log_util.h"
+
 namespace android {
 namespace os {
 namespace statsd {
 
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
+
+LogEventQueue::LogEventQueue(size_t maxSize)
+    // The ring needs at least two slots to tell a free slot from a full one.
+    : mQueueLimit(maxSize > 1 ? maxSize : 2),
+      mSlots(mQueueLimit),
+      mEnqueuePos(0),
+      mDequeuePos(0),
+      mConsumerParked(false) {
+    for (size_t i = 0; i < mQueueLimit; i++) {
+        mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        mSlots[i].timestampNs.store(0, std::memory_order_relaxed);
+    }
+    mPriorityLimits[EVENT_PRIORITY_LOW] = std::max<size_t>(1, mQueueLimit / 2);
+    mPriorityLimits[EVENT_PRIORITY_NORMAL] = std::max<size_t>(1, mQueueLimit - mQueueLimit / 10);
+    mPriorityLimits[EVENT_PRIORITY_CRITICAL] = mQueueLimit;
+}
 
 unique_ptr<LogEvent> LogEventQueue::waitPop() {
-    std::unique_lock<std::mutex> lock(mMutex);
+    // Only the consumer thread advances mDequeuePos.
+    const size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    Slot& slot = mSlots[pos % mQueueLimit];
 
-    if (mQueue.empty()) {
-        mCondition.wait(lock, [this] { return !this->mQueue.empty(); });
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        waitForSlot(slot, pos);
     }
 
-    unique_ptr<LogEvent> item = std::move(mQueue.front());
-    mQueue.pop();
+    unique_ptr<LogEvent> item = std::move(slot.event);
+    // Hand the slot back to producers for the next lap of the ring.
+    slot.sequence.store(pos + mQueueLimit, std::memory_order_release);
+    mDequeuePos.store(pos + 1, std::memory_order_release);
 
     return item;
 }
 
+void LogEventQueue::waitPopBatch(vector<unique_ptr<LogEvent>>& events, size_t maxCount) {
+    if (maxCount == 0) {
+        return;
+    }
+
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    Slot* slot = &mSlots[pos % mQueueLimit];
+    if (slot->sequence.load(std::memory_order_acquire) != pos + 1) {
+        waitForSlot(*slot, pos);
+    }
+
+    size_t count = 0;
+    do {
+        events.push_back(std::move(slot->event));
+        slot->sequence.store(pos + mQueueLimit, std::memory_order_release);
+        pos++;
+        count++;
+        slot = &mSlots[pos % mQueueLimit];
+    } while (count < maxCount && slot->sequence.load(std::memory_order_acquire) == pos + 1);
+
+    mDequeuePos.store(pos, std::memory_order_release);
+}
+
+void LogEventQueue::waitForSlot(Slot& slot, size_t pos) {
+    const auto isReady = [&slot, pos] {
+        return slot.sequence.load(std::memory_order_acquire) == pos + 1;
+    };
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mConsumerParked.store(true, std::memory_order_relaxed);
+    // Pairs with the fence in notifyConsumerIfParked(): either the producer observes the
+    // parked flag, or this thread observes the published slot.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    mCondition.wait(lock, isReady);
+    mConsumerParked.store(false, std::memory_order_relaxed);
+}
+
 LogEventQueue::Result LogEventQueue::push(unique_ptr<LogEvent> item) {
     Result result;
-    {
-        std::unique_lock<std::mutex> lock(mMutex);
-        if (mQueue.size() < mQueueLimit) {
-            mQueue.push(std::move(item));
-            result.success = true;
-        } else {
-            // safe operation as queue must not be empty.
-            result.oldestTimestampNs = mQueue.front()->GetElapsedTimestampNs();
+
+    const size_t priorityLimit = mPriorityLimits[item->getPriority()];
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &mSlots[pos % mQueueLimit];
+        const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (priorityLimit < mQueueLimit &&
+                pos >= mDequeuePos.load(std::memory_order_acquire) + priorityLimit) {
+                // The rest of the queue is kept for events of higher priority.
+                result.oldestTimestampNs = oldestTimestampNs();
+                result.success = false;
+                result.size = size();
+                return result;
+            }
+            if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The slot still holds an event from the previous lap: the queue is full. That
+            // event is the oldest one in the queue.
+            result.oldestTimestampNs = slot->timestampNs.load(std::memory_order_relaxed);
             result.success = false;
+            result.size = size();
+            return result;
+        } else {
+            // Another producer claimed this position, retry with the latest one.
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
         }
-        result.size = mQueue.size();
     }
 
-    mCondition.notify_one();
+    slot->timestampNs.store(item->GetElapsedTimestampNs(), std::memory_order_relaxed);
+    item->setEnqueueTimestampNs(getElapsedRealtimeNs());
+    slot->event = std::move(item);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    result.success = true;
+    result.size = pos + 1 - mDequeuePos.load(std::memory_order_acquire);
+
+    notifyConsumerIfParked();
     return result;
 }
 
+LogEventQueue::BatchResult LogEventQueue::pushBatch(vector<unique_ptr<LogEvent>>& events) {
+    BatchResult result;
+    if (events.empty()) {
+        result.size = size();
+        return result;
+    }
+
+    const size_t admittedCount = admitByPriority(events);
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    size_t count;
+    while (true) {
+        const size_t dequeuePos = mDequeuePos.load(std::memory_order_acquire);
+        const size_t used = pos > dequeuePos ? pos - dequeuePos : 0;
+        count = std::min(admittedCount, used < mQueueLimit ? mQueueLimit - used : 0);
+        if (count == 0) {
+            result.oldestTimestampNs = oldestTimestampNs();
+            result.size = used;
+            return result;
+        }
+        // Slots are released by the consumer in order, so the whole range is free when the
+        // last slot of the range is.
+        const size_t last = pos + count - 1;
+        if (mSlots[last % mQueueLimit].sequence.load(std::memory_order_acquire) == last &&
+            mEnqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+            break;
+        }
+        pos = mEnqueuePos.load(std::memory_order_relaxed);
+    }
+
+    // The events of a batch are read from the socket together, so they share the enqueue time.
+    const int64_t enqueueTimestampNs = getElapsedRealtimeNs();
+    for (size_t i = 0; i < count; i++) {
+        Slot& slot = mSlots[(pos + i) % mQueueLimit];
+        result.lastTimestampNs = events[i]->GetElapsedTimestampNs();
+        slot.timestampNs.store(result.lastTimestampNs, std::memory_order_relaxed);
+        events[i]->setEnqueueTimestampNs(enqueueTimestampNs);
+        slot.event = std::move(events[i]);
+        slot.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+
+    result.pushedCount = count;
+    result.size = pos + count - mDequeuePos.load(std::memory_order_acquire);
+    if (count < events.size()) {
+        result.oldestTimestampNs = oldestTimestampNs();
+    }
+
+    notifyConsumerIfParked();
+    return result;
+}
+
+size_t LogEventQueue::admitByPriority(vector<unique_ptr<LogEvent>>& events) const {
+    const size_t used = size();
+    if (used + events.size() <= mPriorityLimits[EVENT_PRIORITY_LOW]) {
+        // Every event fits under the lowest limit.
+        return events.size();
+    }
+    size_t admitted = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (used + admitted < mPriorityLimits[events[i]->getPriority()]) {
+            std::swap(events[admitted], events[i]);
+            admitted++;
+        }
+    }
+    return admitted;
+}
+
+size_t LogEventQueue::size() const {
+    const size_t dequeuePos = mDequeuePos.load(std::memory_order_acquire);
+    const size_t enqueuePos = mEnqueuePos.load(std::memory_order_acquire);
+    return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+}
+
+int64_t LogEventQueue::oldestTimestampNs() const {
+    const size_t dequeuePos = mDequeuePos.load(std::memory_order_acquire);
+    return mSlots[dequeuePos % mQueueLimit].timestampNs.load(std::memory_order_relaxed);
+}
+
+void LogEventQueue::notifyConsumerIfParked() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mConsumerParked.load(std::memory_order_relaxed)) {
+        // Taking the lock guarantees the consumer is either before its predicate check, or
+        // already waiting on the condition variable.
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCondition.notify_one();
+    }
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
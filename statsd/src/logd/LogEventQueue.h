@@ -18,9 +18,10 @@
 
 #include <gtest/gtest_prod.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <vector>
 
 #include "LogEvent.h"
 
@@ -30,16 +31,29 @@ namespace statsd {
 
 /**
  * A zero copy thread safe queue buffer for producing and consuming LogEvent.
+ *
+ * The queue is a bounded, pre-allocated ring which supports multiple producers (the socket
+ * listener thread and binder threads) and a single consumer (the log reader thread). Producers
+ * and the consumer never contend on a lock; the mutex and condition variable are only touched
+ * when the consumer has drained the ring and is parked waiting for new events.
  */
 class LogEventQueue {
 public:
-    explicit LogEventQueue(size_t maxSize) : mQueueLimit(maxSize){};
+    explicit LogEventQueue(size_t maxSize);
 
     /**
      * Blocking read one event from the queue.
+     * Must only be called from a single consumer thread.
      */
     std::unique_ptr<LogEvent> waitPop();
 
+    /**
+     * Blocking read of up to maxCount events from the queue. Blocks until at least one event
+     * is available, then appends every event already in the queue (up to maxCount) to events.
+     * Must only be called from a single consumer thread.
+     */
+    void waitPopBatch(std::vector<std::unique_ptr<LogEvent>>& events, size_t maxCount);
+
     struct Result {
         bool success = false;
         int64_t oldestTimestampNs = 0;
@@ -48,16 +62,79 @@ public:
 
     /**
      * Puts a LogEvent ptr to the end of the queue.
-     * Returns false on failure when the queue is full, and output the oldest event timestamp
-     * in the queue. Returns true on success and new queue size.
+     * Returns false on failure when the queue is full for the priority of the event, and output
+     * the oldest event timestamp in the queue. Returns true on success and new queue size.
      */
     Result push(std::unique_ptr<LogEvent> event);
 
+    struct BatchResult {
+        size_t pushedCount = 0;
+        int64_t oldestTimestampNs = 0;
+        int64_t lastTimestampNs = 0;
+        int32_t size = 0;
+    };
+
+    /**
+     * Puts the first events of the batch to the end of the queue with a single slot range
+     * reservation and wakes up the consumer at most once.
+     * Returns the number of events pushed, the timestamp of the last pushed event and the new
+     * queue size. When the queue can not fit
+     * the whole batch, the remaining events are left in place starting at index pushedCount,
+     * and the oldest event timestamp in the queue is output. Events of a priority the queue is
+     * full for are moved there too, so the pushed events may not be the first ones of the batch.
+     */
+    BatchResult pushBatch(std::vector<std::unique_ptr<LogEvent>>& events);
+
 private:
+    struct Slot {
+        // Ring position this slot is ready for. A producer may write the slot when
+        // sequence == pos, the consumer may read it when sequence == pos + 1.
+        std::atomic<size_t> sequence;
+        // Elapsed timestamp of the stored event, readable by producers reporting an overflow
+        // without touching the event itself.
+        std::atomic<int64_t> timestampNs;
+        std::unique_ptr<LogEvent> event;
+    };
+
+    /**
+     * Approximate number of events currently in the queue.
+     */
+    size_t size() const;
+
+    /**
+     * Moves the events of the batch the queue is full for to the back of the batch, keeping the
+     * order of the others. Returns the number of events left at the front.
+     */
+    size_t admitByPriority(std::vector<std::unique_ptr<LogEvent>>& events) const;
+
+    /**
+     * Timestamp of the event at the head of the queue.
+     */
+    int64_t oldestTimestampNs() const;
+
+    /**
+     * Wakes up the consumer if it is parked on mCondition.
+     */
+    void notifyConsumerIfParked();
+
+    /**
+     * Parks the consumer until the slot for ring position pos is published.
+     */
+    void waitForSlot(Slot& slot, size_t pos);
+
     const size_t mQueueLimit;
+    // The queue size up to which events of each EventPriority are admitted.
+    size_t mPriorityLimits[EVENT_PRIORITY_COUNT];
+    std::vector<Slot> mSlots;
+
+    // Next position to be claimed by a producer.
+    alignas(64) std::atomic<size_t> mEnqueuePos;
+    // Next position to be read by the consumer.
+    alignas(64) std::atomic<size_t> mDequeuePos;
+
+    alignas(64) std::atomic<bool> mConsumerParked;
     std::condition_variable mCondition;
     std::mutex mMutex;
-    std::queue<std::unique_ptr<LogEvent>> mQueue;
 
     friend class SocketParseMessageTest;
 
@@ -66,6 +143,7 @@ private:
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterCompleteSet);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterPartialSet);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterToggle);
+    FRIEND_TEST(StatsServiceTest, TestEventsQueuedBeforeStopAreProcessed);
 };
 
 }  // namespace statsd
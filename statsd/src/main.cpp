@@ -88,10 +88,13 @@ int main(int /*argc*/, char** /*argv*/) {
     ABinderProcess_startThreadPool();
 
     // Initialize boot flags
-    FlagProvider::getInstance().initBootFlags({STATSD_INIT_COMPLETED_NO_DELAY_FLAG});
+    FlagProvider::getInstance().initBootFlags(
+            {STATSD_INIT_COMPLETED_NO_DELAY_FLAG, METRICS_MANAGER_LANES_FLAG,
+             COMPRESSED_REPORTS_FLAG, PARSE_LANES_FLAG, SPILL_PAST_BUCKETS_FLAG,
+             SOCKET_UID_RATE_LIMIT_FLAG, SOCKET_UID_BURST_SIZE_FLAG});
 
     std::shared_ptr<LogEventQueue> eventQueue =
-            std::make_shared<LogEventQueue>(50000); /*buffer limit. Buffer is NOT pre-allocated*/
+            std::make_shared<LogEventQueue>(50000); /*buffer limit. Buffer is pre-allocated*/
 
     sp<UidMap> uidMap = UidMap::getInstance();
 
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "matchers/AtomMatcherIndex.h"
+
+#include <set>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::optional;
+using std::vector;
+
+namespace {
+
+bool hasStringTransformation(const FieldValueMatcher& matcher) {
+    if (matcher.has_replace_string()) {
+        return true;
+    }
+    if (matcher.value_matcher_case() == FieldValueMatcher::kMatchesTuple) {
+        for (const auto& subMatcher : matcher.matches_tuple().field_value_matcher()) {
+            if (hasStringTransformation(subMatcher)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool hasStringTransformation(const SimpleAtomMatcher& matcher) {
+    for (const auto& fieldValueMatcher : matcher.field_value_matcher()) {
+        if (hasStringTransformation(fieldValueMatcher)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether the matcher requires a single top level field to equal a constant.
+bool isEqualityMatcher(const FieldValueMatcher& matcher) {
+    return !matcher.has_position() &&
+           (matcher.value_matcher_case() == FieldValueMatcher::kEqInt ||
+            matcher.value_matcher_case() == FieldValueMatcher::kEqString);
+}
+
+void setResults(const vector<int>& matcherIndices, MatchingState state,
+                vector<MatchingState>& matcherResults) {
+    for (const int matcherIndex : matcherIndices) {
+        matcherResults[matcherIndex] = state;
+    }
+}
+
+template <typename Key, typename Map>
+void reopen(const Map& matchersByKey, const Key& key, vector<MatchingState>& matcherResults) {
+    const auto it = matchersByKey.find(key);
+    if (it != matchersByKey.end()) {
+        setResults(it->second, MatchingState::kNotComputed, matcherResults);
+    }
+}
+
+}  // anonymous namespace
+
+optional<AtomMatcherIndex> AtomMatcherIndex::create(
+        int atomId, const vector<int>& matcherIndices,
+        const vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers) {
+    vector<std::pair<int, const SimpleAtomMatcher*>> candidates;
+    std::unordered_map<int, size_t> matcherCountPerField;
+    for (const int matcherIndex : matcherIndices) {
+        const SimpleAtomMatcher* matcher =
+                allAtomMatchingTrackers[matcherIndex]->getSimpleAtomMatcher();
+        if (matcher == nullptr || matcher->atom_id() != atomId ||
+            hasStringTransformation(*matcher)) {
+            continue;
+        }
+        candidates.emplace_back(matcherIndex, matcher);
+        std::set<int> fields;
+        for (const auto& fieldValueMatcher : matcher->field_value_matcher()) {
+            if (isEqualityMatcher(fieldValueMatcher) &&
+                fields.insert(fieldValueMatcher.field()).second) {
+                matcherCountPerField[fieldValueMatcher.field()]++;
+            }
+        }
+    }
+
+    int field = 0;
+    size_t matcherCount = 0;
+    for (const auto& [candidateField, count] : matcherCountPerField) {
+        if (count > matcherCount || (count == matcherCount && candidateField < field)) {
+            field = candidateField;
+            matcherCount = count;
+        }
+    }
+    if (matcherCount < kMinIndexedMatchers) {
+        return std::nullopt;
+    }
+
+    AtomMatcherIndex index(field);
+    for (const auto& [matcherIndex, matcher] : candidates) {
+        for (const auto& fieldValueMatcher : matcher->field_value_matcher()) {
+            if (fieldValueMatcher.field() != field || !isEqualityMatcher(fieldValueMatcher)) {
+                continue;
+            }
+            if (fieldValueMatcher.value_matcher_case() == FieldValueMatcher::kEqInt) {
+                index.mIntMatchers[fieldValueMatcher.eq_int()].push_back(matcherIndex);
+            } else {
+                index.mStringMatchers[fieldValueMatcher.eq_string()].push_back(matcherIndex);
+                index.mStringKeyedMatchers.push_back(matcherIndex);
+            }
+            index.mIndexedMatchers.push_back(matcherIndex);
+            // Any further equality on the same field only narrows this matcher down more.
+            break;
+        }
+    }
+    return index;
+}
+
+void AtomMatcherIndex::prune(const LogEvent& event, vector<MatchingState>& matcherResults) const {
+    // The values are sorted by field, so the key field is found before any later one.
+    const FieldValue* keyValue = nullptr;
+    for (const FieldValue& fieldValue : event.getValues()) {
+        const int pos = fieldValue.mField.getPosAtDepth(0);
+        if (pos == mField) {
+            if (keyValue != nullptr) {
+                // A repeated field matches if any element does; leave it to the trackers.
+                return;
+            }
+            keyValue = &fieldValue;
+        } else if (pos > mField) {
+            break;
+        }
+    }
+
+    setResults(mIndexedMatchers, MatchingState::kNotMatched, matcherResults);
+    if (keyValue == nullptr) {
+        // Matchers on a missing field never match.
+        return;
+    }
+
+    const Value& value = keyValue->mValue;
+    switch (value.getType()) {
+        case INT:
+            reopen(mIntMatchers, (int64_t)value.int_value, matcherResults);
+            if (isUidField(*keyValue) || isAttributionUidField(*keyValue)) {
+                setResults(mStringKeyedMatchers, MatchingState::kNotComputed, matcherResults);
+            }
+            break;
+        case LONG:
+            reopen(mIntMatchers, value.long_value, matcherResults);
+            break;
+        case STRING:
+            reopen(mStringMatchers, value.str_value.str(), matcherResults);
+            break;
+        default:
+            // eq_int and eq_string match no other types.
+            break;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
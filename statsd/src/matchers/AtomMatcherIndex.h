@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "logd/LogEvent.h"
+#include "matchers/AtomMatchingTracker.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Index over the SimpleAtomMatchers of one atom that test the same top level field for equality,
+ * eg. dozens of AppStartOccurred matchers that differ only in eq_string on the package name.
+ *
+ * Each indexed matcher is keyed by the value its eq_int or eq_string requires of the field, so
+ * looking up the field value of an event gives the only indexed matchers that can match it; all
+ * other indexed matchers are known not to match without evaluating them.
+ */
+class AtomMatcherIndex {
+public:
+    // Below this many matchers sharing a field, evaluating them all is as cheap as the lookup.
+    static const size_t kMinIndexedMatchers = 4;
+
+    // Builds the index for atomId over the matchers at matcherIndices in allAtomMatchingTrackers,
+    // keyed on the field most of them test for equality. Matchers with string transformations
+    // are never indexed, since the value they test is not the value in the event. Returns
+    // nullopt if fewer than kMinIndexedMatchers matchers share a field.
+    static std::optional<AtomMatcherIndex> create(
+            int atomId, const std::vector<int>& matcherIndices,
+            const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers);
+
+    // Records kNotMatched in matcherResults for the indexed matchers that cannot match event. The
+    // remaining indexed matchers are left kNotComputed for their trackers to evaluate. Must be
+    // called before any of the indexed matchers is evaluated for event.
+    void prune(const LogEvent& event, std::vector<MatchingState>& matcherResults) const;
+
+    // The top level field the matchers are keyed on.
+    int getField() const {
+        return mField;
+    }
+
+    size_t getIndexedMatcherCount() const {
+        return mIndexedMatchers.size();
+    }
+
+private:
+    explicit AtomMatcherIndex(int field) : mField(field) {
+    }
+
+    int mField;
+
+    // Matcher indices, keyed by the eq_int value they require of mField.
+    std::unordered_map<int64_t, std::vector<int>> mIntMatchers;
+
+    // Matcher indices, keyed by the eq_string value they require of mField.
+    std::unordered_map<std::string, std::vector<int>> mStringMatchers;
+
+    // All matchers keyed by a string. They can't be pruned by value if mField is a uid, because
+    // eq_string then matches the package names of the uid.
+    std::vector<int> mStringKeyedMatchers;
+
+    std::vector<int> mIndexedMatchers;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
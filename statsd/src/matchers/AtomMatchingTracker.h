@@ -88,6 +88,22 @@ public:
         return mAtomIds;
     }
 
+    // Get the indices of the matchers that onLogEvent may evaluate on behalf of this matcher.
+    virtual const std::vector<int>& getChildren() const {
+        static const std::vector<int> kNoChildren;
+        return kNoChildren;
+    }
+
+    // The operation combining getChildren() if this is a combination matcher, nullopt otherwise.
+    virtual optional<LogicalOperation> getLogicalOperation() const {
+        return nullopt;
+    }
+
+    // The matcher proto if this is a simple matcher, nullptr otherwise.
+    virtual const SimpleAtomMatcher* getSimpleAtomMatcher() const {
+        return nullptr;
+    }
+
     int64_t getId() const {
         return mId;
     }
@@ -47,6 +47,14 @@ public:
                     std::vector<MatchingState>& matcherResults,
                     std::vector<std::shared_ptr<LogEvent>>& matcherTransformations) override;
 
+    const std::vector<int>& getChildren() const override {
+        return mChildren;
+    }
+
+    optional<LogicalOperation> getLogicalOperation() const override {
+        return mLogicalOperation;
+    }
+
 private:
     LogicalOperation mLogicalOperation;
 
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "matchers/MatcherEvaluationPlan.h"
+
+#include <algorithm>
+
+#include "hash.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::shared_ptr;
+using std::unordered_map;
+using std::vector;
+
+namespace {
+
+// Appends the combination matchers reachable from matcherIndex to order, children first.
+void visitCombinations(int matcherIndex,
+                       const vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
+                       vector<uint8_t>& visited, vector<int>& order) {
+    if (visited[matcherIndex]) {
+        return;
+    }
+    visited[matcherIndex] = true;
+    const sp<AtomMatchingTracker>& tracker = allAtomMatchingTrackers[matcherIndex];
+    if (!tracker->getLogicalOperation()) {
+        return;
+    }
+    for (const int childIndex : tracker->getChildren()) {
+        visitCombinations(childIndex, allAtomMatchingTrackers, visited, order);
+    }
+    order.push_back(matcherIndex);
+}
+
+}  // anonymous namespace
+
+void MatcherEvaluationPlan::build(const vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
+                                  const unordered_map<int, vector<int>>& tagIdsToMatchers) {
+    const size_t matcherCount = allAtomMatchingTrackers.size();
+    mNodes.clear();
+    mChildMasks.clear();
+    mAtomPlans.clear();
+    mMatchedBits.assign((matcherCount + 63) / 64, 0);
+
+    // Configs are validated to be acyclic, so this is a topological order.
+    vector<uint8_t> visited(matcherCount, false);
+    vector<int> order;
+    for (size_t i = 0; i < matcherCount; i++) {
+        visitCombinations(i, allAtomMatchingTrackers, visited, order);
+    }
+
+    vector<int> nodeIndexByMatcher(matcherCount, -1);
+    vector<uint64_t> matcherHashes(matcherCount, 0);
+    for (const int matcherIndex : order) {
+        const sp<AtomMatchingTracker>& tracker = allAtomMatchingTrackers[matcherIndex];
+        CombinationNode node;
+        node.matcherIndex = matcherIndex;
+        node.operation = *tracker->getLogicalOperation();
+        node.maskBegin = mChildMasks.size();
+        vector<int> children = tracker->getChildren();
+        std::sort(children.begin(), children.end());
+        for (const int childIndex : children) {
+            const uint32_t word = childIndex / 64;
+            const uint64_t bit = uint64_t(1) << (childIndex % 64);
+            if (mChildMasks.size() > node.maskBegin && mChildMasks.back().first == word) {
+                mChildMasks.back().second |= bit;
+            } else {
+                mChildMasks.emplace_back(word, bit);
+            }
+        }
+        node.maskEnd = mChildMasks.size();
+        nodeIndexByMatcher[matcherIndex] = mNodes.size();
+        mNodes.push_back(node);
+    }
+
+    for (const auto& [atomId, matcherIndices] : tagIdsToMatchers) {
+        AtomPlan& atomPlan = mAtomPlans[atomId];
+        for (const int matcherIndex : matcherIndices) {
+            if (nodeIndexByMatcher[matcherIndex] == -1) {
+                const SimpleAtomMatcher* simpleMatcher =
+                        allAtomMatchingTrackers[matcherIndex]->getSimpleAtomMatcher();
+                if (matcherHashes[matcherIndex] == 0 && simpleMatcher != nullptr) {
+                    matcherHashes[matcherIndex] = Hash64(simpleMatcher->SerializeAsString());
+                }
+                atomPlan.leafMatchers.push_back({matcherIndex, matcherHashes[matcherIndex]});
+            } else {
+                atomPlan.nodes.push_back(nodeIndexByMatcher[matcherIndex]);
+            }
+        }
+        std::sort(atomPlan.nodes.begin(), atomPlan.nodes.end());
+    }
+}
+
+bool MatcherEvaluationPlan::evaluateNode(const CombinationNode& node) const {
+    bool allMatched = true;
+    bool anyMatched = false;
+    for (uint32_t i = node.maskBegin; i < node.maskEnd; i++) {
+        const auto& [word, mask] = mChildMasks[i];
+        const uint64_t matched = mMatchedBits[word] & mask;
+        allMatched = allMatched && matched == mask;
+        anyMatched = anyMatched || matched != 0;
+    }
+    switch (node.operation) {
+        case LogicalOperation::AND:
+            return allMatched;
+        case LogicalOperation::OR:
+            return anyMatched;
+        case LogicalOperation::NOT:
+            // NOT has exactly one child.
+            return !anyMatched;
+        case LogicalOperation::NAND:
+            return !allMatched;
+        case LogicalOperation::NOR:
+            return !anyMatched;
+        case LogicalOperation::LOGICAL_OPERATION_UNSPECIFIED:
+            return false;
+    }
+    return false;
+}
+
+void MatcherEvaluationPlan::evaluate(const LogEvent& event,
+                                     const vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
+                                     vector<MatchingState>& matcherResults,
+                                     vector<shared_ptr<LogEvent>>& matcherTransformations,
+                                     SharedMatcherResults* sharedResults) {
+    const auto it = mAtomPlans.find(event.GetTagId());
+    if (it == mAtomPlans.end()) {
+        return;
+    }
+    const AtomPlan& atomPlan = it->second;
+
+    for (const auto& [matcherIndex, matcherHash] : atomPlan.leafMatchers) {
+        // Matchers already settled for this event, e.g. pruned by the atom's index, are left alone.
+        const bool shareResult = sharedResults != nullptr && matcherHash != 0 &&
+                                 matcherResults[matcherIndex] == MatchingState::kNotComputed;
+        const SharedMatcherResults::Result* sharedResult =
+                shareResult ? sharedResults->find(matcherHash) : nullptr;
+        if (sharedResult != nullptr) {
+            matcherResults[matcherIndex] = sharedResult->state;
+            matcherTransformations[matcherIndex] = sharedResult->transformation;
+        } else {
+            allAtomMatchingTrackers[matcherIndex]->onLogEvent(
+                    event, matcherIndex, allAtomMatchingTrackers, matcherResults,
+                    matcherTransformations);
+            if (shareResult) {
+                sharedResults->record(matcherHash, matcherResults[matcherIndex],
+                                      matcherTransformations[matcherIndex]);
+            }
+        }
+        if (matcherResults[matcherIndex] == MatchingState::kMatched) {
+            setMatched(matcherIndex);
+        }
+    }
+    for (const int nodeIndex : atomPlan.nodes) {
+        const CombinationNode& node = mNodes[nodeIndex];
+        const bool matched = evaluateNode(node);
+        matcherResults[node.matcherIndex] =
+                matched ? MatchingState::kMatched : MatchingState::kNotMatched;
+        if (matched) {
+            setMatched(node.matcherIndex);
+        }
+    }
+
+    // The bits set above are all within the atom's matchers, so clearing those resets the bitset.
+    for (const LeafMatcher& leafMatcher : atomPlan.leafMatchers) {
+        mMatchedBits[leafMatcher.matcherIndex / 64] = 0;
+    }
+    for (const int nodeIndex : atomPlan.nodes) {
+        mMatchedBits[mNodes[nodeIndex].matcherIndex / 64] = 0;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
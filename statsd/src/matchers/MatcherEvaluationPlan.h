@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logd/LogEvent.h"
+#include "matchers/AtomMatchingTracker.h"
+#include "matchers/SharedMatcherResults.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * A flattened evaluation order for the matchers of each atom.
+ *
+ * The leaf matchers of an atom are evaluated through their trackers. The combination matchers of
+ * the atom are then evaluated in topological order, children first, straight from a bitset of the
+ * matched matchers: each combination stores its children as (word, mask) pairs over that bitset,
+ * so AND/OR/NAND/NOR/NOT test whole words at a time instead of recursing into the children's
+ * trackers.
+ */
+class MatcherEvaluationPlan {
+public:
+    // Rebuilds the plan. tagIdsToMatchers lists, per atom, the matchers that take the atom.
+    void build(const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
+               const std::unordered_map<int, std::vector<int>>& tagIdsToMatchers);
+
+    // Evaluates the matchers of the event's atom, with the same results in matcherResults and
+    // matcherTransformations as calling onLogEvent on each of them. Only the entries of matchers
+    // that take the atom are written; the others are left untouched, which callers treat as not
+    // matched.
+    // If sharedResults is set, the leaf matchers that another config already evaluated for this
+    // event take their result from it, and the others record theirs in it.
+    void evaluate(const LogEvent& event,
+                  const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
+                  std::vector<MatchingState>& matcherResults,
+                  std::vector<std::shared_ptr<LogEvent>>& matcherTransformations,
+                  SharedMatcherResults* sharedResults = nullptr);
+
+private:
+    struct CombinationNode {
+        int matcherIndex;
+        LogicalOperation operation;
+        // The node's children are mChildMasks[maskBegin, maskEnd).
+        uint32_t maskBegin;
+        uint32_t maskEnd;
+    };
+
+    struct LeafMatcher {
+        int matcherIndex;
+        // Hash of the SimpleAtomMatcher, which unlike the proto hash leaves out the matcher id,
+        // so that identical matchers of different configs share their results.
+        uint64_t matcherHash;
+    };
+
+    struct AtomPlan {
+        std::vector<LeafMatcher> leafMatchers;
+        // Indices into mNodes, ascending, so children come before their parents.
+        std::vector<int> nodes;
+    };
+
+    void setMatched(int matcherIndex) {
+        mMatchedBits[matcherIndex / 64] |= uint64_t(1) << (matcherIndex % 64);
+    }
+
+    bool evaluateNode(const CombinationNode& node) const;
+
+    // All combination matchers, in topological order.
+    std::vector<CombinationNode> mNodes;
+
+    // (word index in mMatchedBits, bits of the children in that word), grouped by node.
+    std::vector<std::pair<uint32_t, uint64_t>> mChildMasks;
+
+    std::unordered_map<int, AtomPlan> mAtomPlans;
+
+    // Scratch bitset of the matchers matched by the current event. All zero between events.
+    std::vector<uint64_t> mMatchedBits;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "logd/LogEvent.h"
+#include "matchers/matcher_util.h"
+#include "utils/FlatHashMap.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * The results of the simple matchers evaluated for the current event, shared by all the metrics
+ * managers the event is dispatched to. Configs often define identical simple matchers; the first
+ * manager to evaluate one records its result here under the matcher's content hash, and the
+ * others reuse it instead of matching the event again.
+ *
+ * Not thread-safe. The owner calls startEvent() before dispatching each event.
+ */
+class SharedMatcherResults {
+public:
+    struct Result {
+        MatchingState state;
+        std::shared_ptr<LogEvent> transformation;
+    };
+
+    // Forgets the results of the previous event.
+    void startEvent() {
+        mResults.clear();
+    }
+
+    // The recorded result of the matcher with this content hash, or nullptr if no manager has
+    // evaluated it for the current event yet.
+    const Result* find(uint64_t matcherHash) const {
+        const auto it = mResults.find(matcherHash);
+        return it == mResults.end() ? nullptr : &it->second;
+    }
+
+    void record(uint64_t matcherHash, MatchingState state,
+                const std::shared_ptr<LogEvent>& transformation) {
+        mResults.try_emplace(matcherHash, Result{state, transformation});
+    }
+
+    size_t size() const {
+        return mResults.size();
+    }
+
+private:
+    FlatHashMap<uint64_t, Result> mResults;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -30,7 +30,10 @@ using std::vector;
 SimpleAtomMatchingTracker::SimpleAtomMatchingTracker(const int64_t id, const uint64_t protoHash,
                                                      const SimpleAtomMatcher& matcher,
                                                      const sp<UidMap>& uidMap)
-    : AtomMatchingTracker(id, protoHash), mMatcher(matcher), mUidMap(uidMap) {
+    : AtomMatchingTracker(id, protoHash),
+      mMatcher(matcher),
+      mUidMap(uidMap),
+      mMatcherCache(compileSimpleMatcher(mMatcher)) {
     if (!matcher.has_atom_id()) {
         mInitialized = false;
     } else {
@@ -90,7 +93,7 @@ void SimpleAtomMatchingTracker::onLogEvent(
         return;
     }
 
-    auto [matched, transformedEvent] = matchesSimple(mUidMap, mMatcher, event);
+    auto [matched, transformedEvent] = matchesSimple(mUidMap, mMatcher, event, &mMatcherCache);
     matcherResults[matcherIndex] = matched ? MatchingState::kMatched : MatchingState::kNotMatched;
     VLOG("Stats SimpleAtomMatcher %lld matched? %d", (long long)mId, matched);
 
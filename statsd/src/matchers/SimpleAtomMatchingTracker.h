@@ -49,9 +49,18 @@ public:
                     std::vector<MatchingState>& matcherResults,
                     std::vector<std::shared_ptr<LogEvent>>& matcherTransformations) override;
 
+    const SimpleAtomMatcher* getSimpleAtomMatcher() const override {
+        return &mMatcher;
+    }
+
 private:
     const SimpleAtomMatcher mMatcher;
     const sp<UidMap> mUidMap;
+
+    // The replace_string regexes and wildcard patterns of mMatcher, compiled once so that matching
+    // an event does not recompile them. mMatcher is identical across config updates, so this never
+    // needs rebuilding.
+    const SimpleMatcherCache mMatcherCache;
 };
 
 }  // namespace statsd
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "matchers/WildcardPattern.h"
+
+#include <fnmatch.h>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::string;
+using std::string_view;
+
+WildcardPattern::WildcardPattern(const string& pattern)
+    : mPattern(pattern),
+      mKind(Kind::kSegments),
+      mAnchoredStart(pattern.empty() || pattern.front() != '*'),
+      mAnchoredEnd(pattern.empty() || pattern.back() != '*'),
+      mHasAnyChar(false) {
+    if (pattern.find_first_of("[\\") != string::npos) {
+        mKind = Kind::kFnmatch;
+        return;
+    }
+
+    size_t start = 0;
+    while (start <= pattern.size()) {
+        size_t end = pattern.find('*', start);
+        if (end == string::npos) {
+            end = pattern.size();
+        }
+        if (end > start) {
+            mSegments.emplace_back(pattern, start, end - start);
+        }
+        start = end + 1;
+    }
+    mHasAnyChar = pattern.find('?') != string::npos;
+
+    if (mHasAnyChar) {
+        return;
+    }
+    if (pattern.find('*') == string::npos) {
+        mKind = Kind::kExact;
+    } else if (mSegments.size() == 1) {
+        if (mAnchoredStart) {
+            mKind = Kind::kPrefix;
+        } else if (mAnchoredEnd) {
+            mKind = Kind::kSuffix;
+        } else {
+            mKind = Kind::kContains;
+        }
+    }
+}
+
+bool WildcardPattern::matches(const string& str) const {
+    switch (mKind) {
+        case Kind::kExact:
+            return str == mPattern;
+        case Kind::kPrefix:
+            return string_view(str).substr(0, mSegments[0].size()) == mSegments[0];
+        case Kind::kSuffix:
+            return str.size() >= mSegments[0].size() &&
+                   string_view(str).substr(str.size() - mSegments[0].size()) == mSegments[0];
+        case Kind::kContains:
+            return str.find(mSegments[0]) != string::npos;
+        case Kind::kSegments:
+            return matchesSegments(str);
+        case Kind::kFnmatch:
+            return fnmatch(mPattern.c_str(), str.c_str(), 0) == 0;
+    }
+    return false;
+}
+
+bool WildcardPattern::matchesSegmentAt(const string& segment, string_view str, size_t pos) const {
+    if (pos > str.size() || str.size() - pos < segment.size()) {
+        return false;
+    }
+    if (!mHasAnyChar) {
+        return str.compare(pos, segment.size(), segment) == 0;
+    }
+    for (size_t i = 0; i < segment.size(); i++) {
+        if (segment[i] != '?' && segment[i] != str[pos + i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t WildcardPattern::findSegment(const string& segment, string_view str, size_t pos) const {
+    if (!mHasAnyChar) {
+        return str.find(segment, pos);
+    }
+    for (; pos + segment.size() <= str.size(); pos++) {
+        if (matchesSegmentAt(segment, str, pos)) {
+            return pos;
+        }
+    }
+    return string_view::npos;
+}
+
+bool WildcardPattern::matchesSegments(string_view str) const {
+    if (mSegments.empty()) {
+        // Either only '*'s, which match anything, or the empty pattern.
+        return !mAnchoredStart || str.empty();
+    }
+
+    size_t pos = 0;
+    size_t first = 0;
+    size_t last = mSegments.size();
+    if (mAnchoredStart) {
+        if (!matchesSegmentAt(mSegments[0], str, 0)) {
+            return false;
+        }
+        pos = mSegments[0].size();
+        first = 1;
+        if (mAnchoredEnd && mSegments.size() == 1) {
+            // No '*' at all.
+            return pos == str.size();
+        }
+    }
+    if (mAnchoredEnd) {
+        const string& segment = mSegments.back();
+        if (str.size() < pos + segment.size() ||
+            !matchesSegmentAt(segment, str, str.size() - segment.size())) {
+            return false;
+        }
+        str = str.substr(0, str.size() - segment.size());
+        last--;
+    }
+    // Every '*' between the anchors can absorb any run, so taking the leftmost match of each
+    // segment in turn never rules out a match.
+    for (size_t i = first; i < last; i++) {
+        const size_t found = findSegment(mSegments[i], str, pos);
+        if (found == string_view::npos) {
+            return false;
+        }
+        pos = found + mSegments[i].size();
+    }
+    return true;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
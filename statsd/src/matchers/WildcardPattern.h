@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * A wildcard pattern with the semantics of fnmatch(pattern, str, 0), compiled once.
+ *
+ * Patterns built from literals, '?' and '*' (which covers the package name shapes used in
+ * configs, like "com.foo.*") are matched without fnmatch: exact, prefix, suffix and contains
+ * patterns compare the literal directly, other patterns match their '*'-separated segments left
+ * to right. Patterns with bracket expressions or escapes fall back to fnmatch.
+ */
+class WildcardPattern {
+public:
+    explicit WildcardPattern(const std::string& pattern);
+
+    bool matches(const std::string& str) const;
+
+private:
+    enum class Kind {
+        kExact,
+        kPrefix,
+        kSuffix,
+        kContains,
+        kSegments,
+        kFnmatch,
+    };
+
+    // Whether segment matches str at pos, with '?' in a segment matching any character.
+    bool matchesSegmentAt(const std::string& segment, std::string_view str, size_t pos) const;
+
+    // Returns the first position at or after pos where segment matches, or npos.
+    size_t findSegment(const std::string& segment, std::string_view str, size_t pos) const;
+
+    bool matchesSegments(std::string_view str) const;
+
+    const std::string mPattern;
+
+    Kind mKind;
+
+    // The pattern split at '*', empty segments dropped. '?' in a segment stands for any
+    // character.
+    std::vector<std::string> mSegments;
+
+    // Whether the pattern starts / ends with a literal segment rather than '*'.
+    bool mAnchoredStart;
+    bool mAnchoredEnd;
+
+    // Whether any segment contains '?'. If not, the segments are plain literals.
+    bool mHasAnyChar;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
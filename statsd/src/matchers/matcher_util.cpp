@@ -20,12 +20,17 @@
 
 #include <fnmatch.h>
 
+#include <algorithm>
+
 #include "matchers/AtomMatchingTracker.h"
+#include "packages/UidIndex.h"
 #include "src/statsd_config.pb.h"
 #include "stats_util.h"
 #include "utils/Regex.h"
 
+using std::pair;
 using std::set;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -86,65 +91,206 @@ bool combinationMatch(const vector<int>& children, const LogicalOperation& opera
     return matched;
 }
 
+// Drops the uid results of matcherCache if the uid map changed since they were computed.
+static void syncUidMapGeneration(const sp<UidMap>& uidMap, const SimpleMatcherCache& matcherCache) {
+    const uint64_t generation = uidMap->getGeneration();
+    if (matcherCache.uidMapGeneration != generation) {
+        matcherCache.uidMatchResults.clear();
+        matcherCache.packageUids.clear();
+        matcherCache.uidMapGeneration = generation;
+    }
+}
+
+// Returns the uids that have packageName installed. packageName must belong to the matcher the
+// cache was compiled from.
+static const std::unordered_set<int32_t>& getPackageUids(const sp<UidMap>& uidMap,
+                                                         const string& packageName,
+                                                         const SimpleMatcherCache& matcherCache) {
+    syncUidMapGeneration(uidMap, matcherCache);
+    const auto [it, inserted] = matcherCache.packageUids.try_emplace(&packageName);
+    if (inserted) {
+        const set<int32_t> uids = uidMap->getAppUid(packageName);
+        it->second.insert(uids.begin(), uids.end());
+    }
+    return it->second;
+}
+
+// Returns whether uid matches str, as computed by match. Looking up the packages of a uid takes
+// the UidMap lock, so with a matcher cache the result is remembered until the uid map changes.
+// str must belong to the matcher the cache was compiled from.
+template <typename MatchFn>
+static bool memoizedUidMatch(const sp<UidMap>& uidMap, int uid, const string& str,
+                             const SimpleMatcherCache* matcherCache, const MatchFn& match) {
+    if (matcherCache == nullptr) {
+        return match();
+    }
+    syncUidMapGeneration(uidMap, *matcherCache);
+    auto& results = matcherCache->uidMatchResults;
+    if (results.size() >= SimpleMatcherCache::kMaxUidResults) {
+        results.clear();
+    }
+    const auto [it, inserted] = results.try_emplace(std::make_pair(&str, uid));
+    if (inserted) {
+        it->second = match();
+    }
+    return it->second;
+}
+
 static bool tryMatchString(const sp<UidMap>& uidMap, const FieldValue& fieldValue,
-                           const string& str_match) {
+                           const string& str_match, const SimpleMatcherCache* matcherCache) {
     if (isAttributionUidField(fieldValue) || isUidField(fieldValue)) {
         int uid = fieldValue.mValue.int_value;
-        auto aidIt = UidMap::sAidToUidMapping.find(str_match);
-        if (aidIt != UidMap::sAidToUidMapping.end()) {
-            return ((int)aidIt->second) == uid;
+        const int aidUid = AidIndex::getInstance().getUid(str_match);
+        if (aidUid != -1) {
+            return aidUid == uid;
         }
-        return uidMap->hasApp(uid, str_match);
+        if (matcherCache == nullptr) {
+            return uidMap->hasApp(uid, str_match);
+        }
+        return getPackageUids(uidMap, str_match, *matcherCache).count(uid) > 0;
     } else if (fieldValue.mValue.getType() == STRING) {
         return fieldValue.mValue.str_value == str_match;
     }
     return false;
 }
 
+static bool wildcardMatch(const string& wildcardPattern, const WildcardPattern* compiledPattern,
+                          const string& str) {
+    if (compiledPattern != nullptr) {
+        return compiledPattern->matches(str);
+    }
+    return fnmatch(wildcardPattern.c_str(), str.c_str(), 0) == 0;
+}
+
+static bool tryMatchWildcardUid(const sp<UidMap>& uidMap, int uid, const string& wildcardPattern,
+                                const WildcardPattern* compiledPattern) {
+    const string* aidName = AidIndex::getInstance().getName(uid);
+    if (aidName != nullptr) {
+        return wildcardMatch(wildcardPattern, compiledPattern, *aidName);
+    }
+    std::set<string> packageNames = uidMap->getAppNamesFromUid(uid, false /* normalize*/);
+    for (const auto& packageName : packageNames) {
+        if (wildcardMatch(wildcardPattern, compiledPattern, packageName)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool tryMatchWildcardString(const sp<UidMap>& uidMap, const FieldValue& fieldValue,
-                                   const string& wildcardPattern) {
+                                   const string& wildcardPattern,
+                                   const SimpleMatcherCache* matcherCache) {
+    const WildcardPattern* compiledPattern = nullptr;
+    if (matcherCache != nullptr) {
+        const auto it = matcherCache->wildcards.find(&wildcardPattern);
+        if (it != matcherCache->wildcards.end()) {
+            compiledPattern = &it->second;
+        }
+    }
+
     if (isAttributionUidField(fieldValue) || isUidField(fieldValue)) {
         int uid = fieldValue.mValue.int_value;
-        // TODO(b/236886985): replace aid/uid mapping with efficient bidirectional container
-        // AidToUidMapping will never have uids above 10000
-        if (uid < 10000) {
-            for (auto aidIt = UidMap::sAidToUidMapping.begin();
-                 aidIt != UidMap::sAidToUidMapping.end(); ++aidIt) {
-                if ((int)aidIt->second == uid) {
-                    // Assumes there is only one aid mapping for each uid
-                    return fnmatch(wildcardPattern.c_str(), aidIt->first.c_str(), 0) == 0;
-                }
-            }
-        }
-        std::set<string> packageNames = uidMap->getAppNamesFromUid(uid, false /* normalize*/);
-        for (const auto& packageName : packageNames) {
-            if (fnmatch(wildcardPattern.c_str(), packageName.c_str(), 0) == 0) {
-                return true;
-            }
-        }
+        return memoizedUidMatch(uidMap, uid, wildcardPattern, matcherCache, [&] {
+            return tryMatchWildcardUid(uidMap, uid, wildcardPattern, compiledPattern);
+        });
     } else if (fieldValue.mValue.getType() == STRING) {
-        return fnmatch(wildcardPattern.c_str(), fieldValue.mValue.str_value.c_str(), 0) == 0;
+        return wildcardMatch(wildcardPattern, compiledPattern, fieldValue.mValue.str_value);
     }
     return false;
 }
 
-static unique_ptr<LogEvent> getTransformedEvent(const FieldValueMatcher& matcher,
-                                                const LogEvent& event, int start, int end) {
+namespace {
+
+// The values of an event with the string replacements of replace_string matchers laid over them.
+// Only the replaced slots are stored, so matching an event through a chain of transformations does
+// not copy the event. The event is copied once, when a matched event has to be handed on.
+class TransformedValues {
+public:
+    explicit TransformedValues(const vector<FieldValue>& values) : mValues(values) {
+    }
+
+    const FieldValue& operator[](int index) const {
+        const auto it = findOverride(index);
+        return it != mOverrides.end() && it->first == index ? it->second : mValues[index];
+    }
+
+    // The untransformed values. Transformations never change the fields, only string values.
+    const vector<FieldValue>& getBaseValues() const {
+        return mValues;
+    }
+
+    void replaceString(int index, const string& str) {
+        auto it = findOverride(index);
+        if (it == mOverrides.end() || it->first != index) {
+            it = mOverrides.emplace(it, index, mValues[index]);
+        }
+        it->second.mValue.str_value = str;
+    }
+
+    // Returns a copy of event with the replacements applied, or nullptr if there are none.
+    shared_ptr<LogEvent> createTransformedEvent(const LogEvent& event) const {
+        if (mOverrides.empty()) {
+            return nullptr;
+        }
+        shared_ptr<LogEvent> transformedEvent = std::make_shared<LogEvent>(event);
+        vector<FieldValue>& values = *transformedEvent->getMutableValues();
+        for (const auto& [index, fieldValue] : mOverrides) {
+            values[index] = fieldValue;
+        }
+        return transformedEvent;
+    }
+
+private:
+    using Overrides = vector<pair<int, FieldValue>>;
+
+    static bool indexLess(const pair<int, FieldValue>& entry, int index) {
+        return entry.first < index;
+    }
+
+    Overrides::iterator findOverride(int index) {
+        return std::lower_bound(mOverrides.begin(), mOverrides.end(), index, indexLess);
+    }
+
+    Overrides::const_iterator findOverride(int index) const {
+        return std::lower_bound(mOverrides.begin(), mOverrides.end(), index, indexLess);
+    }
+
+    const vector<FieldValue>& mValues;
+
+    // Replaced slots, sorted by index.
+    Overrides mOverrides;
+};
+
+}  // anonymous namespace
+
+static void applyReplaceString(const FieldValueMatcher& matcher, TransformedValues& values,
+                               int start, int end, const SimpleMatcherCache* matcherCache) {
     if (!matcher.has_replace_string()) {
-        return nullptr;
+        return;
     }
 
-    unique_ptr<Regex> re = Regex::create(matcher.replace_string().regex());
+    const Regex* re = nullptr;
+    bool isCached = false;
+    if (matcherCache != nullptr) {
+        const auto it = matcherCache->regexes.find(&matcher);
+        if (it != matcherCache->regexes.end()) {
+            re = it->second.get();
+            isCached = true;
+        }
+    }
+    unique_ptr<Regex> uncachedRe;
+    if (!isCached) {
+        uncachedRe = Regex::create(matcher.replace_string().regex());
+        re = uncachedRe.get();
+    }
 
     if (re == nullptr) {
-        return nullptr;
+        return;
     }
 
     const string& replacement = matcher.replace_string().replacement();
-    unique_ptr<LogEvent> transformedEvent = nullptr;
     for (int i = start; i < end; i++) {
-        const LogEvent& eventRef = transformedEvent == nullptr ? event : *transformedEvent;
-        const FieldValue& fieldValue = eventRef.getValues()[i];
+        const FieldValue& fieldValue = values[i];
         if (fieldValue.mValue.getType() != STRING) {
             continue;
         }
@@ -153,13 +299,9 @@ static unique_ptr<LogEvent> getTransformedEvent(const FieldValueMatcher& matcher
             continue;
         }
 
-        // String transformation occurred, update the FieldValue in transformedEvent.
-        if (transformedEvent == nullptr) {
-            transformedEvent = std::make_unique<LogEvent>(event);
-        }
-        (*transformedEvent->getMutableValues())[i].mValue.str_value = str;
+        // String transformation occurred, lay the new value over the event.
+        values.replaceString(i, str);
     }
-    return transformedEvent;
 }
 
 static pair<int, int> getStartEndAtDepth(int targetField, int start, int end, int depth,
@@ -185,31 +327,52 @@ static pair<int, int> getStartEndAtDepth(int targetField, int start, int end, in
 }
 
 /*
- * Returns pairs of start-end indices in vector<FieldValue> that pariticipate in matching.
- * The returned vector is empty if an error was encountered.
- * If Position is ANY and value_matcher is matches_tuple, the vector contains a start/end pair
- * corresponding for each child FieldValueMatcher in matches_tuple. For all other cases, the
- * returned vector is of size 1.
+ * The ranges computed by the matchesSimple() calls in progress on this thread. Each call appends
+ * its ranges and drops them when it returns, so the nested calls of a matcher use it as a stack
+ * and matching allocates nothing once it has grown to the largest matcher.
+ */
+static thread_local vector<pair<int, int>> tRangeArena;
+
+// Drops the ranges appended to tRangeArena since it was created.
+class RangeArenaScope {
+public:
+    RangeArenaScope() : mBegin(tRangeArena.size()) {
+    }
+    ~RangeArenaScope() {
+        tRangeArena.resize(mBegin);
+    }
+    size_t begin() const {
+        return mBegin;
+    }
+
+private:
+    const size_t mBegin;
+};
+
+/*
+ * Appends pairs of start-end indices in vector<FieldValue> that pariticipate in matching to
+ * ranges. Nothing is appended if an error was encountered.
+ * If Position is ANY and value_matcher is matches_tuple, a start/end pair is appended
+ * corresponding for each child FieldValueMatcher in matches_tuple. For all other cases, a single
+ * pair is appended.
  *
  * Also updates the depth reference parameter if matcher has Position specified.
  */
-static vector<pair<int, int>> computeRanges(const FieldValueMatcher& matcher,
-                                            const vector<FieldValue>& values, int start, int end,
-                                            int& depth) {
+static void computeRanges(const FieldValueMatcher& matcher, const vector<FieldValue>& values,
+                          int start, int end, int& depth, vector<pair<int, int>>& ranges) {
     // Now we have zoomed in to a new range
     std::tie(start, end) = getStartEndAtDepth(matcher.field(), start, end, depth, values);
 
     if (start == -1) {
         // No such field found.
-        return {};
+        return;
     }
 
-    vector<pair<int, int>> ranges;
     if (matcher.has_position()) {
         // Repeated fields position is stored as a node in the path.
         depth++;
         if (depth > 2) {
-            return ranges;
+            return;
         }
         switch (matcher.position()) {
             case Position::FIRST: {
@@ -279,60 +442,55 @@ static vector<pair<int, int>> computeRanges(const FieldValueMatcher& matcher,
         // No position
         ranges.push_back(std::make_pair(start, end));
     }
-
-    return ranges;
 }
 
-static MatchResult matchesSimple(const sp<UidMap>& uidMap, const FieldValueMatcher& matcher,
-                                 const LogEvent& event, int start, int end, int depth) {
+static bool matchesSimple(const sp<UidMap>& uidMap, const FieldValueMatcher& matcher,
+                          TransformedValues& values, int start, int end, int depth,
+                          const SimpleMatcherCache* matcherCache) {
     if (depth > 2) {
         ALOGE("Depth >= 3 not supported");
-        return {false, nullptr};
+        return false;
     }
 
     if (start >= end) {
-        return {false, nullptr};
+        return false;
     }
 
-    const vector<pair<int, int>> ranges =
-            computeRanges(matcher, event.getValues(), start, end, depth);
+    const RangeArenaScope rangeScope;
+    computeRanges(matcher, values.getBaseValues(), start, end, depth, tRangeArena);
+    const size_t rangesBegin = rangeScope.begin();
+    const size_t rangesEnd = tRangeArena.size();
 
-    if (ranges.empty()) {
+    if (rangesBegin == rangesEnd) {
         // No such field found.
-        return {false, nullptr};
+        return false;
     }
 
-    // ranges should have exactly one start/end pair at this point unless position is ANY and
+    // There should be exactly one start/end pair at this point unless position is ANY and
     // value_matcher is matches_tuple.
-    std::tie(start, end) = ranges[0];
-
-    unique_ptr<LogEvent> transformedEvent = getTransformedEvent(matcher, event, start, end);
+    std::tie(start, end) = tRangeArena[rangesBegin];
 
-    const vector<FieldValue>& values =
-            transformedEvent == nullptr ? event.getValues() : transformedEvent->getValues();
+    applyReplaceString(matcher, values, start, end, matcherCache);
 
     switch (matcher.value_matcher_case()) {
         case FieldValueMatcher::kMatchesTuple: {
             ++depth;
             // If any range matches all matchers, good.
             bool matchResult = false;
-            for (const auto& [rangeStart, rangeEnd] : ranges) {
+            for (size_t i = rangesBegin; i < rangesEnd; i++) {
+                // Copied, as the nested calls may grow the arena.
+                const auto [rangeStart, rangeEnd] = tRangeArena[i];
                 bool matched = true;
                 for (const auto& subMatcher : matcher.matches_tuple().field_value_matcher()) {
-                    const LogEvent& eventRef =
-                            transformedEvent == nullptr ? event : *transformedEvent;
-                    auto [hasMatched, newTransformedEvent] = matchesSimple(
-                            uidMap, subMatcher, eventRef, rangeStart, rangeEnd, depth);
-                    if (newTransformedEvent != nullptr) {
-                        transformedEvent = std::move(newTransformedEvent);
-                    }
+                    const bool hasMatched = matchesSimple(uidMap, subMatcher, values, rangeStart,
+                                                          rangeEnd, depth, matcherCache);
                     if (!hasMatched) {
                         matched = false;
                     }
                 }
                 matchResult = matchResult || matched;
             }
-            return {matchResult, std::move(transformedEvent)};
+            return matchResult;
         }
         // Finally, we get to the point of real value matching.
         // If the field matcher ends with ANY, then we have [start, end) range > 1.
@@ -343,94 +501,95 @@ static MatchResult matchesSimple(const sp<UidMap>& uidMap, const FieldValueMatch
                      (values[i].mValue.int_value != 0) == matcher.eq_bool()) ||
                     (values[i].mValue.getType() == LONG &&
                      (values[i].mValue.long_value != 0) == matcher.eq_bool())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqString: {
             for (int i = start; i < end; i++) {
-                if (tryMatchString(uidMap, values[i], matcher.eq_string())) {
-                    return {true, std::move(transformedEvent)};
+                if (tryMatchString(uidMap, values[i], matcher.eq_string(), matcherCache)) {
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kNeqAnyString: {
             const auto& str_list = matcher.neq_any_string();
             for (int i = start; i < end; i++) {
                 bool notEqAll = true;
                 for (const auto& str : str_list.str_value()) {
-                    if (tryMatchString(uidMap, values[i], str)) {
+                    if (tryMatchString(uidMap, values[i], str, matcherCache)) {
                         notEqAll = false;
                         break;
                     }
                 }
                 if (notEqAll) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqAnyString: {
             const auto& str_list = matcher.eq_any_string();
             for (int i = start; i < end; i++) {
                 for (const auto& str : str_list.str_value()) {
-                    if (tryMatchString(uidMap, values[i], str)) {
-                        return {true, std::move(transformedEvent)};
+                    if (tryMatchString(uidMap, values[i], str, matcherCache)) {
+                        return true;
                     }
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqWildcardString: {
             for (int i = start; i < end; i++) {
-                if (tryMatchWildcardString(uidMap, values[i], matcher.eq_wildcard_string())) {
-                    return {true, std::move(transformedEvent)};
+                if (tryMatchWildcardString(uidMap, values[i], matcher.eq_wildcard_string(),
+                                           matcherCache)) {
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqAnyWildcardString: {
             const auto& str_list = matcher.eq_any_wildcard_string();
             for (int i = start; i < end; i++) {
                 for (const auto& str : str_list.str_value()) {
-                    if (tryMatchWildcardString(uidMap, values[i], str)) {
-                        return {true, std::move(transformedEvent)};
+                    if (tryMatchWildcardString(uidMap, values[i], str, matcherCache)) {
+                        return true;
                     }
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kNeqAnyWildcardString: {
             const auto& str_list = matcher.neq_any_wildcard_string();
             for (int i = start; i < end; i++) {
                 bool notEqAll = true;
                 for (const auto& str : str_list.str_value()) {
-                    if (tryMatchWildcardString(uidMap, values[i], str)) {
+                    if (tryMatchWildcardString(uidMap, values[i], str, matcherCache)) {
                         notEqAll = false;
                         break;
                     }
                 }
                 if (notEqAll) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqInt: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == INT &&
                     (matcher.eq_int() == values[i].mValue.int_value)) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
                 // eq_int covers both int and long.
                 if (values[i].mValue.getType() == LONG &&
                     (matcher.eq_int() == values[i].mValue.long_value)) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kEqAnyInt: {
             const auto& int_list = matcher.eq_any_int();
@@ -438,16 +597,16 @@ static MatchResult matchesSimple(const sp<UidMap>& uidMap, const FieldValueMatch
                 for (const int int_value : int_list.int_value()) {
                     if (values[i].mValue.getType() == INT &&
                         (int_value == values[i].mValue.int_value)) {
-                        return {true, std::move(transformedEvent)};
+                        return true;
                     }
                     // eq_any_int covers both int and long.
                     if (values[i].mValue.getType() == LONG &&
                         (int_value == values[i].mValue.long_value)) {
-                        return {true, std::move(transformedEvent)};
+                        return true;
                     }
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kNeqAnyInt: {
             const auto& int_list = matcher.neq_any_int();
@@ -467,113 +626,269 @@ static MatchResult matchesSimple(const sp<UidMap>& uidMap, const FieldValueMatch
                     }
                 }
                 if (notEqAll) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kLtInt: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == INT &&
                     (values[i].mValue.int_value < matcher.lt_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
                 // lt_int covers both int and long.
                 if (values[i].mValue.getType() == LONG &&
                     (values[i].mValue.long_value < matcher.lt_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kGtInt: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == INT &&
                     (values[i].mValue.int_value > matcher.gt_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
                 // gt_int covers both int and long.
                 if (values[i].mValue.getType() == LONG &&
                     (values[i].mValue.long_value > matcher.gt_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kLtFloat: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == FLOAT &&
                     (values[i].mValue.float_value < matcher.lt_float())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kGtFloat: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == FLOAT &&
                     (values[i].mValue.float_value > matcher.gt_float())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kLteInt: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == INT &&
                     (values[i].mValue.int_value <= matcher.lte_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
                 // lte_int covers both int and long.
                 if (values[i].mValue.getType() == LONG &&
                     (values[i].mValue.long_value <= matcher.lte_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         case FieldValueMatcher::ValueMatcherCase::kGteInt: {
             for (int i = start; i < end; i++) {
                 if (values[i].mValue.getType() == INT &&
                     (values[i].mValue.int_value >= matcher.gte_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
                 // gte_int covers both int and long.
                 if (values[i].mValue.getType() == LONG &&
                     (values[i].mValue.long_value >= matcher.gte_int())) {
-                    return {true, std::move(transformedEvent)};
+                    return true;
                 }
             }
-            return {false, std::move(transformedEvent)};
+            return false;
         }
         default:
             // This only happens if the matcher has a string transformation and no value_matcher. So
             // the default match result is true. If there is no string transformation either then
             // this matcher is invalid, which is enforced when the AtomMatchingTracker is
             // initialized.
-            return {true, std::move(transformedEvent)};
+            return true;
+    }
+}
+
+static void compileFieldValueMatcher(const FieldValueMatcher& matcher,
+                                     SimpleMatcherCache& matcherCache) {
+    if (matcher.has_replace_string()) {
+        matcherCache.regexes[&matcher] = Regex::create(matcher.replace_string().regex());
+    }
+    switch (matcher.value_matcher_case()) {
+        case FieldValueMatcher::kMatchesTuple:
+            for (const auto& subMatcher : matcher.matches_tuple().field_value_matcher()) {
+                compileFieldValueMatcher(subMatcher, matcherCache);
+            }
+            break;
+        case FieldValueMatcher::kEqWildcardString:
+            matcherCache.wildcards.try_emplace(&matcher.eq_wildcard_string(),
+                                               matcher.eq_wildcard_string());
+            break;
+        case FieldValueMatcher::kEqAnyWildcardString:
+            for (const auto& str : matcher.eq_any_wildcard_string().str_value()) {
+                matcherCache.wildcards.try_emplace(&str, str);
+            }
+            break;
+        case FieldValueMatcher::kNeqAnyWildcardString:
+            for (const auto& str : matcher.neq_any_wildcard_string().str_value()) {
+                matcherCache.wildcards.try_emplace(&str, str);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Returns false if matcher is not a top level FieldComparison.
+static bool compileFieldComparison(const FieldValueMatcher& matcher,
+                                   SimpleMatcherCache::FieldComparison* comparison) {
+    if (matcher.has_position() || matcher.has_replace_string()) {
+        return false;
+    }
+    comparison->field = matcher.field();
+    comparison->kind = matcher.value_matcher_case();
+    switch (comparison->kind) {
+        case FieldValueMatcher::kEqBool:
+            comparison->operand = matcher.eq_bool() ? 1 : 0;
+            return true;
+        case FieldValueMatcher::kEqString:
+            comparison->str = &matcher.eq_string();
+            return true;
+        case FieldValueMatcher::kEqInt:
+            comparison->operand = matcher.eq_int();
+            return true;
+        case FieldValueMatcher::kLtInt:
+            comparison->operand = matcher.lt_int();
+            return true;
+        case FieldValueMatcher::kGtInt:
+            comparison->operand = matcher.gt_int();
+            return true;
+        case FieldValueMatcher::kLteInt:
+            comparison->operand = matcher.lte_int();
+            return true;
+        case FieldValueMatcher::kGteInt:
+            comparison->operand = matcher.gte_int();
+            return true;
+        default:
+            return false;
     }
 }
 
+SimpleMatcherCache compileSimpleMatcher(const SimpleAtomMatcher& simpleMatcher) {
+    SimpleMatcherCache matcherCache;
+    matcherCache.comparisonsOnly = true;
+    for (const auto& matcher : simpleMatcher.field_value_matcher()) {
+        compileFieldValueMatcher(matcher, matcherCache);
+        SimpleMatcherCache::FieldComparison comparison;
+        if (matcherCache.comparisonsOnly && compileFieldComparison(matcher, &comparison)) {
+            matcherCache.fieldComparisons.push_back(comparison);
+        } else {
+            matcherCache.comparisonsOnly = false;
+            matcherCache.fieldComparisons.clear();
+        }
+    }
+    return matcherCache;
+}
+
+// Same result as the matchesSimple() of the FieldValueMatcher comparison was compiled from.
+static bool matchesComparison(const sp<UidMap>& uidMap,
+                              const SimpleMatcherCache::FieldComparison& comparison,
+                              const vector<FieldValue>& values,
+                              const SimpleMatcherCache* matcherCache) {
+    const int size = values.size();
+    int start;
+    int end;
+    // Fields are sorted, and when no field before it is repeated, field n is at index n - 1.
+    const int hint = comparison.field - 1;
+    if (hint >= 0 && hint < size && values[hint].mField.getPosAtDepth(0) == comparison.field &&
+        (hint == 0 || values[hint - 1].mField.getPosAtDepth(0) != comparison.field)) {
+        start = hint;
+        end = hint + 1;
+        while (end < size && values[end].mField.getPosAtDepth(0) == comparison.field) {
+            end++;
+        }
+    } else {
+        std::tie(start, end) = getStartEndAtDepth(comparison.field, 0, size, 0, values);
+        if (start == -1) {
+            return false;
+        }
+    }
+
+    for (int i = start; i < end; i++) {
+        if (comparison.kind == FieldValueMatcher::kEqString) {
+            if (tryMatchString(uidMap, values[i], *comparison.str, matcherCache)) {
+                return true;
+            }
+            continue;
+        }
+        // The int comparisons and eq_bool cover both int and long.
+        int64_t value;
+        if (values[i].mValue.getType() == INT) {
+            value = values[i].mValue.int_value;
+        } else if (values[i].mValue.getType() == LONG) {
+            value = values[i].mValue.long_value;
+        } else {
+            continue;
+        }
+        bool matched = false;
+        switch (comparison.kind) {
+            case FieldValueMatcher::kEqBool:
+                matched = (value != 0) == (comparison.operand != 0);
+                break;
+            case FieldValueMatcher::kEqInt:
+                matched = value == comparison.operand;
+                break;
+            case FieldValueMatcher::kLtInt:
+                matched = value < comparison.operand;
+                break;
+            case FieldValueMatcher::kGtInt:
+                matched = value > comparison.operand;
+                break;
+            case FieldValueMatcher::kLteInt:
+                matched = value <= comparison.operand;
+                break;
+            case FieldValueMatcher::kGteInt:
+                matched = value >= comparison.operand;
+                break;
+            default:
+                break;
+        }
+        if (matched) {
+            return true;
+        }
+    }
+    return false;
+}
+
 MatchResult matchesSimple(const sp<UidMap>& uidMap, const SimpleAtomMatcher& simpleMatcher,
-                          const LogEvent& event) {
+                          const LogEvent& event, const SimpleMatcherCache* matcherCache) {
     if (event.GetTagId() != simpleMatcher.atom_id()) {
         return {false, nullptr};
     }
 
-    unique_ptr<LogEvent> transformedEvent = nullptr;
-    for (const auto& matcher : simpleMatcher.field_value_matcher()) {
-        const LogEvent& inputEvent = transformedEvent == nullptr ? event : *transformedEvent;
-        auto [hasMatched, newTransformedEvent] =
-                matchesSimple(uidMap, matcher, inputEvent, 0, inputEvent.getValues().size(), 0);
-        if (newTransformedEvent != nullptr) {
-            transformedEvent = std::move(newTransformedEvent);
+    if (matcherCache != nullptr && matcherCache->comparisonsOnly) {
+        // Comparisons never transform the event.
+        for (const auto& comparison : matcherCache->fieldComparisons) {
+            if (!matchesComparison(uidMap, comparison, event.getValues(), matcherCache)) {
+                return {false, nullptr};
+            }
         }
-        if (!hasMatched) {
-            return {false, std::move(transformedEvent)};
+        return {true, nullptr};
+    }
+
+    TransformedValues values(event.getValues());
+    for (const auto& matcher : simpleMatcher.field_value_matcher()) {
+        if (!matchesSimple(uidMap, matcher, values, 0, event.getValues().size(), 0, matcherCache)) {
+            // The transformations of an event that does not match are never used.
+            return {false, nullptr};
         }
     }
-    return {true, std::move(transformedEvent)};
+    return {true, values.createTransformedEvent(event)};
 }
 
 }  // namespace statsd
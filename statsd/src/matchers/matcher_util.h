@@ -18,10 +18,14 @@
 
 #include "logd/LogEvent.h"
 
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include "matchers/WildcardPattern.h"
 #include "src/statsd_config.pb.h"
 #include "packages/UidMap.h"
 #include "stats_util.h"
+#include "utils/Regex.h"
 
 namespace android {
 namespace os {
@@ -35,14 +39,73 @@ enum MatchingState {
 
 struct MatchResult {
     bool matched;
-    std::unique_ptr<LogEvent> transformedEvent;
+    // The event with the replace_string transformations applied, if the event matched and any
+    // string was changed.
+    std::shared_ptr<LogEvent> transformedEvent;
+};
+
+// State compiled from a SimpleAtomMatcher so that matching an event does not re-parse the config.
+// It refers to the strings and FieldValueMatchers of the matcher, which must outlive it. Not
+// thread safe: the uid results are updated while matching.
+struct SimpleMatcherCache {
+    struct UidResultKeyHash {
+        size_t operator()(const std::pair<const std::string*, int>& key) const noexcept {
+            return std::hash<const std::string*>()(key.first) * 31 + std::hash<int>()(key.second);
+        }
+    };
+
+    // Upper bound on memoized uid results before they are dropped wholesale.
+    static const size_t kMaxUidResults = 4096;
+
+    // Compiled replace_string regexes, keyed by the FieldValueMatcher that owns them. A nullptr
+    // value means the regex is invalid and the transformation is skipped.
+    std::unordered_map<const FieldValueMatcher*, std::unique_ptr<Regex>> regexes;
+
+    // Compiled wildcard patterns, keyed by the pattern string in the matcher.
+    std::unordered_map<const std::string*, WildcardPattern> wildcards;
+
+    // Results of matching a string or wildcard pattern of the matcher against the packages of a
+    // uid, valid while the UidMap generation is uidMapGeneration.
+    mutable std::unordered_map<std::pair<const std::string*, int>, bool, UidResultKeyHash>
+            uidMatchResults;
+
+    // The uids that have a package named by a string of the matcher installed, keyed by the
+    // string. Resolved once per UidMap generation, so that matching the uid fields of an event,
+    // such as the nodes of an attribution chain, against package names is an integer lookup.
+    mutable std::unordered_map<const std::string*, std::unordered_set<int32_t>> packageUids;
+
+    // The UidMap generation uidMatchResults and packageUids were computed at.
+    mutable uint64_t uidMapGeneration = 0;
+
+    // A FieldValueMatcher comparing a top level field, without position or string
+    // transformation, with eq_bool, eq_string or one of the int comparisons.
+    struct FieldComparison {
+        int32_t field;
+        FieldValueMatcher::ValueMatcherCase kind;
+        // The int operand. eq_bool is stored as 0 or 1.
+        int64_t operand = 0;
+        // The eq_string operand.
+        const std::string* str = nullptr;
+    };
+
+    // Set if every FieldValueMatcher of the matcher is a FieldComparison, in which case events
+    // are matched against fieldComparisons directly instead of interpreting the matchers.
+    bool comparisonsOnly = false;
+    std::vector<FieldComparison> fieldComparisons;
 };
 
 bool combinationMatch(const std::vector<int>& children, const LogicalOperation& operation,
                       const std::vector<MatchingState>& matcherResults);
 
+// Compiles the replace_string regexes and wildcard patterns of all FieldValueMatchers in
+// simpleMatcher, including the ones nested in matches_tuple.
+SimpleMatcherCache compileSimpleMatcher(const SimpleAtomMatcher& simpleMatcher);
+
+// matcherCache, if given, must have been compiled from simpleMatcher. Otherwise regexes and
+// wildcard patterns are interpreted for every event.
 MatchResult matchesSimple(const sp<UidMap>& uidMap, const SimpleAtomMatcher& simpleMatcher,
-                          const LogEvent& wrapper);
+                          const LogEvent& wrapper,
+                          const SimpleMatcherCache* matcherCache = nullptr);
 
 }  // namespace statsd
 }  // namespace os
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "ConfigCostEstimator.h"
+
+#include <private/android_filesystem_config.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include "anomaly/AlarmMonitor.h"
+#include "external/StatsPullerManager.h"
+#include "guardrail/StatsdStats.h"
+#include "metrics/MetricsManager.h"
+#include "socket/StatsSocketListener.h"
+#include "stats_log_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::vector;
+
+const ConfigKey ConfigCostEstimator::kEstimateConfigKey(AID_STATSD, -1);
+
+namespace {
+
+// An atom of a recorded datagram, without its size prefix.
+struct AtomBuffer {
+    const uint8_t* buffer;
+    uint32_t size;
+};
+
+// Splits a recorded datagram into its atoms, as StatsSocketListener::processDatagram() does.
+void splitDatagram(const DatagramRecord& record, vector<AtomBuffer>* atoms) {
+    atoms->clear();
+    if (record.datagram.size() <= sizeof(android_log_header_t) + sizeof(uint32_t)) {
+        return;
+    }
+    const uint8_t* ptr = record.datagram.data() + sizeof(android_log_header_t);
+    uint32_t len = record.datagram.size() - sizeof(android_log_header_t);
+    uint32_t tag;
+    memcpy(&tag, ptr, sizeof(tag));
+    ptr += sizeof(tag);
+    len -= sizeof(tag);
+    if (tag != StatsSocketListener::kStatsEventBatchTag) {
+        atoms->push_back({ptr, len});
+        return;
+    }
+    while (len >= sizeof(uint16_t)) {
+        uint16_t recordSize;
+        memcpy(&recordSize, ptr, sizeof(recordSize));
+        ptr += sizeof(recordSize);
+        len -= sizeof(recordSize);
+        if (recordSize == 0 || recordSize > len) {
+            return;
+        }
+        atoms->push_back({ptr, recordSize});
+        ptr += recordSize;
+        len -= recordSize;
+    }
+}
+
+sp<AlarmMonitor> createInertAlarmMonitor() {
+    return new AlarmMonitor(
+            /* minDiffToUpdateRegisteredAlarmTimeSec */ 1,
+            [](const shared_ptr<IStatsCompanionService>&, int64_t) {},
+            [](const shared_ptr<IStatsCompanionService>&) {});
+}
+
+}  // anonymous namespace
+
+bool ConfigCostEstimator::estimate(const StatsdConfig& config,
+                                   const vector<DatagramRecord>& sample, const sp<UidMap>& uidMap,
+                                   ConfigCostEstimate* estimate) {
+    // Buckets start before the first event of the sample.
+    const int64_t timeBaseNs =
+            (sample.empty() ? getElapsedRealtimeNs() : sample.front().elapsedTimestampNs) -
+            NS_PER_SEC;
+    bool valid;
+    {
+        sp<MetricsManager> metricsManager = new MetricsManager(
+                kEstimateConfigKey, config, timeBaseNs, timeBaseNs, uidMap,
+                new StatsPullerManager(), createInertAlarmMonitor(), createInertAlarmMonitor(),
+                /*sharedConditions=*/nullptr, /*deferRegistration=*/true);
+        valid = metricsManager->isConfigValid();
+        if (valid) {
+            replay(*metricsManager, sample, estimate);
+        }
+    }
+    StatsdStats::getInstance().noteConfigRemoved(kEstimateConfigKey);
+    return valid;
+}
+
+void ConfigCostEstimator::replay(MetricsManager& metricsManager,
+                                 const vector<DatagramRecord>& sample,
+                                 ConfigCostEstimate* estimate) {
+    LogEventFilter::AtomIdSet atomIds;
+    metricsManager.addAllAtomIds(atomIds);
+    AtomFieldMasks fieldMasks;
+    metricsManager.addAllAtomFieldMasks(fieldMasks);
+
+    *estimate = ConfigCostEstimate();
+    std::unordered_map<int, int64_t> sampleEventCounts;
+    int64_t costNs = 0;
+    vector<AtomBuffer> atoms;
+    for (const DatagramRecord& record : sample) {
+        if (estimate->sampleEventCount >= kMaxReplayedEvents) {
+            break;
+        }
+        splitDatagram(record, &atoms);
+        for (const AtomBuffer& atom : atoms) {
+            LogEvent event(record.uid, record.pid);
+            const LogEvent::BodyBufferInfo bodyInfo = event.parseHeader(atom.buffer, atom.size);
+            if (!event.isValid() || atomIds.find(event.GetTagId()) == atomIds.end()) {
+                continue;
+            }
+            const int64_t startNs = getElapsedRealtimeNs();
+            event.setFieldMask(fieldMasks[event.GetTagId()]);
+            if (event.parseBody(bodyInfo)) {
+                metricsManager.onLogEvent(event);
+            }
+            costNs += getElapsedRealtimeNs() - startNs;
+            estimate->sampleEventCount++;
+            sampleEventCounts[event.GetTagId()]++;
+        }
+    }
+
+    if (estimate->sampleEventCount > 0) {
+        estimate->costPerEventNs = costNs / estimate->sampleEventCount;
+    }
+    estimate->memoryBytes = metricsManager.byteSize();
+    const int32_t nowSec = getWallClockSec();
+    const int64_t sampleDurationNs =
+            sample.empty() ? 0
+                           : sample.back().elapsedTimestampNs - sample.front().elapsedTimestampNs;
+    for (const int atomId : atomIds) {
+        const double rate = StatsdStats::getInstance().getPushedAtomLogRate({atomId}, nowSec);
+        const auto it = sampleEventCounts.find(atomId);
+        if (rate > 0 || it == sampleEventCounts.end() || sampleDurationNs <= 0) {
+            estimate->eventsPerSec += rate;
+            continue;
+        }
+        // Not counted, e.g. no config used the atom so the socket filter dropped it.
+        estimate->eventsPerSec += (double)it->second * NS_PER_SEC / sampleDurationNs;
+        estimate->rateFromSample = true;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
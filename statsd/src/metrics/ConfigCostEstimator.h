@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "packages/UidMap.h"
+#include "socket/DatagramRecorder.h"
+#include "src/statsd_config.pb.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+class MetricsManager;
+
+// The cost a config would have, see ConfigCostEstimator.
+struct ConfigCostEstimate {
+    // How many events of the atoms of the config are logged per second.
+    double eventsPerSec = 0;
+
+    // Whether eventsPerSec was measured on the sample for some atoms of the config, because
+    // StatsdStats had not counted them.
+    bool rateFromSample = false;
+
+    // The events of the sample that the config processed.
+    int64_t sampleEventCount = 0;
+
+    // The mean time to parse and process one of these events.
+    int64_t costPerEventNs = 0;
+
+    // The bytes held by the metrics of the config once the sample was processed.
+    size_t memoryBytes = 0;
+};
+
+/**
+ * Estimates the cost of a config before it is added, see adb shell cmd stats
+ * estimate-config-cost. The config is built in a MetricsManager of its own, that is not fed the
+ * traffic statsd receives, and a sample of that traffic recorded by DatagramRecorder is replayed
+ * through it.
+ *
+ * The rate of events comes from the atom counters of StatsdStats, which cover a longer time
+ * than the sample, or from the sample for the atoms StatsdStats did not count, such as those
+ * that no config used and the socket filter dropped. The cost per event and the memory come
+ * from the replay: the memory is only a steady-state estimate when the sample holds most of the
+ * dimensions a bucket of the config sees.
+ *
+ * Nothing is pulled and no alarm is registered, so pulled atoms and alerts are not counted. The
+ * metrics are not registered with the StateManager either, so the estimate runs without the lock
+ * of the StatsLogProcessor and sliced by state metrics only see the states statsd already tracks.
+ */
+class ConfigCostEstimator {
+public:
+    // The key the config is built with, so it does not replace the stats of a real config.
+    static const ConfigKey kEstimateConfigKey;
+
+    // Bounds the time the replay takes.
+    static constexpr int64_t kMaxReplayedEvents = 100000;
+
+    // Builds config and replays sample through it. Returns false if the config is invalid.
+    static bool estimate(const StatsdConfig& config, const std::vector<DatagramRecord>& sample,
+                         const sp<UidMap>& uidMap, ConfigCostEstimate* estimate);
+
+private:
+    // Feeds the atoms of sample that metricsManager uses to it and measures their cost.
+    static void replay(MetricsManager& metricsManager, const std::vector<DatagramRecord>& sample,
+                       ConfigCostEstimate* estimate);
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
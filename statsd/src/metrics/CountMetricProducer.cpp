@@ -23,10 +23,13 @@
 #include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "guardrail/StatsdStats.h"
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "stats_log_util.h"
 #include "stats_util.h"
+#include "utils/StatsdTrace.h"
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BOOL;
@@ -38,6 +41,7 @@ using android::util::FIELD_TYPE_STRING;
 using android::util::ProtoOutputStream;
 using std::map;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 using std::shared_ptr;
@@ -62,12 +66,14 @@ const int FIELD_ID_DIMENSION_IN_WHAT = 1;
 const int FIELD_ID_SLICE_BY_STATE = 6;
 const int FIELD_ID_BUCKET_INFO = 3;
 const int FIELD_ID_DIMENSION_LEAF_IN_WHAT = 4;
+const int FIELD_ID_DIMENSION_INDEX_IN_WHAT = 7;
 // for CountBucketInfo
 const int FIELD_ID_COUNT = 3;
 const int FIELD_ID_BUCKET_NUM = 4;
 const int FIELD_ID_START_BUCKET_ELAPSED_MILLIS = 5;
 const int FIELD_ID_END_BUCKET_ELAPSED_MILLIS = 6;
 const int FIELD_ID_CONDITION_TRUE_NS = 7;
+const int FIELD_ID_COUNT_ERROR = 8;
 
 CountMetricProducer::CountMetricProducer(
         const ConfigKey& key, const CountMetric& metric, const int conditionIndex,
@@ -82,7 +88,10 @@ CountMetricProducer::CountMetricProducer(
                      stateGroupMap, getAppUpgradeBucketSplit(metric)),
       mDimensionGuardrailHit(false),
       mDimensionHardLimit(
-              StatsdStats::clampDimensionKeySizeLimit(metric.max_dimensions_per_bucket())) {
+              StatsdStats::clampDimensionKeySizeLimit(metric.max_dimensions_per_bucket())),
+      mTopKDimensions(metric.has_top_k_dimensions()
+                              ? std::min<size_t>(metric.top_k_dimensions(), mDimensionHardLimit)
+                              : 0) {
     if (metric.has_bucket()) {
         mBucketSizeNs =
                 TimeUnitToBucketSizeInMillisGuardrailed(key.GetUid(), metric.bucket()) * 1000000;
@@ -103,6 +112,7 @@ CountMetricProducer::CountMetricProducer(
             mc.conditionId = link.condition();
             translateFieldMatcher(link.fields_in_what(), &mc.metricFields);
             translateFieldMatcher(link.fields_in_condition(), &mc.conditionFields);
+            mc.projection = compileLinkProjection(mc.metricFields, mc.conditionFields);
             mMetric2ConditionLinks.push_back(mc);
         }
         mConditionSliced = true;
@@ -113,6 +123,7 @@ CountMetricProducer::CountMetricProducer(
         ms.stateAtomId = stateLink.state_atom_id();
         translateFieldMatcher(stateLink.fields_in_what(), &ms.metricFields);
         translateFieldMatcher(stateLink.fields_in_state(), &ms.stateFields);
+        ms.projection = compileLinkProjection(ms.metricFields, ms.stateFields);
         mMetric2StateLinks.push_back(ms);
     }
 
@@ -214,30 +225,82 @@ void CountMetricProducer::onSlicedConditionMayChangeLocked(bool overallCondition
 
 void CountMetricProducer::clearPastBucketsLocked(const int64_t dumpTimeNs) {
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
+    mDimensionOverflowSketch.reset();
 }
 
 void CountMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
                                              const bool include_current_partial_bucket,
                                              const bool erase_data, const DumpLatency dumpLatency,
-                                             std::set<string>* str_set,
+                                             StringSet* str_set,
                                              ProtoOutputStream* protoOutput) {
+    DumpReportData data =
+            takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket, erase_data);
+    writeDumpReportData(data, str_set, protoOutput);
+    if (!erase_data) {
+        mPastBuckets.swap(data.pastBuckets);
+        mPastBucketsByteSize = data.pastBucketsByteSize;
+    }
+}
+
+unique_ptr<MetricProducer::DumpReportSnapshot> CountMetricProducer::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    if (!erase_data) {
+        // The data stays in the producer, so it is encoded now rather than copied.
+        return MetricProducer::takeDumpReportSnapshotLocked(
+                dumpTimeNs, include_current_partial_bucket, erase_data, dumpLatency, hashStrings);
+    }
+    return std::make_unique<DetachedDumpReportSnapshot<CountMetricProducer>>(
+            this, takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket, erase_data));
+}
+
+CountMetricProducer::DumpReportData CountMetricProducer::takeDumpReportDataLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+        const bool erase_data) {
     if (include_current_partial_bucket) {
         flushLocked(dumpTimeNs);
     } else {
         flushIfNeededLocked(dumpTimeNs);
     }
 
+    DumpReportData data;
+    data.isActive = isActiveLocked();
+    data.dimensionGuardrailHit = mDimensionGuardrailHit;
+    data.dimensionDictionary = mDimensionDictionaryInReport;
+    // We only write the condition timer value if the metric has a
+    // condition and isn't sliced by state or condition.
+    // TODO(b/268531179): Slice the condition timer by state and condition
+    data.hasConditionTimer =
+            mConditionTrackerIndex >= 0 && mSlicedStateAtoms.empty() && !mConditionSliced;
+    data.pastBuckets.swap(mPastBuckets);
+    data.pastBucketsByteSize = mPastBucketsByteSize;
+    mPastBucketsByteSize = 0;
+    if (erase_data && !data.pastBuckets.empty()) {
+        mDimensionGuardrailHit = false;
+        data.dimensionOverflowSketch.swap(mDimensionOverflowSketch);
+    } else if (!erase_data) {
+        // Written before the producer is unlocked, so the sketch can be shared.
+        data.dimensionOverflowSketch = mDimensionOverflowSketch;
+    }
+    return data;
+}
+
+void CountMetricProducer::writeDumpReportData(const DumpReportData& data,
+                                              StringSet* str_set,
+                                              ProtoOutputStream* protoOutput) const {
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ID, (long long)mMetricId);
-    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, isActiveLocked());
+    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, data.isActive);
 
-    if (mPastBuckets.empty()) {
+    if (data.pastBuckets.empty()) {
         return;
     }
 
-    if (mDimensionGuardrailHit) {
+    if (data.dimensionGuardrailHit) {
         protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_DIMENSION_GUARDRAIL_HIT,
-                           mDimensionGuardrailHit);
+                           data.dimensionGuardrailHit);
     }
+    writeDimensionOverflowSketch(data.dimensionOverflowSketch, str_set, protoOutput);
 
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_TIME_BASE, (long long)mTimeBaseNs);
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_BUCKET_SIZE, (long long)mBucketSizeNs);
@@ -252,9 +315,15 @@ void CountMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         }
     }
 
+    // Only set if the dimensions are written to the dictionary rather than to each data.
+    optional<DimensionDictionary> dimensionDictionary;
+    if (data.dimensionDictionary) {
+        dimensionDictionary.emplace(mShouldUseNestedDimensions);
+    }
+
     uint64_t protoToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_COUNT_METRICS);
 
-    for (const auto& counter : mPastBuckets) {
+    for (const auto& counter : data.pastBuckets) {
         const MetricDimensionKey& dimensionKey = counter.first;
         VLOG("  dimension key %s", dimensionKey.toString().c_str());
 
@@ -262,7 +331,10 @@ void CountMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_DATA);
 
         // First fill dimension.
-        if (mShouldUseNestedDimensions) {
+        if (dimensionDictionary) {
+            protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_DIMENSION_INDEX_IN_WHAT,
+                               dimensionDictionary->indexOf(dimensionKey.getDimensionKeyInWhat()));
+        } else if (mShouldUseNestedDimensions) {
             uint64_t dimensionToken = protoOutput->start(
                     FIELD_TYPE_MESSAGE | FIELD_ID_DIMENSION_IN_WHAT);
             writeDimensionToProto(dimensionKey.getDimensionKeyInWhat(), str_set, protoOutput);
@@ -294,13 +366,14 @@ void CountMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
             }
             protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_COUNT, (long long)bucket.mCount);
 
-            // We only write the condition timer value if the metric has a
-            // condition and isn't sliced by state or condition.
-            // TODO(b/268531179): Slice the condition timer by state and condition
-            if (mConditionTrackerIndex >= 0 && mSlicedStateAtoms.empty() && !mConditionSliced) {
+            if (data.hasConditionTimer) {
                 protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_CONDITION_TRUE_NS,
                                    (long long)bucket.mConditionTrueNs);
             }
+            if (bucket.mCountError > 0) {
+                protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_COUNT_ERROR,
+                                   (long long)bucket.mCountError);
+            }
 
             protoOutput->end(bucketInfoToken);
             VLOG("\t bucket [%lld - %lld] count: %lld", (long long)bucket.mBucketStartNs,
@@ -310,10 +383,8 @@ void CountMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
     }
 
     protoOutput->end(protoToken);
-
-    if (erase_data) {
-        mPastBuckets.clear();
-        mDimensionGuardrailHit = false;
+    if (dimensionDictionary) {
+        dimensionDictionary->writeToProto(str_set, protoOutput);
     }
 }
 
@@ -321,6 +392,7 @@ void CountMetricProducer::dropDataLocked(const int64_t dropTimeNs) {
     flushIfNeededLocked(dropTimeNs);
     StatsdStats::getInstance().noteBucketDropped(mMetricId);
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
 }
 
 void CountMetricProducer::onConditionChangedLocked(const bool conditionMet,
@@ -345,7 +417,7 @@ bool CountMetricProducer::hitGuardRailLocked(const MetricDimensionKey& newKey) {
         size_t newTupleCount = mCurrentSlicedCounter->size() + 1;
         StatsdStats::getInstance().noteMetricDimensionSize(mConfigKey, mMetricId, newTupleCount);
         // 2. Don't add more tuples, we are above the allowed threshold. Drop the data.
-        if (newTupleCount > mDimensionHardLimit) {
+        if (newTupleCount > getDimensionHardLimitLocked(mDimensionHardLimit)) {
             if (!mHasHitGuardrail) {
                 ALOGE("CountMetric %lld dropping data for dimension key %s", (long long)mMetricId,
                       newKey.toString().c_str());
@@ -360,6 +432,17 @@ bool CountMetricProducer::hitGuardRailLocked(const MetricDimensionKey& newKey) {
     return false;
 }
 
+void CountMetricProducer::replaceLowestCounterLocked(const MetricDimensionKey& newKey) {
+    auto lowest = std::min_element(
+            mCurrentSlicedCounter->begin(), mCurrentSlicedCounter->end(),
+            [](const auto& a, const auto& b) { return a.second < b.second; });
+    const int64_t lowestCount = lowest->second;
+    mCurrentCountErrors.erase(lowest->first);
+    mCurrentSlicedCounter->erase(lowest);
+    (*mCurrentSlicedCounter)[newKey] = lowestCount + 1;
+    mCurrentCountErrors[newKey] = lowestCount;
+}
+
 void CountMetricProducer::onMatchedLogEventInternalLocked(
         const size_t matcherIndex, const MetricDimensionKey& eventKey,
         const ConditionKey& conditionKey, bool condition, const LogEvent& event,
@@ -372,9 +455,13 @@ void CountMetricProducer::onMatchedLogEventInternalLocked(
     }
 
     auto it = mCurrentSlicedCounter->find(eventKey);
-    if (it == mCurrentSlicedCounter->end()) {
+    if (it == mCurrentSlicedCounter->end() && mTopKDimensions > 0 &&
+        mCurrentSlicedCounter->size() >= mTopKDimensions) {
+        replaceLowestCounterLocked(eventKey);
+    } else if (it == mCurrentSlicedCounter->end()) {
         // ===========GuardRail==============
         if (hitGuardRailLocked(eventKey)) {
+            noteDimensionOverflowLocked(eventKey);
             return;
         }
         // create a counter for the new key
@@ -438,6 +525,8 @@ bool CountMetricProducer::countPassesThreshold(const int64_t count) {
 
 void CountMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
                                                    const int64_t nextBucketStartTimeNs) {
+    STATSD_TRACE("MetricProducer::flushCurrentBucket config=%d:%lld metric=%lld",
+                 mConfigKey.GetUid(), (long long)mConfigKey.GetId(), (long long)mMetricId);
     int64_t fullBucketEndTimeNs = getCurrentBucketEndTimeNs();
     CountBucket info;
     info.mBucketStartNs = mCurrentBucketStartTimeNs;
@@ -454,8 +543,11 @@ void CountMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
     for (const auto& counter : *mCurrentSlicedCounter) {
         if (countPassesThreshold(counter.second)) {
             info.mCount = counter.second;
+            const auto error = mCurrentCountErrors.find(counter.first);
+            info.mCountError = error != mCurrentCountErrors.end() ? error->second : 0;
             auto& bucketList = mPastBuckets[counter.first];
             bucketList.push_back(info);
+            mPastBucketsByteSize += kBucketSize;
             VLOG("metric %lld, dump key value: %s -> %lld", (long long)mMetricId,
                  counter.first.toString().c_str(), (long long)counter.second);
         }
@@ -470,15 +562,11 @@ void CountMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
                 for (const auto& keyValuePair : *mCurrentSlicedCounter) {
                     (*mCurrentFullCounters)[keyValuePair.first] += keyValuePair.second;
                 }
-                for (auto& tracker : mAnomalyTrackers) {
-                    tracker->addPastBucket(mCurrentFullCounters, mCurrentBucketNum);
-                }
-                mCurrentFullCounters = std::make_shared<DimToValMap>();
+                addPastBucketToAnomalyTrackersLocked(mCurrentFullCounters);
+                mCurrentFullCounters->clear();
             } else {
                 // Skip aggregating the partial buckets since there's no previous partial bucket.
-                for (auto& tracker : mAnomalyTrackers) {
-                    tracker->addPastBucket(mCurrentSlicedCounter, mCurrentBucketNum);
-                }
+                addPastBucketToAnomalyTrackersLocked(mCurrentSlicedCounter);
             }
         } else {
             // Accumulate partial bucket.
@@ -489,23 +577,34 @@ void CountMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
     }
 
     StatsdStats::getInstance().noteBucketCount(mMetricId);
-    // Only resets the counters, but doesn't setup the times nor numbers.
-    // (Do not clear since the old one is still referenced in mAnomalyTrackers).
-    mCurrentSlicedCounter = std::make_shared<DimToValMap>();
+    noteBucketDimensionCountLocked(mCurrentSlicedCounter->size());
+    // Only resets the counters, but doesn't setup the times nor numbers. The anomaly trackers
+    // copy the values they need, so the table is cleared in place and keeps its capacity for the
+    // next bucket.
+    mCurrentSlicedCounter->clear();
+    mCurrentCountErrors.clear();
     mCurrentBucketStartTimeNs = nextBucketStartTimeNs;
     // Reset mHasHitGuardrail boolean since bucket was reset
     mHasHitGuardrail = false;
 }
 
+void CountMetricProducer::addPastBucketToAnomalyTrackersLocked(
+        const std::shared_ptr<DimToValMap>& bucket) {
+    for (auto& tracker : mAnomalyTrackers) {
+        tracker->addPastBucket(bucket, mCurrentBucketNum);
+    }
+}
+
 // Rough estimate of CountMetricProducer buffer stored. This number will be
 // greater than actual data size as it contains each dimension of
 // CountMetricData is  duplicated.
 size_t CountMetricProducer::byteSizeLocked() const {
-    size_t totalSize = 0;
-    for (const auto& pair : mPastBuckets) {
-        totalSize += pair.second.size() * kBucketSize;
-    }
-    return totalSize;
+    return mPastBucketsByteSize;
+}
+
+size_t CountMetricProducer::currentStateByteSizeLocked() const {
+    return dimensionMapByteSize(*mCurrentSlicedCounter) +
+           dimensionMapByteSize(*mCurrentFullCounters) + dimensionMapByteSize(mCurrentCountErrors);
 }
 
 void CountMetricProducer::onActiveStateChangedLocked(const int64_t eventTimeNs,
@@ -519,6 +618,20 @@ void CountMetricProducer::onActiveStateChangedLocked(const int64_t eventTimeNs,
     mConditionTimer.onConditionChanged(isActive, eventTimeNs);
 }
 
+void CountMetricProducer::hibernateLocked() {
+    // The tables are cleared in place when a bucket is flushed, keeping their capacity.
+    if (mCurrentSlicedCounter->empty()) {
+        *mCurrentSlicedCounter = DimToValMap();
+    }
+    if (mCurrentCountErrors.empty()) {
+        mCurrentCountErrors = DimToValMap();
+    }
+    // Partial buckets that the anomaly trackers have not seen yet are kept.
+    if (mCurrentFullCounters->empty()) {
+        *mCurrentFullCounters = DimToValMap();
+    }
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -39,9 +39,11 @@ struct CountBucket {
     int64_t mBucketEndNs;
     int64_t mCount;
     int64_t mConditionTrueNs;
+    // How much mCount may be over the true count, for metrics that only keep the top dimensions.
+    int64_t mCountError;
 };
 
-class CountMetricProducer : public MetricProducer {
+class CountMetricProducer final : public MetricProducer {
 public:
     CountMetricProducer(
             const ConfigKey& key, const CountMetric& countMetric, int conditionIndex,
@@ -63,6 +65,12 @@ public:
         return METRIC_TYPE_COUNT;
     }
 
+    // Same as onMatchedLogEvent, with the calls into this class resolved statically.
+    void onMatchedCountLogEvent(const size_t matcherIndex, const LogEvent& event) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        onMatchedLogEventAsLocked<CountMetricProducer>(matcherIndex, event, nullptr);
+    }
+
 protected:
     void onMatchedLogEventInternalLocked(
             const size_t matcherIndex, const MetricDimensionKey& eventKey,
@@ -75,9 +83,36 @@ private:
                             const bool include_current_partial_bucket,
                             const bool erase_data,
                             const DumpLatency dumpLatency,
-                            std::set<string> *str_set,
+                            StringSet* str_set,
                             android::util::ProtoOutputStream* protoOutput) override;
 
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings) override;
+
+    // The state a dump report is written from, other than the members fixed at construction.
+    struct DumpReportData {
+        bool isActive = false;
+        bool dimensionGuardrailHit = false;
+        bool dimensionDictionary = false;
+        bool hasConditionTimer = false;
+        FlatHashMap<MetricDimensionKey, std::vector<CountBucket>> pastBuckets;
+        size_t pastBucketsByteSize = 0;
+        std::shared_ptr<DimensionOverflowSketch> dimensionOverflowSketch;
+    };
+
+    // Flushes, then swaps mPastBuckets out into the returned data.
+    DumpReportData takeDumpReportDataLocked(const int64_t dumpTimeNs,
+                                            const bool include_current_partial_bucket,
+                                            const bool erase_data);
+
+    void writeDumpReportData(const DumpReportData& data, StringSet* str_set,
+                             android::util::ProtoOutputStream* protoOutput) const;
+
+    friend class DetachedDumpReportSnapshot<CountMetricProducer>;
+    // Calls onMatchedLogEventInternalLocked from onMatchedLogEventAsLocked.
+    friend class MetricProducer;
+
     void clearPastBucketsLocked(const int64_t dumpTimeNs) override;
 
     // Internal interface to handle condition change.
@@ -89,6 +124,8 @@ private:
     // Internal function to calculate the current used bytes.
     size_t byteSizeLocked() const override;
 
+    size_t currentStateByteSizeLocked() const override;
+
     void dumpStatesLocked(int out, bool verbose) const override;
 
     void dropDataLocked(const int64_t dropTimeNs) override;
@@ -96,10 +133,16 @@ private:
     // Util function to flush the old packet.
     void flushIfNeededLocked(int64_t newEventTime) override;
 
+    size_t getOwnDimensionHardLimitLocked() const override {
+        return mDimensionHardLimit;
+    }
+
     void flushCurrentBucketLocked(int64_t eventTimeNs, int64_t nextBucketStartTimeNs) override;
 
     void onActiveStateChangedLocked(const int64_t eventTimeNs, const bool isActive) override;
 
+    void hibernateLocked() override;
+
     optional<InvalidConfigReason> onConfigUpdatedLocked(
             const StatsdConfig& config, int configIndex, int metricIndex,
             const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
@@ -116,7 +159,11 @@ private:
             std::unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
             std::vector<int>& metricsWithActivation) override;
 
-    std::unordered_map<MetricDimensionKey, std::vector<CountBucket>> mPastBuckets;
+    FlatHashMap<MetricDimensionKey, std::vector<CountBucket>> mPastBuckets;
+
+    // The bytes used by mPastBuckets, kept up to date as buckets are added and cleared so that
+    // byteSizeLocked() does not iterate them.
+    size_t mPastBucketsByteSize = 0;
 
     // The current bucket (may be a partial bucket).
     std::shared_ptr<DimToValMap> mCurrentSlicedCounter = std::make_shared<DimToValMap>();
@@ -129,6 +176,13 @@ private:
 
     bool hitGuardRailLocked(const MetricDimensionKey& newKey);
 
+    // Space-saving replacement for the top dimensions mode: the new key takes over the counter of
+    // the dimension with the lowest count, and inherits that count as its error.
+    void replaceLowestCounterLocked(const MetricDimensionKey& newKey);
+
+    // Adds bucket as the past bucket mCurrentBucketNum of every anomaly tracker.
+    void addPastBucketToAnomalyTrackersLocked(const std::shared_ptr<DimToValMap>& bucket);
+
     bool countPassesThreshold(int64_t count);
 
     // Tracks if the dimension guardrail has been hit in the current report.
@@ -136,13 +190,27 @@ private:
 
     const size_t mDimensionHardLimit;
 
+    // The number of dimensions counted in each bucket when top_k_dimensions is set, 0 otherwise.
+    const size_t mTopKDimensions;
+
+    // The count error of the dimensions of the current bucket that took over another dimension's
+    // counter. Only used when mTopKDimensions is set.
+    DimToValMap mCurrentCountErrors;
+
     FRIEND_TEST(CountMetricProducerTest, TestNonDimensionalEvents);
+    FRIEND_TEST(CountMetricProducerTest, TestByteSize);
+    FRIEND_TEST(CountMetricProducerTest, TestHibernateWhenInactive);
+    FRIEND_TEST(CountMetricProducerTest, TestCurrentStateByteSize);
+    FRIEND_TEST(CountMetricProducerTest, TestDumpReportSnapshot);
     FRIEND_TEST(CountMetricProducerTest, TestEventsWithNonSlicedCondition);
     FRIEND_TEST(CountMetricProducerTest, TestEventsWithSlicedCondition);
     FRIEND_TEST(CountMetricProducerTest, TestAnomalyDetectionUnSliced);
+    FRIEND_TEST(CountMetricProducerTest, TestCounterTableReusedAcrossBuckets);
     FRIEND_TEST(CountMetricProducerTest, TestFirstBucket);
     FRIEND_TEST(CountMetricProducerTest, TestOneWeekTimeUnit);
     FRIEND_TEST(CountMetricProducerTest, TestSplitOnAppUpgradeDisabled);
+    FRIEND_TEST(CountMetricProducerTest, TestTopKDimensions);
+    FRIEND_TEST(CountMetricProducerTest, TestDimensionBudgetShared);
 
     FRIEND_TEST(CountMetricProducerTest_PartialBucket, TestSplitInCurrentBucket);
     FRIEND_TEST(CountMetricProducerTest_PartialBucket, TestSplitInNextBucket);
@@ -150,6 +218,7 @@ private:
     FRIEND_TEST(MetricsManagerUtilDimLimitTest, TestDimLimit);
 
     FRIEND_TEST(ConfigUpdateDimLimitTest, TestDimLimit);
+    FRIEND_TEST(MetricsManagerTest, TestScratchBuffersResetBetweenEvents);
 };
 
 }  // namespace statsd
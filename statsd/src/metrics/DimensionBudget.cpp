@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "metrics/DimensionBudget.h"
+
+#include <algorithm>
+
+#include "guardrail/StatsdStats.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+size_t DimensionBudget::addMetric(size_t hardLimit) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mShares.push_back({hardLimit, hardLimit});
+    return mShares.size() - 1;
+}
+
+size_t DimensionBudget::rebalance(size_t slot, size_t dimensionCount, bool hitLimit) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Share& share = mShares[slot];
+    if (hitLimit) {
+        const size_t wanted = std::max(
+                share.limit,
+                std::min<size_t>(share.limit * 2, StatsdStats::kDimensionKeySizeHardLimitMax));
+        const size_t granted = std::min(wanted - share.limit, mFreeDimensionCount);
+        share.limit += granted;
+        mFreeDimensionCount -= granted;
+        VLOG("Dimension share of slot %zu grew by %zu to %zu", slot, granted, share.limit);
+    } else {
+        // Keeps room for the cardinality to grow by half before the next bucket.
+        const size_t needed =
+                std::max(std::max<size_t>(share.hardLimit / 2, 1), dimensionCount * 3 / 2 + 1);
+        if (needed < share.limit) {
+            mFreeDimensionCount += share.limit - needed;
+            share.limit = needed;
+        }
+    }
+    return share.limit;
+}
+
+size_t DimensionBudget::getFreeDimensionCount() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFreeDimensionCount;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
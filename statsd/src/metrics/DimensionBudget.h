@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <mutex>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Shares the dimension keys of a config between its metrics by the cardinality they observe.
+ *
+ * The budget holds the sum of the hard dimension limits the metrics would have on their own, so
+ * that the config never keeps more dimension keys than it would with static limits. Every metric
+ * starts with its own limit as its share. When a bucket closes, a metric whose share went unused
+ * gives the keys it does not need back to the budget, down to half of its own limit, and a metric
+ * that dropped dimensions doubles its share, as far as the returned keys allow and up to
+ * StatsdStats::kDimensionKeySizeHardLimitMax.
+ *
+ * This class is thread-safe: metrics of a config may close their buckets on different threads.
+ */
+class DimensionBudget {
+public:
+    // Adds a metric with the given hard dimension limit to the budget. Returns the slot passed to
+    // rebalance().
+    size_t addMetric(size_t hardLimit);
+
+    // Resizes the share of the metric in slot after a bucket in which it had dimensionCount
+    // dimension keys and, if hitLimit, dropped dimensions. Returns the new share.
+    size_t rebalance(size_t slot, size_t dimensionCount, bool hitLimit);
+
+    // Dimension keys that no metric has in its share.
+    size_t getFreeDimensionCount() const;
+
+private:
+    struct Share {
+        // The limit of the metric on its own.
+        size_t hardLimit;
+        size_t limit;
+    };
+
+    mutable std::mutex mMutex;
+
+    std::vector<Share> mShares;
+
+    size_t mFreeDimensionCount = 0;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
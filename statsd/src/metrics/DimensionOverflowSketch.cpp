@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "DimensionOverflowSketch.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "stats_log_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using android::util::FIELD_COUNT_REPEATED;
+using android::util::FIELD_TYPE_INT64;
+using android::util::FIELD_TYPE_MESSAGE;
+using android::util::ProtoOutputStream;
+using std::string;
+using std::vector;
+
+namespace {
+
+// for DimensionOverflowSketch
+const int FIELD_ID_DROPPED_EVENT_COUNT = 1;
+const int FIELD_ID_ESTIMATED_DROPPED_DIMENSION_COUNT = 2;
+const int FIELD_ID_HEAVY_HITTERS = 3;
+// for DimensionOverflowSketch.HeavyHitter
+const int FIELD_ID_HEAVY_HITTER_DIMENSION = 1;
+const int FIELD_ID_HEAVY_HITTER_COUNT = 2;
+
+// Spreads the 32 bits of a dimension hash over 64, so that both the register index and the rank
+// of the HyperLogLog, and the rows of the count-min sketch, get well mixed bits.
+uint64_t mix64(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+}  // anonymous namespace
+
+void DimensionOverflowSketch::add(const HashableDimensionKey& dimensionInWhat) {
+    mDroppedEventCount++;
+    const uint64_t hash = mix64(std::hash<HashableDimensionKey>{}(dimensionInWhat));
+
+    // The top bits pick the register, which keeps the longest run of leading zeros seen in the
+    // other bits.
+    const size_t index = hash >> (64 - kRegisterBits);
+    const uint64_t rest = hash << kRegisterBits;
+    const uint8_t rank = rest == 0 ? 64 - kRegisterBits + 1 : __builtin_clzll(rest) + 1;
+    mRegisters[index] = std::max(mRegisters[index], rank);
+
+    const uint32_t estimatedCount = addToCountMin(hash);
+    for (HeavyHitter& heavyHitter : mHeavyHitters) {
+        if (heavyHitter.dimensionInWhat == dimensionInWhat) {
+            heavyHitter.estimatedCount = estimatedCount;
+            return;
+        }
+    }
+    if (mHeavyHitters.size() < kMaxHeavyHitters) {
+        mHeavyHitters.push_back({dimensionInWhat, estimatedCount});
+        return;
+    }
+    auto lightest = std::min_element(mHeavyHitters.begin(), mHeavyHitters.end(),
+                                     [](const HeavyHitter& a, const HeavyHitter& b) {
+                                         return a.estimatedCount < b.estimatedCount;
+                                     });
+    if (estimatedCount > lightest->estimatedCount) {
+        *lightest = {dimensionInWhat, estimatedCount};
+    }
+}
+
+uint32_t DimensionOverflowSketch::addToCountMin(uint64_t hash) {
+    // Each row is indexed by its own combination of the two halves of the hash.
+    const uint32_t hash1 = hash;
+    const uint32_t hash2 = hash >> 32;
+    uint32_t estimatedCount = UINT32_MAX;
+    for (size_t row = 0; row < kCountMinDepth; row++) {
+        uint32_t& counter = mCountMin[row][(hash1 + row * hash2) % kCountMinWidth];
+        if (counter < UINT32_MAX) {
+            counter++;
+        }
+        estimatedCount = std::min(estimatedCount, counter);
+    }
+    return estimatedCount;
+}
+
+int64_t DimensionOverflowSketch::estimateDistinctDimensionCount() const {
+    const double registerCount = kRegisterCount;
+    double sum = 0;
+    int zeroRegisters = 0;
+    for (uint8_t rank : mRegisters) {
+        sum += ldexp(1.0, -rank);
+        if (rank == 0) {
+            zeroRegisters++;
+        }
+    }
+    const double alpha = 0.7213 / (1 + 1.079 / registerCount);
+    double estimate = alpha * registerCount * registerCount / sum;
+    if (estimate <= 2.5 * registerCount && zeroRegisters > 0) {
+        // Linear counting is more accurate for small cardinalities.
+        estimate = registerCount * log(registerCount / zeroRegisters);
+    }
+    return std::min<int64_t>(llround(estimate), mDroppedEventCount);
+}
+
+vector<DimensionOverflowSketch::HeavyHitter> DimensionOverflowSketch::getHeavyHitters() const {
+    vector<HeavyHitter> heavyHitters = mHeavyHitters;
+    std::sort(heavyHitters.begin(), heavyHitters.end(),
+              [](const HeavyHitter& a, const HeavyHitter& b) {
+                  return a.estimatedCount > b.estimatedCount;
+              });
+    return heavyHitters;
+}
+
+void DimensionOverflowSketch::writeToProto(StringSet* strSet,
+                                           ProtoOutputStream* protoOutput) const {
+    protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_DROPPED_EVENT_COUNT,
+                       (long long)mDroppedEventCount);
+    protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ESTIMATED_DROPPED_DIMENSION_COUNT,
+                       (long long)estimateDistinctDimensionCount());
+    for (const HeavyHitter& heavyHitter : getHeavyHitters()) {
+        const uint64_t heavyHitterToken = protoOutput->start(
+                FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_HEAVY_HITTERS);
+        const uint64_t dimensionToken =
+                protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_HEAVY_HITTER_DIMENSION);
+        writeDimensionToProto(heavyHitter.dimensionInWhat, strSet, protoOutput);
+        protoOutput->end(dimensionToken);
+        protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_HEAVY_HITTER_COUNT,
+                           (long long)heavyHitter.estimatedCount);
+        protoOutput->end(heavyHitterToken);
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
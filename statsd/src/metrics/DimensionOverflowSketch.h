@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/util/ProtoOutputStream.h>
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "HashableDimensionKey.h"
+#include "stats_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Summarizes the events a metric drops because their dimensions in what are over the dimension
+ * guardrail: how many events were dropped, a HyperLogLog estimate of how many distinct dimensions
+ * they had, and the heaviest of those dimensions, counted with a count-min sketch. It takes a
+ * fixed amount of memory however many dimensions overflow.
+ */
+class DimensionOverflowSketch {
+public:
+    struct HeavyHitter {
+        HashableDimensionKey dimensionInWhat;
+        // Never below the number of dropped events of the dimension.
+        int64_t estimatedCount;
+    };
+
+    static constexpr size_t kMaxHeavyHitters = 5;
+
+    void add(const HashableDimensionKey& dimensionInWhat);
+
+    inline int64_t getDroppedEventCount() const {
+        return mDroppedEventCount;
+    }
+
+    int64_t estimateDistinctDimensionCount() const;
+
+    // Sorted by decreasing estimated count.
+    std::vector<HeavyHitter> getHeavyHitters() const;
+
+    // Writes the fields of a DimensionOverflowReport message.
+    void writeToProto(StringSet* strSet,
+                      android::util::ProtoOutputStream* protoOutput) const;
+
+private:
+    // 2^kRegisterBits HyperLogLog registers, for a standard error of about 3%.
+    static constexpr int kRegisterBits = 10;
+    static constexpr size_t kRegisterCount = 1 << kRegisterBits;
+
+    static constexpr size_t kCountMinDepth = 4;
+    static constexpr size_t kCountMinWidth = 256;
+
+    // Adds the event to the count-min sketch and returns the estimated count of its dimension.
+    uint32_t addToCountMin(uint64_t hash);
+
+    int64_t mDroppedEventCount = 0;
+
+    std::array<uint8_t, kRegisterCount> mRegisters = {};
+
+    std::array<std::array<uint32_t, kCountMinWidth>, kCountMinDepth> mCountMin = {};
+
+    std::vector<HeavyHitter> mHeavyHitters;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -20,6 +20,7 @@
 
 #include "DurationMetricProducer.h"
 
+#include <algorithm>
 #include <limits.h>
 #include <stdlib.h>
 
@@ -27,6 +28,7 @@
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "stats_log_util.h"
 #include "stats_util.h"
+#include "utils/StatsdTrace.h"
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BOOL;
@@ -37,6 +39,7 @@ using android::util::FIELD_TYPE_MESSAGE;
 using android::util::FIELD_TYPE_STRING;
 using android::util::ProtoOutputStream;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 using std::shared_ptr;
@@ -59,6 +62,7 @@ const int FIELD_ID_DATA = 1;
 const int FIELD_ID_DIMENSION_IN_WHAT = 1;
 const int FIELD_ID_BUCKET_INFO = 3;
 const int FIELD_ID_DIMENSION_LEAF_IN_WHAT = 4;
+const int FIELD_ID_DIMENSION_INDEX_IN_WHAT = 7;
 const int FIELD_ID_SLICE_BY_STATE = 6;
 // for DurationBucketInfo
 const int FIELD_ID_DURATION = 3;
@@ -85,6 +89,7 @@ DurationMetricProducer::DurationMetricProducer(
       mStopIndex(stopIndex),
       mStopAllIndex(stopAllIndex),
       mNested(nesting),
+      mLazyBucketFlush(metric.lazy_bucket_flush()),
       mContainANYPositionInInternalDimensions(false),
       mDimensionHardLimit(
               StatsdStats::clampDimensionKeySizeLimit(metric.max_dimensions_per_bucket())) {
@@ -130,6 +135,7 @@ DurationMetricProducer::DurationMetricProducer(
             mc.conditionId = link.condition();
             translateFieldMatcher(link.fields_in_what(), &mc.metricFields);
             translateFieldMatcher(link.fields_in_condition(), &mc.conditionFields);
+            mc.projection = compileLinkProjection(mc.metricFields, mc.conditionFields);
             if (!subsetDimensions(mc.metricFields, mInternalDimensions)) {
                 ALOGE(("Condition links must be a subset of the internal dimensions"));
                 // TODO: Add invalidConfigReason
@@ -146,6 +152,7 @@ DurationMetricProducer::DurationMetricProducer(
         ms.stateAtomId = stateLink.state_atom_id();
         translateFieldMatcher(stateLink.fields_in_what(), &ms.metricFields);
         translateFieldMatcher(stateLink.fields_in_state(), &ms.stateFields);
+        ms.projection = compileLinkProjection(ms.metricFields, ms.stateFields);
         if (!subsetDimensions(ms.metricFields, mInternalDimensions)) {
             ALOGE(("State links must be a subset of the dimensions in what  internal dimensions"));
             // TODO: Add invalidConfigReason
@@ -258,6 +265,8 @@ optional<InvalidConfigReason> DurationMetricProducer::onConfigUpdatedLocked(
     for (const auto& it : mCurrentSlicedDurationTrackerMap) {
         it.second->onConfigUpdated(wizard, mConditionTrackerIndex);
     }
+    // The pooled trackers hold the old wizard and condition.
+    mDurationTrackerPool.clear();
 
     return nullopt;
 }
@@ -270,7 +279,7 @@ void DurationMetricProducer::initTrueDimensions(const int whatIndex, const int64
     if (whatIndex == -1) {
         return;
     }
-    const map<HashableDimensionKey, int>* slicedWhatMap = mWizard->getSlicedDimensionMap(whatIndex);
+    const unordered_map<HashableDimensionKey, int>* slicedWhatMap = mWizard->getSlicedDimensionMap(whatIndex);
     for (const auto& [internalDimKey, count] : *slicedWhatMap) {
         for (int i = 0; i < count; i++) {
             // Fake start events.
@@ -309,6 +318,8 @@ void DurationMetricProducer::addAnomalyTracker(sp<AnomalyTracker>& anomalyTracke
 void DurationMetricProducer::addAnomalyTrackerLocked(sp<AnomalyTracker>& anomalyTracker,
                                                      const UpdateStatus& updateStatus,
                                                      const int64_t updateTimeNs) {
+    // The anomaly tracker needs the past buckets of every tracker.
+    catchUpDurationTrackersLocked();
     mAnomalyTrackers.push_back(anomalyTracker);
     for (const auto& [_, durationTracker] : mCurrentSlicedDurationTrackerMap) {
         durationTracker->addAnomalyTracker(anomalyTracker, updateStatus, updateTimeNs);
@@ -339,12 +350,19 @@ void DurationMetricProducer::onStateChanged(const int64_t eventTimeNs, const int
         if (!containsLinkedStateValues(whatIt.first, primaryKey, mMetric2StateLinks, atomId)) {
             continue;
         }
+        catchUpDurationTrackerLocked(*whatIt.second);
         whatIt.second->onStateChanged(eventTimeNs, atomId, newStateCopy);
     }
 }
 
-unique_ptr<DurationTracker> DurationMetricProducer::createDurationTracker(
-        const MetricDimensionKey& eventKey) const {
+unique_ptr<DurationTracker> DurationMetricProducer::createDurationTrackerLocked(
+        const MetricDimensionKey& eventKey) {
+    if (!mDurationTrackerPool.empty()) {
+        unique_ptr<DurationTracker> tracker = std::move(mDurationTrackerPool.back());
+        mDurationTrackerPool.pop_back();
+        tracker->reset(eventKey, mCurrentBucketStartTimeNs, mCurrentBucketNum, mAnomalyTrackers);
+        return tracker;
+    }
     switch (mAggregationType) {
         case DurationMetric_AggregationType_SUM:
             return make_unique<OringDurationTracker>(
@@ -389,8 +407,9 @@ void DurationMetricProducer::onSlicedConditionMayChangeLocked_opt1(const int64_t
     // state based on the new unsliced condition state.
     if (dimensionsChangedToTrue == nullptr || dimensionsChangedToFalse == nullptr ||
         (dimensionsChangedToTrue->empty() && dimensionsChangedToFalse->empty())) {
-        const map<HashableDimensionKey, int>* slicedConditionMap =
+        const unordered_map<HashableDimensionKey, int>* slicedConditionMap =
                 mWizard->getSlicedDimensionMap(mConditionTrackerIndex);
+        catchUpDurationTrackersLocked();
         for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
             HashableDimensionKey linkedConditionDimensionKey;
             getDimensionForCondition(whatIt.first.getValues(), mMetric2ConditionLinks[0],
@@ -401,23 +420,90 @@ void DurationMetricProducer::onSlicedConditionMayChangeLocked_opt1(const int64_t
             }
         }
     } else {
-        // Handle the condition change from the sliced predicate.
+        // Handle the condition change from the sliced predicate. Only the trackers linked to the
+        // changed keys are visited.
         if (currentUnSlicedPartCondition) {
-            for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
-                HashableDimensionKey linkedConditionDimensionKey;
-                getDimensionForCondition(whatIt.first.getValues(), mMetric2ConditionLinks[0],
-                                         &linkedConditionDimensionKey);
-                if (dimensionsChangedToTrue->find(linkedConditionDimensionKey) !=
-                        dimensionsChangedToTrue->end()) {
-                    whatIt.second->onConditionChanged(true, eventTime);
-                }
-                if (dimensionsChangedToFalse->find(linkedConditionDimensionKey) !=
-                        dimensionsChangedToFalse->end()) {
-                    whatIt.second->onConditionChanged(false, eventTime);
+            for (const auto& conditionKey : *dimensionsChangedToTrue) {
+                onLinkedConditionChangedLocked(conditionKey, true, eventTime);
+            }
+            for (const auto& conditionKey : *dimensionsChangedToFalse) {
+                onLinkedConditionChangedLocked(conditionKey, false, eventTime);
+            }
+        }
+    }
+}
+
+// SlicedConditionChange optimization case 2:
+// 1. Same as case 1, except that the link covers only some of the dimension fields in the sliced
+//    child condition predicate.
+// 2. A tracker may only change condition if its linked condition key is contained in one of the
+//    changed keys, so only those trackers re-query their condition.
+// Returns false if the change cannot be narrowed down to the changed keys.
+bool DurationMetricProducer::onSlicedConditionMayChangeLocked_opt2(const int64_t eventTime) {
+    if (!mWizard->IsSimpleCondition(mConditionTrackerIndex)) {
+        ConditionState unslicedPartState =
+                mWizard->getUnSlicedPartConditionState(mConditionTrackerIndex);
+        if (unslicedPartState != mUnSlicedPartCondition) {
+            mUnSlicedPartCondition = unslicedPartState;
+            return false;
+        }
+        // The trackers stay false whatever the sliced part does.
+        if (unslicedPartState == ConditionState::kFalse) {
+            return true;
+        }
+    }
+
+    auto dimensionsChangedToTrue = mWizard->getChangedToTrueDimensions(mConditionTrackerIndex);
+    auto dimensionsChangedToFalse = mWizard->getChangedToFalseDimensions(mConditionTrackerIndex);
+    if (dimensionsChangedToTrue == nullptr || dimensionsChangedToFalse == nullptr ||
+        (dimensionsChangedToTrue->empty() && dimensionsChangedToFalse->empty())) {
+        return false;
+    }
+
+    vector<DurationTracker*> changedTrackers;
+    for (const auto* changedKeys : {dimensionsChangedToTrue, dimensionsChangedToFalse}) {
+        for (const auto& changedKey : *changedKeys) {
+            HashableDimensionKey linkedConditionKey;
+            if (!getLinkedConditionKey(changedKey, mMetric2ConditionLinks[0],
+                                       &linkedConditionKey)) {
+                continue;
+            }
+            const auto& linkedIt = mConditionKeyToWhatKeys.find(linkedConditionKey);
+            if (linkedIt == mConditionKeyToWhatKeys.end()) {
+                continue;
+            }
+            for (const auto& whatKey : linkedIt->second) {
+                const auto& whatIt = mCurrentSlicedDurationTrackerMap.find(whatKey);
+                if (whatIt != mCurrentSlicedDurationTrackerMap.end()) {
+                    catchUpDurationTrackerLocked(*whatIt->second);
+                    changedTrackers.push_back(whatIt->second.get());
                 }
             }
         }
     }
+    // Several changed keys can contain the linked key of the same tracker.
+    std::sort(changedTrackers.begin(), changedTrackers.end());
+    changedTrackers.erase(std::unique(changedTrackers.begin(), changedTrackers.end()),
+                          changedTrackers.end());
+    for (DurationTracker* tracker : changedTrackers) {
+        tracker->onSlicedConditionMayChange(eventTime);
+    }
+    return true;
+}
+
+void DurationMetricProducer::onLinkedConditionChangedLocked(
+        const HashableDimensionKey& conditionKey, bool condition, const int64_t eventTime) {
+    const auto& linkedIt = mConditionKeyToWhatKeys.find(conditionKey);
+    if (linkedIt == mConditionKeyToWhatKeys.end()) {
+        return;
+    }
+    for (const auto& whatKey : linkedIt->second) {
+        const auto& whatIt = mCurrentSlicedDurationTrackerMap.find(whatKey);
+        if (whatIt != mCurrentSlicedDurationTrackerMap.end()) {
+            catchUpDurationTrackerLocked(*whatIt->second);
+            whatIt->second->onConditionChanged(condition, eventTime);
+        }
+    }
 }
 
 void DurationMetricProducer::onSlicedConditionMayChangeInternalLocked(const int64_t eventTimeNs) {
@@ -426,8 +512,13 @@ void DurationMetricProducer::onSlicedConditionMayChangeInternalLocked(const int6
         onSlicedConditionMayChangeLocked_opt1(eventTimeNs);
         return;
     }
+    if (changeDimTrackable && indexesConditionKeys() &&
+        onSlicedConditionMayChangeLocked_opt2(eventTimeNs)) {
+        return;
+    }
 
     // Now for each of the on-going event, check if the condition has changed for them.
+    catchUpDurationTrackersLocked();
     for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
         whatIt.second->onSlicedConditionMayChange(eventTimeNs);
     }
@@ -463,6 +554,7 @@ void DurationMetricProducer::onActiveStateChangedLocked(const int64_t eventTimeN
             flushIfNeededLocked(eventTimeNs);
         }
 
+        catchUpDurationTrackersLocked();
         for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
             whatIt.second->onConditionChanged(isActive, eventTimeNs);
         }
@@ -471,6 +563,7 @@ void DurationMetricProducer::onActiveStateChangedLocked(const int64_t eventTimeN
         flushIfNeededLocked(eventTimeNs);
         onSlicedConditionMayChangeInternalLocked(eventTimeNs);
     } else {  // mConditionSliced == true && !isActive
+        catchUpDurationTrackersLocked();
         for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
             whatIt.second->onConditionChanged(isActive, eventTimeNs);
         }
@@ -487,6 +580,7 @@ void DurationMetricProducer::onConditionChangedLocked(const bool conditionMet,
     }
 
     flushIfNeededLocked(eventTime);
+    catchUpDurationTrackersLocked();
     for (auto& whatIt : mCurrentSlicedDurationTrackerMap) {
         whatIt.second->onConditionChanged(conditionMet, eventTime);
     }
@@ -496,36 +590,80 @@ void DurationMetricProducer::onConditionChangedLocked(const bool conditionMet,
 
 void DurationMetricProducer::dropDataLocked(const int64_t dropTimeNs) {
     flushIfNeededLocked(dropTimeNs);
+    catchUpDurationTrackersLocked();
     StatsdStats::getInstance().noteBucketDropped(mMetricId);
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
 }
 
 void DurationMetricProducer::clearPastBucketsLocked(const int64_t dumpTimeNs) {
     flushIfNeededLocked(dumpTimeNs);
+    catchUpDurationTrackersLocked();
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
 }
 
 void DurationMetricProducer::onDumpReportLocked(
         const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
-        const DumpLatency dumpLatency, std::set<string>* str_set, ProtoOutputStream* protoOutput) {
+        const DumpLatency dumpLatency, StringSet* str_set, ProtoOutputStream* protoOutput) {
+    DumpReportData data = takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket);
+    writeDumpReportData(data, str_set, protoOutput);
+    if (!erase_data) {
+        mPastBuckets.swap(data.pastBuckets);
+        mPastBucketsByteSize = data.pastBucketsByteSize;
+    }
+}
+
+unique_ptr<MetricProducer::DumpReportSnapshot> DurationMetricProducer::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    if (!erase_data) {
+        // The data stays in the producer, so it is encoded now rather than copied.
+        return MetricProducer::takeDumpReportSnapshotLocked(
+                dumpTimeNs, include_current_partial_bucket, erase_data, dumpLatency, hashStrings);
+    }
+    return std::make_unique<DetachedDumpReportSnapshot<DurationMetricProducer>>(
+            this, takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket));
+}
+
+DurationMetricProducer::DumpReportData DurationMetricProducer::takeDumpReportDataLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket) {
     if (include_current_partial_bucket) {
         flushLocked(dumpTimeNs);
     } else {
         flushIfNeededLocked(dumpTimeNs);
     }
+    catchUpDurationTrackersLocked();
+
+    DumpReportData data;
+    data.isActive = isActiveLocked();
+    data.dimensionGuardrailHit = StatsdStats::getInstance().hasHitDimensionGuardrail(mMetricId);
+    data.dimensionDictionary = mDimensionDictionaryInReport;
+    // We only write the condition timer value if the metric has a
+    // condition and isn't sliced by state or condition.
+    // TODO(b/268531762): Slice the condition timer by state and condition
+    data.hasConditionTimer =
+            mConditionTrackerIndex >= 0 && mSlicedStateAtoms.empty() && !mConditionSliced;
+    data.pastBuckets.swap(mPastBuckets);
+    data.pastBucketsByteSize = mPastBucketsByteSize;
+    mPastBucketsByteSize = 0;
+    return data;
+}
 
+void DurationMetricProducer::writeDumpReportData(const DumpReportData& data,
+                                                 StringSet* str_set,
+                                                 ProtoOutputStream* protoOutput) const {
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ID, (long long)mMetricId);
-    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, isActiveLocked());
+    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, data.isActive);
 
-    if (mPastBuckets.empty()) {
+    if (data.pastBuckets.empty()) {
         VLOG(" Duration metric, empty return");
         return;
     }
 
-    if (StatsdStats::getInstance().hasHitDimensionGuardrail(mMetricId)) {
+    if (data.dimensionGuardrailHit) {
         protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_DIMENSION_GUARDRAIL_HIT, true);
     }
-
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_TIME_BASE, (long long)mTimeBaseNs);
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_BUCKET_SIZE, (long long)mBucketSizeNs);
 
@@ -538,11 +676,17 @@ void DurationMetricProducer::onDumpReportLocked(
         }
     }
 
+    // Only set if the dimensions are written to the dictionary rather than to each data.
+    optional<DimensionDictionary> dimensionDictionary;
+    if (data.dimensionDictionary) {
+        dimensionDictionary.emplace(mShouldUseNestedDimensions);
+    }
+
     uint64_t protoToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_DURATION_METRICS);
 
     VLOG("Duration metric %lld dump report now...", (long long)mMetricId);
 
-    for (const auto& pair : mPastBuckets) {
+    for (const auto& pair : data.pastBuckets) {
         const MetricDimensionKey& dimensionKey = pair.first;
         VLOG("  dimension key %s", dimensionKey.toString().c_str());
 
@@ -550,7 +694,10 @@ void DurationMetricProducer::onDumpReportLocked(
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_DATA);
 
         // First fill dimension.
-        if (mShouldUseNestedDimensions) {
+        if (dimensionDictionary) {
+            protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_DIMENSION_INDEX_IN_WHAT,
+                               dimensionDictionary->indexOf(dimensionKey.getDimensionKeyInWhat()));
+        } else if (mShouldUseNestedDimensions) {
             uint64_t dimensionToken = protoOutput->start(
                     FIELD_TYPE_MESSAGE | FIELD_ID_DIMENSION_IN_WHAT);
             writeDimensionToProto(dimensionKey.getDimensionKeyInWhat(), str_set, protoOutput);
@@ -581,10 +728,7 @@ void DurationMetricProducer::onDumpReportLocked(
             }
             protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_DURATION, (long long)bucket.mDuration);
 
-            // We only write the condition timer value if the metric has a
-            // condition and isn't sliced by state or condition.
-            // TODO(b/268531762): Slice the condition timer by state and condition
-            if (mConditionTrackerIndex >= 0 && mSlicedStateAtoms.empty() && !mConditionSliced) {
+            if (data.hasConditionTimer) {
                 protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_CONDITION_TRUE_NS,
                                    (long long)bucket.mConditionTrueNs);
             }
@@ -598,8 +742,8 @@ void DurationMetricProducer::onDumpReportLocked(
     }
 
     protoOutput->end(protoToken);
-    if (erase_data) {
-        mPastBuckets.clear();
+    if (dimensionDictionary) {
+        dimensionDictionary->writeToProto(str_set, protoOutput);
     }
 }
 
@@ -612,33 +756,105 @@ void DurationMetricProducer::flushIfNeededLocked(const int64_t eventTimeNs) {
     VLOG("flushing...........");
     int numBucketsForward = 1 + (eventTimeNs - currentBucketEndTimeNs) / mBucketSizeNs;
     int64_t nextBucketNs = currentBucketEndTimeNs + (numBucketsForward - 1) * mBucketSizeNs;
-    flushCurrentBucketLocked(eventTimeNs, nextBucketNs);
+    if (flushesBucketsLazilyLocked()) {
+        flushCurrentBucketLazilyLocked(eventTimeNs, nextBucketNs);
+    } else {
+        flushCurrentBucketLocked(eventTimeNs, nextBucketNs);
+    }
 
     mCurrentBucketNum += numBucketsForward;
 }
 
 void DurationMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
                                                       const int64_t nextBucketStartTimeNs) {
+    STATSD_TRACE("MetricProducer::flushCurrentBucket config=%d:%lld metric=%lld",
+                 mConfigKey.GetUid(), (long long)mConfigKey.GetId(), (long long)mMetricId);
+    // The trackers must reach the current bucket before it is split.
+    catchUpDurationTrackersLocked();
     const auto [globalConditionTrueNs, globalConditionCorrectionNs] =
             mConditionTimer.newBucketStart(eventTimeNs, nextBucketStartTimeNs);
 
+    // The trackers flush into a separate map, so that the buckets they add can be counted.
+    std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>> flushedBuckets;
     for (auto whatIt = mCurrentSlicedDurationTrackerMap.begin();
             whatIt != mCurrentSlicedDurationTrackerMap.end();) {
         if (whatIt->second->flushCurrentBucket(eventTimeNs, mUploadThreshold, globalConditionTrueNs,
-                                               &mPastBuckets)) {
+                                               &flushedBuckets)) {
             VLOG("erase bucket for key %s", whatIt->first.toString().c_str());
-            whatIt = mCurrentSlicedDurationTrackerMap.erase(whatIt);
+            whatIt = eraseDurationTrackerLocked(whatIt);
         } else {
             ++whatIt;
         }
     }
+    addPastBucketsLocked(flushedBuckets);
 
     StatsdStats::getInstance().noteBucketCount(mMetricId);
+    noteBucketDimensionCountLocked(mCurrentSlicedDurationTrackerMap.size());
     mCurrentBucketStartTimeNs = nextBucketStartTimeNs;
     // Reset mHasHitGuardrail boolean since bucket was reset
     mHasHitGuardrail = false;
 }
 
+void DurationMetricProducer::flushCurrentBucketLazilyLocked(const int64_t eventTimeNs,
+                                                            const int64_t nextBucketStartTimeNs) {
+    const auto [globalConditionTrueNs, globalConditionCorrectionNs] =
+            mConditionTimer.newBucketStart(eventTimeNs, nextBucketStartTimeNs);
+    if (!mCurrentSlicedDurationTrackerMap.empty()) {
+        mPendingBucketFlushes.push_back({mCurrentBucketNum, eventTimeNs, globalConditionTrueNs});
+    }
+
+    StatsdStats::getInstance().noteBucketCount(mMetricId);
+    noteBucketDimensionCountLocked(mCurrentSlicedDurationTrackerMap.size());
+    mCurrentBucketStartTimeNs = nextBucketStartTimeNs;
+    // Reset mHasHitGuardrail boolean since bucket was reset
+    mHasHitGuardrail = false;
+
+    if (mPendingBucketFlushes.size() >= kMaxPendingBucketFlushes) {
+        catchUpDurationTrackersLocked();
+    }
+}
+
+void DurationMetricProducer::catchUpDurationTrackerLocked(DurationTracker& tracker) {
+    if (mPendingBucketFlushes.empty()) {
+        return;
+    }
+    std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>> flushedBuckets;
+    for (const PendingBucketFlush& flush : mPendingBucketFlushes) {
+        // Skips the flushes from before the tracker was created.
+        if (flush.bucketNum == tracker.getCurrentBucketNum()) {
+            tracker.flushCurrentBucket(flush.eventTimeNs, mUploadThreshold,
+                                       flush.globalConditionTrueNs, &flushedBuckets);
+        }
+    }
+    addPastBucketsLocked(flushedBuckets);
+}
+
+void DurationMetricProducer::catchUpDurationTrackersLocked() {
+    if (mPendingBucketFlushes.empty()) {
+        return;
+    }
+    for (auto whatIt = mCurrentSlicedDurationTrackerMap.begin();
+         whatIt != mCurrentSlicedDurationTrackerMap.end();) {
+        catchUpDurationTrackerLocked(*whatIt->second);
+        if (!whatIt->second->hasAccumulatedDuration()) {
+            VLOG("erase bucket for key %s", whatIt->first.toString().c_str());
+            whatIt = eraseDurationTrackerLocked(whatIt);
+        } else {
+            ++whatIt;
+        }
+    }
+    mPendingBucketFlushes.clear();
+}
+
+void DurationMetricProducer::addPastBucketsLocked(
+        std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>>& flushedBuckets) {
+    for (auto& [metricDimensionKey, buckets] : flushedBuckets) {
+        std::vector<DurationBucket>& bucketList = mPastBuckets[metricDimensionKey];
+        bucketList.insert(bucketList.end(), buckets.begin(), buckets.end());
+        mPastBucketsByteSize += buckets.size() * kBucketSize;
+    }
+}
+
 void DurationMetricProducer::dumpStatesLocked(int out, bool verbose) const {
     if (mCurrentSlicedDurationTrackerMap.size() == 0) {
         return;
@@ -654,6 +870,38 @@ void DurationMetricProducer::dumpStatesLocked(int out, bool verbose) const {
     }
 }
 
+void DurationMetricProducer::addDurationTrackerLocked(const MetricDimensionKey& eventKey) {
+    const auto& whatKey = eventKey.getDimensionKeyInWhat();
+    mCurrentSlicedDurationTrackerMap[whatKey] = createDurationTrackerLocked(eventKey);
+    if (indexesConditionKeys()) {
+        HashableDimensionKey conditionKey;
+        getDimensionForCondition(whatKey.getValues(), mMetric2ConditionLinks[0], &conditionKey);
+        mConditionKeyToWhatKeys[conditionKey].push_back(whatKey);
+    }
+}
+
+DurationMetricProducer::DurationTrackerMap::iterator
+DurationMetricProducer::eraseDurationTrackerLocked(DurationTrackerMap::iterator whatIt) {
+    if (indexesConditionKeys()) {
+        HashableDimensionKey conditionKey;
+        getDimensionForCondition(whatIt->first.getValues(), mMetric2ConditionLinks[0],
+                                 &conditionKey);
+        auto linkedIt = mConditionKeyToWhatKeys.find(conditionKey);
+        if (linkedIt != mConditionKeyToWhatKeys.end()) {
+            auto& whatKeys = linkedIt->second;
+            whatKeys.erase(std::remove(whatKeys.begin(), whatKeys.end(), whatIt->first),
+                           whatKeys.end());
+            if (whatKeys.empty()) {
+                mConditionKeyToWhatKeys.erase(linkedIt);
+            }
+        }
+    }
+    if (mDurationTrackerPool.size() < kMaxPooledDurationTrackers) {
+        mDurationTrackerPool.push_back(std::move(whatIt->second));
+    }
+    return mCurrentSlicedDurationTrackerMap.erase(whatIt);
+}
+
 bool DurationMetricProducer::hitGuardRailLocked(const MetricDimensionKey& newKey) const {
     auto whatIt = mCurrentSlicedDurationTrackerMap.find(newKey.getDimensionKeyInWhat());
     if (whatIt == mCurrentSlicedDurationTrackerMap.end()) {
@@ -663,7 +911,7 @@ bool DurationMetricProducer::hitGuardRailLocked(const MetricDimensionKey& newKey
             StatsdStats::getInstance().noteMetricDimensionSize(
                     mConfigKey, mMetricId, newTupleCount);
             // 2. Don't add more tuples, we are above the allowed threshold. Drop the data.
-            if (newTupleCount > mDimensionHardLimit) {
+            if (newTupleCount > getDimensionHardLimitLocked(mDimensionHardLimit)) {
                 if (!mHasHitGuardrail) {
                     ALOGE("DurationMetric %lld dropping data for what dimension key %s",
                           (long long)mMetricId, newKey.getDimensionKeyInWhat().toString().c_str());
@@ -687,7 +935,9 @@ void DurationMetricProducer::handleStartEvent(const MetricDimensionKey& eventKey
         if (hitGuardRailLocked(eventKey)) {
             return;
         }
-        mCurrentSlicedDurationTrackerMap[whatKey] = createDurationTracker(eventKey);
+        addDurationTrackerLocked(eventKey);
+    } else {
+        catchUpDurationTrackerLocked(*whatIt->second);
     }
 
     auto it = mCurrentSlicedDurationTrackerMap.find(whatKey);
@@ -733,12 +983,13 @@ void DurationMetricProducer::handleMatchedLogEventValuesLocked(const size_t matc
 
     // Handles Stopall events.
     if ((int)matcherIndex == mStopAllIndex) {
+        catchUpDurationTrackersLocked();
         for (auto whatIt = mCurrentSlicedDurationTrackerMap.begin();
              whatIt != mCurrentSlicedDurationTrackerMap.end();) {
             whatIt->second->noteStopAll(eventTimeNs);
             if (!whatIt->second->hasAccumulatedDuration()) {
                 VLOG("erase bucket for key %s", whatIt->first.toString().c_str());
-                whatIt = mCurrentSlicedDurationTrackerMap.erase(whatIt);
+                whatIt = eraseDurationTrackerLocked(whatIt);
             } else {
                 whatIt++;
             }
@@ -794,10 +1045,11 @@ void DurationMetricProducer::handleMatchedLogEventValuesLocked(const size_t matc
         if (mUseWhatDimensionAsInternalDimension) {
             auto whatIt = mCurrentSlicedDurationTrackerMap.find(dimensionInWhat);
             if (whatIt != mCurrentSlicedDurationTrackerMap.end()) {
+                catchUpDurationTrackerLocked(*whatIt->second);
                 whatIt->second->noteStop(dimensionInWhat, eventTimeNs, false);
                 if (!whatIt->second->hasAccumulatedDuration()) {
                     VLOG("erase bucket for key %s", whatIt->first.toString().c_str());
-                    mCurrentSlicedDurationTrackerMap.erase(whatIt);
+                    eraseDurationTrackerLocked(whatIt);
                 }
             }
             return;
@@ -810,10 +1062,11 @@ void DurationMetricProducer::handleMatchedLogEventValuesLocked(const size_t matc
 
         auto whatIt = mCurrentSlicedDurationTrackerMap.find(dimensionInWhat);
         if (whatIt != mCurrentSlicedDurationTrackerMap.end()) {
+            catchUpDurationTrackerLocked(*whatIt->second);
             whatIt->second->noteStop(internalDimensionKey, eventTimeNs, false);
             if (!whatIt->second->hasAccumulatedDuration()) {
                 VLOG("erase bucket for key %s", whatIt->first.toString().c_str());
-                mCurrentSlicedDurationTrackerMap.erase(whatIt);
+                eraseDurationTrackerLocked(whatIt);
             }
         }
         return;
@@ -842,11 +1095,26 @@ void DurationMetricProducer::handleMatchedLogEventValuesLocked(const size_t matc
 }
 
 size_t DurationMetricProducer::byteSizeLocked() const {
-    size_t totalSize = 0;
-    for (const auto& pair : mPastBuckets) {
-        totalSize += pair.second.size() * kBucketSize;
+    return mPastBucketsByteSize;
+}
+
+size_t DurationMetricProducer::currentStateByteSizeLocked() const {
+    size_t bytes = dimensionMapByteSize(mCurrentSlicedDurationTrackerMap,
+                                        [](const unique_ptr<DurationTracker>& tracker) {
+                                            return tracker->byteSize();
+                                        });
+    for (const unique_ptr<DurationTracker>& tracker : mDurationTrackerPool) {
+        bytes += tracker->byteSize();
     }
-    return totalSize;
+    return bytes + dimensionMapByteSize(mConditionKeyToWhatKeys,
+                                        [](const vector<HashableDimensionKey>& whatKeys) {
+                                            size_t bytes = whatKeys.capacity() *
+                                                           sizeof(HashableDimensionKey);
+                                            for (const HashableDimensionKey& key : whatKeys) {
+                                                bytes += key.heapByteSize();
+                                            }
+                                            return bytes;
+                                        });
 }
 
 }  // namespace statsd
@@ -62,6 +62,11 @@ public:
                         const HashableDimensionKey& primaryKey, const FieldValue& oldState,
                         const FieldValue& newState) override;
 
+    // Started durations have to be split at state changes.
+    bool needsStateChangeNotifications() const override {
+        return true;
+    }
+
     MetricType getMetricType() const override {
         return METRIC_TYPE_DURATION;
     }
@@ -69,6 +74,11 @@ public:
 protected:
     void onMatchedLogEventLocked(const size_t matcherIndex, const LogEvent& event) override;
 
+    // Stop all events end the durations of every shard.
+    bool isSampleCheckedOnDispatch(const size_t matcherIndex) const override {
+        return (int)matcherIndex != mStopAllIndex;
+    }
+
     void onMatchedLogEventInternalLocked(
             const size_t matcherIndex, const MetricDimensionKey& eventKey,
             const ConditionKey& conditionKeys, bool condition, const LogEvent& event,
@@ -89,9 +99,32 @@ private:
                             const bool include_current_partial_bucket,
                             const bool erase_data,
                             const DumpLatency dumpLatency,
-                            std::set<string> *str_set,
+                            StringSet* str_set,
                             android::util::ProtoOutputStream* protoOutput) override;
 
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings) override;
+
+    // The state a dump report is written from, other than the members fixed at construction.
+    struct DumpReportData {
+        bool isActive = false;
+        bool dimensionGuardrailHit = false;
+        bool dimensionDictionary = false;
+        bool hasConditionTimer = false;
+        std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>> pastBuckets;
+        size_t pastBucketsByteSize = 0;
+    };
+
+    // Flushes, then swaps mPastBuckets out into the returned data.
+    DumpReportData takeDumpReportDataLocked(const int64_t dumpTimeNs,
+                                            const bool include_current_partial_bucket);
+
+    void writeDumpReportData(const DumpReportData& data, StringSet* str_set,
+                             android::util::ProtoOutputStream* protoOutput) const;
+
+    friend class DetachedDumpReportSnapshot<DurationMetricProducer>;
+
     void clearPastBucketsLocked(const int64_t dumpTimeNs) override;
 
     // Internal interface to handle condition change.
@@ -107,9 +140,13 @@ private:
 
     void onSlicedConditionMayChangeLocked_opt1(const int64_t eventTime);
 
+    bool onSlicedConditionMayChangeLocked_opt2(const int64_t eventTime);
+
     // Internal function to calculate the current used bytes.
     size_t byteSizeLocked() const override;
 
+    size_t currentStateByteSizeLocked() const override;
+
     void dumpStatesLocked(int out, bool verbose) const override;
 
     void dropDataLocked(const int64_t dropTimeNs) override;
@@ -117,6 +154,10 @@ private:
     // Util function to flush the old packet.
     void flushIfNeededLocked(int64_t eventTime);
 
+    size_t getOwnDimensionHardLimitLocked() const override {
+        return mDimensionHardLimit;
+    }
+
     void flushCurrentBucketLocked(int64_t eventTimeNs, int64_t nextBucketStartTimeNs) override;
 
     optional<InvalidConfigReason> onConfigUpdatedLocked(
@@ -152,6 +193,9 @@ private:
     // nest counting -- for the same key, stops must match the number of starts to make real stop
     const bool mNested;
 
+    // Set by lazy_bucket_flush. See flushesBucketsLazilyLocked().
+    const bool mLazyBucketFlush;
+
     // The dimension from the atom predicate. e.g., uid, wakelock name.
     vector<Matcher> mInternalDimensions;
 
@@ -166,15 +210,89 @@ private:
     // Save the past buckets and we can clear when the StatsLogReport is dumped.
     std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>> mPastBuckets;
 
+    // The bytes used by mPastBuckets, kept up to date as buckets are added and cleared so that
+    // byteSizeLocked() does not iterate them.
+    size_t mPastBucketsByteSize = 0;
+
+    using DurationTrackerMap = FlatHashMap<HashableDimensionKey, std::unique_ptr<DurationTracker>>;
+
     // The duration trackers in the current bucket.
-    std::unordered_map<HashableDimensionKey, std::unique_ptr<DurationTracker>>
-            mCurrentSlicedDurationTrackerMap;
+    DurationTrackerMap mCurrentSlicedDurationTrackerMap;
+
+    // Trackers erased from mCurrentSlicedDurationTrackerMap, kept for reuse so that a metric whose
+    // dimensions keep starting and stopping, e.g. wakelocks, does not allocate a tracker and its
+    // maps for each of them. All of them have the type given by mAggregationType.
+    std::vector<std::unique_ptr<DurationTracker>> mDurationTrackerPool;
+
+    static const size_t kMaxPooledDurationTrackers = 64;
+
+    // Set when a sliced condition change can be handled per changed condition key, i.e. there is
+    // one link. Maps each linked condition key to the what keys of its trackers in
+    // mCurrentSlicedDurationTrackerMap.
+    std::unordered_map<HashableDimensionKey, std::vector<HashableDimensionKey>>
+            mConditionKeyToWhatKeys;
 
     const size_t mDimensionHardLimit;
 
-    // Helper function to create a duration tracker given the metric aggregation type.
-    std::unique_ptr<DurationTracker> createDurationTracker(
-            const MetricDimensionKey& eventKey) const;
+    // A bucket flush that has not been applied to every tracker yet.
+    struct PendingBucketFlush {
+        // The bucket that the flush closed.
+        int64_t bucketNum;
+        int64_t eventTimeNs;
+        int64_t globalConditionTrueNs;
+    };
+
+    // The full bucket flushes since the last time every tracker was caught up, oldest first. A
+    // tracker has applied the flushes before the one of its current bucket.
+    std::vector<PendingBucketFlush> mPendingBucketFlushes;
+
+    // All the trackers are caught up once this many flushes are pending.
+    static const size_t kMaxPendingBucketFlushes = 16;
+
+    // Trackers are only flushed when they are next touched or the report is dumped. Anomaly
+    // detection needs the past buckets of every tracker at the bucket boundary, so the flushes
+    // are applied eagerly while the metric has alerts.
+    bool flushesBucketsLazilyLocked() const {
+        return mLazyBucketFlush && mAnomalyTrackers.empty();
+    }
+
+    // Records the flush of the current bucket for the trackers to apply later.
+    void flushCurrentBucketLazilyLocked(const int64_t eventTimeNs,
+                                        const int64_t nextBucketStartTimeNs);
+
+    // Applies the pending flushes of tracker. The tracker is kept even if it has no duration left,
+    // so that callers can use it afterwards.
+    void catchUpDurationTrackerLocked(DurationTracker& tracker);
+
+    // Applies the pending flushes to every tracker and erases the trackers that have no duration
+    // left.
+    void catchUpDurationTrackersLocked();
+
+    // Adds the buckets flushed by the trackers to mPastBuckets.
+    void addPastBucketsLocked(
+            std::unordered_map<MetricDimensionKey, std::vector<DurationBucket>>& flushedBuckets);
+
+    bool indexesConditionKeys() const {
+        return mMetric2ConditionLinks.size() == 1;
+    }
+
+    // Creates the tracker for eventKey and adds it to mCurrentSlicedDurationTrackerMap and
+    // mConditionKeyToWhatKeys.
+    void addDurationTrackerLocked(const MetricDimensionKey& eventKey);
+
+    // Erases the tracker from mCurrentSlicedDurationTrackerMap and mConditionKeyToWhatKeys.
+    // Returns the iterator following it. The tracker is moved to mDurationTrackerPool if it has
+    // room.
+    DurationTrackerMap::iterator eraseDurationTrackerLocked(DurationTrackerMap::iterator whatIt);
+
+    // Notifies the trackers linked to conditionKey of its new condition.
+    void onLinkedConditionChangedLocked(const HashableDimensionKey& conditionKey, bool condition,
+                                        const int64_t eventTime);
+
+    // Helper function to create a duration tracker given the metric aggregation type. Reuses a
+    // tracker from mDurationTrackerPool if there is one.
+    std::unique_ptr<DurationTracker> createDurationTrackerLocked(
+            const MetricDimensionKey& eventKey);
 
     // Util function to check whether the specified dimension hits the guardrail.
     bool hitGuardRailLocked(const MetricDimensionKey& newKey) const;
@@ -188,6 +306,8 @@ private:
 
     FRIEND_TEST(DurationMetricProducerTest, TestSumDurationAppUpgradeSplitDisabled);
     FRIEND_TEST(DurationMetricProducerTest, TestClearCurrentSlicedTrackerMapWhenStop);
+    FRIEND_TEST(DurationMetricProducerTest, TestReuseErasedDurationTracker);
+    FRIEND_TEST(DurationMetricProducerTest, TestLazyBucketFlush);
     FRIEND_TEST(DurationMetricProducerTest_PartialBucket, TestSumDuration);
     FRIEND_TEST(DurationMetricProducerTest_PartialBucket,
                 TestSumDurationWithSplitInFollowingBucket);
@@ -22,6 +22,8 @@
 #include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "stats_log_util.h"
 #include "stats_util.h"
@@ -36,6 +38,7 @@ using android::util::FIELD_TYPE_MESSAGE;
 using android::util::ProtoOutputStream;
 using std::map;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 using std::shared_ptr;
@@ -50,6 +53,7 @@ const int FIELD_ID_EVENT_METRICS = 4;
 const int FIELD_ID_IS_ACTIVE = 14;
 // for EventMetricDataWrapper
 const int FIELD_ID_DATA = 1;
+const int FIELD_ID_SAMPLED_FROM_EVENT_COUNT = 2;
 // for EventMetricData
 const int FIELD_ID_AGGREGATED_ATOM = 4;
 // for AggregatedAtomInfo
@@ -67,13 +71,17 @@ EventMetricProducer::EventMetricProducer(
     : MetricProducer(metric.id(), key, startTimeNs, conditionIndex, initialConditionCache, wizard,
                      protoHash, eventActivationMap, eventDeactivationMap, slicedStateAtoms,
                      stateGroupMap, /*splitBucketForAppUpgrade=*/nullopt),
-      mSamplingPercentage(metric.sampling_percentage()) {
+      mSamplingPercentage(metric.sampling_percentage()),
+      mMaxSampledEvents(metric.has_max_sampled_events()
+                                ? std::make_optional(metric.max_sampled_events())
+                                : std::nullopt) {
     if (metric.links().size() > 0) {
         for (const auto& link : metric.links()) {
             Metric2Condition mc;
             mc.conditionId = link.condition();
             translateFieldMatcher(link.fields_in_what(), &mc.metricFields);
             translateFieldMatcher(link.fields_in_condition(), &mc.conditionFields);
+            mc.projection = compileLinkProjection(mc.metricFields, mc.conditionFields);
             mMetric2ConditionLinks.push_back(mc);
         }
         mConditionSliced = true;
@@ -135,6 +143,8 @@ optional<InvalidConfigReason> EventMetricProducer::onConfigUpdatedLocked(
 
 void EventMetricProducer::dropDataLocked(const int64_t dropTimeNs) {
     mAggregatedAtoms.clear();
+    mSampledEvents.clear();
+    mSampledFromEventCount = 0;
     mTotalSize = 0;
     StatsdStats::getInstance().noteBucketDropped(mMetricId);
 }
@@ -162,6 +172,8 @@ std::unique_ptr<std::vector<uint8_t>> serializeProtoLocked(ProtoOutputStream& pr
 
 void EventMetricProducer::clearPastBucketsLocked(const int64_t dumpTimeNs) {
     mAggregatedAtoms.clear();
+    mSampledEvents.clear();
+    mSampledFromEventCount = 0;
     mTotalSize = 0;
 }
 
@@ -169,12 +181,80 @@ void EventMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
                                              const bool include_current_partial_bucket,
                                              const bool erase_data,
                                              const DumpLatency dumpLatency,
-                                             std::set<string> *str_set,
+                                             StringSet* str_set,
                                              ProtoOutputStream* protoOutput) {
+    DumpReportData data = takeDumpReportDataLocked();
+    writeDumpReportData(data, str_set, protoOutput);
+    if (erase_data) {
+        mTotalSize = 0;
+    } else {
+        restoreDumpReportDataLocked(data);
+    }
+}
+
+unique_ptr<MetricProducer::DumpReportSnapshot> EventMetricProducer::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    if (!erase_data) {
+        // The data stays in the producer, so it is encoded now rather than copied.
+        return MetricProducer::takeDumpReportSnapshotLocked(
+                dumpTimeNs, include_current_partial_bucket, erase_data, dumpLatency, hashStrings);
+    }
+    mTotalSize = 0;
+    return std::make_unique<DetachedDumpReportSnapshot<EventMetricProducer>>(
+            this, takeDumpReportDataLocked());
+}
+
+EventMetricProducer::DumpReportData EventMetricProducer::takeDumpReportDataLocked() {
+    DumpReportData data;
+    data.isActive = isActiveLocked();
+    data.aggregatedAtoms.swap(mAggregatedAtoms);
+    data.sampledEvents.swap(mSampledEvents);
+    data.sampledFromEventCount = mSampledFromEventCount;
+    mSampledFromEventCount = 0;
+    return data;
+}
+
+void EventMetricProducer::restoreDumpReportDataLocked(DumpReportData& data) {
+    mAggregatedAtoms.swap(data.aggregatedAtoms);
+    mSampledEvents.swap(data.sampledEvents);
+    mSampledFromEventCount = data.sampledFromEventCount;
+}
+
+void EventMetricProducer::writeDumpReportData(const DumpReportData& data,
+                                              StringSet* str_set,
+                                              ProtoOutputStream* protoOutput) const {
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ID, (long long)mMetricId);
-    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, isActiveLocked());
+    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, data.isActive);
     uint64_t protoToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_EVENT_METRICS);
-    for (const auto& [atomDimensionKey, elapsedTimestampsNs] : mAggregatedAtoms) {
+    if (mMaxSampledEvents.has_value()) {
+        // Aggregated here rather than when sampling, as sampled events are replaced at random.
+        vector<const SampledEvent*> sampledEvents;
+        sampledEvents.reserve(data.sampledEvents.size());
+        for (const SampledEvent& sampledEvent : data.sampledEvents) {
+            sampledEvents.push_back(&sampledEvent);
+        }
+        std::sort(sampledEvents.begin(), sampledEvents.end(),
+                  [](const SampledEvent* a, const SampledEvent* b) {
+                      return a->elapsedTimestampNs < b->elapsedTimestampNs;
+                  });
+        FlatHashMap<AtomDimensionKey, DeltaEncodedTimestamps> aggregatedAtoms;
+        for (const SampledEvent* sampledEvent : sampledEvents) {
+            aggregatedAtoms[sampledEvent->key].push_back(sampledEvent->elapsedTimestampNs);
+        }
+        writeAggregatedAtoms(aggregatedAtoms, protoOutput);
+        protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_SAMPLED_FROM_EVENT_COUNT,
+                           (long long)data.sampledFromEventCount);
+    } else {
+        writeAggregatedAtoms(data.aggregatedAtoms, protoOutput);
+    }
+    protoOutput->end(protoToken);
+}
+
+void EventMetricProducer::writeAggregatedAtoms(
+        const FlatHashMap<AtomDimensionKey, DeltaEncodedTimestamps>& aggregatedAtoms,
+        ProtoOutputStream* protoOutput) {
+    for (const auto& [atomDimensionKey, elapsedTimestampsNs] : aggregatedAtoms) {
         uint64_t wrapperToken =
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_DATA);
 
@@ -192,11 +272,6 @@ void EventMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         protoOutput->end(aggregatedToken);
         protoOutput->end(wrapperToken);
     }
-    protoOutput->end(protoToken);
-    if (erase_data) {
-        mAggregatedAtoms.clear();
-        mTotalSize = 0;
-    }
 }
 
 void EventMetricProducer::onConditionChangedLocked(const bool conditionMet,
@@ -218,14 +293,40 @@ void EventMetricProducer::onMatchedLogEventInternalLocked(
     }
 
     const int64_t elapsedTimeNs = truncateTimestampIfNecessary(event);
-    AtomDimensionKey key(event.GetTagId(), HashableDimensionKey(event.getValues()));
+    AtomDimensionKey key(event.GetTagId(), getAtomFieldValues(event));
+    if (mMaxSampledEvents.has_value()) {
+        addSampledEventLocked(std::move(key), elapsedTimeNs);
+        return;
+    }
 
-    std::vector<int64_t>& aggregatedTimestampsNs = mAggregatedAtoms[key];
+    DeltaEncodedTimestamps& aggregatedTimestampsNs = mAggregatedAtoms[key];
     if (aggregatedTimestampsNs.empty()) {
         mTotalSize += getSize(key.getAtomFieldValues().getValues());
     }
+    const size_t previousTimestampsSize = aggregatedTimestampsNs.encodedByteSize();
     aggregatedTimestampsNs.push_back(elapsedTimeNs);
-    mTotalSize += sizeof(int64_t); // Add the size of the event timestamp
+    // Add the size of the event timestamp
+    mTotalSize += aggregatedTimestampsNs.encodedByteSize() - previousTimestampsSize;
+}
+
+void EventMetricProducer::addSampledEventLocked(AtomDimensionKey key, const int64_t elapsedTimeNs) {
+    mSampledFromEventCount++;
+    size_t index = mSampledEvents.size();
+    if (index < (size_t)*mMaxSampledEvents) {
+        mSampledEvents.push_back({std::move(key), elapsedTimeNs});
+    } else {
+        // Reservoir sampling: the n-th event replaces a random sampled event with a probability
+        // of max / n, which keeps every event matched so far equally likely to be in the sample.
+        index = randomIndex(mSampledFromEventCount);
+        if (index >= mSampledEvents.size()) {
+            return;
+        }
+        mTotalSize -= getSize(mSampledEvents[index].key.getAtomFieldValues().getValues()) +
+                      sizeof(int64_t);
+        mSampledEvents[index] = {std::move(key), elapsedTimeNs};
+    }
+    mTotalSize +=
+            getSize(mSampledEvents[index].key.getAtomFieldValues().getValues()) + sizeof(int64_t);
 }
 
 size_t EventMetricProducer::byteSizeLocked() const {
@@ -27,6 +27,7 @@
 #include "MetricProducer.h"
 #include "src/statsd_config.pb.h"
 #include "stats_util.h"
+#include "utils/DeltaEncodedTimestamps.h"
 
 namespace android {
 namespace os {
@@ -63,8 +64,44 @@ private:
                             const bool include_current_partial_bucket,
                             const bool erase_data,
                             const DumpLatency dumpLatency,
-                            std::set<string> *str_set,
+                            StringSet* str_set,
                             android::util::ProtoOutputStream* protoOutput) override;
+
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings) override;
+
+    // An event of the reservoir sample, see mMaxSampledEvents.
+    struct SampledEvent {
+        AtomDimensionKey key;
+        int64_t elapsedTimestampNs;
+    };
+
+    // The state a dump report is written from, other than the members fixed at construction.
+    struct DumpReportData {
+        bool isActive = false;
+        FlatHashMap<AtomDimensionKey, DeltaEncodedTimestamps> aggregatedAtoms;
+        std::vector<SampledEvent> sampledEvents;
+        int64_t sampledFromEventCount = 0;
+    };
+
+    // Swaps mAggregatedAtoms and the reservoir sample out into the returned data.
+    DumpReportData takeDumpReportDataLocked();
+
+    // Puts the data of a dump report that does not erase data back.
+    void restoreDumpReportDataLocked(DumpReportData& data);
+
+    void addSampledEventLocked(AtomDimensionKey key, int64_t elapsedTimeNs);
+
+    static void writeAggregatedAtoms(
+            const FlatHashMap<AtomDimensionKey, DeltaEncodedTimestamps>& aggregatedAtoms,
+            android::util::ProtoOutputStream* protoOutput);
+
+    void writeDumpReportData(const DumpReportData& data, StringSet* str_set,
+                             android::util::ProtoOutputStream* protoOutput) const;
+
+    friend class DetachedDumpReportSnapshot<EventMetricProducer>;
+
     void clearPastBucketsLocked(const int64_t dumpTimeNs) override;
 
     // Internal interface to handle condition change.
@@ -97,9 +134,19 @@ private:
     void dumpStatesLocked(int out, bool verbose) const override{};
 
     // Maps the field/value pairs of an atom to a list of timestamps used to deduplicate atoms.
-    std::unordered_map<AtomDimensionKey, std::vector<int64_t>> mAggregatedAtoms;
+    FlatHashMap<AtomDimensionKey, DeltaEncodedTimestamps> mAggregatedAtoms;
 
     const int mSamplingPercentage;
+
+    // When set, only a uniform random sample of at most this many of the events matched since
+    // the last report is kept, so that the memory and report size of a chatty atom are bounded.
+    // Reports then carry the number of events the sample was taken from, to weight each event.
+    const std::optional<int32_t> mMaxSampledEvents;
+
+    // The reservoir sample, in place of mAggregatedAtoms when mMaxSampledEvents is set.
+    std::vector<SampledEvent> mSampledEvents;
+
+    int64_t mSampledFromEventCount = 0;
 };
 
 }  // namespace statsd
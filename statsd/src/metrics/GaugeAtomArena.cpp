@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "metrics/GaugeAtomArena.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::vector;
+
+GaugeAtomArena::GaugeAtomArena() {
+}
+
+GaugeFields GaugeAtomArena::add(vector<FieldValue>* values) {
+    const size_t size = values->size();
+    if (size == 0) {
+        return GaugeFields();
+    }
+    if (mSlabs.empty() || mSlabs.back().capacity() - mSlabs.back().size() < size) {
+        mSlabs.emplace_back();
+        mSlabs.back().reserve(std::max(kSlabSize, size));
+    }
+    vector<FieldValue>& slab = mSlabs.back();
+    const size_t start = slab.size();
+    // Within the reserved capacity, so the slab is not reallocated.
+    slab.insert(slab.end(), std::make_move_iterator(values->begin()),
+                std::make_move_iterator(values->end()));
+    values->clear();
+    return GaugeFields(slab.data() + start, size);
+}
+
+void GaugeAtomArena::clear() {
+    if (mSlabs.size() > 1) {
+        mSlabs.resize(1);
+    }
+    if (!mSlabs.empty()) {
+        mSlabs.front().clear();
+    }
+}
+
+size_t GaugeAtomArena::size() const {
+    size_t size = 0;
+    for (const vector<FieldValue>& slab : mSlabs) {
+        size += slab.size();
+    }
+    return size;
+}
+
+size_t GaugeAtomArena::byteSize() const {
+    size_t bytes = mSlabs.capacity() * sizeof(vector<FieldValue>);
+    for (const vector<FieldValue>& slab : mSlabs) {
+        bytes += slab.capacity() * sizeof(FieldValue);
+    }
+    return bytes;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "FieldValue.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// A range of the FieldValues stored in a GaugeAtomArena.
+class GaugeFields {
+public:
+    GaugeFields() : mBegin(nullptr), mSize(0) {
+    }
+
+    GaugeFields(const FieldValue* begin, size_t size) : mBegin(begin), mSize(size) {
+    }
+
+    const FieldValue* begin() const {
+        return mBegin;
+    }
+
+    const FieldValue* end() const {
+        return mBegin + mSize;
+    }
+
+    const FieldValue& front() const {
+        return *mBegin;
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    bool empty() const {
+        return mSize == 0;
+    }
+
+private:
+    const FieldValue* mBegin;
+    size_t mSize;
+};
+
+/**
+ * Storage for the fields of the GaugeAtoms of one bucket.
+ *
+ * The fields are moved into slabs of at least kSlabSize FieldValues, which never grow past their
+ * reserved capacity and so never move their contents. Sampling an atom therefore costs no
+ * allocation of its own, and all the fields of a bucket are dropped at once by clear().
+ */
+class GaugeAtomArena {
+public:
+    GaugeAtomArena();
+
+    // Moves values into the arena and clears them, keeping their capacity. The returned range
+    // stays valid until clear().
+    GaugeFields add(std::vector<FieldValue>* values);
+
+    // Drops every field. The first slab is kept for the next bucket.
+    void clear();
+
+    // The number of FieldValues in the arena.
+    size_t size() const;
+
+    // The bytes allocated for the slabs, which is more than size() FieldValues.
+    size_t byteSize() const;
+
+private:
+    static constexpr size_t kSlabSize = 256;
+
+    std::vector<std::vector<FieldValue>> mSlabs;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
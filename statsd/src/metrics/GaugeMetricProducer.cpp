@@ -22,6 +22,7 @@
 #include "guardrail/StatsdStats.h"
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "stats_log_util.h"
+#include "utils/StatsdTrace.h"
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BOOL;
@@ -33,6 +34,7 @@ using android::util::FIELD_TYPE_STRING;
 using android::util::ProtoOutputStream;
 using std::map;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 using std::make_shared;
@@ -64,6 +66,7 @@ const int FIELD_ID_DROP_TIME = 2;
 const int FIELD_ID_DIMENSION_IN_WHAT = 1;
 const int FIELD_ID_BUCKET_INFO = 3;
 const int FIELD_ID_DIMENSION_LEAF_IN_WHAT = 4;
+const int FIELD_ID_DIMENSION_INDEX_IN_WHAT = 7;
 // for GaugeBucketInfo
 const int FIELD_ID_BUCKET_NUM = 6;
 const int FIELD_ID_START_BUCKET_ELAPSED_MILLIS = 7;
@@ -73,6 +76,19 @@ const int FIELD_ID_AGGREGATED_ATOM = 9;
 const int FIELD_ID_ATOM_VALUE = 1;
 const int FIELD_ID_ATOM_TIMESTAMPS = 2;
 
+namespace {
+
+size_t getBucketByteSize(const GaugeBucket& bucket) {
+    size_t byteSize = 0;
+    for (const auto& [atomDimensionKey, elapsedTimestampsNs] : bucket.mAggregatedAtoms) {
+        byteSize += sizeof(FieldValue) * atomDimensionKey.getAtomFieldValues().getValues().size();
+        byteSize += elapsedTimestampsNs.encodedByteSize();
+    }
+    return byteSize;
+}
+
+}  // anonymous namespace
+
 GaugeMetricProducer::GaugeMetricProducer(
         const ConfigKey& key, const GaugeMetric& metric, const int conditionIndex,
         const vector<ConditionState>& initialConditionCache, const sp<ConditionWizard>& wizard,
@@ -82,7 +98,8 @@ GaugeMetricProducer::GaugeMetricProducer(
         const sp<StatsPullerManager>& pullerManager,
         const unordered_map<int, shared_ptr<Activation>>& eventActivationMap,
         const unordered_map<int, vector<shared_ptr<Activation>>>& eventDeactivationMap,
-        const size_t dimensionSoftLimit, const size_t dimensionHardLimit)
+        const size_t dimensionSoftLimit, const size_t dimensionHardLimit,
+        bool deferPullRegistration)
     : MetricProducer(metric.id(), key, timeBaseNs, conditionIndex, initialConditionCache, wizard,
                      protoHash, eventActivationMap, eventDeactivationMap, /*slicedStateAtoms=*/{},
                      /*stateGroupMap=*/{}, getAppUpgradeBucketSplit(metric)),
@@ -127,6 +144,7 @@ GaugeMetricProducer::GaugeMetricProducer(
             mc.conditionId = link.condition();
             translateFieldMatcher(link.fields_in_what(), &mc.metricFields);
             translateFieldMatcher(link.fields_in_condition(), &mc.conditionFields);
+            mc.projection = compileLinkProjection(mc.metricFields, mc.conditionFields);
             mMetric2ConditionLinks.push_back(mc);
         }
         mConditionSliced = true;
@@ -136,8 +154,12 @@ GaugeMetricProducer::GaugeMetricProducer(
     flushIfNeededLocked(startTimeNs);
     // Kicks off the puller immediately.
     if (mIsPulled && isRandomNSamples()) {
-        mPullerManager->RegisterReceiver(mPullTagId, mConfigKey, this, getCurrentBucketEndTimeNs(),
-                                         mBucketSizeNs);
+        if (deferPullRegistration) {
+            mPullRegistrationDeferred = true;
+        } else {
+            mPullerManager->RegisterReceiver(mPullTagId, mConfigKey, this,
+                                             getCurrentBucketEndTimeNs(), mBucketSizeNs);
+        }
     }
 
     // Adjust start for partial first bucket and then pull if needed
@@ -147,6 +169,20 @@ GaugeMetricProducer::GaugeMetricProducer(
          (long long)mMetricId, (long long)mBucketSizeNs, (long long)mTimeBaseNs, mConditionSliced);
 }
 
+void GaugeMetricProducer::registerPullReceiver() {
+    int64_t nextPullTimeNs;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mPullRegistrationDeferred) {
+            return;
+        }
+        mPullRegistrationDeferred = false;
+        nextPullTimeNs = getCurrentBucketEndTimeNs();
+    }
+    // Outside of mMutex: the puller manager holds its lock while it hands pulled data over.
+    mPullerManager->RegisterReceiver(mPullTagId, mConfigKey, this, nextPullTimeNs, mBucketSizeNs);
+}
+
 GaugeMetricProducer::~GaugeMetricProducer() {
     VLOG("~GaugeMetricProducer() called");
     if (mIsPulled && isRandomNSamples()) {
@@ -239,6 +275,7 @@ void GaugeMetricProducer::dumpStatesLocked(int out, bool verbose) const {
 void GaugeMetricProducer::clearPastBucketsLocked(const int64_t dumpTimeNs) {
     flushIfNeededLocked(dumpTimeNs);
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
     mSkippedBuckets.clear();
 }
 
@@ -246,8 +283,33 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
                                              const bool include_current_partial_bucket,
                                              const bool erase_data,
                                              const DumpLatency dumpLatency,
-                                             std::set<string> *str_set,
+                                             StringSet* str_set,
                                              ProtoOutputStream* protoOutput) {
+    DumpReportData data =
+            takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket, erase_data);
+    writeDumpReportData(data, str_set, protoOutput);
+    if (!erase_data) {
+        mPastBuckets.swap(data.pastBuckets);
+        mPastBucketsByteSize = data.pastBucketsByteSize;
+        mSkippedBuckets.swap(data.skippedBuckets);
+    }
+}
+
+unique_ptr<MetricProducer::DumpReportSnapshot> GaugeMetricProducer::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    if (!erase_data) {
+        // The data stays in the producer, so it is encoded now rather than copied.
+        return MetricProducer::takeDumpReportSnapshotLocked(
+                dumpTimeNs, include_current_partial_bucket, erase_data, dumpLatency, hashStrings);
+    }
+    return std::make_unique<DetachedDumpReportSnapshot<GaugeMetricProducer>>(
+            this, takeDumpReportDataLocked(dumpTimeNs, include_current_partial_bucket, erase_data));
+}
+
+GaugeMetricProducer::DumpReportData GaugeMetricProducer::takeDumpReportDataLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+        const bool erase_data) {
     VLOG("Gauge metric %lld report now...", (long long)mMetricId);
     if (include_current_partial_bucket) {
         flushLocked(dumpTimeNs);
@@ -255,18 +317,34 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         flushIfNeededLocked(dumpTimeNs);
     }
 
+    DumpReportData data;
+    data.isActive = isActiveLocked();
+    data.dimensionGuardrailHit = mDimensionGuardrailHit;
+    data.dimensionDictionary = mDimensionDictionaryInReport;
+    data.pastBuckets.swap(mPastBuckets);
+    data.pastBucketsByteSize = mPastBucketsByteSize;
+    mPastBucketsByteSize = 0;
+    data.skippedBuckets.swap(mSkippedBuckets);
+    if (erase_data && !(data.pastBuckets.empty() && data.skippedBuckets.empty())) {
+        mDimensionGuardrailHit = false;
+    }
+    return data;
+}
+
+void GaugeMetricProducer::writeDumpReportData(const DumpReportData& data,
+                                              StringSet* str_set,
+                                              ProtoOutputStream* protoOutput) const {
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ID, (long long)mMetricId);
-    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, isActiveLocked());
+    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, data.isActive);
 
-    if (mPastBuckets.empty() && mSkippedBuckets.empty()) {
+    if (data.pastBuckets.empty() && data.skippedBuckets.empty()) {
         return;
     }
 
-    if (mDimensionGuardrailHit) {
+    if (data.dimensionGuardrailHit) {
         protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_DIMENSION_GUARDRAIL_HIT,
-                           mDimensionGuardrailHit);
+                           data.dimensionGuardrailHit);
     }
-
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_TIME_BASE, (long long)mTimeBaseNs);
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_BUCKET_SIZE, (long long)mBucketSizeNs);
 
@@ -280,9 +358,15 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         }
     }
 
+    // Only set if the dimensions are written to the dictionary rather than to each data.
+    optional<DimensionDictionary> dimensionDictionary;
+    if (data.dimensionDictionary) {
+        dimensionDictionary.emplace(mShouldUseNestedDimensions);
+    }
+
     uint64_t protoToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_GAUGE_METRICS);
 
-    for (const auto& skippedBucket : mSkippedBuckets) {
+    for (const auto& skippedBucket : data.skippedBuckets) {
         uint64_t wrapperToken =
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_SKIPPED);
         protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_SKIPPED_START_MILLIS,
@@ -300,7 +384,7 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         protoOutput->end(wrapperToken);
     }
 
-    for (const auto& pair : mPastBuckets) {
+    for (const auto& pair : data.pastBuckets) {
         const MetricDimensionKey& dimensionKey = pair.first;
 
         VLOG("Gauge dimension key %s", dimensionKey.toString().c_str());
@@ -308,7 +392,10 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_DATA);
 
         // First fill dimension.
-        if (mShouldUseNestedDimensions) {
+        if (dimensionDictionary) {
+            protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_DIMENSION_INDEX_IN_WHAT,
+                               dimensionDictionary->indexOf(dimensionKey.getDimensionKeyInWhat()));
+        } else if (mShouldUseNestedDimensions) {
             uint64_t dimensionToken = protoOutput->start(
                     FIELD_TYPE_MESSAGE | FIELD_ID_DIMENSION_IN_WHAT);
             writeDimensionToProto(dimensionKey.getDimensionKeyInWhat(), str_set, protoOutput);
@@ -361,12 +448,8 @@ void GaugeMetricProducer::onDumpReportLocked(const int64_t dumpTimeNs,
         protoOutput->end(wrapperToken);
     }
     protoOutput->end(protoToken);
-
-
-    if (erase_data) {
-        mPastBuckets.clear();
-        mSkippedBuckets.clear();
-        mDimensionGuardrailHit = false;
+    if (dimensionDictionary) {
+        dimensionDictionary->writeToProto(str_set, protoOutput);
     }
 }
 
@@ -433,6 +516,13 @@ void GaugeMetricProducer::onActiveStateChangedLocked(const int64_t eventTimeNs,
     }
 }
 
+void GaugeMetricProducer::hibernateLocked() {
+    // The arena keeps its first slab for the next bucket when the bucket is flushed.
+    if (mCurrentSlicedBucket->empty()) {
+        mCurrentBucketFields = GaugeAtomArena();
+    }
+}
+
 void GaugeMetricProducer::onConditionChangedLocked(const bool conditionMet,
                                                    const int64_t eventTimeNs) {
     VLOG("GaugeMetric %lld onConditionChanged", (long long)mMetricId);
@@ -466,32 +556,48 @@ void GaugeMetricProducer::onSlicedConditionMayChangeLocked(bool overallCondition
     }  // else: Push mode. No need to proactively pull the gauge data.
 }
 
-std::shared_ptr<vector<FieldValue>> GaugeMetricProducer::getGaugeFields(const LogEvent& event) {
-    std::shared_ptr<vector<FieldValue>> gaugeFields;
+// Mirrors the pulls of onConditionChangedLocked and onSlicedConditionMayChangeLocked.
+int GaugeMetricProducer::getConditionChangePullAtomIdLocked(bool conditionMet) const {
+    if (!conditionMet || !mIsPulled || !mIsActive) {
+        return -1;
+    }
+    if (mConditionSliced) {
+        return mTriggerAtomId == -1 ? mPullTagId : -1;
+    }
+    if (mSamplingType == GaugeMetric::RANDOM_ONE_SAMPLE) {
+        return mCurrentSlicedBucket->empty() ? mPullTagId : -1;
+    }
+    return isRandomNSamples() || mSamplingType == GaugeMetric::CONDITION_CHANGE_TO_TRUE
+                   ? mPullTagId
+                   : -1;
+}
+
+GaugeFields GaugeMetricProducer::getGaugeFields(const LogEvent& event) {
+    vector<FieldValue>& gaugeFields = mGaugeFieldsBuffer;
     if (mFieldMatchers.size() > 0) {
-        gaugeFields = std::make_shared<vector<FieldValue>>();
-        filterGaugeValues(mFieldMatchers, event.getValues(), gaugeFields.get());
+        filterGaugeValues(mFieldMatchers, event.getValues(), &gaugeFields);
     } else {
-        gaugeFields = std::make_shared<vector<FieldValue>>(event.getValues());
+        gaugeFields = event.getValues();
     }
     // Trim all dimension fields from output. Dimensions will appear in output report and will
     // benefit from dictionary encoding. For large pulled atoms, this can give the benefit of
     // optional repeated field.
     for (const auto& field : mDimensionsInWhat) {
-        for (auto it = gaugeFields->begin(); it != gaugeFields->end();) {
+        for (auto it = gaugeFields.begin(); it != gaugeFields.end();) {
             if (it->mField.matches(field)) {
-                it = gaugeFields->erase(it);
+                it = gaugeFields.erase(it);
             } else {
                 it++;
             }
         }
     }
-    return gaugeFields;
+    return mCurrentBucketFields.add(&gaugeFields);
 }
 
 void GaugeMetricProducer::onDataPulled(const std::vector<std::shared_ptr<LogEvent>>& allData,
                                        PullResult pullResult, int64_t originalPullTimeNs) {
     std::lock_guard<std::mutex> lock(mMutex);
+    const ScopedCpuTimer cpuTimer = pullCpuTimerLocked();
     if (pullResult != PullResult::PULL_RESULT_SUCCESS || allData.size() == 0) {
         return;
     }
@@ -521,7 +627,7 @@ bool GaugeMetricProducer::hitGuardRailLocked(const MetricDimensionKey& newKey) {
         size_t newTupleCount = mCurrentSlicedBucket->size() + 1;
         StatsdStats::getInstance().noteMetricDimensionSize(mConfigKey, mMetricId, newTupleCount);
         // 2. Don't add more tuples, we are above the allowed threshold. Drop the data.
-        if (newTupleCount > mDimensionHardLimit) {
+        if (newTupleCount > getDimensionHardLimitLocked(mDimensionHardLimit)) {
             if (!mHasHitGuardrail) {
                 ALOGE("GaugeMetric %lld dropping data for dimension key %s", (long long)mMetricId,
                       newKey.toString().c_str());
@@ -584,8 +690,8 @@ void GaugeMetricProducer::onMatchedLogEventInternalLocked(
     // Anomaly detection on gauge metric only works when there is one numeric
     // field specified.
     if (mAnomalyTrackers.size() > 0) {
-        if (gaugeAtom.mFields->size() == 1) {
-            const Value& value = gaugeAtom.mFields->begin()->mValue;
+        if (gaugeAtom.mFields.size() == 1) {
+            const Value& value = gaugeAtom.mFields.front().mValue;
             long gaugeVal = 0;
             if (value.getType() == INT) {
                 gaugeVal = (long)value.int_value;
@@ -605,7 +711,7 @@ void GaugeMetricProducer::updateCurrentSlicedBucketForAnomaly() {
         if (slice.second.empty()) {
             continue;
         }
-        const Value& value = slice.second.front().mFields->front().mValue;
+        const Value& value = slice.second.front().mFields.front().mValue;
         long gaugeVal = 0;
         if (value.getType() == INT) {
             gaugeVal = (long)value.int_value;
@@ -620,6 +726,7 @@ void GaugeMetricProducer::dropDataLocked(const int64_t dropTimeNs) {
     flushIfNeededLocked(dropTimeNs);
     StatsdStats::getInstance().noteBucketDropped(mMetricId);
     mPastBuckets.clear();
+    mPastBucketsByteSize = 0;
 }
 
 // When a new matched event comes in, we check if event falls into the current
@@ -648,6 +755,8 @@ void GaugeMetricProducer::flushIfNeededLocked(const int64_t eventTimeNs) {
 
 void GaugeMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
                                                    const int64_t nextBucketStartTimeNs) {
+    STATSD_TRACE("MetricProducer::flushCurrentBucket config=%d:%lld metric=%lld",
+                 mConfigKey.GetUid(), (long long)mConfigKey.GetId(), (long long)mMetricId);
     int64_t fullBucketEndTimeNs = getCurrentBucketEndTimeNs();
     int64_t bucketEndTime = eventTimeNs < fullBucketEndTimeNs ? eventTimeNs : fullBucketEndTimeNs;
 
@@ -662,12 +771,15 @@ void GaugeMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
         for (const auto& slice : *mCurrentSlicedBucket) {
             info.mAggregatedAtoms.clear();
             for (const GaugeAtom& atom : slice.second) {
-                AtomDimensionKey key(mAtomId, HashableDimensionKey(*atom.mFields));
-                vector<int64_t>& elapsedTimestampsNs = info.mAggregatedAtoms[key];
+                AtomDimensionKey key(mAtomId,
+                                     HashableDimensionKey(vector<FieldValue>(
+                                             atom.mFields.begin(), atom.mFields.end())));
+                DeltaEncodedTimestamps& elapsedTimestampsNs = info.mAggregatedAtoms[key];
                 elapsedTimestampsNs.push_back(atom.mElapsedTimestampNs);
             }
             auto& bucketList = mPastBuckets[slice.first];
             bucketList.push_back(info);
+            mPastBucketsByteSize += getBucketByteSize(info);
             VLOG("Gauge gauge metric %lld, dump key value: %s", (long long)mMetricId,
                  slice.first.toString().c_str());
         }
@@ -695,7 +807,9 @@ void GaugeMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
     }
 
     StatsdStats::getInstance().noteBucketCount(mMetricId);
+    noteBucketDimensionCountLocked(mCurrentSlicedBucket->size());
     mCurrentSlicedBucket = std::make_shared<DimToGaugeAtomsMap>();
+    mCurrentBucketFields.clear();
     mCurrentBucketStartTimeNs = nextBucketStartTimeNs;
     mCurrentSkippedBucket.reset();
     // Reset mHasHitGuardrail boolean since bucket was reset
@@ -703,17 +817,20 @@ void GaugeMetricProducer::flushCurrentBucketLocked(const int64_t eventTimeNs,
 }
 
 size_t GaugeMetricProducer::byteSizeLocked() const {
-    size_t totalSize = 0;
-    for (const auto& pair : mPastBuckets) {
-        for (const auto& bucket : pair.second) {
-            for (const auto& [atomDimensionKey, elapsedTimestampsNs] : bucket.mAggregatedAtoms) {
-                totalSize += sizeof(FieldValue) *
-                             atomDimensionKey.getAtomFieldValues().getValues().size();
-                totalSize += sizeof(int64_t) * elapsedTimestampsNs.size();
-            }
-        }
-    }
-    return totalSize;
+    return mPastBucketsByteSize;
+}
+
+size_t GaugeMetricProducer::currentStateByteSizeLocked() const {
+    // The fields of the atoms are counted once, in the arena they are stored in.
+    size_t bytes = dimensionMapByteSize(*mCurrentSlicedBucket, [](const vector<GaugeAtom>& atoms) {
+        return atoms.capacity() * sizeof(GaugeAtom);
+    });
+    bytes += mCurrentBucketFields.byteSize();
+    bytes += mGaugeFieldsBuffer.capacity() * sizeof(FieldValue);
+    if (mCurrentSlicedBucketForAnomaly != nullptr) {
+        bytes += dimensionMapByteSize(*mCurrentSlicedBucketForAnomaly);
+    }
+    return bytes;
 }
 
 }  // namespace statsd
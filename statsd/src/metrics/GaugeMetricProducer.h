@@ -25,19 +25,22 @@
 #include "../external/StatsPullerManager.h"
 #include "../matchers/matcher_util.h"
 #include "../matchers/EventMatcherWizard.h"
+#include "GaugeAtomArena.h"
 #include "MetricProducer.h"
 #include "src/statsd_config.pb.h"
 #include "../stats_util.h"
+#include "../utils/DeltaEncodedTimestamps.h"
 
 namespace android {
 namespace os {
 namespace statsd {
 
 struct GaugeAtom {
-    GaugeAtom(const std::shared_ptr<vector<FieldValue>>& fields, int64_t elapsedTimeNs)
+    GaugeAtom(const GaugeFields& fields, int64_t elapsedTimeNs)
         : mFields(fields), mElapsedTimestampNs(elapsedTimeNs) {
     }
-    std::shared_ptr<vector<FieldValue>> mFields;
+    // Stored in the GaugeAtomArena of the bucket the atom was sampled in.
+    GaugeFields mFields;
     int64_t mElapsedTimestampNs;
 };
 
@@ -47,7 +50,7 @@ struct GaugeBucket {
     std::vector<GaugeAtom> mGaugeAtoms;
 
     // Maps the field/value pairs of an atom to a list of timestamps used to deduplicate atoms.
-    std::unordered_map<AtomDimensionKey, std::vector<int64_t>> mAggregatedAtoms;
+    std::unordered_map<AtomDimensionKey, DeltaEncodedTimestamps> mAggregatedAtoms;
 };
 
 typedef std::unordered_map<MetricDimensionKey, std::vector<GaugeAtom>>
@@ -70,10 +73,13 @@ public:
             const std::unordered_map<int, std::vector<std::shared_ptr<Activation>>>&
                     eventDeactivationMap = {},
             const size_t dimensionSoftLimit = StatsdStats::kDimensionKeySizeSoftLimit,
-            const size_t dimensionHardLimit = StatsdStats::kDimensionKeySizeHardLimit);
+            const size_t dimensionHardLimit = StatsdStats::kDimensionKeySizeHardLimit,
+            bool deferPullRegistration = false);
 
     virtual ~GaugeMetricProducer();
 
+    void registerPullReceiver() override;
+
     // Handles when the pulled data arrives.
     void onDataPulled(const std::vector<std::shared_ptr<LogEvent>>& data, PullResult pullResult,
                       int64_t originalPullTimeNs) override;
@@ -106,6 +112,10 @@ public:
         return METRIC_TYPE_GAUGE;
     }
 
+    int getPullAtomId() const override {
+        return mPullTagId;
+    }
+
 protected:
     void onMatchedLogEventInternalLocked(
             const size_t matcherIndex, const MetricDimensionKey& eventKey,
@@ -117,8 +127,33 @@ private:
                             const bool include_current_partial_bucket,
                             const bool erase_data,
                             const DumpLatency dumpLatency,
-                            std::set<string> *str_set,
+                            StringSet* str_set,
                             android::util::ProtoOutputStream* protoOutput) override;
+
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings) override;
+
+    // The state a dump report is written from, other than the members fixed at construction.
+    struct DumpReportData {
+        bool isActive = false;
+        bool dimensionGuardrailHit = false;
+        bool dimensionDictionary = false;
+        std::unordered_map<MetricDimensionKey, std::vector<GaugeBucket>> pastBuckets;
+        size_t pastBucketsByteSize = 0;
+        std::vector<SkippedBucket> skippedBuckets;
+    };
+
+    // Flushes, then swaps mPastBuckets and mSkippedBuckets out into the returned data.
+    DumpReportData takeDumpReportDataLocked(const int64_t dumpTimeNs,
+                                            const bool include_current_partial_bucket,
+                                            const bool erase_data);
+
+    void writeDumpReportData(const DumpReportData& data, StringSet* str_set,
+                             android::util::ProtoOutputStream* protoOutput) const;
+
+    friend class DetachedDumpReportSnapshot<GaugeMetricProducer>;
+
     void clearPastBucketsLocked(const int64_t dumpTimeNs) override;
 
     // Internal interface to handle condition change.
@@ -127,12 +162,16 @@ private:
     // Internal interface to handle active state change.
     void onActiveStateChangedLocked(const int64_t eventTimeNs, const bool isActive) override;
 
+    void hibernateLocked() override;
+
     // Internal interface to handle sliced condition change.
     void onSlicedConditionMayChangeLocked(bool overallCondition, int64_t eventTime) override;
 
     // Internal function to calculate the current used bytes.
     size_t byteSizeLocked() const override;
 
+    size_t currentStateByteSizeLocked() const override;
+
     void dumpStatesLocked(int out, bool verbose) const override;
 
     void dropDataLocked(const int64_t dropTimeNs) override;
@@ -140,6 +179,10 @@ private:
     // Util function to flush the old packet.
     void flushIfNeededLocked(int64_t eventTime) override;
 
+    size_t getOwnDimensionHardLimitLocked() const override {
+        return mDimensionHardLimit;
+    }
+
     void flushCurrentBucketLocked(int64_t eventTimeNs, int64_t nextBucketStartTimeNs) override;
 
     void prepareFirstBucketLocked() override;
@@ -147,6 +190,8 @@ private:
     // Only call if mCondition == ConditionState::kTrue && metric is active.
     void pullAndMatchEventsLocked(const int64_t timestampNs);
 
+    int getConditionChangePullAtomIdLocked(bool conditionMet) const override;
+
     optional<InvalidConfigReason> onConfigUpdatedLocked(
             const StatsdConfig& config, int configIndex, int metricIndex,
             const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
@@ -176,6 +221,9 @@ private:
     // tagId for pulled data. -1 if this is not pulled
     const int mPullTagId;
 
+    // Whether the registration for scheduled pulls waits for registerPullReceiver().
+    bool mPullRegistrationDeferred = false;
+
     // tagId for atoms that trigger the pulling, if any
     const int mTriggerAtomId;
 
@@ -188,9 +236,20 @@ private:
     // Save the past buckets and we can clear when the StatsLogReport is dumped.
     std::unordered_map<MetricDimensionKey, std::vector<GaugeBucket>> mPastBuckets;
 
+    // The bytes used by mPastBuckets, kept up to date as buckets are added and cleared so that
+    // byteSizeLocked() does not iterate them.
+    size_t mPastBucketsByteSize = 0;
+
     // The current partial bucket.
     std::shared_ptr<DimToGaugeAtomsMap> mCurrentSlicedBucket;
 
+    // The fields of the atoms of mCurrentSlicedBucket, dropped when the bucket is flushed.
+    GaugeAtomArena mCurrentBucketFields;
+
+    // Reused to filter the fields of each sampled atom before they are moved to
+    // mCurrentBucketFields.
+    std::vector<FieldValue> mGaugeFieldsBuffer;
+
     // The current full bucket for anomaly detection. This is updated to the latest value seen for
     // this slice (ie, for partial buckets, we use the last partial bucket in this full bucket).
     std::shared_ptr<DimToValMap> mCurrentSlicedBucketForAnomaly;
@@ -209,7 +268,7 @@ private:
     const int64_t mMaxPullDelayNs;
 
     // apply an allowlist on the original input
-    std::shared_ptr<vector<FieldValue>> getGaugeFields(const LogEvent& event);
+    GaugeFields getGaugeFields(const LogEvent& event);
 
     // Util function to check whether the specified dimension hits the guardrail.
     bool hitGuardRailLocked(const MetricDimensionKey& newKey);
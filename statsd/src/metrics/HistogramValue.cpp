@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "HistogramValue.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+
+using android::util::FIELD_COUNT_REPEATED;
+using android::util::FIELD_TYPE_SINT32;
+using android::util::ProtoOutputStream;
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::vector;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+// for HistogramBinCounts
+const int FIELD_ID_COUNT = 1;
+
+vector<double> generateBoundaries(const ValueMetric::HistogramBinConfig::GeneratedBins& bins) {
+    vector<double> boundaries;
+    const double min = bins.min();
+    const double max = bins.max();
+    for (int i = 0; i <= bins.count(); i++) {
+        if (i == bins.count()) {
+            // Exact, whatever the rounding of the steps.
+            boundaries.push_back(max);
+        } else if (bins.strategy() == ValueMetric::HistogramBinConfig::GeneratedBins::LINEAR) {
+            boundaries.push_back(min + (max - min) * i / bins.count());
+        } else {
+            boundaries.push_back(min * pow(max / min, (double)i / bins.count()));
+        }
+    }
+    return boundaries;
+}
+
+}  // anonymous namespace
+
+optional<HistogramBins> HistogramBins::create(const ValueMetric::HistogramBinConfig& config) {
+    vector<double> boundaries;
+    switch (config.binning_strategy_case()) {
+        case ValueMetric::HistogramBinConfig::kGeneratedBins: {
+            const ValueMetric::HistogramBinConfig::GeneratedBins& bins = config.generated_bins();
+            if (bins.count() < 1 || (size_t)bins.count() + 2 > kMaxBinCount) {
+                return nullopt;
+            }
+            switch (bins.strategy()) {
+                case ValueMetric::HistogramBinConfig::GeneratedBins::LINEAR:
+                    break;
+                case ValueMetric::HistogramBinConfig::GeneratedBins::EXPONENTIAL:
+                    if (bins.min() <= 0) {
+                        return nullopt;
+                    }
+                    break;
+                default:
+                    return nullopt;
+            }
+            boundaries = generateBoundaries(bins);
+            break;
+        }
+        case ValueMetric::HistogramBinConfig::kExplicitBins:
+            if (config.explicit_bins().boundary_size() + 1 > (int)kMaxBinCount) {
+                return nullopt;
+            }
+            boundaries.assign(config.explicit_bins().boundary().begin(),
+                              config.explicit_bins().boundary().end());
+            break;
+        default:
+            return nullopt;
+    }
+
+    if (boundaries.empty()) {
+        return nullopt;
+    }
+    for (size_t i = 1; i < boundaries.size(); i++) {
+        if (!(boundaries[i - 1] < boundaries[i])) {
+            return nullopt;
+        }
+    }
+    return HistogramBins(std::move(boundaries));
+}
+
+size_t HistogramBins::getBinIndex(const double value) const {
+    return std::upper_bound(mBoundaries.begin(), mBoundaries.end(), value) - mBoundaries.begin();
+}
+
+void HistogramValue::add(const size_t binIndex, const size_t binCount) {
+    if (mBinCounts.empty()) {
+        mBinCounts.resize(binCount);
+    }
+    int32_t& count = mBinCounts[binIndex];
+    if (count < std::numeric_limits<int32_t>::max()) {
+        count++;
+    }
+}
+
+void HistogramValue::clear() {
+    mBinCounts.clear();
+    mCompacted = false;
+}
+
+void HistogramValue::compact() {
+    if (mCompacted) {
+        return;
+    }
+    vector<int32_t> encoded;
+    int32_t emptyBins = 0;
+    for (const int32_t count : mBinCounts) {
+        if (count == 0) {
+            emptyBins++;
+            continue;
+        }
+        if (emptyBins > 0) {
+            encoded.push_back(-emptyBins);
+            emptyBins = 0;
+        }
+        encoded.push_back(count);
+    }
+    if (emptyBins > 0) {
+        encoded.push_back(-emptyBins);
+    }
+    // Assigning to a new vector rather than reserving keeps the capacity to the encoded size.
+    mBinCounts = vector<int32_t>(encoded.begin(), encoded.end());
+    mCompacted = true;
+}
+
+void HistogramValue::writeToProto(ProtoOutputStream* protoOutput) const {
+    HistogramValue compacted;
+    const vector<int32_t>* counts = &mBinCounts;
+    if (!mCompacted) {
+        compacted.mBinCounts = mBinCounts;
+        compacted.compact();
+        counts = &compacted.mBinCounts;
+    }
+    for (const int32_t count : *counts) {
+        protoOutput->write(FIELD_TYPE_SINT32 | FIELD_COUNT_REPEATED | FIELD_ID_COUNT, count);
+    }
+}
+
+string HistogramValue::toString() const {
+    string result = mCompacted ? "compacted [" : "[";
+    for (size_t i = 0; i < mBinCounts.size(); i++) {
+        if (i > 0) {
+            result += ", ";
+        }
+        result += std::to_string(mBinCounts[i]);
+    }
+    return result + "]";
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/util/ProtoOutputStream.h>
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/statsd_config.pb.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// The bins of a value metric with the HISTOGRAM aggregation type, shared by all of its
+// histograms. Bin 0 holds the values below the first boundary, bin i the values in
+// [boundary[i - 1], boundary[i]), and the last bin the values from the last boundary up.
+class HistogramBins {
+public:
+    static constexpr size_t kMaxBinCount = 100;
+
+    // Returns nullopt if the config does not describe strictly increasing boundaries, or more than
+    // kMaxBinCount bins.
+    static std::optional<HistogramBins> create(const ValueMetric::HistogramBinConfig& config);
+
+    inline size_t getBinCount() const {
+        return mBoundaries.size() + 1;
+    }
+
+    size_t getBinIndex(double value) const;
+
+private:
+    explicit HistogramBins(std::vector<double> boundaries) : mBoundaries(std::move(boundaries)) {
+    }
+
+    std::vector<double> mBoundaries;
+};
+
+// The bin counts of one histogram. They are dense while the bucket is open, and compacted into
+// the encoding of HistogramBinCounts once the bucket is closed, since most bins of a closed
+// bucket are usually empty.
+class HistogramValue {
+public:
+    // Adds a value to bin binIndex of binCount bins. Only valid before compact().
+    void add(size_t binIndex, size_t binCount);
+
+    void clear();
+
+    // Encodes runs of empty bins as negative counts and releases the unused memory.
+    void compact();
+
+    inline size_t getByteSize() const {
+        return mBinCounts.capacity() * sizeof(int32_t);
+    }
+
+    // Writes the fields of a HistogramBinCounts message.
+    void writeToProto(android::util::ProtoOutputStream* protoOutput) const;
+
+    std::string toString() const;
+
+private:
+    // Dense, or encoded as in HistogramBinCounts when mCompacted.
+    std::vector<int32_t> mBinCounts;
+
+    bool mCompacted = false;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
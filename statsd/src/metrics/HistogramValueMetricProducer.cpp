@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "HistogramValueMetricProducer.h"
+
+#include "guardrail/StatsdStats.h"
+
+using android::util::FIELD_COUNT_REPEATED;
+using android::util::FIELD_TYPE_INT32;
+using android::util::FIELD_TYPE_MESSAGE;
+using android::util::ProtoOutputStream;
+using std::nullopt;
+using std::optional;
+using std::vector;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// for StatsLogReport
+const int FIELD_ID_VALUE_METRICS = 7;
+// for ValueBucketInfo
+const int FIELD_ID_VALUE_INDEX = 1;
+const int FIELD_ID_VALUE_SAMPLESIZE = 4;
+const int FIELD_ID_VALUE_HISTOGRAM = 5;
+const int FIELD_ID_VALUES = 9;
+const int FIELD_ID_BUCKET_NUM = 4;
+const int FIELD_ID_START_BUCKET_ELAPSED_MILLIS = 5;
+const int FIELD_ID_END_BUCKET_ELAPSED_MILLIS = 6;
+const int FIELD_ID_CONDITION_TRUE_NS = 10;
+
+namespace {
+
+optional<double> getDoubleValueFromEvent(const LogEvent& event, const Matcher& matcher) {
+    for (const FieldValue& value : event.getValues()) {
+        if (value.mField.matches(matcher)) {
+            switch (value.mValue.type) {
+                case INT:
+                case LONG:
+                case FLOAT:
+                case DOUBLE:
+                    return value.mValue.getDouble();
+                default:
+                    return nullopt;
+            }
+        }
+    }
+    return nullopt;
+}
+
+}  // anonymous namespace
+
+HistogramValueMetricProducer::HistogramValueMetricProducer(
+        const ConfigKey& key, const ValueMetric& metric, const HistogramBins& bins,
+        const uint64_t protoHash, const PullOptions& pullOptions,
+        const BucketOptions& bucketOptions, const WhatOptions& whatOptions,
+        const ConditionOptions& conditionOptions, const StateOptions& stateOptions,
+        const ActivationOptions& activationOptions, const GuardrailOptions& guardrailOptions)
+    : ValueMetricProducer(metric.id(), key, protoHash, pullOptions, bucketOptions, whatOptions,
+                          conditionOptions, stateOptions, activationOptions, guardrailOptions),
+      mBins(bins),
+      mIncludeSampleSize(metric.include_sample_size()) {
+}
+
+HistogramValueMetricProducer::DumpProtoFields HistogramValueMetricProducer::getDumpProtoFields()
+        const {
+    return {FIELD_ID_VALUE_METRICS,
+            FIELD_ID_BUCKET_NUM,
+            FIELD_ID_START_BUCKET_ELAPSED_MILLIS,
+            FIELD_ID_END_BUCKET_ELAPSED_MILLIS,
+            FIELD_ID_CONDITION_TRUE_NS,
+            /*conditionCorrectionNsFieldId=*/nullopt};
+}
+
+void HistogramValueMetricProducer::writePastBucketAggregateToProto(
+        const int aggIndex, const HistogramValue& histogram, const int sampleSize,
+        ProtoOutputStream* const protoOutput) const {
+    uint64_t valueToken =
+            protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_VALUES);
+    protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_VALUE_INDEX, aggIndex);
+    if (mIncludeSampleSize) {
+        protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_VALUE_SAMPLESIZE, sampleSize);
+    }
+    uint64_t histogramToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_VALUE_HISTOGRAM);
+    histogram.writeToProto(protoOutput);
+    protoOutput->end(histogramToken);
+    VLOG("\t\t histogram %d: %s", aggIndex, histogram.toString().c_str());
+    protoOutput->end(valueToken);
+}
+
+bool HistogramValueMetricProducer::aggregateFields(const int64_t eventTimeNs,
+                                                   const MetricDimensionKey& eventKey,
+                                                   const LogEvent& event,
+                                                   vector<Interval>& intervals, Empty& empty) {
+    bool seenNewData = false;
+    for (size_t i = 0; i < mFieldMatchers.size(); i++) {
+        const Matcher& matcher = mFieldMatchers[i];
+        Interval& interval = intervals[i];
+        interval.aggIndex = i;
+        const optional<double> valueOpt = getDoubleValueFromEvent(event, matcher);
+        if (!valueOpt) {
+            VLOG("Failed to get value %zu from event %s", i, event.ToString().c_str());
+            StatsdStats::getInstance().noteBadValueType(mMetricId);
+            return seenNewData;
+        }
+
+        // The intervals of state sliced buckets are kept across buckets with no samples.
+        if (!interval.hasValue()) {
+            interval.aggregate.clear();
+        }
+        seenNewData = true;
+        interval.aggregate.add(mBins.getBinIndex(valueOpt.value()), mBins.getBinCount());
+        interval.sampleSize += 1;
+    }
+    return seenNewData;
+}
+
+PastBucket<HistogramValue> HistogramValueMetricProducer::buildPartialBucket(
+        int64_t bucketEndTimeNs, vector<Interval>& intervals) {
+    PastBucket<HistogramValue> bucket;
+    bucket.mBucketStartNs = mCurrentBucketStartTimeNs;
+    bucket.mBucketEndNs = bucketEndTimeNs;
+    bucket.mAggregatesOffset = mPastBucketAggregates.size();
+    bucket.mAggregatesCount = 0;
+    for (Interval& interval : intervals) {
+        if (!interval.hasValue()) {
+            continue;
+        }
+        mPastBucketAggregates.aggIndex.push_back(interval.aggIndex);
+        HistogramValue& histogram = mPastBucketAggregates.aggregates.emplace_back();
+        std::swap(histogram, interval.aggregate);
+        interval.aggregate.clear();
+        histogram.compact();
+        mPastBucketsByteSize += sizeof(int) + sizeof(HistogramValue) + histogram.getByteSize();
+        if (mIncludeSampleSize) {
+            mPastBucketAggregates.sampleSizes.push_back(interval.sampleSize);
+            mPastBucketsByteSize += sizeof(int);
+        }
+        bucket.mAggregatesCount++;
+    }
+    return bucket;
+}
+
+size_t HistogramValueMetricProducer::byteSizeLocked() const {
+    return mPastBucketsByteSize;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -29,6 +29,7 @@
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BYTES;
 using android::util::FIELD_TYPE_INT32;
+using android::util::FIELD_TYPE_INT64;
 using android::util::FIELD_TYPE_MESSAGE;
 using android::util::ProtoOutputStream;
 using std::nullopt;
@@ -42,6 +43,11 @@ namespace statsd {
 
 // for StatsLogReport
 const int FIELD_ID_KLL_METRICS = 16;
+// for KllMetricDataWrapper
+const int FIELD_ID_SKETCH_HEADER = 3;
+// for KllSketchHeader
+const int FIELD_ID_HEADER_K = 1;
+const int FIELD_ID_HEADER_INV_EPS = 2;
 // for KllBucketInfo
 const int FIELD_ID_SKETCH_INDEX = 1;
 const int FIELD_ID_KLL_SKETCH = 2;
@@ -60,7 +66,10 @@ KllMetricProducer::KllMetricProducer(const ConfigKey& key, const KllMetric& metr
                                      const ActivationOptions& activationOptions,
                                      const GuardrailOptions& guardrailOptions)
     : ValueMetricProducer(metric.id(), key, protoHash, pullOptions, bucketOptions, whatOptions,
-                          conditionOptions, stateOptions, activationOptions, guardrailOptions) {
+                          conditionOptions, stateOptions, activationOptions, guardrailOptions),
+      mCompactSketchEncoding(metric.compact_sketch_encoding()),
+      mMaxSketchSize(metric.max_sketch_size()) {
+    mKllQuantileOptions.set_buffer_pool(std::make_shared<CompactorBufferPool>());
 }
 
 KllMetricProducer::DumpProtoFields KllMetricProducer::getDumpProtoFields() const {
@@ -80,7 +89,8 @@ void KllMetricProducer::writePastBucketAggregateToProto(
     protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_SKETCH_INDEX, aggIndex);
 
     // TODO(b/186737273): Serialize directly to ProtoOutputStream
-    const AggregatorStateProto& aggProto = kll->SerializeToProto();
+    const AggregatorStateProto& aggProto =
+            mCompactSketchEncoding ? kll->SerializeToCompactProto() : kll->SerializeToProto();
     const size_t numBytes = aggProto.ByteSizeLong();
     const unique_ptr<char[]> buffer(new char[numBytes]);
     aggProto.SerializeToArray(&buffer[0], numBytes);
@@ -90,6 +100,19 @@ void KllMetricProducer::writePastBucketAggregateToProto(
     protoOutput->end(sketchesToken);
 }
 
+void KllMetricProducer::writeDataWrapperFieldsToProto(const DumpReportData& data,
+                                                      ProtoOutputStream* const protoOutput) const {
+    if (!mCompactSketchEncoding || data.pastBucketAggregates.aggregates.empty()) {
+        return;
+    }
+    // All sketches are created with mKllQuantileOptions, so any of them has the shared fields.
+    const unique_ptr<KllQuantile>& kll = data.pastBucketAggregates.aggregates[0];
+    uint64_t headerToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_SKETCH_HEADER);
+    protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_HEADER_K, kll->k());
+    protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_HEADER_INV_EPS, (long long)kll->inv_eps());
+    protoOutput->end(headerToken);
+}
+
 optional<int64_t> getInt64ValueFromEvent(const LogEvent& event, const Matcher& matcher) {
     for (const FieldValue& value : event.getValues()) {
         if (value.mField.matches(matcher)) {
@@ -126,7 +149,7 @@ bool KllMetricProducer::aggregateFields(const int64_t eventTimeNs,
         // 2. Ownership of the unique_ptr<KllQuantile> at interval.aggregate being transferred to
         // PastBucket after flushing.
         if (!interval.aggregate) {
-            interval.aggregate = KllQuantile::Create();
+            interval.aggregate = KllQuantile::Create(mKllQuantileOptions);
         }
         seenNewData = true;
         interval.aggregate->Add(valueOpt.value());
@@ -140,33 +163,27 @@ PastBucket<unique_ptr<KllQuantile>> KllMetricProducer::buildPartialBucket(
     PastBucket<unique_ptr<KllQuantile>> bucket;
     bucket.mBucketStartNs = mCurrentBucketStartTimeNs;
     bucket.mBucketEndNs = bucketEndTimeNs;
+    bucket.mAggregatesOffset = mPastBucketAggregates.size();
+    bucket.mAggregatesCount = 0;
     for (Interval& interval : intervals) {
         if (interval.hasValue()) {
-            bucket.aggIndex.push_back(interval.aggIndex);
+            if (mMaxSketchSize > 0) {
+                interval.aggregate->CompactTo(mMaxSketchSize);
+            }
+            mPastBucketAggregates.aggIndex.push_back(interval.aggIndex);
+            mPastBucketsByteSize +=
+                    sizeof(int) + sizeof(int64_t) * interval.aggregate->num_stored_values();
             // Transfer ownership of unique_ptr<KllQuantile> from interval.aggregate to
-            // bucket.aggregates vector. interval.aggregate is guaranteed to be nullptr after this.
-            bucket.aggregates.push_back(std::move(interval.aggregate));
+            // mPastBucketAggregates. interval.aggregate is guaranteed to be nullptr after this.
+            mPastBucketAggregates.aggregates.push_back(std::move(interval.aggregate));
+            bucket.mAggregatesCount++;
         }
     }
     return bucket;
 }
 
 size_t KllMetricProducer::byteSizeLocked() const {
-    size_t totalSize = 0;
-    for (const auto& [_, buckets] : mPastBuckets) {
-        totalSize += buckets.size() * kBucketSize;
-        for (const auto& bucket : buckets) {
-            static const size_t kIntSize = sizeof(int);
-            totalSize += bucket.aggIndex.size() * kIntSize;
-            if (!bucket.aggregates.empty()) {
-                static const size_t kInt64Size = sizeof(int64_t);
-                // Assume sketch size is the same for all aggregations in a bucket.
-                totalSize += bucket.aggregates.size() * kInt64Size *
-                             bucket.aggregates[0]->num_stored_values();
-            }
-        }
-    }
-    return totalSize;
+    return mPastBucketsByteSize;
 }
 
 }  // namespace statsd
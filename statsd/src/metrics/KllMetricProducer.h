@@ -30,7 +30,9 @@
 #include "src/statsd_config.pb.h"
 #include "stats_log_util.h"
 
+using dist_proc::aggregation::CompactorBufferPool;
 using dist_proc::aggregation::KllQuantile;
+using dist_proc::aggregation::KllQuantileOptions;
 
 namespace android {
 namespace os {
@@ -102,6 +104,9 @@ private:
                                          const int sampleSize,
                                          ProtoOutputStream* const protoOutput) const override;
 
+    void writeDataWrapperFieldsToProto(const DumpReportData& data,
+                                       ProtoOutputStream* const protoOutput) const override;
+
     bool aggregateFields(const int64_t eventTimeNs, const MetricDimensionKey& eventKey,
                          const LogEvent& event, std::vector<Interval>& intervals,
                          Empty& empty) override;
@@ -109,10 +114,24 @@ private:
     // Internal function to calculate the current used bytes.
     size_t byteSizeLocked() const override;
 
+    // Options for all sketches of this metric. They share one pool of compactor buffers, so the
+    // buffers of sketches freed after a report are reused by the sketches of the next bucket.
+    // Only accessed with mMutex held.
+    KllQuantileOptions mKllQuantileOptions;
+
+    // Whether sketches are written with KllQuantile::SerializeToCompactProto, see
+    // KllMetric.compact_sketch_encoding.
+    const bool mCompactSketchEncoding;
+
+    // If positive, the number of values each sketch is compacted to when its bucket ends.
+    const int32_t mMaxSketchSize;
+
     FRIEND_TEST(KllMetricProducerTest, TestByteSize);
     FRIEND_TEST(KllMetricProducerTest, TestPushedEventsWithoutCondition);
     FRIEND_TEST(KllMetricProducerTest, TestPushedEventsWithCondition);
     FRIEND_TEST(KllMetricProducerTest, TestForcedBucketSplitWhenConditionUnknownSkipsBucket);
+    FRIEND_TEST(KllMetricProducerTest, TestSketchesShareBufferPool);
+    FRIEND_TEST(KllMetricProducerTest, TestCompactSketchEncoding);
 
     FRIEND_TEST(KllMetricProducerTest_BucketDrop, TestInvalidBucketWhenConditionUnknown);
     FRIEND_TEST(KllMetricProducerTest_BucketDrop, TestBucketDropWhenBucketTooSmall);
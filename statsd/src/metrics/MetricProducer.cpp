@@ -20,6 +20,7 @@
 #include "MetricProducer.h"
 
 #include "../guardrail/StatsdStats.h"
+#include "metrics/CountMetricProducer.h"
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "state/StateTracker.h"
 
@@ -44,6 +45,28 @@ const int FIELD_ID_ACTIVE_EVENT_ACTIVATION_ATOM_MATCHER_INDEX = 1;
 const int FIELD_ID_ACTIVE_EVENT_ACTIVATION_REMAINING_TTL_NANOS = 2;
 const int FIELD_ID_ACTIVE_EVENT_ACTIVATION_STATE = 3;
 
+// for StatsLogReport
+const int FIELD_ID_DIMENSION_OVERFLOW = 19;
+
+namespace {
+
+// A report encoded while the producer was locked.
+class EncodedDumpReportSnapshot : public MetricProducer::DumpReportSnapshot {
+public:
+    void write(const uint64_t fieldId, StringSet* str_set,
+               ProtoOutputStream* protoOutput) const override {
+        protoOutput->write(fieldId, reinterpret_cast<const char*>(mReport.data()), mReport.size());
+        if (str_set != nullptr) {
+            str_set->insert(mStrings.begin(), mStrings.end());
+        }
+    }
+
+    std::vector<uint8_t> mReport;
+    StringSet mStrings;
+};
+
+}  // anonymous namespace
+
 MetricProducer::MetricProducer(
         int64_t metricId, const ConfigKey& key, const int64_t timeBaseNs, const int conditionIndex,
         const vector<ConditionState>& initialConditionCache, const sp<ConditionWizard>& wizard,
@@ -110,11 +133,43 @@ optional<InvalidConfigReason> MetricProducer::onConfigUpdatedLocked(
     }
     mEventActivationMap = newEventActivationMap;
     mEventDeactivationMap = newEventDeactivationMap;
+    mActivationGeneration++;
     mAnomalyTrackers.clear();
     return nullopt;
 }
 
+void MetricProducer::setDimensionBudget(const std::shared_ptr<DimensionBudget>& budget) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const size_t ownLimit = getOwnDimensionHardLimitLocked();
+    if (budget == nullptr || ownLimit == 0) {
+        mDimensionBudget = nullptr;
+        return;
+    }
+    mDimensionBudget = budget;
+    mDimensionBudgetSlot = budget->addMetric(ownLimit);
+    mDimensionBudgetLimit = ownLimit;
+}
+
+void MetricProducer::noteBucketDimensionCountLocked(size_t dimensionCount) {
+    if (mDimensionBudget != nullptr) {
+        mDimensionBudgetLimit =
+                mDimensionBudget->rebalance(mDimensionBudgetSlot, dimensionCount, mHasHitGuardrail);
+    }
+}
+
 void MetricProducer::onMatchedLogEventLocked(const size_t matcherIndex, const LogEvent& event) {
+    onMatchedLogEventWithDimensionLocked(matcherIndex, event, nullptr);
+}
+
+void MetricProducer::onMatchedLogEventWithDimensionLocked(
+        const size_t matcherIndex, const LogEvent& event,
+        const HashableDimensionKey* dimensionInWhat) {
+    onMatchedLogEventAsLocked<MetricProducer>(matcherIndex, event, dimensionInWhat);
+}
+
+template <typename Producer>
+void MetricProducer::onMatchedLogEventAsLocked(const size_t matcherIndex, const LogEvent& event,
+                                               const HashableDimensionKey* dimensionInWhat) {
     if (!mIsActive) {
         return;
     }
@@ -178,19 +233,38 @@ void MetricProducer::onMatchedLogEventLocked(const size_t matcherIndex, const Lo
         stateValuesKey.addValue(value);
     }
 
-    HashableDimensionKey dimensionInWhat;
-    filterValues(mDimensionsInWhat, event.getValues(), &dimensionInWhat);
-    MetricDimensionKey metricKey(dimensionInWhat, stateValuesKey);
-    onMatchedLogEventInternalLocked(matcherIndex, metricKey, conditionKey, condition, event,
-                                    statePrimaryKeys);
+    HashableDimensionKey extractedDimensionInWhat;
+    if (dimensionInWhat == nullptr) {
+        filterValues(mDimensionsInWhat, event, &extractedDimensionInWhat);
+        dimensionInWhat = &extractedDimensionInWhat;
+    }
+    if (!mSlicedByUid) {
+        for (const FieldValue& value : dimensionInWhat->getValues()) {
+            if (isUidField(value) || isAttributionUidField(value)) {
+                mSlicedByUid = true;
+                break;
+            }
+        }
+    }
+    MetricDimensionKey metricKey(*dimensionInWhat, stateValuesKey);
+    static_cast<Producer*>(this)->onMatchedLogEventInternalLocked(
+            matcherIndex, metricKey, conditionKey, condition, event, statePrimaryKeys);
 }
 
+template void MetricProducer::onMatchedLogEventAsLocked<MetricProducer>(
+        const size_t matcherIndex, const LogEvent& event,
+        const HashableDimensionKey* dimensionInWhat);
+template void MetricProducer::onMatchedLogEventAsLocked<CountMetricProducer>(
+        const size_t matcherIndex, const LogEvent& event,
+        const HashableDimensionKey* dimensionInWhat);
+
 bool MetricProducer::evaluateActiveStateLocked(int64_t elapsedTimestampNs) {
     bool isActive = mEventActivationMap.empty();
     for (auto& it : mEventActivationMap) {
         if (it.second->state == ActivationState::kActive &&
             elapsedTimestampNs > it.second->ttl_ns + it.second->start_ns) {
             it.second->state = ActivationState::kNotActive;
+            mActivationGeneration++;
         }
         if (it.second->state == ActivationState::kActive) {
             isActive = true;
@@ -211,9 +285,40 @@ void MetricProducer::flushIfExpire(int64_t elapsedTimestampNs) {
         // Set mIsActive to false after onActiveStateChangedLocked to ensure any pulls that occur
         // through onActiveStateChangedLocked are processed.
         mIsActive = false;
+        hibernateLocked();
     }
 }
 
+int64_t MetricProducer::getNextActivationExpiryNs() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mIsActive) {
+        return INT64_MAX;
+    }
+    int64_t expiryNs = INT64_MIN;
+    bool hasRunningActivation = false;
+    for (const auto& [_, activation] : mEventActivationMap) {
+        if (activation->state != ActivationState::kActive) {
+            continue;
+        }
+        const int64_t activationExpiryNs = activation->start_ns + activation->ttl_ns;
+        if (!hasRunningActivation || activationExpiryNs < expiryNs) {
+            expiryNs = activationExpiryNs;
+        }
+        hasRunningActivation = true;
+    }
+    return expiryNs;
+}
+
+optional<uint64_t> MetricProducer::getStableActivationGeneration() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto& [_, activation] : mEventActivationMap) {
+        if (activation->state == ActivationState::kActive) {
+            return nullopt;
+        }
+    }
+    return mActivationGeneration;
+}
+
 void MetricProducer::activateLocked(int activationTrackerIndex, int64_t elapsedTimestampNs) {
     auto it = mEventActivationMap.find(activationTrackerIndex);
     if (it == mEventActivationMap.end()) {
@@ -223,12 +328,14 @@ void MetricProducer::activateLocked(int activationTrackerIndex, int64_t elapsedT
     if (ACTIVATE_ON_BOOT == activation->activationType) {
         if (ActivationState::kNotActive == activation->state) {
             activation->state = ActivationState::kActiveOnBoot;
+            mActivationGeneration++;
         }
         // If the Activation is already active or set to kActiveOnBoot, do nothing.
         return;
     }
     activation->start_ns = elapsedTimestampNs;
     activation->state = ActivationState::kActive;
+    mActivationGeneration++;
     if (!mIsActive) {  // Metric was previously inactive and now is active.
         // Set mIsActive to true before onActiveStateChangedLocked to ensure any pulls that occur
         // through onActiveStateChangedLocked are processed.
@@ -246,6 +353,7 @@ void MetricProducer::cancelEventActivationLocked(int deactivationTrackerIndex) {
     for (auto& activationToCancelIt : it->second) {
         activationToCancelIt->state = ActivationState::kNotActive;
     }
+    mActivationGeneration++;
 }
 
 void MetricProducer::loadActiveMetricLocked(const ActiveMetric& activeMetric,
@@ -253,6 +361,7 @@ void MetricProducer::loadActiveMetricLocked(const ActiveMetric& activeMetric,
     if (mEventActivationMap.size() == 0) {
         return;
     }
+    mActivationGeneration++;
     for (int i = 0; i < activeMetric.activation_size(); i++) {
         const auto& activeEventActivation = activeMetric.activation(i);
         auto it = mEventActivationMap.find(activeEventActivation.atom_matcher_index());
@@ -321,30 +430,33 @@ void MetricProducer::writeActiveMetricToProtoOutputStream(
 
 void MetricProducer::queryStateValue(int32_t atomId, const HashableDimensionKey& queryKey,
                                      FieldValue* value) {
-    if (!StateManager::getInstance().getStateValue(atomId, queryKey, value)) {
+    const StateTracker* stateTracker = getStateTracker(atomId);
+    if (stateTracker == nullptr) {
         value->mValue = Value(StateTracker::kStateUnknown);
         value->mField.setTag(atomId);
         ALOGW("StateTracker not found for state atom %d", atomId);
         return;
     }
+    // A key without a state yields kStateUnknown.
+    stateTracker->getStateValue(queryKey, value);
 }
 
-void MetricProducer::mapStateValue(int32_t atomId, FieldValue* value) {
-    // check if there is a state map for this atom
-    auto atomIt = mStateGroupMap.find(atomId);
-    if (atomIt == mStateGroupMap.end()) {
-        return;
+const StateTracker* MetricProducer::getStateTracker(int32_t atomId) {
+    const StateManager& stateManager = StateManager::getInstance();
+    if (mStateTrackersGeneration != stateManager.getTrackersGeneration()) {
+        mStateTrackers.clear();
+        for (const int32_t slicedStateAtomId : mSlicedStateAtoms) {
+            mStateTrackers.emplace_back(slicedStateAtomId,
+                                        stateManager.findStateTracker(slicedStateAtomId));
+        }
+        mStateTrackersGeneration = stateManager.getTrackersGeneration();
     }
-    auto valueIt = atomIt->second.find(value->mValue.int_value);
-    if (valueIt == atomIt->second.end()) {
-        // state map exists, but value was not put in a state group
-        // so set mValue to kStateUnknown
-        // TODO(tsaichristine): handle incomplete state maps
-        value->mValue.setInt(StateTracker::kStateUnknown);
-    } else {
-        // set mValue to group_id
-        value->mValue.setLong(valueIt->second);
+    for (const auto& [slicedStateAtomId, stateTracker] : mStateTrackers) {
+        if (slicedStateAtomId == atomId) {
+            return stateTracker;
+        }
     }
+    return stateManager.findStateTracker(atomId);
 }
 
 HashableDimensionKey MetricProducer::getUnknownStateKey() {
@@ -366,10 +478,41 @@ DropEvent MetricProducer::buildDropEvent(const int64_t dropTimeNs,
     return event;
 }
 
+std::unique_ptr<MetricProducer::DumpReportSnapshot> MetricProducer::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    std::unique_ptr<EncodedDumpReportSnapshot> snapshot =
+            std::make_unique<EncodedDumpReportSnapshot>();
+    ProtoOutputStream protoOutput;
+    onDumpReportLocked(dumpTimeNs, include_current_partial_bucket, erase_data, dumpLatency,
+                       hashStrings ? &snapshot->mStrings : nullptr, &protoOutput);
+    protoOutput.serializeToVector(&snapshot->mReport);
+    return snapshot;
+}
+
 bool MetricProducer::maxDropEventsReached() const {
     return mCurrentSkippedBucket.dropEvents.size() >= StatsdStats::kMaxLoggedBucketDropEvents;
 }
 
+void MetricProducer::noteDimensionOverflowLocked(const MetricDimensionKey& eventKey) {
+    if (mDimensionOverflowSketch == nullptr) {
+        mDimensionOverflowSketch = std::make_shared<DimensionOverflowSketch>();
+    }
+    mDimensionOverflowSketch->add(eventKey.getDimensionKeyInWhat());
+}
+
+void MetricProducer::writeDimensionOverflowSketch(
+        const shared_ptr<const DimensionOverflowSketch>& sketch, StringSet* strSet,
+        ProtoOutputStream* protoOutput) {
+    if (sketch == nullptr) {
+        return;
+    }
+    const uint64_t overflowToken =
+            protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_DIMENSION_OVERFLOW);
+    sketch->writeToProto(strSet, protoOutput);
+    protoOutput->end(overflowToken);
+}
+
 bool MetricProducer::passesSampleCheckLocked(const vector<FieldValue>& values) const {
     // Only perform sampling if shard count is correct and there is a sampled what field.
     if (mShardCount <= 1 || mSampledWhatFields.size() == 0) {
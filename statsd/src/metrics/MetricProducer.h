@@ -20,6 +20,9 @@
 #include <src/active_config_list.pb.h>
 #include <utils/RefBase.h>
 
+#include <memory>
+#include <optional>
+#include <set>
 #include <unordered_map>
 
 #include "HashableDimensionKey.h"
@@ -30,8 +33,11 @@
 #include "guardrail/StatsdStats.h"
 #include "matchers/EventMatcherWizard.h"
 #include "matchers/matcher_util.h"
+#include "metrics/DimensionBudget.h"
+#include "metrics/DimensionOverflowSketch.h"
 #include "packages/PackageInfoListener.h"
 #include "src/statsd_metadata.pb.h"  // MetricMetadata
+#include "state/StateGroupMap.h"
 #include "state/StateListener.h"
 #include "state/StateManager.h"
 #include "utils/DbUtils.h"
@@ -174,23 +180,49 @@ public:
     };
 
     /**
-     * Force a partial bucket split on app upgrade
+     * Force a partial bucket split on app upgrade. An upgrade within coalescingWindowNs of the
+     * last split does not split again, so that a burst of upgrades makes one partial bucket.
      */
-    void notifyAppUpgrade(int64_t eventTimeNs) {
+    void notifyAppUpgrade(int64_t eventTimeNs, int64_t coalescingWindowNs = 0) {
         std::lock_guard<std::mutex> lock(mMutex);
         const bool splitBucket =
                 mSplitBucketForAppUpgrade ? mSplitBucketForAppUpgrade.value() : false;
         if (!splitBucket) {
             return;
         }
+        if (mLastAppUpgradeSplitNs >= 0 &&
+            eventTimeNs - mLastAppUpgradeSplitNs < coalescingWindowNs) {
+            return;
+        }
+        mLastAppUpgradeSplitNs = eventTimeNs;
         notifyAppUpgradeInternalLocked(eventTimeNs);
     };
 
-    void notifyAppRemoved(int64_t eventTimeNs) {
+    void notifyAppRemoved(int64_t eventTimeNs, int64_t coalescingWindowNs = 0) {
         // Force buckets to split on removal also.
-        notifyAppUpgrade(eventTimeNs);
+        notifyAppUpgrade(eventTimeNs, coalescingWindowNs);
     };
 
+    inline bool splitsBucketForAppUpgrade() const {
+        return mSplitBucketForAppUpgrade.value_or(false);
+    }
+
+    /**
+     * Whether the dimensions in what of the events seen so far hold a uid, so that the metric
+     * has data of individual apps.
+     */
+    bool isSlicedByUid() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSlicedByUid;
+    }
+
+    /**
+     * The atom the metric pulls, or -1 if the metric is on pushed atoms.
+     */
+    virtual int getPullAtomId() const {
+        return -1;
+    }
+
     /**
      * Force a partial bucket split on boot complete.
      */
@@ -219,23 +251,60 @@ public:
         return mConditionSliced;
     };
 
+    // Returns the atom this metric would pull if its condition changed to conditionMet now, or
+    // -1 if it would not pull.
+    int getConditionChangePullAtomId(bool conditionMet) const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return getConditionChangePullAtomIdLocked(conditionMet);
+    }
+
     void onStateChanged(const int64_t eventTimeNs, const int32_t atomId,
                         const HashableDimensionKey& primaryKey, const FieldValue& oldState,
                         const FieldValue& newState){};
 
+    // Metrics look up the state values of their events when the events arrive, so only the ones
+    // that have to act on state changes as they happen opt into notifications.
+    bool needsStateChangeNotifications() const override {
+        return false;
+    }
+
     // Output the metrics data to [protoOutput]. All metrics reports end with the same timestamp.
     // This method clears all the past buckets.
     void onDumpReport(const int64_t dumpTimeNs,
                       const bool include_current_partial_bucket,
                       const bool erase_data,
                       const DumpLatency dumpLatency,
-                      std::set<string> *str_set,
+                      StringSet* str_set,
                       android::util::ProtoOutputStream* protoOutput) {
         std::lock_guard<std::mutex> lock(mMutex);
         return onDumpReportLocked(dumpTimeNs, include_current_partial_bucket, erase_data,
                 dumpLatency, str_set, protoOutput);
     }
 
+    // A dump report whose data has been detached from its producer. Writing it touches no state
+    // that event processing modifies, so it needs no lock.
+    class DumpReportSnapshot {
+    public:
+        virtual ~DumpReportSnapshot() {
+        }
+
+        // Writes the StatsLogReport as the message field fieldId of protoOutput.
+        virtual void write(const uint64_t fieldId, StringSet* str_set,
+                           android::util::ProtoOutputStream* protoOutput) const = 0;
+    };
+
+    // First phase of a two-phase onDumpReport(): flushes the metric and swaps the data of the
+    // report out of it while holding mMutex. The expensive encoding is left to the snapshot's
+    // write(), which callers run once they released their own locks. hashStrings tells whether
+    // write() will be given a str_set. The producer must be owned by an sp.
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshot(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return takeDumpReportSnapshotLocked(dumpTimeNs, include_current_partial_bucket, erase_data,
+                                            dumpLatency, hashStrings);
+    }
+
     virtual optional<InvalidConfigReason> onConfigUpdatedLocked(
             const StatsdConfig& config, int configIndex, int metricIndex,
             const std::vector<sp<AtomMatchingTracker>>& allAtomMatchingTrackers,
@@ -262,6 +331,11 @@ public:
         prepareFirstBucketLocked();
     }
 
+    // Registers the metric for its scheduled pulls, if it was created with its pull registration
+    // deferred. Does nothing for other metrics.
+    virtual void registerPullReceiver() {
+    }
+
     // Returns the memory in bytes currently used to store this metric's data. Does not change
     // state.
     size_t byteSize() const {
@@ -269,6 +343,15 @@ public:
         return byteSizeLocked();
     }
 
+    // Returns the memory in bytes used by the state of the current bucket: the dimension maps,
+    // their hash tables and the heap memory of their keys, and the trackers. Unlike byteSize(),
+    // this memory is not freed by a dump report, and it iterates the dimensions. Does not change
+    // state.
+    size_t currentStateByteSize() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return currentStateByteSizeLocked();
+    }
+
     void dumpStates(int out, bool verbose) const {
         std::lock_guard<std::mutex> lock(mMutex);
         dumpStatesLocked(out, verbose);
@@ -305,6 +388,17 @@ public:
 
     void flushIfExpire(int64_t elapsedTimestampNs);
 
+    // Returns the time after which the first of the running activations expires, i.e. the
+    // earliest time at which flushIfExpire has work to do. Returns INT64_MAX if the metric is not
+    // active, and INT64_MIN if it is active without a running activation.
+    int64_t getNextActivationExpiryNs() const;
+
+    // Returns a counter that changes whenever the state of one of the activations changes, so
+    // that the output of writeActiveMetricToProtoOutputStream can be reused while it stays the
+    // same. Returns nullopt while an activation is running, since the remaining ttl written for
+    // it changes with the current time.
+    std::optional<uint64_t> getStableActivationGeneration() const;
+
     void writeActiveMetricToProtoOutputStream(
             int64_t currentTimeNs, const DumpReportReason reason, ProtoOutputStream* proto);
 
@@ -323,6 +417,15 @@ public:
     virtual void flushRestrictedData() {
     }
 
+    // Sets where the CPU time spent on the pulled data of the metric is added to, see
+    // StatsdStats::getCpuTimeStats(). Either can be nullptr.
+    void setCpuTimeCounters(const std::shared_ptr<CpuTimeStats>& configCpuTimeStats,
+                            const std::shared_ptr<std::atomic<int64_t>>& cpuTimeCounter) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mConfigCpuTimeStats = configCpuTimeStats;
+        mCpuTimeCounter = cpuTimeCounter;
+    }
+
     // Start: getters/setters
     inline int64_t getMetricId() const {
         return mMetricId;
@@ -375,6 +478,29 @@ public:
         mSampledWhatFields.swap(samplingInfo.sampledWhatFields);
         mShardCount = samplingInfo.shardCount;
     }
+
+    inline bool isDimensionallySampled() const {
+        return mShardCount > 1 && !mSampledWhatFields.empty();
+    }
+
+    // Whether an event matched by matcherIndex falls in a shard this metric samples, checked by
+    // the MetricsManager before dispatching the event, so that events of other shards never take
+    // mMutex or reach the condition, dimension and state lookups. Does not take mMutex: the
+    // sampling info is only set on config updates, which never run concurrently with events.
+    bool passesSampleCheck(const size_t matcherIndex, const LogEvent& event) const {
+        return !isSampleCheckedOnDispatch(matcherIndex) ||
+               passesSampleCheckLocked(event.getValues());
+    }
+
+    // Whether dump reports write each distinct dimension once, in their dimension dictionary.
+    void setDimensionDictionaryInReport(const bool dimensionDictionaryInReport) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDimensionDictionaryInReport = dimensionDictionaryInReport;
+    }
+
+    // Makes the hard dimension limit of the metric a share of budget, see DimensionBudget. A null
+    // budget restores the metric's own limit.
+    void setDimensionBudget(const std::shared_ptr<DimensionBudget>& budget);
     // End: getters/setters
 protected:
     /**
@@ -382,6 +508,21 @@ protected:
      */
     virtual void flushIfNeededLocked(int64_t eventTime){};
 
+    // The hard dimension limit of the metric on its own, 0 for metrics without one.
+    virtual size_t getOwnDimensionHardLimitLocked() const {
+        return 0;
+    }
+
+    // The hard dimension limit to enforce: the share of the dimension budget when there is one,
+    // ownLimit otherwise.
+    inline size_t getDimensionHardLimitLocked(size_t ownLimit) const {
+        return mDimensionBudget != nullptr ? mDimensionBudgetLimit : ownLimit;
+    }
+
+    // Called with the number of dimension keys of the bucket being closed, before
+    // mHasHitGuardrail is reset. Resizes the share of the dimension budget, if any.
+    void noteBucketDimensionCountLocked(size_t dimensionCount);
+
     /**
      * For metrics that aggregate (ie, every metric producer except for EventMetricProducer),
      * we need to be able to flush the current buckets on demand (ie, end the current bucket and
@@ -428,18 +569,66 @@ protected:
 
     // Consume the parsed stats log entry that already matched the "what" of the metric.
     virtual void onMatchedLogEventLocked(const size_t matcherIndex, const LogEvent& event);
+
+    // Same as onMatchedLogEventLocked, for callers that already extracted the dimensions in what
+    // of event. If dimensionInWhat is nullptr, they are extracted from event.
+    void onMatchedLogEventWithDimensionLocked(const size_t matcherIndex, const LogEvent& event,
+                                              const HashableDimensionKey* dimensionInWhat);
+
+    // Implements onMatchedLogEventWithDimensionLocked, calling
+    // Producer::onMatchedLogEventInternalLocked. When Producer is a final class the call is
+    // resolved statically. Instantiated in MetricProducer.cpp.
+    template <typename Producer>
+    void onMatchedLogEventAsLocked(const size_t matcherIndex, const LogEvent& event,
+                                   const HashableDimensionKey* dimensionInWhat);
     virtual void onConditionChangedLocked(const bool condition, int64_t eventTime) = 0;
     virtual void onSlicedConditionMayChangeLocked(bool overallCondition,
                                                   const int64_t eventTime) = 0;
+    virtual int getConditionChangePullAtomIdLocked(bool conditionMet) const {
+        return -1;
+    }
     virtual void onDumpReportLocked(const int64_t dumpTimeNs,
                                     const bool include_current_partial_bucket,
                                     const bool erase_data,
                                     const DumpLatency dumpLatency,
-                                    std::set<string> *str_set,
+                                    StringSet* str_set,
                                     android::util::ProtoOutputStream* protoOutput) = 0;
+
+    // The default snapshot is the report encoded by onDumpReportLocked() right away. Producers
+    // that can detach their data override this.
+    virtual std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool include_current_partial_bucket,
+            const bool erase_data, const DumpLatency dumpLatency, const bool hashStrings);
+
+    // A snapshot of the DumpReportData swapped out of a Producer, written by the producer's
+    // writeDumpReportData(). That may only read members fixed at construction.
+    template <typename Producer>
+    class DetachedDumpReportSnapshot : public DumpReportSnapshot {
+    public:
+        DetachedDumpReportSnapshot(const Producer* producer,
+                                   typename Producer::DumpReportData&& data)
+            : mProducer(producer), mData(std::move(data)) {
+        }
+
+        void write(const uint64_t fieldId, StringSet* str_set,
+                   android::util::ProtoOutputStream* protoOutput) const override {
+            uint64_t token = protoOutput->start(fieldId);
+            mProducer->writeDumpReportData(mData, str_set, protoOutput);
+            protoOutput->end(token);
+        }
+
+    private:
+        // Keeps the producer alive if its config is removed before the snapshot is written.
+        const sp<const Producer> mProducer;
+        const typename Producer::DumpReportData mData;
+    };
+
     virtual void clearPastBucketsLocked(const int64_t dumpTimeNs) = 0;
     virtual void prepareFirstBucketLocked(){};
     virtual size_t byteSizeLocked() const = 0;
+    virtual size_t currentStateByteSizeLocked() const {
+        return 0;
+    }
     virtual void dumpStatesLocked(int out, bool verbose) const = 0;
     virtual void dropDataLocked(const int64_t dropTimeNs) = 0;
     void loadActiveMetricLocked(const ActiveMetric& activeMetric, int64_t currentTimeNs);
@@ -454,6 +643,12 @@ protected:
         }
     }
 
+    // Called once the metric went inactive and its bucket was flushed. Releases what the empty
+    // current bucket keeps allocated for reuse, since activation-gated metrics may stay inactive
+    // for long. It is allocated again as the next bucket fills once the metric is active.
+    virtual void hibernateLocked() {
+    }
+
     inline bool isActiveLocked() const {
         return mIsActive;
     }
@@ -464,7 +659,7 @@ protected:
         return mTimeBaseNs + (mCurrentBucketNum + 1) * mBucketSizeNs;
     }
 
-    int64_t getBucketNumFromEndTimeNs(const int64_t endNs) {
+    int64_t getBucketNumFromEndTimeNs(const int64_t endNs) const {
         return (endNs - mTimeBaseNs) / mBucketSizeNs - 1;
     }
 
@@ -472,10 +667,15 @@ protected:
     // The field and value are output.
     void queryStateValue(int32_t atomId, const HashableDimensionKey& queryKey, FieldValue* value);
 
+    // Returns the StateTracker of a sliced state atom, or nullptr if it does not exist.
+    const StateTracker* getStateTracker(int32_t atomId);
+
     // If a state map exists for the given atom, replace the original state
     // value with the group id mapped to the value.
     // If no state map exists, keep the original state value.
-    void mapStateValue(int32_t atomId, FieldValue* value);
+    inline void mapStateValue(int32_t atomId, FieldValue* value) const {
+        mStateGroupMap.mapStateValue(atomId, &value->mValue);
+    }
 
     // Returns a HashableDimensionKey with unknown state value for each state
     // atom.
@@ -489,6 +689,20 @@ protected:
 
     bool passesSampleCheckLocked(const vector<FieldValue>& values) const;
 
+    // Adds an event dropped by the dimension guardrail to mDimensionOverflowSketch.
+    void noteDimensionOverflowLocked(const MetricDimensionKey& eventKey);
+
+    // Writes the dimension_overflow of a StatsLogReport, if sketch is set.
+    static void writeDimensionOverflowSketch(
+            const std::shared_ptr<const DimensionOverflowSketch>& sketch,
+            StringSet* strSet, ProtoOutputStream* protoOutput);
+
+    // Whether events of matcherIndex may be dropped by passesSampleCheck(), false for the
+    // matchers whose events the metric must see in every shard.
+    virtual bool isSampleCheckedOnDispatch(const size_t matcherIndex) const {
+        return true;
+    }
+
     const int64_t mMetricId;
 
     // Hash of the Metric's proto bytes from StatsdConfig, including any activations.
@@ -497,6 +711,17 @@ protected:
 
     const ConfigKey mConfigKey;
 
+    // See setCpuTimeCounters().
+    std::shared_ptr<CpuTimeStats> mConfigCpuTimeStats;
+    std::shared_ptr<std::atomic<int64_t>> mCpuTimeCounter;
+
+    // Measures the CPU time spent on pulled data from now until it goes out of scope.
+    inline ScopedCpuTimer pullCpuTimerLocked() const {
+        return ScopedCpuTimer(mConfigCpuTimeStats != nullptr ? &mConfigCpuTimeStats->pullNs
+                                                             : nullptr,
+                              mCpuTimeCounter.get());
+    }
+
     bool mValid;
 
     // The time when this metric producer was first created. The end time for the current bucket
@@ -532,6 +757,9 @@ protected:
 
     vector<Matcher> mDimensionsInWhat;  // The dimensions_in_what defined in statsd_config
 
+    // Set from StatsdConfig.dimension_dictionary_in_metric_report.
+    bool mDimensionDictionaryInReport = false;
+
     // True iff the metric to condition links cover all dimension fields in the condition tracker.
     // This field is always false for combinational condition trackers.
     bool mHasLinksToAllConditionDimensionsInTracker;
@@ -551,11 +779,19 @@ protected:
 
     bool mIsActive;
 
+    // Bumped whenever the state or start time of an activation in mEventActivationMap changes.
+    uint64_t mActivationGeneration = 0;
+
     // The slice_by_state atom ids defined in statsd_config.
     const std::vector<int32_t> mSlicedStateAtoms;
 
+    // The StateTrackers of mSlicedStateAtoms, valid while StateManager's trackers generation is
+    // mStateTrackersGeneration. Saves the tracker lookup on every state query.
+    std::vector<std::pair<int32_t, const StateTracker*>> mStateTrackers;
+    uint64_t mStateTrackersGeneration = 0;
+
     // Maps atom ids and state values to group_ids (<atom_id, <value, group_id>>).
-    const std::unordered_map<int32_t, std::unordered_map<int, int64_t>> mStateGroupMap;
+    const StateGroupMap mStateGroupMap;
 
     // MetricStateLinks defined in statsd_config that link fields in the state
     // atom to fields in the "what" atom.
@@ -565,6 +801,12 @@ protected:
 
     const optional<bool> mSplitBucketForAppUpgrade;
 
+    // The time of the last partial bucket split for an app upgrade, -1 if there was none.
+    int64_t mLastAppUpgradeSplitNs = -1;
+
+    // Set once the dimensions in what of an event hold a uid field.
+    bool mSlicedByUid = false;
+
     SkippedBucket mCurrentSkippedBucket;
     // Buckets that were invalidated and had their data dropped.
     std::vector<SkippedBucket> mSkippedBuckets;
@@ -572,6 +814,15 @@ protected:
     // If hard dimension guardrail is hit, do not spam logcat. This is a per bucket tracker.
     mutable bool mHasHitGuardrail;
 
+    // The events dropped by the dimension guardrail since the last report that erased data.
+    // Created on the first dropped event, and shared with the dump report data that writes it.
+    std::shared_ptr<DimensionOverflowSketch> mDimensionOverflowSketch;
+
+    // See setDimensionBudget(). mDimensionBudgetLimit is the current share of the metric.
+    std::shared_ptr<DimensionBudget> mDimensionBudget;
+    size_t mDimensionBudgetSlot = 0;
+    size_t mDimensionBudgetLimit = 0;
+
     // Matchers for sampled fields. Currently only one sampled dimension is supported.
     std::vector<Matcher> mSampledWhatFields;
 
@@ -20,11 +20,14 @@
 
 #include <private/android_filesystem_config.h>
 
+#include <algorithm>
+
 #include "CountMetricProducer.h"
 #include "condition/CombinationConditionTracker.h"
 #include "condition/SimpleConditionTracker.h"
 #include "flags/FlagProvider.h"
 #include "guardrail/StatsdStats.h"
+#include "hash.h"
 #include "matchers/CombinationAtomMatchingTracker.h"
 #include "matchers/SimpleAtomMatchingTracker.h"
 #include "parsing_utils/config_update_utils.h"
@@ -34,12 +37,14 @@
 #include "stats_util.h"
 #include "statslog_statsd.h"
 #include "utils/DbUtils.h"
+#include "utils/StatsdTrace.h"
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_INT32;
 using android::util::FIELD_TYPE_INT64;
 using android::util::FIELD_TYPE_MESSAGE;
 using android::util::FIELD_TYPE_STRING;
+using android::util::FIELD_TYPE_UINT64;
 using android::util::ProtoOutputStream;
 
 using std::set;
@@ -60,14 +65,26 @@ const int FIELD_ID_ANNOTATIONS_INT32 = 2;
 const int FIELD_ID_ACTIVE_CONFIG_ID = 1;
 const int FIELD_ID_ACTIVE_CONFIG_UID = 2;
 const int FIELD_ID_ACTIVE_CONFIG_METRIC = 3;
+const int FIELD_ID_ACTIVE_CONFIG_CONFIG_HASH = 4;
+
+namespace {
+
+uint64_t hashConfig(const StatsdConfig& config) {
+    return FastHash64(config.SerializeAsString());
+}
+
+}  // namespace
 
 MetricsManager::MetricsManager(const ConfigKey& key, const StatsdConfig& config,
                                const int64_t timeBaseNs, const int64_t currentTimeNs,
                                const sp<UidMap>& uidMap,
                                const sp<StatsPullerManager>& pullerManager,
                                const sp<AlarmMonitor>& anomalyAlarmMonitor,
-                               const sp<AlarmMonitor>& periodicAlarmMonitor)
+                               const sp<AlarmMonitor>& periodicAlarmMonitor,
+                               const shared_ptr<SharedConditionRegistry>& sharedConditions,
+                               bool deferRegistration)
     : mConfigKey(key),
+      mConfigHash(hashConfig(config)),
       mUidMap(uidMap),
       mPackageCertificateHashSizeBytes(
               static_cast<uint8_t>(config.package_certificate_hash_size_bytes())),
@@ -78,7 +95,9 @@ MetricsManager::MetricsManager(const ConfigKey& key, const StatsdConfig& config,
       mPullerManager(pullerManager),
       mWhitelistedAtomIds(config.whitelisted_atom_ids().begin(),
                           config.whitelisted_atom_ids().end()),
-      mShouldPersistHistory(config.persist_locally()) {
+      mShouldPersistHistory(config.persist_locally()),
+      mSharedConditions(sharedConditions),
+      mStateListenersRegistered(!deferRegistration) {
     if (!isAtLeastU() && config.has_restricted_metrics_delegate_package_name()) {
         mInvalidConfigReason =
                 InvalidConfigReason(INVALID_CONFIG_REASON_RESTRICTED_METRIC_NOT_ENABLED);
@@ -96,16 +115,26 @@ MetricsManager::MetricsManager(const ConfigKey& key, const StatsdConfig& config,
             mAllMetricProducers, mMetricProducerMap, mAllAnomalyTrackers, mAllPeriodicAlarmTrackers,
             mConditionToMetricMap, mTrackerToMetricMap, mTrackerToConditionMap,
             mActivationAtomTrackerToMetricMap, mDeactivationAtomTrackerToMetricMap,
-            mAlertTrackerMap, mMetricIndexesWithActivation, mStateProtoHashes, mNoReportMetricIds);
+            mAlertTrackerMap, mMetricIndexesWithActivation, mStateProtoHashes, mNoReportMetricIds,
+            mSharedConditions.get(), deferRegistration);
+    buildDispatchTables();
+    mAtomFieldMasks = computeAtomFieldMasks(config);
 
     mHashStringsInReport = config.hash_strings_in_metric_report();
     mVersionStringsInReport = config.version_strings_in_metric_report();
     mInstallerInReport = config.installer_in_metric_report();
+    mUidMapDeltaInReport = config.uid_map_delta_in_metric_report();
+    for (const auto& producer : mAllMetricProducers) {
+        producer->setDimensionDictionaryInReport(config.dimension_dictionary_in_metric_report());
+    }
+    setDimensionBudgetFromConfig(config);
 
     createAllLogSourcesFromConfig(config);
     setMaxMetricsBytesFromConfig(config);
     setTriggerGetDataBytesFromConfig(config);
-    mPullerManager->RegisterPullUidProvider(mConfigKey, this);
+    if (!deferRegistration) {
+        mPullerManager->RegisterPullUidProvider(mConfigKey, this);
+    }
 
     // Store the sub-configs used.
     for (const auto& annotation : config.annotation()) {
@@ -116,14 +145,36 @@ MetricsManager::MetricsManager(const ConfigKey& key, const StatsdConfig& config,
 }
 
 MetricsManager::~MetricsManager() {
+    unregisterStateListeners();
+    mPullerManager->UnregisterPullUidProvider(mConfigKey, this);
+
+    VLOG("~MetricsManager()");
+}
+
+void MetricsManager::completeRegistration() {
+    if (!mStateListenersRegistered) {
+        registerStateListeners(mAllMetricProducers);
+        mStateListenersRegistered = true;
+    }
+    for (const sp<MetricProducer>& producer : mAllMetricProducers) {
+        producer->registerPullReceiver();
+    }
+    for (const sp<AlarmTracker>& alarmTracker : mAllPeriodicAlarmTrackers) {
+        alarmTracker->registerAlarm();
+    }
+    mPullerManager->RegisterPullUidProvider(mConfigKey, this);
+}
+
+void MetricsManager::unregisterStateListeners() {
+    if (!mStateListenersRegistered) {
+        return;
+    }
     for (auto it : mAllMetricProducers) {
         for (int atomId : it->getSlicedStateAtoms()) {
             StateManager::getInstance().unregisterListener(atomId, it);
         }
     }
-    mPullerManager->UnregisterPullUidProvider(mConfigKey, this);
-
-    VLOG("~MetricsManager()");
+    mStateListenersRegistered = false;
 }
 
 bool MetricsManager::updateConfig(const StatsdConfig& config, const int64_t timeBaseNs,
@@ -140,6 +191,8 @@ bool MetricsManager::updateConfig(const StatsdConfig& config, const int64_t time
     } else {
         mRestrictedMetricsDelegatePackageName = nullopt;
     }
+    mConfigHash = hashConfig(config);
+    mEncodedActiveConfigKey = nullopt;
     vector<sp<AtomMatchingTracker>> newAtomMatchingTrackers;
     unordered_map<int64_t, int> newAtomMatchingTrackerMap;
     vector<sp<ConditionTracker>> newConditionTrackers;
@@ -168,17 +221,19 @@ bool MetricsManager::updateConfig(const StatsdConfig& config, const int64_t time
             newAlertTrackerMap, newPeriodicAlarmTrackers, mConditionToMetricMap,
             mTrackerToMetricMap, mTrackerToConditionMap, mActivationAtomTrackerToMetricMap,
             mDeactivationAtomTrackerToMetricMap, mMetricIndexesWithActivation, newStateProtoHashes,
-            mNoReportMetricIds);
-    mAllAtomMatchingTrackers = newAtomMatchingTrackers;
-    mAtomMatchingTrackerMap = newAtomMatchingTrackerMap;
-    mAllConditionTrackers = newConditionTrackers;
-    mConditionTrackerMap = newConditionTrackerMap;
-    mAllMetricProducers = newMetricProducers;
-    mMetricProducerMap = newMetricProducerMap;
-    mStateProtoHashes = newStateProtoHashes;
-    mAllAnomalyTrackers = newAnomalyTrackers;
-    mAlertTrackerMap = newAlertTrackerMap;
-    mAllPeriodicAlarmTrackers = newPeriodicAlarmTrackers;
+            mNoReportMetricIds, mSharedConditions.get());
+    mAllAtomMatchingTrackers = std::move(newAtomMatchingTrackers);
+    mAtomMatchingTrackerMap = std::move(newAtomMatchingTrackerMap);
+    mAllConditionTrackers = std::move(newConditionTrackers);
+    mConditionTrackerMap = std::move(newConditionTrackerMap);
+    mAllMetricProducers = std::move(newMetricProducers);
+    mMetricProducerMap = std::move(newMetricProducerMap);
+    mStateProtoHashes = std::move(newStateProtoHashes);
+    mAllAnomalyTrackers = std::move(newAnomalyTrackers);
+    mAlertTrackerMap = std::move(newAlertTrackerMap);
+    mAllPeriodicAlarmTrackers = std::move(newPeriodicAlarmTrackers);
+    buildDispatchTables();
+    mAtomFieldMasks = computeAtomFieldMasks(config);
 
     mTtlNs = config.has_ttl_in_seconds() ? config.ttl_in_seconds() * NS_PER_SEC : -1;
     refreshTtl(currentTimeNs);
@@ -186,6 +241,11 @@ bool MetricsManager::updateConfig(const StatsdConfig& config, const int64_t time
     mHashStringsInReport = config.hash_strings_in_metric_report();
     mVersionStringsInReport = config.version_strings_in_metric_report();
     mInstallerInReport = config.installer_in_metric_report();
+    mUidMapDeltaInReport = config.uid_map_delta_in_metric_report();
+    for (const auto& producer : mAllMetricProducers) {
+        producer->setDimensionDictionaryInReport(config.dimension_dictionary_in_metric_report());
+    }
+    setDimensionBudgetFromConfig(config);
     mWhitelistedAtomIds.clear();
     mWhitelistedAtomIds.insert(config.whitelisted_atom_ids().begin(),
                                config.whitelisted_atom_ids().end());
@@ -266,6 +326,15 @@ void MetricsManager::createAllLogSourcesFromConfig(const StatsdConfig& config) {
     }
 }
 
+void MetricsManager::setDimensionBudgetFromConfig(const StatsdConfig& config) {
+    // The shares start over after a config update, from the limits of the updated metrics.
+    const shared_ptr<DimensionBudget> budget =
+            config.dynamic_dimension_budget() ? std::make_shared<DimensionBudget>() : nullptr;
+    for (const auto& producer : mAllMetricProducers) {
+        producer->setDimensionBudget(budget);
+    }
+}
+
 void MetricsManager::setMaxMetricsBytesFromConfig(const StatsdConfig& config) {
     if (!config.has_max_metrics_memory_kb()) {
         mMaxMetricsBytes = StatsdStats::kDefaultMaxMetricsBytesPerConfig;
@@ -319,27 +388,92 @@ void MetricsManager::verifyGuardrailsAndUpdateStatsdStats() {
             mConfigKey, mAllMetricProducers.size(), mAllConditionTrackers.size(),
             mAllAtomMatchingTrackers.size(), mAllAnomalyTrackers.size(), mAnnotations,
             mInvalidConfigReason);
+
+    // noteConfigReceived replaced the stats of the config, so resolve the matcher counters again.
+    mMatcherMatchedCounters.clear();
+    mMatcherMatchedCounters.reserve(mAllAtomMatchingTrackers.size());
+    for (const sp<AtomMatchingTracker>& matcher : mAllAtomMatchingTrackers) {
+        mMatcherMatchedCounters.push_back(
+                StatsdStats::getInstance().getMatcherMatchedCounter(mConfigKey, matcher->getId()));
+    }
+    mCpuTimeStats = StatsdStats::getInstance().getCpuTimeStats(mConfigKey);
+    mMetricCpuTimeCounters.clear();
+    mMetricCpuTimeCounters.reserve(mAllMetricProducers.size());
+    for (const sp<MetricProducer>& metric : mAllMetricProducers) {
+        mMetricCpuTimeCounters.push_back(StatsdStats::getInstance().getMetricCpuTimeCounter(
+                mConfigKey, metric->getMetricId()));
+        metric->setCpuTimeCounters(mCpuTimeStats, mMetricCpuTimeCounters.back());
+    }
+    mMetricMemoryStats.clear();
+    mMetricMemoryStats.reserve(mAllMetricProducers.size());
+    for (const sp<MetricProducer>& metric : mAllMetricProducers) {
+        mMetricMemoryStats.push_back(
+                StatsdStats::getInstance().getMetricMemoryStats(mConfigKey, metric->getMetricId()));
+    }
 }
 
 void MetricsManager::initializeConfigActiveStatus() {
     mIsAlwaysActive = (mMetricIndexesWithActivation.size() != mAllMetricProducers.size()) ||
                       (mAllMetricProducers.size() == 0);
-    mIsActive = mIsAlwaysActive;
-    for (int metric : mMetricIndexesWithActivation) {
-        mIsActive |= mAllMetricProducers[metric]->isActive();
+    resetActivationExpiries();
+    mIsActive = mIsAlwaysActive || mActiveMetricCount > 0;
+    VLOG("mIsActive is initialized to %d", mIsActive.load());
+}
+
+void MetricsManager::resetActivationExpiries() {
+    mActivationExpiryHeap = {};
+    mActivationExpiryNs.assign(mAllMetricProducers.size(), INT64_MAX);
+    mActiveMetricCount = 0;
+    for (int metricIndex : mMetricIndexesWithActivation) {
+        if (mAllMetricProducers[metricIndex]->isActive()) {
+            mActiveMetricCount++;
+        }
+        scheduleActivationExpiry(metricIndex);
+    }
+}
+
+void MetricsManager::scheduleActivationExpiry(int metricIndex) {
+    // Activations only move the expiry of a metric later, unless a shorter one starts. A later
+    // expiry is picked up when the current entry comes up, so a push is only needed for an
+    // earlier one.
+    const int64_t expiryNs = mAllMetricProducers[metricIndex]->getNextActivationExpiryNs();
+    if (expiryNs < mActivationExpiryNs[metricIndex]) {
+        mActivationExpiryNs[metricIndex] = expiryNs;
+        mActivationExpiryHeap.emplace(expiryNs, metricIndex);
+    }
+}
+
+void MetricsManager::expireActivations(int64_t eventTimeNs) {
+    while (!mActivationExpiryHeap.empty() && mActivationExpiryHeap.top().first < eventTimeNs) {
+        const auto [expiryNs, metricIndex] = mActivationExpiryHeap.top();
+        mActivationExpiryHeap.pop();
+        if (expiryNs != mActivationExpiryNs[metricIndex]) {
+            continue;
+        }
+        mActivationExpiryNs[metricIndex] = INT64_MAX;
+        const sp<MetricProducer>& metric = mAllMetricProducers[metricIndex];
+        // A cancellation may have deactivated the metric since the entry was pushed.
+        const bool wasActive = metric->isActive();
+        metric->flushIfExpire(eventTimeNs);
+        if (wasActive && !metric->isActive()) {
+            mActiveMetricCount--;
+        }
+        scheduleActivationExpiry(metricIndex);
     }
-    VLOG("mIsActive is initialized to %d", mIsActive);
 }
 
 void MetricsManager::initAllowedLogSources() {
     std::lock_guard<std::mutex> lock(mAllowedLogSourcesMutex);
-    mAllowedLogSources.clear();
-    mAllowedLogSources.insert(mAllowedUid.begin(), mAllowedUid.end());
-
+    mAllowedPkgUids.clear();
+    mAllowedLogSources = mAllowedUid;
     for (const auto& pkg : mAllowedPkg) {
-        auto uids = mUidMap->getAppUid(pkg);
-        mAllowedLogSources.insert(uids.begin(), uids.end());
+        const set<int32_t> uids = mUidMap->getAppUid(pkg);
+        mAllowedPkgUids[pkg] = uids;
+        mAllowedLogSources.insert(mAllowedLogSources.end(), uids.begin(), uids.end());
     }
+    std::sort(mAllowedLogSources.begin(), mAllowedLogSources.end());
+    mAllowedLogSources.erase(std::unique(mAllowedLogSources.begin(), mAllowedLogSources.end()),
+                             mAllowedLogSources.end());
     if (STATSD_DEBUG) {
         for (const auto& uid : mAllowedLogSources) {
             VLOG("Allowed uid %d", uid);
@@ -347,6 +481,39 @@ void MetricsManager::initAllowedLogSources() {
     }
 }
 
+void MetricsManager::addAllowedLogSource(const string& apk, const int uid) {
+    std::lock_guard<std::mutex> lock(mAllowedLogSourcesMutex);
+    const auto pkgIt = mAllowedPkgUids.find(apk);
+    if (pkgIt == mAllowedPkgUids.end() || !pkgIt->second.insert(uid).second) {
+        return;
+    }
+    const auto it = std::lower_bound(mAllowedLogSources.begin(), mAllowedLogSources.end(), uid);
+    if (it == mAllowedLogSources.end() || *it != uid) {
+        mAllowedLogSources.insert(it, uid);
+    }
+}
+
+void MetricsManager::removeAllowedLogSource(const string& apk, const int uid) {
+    std::lock_guard<std::mutex> lock(mAllowedLogSourcesMutex);
+    const auto pkgIt = mAllowedPkgUids.find(apk);
+    if (pkgIt == mAllowedPkgUids.end() || pkgIt->second.erase(uid) == 0) {
+        return;
+    }
+    // The uid stays allowed if it is also allowed through another source.
+    if (std::find(mAllowedUid.begin(), mAllowedUid.end(), uid) != mAllowedUid.end()) {
+        return;
+    }
+    for (const auto& [pkg, uids] : mAllowedPkgUids) {
+        if (uids.find(uid) != uids.end()) {
+            return;
+        }
+    }
+    const auto it = std::lower_bound(mAllowedLogSources.begin(), mAllowedLogSources.end(), uid);
+    if (it != mAllowedLogSources.end() && *it == uid) {
+        mAllowedLogSources.erase(it);
+    }
+}
+
 void MetricsManager::initPullAtomSources() {
     std::lock_guard<std::mutex> lock(mAllowedLogSourcesMutex);
     mCombinedPullAtomUids.clear();
@@ -367,43 +534,62 @@ bool MetricsManager::isConfigValid() const {
 
 void MetricsManager::notifyAppUpgrade(const int64_t eventTimeNs, const string& apk, const int uid,
                                       const int64_t version) {
-    // Inform all metric producers.
+    notifyAppsChanged({{eventTimeNs, apk, uid, version, /* removed */ false}});
+}
+
+void MetricsManager::notifyAppRemoved(const int64_t eventTimeNs, const string& apk, const int uid) {
+    notifyAppsChanged({{eventTimeNs, apk, uid, /* version */ 0, /* removed */ true}});
+}
+
+void MetricsManager::notifyAppsChanged(const vector<PackageChange>& changes) {
+    // Inform the metric producers whose data can depend on the apps.
     for (const auto& it : mAllMetricProducers) {
-        it->notifyAppUpgrade(eventTimeNs);
-    }
-    // check if we care this package
-    if (std::find(mAllowedPkg.begin(), mAllowedPkg.end(), apk) != mAllowedPkg.end()) {
-        // We will re-initialize the whole list because we don't want to keep the multi mapping of
-        // UID<->pkg inside MetricsManager to reduce the memory usage.
-        initAllowedLogSources();
+        if (!it->splitsBucketForAppUpgrade()) {
+            continue;
+        }
+        for (const PackageChange& change : changes) {
+            if (!isMetricAffectedByApp(*it, change.apk, change.uid)) {
+                continue;
+            }
+            if (change.removed) {
+                it->notifyAppRemoved(change.eventTimeNs, kAppUpgradeCoalescingWindowNs);
+            } else {
+                it->notifyAppUpgrade(change.eventTimeNs, kAppUpgradeCoalescingWindowNs);
+            }
+        }
     }
 
-    for (const auto& it : mPullAtomPackages) {
-        if (it.second.find(apk) != it.second.end()) {
-            initPullAtomSources();
-            return;
+    bool pullAtomSourcesChanged = false;
+    for (const PackageChange& change : changes) {
+        if (change.removed) {
+            removeAllowedLogSource(change.apk, change.uid);
+        } else {
+            addAllowedLogSource(change.apk, change.uid);
+        }
+        for (const auto& [atomId, packages] : mPullAtomPackages) {
+            pullAtomSourcesChanged |= packages.find(change.apk) != packages.end();
         }
     }
+    if (pullAtomSourcesChanged) {
+        initPullAtomSources();
+    }
 }
 
-void MetricsManager::notifyAppRemoved(const int64_t eventTimeNs, const string& apk, const int uid) {
-    // Inform all metric producers.
-    for (const auto& it : mAllMetricProducers) {
-        it->notifyAppRemoved(eventTimeNs);
-    }
-    // check if we care this package
-    if (std::find(mAllowedPkg.begin(), mAllowedPkg.end(), apk) != mAllowedPkg.end()) {
-        // We will re-initialize the whole list because we don't want to keep the multi mapping of
-        // UID<->pkg inside MetricsManager to reduce the memory usage.
-        initAllowedLogSources();
+bool MetricsManager::isMetricAffectedByApp(const MetricProducer& producer, const string& apk,
+                                           const int uid) {
+    const int pullAtomId = producer.getPullAtomId();
+    // Pushed atoms can be logged by, or be about, any app.
+    if (pullAtomId == -1 || producer.isSlicedByUid()) {
+        return true;
     }
-
-    for (const auto& it : mPullAtomPackages) {
-        if (it.second.find(apk) != it.second.end()) {
-            initPullAtomSources();
-            return;
-        }
+    // Otherwise a pulled atom only depends on the app if the app provides it.
+    const auto packagesIt = mPullAtomPackages.find(pullAtomId);
+    if (packagesIt != mPullAtomPackages.end() &&
+        packagesIt->second.find(apk) != packagesIt->second.end()) {
+        return true;
     }
+    const vector<int32_t> pullUids = getPullAtomUids(pullAtomId);
+    return std::find(pullUids.begin(), pullUids.end(), uid) != pullUids.end();
 }
 
 void MetricsManager::onUidMapReceived(const int64_t eventTimeNs) {
@@ -464,39 +650,44 @@ void MetricsManager::dropData(const int64_t dropTimeNs) {
 
 void MetricsManager::onDumpReport(const int64_t dumpTimeStampNs, const int64_t wallClockNs,
                                   const bool include_current_partial_bucket, const bool erase_data,
-                                  const DumpLatency dumpLatency, std::set<string>* str_set,
+                                  const DumpLatency dumpLatency, StringSet* str_set,
                                   ProtoOutputStream* protoOutput) {
+    DumpReportSnapshot snapshot;
+    takeDumpReportSnapshot(dumpTimeStampNs, wallClockNs, include_current_partial_bucket, erase_data,
+                           dumpLatency, &snapshot);
+    writeDumpReportSnapshot(snapshot, str_set, protoOutput);
+}
+
+void MetricsManager::takeDumpReportSnapshot(const int64_t dumpTimeStampNs,
+                                            const int64_t wallClockNs,
+                                            const bool include_current_partial_bucket,
+                                            const bool erase_data, const DumpLatency dumpLatency,
+                                            DumpReportSnapshot* snapshot) {
     if (hasRestrictedMetricsDelegate()) {
         // TODO(b/268150038): report error to statsdstats
         VLOG("Unexpected call to onDumpReport in restricted metricsmanager.");
         return;
     }
+    STATSD_TRACE("MetricsManager::takeDumpReportSnapshot config=%d:%lld", mConfigKey.GetUid(),
+                 (long long)mConfigKey.GetId());
+    ScopedCpuTimer cpuTimer(mCpuTimeStats != nullptr ? &mCpuTimeStats->dumpReportNs : nullptr,
+                            /*metricCounter=*/nullptr);
     VLOG("=========================Metric Reports Start==========================");
+    snapshot->hashStrings = mHashStringsInReport;
+    snapshot->cpuTimeStats = mCpuTimeStats;
     // one StatsLogReport per MetricProduer
-    for (const auto& producer : mAllMetricProducers) {
+    for (size_t i = 0; i < mAllMetricProducers.size(); i++) {
+        const sp<MetricProducer>& producer = mAllMetricProducers[i];
+        ScopedCpuTimer metricCpuTimer(/*configCounter=*/nullptr, mMetricCpuTimeCounters[i].get());
         if (mNoReportMetricIds.find(producer->getMetricId()) == mNoReportMetricIds.end()) {
-            uint64_t token = protoOutput->start(
-                    FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_METRICS);
-            if (mHashStringsInReport) {
-                producer->onDumpReport(dumpTimeStampNs, include_current_partial_bucket, erase_data,
-                                       dumpLatency, str_set, protoOutput);
-            } else {
-                producer->onDumpReport(dumpTimeStampNs, include_current_partial_bucket, erase_data,
-                                       dumpLatency, nullptr, protoOutput);
-            }
-            protoOutput->end(token);
+            snapshot->metricReports.push_back(producer->takeDumpReportSnapshot(
+                    dumpTimeStampNs, include_current_partial_bucket, erase_data, dumpLatency,
+                    mHashStringsInReport));
         } else {
             producer->clearPastBuckets(dumpTimeStampNs);
         }
     }
-    for (const auto& annotation : mAnnotations) {
-        uint64_t token = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
-                                            FIELD_ID_ANNOTATIONS);
-        protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ANNOTATIONS_INT64,
-                           (long long)annotation.first);
-        protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_ANNOTATIONS_INT32, annotation.second);
-        protoOutput->end(token);
-    }
+    snapshot->annotations.assign(mAnnotations.begin(), mAnnotations.end());
 
     // Do not update the timestamps when data is not cleared to avoid timestamps from being
     // misaligned.
@@ -507,6 +698,26 @@ void MetricsManager::onDumpReport(const int64_t dumpTimeStampNs, const int64_t w
     VLOG("=========================Metric Reports End==========================");
 }
 
+void MetricsManager::writeDumpReportSnapshot(const DumpReportSnapshot& snapshot,
+                                             StringSet* str_set,
+                                             ProtoOutputStream* protoOutput) {
+    ScopedCpuTimer cpuTimer(
+            snapshot.cpuTimeStats != nullptr ? &snapshot.cpuTimeStats->dumpReportNs : nullptr,
+            /*metricCounter=*/nullptr);
+    for (const auto& metricReport : snapshot.metricReports) {
+        metricReport->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_METRICS,
+                            snapshot.hashStrings ? str_set : nullptr, protoOutput);
+    }
+    for (const auto& annotation : snapshot.annotations) {
+        uint64_t token = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
+                                            FIELD_ID_ANNOTATIONS);
+        protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ANNOTATIONS_INT64,
+                           (long long)annotation.first);
+        protoOutput->write(FIELD_TYPE_INT32 | FIELD_ID_ANNOTATIONS_INT32, annotation.second);
+        protoOutput->end(token);
+    }
+}
+
 bool MetricsManager::checkLogCredentials(const LogEvent& event) {
     if (mWhitelistedAtomIds.find(event.GetTagId()) != mWhitelistedAtomIds.end()) {
         return true;
@@ -519,7 +730,8 @@ bool MetricsManager::checkLogCredentials(const LogEvent& event) {
     }
 
     std::lock_guard<std::mutex> lock(mAllowedLogSourcesMutex);
-    if (mAllowedLogSources.find(event.GetUid()) == mAllowedLogSources.end()) {
+    if (!std::binary_search(mAllowedLogSources.begin(), mAllowedLogSources.end(),
+                            event.GetUid())) {
         VLOG("log source %d not on the whitelist", event.GetUid());
         return false;
     }
@@ -527,7 +739,74 @@ bool MetricsManager::checkLogCredentials(const LogEvent& event) {
 }
 
 // Consume the stats log if it's interesting to this metric.
+void MetricsManager::stopSharingConditionStates() {
+    for (const sp<ConditionTracker>& tracker : mAllConditionTrackers) {
+        if (tracker->IsSimpleCondition()) {
+            static_cast<SimpleConditionTracker*>(tracker.get())->keepSharingState(nullopt);
+        }
+    }
+}
+
+bool MetricsManager::shareConditionStates(
+        const shared_ptr<SharedConditionRegistry>& sharedConditions, const StatsdConfig& config) {
+    vector<pair<SimpleConditionTracker*, uint64_t>> sharedTrackers;
+    for (const Predicate& predicate : config.predicate()) {
+        const auto it = mConditionTrackerMap.find(predicate.id());
+        if (it == mConditionTrackerMap.end() ||
+            !mAllConditionTrackers[it->second]->IsSimpleCondition()) {
+            continue;
+        }
+        const optional<uint64_t> sharedKey =
+                getSharedConditionKey(config, predicate, mAtomMatchingTrackerMap);
+        if (!sharedKey.has_value()) {
+            continue;
+        }
+        if (sharedConditions->isShared(*sharedKey)) {
+            return false;
+        }
+        sharedTrackers.emplace_back(
+                static_cast<SimpleConditionTracker*>(mAllConditionTrackers[it->second].get()),
+                *sharedKey);
+    }
+    // No other config uses these states, so the registry starts them from the initial values
+    // the trackers still hold.
+    for (const auto& [tracker, sharedKey] : sharedTrackers) {
+        tracker->shareState(*sharedConditions, sharedKey);
+    }
+    mSharedConditions = sharedConditions;
+    return true;
+}
+
+void MetricsManager::prefetchConditionChangePulls(const vector<ConditionState>& conditionCache,
+                                                  const int64_t eventTimeNs) {
+    vector<int> pullAtomIds;
+    for (const int i : mChangedConditionsScratch) {
+        for (const int metricIndex : mConditionToMetricDispatch.targets(i)) {
+            const sp<MetricProducer>& producer = mAllMetricProducers[metricIndex];
+            // Converted to bool the same way as for onConditionChanged().
+            const int pullAtomId = producer->getConditionChangePullAtomId(conditionCache[i]);
+            if (pullAtomId != -1) {
+                pullAtomIds.push_back(pullAtomId);
+            }
+        }
+    }
+    if (pullAtomIds.size() < 2) {
+        return;
+    }
+    std::sort(pullAtomIds.begin(), pullAtomIds.end());
+    pullAtomIds.erase(std::unique(pullAtomIds.begin(), pullAtomIds.end()), pullAtomIds.end());
+    mPullerManager->PrefetchPulls(pullAtomIds, mConfigKey, eventTimeNs);
+}
+
 void MetricsManager::onLogEvent(const LogEvent& event) {
+    STATSD_TRACE("MetricsManager::onLogEvent config=%d:%lld atom=%d", mConfigKey.GetUid(),
+                 (long long)mConfigKey.GetId(), event.GetTagId());
+    const bool measureCpuTime =
+            mCpuTimeStats != nullptr &&
+            ++mCpuTimeSampleCounter % StatsdStats::kCpuTimeSamplingRate == 0;
+    ScopedCpuTimer cpuTimer(measureCpuTime ? &mCpuTimeStats->logEventNs : nullptr,
+                            /*metricCounter=*/nullptr, StatsdStats::kCpuTimeSamplingRate);
+
     if (!isConfigValid()) {
         return;
     }
@@ -539,23 +818,15 @@ void MetricsManager::onLogEvent(const LogEvent& event) {
     const int tagId = event.GetTagId();
     const int64_t eventTimeNs = event.GetElapsedTimestampNs();
 
-    bool isActive = mIsAlwaysActive;
+    sizeScratchBuffers();
 
-    // Set of metrics that are still active after flushing.
-    unordered_set<int> activeMetricsIndices;
-
-    // Update state of all metrics w/ activation conditions as of eventTimeNs.
-    for (int metricIndex : mMetricIndexesWithActivation) {
-        const sp<MetricProducer>& metric = mAllMetricProducers[metricIndex];
-        metric->flushIfExpire(eventTimeNs);
-        if (metric->isActive()) {
-            // If this metric w/ activation condition is still active after
-            // flushing, remember it.
-            activeMetricsIndices.insert(metricIndex);
-        }
+    // Update state of all metrics w/ activation conditions as of eventTimeNs. Nothing to do
+    // unless the earliest activation expired.
+    if (!mActivationExpiryHeap.empty() && mActivationExpiryHeap.top().first < eventTimeNs) {
+        expireActivations(eventTimeNs);
     }
 
-    mIsActive = isActive || !activeMetricsIndices.empty();
+    mIsActive = mIsAlwaysActive || mActiveMetricCount > 0;
 
     const auto matchersIt = mTagIdsToMatchersMap.find(tagId);
 
@@ -573,94 +844,129 @@ void MetricsManager::onLogEvent(const LogEvent& event) {
         return;
     }
 
-    vector<MatchingState> matcherCache(mAllAtomMatchingTrackers.size(),
-                                       MatchingState::kNotComputed);
-    vector<shared_ptr<LogEvent>> matcherTransformations(matcherCache.size(), nullptr);
+    vector<MatchingState>& matcherCache = mMatcherCacheScratch;
+    vector<shared_ptr<LogEvent>>& matcherTransformations = mMatcherTransformationsScratch;
 
-    for (const auto& matcherIndex : matchersIt->second) {
-        mAllAtomMatchingTrackers[matcherIndex]->onLogEvent(event, matcherIndex,
-                                                           mAllAtomMatchingTrackers, matcherCache,
-                                                           matcherTransformations);
+    const auto indexIt = mAtomMatcherIndexes.find(tagId);
+    if (indexIt != mAtomMatcherIndexes.end()) {
+        indexIt->second.prune(event, matcherCache);
     }
 
-    // Set of metrics that received an activation cancellation.
-    unordered_set<int> metricIndicesWithCanceledActivations;
+    mMatcherEvaluationPlan.evaluate(event, mAllAtomMatchingTrackers, matcherCache,
+                                    matcherTransformations, mSharedMatcherResults.get());
+    // The plan only writes the results of the atom's matchers.
+    for (const int matcherIndex : matchersIt->second) {
+        if (!mIsMatcherTouchedScratch[matcherIndex]) {
+            mIsMatcherTouchedScratch[matcherIndex] = true;
+            mTouchedMatchersScratch.push_back(matcherIndex);
+        }
+    }
+    // Keep dispatching matched events in matcher index order.
+    std::sort(mTouchedMatchersScratch.begin(), mTouchedMatchersScratch.end());
+    for (const int matcherIndex : mTouchedMatchersScratch) {
+        if (matcherCache[matcherIndex] == MatchingState::kMatched) {
+            mMatchedMatchersScratch.push_back(matcherIndex);
+        }
+    }
 
     // Determine which metric activations received a cancellation and cancel them.
-    for (const auto& it : mDeactivationAtomTrackerToMetricMap) {
-        if (matcherCache[it.first] == MatchingState::kMatched) {
-            for (int metricIndex : it.second) {
-                mAllMetricProducers[metricIndex]->cancelEventActivation(it.first);
-                metricIndicesWithCanceledActivations.insert(metricIndex);
-            }
+    for (const int matcherIndex : mMatchedMatchersScratch) {
+        for (const int metricIndex : mDeactivationDispatch.targets(matcherIndex)) {
+            mAllMetricProducers[metricIndex]->cancelEventActivation(matcherIndex);
+            mCanceledMetricsScratch.push_back(metricIndex);
         }
     }
 
     // Determine whether any metrics are no longer active after cancelling metric activations.
-    for (const int metricIndex : metricIndicesWithCanceledActivations) {
+    for (const int metricIndex : mCanceledMetricsScratch) {
         const sp<MetricProducer>& metric = mAllMetricProducers[metricIndex];
+        const bool wasActive = metric->isActive();
         metric->flushIfExpire(eventTimeNs);
-        if (!metric->isActive()) {
-            activeMetricsIndices.erase(metricIndex);
+        if (wasActive && !metric->isActive()) {
+            mActiveMetricCount--;
         }
     }
-
-    isActive |= !activeMetricsIndices.empty();
-
+    mCanceledMetricsScratch.clear();
 
     // Determine which metric activations should be turned on and turn them on
-    for (const auto& it : mActivationAtomTrackerToMetricMap) {
-        if (matcherCache[it.first] == MatchingState::kMatched) {
-            for (int metricIndex : it.second) {
-                mAllMetricProducers[metricIndex]->activate(it.first, eventTimeNs);
-                isActive |= mAllMetricProducers[metricIndex]->isActive();
+    for (const int matcherIndex : mMatchedMatchersScratch) {
+        for (const int metricIndex : mActivationDispatch.targets(matcherIndex)) {
+            const sp<MetricProducer>& metric = mAllMetricProducers[metricIndex];
+            const bool wasActive = metric->isActive();
+            metric->activate(matcherIndex, eventTimeNs);
+            if (!wasActive && metric->isActive()) {
+                mActiveMetricCount++;
             }
+            scheduleActivationExpiry(metricIndex);
         }
     }
 
-    mIsActive = isActive;
+    mIsActive = mIsAlwaysActive || mActiveMetricCount > 0;
 
     // A bitmap to see which ConditionTracker needs to be re-evaluated.
-    vector<uint8_t> conditionToBeEvaluated(mAllConditionTrackers.size(), false);
-    vector<shared_ptr<LogEvent>> conditionToTransformedLogEvents(mAllConditionTrackers.size(),
-                                                                 nullptr);
-
-    for (const auto& [matcherIndex, conditionList] : mTrackerToConditionMap) {
-        if (matcherCache[matcherIndex] == MatchingState::kMatched) {
-            for (const int conditionIndex : conditionList) {
+    vector<uint8_t>& conditionToBeEvaluated = mConditionToBeEvaluatedScratch;
+    vector<shared_ptr<LogEvent>>& conditionToTransformedLogEvents =
+            mConditionToTransformedLogEventsScratch;
+
+    // The dispatch lists are in condition index order, so the worklists only need sorting when
+    // more than one matcher feeds them.
+    int conditionMatcherCount = 0;
+    for (const int matcherIndex : mMatchedMatchersScratch) {
+        const IndexAdjacencyList::Range conditionList =
+                mTrackerToConditionDispatch.targets(matcherIndex);
+        if (conditionList.empty()) {
+            continue;
+        }
+        conditionMatcherCount++;
+        for (const int conditionIndex : conditionList) {
+            if (!conditionToBeEvaluated[conditionIndex]) {
                 conditionToBeEvaluated[conditionIndex] = true;
-                conditionToTransformedLogEvents[conditionIndex] =
-                        matcherTransformations[matcherIndex];
+                mConditionsToEvaluateScratch.push_back(conditionIndex);
             }
+            conditionToTransformedLogEvents[conditionIndex] = matcherTransformations[matcherIndex];
         }
+        for (const int conditionIndex : mTrackerToConditionClosureDispatch.targets(matcherIndex)) {
+            if (!mIsConditionTouchedScratch[conditionIndex]) {
+                mIsConditionTouchedScratch[conditionIndex] = true;
+                mTouchedConditionsScratch.push_back(conditionIndex);
+            }
+        }
+    }
+    if (conditionMatcherCount > 1) {
+        // Evaluate in condition index order, as a full scan over the bitmap would.
+        std::sort(mConditionsToEvaluateScratch.begin(), mConditionsToEvaluateScratch.end());
+        std::sort(mTouchedConditionsScratch.begin(), mTouchedConditionsScratch.end());
     }
 
-    vector<ConditionState> conditionCache(mAllConditionTrackers.size(),
-                                          ConditionState::kNotEvaluated);
+    vector<ConditionState>& conditionCache = mConditionCacheScratch;
     // A bitmap to track if a condition has changed value.
-    vector<uint8_t> changedCache(mAllConditionTrackers.size(), false);
-    for (size_t i = 0; i < mAllConditionTrackers.size(); i++) {
-        if (!conditionToBeEvaluated[i]) {
-            continue;
+    vector<uint8_t>& changedCache = mChangedCacheScratch;
+    if (!mConditionsToEvaluateScratch.empty()) {
+        STATSD_TRACE("MetricsManager::evaluateConditions config=%d:%lld atom=%d conditions=%zu",
+                     mConfigKey.GetUid(), (long long)mConfigKey.GetId(), tagId,
+                     mConditionsToEvaluateScratch.size());
+        for (const int i : mConditionsToEvaluateScratch) {
+            sp<ConditionTracker>& condition = mAllConditionTrackers[i];
+            const LogEvent& conditionEvent = conditionToTransformedLogEvents[i] == nullptr
+                                                     ? event
+                                                     : *conditionToTransformedLogEvents[i];
+            condition->evaluateCondition(conditionEvent, matcherCache, mAllConditionTrackers,
+                                         conditionCache, changedCache);
         }
-        sp<ConditionTracker>& condition = mAllConditionTrackers[i];
-        const LogEvent& conditionEvent = conditionToTransformedLogEvents[i] == nullptr
-                                                 ? event
-                                                 : *conditionToTransformedLogEvents[i];
-        condition->evaluateCondition(conditionEvent, matcherCache, mAllConditionTrackers,
-                                     conditionCache, changedCache);
     }
 
-    for (size_t i = 0; i < mAllConditionTrackers.size(); i++) {
-        if (!changedCache[i]) {
-            continue;
-        }
-        auto it = mConditionToMetricMap.find(i);
-        if (it == mConditionToMetricMap.end()) {
-            continue;
+    for (const int i : mTouchedConditionsScratch) {
+        if (changedCache[i]) {
+            mChangedConditionsScratch.push_back(i);
         }
-        auto& metricList = it->second;
-        for (auto metricIndex : metricList) {
+    }
+
+    if (!mChangedConditionsScratch.empty()) {
+        prefetchConditionChangePulls(conditionCache, eventTimeNs);
+    }
+
+    for (const int i : mChangedConditionsScratch) {
+        for (const int metricIndex : mConditionToMetricDispatch.targets(i)) {
             // Metric cares about non sliced condition, and it's changed.
             // Push the new condition to it directly.
             if (!mAllMetricProducers[metricIndex]->isConditionSliced()) {
@@ -676,23 +982,142 @@ void MetricsManager::onLogEvent(const LogEvent& event) {
         }
     }
     // For matched AtomMatchers, tell relevant metrics that a matched event has come.
-    for (size_t i = 0; i < mAllAtomMatchingTrackers.size(); i++) {
-        if (matcherCache[i] == MatchingState::kMatched) {
-            StatsdStats::getInstance().noteMatcherMatched(mConfigKey,
-                                                          mAllAtomMatchingTrackers[i]->getId());
-            auto it = mTrackerToMetricMap.find(i);
-            if (it == mTrackerToMetricMap.end()) {
+    for (const int i : mMatchedMatchersScratch) {
+        if (mMatcherMatchedCounters[i] != nullptr) {
+            mMatcherMatchedCounters[i]->fetch_add(1, std::memory_order_relaxed);
+        }
+        const IndexAdjacencyList::Range metricList = mTrackerToMetricDispatch.targets(i);
+        if (metricList.empty()) {
+            continue;
+        }
+        const LogEvent& metricEvent =
+                matcherTransformations[i] == nullptr ? event : *matcherTransformations[i];
+        for (const int metricIndex : metricList) {
+            const sp<MetricProducer>& producer = mAllMetricProducers[metricIndex];
+            if (producer->isDimensionallySampled() &&
+                !producer->passesSampleCheck(i, metricEvent)) {
+                continue;
+            }
+            ScopedCpuTimer metricCpuTimer(
+                    /*configCounter=*/nullptr,
+                    measureCpuTime ? mMetricCpuTimeCounters[metricIndex].get() : nullptr,
+                    StatsdStats::kCpuTimeSamplingRate);
+            // pushed metrics are never scheduled pulls
+            if (CountMetricProducer* countProducer = mCountMetricProducers[metricIndex]) {
+                countProducer->onMatchedCountLogEvent(i, metricEvent);
+            } else {
+                producer->onMatchedLogEvent(i, metricEvent);
+            }
+        }
+    }
+
+    resetScratchBuffers();
+}
+
+void MetricsManager::sizeScratchBuffers() {
+    const size_t matcherCount = mAllAtomMatchingTrackers.size();
+    if (mMatcherCacheScratch.size() != matcherCount) {
+        // Entries are always reset to these defaults after an event, so resizing only has to
+        // append new ones.
+        mMatcherCacheScratch.resize(matcherCount, MatchingState::kNotComputed);
+        mMatcherTransformationsScratch.resize(matcherCount, nullptr);
+        mIsMatcherTouchedScratch.resize(matcherCount, false);
+    }
+    const size_t conditionCount = mAllConditionTrackers.size();
+    if (mConditionCacheScratch.size() != conditionCount) {
+        mConditionToBeEvaluatedScratch.resize(conditionCount, false);
+        mConditionToTransformedLogEventsScratch.resize(conditionCount, nullptr);
+        mConditionCacheScratch.resize(conditionCount, ConditionState::kNotEvaluated);
+        mChangedCacheScratch.resize(conditionCount, false);
+        mIsConditionTouchedScratch.resize(conditionCount, false);
+    }
+}
+
+void MetricsManager::resetScratchBuffers() {
+    for (const int i : mTouchedMatchersScratch) {
+        mMatcherCacheScratch[i] = MatchingState::kNotComputed;
+        mMatcherTransformationsScratch[i] = nullptr;
+        mIsMatcherTouchedScratch[i] = false;
+    }
+    mTouchedMatchersScratch.clear();
+    mMatchedMatchersScratch.clear();
+    for (const int i : mConditionsToEvaluateScratch) {
+        mConditionToBeEvaluatedScratch[i] = false;
+        mConditionToTransformedLogEventsScratch[i] = nullptr;
+    }
+    mConditionsToEvaluateScratch.clear();
+    for (const int i : mTouchedConditionsScratch) {
+        mConditionCacheScratch[i] = ConditionState::kNotEvaluated;
+        mChangedCacheScratch[i] = false;
+        mIsConditionTouchedScratch[i] = false;
+    }
+    mTouchedConditionsScratch.clear();
+    mChangedConditionsScratch.clear();
+}
+
+void MetricsManager::buildDispatchTables() {
+    const size_t matcherCount = mAllAtomMatchingTrackers.size();
+    mCountMetricProducers.assign(mAllMetricProducers.size(), nullptr);
+    for (size_t i = 0; i < mAllMetricProducers.size(); i++) {
+        if (mAllMetricProducers[i]->getMetricType() == METRIC_TYPE_COUNT) {
+            mCountMetricProducers[i] =
+                    static_cast<CountMetricProducer*>(mAllMetricProducers[i].get());
+        }
+    }
+    mTrackerToMetricDispatch.build(mTrackerToMetricMap, matcherCount);
+    buildConditionDispatch();
+    mActivationDispatch.build(mActivationAtomTrackerToMetricMap, matcherCount);
+    mDeactivationDispatch.build(mDeactivationAtomTrackerToMetricMap, matcherCount);
+    mConditionToMetricDispatch.build(mConditionToMetricMap, mAllConditionTrackers.size());
+
+    mMatcherEvaluationPlan.build(mAllAtomMatchingTrackers, mTagIdsToMatchersMap);
+
+    mAtomMatcherIndexes.clear();
+    for (const auto& [atomId, matcherIndices] : mTagIdsToMatchersMap) {
+        optional<AtomMatcherIndex> index =
+                AtomMatcherIndex::create(atomId, matcherIndices, mAllAtomMatchingTrackers);
+        if (index) {
+            mAtomMatcherIndexes.emplace(atomId, std::move(*index));
+        }
+    }
+}
+
+void MetricsManager::buildConditionDispatch() {
+    const size_t matcherCount = mAllAtomMatchingTrackers.size();
+    const size_t conditionCount = mAllConditionTrackers.size();
+    unordered_map<int, vector<int>> trackerToConditions;
+    unordered_map<int, vector<int>> trackerToConditionClosure;
+    vector<uint8_t> visited(conditionCount, false);
+    vector<int> stack;
+    for (const auto& [matcherIndex, conditionIndices] : mTrackerToConditionMap) {
+        vector<int>& conditions = trackerToConditions[matcherIndex];
+        conditions = conditionIndices;
+        std::sort(conditions.begin(), conditions.end());
+        conditions.erase(std::unique(conditions.begin(), conditions.end()), conditions.end());
+
+        // Collect the conditions and every descendant they may evaluate.
+        vector<int>& closure = trackerToConditionClosure[matcherIndex];
+        stack = conditions;
+        while (!stack.empty()) {
+            const int conditionIndex = stack.back();
+            stack.pop_back();
+            if (conditionIndex < 0 || (size_t)conditionIndex >= conditionCount ||
+                visited[conditionIndex]) {
                 continue;
             }
-            auto& metricList = it->second;
-            const LogEvent& metricEvent =
-                    matcherTransformations[i] == nullptr ? event : *matcherTransformations[i];
-            for (const int metricIndex : metricList) {
-                // pushed metrics are never scheduled pulls
-                mAllMetricProducers[metricIndex]->onMatchedLogEvent(i, metricEvent);
+            visited[conditionIndex] = true;
+            closure.push_back(conditionIndex);
+            for (const int childIndex : mAllConditionTrackers[conditionIndex]->getChildren()) {
+                stack.push_back(childIndex);
             }
         }
+        for (const int conditionIndex : closure) {
+            visited[conditionIndex] = false;
+        }
+        std::sort(closure.begin(), closure.end());
     }
+    mTrackerToConditionDispatch.build(trackerToConditions, matcherCount);
+    mTrackerToConditionClosureDispatch.build(trackerToConditionClosure, matcherCount);
 }
 
 void MetricsManager::onAnomalyAlarmFired(
@@ -703,11 +1128,13 @@ void MetricsManager::onAnomalyAlarmFired(
     }
 }
 
-void MetricsManager::onPeriodicAlarmFired(
-        const int64_t timestampNs,
-        unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet) {
+void MetricsManager::getFiredPeriodicAlarmTrackers(
+        const unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet,
+        vector<sp<AlarmTracker>>* firedTrackers) const {
     for (const auto& itr : mAllPeriodicAlarmTrackers) {
-        itr->informAlarmsFired(timestampNs, alarmSet);
+        if (itr->hasFired(alarmSet)) {
+            firedTrackers->push_back(itr);
+        }
     }
 }
 
@@ -720,6 +1147,18 @@ size_t MetricsManager::byteSize() {
     return totalSize;
 }
 
+void MetricsManager::noteMemoryUsage() {
+    for (size_t i = 0; i < mMetricMemoryStats.size(); i++) {
+        if (mMetricMemoryStats[i] == nullptr) {
+            continue;
+        }
+        mMetricMemoryStats[i]->pastBucketBytes.store(mAllMetricProducers[i]->byteSize(),
+                                                     std::memory_order_relaxed);
+        mMetricMemoryStats[i]->currentStateBytes.store(
+                mAllMetricProducers[i]->currentStateByteSize(), std::memory_order_relaxed);
+    }
+}
+
 void MetricsManager::loadActiveConfig(const ActiveConfig& config, int64_t currentTimeNs) {
     if (config.metric_size() == 0) {
         ALOGW("No active metric for config %s", mConfigKey.ToString().c_str());
@@ -737,16 +1176,20 @@ void MetricsManager::loadActiveConfig(const ActiveConfig& config, int64_t curren
                     StatsdStats::getInstance().noteActiveStatusChanged(mConfigKey,
                                                                        /*activate=*/ true);
                 }
-                mIsActive |= metric->isActive();
+                if (metric->isActive()) {
+                    mIsActive = true;
+                }
             }
         }
     }
+    resetActivationExpiries();
 }
 
 void MetricsManager::writeActiveConfigToProtoOutputStream(
         int64_t currentTimeNs, const DumpReportReason reason, ProtoOutputStream* proto) {
     proto->write(FIELD_TYPE_INT64 | FIELD_ID_ACTIVE_CONFIG_ID, (long long)mConfigKey.GetId());
     proto->write(FIELD_TYPE_INT32 | FIELD_ID_ACTIVE_CONFIG_UID, mConfigKey.GetUid());
+    proto->write(FIELD_TYPE_UINT64 | FIELD_ID_ACTIVE_CONFIG_CONFIG_HASH, (long long)mConfigHash);
     for (int metricIndex : mMetricIndexesWithActivation) {
         const auto& metric = mAllMetricProducers[metricIndex];
         const uint64_t metricToken = proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
@@ -756,6 +1199,34 @@ void MetricsManager::writeActiveConfigToProtoOutputStream(
     }
 }
 
+const vector<uint8_t>& MetricsManager::getEncodedActiveConfig(int64_t currentTimeNs,
+                                                             const DumpReportReason reason) {
+    uint64_t generationSum = 0;
+    bool stable = true;
+    for (int metricIndex : mMetricIndexesWithActivation) {
+        const optional<uint64_t> generation =
+                mAllMetricProducers[metricIndex]->getStableActivationGeneration();
+        if (!generation.has_value()) {
+            stable = false;
+            break;
+        }
+        generationSum += *generation;
+    }
+    if (stable && mEncodedActiveConfigKey == std::make_pair(reason, generationSum)) {
+        return mEncodedActiveConfig;
+    }
+
+    ProtoOutputStream proto;
+    writeActiveConfigToProtoOutputStream(currentTimeNs, reason, &proto);
+    proto.serializeToVector(&mEncodedActiveConfig);
+    if (stable) {
+        mEncodedActiveConfigKey = std::make_pair(reason, generationSum);
+    } else {
+        mEncodedActiveConfigKey = nullopt;
+    }
+    return mEncodedActiveConfig;
+}
+
 bool MetricsManager::writeMetadataToProto(int64_t currentWallClockTimeNs,
                                           int64_t systemElapsedTimeNs,
                                           metadata::StatsMetadata* statsMetadata) {
@@ -763,6 +1234,7 @@ bool MetricsManager::writeMetadataToProto(int64_t currentWallClockTimeNs,
     metadata::ConfigKey* configKey = statsMetadata->mutable_config_key();
     configKey->set_config_id(mConfigKey.GetId());
     configKey->set_uid(mConfigKey.GetUid());
+    statsMetadata->set_config_hash(mConfigHash);
     for (const auto& anomalyTracker : mAllAnomalyTrackers) {
         metadata::AlertMetadata* alertMetadata = statsMetadata->add_alert_metadata();
         bool alertWritten = anomalyTracker->writeAlertMetadataToProto(currentWallClockTimeNs,
@@ -812,16 +1284,15 @@ void MetricsManager::enforceRestrictedDataTtls(const int64_t wallClockNs) {
     if (!hasRestrictedMetricsDelegate()) {
         return;
     }
-    sqlite3* db = dbutils::getDb(mConfigKey);
+    sqlite3* db = dbutils::acquireDb(mConfigKey);
     if (db == nullptr) {
         ALOGE("Failed to open sqlite db");
-        dbutils::closeDb(db);
         return;
     }
     for (const auto& producer : mAllMetricProducers) {
         producer->enforceRestrictedDataTtl(db, wallClockNs);
     }
-    dbutils::closeDb(db);
+    dbutils::releaseDb(db);
 }
 
 bool MetricsManager::validateRestrictedMetricsDelegate(const int32_t callingUid) {
@@ -861,6 +1332,13 @@ void MetricsManager::addAllAtomIds(LogEventFilter::AtomIdSet& allIds) const {
     }
 }
 
+void MetricsManager::addAllAtomFieldMasks(AtomFieldMasks& fieldMasks) const {
+    for (const auto& [atomId, _] : mTagIdsToMatchersMap) {
+        const auto it = mAtomFieldMasks.find(atomId);
+        fieldMasks[atomId] |= it == mAtomFieldMasks.end() ? kAllFieldsMask : it->second;
+    }
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -16,26 +16,34 @@
 
 #pragma once
 
+#include <atomic>
+#include <queue>
 #include <unordered_map>
 
 #include "anomaly/AlarmMonitor.h"
 #include "anomaly/AlarmTracker.h"
 #include "anomaly/AnomalyTracker.h"
 #include "condition/ConditionTracker.h"
+#include "condition/SharedConditionRegistry.h"
 #include "config/ConfigKey.h"
 #include "external/StatsPullerManager.h"
 #include "guardrail/StatsdStats.h"
 #include "logd/LogEvent.h"
+#include "matchers/AtomMatcherIndex.h"
 #include "matchers/AtomMatchingTracker.h"
+#include "matchers/MatcherEvaluationPlan.h"
 #include "metrics/MetricProducer.h"
 #include "packages/UidMap.h"
 #include "src/statsd_config.pb.h"
 #include "src/statsd_metadata.pb.h"
+#include "utils/IndexAdjacencyList.h"
 
 namespace android {
 namespace os {
 namespace statsd {
 
+class CountMetricProducer;
+
 // A MetricsManager is responsible for managing metrics from one single config source.
 class MetricsManager : public virtual RefBase, public virtual PullUidProvider {
 public:
@@ -43,10 +51,22 @@ public:
                    const int64_t currentTimeNs, const sp<UidMap>& uidMap,
                    const sp<StatsPullerManager>& pullerManager,
                    const sp<AlarmMonitor>& anomalyAlarmMonitor,
-                   const sp<AlarmMonitor>& periodicAlarmMonitor);
+                   const sp<AlarmMonitor>& periodicAlarmMonitor,
+                   const std::shared_ptr<SharedConditionRegistry>& sharedConditions = nullptr,
+                   bool deferRegistration = false);
 
     virtual ~MetricsManager();
 
+    // Registers the metrics with the StateManager and the puller manager, and sets the first
+    // periodic alarms, for a MetricsManager built with deferRegistration so that it could be built
+    // without the lock of the StatsLogProcessor. Needs that lock. Until then, no scheduled pull or
+    // periodic alarm reaches the MetricsManager.
+    void completeRegistration();
+
+    // Unregisters the metrics from the StateManager, so that the MetricsManager can be destroyed
+    // without the lock of the StatsLogProcessor once it is no longer used. Needs that lock.
+    void unregisterStateListeners();
+
     bool updateConfig(const StatsdConfig& config, int64_t timeBaseNs, const int64_t currentTimeNs,
                       const sp<AlarmMonitor>& anomalyAlarmMonitor,
                       const sp<AlarmMonitor>& periodicAlarmMonitor);
@@ -58,18 +78,37 @@ public:
 
     virtual void onLogEvent(const LogEvent& event);
 
+    // Lets onLogEvent reuse the results of simple matchers that other configs, sharing the same
+    // sharedMatcherResults, already evaluated for the event. nullptr turns this off.
+    void setSharedMatcherResults(std::shared_ptr<SharedMatcherResults> sharedMatcherResults) {
+        mSharedMatcherResults = std::move(sharedMatcherResults);
+    }
+
+    // Continues with private copies of the condition states shared with other configs.
+    void stopSharingConditionStates();
+
+    // Shares the condition states of a MetricsManager built without sharedConditions, before it
+    // processes any event. Shares nothing and returns false if another config already shares the
+    // state of one of the predicates: the metrics started from the initial value instead.
+    bool shareConditionStates(const std::shared_ptr<SharedConditionRegistry>& sharedConditions,
+                              const StatsdConfig& config);
+
     void onAnomalyAlarmFired(
             int64_t timestampNs,
             unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet);
 
-    void onPeriodicAlarmFired(
-            int64_t timestampNs,
-            unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet);
+    // Appends the periodic alarm trackers whose alarm is in alarmSet to firedTrackers.
+    void getFiredPeriodicAlarmTrackers(
+            const unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>>& alarmSet,
+            std::vector<sp<AlarmTracker>>* firedTrackers) const;
 
     void notifyAppUpgrade(int64_t eventTimeNs, const string& apk, int uid, int64_t version);
 
     void notifyAppRemoved(int64_t eventTimeNs, const string& apk, int uid);
 
+    // Applies package upgrades and removals, in the order they happened.
+    void notifyAppsChanged(const vector<PackageChange>& changes);
+
     void onUidMapReceived(int64_t eventTimeNs);
 
     void onStatsdInitCompleted(int64_t elapsedTimeNs);
@@ -104,6 +143,10 @@ public:
         return mInstallerInReport;
     };
 
+    inline bool uidMapDeltaInReport() const {
+        return mUidMapDeltaInReport;
+    }
+
     inline uint8_t packageCertificateHashSizeBytes() const {
         return mPackageCertificateHashSizeBytes;
     }
@@ -132,24 +175,60 @@ public:
 
     virtual void onDumpReport(const int64_t dumpTimeNs, int64_t wallClockNs,
                               const bool include_current_partial_bucket, const bool erase_data,
-                              const DumpLatency dumpLatency, std::set<string>* str_set,
+                              const DumpLatency dumpLatency, StringSet* str_set,
                               android::util::ProtoOutputStream* protoOutput);
 
+    // The report of every metric of the config, detached from the metric producers.
+    struct DumpReportSnapshot {
+        std::vector<std::unique_ptr<MetricProducer::DumpReportSnapshot>> metricReports;
+        std::vector<std::pair<int64_t, int32_t>> annotations;
+        bool hashStrings = false;
+        // Where the CPU time of writing the snapshot is added to, may be nullptr.
+        std::shared_ptr<CpuTimeStats> cpuTimeStats;
+    };
+
+    // First phase of a two-phase onDumpReport(), see MetricProducer::takeDumpReportSnapshot().
+    void takeDumpReportSnapshot(const int64_t dumpTimeNs, int64_t wallClockNs,
+                                const bool include_current_partial_bucket, const bool erase_data,
+                                const DumpLatency dumpLatency, DumpReportSnapshot* snapshot);
+
+    // Second phase of a two-phase onDumpReport(). Touches no state of the MetricsManager, which
+    // may even be gone by then.
+    static void writeDumpReportSnapshot(const DumpReportSnapshot& snapshot,
+                                        StringSet* str_set,
+                                        android::util::ProtoOutputStream* protoOutput);
+
     // Computes the total byte size of all metrics managed by a single config source.
     // Does not change the state.
     virtual size_t byteSize();
 
+    // Updates the memory stats of each metric in StatsdStats, with its past buckets and the state
+    // of its current bucket. This iterates the dimensions of the metrics, so it is rate limited
+    // with the byte size check. Does not change the state.
+    void noteMemoryUsage();
+
     // Returns whether or not this config is active.
     // The config is active if any metric in the config is active.
     inline bool isActive() const {
         return mIsActive;
     }
 
+    // Returns true if the config has metrics with activations. Their activations expire as time
+    // passes, so such a config has to see every event, not only those of its atoms.
+    inline bool hasMetricActivations() const {
+        return !mMetricIndexesWithActivation.empty();
+    }
+
     void loadActiveConfig(const ActiveConfig& config, int64_t currentTimeNs);
 
     void writeActiveConfigToProtoOutputStream(
             int64_t currentTimeNs, const DumpReportReason reason, ProtoOutputStream* proto);
 
+    // Returns the ActiveConfig written by writeActiveConfigToProtoOutputStream, encoded. The
+    // previous encoding is returned again if none of the activations changed since.
+    const std::vector<uint8_t>& getEncodedActiveConfig(int64_t currentTimeNs,
+                                                       const DumpReportReason reason);
+
     // Returns true if at least one piece of metadata is written.
     bool writeMetadataToProto(int64_t currentWallClockTimeNs,
                               int64_t systemElapsedTimeNs,
@@ -171,6 +250,12 @@ public:
         return mConfigKey;
     }
 
+    // Hash of the config this manager was last built from. Saved with the metadata and the
+    // activations, which are only restored into the same config.
+    inline uint64_t getConfigHash() const {
+        return mConfigHash;
+    }
+
     void enforceRestrictedDataTtls(const int64_t wallClockNs);
 
     bool validateRestrictedMetricsDelegate(int32_t callingUid);
@@ -183,6 +268,9 @@ public:
     // Adds all atom ids referenced by matchers in the MetricsManager's config
     void addAllAtomIds(LogEventFilter::AtomIdSet& allIds) const;
 
+    // Adds the fields that the config reads to fieldMasks for all atom ids of addAllAtomIds
+    void addAllAtomFieldMasks(AtomFieldMasks& fieldMasks) const;
+
     // Gets the memory limit for the MetricsManager's config
     inline size_t getMaxMetricsBytes() const {
         return mMaxMetricsBytes;
@@ -198,17 +286,21 @@ private:
 
     const ConfigKey mConfigKey;
 
+    uint64_t mConfigHash;
+
     sp<UidMap> mUidMap;
 
     bool mHashStringsInReport = false;
     bool mVersionStringsInReport = false;
     bool mInstallerInReport = false;
+    bool mUidMapDeltaInReport = false;
     uint8_t mPackageCertificateHashSizeBytes;
 
     int64_t mTtlNs;
     int64_t mTtlEndNs;
 
-    int64_t mLastReportTimeNs;
+    // Atomic, like mIsActive, so that StatsLogProcessor can read it without mMetricsMutex.
+    std::atomic<int64_t> mLastReportTimeNs;
     int64_t mLastReportWallClockNs;
 
     optional<InvalidConfigReason> mInvalidConfigReason;
@@ -221,11 +313,14 @@ private:
     // The pkg log sources from StatsdConfig.
     std::vector<std::string> mAllowedPkg;
 
-    // The combined uid sources (after translating pkg name to uid).
+    // The uids of each package in mAllowedPkg, kept up to date with the package changes.
+    std::map<std::string, std::set<int32_t>> mAllowedPkgUids;
+
+    // The combined uid sources (after translating pkg name to uid), sorted without duplicates.
     // Logs from uids that are not in the list will be ignored to avoid spamming.
-    std::set<int32_t> mAllowedLogSources;
+    std::vector<int32_t> mAllowedLogSources;
 
-    // To guard access to mAllowedLogSources
+    // To guard access to mAllowedPkgUids and mAllowedLogSources
     mutable std::mutex mAllowedLogSourcesMutex;
 
     std::set<int32_t> mWhitelistedAtomIds;
@@ -251,6 +346,9 @@ private:
     // All event tags that are interesting to config metrics matchers.
     std::unordered_map<int, std::vector<int>> mTagIdsToMatchersMap;
 
+    // Top-level fields of each atom that the config reads.
+    AtomFieldMasks mAtomFieldMasks;
+
     // We only store the sp of AtomMatchingTracker, MetricProducer, and ConditionTracker in
     // MetricsManager. There are relationships between them, and the relationships are denoted by
     // index instead of pointers. The reasons for this are: (1) the relationship between them are
@@ -261,12 +359,33 @@ private:
     // Hold all the atom matchers from the config.
     std::vector<sp<AtomMatchingTracker>> mAllAtomMatchingTrackers;
 
+    // Parallel to mAllAtomMatchingTrackers: the StatsdStats counter of how often each matcher
+    // matched, resolved whenever the config is (re)loaded. Null if the config has no stats.
+    std::vector<std::shared_ptr<std::atomic<int>>> mMatcherMatchedCounters;
+
     // Hold all the conditions from the config.
     std::vector<sp<ConditionTracker>> mAllConditionTrackers;
 
     // Hold all metrics from the config.
     std::vector<sp<MetricProducer>> mAllMetricProducers;
 
+    // The count metric at each index of mAllMetricProducers, nullptr for metrics of other kinds.
+    // Rebuilt with the dispatch tables. onLogEvent calls count metrics through it, with their
+    // calls resolved statically.
+    std::vector<CountMetricProducer*> mCountMetricProducers;
+
+    // CPU time counters of the config and, parallel to mAllMetricProducers, of its metrics.
+    // Resolved along with mMatcherMatchedCounters. Null if the config has no stats.
+    std::shared_ptr<CpuTimeStats> mCpuTimeStats;
+    std::vector<std::shared_ptr<std::atomic<int64_t>>> mMetricCpuTimeCounters;
+
+    // Memory stats of the metrics, parallel to mAllMetricProducers and resolved like
+    // mMetricCpuTimeCounters.
+    std::vector<std::shared_ptr<MetricMemoryStats>> mMetricMemoryStats;
+
+    // Counts the log events to measure the CPU time of one in StatsdStats::kCpuTimeSamplingRate.
+    uint32_t mCpuTimeSampleCounter = 0;
+
     // Hold all alert trackers.
     std::vector<sp<AnomalyTracker>> mAllAnomalyTrackers;
 
@@ -319,10 +438,105 @@ private:
 
     std::vector<int> mMetricIndexesWithActivation;
 
+    // The last encoding returned by getEncodedActiveConfig, with the dump reason and the sum of
+    // the stable activation generations of the metrics it was encoded at. The generations only
+    // grow, so an equal sum means that no activation has changed. Cleared on config updates.
+    std::vector<uint8_t> mEncodedActiveConfig;
+    optional<std::pair<DumpReportReason, uint64_t>> mEncodedActiveConfigKey;
+
+    // Min-heap of (expiry time, metric index) over the active metrics in
+    // mMetricIndexesWithActivation, so that each event only compares its timestamp with the top.
+    // An entry is stale, and skipped, unless its time is mActivationExpiryNs[metric index].
+    std::priority_queue<std::pair<int64_t, int>, std::vector<std::pair<int64_t, int>>,
+                        std::greater<std::pair<int64_t, int>>>
+            mActivationExpiryHeap;
+
+    // Per metric, the time of its live entry in mActivationExpiryHeap. INT64_MAX if it has none.
+    std::vector<int64_t> mActivationExpiryNs;
+
+    // Number of metrics in mMetricIndexesWithActivation that are active.
+    int mActiveMetricCount = 0;
+
+    // The maps above compiled into dense adjacency lists, rebuilt on config creation/update.
+    // onLogEvent dispatches through these, so it only visits the edges out of the matchers that
+    // matched and the conditions that changed.
+    IndexAdjacencyList mTrackerToMetricDispatch;
+    IndexAdjacencyList mTrackerToConditionDispatch;
+    IndexAdjacencyList mConditionToMetricDispatch;
+    // For each matcher, the conditions it triggers and all of their descendants, i.e. every
+    // condition whose cache entry a match may write. Like mTrackerToConditionDispatch, the
+    // targets are in condition index order.
+    IndexAdjacencyList mTrackerToConditionClosureDispatch;
+    IndexAdjacencyList mActivationDispatch;
+    IndexAdjacencyList mDeactivationDispatch;
+
+    // Per atom id, the matchers of the atom keyed by the value of a field they test for
+    // equality, so that onLogEvent only evaluates the ones that can match. Only built for atoms
+    // with enough such matchers.
+    std::unordered_map<int, AtomMatcherIndex> mAtomMatcherIndexes;
+
+    // Evaluates the matchers of each atom without recursing through the combination matchers.
+    MatcherEvaluationPlan mMatcherEvaluationPlan;
+
+    // Shared with the other metrics managers of the processor, see setSharedMatcherResults.
+    std::shared_ptr<SharedMatcherResults> mSharedMatcherResults;
+
+    // Where the simple condition trackers of this config find the state of identical predicates
+    // of other configs. nullptr if they keep their state to themselves.
+    std::shared_ptr<SharedConditionRegistry> mSharedConditions;
+
+    // Whether the metrics are registered with the StateManager, see completeRegistration().
+    bool mStateListenersRegistered;
+
+    // Should be called on config creation/update, once the maps above are populated.
+    void buildDispatchTables();
+
+    // Builds mTrackerToConditionDispatch and mTrackerToConditionClosureDispatch.
+    void buildConditionDispatch();
+
+    // Scratch buffers reused by onLogEvent so that processing an event does not allocate. They
+    // are sized to the trackers of the current config, and only the entries an event touched are
+    // reset afterwards, so the per-event cost scales with the matchers and conditions it reaches
+    // rather than with the size of the config.
+    std::vector<MatchingState> mMatcherCacheScratch;
+    std::vector<std::shared_ptr<LogEvent>> mMatcherTransformationsScratch;
+    std::vector<uint8_t> mIsMatcherTouchedScratch;
+    std::vector<int> mTouchedMatchersScratch;
+    std::vector<int> mMatchedMatchersScratch;
+    std::vector<uint8_t> mConditionToBeEvaluatedScratch;
+    std::vector<std::shared_ptr<LogEvent>> mConditionToTransformedLogEventsScratch;
+    std::vector<int> mConditionsToEvaluateScratch;
+    std::vector<ConditionState> mConditionCacheScratch;
+    std::vector<uint8_t> mChangedCacheScratch;
+    std::vector<uint8_t> mIsConditionTouchedScratch;
+    std::vector<int> mTouchedConditionsScratch;
+    std::vector<int> mChangedConditionsScratch;
+    std::vector<int> mCanceledMetricsScratch;
+
+    // Grows or shrinks the scratch buffers to match the current trackers.
+    void sizeScratchBuffers();
+
+    // Restores the touched entries of the scratch buffers to their defaults.
+    void resetScratchBuffers();
+
+    // Resolves the uids of all the allowed packages.
     void initAllowedLogSources();
 
+    // Apply the install or removal of a uid of a package to the allowed log sources, if the
+    // package is allowed.
+    void addAllowedLogSource(const string& apk, int uid);
+    void removeAllowedLogSource(const string& apk, int uid);
+
     void initPullAtomSources();
 
+    // Whether the data of the metric can depend on the app, so that the metric splits its bucket
+    // when the app is upgraded or removed.
+    bool isMetricAffectedByApp(const MetricProducer& producer, const string& apk, int uid);
+
+    // Splits for app upgrades within this window of the last split of a metric are coalesced
+    // into it, so that a burst of app updates makes one partial bucket.
+    static constexpr int64_t kAppUpgradeCoalescingWindowNs = 10 * NS_PER_SEC;
+
     // Only called on config creation/update to initialize log sources from the config.
     // Calls initAllowedLogSources and initPullAtomSources. Sets up mInvalidConfigReason on
     // error.
@@ -336,11 +550,25 @@ private:
     // Should be called on config creation/update.
     void initializeConfigActiveStatus();
 
+    // Recomputes mActiveMetricCount and mActivationExpiryHeap from the metrics.
+    void resetActivationExpiries();
+
+    // Makes sure mActivationExpiryHeap has an entry for the next activation expiry of the metric.
+    void scheduleActivationExpiry(int metricIndex);
+
+    // Flushes the metrics whose activations expired before eventTimeNs.
+    void expireActivations(int64_t eventTimeNs);
+
+    // Pulls the atoms that the metrics of the changed conditions are about to pull, all at once,
+    // so that their own pulls are served from the pullers' caches instead of running in turn.
+    void prefetchConditionChangePulls(const std::vector<ConditionState>& conditionCache,
+                                      int64_t eventTimeNs);
+
     // The metrics that don't need to be uploaded or even reported.
     std::set<int64_t> mNoReportMetricIds;
 
    // The config is active if any metric in the config is active.
-    bool mIsActive;
+    std::atomic<bool> mIsActive;
 
     // The config is always active if any metric in the config does not have an activation signal.
     bool mIsAlwaysActive;
@@ -355,6 +583,9 @@ private:
     // Only called on config creation/update. Sets the memory limit in bytes for storing metrics.
     void setMaxMetricsBytesFromConfig(const StatsdConfig& config);
 
+    // Gives the metrics a shared DimensionBudget if the config asks for one.
+    void setDimensionBudgetFromConfig(const StatsdConfig& config);
+
     // Only called on config creation/update. Sets the soft memory limit in bytes for storing
     // metrics.
     void setTriggerGetDataBytesFromConfig(const StatsdConfig& config);
@@ -389,7 +620,10 @@ private:
     FRIEND_TEST(AnomalyDurationDetectionE2eTest, TestDurationMetric_SUM_long_refractory_period);
 
     FRIEND_TEST(AlarmE2eTest, TestMultipleAlarms);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmFiredWhileConfigRemoved);
+    FRIEND_TEST(AlarmE2eTest, TestAlarmFiredWhileConfigUpdated);
     FRIEND_TEST(ConfigTtlE2eTest, TestCountMetric);
+    FRIEND_TEST(ConfigTtlE2eTest, TestTtlCheckedByScheduledHousekeeping);
     FRIEND_TEST(ConfigUpdateE2eAbTest, TestConfigTtl);
     FRIEND_TEST(MetricActivationE2eTest, TestCountMetric);
     FRIEND_TEST(MetricActivationE2eTest, TestCountMetricWithOneDeactivation);
@@ -399,6 +633,11 @@ private:
 
     FRIEND_TEST(MetricsManagerTest, TestLogSources);
     FRIEND_TEST(MetricsManagerTest, TestLogSourcesOnConfigUpdate);
+    FRIEND_TEST(MetricsManagerTest, TestLogSourcesOnPackageChanges);
+    FRIEND_TEST(MetricsManagerTest, TestScratchBuffersResetBetweenEvents);
+    FRIEND_TEST(MetricsManagerTest, TestConditionDispatchInIndexOrder);
+    FRIEND_TEST(MetricsManagerTest, TestActivationExpiryHeap);
+    FRIEND_TEST(MetricsManagerTest, TestEncodedActiveConfigReusedUntilActivationChanges);
     FRIEND_TEST(MetricsManagerTest_SPlus, TestRestrictedMetricsConfig);
     FRIEND_TEST(MetricsManagerTest_SPlus, TestRestrictedMetricsConfigUpdate);
     FRIEND_TEST(MetricsManagerUtilTest, TestSampledMetrics);
@@ -409,6 +648,7 @@ private:
     FRIEND_TEST(StatsLogProcessorTest,
             TestActivationOnBootMultipleActivationsDifferentActivationTypes);
     FRIEND_TEST(StatsLogProcessorTest, TestActivationsPersistAcrossSystemServerRestart);
+    FRIEND_TEST(StatsLogProcessorTest, TestPrebuiltConfigSharingLivePredicateRebuilt);
 
     FRIEND_TEST(CountMetricE2eTest, TestInitialConditionChanges);
     FRIEND_TEST(CountMetricE2eTest, TestSlicedState);
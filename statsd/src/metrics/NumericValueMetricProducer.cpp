@@ -60,6 +60,64 @@ const int FIELD_ID_CONDITION_CORRECTION_NS = 11;
 const Value ZERO_LONG((int64_t)0);
 const Value ZERO_DOUBLE(0.0);
 
+namespace {
+
+// SUM and AVG add up the values, AVG takes the average when flushing the bucket.
+struct SumAggregation {
+    template <typename T>
+    static void apply(const T& value, T& aggregate) {
+        aggregate += value;
+    }
+};
+
+struct MinAggregation {
+    template <typename T>
+    static void apply(const T& value, T& aggregate) {
+        aggregate = std::min(value, aggregate);
+    }
+};
+
+struct MaxAggregation {
+    template <typename T>
+    static void apply(const T& value, T& aggregate) {
+        aggregate = std::max(value, aggregate);
+    }
+};
+
+// Aggregates the value into the aggregate of an interval that already has a value. Values of the
+// same type, which is always the case once the first value of the interval is set, are
+// aggregated on their long or double directly.
+template <typename Aggregation>
+void aggregateValue(const Value& value, Value& aggregate) {
+    if (value.type == LONG && aggregate.type == LONG) {
+        Aggregation::apply(value.long_value, aggregate.long_value);
+    } else if (value.type == DOUBLE && aggregate.type == DOUBLE) {
+        Aggregation::apply(value.double_value, aggregate.double_value);
+    } else {
+        Aggregation::apply(value, aggregate);
+    }
+}
+
+void ignoreValue(const Value& /*value*/, Value& /*aggregate*/) {
+}
+
+NumericValueMetricProducer::AggregateFunction getAggregateFunction(
+        ValueMetric::AggregationType aggregationType) {
+    switch (aggregationType) {
+        case ValueMetric::SUM:
+        case ValueMetric::AVG:
+            return aggregateValue<SumAggregation>;
+        case ValueMetric::MIN:
+            return aggregateValue<MinAggregation>;
+        case ValueMetric::MAX:
+            return aggregateValue<MaxAggregation>;
+        default:
+            return ignoreValue;
+    }
+}
+
+}  // anonymous namespace
+
 // ValueMetric has a minimum bucket size of 10min so that we don't pull too frequently
 NumericValueMetricProducer::NumericValueMetricProducer(
         const ConfigKey& key, const ValueMetric& metric, const uint64_t protoHash,
@@ -71,6 +129,7 @@ NumericValueMetricProducer::NumericValueMetricProducer(
                           conditionOptions, stateOptions, activationOptions, guardrailOptions),
       mUseAbsoluteValueOnReset(metric.use_absolute_value_on_reset()),
       mAggregationType(metric.aggregation_type()),
+      mAggregate(getAggregateFunction(metric.aggregation_type())),
       mIncludeSampleSize(metric.has_include_sample_size()
                                  ? metric.include_sample_size()
                                  : metric.aggregation_type() == ValueMetric_AggregationType_AVG),
@@ -175,6 +234,14 @@ void NumericValueMetricProducer::pullAndMatchEventsLocked(const int64_t timestam
     accumulateEvents(allData, timestampNs, timestampNs);
 }
 
+// Mirrors the pull of ValueMetricProducer::onConditionChangedLocked. Sliced conditions never pull.
+int NumericValueMetricProducer::getConditionChangePullAtomIdLocked(bool conditionMet) const {
+    if (!isPulled() || !mIsActive || mConditionSliced) {
+        return -1;
+    }
+    return conditionMet || mCondition == ConditionState::kTrue ? mPullAtomId : -1;
+}
+
 int64_t NumericValueMetricProducer::calcPreviousBucketEndTime(const int64_t currentTimeNs) {
     return mTimeBaseNs + ((currentTimeNs - mTimeBaseNs) / mBucketSizeNs) * mBucketSizeNs;
 }
@@ -185,6 +252,7 @@ int64_t NumericValueMetricProducer::calcPreviousBucketEndTime(const int64_t curr
 void NumericValueMetricProducer::onDataPulled(const std::vector<std::shared_ptr<LogEvent>>& allData,
                                               PullResult pullResult, int64_t originalPullTimeNs) {
     lock_guard<mutex> lock(mMutex);
+    const ScopedCpuTimer cpuTimer = pullCpuTimerLocked();
     if (mCondition == ConditionState::kTrue) {
         // If the pull failed, we won't be able to compute a diff.
         if (pullResult == PullResult::PULL_RESULT_FAIL) {
@@ -264,7 +332,12 @@ void NumericValueMetricProducer::accumulateEvents(const vector<shared_ptr<LogEve
     if (mUseDiff) {
         // An extra aggregation step is needed to sum values with matching dimensions
         // before calculating the diff between sums of consecutive pulls.
+        // The dimension key of every row is extracted once, in this pass, and passed on with the
+        // aggregated event, so that it is not extracted and hashed again when joined against the
+        // bases in mDimInfos.
         std::unordered_map<HashableDimensionKey, pair<LogEvent, vector<int>>> aggregateEvents;
+        aggregateEvents.reserve(allData.size());
+        mMatchedMetricDimensionKeys.reserve(allData.size());
         for (const auto& data : allData) {
             const auto [matchResult, transformedEvent] =
                     mEventMatcherWizard->matchLogEvent(*data, mWhatMatcherIndex);
@@ -276,25 +349,22 @@ void NumericValueMetricProducer::accumulateEvents(const vector<shared_ptr<LogEve
             HashableDimensionKey dimensionsInWhat;
             vector<int> valueIndices(mFieldMatchers.size(), -1);
             const LogEvent& eventRef = transformedEvent == nullptr ? *data : *transformedEvent;
-            if (!filterValues(mDimensionsInWhat, mFieldMatchers, eventRef.getValues(),
-                              dimensionsInWhat, valueIndices)) {
+            if (!filterValues(mDimensionsInWhat, mFieldMatchers, eventRef, dimensionsInWhat,
+                              valueIndices)) {
                 StatsdStats::getInstance().noteBadValueType(mMetricId);
             }
 
             // Store new event in map or combine values in existing event.
-            auto it = aggregateEvents.find(dimensionsInWhat);
-            if (it == aggregateEvents.end()) {
-                aggregateEvents.emplace(std::piecewise_construct,
-                                        std::forward_as_tuple(dimensionsInWhat),
-                                        std::forward_as_tuple(eventRef, valueIndices));
-            } else {
+            const auto [it, inserted] =
+                    aggregateEvents.try_emplace(std::move(dimensionsInWhat), eventRef, valueIndices);
+            if (!inserted) {
                 combineValueFields(it->second, eventRef, valueIndices);
             }
         }
 
         for (auto& [dimKey, eventInfo] : aggregateEvents) {
             eventInfo.first.setElapsedTimestampNs(eventElapsedTimeNs);
-            onMatchedLogEventLocked(mWhatMatcherIndex, eventInfo.first);
+            onMatchedLogEventWithDimensionLocked(mWhatMatcherIndex, eventInfo.first, &dimKey);
         }
     } else {
         for (const auto& data : allData) {
@@ -313,6 +383,7 @@ void NumericValueMetricProducer::accumulateEvents(const vector<shared_ptr<LogEve
     // 2. A superset of the current mStateChangePrimaryKey
     // was not found in the new pulled data (i.e. not in mMatchedDimensionInWhatKeys)
     // then we clear the data from mDimInfos to reset the base and current state key.
+    applyAllConditionTimerChangesLocked();
     for (auto& [metricDimensionKey, currentValueBucket] : mCurrentSlicedBucket) {
         const auto& whatKey = metricDimensionKey.getDimensionKeyInWhat();
         bool presentInPulledData =
@@ -352,7 +423,7 @@ bool NumericValueMetricProducer::hitFullBucketGuardRailLocked(const MetricDimens
     if (mCurrentFullBucket.size() > mDimensionSoftLimit - 1) {
         size_t newTupleCount = mCurrentFullBucket.size() + 1;
         // 2. Don't add more tuples, we are above the allowed threshold. Drop the data.
-        if (newTupleCount > mDimensionHardLimit) {
+        if (newTupleCount > getDimensionHardLimitLocked(mDimensionHardLimit)) {
             if (!mHasHitGuardrail) {
                 ALOGE("ValueMetric %lld dropping data for full bucket dimension key %s",
                       (long long)mMetricId, newKey.toString().c_str());
@@ -478,21 +549,7 @@ bool NumericValueMetricProducer::aggregateFields(const int64_t eventTimeNs,
         }
 
         if (interval.hasValue()) {
-            switch (mAggregationType) {
-                case ValueMetric::SUM:
-                    // for AVG, we add up and take average when flushing the bucket
-                case ValueMetric::AVG:
-                    interval.aggregate += value;
-                    break;
-                case ValueMetric::MIN:
-                    interval.aggregate = min(value, interval.aggregate);
-                    break;
-                case ValueMetric::MAX:
-                    interval.aggregate = max(value, interval.aggregate);
-                    break;
-                default:
-                    break;
-            }
+            mAggregate(value, interval.aggregate);
         } else {
             interval.aggregate = value;
         }
@@ -521,6 +578,8 @@ PastBucket<Value> NumericValueMetricProducer::buildPartialBucket(int64_t bucketE
     PastBucket<Value> bucket;
     bucket.mBucketStartNs = mCurrentBucketStartTimeNs;
     bucket.mBucketEndNs = bucketEndTimeNs;
+    bucket.mAggregatesOffset = mPastBucketAggregates.size();
+    bucket.mAggregatesCount = 0;
 
     // The first value field acts as a "gatekeeper" - if it does not pass the specified threshold,
     // then all interval values are discarded for this bucket.
@@ -535,11 +594,14 @@ PastBucket<Value> NumericValueMetricProducer::buildPartialBucket(int64_t bucketE
             continue;
         }
 
-        bucket.aggIndex.push_back(interval.aggIndex);
-        bucket.aggregates.push_back(getFinalValue(interval));
+        mPastBucketAggregates.aggIndex.push_back(interval.aggIndex);
+        mPastBucketAggregates.aggregates.push_back(getFinalValue(interval));
+        mPastBucketsByteSize += sizeof(int) + sizeof(Value);
         if (mIncludeSampleSize) {
-            bucket.sampleSizes.push_back(interval.sampleSize);
+            mPastBucketAggregates.sampleSizes.push_back(interval.sampleSize);
+            mPastBucketsByteSize += sizeof(int);
         }
+        bucket.mAggregatesCount++;
     }
     return bucket;
 }
@@ -627,12 +689,7 @@ void NumericValueMetricProducer::appendToFullBucket(const bool isFullBucketReach
 }
 
 size_t NumericValueMetricProducer::byteSizeLocked() const {
-    size_t totalSize = 0;
-    for (const auto& [_, buckets] : mPastBuckets) {
-        totalSize += buckets.size() * kBucketSize;
-        // TODO(b/189283526): Add bytes used to store PastBucket.aggIndex vector
-    }
-    return totalSize;
+    return mPastBucketsByteSize;
 }
 
 bool NumericValueMetricProducer::valuePassesThreshold(const Interval& interval) const {
@@ -52,6 +52,8 @@ public:
         return METRIC_TYPE_VALUE;
     }
 
+    using AggregateFunction = void (*)(const Value& value, Value& aggregate);
+
 protected:
 private:
     void prepareFirstBucketLocked() override;
@@ -133,6 +135,8 @@ private:
 
     void pullAndMatchEventsLocked(const int64_t timestampNs) override;
 
+    int getConditionChangePullAtomIdLocked(bool conditionMet) const override;
+
     DumpProtoFields getDumpProtoFields() const override;
 
     void writePastBucketAggregateToProto(const int aggIndex, const Value& value,
@@ -149,6 +153,10 @@ private:
 
     const ValueMetric::AggregationType mAggregationType;
 
+    // Aggregates a value into the aggregate of an interval that has a value, resolved from
+    // mAggregationType once so that aggregating does not switch on it for every value.
+    const AggregateFunction mAggregate;
+
     const bool mIncludeSampleSize;
 
     const bool mUseDiff;
@@ -191,6 +199,7 @@ private:
     FRIEND_TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithDiff);
     FRIEND_TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithoutDiff);
     FRIEND_TEST(NumericValueMetricProducerTest, TestPartialResetOnBucketBoundaries);
+    FRIEND_TEST(NumericValueMetricProducerTest, TestPastBucketAggregatesDumpedByDimension);
     FRIEND_TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_bucketBoundaryFalse);
     FRIEND_TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_bucketBoundaryTrue);
     FRIEND_TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_withFailure);
@@ -229,6 +238,10 @@ private:
     FRIEND_TEST(NumericValueMetricProducerTest, TestSlicedStateWithMissingDataThenFlushBucket);
     FRIEND_TEST(NumericValueMetricProducerTest, TestSlicedStateWithNoPullOnBucketBoundary);
     FRIEND_TEST(NumericValueMetricProducerTest, TestSlicedStateWithConditionFalseMultipleBuckets);
+    FRIEND_TEST(NumericValueMetricProducerTest, TestSlicedStateConditionTimerChangesConditionFlips);
+    FRIEND_TEST(NumericValueMetricProducerTest, TestSlicedStateConditionTimerChangesNewDimension);
+    FRIEND_TEST(NumericValueMetricProducerTest,
+                TestSlicedStateConditionTimerChangesPendingAtBucketEnd);
     FRIEND_TEST(NumericValueMetricProducerTest,
                 TestSlicedStateWithMultipleDimensionsMissingDataInPull);
     FRIEND_TEST(NumericValueMetricProducerTest, TestUploadThreshold);
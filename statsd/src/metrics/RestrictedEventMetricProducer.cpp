@@ -56,17 +56,19 @@ void RestrictedEventMetricProducer::onMatchedLogEventInternalLocked(
         mRestrictedDataCategory != event.getRestrictionCategory()) {
         StatsdStats::getInstance().noteRestrictedMetricCategoryChanged(mConfigKey, mMetricId);
         deleteMetricTable();
-        mLogEvents.clear();
-        mTotalSize = 0;
+        clearPendingEvents();
     }
     mRestrictedDataCategory = event.getRestrictionCategory();
-    mLogEvents.push_back(event);
-    mTotalSize += getSize(event.getValues()) + sizeof(event);
+    if (mPendingEvents.empty()) {
+        mFirstPendingEvent.emplace(event);
+    }
+    mPendingEvents.append(event);
+    mTotalSize = mPendingEvents.byteSize();
 }
 
 void RestrictedEventMetricProducer::onDumpReportLocked(
         const int64_t dumpTimeNs, const bool include_current_partial_bucket, const bool erase_data,
-        const DumpLatency dumpLatency, std::set<string>* str_set,
+        const DumpLatency dumpLatency, StringSet* str_set,
         android::util::ProtoOutputStream* protoOutput) {
     VLOG("Unexpected call to onDumpReportLocked() in RestrictedEventMetricProducer");
 }
@@ -92,35 +94,40 @@ void RestrictedEventMetricProducer::clearPastBucketsLocked(const int64_t dumpTim
 }
 
 void RestrictedEventMetricProducer::dropDataLocked(const int64_t dropTimeNs) {
-    mLogEvents.clear();
-    mTotalSize = 0;
+    clearPendingEvents();
     StatsdStats::getInstance().noteBucketDropped(mMetricId);
 }
 
 void RestrictedEventMetricProducer::flushRestrictedData() {
     std::lock_guard<std::mutex> lock(mMutex);
-    if (mLogEvents.empty()) {
+    if (mPendingEvents.empty()) {
         return;
     }
     int64_t flushStartNs = getElapsedRealtimeNs();
+    // The schema check, table creation and insert share one pooled connection, so that the
+    // insert statement prepared on it is reused for every row and across flushes.
+    sqlite3* db = dbutils::acquireDb(mConfigKey);
     if (!mIsMetricTableCreated) {
-        if (!dbutils::isEventCompatible(mConfigKey, mMetricId, mLogEvents[0])) {
+        if (db != nullptr && !dbutils::isEventCompatible(db, mMetricId, *mFirstPendingEvent)) {
             // Delete old data if schema changes
             // TODO(b/268150038): report error to statsdstats
             ALOGD("Detected schema change for metric %lld", (long long)mMetricId);
             deleteMetricTable();
         }
         // TODO(b/271481944): add retry.
-        if (!dbutils::createTableIfNeeded(mConfigKey, mMetricId, mLogEvents[0])) {
+        if (db == nullptr || !dbutils::createTableIfNeeded(db, mMetricId, *mFirstPendingEvent)) {
             ALOGE("Failed to create table for metric %lld", (long long)mMetricId);
             StatsdStats::getInstance().noteRestrictedMetricTableCreationError(mConfigKey,
                                                                               mMetricId);
+            if (db != nullptr) {
+                dbutils::releaseDb(db);
+            }
             return;
         }
         mIsMetricTableCreated = true;
     }
     string err;
-    if (!dbutils::insert(mConfigKey, mMetricId, mLogEvents, err)) {
+    if (db == nullptr || !dbutils::insert(db, mMetricId, mPendingEvents, err)) {
         ALOGE("Failed to insert logEvent to table for metric %lld. err=%s", (long long)mMetricId,
               err.c_str());
         StatsdStats::getInstance().noteRestrictedMetricInsertError(mConfigKey, mMetricId);
@@ -128,8 +135,10 @@ void RestrictedEventMetricProducer::flushRestrictedData() {
         StatsdStats::getInstance().noteRestrictedMetricFlushLatency(
                 mConfigKey, mMetricId, getElapsedRealtimeNs() - flushStartNs);
     }
-    mLogEvents.clear();
-    mTotalSize = 0;
+    if (db != nullptr) {
+        dbutils::releaseDb(db);
+    }
+    clearPendingEvents();
 }
 
 bool RestrictedEventMetricProducer::writeMetricMetadataToProto(
@@ -145,6 +154,12 @@ void RestrictedEventMetricProducer::loadMetricMetadataFromProto(
             static_cast<StatsdRestrictionCategory>(metricMetadata.restricted_category());
 }
 
+void RestrictedEventMetricProducer::clearPendingEvents() {
+    mPendingEvents.clear();
+    mFirstPendingEvent.reset();
+    mTotalSize = 0;
+}
+
 void RestrictedEventMetricProducer::deleteMetricTable() {
     if (!dbutils::deleteTable(mConfigKey, mMetricId)) {
         StatsdStats::getInstance().noteRestrictedMetricTableDeletionError(mConfigKey, mMetricId);
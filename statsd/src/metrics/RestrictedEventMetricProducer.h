@@ -3,7 +3,10 @@
 
 #include <gtest/gtest_prod.h>
 
+#include <optional>
+
 #include "EventMetricProducer.h"
+#include "utils/RestrictedEventBuffer.h"
 #include "utils/RestrictedPolicyManager.h"
 
 namespace android {
@@ -45,7 +48,7 @@ private:
 
     void onDumpReportLocked(const int64_t dumpTimeNs, const bool include_current_partial_bucket,
                             const bool erase_data, const DumpLatency dumpLatency,
-                            std::set<string>* str_set,
+                            StringSet* str_set,
                             android::util::ProtoOutputStream* protoOutput) override;
 
     void clearPastBucketsLocked(const int64_t dumpTimeNs) override;
@@ -54,11 +57,17 @@ private:
 
     void deleteMetricTable();
 
+    void clearPendingEvents();
+
     bool mIsMetricTableCreated = false;
 
     StatsdRestrictionCategory mRestrictedDataCategory;
 
-    vector<LogEvent> mLogEvents;
+    // The events matched since the last flush.
+    RestrictedEventBuffer mPendingEvents;
+
+    // The first of mPendingEvents, which the schema of the metric's table is derived from.
+    std::optional<LogEvent> mFirstPendingEvent;
 };
 
 }  // namespace statsd
@@ -26,9 +26,11 @@
 #include "FieldValue.h"
 #include "HashableDimensionKey.h"
 #include "guardrail/StatsdStats.h"
+#include "metrics/HistogramValue.h"
 #include "metrics/parsing_utils/metrics_manager_util.h"
 #include "stats_log_util.h"
 #include "stats_util.h"
+#include "utils/StatsdTrace.h"
 
 using android::util::FIELD_COUNT_REPEATED;
 using android::util::FIELD_TYPE_BOOL;
@@ -68,6 +70,7 @@ const int FIELD_ID_DROP_TIME = 2;
 const int FIELD_ID_DIMENSION_IN_WHAT = 1;
 const int FIELD_ID_BUCKET_INFO = 3;
 const int FIELD_ID_DIMENSION_LEAF_IN_WHAT = 4;
+const int FIELD_ID_DIMENSION_INDEX_IN_WHAT = 7;
 const int FIELD_ID_SLICE_BY_STATE = 6;
 
 template <typename AggregatedValue, typename DimExtras>
@@ -108,6 +111,7 @@ ValueMetricProducer<AggregatedValue, DimExtras>::ValueMetricProducer(
             mc.conditionId = link.condition();
             translateFieldMatcher(link.fields_in_what(), &mc.metricFields);
             translateFieldMatcher(link.fields_in_condition(), &mc.conditionFields);
+            mc.projection = compileLinkProjection(mc.metricFields, mc.conditionFields);
             mMetric2ConditionLinks.push_back(mc);
         }
 
@@ -120,6 +124,7 @@ ValueMetricProducer<AggregatedValue, DimExtras>::ValueMetricProducer(
         ms.stateAtomId = stateLink.state_atom_id();
         translateFieldMatcher(stateLink.fields_in_what(), &ms.metricFields);
         translateFieldMatcher(stateLink.fields_in_state(), &ms.stateFields);
+        ms.projection = compileLinkProjection(ms.metricFields, ms.stateFields);
         mMetric2StateLinks.push_back(ms);
     }
 
@@ -129,8 +134,12 @@ ValueMetricProducer<AggregatedValue, DimExtras>::ValueMetricProducer(
     flushIfNeededLocked(bucketOptions.startTimeNs);
 
     if (isPulled()) {
-        mPullerManager->RegisterReceiver(mPullAtomId, mConfigKey, this, getCurrentBucketEndTimeNs(),
-                                         mBucketSizeNs);
+        if (pullOptions.deferRegistration) {
+            mPullRegistrationDeferred = true;
+        } else {
+            mPullerManager->RegisterReceiver(mPullAtomId, mConfigKey, this,
+                                             getCurrentBucketEndTimeNs(), mBucketSizeNs);
+        }
     }
 
     // Only do this for partial buckets like first bucket. All other buckets should use
@@ -144,6 +153,21 @@ ValueMetricProducer<AggregatedValue, DimExtras>::ValueMetricProducer(
                                        mCurrentBucketStartTimeNs);
 }
 
+template <typename AggregatedValue, typename DimExtras>
+void ValueMetricProducer<AggregatedValue, DimExtras>::registerPullReceiver() {
+    int64_t nextPullTimeNs;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mPullRegistrationDeferred) {
+            return;
+        }
+        mPullRegistrationDeferred = false;
+        nextPullTimeNs = getCurrentBucketEndTimeNs();
+    }
+    // Outside of mMutex: the puller manager holds its lock while it hands pulled data over.
+    mPullerManager->RegisterReceiver(mPullAtomId, mConfigKey, this, nextPullTimeNs, mBucketSizeNs);
+}
+
 template <typename AggregatedValue, typename DimExtras>
 ValueMetricProducer<AggregatedValue, DimExtras>::~ValueMetricProducer() {
     VLOG("~ValueMetricProducer() called");
@@ -286,13 +310,49 @@ template <typename AggregatedValue, typename DimExtras>
 void ValueMetricProducer<AggregatedValue, DimExtras>::clearPastBucketsLocked(
         const int64_t dumpTimeNs) {
     mPastBuckets.clear();
+    mPastBucketAggregates.clear();
+    mPastBucketsByteSize = 0;
     mSkippedBuckets.clear();
+    mDimensionOverflowSketch.reset();
 }
 
 template <typename AggregatedValue, typename DimExtras>
 void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
         const int64_t dumpTimeNs, const bool includeCurrentPartialBucket, const bool eraseData,
-        const DumpLatency dumpLatency, set<string>* strSet, ProtoOutputStream* protoOutput) {
+        const DumpLatency dumpLatency, StringSet* strSet, ProtoOutputStream* protoOutput) {
+    DumpReportData data =
+            takeDumpReportDataLocked(dumpTimeNs, includeCurrentPartialBucket, dumpLatency);
+    writeDumpReportData(data, strSet, protoOutput);
+    if (!eraseData) {
+        mPastBuckets.swap(data.pastBuckets);
+        mPastBucketAggregates.swap(data.pastBucketAggregates);
+        mPastBucketsByteSize = data.pastBucketsByteSize;
+        mSkippedBuckets.swap(data.skippedBuckets);
+        if (data.dimensionOverflowSketch != nullptr) {
+            mDimensionOverflowSketch.swap(data.dimensionOverflowSketch);
+        }
+    }
+}
+
+template <typename AggregatedValue, typename DimExtras>
+unique_ptr<MetricProducer::DumpReportSnapshot>
+ValueMetricProducer<AggregatedValue, DimExtras>::takeDumpReportSnapshotLocked(
+        const int64_t dumpTimeNs, const bool includeCurrentPartialBucket, const bool eraseData,
+        const DumpLatency dumpLatency, const bool hashStrings) {
+    if (!eraseData) {
+        // The data stays in the producer, so it is encoded now rather than copied.
+        return MetricProducer::takeDumpReportSnapshotLocked(
+                dumpTimeNs, includeCurrentPartialBucket, eraseData, dumpLatency, hashStrings);
+    }
+    return std::make_unique<DetachedDumpReportSnapshot<ValueMetricProducer>>(
+            this, takeDumpReportDataLocked(dumpTimeNs, includeCurrentPartialBucket, dumpLatency));
+}
+
+template <typename AggregatedValue, typename DimExtras>
+typename ValueMetricProducer<AggregatedValue, DimExtras>::DumpReportData
+ValueMetricProducer<AggregatedValue, DimExtras>::takeDumpReportDataLocked(
+        const int64_t dumpTimeNs, const bool includeCurrentPartialBucket,
+        const DumpLatency dumpLatency) {
     VLOG("metric %lld dump report now...", (long long)mMetricId);
 
     // Pulled metrics need to pull before flushing, which is why they do not call flushIfNeeded.
@@ -318,15 +378,40 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
         flushCurrentBucketLocked(dumpTimeNs, dumpTimeNs);
     }
 
+    DumpReportData data;
+    data.isActive = isActiveLocked();
+    data.dimensionGuardrailHit = StatsdStats::getInstance().hasHitDimensionGuardrail(mMetricId);
+    data.dimensionDictionary = mDimensionDictionaryInReport;
+    // We only write the condition timer value if the metric has a
+    // condition and/or is sliced by state.
+    // If the metric is sliced by state, the condition timer value is
+    // also sliced by state to reflect time spent in that state.
+    data.hasConditionTimer = mConditionTrackerIndex >= 0 || !mSlicedStateAtoms.empty();
+    data.pastBuckets.swap(mPastBuckets);
+    data.pastBucketAggregates.swap(mPastBucketAggregates);
+    data.pastBucketsByteSize = mPastBucketsByteSize;
+    mPastBucketsByteSize = 0;
+    data.skippedBuckets.swap(mSkippedBuckets);
+    if (!data.pastBuckets.empty() || !data.skippedBuckets.empty()) {
+        // Only taken by reports that write it.
+        data.dimensionOverflowSketch.swap(mDimensionOverflowSketch);
+    }
+    return data;
+}
+
+template <typename AggregatedValue, typename DimExtras>
+void ValueMetricProducer<AggregatedValue, DimExtras>::writeDumpReportData(
+        const DumpReportData& data, StringSet* strSet, ProtoOutputStream* protoOutput) const {
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_ID, (long long)mMetricId);
-    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, isActiveLocked());
-    if (mPastBuckets.empty() && mSkippedBuckets.empty()) {
+    protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_IS_ACTIVE, data.isActive);
+    if (data.pastBuckets.empty() && data.skippedBuckets.empty()) {
         return;
     }
 
-    if (StatsdStats::getInstance().hasHitDimensionGuardrail(mMetricId)) {
+    if (data.dimensionGuardrailHit) {
         protoOutput->write(FIELD_TYPE_BOOL | FIELD_ID_DIMENSION_GUARDRAIL_HIT, true);
     }
+    writeDimensionOverflowSketch(data.dimensionOverflowSketch, strSet, protoOutput);
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_TIME_BASE, (long long)mTimeBaseNs);
     protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_BUCKET_SIZE, (long long)mBucketSizeNs);
     // Fills the dimension path if not slicing by a primitive repeated field or position ALL.
@@ -343,9 +428,15 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
                  conditionTrueNsFieldId,
                  conditionCorrectionNsFieldId] = getDumpProtoFields();
 
+    // Only set if the dimensions are written to the dictionary rather than to each data.
+    optional<DimensionDictionary> dimensionDictionary;
+    if (data.dimensionDictionary) {
+        dimensionDictionary.emplace(mShouldUseNestedDimensions);
+    }
+
     uint64_t protoToken = protoOutput->start(FIELD_TYPE_MESSAGE | metricTypeFieldId);
 
-    for (const auto& skippedBucket : mSkippedBuckets) {
+    for (const auto& skippedBucket : data.skippedBuckets) {
         uint64_t wrapperToken =
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_SKIPPED);
         protoOutput->write(FIELD_TYPE_INT64 | FIELD_ID_SKIPPED_START_MILLIS,
@@ -363,13 +454,17 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
         protoOutput->end(wrapperToken);
     }
 
-    for (const auto& [metricDimensionKey, buckets] : mPastBuckets) {
+    for (const auto& [metricDimensionKey, buckets] : data.pastBuckets) {
         VLOG("  dimension key %s", metricDimensionKey.toString().c_str());
         uint64_t wrapperToken =
                 protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_DATA);
 
         // First fill dimension.
-        if (mShouldUseNestedDimensions) {
+        if (dimensionDictionary) {
+            protoOutput->write(
+                    FIELD_TYPE_INT32 | FIELD_ID_DIMENSION_INDEX_IN_WHAT,
+                    dimensionDictionary->indexOf(metricDimensionKey.getDimensionKeyInWhat()));
+        } else if (mShouldUseNestedDimensions) {
             uint64_t dimensionToken =
                     protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_ID_DIMENSION_IN_WHAT);
             writeDimensionToProto(metricDimensionKey.getDimensionKeyInWhat(), strSet, protoOutput);
@@ -401,11 +496,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
                 protoOutput->write(FIELD_TYPE_INT64 | bucketNumFieldId,
                                    (long long)(getBucketNumFromEndTimeNs(bucket.mBucketEndNs)));
             }
-            // We only write the condition timer value if the metric has a
-            // condition and/or is sliced by state.
-            // If the metric is sliced by state, the condition timer value is
-            // also sliced by state to reflect time spent in that state.
-            if (mConditionTrackerIndex >= 0 || !mSlicedStateAtoms.empty()) {
+            if (data.hasConditionTimer) {
                 protoOutput->write(FIELD_TYPE_INT64 | conditionTrueNsFieldId,
                                    (long long)bucket.mConditionTrueNs);
             }
@@ -424,26 +515,30 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onDumpReportLocked(
                 }
             }
 
-            for (int i = 0; i < (int)bucket.aggIndex.size(); i++) {
+            const uint32_t aggregatesEnd = bucket.mAggregatesOffset + bucket.mAggregatesCount;
+            for (uint32_t i = bucket.mAggregatesOffset; i < aggregatesEnd; i++) {
                 VLOG("\t bucket [%lld - %lld]", (long long)bucket.mBucketStartNs,
                      (long long)bucket.mBucketEndNs);
-                int sampleSize = !bucket.sampleSizes.empty() ? bucket.sampleSizes[i] : 0;
-                writePastBucketAggregateToProto(bucket.aggIndex[i], bucket.aggregates[i],
+                const PastBucketAggregates<AggregatedValue>& aggregates =
+                        data.pastBucketAggregates;
+                int sampleSize = !aggregates.sampleSizes.empty() ? aggregates.sampleSizes[i] : 0;
+                writePastBucketAggregateToProto(aggregates.aggIndex[i], aggregates.aggregates[i],
                                                 sampleSize, protoOutput);
             }
             protoOutput->end(bucketInfoToken);
         }
         protoOutput->end(wrapperToken);
     }
+    writeDataWrapperFieldsToProto(data, protoOutput);
     protoOutput->end(protoToken);
+    if (dimensionDictionary) {
+        dimensionDictionary->writeToProto(strSet, protoOutput);
+    }
 
     VLOG("metric %lld done with dump report...", (long long)mMetricId);
-    if (eraseData) {
-        mPastBuckets.clear();
-        mSkippedBuckets.clear();
-    }
 }
 
+
 template <typename AggregatedValue, typename DimExtras>
 void ValueMetricProducer<AggregatedValue, DimExtras>::invalidateCurrentBucket(
         const int64_t dropTimeNs, const BucketDropReason reason) {
@@ -508,6 +603,14 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onActiveStateChangedLocked
     updateCurrentSlicedBucketConditionTimers(isActive, eventTimeNs);
 }
 
+template <typename AggregatedValue, typename DimExtras>
+void ValueMetricProducer<AggregatedValue, DimExtras>::hibernateLocked() {
+    // The buckets of metrics sliced by state keep the current state of every dimension.
+    if (mCurrentSlicedBucket.empty()) {
+        std::unordered_map<MetricDimensionKey, CurrentBucket>().swap(mCurrentSlicedBucket);
+    }
+}
+
 template <typename AggregatedValue, typename DimExtras>
 void ValueMetricProducer<AggregatedValue, DimExtras>::onConditionChangedLocked(
         const bool condition, const int64_t eventTimeNs) {
@@ -574,18 +677,62 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::updateCurrentSlicedBucketC
         return;
     }
 
-    // Utilize the current state key of each DimensionsInWhat key to determine
-    // which condition timers to update.
-    //
-    // Assumes that the MetricDimensionKey exists in `mCurrentSlicedBucket`.
-    for (const auto& [dimensionInWhatKey, dimensionInWhatInfo] : mDimInfos) {
+    if (mDimInfos.empty()) {
+        return;
+    }
+    mConditionTimerChanges.push_back({newCondition, eventTimeNs});
+}
+
+template <typename AggregatedValue, typename DimExtras>
+void ValueMetricProducer<AggregatedValue, DimExtras>::applyConditionTimerChangesLocked(
+        const HashableDimensionKey& dimensionInWhatKey,
+        DimensionsInWhatInfo& dimensionInWhatInfo) {
+    if (dimensionInWhatInfo.conditionTimerEpoch == mConditionTimerChanges.size()) {
+        return;
+    }
+    // Utilize the current state key of the DimensionsInWhat key to determine
+    // which condition timer to update. The state key has not changed since the
+    // changes were recorded, since it is only changed after applying them.
+    ConditionTimer& conditionTimer =
+            mCurrentSlicedBucket[MetricDimensionKey(dimensionInWhatKey,
+                                                    dimensionInWhatInfo.currentState)]
+                    .conditionTimer;
+    for (size_t i = dimensionInWhatInfo.conditionTimerEpoch; i < mConditionTimerChanges.size();
+         i++) {
         // If the new condition is true, turn ON the condition timer only if
         // the DimensionInWhat key was present in the data.
-        mCurrentSlicedBucket[MetricDimensionKey(dimensionInWhatKey,
-                                                dimensionInWhatInfo.currentState)]
-                .conditionTimer.onConditionChanged(
-                        newCondition && dimensionInWhatInfo.hasCurrentState, eventTimeNs);
+        const ConditionTimerChange& change = mConditionTimerChanges[i];
+        conditionTimer.onConditionChanged(change.condition && dimensionInWhatInfo.hasCurrentState,
+                                          change.timestampNs);
     }
+    dimensionInWhatInfo.conditionTimerEpoch = mConditionTimerChanges.size();
+}
+
+template <typename AggregatedValue, typename DimExtras>
+void ValueMetricProducer<AggregatedValue, DimExtras>::applyAllConditionTimerChangesLocked() {
+    if (mConditionTimerChanges.empty()) {
+        return;
+    }
+    for (auto& [dimensionInWhatKey, dimensionInWhatInfo] : mDimInfos) {
+        applyConditionTimerChangesLocked(dimensionInWhatKey, dimensionInWhatInfo);
+        dimensionInWhatInfo.conditionTimerEpoch = 0;
+    }
+    mConditionTimerChanges.clear();
+}
+
+// The heap memory of the aggregates, e.g. KLL sketches, is not included.
+template <typename AggregatedValue, typename DimExtras>
+size_t ValueMetricProducer<AggregatedValue, DimExtras>::currentStateByteSizeLocked() const {
+    size_t bytes = dimensionMapByteSize(mCurrentSlicedBucket, [](const CurrentBucket& bucket) {
+        return bucket.intervals.capacity() * sizeof(Interval);
+    });
+    return bytes + dimensionMapByteSize(mDimInfos, [](const DimensionsInWhatInfo& info) {
+               size_t bytes = info.currentState.heapByteSize();
+               if constexpr (!std::is_same_v<DimExtras, Empty>) {
+                   bytes += info.dimExtras.capacity() * sizeof(typename DimExtras::value_type);
+               }
+               return bytes;
+           });
 }
 
 template <typename AggregatedValue, typename DimExtras>
@@ -611,7 +758,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::dumpStatesLocked(int out,
 
 template <typename AggregatedValue, typename DimExtras>
 bool ValueMetricProducer<AggregatedValue, DimExtras>::hasReachedGuardRailLimit() const {
-    return mCurrentSlicedBucket.size() >= mDimensionHardLimit;
+    return mCurrentSlicedBucket.size() >= getDimensionHardLimitLocked(mDimensionHardLimit);
 }
 
 template <typename AggregatedValue, typename DimExtras>
@@ -675,11 +822,18 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::onMatchedLogEventInternalL
     }
 
     if (hitGuardRailLocked(eventKey)) {
+        noteDimensionOverflowLocked(eventKey);
         return;
     }
 
     const auto& returnVal = mDimInfos.emplace(whatKey, DimensionsInWhatInfo(getUnknownStateKey()));
     DimensionsInWhatInfo& dimensionsInWhatInfo = returnVal.first->second;
+    if (returnVal.second) {
+        // The recorded condition changes predate the key.
+        dimensionsInWhatInfo.conditionTimerEpoch = mConditionTimerChanges.size();
+    } else {
+        applyConditionTimerChangesLocked(whatKey, dimensionsInWhatInfo);
+    }
     const HashableDimensionKey& oldStateKey = dimensionsInWhatInfo.currentState;
     CurrentBucket& currentBucket = mCurrentSlicedBucket[MetricDimensionKey(whatKey, oldStateKey)];
 
@@ -743,6 +897,8 @@ int64_t ValueMetricProducer<AggregatedValue, DimExtras>::calcBucketsForwardCount
 template <typename AggregatedValue, typename DimExtras>
 void ValueMetricProducer<AggregatedValue, DimExtras>::flushCurrentBucketLocked(
         const int64_t eventTimeNs, const int64_t nextBucketStartTimeNs) {
+    STATSD_TRACE("MetricProducer::flushCurrentBucket config=%d:%lld metric=%lld",
+                 mConfigKey.GetUid(), (long long)mConfigKey.GetId(), (long long)mMetricId);
     if (mCondition == ConditionState::kUnknown) {
         StatsdStats::getInstance().noteBucketUnknownCondition(mMetricId);
         invalidateCurrentBucket(eventTimeNs, BucketDropReason::CONDITION_UNKNOWN);
@@ -751,6 +907,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::flushCurrentBucketLocked(
     VLOG("finalizing bucket for %ld, dumping %d slices", (long)mCurrentBucketStartTimeNs,
          (int)mCurrentSlicedBucket.size());
 
+    noteBucketDimensionCountLocked(mCurrentSlicedBucket.size());
     closeCurrentBucket(eventTimeNs, nextBucketStartTimeNs);
     initNextSlicedBucket(nextBucketStartTimeNs);
 
@@ -787,6 +944,8 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::closeCurrentBucket(
         bucketEndTimeNs = eventTimeNs;
     }
 
+    applyAllConditionTimerChangesLocked();
+
     // Close the current bucket
     const auto [globalConditionDurationNs, globalConditionCorrectionNs] =
             mConditionTimer.newBucketStart(eventTimeNs, bucketEndTimeNs);
@@ -801,7 +960,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::closeCurrentBucket(
         for (auto& [metricDimensionKey, currentBucket] : mCurrentSlicedBucket) {
             PastBucket<AggregatedValue> bucket =
                     buildPartialBucket(bucketEndTimeNs, currentBucket.intervals);
-            if (bucket.aggIndex.empty()) {
+            if (bucket.mAggregatesCount == 0) {
                 continue;
             }
             bucketHasData = true;
@@ -817,6 +976,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::closeCurrentBucket(
 
             auto& bucketList = mPastBuckets[metricDimensionKey];
             bucketList.push_back(std::move(bucket));
+            mPastBucketsByteSize += kBucketSize;
         }
         if (!bucketHasData) {
             skipCurrentBucket(eventTimeNs, BucketDropReason::NO_DATA);
@@ -893,6 +1053,7 @@ void ValueMetricProducer<AggregatedValue, DimExtras>::initNextSlicedBucket(
 // Explicit template instantiations
 template class ValueMetricProducer<Value, vector<optional<Value>>>;
 template class ValueMetricProducer<unique_ptr<KllQuantile>, Empty>;
+template class ValueMetricProducer<HistogramValue, Empty>;
 
 }  // namespace statsd
 }  // namespace os
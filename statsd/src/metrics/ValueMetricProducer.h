@@ -19,6 +19,7 @@
 #include <gtest/gtest_prod.h>
 
 #include <optional>
+#include <unordered_set>
 
 #include "FieldValue.h"
 #include "HashableDimensionKey.h"
@@ -40,9 +41,11 @@ template <typename AggregatedValue>
 struct PastBucket {
     int64_t mBucketStartNs;
     int64_t mBucketEndNs;
-    std::vector<int> aggIndex;
-    std::vector<AggregatedValue> aggregates;
-    std::vector<int> sampleSizes;
+
+    // The aggregates of this bucket are [mAggregatesOffset, mAggregatesOffset + mAggregatesCount)
+    // of the metric's PastBucketAggregates.
+    uint32_t mAggregatesOffset;
+    uint32_t mAggregatesCount;
 
     /**
      * If the metric has no condition, then this field is just wasted.
@@ -58,6 +61,33 @@ struct PastBucket {
     int64_t mConditionCorrectionNs;
 };
 
+// The aggregates of all past buckets of a metric, stored column by column, so that closing a
+// bucket appends to a few contiguous arrays instead of allocating vectors for every bucket.
+template <typename AggregatedValue>
+struct PastBucketAggregates {
+    std::vector<int> aggIndex;
+    std::vector<AggregatedValue> aggregates;
+    // Either empty, if the metric does not report sample sizes, or parallel to aggregates.
+    std::vector<int> sampleSizes;
+
+    uint32_t size() const {
+        return aggregates.size();
+    }
+
+    // Releases the memory of all columns at once.
+    void clear() {
+        aggIndex = std::vector<int>();
+        aggregates = std::vector<AggregatedValue>();
+        sampleSizes = std::vector<int>();
+    }
+
+    void swap(PastBucketAggregates& that) {
+        aggIndex.swap(that.aggIndex);
+        aggregates.swap(that.aggregates);
+        sampleSizes.swap(that.sampleSizes);
+    }
+};
+
 // Aggregates values within buckets.
 //
 // There are different events that might complete a bucket
@@ -70,6 +100,8 @@ public:
     struct PullOptions {
         const int pullAtomId;
         const sp<StatsPullerManager>& pullerManager;
+        // Leaves the registration for scheduled pulls to registerPullReceiver().
+        const bool deferRegistration = false;
     };
 
     struct BucketOptions {
@@ -126,12 +158,23 @@ public:
         return false;
     }
 
+    void registerPullReceiver() override;
+
     // ValueMetric needs special logic if it's a pulled atom.
     void onStatsdInitCompleted(int64_t eventTimeNs) override;
 
     void onStateChanged(int64_t eventTimeNs, int32_t atomId, const HashableDimensionKey& primaryKey,
                         const FieldValue& oldState, const FieldValue& newState) override;
 
+    // Pulled metrics pull on state changes, and all of them flush on them.
+    bool needsStateChangeNotifications() const override {
+        return true;
+    }
+
+    int getPullAtomId() const override {
+        return mPullAtomId;
+    }
+
 protected:
     ValueMetricProducer(int64_t metricId, const ConfigKey& key, uint64_t protoHash,
                         const PullOptions& pullOptions, const BucketOptions& bucketOptions,
@@ -154,9 +197,38 @@ protected:
 
     void onDumpReportLocked(const int64_t dumpTimeNs, const bool includeCurrentPartialBucket,
                             const bool eraseData, const DumpLatency dumpLatency,
-                            std::set<string>* strSet,
+                            StringSet* strSet,
                             android::util::ProtoOutputStream* protoOutput) override;
 
+    std::unique_ptr<DumpReportSnapshot> takeDumpReportSnapshotLocked(
+            const int64_t dumpTimeNs, const bool includeCurrentPartialBucket, const bool eraseData,
+            const DumpLatency dumpLatency, const bool hashStrings) override;
+
+    // The state a dump report is written from, other than the members fixed at construction.
+    struct DumpReportData {
+        bool isActive = false;
+        bool dimensionGuardrailHit = false;
+        bool dimensionDictionary = false;
+        bool hasConditionTimer = false;
+        std::unordered_map<MetricDimensionKey, std::vector<PastBucket<AggregatedValue>>>
+                pastBuckets;
+        PastBucketAggregates<AggregatedValue> pastBucketAggregates;
+        size_t pastBucketsByteSize = 0;
+        std::vector<SkippedBucket> skippedBuckets;
+        std::shared_ptr<DimensionOverflowSketch> dimensionOverflowSketch;
+    };
+
+    // Pulls or invalidates the current bucket as needed and flushes, then swaps the past and
+    // skipped buckets out into the returned data.
+    DumpReportData takeDumpReportDataLocked(const int64_t dumpTimeNs,
+                                            const bool includeCurrentPartialBucket,
+                                            const DumpLatency dumpLatency);
+
+    void writeDumpReportData(const DumpReportData& data, StringSet* strSet,
+                             android::util::ProtoOutputStream* protoOutput) const;
+
+    friend class DetachedDumpReportSnapshot<ValueMetricProducer>;
+
     struct DumpProtoFields {
         const int metricTypeFieldId;
         const int bucketNumFieldId;
@@ -173,6 +245,8 @@ protected:
     // ValueMetricProducer internal interface to handle active state change.
     void onActiveStateChangedLocked(const int64_t eventTimeNs, const bool isActive) override;
 
+    void hibernateLocked() override;
+
     virtual void onActiveStateChangedInternalLocked(const int64_t eventTimeNs,
                                                     const bool isActive) {
     }
@@ -191,12 +265,18 @@ protected:
 
     void dumpStatesLocked(int out, bool verbose) const override;
 
+    size_t currentStateByteSizeLocked() const override;
+
     virtual std::string aggregatedValueToString(const AggregatedValue& aggregate) const = 0;
 
     // For pulled metrics, this method should only be called if a pull has been done. Else we will
     // not have complete data for the bucket.
     void flushIfNeededLocked(int64_t eventTime) override;
 
+    size_t getOwnDimensionHardLimitLocked() const override {
+        return mDimensionHardLimit;
+    }
+
     // For pulled metrics, this method should only be called if a pulled has been done. Else we will
     // not have complete data for the bucket.
     void flushCurrentBucketLocked(int64_t eventTimeNs, int64_t nextBucketStartTimeNs) override;
@@ -248,8 +328,8 @@ protected:
     // Value fields for matching.
     const std::vector<Matcher> mFieldMatchers;
 
-    // Value fields for matching.
-    std::set<HashableDimensionKey> mMatchedMetricDimensionKeys;
+    // The dimensions in what matched by the pull being processed. Only used for pulled metrics.
+    std::unordered_set<HashableDimensionKey> mMatchedMetricDimensionKeys;
 
     // Holds the atom id, primary key pair from a state change.
     // Only used for pulled metrics.
@@ -259,6 +339,9 @@ protected:
     // Atom Id for pulled data. -1 if this is not pulled.
     const int mPullAtomId;
 
+    // Whether the registration for scheduled pulls waits for registerPullReceiver().
+    bool mPullRegistrationDeferred = false;
+
     // Tracks the value information of one value field.
     struct Interval {
         // Index in multi value aggregation.
@@ -308,14 +391,35 @@ protected:
         HashableDimensionKey currentState;
         // Whether this dimensions in what key has a current state key.
         bool hasCurrentState;
+        // The number of mConditionTimerChanges applied to the condition timer of the current
+        // state key.
+        size_t conditionTimerEpoch = 0;
     };
 
     // Tracks current state key and other information for each DimensionsInWhat key.
     std::unordered_map<HashableDimensionKey, DimensionsInWhatInfo> mDimInfos;
 
+    struct ConditionTimerChange {
+        bool condition;
+        int64_t timestampNs;
+    };
+
+    // The condition changes since the condition timers of all DimensionsInWhat keys were last
+    // updated, when slicing by state. A condition change is recorded in constant time instead of
+    // updating the timer of every key.
+    std::vector<ConditionTimerChange> mConditionTimerChanges;
+
     // Save the past buckets and we can clear when the StatsLogReport is dumped.
     std::unordered_map<MetricDimensionKey, std::vector<PastBucket<AggregatedValue>>> mPastBuckets;
 
+    // The aggregates that the past buckets refer to.
+    PastBucketAggregates<AggregatedValue> mPastBucketAggregates;
+
+    // The bytes used by mPastBuckets and mPastBucketAggregates, kept up to date as buckets are
+    // added and cleared so that byteSizeLocked() does not iterate them. Subclasses add the size
+    // of the aggregates they append in buildPartialBucket.
+    size_t mPastBucketsByteSize = 0;
+
     const int64_t mMinBucketSizeNs;
 
     // Util function to check whether the specified dimension hits the guardrail.
@@ -328,6 +432,8 @@ protected:
 
     virtual bool multipleBucketsSkipped(const int64_t numBucketsForward) const = 0;
 
+    // Appends the aggregates of intervals to mPastBucketAggregates, and returns the bucket that
+    // refers to them.
     virtual PastBucket<AggregatedValue> buildPartialBucket(int64_t bucketEndTime,
                                                            std::vector<Interval>& intervals) = 0;
 
@@ -336,14 +442,30 @@ protected:
     virtual void initNextSlicedBucket(int64_t nextBucketStartTimeNs);
 
     // Updates the condition timers in the current sliced bucket when there is a
-    // condition change or an active state change.
+    // condition change or an active state change. The change is only recorded, it is applied to
+    // the timer of each DimensionsInWhat key when that key's timers are next used.
     void updateCurrentSlicedBucketConditionTimers(bool newCondition, int64_t eventTimeNs);
 
+    // Applies the recorded condition changes to the condition timer of the current state key of
+    // one DimensionsInWhat key.
+    void applyConditionTimerChangesLocked(const HashableDimensionKey& dimensionInWhatKey,
+                                          DimensionsInWhatInfo& dimensionInWhatInfo);
+
+    // Applies the recorded condition changes to the condition timers of all DimensionsInWhat keys
+    // and clears them. Called before the condition timers are read or the keys are removed.
+    void applyAllConditionTimerChangesLocked();
+
     virtual void writePastBucketAggregateToProto(const int aggIndex,
                                                  const AggregatedValue& aggregate,
                                                  const int sampleSize,
                                                  ProtoOutputStream* const protoOutput) const = 0;
 
+    // Writes the fields of the metric type's data wrapper that all of the data share. Nothing by
+    // default.
+    virtual void writeDataWrapperFieldsToProto(const DumpReportData& data,
+                                               ProtoOutputStream* const protoOutput) const {
+    }
+
     static const size_t kBucketSize = sizeof(PastBucket<AggregatedValue>{});
 
     const size_t mDimensionSoftLimit;
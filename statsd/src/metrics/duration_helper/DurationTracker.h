@@ -95,6 +95,20 @@ public:
 
     virtual ~DurationTracker(){};
 
+    // Prepares a tracker that its owner stopped using to track eventKey from the given bucket.
+    // The maps of the tracker are cleared but keep their capacity, so reusing a tracker does not
+    // allocate. The other arguments must be the ones the tracker was constructed with.
+    void reset(const MetricDimensionKey& eventKey, int64_t currentBucketStartNs,
+               int64_t currentBucketNum, const std::vector<sp<AnomalyTracker>>& anomalyTrackers) {
+        mEventKey = eventKey;
+        mCurrentBucketStartTimeNs = currentBucketStartNs;
+        mCurrentBucketNum = currentBucketNum;
+        mStateKeyDurationMap.clear();
+        mAnomalyTrackers = anomalyTrackers;
+        mHasHitGuardrail = false;
+        clearDurations();
+    }
+
     void onConfigUpdated(const sp<ConditionWizard>& wizard, int conditionTrackerIndex) {
         sp<ConditionWizard> tmpWizard = mWizard;
         mWizard = wizard;
@@ -142,6 +156,16 @@ public:
 
     virtual bool hasAccumulatedDuration() const = 0;
 
+    // Returns the bytes of memory used by the tracker, including the heap memory of its maps.
+    size_t byteSize() const {
+        return trackerByteSize() + mEventKey.heapByteSize() +
+               dimensionMapByteSize(mStateKeyDurationMap);
+    }
+
+    int64_t getCurrentBucketNum() const {
+        return mCurrentBucketNum;
+    }
+
     void addAnomalyTracker(sp<AnomalyTracker>& anomalyTracker, const UpdateStatus& updateStatus,
                            const int64_t updateTimeNs) {
         mAnomalyTrackers.push_back(anomalyTracker);
@@ -162,6 +186,22 @@ public:
 protected:
     virtual bool hasStartedDuration() const = 0;
 
+    // Drops the durations of the subclass, for reset().
+    virtual void clearDurations() = 0;
+
+    // The bytes of the subclass object and the heap memory of its own maps, for byteSize().
+    virtual size_t trackerByteSize() const = 0;
+
+    // std::map allocates one node per entry, which holds the entry, three pointers and a color.
+    static size_t conditionKeyByteSize(const ConditionKey& conditionKey) {
+        size_t bytes = conditionKey.size() *
+                       (sizeof(ConditionKey::value_type) + 3 * sizeof(void*) + sizeof(int));
+        for (const auto& [_, key] : conditionKey) {
+            bytes += key.heapByteSize();
+        }
+        return bytes;
+    }
+
     int64_t getCurrentBucketEndTimeNs() const {
         return mStartTimeNs + (mCurrentBucketNum + 1) * mBucketSizeNs;
     }
@@ -260,7 +300,7 @@ protected:
     int64_t mCurrentBucketStartTimeNs;
 
     // Recorded duration results for each state key in the current partial bucket.
-    std::unordered_map<HashableDimensionKey, DurationValues> mStateKeyDurationMap;
+    FlatHashMap<HashableDimensionKey, DurationValues> mStateKeyDurationMap;
 
     int64_t mCurrentBucketNum;
 
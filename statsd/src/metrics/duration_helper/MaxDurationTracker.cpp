@@ -90,6 +90,7 @@ void MaxDurationTracker::noteStart(const HashableDimensionKey& key, bool conditi
             } else {
                 duration.state = DurationState::kStarted;
                 duration.lastStartTime = eventTime;
+                addStartedDuration(duration);
                 startAnomalyAlarm(eventTime);
             }
             duration.startCount = 1;
@@ -114,6 +115,7 @@ void MaxDurationTracker::noteStop(const HashableDimensionKey& key, const int64_t
             duration.startCount--;
             if (forceStop || !mNested || duration.startCount <= 0) {
                 stopAnomalyAlarm(eventTime);
+                removeStartedDuration(duration);
                 duration.state = DurationState::kStopped;
                 int64_t durationTime = eventTime - duration.lastStartTime;
                 VLOG("Max, key %s, Stop %lld %lld %lld", key.toString().c_str(),
@@ -150,12 +152,18 @@ void MaxDurationTracker::noteStop(const HashableDimensionKey& key, const int64_t
 }
 
 bool MaxDurationTracker::hasStartedDuration() const {
-    for (auto& pair : mInfos) {
-        if (pair.second.state == kStarted) {
-            return true;
-        }
+    return !mStartedDurationOffsets.empty();
+}
+
+void MaxDurationTracker::addStartedDuration(const DurationInfo& duration) {
+    mStartedDurationOffsets.insert(duration.lastDuration - duration.lastStartTime);
+}
+
+void MaxDurationTracker::removeStartedDuration(const DurationInfo& duration) {
+    auto it = mStartedDurationOffsets.find(duration.lastDuration - duration.lastStartTime);
+    if (it != mStartedDurationOffsets.end()) {
+        mStartedDurationOffsets.erase(it);
     }
-    return false;
 }
 
 bool MaxDurationTracker::hasAccumulatedDuration() const {
@@ -164,6 +172,18 @@ bool MaxDurationTracker::hasAccumulatedDuration() const {
     return !mInfos.empty() || mDuration != 0;
 }
 
+void MaxDurationTracker::clearDurations() {
+    mInfos.clear();
+    mStartedDurationOffsets.clear();
+    mDuration = 0;
+}
+
+size_t MaxDurationTracker::trackerByteSize() const {
+    return sizeof(*this) + dimensionMapByteSize(mInfos, [](const DurationInfo& info) {
+               return conditionKeyByteSize(info.conditionKeys);
+           }) + mStartedDurationOffsets.size() * sizeof(int64_t);
+}
+
 void MaxDurationTracker::noteStopAll(const int64_t eventTime) {
     std::set<HashableDimensionKey> keys;
     for (const auto& pair : mInfos) {
@@ -281,6 +301,7 @@ void MaxDurationTracker::noteConditionChanged(const HashableDimensionKey& key, b
             // stop anomaly alarm.
             if (!conditionMet) {
                 stopAnomalyAlarm(timestamp);
+                removeStartedDuration(it->second);
                 it->second.state = DurationState::kPaused;
                 it->second.lastDuration += (timestamp - it->second.lastStartTime);
                 if (hasStartedDuration()) {
@@ -299,6 +320,7 @@ void MaxDurationTracker::noteConditionChanged(const HashableDimensionKey& key, b
             if (conditionMet) {
                 it->second.state = DurationState::kStarted;
                 it->second.lastStartTime = timestamp;
+                addStartedDuration(it->second);
                 startAnomalyAlarm(timestamp);
                 VLOG("MaxDurationTracker Key: %s Paused->Started", key.toString().c_str());
             }
@@ -312,14 +334,8 @@ int64_t MaxDurationTracker::predictAnomalyTimestampNs(const AnomalyTracker& anom
     // The allowed time we can continue in the current state is the
     // (anomaly threshold) - max(elapsed time of the started mInfos).
     int64_t maxElapsed = 0;
-    for (auto it = mInfos.begin(); it != mInfos.end(); ++it) {
-        if (it->second.state == DurationState::kStarted) {
-            int64_t duration =
-                    it->second.lastDuration + (currentTimestamp - it->second.lastStartTime);
-            if (duration > maxElapsed) {
-                maxElapsed = duration;
-            }
-        }
+    if (!mStartedDurationOffsets.empty()) {
+        maxElapsed = std::max<int64_t>(0, *mStartedDurationOffsets.rbegin() + currentTimestamp);
     }
     int64_t anomalyTimeNs = currentTimestamp + anomalyTracker.getAnomalyThreshold() - maxElapsed;
     int64_t refractoryEndNs = anomalyTracker.getRefractoryPeriodEndsSec(mEventKey) * NS_PER_SEC;
@@ -17,6 +17,8 @@
 #ifndef MAX_DURATION_TRACKER_H
 #define MAX_DURATION_TRACKER_H
 
+#include <set>
+
 #include "DurationTracker.h"
 
 namespace android {
@@ -26,7 +28,7 @@ namespace statsd {
 // Tracks a pool of atom durations, and output the max duration for each bucket.
 // To get max duration, we need to keep track of each individual durations, and compare them when
 // they stop or bucket expires.
-class MaxDurationTracker : public DurationTracker {
+class MaxDurationTracker final : public DurationTracker {
 public:
     MaxDurationTracker(const ConfigKey& key, const int64_t id, const MetricDimensionKey& eventKey,
                        const sp<ConditionWizard>& wizard, int conditionIndex, bool nesting,
@@ -71,11 +73,24 @@ protected:
     // Returns true if at least one of the mInfos is started.
     bool hasStartedDuration() const override;
 
+    void clearDurations() override;
+
+    size_t trackerByteSize() const override;
+
 private:
-    std::unordered_map<HashableDimensionKey, DurationInfo> mInfos;
+    FlatHashMap<HashableDimensionKey, DurationInfo> mInfos;
 
     int64_t mDuration;  // current recorded duration result (for partial bucket)
 
+    // (lastDuration - lastStartTime) of every kStarted entry of mInfos. The largest one is the
+    // entry with the longest elapsed duration at any timestamp, so it is found without iterating
+    // mInfos.
+    std::multiset<int64_t> mStartedDurationOffsets;
+
+    // Must be called after an entry of mInfos becomes kStarted, and before one leaves kStarted.
+    void addStartedDuration(const DurationInfo& duration);
+    void removeStartedDuration(const DurationInfo& duration);
+
     void noteConditionChanged(const HashableDimensionKey& key, bool conditionMet,
                               const int64_t timestamp);
 
@@ -88,6 +103,7 @@ private:
     FRIEND_TEST(MaxDurationTrackerTest, TestStopAll);
     FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyDetection);
     FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp);
+    FRIEND_TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp_UpdatedOnConditionChange);
     FRIEND_TEST(MaxDurationTrackerTest, TestUploadThreshold);
     FRIEND_TEST(MaxDurationTrackerTest, TestNoAccumulatingDuration);
 };
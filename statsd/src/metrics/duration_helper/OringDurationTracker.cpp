@@ -375,6 +375,18 @@ bool OringDurationTracker::hasStartedDuration() const {
     return !mStarted.empty();
 }
 
+void OringDurationTracker::clearDurations() {
+    mStarted.clear();
+    mPaused.clear();
+    mConditionKeyMap.clear();
+    mLastStartTime = 0;
+}
+
+size_t OringDurationTracker::trackerByteSize() const {
+    return sizeof(*this) + dimensionMapByteSize(mStarted) + dimensionMapByteSize(mPaused) +
+           dimensionMapByteSize(mConditionKeyMap, conditionKeyByteSize);
+}
+
 int64_t OringDurationTracker::predictAnomalyTimestampNs(const AnomalyTracker& anomalyTracker,
                                                         const int64_t eventTimestampNs) const {
     // The anomaly threshold.
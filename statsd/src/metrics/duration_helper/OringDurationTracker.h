@@ -24,7 +24,7 @@ namespace os {
 namespace statsd {
 
 // Tracks the "Or'd" duration -- if 2 durations are overlapping, they won't be double counted.
-class OringDurationTracker : public DurationTracker {
+class OringDurationTracker final : public DurationTracker {
 public:
     OringDurationTracker(const ConfigKey& key, const int64_t id, const MetricDimensionKey& eventKey,
                          const sp<ConditionWizard>& wizard, int conditionIndex, bool nesting,
@@ -69,16 +69,20 @@ protected:
     // Returns true if at least one of the mInfos is started.
     bool hasStartedDuration() const override;
 
+    void clearDurations() override;
+
+    size_t trackerByteSize() const override;
+
 private:
     // We don't need to keep track of individual durations. The information that's needed is:
     // 1) which keys are started. We record the first start time.
     // 2) which keys are paused (started but condition was false)
     // 3) whenever a key stops, we remove it from the started set. And if the set becomes empty,
     //    it means everything has stopped, we then record the end time.
-    std::unordered_map<HashableDimensionKey, int> mStarted;
-    std::unordered_map<HashableDimensionKey, int> mPaused;
+    FlatHashMap<HashableDimensionKey, int> mStarted;
+    FlatHashMap<HashableDimensionKey, int> mPaused;
     int64_t mLastStartTime;
-    std::unordered_map<HashableDimensionKey, ConditionKey> mConditionKeyMap;
+    FlatHashMap<HashableDimensionKey, ConditionKey> mConditionKeyMap;
 
     // return true if we should not allow newKey to be tracked because we are above the threshold
     bool hitGuardRail(const HashableDimensionKey& newKey, size_t dimensionHardLimit) const;
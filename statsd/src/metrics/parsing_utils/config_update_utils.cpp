@@ -19,6 +19,9 @@
 
 #include "config_update_utils.h"
 
+#include <algorithm>
+
+#include "condition/SimpleConditionTracker.h"
 #include "external/StatsPullerManager.h"
 #include "hash.h"
 #include "matchers/EventMatcherWizard.h"
@@ -30,10 +33,59 @@ namespace android {
 namespace os {
 namespace statsd {
 
+namespace {
+
+// Hashes every matcher of the config in a single pass, in config order.
+optional<InvalidConfigReason> computeMatcherProtoHashes(const StatsdConfig& config,
+                                                        vector<uint64_t>& protoHashes) {
+    protoHashes.resize(config.atom_matcher_size());
+    for (int i = 0; i < config.atom_matcher_size(); i++) {
+        optional<InvalidConfigReason> invalidConfigReason =
+                getAtomMatcherProtoHash(config.atom_matcher(i), protoHashes[i]);
+        if (invalidConfigReason.has_value()) {
+            return invalidConfigReason;
+        }
+    }
+    return nullopt;
+}
+
+// Hashes every predicate of the config in a single pass, in config order.
+optional<InvalidConfigReason> computePredicateProtoHashes(const StatsdConfig& config,
+                                                          vector<uint64_t>& protoHashes) {
+    protoHashes.resize(config.predicate_size());
+    for (int i = 0; i < config.predicate_size(); i++) {
+        optional<InvalidConfigReason> invalidConfigReason =
+                getPredicateProtoHash(config.predicate(i), protoHashes[i]);
+        if (invalidConfigReason.has_value()) {
+            return invalidConfigReason;
+        }
+    }
+    return nullopt;
+}
+
+}  // namespace
+
+optional<InvalidConfigReason> determineMatcherUpdateStatus(
+        const StatsdConfig& config, const int matcherIdx,
+        const unordered_map<int64_t, int>& oldAtomMatchingTrackerMap,
+        const vector<sp<AtomMatchingTracker>>& oldAtomMatchingTrackers,
+        const unordered_map<int64_t, int>& newAtomMatchingTrackerMap,
+        vector<UpdateStatus>& matchersToUpdate, vector<uint8_t>& cycleTracker) {
+    vector<uint64_t> newProtoHashes;
+    optional<InvalidConfigReason> invalidConfigReason =
+            computeMatcherProtoHashes(config, newProtoHashes);
+    if (invalidConfigReason.has_value()) {
+        return invalidConfigReason;
+    }
+    return determineMatcherUpdateStatus(config, matcherIdx, newProtoHashes,
+                                        oldAtomMatchingTrackerMap, oldAtomMatchingTrackers,
+                                        newAtomMatchingTrackerMap, matchersToUpdate, cycleTracker);
+}
+
 // Recursive function to determine if a matcher needs to be updated. Populates matcherToUpdate.
 // Returns nullopt if successful and InvalidConfigReason if not.
 optional<InvalidConfigReason> determineMatcherUpdateStatus(
-        const StatsdConfig& config, const int matcherIdx,
+        const StatsdConfig& config, const int matcherIdx, const vector<uint64_t>& newProtoHashes,
         const unordered_map<int64_t, int>& oldAtomMatchingTrackerMap,
         const vector<sp<AtomMatchingTracker>>& oldAtomMatchingTrackers,
         const unordered_map<int64_t, int>& newAtomMatchingTrackerMap,
@@ -53,14 +105,8 @@ optional<InvalidConfigReason> determineMatcherUpdateStatus(
     }
 
     // This is an existing matcher. Check if it has changed.
-    string serializedMatcher;
-    if (!matcher.SerializeToString(&serializedMatcher)) {
-        ALOGE("Unable to serialize matcher %lld", (long long)id);
-        return createInvalidConfigReasonWithMatcher(
-                INVALID_CONFIG_REASON_MATCHER_SERIALIZATION_FAILED, id);
-    }
-    uint64_t newProtoHash = Hash64(serializedMatcher);
-    if (newProtoHash != oldAtomMatchingTrackers[oldAtomMatchingTrackerIt->second]->getProtoHash()) {
+    if (newProtoHashes[matcherIdx] !=
+        oldAtomMatchingTrackers[oldAtomMatchingTrackerIt->second]->getProtoHash()) {
         matchersToUpdate[matcherIdx] = UPDATE_REPLACE;
         return nullopt;
     }
@@ -93,8 +139,9 @@ optional<InvalidConfigReason> determineMatcherUpdateStatus(
                     return invalidConfigReason;
                 }
                 invalidConfigReason = determineMatcherUpdateStatus(
-                        config, childIdx, oldAtomMatchingTrackerMap, oldAtomMatchingTrackers,
-                        newAtomMatchingTrackerMap, matchersToUpdate, cycleTracker);
+                        config, childIdx, newProtoHashes, oldAtomMatchingTrackerMap,
+                        oldAtomMatchingTrackers, newAtomMatchingTrackerMap, matchersToUpdate,
+                        cycleTracker);
                 if (invalidConfigReason.has_value()) {
                     invalidConfigReason->matcherIds.push_back(id);
                     return invalidConfigReason;
@@ -143,12 +190,19 @@ optional<InvalidConfigReason> updateAtomMatchingTrackers(
         matcherProtos.push_back(matcher);
     }
 
+    // Each matcher is hashed once, for both the comparison and the tracker that replaces it.
+    vector<uint64_t> newProtoHashes;
+    invalidConfigReason = computeMatcherProtoHashes(config, newProtoHashes);
+    if (invalidConfigReason.has_value()) {
+        return invalidConfigReason;
+    }
+
     // For combination matchers, we need to determine if any children need to be updated.
     vector<UpdateStatus> matchersToUpdate(atomMatcherCount, UPDATE_UNKNOWN);
     vector<uint8_t> cycleTracker(atomMatcherCount, false);
     for (int i = 0; i < atomMatcherCount; i++) {
         invalidConfigReason = determineMatcherUpdateStatus(
-                config, i, oldAtomMatchingTrackerMap, oldAtomMatchingTrackers,
+                config, i, newProtoHashes, oldAtomMatchingTrackerMap, oldAtomMatchingTrackers,
                 newAtomMatchingTrackerMap, matchersToUpdate, cycleTracker);
         if (invalidConfigReason.has_value()) {
             return invalidConfigReason;
@@ -183,8 +237,8 @@ optional<InvalidConfigReason> updateAtomMatchingTrackers(
                 replacedMatchers.insert(id);
                 [[fallthrough]];  // Intentionally fallthrough to create the new matcher.
             case UPDATE_NEW: {
-                sp<AtomMatchingTracker> tracker =
-                        createAtomMatchingTracker(matcher, uidMap, invalidConfigReason);
+                sp<AtomMatchingTracker> tracker = createAtomMatchingTracker(
+                        matcher, newProtoHashes[i], uidMap, invalidConfigReason);
                 if (tracker == nullptr) {
                     return invalidConfigReason;
                 }
@@ -231,10 +285,29 @@ optional<InvalidConfigReason> updateAtomMatchingTrackers(
     return nullopt;
 }
 
+optional<InvalidConfigReason> determineConditionUpdateStatus(
+        const StatsdConfig& config, const int conditionIdx,
+        const unordered_map<int64_t, int>& oldConditionTrackerMap,
+        const vector<sp<ConditionTracker>>& oldConditionTrackers,
+        const unordered_map<int64_t, int>& newConditionTrackerMap,
+        const set<int64_t>& replacedMatchers, vector<UpdateStatus>& conditionsToUpdate,
+        vector<uint8_t>& cycleTracker) {
+    vector<uint64_t> newProtoHashes;
+    optional<InvalidConfigReason> invalidConfigReason =
+            computePredicateProtoHashes(config, newProtoHashes);
+    if (invalidConfigReason.has_value()) {
+        return invalidConfigReason;
+    }
+    return determineConditionUpdateStatus(config, conditionIdx, newProtoHashes,
+                                          oldConditionTrackerMap, oldConditionTrackers,
+                                          newConditionTrackerMap, replacedMatchers,
+                                          conditionsToUpdate, cycleTracker);
+}
+
 // Recursive function to determine if a condition needs to be updated. Populates conditionsToUpdate.
 // Returns nullopt if successful and InvalidConfigReason if not.
 optional<InvalidConfigReason> determineConditionUpdateStatus(
-        const StatsdConfig& config, const int conditionIdx,
+        const StatsdConfig& config, const int conditionIdx, const vector<uint64_t>& newProtoHashes,
         const unordered_map<int64_t, int>& oldConditionTrackerMap,
         const vector<sp<ConditionTracker>>& oldConditionTrackers,
         const unordered_map<int64_t, int>& newConditionTrackerMap,
@@ -255,14 +328,8 @@ optional<InvalidConfigReason> determineConditionUpdateStatus(
     }
 
     // This is an existing condition. Check if it has changed.
-    string serializedCondition;
-    if (!predicate.SerializeToString(&serializedCondition)) {
-        ALOGE("Unable to serialize predicate %lld", (long long)id);
-        return createInvalidConfigReasonWithPredicate(
-                INVALID_CONFIG_REASON_CONDITION_SERIALIZATION_FAILED, id);
-    }
-    uint64_t newProtoHash = Hash64(serializedCondition);
-    if (newProtoHash != oldConditionTrackers[oldConditionTrackerIt->second]->getProtoHash()) {
+    if (newProtoHashes[conditionIdx] !=
+        oldConditionTrackers[oldConditionTrackerIt->second]->getProtoHash()) {
         conditionsToUpdate[conditionIdx] = UPDATE_REPLACE;
         return nullopt;
     }
@@ -315,8 +382,9 @@ optional<InvalidConfigReason> determineConditionUpdateStatus(
                     return invalidConfigReason;
                 }
                 invalidConfigReason = determineConditionUpdateStatus(
-                        config, childIdx, oldConditionTrackerMap, oldConditionTrackers,
-                        newConditionTrackerMap, replacedMatchers, conditionsToUpdate, cycleTracker);
+                        config, childIdx, newProtoHashes, oldConditionTrackerMap,
+                        oldConditionTrackers, newConditionTrackerMap, replacedMatchers,
+                        conditionsToUpdate, cycleTracker);
                 if (invalidConfigReason.has_value()) {
                     invalidConfigReason->conditionIds.push_back(id);
                     return invalidConfigReason;
@@ -350,7 +418,8 @@ optional<InvalidConfigReason> updateConditions(
         unordered_map<int64_t, int>& newConditionTrackerMap,
         vector<sp<ConditionTracker>>& newConditionTrackers,
         unordered_map<int, vector<int>>& trackerToConditionMap,
-        vector<ConditionState>& conditionCache, set<int64_t>& replacedConditions) {
+        vector<ConditionState>& conditionCache, set<int64_t>& replacedConditions,
+        SharedConditionRegistry* sharedConditions) {
     vector<Predicate> conditionProtos;
     const int conditionTrackerCount = config.predicate_size();
     conditionProtos.reserve(conditionTrackerCount);
@@ -369,12 +438,18 @@ optional<InvalidConfigReason> updateConditions(
         conditionProtos.push_back(condition);
     }
 
+    vector<uint64_t> newProtoHashes;
+    invalidConfigReason = computePredicateProtoHashes(config, newProtoHashes);
+    if (invalidConfigReason.has_value()) {
+        return invalidConfigReason;
+    }
+
     vector<UpdateStatus> conditionsToUpdate(conditionTrackerCount, UPDATE_UNKNOWN);
     vector<uint8_t> cycleTracker(conditionTrackerCount, false);
     for (int i = 0; i < conditionTrackerCount; i++) {
         invalidConfigReason = determineConditionUpdateStatus(
-                config, i, oldConditionTrackerMap, oldConditionTrackers, newConditionTrackerMap,
-                replacedMatchers, conditionsToUpdate, cycleTracker);
+                config, i, newProtoHashes, oldConditionTrackerMap, oldConditionTrackers,
+                newConditionTrackerMap, replacedMatchers, conditionsToUpdate, cycleTracker);
         if (invalidConfigReason.has_value()) {
             return invalidConfigReason;
         }
@@ -397,18 +472,33 @@ optional<InvalidConfigReason> updateConditions(
                             INVALID_CONFIG_REASON_CONDITION_NOT_IN_PREV_CONFIG, id);
                 }
                 const int oldIndex = oldConditionTrackerIt->second;
-                newConditionTrackers.push_back(oldConditionTrackers[oldIndex]);
+                const sp<ConditionTracker>& tracker = oldConditionTrackers[oldIndex];
+                if (sharedConditions != nullptr && tracker->IsSimpleCondition()) {
+                    static_cast<SimpleConditionTracker*>(tracker.get())
+                            ->keepSharingState(getSharedConditionKey(config, predicate,
+                                                                     atomMatchingTrackerMap));
+                }
+                newConditionTrackers.push_back(tracker);
                 break;
             }
             case UPDATE_REPLACE:
                 replacedConditions.insert(id);
                 [[fallthrough]];  // Intentionally fallthrough to create the new condition tracker.
             case UPDATE_NEW: {
-                sp<ConditionTracker> tracker = createConditionTracker(
-                        key, predicate, i, atomMatchingTrackerMap, invalidConfigReason);
+                sp<ConditionTracker> tracker =
+                        createConditionTracker(key, predicate, newProtoHashes[i], i,
+                                               atomMatchingTrackerMap, invalidConfigReason);
                 if (tracker == nullptr) {
                     return invalidConfigReason;
                 }
+                if (sharedConditions != nullptr && tracker->IsSimpleCondition()) {
+                    const optional<uint64_t> sharedKey =
+                            getSharedConditionKey(config, predicate, atomMatchingTrackerMap);
+                    if (sharedKey.has_value()) {
+                        static_cast<SimpleConditionTracker*>(tracker.get())
+                                ->shareState(*sharedConditions, *sharedKey);
+                    }
+                }
                 newConditionTrackers.push_back(tracker);
                 break;
             }
@@ -527,27 +617,17 @@ optional<InvalidConfigReason> determineMetricUpdateStatus(
         return nullopt;
     }
 
-    // Take intersections of the matchers/predicates/states that the metric
-    // depends on with those that have been replaced. If a metric depends on any
-    // replaced component, it too must be replaced.
-    set<int64_t> intersection;
-    set_intersection(matcherDependencies.begin(), matcherDependencies.end(),
-                     replacedMatchers.begin(), replacedMatchers.end(),
-                     inserter(intersection, intersection.begin()));
-    if (intersection.size() > 0) {
-        updateStatus = UPDATE_REPLACE;
-        return nullopt;
-    }
-    set_intersection(conditionDependencies.begin(), conditionDependencies.end(),
-                     replacedConditions.begin(), replacedConditions.end(),
-                     inserter(intersection, intersection.begin()));
-    if (intersection.size() > 0) {
-        updateStatus = UPDATE_REPLACE;
-        return nullopt;
-    }
-    set_intersection(stateDependencies.begin(), stateDependencies.end(), replacedStates.begin(),
-                     replacedStates.end(), inserter(intersection, intersection.begin()));
-    if (intersection.size() > 0) {
+    // If a metric depends on any replaced matcher, predicate or state, it too must be replaced.
+    // Most updates replace few components, so each dependency is looked up rather than taking
+    // set intersections.
+    const auto isReplaced = [](const auto& dependencies, const set<int64_t>& replaced) {
+        return !replaced.empty() &&
+               std::any_of(dependencies.begin(), dependencies.end(),
+                           [&replaced](const int64_t id) { return replaced.count(id) > 0; });
+    };
+    if (isReplaced(matcherDependencies, replacedMatchers) ||
+        isReplaced(conditionDependencies, replacedConditions) ||
+        isReplaced(stateDependencies, replacedStates)) {
         updateStatus = UPDATE_REPLACE;
         return nullopt;
     }
@@ -1095,7 +1175,7 @@ optional<InvalidConfigReason> determineAlertUpdateStatus(
         return createInvalidConfigReasonWithAlert(INVALID_CONFIG_REASON_ALERT_SERIALIZATION_FAILED,
                                                   alert.id());
     }
-    uint64_t newProtoHash = Hash64(serializedAlert);
+    uint64_t newProtoHash = FastHash64(serializedAlert);
     const auto [invalidConfigReason, oldProtoHash] =
             oldAnomalyTrackers[oldAnomalyTrackerIt->second]->getProtoHash();
     if (invalidConfigReason.has_value()) {
@@ -1223,7 +1303,7 @@ optional<InvalidConfigReason> updateStatsdConfig(
         unordered_map<int, vector<int>>& activationTrackerToMetricMap,
         unordered_map<int, vector<int>>& deactivationTrackerToMetricMap,
         vector<int>& metricsWithActivation, map<int64_t, uint64_t>& newStateProtoHashes,
-        set<int64_t>& noReportMetricIds) {
+        set<int64_t>& noReportMetricIds, SharedConditionRegistry* sharedConditions) {
     set<int64_t> replacedMatchers;
     set<int64_t> replacedConditions;
     set<int64_t> replacedStates;
@@ -1250,7 +1330,7 @@ optional<InvalidConfigReason> updateStatsdConfig(
     invalidConfigReason = updateConditions(
             key, config, newAtomMatchingTrackerMap, replacedMatchers, oldConditionTrackerMap,
             oldConditionTrackers, newConditionTrackerMap, newConditionTrackers,
-            trackerToConditionMap, conditionCache, replacedConditions);
+            trackerToConditionMap, conditionCache, replacedConditions, sharedConditions);
     if (invalidConfigReason.has_value()) {
         ALOGE("updateConditions failed");
         return invalidConfigReason;
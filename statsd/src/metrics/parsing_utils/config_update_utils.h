@@ -21,6 +21,7 @@
 #include "anomaly/AlarmMonitor.h"
 #include "anomaly/AlarmTracker.h"
 #include "condition/ConditionTracker.h"
+#include "condition/SharedConditionRegistry.h"
 #include "external/StatsPullerManager.h"
 #include "matchers/AtomMatchingTracker.h"
 #include "metrics/MetricProducer.h"
@@ -52,6 +53,15 @@ optional<InvalidConfigReason> determineMatcherUpdateStatus(
         const std::unordered_map<int64_t, int>& newAtomMatchingTrackerMap,
         std::vector<UpdateStatus>& matchersToUpdate, std::vector<uint8_t>& cycleTracker);
 
+// Same as above, with [newProtoHashes] holding the hash of each matcher in the input StatsdConfig
+// so that every matcher is hashed once per update rather than on each call.
+optional<InvalidConfigReason> determineMatcherUpdateStatus(
+        const StatsdConfig& config, int matcherIdx, const std::vector<uint64_t>& newProtoHashes,
+        const std::unordered_map<int64_t, int>& oldAtomMatchingTrackerMap,
+        const std::vector<sp<AtomMatchingTracker>>& oldAtomMatchingTrackers,
+        const std::unordered_map<int64_t, int>& newAtomMatchingTrackerMap,
+        std::vector<UpdateStatus>& matchersToUpdate, std::vector<uint8_t>& cycleTracker);
+
 // Updates the AtomMatchingTrackers.
 // input:
 // [config]: the input StatsdConfig
@@ -93,6 +103,16 @@ optional<InvalidConfigReason> determineConditionUpdateStatus(
         const std::set<int64_t>& replacedMatchers, std::vector<UpdateStatus>& conditionsToUpdate,
         std::vector<uint8_t>& cycleTracker);
 
+// Same as above, with [newProtoHashes] holding the hash of each predicate in the input
+// StatsdConfig so that every predicate is hashed once per update rather than on each call.
+optional<InvalidConfigReason> determineConditionUpdateStatus(
+        const StatsdConfig& config, int conditionIdx, const std::vector<uint64_t>& newProtoHashes,
+        const std::unordered_map<int64_t, int>& oldConditionTrackerMap,
+        const std::vector<sp<ConditionTracker>>& oldConditionTrackers,
+        const std::unordered_map<int64_t, int>& newConditionTrackerMap,
+        const std::set<int64_t>& replacedMatchers, std::vector<UpdateStatus>& conditionsToUpdate,
+        std::vector<uint8_t>& cycleTracker);
+
 // Updates ConditionTrackers
 // input:
 // [config]: the input config
@@ -100,6 +120,7 @@ optional<InvalidConfigReason> determineConditionUpdateStatus(
 // [replacedMatchers]: ids of replaced matchers. conditions depending on these must also be replaced
 // [oldConditionTrackerMap]: existing matcher id to index mapping
 // [oldConditionTrackers]: stores the existing ConditionTrackers
+// [sharedConditions]: if set, shares the state of predicates identical to those of other configs
 // output:
 // [newConditionTrackerMap]: new condition id to index mapping
 // [newConditionTrackers]: stores the sp to all the ConditionTrackers
@@ -117,7 +138,8 @@ optional<InvalidConfigReason> updateConditions(
         std::unordered_map<int64_t, int>& newConditionTrackerMap,
         std::vector<sp<ConditionTracker>>& newConditionTrackers,
         std::unordered_map<int, std::vector<int>>& trackerToConditionMap,
-        std::vector<ConditionState>& conditionCache, std::set<int64_t>& replacedConditions);
+        std::vector<ConditionState>& conditionCache, std::set<int64_t>& replacedConditions,
+        SharedConditionRegistry* sharedConditions = nullptr);
 
 optional<InvalidConfigReason> updateStates(
         const StatsdConfig& config, const std::map<int64_t, uint64_t>& oldStateProtoHashes,
@@ -261,7 +283,7 @@ optional<InvalidConfigReason> updateStatsdConfig(
         std::unordered_map<int, std::vector<int>>& activationTrackerToMetricMap,
         std::unordered_map<int, std::vector<int>>& deactivationTrackerToMetricMap,
         std::vector<int>& metricsWithActivation, std::map<int64_t, uint64_t>& newStateProtoHashes,
-        std::set<int64_t>& noReportMetricIds);
+        std::set<int64_t>& noReportMetricIds, SharedConditionRegistry* sharedConditions = nullptr);
 
 }  // namespace statsd
 }  // namespace os
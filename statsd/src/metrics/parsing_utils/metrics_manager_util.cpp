@@ -34,6 +34,7 @@
 #include "metrics/DurationMetricProducer.h"
 #include "metrics/EventMetricProducer.h"
 #include "metrics/GaugeMetricProducer.h"
+#include "metrics/HistogramValueMetricProducer.h"
 #include "metrics/KllMetricProducer.h"
 #include "metrics/MetricProducer.h"
 #include "metrics/NumericValueMetricProducer.h"
@@ -131,17 +132,44 @@ optional<InvalidConfigReason> validateSimpleAtomMatcher(int64_t matcherId,
 
 }  // namespace
 
-sp<AtomMatchingTracker> createAtomMatchingTracker(
-        const AtomMatcher& logMatcher, const sp<UidMap>& uidMap,
-        optional<InvalidConfigReason>& invalidConfigReason) {
+optional<InvalidConfigReason> getAtomMatcherProtoHash(const AtomMatcher& logMatcher,
+                                                      uint64_t& protoHash) {
     string serializedMatcher;
     if (!logMatcher.SerializeToString(&serializedMatcher)) {
         ALOGE("Unable to serialize matcher %lld", (long long)logMatcher.id());
-        invalidConfigReason = createInvalidConfigReasonWithMatcher(
+        return createInvalidConfigReasonWithMatcher(
                 INVALID_CONFIG_REASON_MATCHER_SERIALIZATION_FAILED, logMatcher.id());
+    }
+    protoHash = FastHash64(serializedMatcher);
+    return nullopt;
+}
+
+optional<InvalidConfigReason> getPredicateProtoHash(const Predicate& predicate,
+                                                    uint64_t& protoHash) {
+    string serializedPredicate;
+    if (!predicate.SerializeToString(&serializedPredicate)) {
+        ALOGE("Unable to serialize predicate %lld", (long long)predicate.id());
+        return createInvalidConfigReasonWithPredicate(
+                INVALID_CONFIG_REASON_CONDITION_SERIALIZATION_FAILED, predicate.id());
+    }
+    protoHash = FastHash64(serializedPredicate);
+    return nullopt;
+}
+
+sp<AtomMatchingTracker> createAtomMatchingTracker(
+        const AtomMatcher& logMatcher, const sp<UidMap>& uidMap,
+        optional<InvalidConfigReason>& invalidConfigReason) {
+    uint64_t protoHash;
+    invalidConfigReason = getAtomMatcherProtoHash(logMatcher, protoHash);
+    if (invalidConfigReason.has_value()) {
         return nullptr;
     }
-    uint64_t protoHash = Hash64(serializedMatcher);
+    return createAtomMatchingTracker(logMatcher, protoHash, uidMap, invalidConfigReason);
+}
+
+sp<AtomMatchingTracker> createAtomMatchingTracker(
+        const AtomMatcher& logMatcher, const uint64_t protoHash, const sp<UidMap>& uidMap,
+        optional<InvalidConfigReason>& invalidConfigReason) {
     switch (logMatcher.contents_case()) {
         case AtomMatcher::ContentsCase::kSimpleAtomMatcher: {
             invalidConfigReason =
@@ -168,14 +196,19 @@ sp<ConditionTracker> createConditionTracker(
         const ConfigKey& key, const Predicate& predicate, const int index,
         const unordered_map<int64_t, int>& atomMatchingTrackerMap,
         optional<InvalidConfigReason>& invalidConfigReason) {
-    string serializedPredicate;
-    if (!predicate.SerializeToString(&serializedPredicate)) {
-        ALOGE("Unable to serialize predicate %lld", (long long)predicate.id());
-        invalidConfigReason = createInvalidConfigReasonWithPredicate(
-                INVALID_CONFIG_REASON_CONDITION_SERIALIZATION_FAILED, predicate.id());
+    uint64_t protoHash;
+    invalidConfigReason = getPredicateProtoHash(predicate, protoHash);
+    if (invalidConfigReason.has_value()) {
         return nullptr;
     }
-    uint64_t protoHash = Hash64(serializedPredicate);
+    return createConditionTracker(key, predicate, protoHash, index, atomMatchingTrackerMap,
+                                  invalidConfigReason);
+}
+
+sp<ConditionTracker> createConditionTracker(
+        const ConfigKey& key, const Predicate& predicate, const uint64_t protoHash,
+        const int index, const unordered_map<int64_t, int>& atomMatchingTrackerMap,
+        optional<InvalidConfigReason>& invalidConfigReason) {
     switch (predicate.contents_case()) {
         case Predicate::ContentsCase::kSimplePredicate: {
             return new SimpleConditionTracker(key, predicate.id(), protoHash, index,
@@ -192,6 +225,54 @@ sp<ConditionTracker> createConditionTracker(
     }
 }
 
+optional<uint64_t> getSharedConditionKey(const StatsdConfig& config, const Predicate& predicate,
+                                         const unordered_map<int64_t, int>& atomMatchingTrackerMap) {
+    if (!predicate.has_simple_predicate()) {
+        return nullopt;
+    }
+    const SimplePredicate& simplePredicate = predicate.simple_predicate();
+    // Identical definitions over identical matchers, regardless of the ids they use.
+    SimplePredicate definition = simplePredicate;
+    definition.clear_start();
+    definition.clear_stop();
+    definition.clear_stop_all();
+    string serializedKey;
+    if (!definition.SerializeToString(&serializedKey)) {
+        return nullopt;
+    }
+    const auto appendMatcher = [&](bool hasMatcher, int64_t matcherId) {
+        if (!hasMatcher) {
+            serializedKey += ";";
+            return true;
+        }
+        const auto it = atomMatchingTrackerMap.find(matcherId);
+        if (it == atomMatchingTrackerMap.end() ||
+            !config.atom_matcher(it->second).has_simple_atom_matcher()) {
+            return false;
+        }
+        const string serializedMatcher =
+                config.atom_matcher(it->second).simple_atom_matcher().SerializeAsString();
+        serializedKey += std::to_string(serializedMatcher.size()) + ":" + serializedMatcher;
+        return true;
+    };
+    if (!appendMatcher(simplePredicate.has_start(), simplePredicate.start()) ||
+        !appendMatcher(simplePredicate.has_stop(), simplePredicate.stop()) ||
+        !appendMatcher(simplePredicate.has_stop_all(), simplePredicate.stop_all())) {
+        return nullopt;
+    }
+    // MetricsManager drops events from log sources the config does not allow, and restricted
+    // events for configs without a delegate, so only configs agreeing on both see the same events.
+    for (const string& source : config.allowed_log_source()) {
+        serializedKey += std::to_string(source.size()) + ":" + source;
+    }
+    serializedKey += ";";
+    for (const int atomId : config.whitelisted_atom_ids()) {
+        serializedKey += std::to_string(atomId) + ",";
+    }
+    serializedKey += config.has_restricted_metrics_delegate_package_name() ? "r" : "u";
+    return FastHash64(serializedKey);
+}
+
 optional<InvalidConfigReason> getMetricProtoHash(
         const StatsdConfig& config, const MessageLite& metric, const int64_t id,
         const unordered_map<int64_t, int>& metricToActivationMap, uint64_t& metricHash) {
@@ -200,7 +281,7 @@ optional<InvalidConfigReason> getMetricProtoHash(
         ALOGE("Unable to serialize metric %lld", (long long)id);
         return InvalidConfigReason(INVALID_CONFIG_REASON_METRIC_SERIALIZATION_FAILED, id);
     }
-    metricHash = Hash64(serializedMetric);
+    metricHash = FastHash64(serializedMetric);
 
     // Combine with activation hash, if applicable
     const auto& metricActivationIt = metricToActivationMap.find(id);
@@ -212,7 +293,10 @@ optional<InvalidConfigReason> getMetricProtoHash(
             return InvalidConfigReason(INVALID_CONFIG_REASON_METRIC_ACTIVATION_SERIALIZATION_FAILED,
                                        id);
         }
-        metricHash = Hash64(to_string(metricHash).append(to_string(Hash64(serializedActivation))));
+        StreamingHash64 hasher;
+        hasher.add(metricHash);
+        hasher.addBytes(serializedActivation.data(), serializedActivation.size());
+        metricHash = hasher.hash();
     }
     return nullopt;
 }
@@ -571,6 +655,14 @@ optional<sp<MetricProducer>> createCountMetricProducerAndUpdateMetadata(
         }
     }
 
+    if (metric.has_top_k_dimensions() &&
+        (metric.top_k_dimensions() < 1 || !metric.has_dimensions_in_what())) {
+        ALOGW("CountMetric's top_k_dimensions must be positive and needs dimensions in what");
+        invalidConfigReason = InvalidConfigReason(
+                INVALID_CONFIG_REASON_METRIC_INCORRECT_TOP_K_DIMENSIONS, metric.id());
+        return nullopt;
+    }
+
     unordered_map<int, shared_ptr<Activation>> eventActivationMap;
     unordered_map<int, vector<shared_ptr<Activation>>> eventDeactivationMap;
     invalidConfigReason = handleMetricActivation(
@@ -851,6 +943,12 @@ optional<sp<MetricProducer>> createEventMetricProducerAndUpdateMetadata(
         return nullopt;
     }
 
+    if (metric.has_max_sampled_events() && metric.max_sampled_events() < 1) {
+        invalidConfigReason = InvalidConfigReason(
+                INVALID_CONFIG_REASON_METRIC_INCORRECT_MAX_SAMPLED_EVENTS, metric.id());
+        return nullopt;
+    }
+
     unordered_map<int, shared_ptr<Activation>> eventActivationMap;
     unordered_map<int, vector<shared_ptr<Activation>>> eventDeactivationMap;
     invalidConfigReason = handleMetricActivation(
@@ -893,7 +991,8 @@ optional<sp<MetricProducer>> createNumericValueMetricProducerAndUpdateMetadata(
         unordered_map<int, vector<int>>& conditionToMetricMap,
         unordered_map<int, vector<int>>& activationAtomTrackerToMetricMap,
         unordered_map<int, vector<int>>& deactivationAtomTrackerToMetricMap,
-        vector<int>& metricsWithActivation, optional<InvalidConfigReason>& invalidConfigReason) {
+        vector<int>& metricsWithActivation, optional<InvalidConfigReason>& invalidConfigReason,
+        const bool deferRegistration) {
     if (!metric.has_id() || !metric.has_what()) {
         ALOGE("cannot find metric id or \"what\" in ValueMetric \"%lld\"", (long long)metric.id());
         invalidConfigReason =
@@ -935,6 +1034,26 @@ optional<sp<MetricProducer>> createNumericValueMetricProducerAndUpdateMetadata(
     int atomTagId = *(atomMatcher->getAtomIds().begin());
     int pullTagId = pullerManager->PullerForMatcherExists(atomTagId) ? atomTagId : -1;
 
+    optional<HistogramBins> histogramBins;
+    if (metric.aggregation_type() == ValueMetric::HISTOGRAM) {
+        histogramBins = HistogramBins::create(metric.histogram_bin_config());
+        if (!histogramBins) {
+            ALOGE("invalid \"histogram_bin_config\" in ValueMetric \"%lld\"",
+                  (long long)metric.id());
+            invalidConfigReason = InvalidConfigReason(
+                    INVALID_CONFIG_REASON_VALUE_METRIC_HISTOGRAM_INVALID_BIN_CONFIG, metric.id());
+            return nullopt;
+        }
+        if (pullTagId != -1 || metric.use_diff()) {
+            ALOGE("histogram ValueMetric \"%lld\" only supports pushed atoms without diff",
+                  (long long)metric.id());
+            invalidConfigReason = InvalidConfigReason(
+                    INVALID_CONFIG_REASON_VALUE_METRIC_HISTOGRAM_WITH_PULLED_ATOM_OR_DIFF,
+                    metric.id());
+            return nullopt;
+        }
+    }
+
     int conditionIndex = -1;
     if (metric.has_condition()) {
         invalidConfigReason = handleMetricWithConditions(
@@ -1014,15 +1133,31 @@ optional<sp<MetricProducer>> createNumericValueMetricProducerAndUpdateMetadata(
                     ? optional<int64_t>(metric.condition_correction_threshold_nanos())
                     : nullopt;
 
-    sp<MetricProducer> metricProducer = new NumericValueMetricProducer(
-            key, metric, metricHash, {pullTagId, pullerManager},
-            {timeBaseNs, currentTimeNs, bucketSizeNs, metric.min_bucket_size_nanos(),
-             conditionCorrectionThresholdNs, getAppUpgradeBucketSplit(metric)},
-            {containsAnyPositionInDimensionsInWhat, shouldUseNestedDimensions, trackerIndex,
-             matcherWizard, metric.dimensions_in_what(), fieldMatchers},
-            {conditionIndex, metric.links(), initialConditionCache, wizard},
-            {metric.state_link(), slicedStateAtoms, stateGroupMap},
-            {eventActivationMap, eventDeactivationMap}, {dimensionSoftLimit, dimensionHardLimit});
+    sp<MetricProducer> metricProducer;
+    if (histogramBins) {
+        metricProducer = new HistogramValueMetricProducer(
+                key, metric, *histogramBins, metricHash,
+                {pullTagId, pullerManager, deferRegistration},
+                {timeBaseNs, currentTimeNs, bucketSizeNs, metric.min_bucket_size_nanos(),
+                 /*conditionCorrectionThresholdNs=*/nullopt, getAppUpgradeBucketSplit(metric)},
+                {containsAnyPositionInDimensionsInWhat, shouldUseNestedDimensions, trackerIndex,
+                 matcherWizard, metric.dimensions_in_what(), fieldMatchers},
+                {conditionIndex, metric.links(), initialConditionCache, wizard},
+                {metric.state_link(), slicedStateAtoms, stateGroupMap},
+                {eventActivationMap, eventDeactivationMap},
+                {dimensionSoftLimit, dimensionHardLimit});
+    } else {
+        metricProducer = new NumericValueMetricProducer(
+                key, metric, metricHash, {pullTagId, pullerManager, deferRegistration},
+                {timeBaseNs, currentTimeNs, bucketSizeNs, metric.min_bucket_size_nanos(),
+                 conditionCorrectionThresholdNs, getAppUpgradeBucketSplit(metric)},
+                {containsAnyPositionInDimensionsInWhat, shouldUseNestedDimensions, trackerIndex,
+                 matcherWizard, metric.dimensions_in_what(), fieldMatchers},
+                {conditionIndex, metric.links(), initialConditionCache, wizard},
+                {metric.state_link(), slicedStateAtoms, stateGroupMap},
+                {eventActivationMap, eventDeactivationMap},
+                {dimensionSoftLimit, dimensionHardLimit});
+    }
 
     SamplingInfo samplingInfo;
     if (metric.has_dimensional_sampling_info()) {
@@ -1205,7 +1340,8 @@ optional<sp<MetricProducer>> createGaugeMetricProducerAndUpdateMetadata(
         unordered_map<int, vector<int>>& conditionToMetricMap,
         unordered_map<int, vector<int>>& activationAtomTrackerToMetricMap,
         unordered_map<int, vector<int>>& deactivationAtomTrackerToMetricMap,
-        vector<int>& metricsWithActivation, optional<InvalidConfigReason>& invalidConfigReason) {
+        vector<int>& metricsWithActivation, optional<InvalidConfigReason>& invalidConfigReason,
+        const bool deferRegistration) {
     if (!metric.has_id() || !metric.has_what()) {
         ALOGE("cannot find metric id or \"what\" in GaugeMetric \"%lld\"", (long long)metric.id());
         invalidConfigReason =
@@ -1325,7 +1461,7 @@ optional<sp<MetricProducer>> createGaugeMetricProducerAndUpdateMetadata(
             key, metric, conditionIndex, initialConditionCache, wizard, metricHash, trackerIndex,
             matcherWizard, pullTagId, triggerAtomId, atomTagId, timeBaseNs, currentTimeNs,
             pullerManager, eventActivationMap, eventDeactivationMap, dimensionSoftLimit,
-            dimensionHardLimit);
+            dimensionHardLimit, deferRegistration);
 
     SamplingInfo samplingInfo;
     std::vector<Matcher> dimensionsInWhat;
@@ -1447,7 +1583,7 @@ optional<InvalidConfigReason> initConditions(
         unordered_map<int64_t, int>& conditionTrackerMap,
         vector<sp<ConditionTracker>>& allConditionTrackers,
         unordered_map<int, std::vector<int>>& trackerToConditionMap,
-        vector<ConditionState>& initialConditionCache) {
+        vector<ConditionState>& initialConditionCache, SharedConditionRegistry* sharedConditions) {
     vector<Predicate> conditionConfigs;
     const int conditionTrackerCount = config.predicate_size();
     conditionConfigs.reserve(conditionTrackerCount);
@@ -1462,6 +1598,14 @@ optional<InvalidConfigReason> initConditions(
         if (tracker == nullptr) {
             return invalidConfigReason;
         }
+        if (sharedConditions != nullptr && tracker->IsSimpleCondition()) {
+            const optional<uint64_t> sharedKey =
+                    getSharedConditionKey(config, condition, atomMatchingTrackerMap);
+            if (sharedKey.has_value()) {
+                static_cast<SimpleConditionTracker*>(tracker.get())
+                        ->shareState(*sharedConditions, *sharedKey);
+            }
+        }
         allConditionTrackers.push_back(tracker);
         if (conditionTrackerMap.find(condition.id()) != conditionTrackerMap.end()) {
             ALOGE("Duplicate Predicate found!");
@@ -1504,7 +1648,7 @@ optional<InvalidConfigReason> initStates(
             return createInvalidConfigReasonWithState(
                     INVALID_CONFIG_REASON_STATE_SERIALIZATION_FAILED, state.id(), state.atom_id());
         }
-        stateProtoHashes[stateId] = Hash64(serializedState);
+        stateProtoHashes[stateId] = FastHash64(serializedState);
 
         const StateMap& stateMap = state.map();
         for (const auto& group : stateMap.group()) {
@@ -1533,7 +1677,7 @@ optional<InvalidConfigReason> initMetrics(
         std::set<int64_t>& noReportMetricIds,
         unordered_map<int, vector<int>>& activationAtomTrackerToMetricMap,
         unordered_map<int, vector<int>>& deactivationAtomTrackerToMetricMap,
-        vector<int>& metricsWithActivation) {
+        vector<int>& metricsWithActivation, const bool deferRegistration) {
     sp<ConditionWizard> wizard = new ConditionWizard(allConditionTrackers);
     sp<EventMatcherWizard> matcherWizard = new EventMatcherWizard(allAtomMatchingTrackers);
     const int allMetricsCount = config.count_metric_size() + config.duration_metric_size() +
@@ -1628,7 +1772,7 @@ optional<InvalidConfigReason> initMetrics(
                 conditionTrackerMap, initialConditionCache, wizard, matcherWizard, stateAtomIdMap,
                 allStateGroupMaps, metricToActivationMap, trackerToMetricMap, conditionToMetricMap,
                 activationAtomTrackerToMetricMap, deactivationAtomTrackerToMetricMap,
-                metricsWithActivation, invalidConfigReason);
+                metricsWithActivation, invalidConfigReason, deferRegistration);
         if (!producer) {
             return invalidConfigReason;
         }
@@ -1664,7 +1808,7 @@ optional<InvalidConfigReason> initMetrics(
                 conditionTrackerMap, initialConditionCache, wizard, matcherWizard,
                 metricToActivationMap, trackerToMetricMap, conditionToMetricMap,
                 activationAtomTrackerToMetricMap, deactivationAtomTrackerToMetricMap,
-                metricsWithActivation, invalidConfigReason);
+                metricsWithActivation, invalidConfigReason, deferRegistration);
         if (!producer) {
             return invalidConfigReason;
         }
@@ -1683,13 +1827,9 @@ optional<InvalidConfigReason> initMetrics(
     const set<int> whitelistedAtomIds(config.whitelisted_atom_ids().begin(),
                                       config.whitelisted_atom_ids().end());
     for (const auto& it : allMetricProducers) {
-        // Register metrics to StateTrackers
+        // Using whitelisted atom as a sliced state atom is not allowed.
         for (int atomId : it->getSlicedStateAtoms()) {
-            // Register listener for non-whitelisted atoms only. Using whitelisted atom as a sliced
-            // state atom is not allowed.
-            if (whitelistedAtomIds.find(atomId) == whitelistedAtomIds.end()) {
-                StateManager::getInstance().registerListener(atomId, it);
-            } else {
+            if (whitelistedAtomIds.find(atomId) != whitelistedAtomIds.end()) {
                 return InvalidConfigReason(
                         INVALID_CONFIG_REASON_METRIC_SLICED_STATE_ATOM_ALLOWED_FROM_ANY_UID,
                         it->getMetricId());
@@ -1699,6 +1839,14 @@ optional<InvalidConfigReason> initMetrics(
     return nullopt;
 }
 
+void registerStateListeners(const vector<sp<MetricProducer>>& allMetricProducers) {
+    for (const auto& it : allMetricProducers) {
+        for (int atomId : it->getSlicedStateAtoms()) {
+            StateManager::getInstance().registerListener(atomId, it);
+        }
+    }
+}
+
 optional<InvalidConfigReason> initAlerts(const StatsdConfig& config, const int64_t currentTimeNs,
                                          const unordered_map<int64_t, int>& metricProducerMap,
                                          unordered_map<int64_t, int>& alertTrackerMap,
@@ -1724,7 +1872,8 @@ optional<InvalidConfigReason> initAlerts(const StatsdConfig& config, const int64
 optional<InvalidConfigReason> initAlarms(const StatsdConfig& config, const ConfigKey& key,
                                          const sp<AlarmMonitor>& periodicAlarmMonitor,
                                          const int64_t timeBaseNs, const int64_t currentTimeNs,
-                                         vector<sp<AlarmTracker>>& allAlarmTrackers) {
+                                         vector<sp<AlarmTracker>>& allAlarmTrackers,
+                                         const bool deferRegistration) {
     unordered_map<int64_t, int> alarmTrackerMap;
     int64_t startMillis = timeBaseNs / 1000 / 1000;
     int64_t currentTimeMillis = currentTimeNs / 1000 / 1000;
@@ -1741,8 +1890,8 @@ optional<InvalidConfigReason> initAlarms(const StatsdConfig& config, const Confi
                     INVALID_CONFIG_REASON_ALARM_PERIOD_LESS_THAN_OR_EQUAL_ZERO, alarm.id());
         }
         alarmTrackerMap.insert(std::make_pair(alarm.id(), allAlarmTrackers.size()));
-        allAlarmTrackers.push_back(
-                new AlarmTracker(startMillis, currentTimeMillis, alarm, key, periodicAlarmMonitor));
+        allAlarmTrackers.push_back(new AlarmTracker(startMillis, currentTimeMillis, alarm, key,
+                                                    periodicAlarmMonitor, deferRegistration));
     }
     return initSubscribersForSubscriptionType(config, Subscription::ALARM, alarmTrackerMap,
                                               allAlarmTrackers);
@@ -1768,7 +1917,8 @@ optional<InvalidConfigReason> initStatsdConfig(
         unordered_map<int, std::vector<int>>& activationAtomTrackerToMetricMap,
         unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
         unordered_map<int64_t, int>& alertTrackerMap, vector<int>& metricsWithActivation,
-        map<int64_t, uint64_t>& stateProtoHashes, set<int64_t>& noReportMetricIds) {
+        map<int64_t, uint64_t>& stateProtoHashes, set<int64_t>& noReportMetricIds,
+        SharedConditionRegistry* sharedConditions, bool deferRegistration) {
     vector<ConditionState> initialConditionCache;
     unordered_map<int64_t, int> stateAtomIdMap;
     unordered_map<int64_t, unordered_map<int, int64_t>> allStateGroupMaps;
@@ -1790,7 +1940,8 @@ optional<InvalidConfigReason> initStatsdConfig(
 
     invalidConfigReason =
             initConditions(key, config, atomMatchingTrackerMap, conditionTrackerMap,
-                           allConditionTrackers, trackerToConditionMap, initialConditionCache);
+                           allConditionTrackers, trackerToConditionMap, initialConditionCache,
+                           sharedConditions);
     if (invalidConfigReason.has_value()) {
         ALOGE("initConditionTrackers failed");
         return invalidConfigReason;
@@ -1808,11 +1959,14 @@ optional<InvalidConfigReason> initStatsdConfig(
             allConditionTrackers, initialConditionCache, allMetricProducers, conditionToMetricMap,
             trackerToMetricMap, metricProducerMap, noReportMetricIds,
             activationAtomTrackerToMetricMap, deactivationAtomTrackerToMetricMap,
-            metricsWithActivation);
+            metricsWithActivation, deferRegistration);
     if (invalidConfigReason.has_value()) {
         ALOGE("initMetricProducers failed");
         return invalidConfigReason;
     }
+    if (!deferRegistration) {
+        registerStateListeners(allMetricProducers);
+    }
 
     invalidConfigReason = initAlerts(config, currentTimeNs, metricProducerMap, alertTrackerMap,
                                      anomalyAlarmMonitor, allMetricProducers, allAnomalyTrackers);
@@ -1822,7 +1976,7 @@ optional<InvalidConfigReason> initStatsdConfig(
     }
 
     invalidConfigReason = initAlarms(config, key, periodicAlarmMonitor, timeBaseNs, currentTimeNs,
-                                     allPeriodicAlarmTrackers);
+                                     allPeriodicAlarmTrackers, deferRegistration);
     if (invalidConfigReason.has_value()) {
         ALOGE("initAlarms failed");
         return invalidConfigReason;
@@ -1831,6 +1985,124 @@ optional<InvalidConfigReason> initStatsdConfig(
     return nullopt;
 }
 
+namespace {
+
+void addTopLevelField(int32_t field, FieldMask& fieldMask) {
+    if (field > 0 && field < kMaxFieldMaskPosition) {
+        fieldMask |= FieldMask(1) << field;
+    }
+}
+
+void addFieldMatcherFields(const FieldMatcher& matcher, AtomFieldMasks& fieldMasks) {
+    if (!matcher.has_field()) {
+        return;
+    }
+    // The root of a FieldMatcher is the atom id, its children are the top-level fields.
+    FieldMask& fieldMask = fieldMasks[matcher.field()];
+    for (const FieldMatcher& child : matcher.child()) {
+        addTopLevelField(child.field(), fieldMask);
+    }
+}
+
+void addMatcherAtomIds(const unordered_map<int64_t, const AtomMatcher*>& matchers,
+                       int64_t matcherId, set<int64_t>& visitedMatcherIds,
+                       set<int>& atomIds) {
+    const auto it = matchers.find(matcherId);
+    if (it == matchers.end() || !visitedMatcherIds.insert(matcherId).second) {
+        return;
+    }
+    const AtomMatcher& matcher = *it->second;
+    if (matcher.has_simple_atom_matcher()) {
+        atomIds.insert(matcher.simple_atom_matcher().atom_id());
+    }
+    for (const int64_t childId : matcher.combination().matcher()) {
+        addMatcherAtomIds(matchers, childId, visitedMatcherIds, atomIds);
+    }
+}
+
+}  // namespace
+
+AtomFieldMasks computeAtomFieldMasks(const StatsdConfig& config) {
+    AtomFieldMasks fieldMasks;
+    unordered_map<int64_t, const AtomMatcher*> matchers;
+    for (const AtomMatcher& matcher : config.atom_matcher()) {
+        matchers[matcher.id()] = &matcher;
+        if (!matcher.has_simple_atom_matcher()) {
+            continue;
+        }
+        const SimpleAtomMatcher& simpleMatcher = matcher.simple_atom_matcher();
+        FieldMask& fieldMask = fieldMasks[simpleMatcher.atom_id()];
+        for (const FieldValueMatcher& fieldValueMatcher : simpleMatcher.field_value_matcher()) {
+            addTopLevelField(fieldValueMatcher.field(), fieldMask);
+        }
+    }
+
+    for (const Predicate& predicate : config.predicate()) {
+        addFieldMatcherFields(predicate.simple_predicate().dimensions(), fieldMasks);
+    }
+    const auto addLinks = [&fieldMasks](const auto& metric) {
+        for (const MetricConditionLink& link : metric.links()) {
+            addFieldMatcherFields(link.fields_in_what(), fieldMasks);
+            addFieldMatcherFields(link.fields_in_condition(), fieldMasks);
+        }
+    };
+    const auto addDimensionedMetric = [&fieldMasks, &addLinks](const auto& metric) {
+        addFieldMatcherFields(metric.dimensions_in_what(), fieldMasks);
+        addFieldMatcherFields(metric.dimensional_sampling_info().sampled_what_field(),
+                              fieldMasks);
+        addLinks(metric);
+    };
+    const auto addStateLinks = [&fieldMasks](const auto& metric) {
+        for (const MetricStateLink& stateLink : metric.state_link()) {
+            addFieldMatcherFields(stateLink.fields_in_what(), fieldMasks);
+            addFieldMatcherFields(stateLink.fields_in_state(), fieldMasks);
+        }
+    };
+
+    // Atoms reported whole.
+    set<int> allFieldsAtomIds;
+    for (const EventMetric& metric : config.event_metric()) {
+        set<int64_t> visitedMatcherIds;
+        addMatcherAtomIds(matchers, metric.what(), visitedMatcherIds, allFieldsAtomIds);
+        addLinks(metric);
+    }
+    for (const CountMetric& metric : config.count_metric()) {
+        addDimensionedMetric(metric);
+        addFieldMatcherFields(metric.dimensions_in_condition(), fieldMasks);
+        addStateLinks(metric);
+    }
+    for (const DurationMetric& metric : config.duration_metric()) {
+        addDimensionedMetric(metric);
+        addFieldMatcherFields(metric.dimensions_in_condition(), fieldMasks);
+        addStateLinks(metric);
+    }
+    for (const GaugeMetric& metric : config.gauge_metric()) {
+        addDimensionedMetric(metric);
+        addFieldMatcherFields(metric.dimensions_in_condition(), fieldMasks);
+        if (metric.has_gauge_fields_filter() && !metric.gauge_fields_filter().include_all()) {
+            addFieldMatcherFields(metric.gauge_fields_filter().fields(), fieldMasks);
+        } else {
+            set<int64_t> visitedMatcherIds;
+            addMatcherAtomIds(matchers, metric.what(), visitedMatcherIds, allFieldsAtomIds);
+        }
+    }
+    for (const ValueMetric& metric : config.value_metric()) {
+        addDimensionedMetric(metric);
+        addFieldMatcherFields(metric.dimensions_in_condition(), fieldMasks);
+        addStateLinks(metric);
+        addFieldMatcherFields(metric.value_field(), fieldMasks);
+    }
+    for (const KllMetric& metric : config.kll_metric()) {
+        addDimensionedMetric(metric);
+        addStateLinks(metric);
+        addFieldMatcherFields(metric.kll_field(), fieldMasks);
+    }
+    for (const int atomId : allFieldsAtomIds) {
+        fieldMasks[atomId] = kAllFieldsMask;
+    }
+    return fieldMasks;
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -22,9 +22,11 @@
 
 #include "anomaly/AlarmTracker.h"
 #include "condition/ConditionTracker.h"
+#include "condition/SharedConditionRegistry.h"
 #include "external/StatsPullerManager.h"
 #include "matchers/AtomMatchingTracker.h"
 #include "metrics/MetricProducer.h"
+#include "socket/LogEventFilter.h"
 
 namespace android {
 namespace os {
@@ -33,6 +35,16 @@ namespace statsd {
 // Helper functions for creating, validating, and updating config components from StatsdConfig.
 // Should only be called from metrics_manager_util and config_update_utils.
 
+// Computes the hash of the serialized AtomMatcher that trackers are compared by on config updates.
+// Returns nullopt if successful and InvalidConfigReason if the matcher cannot be serialized.
+optional<InvalidConfigReason> getAtomMatcherProtoHash(const AtomMatcher& logMatcher,
+                                                      uint64_t& protoHash);
+
+// Computes the hash of the serialized Predicate that trackers are compared by on config updates.
+// Returns nullopt if successful and InvalidConfigReason if the predicate cannot be serialized.
+optional<InvalidConfigReason> getPredicateProtoHash(const Predicate& predicate,
+                                                    uint64_t& protoHash);
+
 // Create a AtomMatchingTracker.
 // input:
 // [logMatcher]: the input AtomMatcher from the StatsdConfig
@@ -43,6 +55,11 @@ sp<AtomMatchingTracker> createAtomMatchingTracker(
         const AtomMatcher& logMatcher, const sp<UidMap>& uidMap,
         optional<InvalidConfigReason>& invalidConfigReason);
 
+// Same as above, for callers that have already computed the matcher's proto hash.
+sp<AtomMatchingTracker> createAtomMatchingTracker(
+        const AtomMatcher& logMatcher, uint64_t protoHash, const sp<UidMap>& uidMap,
+        optional<InvalidConfigReason>& invalidConfigReason);
+
 // Create a ConditionTracker.
 // input:
 // [predicate]: the input Predicate from the StatsdConfig
@@ -56,6 +73,19 @@ sp<ConditionTracker> createConditionTracker(
         const unordered_map<int64_t, int>& atomMatchingTrackerMap,
         optional<InvalidConfigReason>& invalidConfigReason);
 
+// Same as above, for callers that have already computed the predicate's proto hash.
+sp<ConditionTracker> createConditionTracker(
+        const ConfigKey& key, const Predicate& predicate, uint64_t protoHash, int index,
+        const unordered_map<int64_t, int>& atomMatchingTrackerMap,
+        optional<InvalidConfigReason>& invalidConfigReason);
+
+// Get the key under which the trackers of identical predicates in different configs share their
+// state. Only simple predicates whose start, stop and stop_all are simple matchers are shared, and
+// only between configs that accept events from the same log sources.
+// Returns nullopt if the predicate's state cannot be shared.
+optional<uint64_t> getSharedConditionKey(const StatsdConfig& config, const Predicate& predicate,
+                                         const unordered_map<int64_t, int>& atomMatchingTrackerMap);
+
 // Get the hash of a metric, combining the activation if the metric has one.
 optional<InvalidConfigReason> getMetricProtoHash(
         const StatsdConfig& config, const google::protobuf::MessageLite& metric, int64_t id,
@@ -152,8 +182,10 @@ optional<sp<MetricProducer>> createEventMetricProducerAndUpdateMetadata(
         std::vector<int>& metricsWithActivation,
         optional<InvalidConfigReason>& invalidConfigReason);
 
-// Creates a NumericValueMetricProducer and updates the vectors/maps used by MetricsManager with
-// the appropriate indices. Returns an sp to the producer, or nullopt if there was an error.
+// Creates a NumericValueMetricProducer, or a HistogramValueMetricProducer for the HISTOGRAM
+// aggregation type, and updates the vectors/maps used by MetricsManager with the appropriate
+// indices. Returns an sp to the producer, or nullopt if there was an error.
+// [deferRegistration]: leaves the registration for scheduled pulls to registerPullReceiver().
 optional<sp<MetricProducer>> createNumericValueMetricProducerAndUpdateMetadata(
         const ConfigKey& key, const StatsdConfig& config, int64_t timeBaseNs,
         const int64_t currentTimeNs, const sp<StatsPullerManager>& pullerManager,
@@ -172,10 +204,11 @@ optional<sp<MetricProducer>> createNumericValueMetricProducerAndUpdateMetadata(
         std::unordered_map<int, std::vector<int>>& activationAtomTrackerToMetricMap,
         std::unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
         std::vector<int>& metricsWithActivation,
-        optional<InvalidConfigReason>& invalidConfigReason);
+        optional<InvalidConfigReason>& invalidConfigReason, bool deferRegistration = false);
 
 // Creates a GaugeMetricProducer and updates the vectors/maps used by MetricsManager with
 // the appropriate indices. Returns an sp to the producer, or nullopt if there was an error.
+// [deferRegistration]: leaves the registration for scheduled pulls to registerPullReceiver().
 optional<sp<MetricProducer>> createGaugeMetricProducerAndUpdateMetadata(
         const ConfigKey& key, const StatsdConfig& config, int64_t timeBaseNs,
         const int64_t currentTimeNs, const sp<StatsPullerManager>& pullerManager,
@@ -192,7 +225,7 @@ optional<sp<MetricProducer>> createGaugeMetricProducerAndUpdateMetadata(
         std::unordered_map<int, std::vector<int>>& activationAtomTrackerToMetricMap,
         std::unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
         std::vector<int>& metricsWithActivation,
-        optional<InvalidConfigReason>& invalidConfigReason);
+        optional<InvalidConfigReason>& invalidConfigReason, bool deferRegistration = false);
 
 // Creates a KllMetricProducer and updates the vectors/maps used by MetricsManager with
 // the appropriate indices. Returns an sp to the producer, or nullopt if there was an error.
@@ -291,6 +324,7 @@ optional<InvalidConfigReason> initAtomMatchingTrackers(
 // [key]: the config key that this config belongs to
 // [config]: the input config
 // [atomMatchingTrackerMap]: AtomMatchingTracker name to index mapping from previous step.
+// [sharedConditions]: if set, shares the state of predicates identical to those of other configs
 // output:
 // [conditionTrackerMap]: this map should contain condition name to index mapping
 // [allConditionTrackers]: stores the sp to all the ConditionTrackers
@@ -304,7 +338,8 @@ optional<InvalidConfigReason> initConditions(
         std::unordered_map<int64_t, int>& conditionTrackerMap,
         std::vector<sp<ConditionTracker>>& allConditionTrackers,
         std::unordered_map<int, std::vector<int>>& trackerToConditionMap,
-        std::vector<ConditionState>& initialConditionCache);
+        std::vector<ConditionState>& initialConditionCache,
+        SharedConditionRegistry* sharedConditions = nullptr);
 
 // Initialize State maps using State protos in the config. These maps will
 // eventually be passed to MetricProducers to initialize their state info.
@@ -355,15 +390,23 @@ optional<InvalidConfigReason> initMetrics(
         std::unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
         std::vector<int>& metricsWithActivation);
 
+// Registers the metrics that slice by state with the StateManager.
+void registerStateListeners(const std::vector<sp<MetricProducer>>& allMetricProducers);
+
 // Initialize alarms
 // Is called both on initialize new configs and config updates since alarms do not have any state.
+// [deferRegistration]: leaves setting the first alarms to AlarmTracker::registerAlarm().
 optional<InvalidConfigReason> initAlarms(const StatsdConfig& config, const ConfigKey& key,
                                          const sp<AlarmMonitor>& periodicAlarmMonitor,
                                          const int64_t timeBaseNs, int64_t currentTimeNs,
-                                         std::vector<sp<AlarmTracker>>& allAlarmTrackers);
+                                         std::vector<sp<AlarmTracker>>& allAlarmTrackers,
+                                         bool deferRegistration = false);
 
 // Initialize MetricsManager from StatsdConfig.
 // Parameters are the members of MetricsManager. See MetricsManager for declaration.
+// [deferRegistration]: leaves registerStateListeners(), the registration for scheduled pulls and
+//                      the first periodic alarms to the caller, for a MetricsManager that is built
+//                      without the lock of the StatsLogProcessor.
 optional<InvalidConfigReason> initStatsdConfig(
         const ConfigKey& key, const StatsdConfig& config, const sp<UidMap>& uidMap,
         const sp<StatsPullerManager>& pullerManager, const sp<AlarmMonitor>& anomalyAlarmMonitor,
@@ -384,7 +427,13 @@ optional<InvalidConfigReason> initStatsdConfig(
         std::unordered_map<int, std::vector<int>>& activationAtomTrackerToMetricMap,
         std::unordered_map<int, std::vector<int>>& deactivationAtomTrackerToMetricMap,
         std::unordered_map<int64_t, int>& alertTrackerMap, std::vector<int>& metricsWithActivation,
-        std::map<int64_t, uint64_t>& stateProtoHashes, std::set<int64_t>& noReportMetricIds);
+        std::map<int64_t, uint64_t>& stateProtoHashes, std::set<int64_t>& noReportMetricIds,
+        SharedConditionRegistry* sharedConditions = nullptr, bool deferRegistration = false);
+
+// Returns the top-level fields of each atom that the matchers, predicates and metrics of config
+// read. Atoms that a metric reports whole, through event metrics and gauge metrics without a
+// fields filter, get kAllFieldsMask.
+AtomFieldMasks computeAtomFieldMasks(const StatsdConfig& config);
 
 }  // namespace statsd
 }  // namespace os
@@ -25,6 +25,16 @@ namespace android {
 namespace os {
 namespace statsd {
 
+// An upgrade or removal of a package, as notified to a PackageInfoListener.
+struct PackageChange {
+    int64_t eventTimeNs;
+    std::string apk;
+    int uid;
+    // The version after the upgrade, unused for removals.
+    int64_t version;
+    bool removed;
+};
+
 class PackageInfoListener : public virtual RefBase {
 public:
     // Uid map will notify this listener that the app with apk name and uid has been upgraded to
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packages/UidIndex.h"
+
+#include <algorithm>
+
+#include "packages/UidMap.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace {
+
+template <typename T>
+void eraseValue(vector<T>& values, const T& value) {
+    values.erase(std::remove(values.begin(), values.end(), value), values.end());
+}
+
+}  // anonymous namespace
+
+const AidIndex& AidIndex::getInstance() {
+    static const AidIndex sInstance(UidMap::sAidToUidMapping);
+    return sInstance;
+}
+
+AidIndex::AidIndex(const map<string, uint32_t>& aidToUid) : mNameByUid(kAppUidStart, nullptr) {
+    for (const auto& [name, uid] : aidToUid) {
+        if (uid >= (uint32_t)kAppUidStart) {
+            continue;
+        }
+        const auto [it, inserted] = mUidByName.emplace(name, (int)uid);
+        if (inserted && mNameByUid[uid] == nullptr) {
+            mNameByUid[uid] = &it->first;
+        }
+    }
+}
+
+const string* AidIndex::getName(int uid) const {
+    if (uid < 0 || uid >= kAppUidStart) {
+        return nullptr;
+    }
+    return mNameByUid[uid];
+}
+
+int AidIndex::getUid(const string& name) const {
+    const auto it = mUidByName.find(name);
+    return it != mUidByName.end() ? it->second : -1;
+}
+
+void AppUidIndex::add(int uid, const InternedString& packageName) {
+    PackageNames& packageNames = mPackageNamesByUid[uid];
+    if (std::find(packageNames.names.begin(), packageNames.names.end(), packageName) !=
+        packageNames.names.end()) {
+        return;
+    }
+    packageNames.names.push_back(packageName);
+    packageNames.normalizedNames.push_back(InternedString(normalizePackageName(packageName)));
+    mUidsByPackageName[packageName].push_back(uid);
+}
+
+void AppUidIndex::remove(int uid, const InternedString& packageName) {
+    auto packageNamesIt = mPackageNamesByUid.find(uid);
+    if (packageNamesIt != mPackageNamesByUid.end()) {
+        PackageNames& packageNames = packageNamesIt->second;
+        const auto nameIt =
+                std::find(packageNames.names.begin(), packageNames.names.end(), packageName);
+        if (nameIt != packageNames.names.end()) {
+            packageNames.normalizedNames.erase(packageNames.normalizedNames.begin() +
+                                               (nameIt - packageNames.names.begin()));
+            packageNames.names.erase(nameIt);
+        }
+        if (packageNames.names.empty()) {
+            mPackageNamesByUid.erase(packageNamesIt);
+        }
+    }
+    auto uidsIt = mUidsByPackageName.find(packageName);
+    if (uidsIt != mUidsByPackageName.end()) {
+        eraseValue(uidsIt->second, (int32_t)uid);
+        if (uidsIt->second.empty()) {
+            mUidsByPackageName.erase(uidsIt);
+        }
+    }
+}
+
+void AppUidIndex::clear() {
+    mPackageNamesByUid.clear();
+    mUidsByPackageName.clear();
+}
+
+const vector<InternedString>& AppUidIndex::getPackageNames(int uid) const {
+    static const vector<InternedString> kEmpty;
+    const auto it = mPackageNamesByUid.find(uid);
+    return it != mPackageNamesByUid.end() ? it->second.names : kEmpty;
+}
+
+const vector<InternedString>& AppUidIndex::getNormalizedPackageNames(int uid) const {
+    static const vector<InternedString> kEmpty;
+    const auto it = mPackageNamesByUid.find(uid);
+    return it != mPackageNamesByUid.end() ? it->second.normalizedNames : kEmpty;
+}
+
+string AppUidIndex::normalizePackageName(const string& packageName) {
+    string normalizedName = packageName;
+    std::transform(normalizedName.begin(), normalizedName.end(), normalizedName.begin(), ::tolower);
+    return normalizedName;
+}
+
+const vector<int32_t>& AppUidIndex::getUids(const InternedString& packageName) const {
+    static const vector<int32_t> kEmpty;
+    const auto it = mUidsByPackageName.find(packageName);
+    return it != mUidsByPackageName.end() ? it->second : kEmpty;
+}
+
+namespace {
+
+bool isolatedUidLess(const std::pair<int, int>& entry, int isolatedUid) {
+    return entry.first < isolatedUid;
+}
+
+}  // anonymous namespace
+
+int IsolatedUidTable::getHostUidOrSelf(int uid) const {
+    const auto it = std::lower_bound(mHostUids.begin(), mHostUids.end(), uid, isolatedUidLess);
+    return it != mHostUids.end() && it->first == uid ? it->second : uid;
+}
+
+void IsolatedUidTable::assign(int isolatedUid, int hostUid) {
+    const auto it =
+            std::lower_bound(mHostUids.begin(), mHostUids.end(), isolatedUid, isolatedUidLess);
+    if (it != mHostUids.end() && it->first == isolatedUid) {
+        it->second = hostUid;
+    } else {
+        mHostUids.insert(it, {isolatedUid, hostUid});
+    }
+}
+
+void IsolatedUidTable::remove(int isolatedUid) {
+    const auto it =
+            std::lower_bound(mHostUids.begin(), mHostUids.end(), isolatedUid, isolatedUidLess);
+    if (it != mHostUids.end() && it->first == isolatedUid) {
+        mHostUids.erase(it);
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utils/StringPool.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Bidirectional lookup between AID names (eg. AID_SYSTEM) and their uids. AIDs are all below the
+ * first app uid, so uid to name is a dense array lookup and name to uid a hash lookup. Immutable
+ * once built, so lookups take no lock.
+ */
+class AidIndex {
+public:
+    // App uids start from here (AID_APP_START) and never have an AID name.
+    static const int kAppUidStart = 10000;
+
+    // The index over UidMap::sAidToUidMapping.
+    static const AidIndex& getInstance();
+
+    // Entries with a uid at or above kAppUidStart are ignored. If several names map to the same
+    // uid, the first one in name order is the name of that uid.
+    explicit AidIndex(const std::map<std::string, uint32_t>& aidToUid);
+
+    // Returns the AID name of uid, or nullptr if uid has none.
+    const std::string* getName(int uid) const;
+
+    // Returns the uid of the AID name, or -1 if there is no such AID.
+    int getUid(const std::string& name) const;
+
+private:
+    std::unordered_map<std::string, int> mUidByName;
+
+    // Indexed by uid, points to the key in mUidByName, or nullptr for uids without an AID.
+    std::vector<const std::string*> mNameByUid;
+};
+
+/**
+ * Bidirectional index between uids and the package names installed under them. Only holds apps
+ * that are currently installed. Not thread safe: UidMap keeps it in step with its map under its
+ * own lock.
+ */
+class AppUidIndex {
+public:
+    // Adding an app that is already present is a no-op.
+    void add(int uid, const InternedString& packageName);
+
+    void remove(int uid, const InternedString& packageName);
+
+    void clear();
+
+    // Returns the packages installed under uid, in installation order.
+    const std::vector<InternedString>& getPackageNames(int uid) const;
+
+    // Returns the lower-cased names of the packages installed under uid, in the same order as
+    // getPackageNames(). Normalized once when the app is added rather than on every lookup.
+    const std::vector<InternedString>& getNormalizedPackageNames(int uid) const;
+
+    // Returns packageName in lower case, the form package names are compared in by metrics.
+    static std::string normalizePackageName(const std::string& packageName);
+
+    // Returns the uids that have packageName installed, in installation order.
+    const std::vector<int32_t>& getUids(const InternedString& packageName) const;
+
+private:
+    struct PackageNames {
+        std::vector<InternedString> names;
+        std::vector<InternedString> normalizedNames;
+    };
+
+    std::unordered_map<int, PackageNames> mPackageNamesByUid;
+
+    std::unordered_map<InternedString, std::vector<int32_t>> mUidsByPackageName;
+};
+
+/**
+ * Flat map from isolated uids to their host uids, kept sorted by isolated uid. UidMap publishes
+ * immutable copies of it so that lookups need no lock.
+ */
+class IsolatedUidTable {
+public:
+    // Returns the host uid of uid if it is an isolated uid, and uid otherwise.
+    int getHostUidOrSelf(int uid) const;
+
+    void assign(int isolatedUid, int hostUid);
+
+    void remove(int isolatedUid);
+
+    size_t size() const {
+        return mHostUids.size();
+    }
+
+private:
+    // (isolated uid, host uid) pairs.
+    std::vector<std::pair<int, int>> mHostUids;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
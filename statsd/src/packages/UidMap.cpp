@@ -70,7 +70,28 @@ const int FIELD_ID_CHANGE_PREV_VERSION_STRING = 9;
 const int FIELD_ID_CHANGE_NEW_VERSION_STRING_HASH = 10;
 const int FIELD_ID_CHANGE_PREV_VERSION_STRING_HASH = 11;
 
-UidMap::UidMap() : mBytesUsed(0) {
+namespace {
+
+// Source of UidMap::mIsolatedUidsVersion values.
+std::atomic<uint64_t> sIsolatedUidsVersionCounter(0);
+
+// The isolated uid table this thread last read, and the map and version it belongs to.
+struct IsolatedUidsSnapshot {
+    const UidMap* owner = nullptr;
+    uint64_t version = 0;
+    std::shared_ptr<const IsolatedUidTable> table;
+};
+
+thread_local IsolatedUidsSnapshot tIsolatedUidsSnapshot;
+
+}  // anonymous namespace
+
+UidMap::UidMap()
+    : mIsolatedUids(std::make_shared<IsolatedUidTable>()),
+      mIsolatedUidsVersion(++sIsolatedUidsVersionCounter),
+      mChanges(StatsdStats::kMaxBytesUsedUidMap / kBytesChangeRecord),
+      mDeletedApps(StatsdStats::kMaxDeletedAppsInUidMap + 1),
+      mBytesUsed(0) {
 }
 
 UidMap::~UidMap() {}
@@ -83,27 +104,22 @@ sp<UidMap> UidMap::getInstance() {
 bool UidMap::hasApp(int uid, const string& packageName) const {
     lock_guard<mutex> lock(mMutex);
 
-    auto it = mMap.find(std::make_pair(uid, packageName));
+    auto it = mMap.find(std::make_pair(uid, InternedString(packageName)));
     return it != mMap.end() && !it->second.deleted;
 }
 
-string UidMap::normalizeAppName(const string& appName) const {
-    string normalizedName = appName;
-    std::transform(normalizedName.begin(), normalizedName.end(), normalizedName.begin(), ::tolower);
-    return normalizedName;
-}
-
 std::set<string> UidMap::getAppNamesFromUid(const int32_t uid, bool returnNormalized) const {
     lock_guard<mutex> lock(mMutex);
     return getAppNamesFromUidLocked(uid,returnNormalized);
 }
 
 std::set<string> UidMap::getAppNamesFromUidLocked(const int32_t uid, bool returnNormalized) const {
+    const vector<InternedString>& packageNames = returnNormalized
+                                                         ? mAppIndex.getNormalizedPackageNames(uid)
+                                                         : mAppIndex.getPackageNames(uid);
     std::set<string> names;
-    for (const auto& kv : mMap) {
-        if (kv.first.first == uid && !kv.second.deleted) {
-            names.insert(returnNormalized ? normalizeAppName(kv.first.second) : kv.first.second);
-        }
+    for (const InternedString& packageName : packageNames) {
+        names.insert(packageName.str());
     }
     return names;
 }
@@ -111,7 +127,7 @@ std::set<string> UidMap::getAppNamesFromUidLocked(const int32_t uid, bool return
 int64_t UidMap::getAppVersion(int uid, const string& packageName) const {
     lock_guard<mutex> lock(mMutex);
 
-    auto it = mMap.find(std::make_pair(uid, packageName));
+    auto it = mMap.find(std::make_pair(uid, InternedString(packageName)));
     if (it == mMap.end() || it->second.deleted) {
         return 0;
     }
@@ -120,33 +136,42 @@ int64_t UidMap::getAppVersion(int uid, const string& packageName) const {
 
 void UidMap::updateMap(const int64_t timestamp, const UidData& uidData) {
     wp<PackageInfoListener> broadcast = NULL;
+
+    // The new map and its index are built before taking the lock, which is then only held to
+    // carry the deleted apps over and swap them in. Lookups from the event path are not held up
+    // by the hundreds of packages of a full update.
+    std::unordered_map<std::pair<int, InternedString>, AppData, PairHash> newMap;
+    newMap.reserve(uidData.app_info_size());
+    for (const auto& appInfo : uidData.app_info()) {
+        newMap[std::make_pair(appInfo.uid(), InternedString(appInfo.package_name()))] =
+                AppData(appInfo.version(), appInfo.version_string(), appInfo.installer(),
+                        appInfo.certificate_hash());
+    }
+    AppUidIndex newIndex;
+    for (const auto& [keyPair, appData] : newMap) {
+        newIndex.add(keyPair.first, keyPair.second);
+    }
+
     {
         lock_guard<mutex> lock(mMutex);  // Exclusively lock for updates.
 
-        std::unordered_map<std::pair<int, string>, AppData, PairHash> deletedApps;
-
-        // Copy all the deleted apps.
-        for (const auto& kv : mMap) {
-            if (kv.second.deleted) {
-                deletedApps[kv.first] = kv.second;
+        for (const auto& [keyPair, appData] : mMap) {
+            if (!appData.deleted) {
+                continue;
             }
-        }
-
-        mMap.clear();
-        for (const auto& appInfo : uidData.app_info()) {
-            mMap[std::make_pair(appInfo.uid(), appInfo.package_name())] =
-                    AppData(appInfo.version(), appInfo.version_string(), appInfo.installer(),
-                            appInfo.certificate_hash());
-        }
-
-        for (const auto& kv : deletedApps) {
-            auto mMapIt = mMap.find(kv.first);
-            if (mMapIt != mMap.end()) {
+            auto newMapIt = newMap.find(keyPair);
+            if (newMapIt != newMap.end()) {
                 // Insert this deleted app back into the current map.
-                mMap[kv.first] = kv.second;
+                newMapIt->second = appData;
+                newIndex.remove(keyPair.first, keyPair.second);
             }
         }
 
+        // The previous map is left in newMap, to be freed once the lock is released.
+        mMap.swap(newMap);
+        mAppIndex = std::move(newIndex);
+
+        mGeneration.fetch_add(1, std::memory_order_release);
         ensureBytesUsedBelowLimit();
         StatsdStats::getInstance().setCurrentUidMapMemory(mBytesUsed);
         broadcast = mSubscriber;
@@ -171,7 +196,7 @@ void UidMap::updateApp(const int64_t timestamp, const string& appName, const int
         lock_guard<mutex> lock(mMutex);
         int32_t prevVersion = 0;
         string prevVersionString = "";
-        auto key = std::make_pair(uid, appName);
+        auto key = std::make_pair(uid, InternedString(appName));
         auto it = mMap.find(key);
         if (it != mMap.end()) {
             prevVersion = it->second.versionCode;
@@ -191,13 +216,11 @@ void UidMap::updateApp(const int64_t timestamp, const string& appName, const int
             // Otherwise, we need to add an app at this uid.
             mMap[key] = AppData(versionCode, versionString, installer, certificateHashString);
         }
+        mAppIndex.add(uid, key.second);
+        mGeneration.fetch_add(1, std::memory_order_release);
 
-        mChanges.emplace_back(false, timestamp, appName, uid, versionCode, versionString,
-                              prevVersion, prevVersionString);
-        mBytesUsed += kBytesChangeRecord;
-        ensureBytesUsedBelowLimit();
-        StatsdStats::getInstance().setCurrentUidMapMemory(mBytesUsed);
-        StatsdStats::getInstance().setUidMapChanges(mChanges.size());
+        addChangeLocked(ChangeRecord(false, timestamp, appName, uid, versionCode, versionString,
+                                     prevVersion, prevVersionString));
     }
 
     auto strongPtr = broadcast.promote();
@@ -213,14 +236,28 @@ void UidMap::ensureBytesUsedBelowLimit() {
     } else {
         limit = maxBytesOverride;
     }
-    while (mBytesUsed > limit) {
-        ALOGI("Bytes used %zu is above limit %zu, need to delete something", mBytesUsed, limit);
-        if (mChanges.size() > 0) {
-            mBytesUsed -= kBytesChangeRecord;
-            mChanges.pop_front();
-            StatsdStats::getInstance().noteUidMapDropped(1);
-        }
+    if (mBytesUsed <= limit) {
+        return;
     }
+    ALOGI("Bytes used %zu is above limit %zu, need to delete something", mBytesUsed, limit);
+    // Every record takes kBytesChangeRecord, so the number to drop is known up front.
+    const size_t toDrop = std::min(
+            mChanges.size(), (mBytesUsed - limit + kBytesChangeRecord - 1) / kBytesChangeRecord);
+    mChanges.pop_front(toDrop);
+    mBytesUsed -= toDrop * kBytesChangeRecord;
+    StatsdStats::getInstance().noteUidMapDropped(toDrop);
+}
+
+void UidMap::addChangeLocked(ChangeRecord record) {
+    if (mChanges.push_back(std::move(record))) {
+        mBytesUsed += kBytesChangeRecord;
+    } else {
+        // The oldest record was overwritten.
+        StatsdStats::getInstance().noteUidMapDropped(1);
+    }
+    ensureBytesUsedBelowLimit();
+    StatsdStats::getInstance().setCurrentUidMapMemory(mBytesUsed);
+    StatsdStats::getInstance().setUidMapChanges(mChanges.size());
 }
 
 void UidMap::removeApp(const int64_t timestamp, const string& app, const int32_t uid) {
@@ -230,26 +267,26 @@ void UidMap::removeApp(const int64_t timestamp, const string& app, const int32_t
 
         int64_t prevVersion = 0;
         string prevVersionString = "";
-        auto key = std::make_pair(uid, app);
+        auto key = std::make_pair(uid, InternedString(app));
         auto it = mMap.find(key);
         if (it != mMap.end() && !it->second.deleted) {
             prevVersion = it->second.versionCode;
             prevVersionString = it->second.versionString;
             it->second.deleted = true;
             mDeletedApps.push_back(key);
+            mAppIndex.remove(uid, key.second);
         }
         if (mDeletedApps.size() > StatsdStats::kMaxDeletedAppsInUidMap) {
             // Delete the oldest one.
-            auto oldest = mDeletedApps.front();
+            const auto oldest = std::move(mDeletedApps.front());
             mDeletedApps.pop_front();
             mMap.erase(oldest);
+            mAppIndex.remove(oldest.first, oldest.second);
             StatsdStats::getInstance().noteUidMapAppDeletionDropped();
         }
-        mChanges.emplace_back(true, timestamp, app, uid, 0, "", prevVersion, prevVersionString);
-        mBytesUsed += kBytesChangeRecord;
-        ensureBytesUsedBelowLimit();
-        StatsdStats::getInstance().setCurrentUidMapMemory(mBytesUsed);
-        StatsdStats::getInstance().setUidMapChanges(mChanges.size());
+        mGeneration.fetch_add(1, std::memory_order_release);
+        addChangeLocked(
+                ChangeRecord(true, timestamp, app, uid, 0, "", prevVersion, prevVersionString));
         broadcast = mSubscriber;
     }
 
@@ -267,26 +304,52 @@ void UidMap::setListener(const wp<PackageInfoListener>& listener) {
 void UidMap::assignIsolatedUid(int isolatedUid, int parentUid) {
     lock_guard<mutex> lock(mIsolatedMutex);
 
-    mIsolatedUidMap[isolatedUid] = parentUid;
+    auto table = std::make_shared<IsolatedUidTable>(*mIsolatedUids);
+    table->assign(isolatedUid, parentUid);
+    publishIsolatedUidsLocked(std::move(table));
 }
 
 void UidMap::removeIsolatedUid(int isolatedUid) {
     lock_guard<mutex> lock(mIsolatedMutex);
 
-    auto it = mIsolatedUidMap.find(isolatedUid);
-    if (it != mIsolatedUidMap.end()) {
-        mIsolatedUidMap.erase(it);
+    if (mIsolatedUids->getHostUidOrSelf(isolatedUid) == isolatedUid) {
+        return;
     }
+    auto table = std::make_shared<IsolatedUidTable>(*mIsolatedUids);
+    table->remove(isolatedUid);
+    publishIsolatedUidsLocked(std::move(table));
+}
+
+void UidMap::publishIsolatedUidsLocked(std::shared_ptr<const IsolatedUidTable> table) {
+    mIsolatedUids = std::move(table);
+    mIsolatedUidsVersion.store(++sIsolatedUidsVersionCounter, std::memory_order_release);
+}
+
+const IsolatedUidTable& UidMap::getIsolatedUids() const {
+    IsolatedUidsSnapshot& snapshot = tIsolatedUidsSnapshot;
+    if (snapshot.owner != this ||
+        snapshot.version != mIsolatedUidsVersion.load(std::memory_order_acquire)) {
+        lock_guard<mutex> lock(mIsolatedMutex);
+        snapshot.owner = this;
+        snapshot.version = mIsolatedUidsVersion.load(std::memory_order_relaxed);
+        snapshot.table = mIsolatedUids;
+    }
+    return *snapshot.table;
 }
 
 int UidMap::getHostUidOrSelf(int uid) const {
-    lock_guard<mutex> lock(mIsolatedMutex);
+    return getIsolatedUids().getHostUidOrSelf(uid);
+}
 
-    auto it = mIsolatedUidMap.find(uid);
-    if (it != mIsolatedUidMap.end()) {
-        return it->second;
+void UidMap::mapAttributionUidsToHostUids(vector<FieldValue>* values, size_t first,
+                                          size_t last) const {
+    const IsolatedUidTable& isolatedUids = getIsolatedUids();
+    for (size_t i = first; i <= last; i++) {
+        FieldValue& fieldValue = (*values)[i];
+        if (isAttributionUidField(fieldValue)) {
+            fieldValue.mValue.setInt(isolatedUids.getHostUidOrSelf(fieldValue.mValue.int_value));
+        }
     }
-    return uid;
 }
 
 void UidMap::clearOutput() {
@@ -316,7 +379,7 @@ size_t UidMap::getBytesUsed() const {
 void UidMap::writeUidMapSnapshot(int64_t timestamp, bool includeVersionStrings,
                                  bool includeInstaller, const uint8_t truncatedCertificateHashSize,
                                  const std::set<int32_t>& interestingUids,
-                                 map<string, int>* installerIndices, std::set<string>* str_set,
+                                 map<string, int>* installerIndices, StringSet* str_set,
                                  ProtoOutputStream* proto) const {
     lock_guard<mutex> lock(mMutex);
 
@@ -330,10 +393,19 @@ void UidMap::writeUidMapSnapshotLocked(const int64_t timestamp, const bool inclu
                                        const uint8_t truncatedCertificateHashSize,
                                        const std::set<int32_t>& interestingUids,
                                        map<string, int>* installerIndices,
-                                       std::set<string>* str_set, ProtoOutputStream* proto) const {
+                                       StringSet* str_set, ProtoOutputStream* proto) const {
+    proto->write(FIELD_TYPE_INT64 | FIELD_ID_SNAPSHOT_TIMESTAMP, (long long)timestamp);
+    writePackageInfosLocked(includeVersionStrings, includeInstaller, truncatedCertificateHashSize,
+                            interestingUids, installerIndices, str_set, proto);
+}
+
+void UidMap::writePackageInfosLocked(const bool includeVersionStrings, const bool includeInstaller,
+                                     const uint8_t truncatedCertificateHashSize,
+                                     const std::set<int32_t>& interestingUids,
+                                     map<string, int>* installerIndices, StringSet* str_set,
+                                     ProtoOutputStream* proto) const {
     int curInstallerIndex = 0;
 
-    proto->write(FIELD_TYPE_INT64 | FIELD_ID_SNAPSHOT_TIMESTAMP, (long long)timestamp);
     for (const auto& [keyPair, appData] : mMap) {
         const auto& [uid, packageName] = keyPair;
         if (!interestingUids.empty() && interestingUids.find(uid) == interestingUids.end()) {
@@ -408,13 +480,57 @@ void UidMap::writeUidMapSnapshotLocked(const int64_t timestamp, const bool inclu
     }
 }
 
+const UidMap::EncodedSnapshot& UidMap::getEncodedSnapshotLocked(
+        const bool includeVersionStrings, const bool includeInstaller,
+        const uint8_t truncatedCertificateHashSize, const bool hashStrings) {
+    const uint64_t generation = mGeneration.load(std::memory_order_relaxed);
+    if (mEncodedSnapshotsGeneration != generation) {
+        mEncodedSnapshots.clear();
+        mEncodedSnapshotsGeneration = generation;
+    }
+    for (const EncodedSnapshot& encodedSnapshot : mEncodedSnapshots) {
+        if (encodedSnapshot.includeVersionStrings == includeVersionStrings &&
+            encodedSnapshot.includeInstaller == includeInstaller &&
+            encodedSnapshot.truncatedCertificateHashSize == truncatedCertificateHashSize &&
+            encodedSnapshot.hashStrings == hashStrings) {
+            return encodedSnapshot;
+        }
+    }
+
+    if (mEncodedSnapshots.size() >= kMaxEncodedSnapshots) {
+        mEncodedSnapshots.clear();
+    }
+    EncodedSnapshot& encodedSnapshot = mEncodedSnapshots.emplace_back();
+    encodedSnapshot.includeVersionStrings = includeVersionStrings;
+    encodedSnapshot.includeInstaller = includeInstaller;
+    encodedSnapshot.truncatedCertificateHashSize = truncatedCertificateHashSize;
+    encodedSnapshot.hashStrings = hashStrings;
+
+    map<string, int> installerIndices;
+    StringSet strings;
+    ProtoOutputStream packageInfosProto;
+    writePackageInfosLocked(includeVersionStrings, includeInstaller, truncatedCertificateHashSize,
+                            std::set<int32_t>() /*empty uid set means including every uid*/,
+                            &installerIndices, hashStrings ? &strings : nullptr,
+                            &packageInfosProto);
+    packageInfosProto.serializeToVector(&encodedSnapshot.packageInfos);
+    encodedSnapshot.strings.assign(strings.begin(), strings.end());
+    encodedSnapshot.installers.resize(installerIndices.size());
+    for (const auto& [installer, index] : installerIndices) {
+        // index is guaranteed to be < installers.size().
+        encodedSnapshot.installers[index] = installer;
+    }
+    return encodedSnapshot;
+}
+
 void UidMap::appendUidMap(const int64_t timestamp, const ConfigKey& key,
                           const bool includeVersionStrings, const bool includeInstaller,
-                          const uint8_t truncatedCertificateHashSize, std::set<string>* str_set,
-                          ProtoOutputStream* proto) {
+                          const uint8_t truncatedCertificateHashSize, StringSet* str_set,
+                          ProtoOutputStream* proto, const bool omitUnchangedSnapshot) {
     lock_guard<mutex> lock(mMutex);  // Lock for updates
 
-    for (const ChangeRecord& record : mChanges) {
+    for (size_t i = 0; i < mChanges.size(); i++) {
+        const ChangeRecord& record = mChanges[i];
         if (record.timestampNs > mLastUpdatePerConfigKey[key]) {
             uint64_t changesToken =
                     proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_CHANGES);
@@ -451,26 +567,37 @@ void UidMap::appendUidMap(const int64_t timestamp, const ConfigKey& key,
         }
     }
 
-    map<string, int> installerIndices;
-
-    // Write snapshot from current uid map state.
-    uint64_t snapshotsToken =
-            proto->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_SNAPSHOTS);
-    writeUidMapSnapshotLocked(timestamp, includeVersionStrings, includeInstaller,
-                              truncatedCertificateHashSize,
-                              std::set<int32_t>() /*empty uid set means including every uid*/,
-                              &installerIndices, str_set, proto);
-    proto->end(snapshotsToken);
+    if (omitUnchangedSnapshot) {
+        const uint64_t generation = mGeneration.load(std::memory_order_relaxed);
+        const auto [it, inserted] = mSnapshotGenerationPerConfigKey.try_emplace(key, generation);
+        if (!inserted && it->second == generation) {
+            // The receiver already has this snapshot.
+            recordOutputLocked(timestamp, key);
+            return;
+        }
+        it->second = generation;
+    }
 
-    vector<string> installers(installerIndices.size(), "");
-    for (const auto& [installer, index] : installerIndices) {
-        // index is guaranteed to be < installers.size().
-        installers[index] = installer;
+    // Write snapshot from current uid map state. Only the timestamp differs between reports
+    // until the map changes, so the package infos are encoded once and reused.
+    const EncodedSnapshot& encodedSnapshot =
+            getEncodedSnapshotLocked(includeVersionStrings, includeInstaller,
+                                     truncatedCertificateHashSize, str_set != nullptr);
+    if (str_set != nullptr) {
+        str_set->insert(encodedSnapshot.strings.begin(), encodedSnapshot.strings.end());
     }
+    ProtoOutputStream snapshotProto;
+    snapshotProto.write(FIELD_TYPE_INT64 | FIELD_ID_SNAPSHOT_TIMESTAMP, (long long)timestamp);
+    vector<uint8_t> snapshotBytes;
+    snapshotProto.serializeToVector(&snapshotBytes);
+    snapshotBytes.insert(snapshotBytes.end(), encodedSnapshot.packageInfos.begin(),
+                         encodedSnapshot.packageInfos.end());
+    proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_SNAPSHOTS,
+                 reinterpret_cast<const char*>(snapshotBytes.data()), snapshotBytes.size());
 
     if (includeInstaller) {
         // Write installer list; either strings or hashes.
-        for (const string& installerName : installers) {
+        for (const string& installerName : encodedSnapshot.installers) {
             if (str_set == nullptr) {  // Strings not hashed
                 proto->write(FIELD_TYPE_STRING | FIELD_COUNT_REPEATED | FIELD_ID_INSTALLER_NAME,
                              installerName);
@@ -480,7 +607,10 @@ void UidMap::appendUidMap(const int64_t timestamp, const ConfigKey& key,
             }
         }
     }
+    recordOutputLocked(timestamp, key);
+}
 
+void UidMap::recordOutputLocked(const int64_t timestamp, const ConfigKey& key) {
     int64_t prevMin = getMinimumTimestampNs();
     mLastUpdatePerConfigKey[key] = timestamp;
     int64_t newMin = getMinimumTimestampNs();
@@ -488,14 +618,10 @@ void UidMap::appendUidMap(const int64_t timestamp, const ConfigKey& key,
     if (newMin > prevMin) {  // Delete anything possible now that the minimum has
                              // moved forward.
         int64_t cutoff_nanos = newMin;
-        for (auto it_changes = mChanges.begin(); it_changes != mChanges.end();) {
-            if (it_changes->timestampNs < cutoff_nanos) {
-                mBytesUsed -= kBytesChangeRecord;
-                it_changes = mChanges.erase(it_changes);
-            } else {
-                ++it_changes;
-            }
-        }
+        const size_t erased = mChanges.eraseIf([cutoff_nanos](const ChangeRecord& record) {
+            return record.timestampNs < cutoff_nanos;
+        });
+        mBytesUsed -= erased * kBytesChangeRecord;
     }
     StatsdStats::getInstance().setCurrentUidMapMemory(mBytesUsed);
     StatsdStats::getInstance().setUidMapChanges(mChanges.size());
@@ -523,22 +649,19 @@ void UidMap::printUidMap(int out, bool includeCertificateHash) const {
 
 void UidMap::OnConfigUpdated(const ConfigKey& key) {
     mLastUpdatePerConfigKey[key] = -1;
+    mSnapshotGenerationPerConfigKey.erase(key);
 }
 
 void UidMap::OnConfigRemoved(const ConfigKey& key) {
     mLastUpdatePerConfigKey.erase(key);
+    mSnapshotGenerationPerConfigKey.erase(key);
 }
 
 set<int32_t> UidMap::getAppUid(const string& package) const {
     lock_guard<mutex> lock(mMutex);
 
-    set<int32_t> results;
-    for (const auto& kv : mMap) {
-        if (kv.first.second == package && !kv.second.deleted) {
-            results.insert(kv.first.first);
-        }
-    }
-    return results;
+    const vector<int32_t>& uids = mAppIndex.getUids(InternedString(package));
+    return set<int32_t>(uids.begin(), uids.end());
 }
 
 // Note not all the following AIDs are used as uids. Some are used only for gids.
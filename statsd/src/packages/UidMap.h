@@ -22,6 +22,7 @@
 #include <utils/RefBase.h>
 #include <utils/String16.h>
 
+#include <atomic>
 #include <list>
 #include <mutex>
 #include <set>
@@ -30,7 +31,10 @@
 
 #include "config/ConfigKey.h"
 #include "packages/PackageInfoListener.h"
+#include "packages/UidIndex.h"
 #include "stats_util.h"
+#include "utils/RingBuffer.h"
+#include "utils/StringPool.h"
 
 using namespace android;
 using namespace std;
@@ -63,27 +67,32 @@ struct AppData {
 
 // When calling appendUidMap, we retrieve all the ChangeRecords since the last
 // timestamp we called appendUidMap for this configuration key.
+// The strings are interned, so a record is a fixed size whatever the package and version names.
 struct ChangeRecord {
-    const bool deletion;
-    const int64_t timestampNs;
-    const string package;
-    const int32_t uid;
-    const int64_t version;
-    const int64_t prevVersion;
-    const string versionString;
-    const string prevVersionString;
+    int64_t timestampNs = 0;
+    int64_t version = 0;
+    int64_t prevVersion = 0;
+    InternedString package;
+    InternedString versionString;
+    InternedString prevVersionString;
+    int32_t uid = 0;
+    bool deletion = false;
+
+    // Empty constructor needed for the ring buffer slots.
+    ChangeRecord() {
+    }
 
     ChangeRecord(const bool isDeletion, int64_t timestampNs, const string& package,
                  const int32_t uid, int64_t version, const string& versionString,
                  const int64_t prevVersion, const string& prevVersionString)
-        : deletion(isDeletion),
-          timestampNs(timestampNs),
-          package(package),
-          uid(uid),
+        : timestampNs(timestampNs),
           version(version),
           prevVersion(prevVersion),
+          package(package),
           versionString(versionString),
-          prevVersionString(prevVersionString) {
+          prevVersionString(prevVersionString),
+          uid(uid),
+          deletion(isDeletion) {
     }
 };
 
@@ -114,6 +123,13 @@ public:
 
     int64_t getAppVersion(int uid, const string& packageName) const;
 
+    // Returns a counter that changes whenever the set of apps changes, including installs that
+    // do not notify the PackageInfoListener. Callers memoizing lookups by uid compare it to know
+    // when their results are stale.
+    uint64_t getGeneration() const {
+        return mGeneration.load(std::memory_order_acquire);
+    }
+
     // Helper for debugging contents of this uid map. Can be triggered with:
     // adb shell cmd stats print-uid-map [--with_certificate_hash]
     void printUidMap(int outFd, bool includeCertificateHash) const;
@@ -135,12 +151,20 @@ public:
     // Returns the host uid if it exists. Otherwise, returns the same uid that was passed-in.
     virtual int getHostUidOrSelf(int uid) const;
 
+    // Replaces the uids in the attribution chain at values[first..last] with their host uids,
+    // reading one snapshot of the isolated uids for the whole chain.
+    virtual void mapAttributionUidsToHostUids(vector<FieldValue>* values, size_t first,
+                                              size_t last) const;
+
     // Gets all snapshots and changes that have occurred since the last output.
     // If every config key has received a change or snapshot record, then this
     // record is deleted.
+    // With omitUnchangedSnapshot, the snapshot and the installers are left out when the map has
+    // not changed since the last snapshot appended for key.
     void appendUidMap(int64_t timestamp, const ConfigKey& key, const bool includeVersionStrings,
                       const bool includeInstaller, const uint8_t truncatedCertificateHashSize,
-                      std::set<string>* str_set, ProtoOutputStream* proto);
+                      StringSet* str_set, ProtoOutputStream* proto,
+                      const bool omitUnchangedSnapshot = false);
 
     // Forces the output to be cleared. We still generate a snapshot based on the current state.
     // This results in extra data uploaded but helps us reconstruct the uid mapping on the server
@@ -160,69 +184,134 @@ public:
     void writeUidMapSnapshot(int64_t timestamp, bool includeVersionStrings, bool includeInstaller,
                              const uint8_t truncatedCertificateHashSize,
                              const std::set<int32_t>& interestingUids,
-                             std::map<string, int>* installerIndices, std::set<string>* str_set,
+                             std::map<string, int>* installerIndices, StringSet* str_set,
                              ProtoOutputStream* proto) const;
 
 private:
     std::set<string> getAppNamesFromUidLocked(int32_t uid, bool returnNormalized) const;
-    string normalizeAppName(const string& appName) const;
 
     void writeUidMapSnapshotLocked(const int64_t timestamp, const bool includeVersionStrings,
                                    const bool includeInstaller,
                                    const uint8_t truncatedCertificateHashSize,
                                    const std::set<int32_t>& interestingUids,
                                    std::map<string, int>* installerIndices,
-                                   std::set<string>* str_set, ProtoOutputStream* proto) const;
+                                   StringSet* str_set, ProtoOutputStream* proto) const;
+
+    // Writes the package infos of a snapshot, without its timestamp.
+    void writePackageInfosLocked(const bool includeVersionStrings, const bool includeInstaller,
+                                 const uint8_t truncatedCertificateHashSize,
+                                 const std::set<int32_t>& interestingUids,
+                                 std::map<string, int>* installerIndices,
+                                 StringSet* str_set, ProtoOutputStream* proto) const;
+
+    // The package infos of the full snapshot as encoded for one combination of report options.
+    struct EncodedSnapshot {
+        bool includeVersionStrings;
+        bool includeInstaller;
+        uint8_t truncatedCertificateHashSize;
+        bool hashStrings;
+        std::vector<uint8_t> packageInfos;
+        // Strings whose hashes are in packageInfos, added to the report's string set.
+        std::vector<string> strings;
+        // Installers in the order of the indices written in packageInfos.
+        std::vector<string> installers;
+    };
+
+    // Configs rarely use more than a couple of option combinations.
+    static const size_t kMaxEncodedSnapshots = 8;
+
+    // Returns the encoded full snapshot for these options, encoding it if mMap has changed
+    // since it was last encoded.
+    const EncodedSnapshot& getEncodedSnapshotLocked(const bool includeVersionStrings,
+                                                    const bool includeInstaller,
+                                                    const uint8_t truncatedCertificateHashSize,
+                                                    const bool hashStrings);
 
     mutable mutex mMutex;
     mutable mutex mIsolatedMutex;
 
     struct PairHash {
-        size_t operator()(const std::pair<int, string>& p) const noexcept {
-            std::hash<std::string> hash_fn;
-            return hash_fn(std::to_string(p.first) + p.second);
+        size_t operator()(const std::pair<int, InternedString>& p) const noexcept {
+            return p.second.hash() * 31 + std::hash<int>()(p.first);
         }
     };
-    // Maps uid and package name to application data.
-    std::unordered_map<std::pair<int, string>, AppData, PairHash> mMap;
+    // Maps uid and package name to application data. Package names are interned so that the
+    // same names showing up in log events and dimension keys share the storage held here.
+    std::unordered_map<std::pair<int, InternedString>, AppData, PairHash> mMap;
+
+    // Uid to package name index over the apps in mMap that are not deleted, so that looking up
+    // the packages of a uid or the uids of a package does not scan mMap.
+    AppUidIndex mAppIndex;
 
     // Maps isolated uid to the parent uid. Any metrics for an isolated uid will instead contribute
-    // to the parent uid.
-    std::unordered_map<int, int> mIsolatedUidMap;
+    // to the parent uid. Replaced, never modified, under mIsolatedMutex each time an isolated uid
+    // changes, which is rare compared to lookups. Readers keep a per-thread reference to the
+    // current table and only take the lock again when mIsolatedUidsVersion moves on.
+    std::shared_ptr<const IsolatedUidTable> mIsolatedUids;
+
+    // Unique across all UidMap instances, so a thread never mistakes another map's table for
+    // this one's.
+    std::atomic<uint64_t> mIsolatedUidsVersion;
+
+    // Returns the current isolated uid table, without locking if this thread has already seen it.
+    const IsolatedUidTable& getIsolatedUids() const;
+
+    // Publishes table as the new isolated uid table. Requires mIsolatedMutex.
+    void publishIsolatedUidsLocked(std::shared_ptr<const IsolatedUidTable> table);
 
-    // Record the changes that can be provided with the uploads.
-    std::list<ChangeRecord> mChanges;
+    // Record the changes that can be provided with the uploads, oldest first. Holds as many
+    // records as fit in StatsdStats::kMaxBytesUsedUidMap.
+    RingBuffer<ChangeRecord> mChanges;
 
-    // Store which uid and apps represent deleted ones.
-    std::list<std::pair<int, string>> mDeletedApps;
+    // Store which uid and apps represent deleted ones, oldest first.
+    RingBuffer<std::pair<int, InternedString>> mDeletedApps;
 
     // Notify StatsLogProcessor if there's an upgrade/removal in any app.
     wp<PackageInfoListener> mSubscriber;
 
+    // Bumped under mMutex on every change to mMap.
+    std::atomic<uint64_t> mGeneration = 0;
+
+    // Snapshots encoded by appendUidMap since mMap was at mEncodedSnapshotsGeneration.
+    std::vector<EncodedSnapshot> mEncodedSnapshots;
+    uint64_t mEncodedSnapshotsGeneration = 0;
+
     // Mapping of config keys we're aware of to the epoch time they last received an update. This
     // lets us know it's safe to delete events older than the oldest update. The value is nanosec.
     // Value of -1 denotes this config key has never received an upload.
     std::unordered_map<ConfigKey, int64_t> mLastUpdatePerConfigKey;
 
+    // Value of mGeneration when the last snapshot was appended for each config that omits
+    // unchanged snapshots.
+    std::unordered_map<ConfigKey, uint64_t> mSnapshotGenerationPerConfigKey;
+
     // Returns the minimum value from mConfigKeys.
     int64_t getMinimumTimestampNs();
 
-    // If our current used bytes is above the limit, then we clear out the earliest snapshot. If
-    // there are no more snapshots, then we clear out the earliest delta. We repeat the deletions
-    // until the memory consumed by mOutput is below the specified limit.
+    // Records that key received the changes up to timestamp, and drops the changes every config
+    // has received.
+    void recordOutputLocked(const int64_t timestamp, const ConfigKey& key);
+
+    // If our current used bytes is above the limit, then we clear out as many of the earliest
+    // deltas as needed for the memory consumed by mChanges to be below the specified limit.
     void ensureBytesUsedBelowLimit();
 
+    // Appends record to mChanges and enforces the memory limit.
+    void addChangeLocked(ChangeRecord record);
+
     // Override used for testing the max memory allowed by uid map. 0 means we use the value
     // specified in StatsdStats.h with the rest of the guardrails.
     size_t maxBytesOverride = 0;
 
-    // Cache the size of mOutput;
+    // Cache the size of mChanges, in bytes.
     size_t mBytesUsed;
 
     // Allows unit-test to access private methods.
     FRIEND_TEST(RestrictedEventMetricE2eTest, TestRestrictedConfigUpdateDoesNotUpdateUidMap);
     FRIEND_TEST(RestrictedEventMetricE2eTest,
                 TestRestrictedConfigUpdateAddsDelegateRemovesUidMapEntry);
+    FRIEND_TEST(UidMapTest, TestEncodedSnapshotReusedUntilMapChanges);
+    FRIEND_TEST(UidMapTest, TestUnchangedSnapshotOmitted);
     FRIEND_TEST(UidMapTest, TestClearingOutput);
     FRIEND_TEST(UidMapTest, TestRemovedAppRetained);
     FRIEND_TEST(UidMapTest, TestRemovedAppOverGuardrail);
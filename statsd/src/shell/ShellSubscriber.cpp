@@ -22,6 +22,8 @@
 #include <inttypes.h>
 #include <utils/Timers.h>
 
+#include <algorithm>
+
 #include "guardrail/StatsdStats.h"
 #include "stats_log_util.h"
 
@@ -32,6 +34,14 @@ namespace os {
 namespace statsd {
 
 ShellSubscriber::~ShellSubscriber() {
+    {
+        std::lock_guard<std::mutex> lock(mDeliveryMutex);
+        mDeliveryStopRequested = true;
+    }
+    mDeliveryCV.notify_all();
+    if (mDeliveryThread.joinable()) {
+        mDeliveryThread.join();
+    }
     {
         std::unique_lock<std::mutex> lock(mMutex);
         mClientSet.clear();
@@ -58,7 +68,8 @@ bool ShellSubscriber::startNewSubscription(int in, int out, int64_t timeoutSec)
 }
 
 bool ShellSubscriber::startNewSubscription(const vector<uint8_t>& subscriptionConfig,
-                                           const shared_ptr<IStatsSubscriptionCallback>& callback) {
+                                           const shared_ptr<IStatsSubscriptionCallback>& callback,
+                                           int ringFd) {
     std::unique_lock<std::mutex> lock(mMutex);
     VLOG("ShellSubscriber: new subscription has come in");
     if (mClientSet.size() >= kMaxSubscriptions) {
@@ -69,7 +80,7 @@ bool ShellSubscriber::startNewSubscription(const vector<uint8_t>& subscriptionCo
     }
 
     return startNewSubscriptionLocked(ShellSubscriberClient::create(
-            subscriptionConfig, callback, getElapsedRealtimeSec(), mUidMap, mPullerMgr));
+            subscriptionConfig, callback, getElapsedRealtimeSec(), mUidMap, mPullerMgr, ringFd));
 }
 
 bool ShellSubscriber::startNewSubscriptionLocked(unique_ptr<ShellSubscriberClient> client) {
@@ -88,6 +99,9 @@ bool ShellSubscriber::startNewSubscriptionLocked(unique_ptr<ShellSubscriberClien
         }
         mThread = thread([this] { pullAndSendHeartbeats(); });
     }
+    if (!mDeliveryThread.joinable()) {
+        mDeliveryThread = thread([this] { deliverQueuedEvents(); });
+    }
 
     return true;
 }
@@ -98,6 +112,7 @@ void ShellSubscriber::pullAndSendHeartbeats() {
     std::unique_lock<std::mutex> lock(mMutex);
     while (true) {
         StatsdStats::getInstance().noteSubscriptionPullThreadWakeup();
+        mFdBatchStarted = false;
         int64_t sleepTimeMs = 24 * 60 * 60 * 1000;  // 24 hours.
         const int64_t nowNanos = getElapsedRealtimeNs();
         const int64_t nowMillis = nanoseconds_to_milliseconds(nowNanos);
@@ -121,7 +136,8 @@ void ShellSubscriber::pullAndSendHeartbeats() {
             return;
         }
         VLOG("ShellSubscriber: helper thread sleeping for %" PRId64 "ms", sleepTimeMs);
-        mThreadSleepCV.wait_for(lock, sleepTimeMs * 1ms, [this] { return mClientSet.empty(); });
+        mThreadSleepCV.wait_for(lock, sleepTimeMs * 1ms,
+                                [this] { return mClientSet.empty() || mFdBatchStarted; });
     }
 }
 
@@ -135,21 +151,99 @@ void ShellSubscriber::onLogEvent(const LogEvent& event) {
         return;
     }
     std::unique_lock<std::mutex> lock(mMutex);
-    for (auto clientIt = mClientSet.begin(); clientIt != mClientSet.end();) {
-        (*clientIt)->onLogEvent(event);
-        if ((*clientIt)->isAlive()) {
-            ++clientIt;
-        } else {
+    const auto clientsIt = mClientsByAtomId.find(event.GetTagId());
+    if (clientsIt == mClientsByAtomId.end()) {
+        return;
+    }
+    bool fdBatchStarted = false;
+    vector<const ShellSubscriberClient*> deadClients;
+    // Encode the atom once for all the clients, unless only one client can take it.
+    vector<uint8_t> encodedAtom;
+    vector<uint8_t>* sharedEncodedAtom = clientsIt->second.size() > 1 ? &encodedAtom : nullptr;
+    for (ShellSubscriberClient* client : clientsIt->second) {
+        const bool hadPendingFdBatch = client->hasPendingFdBatch();
+        client->onLogEvent(event, sharedEncodedAtom);
+        fdBatchStarted |= !hadPendingFdBatch && client->hasPendingFdBatch();
+        if (!client->isAlive()) {
             VLOG("ShellSubscriber: removing client!");
 
-            (*clientIt)->onUnsubscribe();
-            clientIt = mClientSet.erase(clientIt);
-            updateLogEventFilterLocked();
+            client->onUnsubscribe();
+            deadClients.push_back(client);
+        }
+    }
+    if (!deadClients.empty()) {
+        for (auto clientIt = mClientSet.begin(); clientIt != mClientSet.end();) {
+            if (std::find(deadClients.begin(), deadClients.end(), clientIt->get()) !=
+                deadClients.end()) {
+                clientIt = mClientSet.erase(clientIt);
+            } else {
+                ++clientIt;
+            }
+        }
+        updateLogEventFilterLocked();
+    }
+    // Wake the helper thread so that it writes the new batch once it is due.
+    if (fdBatchStarted) {
+        mFdBatchStarted = true;
+        mThreadSleepCV.notify_one();
+    }
+}
+
+void ShellSubscriber::queueLogEvent(unique_ptr<LogEvent>& event) {
+    if (event->isParsedHeaderOnly() || event->isRestricted()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mDeliveryMutex);
+        if (!mSubscribedAtomIds.contains(event->GetTagId())) {
+            return;
+        }
+        if (mDeliveryQueue.size() < kMaxQueuedEvents) {
+            mDeliveryQueue.push_back(std::move(event));
+            mDeliveryCV.notify_one();
+            return;
         }
     }
+    StatsdStats::getInstance().noteSubscriptionEventDropped();
+}
+
+void ShellSubscriber::deliverQueuedEvents() {
+    std::deque<std::shared_ptr<const LogEvent>> events;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mDeliveryMutex);
+            mDelivering = false;
+            mDeliveryCV.notify_all();
+            mDeliveryCV.wait(lock,
+                             [this] { return mDeliveryStopRequested || !mDeliveryQueue.empty(); });
+            if (mDeliveryStopRequested) {
+                return;
+            }
+            events.swap(mDeliveryQueue);
+            mDelivering = true;
+        }
+        for (const std::shared_ptr<const LogEvent>& event : events) {
+            onLogEvent(*event);
+            if (event->isLatencyTraced()) {
+                StatsdStats::getInstance().noteAtomLatency(
+                        event->GetTagId(), LATENCY_STAGE_SHELL_DELIVERY,
+                        getElapsedRealtimeNs() - event->getLatencyTraceStartNs());
+            }
+        }
+        events.clear();
+    }
+}
+
+void ShellSubscriber::waitForQueuedEvents() {
+    std::unique_lock<std::mutex> lock(mDeliveryMutex);
+    mDeliveryCV.wait(lock, [this] {
+        return mDeliveryStopRequested || (mDeliveryQueue.empty() && !mDelivering);
+    });
 }
 
 void ShellSubscriber::flushSubscription(const shared_ptr<IStatsSubscriptionCallback>& callback) {
+    // The flush includes the events logged before it.
+    waitForQueuedEvents();
     std::unique_lock<std::mutex> lock(mMutex);
 
     // TODO(b/268822860): Consider storing callback clients in a map keyed by
@@ -195,13 +289,23 @@ void ShellSubscriber::unsubscribe(const shared_ptr<IStatsSubscriptionCallback>&
     }
 }
 
-void ShellSubscriber::updateLogEventFilterLocked() const {
+void ShellSubscriber::updateLogEventFilterLocked() {
     VLOG("ShellSubscriber: Updating allAtomIds");
     LogEventFilter::AtomIdSet allAtomIds;
+    mClientsByAtomId.clear();
     for (const auto& client : mClientSet) {
-        client->addAllAtomIds(allAtomIds);
+        LogEventFilter::AtomIdSet clientAtomIds;
+        client->addAllAtomIds(clientAtomIds);
+        for (const int atomId : clientAtomIds) {
+            mClientsByAtomId[atomId].push_back(client.get());
+        }
+        allAtomIds.insert(clientAtomIds.begin(), clientAtomIds.end());
     }
     VLOG("ShellSubscriber: Updating allAtomIds done. Total atoms %d", (int)allAtomIds.size());
+    {
+        std::lock_guard<std::mutex> lock(mDeliveryMutex);
+        mSubscribedAtomIds = AtomIdLookup<LogEventFilter::AtomIdSet>(allAtomIds);
+    }
     mLogEventFilter->setAtomIds(std::move(allAtomIds), this);
 }
 
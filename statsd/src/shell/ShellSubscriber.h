@@ -19,8 +19,12 @@
 #include <aidl/android/os/IStatsSubscriptionCallback.h>
 
 #include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "external/StatsPullerManager.h"
 #include "packages/UidMap.h"
@@ -65,13 +69,21 @@ public:
     // Create new ShellSubscriberClient with file descriptors to manage a new subscription.
     bool startNewSubscription(int inFd, int outFd, int64_t timeoutSec);
 
-    // Create new ShellSubscriberClient with Binder callback to manage a new subscription.
+    // Create new ShellSubscriberClient with Binder callback to manage a new subscription. If
+    // ringFd is not -1, the data is written into the SubscriptionRing it holds.
     bool startNewSubscription(
             const vector<uint8_t>& subscriptionConfig,
-            const shared_ptr<aidl::android::os::IStatsSubscriptionCallback>& callback);
+            const shared_ptr<aidl::android::os::IStatsSubscriptionCallback>& callback,
+            int ringFd = -1);
 
+    // Delivers event to the subscriptions on the calling thread.
     void onLogEvent(const LogEvent& event);
 
+    // Hands event over to the delivery thread if a subscription wants its atom, leaving event
+    // null. Never blocks on the subscriptions: when kMaxQueuedEvents are already waiting, event
+    // is dropped and counted in StatsdStats instead.
+    void queueLogEvent(std::unique_ptr<LogEvent>& event);
+
     void flushSubscription(
             const shared_ptr<aidl::android::os::IStatsSubscriptionCallback>& callback);
 
@@ -85,13 +97,21 @@ public:
         return kMaxSubscriptions;
     }
 
+    static constexpr size_t kMaxQueuedEvents = 1000;
+
 private:
     bool startNewSubscriptionLocked(unique_ptr<ShellSubscriberClient> client);
 
     void pullAndSendHeartbeats();
 
+    // Body of mDeliveryThread: delivers the queued events until the subscriber is destroyed.
+    void deliverQueuedEvents();
+
+    // Blocks until the events queued so far have been delivered.
+    void waitForQueuedEvents();
+
     /* Tells LogEventFilter about atom ids to parse */
-    void updateLogEventFilterLocked() const;
+    void updateLogEventFilterLocked();
 
     sp<UidMap> mUidMap;
 
@@ -99,17 +119,44 @@ private:
 
     std::shared_ptr<LogEventFilter> mLogEventFilter;
 
-    // Protects mClientSet, mThreadAlive, and ShellSubscriberClient
+    // Protects mClientSet, mThreadAlive, and ShellSubscriberClient. Taken before mDeliveryMutex.
     mutable std::mutex mMutex;
 
     std::set<unique_ptr<ShellSubscriberClient>> mClientSet;
 
+    // The clients in mClientSet subscribed to each pushed atom id, so that an event is only given
+    // to the clients that asked for its atom. Rebuilt with the log event filter.
+    std::unordered_map<int, std::vector<ShellSubscriberClient*>> mClientsByAtomId;
+
     bool mThreadAlive = false;
 
+    // Set when a file descriptor subscription caches events while the helper thread sleeps, so
+    // that it wakes up to bound how long they wait.
+    bool mFdBatchStarted = false;
+
     std::condition_variable mThreadSleepCV;
 
     std::thread mThread;
 
+    // Protects the delivery state below. Never held while taking mMutex.
+    std::mutex mDeliveryMutex;
+
+    std::condition_variable mDeliveryCV;
+
+    // Events waiting for mDeliveryThread, at most kMaxQueuedEvents.
+    std::deque<std::shared_ptr<const LogEvent>> mDeliveryQueue;
+
+    // Whether mDeliveryThread is delivering events it took from mDeliveryQueue.
+    bool mDelivering = false;
+
+    bool mDeliveryStopRequested = false;
+
+    // The atoms of all the subscriptions, as last given to mLogEventFilter.
+    AtomIdLookup<LogEventFilter::AtomIdSet> mSubscribedAtomIds;
+
+    // Started with the first subscription, runs until the subscriber is destroyed.
+    std::thread mDeliveryThread;
+
     static constexpr size_t kMaxSubscriptions = 20;
 };
 
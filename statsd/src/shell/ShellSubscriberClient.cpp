@@ -18,6 +18,8 @@
 
 #include "ShellSubscriberClient.h"
 
+#include <sys/uio.h>
+
 #include "FieldValue.h"
 #include "guardrail/StatsdStats.h"
 #include "matchers/matcher_util.h"
@@ -104,7 +106,11 @@ ShellSubscriberClient::ShellSubscriberClient(
       mTimeoutSec(timeoutSec),
       mStartTimeSec(startTimeSec),
       mLastWriteMs(startTimeSec * 1000),
-      mCacheSize(0){};
+      mCacheSize(0) {
+    for (size_t i = 0; i < mPushedMatchers.size(); i++) {
+        mPushedMatcherIndices[mPushedMatchers[i].atom_id()].push_back(i);
+    }
+}
 
 unique_ptr<ShellSubscriberClient> ShellSubscriberClient::create(
         int in, int out, int64_t timeoutSec, int64_t startTimeSec, const sp<UidMap>& uidMap,
@@ -144,7 +150,7 @@ unique_ptr<ShellSubscriberClient> ShellSubscriberClient::create(
 unique_ptr<ShellSubscriberClient> ShellSubscriberClient::create(
         const vector<uint8_t>& subscriptionConfig,
         const shared_ptr<IStatsSubscriptionCallback>& callback, int64_t startTimeSec,
-        const sp<UidMap>& uidMap, const sp<StatsPullerManager>& pullerMgr) {
+        const sp<UidMap>& uidMap, const sp<StatsPullerManager>& pullerMgr, int ringFd) {
     if (callback == nullptr) {
         ALOGE("ShellSubscriberClient: received nullptr callback");
         return nullptr;
@@ -168,25 +174,51 @@ unique_ptr<ShellSubscriberClient> ShellSubscriberClient::create(
 
     StatsdStats::getInstance().noteSubscriptionStarted(id, readConfigResult->pushedMatchers.size(),
                                                        readConfigResult->pullInfo.size());
-    return make_unique<ShellSubscriberClient>(
+    unique_ptr<ShellSubscriberClient> client = make_unique<ShellSubscriberClient>(
             id, /*out=*/-1, callback, readConfigResult->pushedMatchers, readConfigResult->pullInfo,
             /*timeoutSec=*/-1, startTimeSec, uidMap, pullerMgr);
+    if (ringFd >= 0) {
+        // Without a usable ring, the data still reaches the subscriber through binder.
+        client->mRing = SubscriptionRing::create(ringFd);
+        if (client->mRing == nullptr) {
+            ALOGE("ShellSubscriberClient: sending subscription data through binder instead");
+        }
+    }
+    return client;
 }
 
 bool ShellSubscriberClient::writeEventToProtoIfMatched(const LogEvent& event,
                                                        const SimpleAtomMatcher& matcher,
-                                                       const sp<UidMap>& uidMap) {
+                                                       const sp<UidMap>& uidMap,
+                                                       vector<uint8_t>* encodedAtom) {
     auto [matched, transformedEvent] = matchesSimple(mUidMap, matcher, event);
     if (!matched) {
         return false;
     }
     const LogEvent& eventRef = transformedEvent == nullptr ? event : *transformedEvent;
 
+    if (mCallback == nullptr && mCacheSize == 0) {
+        mFdBatchStartMs = getElapsedRealtimeMillis();
+    }
+
     // Cache atom event in mProtoOut.
-    uint64_t atomToken = mProtoOut.start(util::FIELD_TYPE_MESSAGE | util::FIELD_COUNT_REPEATED |
-                                         FIELD_ID_SHELL_DATA__ATOM);
-    eventRef.ToProto(mProtoOut);
-    mProtoOut.end(atomToken);
+    if (transformedEvent == nullptr && encodedAtom != nullptr) {
+        // The event is unchanged, so its encoding can be shared with the other subscriptions.
+        if (encodedAtom->empty()) {
+            ProtoOutputStream atomProto;
+            event.ToProto(atomProto);
+            atomProto.serializeToVector(encodedAtom);
+        }
+        mProtoOut.write(util::FIELD_TYPE_MESSAGE | util::FIELD_COUNT_REPEATED |
+                                FIELD_ID_SHELL_DATA__ATOM,
+                        reinterpret_cast<const char*>(encodedAtom->data()), encodedAtom->size());
+    } else {
+        uint64_t atomToken = mProtoOut.start(util::FIELD_TYPE_MESSAGE |
+                                             util::FIELD_COUNT_REPEATED |
+                                             FIELD_ID_SHELL_DATA__ATOM);
+        eventRef.ToProto(mProtoOut);
+        mProtoOut.end(atomToken);
+    }
 
     const int64_t timestampNs = truncateTimestampIfNecessary(eventRef);
     mProtoOut.write(util::FIELD_TYPE_INT64 | util::FIELD_COUNT_REPEATED |
@@ -200,9 +232,14 @@ bool ShellSubscriberClient::writeEventToProtoIfMatched(const LogEvent& event,
 }
 
 // Called by ShellSubscriber when a pushed event occurs
-void ShellSubscriberClient::onLogEvent(const LogEvent& event) {
-    for (const auto& matcher : mPushedMatchers) {
-        if (writeEventToProtoIfMatched(event, matcher, mUidMap)) {
+void ShellSubscriberClient::onLogEvent(const LogEvent& event, vector<uint8_t>* encodedAtom) {
+    const auto it = mPushedMatcherIndices.find(event.GetTagId());
+    if (it == mPushedMatcherIndices.end()) {
+        return;
+    }
+    for (const size_t matcherIndex : it->second) {
+        if (writeEventToProtoIfMatched(event, mPushedMatchers[matcherIndex], mUidMap,
+                                       encodedAtom)) {
             flushProtoIfNeeded();
             break;
         }
@@ -211,8 +248,13 @@ void ShellSubscriberClient::onLogEvent(const LogEvent& event) {
 
 void ShellSubscriberClient::flushProtoIfNeeded() {
     if (mCallback == nullptr) {  // Using file descriptor.
-        triggerFdFlush();
-    } else if (mCacheSize >= kMaxCacheSizeBytes) {  // Using callback.
+        // Batch events so that bursts do not cost the client a read per event. Events left in the
+        // cache are written by the pull thread once they are kMaxFdBatchDelayMs old.
+        if (mCacheSize >= kMaxFdBatchBytes ||
+            getElapsedRealtimeMillis() - mFdBatchStartMs >= kMaxFdBatchDelayMs) {
+            triggerFdFlush();
+        }
+    } else if (mCacheSize >= getMaxCallbackCacheSizeBytes()) {  // Using callback.
         // Flush data if cache is full.
         triggerCallback(StatsSubscriptionCallbackReason::STATSD_INITIATED);
     }
@@ -255,12 +297,22 @@ int64_t ShellSubscriberClient::pullAndSendHeartbeatsIfNeeded(int64_t nowSecs, in
     int64_t sleepTimeMs;
     if (mCallback == nullptr) {  // File descriptor subscription
         if ((nowSecs - mStartTimeSec >= mTimeoutSec) && (mTimeoutSec > 0)) {
+            // Do not drop the events still waiting for their batch to be written.
+            if (mCacheSize > 0) {
+                triggerFdFlush();
+            }
             mClientAlive = false;
             return kMsBetweenHeartbeats;
         }
 
         sleepTimeMs = min(kMsBetweenHeartbeats, pullIfNeeded(nowSecs, nowMillis, nowNanos));
 
+        // Write the cached events that have waited long enough for more to be batched with them.
+        if (mCacheSize > 0 && nowMillis - mFdBatchStartMs >= kMaxFdBatchDelayMs) {
+            triggerFdFlush();
+            if (!mClientAlive) return kMsBetweenHeartbeats;
+        }
+
         // Send a heartbeat consisting of data size of 0, if
         // the user hasn't recently received data from statsd. When it receives the data size of 0,
         // the user will not expect any atoms and recheck whether the subscription should end.
@@ -271,6 +323,12 @@ int64_t ShellSubscriberClient::pullAndSendHeartbeatsIfNeeded(int64_t nowSecs, in
 
         int64_t timeBeforeHeartbeat = mLastWriteMs + kMsBetweenHeartbeats - nowMillis;
         sleepTimeMs = min(sleepTimeMs, timeBeforeHeartbeat);
+
+        if (mCacheSize > 0) {
+            const int64_t timeBeforeBatchFlushMs =
+                    mFdBatchStartMs + kMaxFdBatchDelayMs - nowMillis;
+            sleepTimeMs = min(sleepTimeMs, max(timeBeforeBatchFlushMs, (int64_t)0));
+        }
     } else {  // Callback subscription.
         sleepTimeMs = min(kMsBetweenCallbacks, pullIfNeeded(nowSecs, nowMillis, nowNanos));
 
@@ -307,31 +365,58 @@ void ShellSubscriberClient::writePulledAtomsLocked(const vector<shared_ptr<LogEv
     }
 }
 
-// Tries to write the atom encoded in mProtoOut to the pipe. If the write fails
-// because the read end of the pipe has closed, change the client status so
-// the manager knows the subscription is no longer active
+// Tries to write the atoms encoded in mProtoOut to the pipe, preceded by their size. If the write
+// fails because the read end of the pipe has closed, change the client status so the manager
+// knows the subscription is no longer active
 void ShellSubscriberClient::attemptWriteToPipeLocked() {
-    const size_t dataSize = mProtoOut.size();
-    // First, write the payload size.
-    if (!android::base::WriteFully(mDupOut, &dataSize, sizeof(dataSize))) {
-        mClientAlive = false;
-        return;
-    }
-    // Then, write the payload if this is not just a heartbeat.
-    if (dataSize > 0 && !mProtoOut.flush(mDupOut.get())) {
-        mClientAlive = false;
-        return;
+    mFdWriteBuffer.clear();
+    mProtoOut.serializeToVector(&mFdWriteBuffer);
+    size_t dataSize = mFdWriteBuffer.size();
+
+    // Write the size and the payload, which is empty for a heartbeat, with a single syscall.
+    struct iovec iov[2];
+    iov[0].iov_base = &dataSize;
+    iov[0].iov_len = sizeof(dataSize);
+    iov[1].iov_base = mFdWriteBuffer.data();
+    iov[1].iov_len = dataSize;
+    int iovIndex = 0;
+    const int iovCount = dataSize > 0 ? 2 : 1;
+    while (iovIndex < iovCount) {
+        const ssize_t written = TEMP_FAILURE_RETRY(
+                writev(mDupOut.get(), iov + iovIndex, iovCount - iovIndex));
+        if (written <= 0) {
+            mClientAlive = false;
+            return;
+        }
+        // Skip past what was written in case the pipe took a partial write.
+        size_t remaining = written;
+        while (iovIndex < iovCount && remaining >= iov[iovIndex].iov_len) {
+            remaining -= iov[iovIndex].iov_len;
+            iovIndex++;
+        }
+        if (iovIndex < iovCount) {
+            iov[iovIndex].iov_base = static_cast<uint8_t*>(iov[iovIndex].iov_base) + remaining;
+            iov[iovIndex].iov_len -= remaining;
+        }
     }
     mLastWriteMs = getElapsedRealtimeMillis();
 }
 
-void ShellSubscriberClient::getUidsForPullAtom(vector<int32_t>* uids, const PullInfo& pullInfo) {
+void ShellSubscriberClient::getUidsForPullAtom(vector<int32_t>* uids, PullInfo& pullInfo) {
     uids->insert(uids->end(), pullInfo.mPullUids.begin(), pullInfo.mPullUids.end());
-    // This is slow. Consider storing the uids per app and listening to uidmap updates.
-    for (const string& pkg : pullInfo.mPullPackages) {
-        set<int32_t> uidsForPkg = mUidMap->getAppUid(pkg);
-        uids->insert(uids->end(), uidsForPkg.begin(), uidsForPkg.end());
+    // Only resolve the packages again once the apps have changed. The generation is read first
+    // so that a change racing with the lookups below leaves the cache stale rather than wrong.
+    const uint64_t generation = mUidMap->getGeneration();
+    if (pullInfo.mPackageUidsGeneration != generation) {
+        pullInfo.mPackageUids.clear();
+        for (const string& pkg : pullInfo.mPullPackages) {
+            set<int32_t> uidsForPkg = mUidMap->getAppUid(pkg);
+            pullInfo.mPackageUids.insert(pullInfo.mPackageUids.end(), uidsForPkg.begin(),
+                                         uidsForPkg.end());
+        }
+        pullInfo.mPackageUidsGeneration = generation;
     }
+    uids->insert(uids->end(), pullInfo.mPackageUids.begin(), pullInfo.mPackageUids.end());
     uids->push_back(DEFAULT_PULL_UID);
 }
 
@@ -350,7 +435,15 @@ void ShellSubscriberClient::triggerCallback(StatsSubscriptionCallbackReason reas
     vector<uint8_t> payloadBytes;
     mProtoOut.serializeToVector(&payloadBytes);
     StatsdStats::getInstance().noteSubscriptionFlushed(mId);
-    const Status status = mCallback->onSubscriptionData(reason, payloadBytes);
+    optional<int64_t> ringPosition;
+    if (mRing != nullptr && !payloadBytes.empty()) {
+        ringPosition = mRing->write(payloadBytes);
+    }
+    const Status status =
+            ringPosition.has_value()
+                    ? mCallback->onSubscriptionDataInRing(reason, *ringPosition,
+                                                          payloadBytes.size())
+                    : mCallback->onSubscriptionData(reason, payloadBytes);
     if (status.getStatus() == STATUS_DEAD_OBJECT &&
         status.getExceptionCode() == EX_TRANSACTION_FAILED) {
         mClientAlive = false;
@@ -361,6 +454,13 @@ void ShellSubscriberClient::triggerCallback(StatsSubscriptionCallbackReason reas
     clearCache();
 }
 
+size_t ShellSubscriberClient::getMaxCallbackCacheSizeBytes() const {
+    if (mRing == nullptr) {
+        return kMaxCacheSizeBytes;
+    }
+    return max(kMaxCacheSizeBytes, mRing->getCapacity() / kRingCapacityPerCache);
+}
+
 void ShellSubscriberClient::flush() {
     triggerCallback(StatsSubscriptionCallbackReason::FLUSH_REQUESTED);
 }
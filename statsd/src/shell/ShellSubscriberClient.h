@@ -23,10 +23,14 @@
 #include <private/android_filesystem_config.h>
 
 #include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 
 #include "external/StatsPullerManager.h"
 #include "logd/LogEvent.h"
 #include "packages/UidMap.h"
+#include "shell/SubscriptionRing.h"
 #include "socket/LogEventFilter.h"
 #include "src/shell/shell_config.pb.h"
 #include "src/statsd_config.pb.h"
@@ -51,6 +55,11 @@ public:
         int64_t mPrevPullElapsedRealtimeMs;
         const std::vector<std::string> mPullPackages;
         const std::vector<int32_t> mPullUids;
+
+        // The uids of mPullPackages, resolved when the UidMap was at
+        // mPackageUidsGeneration.
+        std::vector<int32_t> mPackageUids;
+        std::optional<uint64_t> mPackageUidsGeneration;
     };
 
     static std::unique_ptr<ShellSubscriberClient> create(int in, int out, int64_t timeoutSec,
@@ -61,7 +70,7 @@ public:
     static std::unique_ptr<ShellSubscriberClient> create(
             const std::vector<uint8_t>& subscriptionConfig,
             const std::shared_ptr<IStatsSubscriptionCallback>& callback, int64_t startTimeSec,
-            const sp<UidMap>& uidMap, const sp<StatsPullerManager>& pullerMgr);
+            const sp<UidMap>& uidMap, const sp<StatsPullerManager>& pullerMgr, int ringFd = -1);
 
     // Should only be called by the create() factory.
     explicit ShellSubscriberClient(int id, int out,
@@ -71,7 +80,10 @@ public:
                                    int64_t startTimeSec, const sp<UidMap>& uidMap,
                                    const sp<StatsPullerManager>& pullerMgr);
 
-    void onLogEvent(const LogEvent& event);
+    // encodedAtom, if not null, is the Atom encoding of event shared with the other
+    // subscriptions it is dispatched to. It is filled in by the first subscription that matches
+    // event without transforming it, and copied from by the others.
+    void onLogEvent(const LogEvent& event, std::vector<uint8_t>* encodedAtom = nullptr);
 
     int64_t pullAndSendHeartbeatsIfNeeded(int64_t nowSecs, int64_t nowMillis, int64_t nowNanos);
 
@@ -96,6 +108,12 @@ public:
 
     void addAllAtomIds(LogEventFilter::AtomIdSet& allAtomIds) const;
 
+    // Whether this is a file descriptor subscription holding events that have not been written
+    // to the pipe yet.
+    bool hasPendingFdBatch() const {
+        return mCallback == nullptr && mCacheSize > 0;
+    }
+
     // Minimum pull interval for callback subscriptions.
     static constexpr int64_t kMinCallbackPullIntervalMs = 60'000;  // 60 seconds.
 
@@ -109,12 +127,13 @@ private:
 
     void attemptWriteToPipeLocked();
 
-    void getUidsForPullAtom(vector<int32_t>* uids, const PullInfo& pullInfo);
+    void getUidsForPullAtom(vector<int32_t>* uids, PullInfo& pullInfo);
 
     void flushProtoIfNeeded();
 
     bool writeEventToProtoIfMatched(const LogEvent& event, const SimpleAtomMatcher& matcher,
-                                    const sp<UidMap>& uidMap);
+                                    const sp<UidMap>& uidMap,
+                                    std::vector<uint8_t>* encodedAtom = nullptr);
 
     void clearCache();
 
@@ -122,6 +141,8 @@ private:
 
     void triggerCallback(StatsSubscriptionCallbackReason reason);
 
+    size_t getMaxCallbackCacheSizeBytes() const;
+
     const int32_t DEFAULT_PULL_UID = AID_SYSTEM;
 
     // Unique ID for this subscription for  StatsdStats.
@@ -135,10 +156,16 @@ private:
 
     const std::vector<SimpleAtomMatcher> mPushedMatchers;
 
+    // Atom id to the indices in mPushedMatchers of its matchers, in config order.
+    std::unordered_map<int, std::vector<size_t>> mPushedMatcherIndices;
+
     std::vector<PullInfo> mPulledInfo;
 
     std::shared_ptr<IStatsSubscriptionCallback> mCallback;
 
+    // Where the data of the callback is written, if the subscriber provided a usable ring.
+    std::unique_ptr<SubscriptionRing> mRing;
+
     const int64_t mTimeoutSec;
 
     const int64_t mStartTimeSec;
@@ -147,6 +174,12 @@ private:
 
     int64_t mLastWriteMs;
 
+    // When the first of the events cached for the file descriptor was written to mProtoOut.
+    int64_t mFdBatchStartMs = 0;
+
+    // Reused across writes to the file descriptor to hold the serialized mProtoOut.
+    std::vector<uint8_t> mFdWriteBuffer;
+
     // Stores Atom proto messages for events along with their respective timestamps.
     ProtoOutputStream mProtoOut;
 
@@ -161,6 +194,14 @@ private:
 
     static constexpr size_t kMaxCacheSizeBytes = 2 * 1024;  // 2 KB
 
+    // Callbacks through a SubscriptionRing are not bound by the binder transaction size, so they
+    // batch up to this fraction of the ring capacity.
+    static constexpr size_t kRingCapacityPerCache = 4;
+
+    // File descriptor subscriptions write their cached events once either bound is reached.
+    static constexpr size_t kMaxFdBatchBytes = 16 * 1024;  // 16 KB
+    static constexpr int64_t kMaxFdBatchDelayMs = 100;
+
     static constexpr int64_t kMsBetweenCallbacks = 70'000;  // 70 seconds.
 };
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "SubscriptionRing.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The read position must be usable across processes");
+
+std::unique_ptr<SubscriptionRing> SubscriptionRing::create(int fd) {
+    // The subscriber must not be able to shrink the memory under the mapping, which would crash
+    // statsd when it next writes.
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+        ALOGE("SubscriptionRing: ring is not sealed against shrinking");
+        return nullptr;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        ALOGE("SubscriptionRing: failed to stat the ring");
+        return nullptr;
+    }
+    const size_t size = fileStat.st_size;
+    if (size < kMinSizeBytes || size > kMaxSizeBytes) {
+        ALOGE("SubscriptionRing: ring size %zu bytes is outside of [%zu, %zu]", size,
+              kMinSizeBytes, kMaxSizeBytes);
+        return nullptr;
+    }
+
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, /*offset=*/0);
+    if (memory == MAP_FAILED) {
+        ALOGE("SubscriptionRing: failed to map the ring");
+        return nullptr;
+    }
+    return std::make_unique<SubscriptionRing>(static_cast<uint8_t*>(memory), size);
+}
+
+SubscriptionRing::SubscriptionRing(uint8_t* memory, size_t size)
+    : mMemory(memory), mSize(size) {
+    // Continue after what the subscriber has read, in case it got data from a previous statsd.
+    mWritePosition = loadReadPosition();
+}
+
+SubscriptionRing::~SubscriptionRing() {
+    munmap(mMemory, mSize);
+}
+
+uint64_t SubscriptionRing::loadReadPosition() const {
+    return reinterpret_cast<const std::atomic<uint64_t>*>(mMemory)->load(
+            std::memory_order_acquire);
+}
+
+std::optional<int64_t> SubscriptionRing::write(const std::vector<uint8_t>& payload) {
+    const uint64_t readPosition = loadReadPosition();
+    const size_t capacity = getCapacity();
+
+    // The read position is written by the subscriber, so do not trust it.
+    if (readPosition > mWritePosition || mWritePosition - readPosition > capacity) {
+        ALOGE("SubscriptionRing: invalid read position %" PRIu64 ", write position %" PRIu64,
+              readPosition, mWritePosition);
+        return std::nullopt;
+    }
+    if (payload.size() > capacity - (mWritePosition - readPosition)) {
+        return std::nullopt;
+    }
+
+    uint8_t* const data = mMemory + kHeaderSize;
+    const size_t offset = mWritePosition % capacity;
+    const size_t firstPartSize = std::min(payload.size(), capacity - offset);
+    memcpy(data + offset, payload.data(), firstPartSize);
+    memcpy(data, payload.data() + firstPartSize, payload.size() - firstPartSize);
+
+    const int64_t position = mWritePosition;
+    mWritePosition += payload.size();
+    return position;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// Shared memory ring through which a callback subscription receives its data. statsd writes the
+// data and the subscriber reads it, see IStatsd#addSubscriptionWithSharedMemory.
+//
+// The memory starts with kHeaderSize bytes, the first 8 of which hold the read position of the
+// subscriber as an atomic uint64. The rest of the memory is the data. Positions count the bytes
+// written since the subscription started, and position p is at data offset p % capacity. statsd
+// never writes over the data between the read position and its own write position.
+//
+// The layout is shared with lib/libstatspull/stats_subscription.cpp.
+class SubscriptionRing {
+public:
+    static constexpr size_t kHeaderSize = 64;
+
+    static constexpr size_t kMinSizeBytes = 16 * 1024;  // 16 KB
+
+    static constexpr size_t kMaxSizeBytes = 4 * 1024 * 1024;  // 4 MB
+
+    // Maps the ring in fd, which must be a memfd between kMinSizeBytes and kMaxSizeBytes sealed
+    // against resizing. Returns nullptr if it is not.
+    static std::unique_ptr<SubscriptionRing> create(int fd);
+
+    // Should only be called by the create() factory.
+    SubscriptionRing(uint8_t* memory, size_t size);
+
+    ~SubscriptionRing();
+
+    size_t getCapacity() const {
+        return mSize - kHeaderSize;
+    }
+
+    // Copies payload after the data written so far and returns its position, or nullopt if the
+    // subscriber has not read enough of the ring for payload to fit.
+    std::optional<int64_t> write(const std::vector<uint8_t>& payload);
+
+private:
+    uint64_t loadReadPosition() const;
+
+    uint8_t* const mMemory;
+
+    const size_t mSize;
+
+    uint64_t mWritePosition;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
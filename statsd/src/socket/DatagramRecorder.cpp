@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "DatagramRecorder.h"
+
+#include <android-base/file.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "stats_log_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+struct RecordHeader {
+    int64_t elapsedTimestampNs;
+    int64_t wallClockTimestampNs;
+    uint32_t uid;
+    uint32_t pid;
+    uint32_t size;
+} __attribute__((packed));
+
+void append(std::vector<uint8_t>& trace, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    trace.insert(trace.end(), bytes, bytes + size);
+}
+
+}  // anonymous namespace
+
+DatagramRecorder& DatagramRecorder::getInstance() {
+    static DatagramRecorder recorder;
+    return recorder;
+}
+
+bool DatagramRecorder::start() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mRecording) {
+        return false;
+    }
+    mTrace.clear();
+    append(mTrace, &kTraceMagic, sizeof(kTraceMagic));
+    mRecording = true;
+    return true;
+}
+
+std::vector<uint8_t> DatagramRecorder::stop() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRecording = false;
+    return std::move(mTrace);
+}
+
+bool DatagramRecorder::recordTrace(int durationSec, std::vector<uint8_t>* trace) {
+    if (!start()) {
+        ALOGW("DatagramRecorder: a recording is already in progress");
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(durationSec));
+    *trace = stop();
+    return true;
+}
+
+bool DatagramRecorder::record(int fd, int durationSec) {
+    std::vector<uint8_t> trace;
+    if (!recordTrace(durationSec, &trace)) {
+        return false;
+    }
+    return android::base::WriteFully(fd, trace.data(), trace.size());
+}
+
+bool DatagramRecorder::recordSample(int durationSec, std::vector<DatagramRecord>* records) {
+    std::vector<uint8_t> trace;
+    if (!recordTrace(durationSec, &trace)) {
+        return false;
+    }
+    return parseTrace(trace.data(), trace.size(), records);
+}
+
+void DatagramRecorder::noteDatagram(const uint8_t* datagram, size_t size, uint32_t uid,
+                                    uint32_t pid) {
+    const RecordHeader header{getElapsedRealtimeNs(), getWallClockNs(), uid, pid,
+                              static_cast<uint32_t>(size)};
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRecording || mTrace.size() + sizeof(header) + size > kMaxTraceBytes) {
+        return;
+    }
+    append(mTrace, &header, sizeof(header));
+    append(mTrace, datagram, size);
+}
+
+bool DatagramRecorder::readTrace(int fd, std::vector<DatagramRecord>* records) {
+    std::string trace;
+    if (!android::base::ReadFdToString(fd, &trace)) {
+        return false;
+    }
+    return parseTrace(reinterpret_cast<const uint8_t*>(trace.data()), trace.size(), records);
+}
+
+bool DatagramRecorder::parseTrace(const uint8_t* trace, size_t size,
+                                  std::vector<DatagramRecord>* records) {
+    uint32_t magic;
+    if (size < sizeof(magic)) {
+        return false;
+    }
+    memcpy(&magic, trace, sizeof(magic));
+    if (magic != kTraceMagic) {
+        return false;
+    }
+
+    size_t offset = sizeof(magic);
+    while (offset < size) {
+        RecordHeader header;
+        if (size - offset < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, trace + offset, sizeof(header));
+        offset += sizeof(header);
+        if (size - offset < header.size) {
+            return false;
+        }
+        const uint8_t* datagram = trace + offset;
+        records->push_back({header.elapsedTimestampNs, header.wallClockTimestampNs, header.uid,
+                            header.pid, std::vector<uint8_t>(datagram, datagram + header.size)});
+        offset += header.size;
+    }
+    return true;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <gtest/gtest_prod.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+// A datagram read from a trace written by DatagramRecorder.
+struct DatagramRecord {
+    int64_t elapsedTimestampNs;
+    int64_t wallClockTimestampNs;
+    uint32_t uid;
+    uint32_t pid;
+
+    // The whole datagram, including the android_log_header_t.
+    std::vector<uint8_t> datagram;
+};
+
+/**
+ * Records the datagrams StatsSocketListener receives into a trace, so that real atom traffic can
+ * be replayed by benchmark/replay_benchmark.cpp. See adb shell cmd stats record-datagrams.
+ * Only the datagrams that the socket filter keeps are received, so the callers suspend the
+ * filtering of the LogEventFilter while they record.
+ *
+ * The trace starts with kTraceMagic. Every datagram follows as a record header of
+ * {int64 elapsed timestamp ns, int64 wall clock timestamp ns, uint32 uid, uint32 pid,
+ * uint32 size}, in host byte order, and then size bytes of the datagram.
+ *
+ * Thread safe: datagrams are noted by the socket listener thread while the trace is written by
+ * the thread that runs the shell command.
+ */
+class DatagramRecorder {
+public:
+    static DatagramRecorder& getInstance();
+
+    static constexpr uint32_t kTraceMagic = 0x53445452;  // "RTDS"
+
+    // Keeps the memory of a recording bounded, the datagrams beyond it are not recorded.
+    static constexpr size_t kMaxTraceBytes = 32 * 1024 * 1024;  // 32 MB
+
+    /**
+     * Records the datagrams received in the next durationSec seconds, then writes the trace to
+     * fd. Blocks until then. Returns false if another recording is in progress or the trace
+     * could not be written.
+     */
+    bool record(int fd, int durationSec);
+
+    /**
+     * Records like record(), but keeps the datagrams in records instead of writing a trace. Used
+     * to replay a sample of the current traffic, see ConfigCostEstimator.
+     */
+    bool recordSample(int durationSec, std::vector<DatagramRecord>* records);
+
+    inline bool isRecording() const {
+        return mRecording.load(std::memory_order_relaxed);
+    }
+
+    // Appends a received datagram to the trace being recorded, if any.
+    void noteDatagram(const uint8_t* datagram, size_t size, uint32_t uid, uint32_t pid);
+
+    /**
+     * Reads a trace written by record() from fd into records. Returns false if the trace is
+     * malformed, in which case records holds the datagrams before the malformed one.
+     */
+    static bool readTrace(int fd, std::vector<DatagramRecord>* records);
+
+private:
+    DatagramRecorder() = default;
+
+    // Starts a recording, returns false if one is already in progress.
+    bool start();
+
+    // Stops the recording and returns its trace.
+    std::vector<uint8_t> stop();
+
+    // Records the datagrams received in the next durationSec seconds into trace.
+    bool recordTrace(int durationSec, std::vector<uint8_t>* trace);
+
+    // Parses the size bytes of a trace, see readTrace().
+    static bool parseTrace(const uint8_t* trace, size_t size, std::vector<DatagramRecord>* records);
+
+    std::mutex mMutex;
+
+    std::atomic<bool> mRecording = false;
+
+    // The trace being recorded, guarded by mMutex.
+    std::vector<uint8_t> mTrace;
+
+    FRIEND_TEST(DatagramRecorderTest, TestRecordAndRead);
+    FRIEND_TEST(DatagramRecorderTest, TestMaxTraceBytes);
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
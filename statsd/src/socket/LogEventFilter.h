@@ -18,8 +18,15 @@
 
 #include <gtest/gtest_prod.h>
 
+#include <stdint.h>
+
 #include <atomic>
+#include <bitset>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -27,6 +34,83 @@ namespace android {
 namespace os {
 namespace statsd {
 
+/**
+ * Read-only view of a superset of atom ids, rebuilt by LogEventFilterGeneric::setAtomIds and
+ * queried by isAtomInUse. The generic version keeps a copy of the container.
+ */
+template <typename T>
+class AtomIdLookup {
+public:
+    AtomIdLookup() = default;
+
+    explicit AtomIdLookup(const T& atomIds) : mAtomIds(atomIds) {
+    }
+
+    bool contains(int atomId) const {
+        return mAtomIds.find(atomId) != mAtomIds.end();
+    }
+
+    size_t size() const {
+        return mAtomIds.size();
+    }
+
+private:
+    T mAtomIds;
+};
+
+/**
+ * Platform atom ids are dense and small, so they are looked up in a bitmap. Only the remaining
+ * ids (vendor / non-platform atoms, pulled atoms) go to a hash set, which is usually empty or
+ * tiny.
+ */
+template <>
+class AtomIdLookup<std::unordered_set<int>> {
+public:
+    // Covers the platform pushed atom range (below StatsdStats::kMaxPushedAtomId) with headroom.
+    static constexpr int kDenseAtomIdCount = 2048;
+
+    AtomIdLookup() = default;
+
+    explicit AtomIdLookup(const std::unordered_set<int>& atomIds) : mSize(atomIds.size()) {
+        for (const int atomId : atomIds) {
+            if (atomId >= 0 && atomId < kDenseAtomIdCount) {
+                mDenseAtomIds.set(atomId);
+            } else {
+                mSparseAtomIds.insert(atomId);
+            }
+        }
+    }
+
+    bool contains(int atomId) const {
+        if (atomId >= 0 && atomId < kDenseAtomIdCount) {
+            return mDenseAtomIds.test(atomId);
+        }
+        return !mSparseAtomIds.empty() && mSparseAtomIds.find(atomId) != mSparseAtomIds.end();
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+private:
+    std::bitset<kDenseAtomIdCount> mDenseAtomIds;
+    std::unordered_set<int> mSparseAtomIds;
+    size_t mSize = 0;
+};
+
+/**
+ * Top-level field positions of an atom that its consumers read, bit n standing for position n.
+ * LogEvent::parseBody skips the values of unread string and byte array fields. Positions from
+ * kMaxFieldMaskPosition on are always decoded.
+ */
+typedef uint64_t FieldMask;
+
+constexpr int kMaxFieldMaskPosition = 64;
+
+constexpr FieldMask kAllFieldsMask = ~FieldMask(0);
+
+typedef std::unordered_map<int, FieldMask> AtomFieldMasks;
+
 /**
  * Templating is for benchmarks only
  *
@@ -37,15 +121,44 @@ namespace statsd {
  * #BM_LogEventFilterSet                                613362 ns     611259 ns         1146
  * #BM_LogEventFilterSet2Consumers                     1859397 ns    1854193 ns          378
  *
+ * The reader side is queried through AtomIdLookup, which for unordered_set<int> is a bitmap
+ * over the dense platform atom ids.
+ *
+ * isAtomInUse is expected to be called from a single thread (the socket listener). setAtomIds
+ * builds a new lookup under mTagIdsMutex and publishes it through an atomic pointer; the reader
+ * takes ownership of it with an exchange the next time it checks, so it never blocks on the
+ * mutex and a lookup is never freed while being read.
+ *
  * See @LogEventFilter definition below
  */
 template <typename T>
 class LogEventFilterGeneric {
 public:
-    virtual ~LogEventFilterGeneric() = default;
+    virtual ~LogEventFilterGeneric() {
+        delete mPendingTagIds.load(std::memory_order_acquire);
+    }
 
     virtual void setFilteringEnabled(bool isEnabled) {
-        mLogsFilteringEnabled = isEnabled;
+        std::unique_lock lock(mTagIdsMutex);
+        mFilteringRequested = isEnabled;
+        updateFilteringEnabled(lock);
+    }
+
+    /**
+     * @brief Disables filtering until the matching resumeFiltering() call, whatever
+     *        setFilteringEnabled() asks for in the meantime. For callers that need every atom
+     *        for a while, such as DatagramRecorder. Calls nest
+     */
+    void suspendFiltering() {
+        std::unique_lock lock(mTagIdsMutex);
+        mFilteringSuspensions++;
+        updateFilteringEnabled(lock);
+    }
+
+    void resumeFiltering() {
+        std::unique_lock lock(mTagIdsMutex);
+        mFilteringSuspensions--;
+        updateFilteringEnabled(lock);
     }
 
     bool getFilteringEnabled() const {
@@ -55,8 +168,8 @@ public:
     /**
      * @brief Tests atom id with list of interesting atoms
      *        If Logs filtering is disabled - assume all atoms in use
-     *        Most of the time should be non-blocking call - only in case when setAtomIds() was
-     *        called the call will be blocking due to atom list needs to be synced up
+     *        Never blocking - when setAtomIds() published a new atom list it is picked up
+     *        with a single atomic exchange
      * @param atomId
      * @return true if atom is used by any of consumer or filtering is disabled
      */
@@ -66,17 +179,68 @@ public:
         }
 
         // check if there is an updated set of interesting atom ids
-        if (mLocalSetUpdateCounter != mSetUpdateCounter.load(std::memory_order_relaxed)) {
-            std::lock_guard<std::mutex> guard(mTagIdsMutex);
-            mLocalSetUpdateCounter = mSetUpdateCounter.load(std::memory_order_relaxed);
-            mLocalTagIds.swap(mTagIds);
+        if (mPendingTagIds.load(std::memory_order_relaxed) != nullptr) {
+            std::unique_ptr<PublishedAtoms> pending(
+                    mPendingTagIds.exchange(nullptr, std::memory_order_acquire));
+            if (pending != nullptr) {
+                mLocalTagIds = std::move(pending->atomIds);
+                mLocalFieldMasks = std::move(pending->fieldMasks);
+                mLocalCriticalTagIds = std::move(pending->criticalAtomIds);
+            }
+        }
+        return mLocalTagIds.contains(atomId);
+    }
+
+    /**
+     * @brief Returns the fields of an atom that its consumers read, as of the last isAtomInUse
+     *        call. Should be called from the isAtomInUse thread, after isAtomInUse(atomId)
+     * @param atomId
+     * @return kAllFieldsMask if filtering is disabled or any consumer reads the whole atom
+     */
+    FieldMask getFieldMask(int atomId) const {
+        if (!mLogsFilteringEnabled || mLocalFieldMasks.empty()) {
+            return kAllFieldsMask;
         }
-        return mLocalTagIds.find(atomId) != mLocalTagIds.end();
+        const auto it = mLocalFieldMasks.find(atomId);
+        return it == mLocalFieldMasks.end() ? kAllFieldsMask : it->second;
+    }
+
+    /**
+     * @brief Tests whether losing the atom would corrupt the results of its consumers, as of the
+     *        last isAtomInUse call. Should be called from the isAtomInUse thread, after
+     *        isAtomInUse(atomId)
+     * @param atomId
+     * @return false if filtering is disabled
+     */
+    bool isAtomCritical(int atomId) const {
+        return mLogsFilteringEnabled && mLocalCriticalTagIds.contains(atomId);
     }
 
     typedef const void* ConsumerId;
 
     typedef T AtomIdSet;
+
+    /**
+     * Receives the superset of atom ids whenever it changes, or nullptr while filtering is
+     * disabled. Calls are serialized and made without mTagIdsMutex, so that a slow listener
+     * does not hold up the writers. A call that a newer superset overtook is skipped.
+     */
+    typedef std::function<void(const AtomIdSet* atomIds)> AtomIdsListener;
+
+    /**
+     * @brief Set the listener of the superset of atom ids. It is called right away with the
+     *        current superset
+     *
+     * @param listener replaces the previous listener, nullptr to remove it
+     */
+    void setAtomIdsListener(AtomIdsListener listener) {
+        std::unique_lock lock(mTagIdsMutex);
+        {
+            std::lock_guard listenerLock(mAtomIdsListenerMutex);
+            mAtomIdsListener = std::move(listener);
+        }
+        notifyAtomIdsListener(lock);
+    }
     /**
      * @brief Set the Atom Ids object
      *
@@ -84,30 +248,148 @@ public:
      * @param consumer used to differentiate the consumers to form proper superset of ids
      */
     virtual void setAtomIds(AtomIdSet tagIds, ConsumerId consumer) {
-        std::lock_guard lock(mTagIdsMutex);
+        std::unique_lock lock(mTagIdsMutex);
         // update ids list from consumer
         if (tagIds.size() == 0) {
             mTagIdsPerConsumer.erase(consumer);
+            mFieldMasksPerConsumer.erase(consumer);
+            mCriticalTagIdsPerConsumer.erase(consumer);
         } else {
             mTagIdsPerConsumer[consumer].swap(tagIds);
         }
-        // populate the superset incorporating list of distinct atom ids from all consumers
-        mTagIds.clear();
-        for (const auto& [_, atomIds] : mTagIdsPerConsumer) {
-            mTagIds.insert(atomIds.begin(), atomIds.end());
+        // populate the superset incorporating list of distinct atom ids from all consumers,
+        // and the fields of each atom read by any of them
+        AtomIdSet allTagIds;
+        AtomIdSet allCriticalTagIds;
+        AtomFieldMasks allFieldMasks;
+        for (const auto& [atomsConsumer, atomIds] : mTagIdsPerConsumer) {
+            allTagIds.insert(atomIds.begin(), atomIds.end());
+            const auto criticalIt = mCriticalTagIdsPerConsumer.find(atomsConsumer);
+            if (criticalIt != mCriticalTagIdsPerConsumer.end()) {
+                allCriticalTagIds.insert(criticalIt->second.begin(), criticalIt->second.end());
+            }
+            const auto masksIt = mFieldMasksPerConsumer.find(atomsConsumer);
+            for (const int atomId : atomIds) {
+                FieldMask fieldMask = kAllFieldsMask;
+                if (masksIt != mFieldMasksPerConsumer.end()) {
+                    const auto maskIt = masksIt->second.find(atomId);
+                    if (maskIt != masksIt->second.end()) {
+                        fieldMask = maskIt->second;
+                    }
+                }
+                allFieldMasks[atomId] |= fieldMask;
+            }
+        }
+        for (auto it = allFieldMasks.begin(); it != allFieldMasks.end();) {
+            it = it->second == kAllFieldsMask ? allFieldMasks.erase(it) : std::next(it);
+        }
+        // a lookup the reader has not picked up yet is superseded
+        delete mPendingTagIds.exchange(
+                new PublishedAtoms{AtomIdLookup<T>(allTagIds), std::move(allFieldMasks),
+                                   AtomIdLookup<T>(allCriticalTagIds)},
+                std::memory_order_acq_rel);
+        mAllTagIds.swap(allTagIds);
+        notifyAtomIdsListener(lock);
+    }
+
+    /**
+     * @brief Set the fields that a consumer reads of its atoms. Applies from the next
+     *        setAtomIds() call of the consumer. Atoms of the consumer without a mask are
+     *        decoded whole, which is also the case for consumers that never call this
+     *
+     * @param fieldMasks fields read per atom id
+     * @param consumer same as for setAtomIds()
+     */
+    virtual void setAtomFieldMasks(AtomFieldMasks fieldMasks, ConsumerId consumer) {
+        std::lock_guard lock(mTagIdsMutex);
+        if (fieldMasks.empty()) {
+            mFieldMasksPerConsumer.erase(consumer);
+        } else {
+            mFieldMasksPerConsumer[consumer].swap(fieldMasks);
+        }
+    }
+
+    /**
+     * @brief Set the atoms of a consumer that isAtomCritical() reports. Applies from the next
+     *        setAtomIds() call of the consumer
+     *
+     * @param tagIds critical atom ids
+     * @param consumer same as for setAtomIds()
+     */
+    virtual void setCriticalAtomIds(AtomIdSet tagIds, ConsumerId consumer) {
+        std::lock_guard lock(mTagIdsMutex);
+        if (tagIds.size() == 0) {
+            mCriticalTagIdsPerConsumer.erase(consumer);
+        } else {
+            mCriticalTagIdsPerConsumer[consumer].swap(tagIds);
         }
-        mSetUpdateCounter.fetch_add(1, std::memory_order_relaxed);
     }
 
 private:
+    // lock holds mTagIdsMutex and is released, see notifyAtomIdsListener().
+    void updateFilteringEnabled(std::unique_lock<std::mutex>& lock) {
+        mLogsFilteringEnabled = mFilteringRequested && mFilteringSuspensions == 0;
+        notifyAtomIdsListener(lock);
+    }
+
+    // Releases lock, which holds mTagIdsMutex, before calling the listener.
+    void notifyAtomIdsListener(std::unique_lock<std::mutex>& lock) {
+        const uint64_t version = ++mAtomIdsVersion;
+        std::optional<AtomIdSet> atomIds;
+        if (mAtomIdsListener && mLogsFilteringEnabled) {
+            atomIds = mAllTagIds;
+        }
+        lock.unlock();
+
+        std::lock_guard listenerLock(mAtomIdsListenerMutex);
+        if (version < mNotifiedAtomIdsVersion) {
+            return;
+        }
+        mNotifiedAtomIdsVersion = version;
+        if (mAtomIdsListener) {
+            mAtomIdsListener(atomIds ? &*atomIds : nullptr);
+        }
+    }
+
+    struct PublishedAtoms {
+        AtomIdLookup<T> atomIds;
+        AtomFieldMasks fieldMasks;
+        AtomIdLookup<T> criticalAtomIds;
+    };
+
     std::atomic_bool mLogsFilteringEnabled = true;
-    std::atomic_int mSetUpdateCounter;
-    mutable int mLocalSetUpdateCounter;
 
+    // What setFilteringEnabled() asked for, and the pending suspendFiltering() calls. Guarded by
+    // mTagIdsMutex.
+    bool mFilteringRequested = true;
+    int mFilteringSuspensions = 0;
+
+    // Lookup published by setAtomIds and not yet taken by isAtomInUse, or nullptr.
+    mutable std::atomic<PublishedAtoms*> mPendingTagIds = nullptr;
+
+    // Guards the writers only.
     mutable std::mutex mTagIdsMutex;
     std::unordered_map<ConsumerId, AtomIdSet> mTagIdsPerConsumer;
-    mutable AtomIdSet mTagIds;
-    mutable AtomIdSet mLocalTagIds;
+    std::unordered_map<ConsumerId, AtomFieldMasks> mFieldMasksPerConsumer;
+    std::unordered_map<ConsumerId, AtomIdSet> mCriticalTagIdsPerConsumer;
+    // The superset of the atom ids of all consumers.
+    AtomIdSet mAllTagIds;
+    // Counts the changes of mAllTagIds and of the filtering state.
+    uint64_t mAtomIdsVersion = 0;
+
+    // Taken within mTagIdsMutex or after releasing it, never the other way around.
+    std::mutex mAtomIdsListenerMutex;
+    // Guarded by both mTagIdsMutex and mAtomIdsListenerMutex, written with both held.
+    AtomIdsListener mAtomIdsListener;
+    // The version mAtomIdsListener was last called with, guarded by mAtomIdsListenerMutex.
+    uint64_t mNotifiedAtomIdsVersion = 0;
+
+    // Owned by the isAtomInUse caller.
+    mutable AtomIdLookup<T> mLocalTagIds;
+    // Only atoms with fields that no consumer reads, owned by the isAtomInUse caller.
+    mutable AtomFieldMasks mLocalFieldMasks;
+    // Owned by the isAtomInUse caller.
+    mutable AtomIdLookup<T> mLocalCriticalTagIds;
 
     friend class LogEventFilterTest;
 
@@ -121,6 +403,12 @@ private:
     FRIEND_TEST(LogEventFilterTest, TestMultipleConsumerOverlapIds);
     FRIEND_TEST(LogEventFilterTest, TestMultipleConsumerOverlapIdsRemoved);
     FRIEND_TEST(LogEventFilterTest, TestMultipleConsumerEmptyFilter);
+    FRIEND_TEST(LogEventFilterTest, TestDenseAndSparseAtomIds);
+    FRIEND_TEST(LogEventFilterTest, TestConcurrentUpdates);
+    FRIEND_TEST(LogEventFilterTest, TestFieldMasksUnion);
+    FRIEND_TEST(LogEventFilterTest, TestCriticalAtomIds);
+    FRIEND_TEST(LogEventFilterTest, TestSuspendFiltering);
+    FRIEND_TEST(LogEventFilterTest, TestAtomIdsListenerCalledWithoutLock);
 };
 
 typedef LogEventFilterGeneric<std::unordered_set<int>> LogEventFilter;
@@ -18,10 +18,13 @@
 
 #include "StatsSocketListener.h"
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <cutils/sockets.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/cdefs.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
@@ -29,60 +32,263 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include "DatagramRecorder.h"
+#include "flags/FlagProvider.h"
 #include "guardrail/StatsdStats.h"
+#include "logd/LogEventPool.h"
 #include "logd/logevent_util.h"
 #include "stats_log_util.h"
 #include "statslog_statsd.h"
+#include "utils/StatsdTrace.h"
 
 namespace android {
 namespace os {
 namespace statsd {
 
+namespace {
+
+// Offsets in a datagram holding a single atom: android_log_header_t | StatsEventTag |
+// OBJECT_TYPE | NUM_FIELDS | INT64_TYPE | TIMESTAMP | INT32_TYPE | ATOM_ID
+constexpr uint32_t kTagOffset = sizeof(android_log_header_t);
+constexpr uint32_t kObjectTypeOffset = kTagOffset + sizeof(uint32_t);
+constexpr uint32_t kTimestampTypeOffset = kObjectTypeOffset + 2 * sizeof(uint8_t);
+constexpr uint32_t kAtomIdTypeOffset = kTimestampTypeOffset + sizeof(uint8_t) + sizeof(int64_t);
+constexpr uint32_t kAtomIdOffset = kAtomIdTypeOffset + sizeof(uint8_t);
+constexpr uint32_t kAtomHeaderSize = kAtomIdOffset + sizeof(int32_t);
+
+constexpr uint32_t kFilterAccept = 0xffffffff;
+constexpr uint32_t kFilterDrop = 0;
+
+// Number of atom ids compared one after the other at the leaves of the search.
+constexpr size_t kAtomFilterLeafSize = 8;
+
+// Word loads of socket filters read in network byte order.
+uint32_t toFilterWord(uint32_t value) {
+    return ntohl(value);
+}
+
+void appendAcceptUnlessTypeId(uint32_t offset, uint8_t typeId, std::vector<sock_filter>* program) {
+    program->push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset));
+    program->push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0F));
+    program->push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, typeId, 1, 0));
+    program->push_back(BPF_STMT(BPF_RET | BPF_K, kFilterAccept));
+}
+
+// Appends the search of the accumulator among the sorted values [begin, end). Every path ends
+// with a return, or with one of the jumps appended to dropJumps when the value is not found.
+void appendAtomIdSearch(const std::vector<uint32_t>& values, size_t begin, size_t end,
+                        std::vector<sock_filter>* program, std::vector<size_t>* dropJumps) {
+    const size_t count = end - begin;
+    if (count <= kAtomFilterLeafSize) {
+        for (size_t i = 0; i < count; i++) {
+            // Jumps over the remaining comparisons and the drop to the accept.
+            const uint8_t toAccept = count - i;
+            program->push_back(
+                    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, values[begin + i], toAccept, 0));
+        }
+        dropJumps->push_back(program->size());
+        program->push_back(BPF_STMT(BPF_JMP | BPF_JA, 0));
+        program->push_back(BPF_STMT(BPF_RET | BPF_K, kFilterAccept));
+        return;
+    }
+    const size_t middle = begin + count / 2;
+    // Conditional jumps are limited to 255 instructions, the unconditional one over the lower
+    // half is not.
+    program->push_back(BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, values[middle - 1], 0, 1));
+    const size_t jumpIndex = program->size();
+    program->push_back(BPF_STMT(BPF_JMP | BPF_JA, 0));
+    appendAtomIdSearch(values, begin, middle, program, dropJumps);
+    (*program)[jumpIndex].k = program->size() - jumpIndex - 1;
+    appendAtomIdSearch(values, middle, end, program, dropJumps);
+}
+
+}  // namespace
+
+// The header of the atom and the type of its first field, which a well-formed atom cannot end
+// with.
+const uint32_t StatsSocketListener::kSampledAtomSize = kAtomHeaderSize + 1;
+
 StatsSocketListener::StatsSocketListener(const std::shared_ptr<LogEventQueue>& queue,
                                          const std::shared_ptr<LogEventFilter>& logEventFilter)
-    : SocketListener(getLogSocket(), false /*start listen*/),
+    : StatsSocketListener(queue, logEventFilter, getLogSocket()) {
+}
+
+StatsSocketListener::StatsSocketListener(const std::shared_ptr<LogEventQueue>& queue,
+                                         const std::shared_ptr<LogEventFilter>& logEventFilter,
+                                         int socket)
+    : SocketListener(socket, false /*start listen*/),
       mQueue(queue),
-      mLogEventFilter(logEventFilter) {
+      mLogEventFilter(logEventFilter),
+      mUidRateLimiter(createUidRateLimiter()),
+      mDatagramBuffers(kMaxBatchSize * kDatagramBufferSize),
+      mControlBuffers(kMaxBatchSize * CMSG_SPACE(sizeof(struct ucred))),
+      mIovecs(kMaxBatchSize),
+      mMsgHeaders(kMaxBatchSize) {
+    mEventsBatch.reserve(kMaxBatchSize);
+    mLogEventFilter->setAtomIdsListener([socket](const LogEventFilter::AtomIdSet* atomIds) {
+        updateAtomFilter(socket, atomIds);
+    });
+}
+
+StatsSocketListener::~StatsSocketListener() {
+    mLogEventFilter->setAtomIdsListener(nullptr);
+}
+
+UidRateLimiter StatsSocketListener::createUidRateLimiter() {
+    const FlagProvider& flags = FlagProvider::getInstance();
+    const int64_t eventsPerSec =
+            strtoll(flags.getBootFlagString(SOCKET_UID_RATE_LIMIT_FLAG, FLAG_EMPTY).c_str(),
+                    nullptr, 10);
+    const std::string burstSizeFlag =
+            flags.getBootFlagString(SOCKET_UID_BURST_SIZE_FLAG, FLAG_EMPTY);
+    // One second of atoms by default.
+    const int64_t burstSize =
+            burstSizeFlag.empty() ? eventsPerSec : strtoll(burstSizeFlag.c_str(), nullptr, 10);
+    UidRateLimiter rateLimiter(eventsPerSec, burstSize);
+    if (rateLimiter.isEnabled()) {
+        ALOGI("Atoms of each app uid are limited to %lld per second", (long long)eventsPerSec);
+    }
+    return rateLimiter;
+}
+
+void StatsSocketListener::updateAtomFilter(int socket, const LogEventFilter::AtomIdSet* atomIds) {
+    if (socket < 0) {
+        return;
+    }
+    std::vector<sock_filter> program;
+    if (atomIds != nullptr && atomIds->size() > 0) {
+        program = buildAtomFilter(*atomIds);
+        if (program.empty()) {
+            ALOGW("Too many atoms (%zu) to filter them in the socket", atomIds->size());
+        }
+    }
+    if (program.empty()) {
+        // Fails with ENOENT when no filter is attached, which is the expected state.
+        int unused = 0;
+        setsockopt(socket, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+        return;
+    }
+    struct sock_fprog filter = {static_cast<unsigned short>(program.size()), program.data()};
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0) {
+        ALOGE("Failed to attach the atom filter to the socket: %s", strerror(errno));
+    }
+}
+
+std::vector<sock_filter> StatsSocketListener::buildAtomFilter(
+        const LogEventFilter::AtomIdSet& atomIds) {
+    std::vector<uint32_t> values;
+    values.reserve(atomIds.size() + 1);
+    for (const int atomId : atomIds) {
+        values.push_back(toFilterWord(atomId));
+    }
+    // Handled in parseMessage() whether the atom is in use or not.
+    values.push_back(toFilterWord(util::STATS_SOCKET_LOSS_REPORTED));
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    std::vector<sock_filter> program;
+    // Dropped events reports and malformed datagrams are too short to hold an atom header.
+    program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0));
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, kAtomHeaderSize, 1, 0));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kFilterAccept));
+    // Batched datagrams carry several atoms.
+    program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kTagOffset));
+    program.push_back(
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, toFilterWord(kStatsEventBatchTag), 0, 1));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kFilterAccept));
+    // Invalid headers are reported by LogEvent::parseHeader.
+    appendAcceptUnlessTypeId(kObjectTypeOffset, OBJECT_TYPE, &program);
+    appendAcceptUnlessTypeId(kTimestampTypeOffset, INT64_TYPE, &program);
+    appendAcceptUnlessTypeId(kAtomIdTypeOffset, INT32_TYPE, &program);
+    program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kAtomIdOffset));
+    std::vector<size_t> dropJumps;
+    appendAtomIdSearch(values, 0, values.size(), &program, &dropJumps);
+    // The atoms not found are dropped, but for a random sample of them.
+    for (const size_t jumpIndex : dropJumps) {
+        program[jumpIndex].k = program.size() - jumpIndex - 1;
+    }
+    program.push_back(
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_RANDOM)));
+    program.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, kAtomFilterSampleRate - 1));
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kSampledAtomSize));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kFilterDrop));
+
+    if (program.size() > kMaxAtomFilterSize) {
+        return {};
+    }
+    return program;
 }
 
 bool StatsSocketListener::onDataAvailable(SocketClient* cli) {
+    STATSD_TRACE("StatsSocketListener::onDataAvailable");
     static bool name_set;
     if (!name_set) {
         prctl(PR_SET_NAME, "statsd.writer");
         name_set = true;
     }
 
-    // + 1 to ensure null terminator if MAX_PAYLOAD buffer is received
-    char buffer[sizeof(android_log_header_t) + LOGGER_ENTRY_MAX_PAYLOAD + 1];
-    struct iovec iov = {buffer, sizeof(buffer) - 1};
-
-    alignas(4) char control[CMSG_SPACE(sizeof(struct ucred))];
-    struct msghdr hdr = {
-            NULL, 0, &iov, 1, control, sizeof(control), 0,
-    };
+    // recvmmsg() updates msg_controllen, so the headers are reset before every call.
+    for (size_t i = 0; i < kMaxBatchSize; i++) {
+        mIovecs[i] = {mDatagramBuffers.data() + i * kDatagramBufferSize,
+                      kDatagramBufferSize - 1};
+        struct msghdr& hdr = mMsgHeaders[i].msg_hdr;
+        hdr = {NULL, 0, &mIovecs[i], 1,
+               mControlBuffers.data() + i * CMSG_SPACE(sizeof(struct ucred)),
+               CMSG_SPACE(sizeof(struct ucred)), 0};
+        mMsgHeaders[i].msg_len = 0;
+    }
 
     int socket = cli->getSocket();
 
     // To clear the entire buffer is secure/safe, but this contributes to 1.68%
     // overhead under logging load. We are safe because we check counts, but
-    // still need to clear null terminator
-    // memset(buffer, 0, sizeof(buffer));
-    ssize_t n = recvmsg(socket, &hdr, 0);
-    if (n <= (ssize_t)(sizeof(android_log_header_t))) {
+    // still need to clear null terminator (done in processDatagram()).
+    // The socket is readable so at least one datagram is available, the rest of the batch is
+    // only what is already queued on the socket.
+    const int count = recvmmsg(socket, mMsgHeaders.data(), kMaxBatchSize, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
         return false;
     }
 
+    UidRateLimiter* rateLimiter = nullptr;
+    if (mUidRateLimiter.isEnabled()) {
+        rateLimiter = &mUidRateLimiter;
+        rateLimiter->advanceTo(getElapsedRealtimeNs());
+    }
+
+    mEventsBatch.clear();
+    for (int i = 0; i < count; i++) {
+        processDatagram(mDatagramBuffers.data() + i * kDatagramBufferSize, mMsgHeaders[i].msg_len,
+                        &mMsgHeaders[i].msg_hdr, mLogEventFilter, mEventsBatch, rateLimiter);
+    }
+
+    pushEvents(mEventsBatch, mQueue);
+
+    return true;
+}
+
+void StatsSocketListener::processDatagram(uint8_t* buffer, ssize_t n, struct msghdr* hdr,
+                                          const std::shared_ptr<LogEventFilter>& filter,
+                                          std::vector<std::unique_ptr<LogEvent>>& events,
+                                          UidRateLimiter* rateLimiter) {
+    if (n <= (ssize_t)(sizeof(android_log_header_t))) {
+        return;
+    }
+
     buffer[n] = 0;
 
     struct ucred* cred = NULL;
 
-    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
     while (cmsg != NULL) {
         if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
             cred = (struct ucred*)CMSG_DATA(cmsg);
             break;
         }
-        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+        cmsg = CMSG_NXTHDR(hdr, cmsg);
     }
 
     struct ucred fake_cred;
@@ -92,7 +298,20 @@ bool StatsSocketListener::onDataAvailable(SocketClient* cli) {
         cred->uid = DEFAULT_OVERFLOWUID;
     }
 
-    uint8_t* ptr = ((uint8_t*)buffer) + sizeof(android_log_header_t);
+    if (n == kSampledAtomSize) {
+        // Stands for the atoms not in use that the socket filter dropped, see buildAtomFilter().
+        int32_t atomId;
+        memcpy(&atomId, buffer + kAtomIdOffset, sizeof(atomId));
+        StatsdStats::getInstance().noteAtomsDroppedBySocketFilter(atomId, kAtomFilterSampleRate);
+        return;
+    }
+
+    DatagramRecorder& recorder = DatagramRecorder::getInstance();
+    if (recorder.isRecording()) {
+        recorder.noteDatagram(buffer, n, cred->uid, cred->pid);
+    }
+
+    uint8_t* ptr = buffer + sizeof(android_log_header_t);
     n -= sizeof(android_log_header_t);
 
     // When a log failed to write to statsd socket (e.g., due ot EBUSY), a special message would
@@ -117,41 +336,99 @@ bool StatsSocketListener::onDataAvailable(SocketClient* cli) {
             StatsdStats::getInstance().noteLogLost((int32_t)getWallClockSec(), dropped_count,
                                                    long_event->header.tag, last_atom_tag, cred->uid,
                                                    cred->pid);
-            return true;
+            return;
         }
     }
 
+    if (n < (ssize_t)sizeof(uint32_t)) {
+        return;
+    }
+
     // move past the 4-byte StatsEventTag
+    uint32_t tag;
+    memcpy(&tag, ptr, sizeof(tag));
     const uint8_t* msg = ptr + sizeof(uint32_t);
     const uint32_t len = n - sizeof(uint32_t);
     const uint32_t uid = cred->uid;
     const uint32_t pid = cred->pid;
 
-    processMessage(msg, len, uid, pid, mQueue, mLogEventFilter);
+    if (tag == kStatsEventBatchTag) {
+        parseBatchedMessage(msg, len, uid, pid, filter, events, rateLimiter);
+        return;
+    }
+    if (rateLimiter != nullptr && !rateLimiter->tryAcquire(uid)) {
+        StatsdStats::getInstance().noteUidRateLimited(uid);
+        return;
+    }
+    events.push_back(parseMessage(msg, len, uid, pid, filter));
+}
 
-    return true;
+void StatsSocketListener::parseBatchedMessage(const uint8_t* msg, uint32_t len, uint32_t uid,
+                                              uint32_t pid,
+                                              const std::shared_ptr<LogEventFilter>& filter,
+                                              std::vector<std::unique_ptr<LogEvent>>& events,
+                                              UidRateLimiter* rateLimiter) {
+    while (len >= sizeof(uint16_t)) {
+        uint16_t recordSize;
+        memcpy(&recordSize, msg, sizeof(recordSize));
+        msg += sizeof(uint16_t);
+        len -= sizeof(uint16_t);
+        if (recordSize == 0 || recordSize > len) {
+            ALOGW("Batched message from uid %d has a malformed record", uid);
+            return;
+        }
+        if (rateLimiter != nullptr && !rateLimiter->tryAcquire(uid)) {
+            StatsdStats::getInstance().noteUidRateLimited(uid);
+        } else {
+            events.push_back(parseMessage(msg, recordSize, uid, pid, filter));
+        }
+        msg += recordSize;
+        len -= recordSize;
+    }
 }
 
 void StatsSocketListener::processMessage(const uint8_t* msg, uint32_t len, uint32_t uid,
                                          uint32_t pid, const std::shared_ptr<LogEventQueue>& queue,
                                          const std::shared_ptr<LogEventFilter>& filter) {
-    std::unique_ptr<LogEvent> logEvent = std::make_unique<LogEvent>(uid, pid);
-
-    if (filter->getFilteringEnabled()) {
-        const LogEvent::BodyBufferInfo bodyInfo = logEvent->parseHeader(msg, len);
-        if (filter->isAtomInUse(logEvent->GetTagId())) {
-            logEvent->parseBody(bodyInfo);
-        }
-    } else {
-        logEvent->parseBuffer(msg, len);
-    }
+    std::unique_ptr<LogEvent> logEvent = parseMessage(msg, len, uid, pid, filter);
 
     const int32_t atomId = logEvent->GetTagId();
     const bool isAtomSkipped = logEvent->isParsedHeaderOnly();
     const int64_t atomTimestamp = logEvent->GetElapsedTimestampNs();
+    const EventPriority priority = logEvent->getPriority();
 
-    if (atomId == util::STATS_SOCKET_LOSS_REPORTED) {
-        if (isAtomSkipped) {
+    const auto [success, oldestTimestamp, queueSize] = queue->push(std::move(logEvent));
+    if (success) {
+        StatsdStats::getInstance().noteEventQueueSize(queueSize, atomTimestamp);
+    } else {
+        StatsdStats::getInstance().noteEventQueueOverflow(oldestTimestamp, atomId, isAtomSkipped,
+                                                          priority);
+    }
+}
+
+std::unique_ptr<LogEvent> StatsSocketListener::parseMessage(
+        const uint8_t* msg, uint32_t len, uint32_t uid, uint32_t pid,
+        const std::shared_ptr<LogEventFilter>& filter) {
+    std::unique_ptr<LogEvent> logEvent = LogEventPool::getInstance().obtain(uid, pid);
+
+    // The body is only copied here and parsed by the first reader of the event, which for queued
+    // events is the processor thread.
+    const LogEvent::BodyBufferInfo bodyInfo = logEvent->parseHeader(msg, len);
+    if (!filter->getFilteringEnabled() || filter->isAtomInUse(logEvent->GetTagId())) {
+        logEvent->setFieldMask(filter->getFieldMask(logEvent->GetTagId()));
+        logEvent->deferBody(bodyInfo);
+        if (StatsdStats::getInstance().shouldTraceLatency()) {
+            logEvent->setLatencyTraceStartNs(getElapsedRealtimeNs());
+        }
+        if (filter->isAtomCritical(logEvent->GetTagId())) {
+            logEvent->setPriority(EVENT_PRIORITY_CRITICAL);
+        }
+    } else {
+        logEvent->setPriority(EVENT_PRIORITY_LOW);
+    }
+
+    if (logEvent->GetTagId() == util::STATS_SOCKET_LOSS_REPORTED) {
+        if (logEvent->isParsedHeaderOnly()) {
             ALOGW("Atom STATS_SOCKET_LOSS_REPORTED should not be skipped");
         }
 
@@ -165,11 +442,25 @@ void StatsSocketListener::processMessage(const uint8_t* msg, uint32_t len, uint3
         }
     }
 
-    const auto [success, oldestTimestamp, queueSize] = queue->push(std::move(logEvent));
-    if (success) {
-        StatsdStats::getInstance().noteEventQueueSize(queueSize, atomTimestamp);
-    } else {
-        StatsdStats::getInstance().noteEventQueueOverflow(oldestTimestamp, atomId, isAtomSkipped);
+    return logEvent;
+}
+
+void StatsSocketListener::pushEvents(std::vector<std::unique_ptr<LogEvent>>& events,
+                                     const std::shared_ptr<LogEventQueue>& queue) {
+    if (events.empty()) {
+        return;
+    }
+
+    const LogEventQueue::BatchResult result = queue->pushBatch(events);
+    if (result.pushedCount > 0) {
+        // The queue size is the largest right after the last event of the batch is pushed.
+        StatsdStats::getInstance().noteEventQueueSize(result.size, result.lastTimestampNs);
+        STATSD_TRACE_COUNTER("statsd_event_queue_size", result.size);
+    }
+    for (size_t i = result.pushedCount; i < events.size(); i++) {
+        StatsdStats::getInstance().noteEventQueueOverflow(
+                result.oldestTimestampNs, events[i]->GetTagId(), events[i]->isParsedHeaderOnly(),
+                events[i]->getPriority());
     }
 }
 
@@ -16,10 +16,15 @@
 #pragma once
 
 #include <gtest/gtest_prod.h>
+#include <linux/filter.h>
 #include <sysutils/SocketListener.h>
+#include <sys/socket.h>
 #include <utils/RefBase.h>
 
+#include <vector>
+
 #include "LogEventFilter.h"
+#include "UidRateLimiter.h"
 #include "logd/LogEventQueue.h"
 
 // DEFAULT_OVERFLOWUID is defined in linux/highuid.h, which is not part of
@@ -36,19 +41,126 @@ namespace android {
 namespace os {
 namespace statsd {
 
+struct DatagramRecord;
+
 class StatsSocketListener : public SocketListener, public virtual RefBase {
 public:
     explicit StatsSocketListener(const std::shared_ptr<LogEventQueue>& queue,
                                  const std::shared_ptr<LogEventFilter>& logEventFilter);
 
-    virtual ~StatsSocketListener() = default;
+    virtual ~StatsSocketListener();
+
+    // Tag of a datagram that carries several atoms, each prefixed with its uint16_t size.
+    // Must be kept in sync with kStatsEventBatchTag in libstatssocket's stats_buffer_writer.c.
+    static constexpr uint32_t kStatsEventBatchTag = 1937006965;
+
+    // The socket filter keeps one in kAtomFilterSampleRate of the atoms not in use, on average,
+    // truncated to kSampledAtomSize bytes, so that StatsdStats still counts them. Must be a power
+    // of 2.
+    static constexpr uint32_t kAtomFilterSampleRate = 64;
+    static const uint32_t kSampledAtomSize;
+
+    /**
+     * @brief Attaches a socket filter that drops in the kernel the datagrams of the atoms which
+     * are not in atomIds, but for a sample of them, see kAtomFilterSampleRate. Datagrams that are
+     * not a single well-formed atom are always kept, as are the atoms statsd handles before
+     * filtering
+     *
+     * @param socket datagram socket receiving the atoms
+     * @param atomIds atoms to keep, nullptr or an empty set to detach the filter
+     */
+    static void updateAtomFilter(int socket, const LogEventFilter::AtomIdSet* atomIds);
 
 protected:
     bool onDataAvailable(SocketClient* cli) override;
 
 private:
+    // Maximum number of datagrams drained from the socket per onDataAvailable() wakeup.
+    static constexpr size_t kMaxBatchSize = 16;
+
+    // + 1 to ensure null terminator if MAX_PAYLOAD buffer is received
+    static constexpr size_t kDatagramBufferSize =
+            sizeof(android_log_header_t) + LOGGER_ENTRY_MAX_PAYLOAD + 1;
+
+    // Largest socket filter program the kernel accepts.
+    static constexpr size_t kMaxAtomFilterSize = BPF_MAXINSNS;
+
+    StatsSocketListener(const std::shared_ptr<LogEventQueue>& queue,
+                        const std::shared_ptr<LogEventFilter>& logEventFilter, int socket);
+
     static int getLogSocket();
 
+    /**
+     * @brief Helper API to compile the socket filter program of updateAtomFilter(). Atom ids
+     * are found with a binary search, so the cost per datagram is logarithmic in their number
+     *
+     * @param atomIds atoms to keep
+     * @return the program, empty if it would be larger than kMaxAtomFilterSize
+     */
+    static std::vector<struct sock_filter> buildAtomFilter(
+            const LogEventFilter::AtomIdSet& atomIds);
+
+    /**
+     * @brief Helper API to handle one received datagram: either notes the dropped events
+     * reported by the client, or parses the atoms it carries into LogEvents.
+     *
+     * @param buffer datagram payload including the android_log_header_t
+     * @param n size of the datagram in bytes
+     * @param hdr message header the datagram was received with, to extract the credentials
+     * @param filter to be used for event evaluation
+     * @param events parsed LogEvents are appended to it
+     * @param rateLimiter drops the atoms of the uids over their rate before they are parsed,
+     * nullptr to keep every atom
+     */
+    static void processDatagram(uint8_t* buffer, ssize_t n, struct msghdr* hdr,
+                                const std::shared_ptr<LogEventFilter>& filter,
+                                std::vector<std::unique_ptr<LogEvent>>& events,
+                                UidRateLimiter* rateLimiter = nullptr);
+
+    /**
+     * @brief Helper API to split a batched message into its atoms and parse each of them
+     * Parsing stops at the first record whose size prefix runs past the end of the message.
+     *
+     * @param msg batched message following the kStatsEventBatchTag
+     * @param len size of msg in bytes
+     * @param uid arguments for LogEvent constructor
+     * @param pid arguments for LogEvent constructor
+     * @param filter to be used for event evaluation
+     * @param events parsed LogEvents are appended to it
+     * @param rateLimiter same as for processDatagram(), applied to each atom of the batch
+     */
+    static void parseBatchedMessage(const uint8_t* msg, uint32_t len, uint32_t uid, uint32_t pid,
+                                    const std::shared_ptr<LogEventFilter>& filter,
+                                    std::vector<std::unique_ptr<LogEvent>>& events,
+                                    UidRateLimiter* rateLimiter = nullptr);
+
+    // Returns the limiter configured by SOCKET_UID_RATE_LIMIT_FLAG and
+    // SOCKET_UID_BURST_SIZE_FLAG.
+    static UidRateLimiter createUidRateLimiter();
+
+    /**
+     * @brief Helper API to parse buffer and make the LogEvent
+     *
+     * @param msg buffer to parse
+     * @param len size of buffer in bytes
+     * @param uid arguments for LogEvent constructor
+     * @param pid arguments for LogEvent constructor
+     * @param filter to be used for event evaluation
+     */
+    static std::unique_ptr<LogEvent> parseMessage(const uint8_t* msg, uint32_t len, uint32_t uid,
+                                                  uint32_t pid,
+                                                  const std::shared_ptr<LogEventFilter>& filter);
+
+    /**
+     * @brief Helper API to submit a batch of parsed events into the queue with a single queue
+     * operation and to note the queue stats
+     *
+     * @param events events to submit, the vector is left in an unspecified state
+     * @param queue queue to submit the events
+     */
+    static void pushEvents(std::vector<std::unique_ptr<LogEvent>>& events,
+                           const std::shared_ptr<LogEventQueue>& queue);
+
     /**
      * @brief Helper API to parse buffer, make the LogEvent & submit it into the queue
      * Created as a separate API to be easily tested without StatsSocketListener instance
@@ -71,16 +183,41 @@ private:
 
     std::shared_ptr<LogEventFilter> mLogEventFilter;
 
+    UidRateLimiter mUidRateLimiter;
+
+    /**
+     * Buffers reused across onDataAvailable() calls to receive up to kMaxBatchSize datagrams
+     * with a single recvmmsg().
+     */
+    std::vector<uint8_t> mDatagramBuffers;
+    std::vector<uint8_t> mControlBuffers;
+    std::vector<struct iovec> mIovecs;
+    std::vector<struct mmsghdr> mMsgHeaders;
+
+    /**
+     * Scratch vector holding events parsed in one batch before they are pushed to the queue.
+     */
+    std::vector<std::unique_ptr<LogEvent>> mEventsBatch;
+
     friend class SocketParseMessageTest;
     friend void generateAtomLogging(const std::shared_ptr<LogEventQueue>& queue,
                                     const std::shared_ptr<LogEventFilter>& filter, int eventCount,
                                     int startAtomId);
+    friend void replayDatagram(const DatagramRecord& record,
+                               const std::shared_ptr<LogEventFilter>& filter,
+                               std::vector<std::unique_ptr<LogEvent>>& events);
 
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessage);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageEmptySetExplicitSet);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterCompleteSet);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterPartialSet);
     FRIEND_TEST(SocketParseMessageTest, TestProcessMessageFilterToggle);
+    FRIEND_TEST(SocketParseMessageTest, TestParseBatchedMessage);
+    FRIEND_TEST(SocketParseMessageTest, TestParseBatchedMessageTruncated);
+    FRIEND_TEST(SocketAtomFilterTest, TestDropsAtomsNotInUse);
+    FRIEND_TEST(SocketAtomFilterTest, TestLargeAtomIdSet);
+    FRIEND_TEST(SocketAtomFilterTest, TestSampledAtomsNotInUse);
+    FRIEND_TEST(SocketParseMessageTest, TestParseBatchedMessageRateLimited);
     FRIEND_TEST(LogEventQueue_test, TestQueueMaxSize);
 };
 
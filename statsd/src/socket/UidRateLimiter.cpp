@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "UidRateLimiter.h"
+
+#include <log/log_time.h>
+
+#include <algorithm>
+#include <iterator>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+UidRateLimiter::UidRateLimiter(int64_t eventsPerSec, int64_t burstSize)
+    : mEventsPerSec(std::max<int64_t>(eventsPerSec, 0)),
+      mBurstSize(std::max<int64_t>(burstSize, 0)),
+      // Bounded so that refills cannot overflow.
+      mScaledCapacity(std::min<int64_t>(mBurstSize, INT32_MAX) * NS_PER_SEC),
+      mOverflowBucket{mScaledCapacity, 0} {
+}
+
+void UidRateLimiter::advanceTo(int64_t timestampNs) {
+    mTimestampNs = std::max(mTimestampNs, timestampNs);
+}
+
+bool UidRateLimiter::tryAcquire(int32_t uid) {
+    if (!isEnabled() || uid % kUserUidOffset < kAppUidStart) {
+        return true;
+    }
+    auto it = mBuckets.find(uid);
+    if (it == mBuckets.end()) {
+        if (mBuckets.size() >= kMaxTrackedUids) {
+            evictFullBuckets();
+        }
+        if (mBuckets.size() >= kMaxTrackedUids) {
+            return tryAcquire(mOverflowBucket);
+        }
+        it = mBuckets.emplace(uid, Bucket{mScaledCapacity, mTimestampNs}).first;
+    }
+    return tryAcquire(it->second);
+}
+
+bool UidRateLimiter::tryAcquire(Bucket& bucket) {
+    if (isFull(bucket)) {
+        bucket.scaledTokens = mScaledCapacity;
+    } else {
+        bucket.scaledTokens = std::min(
+                mScaledCapacity,
+                bucket.scaledTokens + (mTimestampNs - bucket.lastRefillNs) * mEventsPerSec);
+    }
+    bucket.lastRefillNs = mTimestampNs;
+    if (bucket.scaledTokens < NS_PER_SEC) {
+        return false;
+    }
+    bucket.scaledTokens -= NS_PER_SEC;
+    return true;
+}
+
+bool UidRateLimiter::isFull(const Bucket& bucket) const {
+    // elapsedNs * mEventsPerSec would overflow long before the bucket is full.
+    const int64_t elapsedNs = mTimestampNs - bucket.lastRefillNs;
+    return elapsedNs >= (mScaledCapacity - bucket.scaledTokens) / mEventsPerSec + 1;
+}
+
+void UidRateLimiter::evictFullBuckets() {
+    // A flood of new uids would go through the buckets for each of them otherwise.
+    if (mLastEvictionNs == mTimestampNs) {
+        return;
+    }
+    mLastEvictionNs = mTimestampNs;
+    for (auto it = mBuckets.begin(); it != mBuckets.end();) {
+        it = isFull(it->second) ? mBuckets.erase(it) : std::next(it);
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
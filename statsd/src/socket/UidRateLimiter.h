@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <gtest/gtest_prod.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Token bucket per sending app uid, applied by StatsSocketListener to the atoms it receives
+ * before it parses them, so that a single app flooding the socket cannot fill the LogEventQueue
+ * for everyone. Every app uid may send eventsPerSec atoms per second on average, and up to
+ * burstSize atoms at once.
+ *
+ * Uids below kAppUidStart (system components) are never limited. Not thread safe: only used by
+ * the socket listener thread.
+ */
+class UidRateLimiter {
+public:
+    // App uids start from here (AID_APP_START) in every user.
+    static constexpr int32_t kAppUidStart = 10000;
+    static constexpr int32_t kUserUidOffset = 100000;
+
+    // Limits the number of uids tracked. Once reached, the buckets that refilled are dropped,
+    // since a full bucket is the same as a new one, and the uids that still do not fit share a
+    // single bucket.
+    static constexpr size_t kMaxTrackedUids = 5000;
+
+    // Disabled if eventsPerSec or burstSize is not positive.
+    UidRateLimiter(int64_t eventsPerSec, int64_t burstSize);
+
+    inline bool isEnabled() const {
+        return mEventsPerSec > 0 && mBurstSize > 0;
+    }
+
+    // Refills the buckets up to timestampNs. Called before the atoms received at that time are
+    // checked, timestamps must not decrease.
+    void advanceTo(int64_t timestampNs);
+
+    // Takes one atom from the bucket of uid. Returns false if the uid is over its rate, in which
+    // case the atom should be dropped.
+    bool tryAcquire(int32_t uid);
+
+private:
+    struct Bucket {
+        // Tokens scaled by NS_PER_SEC, an atom costs NS_PER_SEC of them.
+        int64_t scaledTokens;
+        int64_t lastRefillNs;
+    };
+
+    // Refills bucket up to mTimestampNs and takes one atom from it.
+    bool tryAcquire(Bucket& bucket);
+
+    // Whether bucket is full once refilled up to mTimestampNs.
+    bool isFull(const Bucket& bucket) const;
+
+    // Drops the buckets that are full, at most once per timestamp.
+    void evictFullBuckets();
+
+    const int64_t mEventsPerSec;
+    const int64_t mBurstSize;
+
+    // mBurstSize scaled like the tokens of a Bucket.
+    const int64_t mScaledCapacity;
+
+    int64_t mTimestampNs = 0;
+
+    std::unordered_map<int32_t, Bucket> mBuckets;
+
+    // Shared by the uids that do not fit in mBuckets.
+    Bucket mOverflowBucket;
+
+    // When evictFullBuckets() last went through mBuckets, -1 if never.
+    int64_t mLastEvictionNs = -1;
+
+    FRIEND_TEST(UidRateLimiterTest, TestMaxTrackedUids);
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
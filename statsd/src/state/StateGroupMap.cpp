@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "state/StateGroupMap.h"
+
+#include "state/StateTracker.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+StateGroupMap::StateGroupMap(
+        const std::unordered_map<int32_t, std::unordered_map<int, int64_t>>& stateGroups) {
+    mAtoms.reserve(stateGroups.size());
+    for (const auto& [atomId, groupIds] : stateGroups) {
+        AtomStateGroups atom;
+        atom.atomId = atomId;
+        for (const auto& [stateValue, groupId] : groupIds) {
+            if (stateValue < 0 || stateValue >= kMaxDenseStateValue) {
+                atom.sparseGroupIds[stateValue] = groupId;
+                continue;
+            }
+            if (static_cast<size_t>(stateValue) >= atom.denseGroupIds.size()) {
+                atom.denseGroupIds.resize(stateValue + 1);
+            }
+            atom.denseGroupIds[stateValue] = groupId;
+        }
+        mAtoms.push_back(std::move(atom));
+    }
+}
+
+void StateGroupMap::mapStateValue(int32_t atomId, Value* value) const {
+    for (const AtomStateGroups& atom : mAtoms) {
+        if (atom.atomId != atomId) {
+            continue;
+        }
+        const int stateValue = value->int_value;
+        if (stateValue >= 0 && static_cast<size_t>(stateValue) < atom.denseGroupIds.size()) {
+            const std::optional<int64_t>& groupId = atom.denseGroupIds[stateValue];
+            if (groupId.has_value()) {
+                value->setLong(*groupId);
+                return;
+            }
+        } else if (!atom.sparseGroupIds.empty()) {
+            const auto it = atom.sparseGroupIds.find(stateValue);
+            if (it != atom.sparseGroupIds.end()) {
+                value->setLong(it->second);
+                return;
+            }
+        }
+        // The atom has state groups, but the value was not put in one.
+        // TODO(tsaichristine): handle incomplete state maps
+        value->setInt(StateTracker::kStateUnknown);
+        return;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
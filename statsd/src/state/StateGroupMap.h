@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FieldValue.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * The state groups of the sliced state atoms of a metric, <atom_id, <value, group_id>>, compiled
+ * for lookups by raw state value. State values are mostly small enum values, so the groups of
+ * values in [0, kMaxDenseStateValue) are looked up in an array indexed by the value, and only
+ * the other values in a hash map.
+ */
+class StateGroupMap {
+public:
+    StateGroupMap() = default;
+
+    explicit StateGroupMap(
+            const std::unordered_map<int32_t, std::unordered_map<int, int64_t>>& stateGroups);
+
+    // Replaces value, a state of atomId, with its group id. Sets it to kStateUnknown if the
+    // state is in no group of the atom, and leaves it as is if the atom has no state groups.
+    void mapStateValue(int32_t atomId, Value* value) const;
+
+    static constexpr int kMaxDenseStateValue = 256;
+
+private:
+    struct AtomStateGroups {
+        int32_t atomId;
+        // Indexed by state value, up to the largest grouped value below kMaxDenseStateValue.
+        std::vector<std::optional<int64_t>> denseGroupIds;
+        std::unordered_map<int, int64_t> sparseGroupIds;
+    };
+
+    // Metrics slice by a handful of atoms at most, so they are searched linearly.
+    std::vector<AtomStateGroups> mAtoms;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -47,6 +47,15 @@ public:
     virtual void onStateChanged(const int64_t eventTimeNs, const int32_t atomId,
                                 const HashableDimensionKey& primaryKey, const FieldValue& oldState,
                                 const FieldValue& newState) = 0;
+
+    /**
+     * Whether the listener acts on state changes. Listeners that only query
+     * state values when their own events arrive return false, and StateTrackers
+     * then skip them when notifying. Read once, when the listener is registered.
+     */
+    virtual bool needsStateChangeNotifications() const {
+        return true;
+    }
 };
 
 }  // namespace statsd
@@ -38,18 +38,22 @@ StateManager& StateManager::getInstance() {
 
 void StateManager::clear() {
     mStateTrackers.clear();
+    mTrackersGeneration++;
 }
 
 void StateManager::onLogEvent(const LogEvent& event) {
+    // Most events are not state atoms, so look up the tracker before checking the log source.
+    const auto it = mStateTrackers.find(event.GetTagId());
+    if (it == mStateTrackers.end()) {
+        return;
+    }
     // Only process state events from uids in AID_* and packages that are whitelisted in
     // mAllowedPkg.
     // Allowlisted AIDs are AID_ROOT and all AIDs in [1000, 2000) which is [AID_SYSTEM, AID_SHELL)
     if (event.GetUid() == AID_ROOT ||
         (event.GetUid() >= AID_SYSTEM && event.GetUid() < AID_SHELL) ||
         mAllowedLogSources.find(event.GetUid()) != mAllowedLogSources.end()) {
-        if (mStateTrackers.find(event.GetTagId()) != mStateTrackers.end()) {
-            mStateTrackers[event.GetTagId()]->onLogEvent(event);
-        }
+        it->second->onLogEvent(event);
     }
 }
 
@@ -57,6 +61,7 @@ void StateManager::registerListener(const int32_t atomId, const wp<StateListener
     // Check if state tracker already exists.
     if (mStateTrackers.find(atomId) == mStateTrackers.end()) {
         mStateTrackers[atomId] = new StateTracker(atomId);
+        mTrackersGeneration++;
     }
     mStateTrackers[atomId]->registerListener(listener);
 }
@@ -77,6 +82,7 @@ void StateManager::unregisterListener(const int32_t atomId, const wp<StateListen
         if (it->second->getListenersCount() == 0) {
             toRemove = it->second;
             mStateTrackers.erase(it);
+            mTrackersGeneration++;
         }
     } else {
         ALOGE("StateManager cannot unregister listener, StateTracker for atom %d does not exist",
@@ -68,6 +68,19 @@ public:
     bool getStateValue(int32_t atomId, const HashableDimensionKey& queryKey,
                        FieldValue* output) const;
 
+    // Returns the StateTracker for the given atomId, or nullptr if there is none. The pointer is
+    // valid for as long as getTrackersGeneration() returns the same value.
+    const StateTracker* findStateTracker(int32_t atomId) const {
+        const auto it = mStateTrackers.find(atomId);
+        return it != mStateTrackers.end() ? it->second.get() : nullptr;
+    }
+
+    // Changes whenever a StateTracker is added or removed, so that callers can hold on to the
+    // result of findStateTracker() instead of looking the tracker up for every query.
+    inline uint64_t getTrackersGeneration() const {
+        return mTrackersGeneration;
+    }
+
     // Updates mAllowedLogSources with the latest uids for the packages that are allowed to log.
     void updateLogSources(const sp<UidMap>& uidMap);
 
@@ -93,6 +106,10 @@ private:
     // Maps state atom ids to StateTrackers
     std::unordered_map<int32_t, sp<StateTracker>> mStateTrackers;
 
+    // Incremented whenever mStateTrackers gains or loses a tracker. Starts at 1, so that 0
+    // never matches.
+    uint64_t mTrackersGeneration = 1;
+
     // The package names that can log state events.
     const std::set<std::string> mAllowedPkg;
 
@@ -21,6 +21,8 @@
 
 #include "StateTracker.h"
 
+#include <algorithm>
+
 namespace android {
 namespace os {
 namespace statsd {
@@ -63,11 +65,22 @@ void StateTracker::onLogEvent(const LogEvent& event) {
 }
 
 void StateTracker::registerListener(const wp<StateListener>& listener) {
-    mListeners.insert(listener);
+    if (std::find(mListeners.begin(), mListeners.end(), listener) != mListeners.end() ||
+        std::find(mQueryOnlyListeners.begin(), mQueryOnlyListeners.end(), listener) !=
+                mQueryOnlyListeners.end()) {
+        return;
+    }
+    const sp<StateListener> sl = listener.promote();
+    if (sl != nullptr && !sl->needsStateChangeNotifications()) {
+        mQueryOnlyListeners.push_back(listener);
+    } else {
+        mListeners.push_back(listener);
+    }
 }
 
 void StateTracker::unregisterListener(const wp<StateListener>& listener) {
-    mListeners.erase(listener);
+    std::erase(mListeners, listener);
+    std::erase(mQueryOnlyListeners, listener);
 }
 
 bool StateTracker::getStateValue(const HashableDimensionKey& queryKey, FieldValue* output) const {
@@ -96,8 +109,7 @@ void StateTracker::handleReset(const int64_t eventTimeNs, const FieldValue& newS
 void StateTracker::clearStateForPrimaryKey(const int64_t eventTimeNs,
                                            const HashableDimensionKey& primaryKey) {
     VLOG("StateTracker clear state for primary key");
-    const std::unordered_map<HashableDimensionKey, StateValueInfo>::iterator it =
-            mStateMap.find(primaryKey);
+    const auto it = mStateMap.find(primaryKey);
 
     // If there is no entry for the primaryKey in mStateMap, then the state is already
     // kStateUnknown.
@@ -156,7 +168,8 @@ void StateTracker::updateStateForPrimaryKey(const int64_t eventTimeNs,
 
     // Clear primary key entry from state map if state is now unknown.
     // stateValueInfo points to a value in mStateMap and should not be accessed after erasing the
-    // entry
+    // entry. Resets never set the state to unknown, so this does not erase entries while
+    // handleReset iterates over mStateMap.
     if (newStateValue == kStateUnknown) {
         mStateMap.erase(primaryKey);
     }
@@ -20,8 +20,9 @@
 #include "logd/LogEvent.h"
 
 #include "state/StateListener.h"
+#include "utils/FlatHashMap.h"
 
-#include <unordered_map>
+#include <vector>
 
 namespace android {
 namespace os {
@@ -38,8 +39,9 @@ public:
     // the log event and comparing the old and new states.
     void onLogEvent(const LogEvent& event);
 
-    // Adds new listeners to set of StateListeners. If a listener is already
-    // registered, it is ignored.
+    // Adds new listeners to the StateListeners. If a listener is already
+    // registered, it is ignored. Listeners that do not need state change notifications
+    // are kept apart and never notified.
     void registerListener(const wp<StateListener>& listener);
 
     void unregisterListener(const wp<StateListener>& listener);
@@ -52,7 +54,7 @@ public:
     bool getStateValue(const HashableDimensionKey& queryKey, FieldValue* output) const;
 
     inline int getListenersCount() const {
-        return mListeners.size();
+        return mListeners.size() + mQueryOnlyListeners.size();
     }
 
     const static int kStateUnknown = -1;
@@ -66,10 +68,14 @@ private:
     Field mField;
 
     // Maps primary key to state value info
-    std::unordered_map<HashableDimensionKey, StateValueInfo> mStateMap;
+    FlatHashMap<HashableDimensionKey, StateValueInfo> mStateMap;
 
-    // Set of all StateListeners (objects listening for state changes)
-    std::set<wp<StateListener>> mListeners;
+    // StateListeners that are notified of state changes, in registration order.
+    std::vector<wp<StateListener>> mListeners;
+
+    // StateListeners that only query state values. They keep the tracker alive, but notifying
+    // them would only promote and call into them for nothing.
+    std::vector<wp<StateListener>> mQueryOnlyListeners;
 
     // Reset all state values in map to the given state.
     void handleReset(const int64_t eventTimeNs, const FieldValue& newState);
@@ -55,6 +55,9 @@ const int DIMENSIONS_VALUE_VALUE_STR_HASH = 8;
 
 const int DIMENSIONS_VALUE_TUPLE_VALUE = 1;
 
+// for StatsLogReport proto
+const int FIELD_ID_DIMENSION_DICTIONARY = 18;
+
 // for StateValue Proto
 const int STATE_VALUE_ATOM_ID = 1;
 const int STATE_VALUE_CONTENTS_GROUP_ID = 2;
@@ -104,7 +107,7 @@ const int FIELD_ID_BUCKET_COUNT = 12;
 namespace {
 
 void writeDimensionToProtoHelper(const std::vector<FieldValue>& dims, size_t* index, int depth,
-                                 int prefix, std::set<string>* str_set,
+                                 int prefix, StringSet* str_set,
                                  ProtoOutputStream* protoOutput) {
     size_t count = dims.size();
     while (*index < count) {
@@ -173,7 +176,7 @@ void writeDimensionToProtoHelper(const std::vector<FieldValue>& dims, size_t* in
 
 void writeDimensionLeafToProtoHelper(const std::vector<FieldValue>& dims,
                                      const int dimensionLeafField, size_t* index, int depth,
-                                     int prefix, std::set<string>* str_set,
+                                     int prefix, StringSet* str_set,
                                      ProtoOutputStream* protoOutput) {
     size_t count = dims.size();
     while (*index < count) {
@@ -272,7 +275,7 @@ void writeDimensionPathToProtoHelper(const std::vector<Matcher>& fieldMatchers,
 
 }  // namespace
 
-void writeDimensionToProto(const HashableDimensionKey& dimension, std::set<string> *str_set,
+void writeDimensionToProto(const HashableDimensionKey& dimension, StringSet* str_set,
                            ProtoOutputStream* protoOutput) {
     if (dimension.getValues().size() == 0) {
         return;
@@ -287,7 +290,7 @@ void writeDimensionToProto(const HashableDimensionKey& dimension, std::set<strin
 
 void writeDimensionLeafNodesToProto(const HashableDimensionKey& dimension,
                                     const int dimensionLeafFieldId,
-                                    std::set<string> *str_set,
+                                    StringSet* str_set,
                                     ProtoOutputStream* protoOutput) {
     if (dimension.getValues().size() == 0) {
         return;
@@ -310,6 +313,62 @@ void writeDimensionPathToProto(const std::vector<Matcher>& fieldMatchers,
     protoOutput->end(topToken);
 }
 
+DimensionDictionary::DimensionDictionary(bool useNestedDimensions)
+    : mUseNestedDimensions(useNestedDimensions) {
+}
+
+int DimensionDictionary::indexOf(const HashableDimensionKey& dimension) {
+    const auto [it, inserted] = mIndices.try_emplace(dimension, mDimensions.size());
+    if (inserted) {
+        mDimensions.push_back(&it->first);
+    }
+    return it->second;
+}
+
+void DimensionDictionary::writeToProto(StringSet* str_set,
+                                       ProtoOutputStream* protoOutput) const {
+    for (const HashableDimensionKey* dimension : mDimensions) {
+        uint64_t entryToken = protoOutput->start(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED |
+                                                 FIELD_ID_DIMENSION_DICTIONARY);
+        if (mUseNestedDimensions) {
+            uint64_t dimensionToken = protoOutput->start(
+                    FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | DIMENSIONS_VALUE_TUPLE_VALUE);
+            writeDimensionToProto(*dimension, str_set, protoOutput);
+            protoOutput->end(dimensionToken);
+        } else {
+            writeDimensionLeafNodesToProto(*dimension, DIMENSIONS_VALUE_TUPLE_VALUE, str_set,
+                                           protoOutput);
+        }
+        protoOutput->end(entryToken);
+    }
+}
+
+static void writeLeafValueToStream(const Value& value, const uint64_t fieldId,
+                                   ProtoOutputStream* protoOutput) {
+    switch (value.getType()) {
+        case INT:
+            protoOutput->write(FIELD_TYPE_INT32 | fieldId, value.int_value);
+            break;
+        case LONG:
+            protoOutput->write(FIELD_TYPE_INT64 | fieldId, (long long)value.long_value);
+            break;
+        case FLOAT:
+            protoOutput->write(FIELD_TYPE_FLOAT | fieldId, value.float_value);
+            break;
+        case STRING:
+            protoOutput->write(FIELD_TYPE_STRING | fieldId, value.str_value);
+            break;
+        case STORAGE:
+            // Byte fields are never repeated.
+            protoOutput->write(FIELD_TYPE_MESSAGE | (fieldId & ~FIELD_COUNT_REPEATED),
+                               (const char*)value.storage_value.data(),
+                               value.storage_value.size());
+            break;
+        default:
+            break;
+    }
+}
+
 // Supported Atoms format
 // XYZ_Atom {
 //     repeated SubMsg field_1 = 1;
@@ -354,32 +413,7 @@ void writeFieldValueTreeToStreamHelper(int tagId, const std::vector<FieldValue>&
         // If valueDepth == 1, we're writing a repeated field. Use fieldNum at depth 0 instead
         // of valueDepth.
         if ((depth == valueDepth || valueDepth == 1) && valuePrefix == prefix) {
-            switch (dim.mValue.getType()) {
-                case INT:
-                    protoOutput->write(FIELD_TYPE_INT32 | repeatedFieldMask | fieldNum,
-                                       dim.mValue.int_value);
-                    break;
-                case LONG:
-                    protoOutput->write(FIELD_TYPE_INT64 | repeatedFieldMask | fieldNum,
-                                       (long long)dim.mValue.long_value);
-                    break;
-                case FLOAT:
-                    protoOutput->write(FIELD_TYPE_FLOAT | repeatedFieldMask | fieldNum,
-                                       dim.mValue.float_value);
-                    break;
-                case STRING: {
-                    protoOutput->write(FIELD_TYPE_STRING | repeatedFieldMask | fieldNum,
-                                       dim.mValue.str_value);
-                    break;
-                }
-                case STORAGE:
-                    protoOutput->write(FIELD_TYPE_MESSAGE | fieldNum,
-                                       (const char*)dim.mValue.storage_value.data(),
-                                       dim.mValue.storage_value.size());
-                    break;
-                default:
-                    break;
-            }
+            writeLeafValueToStream(dim.mValue, repeatedFieldMask | fieldNum, protoOutput);
             (*index)++;
         } else if (valueDepth == depth + 2 && valuePrefix == prefix) {
             // Writing the sub tree
@@ -403,7 +437,14 @@ void writeFieldValueTreeToStream(int tagId, const std::vector<FieldValue>& value
                                  util::ProtoOutputStream* protoOutput) {
     uint64_t atomToken = protoOutput->start(FIELD_TYPE_MESSAGE | tagId);
 
+    // Most atoms have no repeated or nested fields. Their top level values up to the first
+    // nested one are written directly, and only the rest of the atom walks the field tree.
     size_t index = 0;
+    while (index < values.size() && values[index].mField.getDepth() == 0) {
+        writeLeafValueToStream(values[index].mValue, values[index].mField.getPosAtDepth(0),
+                               protoOutput);
+        index++;
+    }
     writeFieldValueTreeToStreamHelper(tagId, values, &index, 0, 0, protoOutput);
     protoOutput->end(atomToken);
 }
@@ -584,6 +625,12 @@ int64_t getWallClockMillis() {
     return time(nullptr) * MS_PER_SEC;
 }
 
+int64_t getThreadCpuTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
 int64_t truncateTimestampIfNecessary(const LogEvent& event) {
     if (event.shouldTruncateTimestamp() ||
         (event.GetTagId() >= StatsdStats::kTimestampTruncationStartTag &&
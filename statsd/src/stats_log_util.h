@@ -18,6 +18,9 @@
 
 #include <android/util/ProtoOutputStream.h>
 
+#include <unordered_map>
+#include <vector>
+
 #include "FieldValue.h"
 #include "HashableDimensionKey.h"
 #include "src/statsd_config.pb.h"
@@ -33,12 +36,12 @@ namespace statsd {
 
 void writeFieldValueTreeToStream(int tagId, const std::vector<FieldValue>& values,
                                  ProtoOutputStream* protoOutput);
-void writeDimensionToProto(const HashableDimensionKey& dimension, std::set<string> *str_set,
+void writeDimensionToProto(const HashableDimensionKey& dimension, StringSet* str_set,
                            ProtoOutputStream* protoOutput);
 
 void writeDimensionLeafNodesToProto(const HashableDimensionKey& dimension,
                                     const int dimensionLeafFieldId,
-                                    std::set<string> *str_set,
+                                    StringSet* str_set,
                                     ProtoOutputStream* protoOutput);
 
 void writeDimensionPathToProto(const std::vector<Matcher>& fieldMatchers,
@@ -46,6 +49,32 @@ void writeDimensionPathToProto(const std::vector<Matcher>& fieldMatchers,
 
 void writeStateToProto(const FieldValue& state, ProtoOutputStream* protoOutput);
 
+// Collects the distinct dimensions written to a StatsLogReport, so that each of them is written
+// once, in the dimension_dictionary of the report, and the metric data refer to it by index.
+class DimensionDictionary {
+public:
+    // useNestedDimensions tells whether the entries are DimensionsValue trees or leaf values.
+    explicit DimensionDictionary(bool useNestedDimensions);
+
+    // Returns the index of dimension in the dictionary, adding it if it is not there yet.
+    int indexOf(const HashableDimensionKey& dimension);
+
+    // Writes the entries as the dimension_dictionary of the StatsLogReport being written.
+    void writeToProto(StringSet* str_set, ProtoOutputStream* protoOutput) const;
+
+    size_t size() const {
+        return mDimensions.size();
+    }
+
+private:
+    const bool mUseNestedDimensions;
+
+    std::unordered_map<HashableDimensionKey, int> mIndices;
+
+    // The keys of mIndices by index. Rehashing mIndices does not move them.
+    std::vector<const HashableDimensionKey*> mDimensions;
+};
+
 // Convert the TimeUnit enum to the bucket size in millis with a guardrail on
 // bucket size.
 int64_t TimeUnitToBucketSizeInMillisGuardrailed(int uid, TimeUnit unit);
@@ -74,6 +103,9 @@ int64_t getWallClockMillis();
 // Gets the wall clock timestamp in seconds.
 int64_t getWallClockSec();
 
+// Gets the CPU time consumed by the calling thread in ns.
+int64_t getThreadCpuTimeNs();
+
 int64_t NanoToMillis(const int64_t nano);
 
 int64_t NanoToSeconds(const int64_t nano);
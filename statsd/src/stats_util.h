@@ -18,9 +18,12 @@
 
 #include <android-modules-utils/sdk_level.h>
 
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "HashableDimensionKey.h"
+#include "utils/FlatHashMap.h"
 
 namespace android {
 namespace os {
@@ -41,7 +44,47 @@ const MetricDimensionKey DEFAULT_METRIC_DIMENSION_KEY = MetricDimensionKey();
 
 typedef std::map<int64_t, HashableDimensionKey> ConditionKey;
 
-typedef std::unordered_map<MetricDimensionKey, int64_t> DimToValMap;
+typedef FlatHashMap<MetricDimensionKey, int64_t> DimToValMap;
+
+// The strings hashed in a report, sent in its strings field. Every string dimension value and
+// package name of the report is inserted, so most inserts find the string already there.
+typedef std::unordered_set<std::string> StringSet;
+
+// Value size function of dimensionMapByteSize() for values that own no heap memory.
+struct NoHeapBytes {
+    template <typename T>
+    size_t operator()(const T&) const {
+        return 0;
+    }
+};
+
+// Bytes used by a map keyed by dimension: its table, the heap memory of its keys and
+// valueHeapBytes(value) for the heap memory its values own.
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+          typename ValueHeapBytes = NoHeapBytes>
+size_t dimensionMapByteSize(const FlatHashMap<Key, T, Hash, KeyEqual>& map,
+                            ValueHeapBytes valueHeapBytes = {}) {
+    size_t bytes = map.tableByteSize();
+    for (const auto& [key, value] : map) {
+        bytes += key.heapByteSize() + valueHeapBytes(value);
+    }
+    return bytes;
+}
+
+// std::unordered_map allocates the bucket array and one node per entry, which holds the entry,
+// the next pointer and the hash. The allocator's own overhead is not included.
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+          typename ValueHeapBytes = NoHeapBytes>
+size_t dimensionMapByteSize(const std::unordered_map<Key, T, Hash, KeyEqual>& map,
+                            ValueHeapBytes valueHeapBytes = {}) {
+    using value_type = typename std::unordered_map<Key, T, Hash, KeyEqual>::value_type;
+    size_t bytes = map.bucket_count() * sizeof(void*) +
+                   map.size() * (sizeof(value_type) + sizeof(void*) + sizeof(size_t));
+    for (const auto& [key, value] : map) {
+        bytes += key.heapByteSize() + valueHeapBytes(value);
+    }
+    return bytes;
+}
 
 using ConditionLinks = google::protobuf::RepeatedPtrField<MetricConditionLink>;
 
@@ -63,6 +106,12 @@ inline bool shouldKeepRandomSample(int samplingPercentage) {
     return (rand() % (100) + 1) <= samplingPercentage;
 }
 
+// Returns a random index in [0, bound), from the same source as shouldKeepRandomSample.
+inline int64_t randomIndex(int64_t bound) {
+    const uint64_t value = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+    return (int64_t)(value % (uint64_t)bound);
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
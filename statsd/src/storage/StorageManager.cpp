@@ -21,14 +21,24 @@
 
 #include <android-base/file.h>
 #include <private/android_filesystem_config.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <map>
+#include <thread>
 
 #include "android-base/stringprintf.h"
 #include "guardrail/StatsdStats.h"
 #include "stats_log_util.h"
 #include "utils/DbUtils.h"
+#include "utils/ParallelFor.h"
+#include "utils/StatsdTrace.h"
 
 namespace android {
 namespace os {
@@ -48,6 +58,20 @@ using std::map;
 // for ConfigMetricsReportList
 const int FIELD_ID_REPORTS = 2;
 
+// Compressed reports start with this, followed by the size of the report and its zlib stream. A
+// serialized report never starts with a zero byte, since that is not a valid field tag.
+const char kCompressedReportMagic[4] = {0, 'S', 'Z', '1'};
+
+struct CompressedReportHeader {
+    char mMagic[4];
+    uint32_t mReportSizeBytes;
+};
+
+// Size of the chunks in which compressed reports are written.
+const size_t kCompressChunkBytes = 16 * 1024;
+
+static std::atomic<bool> sCompressReports = false;
+
 std::mutex StorageManager::sTrainInfoMutex;
 
 using android::base::StringPrintf;
@@ -74,29 +98,6 @@ string StorageManager::getDataHistoryFileName(long wallClockSec, int uid, int64_
                         (long long)id);
 }
 
-static string findTrainInfoFileNameLocked(const string& trainName) {
-    unique_ptr<DIR, decltype(&closedir)> dir(opendir(TRAIN_INFO_DIR), closedir);
-    if (dir == NULL) {
-        VLOG("Path %s does not exist", TRAIN_INFO_DIR);
-        return "";
-    }
-    dirent* de;
-    while ((de = readdir(dir.get()))) {
-        char* fileName = de->d_name;
-        if (fileName[0] == '.' || de->d_type == DT_DIR) continue;
-
-        size_t fileNameLength = strlen(fileName);
-        if (fileNameLength >= trainName.length()) {
-            if (0 == strncmp(fileName + fileNameLength - trainName.length(), trainName.c_str(),
-                             trainName.length())) {
-              return string(fileName);
-            }
-        }
-    }
-
-    return "";
-}
-
 // Returns array of int64_t which contains timestamp in seconds, uid,
 // configID and whether the file is a local history file.
 static void parseFileName(char* name, FileName* output) {
@@ -132,157 +133,333 @@ static ConfigKey parseDbName(char* name) {
     return ConfigKey(StrToInt64(uid), StrToInt64(configId));
 }
 
-void StorageManager::writeFile(const char* file, const void* buffer, int numBytes) {
-    int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        VLOG("Attempt to access %s but failed", file);
-        return;
-    }
-    trimToFit(STATS_SERVICE_DIR);
-    trimToFit(STATS_DATA_DIR);
+// A report or config file in an indexed directory.
+struct IndexedFile {
+    FileName mName;
+    int64_t mSizeBytes;
+};
 
-    if (android::base::WriteFully(fd, buffer, numBytes)) {
-        VLOG("Successfully wrote %s", file);
+// In-memory catalog of the report and config files, so that trimming the directories on every
+// write and finding the reports of a config don't list and stat the whole directory. Only statsd
+// writes these directories, and it does so through StorageManager, which keeps the catalog up to
+// date. It is rebuilt from disk whenever the directory has changed in any other way, which shows
+// up as an unexpected directory modification time.
+struct FileIndex {
+    const char* mPath;
+    bool mScanned;
+    timespec mDirMtime;
+    // Keyed by the file name without the directory.
+    map<string, IndexedFile> mFiles;
+};
+
+static std::mutex sFileIndexMutex;
+static FileIndex sDataDirIndex = {STATS_DATA_DIR, false, {}, {}};
+static FileIndex sServiceDirIndex = {STATS_SERVICE_DIR, false, {}, {}};
+
+static bool isSameTime(const timespec& lhs, const timespec& rhs) {
+    return lhs.tv_sec == rhs.tv_sec && lhs.tv_nsec == rhs.tv_nsec;
+}
+
+// Returns the index of dir brought up to date with the disk, or nullptr if dir is not indexed.
+// Changes to an indexed directory are made after this call and recorded with
+// noteFileChangedLocked, so that they are not mistaken for changes made elsewhere.
+static FileIndex* getFileIndexLocked(const string& path) {
+    FileIndex* index = nullptr;
+    if (path == STATS_DATA_DIR) {
+        index = &sDataDirIndex;
+    } else if (path == STATS_SERVICE_DIR) {
+        index = &sServiceDirIndex;
     } else {
-        ALOGE("Failed to write %s", file);
+        return nullptr;
     }
 
-    int result = fchown(fd, AID_STATSD, AID_STATSD);
-    if (result) {
-        VLOG("Failed to chown %s to statsd", file);
+    struct stat dirInfo;
+    if (stat(index->mPath, &dirInfo) != 0) {
+        index->mFiles.clear();
+        index->mScanned = false;
+        return index;
+    }
+    if (index->mScanned && isSameTime(dirInfo.st_mtim, index->mDirMtime)) {
+        return index;
     }
 
-    close(fd);
+    index->mFiles.clear();
+    index->mScanned = false;
+    unique_ptr<DIR, decltype(&closedir)> dir(opendir(index->mPath), closedir);
+    if (dir == NULL) {
+        VLOG("Path %s does not exist", index->mPath);
+        return index;
+    }
+    dirent* de;
+    while ((de = readdir(dir.get()))) {
+        char* name = de->d_name;
+        if (name[0] == '.' || de->d_type == DT_DIR) continue;
+        string fileName(name);
+        FileName output;
+        parseFileName(name, &output);
+        if (output.mTimestampSec == -1) continue;
+        struct stat fileInfo;
+        const string fullPathName = StringPrintf("%s/%s", index->mPath, fileName.c_str());
+        const int64_t fileSize = stat(fullPathName.c_str(), &fileInfo) == 0 ? fileInfo.st_size : 0;
+        index->mFiles[fileName] = {output, fileSize};
+    }
+    index->mDirMtime = dirInfo.st_mtim;
+    index->mScanned = true;
+    return index;
 }
 
-bool StorageManager::writeTrainInfo(const InstallTrainInfo& trainInfo) {
-    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
-
-    if (trainInfo.trainName.empty()) {
-      return false;
+// Records that the file called name in the indexed directory now has fileSize bytes, or was
+// removed if fileSize is -1.
+static void noteFileChangedLocked(FileIndex* index, const string& name, int64_t fileSize) {
+    if (!index->mScanned) {
+        return;
     }
-    deleteSuffixedFiles(TRAIN_INFO_DIR, trainInfo.trainName.c_str());
-
-    std::string fileName =
-            StringPrintf("%s/%ld_%s", TRAIN_INFO_DIR, (long) getWallClockSec(),
-                         trainInfo.trainName.c_str());
+    if (fileSize < 0) {
+        index->mFiles.erase(name);
+    } else {
+        string nameToParse(name);
+        FileName output;
+        parseFileName(nameToParse.data(), &output);
+        if (output.mTimestampSec != -1) {
+            index->mFiles[name] = {output, fileSize};
+        }
+    }
+    struct stat dirInfo;
+    if (stat(index->mPath, &dirInfo) == 0) {
+        index->mDirMtime = dirInfo.st_mtim;
+    }
+}
 
-    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        VLOG("Attempt to access %s but failed", fileName.c_str());
-        return false;
+// Splits a path into its directory and file name.
+static void splitPath(const string& path, string* dir, string* name) {
+    const size_t slash = path.rfind('/');
+    if (slash == string::npos) {
+        dir->clear();
+        *name = path;
+        return;
     }
+    *dir = path.substr(0, slash);
+    *name = path.substr(slash + 1);
+}
 
-    size_t result;
-    // Write the magic word
-    result = write(fd, &TRAIN_INFO_FILE_MAGIC, sizeof(TRAIN_INFO_FILE_MAGIC));
-    if (result != sizeof(TRAIN_INFO_FILE_MAGIC)) {
-        VLOG("Failed to wrtie train info magic");
-        close(fd);
-        return false;
+static void deleteFileLocked(const char* file) {
+    string dir, name;
+    splitPath(file, &dir, &name);
+    FileIndex* index = getFileIndexLocked(dir);
+    if (remove(file) != 0) {
+        VLOG("Attempt to delete %s but is not found", file);
+    } else {
+        VLOG("Successfully deleted %s", file);
     }
+    if (index != nullptr) {
+        noteFileChangedLocked(index, name, -1);
+    }
+}
 
-    // Write the train version
-    const size_t trainVersionCodeByteCount = sizeof(trainInfo.trainVersionCode);
-    result = write(fd, &trainInfo.trainVersionCode, trainVersionCodeByteCount);
-    if (result != trainVersionCodeByteCount) {
-        VLOG("Failed to wrtie train version code");
-        close(fd);
+static void trimToFitLocked(const char* path, bool parseTimestampOnly);
+
+// Writes the report to fd as a CompressedReportHeader followed by its zlib stream.
+static bool writeCompressedReport(int fd, const void* buffer, int numBytes) {
+    const CompressedReportHeader header = {
+            {kCompressedReportMagic[0], kCompressedReportMagic[1], kCompressedReportMagic[2],
+             kCompressedReportMagic[3]},
+            static_cast<uint32_t>(numBytes)};
+    if (!android::base::WriteFully(fd, &header, sizeof(header))) {
         return false;
     }
-
-    // Write # of bytes in trainName to file
-    const size_t trainNameSize = trainInfo.trainName.size();
-    const size_t trainNameSizeByteCount = sizeof(trainNameSize);
-    result = write(fd, (uint8_t*)&trainNameSize, trainNameSizeByteCount);
-    if (result != trainNameSizeByteCount) {
-        VLOG("Failed to write train name size");
-        close(fd);
+    z_stream stream = {};
+    if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) {
         return false;
     }
+    stream.next_in = static_cast<Bytef*>(const_cast<void*>(buffer));
+    stream.avail_in = numBytes;
+    uint8_t chunk[kCompressChunkBytes];
+    bool written = true;
+    do {
+        stream.next_out = chunk;
+        stream.avail_out = sizeof(chunk);
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_ERROR ||
+            !android::base::WriteFully(fd, chunk, sizeof(chunk) - stream.avail_out)) {
+            written = false;
+            break;
+        }
+    } while (stream.avail_out == 0);
+    deflateEnd(&stream);
+    return written;
+}
 
-    // Write trainName to file
-    result = write(fd, trainInfo.trainName.c_str(), trainNameSize);
-    if (result != trainNameSize) {
-        VLOG("Failed to write train name");
-        close(fd);
+// Returns the report in a file written by writeCompressedReport, or false if the content is not
+// a complete compressed report.
+static bool uncompressReport(const char* content, size_t sizeBytes, string* report) {
+    CompressedReportHeader header;
+    if (sizeBytes < sizeof(header)) {
         return false;
     }
-
-    // Write status to file
-    const size_t statusByteCount = sizeof(trainInfo.status);
-    result = write(fd, (uint8_t*)&trainInfo.status, statusByteCount);
-    if (result != statusByteCount) {
-        VLOG("Failed to write status");
-        close(fd);
+    memcpy(&header, content, sizeof(header));
+    report->resize(header.mReportSizeBytes);
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK) {
         return false;
     }
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content + sizeof(header)));
+    stream.avail_in = sizeBytes - sizeof(header);
+    stream.next_out = reinterpret_cast<Bytef*>(report->data());
+    stream.avail_out = report->size();
+    const bool uncompressed =
+            inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_out == 0;
+    inflateEnd(&stream);
+    return uncompressed;
+}
 
-    // Write experiment id count to file.
-    const size_t experimentIdsCount = trainInfo.experimentIds.size();
-    const size_t experimentIdsCountByteCount = sizeof(experimentIdsCount);
-    result = write(fd, (uint8_t*) &experimentIdsCount, experimentIdsCountByteCount);
-    if (result != experimentIdsCountByteCount) {
-        VLOG("Failed to write experiment id count");
-        close(fd);
-        return false;
+static bool isCompressedReport(const char* content, size_t sizeBytes) {
+    return sizeBytes >= sizeof(CompressedReportHeader) &&
+           memcmp(content, kCompressedReportMagic, sizeof(kCompressedReportMagic)) == 0;
+}
+
+void StorageManager::setCompressReports(bool compressReports) {
+    sCompressReports = compressReports;
+}
+
+void StorageManager::writeFile(const char* file, const void* buffer, int numBytes) {
+    STATSD_TRACE("StorageManager::writeFile bytes=%d", numBytes);
+    std::lock_guard<std::mutex> lock(sFileIndexMutex);
+    string dir, name;
+    splitPath(file, &dir, &name);
+    FileIndex* index = getFileIndexLocked(dir);
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        VLOG("Attempt to access %s but failed", file);
+        return;
+    }
+    struct stat fileInfo;
+    if (index != nullptr) {
+        noteFileChangedLocked(index, name, fstat(fd, &fileInfo) == 0 ? fileInfo.st_size : 0);
     }
+    trimToFitLocked(STATS_SERVICE_DIR, /*parseTimestampOnly=*/false);
+    trimToFitLocked(STATS_DATA_DIR, /*parseTimestampOnly=*/false);
 
-    // Write experimentIds to file
-    for (size_t i = 0; i < experimentIdsCount; i++) {
-        const int64_t experimentId = trainInfo.experimentIds[i];
-        const size_t experimentIdByteCount = sizeof(experimentId);
-        result = write(fd, &experimentId, experimentIdByteCount);
-        if (result == experimentIdByteCount) {
-            VLOG("Successfully wrote experiment IDs");
-        } else {
-            VLOG("Failed to write experiment ids");
-            close(fd);
-            return false;
-        }
+    const bool written = sCompressReports && dir == STATS_DATA_DIR
+                                 ? writeCompressedReport(fd, buffer, numBytes)
+                                 : android::base::WriteFully(fd, buffer, numBytes);
+    if (written) {
+        VLOG("Successfully wrote %s", file);
+    } else {
+        ALOGE("Failed to write %s", file);
     }
 
-    // Write bools to file
-    const size_t boolByteCount = sizeof(trainInfo.requiresStaging);
-    result = write(fd, (uint8_t*)&trainInfo.requiresStaging, boolByteCount);
-    if (result != boolByteCount) {
-      VLOG("Failed to write requires staging");
-      close(fd);
-      return false;
+    int result = fchown(fd, AID_STATSD, AID_STATSD);
+    if (result) {
+        VLOG("Failed to chown %s to statsd", file);
     }
 
-    result = write(fd, (uint8_t*)&trainInfo.rollbackEnabled, boolByteCount);
-    if (result != boolByteCount) {
-      VLOG("Failed to write rollback enabled");
-      close(fd);
-      return false;
+    if (index != nullptr && fstat(fd, &fileInfo) == 0) {
+        noteFileChangedLocked(index, name, fileInfo.st_size);
     }
+    close(fd);
+}
 
-    result = write(fd, (uint8_t*)&trainInfo.requiresLowLatencyMonitor, boolByteCount);
-    if (result != boolByteCount) {
-      VLOG("Failed to write requires log latency monitor");
-      close(fd);
-      return false;
+struct PendingWrite {
+    string mFile;
+    vector<uint8_t> mBuffer;
+};
+
+// The queue of the disk writer thread. Never destroyed, since the thread is never joined and may
+// still be waiting on it while the process exits.
+struct DiskWriterQueue {
+    std::mutex mMutex;
+    // Notified whenever a write is queued or done.
+    std::condition_variable mCondition;
+    std::deque<PendingWrite> mWrites;
+    // The file being written by the thread, empty if none.
+    string mWritingFile;
+    bool mStarted = false;
+};
+
+static DiskWriterQueue& getDiskWriterQueue() {
+    static DiskWriterQueue* queue = new DiskWriterQueue();
+    return *queue;
+}
+
+void StorageManager::writeFileAsync(const string& file, vector<uint8_t>&& buffer) {
+    DiskWriterQueue& queue = getDiskWriterQueue();
+    std::unique_lock<std::mutex> lock(queue.mMutex);
+    for (PendingWrite& write : queue.mWrites) {
+        if (write.mFile == file) {
+            write.mBuffer = std::move(buffer);
+            return;
+        }
+    }
+    queue.mCondition.wait(lock, [&queue] { return queue.mWrites.size() < kMaxPendingWrites; });
+    queue.mWrites.push_back({file, std::move(buffer)});
+    if (!queue.mStarted) {
+        queue.mStarted = true;
+        std::thread(runPendingWrites).detach();
     }
+    queue.mCondition.notify_all();
+}
 
-    close(fd);
-    return true;
+void StorageManager::runPendingWrites() {
+    DiskWriterQueue& queue = getDiskWriterQueue();
+    std::unique_lock<std::mutex> lock(queue.mMutex);
+    while (true) {
+        queue.mCondition.wait(lock, [&queue] { return !queue.mWrites.empty(); });
+        PendingWrite write = std::move(queue.mWrites.front());
+        queue.mWrites.pop_front();
+        queue.mWritingFile = write.mFile;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> fileIndexLock(sFileIndexMutex);
+            deleteFileLocked(write.mFile.c_str());
+        }
+        writeFile(write.mFile.c_str(), write.mBuffer.data(), write.mBuffer.size());
+
+        lock.lock();
+        queue.mWritingFile.clear();
+        queue.mCondition.notify_all();
+    }
 }
 
-bool StorageManager::readTrainInfo(const std::string& trainName, InstallTrainInfo& trainInfo) {
-    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
-    return readTrainInfoLocked(trainName, trainInfo);
+void StorageManager::waitForPendingWrites() {
+    DiskWriterQueue& queue = getDiskWriterQueue();
+    std::unique_lock<std::mutex> lock(queue.mMutex);
+    queue.mCondition.wait(
+            lock, [&queue] { return queue.mWrites.empty() && queue.mWritingFile.empty(); });
 }
 
-bool StorageManager::readTrainInfoLocked(const std::string& trainName, InstallTrainInfo& trainInfo) {
-    trimToFit(TRAIN_INFO_DIR, /*parseTimestampOnly=*/ true);
-    string fileName = findTrainInfoFileNameLocked(trainName);
-    if (fileName.empty()) {
-        return false;
+void StorageManager::cancelPendingWrites(const char* file) {
+    DiskWriterQueue& queue = getDiskWriterQueue();
+    std::unique_lock<std::mutex> lock(queue.mMutex);
+    const size_t pendingWrites = queue.mWrites.size();
+    queue.mWrites.erase(std::remove_if(queue.mWrites.begin(), queue.mWrites.end(),
+                                       [file](const PendingWrite& write) {
+                                           return write.mFile == file;
+                                       }),
+                        queue.mWrites.end());
+    if (queue.mWrites.size() != pendingWrites) {
+        queue.mCondition.notify_all();
     }
-    int fd = open(StringPrintf("%s/%s", TRAIN_INFO_DIR, fileName.c_str()).c_str(), O_RDONLY | O_CLOEXEC);
+    queue.mCondition.wait(lock, [&queue, file] { return queue.mWritingFile != file; });
+}
+
+// A train info file of TRAIN_INFO_DIR and the train info it holds.
+struct TrainInfoFile {
+    string mFileName;
+    int64_t mTimestampSec;
+    InstallTrainInfo mTrainInfo;
+};
+
+// The train info files by train name, guarded by sTrainInfoMutex. They are loaded from
+// TRAIN_INFO_DIR on first use and kept in sync with it, so that train infos are read and written
+// without scanning the directory.
+static std::map<string, TrainInfoFile> sTrainInfoFiles;
+static bool sTrainInfoFilesLoaded = false;
+
+static bool readTrainInfoFile(const char* file, InstallTrainInfo& trainInfo) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
     if (fd == -1) {
-        VLOG("Failed to open %s", fileName.c_str());
+        VLOG("Failed to open %s", file);
         return false;
     }
 
@@ -432,41 +609,152 @@ bool StorageManager::readTrainInfoLocked(const std::string& trainName, InstallTr
     return true;
 }
 
-vector<InstallTrainInfo> StorageManager::readAllTrainInfo() {
-    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
-    vector<InstallTrainInfo> trainInfoList;
+static void appendBytes(const void* data, size_t size, vector<uint8_t>* buffer) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    buffer->insert(buffer->end(), bytes, bytes + size);
+}
+
+// Serializes the train info in the format read by readTrainInfoFile.
+static vector<uint8_t> serializeTrainInfo(const InstallTrainInfo& trainInfo) {
+    vector<uint8_t> buffer;
+    appendBytes(&TRAIN_INFO_FILE_MAGIC, sizeof(TRAIN_INFO_FILE_MAGIC), &buffer);
+    appendBytes(&trainInfo.trainVersionCode, sizeof(trainInfo.trainVersionCode), &buffer);
+    const size_t trainNameSize = trainInfo.trainName.size();
+    appendBytes(&trainNameSize, sizeof(trainNameSize), &buffer);
+    appendBytes(trainInfo.trainName.data(), trainNameSize, &buffer);
+    appendBytes(&trainInfo.status, sizeof(trainInfo.status), &buffer);
+    const size_t experimentIdsCount = trainInfo.experimentIds.size();
+    appendBytes(&experimentIdsCount, sizeof(experimentIdsCount), &buffer);
+    appendBytes(trainInfo.experimentIds.data(), experimentIdsCount * sizeof(int64_t), &buffer);
+    appendBytes(&trainInfo.requiresStaging, sizeof(trainInfo.requiresStaging), &buffer);
+    appendBytes(&trainInfo.rollbackEnabled, sizeof(trainInfo.rollbackEnabled), &buffer);
+    appendBytes(&trainInfo.requiresLowLatencyMonitor, sizeof(trainInfo.requiresLowLatencyMonitor),
+                &buffer);
+    return buffer;
+}
+
+static void loadTrainInfoFilesLocked() {
+    if (sTrainInfoFilesLoaded) {
+        return;
+    }
+    sTrainInfoFilesLoaded = true;
+    sTrainInfoFiles.clear();
+    StorageManager::trimToFit(TRAIN_INFO_DIR, /*parseTimestampOnly=*/true);
     unique_ptr<DIR, decltype(&closedir)> dir(opendir(TRAIN_INFO_DIR), closedir);
     if (dir == NULL) {
         VLOG("Directory does not exist: %s", TRAIN_INFO_DIR);
-        return trainInfoList;
+        return;
     }
 
     dirent* de;
     while ((de = readdir(dir.get()))) {
-        char* name = de->d_name;
+        const char* name = de->d_name;
         if (name[0] == '.' || de->d_type == DT_DIR) {
             continue;
         }
 
-        InstallTrainInfo trainInfo;
-        bool readSuccess = StorageManager::readTrainInfoLocked(name, trainInfo);
-        if (!readSuccess) {
+        TrainInfoFile trainInfoFile;
+        trainInfoFile.mFileName = StringPrintf("%s/%s", TRAIN_INFO_DIR, name);
+        trainInfoFile.mTimestampSec = StrToInt64(string(name, strcspn(name, "_")));
+        if (!readTrainInfoFile(trainInfoFile.mFileName.c_str(), trainInfoFile.mTrainInfo)) {
             continue;
         }
-        trainInfoList.push_back(trainInfo);
+        const string trainName = trainInfoFile.mTrainInfo.trainName;
+        auto it = sTrainInfoFiles.find(trainName);
+        if (it == sTrainInfoFiles.end() || it->second.mTimestampSec < trainInfoFile.mTimestampSec) {
+            sTrainInfoFiles[trainName] = std::move(trainInfoFile);
+        }
+    }
+}
+
+// Applies the age and file number limits of trimToFit to the loaded train info files.
+static void trimTrainInfoFilesLocked() {
+    const int64_t nowSec = getWallClockSec();
+    for (auto it = sTrainInfoFiles.begin(); it != sTrainInfoFiles.end();) {
+        if (nowSec - it->second.mTimestampSec > StatsdStats::kMaxAgeSecond) {
+            StorageManager::deleteFile(it->second.mFileName.c_str());
+            it = sTrainInfoFiles.erase(it);
+        } else {
+            it++;
+        }
+    }
+    while (sTrainInfoFiles.size() > StatsdStats::kMaxFileNumber) {
+        auto oldest = std::min_element(sTrainInfoFiles.begin(), sTrainInfoFiles.end(),
+                                       [](const auto& a, const auto& b) {
+                                           return a.second.mTimestampSec < b.second.mTimestampSec;
+                                       });
+        StorageManager::deleteFile(oldest->second.mFileName.c_str());
+        sTrainInfoFiles.erase(oldest);
+    }
+}
+
+// Makes the next use of the train info files reload them from TRAIN_INFO_DIR.
+static void invalidateTrainInfoFilesLocked() {
+    sTrainInfoFilesLoaded = false;
+    sTrainInfoFiles.clear();
+}
+
+bool StorageManager::writeTrainInfo(const InstallTrainInfo& trainInfo) {
+    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
+
+    if (trainInfo.trainName.empty()) {
+      return false;
+    }
+    loadTrainInfoFilesLocked();
+
+    TrainInfoFile trainInfoFile;
+    trainInfoFile.mTimestampSec = getWallClockSec();
+    trainInfoFile.mFileName = StringPrintf("%s/%lld_%s", TRAIN_INFO_DIR,
+                                           (long long)trainInfoFile.mTimestampSec,
+                                           trainInfo.trainName.c_str());
+    trainInfoFile.mTrainInfo = trainInfo;
+
+    auto it = sTrainInfoFiles.find(trainInfo.trainName);
+    if (it != sTrainInfoFiles.end() && it->second.mFileName != trainInfoFile.mFileName) {
+        deleteFile(it->second.mFileName.c_str());
+    }
+    // The file is written behind, the train info is served from memory until then.
+    writeFileAsync(trainInfoFile.mFileName, serializeTrainInfo(trainInfo));
+    sTrainInfoFiles[trainInfo.trainName] = std::move(trainInfoFile);
+    return true;
+}
+
+bool StorageManager::readTrainInfo(const std::string& trainName, InstallTrainInfo& trainInfo) {
+    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
+    return readTrainInfoLocked(trainName, trainInfo);
+}
+
+bool StorageManager::readTrainInfoLocked(const std::string& trainName, InstallTrainInfo& trainInfo) {
+    loadTrainInfoFilesLocked();
+    trimTrainInfoFilesLocked();
+    auto it = sTrainInfoFiles.find(trainName);
+    if (it == sTrainInfoFiles.end()) {
+        return false;
+    }
+    trainInfo = it->second.mTrainInfo;
+    return true;
+}
+
+vector<InstallTrainInfo> StorageManager::readAllTrainInfo() {
+    std::lock_guard<std::mutex> lock(sTrainInfoMutex);
+    loadTrainInfoFilesLocked();
+    trimTrainInfoFilesLocked();
+    vector<InstallTrainInfo> trainInfoList;
+    trainInfoList.reserve(sTrainInfoFiles.size());
+    for (const auto& [trainName, trainInfoFile] : sTrainInfoFiles) {
+        trainInfoList.push_back(trainInfoFile.mTrainInfo);
     }
     return trainInfoList;
 }
 
 void StorageManager::deleteFile(const char* file) {
-    if (remove(file) != 0) {
-        VLOG("Attempt to delete %s but is not found", file);
-    } else {
-        VLOG("Successfully deleted %s", file);
-    }
+    cancelPendingWrites(file);
+    std::lock_guard<std::mutex> lock(sFileIndexMutex);
+    deleteFileLocked(file);
 }
 
 void StorageManager::deleteAllFiles(const char* path) {
+    waitForPendingWrites();
     unique_ptr<DIR, decltype(&closedir)> dir(opendir(path), closedir);
     if (dir == NULL) {
         VLOG("Directory does not exist: %s", path);
@@ -479,9 +767,14 @@ void StorageManager::deleteAllFiles(const char* path) {
         if (name[0] == '.' || de->d_type == DT_DIR) continue;
         deleteFile(StringPrintf("%s/%s", path, name).c_str());
     }
+    if (strcmp(path, TRAIN_INFO_DIR) == 0) {
+        std::lock_guard<std::mutex> lock(sTrainInfoMutex);
+        invalidateTrainInfoFilesLocked();
+    }
 }
 
 void StorageManager::deleteSuffixedFiles(const char* path, const char* suffix) {
+    waitForPendingWrites();
     unique_ptr<DIR, decltype(&closedir)> dir(opendir(path), closedir);
     if (dir == NULL) {
         VLOG("Directory does not exist: %s", path);
@@ -500,86 +793,118 @@ void StorageManager::deleteSuffixedFiles(const char* path, const char* suffix) {
             deleteFile(StringPrintf("%s/%s", path, name).c_str());
         }
     }
+    if (strcmp(path, TRAIN_INFO_DIR) == 0) {
+        std::lock_guard<std::mutex> lock(sTrainInfoMutex);
+        invalidateTrainInfoFilesLocked();
+    }
 }
 
 void StorageManager::sendBroadcast(const char* path,
                                    const std::function<void(const ConfigKey&)>& sendBroadcast) {
-    unique_ptr<DIR, decltype(&closedir)> dir(opendir(path), closedir);
-    if (dir == NULL) {
-        VLOG("no stats-data directory on disk");
-        return;
-    }
+    waitForPendingWrites();
+    vector<ConfigKey> keys;
+    {
+        std::lock_guard<std::mutex> lock(sFileIndexMutex);
+        FileIndex* index = getFileIndexLocked(path);
+        if (index != nullptr) {
+            for (const auto& [name, file] : index->mFiles) {
+                if (!file.mName.mIsHistory) {
+                    keys.emplace_back(file.mName.mUid, file.mName.mConfigId);
+                }
+            }
+        } else {
+            unique_ptr<DIR, decltype(&closedir)> dir(opendir(path), closedir);
+            if (dir == NULL) {
+                VLOG("no stats-data directory on disk");
+                return;
+            }
 
-    dirent* de;
-    while ((de = readdir(dir.get()))) {
-        char* name = de->d_name;
-        if (name[0] == '.' || de->d_type == DT_DIR) continue;
-        VLOG("file %s", name);
+            dirent* de;
+            while ((de = readdir(dir.get()))) {
+                char* name = de->d_name;
+                if (name[0] == '.' || de->d_type == DT_DIR) continue;
+                VLOG("file %s", name);
 
-        FileName output;
-        parseFileName(name, &output);
-        if (output.mTimestampSec == -1 || output.mIsHistory) continue;
-        sendBroadcast(ConfigKey((int)output.mUid, output.mConfigId));
+                FileName output;
+                parseFileName(name, &output);
+                if (output.mTimestampSec == -1 || output.mIsHistory) continue;
+                keys.emplace_back((int)output.mUid, output.mConfigId);
+            }
+        }
+    }
+    // The receivers may read the reports, so they are called without the lock.
+    for (const ConfigKey& key : keys) {
+        sendBroadcast(key);
     }
 }
 
 bool StorageManager::hasConfigMetricsReport(const ConfigKey& key) {
-    unique_ptr<DIR, decltype(&closedir)> dir(opendir(STATS_DATA_DIR), closedir);
-    if (dir == NULL) {
-        VLOG("Path %s does not exist", STATS_DATA_DIR);
-        return false;
-    }
-
-    string suffix = StringPrintf("%d_%lld", key.GetUid(), (long long)key.GetId());
-
-    dirent* de;
-    while ((de = readdir(dir.get()))) {
-        char* name = de->d_name;
-        if (name[0] == '.' || de->d_type == DT_DIR) continue;
-
-        size_t nameLen = strlen(name);
-        size_t suffixLen = suffix.length();
-        if (suffixLen <= nameLen &&
-            strncmp(name + nameLen - suffixLen, suffix.c_str(), suffixLen) == 0) {
-            // Check again that the file name is parseable.
-            FileName output;
-            parseFileName(name, &output);
-            if (output.mTimestampSec == -1 || output.mIsHistory) continue;
+    waitForPendingWrites();
+    std::lock_guard<std::mutex> lock(sFileIndexMutex);
+    FileIndex* index = getFileIndexLocked(STATS_DATA_DIR);
+    for (const auto& [name, file] : index->mFiles) {
+        if (!file.mName.mIsHistory && file.mName.mUid == key.GetUid() &&
+            file.mName.mConfigId == key.GetId()) {
             return true;
         }
     }
     return false;
 }
 
-void StorageManager::appendConfigMetricsReport(const ConfigKey& key, ProtoOutputStream* proto,
-                                               bool erase_data, bool isAdb) {
-    unique_ptr<DIR, decltype(&closedir)> dir(opendir(STATS_DATA_DIR), closedir);
-    if (dir == NULL) {
-        VLOG("Path %s does not exist", STATS_DATA_DIR);
+// Appends the report, as read from a report file, to proto.
+static void appendReport(const char* content, size_t sizeBytes, ProtoOutputStream* proto) {
+    if (!isCompressedReport(content, sizeBytes)) {
+        proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_REPORTS, content,
+                     sizeBytes);
+        return;
+    }
+    string report;
+    if (!uncompressReport(content, sizeBytes, &report)) {
+        ALOGE("Failed to uncompress report");
         return;
     }
+    proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_REPORTS, report.c_str(),
+                 report.size());
+}
 
-    dirent* de;
-    while ((de = readdir(dir.get()))) {
-        char* name = de->d_name;
-        string fileName(name);
-        if (name[0] == '.' || de->d_type == DT_DIR) continue;
-        FileName output;
-        parseFileName(name, &output);
+// Appends the report in the file to proto. The file is mapped rather than read, so that its
+// content is copied once, straight into proto.
+static void appendReportFile(int fd, ProtoOutputStream* proto) {
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) == 0 && fileInfo.st_size > 0) {
+        void* content = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content != MAP_FAILED) {
+            appendReport(static_cast<const char*>(content), fileInfo.st_size, proto);
+            munmap(content, fileInfo.st_size);
+            return;
+        }
+    }
+    string content;
+    if (android::base::ReadFdToString(fd, &content)) {
+        appendReport(content.c_str(), content.size(), proto);
+    }
+}
 
-        if (output.mTimestampSec == -1 || (output.mIsHistory && !isAdb) ||
-            output.mUid != key.GetUid() || output.mConfigId != key.GetId()) {
+void StorageManager::appendConfigMetricsReport(const ConfigKey& key, ProtoOutputStream* proto,
+                                               bool erase_data, bool isAdb) {
+    waitForPendingWrites();
+    std::lock_guard<std::mutex> lock(sFileIndexMutex);
+    FileIndex* index = getFileIndexLocked(STATS_DATA_DIR);
+    vector<string> fileNames;
+    for (const auto& [name, file] : index->mFiles) {
+        if ((file.mName.mIsHistory && !isAdb) || file.mName.mUid != key.GetUid() ||
+            file.mName.mConfigId != key.GetId()) {
             continue;
         }
+        fileNames.push_back(name);
+    }
 
+    for (const string& fileName : fileNames) {
+        const IndexedFile file = index->mFiles[fileName];
         auto fullPathName = StringPrintf("%s/%s", STATS_DATA_DIR, fileName.c_str());
         int fd = open(fullPathName.c_str(), O_RDONLY | O_CLOEXEC);
         if (fd != -1) {
-            string content;
-            if (android::base::ReadFdToString(fd, &content)) {
-                proto->write(FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | FIELD_ID_REPORTS,
-                             content.c_str(), content.size());
-            }
+            appendReportFile(fd, proto);
             close(fd);
         } else {
             ALOGE("file cannot be opened");
@@ -587,19 +912,24 @@ void StorageManager::appendConfigMetricsReport(const ConfigKey& key, ProtoOutput
 
         if (erase_data) {
             remove(fullPathName.c_str());
-        } else if (!output.mIsHistory && !isAdb) {
+            noteFileChangedLocked(index, fileName, -1);
+        } else if (!file.mName.mIsHistory && !isAdb) {
             // This means a real data owner has called to get this data. But the config says it
             // wants to keep a local history. So now this file must be renamed as a history file.
             // So that next time, when owner calls getData() again, this data won't be uploaded
             // again. rename returns 0 on success
             if (rename(fullPathName.c_str(), (fullPathName + "_history").c_str())) {
                 ALOGE("Failed to rename file %s", fullPathName.c_str());
+            } else {
+                noteFileChangedLocked(index, fileName, -1);
+                noteFileChangedLocked(index, fileName + "_history", file.mSizeBytes);
             }
         }
     }
 }
 
 bool StorageManager::readFileToString(const char* file, string* content) {
+    waitForPendingWrites();
     int fd = open(file, O_RDONLY | O_CLOEXEC);
     bool res = false;
     if (fd != -1) {
@@ -621,6 +951,7 @@ void StorageManager::readConfigFromDisk(map<ConfigKey, StatsdConfig>& configsMap
     }
     trimToFit(STATS_SERVICE_DIR);
 
+    vector<FileName> files;
     dirent* de;
     while ((de = readdir(dir.get()))) {
         char* name = de->d_name;
@@ -629,20 +960,30 @@ void StorageManager::readConfigFromDisk(map<ConfigKey, StatsdConfig>& configsMap
         FileName output;
         parseFileName(name, &output);
         if (output.mTimestampSec == -1) continue;
-        string file_name = output.getFullFileName(STATS_SERVICE_DIR);
+        files.push_back(output);
+    }
+
+    // Parsing dominates and the files do not depend on each other, so they are read in parallel.
+    vector<StatsdConfig> configs(files.size());
+    vector<char> parsed(files.size(), false);
+    parallelFor(files.size(), std::thread::hardware_concurrency(), [&](size_t i) {
+        string file_name = files[i].getFullFileName(STATS_SERVICE_DIR);
         int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
         if (fd != -1) {
             string content;
             if (android::base::ReadFdToString(fd, &content)) {
-                StatsdConfig config;
-                if (config.ParseFromString(content)) {
-                    configsMap[ConfigKey(output.mUid, output.mConfigId)] = config;
-                    VLOG("map key uid=%lld|configID=%lld", (long long)output.mUid,
-                         (long long)output.mConfigId);
-                }
+                parsed[i] = configs[i].ParseFromString(content);
             }
             close(fd);
         }
+    });
+
+    for (size_t i = 0; i < files.size(); i++) {
+        if (parsed[i]) {
+            configsMap[ConfigKey(files[i].mUid, files[i].mConfigId)] = std::move(configs[i]);
+            VLOG("map key uid=%lld|configID=%lld", (long long)files[i].mUid,
+                 (long long)files[i].mConfigId);
+        }
     }
 }
 
@@ -721,6 +1062,54 @@ void StorageManager::sortFiles(vector<FileInfo>* fileNames) {
 }
 
 void StorageManager::trimToFit(const char* path, bool parseTimestampOnly) {
+    waitForPendingWrites();
+    std::lock_guard<std::mutex> lock(sFileIndexMutex);
+    trimToFitLocked(path, parseTimestampOnly);
+}
+
+static void trimToFitLocked(const char* path, bool parseTimestampOnly) {
+    using FileInfo = StorageManager::FileInfo;
+    FileIndex* index = parseTimestampOnly ? nullptr : getFileIndexLocked(path);
+    if (index != nullptr) {
+        if (!index->mScanned) {
+            VLOG("Path %s does not exist", path);
+            return;
+        }
+        int totalFileSize = 0;
+        vector<FileInfo> fileNames;
+        auto nowSec = getWallClockSec();
+        vector<string> tooOld;
+        for (const auto& [name, file] : index->mFiles) {
+            // Check for timestamp and delete if it's too old.
+            long fileAge = nowSec - file.mName.mTimestampSec;
+            if (fileAge > StatsdStats::kMaxAgeSecond ||
+                (file.mName.mIsHistory && fileAge > StatsdStats::kMaxLocalHistoryAgeSecond)) {
+                tooOld.push_back(name);
+                continue;
+            }
+            totalFileSize += file.mSizeBytes;
+            fileNames.emplace_back(name, file.mName.mIsHistory, file.mSizeBytes, fileAge);
+        }
+        for (const string& name : tooOld) {
+            deleteFileLocked(StringPrintf("%s/%s", path, name.c_str()).c_str());
+        }
+
+        if (fileNames.size() > StatsdStats::kMaxFileNumber ||
+            totalFileSize > StatsdStats::kMaxFileSize) {
+            StorageManager::sortFiles(&fileNames);
+        }
+
+        // Start removing files from oldest to be under the limit.
+        while (fileNames.size() > 0 && (fileNames.size() > StatsdStats::kMaxFileNumber ||
+                                        totalFileSize > StatsdStats::kMaxFileSize)) {
+            totalFileSize -= fileNames.back().mFileSizeBytes;
+            const FileInfo& oldest = fileNames.back();
+            deleteFileLocked(StringPrintf("%s/%s", path, oldest.mFileName.c_str()).c_str());
+            fileNames.pop_back();
+        }
+        return;
+    }
+
     unique_ptr<DIR, decltype(&closedir)> dir(opendir(path), closedir);
     if (dir == NULL) {
         VLOG("Path %s does not exist", path);
@@ -750,7 +1139,7 @@ void StorageManager::trimToFit(const char* path, bool parseTimestampOnly) {
         long fileAge = nowSec - output.mTimestampSec;
         if (fileAge > StatsdStats::kMaxAgeSecond ||
             (output.mIsHistory && fileAge > StatsdStats::kMaxLocalHistoryAgeSecond)) {
-            deleteFile(file_name.c_str());
+            deleteFileLocked(file_name.c_str());
             continue;
         }
 
@@ -767,19 +1156,20 @@ void StorageManager::trimToFit(const char* path, bool parseTimestampOnly) {
 
     if (fileNames.size() > StatsdStats::kMaxFileNumber ||
         totalFileSize > StatsdStats::kMaxFileSize) {
-        sortFiles(&fileNames);
+        StorageManager::sortFiles(&fileNames);
     }
 
     // Start removing files from oldest to be under the limit.
     while (fileNames.size() > 0 && (fileNames.size() > StatsdStats::kMaxFileNumber ||
                                     totalFileSize > StatsdStats::kMaxFileSize)) {
         totalFileSize -= fileNames.at(fileNames.size() - 1).mFileSizeBytes;
-        deleteFile(fileNames.at(fileNames.size() - 1).mFileName.c_str());
+        deleteFileLocked(fileNames.at(fileNames.size() - 1).mFileName.c_str());
         fileNames.pop_back();
     }
 }
 
 void StorageManager::printStats(int outFd) {
+    waitForPendingWrites();
     printDirStats(outFd, STATS_SERVICE_DIR);
     printDirStats(outFd, STATS_DATA_DIR);
 }
@@ -850,10 +1240,12 @@ void StorageManager::enforceDbGuardrails(const char* path, const int64_t currWal
                                                               fileInfo.st_size);
         if (fileInfo.st_mtime <= deleteThresholdSec) {
             StatsdStats::getInstance().noteDbTooOld(key);
+            dbutils::evictDb(key);
             remove(fullPathName.c_str());
         }
         if (fileInfo.st_size >= maxBytes) {
             StatsdStats::getInstance().noteDbSizeExceeded(key);
+            dbutils::evictDb(key);
             remove(fullPathName.c_str());
         }
         if (hasFile(dbutils::getDbName(key).c_str())) {
@@ -866,6 +1258,7 @@ void StorageManager::enforceDbGuardrails(const char* path, const int64_t currWal
 }
 
 bool StorageManager::hasFile(const char* file) {
+    waitForPendingWrites();
     struct stat fileInfo;
     return stat(file, &fileInfo) == 0;
 }
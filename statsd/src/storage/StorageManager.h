@@ -55,12 +55,33 @@ public:
     };
 
     /**
-     * Writes a given byte array as a file to the specified file path.
+     * Writes a given byte array as a file to the specified file path. Reports written to the data
+     * directory are compressed if setCompressReports(true) was called.
      */
     static void writeFile(const char* file, const void* buffer, int numBytes);
 
     /**
-     * Writes train info.
+     * Sets whether reports persisted to the data directory are compressed. Reports are read back
+     * in either format, whichever format they were written in.
+     */
+    static void setCompressReports(bool compressReports);
+
+    /**
+     * Replaces the file at the specified path with the buffer on the disk writer thread, so that
+     * the caller does not wait for the I/O. Writes are done in the order they were queued, and a
+     * queued write to the same file that has not started yet is replaced by this one. Blocks
+     * while kMaxPendingWrites writes are queued.
+     */
+    static void writeFileAsync(const std::string& file, std::vector<uint8_t>&& buffer);
+
+    /**
+     * Blocks until all writes queued by writeFileAsync are done.
+     */
+    static void waitForPendingWrites();
+
+    /**
+     * Writes train info. Train infos are kept in memory, the file of the train is replaced on the
+     * disk writer thread.
      */
     static bool writeTrainInfo(const InstallTrainInfo& trainInfo);
 
@@ -70,7 +91,8 @@ public:
     static bool readTrainInfo(const std::string& trainName, InstallTrainInfo& trainInfo);
 
     /**
-     * Reads train info assuming lock is obtained.
+     * Reads train info assuming lock is obtained. Train info files are only read from disk on
+     * first use.
      */
     static bool readTrainInfoLocked(const std::string& trainName, InstallTrainInfo& trainInfo);
 
@@ -90,12 +112,14 @@ public:
     static void deleteFile(const char* file);
 
     /**
-     * Deletes all files in a given directory.
+     * Deletes all files in a given directory. Train infos are reloaded from disk after deleting
+     * files of TRAIN_INFO_DIR.
      */
     static void deleteAllFiles(const char* path);
 
     /**
-     * Deletes all files whose name matches with a provided suffix.
+     * Deletes all files whose name matches with a provided suffix. Like deleteAllFiles, makes
+     * train infos reload from disk.
      */
     static void deleteSuffixedFiles(const char* path, const char* suffix);
 
@@ -173,6 +197,18 @@ private:
     static void printDirStats(int out, const char* path);
 
     static std::mutex sTrainInfoMutex;
+
+    // Bound on the serialized buffers held in memory by the disk writer thread.
+    static constexpr size_t kMaxPendingWrites = 16;
+
+    /**
+     * Drops the queued writes to the file and waits for the one in progress, if any, so that the
+     * file is not written again after the caller deletes it.
+     */
+    static void cancelPendingWrites(const char* file);
+
+    // Runs the queued writes, on the disk writer thread.
+    static void runPendingWrites();
 };
 
 }  // namespace statsd
@@ -123,6 +123,15 @@ void getProtoData(const int64_t& rule_id, int64_t metricId, const MetricDimensio
 }
 }  // namespace
 
+vector<uint8_t> GetIncidentReportHeader(const IncidentdDetails& config, int64_t rule_id,
+                                        int64_t metricId, const MetricDimensionKey& dimensionKey,
+                                        int64_t metricValue, const ConfigKey& configKey) {
+    vector<uint8_t> protoData;
+    getProtoData(rule_id, metricId, dimensionKey, metricValue, configKey,
+                 config.alert_description(), &protoData);
+    return protoData;
+}
+
 bool GenerateIncidentReport(const IncidentdDetails& config, int64_t rule_id, int64_t metricId,
                             const MetricDimensionKey& dimensionKey, int64_t metricValue,
                             const ConfigKey& configKey) {
@@ -131,13 +140,23 @@ bool GenerateIncidentReport(const IncidentdDetails& config, int64_t rule_id, int
              configKey.GetUid(), (long long)configKey.GetId());
         return false;
     }
+    return GenerateIncidentReport(
+            config, rule_id, configKey,
+            GetIncidentReportHeader(config, rule_id, metricId, dimensionKey, metricValue,
+                                    configKey));
+}
+
+bool GenerateIncidentReport(const IncidentdDetails& config, int64_t rule_id,
+                            const ConfigKey& configKey, const vector<uint8_t>& header) {
+    if (config.section_size() == 0) {
+        VLOG("The alert %lld contains zero section in config(%d,%lld)", (unsigned long long)rule_id,
+             configKey.GetUid(), (long long)configKey.GetId());
+        return false;
+    }
 
     AIncidentReportArgs* args = AIncidentReportArgs_init();
 
-    vector<uint8_t> protoData;
-    getProtoData(rule_id, metricId, dimensionKey, metricValue, configKey,
-                 config.alert_description(), &protoData);
-    AIncidentReportArgs_addHeader(args, protoData.data(), protoData.size());
+    AIncidentReportArgs_addHeader(args, header.data(), header.size());
 
     for (int i = 0; i < config.section_size(); i++) {
         AIncidentReportArgs_addSection(args, config.section(i));
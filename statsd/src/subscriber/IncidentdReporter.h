@@ -20,6 +20,8 @@
 #include "config/ConfigKey.h"
 #include "src/statsd_config.pb.h"  // Alert, IncidentdDetails
 
+#include <vector>
+
 namespace android {
 namespace os {
 namespace statsd {
@@ -31,6 +33,20 @@ bool GenerateIncidentReport(const IncidentdDetails& config, int64_t rule_id, int
                             const MetricDimensionKey& dimensionKey, int64_t metricValue,
                             const ConfigKey& configKey);
 
+/**
+ * Encodes the IncidentHeaderProto that GenerateIncidentReport passes to incidentd.
+ */
+std::vector<uint8_t> GetIncidentReportHeader(const IncidentdDetails& config, int64_t rule_id,
+                                             int64_t metricId,
+                                             const MetricDimensionKey& dimensionKey,
+                                             int64_t metricValue, const ConfigKey& configKey);
+
+/**
+ * Same as above, with the header already encoded by GetIncidentReportHeader.
+ */
+bool GenerateIncidentReport(const IncidentdDetails& config, int64_t rule_id,
+                            const ConfigKey& configKey, const std::vector<uint8_t>& header);
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -91,6 +91,13 @@ void SubscriberReporter::unsetBroadcastSubscriber(const ConfigKey& configKey,
 void SubscriberReporter::alertBroadcastSubscriber(const ConfigKey& configKey,
                                                   const Subscription& subscription,
                                                   const MetricDimensionKey& dimKey) const {
+    alertBroadcastSubscriber(configKey, subscription,
+                             dimKey.getDimensionKeyInWhat().toStatsDimensionsValueParcel());
+}
+
+void SubscriberReporter::alertBroadcastSubscriber(
+        const ConfigKey& configKey, const Subscription& subscription,
+        const StatsDimensionsValueParcel& dimensionsValueParcel) const {
     // Reminder about ids:
     //  subscription id - name of the Subscription (that ties the Alert to the broadcast)
     //  subscription rule_id - the name of the Alert (that triggers the broadcast)
@@ -126,14 +133,13 @@ void SubscriberReporter::alertBroadcastSubscriber(const ConfigKey& configKey,
                 configKey.ToString().c_str(), (long long)subscriberId);
         return;
     }
-    sendBroadcastLocked(it2->second, configKey, subscription, cookies, dimKey);
+    sendBroadcastLocked(it2->second, configKey, subscription, cookies, dimensionsValueParcel);
 }
 
-void SubscriberReporter::sendBroadcastLocked(const shared_ptr<IPendingIntentRef>& pir,
-                                             const ConfigKey& configKey,
-                                             const Subscription& subscription,
-                                             const vector<string>& cookies,
-                                             const MetricDimensionKey& dimKey) const {
+void SubscriberReporter::sendBroadcastLocked(
+        const shared_ptr<IPendingIntentRef>& pir, const ConfigKey& configKey,
+        const Subscription& subscription, const vector<string>& cookies,
+        const StatsDimensionsValueParcel& dimensionsValueParcel) const {
     VLOG("SubscriberReporter::sendBroadcastLocked called.");
     pir->sendSubscriberBroadcast(
             configKey.GetUid(),
@@ -141,7 +147,7 @@ void SubscriberReporter::sendBroadcastLocked(const shared_ptr<IPendingIntentRef>
             subscription.id(),
             subscription.rule_id(),
             cookies,
-            dimKey.getDimensionKeyInWhat().toStatsDimensionsValueParcel());
+            dimensionsValueParcel);
 }
 
 }  // namespace statsd
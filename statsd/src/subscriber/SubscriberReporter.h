@@ -74,6 +74,13 @@ public:
                                   const Subscription& subscription,
                                   const MetricDimensionKey& dimKey) const;
 
+    /**
+     * Same as above, with the dimensions of dimKey already converted, so that one conversion can
+     * be shared by all the subscribers of an alert.
+     */
+    void alertBroadcastSubscriber(const ConfigKey& configKey, const Subscription& subscription,
+                                  const StatsDimensionsValueParcel& dimensionsValueParcel) const;
+
 private:
     SubscriberReporter();
 
@@ -90,7 +97,7 @@ private:
                              const ConfigKey& configKey,
                              const Subscription& subscription,
                              const vector<string>& cookies,
-                             const MetricDimensionKey& dimKey) const;
+                             const StatsDimensionsValueParcel& dimensionsValueParcel) const;
 
     ::ndk::ScopedAIBinder_DeathRecipient mBroadcastSubscriberDeathRecipient;
 
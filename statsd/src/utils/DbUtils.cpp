@@ -22,6 +22,11 @@
 
 #include <android/api-level.h>
 
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 #include "FieldValue.h"
 #include "android-base/properties.h"
 #include "android-base/stringprintf.h"
@@ -135,17 +140,19 @@ string reformatMetricId(const int64_t metricId) {
 }
 
 bool createTableIfNeeded(const ConfigKey& key, const int64_t metricId, const LogEvent& event) {
-    const string dbName = getDbName(key);
-    sqlite3* db;
-    if (sqlite3_open(dbName.c_str(), &db) != SQLITE_OK) {
-        sqlite3_close(db);
+    sqlite3* db = acquireDb(key);
+    if (db == nullptr) {
         return false;
     }
+    bool success = createTableIfNeeded(db, metricId, event);
+    releaseDb(db);
+    return success;
+}
 
+bool createTableIfNeeded(sqlite3* db, const int64_t metricId, const LogEvent& event) {
     char* error = nullptr;
     string zSql = getCreateSqlString(metricId, event);
     sqlite3_exec(db, zSql.c_str(), nullptr, nullptr, &error);
-    sqlite3_close(db);
     if (error) {
         ALOGW("Failed to create table to db: %s", error);
         return false;
@@ -153,21 +160,27 @@ bool createTableIfNeeded(const ConfigKey& key, const int64_t metricId, const Log
     return true;
 }
 
+static bool query(sqlite3* db, const string& zSql, vector<vector<string>>& rows,
+                  vector<int32_t>& columnTypes, vector<string>& columnNames, string& err);
+
 bool isEventCompatible(const ConfigKey& key, const int64_t metricId, const LogEvent& event) {
-    const string dbName = getDbName(key);
-    sqlite3* db;
-    if (sqlite3_open(dbName.c_str(), &db) != SQLITE_OK) {
-        sqlite3_close(db);
+    sqlite3* db = acquireDb(key);
+    if (db == nullptr) {
         return false;
     }
+    bool compatible = isEventCompatible(db, metricId, event);
+    releaseDb(db);
+    return compatible;
+}
+
+bool isEventCompatible(sqlite3* db, const int64_t metricId, const LogEvent& event) {
     string zSql = StringPrintf("PRAGMA table_info(metric_%s);", reformatMetricId(metricId).c_str());
     string err;
     std::vector<int32_t> columnTypes;
     std::vector<string> columnNames;
     std::vector<std::vector<std::string>> rows;
-    if (!query(key, zSql, rows, columnTypes, columnNames, err)) {
+    if (!query(db, zSql, rows, columnTypes, columnNames, err)) {
         ALOGE("Failed to check table schema for metric %lld: %s", (long long)metricId, err.c_str());
-        sqlite3_close(db);
         return false;
     }
     // Sample query result
@@ -182,22 +195,19 @@ bool isEventCompatible(const ConfigKey& key, const int64_t metricId, const LogEv
     for (size_t i = 3; i < rows.size(); ++i) {  // Atom fields start at the third row
         tableSchema.push_back(rows[i][2]);  // The third column stores the data type for the column
     }
-    sqlite3_close(db);
     // An empty rows vector implies the table has not yet been created.
     return rows.size() == 0 || getExpectedTableSchema(event) == tableSchema;
 }
 
 bool deleteTable(const ConfigKey& key, const int64_t metricId) {
-    const string dbName = getDbName(key);
-    sqlite3* db;
-    if (sqlite3_open(dbName.c_str(), &db) != SQLITE_OK) {
-        sqlite3_close(db);
+    sqlite3* db = acquireDb(key);
+    if (db == nullptr) {
         return false;
     }
     string zSql = StringPrintf("DROP TABLE metric_%s", reformatMetricId(metricId).c_str());
     char* error = nullptr;
     sqlite3_exec(db, zSql.c_str(), nullptr, nullptr, &error);
-    sqlite3_close(db);
+    releaseDb(db);
     if (error) {
         ALOGW("Failed to drop table from db: %s", error);
         return false;
@@ -206,6 +216,7 @@ bool deleteTable(const ConfigKey& key, const int64_t metricId) {
 }
 
 void deleteDb(const ConfigKey& key) {
+    evictDb(key);
     const string dbName = getDbName(key);
     StorageManager::deleteFile(dbName.c_str());
 }
@@ -219,98 +230,292 @@ sqlite3* getDb(const ConfigKey& key) {
     return nullptr;
 }
 
+// Single row insert statements prepared on each open db handle, keyed by metric id and
+// parameter count, so that flushes of the same metric do not compile the insert again. They are
+// finalized by closeDb before the handle is closed.
+static std::mutex gInsertStmtsMutex;
+static std::unordered_map<sqlite3*, std::map<std::pair<int64_t, int>, sqlite3_stmt*>> gInsertStmts;
+
+// Bounds how much one transaction of a large flush holds in the journal.
+static const size_t kMaxRowsPerTransaction = 500;
+
 void closeDb(sqlite3* db) {
+    {
+        std::lock_guard<std::mutex> lock(gInsertStmtsMutex);
+        auto it = gInsertStmts.find(db);
+        if (it != gInsertStmts.end()) {
+            for (const auto& [key, stmt] : it->second) {
+                sqlite3_finalize(stmt);
+            }
+            gInsertStmts.erase(it);
+        }
+    }
     sqlite3_close(db);
 }
 
-static bool getInsertSqlStmt(sqlite3* db, sqlite3_stmt** stmt, const int64_t metricId,
-                             const vector<LogEvent>& events, string& err) {
-    string result =
-            StringPrintf("INSERT INTO metric_%s VALUES", reformatMetricId(metricId).c_str());
-    for (auto& logEvent : events) {
-        result += StringPrintf("(%d, %lld, %lld,", logEvent.GetTagId(),
-                               (long long)logEvent.GetElapsedTimestampNs(),
-                               (long long)logEvent.GetLogdTimestampNs());
-        for (auto& fieldValue : logEvent.getValues()) {
-            if (fieldValue.mField.getDepth() > 0 || fieldValue.mValue.getType() == STORAGE) {
-                // Repeated fields and byte fields are not supported.
-                continue;
+// Open connections to the most recently used dbs, most recent first. A connection handed out by
+// acquireDb is marked in use until releaseDb, so that no two threads share a handle.
+struct PooledDb {
+    ConfigKey key;
+    sqlite3* db;
+    bool inUse;
+};
+static std::mutex gDbPoolMutex;
+static std::list<PooledDb> gDbPool;
+
+// Restricted configs are few and rarely more than a couple are written at the same time.
+static const size_t kMaxPooledDbs = 4;
+
+// Page cache of a pooled connection, in KiB. Flushes only append, so the default of about 2 MiB
+// per connection would mostly hold pages that are never read again.
+static const int kPooledDbCacheSizeKib = 256;
+
+sqlite3* acquireDb(const ConfigKey& key) {
+    {
+        std::lock_guard<std::mutex> lock(gDbPoolMutex);
+        for (auto it = gDbPool.begin(); it != gDbPool.end(); ++it) {
+            if (it->key == key && !it->inUse) {
+                it->inUse = true;
+                gDbPool.splice(gDbPool.begin(), gDbPool, it);
+                return it->db;
             }
-            result += "?,";
         }
-        result.pop_back();
-        result += "),";
     }
-    result.pop_back();
-    result += ";";
-    if (sqlite3_prepare_v2(db, result.c_str(), -1, stmt, nullptr) != SQLITE_OK) {
+    sqlite3* db = getDb(key);
+    if (db == nullptr) {
+        return nullptr;
+    }
+    string zSql = StringPrintf("PRAGMA cache_size=-%d;", kPooledDbCacheSizeKib);
+    sqlite3_exec(db, zSql.c_str(), nullptr, nullptr, nullptr);
+
+    std::lock_guard<std::mutex> lock(gDbPoolMutex);
+    for (const PooledDb& pooled : gDbPool) {
+        if (pooled.key == key) {
+            // Another thread holds the pooled connection of this db. This one is closed on
+            // release.
+            return db;
+        }
+    }
+    gDbPool.push_front({key, db, /*inUse=*/true});
+    // Close the least recently used idle connections beyond the limit.
+    auto it = gDbPool.end();
+    while (gDbPool.size() > kMaxPooledDbs && it != gDbPool.begin()) {
+        --it;
+        if (!it->inUse) {
+            closeDb(it->db);
+            it = gDbPool.erase(it);
+        }
+    }
+    return db;
+}
+
+void releaseDb(sqlite3* db) {
+    {
+        std::lock_guard<std::mutex> lock(gDbPoolMutex);
+        for (PooledDb& pooled : gDbPool) {
+            if (pooled.db == db) {
+                pooled.inUse = false;
+                return;
+            }
+        }
+    }
+    closeDb(db);
+}
+
+void evictDb(const ConfigKey& key) {
+    std::lock_guard<std::mutex> lock(gDbPoolMutex);
+    for (auto it = gDbPool.begin(); it != gDbPool.end(); ++it) {
+        if (it->key == key) {
+            // A connection in use is closed by releaseDb once it is no longer in the pool.
+            if (!it->inUse) {
+                closeDb(it->db);
+            }
+            gDbPool.erase(it);
+            return;
+        }
+    }
+}
+
+// Returns the number of values of the event that are stored in its row.
+static int getInsertParamCount(const LogEvent& logEvent) {
+    int count = 0;
+    for (auto& fieldValue : logEvent.getValues()) {
+        if (fieldValue.mField.getDepth() > 0 || fieldValue.mValue.getType() == STORAGE) {
+            // Repeated fields and byte fields are not supported.
+            continue;
+        }
+        ++count;
+    }
+    return count;
+}
+
+static sqlite3_stmt* getInsertSqlStmt(sqlite3* db, const int64_t metricId, const int paramCount,
+                                      string& err) {
+    std::lock_guard<std::mutex> lock(gInsertStmtsMutex);
+    std::map<std::pair<int64_t, int>, sqlite3_stmt*>& stmts = gInsertStmts[db];
+    auto it = stmts.find({metricId, paramCount});
+    if (it != stmts.end()) {
+        return it->second;
+    }
+    string result = StringPrintf("INSERT INTO metric_%s VALUES(?,?,?",
+                                 reformatMetricId(metricId).c_str());
+    for (int i = 0; i < paramCount; ++i) {
+        result += ",?";
+    }
+    result += ");";
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, result.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
         err = sqlite3_errmsg(db);
-        return false;
+        sqlite3_finalize(stmt);
+        return nullptr;
     }
+    stmts[{metricId, paramCount}] = stmt;
+    return stmt;
+}
+
+static void bindInsertParams(sqlite3_stmt* stmt, const LogEvent& logEvent) {
     // ? parameters start with an index of 1 from start of query string to the
     // end.
-    int32_t index = 1;
-    for (auto& logEvent : events) {
-        for (auto& fieldValue : logEvent.getValues()) {
-            if (fieldValue.mField.getDepth() > 0 || fieldValue.mValue.getType() == STORAGE) {
-                // Repeated fields and byte fields are not supported.
-                continue;
-            }
-            switch (fieldValue.mValue.getType()) {
-                case INT:
-                    sqlite3_bind_int(*stmt, index, fieldValue.mValue.int_value);
-                    break;
-                case LONG:
-                    sqlite3_bind_int64(*stmt, index, fieldValue.mValue.long_value);
-                    break;
-                case STRING:
-                    sqlite3_bind_text(*stmt, index, fieldValue.mValue.str_value.c_str(), -1,
-                                      SQLITE_STATIC);
-                    break;
-                case FLOAT:
-                    sqlite3_bind_double(*stmt, index, fieldValue.mValue.float_value);
-                    break;
-                default:
-                    // Byte array fields are not supported.
-                    break;
-            }
-            ++index;
+    sqlite3_bind_int(stmt, 1, logEvent.GetTagId());
+    sqlite3_bind_int64(stmt, 2, logEvent.GetElapsedTimestampNs());
+    sqlite3_bind_int64(stmt, 3, logEvent.GetLogdTimestampNs());
+    int32_t index = 4;
+    for (auto& fieldValue : logEvent.getValues()) {
+        if (fieldValue.mField.getDepth() > 0 || fieldValue.mValue.getType() == STORAGE) {
+            // Repeated fields and byte fields are not supported.
+            continue;
+        }
+        switch (fieldValue.mValue.getType()) {
+            case INT:
+                sqlite3_bind_int(stmt, index, fieldValue.mValue.int_value);
+                break;
+            case LONG:
+                sqlite3_bind_int64(stmt, index, fieldValue.mValue.long_value);
+                break;
+            case STRING:
+                sqlite3_bind_text(stmt, index, fieldValue.mValue.str_value.c_str(), -1,
+                                  SQLITE_STATIC);
+                break;
+            case FLOAT:
+                sqlite3_bind_double(stmt, index, fieldValue.mValue.float_value);
+                break;
+            default:
+                // Byte array fields are not supported.
+                break;
         }
+        ++index;
+    }
+}
+
+static int getInsertParamCount(const RestrictedEventBuffer& events, const size_t row) {
+    return events.getRow(row).valueCount;
+}
+
+static int getInsertParamCount(const vector<LogEvent>& events, const size_t row) {
+    return getInsertParamCount(events[row]);
+}
+
+static void bindInsertParams(sqlite3_stmt* stmt, const RestrictedEventBuffer& events,
+                             const size_t rowIndex) {
+    const RestrictedEventBuffer::Row& row = events.getRow(rowIndex);
+    sqlite3_bind_int(stmt, 1, row.atomId);
+    sqlite3_bind_int64(stmt, 2, row.elapsedTimestampNs);
+    sqlite3_bind_int64(stmt, 3, row.logdTimestampNs);
+    for (uint32_t i = 0; i < row.valueCount; ++i) {
+        const RestrictedEventBuffer::Value& value = events.getValue(row, i);
+        const int index = i + 4;
+        switch (value.type) {
+            case INT:
+                sqlite3_bind_int(stmt, index, value.intValue);
+                break;
+            case LONG:
+                sqlite3_bind_int64(stmt, index, value.longValue);
+                break;
+            case STRING:
+                sqlite3_bind_text(stmt, index, events.getString(value), -1, SQLITE_STATIC);
+                break;
+            case FLOAT:
+                sqlite3_bind_double(stmt, index, value.floatValue);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void bindInsertParams(sqlite3_stmt* stmt, const vector<LogEvent>& events,
+                             const size_t row) {
+    bindInsertParams(stmt, events[row]);
+}
+
+// Inserts the rows [first, last) of events in one transaction.
+template <typename Rows>
+static bool insertTransaction(sqlite3* db, const int64_t metricId, const Rows& events,
+                              const size_t first, const size_t last, string& error) {
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        error = sqlite3_errmsg(db);
+        return false;
+    }
+    for (size_t i = first; i < last; ++i) {
+        sqlite3_stmt* stmt =
+                getInsertSqlStmt(db, metricId, getInsertParamCount(events, i), error);
+        if (stmt == nullptr) {
+            ALOGW("Failed to generate prepared sql insert query %s", error.c_str());
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        bindInsertParams(stmt, events, i);
+        const int result = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (result != SQLITE_DONE) {
+            error = sqlite3_errmsg(db);
+            ALOGW("Failed to insert data to db: %s", error.c_str());
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+    }
+    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        error = sqlite3_errmsg(db);
+        ALOGW("Failed to commit data to db: %s", error.c_str());
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return false;
     }
     return true;
 }
 
 bool insert(const ConfigKey& key, const int64_t metricId, const vector<LogEvent>& events,
             string& error) {
-    const string dbName = getDbName(key);
-    sqlite3* db;
-    if (sqlite3_open(dbName.c_str(), &db) != SQLITE_OK) {
-        error = sqlite3_errmsg(db);
-        sqlite3_close(db);
+    sqlite3* db = acquireDb(key);
+    if (db == nullptr) {
+        error = "Failed to open db " + getDbName(key);
         return false;
     }
     bool success = insert(db, metricId, events, error);
-    sqlite3_close(db);
+    releaseDb(db);
     return success;
 }
 
-bool insert(sqlite3* db, const int64_t metricId, const vector<LogEvent>& events, string& error) {
-    sqlite3_stmt* stmt = nullptr;
-    if (!getInsertSqlStmt(db, &stmt, metricId, events, error)) {
-        ALOGW("Failed to generate prepared sql insert query %s", error.c_str());
-        sqlite3_finalize(stmt);
-        return false;
-    }
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        error = sqlite3_errmsg(db);
-        ALOGW("Failed to insert data to db: %s", error.c_str());
-        sqlite3_finalize(stmt);
-        return false;
+template <typename Rows>
+static bool insertRows(sqlite3* db, const int64_t metricId, const Rows& events, string& error) {
+    for (size_t first = 0; first < events.size(); first += kMaxRowsPerTransaction) {
+        const size_t last = std::min(first + kMaxRowsPerTransaction, events.size());
+        if (!insertTransaction(db, metricId, events, first, last, error)) {
+            return false;
+        }
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
+bool insert(sqlite3* db, const int64_t metricId, const vector<LogEvent>& events, string& error) {
+    return insertRows(db, metricId, events, error);
+}
+
+bool insert(sqlite3* db, const int64_t metricId, const RestrictedEventBuffer& events,
+            string& error) {
+    return insertRows(db, metricId, events, error);
+}
+
 bool query(const ConfigKey& key, const string& zSql, vector<vector<string>>& rows,
            vector<int32_t>& columnTypes, vector<string>& columnNames, string& err) {
     const string dbName = getDbName(key);
@@ -320,11 +525,17 @@ bool query(const ConfigKey& key, const string& zSql, vector<vector<string>>& row
         sqlite3_close(db);
         return false;
     }
+    bool success = query(db, zSql, rows, columnTypes, columnNames, err);
+    sqlite3_close(db);
+    return success;
+}
+
+static bool query(sqlite3* db, const string& zSql, vector<vector<string>>& rows,
+                  vector<int32_t>& columnTypes, vector<string>& columnNames, string& err) {
     sqlite3_stmt* stmt;
     if (sqlite3_prepare_v2(db, zSql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
         err = sqlite3_errmsg(db);
         sqlite3_finalize(stmt);
-        sqlite3_close(db);
         return false;
     }
     int result = sqlite3_step(stmt);
@@ -354,10 +565,8 @@ bool query(const ConfigKey& key, const string& zSql, vector<vector<string>>& row
     sqlite3_finalize(stmt);
     if (result != SQLITE_DONE) {
         err = sqlite3_errmsg(db);
-        sqlite3_close(db);
         return false;
     }
-    sqlite3_close(db);
     return true;
 }
 
@@ -450,11 +659,9 @@ static bool getDeviceInfoInsertStmt(sqlite3* db, sqlite3_stmt** stmt, string err
 }
 
 bool updateDeviceInfoTable(const ConfigKey& key, string& error) {
-    const string dbName = getDbName(key);
-    sqlite3* db;
-    if (sqlite3_open(dbName.c_str(), &db) != SQLITE_OK) {
-        error = sqlite3_errmsg(db);
-        sqlite3_close(db);
+    sqlite3* db = acquireDb(key);
+    if (db == nullptr) {
+        error = "Failed to open db " + getDbName(key);
         return false;
     }
 
@@ -473,7 +680,7 @@ bool updateDeviceInfoTable(const ConfigKey& key, string& error) {
     if (sqlite3_exec(db, createTableSql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
         error = sqlite3_errmsg(db);
         ALOGW("Failed to create device info table %s", error.c_str());
-        sqlite3_close(db);
+        releaseDb(db);
         return false;
     }
 
@@ -481,7 +688,7 @@ bool updateDeviceInfoTable(const ConfigKey& key, string& error) {
     if (!getDeviceInfoInsertStmt(db, &stmt, error)) {
         ALOGW("Failed to generate device info prepared sql insert query %s", error.c_str());
         sqlite3_finalize(stmt);
-        sqlite3_close(db);
+        releaseDb(db);
         return false;
     }
 
@@ -489,11 +696,11 @@ bool updateDeviceInfoTable(const ConfigKey& key, string& error) {
         error = sqlite3_errmsg(db);
         ALOGW("Failed to insert data to device info table: %s", error.c_str());
         sqlite3_finalize(stmt);
-        sqlite3_close(db);
+        releaseDb(db);
         return false;
     }
     sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    releaseDb(db);
     return true;
 }
 }  // namespace dbutils
@@ -19,6 +19,7 @@
 
 #include "config/ConfigKey.h"
 #include "logd/LogEvent.h"
+#include "utils/RestrictedEventBuffer.h"
 
 using std::string;
 using std::vector;
@@ -41,11 +42,17 @@ string reformatMetricId(const int64_t metricId);
 /* Creates a new data table for a specified metric if one does not yet exist. */
 bool createTableIfNeeded(const ConfigKey& key, int64_t metricId, const LogEvent& event);
 
+/* Creates a new data table for a specified metric in the specified sqlite db handle. */
+bool createTableIfNeeded(sqlite3* db, int64_t metricId, const LogEvent& event);
+
 /* Checks whether the table schema for the given metric matches the event.
  * Returns true if the table has not yet been created.
  */
 bool isEventCompatible(const ConfigKey& key, int64_t metricId, const LogEvent& event);
 
+/* Checks whether the table schema in the specified sqlite db handle matches the event. */
+bool isEventCompatible(sqlite3* db, int64_t metricId, const LogEvent& event);
+
 /* Deletes a data table for the specified metric. */
 bool deleteTable(const ConfigKey& key, int64_t metricId);
 
@@ -57,17 +64,38 @@ void deleteDb(const ConfigKey& key);
  */
 sqlite3* getDb(const ConfigKey& key);
 
-/* Closes the handle to the sqlite db. */
+/* Closes the handle to the sqlite db, finalizing the insert statements prepared on it. */
 void closeDb(sqlite3* db);
 
+/* Gets a handle to the sqlite db from a small pool of open connections, so that the schema and
+ * the prepared statements of a db are kept across flushes and TTL enforcement. The handle is
+ * only used by the caller until it is returned with releaseDb, and must not be closed by it.
+ * Returns a nullptr if an error occurs.
+ */
+sqlite3* acquireDb(const ConfigKey& key);
+
+/* Returns a handle obtained from acquireDb. */
+void releaseDb(sqlite3* db);
+
+/* Closes the pooled connection to the db, if any. Must be called before the db file is removed. */
+void evictDb(const ConfigKey& key);
+
 /* Inserts new data into the specified metric data table.
- * A temp sqlite handle is created using the ConfigKey.
+ * The sqlite handle is taken from the connection pool using the ConfigKey.
  */
 bool insert(const ConfigKey& key, int64_t metricId, const vector<LogEvent>& events, string& error);
 
-/* Inserts new data into the specified sqlite db handle. */
+/* Inserts new data into the specified sqlite db handle, one transaction per up to 500 rows.
+ * The insert statement is prepared once per metric and kept until the handle is closed with
+ * closeDb. If a transaction fails, the rows of the earlier transactions remain inserted.
+ */
 bool insert(sqlite3* db, int64_t metricId, const vector<LogEvent>& events, string& error);
 
+/* Inserts the buffered events into the specified sqlite db handle, as the overload above does.
+ * The values are bound from the buffer, which must not be modified until the call returns.
+ */
+bool insert(sqlite3* db, int64_t metricId, const RestrictedEventBuffer& events, string& error);
+
 /* Executes a sql query on the specified SQLite db.
  * A temp sqlite handle is created using the ConfigKey.
  */
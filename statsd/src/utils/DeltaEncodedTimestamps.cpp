@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "utils/DeltaEncodedTimestamps.h"
+
+#include "varint.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+// Maps signed deltas to unsigned ones so that small negative deltas also encode to short varints.
+// The arithmetic is done on uint64_t so that deltas between far apart timestamps wrap around
+// instead of overflowing.
+uint64_t zigzagEncode(int64_t previous, int64_t timestamp) {
+    const int64_t delta = static_cast<int64_t>(static_cast<uint64_t>(timestamp) -
+                                               static_cast<uint64_t>(previous));
+    return (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+}
+
+int64_t zigzagDecode(int64_t previous, uint64_t encoded) {
+    const uint64_t delta = (encoded >> 1) ^ -(encoded & 1);
+    return static_cast<int64_t>(static_cast<uint64_t>(previous) + delta);
+}
+
+}  // anonymous namespace
+
+DeltaEncodedTimestamps::DeltaEncodedTimestamps() : mLast(0), mSize(0) {
+}
+
+void DeltaEncodedTimestamps::push_back(int64_t timestamp) {
+    char buffer[Varint::kMax64];
+    char* end = Varint::Encode64(buffer, zigzagEncode(mLast, timestamp));
+    mEncoded.insert(mEncoded.end(), buffer, end);
+    mLast = timestamp;
+    mSize++;
+}
+
+DeltaEncodedTimestamps::const_iterator DeltaEncodedTimestamps::begin() const {
+    return const_iterator(mEncoded.data(), mEncoded.data() + mEncoded.size());
+}
+
+DeltaEncodedTimestamps::const_iterator DeltaEncodedTimestamps::end() const {
+    const char* end = mEncoded.data() + mEncoded.size();
+    return const_iterator(end, end);
+}
+
+DeltaEncodedTimestamps::const_iterator::const_iterator(const char* pos, const char* end)
+    : mPos(pos), mNext(pos), mEnd(end), mTimestamp(0) {
+    decode();
+}
+
+DeltaEncodedTimestamps::const_iterator& DeltaEncodedTimestamps::const_iterator::operator++() {
+    mPos = mNext;
+    decode();
+    return *this;
+}
+
+void DeltaEncodedTimestamps::const_iterator::decode() {
+    if (mPos == mEnd) {
+        return;
+    }
+    uint64_t encoded = 0;
+    mNext = Varint::Parse64(mPos, mEnd, &encoded);
+    if (mNext == nullptr) {
+        // Only written by push_back(), so this cannot happen. End the iteration rather than
+        // read past the buffer.
+        mNext = mEnd;
+        return;
+    }
+    mTimestamp = zigzagDecode(mTimestamp, encoded);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iterator>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * A sequence of timestamps stored as the zigzag-encoded varints of the deltas between consecutive
+ * timestamps. The timestamps of the events of one atom are usually close together, so each of
+ * them takes one to a few bytes rather than eight. Appending is amortized O(1), and iterating
+ * decodes the timestamps in the order they were appended.
+ */
+class DeltaEncodedTimestamps {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = int64_t;
+        using difference_type = ptrdiff_t;
+        using pointer = const int64_t*;
+        using reference = int64_t;
+
+        int64_t operator*() const {
+            return mTimestamp;
+        }
+
+        const_iterator& operator++();
+
+        bool operator==(const const_iterator& other) const {
+            return mPos == other.mPos;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return mPos != other.mPos;
+        }
+
+    private:
+        friend class DeltaEncodedTimestamps;
+
+        const_iterator(const char* pos, const char* end);
+
+        // Decodes the delta at mPos into mTimestamp and sets mNext past it.
+        void decode();
+
+        const char* mPos;
+        const char* mNext;
+        const char* mEnd;
+        int64_t mTimestamp;
+    };
+
+    DeltaEncodedTimestamps();
+
+    void push_back(int64_t timestamp);
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    size_t size() const {
+        return mSize;
+    }
+
+    bool empty() const {
+        return mSize == 0;
+    }
+
+    // The number of bytes taken by the encoded deltas.
+    size_t encodedByteSize() const {
+        return mEncoded.size();
+    }
+
+private:
+    std::vector<char> mEncoded;
+
+    // The last timestamp appended, which the next delta is relative to.
+    int64_t mLast;
+
+    size_t mSize;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
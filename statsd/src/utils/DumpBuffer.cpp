@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "DumpBuffer.h"
+
+#include <android-base/file.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+DumpBuffer::DumpBuffer(int out) : mOut(out), mBuffer(memfd_create("statsd_dump", MFD_CLOEXEC)) {
+    if (!mBuffer.ok()) {
+        ALOGW("Failed to create dump buffer, writing the dump directly, errno=%d", errno);
+    }
+}
+
+bool DumpBuffer::flush() {
+    if (!mBuffer.ok()) {
+        return true;
+    }
+    off_t remaining = lseek(mBuffer.get(), 0, SEEK_CUR);
+    if (remaining < 0 || lseek(mBuffer.get(), 0, SEEK_SET) != 0) {
+        return false;
+    }
+    char chunk[4096];
+    bool success = true;
+    while (remaining > 0 && success) {
+        const ssize_t count = TEMP_FAILURE_RETRY(
+                read(mBuffer.get(), chunk, std::min<off_t>(remaining, sizeof(chunk))));
+        success = count > 0 && android::base::WriteFully(mOut, chunk, count);
+        remaining -= count;
+    }
+    lseek(mBuffer.get(), 0, SEEK_SET);
+    ftruncate(mBuffer.get(), 0);
+    return success;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Collects a text dump in memory, so that it can be formatted while holding a lock and written to
+ * its output after the lock is released. The reader of a dumpsys or bug report pipe may be slow
+ * to drain it, and statsd must not process events or answer binder calls at that pace.
+ *
+ * If the memory buffer cannot be created, fd() is the output itself and the dump is written
+ * directly, as it would be without the buffer.
+ */
+class DumpBuffer {
+public:
+    explicit DumpBuffer(int out);
+
+    // Where the dump is formatted to, for example with dprintf.
+    int fd() const {
+        return mBuffer.ok() ? mBuffer.get() : mOut;
+    }
+
+    // Copies what was formatted into fd() to the output and empties the buffer. Returns false if
+    // the output could not be written.
+    bool flush();
+
+private:
+    const int mOut;
+    android::base::unique_fd mBuffer;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
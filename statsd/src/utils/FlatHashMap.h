@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Open-addressing hash map with the subset of the std::unordered_map interface used by the metric
+ * producers.
+ *
+ * Entries live in one contiguous array next to a byte array of control bytes, so inserting a key
+ * does not allocate a node and lookups probe adjacent memory. Each control byte caches 7 bits of
+ * the key's hash, which lets most probes skip the key comparison.
+ *
+ * Differences from std::unordered_map:
+ *  - Inserting may move existing entries, which invalidates iterators, pointers and references.
+ *    Erasing only invalidates iterators and references to the erased entry.
+ *  - value_type is std::pair<Key, T> so entries can be moved on rehash. Keys must not be modified
+ *    through iterators.
+ *  - Iteration order is unspecified and differs from std::unordered_map.
+ */
+template <typename Key, typename T, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class FlatHashMap {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+    using size_type = size_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+
+    template <bool kConst>
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = FlatHashMap::value_type;
+        using difference_type = ptrdiff_t;
+        using pointer = std::conditional_t<kConst, const value_type*, value_type*>;
+        using reference = std::conditional_t<kConst, const value_type&, value_type&>;
+        using MapPtr = std::conditional_t<kConst, const FlatHashMap*, FlatHashMap*>;
+
+        Iterator() : mMap(nullptr), mIndex(0) {
+        }
+
+        // Allows conversion from iterator to const_iterator.
+        template <bool kOtherConst, typename = std::enable_if_t<kConst && !kOtherConst>>
+        Iterator(const Iterator<kOtherConst>& other) : mMap(other.mMap), mIndex(other.mIndex) {
+        }
+
+        reference operator*() const {
+            return mMap->mSlots[mIndex];
+        }
+
+        pointer operator->() const {
+            return &mMap->mSlots[mIndex];
+        }
+
+        Iterator& operator++() {
+            mIndex = mMap->nextFull(mIndex + 1);
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator copy = *this;
+            ++*this;
+            return copy;
+        }
+
+        template <bool kOtherConst>
+        bool operator==(const Iterator<kOtherConst>& that) const {
+            return mIndex == that.mIndex;
+        }
+
+        template <bool kOtherConst>
+        bool operator!=(const Iterator<kOtherConst>& that) const {
+            return mIndex != that.mIndex;
+        }
+
+    private:
+        Iterator(MapPtr map, size_t index) : mMap(map), mIndex(index) {
+        }
+
+        MapPtr mMap;
+        size_t mIndex;
+
+        friend class FlatHashMap;
+        friend class Iterator<!kConst>;
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    FlatHashMap() : mCtrl(nullptr), mSlots(nullptr), mCapacity(0), mSize(0), mTombstones(0) {
+    }
+
+    FlatHashMap(std::initializer_list<value_type> init) : FlatHashMap() {
+        reserve(init.size());
+        for (const value_type& value : init) {
+            insert(value);
+        }
+    }
+
+    FlatHashMap(const FlatHashMap& that) : FlatHashMap() {
+        reserve(that.size());
+        for (const value_type& value : that) {
+            insertUnique(that.hashOf(value.first), value);
+        }
+    }
+
+    FlatHashMap(FlatHashMap&& that) noexcept : FlatHashMap() {
+        swap(that);
+    }
+
+    ~FlatHashMap() {
+        destroyAll();
+    }
+
+    FlatHashMap& operator=(const FlatHashMap& that) {
+        if (this != &that) {
+            FlatHashMap copy(that);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    FlatHashMap& operator=(FlatHashMap&& that) noexcept {
+        if (this != &that) {
+            destroyAll();
+            swap(that);
+        }
+        return *this;
+    }
+
+    iterator begin() {
+        return iterator(this, nextFull(0));
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, nextFull(0));
+    }
+
+    iterator end() {
+        return iterator(this, mCapacity);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, mCapacity);
+    }
+
+    bool empty() const {
+        return mSize == 0;
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    size_t capacity() const {
+        return mCapacity;
+    }
+
+    // Bytes allocated for the table: the entries, including the empty and deleted ones, and their
+    // control bytes. Memory the entries own, e.g. the values of a vector, is not included.
+    size_t tableByteSize() const {
+        return mCapacity * (sizeof(value_type) + sizeof(uint8_t));
+    }
+
+    void clear() {
+        if (mSize == 0 && mTombstones == 0) {
+            return;
+        }
+        for (size_t i = 0; i < mCapacity; i++) {
+            if (isFull(mCtrl[i])) {
+                mSlots[i].~value_type();
+            }
+            mCtrl[i] = kEmpty;
+        }
+        mSize = 0;
+        mTombstones = 0;
+    }
+
+    // Makes room for count entries without rehashing.
+    void reserve(size_t count) {
+        size_t capacity = kMinCapacity;
+        while (capacity * kMaxLoadNum / kMaxLoadDen < count) {
+            capacity *= 2;
+        }
+        if (capacity > mCapacity) {
+            rehash(capacity);
+        }
+    }
+
+    iterator find(const Key& key) {
+        return iterator(this, findIndex(key, hashOf(key)));
+    }
+
+    const_iterator find(const Key& key) const {
+        return const_iterator(this, findIndex(key, hashOf(key)));
+    }
+
+    size_t count(const Key& key) const {
+        return findIndex(key, hashOf(key)) != mCapacity ? 1 : 0;
+    }
+
+    bool contains(const Key& key) const {
+        return count(key) != 0;
+    }
+
+    T& operator[](const Key& key) {
+        return try_emplace(key).first->second;
+    }
+
+    T& operator[](Key&& key) {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        const size_t hash = hashOf(key);
+        const size_t index = findIndex(key, hash);
+        if (index != mCapacity) {
+            return {iterator(this, index), false};
+        }
+        return {iterator(this, insertUnique(hash, std::piecewise_construct,
+                                            std::forward_as_tuple(std::forward<K>(key)),
+                                            std::forward_as_tuple(std::forward<Args>(args)...))),
+                true};
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value) {
+        return try_emplace(value.first, value.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return try_emplace(std::move(value.first), std::move(value.second));
+    }
+
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+
+    // Returns an iterator to the entry after the erased one.
+    iterator erase(const_iterator pos) {
+        eraseIndex(pos.mIndex);
+        return iterator(this, nextFull(pos.mIndex + 1));
+    }
+
+    iterator erase(iterator pos) {
+        return erase(const_iterator(pos));
+    }
+
+    size_t erase(const Key& key) {
+        const size_t index = findIndex(key, hashOf(key));
+        if (index == mCapacity) {
+            return 0;
+        }
+        eraseIndex(index);
+        return 1;
+    }
+
+    void swap(FlatHashMap& that) noexcept {
+        std::swap(mCtrl, that.mCtrl);
+        std::swap(mSlots, that.mSlots);
+        std::swap(mCapacity, that.mCapacity);
+        std::swap(mSize, that.mSize);
+        std::swap(mTombstones, that.mTombstones);
+    }
+
+    bool operator==(const FlatHashMap& that) const {
+        if (mSize != that.mSize) {
+            return false;
+        }
+        for (const value_type& value : *this) {
+            auto it = that.find(value.first);
+            if (it == that.end() || !(it->second == value.second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const FlatHashMap& that) const {
+        return !(*this == that);
+    }
+
+private:
+    // Control byte values. Full slots store the low 7 bits of the hash, so their top bit is 0.
+    static constexpr uint8_t kEmpty = 0x80;
+    static constexpr uint8_t kDeleted = 0xfe;
+
+    static constexpr size_t kMinCapacity = 8;
+
+    // Maximum fraction of slots that can be full or deleted before growing.
+    static constexpr size_t kMaxLoadNum = 7;
+    static constexpr size_t kMaxLoadDen = 8;
+
+    static bool isFull(uint8_t ctrl) {
+        return (ctrl & 0x80) == 0;
+    }
+
+    static uint8_t h2(size_t hash) {
+        return hash & 0x7f;
+    }
+
+    // Uses the high bits of the hash to pick the first probe position, since the low bits are
+    // kept in the control byte.
+    size_t h1(size_t hash) const {
+        return (hash >> 7) & (mCapacity - 1);
+    }
+
+    // std::hash is the identity for integers on some platforms, so the user hash is mixed before
+    // its bits are split between the probe position and the control byte.
+    template <typename K>
+    size_t hashOf(const K& key) const {
+        const uint64_t hash = static_cast<uint64_t>(Hash()(key)) * 0x9e3779b97f4a7c15ULL;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+
+    size_t nextFull(size_t index) const {
+        while (index < mCapacity && !isFull(mCtrl[index])) {
+            index++;
+        }
+        return index;
+    }
+
+    // Returns the index of key, or mCapacity if it is not present.
+    template <typename K>
+    size_t findIndex(const K& key, size_t hash) const {
+        if (mCapacity == 0) {
+            return mCapacity;
+        }
+        const uint8_t tag = h2(hash);
+        const size_t mask = mCapacity - 1;
+        for (size_t index = h1(hash), probes = 0; probes < mCapacity;
+             index = (index + 1) & mask, probes++) {
+            const uint8_t ctrl = mCtrl[index];
+            if (ctrl == kEmpty) {
+                return mCapacity;
+            }
+            if (ctrl == tag && KeyEqual()(mSlots[index].first, key)) {
+                return index;
+            }
+        }
+        return mCapacity;
+    }
+
+    // Constructs a new entry for a key known to be absent, and returns its index.
+    template <typename... Args>
+    size_t insertUnique(size_t hash, Args&&... args) {
+        if (mCapacity == 0 || (mSize + mTombstones + 1) * kMaxLoadDen > mCapacity * kMaxLoadNum) {
+            // Rehashing in place is enough if most of the used slots are tombstones.
+            const size_t capacity = mCapacity == 0 ? kMinCapacity
+                                    : mSize * 2 >= mCapacity ? mCapacity * 2
+                                                             : mCapacity;
+            rehash(capacity);
+        }
+        const size_t mask = mCapacity - 1;
+        size_t index = h1(hash);
+        while (isFull(mCtrl[index])) {
+            index = (index + 1) & mask;
+        }
+        if (mCtrl[index] == kDeleted) {
+            mTombstones--;
+        }
+        new (&mSlots[index]) value_type(std::forward<Args>(args)...);
+        mCtrl[index] = h2(hash);
+        mSize++;
+        return index;
+    }
+
+    void eraseIndex(size_t index) {
+        mSlots[index].~value_type();
+        // A slot followed by an empty one can't be in the middle of a probe chain, so it can go
+        // back to empty instead of becoming a tombstone.
+        if (mCtrl[(index + 1) & (mCapacity - 1)] == kEmpty) {
+            mCtrl[index] = kEmpty;
+        } else {
+            mCtrl[index] = kDeleted;
+            mTombstones++;
+        }
+        mSize--;
+    }
+
+    void rehash(size_t capacity) {
+        uint8_t* oldCtrl = mCtrl;
+        value_type* oldSlots = mSlots;
+        const size_t oldCapacity = mCapacity;
+
+        mCtrl = new uint8_t[capacity];
+        std::fill(mCtrl, mCtrl + capacity, kEmpty);
+        mSlots = std::allocator<value_type>().allocate(capacity);
+        mCapacity = capacity;
+        mSize = 0;
+        mTombstones = 0;
+
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (isFull(oldCtrl[i])) {
+                insertUnique(hashOf(oldSlots[i].first), std::move(oldSlots[i]));
+                oldSlots[i].~value_type();
+            }
+        }
+        if (oldCapacity > 0) {
+            std::allocator<value_type>().deallocate(oldSlots, oldCapacity);
+            delete[] oldCtrl;
+        }
+    }
+
+    void destroyAll() {
+        if (mCapacity == 0) {
+            return;
+        }
+        clear();
+        std::allocator<value_type>().deallocate(mSlots, mCapacity);
+        delete[] mCtrl;
+        mCtrl = nullptr;
+        mSlots = nullptr;
+        mCapacity = 0;
+    }
+
+    uint8_t* mCtrl;
+    value_type* mSlots;
+    size_t mCapacity;
+    size_t mSize;
+    size_t mTombstones;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * An immutable adjacency list over the dense indices [0, nodeCount), stored as two flat arrays
+ * (compressed sparse row). The edges out of node i are mTargets[mOffsets[i], mOffsets[i + 1]), so
+ * looking up a node's edges is two array reads instead of a hash lookup, and all edges sit in one
+ * contiguous allocation.
+ *
+ * Built once at config load from the maps produced while parsing the config.
+ */
+class IndexAdjacencyList {
+public:
+    // A view of the edges out of one node. Valid until the list is rebuilt.
+    class Range {
+    public:
+        Range(const int* begin, const int* end) : mBegin(begin), mEnd(end) {
+        }
+
+        const int* begin() const {
+            return mBegin;
+        }
+
+        const int* end() const {
+            return mEnd;
+        }
+
+        size_t size() const {
+            return mEnd - mBegin;
+        }
+
+        bool empty() const {
+            return mBegin == mEnd;
+        }
+
+    private:
+        const int* mBegin;
+        const int* mEnd;
+    };
+
+    IndexAdjacencyList() : mOffsets(1, 0) {
+    }
+
+    // Rebuilds the list from a map of node index to target indices. Keys outside
+    // [0, nodeCount) are dropped. The targets of each node keep the order they have in the map.
+    void build(const std::unordered_map<int, std::vector<int>>& edges, size_t nodeCount) {
+        mOffsets.assign(nodeCount + 1, 0);
+        for (const auto& [node, targets] : edges) {
+            if (node >= 0 && (size_t)node < nodeCount) {
+                mOffsets[node + 1] = targets.size();
+            }
+        }
+        for (size_t i = 0; i < nodeCount; i++) {
+            mOffsets[i + 1] += mOffsets[i];
+        }
+        mTargets.resize(mOffsets[nodeCount]);
+        for (const auto& [node, targets] : edges) {
+            if (node >= 0 && (size_t)node < nodeCount) {
+                std::copy(targets.begin(), targets.end(), mTargets.begin() + mOffsets[node]);
+            }
+        }
+    }
+
+    // Returns the edges out of node. Nodes outside the list have none.
+    Range targets(int node) const {
+        if (node < 0 || (size_t)node >= nodeCount()) {
+            return Range(nullptr, nullptr);
+        }
+        return Range(mTargets.data() + mOffsets[node], mTargets.data() + mOffsets[node + 1]);
+    }
+
+    // Whether node has at least one edge.
+    bool hasTargets(int node) const {
+        return node >= 0 && (size_t)node < nodeCount() && mOffsets[node] != mOffsets[node + 1];
+    }
+
+    size_t nodeCount() const {
+        return mOffsets.size() - 1;
+    }
+
+    size_t edgeCount() const {
+        return mTargets.size();
+    }
+
+private:
+    // mOffsets[i] is the position in mTargets of the first edge out of node i. Has nodeCount + 1
+    // entries so that the end of the last node's edges is mOffsets[nodeCount].
+    std::vector<int> mOffsets;
+
+    std::vector<int> mTargets;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "utils/LaneExecutor.h"
+
+#include <algorithm>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+LaneExecutor::LaneExecutor(size_t numLanes) : mNumLanes(std::max<size_t>(numLanes, 1)) {
+    mWorkerLanes.reserve(mNumLanes - 1);
+    for (size_t lane = 1; lane < mNumLanes; lane++) {
+        mWorkerLanes.push_back(std::make_unique<WorkerLane>());
+    }
+    // Start the threads only once mWorkerLanes is complete; they look up their lane in it.
+    for (size_t lane = 1; lane < mNumLanes; lane++) {
+        mWorkerLanes[lane - 1]->thread = std::thread([this, lane] { runWorkerLane(lane); });
+    }
+}
+
+LaneExecutor::~LaneExecutor() {
+    for (const std::unique_ptr<WorkerLane>& workerLane : mWorkerLanes) {
+        {
+            std::lock_guard<std::mutex> lock(workerLane->mutex);
+            workerLane->stop = true;
+        }
+        workerLane->wakeup.notify_one();
+    }
+    for (const std::unique_ptr<WorkerLane>& workerLane : mWorkerLanes) {
+        workerLane->thread.join();
+    }
+}
+
+void LaneExecutor::runOnEveryLane(const std::function<void(size_t)>& task) {
+    {
+        std::lock_guard<std::mutex> lock(mDoneMutex);
+        mPendingLanes = mWorkerLanes.size();
+    }
+    for (const std::unique_ptr<WorkerLane>& workerLane : mWorkerLanes) {
+        {
+            std::lock_guard<std::mutex> lock(workerLane->mutex);
+            workerLane->task = &task;
+        }
+        workerLane->wakeup.notify_one();
+    }
+
+    task(0);
+
+    std::unique_lock<std::mutex> lock(mDoneMutex);
+    mDone.wait(lock, [this] { return mPendingLanes == 0; });
+}
+
+void LaneExecutor::runWorkerLane(size_t lane) {
+    WorkerLane& workerLane = *mWorkerLanes[lane - 1];
+    std::unique_lock<std::mutex> lock(workerLane.mutex);
+    while (true) {
+        workerLane.wakeup.wait(lock,
+                               [&workerLane] { return workerLane.stop || workerLane.task; });
+        if (workerLane.stop) {
+            return;
+        }
+        const std::function<void(size_t)>* task = workerLane.task;
+        workerLane.task = nullptr;
+        lock.unlock();
+
+        (*task)(lane);
+
+        {
+            std::lock_guard<std::mutex> doneLock(mDoneMutex);
+            if (--mPendingLanes == 0) {
+                mDone.notify_one();
+            }
+        }
+        lock.lock();
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * A fixed set of lanes that run the same task side by side. Lane 0 is the calling thread, every
+ * other lane has its own long-lived worker thread, so that handing work to a lane only costs a
+ * wakeup, not a thread start. Callers that always give a lane the same share of the work keep
+ * that work on one thread.
+ *
+ * This class is not reentrant: only one thread may call runOnEveryLane at a time.
+ */
+class LaneExecutor {
+public:
+    explicit LaneExecutor(size_t numLanes);
+
+    LaneExecutor(const LaneExecutor&) = delete;
+    LaneExecutor& operator=(const LaneExecutor&) = delete;
+
+    // Stops and joins the worker threads.
+    ~LaneExecutor();
+
+    size_t getNumLanes() const {
+        return mNumLanes;
+    }
+
+    // Runs task(lane) once for every lane in [0, getNumLanes()), and returns once all of them
+    // are done.
+    void runOnEveryLane(const std::function<void(size_t)>& task);
+
+private:
+    struct WorkerLane {
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        // The task to run next, handed over by runOnEveryLane. Guarded by mutex.
+        const std::function<void(size_t)>* task = nullptr;
+        bool stop = false;
+        std::thread thread;
+    };
+
+    void runWorkerLane(size_t lane);
+
+    const size_t mNumLanes;
+
+    // The lanes with worker threads, i.e. lanes [1, mNumLanes).
+    std::vector<std::unique_ptr<WorkerLane>> mWorkerLanes;
+
+    std::mutex mDoneMutex;
+    std::condition_variable mDone;
+    // Worker lanes that have not finished the current task yet. Guarded by mDoneMutex.
+    size_t mPendingLanes = 0;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
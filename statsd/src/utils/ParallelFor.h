@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Runs task(i) for every i in [0, count) on up to maxThreads threads, the calling thread included,
+ * and returns once every task is done. Each thread takes the next index until none are left, so
+ * long tasks do not hold up the others. Tasks may run in any order and must not depend on each
+ * other.
+ */
+template <typename Task>
+void parallelFor(size_t count, size_t maxThreads, const Task& task) {
+    std::atomic<size_t> next(0);
+    const auto runTasks = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            task(i);
+        }
+    };
+
+    const size_t threadCount = std::min(count, std::max<size_t>(maxThreads, 1));
+    std::vector<std::thread> workers;
+    workers.reserve(threadCount > 0 ? threadCount - 1 : 0);
+    for (size_t i = 1; i < threadCount; i++) {
+        workers.emplace_back(runTasks);
+    }
+    runTasks();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
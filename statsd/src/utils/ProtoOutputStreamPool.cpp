@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "utils/ProtoOutputStreamPool.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using android::util::ProtoOutputStream;
+using std::unique_ptr;
+
+ProtoOutputStreamPool::ProtoOutputStreamPool(size_t maxPooledBytes)
+    : mMaxPooledBytes(maxPooledBytes) {
+}
+
+unique_ptr<ProtoOutputStream> ProtoOutputStreamPool::acquire(const ConfigKey& key) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mStreams.find(key);
+        if (it != mStreams.end()) {
+            unique_ptr<ProtoOutputStream> proto = std::move(it->second.proto);
+            mPooledBytes -= it->second.bytes;
+            mStreams.erase(it);
+            return proto;
+        }
+    }
+    return std::make_unique<ProtoOutputStream>();
+}
+
+void ProtoOutputStreamPool::release(const ConfigKey& key, unique_ptr<ProtoOutputStream> proto) {
+    // The chunks of the stream hold at least what was written to it.
+    const size_t bytes = proto->size();
+    if (bytes > mMaxPooledBytes) {
+        return;
+    }
+    // Clearing keeps the chunks the stream allocated.
+    proto->clear();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mStreams.find(key);
+    if (it != mStreams.end()) {
+        // Another report of the config was encoded meanwhile. Keep the larger stream.
+        if (it->second.bytes >= bytes) {
+            return;
+        }
+        mPooledBytes -= it->second.bytes;
+        mStreams.erase(it);
+    }
+    // Make room by dropping the streams of other configs.
+    while (mPooledBytes + bytes > mMaxPooledBytes && !mStreams.empty()) {
+        mPooledBytes -= mStreams.begin()->second.bytes;
+        mStreams.erase(mStreams.begin());
+    }
+    mPooledBytes += bytes;
+    mStreams.emplace(key, PooledStream{std::move(proto), bytes});
+}
+
+void ProtoOutputStreamPool::erase(const ConfigKey& key) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mStreams.find(key);
+    if (it != mStreams.end()) {
+        mPooledBytes -= it->second.bytes;
+        mStreams.erase(it);
+    }
+}
+
+size_t ProtoOutputStreamPool::getPooledBytes() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mPooledBytes;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
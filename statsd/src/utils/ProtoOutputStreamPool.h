@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/util/ProtoOutputStream.h>
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "config/ConfigKey.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Keeps the ProtoOutputStream of the last report of each config, so that the next report of the
+ * config is encoded into the chunks the previous one allocated instead of growing a new stream
+ * from scratch. A stream is only kept while the sizes of all the kept streams, which are their
+ * high-water marks, stay within maxPooledBytes.
+ *
+ * Streams are handed out exclusively, so reports of the same config can be encoded concurrently:
+ * the ones that find the pool empty get a new stream.
+ */
+class ProtoOutputStreamPool {
+public:
+    explicit ProtoOutputStreamPool(size_t maxPooledBytes);
+
+    // Returns an empty stream, the one last released for key if there is one.
+    std::unique_ptr<android::util::ProtoOutputStream> acquire(const ConfigKey& key);
+
+    // Gives the stream back once the report it holds was copied out.
+    void release(const ConfigKey& key, std::unique_ptr<android::util::ProtoOutputStream> proto);
+
+    // Frees the stream kept for key, for configs that are removed.
+    void erase(const ConfigKey& key);
+
+    size_t getPooledBytes() const;
+
+private:
+    struct PooledStream {
+        std::unique_ptr<android::util::ProtoOutputStream> proto;
+        size_t bytes;
+    };
+
+    const size_t mMaxPooledBytes;
+
+    mutable std::mutex mMutex;
+
+    std::unordered_map<ConfigKey, PooledStream> mStreams;
+
+    // Sum of the bytes of mStreams.
+    size_t mPooledBytes = 0;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
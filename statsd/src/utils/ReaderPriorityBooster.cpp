@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "ReaderPriorityBooster.h"
+
+#include <errno.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+int getThreadNice() {
+    // The nice value of a thread can be -1, so errno tells failures apart.
+    errno = 0;
+    const int nice = getpriority(PRIO_PROCESS, gettid());
+    return errno == 0 ? nice : 0;
+}
+
+}  // anonymous namespace
+
+ReaderPriorityBooster::ReaderPriorityBooster(int64_t boostThresholdNs, int64_t restoreThresholdNs,
+                                             int boostedNice, SetNiceFn setNice)
+    : mBoostThresholdNs(boostThresholdNs),
+      mRestoreThresholdNs(restoreThresholdNs),
+      mNormalNice(getThreadNice()),
+      mBoostedNice(boostedNice),
+      mSetNice(std::move(setNice)) {
+}
+
+ReaderPriorityBooster::~ReaderPriorityBooster() {
+    if (mBoosted) {
+        mSetNice(mNormalNice);
+    }
+}
+
+bool ReaderPriorityBooster::onBatch(int64_t residencyNs) {
+    if (mBoosted) {
+        if (residencyNs < mRestoreThresholdNs && mSetNice(mNormalNice)) {
+            mBoosted = false;
+        }
+        return false;
+    }
+    if (residencyNs <= mBoostThresholdNs || mBoostUnavailable || mBoostedNice >= mNormalNice) {
+        return false;
+    }
+    if (!mSetNice(mBoostedNice)) {
+        ALOGW("Failed to boost the log reader, queue residency %lld ns", (long long)residencyNs);
+        mBoostUnavailable = true;
+        return false;
+    }
+    VLOG("Boosted the log reader, queue residency %lld ns", (long long)residencyNs);
+    mBoosted = true;
+    return true;
+}
+
+bool ReaderPriorityBooster::setThreadNice(int nice) {
+    return setpriority(PRIO_PROCESS, gettid(), nice) == 0;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
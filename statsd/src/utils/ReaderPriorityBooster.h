@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Raises the scheduling priority of the thread reading the LogEventQueue while events wait in
+ * the queue for too long, so that the reader catches up before the queue overflows.
+ *
+ * The reader boosts itself once the residency of a batch, the time its oldest event waited in the
+ * queue, exceeds the boost threshold, and drops back to its normal priority once the residency is
+ * under the restore threshold again. If the thread may not raise its priority, boosting stops
+ * being attempted.
+ *
+ * Must only be used from the thread it boosts.
+ */
+class ReaderPriorityBooster {
+public:
+    // Sets the nice value of the calling thread, returns false on failure.
+    using SetNiceFn = std::function<bool(int nice)>;
+
+    // The reader is boosted from its nice value at construction time to boostedNice.
+    ReaderPriorityBooster(int64_t boostThresholdNs, int64_t restoreThresholdNs, int boostedNice,
+                          SetNiceFn setNice = setThreadNice);
+
+    ~ReaderPriorityBooster();
+
+    /**
+     * Notes the residency of the batch just read. Returns true if the reader was boosted by this
+     * call.
+     */
+    bool onBatch(int64_t residencyNs);
+
+    inline bool isBoosted() const {
+        return mBoosted;
+    }
+
+    static bool setThreadNice(int nice);
+
+private:
+    const int64_t mBoostThresholdNs;
+    const int64_t mRestoreThresholdNs;
+    const int mNormalNice;
+    const int mBoostedNice;
+    const SetNiceFn mSetNice;
+
+    bool mBoosted = false;
+    bool mBoostUnavailable = false;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define STATSD_DEBUG false  // STOPSHIP if true
+#include "Log.h"
+
+#include "utils/RestrictedEventBuffer.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+void RestrictedEventBuffer::append(const LogEvent& event) {
+    Row row;
+    row.elapsedTimestampNs = event.GetElapsedTimestampNs();
+    row.logdTimestampNs = event.GetLogdTimestampNs();
+    row.atomId = event.GetTagId();
+    row.firstValue = mValues.size();
+    for (const FieldValue& fieldValue : event.getValues()) {
+        if (fieldValue.mField.getDepth() > 0) {
+            // Repeated fields are not supported.
+            continue;
+        }
+        Value value;
+        value.type = fieldValue.mValue.getType();
+        switch (value.type) {
+            case INT:
+                value.intValue = fieldValue.mValue.int_value;
+                break;
+            case LONG:
+                value.longValue = fieldValue.mValue.long_value;
+                break;
+            case FLOAT:
+                value.floatValue = fieldValue.mValue.float_value;
+                break;
+            case STRING:
+                value.strOffset = mStrings.size();
+                mStrings.append(fieldValue.mValue.str_value.c_str());
+                mStrings.push_back('\0');
+                break;
+            case STORAGE:
+                // Byte array fields are not supported.
+                continue;
+            default:
+                // Bound as NULL, as the column is neither an integer, a real nor a text.
+                value.longValue = 0;
+                break;
+        }
+        mValues.push_back(value);
+    }
+    row.valueCount = mValues.size() - row.firstValue;
+    mRows.push_back(row);
+}
+
+void RestrictedEventBuffer::clear() {
+    mRows.clear();
+    mValues.clear();
+    mStrings.clear();
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
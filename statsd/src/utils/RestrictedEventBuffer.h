@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "FieldValue.h"
+#include "logd/LogEvent.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * The events of a restricted metric that are waiting to be inserted in the metric's table. Only
+ * what is bound to the insert statement is kept: the atom id, the timestamps and the top level
+ * values other than byte arrays. The values of all rows are stored in one array, and their
+ * strings in one NUL-separated buffer, so an event takes a few dozen bytes instead of a LogEvent
+ * with its heap-allocated values.
+ */
+class RestrictedEventBuffer {
+public:
+    struct Value {
+        union {
+            int32_t intValue;
+            int64_t longValue;
+            float floatValue;
+            // Offset of the NUL-terminated string in the string buffer.
+            uint32_t strOffset;
+        };
+        Type type;
+    };
+
+    struct Row {
+        int64_t elapsedTimestampNs;
+        int64_t logdTimestampNs;
+        int32_t atomId;
+        // Index of the first value of the row in the value array.
+        uint32_t firstValue;
+        uint32_t valueCount;
+    };
+
+    void append(const LogEvent& event);
+
+    void clear();
+
+    size_t size() const {
+        return mRows.size();
+    }
+
+    bool empty() const {
+        return mRows.empty();
+    }
+
+    const Row& getRow(size_t index) const {
+        return mRows[index];
+    }
+
+    const Value& getValue(const Row& row, size_t index) const {
+        return mValues[row.firstValue + index];
+    }
+
+    // The returned pointer is valid until the next append or clear.
+    const char* getString(const Value& value) const {
+        return mStrings.data() + value.strOffset;
+    }
+
+    // The number of bytes taken by the rows, their values and their strings.
+    size_t byteSize() const {
+        return mRows.size() * sizeof(Row) + mValues.size() * sizeof(Value) + mStrings.size();
+    }
+
+private:
+    std::vector<Row> mRows;
+
+    std::vector<Value> mValues;
+
+    std::string mStrings;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
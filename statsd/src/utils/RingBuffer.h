@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+/**
+ * Fixed-capacity FIFO queue. All slots are allocated up front in one contiguous array, so pushing
+ * and popping never allocate and reuse the slots of popped entries. Pushing to a full buffer
+ * overwrites the oldest entry.
+ *
+ * Entries are indexed from the oldest one. T must be default constructible and move assignable.
+ * Popped entries are reset to T(), so the resources they hold are released right away.
+ *
+ * This class is not thread-safe.
+ */
+template <typename T>
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity) : mSlots(capacity > 0 ? capacity : 1) {
+    }
+
+    size_t capacity() const {
+        return mSlots.size();
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    bool empty() const {
+        return mSize == 0;
+    }
+
+    bool full() const {
+        return mSize == mSlots.size();
+    }
+
+    // Appends item as the newest entry. Returns false if the oldest entry had to be overwritten.
+    bool push_back(T item) {
+        const bool overwrite = full();
+        if (overwrite) {
+            pop_front();
+        }
+        mSlots[slotIndex(mSize)] = std::move(item);
+        mSize++;
+        return !overwrite;
+    }
+
+    T& front() {
+        return mSlots[mHead];
+    }
+
+    const T& front() const {
+        return mSlots[mHead];
+    }
+
+    void pop_front() {
+        mSlots[mHead] = T();
+        mHead = slotIndex(1);
+        mSize--;
+    }
+
+    // Pops the count oldest entries.
+    void pop_front(size_t count) {
+        for (size_t i = 0; i < count && mSize > 0; i++) {
+            pop_front();
+        }
+    }
+
+    // i-th oldest entry.
+    T& operator[](size_t i) {
+        return mSlots[slotIndex(i)];
+    }
+
+    const T& operator[](size_t i) const {
+        return mSlots[slotIndex(i)];
+    }
+
+    // Removes the entries pred returns true for, keeping the others in order. Returns the number
+    // of entries removed.
+    template <typename Pred>
+    size_t eraseIf(Pred pred) {
+        size_t kept = 0;
+        for (size_t i = 0; i < mSize; i++) {
+            T& item = (*this)[i];
+            if (pred(static_cast<const T&>(item))) {
+                continue;
+            }
+            if (kept != i) {
+                (*this)[kept] = std::move(item);
+            }
+            kept++;
+        }
+        const size_t erased = mSize - kept;
+        for (size_t i = kept; i < mSize; i++) {
+            (*this)[i] = T();
+        }
+        mSize = kept;
+        return erased;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < mSize; i++) {
+            (*this)[i] = T();
+        }
+        mHead = 0;
+        mSize = 0;
+    }
+
+private:
+    size_t slotIndex(size_t i) const {
+        const size_t index = mHead + i;
+        return index < mSlots.size() ? index : index - mSlots.size();
+    }
+
+    std::vector<T> mSlots;
+
+    // Slot of the oldest entry.
+    size_t mHead = 0;
+
+    size_t mSize = 0;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
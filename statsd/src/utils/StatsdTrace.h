@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/**
+ * Trace sections around the hot paths of statsd, for Perfetto and systrace.
+ *
+ * The sections are compiled out unless statsd is built with -DSTATSD_TRACING, e.g. by adding it to
+ * the cflags of statsd_defaults in Android.bp, and their arguments are then not evaluated. When
+ * compiled in, they are recorded with the "ss" atrace category, and a section costs one check of
+ * the enabled tags while that category is not traced.
+ *
+ * STATSD_TRACE(format, ...) traces the rest of the enclosing scope. The name is a printf format so
+ * that sections can carry the atom id and the config, e.g.
+ *     STATSD_TRACE("StatsPuller::Pull atom=%d", mTagId);
+ * STATSD_TRACE_COUNTER(name, value) sets the value of a counter track.
+ */
+
+#ifdef STATSD_TRACING
+
+#include <cutils/trace.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+constexpr uint64_t kStatsdTraceTag = ATRACE_TAG_SYSTEM_SERVER;
+
+class ScopedTrace {
+public:
+    __attribute__((format(printf, 2, 3))) ScopedTrace(const char* format, ...)
+        : mEnabled(atrace_is_tag_enabled(kStatsdTraceTag)) {
+        if (mEnabled) {
+            char name[128];
+            va_list args;
+            va_start(args, format);
+            vsnprintf(name, sizeof(name), format, args);
+            va_end(args);
+            atrace_begin(kStatsdTraceTag, name);
+        }
+    }
+
+    ~ScopedTrace() {
+        if (mEnabled) {
+            atrace_end(kStatsdTraceTag);
+        }
+    }
+
+    ScopedTrace(const ScopedTrace&) = delete;
+    ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+private:
+    const bool mEnabled;
+};
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+
+#define STATSD_TRACE_CONCAT_(a, b) a##b
+#define STATSD_TRACE_CONCAT(a, b) STATSD_TRACE_CONCAT_(a, b)
+#define STATSD_TRACE(...) \
+    ::android::os::statsd::ScopedTrace STATSD_TRACE_CONCAT(statsdTrace, __LINE__)(__VA_ARGS__)
+#define STATSD_TRACE_COUNTER(name, value) \
+    atrace_int64(::android::os::statsd::kStatsdTraceTag, name, value)
+
+#else
+
+#define STATSD_TRACE(...) ((void)0)
+#define STATSD_TRACE_COUNTER(name, value) ((void)0)
+
+#endif
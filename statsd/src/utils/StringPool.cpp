@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StringPool.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::lock_guard;
+using std::mutex;
+using std::string_view;
+
+StringPool& StringPool::getInstance() {
+    // Never destroyed so that InternedStrings held by other statics stay valid during exit.
+    static StringPool* sInstance = new StringPool();
+    return *sInstance;
+}
+
+size_t StringPool::size() const {
+    size_t total = 0;
+    for (const Shard& shard : mShards) {
+        lock_guard<mutex> lock(shard.mutex);
+        total += shard.entries.size();
+    }
+    return total;
+}
+
+StringPool::Entry* StringPool::acquire(string_view str) {
+    const size_t hash = std::hash<string_view>()(str);
+    Shard& shard = mShards[hash % kNumShards];
+
+    lock_guard<mutex> lock(shard.mutex);
+    auto it = shard.entries.find(str);
+    if (it != shard.entries.end()) {
+        it->second->refCount.fetch_add(1, std::memory_order_relaxed);
+        return it->second;
+    }
+    Entry* entry = new Entry(str, hash);
+    shard.entries.emplace(entry->str, entry);
+    return entry;
+}
+
+void StringPool::release(Entry* entry) {
+    // Fast path: drop a reference without locking as long as it is not the last one. The count
+    // only goes from 1 to 0 under the shard lock, so acquire() never revives a dying entry.
+    int32_t count = entry->refCount.load(std::memory_order_relaxed);
+    while (count > 1) {
+        if (entry->refCount.compare_exchange_weak(count, count - 1, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+            return;
+        }
+    }
+
+    Shard& shard = mShards[entry->hash % kNumShards];
+    lock_guard<mutex> lock(shard.mutex);
+    if (entry->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        shard.entries.erase(string_view(entry->str));
+        delete entry;
+    }
+}
+
+const std::string& InternedString::emptyString() {
+    static const std::string* sEmpty = new std::string();
+    return *sEmpty;
+}
+
+InternedString::InternedString(string_view str)
+    : mEntry(str.empty() ? nullptr : StringPool::getInstance().acquire(str)) {
+}
+
+InternedString& InternedString::operator=(const InternedString& other) {
+    if (mEntry != other.mEntry) {
+        if (other.mEntry != nullptr) {
+            other.mEntry->refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        reset();
+        mEntry = other.mEntry;
+    }
+    return *this;
+}
+
+InternedString& InternedString::operator=(InternedString&& other) noexcept {
+    if (this != &other) {
+        reset();
+        mEntry = other.mEntry;
+        other.mEntry = nullptr;
+    }
+    return *this;
+}
+
+InternedString& InternedString::operator=(string_view str) {
+    *this = InternedString(str);
+    return *this;
+}
+
+void InternedString::reset() {
+    if (mEntry != nullptr) {
+        StringPool::getInstance().release(mEntry);
+        mEntry = nullptr;
+    }
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace android {
+namespace os {
+namespace statsd {
+
+class InternedString;
+
+/**
+ * Process-wide table of refcounted, deduplicated strings.
+ *
+ * Package names, tags and wakelock names repeat across events, dimension keys and buckets. Each
+ * distinct string is stored once and shared by all InternedString handles that refer to it, and
+ * the entry is freed when the last handle goes away. Since equal strings always resolve to the
+ * same entry, handles can be compared and hashed without touching the string bytes.
+ *
+ * This class is thread-safe. The table is split into shards to keep lock contention between the
+ * socket reader, pullers and binder threads low.
+ */
+class StringPool final {
+public:
+    static StringPool& getInstance();
+
+    // Number of distinct strings currently alive in the pool.
+    size_t size() const;
+
+private:
+    struct Entry {
+        Entry(std::string_view s, size_t h) : str(s), hash(h), refCount(1) {
+        }
+
+        const std::string str;
+        const size_t hash;
+        std::atomic<int32_t> refCount;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // Keys are views into the owning Entry's str.
+        std::unordered_map<std::string_view, Entry*> entries;
+    };
+
+    static constexpr size_t kNumShards = 16;
+
+    StringPool() = default;
+
+    // Returns the entry for str with its refcount incremented, creating it if needed.
+    Entry* acquire(std::string_view str);
+
+    // Drops one reference to entry and frees it if that was the last one.
+    void release(Entry* entry);
+
+    Shard mShards[kNumShards];
+
+    friend class InternedString;
+};
+
+/**
+ * Handle to a string owned by StringPool. Copying a handle only bumps a refcount. The empty
+ * string is represented without a pool entry.
+ */
+class InternedString final {
+public:
+    InternedString() : mEntry(nullptr) {
+    }
+
+    explicit InternedString(std::string_view str);
+
+    InternedString(const InternedString& other) : mEntry(other.mEntry) {
+        if (mEntry != nullptr) {
+            mEntry->refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    InternedString(InternedString&& other) noexcept : mEntry(other.mEntry) {
+        other.mEntry = nullptr;
+    }
+
+    ~InternedString() {
+        reset();
+    }
+
+    InternedString& operator=(const InternedString& other);
+    InternedString& operator=(InternedString&& other) noexcept;
+    InternedString& operator=(std::string_view str);
+
+    const std::string& str() const {
+        return mEntry != nullptr ? mEntry->str : emptyString();
+    }
+
+    operator const std::string&() const {
+        return str();
+    }
+
+    const char* c_str() const {
+        return str().c_str();
+    }
+
+    size_t size() const {
+        return str().size();
+    }
+
+    size_t length() const {
+        return size();
+    }
+
+    bool empty() const {
+        return mEntry == nullptr;
+    }
+
+    // Hash of the string contents, computed once when the string was interned.
+    size_t hash() const {
+        return mEntry != nullptr ? mEntry->hash : std::hash<std::string_view>()({});
+    }
+
+    // Interned strings are equal iff they share the same entry.
+    bool operator==(const InternedString& that) const {
+        return mEntry == that.mEntry;
+    }
+
+    bool operator!=(const InternedString& that) const {
+        return mEntry != that.mEntry;
+    }
+
+    bool operator<(const InternedString& that) const {
+        return mEntry != that.mEntry && str() < that.str();
+    }
+
+    bool operator>(const InternedString& that) const {
+        return that < *this;
+    }
+
+    bool operator>=(const InternedString& that) const {
+        return !(*this < that);
+    }
+
+    bool operator==(const std::string& that) const {
+        return str() == that;
+    }
+
+    bool operator!=(const std::string& that) const {
+        return str() != that;
+    }
+
+    bool operator==(const char* that) const {
+        return str() == that;
+    }
+
+    bool operator!=(const char* that) const {
+        return str() != that;
+    }
+
+private:
+    void reset();
+
+    static const std::string& emptyString();
+
+    StringPool::Entry* mEntry;
+};
+
+inline bool operator==(const std::string& lhs, const InternedString& rhs) {
+    return rhs == lhs;
+}
+
+inline bool operator!=(const std::string& lhs, const InternedString& rhs) {
+    return rhs != lhs;
+}
+
+inline bool operator==(const char* lhs, const InternedString& rhs) {
+    return rhs == lhs;
+}
+
+inline bool operator!=(const char* lhs, const InternedString& rhs) {
+    return rhs != lhs;
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+
+namespace std {
+template <>
+struct hash<android::os::statsd::InternedString> {
+    std::size_t operator()(const android::os::statsd::InternedString& str) const {
+        return str.hash();
+    }
+};
+}  // namespace std
@@ -18,6 +18,7 @@
 
 using namespace android::os::statsd;
 using std::shared_ptr;
+using std::vector;
 
 #ifdef __ANDROID__
 TEST(AlarmMonitor, popSoonerThan) {
@@ -64,6 +65,39 @@ TEST(AlarmMonitor, popSoonerThan) {
     ASSERT_EQ(0u, set.size());
 }
 
+TEST(AlarmMonitor, replace) {
+    vector<int64_t> updatedAlarmsMs;
+    int cancelCount = 0;
+    AlarmMonitor am(
+            2,
+            [&updatedAlarmsMs](const shared_ptr<IStatsCompanionService>&, int64_t timeMs) {
+                updatedAlarmsMs.push_back(timeMs);
+            },
+            [&cancelCount](const shared_ptr<IStatsCompanionService>&) { cancelCount++; });
+
+    sp<const InternalAlarm> a = new InternalAlarm{10};
+    sp<const InternalAlarm> b = new InternalAlarm{11};
+    sp<const InternalAlarm> c = new InternalAlarm{30};
+
+    am.add(a);
+    EXPECT_EQ(10u, am.getRegisteredAlarmTimeSec());
+
+    // Within the minimum update difference: the registered alarm is kept.
+    am.replace(a, b);
+    EXPECT_EQ(10u, am.getRegisteredAlarmTimeSec());
+    EXPECT_EQ(0, cancelCount);
+
+    // The only alarm moves later: the registered alarm is updated, never cancelled.
+    am.replace(b, c);
+    EXPECT_EQ(30u, am.getRegisteredAlarmTimeSec());
+    EXPECT_EQ(0, cancelCount);
+    EXPECT_EQ(vector<int64_t>({10000, 30000}), updatedAlarmsMs);
+
+    unordered_set<sp<const InternalAlarm>, SpHash<InternalAlarm>> set = am.popSoonerThan(40);
+    ASSERT_EQ(1u, set.size());
+    EXPECT_EQ(1u, set.count(c));
+}
+
 #else
 GTEST_LOG_(INFO) << "This test does nothing.\n";
 #endif
@@ -0,0 +1,160 @@
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "anomaly/AlarmTimerWheel.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "anomaly/AlarmMonitor.h"
+
+using namespace android::os::statsd;
+using std::set;
+using std::vector;
+
+#ifdef __ANDROID__
+
+namespace {
+
+set<const InternalAlarm*> toSet(const vector<sp<const InternalAlarm>>& alarms) {
+    set<const InternalAlarm*> result;
+    for (const auto& alarm : alarms) {
+        result.insert(alarm.get());
+    }
+    return result;
+}
+
+}  // anonymous namespace
+
+TEST(AlarmTimerWheelTest, TestPushRemoveTop) {
+    AlarmTimerWheel wheel;
+    EXPECT_TRUE(wheel.empty());
+    EXPECT_EQ(nullptr, wheel.top());
+
+    sp<const InternalAlarm> a = new InternalAlarm{1000};
+    sp<const InternalAlarm> b = new InternalAlarm{20};
+    sp<const InternalAlarm> c = new InternalAlarm{20};
+    sp<const InternalAlarm> d = new InternalAlarm{3000000000u};
+    wheel.push(a);
+    wheel.push(b);
+    wheel.push(c);
+    wheel.push(d);
+    wheel.push(a);
+    wheel.push(nullptr);
+    EXPECT_EQ(4u, wheel.size());
+    EXPECT_EQ(20u, wheel.top()->timestampSec);
+
+    EXPECT_TRUE(wheel.remove(b));
+    EXPECT_FALSE(wheel.remove(b));
+    EXPECT_FALSE(wheel.remove(nullptr));
+    EXPECT_EQ(c, wheel.top());
+    EXPECT_TRUE(wheel.remove(c));
+    EXPECT_EQ(a, wheel.top());
+    EXPECT_TRUE(wheel.remove(a));
+    EXPECT_EQ(d, wheel.top());
+    EXPECT_TRUE(wheel.remove(d));
+    EXPECT_TRUE(wheel.empty());
+    EXPECT_EQ(nullptr, wheel.top());
+}
+
+TEST(AlarmTimerWheelTest, TestPopSoonerThan) {
+    AlarmTimerWheel wheel;
+    sp<const InternalAlarm> a = new InternalAlarm{10};
+    sp<const InternalAlarm> b = new InternalAlarm{70};
+    sp<const InternalAlarm> c = new InternalAlarm{4100};
+    sp<const InternalAlarm> d = new InternalAlarm{4200};
+    for (const auto& alarm : {a, b, c, d}) {
+        wheel.push(alarm);
+    }
+
+    vector<sp<const InternalAlarm>> popped;
+    wheel.popSoonerThan(5, &popped);
+    EXPECT_TRUE(popped.empty());
+
+    wheel.popSoonerThan(70, &popped);
+    EXPECT_EQ(set<const InternalAlarm*>({a.get(), b.get()}), toSet(popped));
+    EXPECT_EQ(c, wheel.top());
+
+    // Alarms sooner than the popped time are still ordered and popped.
+    sp<const InternalAlarm> e = new InternalAlarm{30};
+    wheel.push(e);
+    EXPECT_EQ(e, wheel.top());
+
+    popped.clear();
+    wheel.popSoonerThan(4150, &popped);
+    EXPECT_EQ(set<const InternalAlarm*>({e.get(), c.get()}), toSet(popped));
+    EXPECT_EQ(d, wheel.top());
+
+    popped.clear();
+    wheel.popSoonerThan(UINT32_MAX, &popped);
+    EXPECT_EQ(set<const InternalAlarm*>({d.get()}), toSet(popped));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(AlarmTimerWheelTest, TestMatchesMultiset) {
+    AlarmTimerWheel wheel;
+    // Reference model, ordered by timestamp.
+    std::multiset<std::pair<uint32_t, const InternalAlarm*>> expected;
+    vector<sp<const InternalAlarm>> alarms;
+    std::mt19937 random(42);
+
+    uint32_t nowSec = 1000000;
+    for (int i = 0; i < 20000; i++) {
+        const int op = random() % 10;
+        if (op < 5) {
+            // Mostly near future, sometimes far future or already due.
+            uint32_t timestampSec = nowSec + random() % 7200;
+            if (op == 0) {
+                timestampSec = nowSec + random() % 100000000;
+            } else if (op == 1) {
+                timestampSec = nowSec - random() % 100;
+            }
+            sp<const InternalAlarm> alarm = new InternalAlarm{timestampSec};
+            alarms.push_back(alarm);
+            wheel.push(alarm);
+            expected.insert({timestampSec, alarm.get()});
+        } else if (op < 8 && !alarms.empty()) {
+            const size_t index = random() % alarms.size();
+            const sp<const InternalAlarm> alarm = alarms[index];
+            alarms[index] = alarms.back();
+            alarms.pop_back();
+            EXPECT_EQ(expected.erase({alarm->timestampSec, alarm.get()}) > 0,
+                      wheel.remove(alarm));
+        } else {
+            nowSec += random() % 600;
+            vector<sp<const InternalAlarm>> popped;
+            wheel.popSoonerThan(nowSec, &popped);
+            set<const InternalAlarm*> expectedPopped;
+            while (!expected.empty() && expected.begin()->first <= nowSec) {
+                expectedPopped.insert(expected.begin()->second);
+                expected.erase(expected.begin());
+            }
+            ASSERT_EQ(expectedPopped, toSet(popped));
+        }
+        ASSERT_EQ(expected.size(), wheel.size());
+        if (expected.empty()) {
+            ASSERT_EQ(nullptr, wheel.top());
+        } else {
+            ASSERT_EQ(expected.begin()->first, wheel.top()->timestampSec);
+        }
+    }
+}
+
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "socket/DatagramRecorder.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+// Writes trace to a file and reads it back.
+bool readBack(const vector<uint8_t>& trace, vector<DatagramRecord>* records) {
+    TemporaryFile file;
+    EXPECT_TRUE(android::base::WriteFully(file.fd, trace.data(), trace.size()));
+    EXPECT_EQ(0, lseek(file.fd, 0, SEEK_SET));
+    return DatagramRecorder::readTrace(file.fd, records);
+}
+
+}  // anonymous namespace
+
+TEST(DatagramRecorderTest, TestRecordAndRead) {
+    DatagramRecorder& recorder = DatagramRecorder::getInstance();
+    const vector<uint8_t> first = {1, 2, 3};
+    const vector<uint8_t> second = {4, 5};
+
+    // Nothing is recorded before the recording starts.
+    recorder.noteDatagram(first.data(), first.size(), 1000, 1);
+    ASSERT_TRUE(recorder.start());
+    EXPECT_TRUE(recorder.isRecording());
+    EXPECT_FALSE(recorder.start());
+    recorder.noteDatagram(first.data(), first.size(), 1000, 1);
+    recorder.noteDatagram(second.data(), second.size(), 1001, 2);
+    const vector<uint8_t> trace = recorder.stop();
+    EXPECT_FALSE(recorder.isRecording());
+
+    vector<DatagramRecord> records;
+    ASSERT_TRUE(readBack(trace, &records));
+    ASSERT_EQ(2, records.size());
+    EXPECT_EQ(first, records[0].datagram);
+    EXPECT_EQ(1000, records[0].uid);
+    EXPECT_EQ(1, records[0].pid);
+    EXPECT_EQ(second, records[1].datagram);
+    EXPECT_EQ(1001, records[1].uid);
+    EXPECT_EQ(2, records[1].pid);
+    EXPECT_LE(records[0].elapsedTimestampNs, records[1].elapsedTimestampNs);
+
+    // A truncated trace keeps the complete records.
+    records.clear();
+    const vector<uint8_t> truncated(trace.begin(), trace.end() - 1);
+    EXPECT_FALSE(readBack(truncated, &records));
+    EXPECT_EQ(1, records.size());
+
+    records.clear();
+    EXPECT_FALSE(readBack({0, 0, 0, 0}, &records));
+}
+
+TEST(DatagramRecorderTest, TestMaxTraceBytes) {
+    DatagramRecorder& recorder = DatagramRecorder::getInstance();
+    const vector<uint8_t> large(DatagramRecorder::kMaxTraceBytes);
+    const vector<uint8_t> small = {1};
+
+    ASSERT_TRUE(recorder.start());
+    recorder.noteDatagram(large.data(), large.size(), 1000, 1);
+    recorder.noteDatagram(small.data(), small.size(), 1000, 1);
+    const vector<uint8_t> trace = recorder.stop();
+
+    vector<DatagramRecord> records;
+    ASSERT_TRUE(readBack(trace, &records));
+    ASSERT_EQ(1, records.size());
+    EXPECT_EQ(small, records[0].datagram);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
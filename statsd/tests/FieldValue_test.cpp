@@ -192,6 +192,42 @@ TEST(AtomMatcherTest, TestFilter_FIRST) {
     EXPECT_EQ("some value", output.getValues()[2].mValue.str_value);
 };
 
+TEST(AtomMatcherTest, TestFilterFromLogEvent_HashCombinedFromValueHashes) {
+    FieldMatcher matcher1;
+    matcher1.set_field(10);
+    FieldMatcher* child = matcher1.add_child();
+    child->set_field(1);
+    child->set_position(Position::FIRST);
+    child->add_child()->set_field(1);
+    child->add_child()->set_field(2);
+    matcher1.add_child()->set_field(2);
+
+    vector<Matcher> matchers;
+    translateFieldMatcher(matcher1, &matchers);
+
+    std::vector<int> attributionUids = {1111, 2222, 3333};
+    std::vector<string> attributionTags = {"location1", "location2", "location3"};
+
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event, 10 /*atomId*/, 1012345, attributionUids, attributionTags, "some value");
+    ASSERT_EQ(event.getValues().size(), event.getValueHashes().size());
+
+    HashableDimensionKey fromValues;
+    EXPECT_TRUE(filterValues(matchers, event.getValues(), &fromValues));
+    HashableDimensionKey fromEvent;
+    EXPECT_TRUE(filterValues(matchers, event, &fromEvent));
+
+    // The hash combined from the value hashes of the event is the one the key computes itself.
+    EXPECT_EQ(fromValues, fromEvent);
+    EXPECT_EQ(std::hash<HashableDimensionKey>{}(fromValues),
+              std::hash<HashableDimensionKey>{}(fromEvent));
+
+    const HashableDimensionKey atomValues = getAtomFieldValues(event);
+    EXPECT_EQ(HashableDimensionKey(event.getValues()), atomValues);
+    EXPECT_EQ(std::hash<HashableDimensionKey>{}(HashableDimensionKey(event.getValues())),
+              std::hash<HashableDimensionKey>{}(atomValues));
+}
+
 TEST(AtomMatcherTest, TestFilterRepeated_FIRST) {
     FieldMatcher matcher;
     matcher.set_field(123);
@@ -731,6 +767,47 @@ TEST(AtomMatcherTest, TestWriteDimensionLeafNodesToProto) {
     EXPECT_EQ(99999, dim4.value_long());
 }
 
+TEST(AtomMatcherTest, TestDimensionDictionary) {
+    int pos1[] = {1, 0, 0};
+    int pos2[] = {2, 0, 0};
+    Field field1(10, pos1, 0);
+    Field field2(10, pos2, 0);
+    HashableDimensionKey dimA;
+    dimA.addValue(FieldValue(field1, Value((int32_t)10025)));
+    dimA.addValue(FieldValue(field2, Value("tag")));
+    HashableDimensionKey dimB;
+    dimB.addValue(FieldValue(field1, Value((int32_t)987654)));
+    dimB.addValue(FieldValue(field2, Value("tag")));
+
+    DimensionDictionary leafDictionary(false /* useNestedDimensions */);
+    EXPECT_EQ(0, leafDictionary.indexOf(dimA));
+    EXPECT_EQ(1, leafDictionary.indexOf(dimB));
+    EXPECT_EQ(0, leafDictionary.indexOf(HashableDimensionKey(dimA.getValues())));
+    EXPECT_EQ(2u, leafDictionary.size());
+
+    android::util::ProtoOutputStream leafOutput;
+    leafDictionary.writeToProto(nullptr /* include strings */, &leafOutput);
+    StatsLogReport leafReport = outputStreamToProto(&leafOutput);
+    ASSERT_EQ(2, leafReport.dimension_dictionary_size());
+    const DimensionsValueTuple& leafEntry = leafReport.dimension_dictionary(1);
+    ASSERT_EQ(2, leafEntry.dimensions_value_size());
+    EXPECT_EQ(987654, leafEntry.dimensions_value(0).value_int());
+    EXPECT_EQ("tag", leafEntry.dimensions_value(1).value_str());
+
+    DimensionDictionary nestedDictionary(true /* useNestedDimensions */);
+    EXPECT_EQ(0, nestedDictionary.indexOf(dimB));
+    android::util::ProtoOutputStream nestedOutput;
+    nestedDictionary.writeToProto(nullptr /* include strings */, &nestedOutput);
+    StatsLogReport nestedReport = outputStreamToProto(&nestedOutput);
+    ASSERT_EQ(1, nestedReport.dimension_dictionary_size());
+    ASSERT_EQ(1, nestedReport.dimension_dictionary(0).dimensions_value_size());
+    const DimensionsValue& nestedEntry = nestedReport.dimension_dictionary(0).dimensions_value(0);
+    EXPECT_EQ(10, nestedEntry.field());
+    ASSERT_EQ(2, nestedEntry.value_tuple().dimensions_value_size());
+    EXPECT_EQ(987654, nestedEntry.value_tuple().dimensions_value(0).value_int());
+    EXPECT_EQ("tag", nestedEntry.value_tuple().dimensions_value(1).value_str());
+}
+
 TEST(AtomMatcherTest, TestWriteAtomToProto) {
     std::vector<int> attributionUids = {1111, 2222};
     std::vector<string> attributionTags = {"location1", "location2"};
@@ -764,6 +841,27 @@ TEST(AtomMatcherTest, TestWriteAtomToProto) {
     EXPECT_EQ(999, atom.num_results());
 }
 
+TEST(AtomMatcherTest, TestWriteAtomWithTopLevelFieldsToProto) {
+    unique_ptr<LogEvent> event = CreateOverlayStateChangedEvent(
+            12345, /*uid=*/1001, "com.example.app", /*usingAlertWindow=*/true,
+            OverlayStateChanged::ENTERED);
+
+    android::util::ProtoOutputStream protoOutput;
+    writeFieldValueTreeToStream(event->GetTagId(), event->getValues(), &protoOutput);
+
+    vector<uint8_t> outData;
+    protoOutput.serializeToVector(&outData);
+
+    Atom result;
+    ASSERT_EQ(true, result.ParseFromArray(outData.data(), outData.size()));
+    EXPECT_EQ(Atom::PushedCase::kOverlayStateChanged, result.pushed_case());
+    const auto& atom = result.overlay_state_changed();
+    EXPECT_EQ(1001, atom.uid());
+    EXPECT_EQ("com.example.app", atom.package_name());
+    EXPECT_TRUE(atom.using_alert_window());
+    EXPECT_EQ(OverlayStateChanged::ENTERED, atom.state());
+}
+
 TEST(AtomMatcherTest, TestWriteAtomWithRepeatedFieldsToProto) {
     vector<int> intArray = {3, 6};
     vector<int64_t> longArray = {1000L, 10002L};
@@ -1200,6 +1298,59 @@ TEST(FieldValueTest, TestShouldKeepSampleByteArray) {
     EXPECT_TRUE(shouldKeepSample(fieldValue2, shardOffset, shardCount));
 }
 
+TEST(FieldValueTest, TestValueCopyAndMoveAcrossTypes) {
+    const string str = "a string long enough to not fit in the small string buffer";
+    const vector<uint8_t> bytes = {'\t', 'e', '\0', 's', 't'};
+
+    Value value(str);
+    Value copy(value);
+    EXPECT_EQ(STRING, copy.getType());
+    EXPECT_EQ(str, copy.str_value);
+
+    // String to numeric and back.
+    copy = Value((int64_t)7);
+    EXPECT_EQ(LONG, copy.getType());
+    EXPECT_EQ(7, copy.long_value);
+    copy = value;
+    EXPECT_EQ(STRING, copy.getType());
+    EXPECT_EQ(str, copy.str_value);
+
+    // String to storage.
+    copy = Value(bytes);
+    EXPECT_EQ(STORAGE, copy.getType());
+    EXPECT_EQ(bytes, copy.storage_value);
+
+    // Numeric setters on a storage value.
+    copy.setDouble(2.5);
+    EXPECT_EQ(DOUBLE, copy.getType());
+    EXPECT_EQ(2.5, copy.double_value);
+
+    Value moved(std::move(value));
+    EXPECT_EQ(STRING, moved.getType());
+    EXPECT_EQ(str, moved.str_value);
+
+    Value target(3);
+    target = std::move(moved);
+    EXPECT_EQ(STRING, target.getType());
+    EXPECT_EQ(str, target.str_value);
+
+    // Numeric values do not carry the string or storage containers.
+    EXPECT_LT(sizeof(Value), sizeof(int64_t) + sizeof(string) + sizeof(vector<uint8_t>));
+}
+
+TEST(FieldValueTest, TestStringValuesAreInterned) {
+    Value a(string("wakelock"));
+    Value b(string("wakelock"));
+    Value c(string("other"));
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+    // Both values point at the same pooled string.
+    EXPECT_EQ(a.str_value.c_str(), b.str_value.c_str());
+
+    Value copy(a);
+    EXPECT_EQ(a.str_value.c_str(), copy.str_value.c_str());
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
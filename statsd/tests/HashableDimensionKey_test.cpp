@@ -17,6 +17,9 @@
 
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <vector>
+
 #include "src/statsd_config.pb.h"
 #include "statsd_test_util.h"
 
@@ -129,6 +132,113 @@ TEST(HashableDimensionKeyTest, TestContainsLinkedStateValues_AllConditionsMet) {
     EXPECT_TRUE(containsLinkedStateValues(whatKey, primaryKey, mMetric2StateLinks, stateAtomId));
 }
 
+/**
+ * Test that #getLinkedConditionKey takes the linked values of a condition key, giving the key that
+ * #getDimensionForCondition returns for an event with the same linked values.
+ */
+TEST(HashableDimensionKeyTest, TestGetLinkedConditionKey) {
+    const int whatAtomId = 10;
+    const int conditionAtomId = 20;
+
+    FieldMatcher whatMatcher;
+    whatMatcher.set_field(whatAtomId);
+    whatMatcher.add_child()->set_field(1);
+
+    FieldMatcher conditionMatcher;
+    conditionMatcher.set_field(conditionAtomId);
+    conditionMatcher.add_child()->set_field(2);
+
+    Metric2Condition link;
+    translateFieldMatcher(whatMatcher, &link.metricFields);
+    translateFieldMatcher(conditionMatcher, &link.conditionFields);
+
+    int pos1[] = {1, 0, 0};
+    int pos2[] = {2, 0, 0};
+    HashableDimensionKey conditionKey;
+    conditionKey.addValue(FieldValue(Field(conditionAtomId, pos1, 0), Value("name")));
+    conditionKey.addValue(FieldValue(Field(conditionAtomId, pos2, 0), Value((int32_t)1000)));
+
+    HashableDimensionKey linkedConditionKey;
+    EXPECT_TRUE(getLinkedConditionKey(conditionKey, link, &linkedConditionKey));
+    ASSERT_EQ(1u, linkedConditionKey.getValues().size());
+    EXPECT_TRUE(conditionKey.contains(linkedConditionKey));
+
+    std::vector<FieldValue> eventValues;
+    eventValues.push_back(FieldValue(Field(whatAtomId, pos1, 0), Value((int32_t)1000)));
+    HashableDimensionKey eventConditionKey;
+    getDimensionForCondition(eventValues, link, &eventConditionKey);
+    EXPECT_EQ(eventConditionKey, linkedConditionKey);
+
+    HashableDimensionKey otherConditionKey;
+    otherConditionKey.addValue(FieldValue(Field(conditionAtomId, pos1, 0), Value("name")));
+    HashableDimensionKey otherLinkedConditionKey;
+    EXPECT_FALSE(getLinkedConditionKey(otherConditionKey, link, &otherLinkedConditionKey));
+}
+
+/**
+ * Test that a link compiled to a position list gives the same keys as its matchers.
+ */
+TEST(HashableDimensionKeyTest, TestLinkProjectionPositionList) {
+    const int whatAtomId = 10;
+    const int conditionAtomId = 20;
+
+    FieldMatcher whatMatcher;
+    whatMatcher.set_field(whatAtomId);
+    whatMatcher.add_child()->set_field(4);
+    whatMatcher.add_child()->set_field(2);
+
+    FieldMatcher conditionMatcher;
+    conditionMatcher.set_field(conditionAtomId);
+    conditionMatcher.add_child()->set_field(1);
+    conditionMatcher.add_child()->set_field(3);
+
+    Metric2Condition matcherLink;
+    translateFieldMatcher(whatMatcher, &matcherLink.metricFields);
+    translateFieldMatcher(conditionMatcher, &matcherLink.conditionFields);
+    Metric2Condition compiledLink = matcherLink;
+    compiledLink.projection =
+            compileLinkProjection(compiledLink.metricFields, compiledLink.conditionFields);
+    ASSERT_TRUE(compiledLink.projection.isPositionList);
+    EXPECT_EQ(vector<int32_t>({2, 4}), compiledLink.projection.positions);
+
+    const auto topLevel = [whatAtomId](int pos, const Value& value) {
+        int positions[] = {pos, 0, 0};
+        return FieldValue(Field(whatAtomId, positions, 0), value);
+    };
+    const auto attribution = [whatAtomId](int node, int field, const Value& value) {
+        int positions[] = {1, node, field};
+        return FieldValue(Field(whatAtomId, positions, 2), value);
+    };
+
+    // An atom without repeated fields, one with an attribution chain, and one lacking field 4.
+    const vector<vector<FieldValue>> events = {
+            {topLevel(1, Value(1)), topLevel(2, Value(2)), topLevel(3, Value(3)),
+             topLevel(4, Value("four"))},
+            {attribution(1, 1, Value(1000)), attribution(1, 2, Value("tag")),
+             attribution(2, 1, Value(1001)), attribution(2, 2, Value("tag")),
+             topLevel(2, Value(2)), topLevel(3, Value(3)), topLevel(4, Value("four"))},
+            {topLevel(1, Value(1)), topLevel(2, Value(2))},
+    };
+    for (const vector<FieldValue>& eventValues : events) {
+        HashableDimensionKey matcherKey;
+        getDimensionForCondition(eventValues, matcherLink, &matcherKey);
+        HashableDimensionKey compiledKey;
+        getDimensionForCondition(eventValues, compiledLink, &compiledKey);
+        EXPECT_EQ(matcherKey, compiledKey);
+    }
+
+    // Matchers with a position are left to the matchers.
+    FieldMatcher firstUidMatcher;
+    firstUidMatcher.set_field(whatAtomId);
+    FieldMatcher* child = firstUidMatcher.add_child();
+    child->set_field(1);
+    child->set_position(FIRST);
+    child->add_child()->set_field(1);
+    vector<Matcher> firstUidFields;
+    translateFieldMatcher(firstUidMatcher, &firstUidFields);
+    EXPECT_FALSE(compileLinkProjection(firstUidFields, firstUidFields).isPositionList);
+}
+
 /**
  * Test that FieldValues with STORAGE values are hashed differently.
  */
@@ -164,6 +274,81 @@ TEST(HashableDimensionKeyTest, TestHashDimensionDouble) {
               std::hash<HashableDimensionKey>{}(dimKey2));
 }
 
+/**
+ * Test that the cached hash is dropped when the key's values are modified.
+ */
+TEST(HashableDimensionKeyTest, TestCachedHashInvalidatedOnModification) {
+    int pos[] = {1, 1, 1};
+    Field field(1, pos, 1);
+    HashableDimensionKey dimKey1;
+    dimKey1.addValue(FieldValue(field, Value((int32_t)10)));
+    HashableDimensionKey dimKey2;
+    dimKey2.addValue(FieldValue(field, Value((int32_t)20)));
+
+    const size_t hash1 = std::hash<HashableDimensionKey>{}(dimKey1);
+    EXPECT_NE(hash1, std::hash<HashableDimensionKey>{}(dimKey2));
+
+    // Copies carry the cached hash.
+    HashableDimensionKey copy(dimKey1);
+    EXPECT_EQ(hash1, std::hash<HashableDimensionKey>{}(copy));
+
+    dimKey1.mutableValue(0)->mValue = Value((int32_t)20);
+    EXPECT_EQ(dimKey1, dimKey2);
+    EXPECT_EQ(std::hash<HashableDimensionKey>{}(dimKey2),
+              std::hash<HashableDimensionKey>{}(dimKey1));
+
+    dimKey2.addValue(FieldValue(field, Value((int32_t)30)));
+    EXPECT_NE(std::hash<HashableDimensionKey>{}(dimKey1),
+              std::hash<HashableDimensionKey>{}(dimKey2));
+
+    MetricDimensionKey metricKey1(dimKey1, DEFAULT_DIMENSION_KEY);
+    MetricDimensionKey metricKey2(dimKey1, DEFAULT_DIMENSION_KEY);
+    EXPECT_EQ(std::hash<MetricDimensionKey>{}(metricKey1),
+              std::hash<MetricDimensionKey>{}(metricKey2));
+    metricKey2.getMutableStateValuesKey()->addValue(FieldValue(field, Value((int32_t)1)));
+    EXPECT_NE(std::hash<MetricDimensionKey>{}(metricKey1),
+              std::hash<MetricDimensionKey>{}(metricKey2));
+}
+
+/**
+ * Test that a const key shared between threads, as DEFAULT_DIMENSION_KEY is between the lanes
+ * that process events, hashes the same from all of them. Run under TSAN to catch races on the
+ * cached hash.
+ */
+TEST(HashableDimensionKeyTest, TestConcurrentHashOfSharedKey) {
+    int pos[] = {1, 1, 1};
+    Field field(1, pos, 1);
+    HashableDimensionKey expectedKey;
+    expectedKey.addValue(FieldValue(field, Value((int32_t)10)));
+    expectedKey.addValue(FieldValue(field, Value("string")));
+    const size_t expectedHash = std::hash<HashableDimensionKey>{}(expectedKey);
+    const size_t expectedDefaultHash =
+            std::hash<HashableDimensionKey>{}(HashableDimensionKey(DEFAULT_DIMENSION_KEY));
+
+    const int kThreads = 8;
+    const int kRounds = 1000;
+    for (int round = 0; round < kRounds; round++) {
+        // A fresh key each round, so that the threads race on the first computation.
+        const HashableDimensionKey sharedKey(expectedKey.getValues());
+        std::vector<size_t> hashes(kThreads);
+        std::vector<size_t> defaultHashes(kThreads);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; i++) {
+            threads.emplace_back([&, i] {
+                hashes[i] = std::hash<HashableDimensionKey>{}(sharedKey);
+                defaultHashes[i] = std::hash<HashableDimensionKey>{}(DEFAULT_DIMENSION_KEY);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < kThreads; i++) {
+            ASSERT_EQ(expectedHash, hashes[i]);
+            ASSERT_EQ(expectedDefaultHash, defaultHashes[i]);
+        }
+    }
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -12,9 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <fnmatch.h>
 #include <gtest/gtest.h>
 #include <stdio.h>
 
+#include "matchers/AtomMatcherIndex.h"
+#include "matchers/CombinationAtomMatchingTracker.h"
+#include "matchers/MatcherEvaluationPlan.h"
+#include "matchers/SharedMatcherResults.h"
+#include "matchers/SimpleAtomMatchingTracker.h"
 #include "matchers/matcher_util.h"
 #include "src/statsd_config.pb.h"
 #include "stats_annotations.h"
@@ -1053,6 +1059,57 @@ TEST(AtomMatcherTest, TestIntComparisonMatcher) {
     EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event).matched);
 }
 
+TEST(AtomMatcherTest, TestCompiledFieldComparisons) {
+    sp<UidMap> uidMap = new UidMap();
+    AtomMatcher matcher;
+    auto simpleMatcher = matcher.mutable_simple_atom_matcher();
+    simpleMatcher->set_atom_id(TAG_ID);
+    auto keyValue1 = simpleMatcher->add_field_value_matcher();
+    keyValue1->set_field(FIELD_ID_1);
+    keyValue1->set_gte_int(2);
+    auto keyValue2 = simpleMatcher->add_field_value_matcher();
+    keyValue2->set_field(FIELD_ID_2);
+    keyValue2->set_eq_int(3);
+
+    SimpleMatcherCache matcherCache = compileSimpleMatcher(*simpleMatcher);
+    EXPECT_TRUE(matcherCache.comparisonsOnly);
+    ASSERT_EQ(matcherCache.fieldComparisons.size(), 2);
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event1, TAG_ID, 0, 2, 3);
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event2, TAG_ID, 0, 1, 3);
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event1, &matcherCache).matched);
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event2, &matcherCache).matched);
+
+    // The field after a repeated field is not at the index of its field number.
+    simpleMatcher->clear_field_value_matcher();
+    keyValue1 = simpleMatcher->add_field_value_matcher();
+    keyValue1->set_field(FIELD_ID_2);
+    keyValue1->set_eq_string("some value");
+    matcherCache = compileSimpleMatcher(*simpleMatcher);
+    EXPECT_TRUE(matcherCache.comparisonsOnly);
+
+    LogEvent event3(/*uid=*/0, /*pid=*/0);
+    makeAttributionLogEvent(&event3, TAG_ID, 0, {1111, 2222} /* uids */, {"a", "b"} /* tags */,
+                            "some value");
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event3).matched);
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event3, &matcherCache).matched);
+    keyValue1->set_eq_string("other value");
+    matcherCache = compileSimpleMatcher(*simpleMatcher);
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event3, &matcherCache).matched);
+
+    // Matchers with a position are interpreted.
+    keyValue2 = simpleMatcher->add_field_value_matcher();
+    keyValue2->set_field(FIELD_ID_1);
+    keyValue2->set_position(Position::FIRST);
+    keyValue2->mutable_matches_tuple()->add_field_value_matcher()->set_field(
+            ATTRIBUTION_UID_FIELD_ID);
+    matcherCache = compileSimpleMatcher(*simpleMatcher);
+    EXPECT_FALSE(matcherCache.comparisonsOnly);
+    EXPECT_TRUE(matcherCache.fieldComparisons.empty());
+}
+
 TEST(AtomMatcherTest, TestFloatComparisonMatcher) {
     sp<UidMap> uidMap = new UidMap();
     // Set up the matcher
@@ -1270,6 +1327,281 @@ TEST(AtomMatcherTest, TestUidFieldMatcherWithWildcardString) {
     EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event8).matched);
 }
 
+TEST(AtomMatcherTest, TestUidFieldMatcherWithCompiledWildcardString) {
+    sp<UidMap> uidMap = new UidMap();
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1111, /*version*/ 1, "v1", "pkg1");
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 3333, /*version*/ 1, "v1", "package2");
+    uidMap->updateMap(1, uidData);
+
+    AtomMatcher matcher;
+    auto simpleMatcher = matcher.mutable_simple_atom_matcher();
+    simpleMatcher->set_atom_id(TAG_ID);
+    simpleMatcher->add_field_value_matcher()->set_field(1);
+    simpleMatcher->mutable_field_value_matcher(0)->set_eq_wildcard_string("pkg*");
+    const SimpleMatcherCache matcherCache = compileSimpleMatcher(*simpleMatcher);
+    EXPECT_EQ(matcherCache.wildcards.size(), 1);
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeIntWithBoolAnnotationLogEvent(&event1, TAG_ID, 1111, ASTATSLOG_ANNOTATION_ID_IS_UID, true);
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeIntWithBoolAnnotationLogEvent(&event2, TAG_ID, 3333, ASTATSLOG_ANNOTATION_ID_IS_UID, true);
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event1, &matcherCache).matched);
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event2, &matcherCache).matched);
+    EXPECT_EQ(matcherCache.uidMatchResults.size(), 2);
+
+    // Memoized results are dropped when apps are removed or installed.
+    uidMap->removeApp(2, "pkg1", 1111);
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event1, &matcherCache).matched);
+    uidMap->updateApp(3, "pkg3", 3333, /*version*/ 1, "v1", "", /*certificateHash*/ {});
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event2, &matcherCache).matched);
+}
+
+TEST(AtomMatcherTest, TestAttributionUidMatcherWithCompiledPackageUids) {
+    sp<UidMap> uidMap = new UidMap();
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1111, /*version*/ 1, "v1", "pkg1");
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 3333, /*version*/ 1, "v1", "pkg2");
+    uidMap->updateMap(1, uidData);
+
+    AtomMatcher matcher;
+    auto simpleMatcher = matcher.mutable_simple_atom_matcher();
+    simpleMatcher->set_atom_id(TAG_ID);
+    auto attributionMatcher = simpleMatcher->add_field_value_matcher();
+    attributionMatcher->set_field(FIELD_ID_1);
+    attributionMatcher->set_position(Position::ANY);
+    attributionMatcher->mutable_matches_tuple()->add_field_value_matcher()->set_field(
+            ATTRIBUTION_UID_FIELD_ID);
+    attributionMatcher->mutable_matches_tuple()->mutable_field_value_matcher(0)->set_eq_string(
+            "pkg2");
+    const SimpleMatcherCache matcherCache = compileSimpleMatcher(*simpleMatcher);
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeAttributionLogEvent(&event1, TAG_ID, 0, {1111, 2222} /* uids */, {"a", "b"} /* tags */,
+                            "some value");
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeAttributionLogEvent(&event2, TAG_ID, 0, {1111, 3333} /* uids */, {"a", "b"} /* tags */,
+                            "some value");
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event1, &matcherCache).matched);
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event2, &matcherCache).matched);
+    // The package was resolved to its uids once for all the attribution nodes.
+    ASSERT_EQ(matcherCache.packageUids.size(), 1);
+    EXPECT_THAT(matcherCache.packageUids.begin()->second, UnorderedElementsAre(3333));
+    EXPECT_TRUE(matcherCache.uidMatchResults.empty());
+
+    // The uids are resolved again when apps are installed or removed.
+    uidMap->updateApp(2, "pkg2", 2222, /*version*/ 1, "v1", "", /*certificateHash*/ {});
+    EXPECT_TRUE(matchesSimple(uidMap, *simpleMatcher, event1, &matcherCache).matched);
+    uidMap->removeApp(3, "pkg2", 3333);
+    uidMap->removeApp(4, "pkg2", 2222);
+    EXPECT_FALSE(matchesSimple(uidMap, *simpleMatcher, event2, &matcherCache).matched);
+}
+
+TEST(AtomMatcherTest, TestAtomMatcherIndex) {
+    sp<UidMap> uidMap = new UidMap();
+    vector<sp<AtomMatchingTracker>> trackers;
+    auto addTracker = [&](const SimpleAtomMatcher& matcher) {
+        trackers.push_back(new SimpleAtomMatchingTracker(/*id*/ trackers.size(),
+                                                         /*protoHash*/ 0, matcher, uidMap));
+    };
+    for (int i = 0; i < 5; i++) {
+        SimpleAtomMatcher matcher;
+        matcher.set_atom_id(TAG_ID);
+        matcher.add_field_value_matcher()->set_field(FIELD_ID_1);
+        matcher.mutable_field_value_matcher(0)->set_eq_string("pkg" + std::to_string(i));
+        addTracker(matcher);
+    }
+    // Matchers that transform strings or test other atoms are not indexed.
+    SimpleAtomMatcher transformingMatcher;
+    transformingMatcher.set_atom_id(TAG_ID);
+    transformingMatcher.add_field_value_matcher()->set_field(FIELD_ID_1);
+    transformingMatcher.mutable_field_value_matcher(0)->set_eq_string("pkg");
+    transformingMatcher.mutable_field_value_matcher(0)->mutable_replace_string()->set_regex(
+            R"([0-9]+$)");
+    addTracker(transformingMatcher);
+    SimpleAtomMatcher otherAtomMatcher;
+    otherAtomMatcher.set_atom_id(TAG_ID_2);
+    otherAtomMatcher.add_field_value_matcher()->set_field(FIELD_ID_1);
+    otherAtomMatcher.mutable_field_value_matcher(0)->set_eq_string("pkg1");
+    addTracker(otherAtomMatcher);
+
+    EXPECT_FALSE(AtomMatcherIndex::create(TAG_ID, {0, 1, 2, 5, 6}, trackers));
+    const std::optional<AtomMatcherIndex> index =
+            AtomMatcherIndex::create(TAG_ID, {0, 1, 2, 3, 4, 5, 6}, trackers);
+    ASSERT_TRUE(index);
+    EXPECT_EQ(FIELD_ID_1, index->getField());
+    EXPECT_EQ(5, index->getIndexedMatcherCount());
+
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeStringLogEvent(&event, TAG_ID, 0, "pkg1");
+    vector<MatchingState> results(trackers.size(), MatchingState::kNotComputed);
+    index->prune(event, results);
+    EXPECT_EQ(results, vector<MatchingState>({kNotMatched, kNotComputed, kNotMatched, kNotMatched,
+                                              kNotMatched, kNotComputed, kNotComputed}));
+
+    // Results of the pruned matchers agree with evaluating them.
+    for (size_t i = 0; i < 5; i++) {
+        if (results[i] == kNotMatched) {
+            EXPECT_FALSE(
+                    matchesSimple(uidMap, *trackers[i]->getSimpleAtomMatcher(), event).matched);
+        }
+    }
+
+    LogEvent intEvent(/*uid=*/0, /*pid=*/0);
+    makeIntLogEvent(&intEvent, TAG_ID, 0, 11);
+    results.assign(trackers.size(), MatchingState::kNotComputed);
+    index->prune(intEvent, results);
+    EXPECT_EQ(results, vector<MatchingState>({kNotMatched, kNotMatched, kNotMatched, kNotMatched,
+                                              kNotMatched, kNotComputed, kNotComputed}));
+}
+
+TEST(AtomMatcherTest, TestMatcherEvaluationPlanMatchesRecursiveEvaluation) {
+    sp<UidMap> uidMap = new UidMap();
+    vector<AtomMatcher> matchers;
+    auto addIntMatcher = [&](const string& name, int atomId, int value) {
+        AtomMatcher matcher = CreateSimpleAtomMatcher(name, atomId);
+        auto fvm = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+        fvm->set_field(FIELD_ID_1);
+        fvm->set_eq_int(value);
+        matchers.push_back(matcher);
+    };
+    auto addCombination = [&](const string& name, LogicalOperation operation,
+                              const vector<string>& children) {
+        AtomMatcher matcher;
+        matcher.set_id(StringToId(name));
+        auto combination = matcher.mutable_combination();
+        combination->set_operation(operation);
+        for (const string& child : children) {
+            combination->add_matcher(StringToId(child));
+        }
+        matchers.push_back(matcher);
+    };
+    // Parents come before some of their children, so the plan has to reorder them.
+    addCombination("And", LogicalOperation::AND, {"A", "AOrB"});
+    addIntMatcher("A", TAG_ID, 1);
+    addIntMatcher("B", TAG_ID, 2);
+    addIntMatcher("C", TAG_ID_2, 1);
+    addCombination("AOrB", LogicalOperation::OR, {"A", "B"});
+    addCombination("NotC", LogicalOperation::NOT, {"C"});
+    addCombination("NorAB", LogicalOperation::NOR, {"A", "B"});
+    addCombination("NandAC", LogicalOperation::NAND, {"A", "C"});
+    addCombination("NotAnd", LogicalOperation::NOT, {"And"});
+
+    vector<sp<AtomMatchingTracker>> trackers;
+    unordered_map<int64_t, int> matcherMap;
+    for (const AtomMatcher& matcher : matchers) {
+        matcherMap[matcher.id()] = trackers.size();
+        if (matcher.has_simple_atom_matcher()) {
+            trackers.push_back(new SimpleAtomMatchingTracker(matcher.id(), /*protoHash*/ 0,
+                                                             matcher.simple_atom_matcher(), uidMap));
+        } else {
+            trackers.push_back(new CombinationAtomMatchingTracker(matcher.id(), /*protoHash*/ 0));
+        }
+    }
+    unordered_map<int, vector<int>> tagIdsToMatchers;
+    for (size_t i = 0; i < trackers.size(); i++) {
+        vector<uint8_t> stack(trackers.size(), false);
+        ASSERT_EQ(trackers[i]->init(i, matchers, trackers, matcherMap, stack).invalidConfigReason,
+                  std::nullopt);
+    }
+    for (size_t i = 0; i < trackers.size(); i++) {
+        for (const int atomId : trackers[i]->getAtomIds()) {
+            tagIdsToMatchers[atomId].push_back(i);
+        }
+    }
+
+    MatcherEvaluationPlan plan;
+    plan.build(trackers, tagIdsToMatchers);
+    for (const int atomId : {TAG_ID, TAG_ID_2}) {
+        for (const int value : {1, 2, 3}) {
+            LogEvent event(/*uid=*/0, /*pid=*/0);
+            makeIntLogEvent(&event, atomId, 0, value);
+
+            vector<MatchingState> expected(trackers.size(), MatchingState::kNotComputed);
+            vector<shared_ptr<LogEvent>> transformations(trackers.size());
+            for (const int matcherIndex : tagIdsToMatchers[atomId]) {
+                trackers[matcherIndex]->onLogEvent(event, matcherIndex, trackers, expected,
+                                                   transformations);
+            }
+            vector<MatchingState> results(trackers.size(), MatchingState::kNotComputed);
+            plan.evaluate(event, trackers, results, transformations);
+            for (const int matcherIndex : tagIdsToMatchers[atomId]) {
+                EXPECT_EQ(expected[matcherIndex], results[matcherIndex])
+                        << "atom " << atomId << " value " << value << " matcher "
+                        << matchers[matcherIndex].id();
+            }
+        }
+    }
+}
+
+TEST(AtomMatcherTest, TestMatcherEvaluationPlanSharesIdenticalMatchers) {
+    sp<UidMap> uidMap = new UidMap();
+    // Each config has a single simple matcher on TAG_ID.
+    auto makeConfig = [&](const string& name, int value, vector<sp<AtomMatchingTracker>>& trackers,
+                          MatcherEvaluationPlan& plan) {
+        AtomMatcher matcher = CreateSimpleAtomMatcher(name, TAG_ID);
+        auto fvm = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+        fvm->set_field(FIELD_ID_1);
+        fvm->set_eq_int(value);
+        trackers.push_back(new SimpleAtomMatchingTracker(matcher.id(), /*protoHash*/ 0,
+                                                         matcher.simple_atom_matcher(), uidMap));
+        vector<uint8_t> stack(1, false);
+        ASSERT_EQ(trackers[0]->init(0, {matcher}, trackers, {{matcher.id(), 0}}, stack)
+                          .invalidConfigReason,
+                  std::nullopt);
+        plan.build(trackers, {{TAG_ID, {0}}});
+    };
+    vector<sp<AtomMatchingTracker>> trackersA, trackersB, trackersC;
+    MatcherEvaluationPlan planA, planB, planC;
+    makeConfig("TeamA", 1, trackersA, planA);
+    // Same matcher under another id.
+    makeConfig("TeamB", 1, trackersB, planB);
+    makeConfig("TeamC", 2, trackersC, planC);
+
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeIntLogEvent(&event, TAG_ID, 0, 1);
+    SharedMatcherResults sharedResults;
+    sharedResults.startEvent();
+
+    vector<MatchingState> results(1, MatchingState::kNotComputed);
+    vector<shared_ptr<LogEvent>> transformations(1);
+    planA.evaluate(event, trackersA, results, transformations, &sharedResults);
+    EXPECT_EQ(MatchingState::kMatched, results[0]);
+    EXPECT_EQ(1u, sharedResults.size());
+
+    results.assign(1, MatchingState::kNotComputed);
+    planB.evaluate(event, trackersB, results, transformations, &sharedResults);
+    EXPECT_EQ(MatchingState::kMatched, results[0]);
+    EXPECT_EQ(1u, sharedResults.size());
+
+    results.assign(1, MatchingState::kNotComputed);
+    planC.evaluate(event, trackersC, results, transformations, &sharedResults);
+    EXPECT_EQ(MatchingState::kNotMatched, results[0]);
+    EXPECT_EQ(2u, sharedResults.size());
+
+    sharedResults.startEvent();
+    EXPECT_EQ(0u, sharedResults.size());
+}
+
+TEST(AtomMatcherTest, TestCompiledWildcardPatternMatchesFnmatch) {
+    const vector<std::string> patterns = {"",        "*",      "**",     "pkg",       "pkg*",
+                                          "*pkg",    "*pkg*",  "p?g",    "p*g",       "p*k*g*",
+                                          "*.a?p",   "?",      "a*b*a",  "com.*.app", "[pq]kg*",
+                                          "pk\\g", "pk\\*", "*a*a*a"};
+    const vector<std::string> inputs = {"",     "pkg",    "pkg1", "apkg",        "apkg1",
+                                        "pg",   "pkkg",   "aba",  "com.foo.app", "com.app",
+                                        "ab",   "x.app",  "abba", "x.apps",      "qkg",
+                                        "pk*",  "aaaa",   "a",    "pk\\g"};
+    for (const std::string& pattern : patterns) {
+        const WildcardPattern compiledPattern(pattern);
+        for (const std::string& input : inputs) {
+            EXPECT_EQ(fnmatch(pattern.c_str(), input.c_str(), 0) == 0,
+                      compiledPattern.matches(input))
+                    << "pattern: \"" << pattern << "\" input: \"" << input << "\"";
+        }
+    }
+}
+
 TEST(AtomMatcherTest, TestWildcardStringMatcher) {
     sp<UidMap> uidMap = new UidMap();
     // Set up the matcher
@@ -1535,6 +1867,51 @@ TEST(AtomMatcherTest, TestStringReplaceRoot) {
     EXPECT_EQ(fieldValues[6].mValue.str_value, "some value");
 }
 
+TEST(AtomMatcherTest, TestStringReplaceChained) {
+    sp<UidMap> uidMap = new UidMap();
+
+    // Set up the log event.
+    std::vector<int> attributionUids = {1111, 2222, 3333};
+    std::vector<string> attributionTags = {"location1", "location2", "location3"};
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeAttributionLogEvent(&event, TAG_ID, 0, attributionUids, attributionTags, "some value123");
+
+    // Set up the matcher. Both field value matchers transform the second field, and the second
+    // one matches on the result of both transformations.
+    AtomMatcher matcher = CreateSimpleAtomMatcher("matcher", TAG_ID);
+    FieldValueMatcher* fvm1 = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+    fvm1->set_field(FIELD_ID_2);
+    fvm1->mutable_replace_string()->set_regex(R"([0-9]+$)");
+    fvm1->mutable_replace_string()->set_replacement("");
+    FieldValueMatcher* fvm2 = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+    fvm2->set_field(FIELD_ID_2);
+    fvm2->mutable_replace_string()->set_regex(R"(^some )");
+    fvm2->mutable_replace_string()->set_replacement("");
+    fvm2->set_eq_string("value");
+
+    {
+        const auto [hasMatched, transformedEvent] =
+                matchesSimple(uidMap, matcher.simple_atom_matcher(), event);
+        EXPECT_TRUE(hasMatched);
+        ASSERT_NE(transformedEvent, nullptr);
+
+        const vector<FieldValue>& fieldValues = transformedEvent->getValues();
+        ASSERT_EQ(fieldValues.size(), 7);
+        EXPECT_EQ(fieldValues[1].mValue.str_value, "location1");
+        EXPECT_EQ(fieldValues[6].mValue.str_value, "value");
+
+        // The original event is untouched.
+        EXPECT_EQ(event.getValues()[6].mValue.str_value, "some value123");
+    }
+
+    // Transformations of an event that does not match are dropped.
+    fvm2->set_eq_string("some value");
+    const auto [hasMatched, transformedEvent] =
+            matchesSimple(uidMap, matcher.simple_atom_matcher(), event);
+    EXPECT_FALSE(hasMatched);
+    EXPECT_EQ(transformedEvent, nullptr);
+}
+
 TEST(AtomMatcherTest, TestStringReplaceAttributionTagFirst) {
     sp<UidMap> uidMap = new UidMap();
 
@@ -2064,6 +2441,55 @@ TEST(AtomMatcherTest, TestStringReplaceNoop) {
     ASSERT_EQ(transformedEvent, nullptr);
 }
 
+TEST(AtomMatcherTest, TestStringReplaceWithRegexCache) {
+    sp<UidMap> uidMap = new UidMap();
+
+    // Set up the matcher. Replace all attribution tags, match on any tag, and replace the root
+    // field with a bad regex.
+    AtomMatcher matcher = CreateSimpleAtomMatcher("matcher", TAG_ID);
+    FieldValueMatcher* attributionFvm =
+            matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+    attributionFvm->set_field(FIELD_ID_1);
+    attributionFvm->set_position(Position::ANY);
+    FieldValueMatcher* attributionTagFvm =
+            attributionFvm->mutable_matches_tuple()->add_field_value_matcher();
+    attributionTagFvm->set_field(ATTRIBUTION_TAG_FIELD_ID);
+    attributionTagFvm->set_eq_string("bar");
+    StringReplacer* stringReplacer = attributionTagFvm->mutable_replace_string();
+    stringReplacer->set_regex(R"([0-9]+$)");  // match trailing digits, example "42" in "foo42".
+    stringReplacer->set_replacement("");
+    FieldValueMatcher* rootFvm = matcher.mutable_simple_atom_matcher()->add_field_value_matcher();
+    rootFvm->set_field(FIELD_ID_2);
+    stringReplacer = rootFvm->mutable_replace_string();
+    stringReplacer->set_regex(
+            R"(*[0-9]+$)");  // bad regex: asterisk not preceded by any expression.
+    stringReplacer->set_replacement("");
+
+    const SimpleMatcherCache matcherCache = compileSimpleMatcher(matcher.simple_atom_matcher());
+    ASSERT_EQ(matcherCache.regexes.size(), 2);
+    ASSERT_EQ(matcherCache.regexes.count(attributionTagFvm), 1);
+    EXPECT_NE(matcherCache.regexes.at(attributionTagFvm), nullptr);
+    ASSERT_EQ(matcherCache.regexes.count(rootFvm), 1);
+    EXPECT_EQ(matcherCache.regexes.at(rootFvm), nullptr);
+
+    // The cached regexes can be reused across events.
+    for (int i = 0; i < 2; i++) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeAttributionLogEvent(&event, TAG_ID, 0, {1111, 2222, 3333} /* uids */,
+                                {"foo1", "bar2", "foo3"} /* tags */, "blah123" /* name */);
+        const auto [hasMatched, transformedEvent] =
+                matchesSimple(uidMap, matcher.simple_atom_matcher(), event, &matcherCache);
+        EXPECT_TRUE(hasMatched);
+        ASSERT_NE(transformedEvent, nullptr);
+        const vector<FieldValue>& fieldValues = transformedEvent->getValues();
+        ASSERT_EQ(fieldValues.size(), 7);
+        EXPECT_EQ(fieldValues[1].mValue.str_value, "foo");
+        EXPECT_EQ(fieldValues[3].mValue.str_value, "bar");
+        EXPECT_EQ(fieldValues[5].mValue.str_value, "foo");
+        EXPECT_EQ(fieldValues[6].mValue.str_value, "blah123");
+    }
+}
+
 #else
 GTEST_LOG_(INFO) << "This test does nothing.\n";
 #endif
@@ -18,6 +18,9 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #ifdef __ANDROID__
 
@@ -183,6 +186,143 @@ TEST(LogEventFilterTest, TestMultipleConsumerEmptyFilter) {
     EXPECT_TRUE(testGuaranteedUnusedAtomsNotInUse(filter));
 }
 
+TEST(LogEventFilterTest, TestDenseAndSparseAtomIds) {
+    LogEventFilter filter;
+    // Platform, vendor and negative ids take different paths through the lookup.
+    LogEventFilter::AtomIdSet filterIds = {0, 10, 2047, 2048, 10001, 100000, -5};
+    filter.setAtomIds(filterIds, reinterpret_cast<LogEventFilter::ConsumerId>(0));
+    for (const int atomId : filterIds) {
+        EXPECT_TRUE(filter.isAtomInUse(atomId));
+    }
+    EXPECT_EQ(filterIds.size(), filter.mLocalTagIds.size());
+    for (const int atomId : {1, 11, 2046, 2049, 10002, 99999, -4}) {
+        EXPECT_FALSE(filter.isAtomInUse(atomId));
+    }
+}
+
+TEST(LogEventFilterTest, TestConcurrentUpdates) {
+    LogEventFilter filter;
+    const auto atomIds = generateAtomIds(1, kAtomIdsCount);
+    std::atomic_bool done = false;
+    // The reader picks up whichever published set is the latest without blocking the writer.
+    std::thread reader([&filter, &done] {
+        while (!done) {
+            filter.isAtomInUse(1);
+            EXPECT_FALSE(filter.isAtomInUse(kAtomIdsCount + 1));
+        }
+    });
+    for (int i = 0; i < 1001; i++) {
+        filter.setAtomIds(i % 2 == 0 ? atomIds : LogEventFilter::AtomIdSet(),
+                          reinterpret_cast<LogEventFilter::ConsumerId>(0));
+    }
+    done = true;
+    reader.join();
+
+    // The last update set the ids.
+    EXPECT_TRUE(filter.isAtomInUse(1));
+    EXPECT_EQ(kAtomIdsCount, filter.mLocalTagIds.size());
+}
+
+TEST(LogEventFilterTest, TestFieldMasksUnion) {
+    LogEventFilter filter;
+    const auto consumer1 = reinterpret_cast<LogEventFilter::ConsumerId>(1);
+    const auto consumer2 = reinterpret_cast<LogEventFilter::ConsumerId>(2);
+    const auto consumer3 = reinterpret_cast<LogEventFilter::ConsumerId>(3);
+    filter.setAtomFieldMasks({{1, 0b10}, {2, 0b100}}, consumer1);
+    filter.setAtomIds({1, 2, 3}, consumer1);
+    filter.setAtomFieldMasks({{1, 0b1000}}, consumer2);
+    filter.setAtomIds({1}, consumer2);
+    // No masks, so atom 2 is read whole.
+    filter.setAtomIds({2}, consumer3);
+
+    EXPECT_TRUE(filter.isAtomInUse(1));
+    EXPECT_EQ(0b1010, filter.getFieldMask(1));
+    EXPECT_EQ(kAllFieldsMask, filter.getFieldMask(2));
+    // Consumer 1 has no mask for atom 3.
+    EXPECT_EQ(kAllFieldsMask, filter.getFieldMask(3));
+    EXPECT_EQ(1, filter.mLocalFieldMasks.size());
+
+    // The masks of consumer 2 go away with its atoms.
+    filter.setAtomIds({}, consumer2);
+    EXPECT_TRUE(filter.isAtomInUse(1));
+    EXPECT_EQ(0b10, filter.getFieldMask(1));
+
+    filter.setFilteringEnabled(false);
+    EXPECT_EQ(kAllFieldsMask, filter.getFieldMask(1));
+}
+
+TEST(LogEventFilterTest, TestCriticalAtomIds) {
+    LogEventFilter filter;
+    const auto consumer1 = reinterpret_cast<LogEventFilter::ConsumerId>(1);
+    const auto consumer2 = reinterpret_cast<LogEventFilter::ConsumerId>(2);
+    filter.setCriticalAtomIds({1}, consumer1);
+    filter.setAtomIds({1, 2}, consumer1);
+    filter.setCriticalAtomIds({3}, consumer2);
+    filter.setAtomIds({2, 3}, consumer2);
+
+    EXPECT_TRUE(filter.isAtomInUse(1));
+    EXPECT_TRUE(filter.isAtomCritical(1));
+    EXPECT_FALSE(filter.isAtomCritical(2));
+    EXPECT_TRUE(filter.isAtomCritical(3));
+    EXPECT_EQ(2, filter.mLocalCriticalTagIds.size());
+
+    // The critical atoms of consumer 2 go away with its atoms.
+    filter.setAtomIds({}, consumer2);
+    EXPECT_TRUE(filter.isAtomInUse(1));
+    EXPECT_TRUE(filter.isAtomCritical(1));
+    EXPECT_FALSE(filter.isAtomCritical(3));
+
+    filter.setFilteringEnabled(false);
+    EXPECT_FALSE(filter.isAtomCritical(1));
+}
+
+TEST(LogEventFilterTest, TestSuspendFiltering) {
+    LogEventFilter filter;
+    std::vector<bool> listenerFiltering;
+    filter.setAtomIdsListener([&listenerFiltering](const LogEventFilter::AtomIdSet* atomIds) {
+        listenerFiltering.push_back(atomIds != nullptr);
+    });
+    filter.setAtomIds({1}, reinterpret_cast<LogEventFilter::ConsumerId>(0));
+    EXPECT_FALSE(filter.isAtomInUse(2));
+
+    // Atoms that no consumer uses yet get through, and the listener drops its filter.
+    filter.suspendFiltering();
+    filter.suspendFiltering();
+    EXPECT_TRUE(filter.isAtomInUse(2));
+    filter.setFilteringEnabled(true);
+    EXPECT_TRUE(filter.isAtomInUse(2));
+    filter.resumeFiltering();
+    EXPECT_TRUE(filter.isAtomInUse(2));
+    filter.resumeFiltering();
+    EXPECT_FALSE(filter.isAtomInUse(2));
+    EXPECT_EQ(std::vector<bool>({true, true, false, false, false, false, true}),
+              listenerFiltering);
+
+    // Filtering disabled while suspended stays disabled once resumed.
+    filter.suspendFiltering();
+    filter.setFilteringEnabled(false);
+    filter.resumeFiltering();
+    EXPECT_TRUE(filter.isAtomInUse(2));
+}
+
+TEST(LogEventFilterTest, TestAtomIdsListenerCalledWithoutLock) {
+    LogEventFilter filter;
+    int calls = 0;
+    filter.setAtomIdsListener([&filter, &calls](const LogEventFilter::AtomIdSet*) {
+        // Writers are not held up while the listener runs.
+        EXPECT_TRUE(filter.mTagIdsMutex.try_lock());
+        filter.mTagIdsMutex.unlock();
+        calls++;
+    });
+    filter.setAtomIds({1}, reinterpret_cast<LogEventFilter::ConsumerId>(0));
+    filter.setFilteringEnabled(false);
+    EXPECT_EQ(3, calls);
+
+    filter.setAtomIdsListener(nullptr);
+    filter.setFilteringEnabled(true);
+    EXPECT_EQ(3, calls);
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -16,6 +16,8 @@
 
 #include <gtest/gtest.h>
 
+#include <thread>
+
 #include "flags/FlagProvider.h"
 #include "frameworks/proto_logging/stats/atoms.pb.h"
 #include "frameworks/proto_logging/stats/enums/stats/launcher/launcher.pb.h"
@@ -300,6 +302,169 @@ TEST(LogEventTestParsing, TestFetchHeaderOnly) {
     ASSERT_EQ(0, logEvent.getValues().size());
 }
 
+TEST(LogEventTestParsing, TestDeferredBody) {
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeInt32(event, 10);
+    AStatsEvent_writeString(event, "test");
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    const LogEvent::BodyBufferInfo bodyInfo = logEvent.parseHeader(buf, size);
+    logEvent.deferBody(bodyInfo);
+    EXPECT_FALSE(logEvent.isParsedHeaderOnly());
+
+    // The body was copied, so the event outlives the buffer.
+    AStatsEvent_release(event);
+
+    EXPECT_EQ(100, logEvent.GetTagId());
+    EXPECT_TRUE(logEvent.isValid());
+    const vector<FieldValue>& values = logEvent.getValues();
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ(10, values[0].mValue.int_value);
+    EXPECT_EQ("test", values[1].mValue.str_value);
+
+    // Later accesses see the same values.
+    EXPECT_EQ(2, logEvent.size());
+    status_t err = NO_ERROR;
+    EXPECT_EQ(10, logEvent.GetInt(1, &err));
+    EXPECT_EQ(NO_ERROR, err);
+}
+
+TEST(LogEventTestParsing, TestDeferredBodyParsedOnAnotherThread) {
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeInt32(event, 10);
+    AStatsEvent_writeString(event, "test");
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    logEvent.deferBody(logEvent.parseHeader(buf, size));
+    AStatsEvent_release(event);
+
+    std::thread parser([&logEvent] { logEvent.parseDeferredBodyNow(); });
+    parser.join();
+
+    EXPECT_TRUE(logEvent.isValid());
+    const vector<FieldValue>& values = logEvent.getValues();
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ(10, values[0].mValue.int_value);
+    EXPECT_EQ("test", values[1].mValue.str_value);
+}
+
+TEST(LogEventTestParsing, TestDeferredBodyInvalid) {
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeInt32(event, 10);
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    // Drop the last byte of the body.
+    const LogEvent::BodyBufferInfo bodyInfo = logEvent.parseHeader(buf, size - 1);
+    logEvent.deferBody(bodyInfo);
+    AStatsEvent_release(event);
+
+    EXPECT_FALSE(logEvent.isValid());
+}
+
+TEST(LogEventTestParsing, TestValuesReservedFromPreviousEvent) {
+    // Two top-level elements that decode into five values.
+    uint32_t uids[] = {1001, 1002};
+    const char* tags[] = {"tag1", "tag2"};
+
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 101);
+    AStatsEvent_writeAttributionChain(event, uids, tags, 2);
+    AStatsEvent_writeInt32(event, 10);
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    LogEvent first(/*uid=*/1000, /*pid=*/1001);
+    EXPECT_TRUE(first.parseBuffer(buf, size));
+    ASSERT_EQ(5, first.getValues().size());
+
+    // The second event of the same atom reserves exactly as many values as the first produced.
+    LogEvent second(/*uid=*/1000, /*pid=*/1001);
+    EXPECT_TRUE(second.parseBuffer(buf, size));
+    ASSERT_EQ(5, second.getValues().size());
+    EXPECT_EQ(5, second.getValues().capacity());
+    EXPECT_EQ(first.getValues(), second.getValues());
+
+    AStatsEvent_release(event);
+}
+
+TEST(LogEventTestParsing, TestFieldMaskSkipsStringAndByteArray) {
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeString(event, "skipped");
+    AStatsEvent_writeByteArray(event, (const uint8_t*)"skipped", 7);
+    AStatsEvent_writeString(event, "kept");
+    AStatsEvent_writeInt32(event, 10);
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    // Only field 3 is read. Fields that are not strings or byte arrays are decoded anyway.
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    logEvent.setFieldMask(uint64_t(1) << 3);
+    EXPECT_TRUE(logEvent.parseBuffer(buf, size));
+
+    const vector<FieldValue>& values = logEvent.getValues();
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ(3, values[0].mField.getPosAtDepth(0));
+    EXPECT_EQ("kept", values[0].mValue.str_value);
+    EXPECT_EQ(4, values[1].mField.getPosAtDepth(0));
+    EXPECT_EQ(10, values[1].mValue.int_value);
+
+    // A skipped value is still checked against the size of the buffer.
+    LogEvent truncatedEvent(/*uid=*/1000, /*pid=*/1001);
+    truncatedEvent.setFieldMask(0);
+    EXPECT_FALSE(truncatedEvent.parseBuffer(buf, size - 20));
+
+    AStatsEvent_release(event);
+}
+
+TEST(LogEventTestParsing, TestWidenFieldMaskParsesDeferredBodyAgain) {
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeString(event, "first");
+    AStatsEvent_writeString(event, "second");
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    const LogEvent::BodyBufferInfo bodyInfo = logEvent.parseHeader(buf, size);
+    logEvent.setFieldMask(uint64_t(1) << 1);
+    logEvent.deferBody(bodyInfo);
+    AStatsEvent_release(event);
+    ASSERT_EQ(1, logEvent.getValues().size());
+
+    // Fields that were already decoded do not need the body parsed again.
+    logEvent.widenFieldMask(uint64_t(1) << 1);
+    ASSERT_EQ(1, logEvent.getValues().size());
+
+    logEvent.widenFieldMask(uint64_t(1) << 2);
+    const vector<FieldValue>& values = logEvent.getValues();
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ("first", values[0].mValue.str_value);
+    EXPECT_EQ("second", values[1].mValue.str_value);
+    EXPECT_EQ(2, logEvent.getValueHashes().size());
+}
+
 TEST_P(LogEventTest, TestStringAndByteArrayParsing) {
     AStatsEvent* event = AStatsEvent_obtain();
     AStatsEvent_setAtomId(event, 100);
@@ -679,6 +844,24 @@ TEST_P(LogEventTest, TestArrayTooManyElements) {
     AStatsEvent_release(event);
 }
 
+TEST_P(LogEventTest, TestTruncatedArray) {
+    int64_t int64Array[] = {3000000000L, 3000000001L, 3000000002L};
+
+    AStatsEvent* event = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(event, 100);
+    AStatsEvent_writeInt64Array(event, int64Array, 3);
+    AStatsEvent_build(event);
+
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(event, &size);
+
+    // Cut the last element short.
+    LogEvent logEvent(/*uid=*/1000, /*pid=*/1001);
+    EXPECT_FALSE(ParseBuffer(logEvent, buf, size - 4));
+
+    AStatsEvent_release(event);
+}
+
 TEST_P(LogEventTest, TestEmptyArray) {
     int32_t int32Array[0] = {};
 
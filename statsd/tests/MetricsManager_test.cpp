@@ -37,7 +37,9 @@ using namespace testing;
 using android::sp;
 using android::os::statsd::Predicate;
 using std::map;
+using std::nullopt;
 using std::set;
+using std::shared_ptr;
 using std::unordered_map;
 using std::vector;
 
@@ -134,7 +136,7 @@ TEST(MetricsManagerTest, TestLogSources) {
     EXPECT_THAT(metricsManager.mAllowedUid, ElementsAre(AID_SYSTEM));
     EXPECT_THAT(metricsManager.mAllowedPkg, ElementsAre(app1));
     EXPECT_THAT(metricsManager.mAllowedLogSources,
-                ContainerEq(unionSet(vector<set<int32_t>>({app1Uids, {AID_SYSTEM}}))));
+                ElementsAreArray(unionSet(vector<set<int32_t>>({app1Uids, {AID_SYSTEM}}))));
     EXPECT_THAT(metricsManager.mDefaultPullUids, ContainerEq(defaultPullUids));
 
     vector<int32_t> atom1Uids = metricsManager.getPullAtomUids(atom1);
@@ -221,7 +223,7 @@ TEST(MetricsManagerTest, TestLogSourcesOnConfigUpdate) {
 
     EXPECT_THAT(metricsManager.mAllowedPkg, ElementsAre(app2));
     EXPECT_THAT(metricsManager.mAllowedLogSources,
-                ContainerEq(unionSet(vector<set<int32_t>>({app2Uids}))));
+                ElementsAreArray(unionSet(vector<set<int32_t>>({app2Uids}))));
     const set<int32_t> defaultPullUids = {AID_SYSTEM, AID_STATSD};
     EXPECT_THAT(metricsManager.mDefaultPullUids, ContainerEq(defaultPullUids));
 
@@ -237,6 +239,52 @@ TEST(MetricsManagerTest, TestLogSourcesOnConfigUpdate) {
                 UnorderedElementsAreArray(unionSet({defaultPullUids, app2Uids, {AID_ADB}})));
 }
 
+TEST(MetricsManagerTest, TestLogSourcesOnPackageChanges) {
+    const string app1 = "app1";
+    const string app2 = "app2";
+    map<string, set<int32_t>> pkgToUids;
+    pkgToUids[app1] = {11110};
+    pkgToUids[app2] = {22220};
+
+    sp<MockUidMap> uidMap = new StrictMock<MockUidMap>();
+    // The uids of the allowed packages are only resolved when the config is created.
+    EXPECT_CALL(*uidMap, getAppUid(_))
+            .Times(2)
+            .WillRepeatedly(Invoke([&pkgToUids](const string& pkg) { return pkgToUids[pkg]; }));
+    sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+    EXPECT_CALL(*pullerManager, RegisterPullUidProvider(kConfigKey, _)).Times(1);
+    EXPECT_CALL(*pullerManager, UnregisterPullUidProvider(kConfigKey, _)).Times(1);
+
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.add_allowed_log_source("AID_SYSTEM");
+    config.add_allowed_log_source(app1);
+    config.add_allowed_log_source(app2);
+
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    EXPECT_TRUE(metricsManager.isConfigValid());
+    EXPECT_THAT(metricsManager.mAllowedLogSources, ElementsAre(AID_SYSTEM, 11110, 22220));
+
+    // app1 reinstalled for another user, and app2 sharing the system uid.
+    metricsManager.notifyAppUpgrade(timeBaseSec + 1, app1, 11111, /*version*/ 2);
+    metricsManager.notifyAppUpgrade(timeBaseSec + 1, app2, AID_SYSTEM, /*version*/ 2);
+    EXPECT_THAT(metricsManager.mAllowedLogSources,
+                ElementsAre(AID_SYSTEM, 11110, 11111, 22220));
+
+    // Packages that are not allowed do not change the sources.
+    metricsManager.notifyAppUpgrade(timeBaseSec + 2, "app3", 33330, /*version*/ 2);
+    EXPECT_THAT(metricsManager.mAllowedLogSources,
+                ElementsAre(AID_SYSTEM, 11110, 11111, 22220));
+
+    // The system uid is still allowed through AID_SYSTEM.
+    metricsManager.notifyAppRemoved(timeBaseSec + 3, app2, AID_SYSTEM);
+    metricsManager.notifyAppRemoved(timeBaseSec + 3, app1, 11110);
+    EXPECT_THAT(metricsManager.mAllowedLogSources, ElementsAre(AID_SYSTEM, 11111, 22220));
+}
+
 struct MetricsManagerServerFlagParam {
     string flagValue;
     string label;
@@ -327,6 +375,122 @@ TEST(MetricsManagerTest, TestWhitelistedAtomStateTracker) {
     EXPECT_FALSE(metricsManager.isConfigValid());
 }
 
+TEST(MetricsManagerTest, TestDeferredRegistration) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_state() = CreateScreenState();
+    *config.add_count_metric() =
+            createCountMetric("Count", config.atom_matcher(0).id(), /* condition */ nullopt,
+                              {config.state(0).id()});
+
+    StateManager::getInstance().clear();
+    {
+        MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                      pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor,
+                                      /*sharedConditions=*/nullptr, /*deferRegistration=*/true);
+        ASSERT_TRUE(metricsManager.isConfigValid());
+        EXPECT_EQ(-1, StateManager::getInstance().getListenersCount(SCREEN_STATE_ATOM_ID));
+
+        metricsManager.completeRegistration();
+        EXPECT_EQ(1, StateManager::getInstance().getListenersCount(SCREEN_STATE_ATOM_ID));
+
+        // Unregistering early leaves nothing for the destructor to do.
+        metricsManager.unregisterStateListeners();
+        EXPECT_EQ(-1, StateManager::getInstance().getListenersCount(SCREEN_STATE_ATOM_ID));
+    }
+    EXPECT_EQ(0, StateManager::getInstance().getStateTrackersCount());
+}
+
+TEST(MetricsManagerTest, TestDeferredPullAndAlarmRegistration) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<MockStatsPullerManager> pullerManager = new NiceMock<MockStatsPullerManager>();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor =
+            new AlarmMonitor(1, [](const shared_ptr<IStatsCompanionService>&, int64_t) {},
+                             [](const shared_ptr<IStatsCompanionService>&) {});
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() =
+            CreateSimpleAtomMatcher("SubsystemSleep", util::SUBSYSTEM_SLEEP_STATE);
+    *config.add_value_metric() =
+            createValueMetric("Value", config.atom_matcher(0), /*valueField=*/4,
+                              /*condition=*/nullopt, /*states=*/{});
+    *config.add_gauge_metric() =
+            createGaugeMetric("Gauge", config.atom_matcher(0).id(),
+                              GaugeMetric::RANDOM_ONE_SAMPLE, /*condition=*/nullopt,
+                              /*triggerEvent=*/nullopt);
+    *config.add_alarm() = createAlarm("Alarm", /*offsetMillis=*/15 * MS_PER_SEC,
+                                      /*periodMillis=*/60 * 60 * MS_PER_SEC);
+
+    // Nothing is registered while the MetricsManager is built aside.
+    EXPECT_CALL(*pullerManager, RegisterReceiver(util::SUBSYSTEM_SLEEP_STATE, kConfigKey, _, _, _))
+            .Times(0);
+    EXPECT_CALL(*pullerManager, RegisterPullUidProvider(kConfigKey, _)).Times(0);
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor,
+                                  /*sharedConditions=*/nullptr, /*deferRegistration=*/true);
+    ASSERT_TRUE(metricsManager.isConfigValid());
+    Mock::VerifyAndClearExpectations(pullerManager.get());
+    EXPECT_TRUE(periodicAlarmMonitor->popSoonerThan(UINT32_MAX).empty());
+
+    // Both pulled metrics and the alarm are registered once, at the swap.
+    EXPECT_CALL(*pullerManager, RegisterReceiver(util::SUBSYSTEM_SLEEP_STATE, kConfigKey, _, _, _))
+            .Times(2);
+    EXPECT_CALL(*pullerManager, RegisterPullUidProvider(kConfigKey, _)).Times(1);
+    metricsManager.completeRegistration();
+    Mock::VerifyAndClearExpectations(pullerManager.get());
+    EXPECT_EQ(1u, periodicAlarmMonitor->popSoonerThan(UINT32_MAX).size());
+}
+
+TEST(MetricsManagerTest, TestShareConditionStatesAfterConstruction) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_predicate() = CreateScreenIsOnPredicate();
+    *config.add_count_metric() = createCountMetric("Count", config.atom_matcher(0).id(),
+                                                   config.predicate(0).id(), /* states */ {});
+
+    shared_ptr<SharedConditionRegistry> registry = std::make_shared<SharedConditionRegistry>();
+    MetricsManager first(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap, pullerManager,
+                         anomalyAlarmMonitor, periodicAlarmMonitor, /*sharedConditions=*/nullptr,
+                         /*deferRegistration=*/true);
+    ASSERT_TRUE(first.isConfigValid());
+    EXPECT_EQ(0u, registry->size());
+
+    // No other config shares the predicate, so the built config shares it from now on.
+    EXPECT_TRUE(first.shareConditionStates(registry, config));
+    EXPECT_EQ(1u, registry->size());
+
+    // A second config built aside finds the state already shared and keeps its own.
+    MetricsManager second(ConfigKey(1, kConfigId), config, timeBaseSec, timeBaseSec, uidMap,
+                          pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor,
+                          /*sharedConditions=*/nullptr, /*deferRegistration=*/true);
+    ASSERT_TRUE(second.isConfigValid());
+    EXPECT_FALSE(second.shareConditionStates(registry, config));
+    EXPECT_EQ(1u, registry->size());
+
+    first.stopSharingConditionStates();
+    EXPECT_EQ(0u, registry->size());
+    EXPECT_TRUE(second.shareConditionStates(registry, config));
+    EXPECT_EQ(1u, registry->size());
+}
+
 TEST_P(MetricsManagerTest_SPlus, TestRestrictedMetricsConfig) {
     sp<UidMap> uidMap;
     sp<StatsPullerManager> pullerManager = new StatsPullerManager();
@@ -527,6 +691,256 @@ TEST(MetricsManagerTest, TestGetTriggerMemoryKbUnset) {
     EXPECT_TRUE(metricsManager.isConfigValid());
 }
 
+TEST(MetricsManagerTest, TestScratchBuffersResetBetweenEvents) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_atom_matcher() = CreateAcquireWakelockAtomMatcher();
+    // The combination matcher evaluates the screen off matcher on its own for screen events.
+    AtomMatcher* combinationMatcher = config.add_atom_matcher();
+    combinationMatcher->set_id(StringToId("ScreenChangedOrWakelock"));
+    combinationMatcher->mutable_combination()->set_operation(LogicalOperation::OR);
+    addMatcherToMatcherCombination(CreateScreenTurnedOffAtomMatcher(), combinationMatcher);
+    addMatcherToMatcherCombination(CreateAcquireWakelockAtomMatcher(), combinationMatcher);
+
+    Predicate screenIsOnPredicate = CreateScreenIsOnPredicate();
+    *config.add_predicate() = screenIsOnPredicate;
+    Predicate* screenIsOffPredicate = config.add_predicate();
+    screenIsOffPredicate->set_id(StringToId("ScreenIsNotOn"));
+    screenIsOffPredicate->mutable_combination()->set_operation(LogicalOperation::NOT);
+    addPredicateToPredicateCombination(screenIsOnPredicate, screenIsOffPredicate);
+
+    CountMetric* metric = config.add_count_metric();
+    metric->set_id(StringToId("ScreenOffOrWakelockWhileScreenOff"));
+    metric->set_what(combinationMatcher->id());
+    metric->set_condition(screenIsOffPredicate->id());
+    metric->set_bucket(FIVE_MINUTES);
+
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    ASSERT_TRUE(metricsManager.isConfigValid());
+
+    const int64_t baseTimeNs = timeBaseSec * NS_PER_SEC;
+    vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(CreateScreenStateChangedEvent(baseTimeNs + 1,
+                                                   android::view::DisplayStateEnum::DISPLAY_STATE_ON));
+    events.push_back(CreateAcquireWakelockEvent(baseTimeNs + 2, {1001}, {"tag"}, "wl1"));
+    events.push_back(CreateScreenStateChangedEvent(
+            baseTimeNs + 3, android::view::DisplayStateEnum::DISPLAY_STATE_OFF));
+    events.push_back(CreateAcquireWakelockEvent(baseTimeNs + 4, {1001}, {"tag"}, "wl1"));
+    for (const auto& event : events) {
+        metricsManager.onLogEvent(*event);
+
+        ASSERT_EQ((size_t)config.atom_matcher_size(), metricsManager.mMatcherCacheScratch.size());
+        ASSERT_EQ((size_t)config.predicate_size(), metricsManager.mConditionCacheScratch.size());
+        EXPECT_THAT(metricsManager.mMatcherCacheScratch, Each(MatchingState::kNotComputed));
+        EXPECT_THAT(metricsManager.mMatcherTransformationsScratch, Each(IsNull()));
+        EXPECT_THAT(metricsManager.mIsMatcherTouchedScratch, Each(0));
+        EXPECT_THAT(metricsManager.mConditionCacheScratch, Each(ConditionState::kNotEvaluated));
+        EXPECT_THAT(metricsManager.mChangedCacheScratch, Each(0));
+        EXPECT_THAT(metricsManager.mConditionToBeEvaluatedScratch, Each(0));
+        EXPECT_THAT(metricsManager.mIsConditionTouchedScratch, Each(0));
+        EXPECT_TRUE(metricsManager.mTouchedMatchersScratch.empty());
+        EXPECT_TRUE(metricsManager.mTouchedConditionsScratch.empty());
+        EXPECT_TRUE(metricsManager.mConditionsToEvaluateScratch.empty());
+    }
+
+    // The screen off event and the wakelock acquired after it are counted, the wakelock acquired
+    // while the screen was on is not.
+    sp<CountMetricProducer> countProducer =
+            static_cast<CountMetricProducer*>(metricsManager.mAllMetricProducers[0].get());
+    ASSERT_EQ(1, countProducer->mCurrentSlicedCounter->size());
+    EXPECT_EQ(2, countProducer->mCurrentSlicedCounter->begin()->second);
+}
+
+TEST(MetricsManagerTest, TestConditionDispatchInIndexOrder) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_atom_matcher() = CreateAcquireWakelockAtomMatcher();
+
+    // The combination comes before its child, so its index is lower.
+    Predicate screenIsOnPredicate = CreateScreenIsOnPredicate();
+    Predicate* screenIsOffPredicate = config.add_predicate();
+    screenIsOffPredicate->set_id(StringToId("ScreenIsNotOn"));
+    screenIsOffPredicate->mutable_combination()->set_operation(LogicalOperation::NOT);
+    addPredicateToPredicateCombination(screenIsOnPredicate, screenIsOffPredicate);
+    *config.add_predicate() = screenIsOnPredicate;
+
+    CountMetric* metric = config.add_count_metric();
+    metric->set_id(StringToId("WakelockWhileScreenOff"));
+    metric->set_what(config.atom_matcher(2).id());
+    metric->set_condition(screenIsOffPredicate->id());
+    metric->set_bucket(FIVE_MINUTES);
+
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    ASSERT_TRUE(metricsManager.isConfigValid());
+
+    for (const int matcherIndex : {0, 1}) {
+        const auto conditions = metricsManager.mTrackerToConditionDispatch.targets(matcherIndex);
+        EXPECT_EQ(vector<int>({0, 1}), vector<int>(conditions.begin(), conditions.end()));
+        const auto closure =
+                metricsManager.mTrackerToConditionClosureDispatch.targets(matcherIndex);
+        EXPECT_EQ(vector<int>({0, 1}), vector<int>(closure.begin(), closure.end()));
+    }
+    EXPECT_TRUE(metricsManager.mTrackerToConditionDispatch.targets(2).empty());
+    EXPECT_TRUE(metricsManager.mTrackerToConditionClosureDispatch.targets(2).empty());
+}
+
+TEST(MetricsManagerTest, TestActivationExpiryHeap) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_atom_matcher() = CreateAcquireWakelockAtomMatcher();
+
+    CountMetric* metric = config.add_count_metric();
+    metric->set_id(StringToId("WakelockWhileActive"));
+    metric->set_what(config.atom_matcher(2).id());
+    metric->set_bucket(FIVE_MINUTES);
+
+    MetricActivation* metricActivation = config.add_metric_activation();
+    metricActivation->set_metric_id(metric->id());
+    EventActivation* eventActivation = metricActivation->add_event_activation();
+    eventActivation->set_atom_matcher_id(config.atom_matcher(0).id());
+    eventActivation->set_deactivation_atom_matcher_id(config.atom_matcher(1).id());
+    eventActivation->set_ttl_seconds(10);
+    eventActivation->set_activation_type(ACTIVATE_IMMEDIATELY);
+
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    ASSERT_TRUE(metricsManager.isConfigValid());
+    EXPECT_FALSE(metricsManager.isActive());
+    EXPECT_TRUE(metricsManager.mActivationExpiryHeap.empty());
+
+    const int64_t baseTimeNs = timeBaseSec * NS_PER_SEC;
+    unique_ptr<LogEvent> event = CreateScreenStateChangedEvent(
+            baseTimeNs + 1, android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    metricsManager.onLogEvent(*event);
+    EXPECT_TRUE(metricsManager.isActive());
+    EXPECT_EQ(1, metricsManager.mActiveMetricCount);
+    ASSERT_EQ(1, metricsManager.mActivationExpiryHeap.size());
+    EXPECT_EQ(baseTimeNs + 1 + 10 * NS_PER_SEC, metricsManager.mActivationExpiryHeap.top().first);
+
+    // Activating again moves the expiry later without another heap entry.
+    event = CreateScreenStateChangedEvent(baseTimeNs + 5 * NS_PER_SEC,
+                                          android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    metricsManager.onLogEvent(*event);
+    EXPECT_EQ(1, metricsManager.mActivationExpiryHeap.size());
+
+    // The first entry is out of date, so the metric is rescheduled instead of deactivated.
+    event = CreateAcquireWakelockEvent(baseTimeNs + 12 * NS_PER_SEC, {1001}, {"tag"}, "wl1");
+    metricsManager.onLogEvent(*event);
+    EXPECT_TRUE(metricsManager.isActive());
+    ASSERT_EQ(1, metricsManager.mActivationExpiryHeap.size());
+    EXPECT_EQ(baseTimeNs + 15 * NS_PER_SEC, metricsManager.mActivationExpiryHeap.top().first);
+
+    event = CreateAcquireWakelockEvent(baseTimeNs + 16 * NS_PER_SEC, {1001}, {"tag"}, "wl1");
+    metricsManager.onLogEvent(*event);
+    EXPECT_FALSE(metricsManager.isActive());
+    EXPECT_EQ(0, metricsManager.mActiveMetricCount);
+    EXPECT_TRUE(metricsManager.mActivationExpiryHeap.empty());
+
+    // A cancelled activation leaves its entry behind, which must not deactivate the metric again.
+    event = CreateScreenStateChangedEvent(baseTimeNs + 20 * NS_PER_SEC,
+                                          android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    metricsManager.onLogEvent(*event);
+    event = CreateScreenStateChangedEvent(baseTimeNs + 21 * NS_PER_SEC,
+                                          android::view::DisplayStateEnum::DISPLAY_STATE_OFF);
+    metricsManager.onLogEvent(*event);
+    EXPECT_FALSE(metricsManager.isActive());
+    EXPECT_EQ(0, metricsManager.mActiveMetricCount);
+
+    event = CreateAcquireWakelockEvent(baseTimeNs + 40 * NS_PER_SEC, {1001}, {"tag"}, "wl1");
+    metricsManager.onLogEvent(*event);
+    EXPECT_FALSE(metricsManager.isActive());
+    EXPECT_EQ(0, metricsManager.mActiveMetricCount);
+    EXPECT_TRUE(metricsManager.mActivationExpiryHeap.empty());
+}
+
+TEST(MetricsManagerTest, TestEncodedActiveConfigReusedUntilActivationChanges) {
+    sp<UidMap> uidMap = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> periodicAlarmMonitor;
+
+    StatsdConfig config;
+    config.set_id(kConfigId);
+    config.add_allowed_log_source("AID_SYSTEM");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_atom_matcher() = CreateAcquireWakelockAtomMatcher();
+
+    CountMetric* metric = config.add_count_metric();
+    metric->set_id(StringToId("WakelockWhileActive"));
+    metric->set_what(config.atom_matcher(2).id());
+    metric->set_bucket(FIVE_MINUTES);
+
+    MetricActivation* metricActivation = config.add_metric_activation();
+    metricActivation->set_metric_id(metric->id());
+    EventActivation* eventActivation = metricActivation->add_event_activation();
+    eventActivation->set_atom_matcher_id(config.atom_matcher(0).id());
+    eventActivation->set_deactivation_atom_matcher_id(config.atom_matcher(1).id());
+    eventActivation->set_ttl_seconds(10);
+    eventActivation->set_activation_type(ACTIVATE_IMMEDIATELY);
+
+    MetricsManager metricsManager(kConfigKey, config, timeBaseSec, timeBaseSec, uidMap,
+                                  pullerManager, anomalyAlarmMonitor, periodicAlarmMonitor);
+    ASSERT_TRUE(metricsManager.isConfigValid());
+
+    const int64_t baseTimeNs = timeBaseSec * NS_PER_SEC;
+    const vector<uint8_t> inactiveConfig =
+            metricsManager.getEncodedActiveConfig(baseTimeNs, DEVICE_SHUTDOWN);
+    EXPECT_TRUE(metricsManager.mEncodedActiveConfigKey.has_value());
+    const auto inactiveKey = metricsManager.mEncodedActiveConfigKey;
+    EXPECT_EQ(inactiveConfig, metricsManager.getEncodedActiveConfig(baseTimeNs + NS_PER_SEC,
+                                                                     DEVICE_SHUTDOWN));
+    EXPECT_EQ(inactiveKey, metricsManager.mEncodedActiveConfigKey);
+
+    // A running activation writes its remaining ttl, so it is encoded on each call.
+    unique_ptr<LogEvent> event = CreateScreenStateChangedEvent(
+            baseTimeNs + 1, android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    metricsManager.onLogEvent(*event);
+    const vector<uint8_t>& encoded =
+            metricsManager.getEncodedActiveConfig(baseTimeNs + 4 * NS_PER_SEC, DEVICE_SHUTDOWN);
+    EXPECT_FALSE(metricsManager.mEncodedActiveConfigKey.has_value());
+    ActiveConfig activeConfig;
+    ASSERT_TRUE(activeConfig.ParseFromArray(encoded.data(), encoded.size()));
+    ASSERT_EQ(1, activeConfig.metric_size());
+    ASSERT_EQ(1, activeConfig.metric(0).activation_size());
+    EXPECT_EQ(6 * NS_PER_SEC + 1, activeConfig.metric(0).activation(0).remaining_ttl_nanos());
+
+    // Once cancelled, the encoding is the same as before the activation.
+    event = CreateScreenStateChangedEvent(baseTimeNs + 5 * NS_PER_SEC,
+                                          android::view::DisplayStateEnum::DISPLAY_STATE_OFF);
+    metricsManager.onLogEvent(*event);
+    EXPECT_EQ(inactiveConfig, metricsManager.getEncodedActiveConfig(baseTimeNs + 6 * NS_PER_SEC,
+                                                                     DEVICE_SHUTDOWN));
+    EXPECT_TRUE(metricsManager.mEncodedActiveConfigKey.has_value());
+    EXPECT_NE(inactiveKey, metricsManager.mEncodedActiveConfigKey);
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -31,6 +31,8 @@ constexpr uint32_t kTestPid = 1002;
 constexpr int kEventCount = 1000;
 constexpr int kEventFilteredCount = 500;
 constexpr int kAtomId = 1000;
+// Events of atoms not in use only get half of the queue, see LogEventQueue.
+constexpr int kQueueSize = kEventCount * 2;
 
 class AStatsEventWrapper final {
     AStatsEvent* statsEvent = nullptr;
@@ -73,7 +75,7 @@ protected:
 
 public:
     SocketParseMessageTest()
-        : mEventQueue(std::make_shared<LogEventQueue>(kEventCount /*buffer limit*/)),
+        : mEventQueue(std::make_shared<LogEventQueue>(kQueueSize /*buffer limit*/)),
           mLogEventFilter(std::make_shared<LogEventFilter>()) {
         mLogEventFilter->setFilteringEnabled(GetParam());
     }
@@ -93,7 +95,7 @@ TEST_P(SocketParseMessageTest, TestProcessMessage) {
 
     int64_t lastEventTs = 0;
     // check content of the queue
-    EXPECT_EQ(kEventCount, mEventQueue->mQueue.size());
+    EXPECT_EQ(kEventCount, mEventQueue->size());
     for (int i = 0; i < kEventCount; i++) {
         auto logEvent = mEventQueue->waitPop();
         EXPECT_TRUE(logEvent->isValid());
@@ -102,7 +104,7 @@ TEST_P(SocketParseMessageTest, TestProcessMessage) {
         lastEventTs = logEvent->GetElapsedTimestampNs();
     }
 
-    EXPECT_EQ(StatsdStats::getInstance().mEventQueueMaxSizeObserved, kEventCount);
+    EXPECT_EQ(StatsdStats::getInstance().mEventQueueMaxSizeObserved.load(), kEventCount);
     EXPECT_EQ(StatsdStats::getInstance().mEventQueueMaxSizeObservedElapsedNanos, lastEventTs);
 }
 
@@ -112,7 +114,7 @@ TEST_P(SocketParseMessageTest, TestProcessMessageEmptySetExplicitSet) {
     generateAtomLogging(mEventQueue, mLogEventFilter, kEventCount, kAtomId);
 
     // check content of the queue
-    EXPECT_EQ(kEventCount, mEventQueue->mQueue.size());
+    EXPECT_EQ(kEventCount, mEventQueue->size());
     for (int i = 0; i < kEventCount; i++) {
         auto logEvent = mEventQueue->waitPop();
         EXPECT_TRUE(logEvent->isValid());
@@ -123,7 +125,7 @@ TEST_P(SocketParseMessageTest, TestProcessMessageEmptySetExplicitSet) {
 
 TEST(SocketParseMessageTest, TestProcessMessageFilterCompleteSet) {
     std::shared_ptr<LogEventQueue> eventQueue =
-            std::make_shared<LogEventQueue>(kEventCount /*buffer limit*/);
+            std::make_shared<LogEventQueue>(kQueueSize /*buffer limit*/);
 
     std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
 
@@ -136,7 +138,7 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterCompleteSet) {
     generateAtomLogging(eventQueue, logEventFilter, kEventCount, kAtomId);
 
     // check content of the queue
-    EXPECT_EQ(kEventCount, eventQueue->mQueue.size());
+    EXPECT_EQ(kEventCount, eventQueue->size());
     for (int i = 0; i < kEventCount; i++) {
         auto logEvent = eventQueue->waitPop();
         EXPECT_TRUE(logEvent->isValid());
@@ -147,7 +149,7 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterCompleteSet) {
 
 TEST(SocketParseMessageTest, TestProcessMessageFilterPartialSet) {
     std::shared_ptr<LogEventQueue> eventQueue =
-            std::make_shared<LogEventQueue>(kEventCount /*buffer limit*/);
+            std::make_shared<LogEventQueue>(kQueueSize /*buffer limit*/);
 
     std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
 
@@ -160,7 +162,7 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterPartialSet) {
     generateAtomLogging(eventQueue, logEventFilter, kEventCount, kAtomId);
 
     // check content of the queue
-    EXPECT_EQ(kEventCount, eventQueue->mQueue.size());
+    EXPECT_EQ(kEventCount, eventQueue->size());
     for (int i = 0; i < kEventFilteredCount; i++) {
         auto logEvent = eventQueue->waitPop();
         EXPECT_TRUE(logEvent->isValid());
@@ -178,7 +180,7 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterPartialSet) {
 
 TEST(SocketParseMessageTest, TestProcessMessageFilterToggle) {
     std::shared_ptr<LogEventQueue> eventQueue =
-            std::make_shared<LogEventQueue>(kEventCount * 3 /*buffer limit*/);
+            std::make_shared<LogEventQueue>(kQueueSize * 3 /*buffer limit*/);
 
     std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
 
@@ -208,7 +210,7 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterToggle) {
     generateAtomLogging(eventQueue, logEventFilter, kEventCount, kAtomId + kEventCount * 2);
 
     // check content of the queue
-    EXPECT_EQ(kEventCount * 3, eventQueue->mQueue.size());
+    EXPECT_EQ(kEventCount * 3, eventQueue->size());
     // events with ids from kAtomId to kAtomId + kEventFilteredCount should not be skipped
     for (int i = 0; i < kEventFilteredCount; i++) {
         auto logEvent = eventQueue->waitPop();
@@ -253,6 +255,238 @@ TEST(SocketParseMessageTest, TestProcessMessageFilterToggle) {
     }
 }
 
+namespace {
+
+void appendBatchRecord(std::vector<uint8_t>& batch, int atomId) {
+    AStatsEventWrapper event(atomId);
+    auto [buf, size] = event.getBuffer();
+    const uint16_t recordSize = size;
+    const uint8_t* sizeBytes = reinterpret_cast<const uint8_t*>(&recordSize);
+    batch.insert(batch.end(), sizeBytes, sizeBytes + sizeof(recordSize));
+    batch.insert(batch.end(), buf, buf + size);
+}
+
+}  //  namespace
+
+TEST(SocketParseMessageTest, TestParseBatchedMessage) {
+    std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
+    logEventFilter->setFilteringEnabled(false);
+
+    std::vector<uint8_t> batch;
+    for (int i = 0; i < 3; i++) {
+        appendBatchRecord(batch, kAtomId + i);
+    }
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    StatsSocketListener::parseBatchedMessage(batch.data(), batch.size(), kTestUid, kTestPid,
+                                             logEventFilter, events);
+
+    ASSERT_EQ(3, events.size());
+    for (int i = 0; i < 3; i++) {
+        EXPECT_TRUE(events[i]->isValid());
+        EXPECT_EQ(kAtomId + i, events[i]->GetTagId());
+        EXPECT_EQ((int32_t)kTestUid, events[i]->GetUid());
+        EXPECT_EQ((int32_t)kTestPid, events[i]->GetPid());
+    }
+}
+
+TEST(SocketParseMessageTest, TestParseBatchedMessageTruncated) {
+    std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
+    logEventFilter->setFilteringEnabled(false);
+
+    std::vector<uint8_t> batch;
+    appendBatchRecord(batch, kAtomId);
+    appendBatchRecord(batch, kAtomId + 1);
+    // The size prefix of the second record now runs past the end of the message.
+    batch.pop_back();
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    StatsSocketListener::parseBatchedMessage(batch.data(), batch.size(), kTestUid, kTestPid,
+                                             logEventFilter, events);
+
+    ASSERT_EQ(1, events.size());
+    EXPECT_EQ(kAtomId, events[0]->GetTagId());
+}
+
+TEST(SocketParseMessageTest, TestParseBatchedMessageRateLimited) {
+    std::shared_ptr<LogEventFilter> logEventFilter = std::make_shared<LogEventFilter>();
+    logEventFilter->setFilteringEnabled(false);
+    const uint32_t appUid = 10001;
+
+    std::vector<uint8_t> batch;
+    for (int i = 0; i < 5; i++) {
+        appendBatchRecord(batch, kAtomId + i);
+    }
+
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 1, /* burstSize */ 3);
+    std::vector<std::unique_ptr<LogEvent>> events;
+    StatsSocketListener::parseBatchedMessage(batch.data(), batch.size(), appUid, kTestPid,
+                                             logEventFilter, events, &rateLimiter);
+
+    // The records over the burst size are dropped.
+    ASSERT_EQ(3, events.size());
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(kAtomId + i, events[i]->GetTagId());
+    }
+
+    // System uids are not limited.
+    events.clear();
+    StatsSocketListener::parseBatchedMessage(batch.data(), batch.size(), kTestUid, kTestPid,
+                                             logEventFilter, events, &rateLimiter);
+    EXPECT_EQ(5, events.size());
+}
+
+namespace {
+
+// Must be kept in sync with libstatssocket's stats_buffer_writer.c.
+constexpr uint32_t kStatsEventTag = 1937006964;
+constexpr uint32_t kStatsEventBatchTag = 1937006965;
+
+void sendDatagram(int socket, uint32_t tag, const uint8_t* payload, size_t size) {
+    std::vector<uint8_t> datagram(sizeof(android_log_header_t));
+    const uint8_t* tagBytes = reinterpret_cast<const uint8_t*>(&tag);
+    datagram.insert(datagram.end(), tagBytes, tagBytes + sizeof(tag));
+    datagram.insert(datagram.end(), payload, payload + size);
+    ASSERT_EQ((ssize_t)datagram.size(), send(socket, datagram.data(), datagram.size(), 0));
+}
+
+void sendAtom(int socket, int atomId) {
+    AStatsEventWrapper event(atomId);
+    auto [buf, size] = event.getBuffer();
+    sendDatagram(socket, kStatsEventTag, buf, size);
+}
+
+// Returns the atom id of each datagram received on the socket, -1 for a batched datagram. The
+// samples of the atoms not in use are only counted in sampledCount.
+std::vector<int> receiveAtomIds(int socket, int* sampledCount = nullptr) {
+    std::vector<int> atomIds;
+    std::vector<uint8_t> buffer(LOGGER_ENTRY_MAX_PAYLOAD);
+    while (true) {
+        const ssize_t size = recv(socket, buffer.data(), buffer.size(), MSG_DONTWAIT);
+        if (size <= (ssize_t)(sizeof(android_log_header_t) + sizeof(uint32_t))) {
+            return atomIds;
+        }
+        if (size == StatsSocketListener::kSampledAtomSize) {
+            if (sampledCount != nullptr) {
+                (*sampledCount)++;
+            }
+            continue;
+        }
+        const uint8_t* msg = buffer.data() + sizeof(android_log_header_t);
+        uint32_t tag;
+        memcpy(&tag, msg, sizeof(tag));
+        if (tag == kStatsEventBatchTag) {
+            atomIds.push_back(-1);
+            continue;
+        }
+        LogEvent event(kTestUid, kTestPid);
+        event.parseHeader(msg + sizeof(tag), size - sizeof(android_log_header_t) - sizeof(tag));
+        atomIds.push_back(event.GetTagId());
+    }
+}
+
+}  //  namespace
+
+TEST(SocketAtomFilterTest, TestDropsAtomsNotInUse) {
+    int sockets[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets));
+
+    LogEventFilter::AtomIdSet atomIds = {kAtomId, kAtomId + 2};
+    StatsSocketListener::updateAtomFilter(sockets[1], &atomIds);
+
+    sendAtom(sockets[0], kAtomId);
+    sendAtom(sockets[0], kAtomId + 1);
+    sendAtom(sockets[0], kAtomId + 2);
+    sendAtom(sockets[0], util::STATS_SOCKET_LOSS_REPORTED);
+    std::vector<uint8_t> batch;
+    appendBatchRecord(batch, kAtomId + 1);
+    sendDatagram(sockets[0], kStatsEventBatchTag, batch.data(), batch.size());
+    EXPECT_EQ(std::vector<int>({kAtomId, kAtomId + 2, util::STATS_SOCKET_LOSS_REPORTED, -1}),
+              receiveAtomIds(sockets[1]));
+
+    // Without atom ids every datagram is kept.
+    StatsSocketListener::updateAtomFilter(sockets[1], nullptr);
+    sendAtom(sockets[0], kAtomId + 1);
+    EXPECT_EQ(std::vector<int>({kAtomId + 1}), receiveAtomIds(sockets[1]));
+
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
+TEST(SocketAtomFilterTest, TestSampledAtomsNotInUse) {
+    int sockets[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets));
+
+    LogEventFilter::AtomIdSet atomIds = {kAtomId};
+    StatsSocketListener::updateAtomFilter(sockets[1], &atomIds);
+
+    // Received in rounds, so that the samples do not fill the socket.
+    const int rounds = 32;
+    int sampledCount = 0;
+    for (int i = 0; i < rounds; i++) {
+        for (uint32_t j = 0; j < StatsSocketListener::kAtomFilterSampleRate; j++) {
+            sendAtom(sockets[0], kAtomId + 1);
+        }
+        EXPECT_TRUE(receiveAtomIds(sockets[1], &sampledCount).empty());
+    }
+    // rounds on average, none at all is next to impossible.
+    EXPECT_GT(sampledCount, 0);
+    EXPECT_LT(sampledCount, rounds * 4);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    // A sample stands for kAtomFilterSampleRate atoms that are logged and skipped.
+    StatsdStats::getInstance().reset();
+    AStatsEventWrapper event(kAtomId + 1);
+    auto [buf, size] = event.getBuffer();
+    std::vector<uint8_t> datagram(sizeof(android_log_header_t));
+    const uint8_t* tagBytes = reinterpret_cast<const uint8_t*>(&kStatsEventTag);
+    datagram.insert(datagram.end(), tagBytes, tagBytes + sizeof(kStatsEventTag));
+    datagram.insert(datagram.end(), buf, buf + size);
+    ASSERT_GT(datagram.size(), StatsSocketListener::kSampledAtomSize);
+    struct msghdr hdr = {};
+    std::vector<std::unique_ptr<LogEvent>> events;
+    StatsSocketListener::processDatagram(datagram.data(), StatsSocketListener::kSampledAtomSize,
+                                         &hdr, std::make_shared<LogEventFilter>(), events);
+    EXPECT_TRUE(events.empty());
+    const auto& stats = StatsdStats::getInstance().mNonPlatformPushedAtomStats[kAtomId + 1];
+    EXPECT_EQ(StatsSocketListener::kAtomFilterSampleRate, stats.logCount);
+    EXPECT_EQ(StatsSocketListener::kAtomFilterSampleRate, stats.skipCount);
+}
+
+TEST(SocketAtomFilterTest, TestLargeAtomIdSet) {
+    int sockets[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets));
+
+    // Even atom ids only.
+    LogEventFilter::AtomIdSet atomIds;
+    for (int i = 0; i < 2000; i++) {
+        atomIds.insert(kAtomId + 2 * i);
+    }
+    const std::vector<sock_filter> program = StatsSocketListener::buildAtomFilter(atomIds);
+    ASSERT_FALSE(program.empty());
+    EXPECT_LE(program.size(), StatsSocketListener::kMaxAtomFilterSize);
+    StatsSocketListener::updateAtomFilter(sockets[1], &atomIds);
+
+    std::vector<int> expectedAtomIds;
+    for (int atomId = kAtomId - 1; atomId <= kAtomId + 4000; atomId += 7) {
+        sendAtom(sockets[0], atomId);
+        if (atomIds.count(atomId) > 0) {
+            expectedAtomIds.push_back(atomId);
+        }
+    }
+    EXPECT_EQ(expectedAtomIds, receiveAtomIds(sockets[1]));
+
+    for (int i = 2000; i < 5000; i++) {
+        atomIds.insert(kAtomId + 2 * i);
+    }
+    EXPECT_TRUE(StatsSocketListener::buildAtomFilter(atomIds).empty());
+
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
 // TODO: tests for setAtomIds() with multiple consumers
 // TODO: use MockLogEventFilter to test different sets from different consumers
 
@@ -14,12 +14,15 @@
 
 #include "StatsLogProcessor.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
+#include <arpa/inet.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <stdio.h>
 
 #include "StatsService.h"
+#include "condition/SimpleConditionTracker.h"
 #include "config/ConfigKey.h"
 #include "guardrail/StatsdStats.h"
 #include "logd/LogEvent.h"
@@ -45,6 +48,7 @@ using android::base::StringPrintf;
 using android::util::ProtoOutputStream;
 
 using ::testing::Expectation;
+using ::testing::UnorderedElementsAre;
 
 #ifdef __ANDROID__
 #define STATS_DATA_DIR "/data/misc/stats-data"
@@ -74,7 +78,7 @@ public:
     MOCK_METHOD(void, onDumpReport,
                 (const int64_t dumpTimeNs, const int64_t wallClockNs,
                  const bool include_current_partial_bucket, const bool erase_data,
-                 const DumpLatency dumpLatency, std::set<string>* str_set,
+                 const DumpLatency dumpLatency, StringSet* str_set,
                  android::util::ProtoOutputStream* protoOutput),
                 (override));
 };
@@ -214,7 +218,7 @@ public:
     MOCK_METHOD(void, onDumpReport,
                 (const int64_t dumpTimeNs, const int64_t wallClockNs,
                  const bool include_current_partial_bucket, const bool erase_data,
-                 const DumpLatency dumpLatency, std::set<string>* str_set,
+                 const DumpLatency dumpLatency, StringSet* str_set,
                  android::util::ProtoOutputStream* protoOutput),
                 (override));
     MOCK_METHOD(size_t, byteSize, (), (override));
@@ -304,6 +308,36 @@ TEST(StatsLogProcessorTest, TestEmptyConfigHasNoUidMap) {
     EXPECT_FALSE(output.reports(0).has_uid_map());
 }
 
+TEST(StatsLogProcessorTest, TestConfigsUpdatedTogether) {
+    StatsdConfig config;
+    config.add_allowed_log_source("AID_ROOT");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_count_metric() =
+            createCountMetric("Count", config.atom_matcher(0).id(), nullopt, {});
+    map<ConfigKey, StatsdConfig> configs = {{ConfigKey(3, 4), config}, {ConfigKey(3, 5), config}};
+
+    sp<UidMap> m = new UidMap();
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    sp<AlarmMonitor> anomalyAlarmMonitor;
+    sp<AlarmMonitor> subscriberAlarmMonitor;
+    std::shared_ptr<MockLogEventFilter> mockLogEventFilter = std::make_shared<MockLogEventFilter>();
+    EXPECT_CALL(*mockLogEventFilter, setAtomIds(StatsLogProcessor::getDefaultAtomIdSet(), _))
+            .Times(1);
+    StatsLogProcessor p(
+            m, pullerManager, anomalyAlarmMonitor, subscriberAlarmMonitor, 0,
+            [](const ConfigKey& key) { return true; },
+            [](const int&, const vector<int64_t>&) { return true; },
+            [](const ConfigKey&, const string&, const vector<int64_t>&) {}, mockLogEventFilter);
+
+    // The filter is updated once for all of the configs.
+    EXPECT_CALL(*mockLogEventFilter, setAtomIds(CreateAtomIdSetFromConfig(config), &p)).Times(1);
+    p.OnConfigsUpdated(1, configs);
+
+    vector<int64_t> activeConfigs;
+    p.GetActiveConfigs(/*uid=*/3, activeConfigs);
+    EXPECT_THAT(activeConfigs, UnorderedElementsAre(4, 5));
+}
+
 TEST(StatsLogProcessorTest, TestReportIncludesSubConfig) {
     // Setup simple config key corresponding to empty config.
     ConfigKey key(3, 4);
@@ -394,6 +428,118 @@ TEST(StatsLogProcessorTest, TestOnDumpReportEraseData) {
     EXPECT_TRUE(noData);
 }
 
+TEST(StatsLogProcessorTest, TestSpilledPastBucketsMergedIntoReport) {
+    StatsdConfig config;
+    auto wakelockAcquireMatcher = CreateAcquireWakelockAtomMatcher();
+    *config.add_atom_matcher() = wakelockAcquireMatcher;
+
+    auto countMetric = config.add_count_metric();
+    countMetric->set_id(123456);
+    countMetric->set_what(wakelockAcquireMatcher.id());
+    countMetric->set_bucket(FIVE_MINUTES);
+    const int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(FIVE_MINUTES) * 1000000LL;
+
+    ConfigKey cfgKey;
+    sp<StatsLogProcessor> processor = CreateStatsLogProcessor(1, 1, config, cfgKey);
+
+    std::vector<int> attributionUids = {111};
+    std::vector<string> attributionTags = {"App1"};
+    std::unique_ptr<LogEvent> event =
+            CreateAcquireWakelockEvent(2, attributionUids, attributionTags, "wl1");
+    processor->OnLogEvent(event.get());
+    event = CreateAcquireWakelockEvent(bucketSizeNs + 2, attributionUids, attributionTags, "wl1");
+    processor->OnLogEvent(event.get());
+
+    // Only the closed first bucket is spilled.
+    ASSERT_TRUE(processor->spillPastBucketsLocked(cfgKey, *processor->mMetricsManagers[cfgKey],
+                                                  bucketSizeNs + 3));
+    StorageManager::waitForPendingWrites();
+
+    vector<uint8_t> bytes;
+    processor->onDumpReport(cfgKey, bucketSizeNs + 4, true, true /* erase data */, ADB_DUMP, FAST,
+                            &bytes);
+    ConfigMetricsReportList output;
+    output.ParseFromArray(bytes.data(), bytes.size());
+    ASSERT_EQ(output.reports_size(), 2);
+
+    for (const ConfigMetricsReport& report : output.reports()) {
+        ASSERT_EQ(report.metrics_size(), 1);
+        ASSERT_EQ(report.metrics(0).count_metrics().data_size(), 1);
+        const CountMetricData& data = report.metrics(0).count_metrics().data(0);
+        ASSERT_EQ(data.bucket_info_size(), 1);
+        EXPECT_EQ(data.bucket_info(0).count(), 1);
+        if (report.dump_report_reason() == PAST_BUCKETS_SPILLED) {
+            // The uid map changes are left for the report that follows.
+            EXPECT_FALSE(report.has_uid_map());
+            EXPECT_EQ(data.bucket_info(0).start_bucket_elapsed_nanos(), 1);
+        } else {
+            EXPECT_EQ(report.dump_report_reason(), ADB_DUMP);
+            EXPECT_TRUE(report.has_uid_map());
+            EXPECT_EQ(report.last_report_elapsed_nanos(), bucketSizeNs + 3);
+            EXPECT_EQ(data.bucket_info(0).start_bucket_elapsed_nanos(), bucketSizeNs + 1);
+        }
+    }
+}
+
+TEST(StatsLogProcessorTest, TestOnDumpReportToFd) {
+    StatsdConfig config;
+    auto wakelockAcquireMatcher = CreateAcquireWakelockAtomMatcher();
+    *config.add_atom_matcher() = wakelockAcquireMatcher;
+    auto countMetric = config.add_count_metric();
+    countMetric->set_id(123456);
+    countMetric->set_what(wakelockAcquireMatcher.id());
+    countMetric->set_bucket(FIVE_MINUTES);
+
+    ConfigKey cfgKey;
+    // Removes any reports that were persisted on disk.
+    ProtoOutputStream proto;
+    StorageManager::appendConfigMetricsReport(cfgKey, &proto, /*erase data=*/true,
+                                              /*isAdb=*/false);
+    sp<StatsLogProcessor> processor = CreateStatsLogProcessor(1, 1, config, cfgKey);
+
+    std::unique_ptr<LogEvent> event =
+            CreateAcquireWakelockEvent(2 /*timestamp*/, {111}, {"App1"}, "wl1");
+    processor->OnLogEvent(event.get());
+
+    vector<uint8_t> bytes;
+    processor->onDumpReport(cfgKey, 3, /*wallClockNs=*/10, true, false /* Do NOT erase data. */,
+                            ADB_DUMP, FAST, &bytes);
+
+    // The report written to the fd is the one that would have been returned.
+    TemporaryFile file;
+    ASSERT_TRUE(processor->onDumpReport(cfgKey, 3, /*wallClockNs=*/10, true,
+                                        false /* Do NOT erase data. */, ADB_DUMP, FAST,
+                                        /*writeSizePrefix=*/false, file.fd));
+    string fileBytes;
+    ASSERT_TRUE(android::base::ReadFileToString(file.path, &fileBytes));
+    EXPECT_EQ(string(bytes.begin(), bytes.end()), fileBytes);
+
+    // Dump report WITH erasing data, preceded by its size as getDataFd does.
+    TemporaryFile erasedFile;
+    ASSERT_TRUE(processor->onDumpReport(cfgKey, 4, /*wallClockNs=*/20, true,
+                                        true /* DO erase data. */, ADB_DUMP, FAST,
+                                        /*writeSizePrefix=*/true, erasedFile.fd));
+    ASSERT_TRUE(android::base::ReadFileToString(erasedFile.path, &fileBytes));
+    uint32_t reportSizeBE;
+    ASSERT_GE(fileBytes.size(), sizeof(reportSizeBE));
+    memcpy(&reportSizeBE, fileBytes.data(), sizeof(reportSizeBE));
+    EXPECT_EQ(ntohl(reportSizeBE), fileBytes.size() - sizeof(reportSizeBE));
+    ConfigMetricsReportList output;
+    ASSERT_TRUE(output.ParseFromArray(fileBytes.data() + sizeof(reportSizeBE),
+                                      fileBytes.size() - sizeof(reportSizeBE)));
+    ASSERT_EQ(output.reports_size(), 1);
+    ASSERT_EQ(output.reports(0).metrics_size(), 1);
+    ASSERT_EQ(output.reports(0).metrics(0).count_metrics().data_size(), 1);
+    EXPECT_EQ(output.report_number(), 1);
+
+    // Dump report again. There should be no data since we erased it.
+    processor->onDumpReport(cfgKey, 5, true, true /* DO erase data. */, ADB_DUMP, FAST, &bytes);
+    output.ParseFromArray(bytes.data(), bytes.size());
+    bool noData = output.reports_size() == 0 || output.reports(0).metrics_size() == 0 ||
+                  output.reports(0).metrics(0).count_metrics().data_size() == 0;
+    EXPECT_TRUE(noData);
+}
+
 TEST(StatsLogProcessorTest, TestPullUidProviderSetOnConfigUpdate) {
     // Setup simple config key corresponding to empty config.
     ConfigKey key(3, 4);
@@ -426,6 +572,33 @@ TEST(StatsLogProcessorTest, TestPullUidProviderSetOnConfigUpdate) {
     EXPECT_EQ(pullerManager->mPullUidProviders.find(key), pullerManager->mPullUidProviders.end());
 }
 
+TEST(StatsLogProcessorTest, TestPrebuiltConfigSharingLivePredicateRebuilt) {
+    StatsdConfig config;
+    config.add_allowed_log_source("AID_ROOT");
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    *config.add_atom_matcher() = CreateScreenTurnedOffAtomMatcher();
+    *config.add_predicate() = CreateScreenIsOnPredicate();
+    *config.add_count_metric() = createCountMetric("Count", config.atom_matcher(0).id(),
+                                                   config.predicate(0).id(), /* states */ {});
+
+    const ConfigKey firstKey(3, 4);
+    const ConfigKey secondKey(3, 5);
+    sp<StatsLogProcessor> processor = CreateStatsLogProcessor(0, 0, config, firstKey);
+    ASSERT_EQ(1u, processor->mSharedConditions->size());
+
+    // The second config is built aside from a private state, which it can no longer adopt once
+    // installed next to the first config. It is then rebuilt under the lock and shares the state.
+    processor->OnConfigUpdated(1, secondKey, config);
+    ASSERT_EQ(2u, processor->mMetricsManagers.size());
+    const sp<MetricsManager>& first = processor->mMetricsManagers[firstKey];
+    const sp<MetricsManager>& second = processor->mMetricsManagers[secondKey];
+    ASSERT_TRUE(second->isConfigValid());
+    EXPECT_EQ(1u, processor->mSharedConditions->size());
+    EXPECT_EQ(processor->mSharedConditions, second->mSharedConditions);
+    EXPECT_EQ(static_cast<SimpleConditionTracker*>(first->mAllConditionTrackers[0].get())->mState,
+              static_cast<SimpleConditionTracker*>(second->mAllConditionTrackers[0].get())->mState);
+}
+
 TEST(StatsLogProcessorTest, InvalidConfigRemoved) {
     ConfigKey key(3, 4);
     StatsdConfig config = MakeConfig(true);
@@ -479,6 +652,55 @@ TEST(StatsLogProcessorTest, InvalidConfigRemoved) {
     StorageManager::deleteSuffixedFiles(STATS_DATA_DIR, suffix.c_str());
 }
 
+TEST(StatsLogProcessorTest, TestActivationsOnlyLoadedIntoSameConfig) {
+    StatsdConfig config;
+    auto wakelockAcquireMatcher = CreateAcquireWakelockAtomMatcher();
+    *config.add_atom_matcher() = wakelockAcquireMatcher;
+
+    auto countMetric = config.add_count_metric();
+    countMetric->set_id(123456);
+    countMetric->set_what(wakelockAcquireMatcher.id());
+    countMetric->set_bucket(FIVE_MINUTES);
+
+    auto metricActivation = config.add_metric_activation();
+    metricActivation->set_metric_id(countMetric->id());
+    metricActivation->set_activation_type(ACTIVATE_IMMEDIATELY);
+    auto activationTrigger = metricActivation->add_event_activation();
+    activationTrigger->set_atom_matcher_id(wakelockAcquireMatcher.id());
+    activationTrigger->set_ttl_seconds(100);
+
+    ConfigKey cfgKey(1111, 12345);
+    sp<StatsLogProcessor> processor = CreateStatsLogProcessor(1, 1, config, cfgKey);
+    std::vector<int> attributionUids = {111};
+    std::vector<string> attributionTags = {"App1"};
+    std::unique_ptr<LogEvent> event =
+            CreateAcquireWakelockEvent(2, attributionUids, attributionTags, "wl1");
+    processor->OnLogEvent(event.get());
+
+    ProtoOutputStream proto;
+    processor->WriteActiveConfigsToProtoOutputStream(3, DEVICE_SHUTDOWN, &proto);
+    vector<uint8_t> buffer;
+    proto.serializeToVector(&buffer);
+    ActiveConfigList activeConfigList;
+    ASSERT_TRUE(activeConfigList.ParseFromArray(buffer.data(), buffer.size()));
+    ASSERT_EQ(activeConfigList.config_size(), 1);
+    EXPECT_TRUE(activeConfigList.config(0).has_config_hash());
+
+    vector<int64_t> activeConfigs;
+    StatsdConfig updatedConfig = config;
+    updatedConfig.mutable_count_metric(0)->set_bucket(ONE_HOUR);
+    sp<StatsLogProcessor> updatedProcessor =
+            CreateStatsLogProcessor(4, 4, updatedConfig, cfgKey);
+    updatedProcessor->SetConfigsActiveState(activeConfigList, 4);
+    updatedProcessor->GetActiveConfigs(cfgKey.GetUid(), activeConfigs);
+    EXPECT_THAT(activeConfigs, ::testing::IsEmpty());
+
+    sp<StatsLogProcessor> restartedProcessor = CreateStatsLogProcessor(4, 4, config, cfgKey);
+    restartedProcessor->SetConfigsActiveState(activeConfigList, 4);
+    restartedProcessor->GetActiveConfigs(cfgKey.GetUid(), activeConfigs);
+    EXPECT_THAT(activeConfigs, UnorderedElementsAre(cfgKey.GetId()));
+}
+
 TEST(StatsLogProcessorTest, TestActiveConfigMetricDiskWriteRead) {
     int uid = 1111;
 
@@ -2143,13 +2365,243 @@ TEST(StatsLogProcessorTest, TestDumpReportWithoutErasingDataDoesNotUpdateTimesta
     EXPECT_EQ(output.reports(0).last_report_elapsed_nanos(), dumpTime1Ns);
 }
 
+TEST(StatsLogProcessorTest, TestOnLogEventsBatch) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    CountMetric* countMetric = config.add_count_metric();
+    countMetric->set_id(StringToId("ScreenTurnedOnCount"));
+    countMetric->set_what(config.atom_matcher(0).id());
+    countMetric->set_bucket(FIVE_MINUTES);
+
+    const int64_t bucketStartTimeNs = 10 * NS_PER_SEC;
+    ConfigKey cfgKey(3, 4);
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(
+            CreateScreenStateChangedEvent(bucketStartTimeNs + 10, android::view::DISPLAY_STATE_ON));
+    events.push_back(CreateScreenStateChangedEvent(bucketStartTimeNs + 20,
+                                                   android::view::DISPLAY_STATE_OFF));
+    events.push_back(
+            CreateScreenStateChangedEvent(bucketStartTimeNs + 30, android::view::DISPLAY_STATE_ON));
+    processor->OnLogEvents(events);
+
+    vector<uint8_t> bytes;
+    processor->onDumpReport(cfgKey, bucketStartTimeNs + NS_PER_SEC,
+                            true /* include_current_bucket */, true /* erase_data */, ADB_DUMP,
+                            FAST, &bytes);
+    ConfigMetricsReportList reports;
+    ASSERT_TRUE(reports.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_EQ(1, reports.reports_size());
+    ASSERT_EQ(1, reports.reports(0).metrics_size());
+    ASSERT_EQ(1, reports.reports(0).metrics(0).count_metrics().data_size());
+    const CountMetricData& data = reports.reports(0).metrics(0).count_metrics().data(0);
+    ASSERT_EQ(1, data.bucket_info_size());
+    EXPECT_EQ(2, data.bucket_info(0).count());
+}
+
+namespace {
+
+// Reads an APP_CRASH_OCCURRED event the way StatsSocketListener does, with the field mask the
+// filter holds at that time and the body left to the first reader.
+std::unique_ptr<LogEvent> ReadAppCrashEvent(int64_t timestampNs,
+                                            const std::shared_ptr<LogEventFilter>& filter) {
+    AStatsEvent* statsEvent = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(statsEvent, util::APP_CRASH_OCCURRED);
+    AStatsEvent_overwriteTimestamp(statsEvent, timestampNs);
+    AStatsEvent_writeInt32(statsEvent, 1000);
+    AStatsEvent_writeString(statsEvent, "crash");
+    AStatsEvent_writeString(statsEvent, "com.app");
+    AStatsEvent_build(statsEvent);
+    size_t size;
+    const uint8_t* buf = AStatsEvent_getBuffer(statsEvent, &size);
+
+    std::unique_ptr<LogEvent> logEvent = std::make_unique<LogEvent>(/*uid=*/0, /*pid=*/0);
+    const LogEvent::BodyBufferInfo bodyInfo = logEvent->parseHeader(buf, size);
+    EXPECT_TRUE(filter->isAtomInUse(util::APP_CRASH_OCCURRED));
+    logEvent->setFieldMask(filter->getFieldMask(util::APP_CRASH_OCCURRED));
+    logEvent->deferBody(bodyInfo);
+    AStatsEvent_release(statsEvent);
+    return logEvent;
+}
+
+StatsdConfig CreateAppCrashCountConfig(int dimensionField) {
+    StatsdConfig config;
+    *config.add_atom_matcher() =
+            CreateSimpleAtomMatcher("AppCrashMatcher", util::APP_CRASH_OCCURRED);
+    CountMetric* countMetric = config.add_count_metric();
+    countMetric->set_id(StringToId("AppCrashCount"));
+    countMetric->set_what(config.atom_matcher(0).id());
+    countMetric->set_bucket(FIVE_MINUTES);
+    *countMetric->mutable_dimensions_in_what() =
+            CreateDimensions(util::APP_CRASH_OCCURRED, {dimensionField});
+    return config;
+}
+
+}  // namespace
+
+TEST(StatsLogProcessorTest, TestQueuedEventReadsFieldsOfUpdatedConfig) {
+    const int64_t bucketStartTimeNs = 10 * NS_PER_SEC;
+    ConfigKey cfgKey(3, 4);
+    std::shared_ptr<LogEventFilter> filter = std::make_shared<LogEventFilter>();
+    // Slices by uid, so the string fields aren't decoded.
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs,
+                                    CreateAppCrashCountConfig(1 /* uid */), cfgKey, nullptr, 0,
+                                    new UidMap(), filter);
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(ReadAppCrashEvent(bucketStartTimeNs + 10, filter));
+    events.push_back(ReadAppCrashEvent(bucketStartTimeNs + 20, filter));
+    EXPECT_EQ(0u, events[0]->getFieldMask() & (uint64_t(1) << 3));
+
+    // The events are parsed by the parse lanes, without the processor lock.
+    const uint64_t fieldMasksGeneration = processor->widenFieldMasks(events);
+    for (const std::unique_ptr<LogEvent>& event : events) {
+        event->parseDeferredBodyNow();
+    }
+    ASSERT_EQ(1, events[0]->getValues().size());
+
+    // The config is updated to slice by process name before the processor reads them.
+    processor->OnConfigUpdated(bucketStartTimeNs + 5, cfgKey,
+                               CreateAppCrashCountConfig(3 /* process_name */));
+    processor->OnLogEvents(events, fieldMasksGeneration);
+
+    for (const std::unique_ptr<LogEvent>& event : events) {
+        const vector<FieldValue>& values = event->getValues();
+        ASSERT_EQ(2, values.size());
+        EXPECT_EQ(1000, values[0].mValue.int_value);
+        EXPECT_EQ(3, values[1].mField.getPosAtDepth(0));
+        EXPECT_EQ("com.app", values[1].mValue.str_value);
+    }
+
+    vector<uint8_t> bytes;
+    processor->onDumpReport(cfgKey, bucketStartTimeNs + NS_PER_SEC,
+                            true /* include_current_bucket */, true /* erase_data */, ADB_DUMP,
+                            FAST, &bytes);
+    ConfigMetricsReportList reports;
+    ASSERT_TRUE(reports.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_EQ(1, reports.reports_size());
+    ASSERT_EQ(1, reports.reports(0).metrics_size());
+    ASSERT_EQ(1, reports.reports(0).metrics(0).count_metrics().data_size());
+    const CountMetricData& data = reports.reports(0).metrics(0).count_metrics().data(0);
+    ASSERT_EQ(1, data.dimensions_in_what().value_tuple().dimensions_value_size());
+    EXPECT_EQ("com.app", data.dimensions_in_what().value_tuple().dimensions_value(0).value_str());
+    ASSERT_EQ(1, data.bucket_info_size());
+    EXPECT_EQ(2, data.bucket_info(0).count());
+}
+
+TEST(StatsLogProcessorTest, TestAppChangesAppliedInOnePass) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    CountMetric* countMetric = config.add_count_metric();
+    countMetric->set_id(StringToId("ScreenTurnedOnCount"));
+    countMetric->set_what(config.atom_matcher(0).id());
+    countMetric->set_bucket(FIVE_MINUTES);
+    countMetric->set_split_bucket_for_app_upgrade(true);
+
+    const int64_t bucketStartTimeNs = 10 * NS_PER_SEC;
+    ConfigKey cfgKey(3, 4);
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+
+    std::unique_ptr<LogEvent> event =
+            CreateScreenStateChangedEvent(bucketStartTimeNs + 10, android::view::DISPLAY_STATE_ON);
+    processor->OnLogEvent(event.get());
+
+    // Package changes are queued until the next event.
+    processor->notifyAppUpgrade(bucketStartTimeNs + 20, "app1", 1001, 2);
+    processor->notifyAppRemoved(bucketStartTimeNs + 30, "app2", 1002);
+    EXPECT_EQ(2, processor->mPendingAppChanges.size());
+
+    event = CreateScreenStateChangedEvent(bucketStartTimeNs + 40, android::view::DISPLAY_STATE_ON);
+    processor->OnLogEvent(event.get());
+    EXPECT_TRUE(processor->mPendingAppChanges.empty());
+
+    vector<uint8_t> bytes;
+    processor->onDumpReport(cfgKey, bucketStartTimeNs + NS_PER_SEC,
+                            true /* include_current_bucket */, true /* erase_data */, ADB_DUMP,
+                            FAST, &bytes);
+    ConfigMetricsReportList reports;
+    ASSERT_TRUE(reports.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_EQ(1, reports.reports_size());
+    ASSERT_EQ(1, reports.reports(0).metrics_size());
+    ASSERT_EQ(1, reports.reports(0).metrics(0).count_metrics().data_size());
+    // The removal follows the upgrade closely, so it does not split the bucket again.
+    const CountMetricData& data = reports.reports(0).metrics(0).count_metrics().data(0);
+    ASSERT_EQ(2, data.bucket_info_size());
+    EXPECT_EQ(1, data.bucket_info(0).count());
+    EXPECT_EQ(1, data.bucket_info(1).count());
+}
+
+TEST(StatsLogProcessorTest, TestMetadataQueriesWithoutMetricsMutex) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    CountMetric* countMetric = config.add_count_metric();
+    countMetric->set_id(StringToId("ScreenTurnedOnCount"));
+    countMetric->set_what(config.atom_matcher(0).id());
+    countMetric->set_bucket(FIVE_MINUTES);
+
+    const int64_t configAddedTimeNs = 10 * NS_PER_SEC;
+    ConfigKey cfgKey(3, 4);
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(configAddedTimeNs, configAddedTimeNs, config, cfgKey);
+
+    // Event processing holds mMetricsMutex, the queries must not wait for it.
+    std::lock_guard<std::mutex> lock(processor->mMetricsMutex);
+    vector<int64_t> activeConfigs;
+    processor->GetActiveConfigs(cfgKey.GetUid(), activeConfigs);
+    EXPECT_THAT(activeConfigs, UnorderedElementsAre(cfgKey.GetId()));
+    EXPECT_EQ(configAddedTimeNs, processor->getLastReportTimeNs(cfgKey));
+    EXPECT_EQ(0, processor->getLastReportTimeNs(ConfigKey(3, 5)));
+}
+
+TEST(StatsLogProcessorTest, TestLogEventOnlyDispatchedToInterestedConfigs) {
+    StatsdConfig screenConfig;
+    *screenConfig.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    CountMetric* screenMetric = screenConfig.add_count_metric();
+    screenMetric->set_id(StringToId("ScreenTurnedOnCount"));
+    screenMetric->set_what(screenConfig.atom_matcher(0).id());
+    screenMetric->set_bucket(FIVE_MINUTES);
+
+    StatsdConfig crashConfig;
+    *crashConfig.add_atom_matcher() = CreateProcessCrashAtomMatcher();
+    CountMetric* crashMetric = crashConfig.add_count_metric();
+    crashMetric->set_id(StringToId("ProcessCrashCount"));
+    crashMetric->set_what(crashConfig.atom_matcher(0).id());
+    crashMetric->set_bucket(FIVE_MINUTES);
+
+    ConfigKey screenKey(3, 4);
+    ConfigKey crashKey(3, 5);
+    sp<StatsLogProcessor> processor = CreateStatsLogProcessor(1, 1, screenConfig, screenKey);
+    processor->OnConfigUpdated(1, crashKey, crashConfig);
+
+    // The dispatch index is built from the real configs. Swap in mocks to count the dispatches.
+    sp<MockMetricsManager> screenMetricsManager = new MockMetricsManager(screenKey);
+    sp<MockMetricsManager> crashMetricsManager = new MockMetricsManager(crashKey);
+    EXPECT_CALL(*screenMetricsManager, onLogEvent).Times(1);
+    EXPECT_CALL(*crashMetricsManager, onLogEvent).Times(0);
+    processor->mMetricsManagers[screenKey] = screenMetricsManager;
+    processor->mMetricsManagers[crashKey] = crashMetricsManager;
+
+    unique_ptr<LogEvent> screenEvent =
+            CreateScreenStateChangedEvent(2, android::view::DISPLAY_STATE_ON);
+    processor->OnLogEvent(screenEvent.get());
+
+    // No config is interested in this atom.
+    unique_ptr<LogEvent> otherEvent = CreateNonRestrictedLogEvent(123, 3);
+    processor->OnLogEvent(otherEvent.get());
+}
+
 TEST(StatsLogProcessorTest, TestDataCorruptedEnum) {
     ConfigKey cfgKey;
     StatsdConfig config = MakeConfig(true);
     sp<StatsLogProcessor> processor = CreateStatsLogProcessor(1, 1, config, cfgKey);
 
     StatsdStats::getInstance().noteEventQueueOverflow(/*oldestEventTimestampNs=*/0, /*atomId=*/100,
-                                                      /*isSkipped=*/false);
+                                                      /*isSkipped=*/false,
+                                                      EVENT_PRIORITY_NORMAL);
     StatsdStats::getInstance().noteLogLost(/*wallClockTimeSec=*/0, /*count=*/1, /*lastError=*/0,
                                            /*lastTag=*/0, /*uid=*/0, /*pid=*/0);
     vector<uint8_t> bytes;
@@ -2237,8 +2689,15 @@ TEST_F(StatsLogProcessorTestRestricted, TestRestrictedLogEventNotPassed) {
 }
 
 TEST_F(StatsLogProcessorTestRestricted, TestRestrictedLogEventPassed) {
+    // Events are only dispatched to the configs interested in their atom.
+    StatsdConfig config;
+    AtomMatcher atomMatcher = CreateSimpleAtomMatcher("AtomMatcher", 123);
+    *config.add_atom_matcher() = atomMatcher;
+    EventMetric* eventMetric = config.add_event_metric();
+    eventMetric->set_id(StringToId("EventMetric"));
+    eventMetric->set_what(atomMatcher.id());
     sp<StatsLogProcessor> processor = CreateStatsLogProcessor(
-            /*timeBaseNs=*/1, /*currentTimeNs=*/1, StatsdConfig(), mConfigKey);
+            /*timeBaseNs=*/1, /*currentTimeNs=*/1, config, mConfigKey);
     sp<MockRestrictedMetricsManager> metricsManager = new MockRestrictedMetricsManager(mConfigKey);
     EXPECT_CALL(*metricsManager, onLogEvent).Times(1);
 
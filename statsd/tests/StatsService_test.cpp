@@ -19,7 +19,11 @@
 #include <gtest/gtest.h>
 #include <stdio.h>
 
+#include <chrono>
+#include <thread>
+
 #include "config/ConfigKey.h"
+#include "guardrail/StatsdStats.h"
 #include "packages/UidMap.h"
 #include "src/statsd_config.pb.h"
 #include "tests/statsd_test_util.h"
@@ -146,6 +150,50 @@ TEST(StatsServiceTest, TestGetUidFromArgs) {
     EXPECT_FALSE(service->getUidFromArgs(args, 2, uid));
 }
 
+TEST(StatsServiceTest, TestVerboseDumpRateLimit) {
+    const sp<UidMap> uidMap = new UidMap();
+    shared_ptr<StatsService> service = SharedRefBase::make<StatsService>(
+            uidMap, /* queue */ nullptr, std::make_shared<LogEventFilter>());
+    const int64_t intervalNs = StatsService::kMinVerboseDumpIntervalNs;
+
+    EXPECT_TRUE(service->noteVerboseDumpIfAllowed(NS_PER_SEC));
+    EXPECT_FALSE(service->noteVerboseDumpIfAllowed(NS_PER_SEC + 1));
+    EXPECT_FALSE(service->noteVerboseDumpIfAllowed(NS_PER_SEC + intervalNs - 1));
+    EXPECT_TRUE(service->noteVerboseDumpIfAllowed(NS_PER_SEC + intervalNs));
+    EXPECT_FALSE(service->noteVerboseDumpIfAllowed(NS_PER_SEC + intervalNs + 1));
+}
+
+TEST(StatsServiceTest, TestEventsQueuedBeforeStopAreProcessed) {
+    StatsdStats::getInstance().reset();
+    const int atomId = 10001;
+    shared_ptr<LogEventQueue> queue = std::make_shared<LogEventQueue>(/*maxSize=*/100);
+    shared_ptr<StatsService> service = SharedRefBase::make<StatsService>(
+            new UidMap(), queue, std::make_shared<LogEventFilter>());
+
+    {
+        // The reader waits on the processor with the first event, so the other events and the
+        // stop event are popped in the same batch.
+        std::lock_guard<std::mutex> lock(service->mProcessor->mMetricsMutex);
+        std::unique_ptr<LogEvent> event = std::make_unique<LogEvent>(/*uid=*/0, /*pid=*/0);
+        CreateNoValuesLogEvent(event.get(), atomId, NS_PER_SEC);
+        queue->push(std::move(event));
+        while (queue->size() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (int i = 0; i < 10; i++) {
+            event = std::make_unique<LogEvent>(/*uid=*/0, /*pid=*/0);
+            CreateNoValuesLogEvent(event.get(), atomId, NS_PER_SEC);
+            queue->push(std::move(event));
+        }
+        service->stopReadingLogs();
+    }
+    service->mLogsReaderThread->join();
+    // Joined by the destructor of the service.
+    service->mLogsReaderThread = std::make_unique<std::thread>([] {});
+
+    EXPECT_EQ(11, StatsdStats::getInstance().mNonPlatformPushedAtomStats[atomId].logCount);
+}
+
 class StatsServiceStatsdInitTest : public StatsServiceConfigTest,
                                    public testing::WithParamInterface<bool> {
 public:
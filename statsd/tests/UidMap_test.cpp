@@ -19,6 +19,8 @@
 #include <src/uid_data.pb.h>
 #include <stdio.h>
 
+#include <thread>
+
 #include "StatsLogProcessor.h"
 #include "StatsService.h"
 #include "config/ConfigKey.h"
@@ -124,6 +126,47 @@ TEST(UidMapTest, TestIsolatedUID) {
     EXPECT_EQ(101, m->getHostUidOrSelf(101));
 }
 
+TEST(UidMapTest, TestIsolatedUidsAcrossThreads) {
+    const sp<UidMap> uidMap = new UidMap();
+    const sp<UidMap> otherUidMap = new UidMap();
+    uidMap->assignIsolatedUid(101, 100);
+    EXPECT_EQ(100, uidMap->getHostUidOrSelf(101));
+    // Each map has its own table, even after this thread read another one.
+    EXPECT_EQ(101, otherUidMap->getHostUidOrSelf(101));
+
+    int hostUidOnOtherThread = 0;
+    std::thread([&] { hostUidOnOtherThread = uidMap->getHostUidOrSelf(101); }).join();
+    EXPECT_EQ(100, hostUidOnOtherThread);
+
+    // An update on another thread is seen by this thread's next lookup.
+    std::thread([&] { uidMap->assignIsolatedUid(101, 200); }).join();
+    EXPECT_EQ(200, uidMap->getHostUidOrSelf(101));
+    uidMap->removeIsolatedUid(101);
+    EXPECT_EQ(101, uidMap->getHostUidOrSelf(101));
+}
+
+TEST(UidMapTest, TestMapAttributionUidsToHostUids) {
+    const sp<UidMap> uidMap = new UidMap();
+    uidMap->assignIsolatedUid(101, 100);
+    uidMap->assignIsolatedUid(201, 200);
+
+    std::shared_ptr<LogEvent> event = makeAttributionLogEvent(
+            /*atomId=*/10, /*eventTimeNs=*/1, {101, 300, 201}, {"a", "b", "c"}, 1, 2);
+    std::pair<size_t, size_t> indexRange;
+    ASSERT_TRUE(event->hasAttributionChain(&indexRange));
+    uidMap->mapAttributionUidsToHostUids(event->getMutableValues(), indexRange.first,
+                                         indexRange.second);
+
+    vector<int> uids;
+    for (size_t i = indexRange.first; i <= indexRange.second; i++) {
+        const FieldValue& fieldValue = event->getValues()[i];
+        if (isAttributionUidField(fieldValue)) {
+            uids.push_back(fieldValue.mValue.int_value);
+        }
+    }
+    EXPECT_THAT(uids, ElementsAre(100, 300, 200));
+}
+
 TEST(UidMapTest, TestUpdateMap) {
     const sp<UidMap> uidMap = new UidMap();
     const shared_ptr<StatsService> service = SharedRefBase::make<StatsService>(
@@ -257,6 +300,78 @@ TEST(UidMapTest, TestRemoveApp) {
                 UnorderedPointwise(EqPackageInfo(), expectedPackageInfos));
 }
 
+TEST(UidMapTest, TestGetAppUid) {
+    const sp<UidMap> uidMap = new UidMap();
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1000, /*version*/ 1, "v1", kApp1);
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1500, /*version*/ 1, "v1", kApp1);
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1500, /*version*/ 1, "v1", kApp3);
+    uidMap->updateMap(1 /* timestamp */, uidData);
+    EXPECT_THAT(uidMap->getAppUid(kApp1), UnorderedElementsAre(1000, 1500));
+    EXPECT_THAT(uidMap->getAppUid(kApp3), UnorderedElementsAre(1500));
+    EXPECT_THAT(uidMap->getAppUid("not.app"), IsEmpty());
+
+    uidMap->removeApp(2 /* timestamp */, kApp1, 1500);
+    EXPECT_THAT(uidMap->getAppUid(kApp1), UnorderedElementsAre(1000));
+    EXPECT_THAT(uidMap->getAppNamesFromUid(1500, false /* returnNormalized */),
+                UnorderedElementsAre(kApp3));
+
+    // A new snapshot keeps the app deleted.
+    uidMap->updateMap(3 /* timestamp */, uidData);
+    EXPECT_THAT(uidMap->getAppUid(kApp1), UnorderedElementsAre(1000));
+
+    uidMap->updateApp(4 /* timestamp */, kApp1, 1500, /*version*/ 2, "v2", "",
+                      /* certificateHash */ {});
+    uidMap->updateApp(5 /* timestamp */, kApp2, 1000, /*version*/ 1, "v1", "",
+                      /* certificateHash */ {});
+    EXPECT_THAT(uidMap->getAppUid(kApp1), UnorderedElementsAre(1000, 1500));
+    EXPECT_THAT(uidMap->getAppUid(kApp2), UnorderedElementsAre(1000));
+    EXPECT_THAT(uidMap->getAppNamesFromUid(1000, false /* returnNormalized */),
+                UnorderedElementsAre(kApp1, kApp2));
+}
+
+TEST(AidIndexTest, TestLookups) {
+    const AidIndex& aidIndex = AidIndex::getInstance();
+    EXPECT_EQ(0, aidIndex.getUid("AID_ROOT"));
+    EXPECT_EQ(1000, aidIndex.getUid("AID_SYSTEM"));
+    EXPECT_EQ(9999, aidIndex.getUid("AID_NOBODY"));
+    EXPECT_EQ(-1, aidIndex.getUid("not.an.aid"));
+    ASSERT_NE(nullptr, aidIndex.getName(1000));
+    EXPECT_EQ("AID_SYSTEM", *aidIndex.getName(1000));
+    EXPECT_EQ(nullptr, aidIndex.getName(1022));
+    EXPECT_EQ(nullptr, aidIndex.getName(-1));
+    EXPECT_EQ(nullptr, aidIndex.getName(AidIndex::kAppUidStart));
+
+    for (const auto& [name, uid] : UidMap::sAidToUidMapping) {
+        EXPECT_EQ((int)uid, aidIndex.getUid(name)) << name;
+    }
+
+    const AidIndex customIndex({{"AID_A", 5}, {"AID_B", 5}, {"AID_APP", 10001}});
+    ASSERT_NE(nullptr, customIndex.getName(5));
+    EXPECT_EQ("AID_A", *customIndex.getName(5));
+    EXPECT_EQ(5, customIndex.getUid("AID_B"));
+    EXPECT_EQ(-1, customIndex.getUid("AID_APP"));
+}
+
+TEST(AppUidIndexTest, TestNormalizedNamesFollowPackageNames) {
+    AppUidIndex index;
+    index.add(1000, InternedString("com.Example.One"));
+    index.add(1000, InternedString("com.example.two"));
+    index.add(1000, InternedString("com.Example.One"));
+    EXPECT_THAT(index.getPackageNames(1000),
+                ElementsAre(InternedString("com.Example.One"), InternedString("com.example.two")));
+    EXPECT_THAT(index.getNormalizedPackageNames(1000),
+                ElementsAre(InternedString("com.example.one"), InternedString("com.example.two")));
+
+    index.remove(1000, InternedString("com.Example.One"));
+    EXPECT_THAT(index.getPackageNames(1000), ElementsAre(InternedString("com.example.two")));
+    EXPECT_THAT(index.getNormalizedPackageNames(1000),
+                ElementsAre(InternedString("com.example.two")));
+
+    index.remove(1000, InternedString("com.example.two"));
+    EXPECT_TRUE(index.getNormalizedPackageNames(1000).empty());
+}
+
 TEST(UidMapTest, TestUpdateApp) {
     const sp<UidMap> uidMap = new UidMap();
     const shared_ptr<StatsService> service = SharedRefBase::make<StatsService>(
@@ -363,6 +478,24 @@ TEST(UidMapTest, TestRemovedAppRetained) {
     EXPECT_EQ(true, results.snapshots(0).package_info(0).deleted());
 }
 
+TEST(UidMapTest, TestUpdateMapKeepsRemovedAppDeleted) {
+    UidMap m;
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1000, /*version*/ 5, "v5", kApp1);
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1000, /*version*/ 5, "v5", kApp2);
+
+    m.updateMap(1 /* timestamp */, uidData);
+    m.removeApp(2, kApp2, 1000);
+    // A full update that still lists the removed app keeps it deleted.
+    m.updateMap(3 /* timestamp */, uidData);
+
+    EXPECT_TRUE(m.hasApp(1000, kApp1));
+    EXPECT_FALSE(m.hasApp(1000, kApp2));
+    EXPECT_THAT(m.getAppNamesFromUid(1000, true /* returnNormalized */),
+                UnorderedElementsAre(kApp1));
+    EXPECT_THAT(m.getAppUid(kApp2), IsEmpty());
+}
+
 TEST(UidMapTest, TestRemovedAppOverGuardrail) {
     UidMap m;
     // Initialize single config key.
@@ -400,6 +533,107 @@ TEST(UidMapTest, TestRemovedAppOverGuardrail) {
     ASSERT_EQ(maxDeletedApps, results.snapshots(0).package_info_size());
 }
 
+TEST(UidMapTest, TestUnchangedSnapshotOmitted) {
+    UidMap m;
+    ConfigKey config1(1, StringToId("config1"));
+    m.OnConfigUpdated(config1);
+
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1000, /*version*/ 4, "v4", kApp1);
+    m.updateMap(1 /* timestamp */, uidData);
+
+    // The first report has the snapshot, the next one has nothing new.
+    ProtoOutputStream proto1;
+    m.appendUidMap(/* timestamp */ 2, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0,
+                   /* str_set */ nullptr, &proto1, /* omitUnchangedSnapshot */ true);
+    UidMapping results1;
+    outputStreamToProto(&proto1, &results1);
+    EXPECT_EQ(1, results1.snapshots_size());
+
+    StringSet strSet2;
+    ProtoOutputStream proto2;
+    m.appendUidMap(/* timestamp */ 3, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0, &strSet2,
+                   &proto2, /* omitUnchangedSnapshot */ true);
+    UidMapping results2;
+    outputStreamToProto(&proto2, &results2);
+    EXPECT_EQ(0, results2.snapshots_size());
+    EXPECT_EQ(0, results2.changes_size());
+    EXPECT_THAT(strSet2, IsEmpty());
+
+    // A change brings the snapshot back, along with the change itself.
+    m.updateApp(4, kApp2, 1001, 5, "v5", "", /* certificateHash */ {});
+    ProtoOutputStream proto3;
+    m.appendUidMap(/* timestamp */ 5, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0,
+                   /* str_set */ nullptr, &proto3, /* omitUnchangedSnapshot */ true);
+    UidMapping results3;
+    outputStreamToProto(&proto3, &results3);
+    ASSERT_EQ(1, results3.snapshots_size());
+    EXPECT_EQ(2, results3.snapshots(0).package_info_size());
+    EXPECT_EQ(1, results3.changes_size());
+
+    // So does a config update.
+    m.OnConfigUpdated(config1);
+    ProtoOutputStream proto4;
+    m.appendUidMap(/* timestamp */ 6, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0,
+                   /* str_set */ nullptr, &proto4, /* omitUnchangedSnapshot */ true);
+    UidMapping results4;
+    outputStreamToProto(&proto4, &results4);
+    EXPECT_EQ(1, results4.snapshots_size());
+}
+
+TEST(UidMapTest, TestEncodedSnapshotReusedUntilMapChanges) {
+    UidMap m;
+    ConfigKey config1(1, StringToId("config1"));
+    ConfigKey config2(1, StringToId("config2"));
+    m.OnConfigUpdated(config1);
+    m.OnConfigUpdated(config2);
+
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1000, /*version*/ 4, "v4", kApp1);
+    m.updateMap(1 /* timestamp */, uidData);
+
+    StringSet strSet1;
+    ProtoOutputStream proto1;
+    m.appendUidMap(/* timestamp */ 2, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0, &strSet1,
+                   &proto1);
+    StringSet strSet2;
+    ProtoOutputStream proto2;
+    m.appendUidMap(/* timestamp */ 3, config2, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0, &strSet2,
+                   &proto2);
+    EXPECT_EQ(1U, m.mEncodedSnapshots.size());
+
+    UidMapping results1;
+    outputStreamToProto(&proto1, &results1);
+    UidMapping results2;
+    outputStreamToProto(&proto2, &results2);
+    ASSERT_EQ(1, results1.snapshots_size());
+    ASSERT_EQ(1, results2.snapshots_size());
+    EXPECT_EQ(2, results1.snapshots(0).elapsed_timestamp_nanos());
+    EXPECT_EQ(3, results2.snapshots(0).elapsed_timestamp_nanos());
+    ASSERT_EQ(1, results2.snapshots(0).package_info_size());
+    EXPECT_EQ(results1.snapshots(0).package_info(0).SerializeAsString(),
+              results2.snapshots(0).package_info(0).SerializeAsString());
+    EXPECT_EQ(strSet1, strSet2);
+    EXPECT_THAT(strSet2, Contains(kApp1));
+
+    // A change to the map is in the next snapshot.
+    m.updateApp(4, kApp2, 1001, 5, "v5", "", /* certificateHash */ {});
+    ProtoOutputStream proto3;
+    m.appendUidMap(/* timestamp */ 5, config1, /* includeVersionStrings */ true,
+                   /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0,
+                   /* str_set */ nullptr, &proto3);
+    UidMapping results3;
+    outputStreamToProto(&proto3, &results3);
+    ASSERT_EQ(1, results3.snapshots_size());
+    EXPECT_EQ(2, results3.snapshots(0).package_info_size());
+}
+
 TEST(UidMapTest, TestClearingOutput) {
     UidMap m;
 
@@ -512,7 +746,7 @@ TEST(UidMapTest, TestMemoryGuardrail) {
     ASSERT_EQ(1U, m.mChanges.size());
 
     // Now force deletion by limiting the memory to hold one delta change.
-    m.maxBytesOverride = 120; // Since the app string alone requires >45 characters.
+    m.maxBytesOverride = kBytesChangeRecord;
     m.updateApp(5, "EXTREMELY_LONG_STRING_FOR_APP_TO_WASTE_MEMORY.0", 1000, 4, "v4", "",
                 /* certificateHash */ {});
     ASSERT_EQ(1U, m.mChanges.size());
@@ -550,7 +784,7 @@ protected:
 
 TEST_F(UidMapTestAppendUidMap, TestInstallersInReportIncludeInstallerAndHashStrings) {
     ProtoOutputStream proto;
-    set<string> strSet;
+    StringSet strSet;
     uidMap->appendUidMap(/* timestamp */ 3, config1, /* includeVersionStrings */ true,
                          /* includeInstaller */ true, /* truncatedCertificateHashSize */ 0, &strSet,
                          &proto);
@@ -613,13 +847,13 @@ TEST_F(UidMapTestAppendUidMap, TestInstallersInReportIncludeInstallerAndDontHash
                 UnorderedPointwise(EqPackageInfo(), expectedPackageInfos));
 }
 
-// Set up parameterized test with set<string>* parameter to control whether strings are hashed
+// Set up parameterized test with StringSet* parameter to control whether strings are hashed
 // or not in the report. A value of nullptr indicates strings should not be hashed and non-null
 // values indicates strings are hashed in the report and the original strings are added to this set.
 class UidMapTestAppendUidMapHashStrings : public UidMapTestAppendUidMap,
-                                          public WithParamInterface<set<string>*> {
+                                          public WithParamInterface<StringSet*> {
 public:
-    inline static set<string> strSet;
+    inline static StringSet strSet;
 
 protected:
     void SetUp() override {
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "socket/UidRateLimiter.h"
+
+#include <gtest/gtest.h>
+#include <log/log_time.h>
+
+#ifdef __ANDROID__
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int32_t kAppUid = 10001;
+
+// Returns how many of count atoms sent by uid are kept.
+int acquire(UidRateLimiter& rateLimiter, int32_t uid, int count) {
+    int acquired = 0;
+    for (int i = 0; i < count; i++) {
+        acquired += rateLimiter.tryAcquire(uid);
+    }
+    return acquired;
+}
+
+}  // anonymous namespace
+
+TEST(UidRateLimiterTest, TestDisabled) {
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 0, /* burstSize */ 10);
+    EXPECT_FALSE(rateLimiter.isEnabled());
+    EXPECT_EQ(100, acquire(rateLimiter, kAppUid, 100));
+}
+
+TEST(UidRateLimiterTest, TestBurstAndRefill) {
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 10, /* burstSize */ 5);
+    rateLimiter.advanceTo(NS_PER_SEC);
+    EXPECT_EQ(5, acquire(rateLimiter, kAppUid, 10));
+
+    // 10 atoms per second refill one atom in 100ms.
+    rateLimiter.advanceTo(NS_PER_SEC + 250 * 1000000LL);
+    EXPECT_EQ(2, acquire(rateLimiter, kAppUid, 10));
+
+    // The bucket never holds more than the burst size.
+    rateLimiter.advanceTo(100 * NS_PER_SEC);
+    EXPECT_EQ(5, acquire(rateLimiter, kAppUid, 10));
+}
+
+TEST(UidRateLimiterTest, TestUidsAreIndependent) {
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 1, /* burstSize */ 2);
+    rateLimiter.advanceTo(NS_PER_SEC);
+    EXPECT_EQ(2, acquire(rateLimiter, kAppUid, 10));
+    EXPECT_EQ(2, acquire(rateLimiter, kAppUid + 1, 10));
+    // Same app in another user.
+    EXPECT_EQ(2, acquire(rateLimiter, kAppUid + UidRateLimiter::kUserUidOffset, 10));
+}
+
+TEST(UidRateLimiterTest, TestSystemUidsNotLimited) {
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 1, /* burstSize */ 1);
+    rateLimiter.advanceTo(NS_PER_SEC);
+    EXPECT_EQ(10, acquire(rateLimiter, /* AID_SYSTEM */ 1000, 10));
+    EXPECT_EQ(10, acquire(rateLimiter, UidRateLimiter::kUserUidOffset + 1000, 10));
+}
+
+TEST(UidRateLimiterTest, TestMaxTrackedUids) {
+    UidRateLimiter rateLimiter(/* eventsPerSec */ 1, /* burstSize */ 1);
+    rateLimiter.advanceTo(NS_PER_SEC);
+    for (size_t i = 0; i < UidRateLimiter::kMaxTrackedUids; i++) {
+        EXPECT_TRUE(rateLimiter.tryAcquire(kAppUid + i));
+    }
+    EXPECT_EQ(UidRateLimiter::kMaxTrackedUids, rateLimiter.mBuckets.size());
+
+    // The buckets are all in use, so the uids beyond the limit share one.
+    const int32_t untrackedUid = kAppUid + UidRateLimiter::kMaxTrackedUids;
+    EXPECT_EQ(1, acquire(rateLimiter, untrackedUid, 10));
+    EXPECT_EQ(0, acquire(rateLimiter, untrackedUid + 1, 10));
+    EXPECT_EQ(0, acquire(rateLimiter, kAppUid, 10));
+    EXPECT_EQ(UidRateLimiter::kMaxTrackedUids, rateLimiter.mBuckets.size());
+
+    // Once refilled, the buckets make room for the new uid, which is still limited.
+    rateLimiter.advanceTo(3 * NS_PER_SEC);
+    EXPECT_EQ(1, acquire(rateLimiter, untrackedUid + 2, 10));
+    EXPECT_EQ(1, rateLimiter.mBuckets.size());
+    EXPECT_EQ(1, acquire(rateLimiter, kAppUid, 10));
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
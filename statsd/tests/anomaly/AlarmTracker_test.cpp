@@ -20,6 +20,7 @@
 
 #include <vector>
 
+#include "src/anomaly/subscriber_util.h"
 #include "src/subscriber/SubscriberReporter.h"
 #include "tests/statsd_test_util.h"
 
@@ -94,6 +95,26 @@ TEST(AlarmTrackerTest, TestTriggerTimestamp) {
     EXPECT_EQ(tracker.getAlarmTimestampSec(), nextAlarmTime);
 }
 
+TEST(AlarmTrackerTest, TestDeferredAlarm) {
+    sp<AlarmMonitor> subscriberAlarmMonitor = new AlarmMonitor(
+            100, [](const shared_ptr<IStatsCompanionService>&, int64_t) {},
+            [](const shared_ptr<IStatsCompanionService>&) {});
+    Alarm alarm = createAlarm("alarm", /*offsetMillis=*/15 * MS_PER_SEC,
+                              /*periodMillis=*/60 * 60 * MS_PER_SEC);
+    int64_t startMillis = 100000000 * MS_PER_SEC;
+    AlarmTracker tracker(startMillis, startMillis, alarm, kConfigKey, subscriberAlarmMonitor,
+                         /*deferAlarm=*/true);
+    EXPECT_EQ(tracker.getAlarmTimestampSec(), startMillis / MS_PER_SEC + 15);
+    EXPECT_TRUE(subscriberAlarmMonitor->popSoonerThan(UINT32_MAX).empty());
+
+    tracker.registerAlarm();
+    // The alarm is only set once.
+    tracker.registerAlarm();
+    auto firedAlarms = subscriberAlarmMonitor->popSoonerThan(UINT32_MAX);
+    ASSERT_EQ(1u, firedAlarms.size());
+    EXPECT_TRUE(tracker.hasFired(firedAlarms));
+}
+
 TEST(AlarmTrackerTest, TestProbabilityOfInforming) {
     // Initiating StatsdStats at the start of this test, so it doesn't call rand() during the test
     StatsdStats::getInstance();
@@ -143,7 +164,7 @@ TEST(AlarmTrackerTest, TestProbabilityOfInforming) {
     ASSERT_EQ(firedAlarmSet.size(), 3u);
 
     int alarmRandCount = 0, alarmAlwaysCount = 0;
-    // The binder calls here will happen synchronously because they are in-process.
+    // The binder calls here happen on the subscriber dispatcher thread.
     shared_ptr<MockPendingIntentRef> randBroadcast =
             SharedRefBase::make<StrictMock<MockPendingIntentRef>>();
     EXPECT_CALL(*randBroadcast,
@@ -181,6 +202,7 @@ TEST(AlarmTrackerTest, TestProbabilityOfInforming) {
     // 0.96, 0.95, 0.95, 0.94, 0.43, 0.92, 0.92, 0.41, 0.39, 0.88
     for (size_t i = 0; i < 10; i++) {
         trackerRand.informAlarmsFired(currentTimeSec * NS_PER_SEC, firedAlarmSet);
+        waitForSubscriberTriggers();
         if (i <= 3) {
             EXPECT_EQ(alarmRandCount, 0);
         } else if (i >= 4 && i <= 6) {
@@ -191,6 +213,7 @@ TEST(AlarmTrackerTest, TestProbabilityOfInforming) {
             EXPECT_EQ(alarmRandCount, 3);
         }
         trackerAlways.informAlarmsFired(currentTimeSec * NS_PER_SEC, firedAlarmSet);
+        waitForSubscriberTriggers();
         EXPECT_EQ(alarmAlwaysCount, i + 1);
         trackerNever.informAlarmsFired(currentTimeSec * NS_PER_SEC, firedAlarmSet);
 
@@ -18,8 +18,11 @@
 #include <math.h>
 #include <stdio.h>
 
+#include <map>
+#include <random>
 #include <vector>
 
+#include "src/anomaly/subscriber_util.h"
 #include "src/subscriber/SubscriberReporter.h"
 #include "tests/statsd_test_util.h"
 
@@ -151,7 +154,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     std::shared_ptr<DimToValMap> bucket6 = MockBucket({{keyA, 2}});
 
     // Start time with no events.
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0u);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0u);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, -1LL);
 
     // Event from bucket #0 occurs.
@@ -162,7 +165,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
 
     // Adds past bucket #0
     anomalyTracker.addPastBucket(bucket0, 0);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 3u);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 3u);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
@@ -176,7 +179,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
 
     // Adds past bucket #0 again. The sum does not change.
     anomalyTracker.addPastBucket(bucket0, 0);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 3u);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 3u);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
@@ -189,7 +192,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds past bucket #1.
     anomalyTracker.addPastBucket(bucket1, 1);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 1L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 3UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 3UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
@@ -203,7 +206,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds past bucket #1 again. Nothing changes.
     anomalyTracker.addPastBucket(bucket1, 1);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 1L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 3UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 3UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
@@ -216,7 +219,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds past bucket #2.
     anomalyTracker.addPastBucket(bucket2, 2);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 2L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
 
@@ -229,7 +232,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds bucket #3.
     anomalyTracker.addPastBucket(bucket3, 3L);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 3L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
 
@@ -242,7 +245,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds bucket #4.
     anomalyTracker.addPastBucket(bucket4, 4);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 4L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 5LL);
 
@@ -255,7 +258,7 @@ TEST(AnomalyTrackerTest, TestConsecutiveBuckets) {
     // Adds bucket #5.
     anomalyTracker.addPastBucket(bucket5, 5);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 5L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 5LL);
 
@@ -296,7 +299,7 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     int64_t eventTimestamp6 = bucketSizeNs * 27 + 3;
 
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, -1LL);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 9, bucket9, {}, {keyA, keyB, keyC, keyD}));
     detectAndDeclareAnomalies(anomalyTracker, 9, bucket9, eventTimestamp1);
     checkRefractoryTimes(anomalyTracker, eventTimestamp1, refractoryPeriodSec,
@@ -305,15 +308,15 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     // Add past bucket #9
     anomalyTracker.addPastBucket(bucket9, 9);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 9L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 3UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 3UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyA), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 2LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 16, bucket16, {keyB}, {keyA, keyC, keyD}));
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 15L);
     detectAndDeclareAnomalies(anomalyTracker, 16, bucket16, eventTimestamp2);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 15L);
     checkRefractoryTimes(anomalyTracker, eventTimestamp2, refractoryPeriodSec,
             {{keyA, -1}, {keyB, eventTimestamp2}, {keyC, -1}, {keyD, -1}, {keyE, -1}});
@@ -321,27 +324,27 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     // Add past bucket #16
     anomalyTracker.addPastBucket(bucket16, 16);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 16L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 1UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 1UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 4LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 18, bucket18, {keyB}, {keyA, keyC, keyD}));
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 1UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 1UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 4LL);
     // Within refractory period.
     detectAndDeclareAnomalies(anomalyTracker, 18, bucket18, eventTimestamp3);
     checkRefractoryTimes(anomalyTracker, eventTimestamp3, refractoryPeriodSec,
             {{keyA, -1}, {keyB, eventTimestamp2}, {keyC, -1}, {keyD, -1}, {keyE, -1}});
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 1UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 1UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 4LL);
 
     // Add past bucket #18
     anomalyTracker.addPastBucket(bucket18, 18);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 18L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 20, bucket20, {keyB}, {keyA, keyC, keyD}));
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 19L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     detectAndDeclareAnomalies(anomalyTracker, 20, bucket20, eventTimestamp4);
@@ -351,11 +354,11 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     // Add bucket #18 again. Nothing changes.
     anomalyTracker.addPastBucket(bucket18, 18);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 19L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 20, bucket20, {keyB}, {keyA, keyC, keyD}));
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 1LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     detectAndDeclareAnomalies(anomalyTracker, 20, bucket20, eventTimestamp4 + 1);
@@ -366,12 +369,12 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     // Add past bucket #20
     anomalyTracker.addPastBucket(bucket20, 20);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 20L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 2UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 2UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyB), 3LL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyC), 1LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 25, bucket25, {}, {keyA, keyB, keyC, keyD}));
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 24L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     detectAndDeclareAnomalies(anomalyTracker, 25, bucket25, eventTimestamp5);
     checkRefractoryTimes(anomalyTracker, eventTimestamp5, refractoryPeriodSec,
             {{keyA, -1}, {keyB, eventTimestamp4}, {keyC, -1}, {keyD, -1}, {keyE, -1}});
@@ -379,14 +382,14 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     // Add past bucket #25
     anomalyTracker.addPastBucket(bucket25, 25);
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 25L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 1UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 1UL);
     EXPECT_EQ(anomalyTracker.getSumOverPastBuckets(keyD), 1LL);
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 28, bucket28, {},
             {keyA, keyB, keyC, keyD, keyE}));
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 27L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     detectAndDeclareAnomalies(anomalyTracker, 28, bucket28, eventTimestamp6);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     checkRefractoryTimes(anomalyTracker, eventTimestamp6, refractoryPeriodSec,
             {{keyA, -1}, {keyB, -1}, {keyC, -1}, {keyD, -1}, {keyE, -1}});
 
@@ -395,13 +398,88 @@ TEST(AnomalyTrackerTest, TestSparseBuckets) {
     EXPECT_TRUE(detectAnomaliesPass(anomalyTracker, 28, bucket28, {keyE},
             {keyA, keyB, keyC, keyD}));
     EXPECT_EQ(anomalyTracker.mMostRecentBucketNum, 27L);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     detectAndDeclareAnomalies(anomalyTracker, 28, bucket28, eventTimestamp6 + 7);
-    ASSERT_EQ(anomalyTracker.mSumOverPastBuckets.size(), 0UL);
+    ASSERT_EQ(anomalyTracker.getNumDimensionsWithPastData(), 0UL);
     checkRefractoryTimes(anomalyTracker, eventTimestamp6, refractoryPeriodSec,
             {{keyA, -1}, {keyB, -1}, {keyC, -1}, {keyD, -1}, {keyE, eventTimestamp6 + 7}});
 }
 
+TEST(AnomalyTrackerTest, TestSlidingWindowMatchesBucketSums) {
+    const int numBuckets = 8;
+    Alert alert;
+    alert.set_num_buckets(numBuckets);
+    alert.set_trigger_if_sum_gt(1000000);
+    AnomalyTracker anomalyTracker(alert, kConfigKey);
+
+    vector<MetricDimensionKey> keys;
+    for (int i = 0; i < 20; i++) {
+        keys.push_back(getMockMetricDimensionKey(1, "key" + std::to_string(i)));
+    }
+
+    // Reference values of every bucket ever added, by bucket number.
+    std::map<int64_t, DimToValMap> expectedBuckets;
+    auto expectSums = [&](int64_t mostRecentBucketNum) {
+        for (const MetricDimensionKey& key : keys) {
+            int64_t expectedSum = 0;
+            for (int64_t bucketNum = mostRecentBucketNum - numBuckets + 2;
+                 bucketNum <= mostRecentBucketNum; bucketNum++) {
+                auto bucket = expectedBuckets.find(bucketNum);
+                if (bucket == expectedBuckets.end()) {
+                    continue;
+                }
+                auto value = bucket->second.find(key);
+                if (value != bucket->second.end()) {
+                    EXPECT_EQ(value->second, anomalyTracker.getPastBucketValue(key, bucketNum));
+                    expectedSum += value->second;
+                }
+            }
+            EXPECT_EQ(expectedSum, anomalyTracker.getSumOverPastBuckets(key))
+                    << "bucket " << mostRecentBucketNum << " " << key.toString();
+        }
+    };
+
+    std::mt19937 random(7);
+    int64_t bucketNum = 0;
+    for (int round = 0; round < 200; round++) {
+        // Skip some buckets, including more than the whole window now and then.
+        bucketNum += (round % 50 == 49) ? numBuckets + 1 : 1 + random() % 3;
+        std::shared_ptr<DimToValMap> bucket = std::make_shared<DimToValMap>();
+        for (const MetricDimensionKey& key : keys) {
+            if (random() % 3 == 0) {
+                (*bucket)[key] = 1 + random() % 10;
+            }
+        }
+        anomalyTracker.addPastBucket(bucket, bucketNum);
+        expectedBuckets[bucketNum] = *bucket;
+
+        // Update a single dimension of a recent bucket.
+        const int64_t updatedBucketNum = bucketNum - random() % 3;
+        const MetricDimensionKey& updatedKey = keys[random() % keys.size()];
+        const int64_t updatedValue = random() % 10;
+        anomalyTracker.addPastBucket(updatedKey, updatedValue, updatedBucketNum);
+        expectedBuckets[updatedBucketNum][updatedKey] = updatedValue;
+
+        // Replace a whole recent bucket now and then.
+        if (round % 10 == 5) {
+            const int64_t replacedBucketNum = bucketNum - 1;
+            std::shared_ptr<DimToValMap> replacement = MockBucket({{keys[0], 5}});
+            anomalyTracker.addPastBucket(replacement, replacedBucketNum);
+            expectedBuckets[replacedBucketNum] = *replacement;
+        }
+
+        expectSums(bucketNum);
+        EXPECT_LE(anomalyTracker.mPastBucketWindows.size(), keys.size());
+    }
+
+    // Dimensions that have not been updated for a full window are eventually erased.
+    for (int i = 1; i <= 2 * numBuckets; i++) {
+        anomalyTracker.addPastBucket(MockBucket({{keys[0], 1}}), bucketNum + i);
+    }
+    EXPECT_EQ(1u, anomalyTracker.mPastBucketWindows.size());
+    EXPECT_EQ(1u, anomalyTracker.getNumDimensionsWithPastData());
+}
+
 TEST(AnomalyTrackerTest, TestProbabilityOfInforming) {
     // Initiating StatsdStats at the start of this test, so it doesn't call rand() during the test
     StatsdStats::getInstance();
@@ -447,7 +525,7 @@ TEST(AnomalyTrackerTest, TestProbabilityOfInforming) {
     int bucketValue = 1;
 
     int alertRandCount = 0, alertAlwaysCount = 0;
-    // The binder calls here will happen synchronously because they are in-process.
+    // The binder calls here happen on the subscriber dispatcher thread.
     shared_ptr<MockPendingIntentRef> randBroadcast =
             SharedRefBase::make<StrictMock<MockPendingIntentRef>>();
     EXPECT_CALL(*randBroadcast,
@@ -489,6 +567,7 @@ TEST(AnomalyTrackerTest, TestProbabilityOfInforming) {
         anomalyTrackerRand.detectAndDeclareAnomaly(curEventTimestamp, /*bucketNum=*/i,
                                                    /*metric_id=*/0, DEFAULT_METRIC_DIMENSION_KEY,
                                                    bucketValue);
+        waitForSubscriberTriggers();
         if (i <= 3) {
             EXPECT_EQ(alertRandCount, 0);
         } else if (i >= 4 && i <= 6) {
@@ -501,6 +580,7 @@ TEST(AnomalyTrackerTest, TestProbabilityOfInforming) {
         anomalyTrackerAlways.detectAndDeclareAnomaly(curEventTimestamp, /*bucketNum=*/i,
                                                      /*metric_id=*/0, DEFAULT_METRIC_DIMENSION_KEY,
                                                      bucketValue);
+        waitForSubscriberTriggers();
         EXPECT_EQ(alertAlwaysCount, i + 1);
         anomalyTrackerNever.detectAndDeclareAnomaly(curEventTimestamp, /*bucketNum=*/i,
                                                     /*metric_id=*/0, DEFAULT_METRIC_DIMENSION_KEY,
@@ -511,6 +591,57 @@ TEST(AnomalyTrackerTest, TestProbabilityOfInforming) {
     SubscriberReporter::getInstance().unsetBroadcastSubscriber(kConfigKey, broadcastSubNeverId);
 }
 
+TEST(AnomalyTrackerTest, TestAlertMetadataFollowsRefractoryPeriods) {
+    const int32_t refractoryPeriodSec = 100;
+    Alert alert = createAlert("alert", /*metric id=*/0, /*buckets=*/1, /*triggerSum=*/0);
+    alert.set_refractory_period_secs(refractoryPeriodSec);
+    AnomalyTracker anomalyTracker(alert, kConfigKey);
+    const MetricDimensionKey keyA = getMockMetricDimensionKey(1, "a");
+    const MetricDimensionKey keyB = getMockMetricDimensionKey(1, "b");
+    const int64_t wallClockOffsetNs = 1000000 * NS_PER_SEC;
+
+    anomalyTracker.declareAnomaly(10 * NS_PER_SEC, /*metric_id=*/0, keyA, /*metricValue=*/1);
+    metadata::AlertMetadata first;
+    ASSERT_TRUE(anomalyTracker.writeAlertMetadataToProto(20 * NS_PER_SEC + wallClockOffsetNs,
+                                                         20 * NS_PER_SEC, &first));
+    ASSERT_EQ(1, first.alert_dim_keyed_data_size());
+    EXPECT_EQ(110 + wallClockOffsetNs / NS_PER_SEC,
+              first.alert_dim_keyed_data(0).last_refractory_ends_sec());
+
+    // Nothing changed, so the same metadata is written again.
+    metadata::AlertMetadata second;
+    ASSERT_TRUE(anomalyTracker.writeAlertMetadataToProto(50 * NS_PER_SEC + wallClockOffsetNs,
+                                                         50 * NS_PER_SEC, &second));
+    EXPECT_EQ(first.SerializeAsString(), second.SerializeAsString());
+
+    // The end of the refractory period follows a change of the wall clock.
+    metadata::AlertMetadata clockChanged;
+    ASSERT_TRUE(anomalyTracker.writeAlertMetadataToProto(
+            50 * NS_PER_SEC + 2 * wallClockOffsetNs, 50 * NS_PER_SEC, &clockChanged));
+    ASSERT_EQ(1, clockChanged.alert_dim_keyed_data_size());
+    EXPECT_EQ(110 + 2 * wallClockOffsetNs / NS_PER_SEC,
+              clockChanged.alert_dim_keyed_data(0).last_refractory_ends_sec());
+
+    // A new refractory period is written.
+    anomalyTracker.declareAnomaly(60 * NS_PER_SEC, /*metric_id=*/0, keyB, /*metricValue=*/1);
+    metadata::AlertMetadata twoKeys;
+    ASSERT_TRUE(anomalyTracker.writeAlertMetadataToProto(70 * NS_PER_SEC + wallClockOffsetNs,
+                                                         70 * NS_PER_SEC, &twoKeys));
+    EXPECT_EQ(2, twoKeys.alert_dim_keyed_data_size());
+
+    // An ended one is not.
+    metadata::AlertMetadata oneKey;
+    ASSERT_TRUE(anomalyTracker.writeAlertMetadataToProto(120 * NS_PER_SEC + wallClockOffsetNs,
+                                                         120 * NS_PER_SEC, &oneKey));
+    ASSERT_EQ(1, oneKey.alert_dim_keyed_data_size());
+    EXPECT_EQ(160 + wallClockOffsetNs / NS_PER_SEC,
+              oneKey.alert_dim_keyed_data(0).last_refractory_ends_sec());
+
+    metadata::AlertMetadata none;
+    EXPECT_FALSE(anomalyTracker.writeAlertMetadataToProto(170 * NS_PER_SEC + wallClockOffsetNs,
+                                                          170 * NS_PER_SEC, &none));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
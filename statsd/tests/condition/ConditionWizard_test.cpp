@@ -0,0 +1,160 @@
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/condition/ConditionWizard.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "src/condition/CombinationConditionTracker.h"
+#include "src/condition/SimpleConditionTracker.h"
+#include "stats_event.h"
+#include "tests/statsd_test_util.h"
+
+using std::unordered_map;
+using std::vector;
+
+#ifdef __ANDROID__
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const ConfigKey kConfigKey(0, 12345);
+const int TAG_ID = 1;
+const uint64_t protoHash = 0x123456789;
+
+SimplePredicate getWakeLockHeldByUidCondition() {
+    SimplePredicate simplePredicate;
+    simplePredicate.set_start(StringToId("WAKE_LOCK_ACQUIRE"));
+    simplePredicate.set_stop(StringToId("WAKE_LOCK_RELEASE"));
+    simplePredicate.mutable_dimensions()->set_field(TAG_ID);
+    simplePredicate.mutable_dimensions()->add_child()->set_field(1);
+    simplePredicate.mutable_dimensions()->mutable_child(0)->set_position(Position::FIRST);
+    simplePredicate.mutable_dimensions()->mutable_child(0)->add_child()->set_field(1);
+    simplePredicate.set_count_nesting(false);
+    simplePredicate.set_initial_value(SimplePredicate_InitialValue_FALSE);
+    return simplePredicate;
+}
+
+void makeWakeLockEvent(LogEvent* logEvent, int uid) {
+    AStatsEvent* statsEvent = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(statsEvent, TAG_ID);
+    AStatsEvent_overwriteTimestamp(statsEvent, 0);
+    writeAttribution(statsEvent, {uid}, {""});
+    AStatsEvent_writeString(statsEvent, "wl");
+    parseStatsEventToLogEvent(statsEvent, logEvent);
+}
+
+ConditionKey getUidQueryKey(int64_t conditionId, int uid) {
+    int pos[] = {1, 1, 1};
+    Field field(TAG_ID, pos, 2);
+    HashableDimensionKey key;
+    key.addValue(FieldValue(field, Value((int32_t)uid)));
+    return {{conditionId, key}};
+}
+
+}  // anonymous namespace
+
+TEST(ConditionWizardTest, TestQueryMemoizedUntilStateChanges) {
+    const int64_t conditionId = StringToId("WL_HELD_BY_UID");
+    unordered_map<int64_t, int> trackerNameIndexMap = {{StringToId("WAKE_LOCK_ACQUIRE"), 0},
+                                                       {StringToId("WAKE_LOCK_RELEASE"), 1}};
+    sp<SimpleConditionTracker> tracker =
+            new SimpleConditionTracker(kConfigKey, conditionId, protoHash, 0 /*index*/,
+                                       getWakeLockHeldByUidCondition(), trackerNameIndexMap);
+    vector<sp<ConditionTracker>> allConditions = {tracker};
+    sp<ConditionWizard> wizard = new ConditionWizard(allConditions);
+
+    vector<ConditionState> conditionCache(1, ConditionState::kNotEvaluated);
+    vector<uint8_t> changedCache(1, false);
+    auto evaluate = [&](int uid, bool acquire) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeWakeLockEvent(&event, uid);
+        vector<MatchingState> matcherState(2, MatchingState::kNotMatched);
+        matcherState[acquire ? 0 : 1] = MatchingState::kMatched;
+        conditionCache[0] = ConditionState::kNotEvaluated;
+        tracker->evaluateCondition(event, matcherState, allConditions, conditionCache,
+                                   changedCache);
+    };
+
+    evaluate(111, /*acquire=*/true);
+    EXPECT_EQ(ConditionState::kTrue, wizard->query(0, getUidQueryKey(conditionId, 111), false));
+    EXPECT_EQ(ConditionState::kTrue, wizard->query(0, getUidQueryKey(conditionId, 111), false));
+    EXPECT_EQ(ConditionState::kFalse, wizard->query(0, getUidQueryKey(conditionId, 222), false));
+    EXPECT_EQ(2u, wizard->mQueryMemos[0].results[0].size());
+    EXPECT_TRUE(wizard->mQueryMemos[0].results[1].empty());
+    EXPECT_THAT(wizard->mQueryCache, testing::Each(ConditionState::kNotEvaluated));
+
+    // The release changes the state, so the memoized results are dropped.
+    evaluate(111, /*acquire=*/false);
+    EXPECT_EQ(ConditionState::kFalse, wizard->query(0, getUidQueryKey(conditionId, 111), false));
+    EXPECT_EQ(1u, wizard->mQueryMemos[0].results[0].size());
+
+    evaluate(222, /*acquire=*/true);
+    EXPECT_EQ(ConditionState::kTrue, wizard->query(0, getUidQueryKey(conditionId, 222), false));
+    EXPECT_EQ(ConditionState::kFalse, wizard->query(0, getUidQueryKey(conditionId, 111), false));
+}
+
+TEST(ConditionWizardTest, TestCombinationQueryTracksChildState) {
+    const int64_t slicedId = StringToId("WL_HELD_BY_UID");
+    unordered_map<int64_t, int> trackerNameIndexMap = {{StringToId("WAKE_LOCK_ACQUIRE"), 0},
+                                                       {StringToId("WAKE_LOCK_RELEASE"), 1}};
+    sp<SimpleConditionTracker> sliced =
+            new SimpleConditionTracker(kConfigKey, slicedId, protoHash, 1 /*index*/,
+                                       getWakeLockHeldByUidCondition(), trackerNameIndexMap);
+
+    StatsdConfig config;
+    Predicate* notHeld = config.add_predicate();
+    notHeld->set_id(StringToId("WL_NOT_HELD_BY_UID"));
+    notHeld->mutable_combination()->set_operation(LogicalOperation::NOT);
+    notHeld->mutable_combination()->add_predicate(slicedId);
+    Predicate* held = config.add_predicate();
+    held->set_id(slicedId);
+    *held->mutable_simple_predicate() = getWakeLockHeldByUidCondition();
+
+    sp<CombinationConditionTracker> combination =
+            new CombinationConditionTracker(notHeld->id(), 0 /*index*/, protoHash);
+    vector<sp<ConditionTracker>> allConditions = {combination, sliced};
+    unordered_map<int64_t, int> conditionIdIndexMap = {{notHeld->id(), 0}, {slicedId, 1}};
+    vector<uint8_t> stack(2, false);
+    vector<ConditionState> conditionCache(2, ConditionState::kNotEvaluated);
+    ASSERT_EQ(nullopt, combination->init({*notHeld, *held}, allConditions, conditionIdIndexMap,
+                                         stack, conditionCache));
+    sp<ConditionWizard> wizard = new ConditionWizard(allConditions);
+
+    const ConditionKey queryKey = getUidQueryKey(slicedId, 111);
+    EXPECT_EQ(ConditionState::kTrue, wizard->query(0, queryKey, false));
+
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeWakeLockEvent(&event, 111);
+    vector<MatchingState> matcherState = {MatchingState::kMatched, MatchingState::kNotMatched};
+    vector<uint8_t> changedCache(2, false);
+    conditionCache.assign(2, ConditionState::kNotEvaluated);
+    sliced->evaluateCondition(event, matcherState, allConditions, conditionCache, changedCache);
+
+    EXPECT_EQ(ConditionState::kFalse, wizard->query(0, queryKey, false));
+    EXPECT_THAT(wizard->mQueryCache, testing::Each(ConditionState::kNotEvaluated));
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -424,7 +424,7 @@ TEST_P(SimpleConditionTrackerTest, TestSlicedCondition) {
         conditionTracker.evaluateCondition(event1, matcherState, allPredicates, conditionCache,
                                            changedCache);
 
-        ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
         EXPECT_TRUE(changedCache[0]);
         ASSERT_EQ(conditionTracker.getChangedToTrueDimensions(allConditions)->size(), 1u);
         EXPECT_TRUE(conditionTracker.getChangedToFalseDimensions(allConditions)->empty());
@@ -447,7 +447,7 @@ TEST_P(SimpleConditionTrackerTest, TestSlicedCondition) {
         conditionTracker.evaluateCondition(event2, matcherState, allPredicates, conditionCache,
                                            changedCache);
         EXPECT_FALSE(changedCache[0]);
-        ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
         EXPECT_TRUE(conditionTracker.getChangedToTrueDimensions(allConditions)->empty());
         EXPECT_TRUE(conditionTracker.getChangedToFalseDimensions(allConditions)->empty());
 
@@ -463,7 +463,7 @@ TEST_P(SimpleConditionTrackerTest, TestSlicedCondition) {
                                            changedCache);
         // nothing changes, because wake lock 2 is still held for this uid
         EXPECT_FALSE(changedCache[0]);
-        ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
         EXPECT_TRUE(conditionTracker.getChangedToTrueDimensions(allConditions)->empty());
         EXPECT_TRUE(conditionTracker.getChangedToFalseDimensions(allConditions)->empty());
 
@@ -477,7 +477,7 @@ TEST_P(SimpleConditionTrackerTest, TestSlicedCondition) {
         conditionTracker.evaluateCondition(event4, matcherState, allPredicates, conditionCache,
                                            changedCache);
 
-        ASSERT_EQ(conditionTracker.mSlicedConditionState.size(),
+        ASSERT_EQ(conditionTracker.mState->slicedConditionState.size(),
                   GetParam() == SimplePredicate_InitialValue_FALSE ? 0 : 1);
         EXPECT_TRUE(changedCache[0]);
         ASSERT_EQ(conditionTracker.getChangedToFalseDimensions(allConditions)->size(), 1u);
@@ -529,7 +529,7 @@ TEST(SimpleConditionTrackerTest, TestSlicedWithNoOutputDim) {
     conditionTracker.evaluateCondition(event1, matcherState, allPredicates, conditionCache,
                                        changedCache);
 
-    ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+    ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
     EXPECT_TRUE(changedCache[0]);
 
     // Now test query
@@ -577,7 +577,7 @@ TEST(SimpleConditionTrackerTest, TestSlicedWithNoOutputDim) {
     changedCache[0] = false;
     conditionTracker.evaluateCondition(event4, matcherState, allPredicates, conditionCache,
                                        changedCache);
-    ASSERT_EQ(0UL, conditionTracker.mSlicedConditionState.size());
+    ASSERT_EQ(0UL, conditionTracker.mState->slicedConditionState.size());
     EXPECT_TRUE(changedCache[0]);
 
     // query again
@@ -620,7 +620,7 @@ TEST_P(SimpleConditionTrackerTest, TestStopAll) {
 
         conditionTracker.evaluateCondition(event1, matcherState, allPredicates, conditionCache,
                                            changedCache);
-        ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
         EXPECT_TRUE(changedCache[0]);
         ASSERT_EQ(1UL, conditionTracker.getChangedToTrueDimensions(allConditions)->size());
         EXPECT_TRUE(conditionTracker.getChangedToFalseDimensions(allConditions)->empty());
@@ -644,7 +644,7 @@ TEST_P(SimpleConditionTrackerTest, TestStopAll) {
         changedCache[0] = false;
         conditionTracker.evaluateCondition(event2, matcherState, allPredicates, conditionCache,
                                            changedCache);
-        ASSERT_EQ(2UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(2UL, conditionTracker.mState->slicedConditionState.size());
 
         EXPECT_TRUE(changedCache[0]);
         ASSERT_EQ(1UL, conditionTracker.getChangedToTrueDimensions(allConditions)->size());
@@ -671,7 +671,7 @@ TEST_P(SimpleConditionTrackerTest, TestStopAll) {
         conditionTracker.evaluateCondition(event3, matcherState, allPredicates, conditionCache,
                                            changedCache);
         EXPECT_TRUE(changedCache[0]);
-        ASSERT_EQ(0UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(0UL, conditionTracker.mState->slicedConditionState.size());
         ASSERT_EQ(2UL, conditionTracker.getChangedToFalseDimensions(allConditions)->size());
         EXPECT_TRUE(conditionTracker.getChangedToTrueDimensions(allConditions)->empty());
 
@@ -719,7 +719,7 @@ TEST(SimpleConditionTrackerTest, TestGuardrailNotHitWhenDefaultFalse) {
         conditionTracker.evaluateCondition(event, matcherState, allPredicates, conditionCache,
                                            changedCache);
 
-        ASSERT_EQ(1UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(1UL, conditionTracker.mState->slicedConditionState.size());
 
         LogEvent event2(/*uid=*/0, /*pid=*/0);
         makeWakeLockEvent(&event2, /*uids=*/{i}, "wl", /*acquire=*/0);
@@ -731,7 +731,7 @@ TEST(SimpleConditionTrackerTest, TestGuardrailNotHitWhenDefaultFalse) {
         conditionTracker.evaluateCondition(event2, matcherState, allPredicates, conditionCache,
                                            changedCache);
         // wakelock is now released, key is cleared from map since the default value is false.
-        ASSERT_EQ(0UL, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(0UL, conditionTracker.mState->slicedConditionState.size());
     }
 }
 
@@ -766,7 +766,7 @@ TEST(SimpleConditionTrackerTest, TestGuardrailHitWhenDefaultUnknown) {
         conditionTracker.evaluateCondition(event, matcherState, allPredicates, conditionCache,
                                            changedCache);
 
-        ASSERT_EQ(i + 1, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(i + 1, conditionTracker.mState->slicedConditionState.size());
 
         LogEvent event2(/*uid=*/0, /*pid=*/0);
         makeWakeLockEvent(&event2, /*uids=*/{i}, "wl", /*acquire=*/0);
@@ -778,11 +778,11 @@ TEST(SimpleConditionTrackerTest, TestGuardrailHitWhenDefaultUnknown) {
         conditionTracker.evaluateCondition(event2, matcherState, allPredicates, conditionCache,
                                            changedCache);
         // wakelock is now released, key is not cleared from map since the default value is unknown.
-        ASSERT_EQ(i + 1, conditionTracker.mSlicedConditionState.size());
+        ASSERT_EQ(i + 1, conditionTracker.mState->slicedConditionState.size());
     }
 
     ASSERT_EQ(StatsdStats::kDimensionKeySizeHardLimit,
-              conditionTracker.mSlicedConditionState.size());
+              conditionTracker.mState->slicedConditionState.size());
     // one more acquire after the guardrail is hit.
     LogEvent event3(/*uid=*/0, /*pid=*/0);
     makeWakeLockEvent(&event3, /*uids=*/{i}, "wl", /*acquire=*/1);
@@ -797,9 +797,229 @@ TEST(SimpleConditionTrackerTest, TestGuardrailHitWhenDefaultUnknown) {
                                        changedCache);
 
     ASSERT_EQ(StatsdStats::kDimensionKeySizeHardLimit,
-              conditionTracker.mSlicedConditionState.size());
+              conditionTracker.mState->slicedConditionState.size());
     EXPECT_EQ(conditionCache[0], ConditionState::kUnknown);
 }
+
+TEST_P(SimpleConditionTrackerTest, TestSlicedOverallConditionOnUnmatchedEvent) {
+    SimplePredicate simplePredicate =
+            getWakeLockHeldCondition(false /*nesting*/, GetParam() /*initialValue*/,
+                                     true /*output slice by uid*/, Position::FIRST);
+    unordered_map<int64_t, int> trackerNameIndexMap;
+    trackerNameIndexMap[StringToId("WAKE_LOCK_ACQUIRE")] = 0;
+    trackerNameIndexMap[StringToId("WAKE_LOCK_RELEASE")] = 1;
+    trackerNameIndexMap[StringToId("RELEASE_ALL")] = 2;
+
+    SimpleConditionTracker conditionTracker(kConfigKey, StringToId("WL_HELD_BY_UID"), protoHash,
+                                            0 /*condition tracker index*/, simplePredicate,
+                                            trackerNameIndexMap);
+    const ConditionState initialValue = GetParam() == SimplePredicate_InitialValue_FALSE
+                                                ? ConditionState::kFalse
+                                                : ConditionState::kUnknown;
+    vector<sp<ConditionTracker>> allPredicates;
+    vector<ConditionState> conditionCache(1, ConditionState::kNotEvaluated);
+    vector<uint8_t> changedCache(1, false);
+
+    // Evaluates an event that matches none of the condition's matchers and returns the overall
+    // condition reported for it.
+    auto evaluateUnmatched = [&]() {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeWakeLockEvent(&event, {999}, "other", /*acquire=*/1);
+        vector<MatchingState> matcherState(3, MatchingState::kNotMatched);
+        conditionCache[0] = ConditionState::kNotEvaluated;
+        conditionTracker.evaluateCondition(event, matcherState, allPredicates, conditionCache,
+                                           changedCache);
+        EXPECT_FALSE(changedCache[0]);
+        return conditionCache[0];
+    };
+    auto evaluateWakeLock = [&](int uid, int acquire) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeWakeLockEvent(&event, {uid}, "wl", acquire);
+        vector<MatchingState> matcherState(3, MatchingState::kNotMatched);
+        matcherState[acquire ? 0 : 1] = MatchingState::kMatched;
+        conditionCache[0] = ConditionState::kNotEvaluated;
+        conditionTracker.evaluateCondition(event, matcherState, allPredicates, conditionCache,
+                                           changedCache);
+    };
+
+    EXPECT_EQ(initialValue, evaluateUnmatched());
+
+    evaluateWakeLock(111, /*acquire=*/1);
+    evaluateWakeLock(222, /*acquire=*/1);
+    // Acquiring again doesn't count twice without nesting.
+    evaluateWakeLock(222, /*acquire=*/1);
+    EXPECT_EQ(ConditionState::kTrue, evaluateUnmatched());
+
+    evaluateWakeLock(111, /*acquire=*/0);
+    EXPECT_EQ(ConditionState::kTrue, evaluateUnmatched());
+
+    // Releasing an unknown key doesn't affect the other keys.
+    evaluateWakeLock(333, /*acquire=*/0);
+    EXPECT_EQ(ConditionState::kTrue, evaluateUnmatched());
+
+    evaluateWakeLock(222, /*acquire=*/0);
+    EXPECT_EQ(initialValue, evaluateUnmatched());
+
+    evaluateWakeLock(111, /*acquire=*/1);
+    EXPECT_EQ(ConditionState::kTrue, evaluateUnmatched());
+
+    // Stop all resets every key, and the initial value becomes false.
+    LogEvent stopAllEvent(/*uid=*/0, /*pid=*/0);
+    makeWakeLockEvent(&stopAllEvent, {111}, "wl", /*acquire=*/0);
+    vector<MatchingState> matcherState(3, MatchingState::kNotMatched);
+    matcherState[2] = MatchingState::kMatched;
+    conditionCache[0] = ConditionState::kNotEvaluated;
+    conditionTracker.evaluateCondition(stopAllEvent, matcherState, allPredicates, conditionCache,
+                                       changedCache);
+    EXPECT_EQ(ConditionState::kFalse, evaluateUnmatched());
+
+    evaluateWakeLock(222, /*acquire=*/1);
+    EXPECT_EQ(ConditionState::kTrue, evaluateUnmatched());
+}
+
+TEST(SimpleConditionTrackerTest, TestSharedState) {
+    SimplePredicate simplePredicate;
+    simplePredicate.set_start(StringToId("SCREEN_TURNED_ON"));
+    simplePredicate.set_stop(StringToId("SCREEN_TURNED_OFF"));
+    simplePredicate.set_count_nesting(true);
+    simplePredicate.set_initial_value(SimplePredicate_InitialValue_FALSE);
+
+    // The two configs order their matchers differently.
+    unordered_map<int64_t, int> trackerNameIndexMap1;
+    trackerNameIndexMap1[StringToId("SCREEN_TURNED_ON")] = 0;
+    trackerNameIndexMap1[StringToId("SCREEN_TURNED_OFF")] = 1;
+    unordered_map<int64_t, int> trackerNameIndexMap2;
+    trackerNameIndexMap2[StringToId("SCREEN_TURNED_ON")] = 1;
+    trackerNameIndexMap2[StringToId("SCREEN_TURNED_OFF")] = 0;
+
+    shared_ptr<SharedConditionRegistry> registry = std::make_shared<SharedConditionRegistry>();
+    sp<SimpleConditionTracker> tracker1 =
+            new SimpleConditionTracker(kConfigKey, StringToId("SCREEN_IS_ON"), protoHash,
+                                       0 /*tracker index*/, simplePredicate, trackerNameIndexMap1);
+    sp<SimpleConditionTracker> tracker2 = new SimpleConditionTracker(
+            ConfigKey(1, 6789), StringToId("SCREEN_ON"), protoHash, 0 /*tracker index*/,
+            simplePredicate, trackerNameIndexMap2);
+    tracker1->shareState(*registry, /*key=*/1);
+    tracker2->shareState(*registry, /*key=*/1);
+    EXPECT_EQ(tracker1->mState, tracker2->mState);
+    EXPECT_EQ(1u, registry->size());
+
+    vector<sp<ConditionTracker>> allPredicates;
+    auto evaluate = [&](const sp<SimpleConditionTracker>& tracker, const LogEvent& event,
+                        const vector<MatchingState>& matcherState) {
+        vector<ConditionState> conditionCache(1, ConditionState::kNotEvaluated);
+        vector<uint8_t> changedCache(1, false);
+        tracker->evaluateCondition(event, matcherState, allPredicates, conditionCache,
+                                   changedCache);
+        return std::make_pair(conditionCache[0], (bool)changedCache[0]);
+    };
+
+    // Both configs see the screen turn on; the nested start count is only bumped once.
+    unique_ptr<LogEvent> screenOnEvent =
+            CreateScreenStateChangedEvent(/*timestamp=*/100, android::view::DISPLAY_STATE_ON);
+    registry->startEvent();
+    EXPECT_EQ(std::make_pair(ConditionState::kTrue, true),
+              evaluate(tracker1, *screenOnEvent, {MatchingState::kMatched,
+                                                  MatchingState::kNotMatched}));
+    EXPECT_EQ(std::make_pair(ConditionState::kTrue, true),
+              evaluate(tracker2, *screenOnEvent, {MatchingState::kNotMatched,
+                                                  MatchingState::kMatched}));
+    EXPECT_EQ(1, tracker1->mState->slicedConditionState[DEFAULT_DIMENSION_KEY]);
+
+    // A single screen off therefore turns the condition off for both.
+    unique_ptr<LogEvent> screenOffEvent =
+            CreateScreenStateChangedEvent(/*timestamp=*/200, android::view::DISPLAY_STATE_OFF);
+    registry->startEvent();
+    EXPECT_EQ(std::make_pair(ConditionState::kFalse, true),
+              evaluate(tracker2, *screenOffEvent, {MatchingState::kMatched,
+                                                   MatchingState::kNotMatched}));
+    EXPECT_EQ(std::make_pair(ConditionState::kFalse, true),
+              evaluate(tracker1, *screenOffEvent, {MatchingState::kNotMatched,
+                                                   MatchingState::kMatched}));
+
+    // Once the state is no longer shared, a tracker keeps a copy of it.
+    tracker2->keepSharingState(/*key=*/2);
+    EXPECT_NE(tracker1->mState, tracker2->mState);
+    registry->startEvent();
+    EXPECT_EQ(std::make_pair(ConditionState::kTrue, true),
+              evaluate(tracker1, *screenOnEvent, {MatchingState::kMatched,
+                                                  MatchingState::kNotMatched}));
+    EXPECT_EQ(std::make_pair(ConditionState::kTrue, true),
+              evaluate(tracker2, *screenOnEvent, {MatchingState::kNotMatched,
+                                                  MatchingState::kMatched}));
+
+    tracker1.clear();
+    EXPECT_EQ(0u, registry->size());
+}
+
+TEST(SimpleConditionTrackerTest, TestSharedStateGuardrailNotedForEveryConfig) {
+    StatsdStats::getInstance().reset();
+    SimplePredicate simplePredicate =
+            getWakeLockHeldCondition(true /*nesting*/, SimplePredicate_InitialValue_UNKNOWN,
+                                     true /*output slice by uid*/, Position::FIRST);
+    unordered_map<int64_t, int> trackerNameIndexMap;
+    trackerNameIndexMap[StringToId("WAKE_LOCK_ACQUIRE")] = 0;
+    trackerNameIndexMap[StringToId("WAKE_LOCK_RELEASE")] = 1;
+    trackerNameIndexMap[StringToId("RELEASE_ALL")] = 2;
+
+    const ConfigKey configKey1(1, 1234);
+    const ConfigKey configKey2(2, 5678);
+    for (const ConfigKey& key : {configKey1, configKey2}) {
+        StatsdStats::getInstance().noteConfigReceived(key, /*metricsCount=*/0,
+                                                      /*conditionsCount=*/1, /*matchersCount=*/3,
+                                                      /*alertCount=*/0, /*annotations=*/{},
+                                                      nullopt);
+    }
+
+    shared_ptr<SharedConditionRegistry> registry = std::make_shared<SharedConditionRegistry>();
+    sp<SimpleConditionTracker> tracker1 =
+            new SimpleConditionTracker(configKey1, StringToId("WL_HELD_BY_UID"), protoHash,
+                                       0 /*tracker index*/, simplePredicate, trackerNameIndexMap);
+    sp<SimpleConditionTracker> tracker2 =
+            new SimpleConditionTracker(configKey2, StringToId("WAKELOCK_HELD"), protoHash,
+                                       0 /*tracker index*/, simplePredicate, trackerNameIndexMap);
+    tracker1->shareState(*registry, /*key=*/1);
+    tracker2->shareState(*registry, /*key=*/1);
+
+    // Only tracker1 applies the events, one acquire for each uid past the soft limit.
+    vector<sp<ConditionTracker>> allPredicates;
+    const int acquireCount = StatsdStats::kDimensionKeySizeSoftLimit + 1;
+    for (int i = 0; i < acquireCount; i++) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeWakeLockEvent(&event, /*uids=*/{i}, "wl", /*acquire=*/1);
+        const vector<MatchingState> matcherState = {MatchingState::kMatched,
+                                                    MatchingState::kNotMatched,
+                                                    MatchingState::kNotMatched};
+        registry->startEvent();
+        for (const sp<SimpleConditionTracker>& tracker : {tracker1, tracker2}) {
+            vector<ConditionState> conditionCache(1, ConditionState::kNotEvaluated);
+            vector<uint8_t> changedCache(1, false);
+            tracker->evaluateCondition(event, matcherState, allPredicates, conditionCache,
+                                       changedCache);
+        }
+    }
+    ASSERT_EQ(acquireCount, tracker1->mState->slicedConditionState.size());
+
+    // The tuple count is reported under both configs, with the predicate id of each.
+    StatsdStatsReport report = getStatsdStatsReport(/*resetStats=*/true);
+    ASSERT_EQ(2, report.config_stats_size());
+    for (const auto& configStats : report.config_stats()) {
+        ASSERT_EQ(1, configStats.condition_stats_size());
+        EXPECT_EQ(configStats.id() == configKey1.GetId() ? StringToId("WL_HELD_BY_UID")
+                                                         : StringToId("WAKELOCK_HELD"),
+                  configStats.condition_stats(0).id());
+        EXPECT_EQ(acquireCount, configStats.condition_stats(0).max_tuple_counts());
+    }
+
+    // A tracker that stops sharing the state is only a user of its own copy.
+    tracker2->keepSharingState(/*key=*/2);
+    EXPECT_EQ(1u, tracker1->mState->users.size());
+    EXPECT_EQ(1u, tracker2->mState->users.size());
+    tracker1.clear();
+    tracker2.clear();
+    StatsdStats::getInstance().reset();
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -18,6 +18,8 @@
 #include "src/stats_log_util.h"
 #include "tests/statsd_test_util.h"
 
+#include <atomic>
+#include <thread>
 #include <vector>
 
 namespace android {
@@ -82,6 +84,105 @@ TEST(AlarmE2eTest, TestMultipleAlarms) {
     EXPECT_EQ(alarmTimestampSec1 + 30 * 60 * 5, alarmTracker2->getAlarmTimestampSec());
 }
 
+TEST(AlarmE2eTest, TestAlarmFiredWhileConfigRemoved) {
+    auto config = CreateStatsdConfig();
+    int64_t bucketStartTimeNs = 10000000000;
+
+    ConfigKey cfgKey;
+    auto processor = CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+    ASSERT_EQ(processor->mMetricsManagers.size(), 1u);
+    sp<AlarmMonitor> alarmMonitor = processor->getPeriodicAlarmMonitor();
+
+    // The second alarm fires and onPeriodicAlarmFired() collects its tracker, then the config is
+    // removed before the tracker is informed outside the processor lock.
+    const int64_t alarmFiredTimestampSec = bucketStartTimeNs / NS_PER_SEC + 5 * 60 + 5;
+    auto alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
+    ASSERT_EQ(1u, alarmSet.size());
+    vector<sp<AlarmTracker>> firedTrackers;
+    processor->mMetricsManagers.begin()->second->getFiredPeriodicAlarmTrackers(alarmSet,
+                                                                              &firedTrackers);
+    ASSERT_EQ(1u, firedTrackers.size());
+
+    processor->OnConfigRemoved(cfgKey);
+    EXPECT_EQ(processor->mMetricsManagers.size(), 0u);
+
+    // The collected tracker outlives its config and still sets its next alarm.
+    firedTrackers[0]->informAlarmsFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    EXPECT_TRUE(alarmSet.empty());
+    EXPECT_EQ(bucketStartTimeNs / NS_PER_SEC + 35 * 60, firedTrackers[0]->getAlarmTimestampSec());
+
+    // Releasing the tracker removes that alarm, no alarm of the removed config is left.
+    firedTrackers.clear();
+    EXPECT_TRUE(alarmMonitor->popSoonerThan(UINT32_MAX).empty());
+}
+
+TEST(AlarmE2eTest, TestAlarmFiredWhileConfigUpdated) {
+    auto config = CreateStatsdConfig();
+    int64_t bucketStartTimeNs = 10000000000;
+
+    ConfigKey cfgKey;
+    auto processor = CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+    ASSERT_EQ(processor->mMetricsManagers.size(), 1u);
+    sp<AlarmMonitor> alarmMonitor = processor->getPeriodicAlarmMonitor();
+
+    const int64_t alarmFiredTimestampSec = bucketStartTimeNs / NS_PER_SEC + 5 * 60 + 5;
+    auto alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
+    ASSERT_EQ(1u, alarmSet.size());
+    vector<sp<AlarmTracker>> firedTrackers;
+    processor->mMetricsManagers.begin()->second->getFiredPeriodicAlarmTrackers(alarmSet,
+                                                                              &firedTrackers);
+    ASSERT_EQ(1u, firedTrackers.size());
+
+    // The update replaces the alarm trackers before the collected one is informed.
+    processor->OnConfigUpdated(alarmFiredTimestampSec * NS_PER_SEC, cfgKey, config);
+    ASSERT_EQ(processor->mMetricsManagers.size(), 1u);
+    sp<MetricsManager> metricsManager = processor->mMetricsManagers.begin()->second;
+    ASSERT_EQ(2u, metricsManager->mAllPeriodicAlarmTrackers.size());
+    EXPECT_NE(firedTrackers[0], metricsManager->mAllPeriodicAlarmTrackers[1]);
+
+    firedTrackers[0]->informAlarmsFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    EXPECT_TRUE(alarmSet.empty());
+    firedTrackers.clear();
+
+    // Only the alarms of the updated config's trackers are left.
+    alarmSet = alarmMonitor->popSoonerThan(UINT32_MAX);
+    ASSERT_EQ(2u, alarmSet.size());
+    for (const sp<AlarmTracker>& tracker : metricsManager->mAllPeriodicAlarmTrackers) {
+        EXPECT_TRUE(tracker->hasFired(alarmSet));
+    }
+}
+
+TEST(AlarmE2eTest, TestAlarmsFiredDuringConfigChanges) {
+    auto config = CreateStatsdConfig();
+    int64_t bucketStartTimeNs = 10000000000;
+
+    ConfigKey cfgKey;
+    auto processor = CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+    sp<AlarmMonitor> alarmMonitor = processor->getPeriodicAlarmMonitor();
+
+    std::atomic_bool done = false;
+    std::thread alarmThread([&] {
+        int64_t timestampSec = bucketStartTimeNs / NS_PER_SEC;
+        while (!done) {
+            timestampSec += 30 * 60;
+            auto alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(timestampSec));
+            processor->onPeriodicAlarmFired(timestampSec * NS_PER_SEC, alarmSet);
+        }
+    });
+    for (int i = 0; i < 100; i++) {
+        processor->OnConfigUpdated(bucketStartTimeNs + i * NS_PER_SEC, cfgKey, config);
+        if (i % 2 == 0) {
+            processor->OnConfigRemoved(cfgKey);
+        }
+    }
+    processor->OnConfigRemoved(cfgKey);
+    done = true;
+    alarmThread.join();
+
+    // Every tracker that was informed after its config went away removed its alarm again.
+    EXPECT_TRUE(alarmMonitor->popSoonerThan(UINT32_MAX).empty());
+}
+
 #else
 GTEST_LOG_(INFO) << "This test does nothing.\n";
 #endif
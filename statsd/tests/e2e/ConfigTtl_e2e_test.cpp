@@ -104,6 +104,37 @@ TEST(ConfigTtlE2eTest, TestCountMetric) {
                             ADB_DUMP, FAST, &buffer);
 }
 
+TEST(ConfigTtlE2eTest, TestTtlCheckedByScheduledHousekeeping) {
+    auto config = CreateStatsdConfig(/*num_buckets=*/1, /*threshold=*/3);
+    int64_t bucketStartTimeNs = 10000000000;
+    const int64_t ttlNs = 2 * 3600 * NS_PER_SEC;
+
+    ConfigKey cfgKey;
+    auto processor = CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+    ASSERT_EQ(processor->mMetricsManagers.size(), 1u);
+    processor->setPeriodicHousekeepingScheduled(true);
+
+    std::vector<int> attributionUids1 = {111};
+    std::vector<string> attributionTags1 = {"App1"};
+    const int64_t expiredTimeNs = bucketStartTimeNs + ttlNs + 2;
+    auto event =
+            CreateAcquireWakelockEvent(expiredTimeNs, attributionUids1, attributionTags1, "wl1");
+    processor->OnLogEvent(event.get());
+
+    // The expired TTL is left to the housekeeping timer.
+    EXPECT_EQ(bucketStartTimeNs + ttlNs,
+              processor->mMetricsManagers.begin()->second->getTtlEndNs());
+
+    const int64_t housekeepingTimeNs = expiredTimeNs + NS_PER_SEC;
+    processor->runPeriodicHousekeeping(housekeepingTimeNs);
+    EXPECT_EQ(housekeepingTimeNs + ttlNs,
+              processor->mMetricsManagers.begin()->second->getTtlEndNs());
+
+    // Clear the data stored on disk as a result of the ttl.
+    vector<uint8_t> buffer;
+    processor->onDumpReport(cfgKey, housekeepingTimeNs + 1, false, true, ADB_DUMP, FAST, &buffer);
+}
+
 #else
 GTEST_LOG_(INFO) << "This test does nothing.\n";
 #endif
@@ -22,6 +22,7 @@
 
 #include "src/StatsLogProcessor.h"
 #include "src/StatsService.h"
+#include "src/anomaly/subscriber_util.h"
 #include "src/storage/StorageManager.h"
 #include "src/subscriber/SubscriberReporter.h"
 #include "tests/statsd_test_util.h"
@@ -2155,7 +2156,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     StatsDimensionsValueParcel alertPreserveDims;
     StatsDimensionsValueParcel alertRemoveDims;
 
-    // The binder calls here will happen synchronously because they are in-process.
+    // The binder calls here happen on the subscriber dispatcher thread.
     shared_ptr<MockPendingIntentRef> preserveBroadcast =
             SharedRefBase::make<StrictMock<MockPendingIntentRef>>();
     EXPECT_CALL(*preserveBroadcast, sendSubscriberBroadcast(configUid, configId, preserveSub.id(),
@@ -2208,6 +2209,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateAcquireWakelockEvent(bucketStartTimeNs + 15 * NS_PER_SEC,
                                                      attributionUids1, attributionTags1, "wl1")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 1);
     EXPECT_EQ(alertRemoveDims, wlUid1);
@@ -2215,6 +2217,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateAcquireWakelockEvent(bucketStartTimeNs + 20 * NS_PER_SEC,
                                                      attributionUids2, attributionTags2, "wl2")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 2);
     EXPECT_EQ(alertRemoveDims, wlUid2);
@@ -2222,6 +2225,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateSyncStartEvent(bucket2StartTimeNs + 5 * NS_PER_SEC,
                                                attributionUids1, attributionTags1, "sync1")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 2);
 
@@ -2229,6 +2233,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateAcquireWakelockEvent(bucket2StartTimeNs + 10 * NS_PER_SEC,
                                                      attributionUids2, attributionTags2, "wl2")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 1);
     EXPECT_EQ(alertPreserveDims, wlUid2);
     EXPECT_EQ(alertRemoveCount, 3);
@@ -2283,6 +2288,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateAcquireWakelockEvent(bucket2StartTimeNs + 20 * NS_PER_SEC,
                                                      attributionUids2, attributionTags2, "wl2")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 1);
     EXPECT_EQ(alertNewCount, 1);
     EXPECT_EQ(alertNewDims, wlUid2);
@@ -2291,6 +2297,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateAcquireWakelockEvent(bucket2StartTimeNs + 25 * NS_PER_SEC,
                                                      attributionUids1, attributionTags1, "wl1")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertPreserveDims, wlUid1);
     EXPECT_EQ(alertNewCount, 1);
@@ -2298,6 +2305,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyCountMetric) {
     processor->OnLogEvent(CreateSyncStartEvent(bucket2StartTimeNs + 30 * NS_PER_SEC,
                                                attributionUids1, attributionTags1, "sync1")
                                   .get());
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertNewCount, 1);
     EXPECT_EQ(alertRemoveCount, 3);
@@ -2375,7 +2383,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
     StatsDimensionsValueParcel alertPreserveDims;
     StatsDimensionsValueParcel alertRemoveDims;
 
-    // The binder calls here will happen synchronously because they are in-process.
+    // The binder calls here happen on the subscriber dispatcher thread.
     shared_ptr<MockPendingIntentRef> preserveBroadcast =
             SharedRefBase::make<StrictMock<MockPendingIntentRef>>();
     EXPECT_CALL(*preserveBroadcast, sendSubscriberBroadcast(configUid, configId, preserveSub.id(),
@@ -2445,6 +2453,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids1, attributionTags1, "wl1")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 0);
 
@@ -2453,6 +2462,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, android::view::DisplayStateEnum::DISPLAY_STATE_ON)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 0);
 
@@ -2462,6 +2472,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateReleaseWakelockEvent(eventTimeNs, attributionUids1, attributionTags1, "wl1")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 1);
     EXPECT_EQ(alertRemoveDims, wlUid1);
@@ -2472,6 +2483,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, android::view::DisplayStateEnum::DISPLAY_STATE_OFF)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 1);
 
@@ -2480,6 +2492,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids4, attributionTags4, "wl4")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 1);
 
@@ -2488,6 +2501,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids2, attributionTags2, "wl2")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 1);
 
@@ -2497,6 +2511,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, BatteryPluggedStateEnum::BATTERY_PLUGGED_USB)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 2);
     EXPECT_EQ(alertRemoveDims, wlUid4);
@@ -2508,6 +2523,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids3, attributionTags3, "wl3")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 0);
     EXPECT_EQ(alertRemoveCount, 3);
     EXPECT_EQ(alertRemoveDims, wlUid2);
@@ -2518,6 +2534,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, BatteryPluggedStateEnum::BATTERY_PLUGGED_USB)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 1);
     EXPECT_EQ(alertPreserveDims, wlUid4);
     EXPECT_EQ(alertRemoveCount, 3);
@@ -2530,6 +2547,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateReleaseWakelockEvent(eventTimeNs, attributionUids2, attributionTags2, "wl2")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertPreserveDims, wlUid2);
     EXPECT_EQ(alertRemoveCount, 4);
@@ -2541,6 +2559,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, BatteryPluggedStateEnum::BATTERY_PLUGGED_USB)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertRemoveCount, 5);
     EXPECT_EQ(alertRemoveDims, wlUid3);
@@ -2552,6 +2571,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateReleaseWakelockEvent(eventTimeNs, attributionUids4, attributionTags4, "wl4")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertRemoveCount, 6);
     EXPECT_EQ(alertRemoveDims, wlUid4);
@@ -2562,6 +2582,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, android::view::DisplayStateEnum::DISPLAY_STATE_ON)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertRemoveCount, 6);
 
@@ -2621,6 +2642,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids2, attributionTags2, "wl2")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertNewCount, 1);
     EXPECT_EQ(alertNewDims, wlUid4);
@@ -2631,6 +2653,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
                                   eventTimeNs, android::view::DisplayStateEnum::DISPLAY_STATE_OFF)
                                   .get(),
                           eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 2);
     EXPECT_EQ(alertNewCount, 1);
 
@@ -2642,6 +2665,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateAcquireWakelockEvent(eventTimeNs, attributionUids1, attributionTags1, "wl1")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 3);
     EXPECT_EQ(alertPreserveDims, wlUid3);
     EXPECT_EQ(alertNewCount, 2);
@@ -2654,6 +2678,7 @@ TEST_F(ConfigUpdateE2eTest, TestAnomalyDurationMetric) {
             CreateReleaseWakelockEvent(eventTimeNs, attributionUids1, attributionTags1, "wl1")
                     .get(),
             eventTimeNs);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alertPreserveCount, 4);
     EXPECT_EQ(alertPreserveDims, wlUid1);
     EXPECT_EQ(alertNewCount, 3);
@@ -2697,7 +2722,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
 
     int alarmPreserveCount = 0, alarmReplaceCount = 0, alarmRemoveCount = 0;
 
-    // The binder calls here will happen synchronously because they are in-process.
+    // The binder calls here happen on the subscriber dispatcher thread.
     shared_ptr<MockPendingIntentRef> preserveBroadcast =
             SharedRefBase::make<StrictMock<MockPendingIntentRef>>();
     EXPECT_CALL(*preserveBroadcast, sendSubscriberBroadcast(configUid, configId, preserveSub.id(),
@@ -2750,6 +2775,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
     int32_t alarmFiredTimestampSec = startTimeSec + 5;
     auto alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
     processor->onPeriodicAlarmFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alarmPreserveCount, 1);
     EXPECT_EQ(alarmReplaceCount, 0);
     EXPECT_EQ(alarmRemoveCount, 0);
@@ -2759,6 +2785,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
     alarmFiredTimestampSec = startTimeSec + 75;
     alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
     processor->onPeriodicAlarmFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alarmPreserveCount, 2);
     EXPECT_EQ(alarmReplaceCount, 0);
     EXPECT_EQ(alarmRemoveCount, 1);
@@ -2805,6 +2832,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
     alarmFiredTimestampSec = startTimeSec + 120;
     alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
     processor->onPeriodicAlarmFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alarmPreserveCount, 2);
     EXPECT_EQ(alarmReplaceCount, 1);
     EXPECT_EQ(alarmNewCount, 0);
@@ -2814,6 +2842,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
     alarmFiredTimestampSec = startTimeSec + 130;
     alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
     processor->onPeriodicAlarmFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alarmPreserveCount, 3);
     EXPECT_EQ(alarmReplaceCount, 1);
     EXPECT_EQ(alarmNewCount, 0);
@@ -2823,6 +2852,7 @@ TEST_F(ConfigUpdateE2eTest, TestAlarms) {
     alarmFiredTimestampSec = startTimeSec + 310;
     alarmSet = alarmMonitor->popSoonerThan(static_cast<uint32_t>(alarmFiredTimestampSec));
     processor->onPeriodicAlarmFired(alarmFiredTimestampSec * NS_PER_SEC, alarmSet);
+    waitForSubscriberTriggers();
     EXPECT_EQ(alarmPreserveCount, 4);
     EXPECT_EQ(alarmReplaceCount, 2);
     EXPECT_EQ(alarmNewCount, 1);
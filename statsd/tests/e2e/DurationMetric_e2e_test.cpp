@@ -566,6 +566,110 @@ TEST(DurationMetricE2eTest, TestWithSlicedCondition) {
     EXPECT_EQ(38 * NS_PER_SEC, bucketInfo.duration_nanos());
 }
 
+TEST(DurationMetricE2eTest, TestWithPartiallyLinkedSlicedCondition) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateAcquireWakelockAtomMatcher();
+    *config.add_atom_matcher() = CreateReleaseWakelockAtomMatcher();
+    *config.add_atom_matcher() = CreateSyncStartAtomMatcher();
+    *config.add_atom_matcher() = CreateSyncEndAtomMatcher();
+
+    auto holdingWakelockPredicate = CreateHoldingWakelockPredicate();
+    FieldMatcher dimensions = CreateAttributionUidDimensions(util::WAKELOCK_STATE_CHANGED,
+                                                             {Position::FIRST});
+    *holdingWakelockPredicate.mutable_simple_predicate()->mutable_dimensions() = dimensions;
+    *config.add_predicate() = holdingWakelockPredicate;
+
+    // The predicate is dimensioned by uid and sync name, but only the uid is linked.
+    auto isSyncingPredicate = CreateIsSyncingPredicate();
+    auto syncDimension = isSyncingPredicate.mutable_simple_predicate()->mutable_dimensions();
+    *syncDimension = CreateAttributionUidDimensions(util::SYNC_STATE_CHANGED, {Position::FIRST});
+    syncDimension->add_child()->set_field(2 /* name field*/);
+    *config.add_predicate() = isSyncingPredicate;
+
+    auto durationMetric = config.add_duration_metric();
+    durationMetric->set_id(StringToId("WakelockDuration"));
+    durationMetric->set_what(holdingWakelockPredicate.id());
+    durationMetric->set_condition(isSyncingPredicate.id());
+    durationMetric->set_aggregation_type(DurationMetric::SUM);
+    *durationMetric->mutable_dimensions_in_what() = CreateAttributionUidDimensions(
+            util::WAKELOCK_STATE_CHANGED, {Position::FIRST});
+    durationMetric->set_bucket(FIVE_MINUTES);
+
+    auto links = durationMetric->add_links();
+    links->set_condition(isSyncingPredicate.id());
+    *links->mutable_fields_in_what() =
+            CreateAttributionUidDimensions(util::WAKELOCK_STATE_CHANGED, {Position::FIRST});
+    *links->mutable_fields_in_condition() =
+            CreateAttributionUidDimensions(util::SYNC_STATE_CHANGED, {Position::FIRST});
+
+    ConfigKey cfgKey;
+    uint64_t bucketStartTimeNs = 10000000000;
+    uint64_t bucketSizeNs =
+            TimeUnitToBucketSizeInMillis(config.duration_metric(0).bucket()) * 1000000LL;
+    auto processor = CreateStatsLogProcessor(bucketStartTimeNs, bucketStartTimeNs, config, cfgKey);
+    ASSERT_EQ(processor->mMetricsManagers.size(), 1u);
+    EXPECT_TRUE(processor->mMetricsManagers.begin()->second->isConfigValid());
+
+    int appUid1 = 123;
+    int appUid2 = 456;
+    std::vector<int> attributionUids1 = {appUid1};
+    std::vector<int> attributionUids2 = {appUid2};
+    std::vector<string> attributionTags = {"App"};
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(CreateAcquireWakelockEvent(bucketStartTimeNs + 5 * NS_PER_SEC,
+                                                attributionUids2, attributionTags, "wl2"));
+    events.push_back(CreateAcquireWakelockEvent(bucketStartTimeNs + 10 * NS_PER_SEC,
+                                                attributionUids1, attributionTags, "wl1"));
+    events.push_back(CreateSyncStartEvent(bucketStartTimeNs + 20 * NS_PER_SEC, attributionUids1,
+                                          attributionTags, "sync1"));  // uid1 true at 0:20
+    events.push_back(CreateSyncStartEvent(bucketStartTimeNs + 25 * NS_PER_SEC, attributionUids2,
+                                          attributionTags, "sync2"));  // uid2 true at 0:25
+    events.push_back(CreateSyncStartEvent(bucketStartTimeNs + 30 * NS_PER_SEC, attributionUids1,
+                                          attributionTags, "sync2"));
+    // uid1 still has sync2 running.
+    events.push_back(CreateSyncEndEvent(bucketStartTimeNs + 40 * NS_PER_SEC, attributionUids1,
+                                        attributionTags, "sync1"));
+    events.push_back(CreateSyncEndEvent(bucketStartTimeNs + 50 * NS_PER_SEC, attributionUids1,
+                                        attributionTags, "sync2"));  // uid1 false at 0:50
+    events.push_back(CreateReleaseWakelockEvent(bucketStartTimeNs + 60 * NS_PER_SEC,
+                                                attributionUids1, attributionTags, "wl1"));
+    events.push_back(CreateReleaseWakelockEvent(bucketStartTimeNs + 90 * NS_PER_SEC,
+                                                attributionUids2, attributionTags, "wl2"));
+    for (const auto& event : events) {
+        processor->OnLogEvent(event.get());
+    }
+
+    vector<uint8_t> buffer;
+    ConfigMetricsReportList reports;
+    processor->onDumpReport(cfgKey, bucketStartTimeNs + bucketSizeNs + 1, false, true, ADB_DUMP,
+                            FAST, &buffer);
+    ASSERT_GT(buffer.size(), 0);
+    EXPECT_TRUE(reports.ParseFromArray(&buffer[0], buffer.size()));
+    backfillDimensionPath(&reports);
+    backfillStringInReport(&reports);
+    backfillStartEndTimestamp(&reports);
+
+    ASSERT_EQ(1, reports.reports_size());
+    ASSERT_EQ(1, reports.reports(0).metrics_size());
+    StatsLogReport::DurationMetricDataWrapper durationMetrics;
+    sortMetricDataByDimensionsValue(reports.reports(0).metrics(0).duration_metrics(),
+                                    &durationMetrics);
+    ASSERT_EQ(2, durationMetrics.data_size());
+
+    DurationMetricData data = durationMetrics.data(0);
+    ValidateAttributionUidDimension(data.dimensions_in_what(), util::WAKELOCK_STATE_CHANGED,
+                                    appUid1);
+    ASSERT_EQ(1, data.bucket_info_size());
+    EXPECT_EQ(30 * NS_PER_SEC, data.bucket_info(0).duration_nanos());
+
+    data = durationMetrics.data(1);
+    ValidateAttributionUidDimension(data.dimensions_in_what(), util::WAKELOCK_STATE_CHANGED,
+                                    appUid2);
+    ASSERT_EQ(1, data.bucket_info_size());
+    EXPECT_EQ(65 * NS_PER_SEC, data.bucket_info(0).duration_nanos());
+}
+
 TEST(DurationMetricE2eTest, TestWithActivationAndSlicedCondition) {
     StatsdConfig config;
     auto screenOnMatcher = CreateScreenTurnedOnAtomMatcher();
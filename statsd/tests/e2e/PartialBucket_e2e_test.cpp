@@ -34,6 +34,7 @@ namespace statsd {
 #ifdef __ANDROID__
 namespace {
 const string kApp1 = "app1.sharing.1";
+const string kApp2 = "app2.sharing.1";
 
 StatsdConfig MakeCountMetricConfig(const std::optional<bool> splitBucket) {
     StatsdConfig config;
@@ -53,6 +54,10 @@ StatsdConfig MakeCountMetricConfig(const std::optional<bool> splitBucket) {
 StatsdConfig MakeValueMetricConfig(int64_t minTime) {
     StatsdConfig config;
     config.add_default_pull_packages("AID_ROOT");  // Fake puller is registered with root.
+    // The pulled atom may come from kApp1, so its upgrades split the buckets.
+    PullAtomPackages* pullAtomPackages = config.add_pull_atom_packages();
+    pullAtomPackages->set_atom_id(util::SUBSYSTEM_SLEEP_STATE);
+    pullAtomPackages->add_packages(kApp1);
 
     auto pulledAtomMatcher =
             CreateSimpleAtomMatcher("TestMatcher", util::SUBSYSTEM_SLEEP_STATE);
@@ -78,6 +83,10 @@ StatsdConfig MakeValueMetricConfig(int64_t minTime) {
 StatsdConfig MakeGaugeMetricConfig(int64_t minTime) {
     StatsdConfig config;
     config.add_default_pull_packages("AID_ROOT");  // Fake puller is registered with root.
+    // The pulled atom may come from kApp1, so its upgrades split the buckets.
+    PullAtomPackages* pullAtomPackages = config.add_pull_atom_packages();
+    pullAtomPackages->set_atom_id(util::SUBSYSTEM_SLEEP_STATE);
+    pullAtomPackages->add_packages(kApp1);
 
     auto pulledAtomMatcher =
                 CreateSimpleAtomMatcher("TestMatcher", util::SUBSYSTEM_SLEEP_STATE);
@@ -166,6 +175,33 @@ TEST_F(PartialBucketE2eTest, TestCountMetricSplitOnUpgrade) {
     EXPECT_EQ(1, report.metrics(0).count_metrics().data(0).bucket_info(0).count());
 }
 
+TEST_F(PartialBucketE2eTest, TestCountMetricSplitOnceOnUpgradeBurst) {
+    sendConfig(MakeCountMetricConfig({true}));
+    int64_t start = getElapsedRealtimeNs();  // This is the start-time the metrics producers are
+                                             // initialized with.
+    UidData uidData;
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 1, /*version*/ 1, "v1", kApp1);
+    *uidData.add_app_info() = createApplicationInfo(/*uid*/ 2, /*version*/ 1, "v1", kApp2);
+    service->mUidMap->updateMap(start, uidData);
+
+    service->mProcessor->OnLogEvent(CreateAppCrashEvent(start + 1, 100).get());
+    service->mUidMap->updateApp(start + 2, kApp1, 1, 2, "v2", "", /* certificateHash */ {});
+    service->mProcessor->OnLogEvent(CreateAppCrashEvent(start + 3, 100).get());
+    // Coalesced into the split of the first upgrade.
+    service->mUidMap->updateApp(start + 4, kApp2, 2, 2, "v2", "", /* certificateHash */ {});
+    service->mProcessor->OnLogEvent(CreateAppCrashEvent(start + 5, 100).get());
+
+    ConfigMetricsReport report =
+            getReports(service->mProcessor, start + 6, /*include_current=*/true);
+    backfillStartEndTimestamp(&report);
+
+    ASSERT_EQ(1, report.metrics_size());
+    ASSERT_EQ(1, report.metrics(0).count_metrics().data_size());
+    ASSERT_EQ(2, report.metrics(0).count_metrics().data(0).bucket_info_size());
+    EXPECT_EQ(1, report.metrics(0).count_metrics().data(0).bucket_info(0).count());
+    EXPECT_EQ(2, report.metrics(0).count_metrics().data(0).bucket_info(1).count());
+}
+
 TEST_F(PartialBucketE2eTest, TestCountMetricSplitOnRemoval) {
     sendConfig(MakeCountMetricConfig({true}));
     int64_t start = getElapsedRealtimeNs();  // This is the start-time the metrics producers are
@@ -282,6 +318,30 @@ TEST_F(PartialBucketE2eTest, TestValueMetricWithoutMinPartialBucket) {
               report.metrics(0).value_metrics().data(0).bucket_info(1).end_bucket_elapsed_nanos());
 }
 
+TEST_F(PartialBucketE2eTest, TestValueMetricNoSplitOnUnrelatedUpgrade) {
+    service->mPullerManager->RegisterPullAtomCallback(
+            /*uid=*/0, util::SUBSYSTEM_SLEEP_STATE, NS_PER_SEC, NS_PER_SEC * 10, {},
+            SharedRefBase::make<FakeSubsystemSleepCallback>());
+    service->mUidMap->updateApp(1, kApp2, 2, 1, "v1", "", /* certificateHash */ {});
+    sendConfig(MakeValueMetricConfig(0));
+    int64_t start = getElapsedRealtimeNs();  // This is the start-time the metrics producers are
+                                             // initialized with.
+
+    service->mProcessor->informPullAlarmFired(5 * 60 * NS_PER_SEC + start);
+    // The pulled atom does not come from kApp2, so its upgrade neither pulls nor splits.
+    service->mUidMap->updateApp(5 * 60 * NS_PER_SEC + start + 2 * NS_PER_SEC, kApp2, 2, 2, "v2",
+                                "", /* certificateHash */ {});
+
+    ConfigMetricsReport report =
+            getReports(service->mProcessor, 5 * 60 * NS_PER_SEC + start + 100 * NS_PER_SEC);
+    backfillStartEndTimestamp(&report);
+
+    ASSERT_EQ(1, report.metrics_size());
+    ASSERT_EQ(0, report.metrics(0).value_metrics().skipped_size());
+    ASSERT_EQ(2, report.metrics(0).value_metrics().data_size());
+    ASSERT_EQ(1, report.metrics(0).value_metrics().data(0).bucket_info_size());
+}
+
 TEST_F(PartialBucketE2eTest, TestValueMetricWithMinPartialBucket) {
     service->mPullerManager->RegisterPullAtomCallback(
             /*uid=*/0, util::SUBSYSTEM_SLEEP_STATE, NS_PER_SEC, NS_PER_SEC * 10, {},
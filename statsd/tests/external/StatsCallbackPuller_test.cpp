@@ -96,6 +96,26 @@ public:
     }
 };
 
+// Answers every pull on its own thread, so several pulls can be outstanding at once.
+class ConcurrentPullAtomCallback : public BnPullAtomCallback {
+public:
+    ~ConcurrentPullAtomCallback() {
+        joinPullThreads();
+    }
+    void joinPullThreads() {
+        for (std::thread& thread : mPullThreads) {
+            thread.join();
+        }
+        mPullThreads.clear();
+    }
+    Status onPullAtom(int atomTag,
+                      const shared_ptr<IPullAtomResultReceiver>& resultReceiver) override {
+        mPullThreads.emplace_back(executePull, resultReceiver);
+        return Status::ok();
+    }
+    vector<std::thread> mPullThreads;
+};
+
 class StatsCallbackPullerTest : public ::testing::Test {
 public:
     StatsCallbackPullerTest() {
@@ -211,6 +231,47 @@ TEST_F(StatsCallbackPullerTest, RegisterAndTimeout) {
     ASSERT_EQ(0, dataHolder.size());
 }
 
+TEST_F(StatsCallbackPullerTest, PullAsyncManyOutstanding) {
+    shared_ptr<ConcurrentPullAtomCallback> cb =
+            SharedRefBase::make<ConcurrentPullAtomCallback>();
+    pullSuccess = true;
+    pullDelayNs = MillisToNano(50);  // 50 ms.
+    int64_t value = 77;
+    values.push_back(value);
+
+    StatsCallbackPuller puller(pullTagId, cb, pullCoolDownNs, pullTimeoutNs, {});
+
+    const int numPulls = 3;
+    std::mutex lock;
+    std::condition_variable cv;
+    int numFinished = 0;
+    vector<int64_t> pulledValues;
+    int64_t startTimeNs = getElapsedRealtimeNs();
+    for (int i = 0; i < numPulls; i++) {
+        EXPECT_EQ(puller.PullAsync([&](bool success, vector<shared_ptr<LogEvent>>& data) {
+            std::lock_guard<std::mutex> lk(lock);
+            EXPECT_TRUE(success);
+            for (const shared_ptr<LogEvent>& event : data) {
+                pulledValues.push_back(event->getValues()[0].mValue.long_value);
+            }
+            numFinished++;
+            cv.notify_one();
+        }),
+                  PULL_SUCCESS);
+    }
+    // Issuing the pulls does not wait for any of them.
+    EXPECT_GT(pullDelayNs, getElapsedRealtimeNs() - startTimeNs);
+
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait(lk, [&] { return numFinished == numPulls; });
+    }
+    cb->joinPullThreads();
+    // The pulls were outstanding at the same time, so they took less than the delays in a row.
+    EXPECT_GT(numPulls * pullDelayNs, getElapsedRealtimeNs() - startTimeNs);
+    EXPECT_THAT(pulledValues, ElementsAre(value, value, value));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
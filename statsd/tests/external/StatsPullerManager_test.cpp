@@ -19,6 +19,9 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <thread>
+
 #include "stats_event.h"
 #include "tests/statsd_test_util.h"
 
@@ -74,6 +77,32 @@ public:
     int32_t mUid;
 };
 
+class SlowPullAtomCallback : public FakePullAtomCallback {
+public:
+    SlowPullAtomCallback(int32_t uid, int64_t delayMs)
+        : FakePullAtomCallback(uid), mDelayMs(delayMs){};
+    Status onPullAtom(int atomTag,
+                      const shared_ptr<IPullAtomResultReceiver>& resultReceiver) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(mDelayMs));
+        return FakePullAtomCallback::onPullAtom(atomTag, resultReceiver);
+    }
+    int64_t mDelayMs;
+};
+
+class FakePullDataReceiver : public PullDataReceiver {
+public:
+    void onDataPulled(const vector<shared_ptr<LogEvent>>& data, PullResult pullResult,
+                      int64_t originalPullTimeNs) override {
+        mData = data;
+        mPullResult = pullResult;
+    }
+    bool isPullNeeded() const override {
+        return true;
+    }
+    vector<shared_ptr<LogEvent>> mData;
+    PullResult mPullResult = PULL_NOT_NEEDED;
+};
+
 class FakePullUidProvider : public PullUidProvider {
 public:
     vector<int32_t> getPullAtomUids(int atomId) override {
@@ -145,6 +174,141 @@ TEST(StatsPullerManagerTest, TestPullConfigKeyNoPullerWithUid) {
     EXPECT_FALSE(pullerManager->Pull(pullTagId2, configKey, /*timestamp =*/1, &data));
 }
 
+TEST(StatsPullerManagerTest, TestRegisterPullAtomCallbacks) {
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    vector<PullAtomCallbackRegistration> registrations(3);
+    registrations[0].uid = uid1;
+    registrations[0].atomTag = pullTagId1;
+    registrations[0].pullerCallback = SharedRefBase::make<FakePullAtomCallback>(uid1);
+    registrations[1].uid = uid2;
+    registrations[1].atomTag = pullTagId1;
+    registrations[1].pullerCallback = SharedRefBase::make<FakePullAtomCallback>(uid2);
+    // Replaces the first registration.
+    registrations[2].uid = uid1;
+    registrations[2].atomTag = pullTagId1;
+    registrations[2].pullerCallback = SharedRefBase::make<FakePullAtomCallback>(uid2);
+    pullerManager->RegisterPullAtomCallbacks(registrations);
+
+    vector<shared_ptr<LogEvent>> data;
+    ASSERT_TRUE(pullerManager->Pull(pullTagId1, {uid1}, /*timestamp =*/1, &data));
+    ASSERT_EQ(data.size(), 1);
+    ASSERT_EQ(data[0]->getValues().size(), 1);
+    EXPECT_EQ(data[0]->getValues()[0].mValue.int_value, uid2);
+
+    data.clear();
+    EXPECT_TRUE(pullerManager->Pull(pullTagId1, {uid2}, /*timestamp =*/1, &data));
+    EXPECT_FALSE(pullerManager->Pull(pullTagId2, {uid1}, /*timestamp =*/1, &data));
+}
+
+TEST(StatsPullerManagerTest, TestAlarmPullsRunConcurrently) {
+    const int64_t delayMs = 200;
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    shared_ptr<SlowPullAtomCallback> cb = SharedRefBase::make<SlowPullAtomCallback>(uid2, delayMs);
+    pullerManager->RegisterPullAtomCallback(uid2, pullTagId1, coolDownNs, timeoutNs, {}, cb);
+    pullerManager->RegisterPullAtomCallback(uid2, pullTagId2, coolDownNs, timeoutNs, {}, cb);
+    sp<FakePullUidProvider> uidProvider = new FakePullUidProvider();
+    pullerManager->RegisterPullUidProvider(configKey, uidProvider);
+
+    const int64_t intervalNs = 60 * NS_PER_SEC;
+    sp<FakePullDataReceiver> receiver1 = new FakePullDataReceiver();
+    sp<FakePullDataReceiver> receiver2 = new FakePullDataReceiver();
+    pullerManager->RegisterReceiver(pullTagId1, configKey, receiver1, /*nextPullTimeNs=*/1,
+                                    intervalNs);
+    pullerManager->RegisterReceiver(pullTagId2, configKey, receiver2, /*nextPullTimeNs=*/1,
+                                    intervalNs);
+
+    const auto start = std::chrono::steady_clock::now();
+    pullerManager->OnAlarmFired(/*elapsedTimeNs=*/1);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // Both pulls ran at the same time, so the alarm took less than the two delays back to back.
+    EXPECT_LT(elapsed, std::chrono::milliseconds(2 * delayMs));
+    EXPECT_EQ(receiver1->mPullResult, PullResult::PULL_RESULT_SUCCESS);
+    ASSERT_EQ(receiver1->mData.size(), 1);
+    EXPECT_EQ(receiver1->mData[0]->GetTagId(), pullTagId1);
+    EXPECT_EQ(receiver2->mPullResult, PullResult::PULL_RESULT_SUCCESS);
+    ASSERT_EQ(receiver2->mData.size(), 1);
+    EXPECT_EQ(receiver2->mData[0]->GetTagId(), pullTagId2);
+}
+
+TEST(StatsPullerManagerTest, TestPrefetchPulls) {
+    const int64_t delayMs = 200;
+    sp<StatsPullerManager> pullerManager = new StatsPullerManager();
+    shared_ptr<SlowPullAtomCallback> cb = SharedRefBase::make<SlowPullAtomCallback>(uid2, delayMs);
+    pullerManager->RegisterPullAtomCallback(uid2, pullTagId1, coolDownNs, timeoutNs, {}, cb);
+    pullerManager->RegisterPullAtomCallback(uid2, pullTagId2, coolDownNs, timeoutNs, {}, cb);
+    sp<FakePullUidProvider> uidProvider = new FakePullUidProvider();
+    pullerManager->RegisterPullUidProvider(configKey, uidProvider);
+
+    const int64_t eventTimeNs = 1;
+    auto start = std::chrono::steady_clock::now();
+    pullerManager->PrefetchPulls({pullTagId1, pullTagId2}, configKey, eventTimeNs);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(2 * delayMs));
+
+    // The pulls for the same event are served from the cache.
+    start = std::chrono::steady_clock::now();
+    vector<shared_ptr<LogEvent>> data1;
+    EXPECT_TRUE(pullerManager->Pull(pullTagId1, configKey, eventTimeNs, &data1));
+    vector<shared_ptr<LogEvent>> data2;
+    EXPECT_TRUE(pullerManager->Pull(pullTagId2, configKey, eventTimeNs, &data2));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(delayMs));
+    ASSERT_EQ(data1.size(), 1);
+    EXPECT_EQ(data1[0]->GetTagId(), pullTagId1);
+    ASSERT_EQ(data2.size(), 1);
+    EXPECT_EQ(data2[0]->GetTagId(), pullTagId2);
+}
+
+TEST(StatsPullerManagerTest, TestAlarmCoalescesNearbyPulls) {
+    sp<StatsPullerManager> pullerManager = createPullerManagerAndRegister();
+    sp<FakePullUidProvider> uidProvider = new FakePullUidProvider();
+    pullerManager->RegisterPullUidProvider(configKey, uidProvider);
+    pullerManager->RegisterPullUidProvider(badConfigKey, uidProvider);
+
+    const int64_t intervalNs = 60 * NS_PER_SEC;
+    const int64_t firstPullTimeNs = 100 * NS_PER_SEC;
+    const int64_t nearbyPullTimeNs = firstPullTimeNs + 2 * NS_PER_SEC;
+    const int64_t farPullTimeNs = firstPullTimeNs + 30 * NS_PER_SEC;
+    sp<FakePullDataReceiver> receiver1 = new FakePullDataReceiver();
+    sp<FakePullDataReceiver> receiver2 = new FakePullDataReceiver();
+    sp<FakePullDataReceiver> receiver3 = new FakePullDataReceiver();
+    pullerManager->RegisterReceiver(pullTagId1, configKey, receiver1, firstPullTimeNs, intervalNs);
+    pullerManager->RegisterReceiver(pullTagId1, badConfigKey, receiver2, nearbyPullTimeNs,
+                                    intervalNs);
+    pullerManager->RegisterReceiver(pullTagId1, badConfigKey, receiver3, farPullTimeNs,
+                                    intervalNs);
+
+    // The alarm waits for the nearby pull but not for the far one.
+    EXPECT_EQ(pullerManager->mNextPullTimeNs, firstPullTimeNs);
+    EXPECT_EQ(pullerManager->getCoalescedAlarmTimeNsLocked(), nearbyPullTimeNs);
+
+    pullerManager->OnAlarmFired(nearbyPullTimeNs);
+    EXPECT_EQ(receiver1->mPullResult, PullResult::PULL_RESULT_SUCCESS);
+    ASSERT_EQ(receiver1->mData.size(), 1);
+    EXPECT_EQ(receiver2->mPullResult, PullResult::PULL_RESULT_SUCCESS);
+    ASSERT_EQ(receiver2->mData.size(), 1);
+    EXPECT_EQ(receiver1->mData[0], receiver2->mData[0]);
+    EXPECT_EQ(receiver3->mPullResult, PullResult::PULL_NOT_NEEDED);
+    ASSERT_EQ(receiver3->mData.size(), 0);
+    EXPECT_EQ(pullerManager->mNextPullTimeNs, farPullTimeNs);
+}
+
+TEST(StatsPullerManagerTest, TestIsPullAlarmDue) {
+    sp<StatsPullerManager> pullerManager = createPullerManagerAndRegister();
+    sp<FakePullUidProvider> uidProvider = new FakePullUidProvider();
+    pullerManager->RegisterPullUidProvider(configKey, uidProvider);
+    EXPECT_FALSE(pullerManager->IsPullAlarmDue(/*elapsedTimeNs=*/100 * NS_PER_SEC));
+
+    const int64_t pullTimeNs = 100 * NS_PER_SEC;
+    sp<FakePullDataReceiver> receiver = new FakePullDataReceiver();
+    pullerManager->RegisterReceiver(pullTagId1, configKey, receiver, pullTimeNs,
+                                    /*intervalNs=*/60 * NS_PER_SEC);
+    EXPECT_FALSE(pullerManager->IsPullAlarmDue(pullTimeNs - 1));
+    EXPECT_TRUE(pullerManager->IsPullAlarmDue(pullTimeNs));
+
+    pullerManager->OnAlarmFired(pullTimeNs);
+    EXPECT_FALSE(pullerManager->IsPullAlarmDue(pullTimeNs));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
\ No newline at end of file
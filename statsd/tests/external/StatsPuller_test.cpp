@@ -47,8 +47,8 @@ long pullDelayNs;
 
 class FakePuller : public StatsPuller {
 public:
-    FakePuller()
-        : StatsPuller(pullTagId, /*coolDownNs=*/MillisToNano(10), /*timeoutNs=*/MillisToNano(5)){};
+    FakePuller(int64_t timeoutNs = MillisToNano(5))
+        : StatsPuller(pullTagId, /*coolDownNs=*/MillisToNano(10), timeoutNs){};
 
 private:
     PullErrorCode PullInternal(vector<std::shared_ptr<LogEvent>>* data) override {
@@ -261,6 +261,85 @@ TEST_F(StatsPullerTest, PullSameEventTime) {
     EXPECT_EQ(33, dataHolder[0]->getValues()[0].mValue.int_value);
 }
 
+TEST_F(StatsPullerTest, PullSnapshotSharedWithCache) {
+    pullData.push_back(createSimpleEvent(1111L, 33));
+    pullSuccess = true;
+    int64_t eventTimeNs = getElapsedRealtimeNs();
+
+    PullSnapshot snapshot1;
+    EXPECT_EQ(puller.Pull(eventTimeNs, &snapshot1), PULL_SUCCESS);
+    ASSERT_NE(nullptr, snapshot1);
+    ASSERT_EQ(1, snapshot1->size());
+    EXPECT_EQ(33, (*snapshot1)[0]->getValues()[0].mValue.int_value);
+
+    // A cache hit hands out the same snapshot rather than a copy.
+    PullSnapshot snapshot2;
+    EXPECT_EQ(puller.Pull(eventTimeNs, &snapshot2), PULL_SUCCESS);
+    EXPECT_EQ(snapshot1, snapshot2);
+
+    // Clearing the cache does not affect snapshots already handed out.
+    puller.ForceClearCache();
+    ASSERT_EQ(1, snapshot1->size());
+
+    pullSuccess = false;
+    PullSnapshot failedSnapshot;
+    EXPECT_EQ(puller.Pull(eventTimeNs + 1, &failedSnapshot), PULL_FAIL);
+    ASSERT_NE(nullptr, failedSnapshot);
+    EXPECT_TRUE(failedSnapshot->empty());
+}
+
+TEST_F(StatsPullerTest, ExpensivePullCachedLonger) {
+    FakePuller slowPuller(/*timeoutNs=*/NS_PER_SEC);
+    pullData.push_back(createSimpleEvent(1111L, 33));
+    pullSuccess = true;
+    pullDelayNs = MillisToNano(30);
+
+    vector<std::shared_ptr<LogEvent>> dataHolder;
+    EXPECT_EQ(slowPuller.Pull(getElapsedRealtimeNs(), &dataHolder), PULL_SUCCESS);
+    ASSERT_EQ(1, dataHolder.size());
+
+    pullData.clear();
+    pullData.push_back(createSimpleEvent(2222L, 44));
+    pullDelayNs = 0;
+
+    // Past the 10ms cool down, but within twice the 30ms the pull took.
+    sleep_for(std::chrono::milliseconds(15));
+    dataHolder.clear();
+    EXPECT_EQ(slowPuller.Pull(getElapsedRealtimeNs(), &dataHolder), PULL_SUCCESS);
+    ASSERT_EQ(1, dataHolder.size());
+    EXPECT_EQ(33, dataHolder[0]->getValues()[0].mValue.int_value);
+    EXPECT_EQ(0, slowPuller.ClearCacheIfNecessary(getElapsedRealtimeNs()));
+
+    // Past the adaptive cool down too.
+    sleep_for(std::chrono::milliseconds(40));
+    dataHolder.clear();
+    EXPECT_EQ(slowPuller.Pull(getElapsedRealtimeNs(), &dataHolder), PULL_SUCCESS);
+    ASSERT_EQ(1, dataHolder.size());
+    EXPECT_EQ(44, dataHolder[0]->getValues()[0].mValue.int_value);
+}
+
+TEST_F(StatsPullerTest, RecentPullDuration) {
+    FakePuller slowPuller(/*timeoutNs=*/NS_PER_SEC);
+    EXPECT_EQ(0, slowPuller.getRecentPullDurationNs());
+
+    pullDelayNs = MillisToNano(20);
+    vector<std::shared_ptr<LogEvent>> dataHolder;
+    const int64_t eventTimeNs = getElapsedRealtimeNs();
+    EXPECT_EQ(slowPuller.Pull(eventTimeNs, &dataHolder), PULL_FAIL);
+    // Failed pulls are timed too.
+    EXPECT_GE(slowPuller.getRecentPullDurationNs(), MillisToNano(20));
+
+    // Served from the cache, which leaves the duration of the last actual pull.
+    pullDelayNs = 0;
+    EXPECT_EQ(slowPuller.Pull(eventTimeNs, &dataHolder), PULL_FAIL);
+    EXPECT_GE(slowPuller.getRecentPullDurationNs(), MillisToNano(20));
+
+    sleep_for(std::chrono::milliseconds(11));
+    pullSuccess = true;
+    EXPECT_EQ(slowPuller.Pull(getElapsedRealtimeNs(), &dataHolder), PULL_SUCCESS);
+    EXPECT_LT(slowPuller.getRecentPullDurationNs(), MillisToNano(20));
+}
+
 // Test pull takes longer than timeout, 2nd pull happens at same event time
 TEST_F(StatsPullerTest, PullTakeTooLongAndPullSameEventTime) {
     pullData.push_back(createSimpleEvent(1111L, 33));
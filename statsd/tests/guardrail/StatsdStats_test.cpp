@@ -221,6 +221,27 @@ TEST(StatsdStatsTest, TestConfigRemove) {
     EXPECT_TRUE(configReport2.has_deletion_time_sec());
 }
 
+TEST(StatsdStatsTest, TestIcedConfigStatsEncodedOnce) {
+    StatsdStats stats;
+    ConfigKey key(0, 12345);
+    stats.noteConfigReceived(key, 10, 20, 30, 10, {}, nullopt);
+    stats.noteConfigRemoved(key);
+    ASSERT_EQ(1, stats.mIceBox.size());
+    EXPECT_TRUE(stats.mIceBox.front()->encoded_proto.empty());
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(1, report.config_stats_size());
+    EXPECT_EQ(10, report.config_stats(0).metric_count());
+    EXPECT_TRUE(report.config_stats(0).has_deletion_time_sec());
+    EXPECT_FALSE(stats.mIceBox.front()->encoded_proto.empty());
+
+    // The next dump reuses the encoding.
+    StatsdStatsReport report2 = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(1, report2.config_stats_size());
+    EXPECT_EQ(report.config_stats(0).SerializeAsString(),
+              report2.config_stats(0).SerializeAsString());
+}
+
 TEST(StatsdStatsTest, TestSubStats) {
     StatsdStats stats;
     ConfigKey key(0, 12345);
@@ -335,6 +356,109 @@ TEST(StatsdStatsTest, TestSubStats) {
     EXPECT_EQ(1, configReport2.alert_stats(0).alerted_times());
 }
 
+TEST(StatsdStatsTest, TestMatcherMatchedCounter) {
+    StatsdStats stats;
+    ConfigKey key(0, 12345);
+    EXPECT_EQ(nullptr, stats.getMatcherMatchedCounter(key, StringToId("matcher1")));
+    stats.noteConfigReceived(key, 2, 3, 4, 5, {}, nullopt);
+
+    // The counter and noteMatcherMatched count into the same stat.
+    std::shared_ptr<std::atomic<int>> counter =
+            stats.getMatcherMatchedCounter(key, StringToId("matcher1"));
+    ASSERT_NE(nullptr, counter);
+    counter->fetch_add(2);
+    stats.noteMatcherMatched(key, StringToId("matcher1"));
+    // Matchers that never matched are not reported.
+    ASSERT_NE(nullptr, stats.getMatcherMatchedCounter(key, StringToId("matcher2")));
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ true);
+    ASSERT_EQ(1, report.config_stats_size());
+    ASSERT_EQ(1, report.config_stats(0).matcher_stats_size());
+    EXPECT_EQ(StringToId("matcher1"), report.config_stats(0).matcher_stats(0).id());
+    EXPECT_EQ(3, report.config_stats(0).matcher_stats(0).matched_times());
+
+    // Resetting the stats zeroes the counter, which stays in use.
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(1, report.config_stats_size());
+    EXPECT_EQ(0, report.config_stats(0).matcher_stats_size());
+    counter->fetch_add(1);
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(1, report.config_stats(0).matcher_stats_size());
+    EXPECT_EQ(1, report.config_stats(0).matcher_stats(0).matched_times());
+}
+
+TEST(StatsdStatsTest, TestCpuTimeStats) {
+    StatsdStats stats;
+    ConfigKey key(0, 12345);
+    EXPECT_EQ(nullptr, stats.getCpuTimeStats(key));
+    EXPECT_EQ(nullptr, stats.getMetricCpuTimeCounter(key, StringToId("metric1")));
+    stats.noteConfigReceived(key, 2, 3, 4, 5, {}, nullopt);
+
+    std::shared_ptr<CpuTimeStats> cpuTimeStats = stats.getCpuTimeStats(key);
+    ASSERT_NE(nullptr, cpuTimeStats);
+    std::shared_ptr<std::atomic<int64_t>> metricCounter =
+            stats.getMetricCpuTimeCounter(key, StringToId("metric1"));
+    ASSERT_NE(nullptr, metricCounter);
+    // Metrics that took no CPU time are not reported.
+    ASSERT_NE(nullptr, stats.getMetricCpuTimeCounter(key, StringToId("metric2")));
+    {
+        ScopedCpuTimer timer(&cpuTimeStats->pullNs, metricCounter.get());
+        volatile int64_t sum = 0;
+        for (int i = 0; i < 1000000; i++) {
+            sum += i;
+        }
+    }
+    EXPECT_GT(cpuTimeStats->pullNs, 0);
+    EXPECT_EQ(cpuTimeStats->pullNs, *metricCounter);
+    cpuTimeStats->logEventNs += 100;
+    cpuTimeStats->dumpReportNs += 200;
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(1, report.config_stats_size());
+    const auto& configReport = report.config_stats(0);
+    EXPECT_EQ(100, configReport.cpu_time_stats().log_event_ns());
+    EXPECT_EQ(200, configReport.cpu_time_stats().dump_report_ns());
+    EXPECT_EQ(cpuTimeStats->pullNs, configReport.cpu_time_stats().pull_ns());
+    ASSERT_EQ(1, configReport.metric_cpu_time_stats_size());
+    EXPECT_EQ(StringToId("metric1"), configReport.metric_cpu_time_stats(0).id());
+    EXPECT_EQ(*metricCounter, configReport.metric_cpu_time_stats(0).cpu_time_ns());
+
+    // Resetting the stats zeroes the counters, which stay in use.
+    report = getStatsdStatsReport(stats, /* reset stats */ true);
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_FALSE(report.config_stats(0).has_cpu_time_stats());
+    EXPECT_EQ(0, report.config_stats(0).metric_cpu_time_stats_size());
+    EXPECT_EQ(cpuTimeStats, stats.getCpuTimeStats(key));
+}
+
+TEST(StatsdStatsTest, TestMetricMemoryStats) {
+    StatsdStats stats;
+    ConfigKey key(0, 12345);
+    EXPECT_EQ(nullptr, stats.getMetricMemoryStats(key, StringToId("metric1")));
+    stats.noteConfigReceived(key, 2, 3, 4, 5, {}, nullopt);
+
+    std::shared_ptr<MetricMemoryStats> memoryStats =
+            stats.getMetricMemoryStats(key, StringToId("metric1"));
+    ASSERT_NE(nullptr, memoryStats);
+    EXPECT_EQ(memoryStats, stats.getMetricMemoryStats(key, StringToId("metric1")));
+    // Metrics that hold no memory are not reported.
+    ASSERT_NE(nullptr, stats.getMetricMemoryStats(key, StringToId("metric2")));
+    memoryStats->pastBucketBytes = 100;
+    memoryStats->currentStateBytes = 200;
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ true);
+    ASSERT_EQ(1, report.config_stats_size());
+    ASSERT_EQ(1, report.config_stats(0).metric_memory_stats_size());
+    const auto& metricReport = report.config_stats(0).metric_memory_stats(0);
+    EXPECT_EQ(StringToId("metric1"), metricReport.id());
+    EXPECT_EQ(100, metricReport.past_bucket_bytes());
+    EXPECT_EQ(200, metricReport.current_state_bytes());
+
+    // The memory is still in use after a reset.
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_EQ(1, report.config_stats(0).metric_memory_stats_size());
+}
+
 TEST(StatsdStatsTest, TestAtomLog) {
     StatsdStats stats;
     time_t now = time(nullptr);
@@ -724,8 +848,10 @@ TEST(StatsdStatsTest, TestAtomDroppedStats) {
 
     const int numDropped = 10;
     for (int i = 0; i < numDropped; i++) {
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, false);
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, false);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, false,
+                                     EVENT_PRIORITY_NORMAL);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, false,
+                                     EVENT_PRIORITY_NORMAL);
     }
 
     StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ true);
@@ -760,6 +886,86 @@ TEST(StatsdStatsTest, TestQueueStats) {
     ASSERT_EQ(1000, report.event_queue_stats().max_size_observed_elapsed_nanos());
 }
 
+TEST(StatsdStatsTest, TestAtomLatencyStats) {
+    StatsdStats stats;
+    ConfigKey key(0, 12345);
+    stats.noteConfigReceived(key, 2, 3, 4, 5, {}, nullopt);
+
+    stats.noteAtomLatency(10, LATENCY_STAGE_QUEUE_WAIT, 100);
+    stats.noteAtomLatency(10, LATENCY_STAGE_QUEUE_WAIT, 300);
+    stats.noteAtomLatency(10, LATENCY_STAGE_END_TO_END, 500);
+    stats.noteMetricsManagerLatency(key, 50);
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
+    ASSERT_EQ(2, report.atom_latency_stats_size());
+    const auto& queueWait = report.atom_latency_stats(0);
+    EXPECT_EQ(10, queueWait.atom_id());
+    EXPECT_EQ(LATENCY_STAGE_QUEUE_WAIT, queueWait.stage());
+    EXPECT_EQ(2, queueWait.latency().count());
+    EXPECT_EQ(400, queueWait.latency().sum_ns());
+    EXPECT_EQ(300, queueWait.latency().max_ns());
+    EXPECT_FALSE(queueWait.latency().kll_sketch().empty());
+    EXPECT_EQ(LATENCY_STAGE_END_TO_END, report.atom_latency_stats(1).stage());
+    EXPECT_EQ(1, report.atom_latency_stats(1).latency().count());
+
+    ASSERT_EQ(1, report.config_stats_size());
+    EXPECT_EQ(1, report.config_stats(0).metrics_manager_latency().count());
+    EXPECT_EQ(50, report.config_stats(0).metrics_manager_latency().max_ns());
+
+    // Pairs beyond the guardrail are dropped, known pairs keep counting.
+    for (int atomId = 100; atomId < 100 + StatsdStats::kMaxAtomLatencyStatsSize; atomId++) {
+        stats.noteAtomLatency(atomId, LATENCY_STAGE_PROCESS, 1);
+    }
+    EXPECT_EQ(StatsdStats::kMaxAtomLatencyStatsSize, (int)stats.mAtomLatencyStats.size());
+    stats.noteAtomLatency(10, LATENCY_STAGE_QUEUE_WAIT, 1);
+    EXPECT_EQ(3, (stats.mAtomLatencyStats[{10, LATENCY_STAGE_QUEUE_WAIT}].count));
+
+    report = getStatsdStatsReport(stats, /* reset stats */ true);
+    EXPECT_EQ(0, report.atom_latency_stats_size());
+    EXPECT_FALSE(report.config_stats(0).has_metrics_manager_latency());
+}
+
+TEST(StatsdStatsTest, TestEventQueueResidency) {
+    StatsdStats stats;
+
+    // Only the first of every kQueueResidencySamplingRate residencies is recorded.
+    for (int i = 0; i < 2 * (int)StatsdStats::kQueueResidencySamplingRate; i++) {
+        stats.noteEventQueueResidency(1000 + i);
+    }
+    stats.noteEventQueueReaderBoosted();
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ true);
+    const auto& residency = report.event_queue_stats().residency();
+    EXPECT_EQ(2, residency.count());
+    EXPECT_EQ(2000 + StatsdStats::kQueueResidencySamplingRate, residency.sum_ns());
+    EXPECT_EQ(1000 + StatsdStats::kQueueResidencySamplingRate, residency.max_ns());
+    EXPECT_FALSE(residency.kll_sketch().empty());
+    EXPECT_EQ(1, report.event_queue_stats().reader_boost_count());
+
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_FALSE(report.event_queue_stats().has_residency());
+    EXPECT_FALSE(report.event_queue_stats().has_reader_boost_count());
+}
+
+TEST(StatsdStatsTest, TestEventQueueOverflowPerPriority) {
+    StatsdStats stats;
+    stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, /*atomId*/ 100, false,
+                                 EVENT_PRIORITY_LOW);
+    stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, /*atomId*/ 100, false,
+                                 EVENT_PRIORITY_LOW);
+    stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, /*atomId*/ 101, false,
+                                 EVENT_PRIORITY_CRITICAL);
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ true);
+    EXPECT_EQ(3, report.queue_overflow().count());
+    EXPECT_EQ(2, report.queue_overflow().low_priority_count());
+    EXPECT_EQ(0, report.queue_overflow().normal_priority_count());
+    EXPECT_EQ(1, report.queue_overflow().critical_priority_count());
+
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_FALSE(report.has_queue_overflow());
+}
+
 TEST(StatsdStatsTest, TestAtomLoggedAndDroppedStats) {
     StatsdStats stats;
 
@@ -774,8 +980,10 @@ TEST(StatsdStatsTest, TestAtomLoggedAndDroppedStats) {
 
     const int numDropped = 10;
     for (int i = 0; i < numDropped; i++) {
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, false);
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, false);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, false,
+                                     EVENT_PRIORITY_NORMAL);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, false,
+                                     EVENT_PRIORITY_NORMAL);
     }
 
     StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
@@ -842,8 +1050,10 @@ TEST(StatsdStatsTest, TestAtomLoggedAndDroppedAndSkippedStats) {
 
     const int numDropped = 10;
     for (int i = 0; i < numDropped; i++) {
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, true);
-        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, true);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, pushAtomTag, true,
+                                     EVENT_PRIORITY_NORMAL);
+        stats.noteEventQueueOverflow(/*oldestEventTimestampNs*/ 0, nonPlatformPushAtomTag, true,
+                                     EVENT_PRIORITY_NORMAL);
     }
 
     StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
@@ -961,6 +1171,20 @@ TEST(StatsdStatsTest, TestSubscriptionPullThreadWakeup) {
     EXPECT_EQ(subscriptionStats.pull_thread_wakeup_count(), 1);
 }
 
+TEST(StatsdStatsTest, TestSubscriptionEventDropped) {
+    StatsdStats stats;
+
+    stats.noteSubscriptionEventDropped();
+    stats.noteSubscriptionEventDropped();
+
+    StatsdStatsReport report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_EQ(report.subscription_stats().dropped_event_count(), 2);
+
+    report = getStatsdStatsReport(stats, /* reset stats */ true);
+    report = getStatsdStatsReport(stats, /* reset stats */ false);
+    EXPECT_FALSE(report.subscription_stats().has_dropped_event_count());
+}
+
 TEST(StatsdStatsTest, TestSubscriptionStartedMaxActiveSubscriptions) {
     StatsdStats stats;
 
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "src/hash.h"
+
+#include <gtest/gtest.h>
+
+#ifdef __ANDROID__
+
+using std::string;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(HashTest, TestFastHash64) {
+    EXPECT_EQ(FastHash64("statsd"), FastHash64(string("statsd")));
+    EXPECT_NE(FastHash64("statsd"), FastHash64("statsD"));
+    EXPECT_NE(FastHash64(""), FastHash64(string(1, '\0')));
+    EXPECT_NE(FastHash64(string(7, '\0')), FastHash64(string(8, '\0')));
+
+    // Strings longer than a word are hashed to their end.
+    const string prefix = "com.google.android.apps";
+    EXPECT_NE(FastHash64(prefix + ".a"), FastHash64(prefix + ".b"));
+}
+
+TEST(HashTest, TestStreamingHash64) {
+    StreamingHash64 hasher1;
+    hasher1.add(1);
+    hasher1.add(2);
+    StreamingHash64 hasher2;
+    hasher2.add(1);
+    hasher2.add(2);
+    EXPECT_EQ(hasher1.hash(), hasher2.hash());
+
+    StreamingHash64 swapped;
+    swapped.add(2);
+    swapped.add(1);
+    EXPECT_NE(hasher1.hash(), swapped.hash());
+
+    StreamingHash64 longer;
+    longer.add(1);
+    longer.add(2);
+    longer.add(0);
+    EXPECT_NE(hasher1.hash(), longer.hash());
+
+    StreamingHash64 seeded(1);
+    seeded.add(1);
+    seeded.add(2);
+    EXPECT_NE(hasher1.hash(), seeded.hash());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,96 @@
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "logd/LogEventPool.h"
+
+#include <gtest/gtest.h>
+
+#include "stats_event.h"
+#include "tests/statsd_test_util.h"
+
+namespace android {
+namespace os {
+namespace statsd {
+
+using std::unique_ptr;
+using std::vector;
+
+#ifdef __ANDROID__
+namespace {
+
+unique_ptr<LogEvent> makeLogEvent(LogEventPool& pool, int32_t uid, int32_t pid, int atomId) {
+    AStatsEvent* statsEvent = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(statsEvent, atomId);
+    AStatsEvent_writeInt32(statsEvent, 10);
+    AStatsEvent_writeString(statsEvent, "value");
+    unique_ptr<LogEvent> logEvent = pool.obtain(uid, pid);
+    parseStatsEventToLogEvent(statsEvent, logEvent.get());
+    return logEvent;
+}
+
+}  // anonymous namespace
+
+TEST(LogEventPoolTest, TestReuse) {
+    LogEventPool& pool = LogEventPool::getInstance();
+    pool.clear();
+
+    vector<unique_ptr<LogEvent>> events;
+    events.push_back(makeLogEvent(pool, /*uid=*/1000, /*pid=*/1001, /*atomId=*/100));
+    const LogEvent* recycledEvent = events.back().get();
+    ASSERT_EQ(2, recycledEvent->size());
+    const size_t valuesCapacity = recycledEvent->getValues().capacity();
+
+    pool.recycle(events);
+    EXPECT_TRUE(events.empty());
+    EXPECT_EQ(1, pool.size());
+
+    // The recycled event comes back as new, but with the capacity of its values.
+    unique_ptr<LogEvent> event = pool.obtain(/*uid=*/2000, /*pid=*/2001);
+    EXPECT_EQ(recycledEvent, event.get());
+    EXPECT_EQ(0, pool.size());
+    EXPECT_EQ(2000, event->GetUid());
+    EXPECT_EQ(2001, event->GetPid());
+    EXPECT_EQ(0, event->GetTagId());
+    EXPECT_TRUE(event->isValid());
+    EXPECT_FALSE(event->isParsedHeaderOnly());
+    EXPECT_FALSE(event->hasAttributionChain());
+    EXPECT_EQ(0, event->size());
+    EXPECT_EQ(valuesCapacity, event->getValues().capacity());
+
+    pool.clear();
+}
+
+TEST(LogEventPoolTest, TestMaxPooledEvents) {
+    LogEventPool& pool = LogEventPool::getInstance();
+    pool.clear();
+
+    vector<unique_ptr<LogEvent>> events;
+    for (size_t i = 0; i < LogEventPool::kMaxPooledEvents + 10; i++) {
+        events.push_back(pool.obtain(/*uid=*/1000, /*pid=*/1001));
+    }
+    pool.recycle(events);
+    EXPECT_TRUE(events.empty());
+    EXPECT_EQ(LogEventPool::kMaxPooledEvents, pool.size());
+
+    pool.clear();
+    EXPECT_EQ(0, pool.size());
+}
+
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
@@ -43,10 +43,13 @@ AStatsEvent* makeStatsEvent(uint64_t timestampNs) {
     return statsEvent;
 }
 
-std::unique_ptr<LogEvent> makeLogEvent(uint64_t timestampNs) {
+// Critical events may use the whole queue.
+std::unique_ptr<LogEvent> makeLogEvent(uint64_t timestampNs,
+                                       EventPriority priority = EVENT_PRIORITY_CRITICAL) {
     AStatsEvent* statsEvent = makeStatsEvent(timestampNs);
     std::unique_ptr<LogEvent> logEvent = std::make_unique<LogEvent>(/*uid=*/0, /*pid=*/0);
     parseStatsEventToLogEvent(statsEvent, logEvent.get());
+    logEvent->setPriority(priority);
     EXPECT_EQ(logEvent->GetElapsedTimestampNs(), timestampNs);
     return logEvent;
 }
@@ -115,6 +118,192 @@ TEST(LogEventQueue_test, TestSlowConsumer) {
     writer.join();
 }
 
+TEST(LogEventQueue_test, TestMultipleProducers) {
+    LogEventQueue queue(50);
+    const int kProducerCount = 4;
+    const int kEventsPerProducer = 100;
+    std::vector<std::thread> writers;
+    for (int producer = 0; producer < kProducerCount; producer++) {
+        writers.emplace_back([&queue, producer] {
+            for (int i = 0; i < kEventsPerProducer; i++) {
+                // Encode the producer in the high bits to check the per producer order.
+                const int64_t eventTimeNs = ((int64_t)producer << 32) + i;
+                while (!queue.push(makeLogEvent(eventTimeNs)).success) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        });
+    }
+
+    std::vector<int64_t> lastEventIndex(kProducerCount, -1);
+    for (int i = 0; i < kProducerCount * kEventsPerProducer; i++) {
+        auto event = queue.waitPop();
+        ASSERT_TRUE(event != nullptr);
+        const int producer = event->GetElapsedTimestampNs() >> 32;
+        const int64_t index = event->GetElapsedTimestampNs() & 0xffffffff;
+        ASSERT_GE(producer, 0);
+        ASSERT_LT(producer, kProducerCount);
+        // Events from the same producer are in right order.
+        EXPECT_EQ(lastEventIndex[producer] + 1, index);
+        lastEventIndex[producer] = index;
+    }
+
+    for (auto& writer : writers) {
+        writer.join();
+    }
+}
+
+TEST(LogEventQueue_test, TestPushBatch) {
+    LogEventQueue queue(10);
+    const int64_t eventTimeNs = 100;
+
+    std::vector<std::unique_ptr<LogEvent>> events;
+    for (int i = 0; i < 6; i++) {
+        events.push_back(makeLogEvent(eventTimeNs + i));
+    }
+    LogEventQueue::BatchResult result = queue.pushBatch(events);
+    EXPECT_EQ(6, result.pushedCount);
+    EXPECT_EQ(6, result.size);
+    EXPECT_EQ(eventTimeNs + 5, result.lastTimestampNs);
+
+    // Only 4 of the next 6 events fit into the queue.
+    events.clear();
+    for (int i = 6; i < 12; i++) {
+        events.push_back(makeLogEvent(eventTimeNs + i));
+    }
+    result = queue.pushBatch(events);
+    EXPECT_EQ(4, result.pushedCount);
+    EXPECT_EQ(10, result.size);
+    EXPECT_EQ(eventTimeNs + 9, result.lastTimestampNs);
+    EXPECT_EQ(eventTimeNs, result.oldestTimestampNs);
+    ASSERT_NE(nullptr, events[4]);
+    EXPECT_EQ(eventTimeNs + 10, events[4]->GetElapsedTimestampNs());
+
+    for (int i = 0; i < 10; i++) {
+        auto event = queue.waitPop();
+        ASSERT_TRUE(event != nullptr);
+        // All events are in right order.
+        EXPECT_EQ(eventTimeNs + i, event->GetElapsedTimestampNs());
+    }
+}
+
+TEST(LogEventQueue_test, TestPriorityLimits) {
+    LogEventQueue queue(10);
+    const int64_t eventTimeNs = 100;
+
+    // Low priority events only get half of the queue.
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + i, EVENT_PRIORITY_LOW)).success);
+    }
+    LogEventQueue::Result result = queue.push(makeLogEvent(eventTimeNs, EVENT_PRIORITY_LOW));
+    EXPECT_FALSE(result.success);
+    EXPECT_EQ(5, result.size);
+    EXPECT_EQ(eventTimeNs, result.oldestTimestampNs);
+
+    // The last tenth of the queue is kept for critical events.
+    for (int i = 5; i < 9; i++) {
+        EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + i, EVENT_PRIORITY_NORMAL)).success);
+    }
+    EXPECT_FALSE(queue.push(makeLogEvent(eventTimeNs, EVENT_PRIORITY_NORMAL)).success);
+    EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + 9, EVENT_PRIORITY_CRITICAL)).success);
+    EXPECT_FALSE(queue.push(makeLogEvent(eventTimeNs, EVENT_PRIORITY_CRITICAL)).success);
+
+    for (int i = 0; i < 10; i++) {
+        auto event = queue.waitPop();
+        ASSERT_TRUE(event != nullptr);
+        EXPECT_EQ(eventTimeNs + i, event->GetElapsedTimestampNs());
+    }
+}
+
+TEST(LogEventQueue_test, TestPushBatchPriorityLimits) {
+    LogEventQueue queue(10);
+    const int64_t eventTimeNs = 100;
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + i)).success);
+    }
+
+    // Only one low priority event fits under half of the queue, the events the queue is full for
+    // are moved behind the pushed ones.
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(makeLogEvent(eventTimeNs + 4, EVENT_PRIORITY_LOW));
+    events.push_back(makeLogEvent(eventTimeNs + 5, EVENT_PRIORITY_LOW));
+    events.push_back(makeLogEvent(eventTimeNs + 6, EVENT_PRIORITY_NORMAL));
+    events.push_back(makeLogEvent(eventTimeNs + 7, EVENT_PRIORITY_LOW));
+    events.push_back(makeLogEvent(eventTimeNs + 8, EVENT_PRIORITY_CRITICAL));
+    LogEventQueue::BatchResult result = queue.pushBatch(events);
+    EXPECT_EQ(3, result.pushedCount);
+    EXPECT_EQ(7, result.size);
+    EXPECT_EQ(eventTimeNs + 8, result.lastTimestampNs);
+    EXPECT_EQ(eventTimeNs, result.oldestTimestampNs);
+    ASSERT_NE(nullptr, events[3]);
+    ASSERT_NE(nullptr, events[4]);
+    EXPECT_EQ(EVENT_PRIORITY_LOW, events[3]->getPriority());
+    EXPECT_EQ(EVENT_PRIORITY_LOW, events[4]->getPriority());
+
+    const std::vector<int64_t> expectedTimestampsNs = {100, 101, 102, 103, 104, 106, 108};
+    for (int64_t expectedTimestampNs : expectedTimestampsNs) {
+        auto event = queue.waitPop();
+        ASSERT_TRUE(event != nullptr);
+        EXPECT_EQ(expectedTimestampNs, event->GetElapsedTimestampNs());
+    }
+}
+
+TEST(LogEventQueue_test, TestWaitPopBatch) {
+    LogEventQueue queue(50);
+    const int64_t eventTimeNs = 100;
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + i)).success);
+    }
+
+    // Only up to maxCount events are popped.
+    std::vector<std::unique_ptr<LogEvent>> events;
+    queue.waitPopBatch(events, 4);
+    ASSERT_EQ(4, events.size());
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(eventTimeNs + i, events[i]->GetElapsedTimestampNs());
+    }
+
+    // The events already queued are popped without blocking for more.
+    events.clear();
+    queue.waitPopBatch(events, 50);
+    ASSERT_EQ(6, events.size());
+    for (int i = 0; i < 6; i++) {
+        EXPECT_EQ(eventTimeNs + 4 + i, events[i]->GetElapsedTimestampNs());
+    }
+
+    // A parked consumer is woken up by the next push.
+    std::thread writer([&queue, eventTimeNs] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_TRUE(queue.push(makeLogEvent(eventTimeNs + 10)).success);
+    });
+    events.clear();
+    queue.waitPopBatch(events, 50);
+    ASSERT_EQ(1, events.size());
+    EXPECT_EQ(eventTimeNs + 10, events[0]->GetElapsedTimestampNs());
+    writer.join();
+}
+
+TEST(LogEventQueue_test, TestEnqueueTimestamp) {
+    LogEventQueue queue(10);
+    const int64_t startNs = getElapsedRealtimeNs();
+    EXPECT_TRUE(queue.push(makeLogEvent(100)).success);
+    std::vector<std::unique_ptr<LogEvent>> events;
+    events.push_back(makeLogEvent(101));
+    events.push_back(makeLogEvent(102));
+    EXPECT_EQ(2, queue.pushBatch(events).pushedCount);
+    const int64_t endNs = getElapsedRealtimeNs();
+
+    events.clear();
+    queue.waitPopBatch(events, 10);
+    ASSERT_EQ(3, events.size());
+    for (const auto& event : events) {
+        EXPECT_GE(event->getEnqueueTimestampNs(), startNs);
+        EXPECT_LE(event->getEnqueueTimestampNs(), endNs);
+    }
+    // The events of a batch share the enqueue time.
+    EXPECT_EQ(events[1]->getEnqueueTimestampNs(), events[2]->getEnqueueTimestampNs());
+}
+
 TEST(LogEventQueue_test, TestQueueMaxSize) {
     StatsdStats::getInstance().reset();
 
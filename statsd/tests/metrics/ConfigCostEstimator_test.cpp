@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "src/metrics/ConfigCostEstimator.h"
+
+#include <gtest/gtest.h>
+
+#include "src/StatsLogProcessor.h"
+#include "src/guardrail/StatsdStats.h"
+#include "src/state/StateManager.h"
+#include "tests/statsd_test_util.h"
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int kAtomId = 10001;
+const int kOtherAtomId = 10002;
+const int64_t kSampleStartNs = 100 * NS_PER_SEC;
+
+// Records an atom with a uid field as StatsSocketListener would receive it.
+DatagramRecord createRecord(int atomId, int64_t timestampNs, int32_t uid) {
+    AStatsEvent* statsEvent = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(statsEvent, atomId);
+    AStatsEvent_overwriteTimestamp(statsEvent, timestampNs);
+    AStatsEvent_writeInt32(statsEvent, uid);
+    AStatsEvent_build(statsEvent);
+    size_t size;
+    const uint8_t* buffer = AStatsEvent_getBuffer(statsEvent, &size);
+
+    DatagramRecord record{timestampNs, timestampNs, (uint32_t)uid, /* pid */ 1, {}};
+    record.datagram.resize(sizeof(android_log_header_t) + sizeof(uint32_t));
+    record.datagram.insert(record.datagram.end(), buffer, buffer + size);
+    AStatsEvent_release(statsEvent);
+    return record;
+}
+
+StatsdConfig createConfig() {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateSimpleAtomMatcher("What", kAtomId);
+    CountMetric* metric = config.add_count_metric();
+    *metric = createCountMetric("Count", config.atom_matcher(0).id(), /* condition */ nullopt,
+                                /* states */ {});
+    *metric->mutable_dimensions_in_what() = CreateDimensions(kAtomId, {1 /* uid */});
+    return config;
+}
+
+}  // anonymous namespace
+
+TEST(ConfigCostEstimatorTest, TestEstimateFromSample) {
+    // No atom was counted since the reset, so the rate is measured on the sample.
+    StatsdStats::getInstance().reset();
+    vector<DatagramRecord> sample;
+    for (int i = 0; i < 4; i++) {
+        sample.push_back(createRecord(kAtomId, kSampleStartNs + i * NS_PER_SEC, 1000 + i));
+    }
+    // Not used by the config, so neither processed nor counted.
+    sample.push_back(createRecord(kOtherAtomId, kSampleStartNs + 4 * NS_PER_SEC, 1000));
+
+    ConfigCostEstimate estimate;
+    ASSERT_TRUE(ConfigCostEstimator::estimate(createConfig(), sample, new UidMap(), &estimate));
+    EXPECT_EQ(4, estimate.sampleEventCount);
+    EXPECT_TRUE(estimate.rateFromSample);
+    EXPECT_DOUBLE_EQ(1, estimate.eventsPerSec);
+    EXPECT_GT(estimate.costPerEventNs, 0);
+    EXPECT_GT(estimate.memoryBytes, 0);
+}
+
+TEST(ConfigCostEstimatorTest, TestEstimateAtomNotInUse) {
+    // Only the other atom is in use, so the socket filter dropped the atom before the sample.
+    StatsdStats::getInstance().reset();
+    StatsdStats::getInstance().mStartTimeSec = getWallClockSec() - 10;
+    for (int i = 0; i < 20; i++) {
+        StatsdStats::getInstance().noteAtomLogged(kOtherAtomId, getWallClockSec(), false);
+    }
+    vector<DatagramRecord> sample;
+    for (int i = 0; i < 4; i++) {
+        sample.push_back(createRecord(kAtomId, kSampleStartNs + i * NS_PER_SEC, 1000 + i));
+    }
+    sample.push_back(createRecord(kOtherAtomId, kSampleStartNs + 4 * NS_PER_SEC, 1000));
+
+    StatsdConfig config = createConfig();
+    *config.add_atom_matcher() = CreateSimpleAtomMatcher("Other", kOtherAtomId);
+    *config.add_count_metric() = createCountMetric("OtherCount", config.atom_matcher(1).id(),
+                                                   /* condition */ nullopt, /* states */ {});
+
+    ConfigCostEstimate estimate;
+    ASSERT_TRUE(ConfigCostEstimator::estimate(config, sample, new UidMap(), &estimate));
+    EXPECT_EQ(5, estimate.sampleEventCount);
+    // 1 per second of the atom in the sample, 2 per second of the other atom in the stats.
+    EXPECT_TRUE(estimate.rateFromSample);
+    EXPECT_NEAR(3, estimate.eventsPerSec, 0.2);
+}
+
+TEST(ConfigCostEstimatorTest, TestEstimateWithoutProcessorLock) {
+    StatsdStats::getInstance().reset();
+    const ConfigKey cfgKey(0, 12345);
+    sp<StatsLogProcessor> processor =
+            CreateStatsLogProcessor(NS_PER_SEC, NS_PER_SEC, createConfig(), cfgKey);
+
+    // Sliced by screen state, which is not tracked yet.
+    StatsdConfig config = createConfig();
+    *config.add_state() = CreateScreenState();
+    config.mutable_count_metric(0)->add_slice_by_state(config.state(0).id());
+    vector<DatagramRecord> sample = {createRecord(kAtomId, kSampleStartNs, 1000)};
+    const int stateTrackersCount = StateManager::getInstance().getStateTrackersCount();
+
+    // Events, dumps and config updates keep going while the estimate is built and replayed.
+    std::lock_guard<std::mutex> lock(processor->mMetricsMutex);
+    ConfigCostEstimate estimate;
+    ASSERT_TRUE(processor->estimateConfigCost(config, sample, &estimate));
+    EXPECT_EQ(1, estimate.sampleEventCount);
+    // The estimated metrics never registered with the StateManager.
+    EXPECT_EQ(stateTrackersCount, StateManager::getInstance().getStateTrackersCount());
+}
+
+TEST(ConfigCostEstimatorTest, TestInvalidConfig) {
+    StatsdConfig config = createConfig();
+    config.mutable_count_metric(0)->set_what(StringToId("Unknown"));
+
+    ConfigCostEstimate estimate;
+    EXPECT_FALSE(ConfigCostEstimator::estimate(config, {}, new UidMap(), &estimate));
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -28,7 +28,10 @@
 
 using namespace testing;
 using android::sp;
+using android::util::FIELD_COUNT_REPEATED;
+using android::util::FIELD_TYPE_MESSAGE;
 using std::set;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 
@@ -147,6 +150,181 @@ TEST(CountMetricProducerTest, TestNonDimensionalEvents) {
     ASSERT_EQ(2UL, buckets3.size());
 }
 
+TEST(CountMetricProducerTest, TestByteSize) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /*uid*/});
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer countProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    EXPECT_EQ(0UL, countProducer.byteSize());
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event1, bucketStartTimeNs + 1, tagId, /*uid=*/"111");
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event2, bucketStartTimeNs + 2, tagId, /*uid=*/"222");
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event1);
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event2);
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    EXPECT_EQ(2 * CountMetricProducer::kBucketSize, countProducer.byteSize());
+
+    LogEvent event3(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event3, bucketStartTimeNs + bucketSizeNs + 2, tagId, /*uid=*/"111");
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event3);
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + 2 * bucketSizeNs + 1);
+    EXPECT_EQ(3 * CountMetricProducer::kBucketSize, countProducer.byteSize());
+
+    // A dump that keeps the data keeps its size.
+    ProtoOutputStream output;
+    StringSet strSet;
+    countProducer.onDumpReport(bucketStartTimeNs + 2 * bucketSizeNs + 2,
+                               false /*include partial bucket*/, false /*erase data*/, FAST,
+                               &strSet, &output);
+    EXPECT_EQ(3 * CountMetricProducer::kBucketSize, countProducer.byteSize());
+
+    countProducer.onDumpReport(bucketStartTimeNs + 2 * bucketSizeNs + 3,
+                               false /*include partial bucket*/, true /*erase data*/, FAST,
+                               &strSet, &output);
+    EXPECT_EQ(0UL, countProducer.byteSize());
+}
+
+TEST(CountMetricProducerTest, TestHibernateWhenInactive) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t ttlNs = 10 * NS_PER_SEC;
+    int tagId = 1;
+    int activationMatcherIndex = 2;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /*uid*/});
+
+    std::unordered_map<int, std::shared_ptr<Activation>> eventActivationMap = {
+            {activationMatcherIndex, std::make_shared<Activation>(ACTIVATE_IMMEDIATELY, ttlNs)}};
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer countProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs,
+                                      eventActivationMap);
+    countProducer.activate(activationMatcherIndex, bucketStartTimeNs + 1);
+    ASSERT_TRUE(countProducer.isActive());
+
+    for (int i = 0; i < 100; i++) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        makeLogEvent(&event, bucketStartTimeNs + 2, tagId, /*uid=*/std::to_string(i));
+        countProducer.onMatchedLogEvent(1 /*log matcher index*/, event);
+    }
+    EXPECT_GT(countProducer.mCurrentSlicedCounter->capacity(), 0u);
+
+    // The activation expires: the bucket is flushed and its table released.
+    countProducer.flushIfExpire(bucketStartTimeNs + ttlNs + 2);
+    EXPECT_FALSE(countProducer.isActive());
+    EXPECT_EQ(100u, countProducer.mPastBuckets.size());
+    EXPECT_EQ(0u, countProducer.mCurrentSlicedCounter->capacity());
+
+    // Once active again, the metric counts as before.
+    countProducer.activate(activationMatcherIndex, bucketStartTimeNs + ttlNs + 3);
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event, bucketStartTimeNs + ttlNs + 4, tagId, /*uid=*/"1");
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event);
+    EXPECT_EQ(1u, countProducer.mCurrentSlicedCounter->size());
+}
+
+TEST(CountMetricProducerTest, TestCurrentStateByteSize) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /*uid*/});
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer countProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    EXPECT_EQ(0UL, countProducer.currentStateByteSize());
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event1, bucketStartTimeNs + 1, tagId, /*uid=*/"111");
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event2, bucketStartTimeNs + 2, tagId, /*uid=*/"222");
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event1);
+    countProducer.onMatchedLogEvent(1 /*log matcher index*/, event2);
+
+    // The table of the current bucket and the values of its two keys.
+    const size_t tableBytes = countProducer.mCurrentSlicedCounter->tableByteSize();
+    EXPECT_GT(tableBytes, 0UL);
+    EXPECT_GE(countProducer.currentStateByteSize(), tableBytes + 2 * sizeof(FieldValue));
+    // The current bucket is not part of the past buckets.
+    EXPECT_EQ(0UL, countProducer.byteSize());
+
+    // The table is kept for the next bucket.
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    EXPECT_GE(countProducer.currentStateByteSize(), tableBytes);
+}
+
+TEST(CountMetricProducerTest, TestDumpReportSnapshot) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+
+    // The snapshot is taken of one producer and the report dumped from the other.
+    sp<CountMetricProducer> snapshotProducer =
+            new CountMetricProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {}, wizard,
+                                    protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    sp<CountMetricProducer> dumpProducer =
+            new CountMetricProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {}, wizard,
+                                    protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    for (const sp<CountMetricProducer>& producer : {snapshotProducer, dumpProducer}) {
+        LogEvent event1(/*uid=*/0, /*pid=*/0);
+        makeLogEvent(&event1, bucketStartTimeNs + 1, tagId);
+        LogEvent event2(/*uid=*/0, /*pid=*/0);
+        makeLogEvent(&event2, bucketStartTimeNs + bucketSizeNs + 1, tagId);
+        producer->onMatchedLogEvent(1 /*log matcher index*/, event1);
+        producer->onMatchedLogEvent(1 /*log matcher index*/, event2);
+    }
+
+    const int64_t dumpTimeNs = bucketStartTimeNs + 2 * bucketSizeNs + 1;
+    unique_ptr<MetricProducer::DumpReportSnapshot> snapshot =
+            snapshotProducer->takeDumpReportSnapshot(dumpTimeNs, true /*include partial bucket*/,
+                                                     true /*erase data*/, FAST,
+                                                     false /*hashStrings*/);
+    // The data is taken out of the producer when the snapshot is taken, not when it is written.
+    EXPECT_EQ(0UL, snapshotProducer->mPastBuckets.size());
+    LogEvent event3(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event3, dumpTimeNs + 1, tagId);
+    snapshotProducer->onMatchedLogEvent(1 /*log matcher index*/, event3);
+
+    const uint64_t fieldId = FIELD_TYPE_MESSAGE | FIELD_COUNT_REPEATED | 1;
+    ProtoOutputStream snapshotOutput;
+    snapshot->write(fieldId, nullptr, &snapshotOutput);
+    vector<uint8_t> snapshotBytes;
+    snapshotOutput.serializeToVector(&snapshotBytes);
+
+    ProtoOutputStream dumpOutput;
+    uint64_t token = dumpOutput.start(fieldId);
+    StringSet strSet;
+    dumpProducer->onDumpReport(dumpTimeNs, true /*include partial bucket*/, true /*erase data*/,
+                               FAST, &strSet, &dumpOutput);
+    dumpOutput.end(token);
+    vector<uint8_t> dumpBytes;
+    dumpOutput.serializeToVector(&dumpBytes);
+
+    EXPECT_EQ(dumpBytes, snapshotBytes);
+}
+
 TEST(CountMetricProducerTest, TestEventsWithNonSlicedCondition) {
     int64_t bucketStartTimeNs = 10000000000;
     int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
@@ -521,6 +699,166 @@ TEST(CountMetricProducerTest, TestAnomalyDetectionUnSliced) {
               std::ceil(1.0 * event7.GetElapsedTimestampNs() / NS_PER_SEC + refPeriodSec));
 }
 
+TEST(CountMetricProducerTest, TestCounterTableReusedAcrossBuckets) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /* uid */});
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer countProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+
+    auto logEventsInBucket = [&](int64_t bucketNum) {
+        for (int i = 0; i < 20; i++) {
+            LogEvent event(/*uid=*/0, /*pid=*/0);
+            makeLogEvent(&event, bucketStartTimeNs + bucketNum * bucketSizeNs + 1 + i, tagId,
+                         "uid" + std::to_string(i));
+            countProducer.onMatchedLogEvent(1 /*log matcher index*/, event);
+        }
+    };
+
+    // Without anomaly trackers, the table is cleared in place and keeps its capacity.
+    logEventsInBucket(0);
+    const DimToValMap* table = countProducer.mCurrentSlicedCounter.get();
+    const size_t capacity = table->capacity();
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    EXPECT_EQ(table, countProducer.mCurrentSlicedCounter.get());
+    EXPECT_EQ(0UL, countProducer.mCurrentSlicedCounter->size());
+    EXPECT_EQ(capacity, countProducer.mCurrentSlicedCounter->capacity());
+
+    // The anomaly trackers copy the values of the closed bucket, so the table is still reused.
+    Alert alert;
+    alert.set_id(11);
+    alert.set_metric_id(1);
+    alert.set_trigger_if_sum_gt(100);
+    alert.set_num_buckets(2);
+    sp<AlarmMonitor> alarmMonitor;
+    sp<AnomalyTracker> anomalyTracker =
+            countProducer.addAnomalyTracker(alert, alarmMonitor, UPDATE_NEW, bucketStartTimeNs);
+
+    logEventsInBucket(1);
+    const MetricDimensionKey key = countProducer.mCurrentSlicedCounter->begin()->first;
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + 2 * bucketSizeNs + 1);
+    EXPECT_EQ(table, countProducer.mCurrentSlicedCounter.get());
+    EXPECT_EQ(0UL, countProducer.mCurrentSlicedCounter->size());
+    EXPECT_EQ(capacity, countProducer.mCurrentSlicedCounter->capacity());
+    EXPECT_EQ(1, anomalyTracker->getSumOverPastBuckets(key));
+}
+
+TEST(CountMetricProducerTest, TestTopKDimensions) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    metric.set_top_k_dimensions(2);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /* uid */});
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer countProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+
+    int64_t eventTimeNs = bucketStartTimeNs;
+    auto logEvents = [&](const string& uid, int count) {
+        for (int i = 0; i < count; i++) {
+            LogEvent event(/*uid=*/0, /*pid=*/0);
+            makeLogEvent(&event, ++eventTimeNs, tagId, uid);
+            countProducer.onMatchedLogEvent(1 /*log matcher index*/, event);
+        }
+    };
+    logEvents("uid1", 5);
+    logEvents("uid2", 1);
+    // uid3 takes over the counter of uid2, the lowest one.
+    logEvents("uid3", 3);
+    EXPECT_EQ(2UL, countProducer.mCurrentSlicedCounter->size());
+
+    countProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    ASSERT_EQ(2UL, countProducer.mPastBuckets.size());
+    EXPECT_EQ(0UL, countProducer.mCurrentCountErrors.size());
+    map<string, CountBucket> buckets;
+    for (const auto& [key, bucketList] : countProducer.mPastBuckets) {
+        ASSERT_EQ(1UL, bucketList.size());
+        buckets[key.getDimensionKeyInWhat().getValues()[0].mValue.str_value] = bucketList[0];
+    }
+    ASSERT_EQ(1UL, buckets.count("uid1"));
+    EXPECT_EQ(5, buckets["uid1"].mCount);
+    EXPECT_EQ(0, buckets["uid1"].mCountError);
+    // The true count of uid3 is between mCount - mCountError and mCount.
+    ASSERT_EQ(1UL, buckets.count("uid3"));
+    EXPECT_EQ(4, buckets["uid3"].mCount);
+    EXPECT_EQ(1, buckets["uid3"].mCountError);
+
+    ProtoOutputStream output;
+    StringSet strSet;
+    countProducer.onDumpReport(bucketStartTimeNs + bucketSizeNs + 2,
+                               false /*include partial bucket*/, true /*erase data*/, FAST,
+                               &strSet, &output);
+    StatsLogReport report = outputStreamToProto(&output);
+    ASSERT_EQ(2, report.count_metrics().data_size());
+    int64_t totalCountError = 0;
+    for (const CountMetricData& data : report.count_metrics().data()) {
+        ASSERT_EQ(1, data.bucket_info_size());
+        totalCountError += data.bucket_info(0).count_error();
+    }
+    EXPECT_EQ(1, totalCountError);
+}
+
+TEST(CountMetricProducerTest, TestDimensionBudgetShared) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    CountMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /* uid */});
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    CountMetricProducer smallProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    metric.set_id(2);
+    CountMetricProducer largeProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs, bucketStartTimeNs);
+    const size_t hardLimit = StatsdStats::kDimensionKeySizeHardLimit;
+    shared_ptr<DimensionBudget> budget = std::make_shared<DimensionBudget>();
+    smallProducer.setDimensionBudget(budget);
+    largeProducer.setDimensionBudget(budget);
+
+    auto logEvents = [&](CountMetricProducer& producer, int64_t bucketNum, int dimensionCount) {
+        for (int i = 0; i < dimensionCount; i++) {
+            LogEvent event(/*uid=*/0, /*pid=*/0);
+            makeLogEvent(&event, bucketStartTimeNs + bucketNum * bucketSizeNs + 1 + i, tagId,
+                         "uid" + std::to_string(i));
+            producer.onMatchedLogEvent(1 /*log matcher index*/, event);
+        }
+    };
+
+    logEvents(smallProducer, 0, 10);
+    logEvents(largeProducer, 0, hardLimit + 100);
+    EXPECT_EQ(hardLimit, largeProducer.mCurrentSlicedCounter->size());
+
+    // The small metric gives back half of its limit, which goes to the metric that dropped data.
+    smallProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    EXPECT_EQ(hardLimit / 2, budget->getFreeDimensionCount());
+    largeProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    EXPECT_EQ(0, budget->getFreeDimensionCount());
+
+    logEvents(largeProducer, 1, hardLimit + 100);
+    EXPECT_EQ(hardLimit + 100, largeProducer.mCurrentSlicedCounter->size());
+
+    // Without a budget, the metric has its own limit again.
+    largeProducer.setDimensionBudget(nullptr);
+    logEvents(largeProducer, 1, hardLimit + 200);
+    EXPECT_EQ(hardLimit + 100, largeProducer.mCurrentSlicedCounter->size());
+}
+
 TEST(CountMetricProducerTest, TestOneWeekTimeUnit) {
     CountMetric metric;
     metric.set_id(1);
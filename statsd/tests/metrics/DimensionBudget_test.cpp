@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "src/metrics/DimensionBudget.h"
+
+#include <gtest/gtest.h>
+
+#include "src/guardrail/StatsdStats.h"
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(DimensionBudgetTest, TestUnusedShareGoesToDroppingMetric) {
+    DimensionBudget budget;
+    const size_t idle = budget.addMetric(800);
+    const size_t busy = budget.addMetric(800);
+    EXPECT_EQ(0, budget.getFreeDimensionCount());
+
+    // Nothing to give until another metric returns keys.
+    EXPECT_EQ(800, budget.rebalance(busy, 800, /* hitLimit */ true));
+
+    // Keeps half again the observed cardinality, but never less than half of its own limit.
+    EXPECT_EQ(601, budget.rebalance(idle, 400, /* hitLimit */ false));
+    EXPECT_EQ(400, budget.rebalance(idle, 10, /* hitLimit */ false));
+    EXPECT_EQ(400, budget.getFreeDimensionCount());
+
+    EXPECT_EQ(1200, budget.rebalance(busy, 800, /* hitLimit */ true));
+    EXPECT_EQ(0, budget.getFreeDimensionCount());
+
+    // A share that is used does not shrink.
+    EXPECT_EQ(1200, budget.rebalance(busy, 1000, /* hitLimit */ false));
+}
+
+TEST(DimensionBudgetTest, TestShareCappedAtMaxLimit) {
+    DimensionBudget budget;
+    const size_t idle = budget.addMetric(StatsdStats::kDimensionKeySizeHardLimitMax);
+    const size_t busy = budget.addMetric(StatsdStats::kDimensionKeySizeHardLimitMax);
+    budget.rebalance(idle, 0, /* hitLimit */ false);
+
+    EXPECT_EQ(StatsdStats::kDimensionKeySizeHardLimitMax,
+              budget.rebalance(busy, StatsdStats::kDimensionKeySizeHardLimitMax,
+                               /* hitLimit */ true));
+    EXPECT_EQ(StatsdStats::kDimensionKeySizeHardLimitMax / 2, budget.getFreeDimensionCount());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
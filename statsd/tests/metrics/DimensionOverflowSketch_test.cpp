@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "src/metrics/DimensionOverflowSketch.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "src/stats_log.pb.h"
+#include "tests/statsd_test_util.h"
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int kTagId = 10;
+
+HashableDimensionKey makeDimension(int uid) {
+    int pos[] = {1, 0, 0};
+    HashableDimensionKey dimension;
+    dimension.addValue(FieldValue(Field(kTagId, pos, 0), Value(uid)));
+    return dimension;
+}
+
+}  // anonymous namespace
+
+TEST(DimensionOverflowSketchTest, TestDistinctCountEstimate) {
+    for (int distinctCount : {10, 1000, 100000}) {
+        DimensionOverflowSketch sketch;
+        for (int i = 0; i < distinctCount; i++) {
+            // Repeated dimensions do not count twice.
+            sketch.add(makeDimension(i));
+            sketch.add(makeDimension(i));
+        }
+        EXPECT_EQ(2 * distinctCount, sketch.getDroppedEventCount());
+        EXPECT_NEAR(distinctCount, sketch.estimateDistinctDimensionCount(), distinctCount * 0.1);
+    }
+}
+
+TEST(DimensionOverflowSketchTest, TestHeavyHitters) {
+    DimensionOverflowSketch sketch;
+    // Three heavy dimensions among many light ones.
+    for (int i = 0; i < 10000; i++) {
+        sketch.add(makeDimension(1000 + i));
+        if (i % 10 == 0) {
+            sketch.add(makeDimension(1));
+            sketch.add(makeDimension(2));
+        }
+        if (i % 5 == 0) {
+            sketch.add(makeDimension(3));
+        }
+    }
+
+    const vector<DimensionOverflowSketch::HeavyHitter> heavyHitters = sketch.getHeavyHitters();
+    ASSERT_EQ(DimensionOverflowSketch::kMaxHeavyHitters, heavyHitters.size());
+    EXPECT_EQ(makeDimension(3), heavyHitters[0].dimensionInWhat);
+    EXPECT_GE(heavyHitters[0].estimatedCount, 2000);
+    // The count-min sketch never underestimates.
+    EXPECT_GE(heavyHitters[1].estimatedCount, 1000);
+    EXPECT_GE(heavyHitters[2].estimatedCount, 1000);
+    vector<HashableDimensionKey> secondAndThird = {heavyHitters[1].dimensionInWhat,
+                                                   heavyHitters[2].dimensionInWhat};
+    EXPECT_THAT(secondAndThird, testing::UnorderedElementsAre(makeDimension(1), makeDimension(2)));
+}
+
+TEST(DimensionOverflowSketchTest, TestWriteToProto) {
+    DimensionOverflowSketch sketch;
+    sketch.add(makeDimension(1));
+    sketch.add(makeDimension(1));
+    sketch.add(makeDimension(2));
+
+    ProtoOutputStream output;
+    sketch.writeToProto(/* strSet */ nullptr, &output);
+    DimensionOverflowReport proto;
+    vector<uint8_t> bytes;
+    output.serializeToVector(&bytes);
+    ASSERT_TRUE(proto.ParseFromArray(bytes.data(), bytes.size()));
+    EXPECT_EQ(3, proto.dropped_event_count());
+    EXPECT_EQ(2, proto.estimated_dropped_dimension_count());
+    ASSERT_EQ(2, proto.heavy_hitter_size());
+    EXPECT_EQ(2, proto.heavy_hitter(0).estimated_event_count());
+    EXPECT_EQ(kTagId, proto.heavy_hitter(0).dimensions_in_what().field());
+    EXPECT_EQ(1, proto.heavy_hitter(1).estimated_event_count());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -614,6 +614,164 @@ TEST(DurationMetricProducerTest, TestClearCurrentSlicedTrackerMapWhenStop) {
     EXPECT_EQ(1, durationProducer.getCurrentBucketNum());
 }
 
+TEST(DurationMetricProducerTest, TestReuseErasedDurationTracker) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    DurationMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    metric.set_aggregation_type(DurationMetric_AggregationType_SUM);
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    FieldMatcher dimensions;
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event1, bucketStartTimeNs + 50, tagId);
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event2, bucketStartTimeNs + 100, tagId);
+    LogEvent event3(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event3, bucketStartTimeNs + bucketSizeNs + 10, tagId);
+    LogEvent event4(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event4, bucketStartTimeNs + bucketSizeNs + 40, tagId);
+
+    DurationMetricProducer durationProducer(
+            kConfigKey, metric, -1 /* no condition */, {}, -1 /*what index not needed*/,
+            1 /* start index */, 2 /* stop index */, 3 /* stop_all index */, false /*nesting*/,
+            wizard, protoHash, dimensions, bucketStartTimeNs, bucketStartTimeNs);
+
+    durationProducer.onMatchedLogEvent(1 /* start index*/, event1);
+    durationProducer.onMatchedLogEvent(2 /* stop index*/, event2);
+    ASSERT_EQ(1UL, durationProducer.mCurrentSlicedDurationTrackerMap.size());
+    const DurationTracker* tracker =
+            durationProducer.mCurrentSlicedDurationTrackerMap.begin()->second.get();
+
+    // The flush erases the stopped tracker, which is kept for the next start.
+    durationProducer.flushIfNeededLocked(bucketStartTimeNs + bucketSizeNs + 1);
+    ASSERT_TRUE(durationProducer.mCurrentSlicedDurationTrackerMap.empty());
+    ASSERT_EQ(1UL, durationProducer.mDurationTrackerPool.size());
+
+    durationProducer.onMatchedLogEvent(1 /* start index*/, event3);
+    EXPECT_TRUE(durationProducer.mDurationTrackerPool.empty());
+    ASSERT_EQ(1UL, durationProducer.mCurrentSlicedDurationTrackerMap.size());
+    EXPECT_EQ(tracker, durationProducer.mCurrentSlicedDurationTrackerMap.begin()->second.get());
+    durationProducer.onMatchedLogEvent(2 /* stop index*/, event4);
+
+    durationProducer.flushIfNeededLocked(bucketStartTimeNs + 2 * bucketSizeNs + 1);
+    const vector<DurationBucket>& buckets =
+            durationProducer.mPastBuckets[DEFAULT_METRIC_DIMENSION_KEY];
+    ASSERT_EQ(2UL, buckets.size());
+    EXPECT_EQ(bucketStartTimeNs, buckets[0].mBucketStartNs);
+    EXPECT_EQ(50LL, buckets[0].mDuration);
+    EXPECT_EQ(bucketStartTimeNs + bucketSizeNs, buckets[1].mBucketStartNs);
+    EXPECT_EQ(bucketStartTimeNs + 2 * bucketSizeNs, buckets[1].mBucketEndNs);
+    EXPECT_EQ(30LL, buckets[1].mDuration);
+}
+
+TEST(DurationMetricProducerTest, TestLazyBucketFlush) {
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+    int tagId = 1;
+
+    DurationMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    metric.set_aggregation_type(DurationMetric_AggregationType_SUM);
+    DurationMetric lazyMetric = metric;
+    lazyMetric.set_lazy_bucket_flush(true);
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    FieldMatcher dimensions;
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event1, bucketStartTimeNs + 1, tagId);
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    makeLogEvent(&event2, bucketStartTimeNs + 3 * bucketSizeNs + 10, tagId);
+
+    DurationMetricProducer eagerProducer(
+            kConfigKey, metric, -1 /* no condition */, {}, -1 /*what index not needed*/,
+            1 /* start index */, 2 /* stop index */, 3 /* stop_all index */, false /*nesting*/,
+            wizard, protoHash, dimensions, bucketStartTimeNs, bucketStartTimeNs);
+    DurationMetricProducer lazyProducer(
+            kConfigKey, lazyMetric, -1 /* no condition */, {}, -1 /*what index not needed*/,
+            1 /* start index */, 2 /* stop index */, 3 /* stop_all index */, false /*nesting*/,
+            wizard, protoHash, dimensions, bucketStartTimeNs, bucketStartTimeNs);
+
+    for (DurationMetricProducer* producer : {&eagerProducer, &lazyProducer}) {
+        producer->onMatchedLogEvent(1 /* start index*/, event1);
+        producer->flushIfNeededLocked(bucketStartTimeNs + 3 * bucketSizeNs + 5);
+        EXPECT_EQ(3, producer->getCurrentBucketNum());
+    }
+    // The lazy producer has not split the open duration yet.
+    EXPECT_EQ(3UL, eagerProducer.mPastBuckets[DEFAULT_METRIC_DIMENSION_KEY].size());
+    EXPECT_TRUE(lazyProducer.mPastBuckets.empty());
+    ASSERT_EQ(1UL, lazyProducer.mPendingBucketFlushes.size());
+    ASSERT_EQ(1UL, lazyProducer.mCurrentSlicedDurationTrackerMap.size());
+    EXPECT_EQ(0, lazyProducer.mCurrentSlicedDurationTrackerMap.begin()->second
+                         ->getCurrentBucketNum());
+
+    for (DurationMetricProducer* producer : {&eagerProducer, &lazyProducer}) {
+        producer->onMatchedLogEvent(2 /* stop index*/, event2);
+    }
+    EXPECT_EQ(3UL, lazyProducer.mPastBuckets[DEFAULT_METRIC_DIMENSION_KEY].size());
+
+    const int64_t dumpTimeNs = bucketStartTimeNs + 4 * bucketSizeNs + 1;
+    auto eagerData = eagerProducer.takeDumpReportDataLocked(dumpTimeNs, false);
+    auto lazyData = lazyProducer.takeDumpReportDataLocked(dumpTimeNs, false);
+    EXPECT_TRUE(lazyProducer.mPendingBucketFlushes.empty());
+    EXPECT_TRUE(lazyProducer.mCurrentSlicedDurationTrackerMap.empty());
+    EXPECT_EQ(eagerData.pastBucketsByteSize, lazyData.pastBucketsByteSize);
+
+    const vector<DurationBucket>& eagerBuckets =
+            eagerData.pastBuckets[DEFAULT_METRIC_DIMENSION_KEY];
+    const vector<DurationBucket>& lazyBuckets = lazyData.pastBuckets[DEFAULT_METRIC_DIMENSION_KEY];
+    ASSERT_EQ(4UL, eagerBuckets.size());
+    ASSERT_EQ(eagerBuckets.size(), lazyBuckets.size());
+    for (size_t i = 0; i < eagerBuckets.size(); i++) {
+        EXPECT_EQ(eagerBuckets[i].mBucketStartNs, lazyBuckets[i].mBucketStartNs);
+        EXPECT_EQ(eagerBuckets[i].mBucketEndNs, lazyBuckets[i].mBucketEndNs);
+        EXPECT_EQ(eagerBuckets[i].mDuration, lazyBuckets[i].mDuration);
+        EXPECT_EQ(eagerBuckets[i].mConditionTrueNs, lazyBuckets[i].mConditionTrueNs);
+    }
+    EXPECT_EQ(bucketSizeNs - 1, lazyBuckets[0].mDuration);
+    EXPECT_EQ(10LL, lazyBuckets[3].mDuration);
+}
+
+TEST(DurationMetricProducerTest, TestSampleCheckOnDispatch) {
+    ShardOffsetProvider::getInstance().setShardOffset(5);
+    const int64_t bucketStartTimeNs = 10000000000;
+    const int tagId = 1;
+    const int shardCount = 2;
+
+    DurationMetric metric;
+    metric.set_id(1);
+    metric.set_bucket(ONE_MINUTE);
+    metric.set_aggregation_type(DurationMetric_AggregationType_SUM);
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    FieldMatcher dimensions;
+
+    DurationMetricProducer durationProducer(
+            kConfigKey, metric, -1 /* no condition */, {}, -1 /*what index not needed*/,
+            1 /* start index */, 2 /* stop index */, 3 /* stop_all index */, false /*nesting*/,
+            wizard, protoHash, dimensions, bucketStartTimeNs, bucketStartTimeNs);
+    EXPECT_FALSE(durationProducer.isDimensionallySampled());
+
+    SamplingInfo samplingInfo;
+    samplingInfo.shardCount = shardCount;
+    translateFieldMatcher(CreateDimensions(tagId, {1 /* uid */}), &samplingInfo.sampledWhatFields);
+    durationProducer.setSamplingInfo(samplingInfo);
+    EXPECT_TRUE(durationProducer.isDimensionallySampled());
+
+    // Uids 1001 and 1003 are in the sampled shard, 1002 is not.
+    shared_ptr<LogEvent> sampledEvent = makeUidLogEvent(tagId, bucketStartTimeNs + 1, 1001, 0, 0);
+    shared_ptr<LogEvent> unsampledEvent =
+            makeUidLogEvent(tagId, bucketStartTimeNs + 1, 1002, 0, 0);
+    EXPECT_TRUE(durationProducer.passesSampleCheck(1 /* start index */, *sampledEvent));
+    EXPECT_FALSE(durationProducer.passesSampleCheck(1 /* start index */, *unsampledEvent));
+    EXPECT_FALSE(durationProducer.passesSampleCheck(2 /* stop index */, *unsampledEvent));
+    // Stop all events reach the metric in every shard.
+    EXPECT_TRUE(durationProducer.passesSampleCheck(3 /* stop_all index */, *unsampledEvent));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
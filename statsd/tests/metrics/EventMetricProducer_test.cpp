@@ -89,7 +89,7 @@ TEST_F(EventMetricProducerTest, TestNoCondition) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 20, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
@@ -101,6 +101,67 @@ TEST_F(EventMetricProducerTest, TestNoCondition) {
     EXPECT_EQ(bucketStartTimeNs + 2, report.event_metrics().data(1).elapsed_timestamp_nanos());
 }
 
+TEST_F(EventMetricProducerTest, TestReservoirSampling) {
+    int64_t bucketStartTimeNs = 10000000000;
+    const int maxSampledEvents = 3;
+    const int eventCount = 100;
+
+    EventMetric metric;
+    metric.set_id(1);
+    metric.set_max_sampled_events(maxSampledEvents);
+
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    EventMetricProducer eventProducer(kConfigKey, metric, -1 /*-1 meaning no condition*/, {},
+                                      wizard, protoHash, bucketStartTimeNs);
+
+    size_t maxByteSize = 0;
+    for (int i = 0; i < eventCount; i++) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        CreateTwoValueLogEvent(&event, 1 /*tagId*/, bucketStartTimeNs + i + 1, i, i);
+        eventProducer.onMatchedLogEvent(1 /*matcher index*/, event);
+        if (i == maxSampledEvents - 1) {
+            maxByteSize = eventProducer.byteSize();
+        }
+    }
+    // The sample is full from the third event on, later events only replace sampled ones.
+    EXPECT_EQ(maxByteSize, eventProducer.byteSize());
+
+    // Dump without erasing data keeps the sample.
+    ProtoOutputStream output;
+    StringSet strSet;
+    eventProducer.onDumpReport(bucketStartTimeNs + eventCount + 1,
+                               true /*include current partial bucket*/, false /*erase data*/,
+                               FAST, &strSet, &output);
+    StatsLogReport report = outputStreamToProto(&output);
+    backfillAggregatedAtoms(&report);
+    ASSERT_EQ(maxSampledEvents, report.event_metrics().data_size());
+    EXPECT_EQ(eventCount, report.event_metrics().sampled_from_event_count());
+    for (int i = 1; i < maxSampledEvents; i++) {
+        EXPECT_LT(report.event_metrics().data(i - 1).elapsed_timestamp_nanos(),
+                  report.event_metrics().data(i).elapsed_timestamp_nanos());
+    }
+
+    ProtoOutputStream output2;
+    eventProducer.onDumpReport(bucketStartTimeNs + eventCount + 2,
+                               true /*include current partial bucket*/, true /*erase data*/,
+                               FAST, &strSet, &output2);
+    report = outputStreamToProto(&output2);
+    ASSERT_EQ(maxSampledEvents, report.event_metrics().data_size());
+    EXPECT_EQ(eventCount, report.event_metrics().sampled_from_event_count());
+
+    // The next report samples from the events matched after the last one.
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event, 1 /*tagId*/, bucketStartTimeNs + eventCount + 3, 0, 0);
+    eventProducer.onMatchedLogEvent(1 /*matcher index*/, event);
+    ProtoOutputStream output3;
+    eventProducer.onDumpReport(bucketStartTimeNs + eventCount + 4,
+                               true /*include current partial bucket*/, true /*erase data*/,
+                               FAST, &strSet, &output3);
+    report = outputStreamToProto(&output3);
+    ASSERT_EQ(1, report.event_metrics().data_size());
+    EXPECT_EQ(1, report.event_metrics().sampled_from_event_count());
+}
+
 TEST_F(EventMetricProducerTest, TestEventsWithNonSlicedCondition) {
     int64_t bucketStartTimeNs = 10000000000;
     int64_t eventStartTimeNs = bucketStartTimeNs + 1;
@@ -131,7 +192,7 @@ TEST_F(EventMetricProducerTest, TestEventsWithNonSlicedCondition) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 20, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
@@ -184,7 +245,7 @@ TEST_F(EventMetricProducerTest, TestEventsWithSlicedCondition) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 20, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
@@ -223,7 +284,7 @@ TEST_F(EventMetricProducerTest, TestOneAtomTagAggregatedEvents) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 50, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
@@ -275,7 +336,7 @@ TEST_F(EventMetricProducerTest, TestBytesFieldAggregatedEvents) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 50, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
@@ -323,7 +384,7 @@ TEST_F(EventMetricProducerTest, TestTwoAtomTagAggregatedEvents) {
 
     // Check dump report content.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     eventProducer.onDumpReport(bucketStartTimeNs + 50, true /*include current partial bucket*/,
                                true /*erase data*/, FAST, &strSet, &output);
 
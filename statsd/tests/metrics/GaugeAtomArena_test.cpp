@@ -0,0 +1,96 @@
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/metrics/GaugeAtomArena.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace android::os::statsd;
+using std::vector;
+
+#ifdef __ANDROID__
+
+namespace {
+
+vector<FieldValue> makeFields(int32_t first, size_t count) {
+    vector<FieldValue> fields;
+    for (size_t i = 0; i < count; i++) {
+        int pos[] = {static_cast<int>(i) + 1, 0, 0};
+        fields.emplace_back(Field(10, pos, 0), Value(first + static_cast<int32_t>(i)));
+    }
+    return fields;
+}
+
+}  // anonymous namespace
+
+TEST(GaugeAtomArenaTest, TestAdd) {
+    GaugeAtomArena arena;
+    vector<FieldValue> buffer = makeFields(100, 3);
+    GaugeFields first = arena.add(&buffer);
+    EXPECT_TRUE(buffer.empty());
+
+    buffer = makeFields(200, 2);
+    int pos[] = {3, 0, 0};
+    buffer.emplace_back(Field(10, pos, 0), Value("str"));
+    GaugeFields second = arena.add(&buffer);
+    EXPECT_EQ(6u, arena.size());
+
+    GaugeFields empty = arena.add(&buffer);
+    EXPECT_TRUE(empty.empty());
+    EXPECT_EQ(6u, arena.size());
+
+    ASSERT_EQ(3u, first.size());
+    EXPECT_EQ(100, first.front().mValue.int_value);
+    EXPECT_EQ(102, first.begin()[2].mValue.int_value);
+    ASSERT_EQ(3u, second.size());
+    EXPECT_EQ(200, second.front().mValue.int_value);
+    EXPECT_EQ("str", second.begin()[2].mValue.str_value);
+}
+
+TEST(GaugeAtomArenaTest, TestRangesStayValidAcrossSlabs) {
+    GaugeAtomArena arena;
+    vector<GaugeFields> ranges;
+    vector<FieldValue> buffer;
+    for (int32_t i = 0; i < 1000; i++) {
+        buffer = makeFields(i * 10, i % 7 + 1);
+        ranges.push_back(arena.add(&buffer));
+    }
+    // Larger than a slab.
+    buffer = makeFields(-1000, 1000);
+    GaugeFields large = arena.add(&buffer);
+
+    for (int32_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(static_cast<size_t>(i % 7 + 1), ranges[i].size());
+        int32_t expected = i * 10;
+        for (const FieldValue& field : ranges[i]) {
+            EXPECT_EQ(expected++, field.mValue.int_value);
+        }
+    }
+    ASSERT_EQ(1000u, large.size());
+    EXPECT_EQ(-1, large.begin()[999].mValue.int_value);
+
+    arena.clear();
+    EXPECT_EQ(0u, arena.size());
+    buffer = makeFields(7, 2);
+    GaugeFields afterClear = arena.add(&buffer);
+    ASSERT_EQ(2u, afterClear.size());
+    EXPECT_EQ(7, afterClear.front().mValue.int_value);
+    EXPECT_EQ(2u, arena.size());
+}
+
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -152,7 +152,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsNoCondition) {
 
     gaugeProducer.onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
-    auto it = gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields->begin();
+    auto it = gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields.begin();
     EXPECT_EQ(INT, it->mValue.getType());
     EXPECT_EQ(10, it->mValue.int_value);
     it++;
@@ -170,7 +170,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsNoCondition) {
     allData.push_back(makeLogEvent(tagId, bucket3StartTimeNs + 10, 24, "some value", 25));
     gaugeProducer.onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
-    it = gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields->begin();
+    it = gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields.begin();
     EXPECT_EQ(INT, it->mValue.getType());
     EXPECT_EQ(24, it->mValue.int_value);
     it++;
@@ -193,6 +193,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsNoCondition) {
 
     gaugeProducer.flushIfNeededLocked(bucket4StartTimeNs);
     ASSERT_EQ(0UL, gaugeProducer.mCurrentSlicedBucket->size());
+    EXPECT_EQ(0UL, gaugeProducer.mCurrentBucketFields.size());
     // One dimension.
     ASSERT_EQ(1UL, gaugeProducer.mPastBuckets.size());
     ASSERT_EQ(3UL, gaugeProducer.mPastBuckets.begin()->second.size());
@@ -335,7 +336,7 @@ TEST_P(GaugeMetricProducerTest_PartialBucket, TestPulled) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(1, gaugeProducer.mCurrentSlicedBucket->begin()
                          ->second.front()
-                         .mFields->begin()
+                         .mFields.begin()
                          ->mValue.int_value);
 
     switch (GetParam()) {
@@ -356,7 +357,7 @@ TEST_P(GaugeMetricProducerTest_PartialBucket, TestPulled) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(2, gaugeProducer.mCurrentSlicedBucket->begin()
                          ->second.front()
-                         .mFields->begin()
+                         .mFields.begin()
                          ->mValue.int_value);
 
     allData.clear();
@@ -367,7 +368,7 @@ TEST_P(GaugeMetricProducerTest_PartialBucket, TestPulled) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(3, gaugeProducer.mCurrentSlicedBucket->begin()
                          ->second.front()
-                         .mFields->begin()
+                         .mFields.begin()
                          ->mValue.int_value);
 }
 
@@ -404,7 +405,7 @@ TEST(GaugeMetricProducerTest, TestPulledWithAppUpgradeDisabled) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(1, gaugeProducer.mCurrentSlicedBucket->begin()
                          ->second.front()
-                         .mFields->begin()
+                         .mFields.begin()
                          ->mValue.int_value);
 
     gaugeProducer.notifyAppUpgrade(partialBucketSplitTimeNs);
@@ -414,7 +415,7 @@ TEST(GaugeMetricProducerTest, TestPulledWithAppUpgradeDisabled) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(1, gaugeProducer.mCurrentSlicedBucket->begin()
                          ->second.front()
-                         .mFields->begin()
+                         .mFields.begin()
                          ->mValue.int_value);
 }
 
@@ -456,7 +457,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsWithCondition) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(100, gaugeProducer.mCurrentSlicedBucket->begin()
                            ->second.front()
-                           .mFields->begin()
+                           .mFields.begin()
                            ->mValue.int_value);
     ASSERT_EQ(0UL, gaugeProducer.mPastBuckets.size());
 
@@ -468,7 +469,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsWithCondition) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(110, gaugeProducer.mCurrentSlicedBucket->begin()
                            ->second.front()
-                           .mFields->begin()
+                           .mFields.begin()
                            ->mValue.int_value);
     ASSERT_EQ(1UL, gaugeProducer.mPastBuckets.size());
 
@@ -603,7 +604,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsAnomalyDetection) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(13L, gaugeProducer.mCurrentSlicedBucket->begin()
                            ->second.front()
-                           .mFields->begin()
+                           .mFields.begin()
                            ->mValue.int_value);
     EXPECT_EQ(anomalyTracker->getRefractoryPeriodEndsSec(DEFAULT_METRIC_DIMENSION_KEY), 0U);
 
@@ -617,7 +618,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsAnomalyDetection) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(15L, gaugeProducer.mCurrentSlicedBucket->begin()
                            ->second.front()
-                           .mFields->begin()
+                           .mFields.begin()
                            ->mValue.int_value);
     EXPECT_EQ(anomalyTracker->getRefractoryPeriodEndsSec(DEFAULT_METRIC_DIMENSION_KEY),
               std::ceil(1.0 * event2->GetElapsedTimestampNs() / NS_PER_SEC) + refPeriodSec);
@@ -630,7 +631,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsAnomalyDetection) {
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
     EXPECT_EQ(26L, gaugeProducer.mCurrentSlicedBucket->begin()
                            ->second.front()
-                           .mFields->begin()
+                           .mFields.begin()
                            ->mValue.int_value);
     EXPECT_EQ(anomalyTracker->getRefractoryPeriodEndsSec(DEFAULT_METRIC_DIMENSION_KEY),
               std::ceil(1.0 * event2->GetElapsedTimestampNs() / NS_PER_SEC + refPeriodSec));
@@ -641,7 +642,7 @@ TEST(GaugeMetricProducerTest, TestPulledEventsAnomalyDetection) {
     gaugeProducer.onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS,
                                bucketStartTimeNs + 3 * bucketSizeNs);
     ASSERT_EQ(1UL, gaugeProducer.mCurrentSlicedBucket->size());
-    EXPECT_TRUE(gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields->empty());
+    EXPECT_TRUE(gaugeProducer.mCurrentSlicedBucket->begin()->second.front().mFields.empty());
 }
 
 TEST(GaugeMetricProducerTest, TestPullOnTrigger) {
@@ -890,7 +891,7 @@ TEST(GaugeMetricProducerTest_BucketDrop, TestBucketDropWhenBucketTooSmall) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     gaugeProducer.onDumpReport(bucketStartTimeNs + 9000000, true /* include recent buckets */, true,
                                FAST /* dump_latency */, &strSet, &output);
 
@@ -971,7 +972,7 @@ TEST(GaugeMetricProducerTest, TestPullDimensionalSampling) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;
     gaugeProducer.onDumpReport(dumpReportTimeNs, true /* include current buckets */, true,
                                NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/metrics/HistogramValueMetricProducer.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "metrics_test_helper.h"
+#include "src/stats_log_util.h"
+#include "tests/statsd_test_util.h"
+
+using namespace testing;
+using android::sp;
+using std::optional;
+using std::set;
+using std::vector;
+
+#ifdef __ANDROID__
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const ConfigKey kConfigKey(0, 12345);
+const int atomId = 1;
+const int64_t metricId = 123;
+const uint64_t protoHash = 0x1234567890;
+const int logEventMatcherIndex = 0;
+const int64_t bucketStartTimeNs = 10000000000;
+const int64_t bucketSizeNs = TimeUnitToBucketSizeInMillis(ONE_MINUTE) * 1000000LL;
+const int64_t bucket2StartTimeNs = bucketStartTimeNs + bucketSizeNs;
+
+// Linear bins [0, 10), [10, 20), [20, 30), with the underflow and overflow bins.
+ValueMetric createMetric() {
+    ValueMetric metric;
+    metric.set_id(metricId);
+    metric.set_bucket(ONE_MINUTE);
+    metric.mutable_value_field()->set_field(atomId);
+    metric.mutable_value_field()->add_child()->set_field(2);
+    metric.set_aggregation_type(ValueMetric::HISTOGRAM);
+    ValueMetric::HistogramBinConfig::GeneratedBins* bins =
+            metric.mutable_histogram_bin_config()->mutable_generated_bins();
+    bins->set_min(0);
+    bins->set_max(30);
+    bins->set_count(3);
+    bins->set_strategy(ValueMetric::HistogramBinConfig::GeneratedBins::LINEAR);
+    return metric;
+}
+
+sp<HistogramValueMetricProducer> createProducer(
+        const ValueMetric& metric, optional<ConditionState> initialCondition = nullopt) {
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+    vector<Matcher> fieldMatchers;
+    translateFieldMatcher(metric.value_field(), &fieldMatchers);
+    const auto [dimensionSoftLimit, dimensionHardLimit] =
+            StatsdStats::getAtomDimensionKeySizeLimits(
+                    atomId, StatsdStats::kDimensionKeySizeHardLimitMin);
+
+    const int conditionIndex = initialCondition ? 0 : -1;
+    vector<ConditionState> initialConditionCache;
+    if (initialCondition) {
+        initialConditionCache.push_back(initialCondition.value());
+    }
+
+    return new HistogramValueMetricProducer(
+            kConfigKey, metric, HistogramBins::create(metric.histogram_bin_config()).value(),
+            protoHash, {/*pullAtomId=*/-1, /*pullerManager=*/nullptr},
+            {bucketStartTimeNs, bucketStartTimeNs, bucketSizeNs, metric.min_bucket_size_nanos(),
+             /*conditionCorrectionThresholdNs=*/nullopt, metric.split_bucket_for_app_upgrade()},
+            {HasPositionANY(metric.dimensions_in_what()),
+             ShouldUseNestedDimensions(metric.dimensions_in_what()), logEventMatcherIndex,
+             /*eventMatcherWizard=*/nullptr, metric.dimensions_in_what(), fieldMatchers},
+            {conditionIndex, metric.links(), initialConditionCache, wizard},
+            {metric.state_link(), /*slicedStateAtoms=*/{}, /*stateGroupMap=*/{}},
+            {/*eventActivationMap=*/{}, /*eventDeactivationMap=*/{}},
+            {dimensionSoftLimit, dimensionHardLimit});
+}
+
+void logEvent(const sp<HistogramValueMetricProducer>& producer, int64_t eventTimeNs, int value) {
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    CreateRepeatedValueLogEvent(&event, atomId, eventTimeNs, value);
+    producer->onMatchedLogEvent(1 /*log matcher index*/, event);
+}
+
+}  // anonymous namespace
+
+TEST(HistogramBinsTest, TestGeneratedBins) {
+    ValueMetric::HistogramBinConfig config;
+    ValueMetric::HistogramBinConfig::GeneratedBins* bins = config.mutable_generated_bins();
+    bins->set_min(1);
+    bins->set_max(1000);
+    bins->set_count(3);
+    bins->set_strategy(ValueMetric::HistogramBinConfig::GeneratedBins::EXPONENTIAL);
+
+    // Boundaries 1, 10, 100, 1000.
+    optional<HistogramBins> histogramBins = HistogramBins::create(config);
+    ASSERT_TRUE(histogramBins.has_value());
+    EXPECT_EQ(5UL, histogramBins->getBinCount());
+    EXPECT_EQ(0UL, histogramBins->getBinIndex(0.5));
+    EXPECT_EQ(1UL, histogramBins->getBinIndex(1));
+    EXPECT_EQ(1UL, histogramBins->getBinIndex(9));
+    EXPECT_EQ(2UL, histogramBins->getBinIndex(50));
+    EXPECT_EQ(3UL, histogramBins->getBinIndex(999));
+    EXPECT_EQ(4UL, histogramBins->getBinIndex(1000));
+
+    bins->set_strategy(ValueMetric::HistogramBinConfig::GeneratedBins::LINEAR);
+    histogramBins = HistogramBins::create(config);
+    ASSERT_TRUE(histogramBins.has_value());
+    EXPECT_EQ(1UL, histogramBins->getBinIndex(333));
+    EXPECT_EQ(2UL, histogramBins->getBinIndex(334));
+}
+
+TEST(HistogramBinsTest, TestInvalidBins) {
+    ValueMetric::HistogramBinConfig config;
+    EXPECT_FALSE(HistogramBins::create(config).has_value());
+
+    ValueMetric::HistogramBinConfig::GeneratedBins* bins = config.mutable_generated_bins();
+    bins->set_min(0);
+    bins->set_max(100);
+    bins->set_count(10);
+    // Exponential bins need a positive min.
+    bins->set_strategy(ValueMetric::HistogramBinConfig::GeneratedBins::EXPONENTIAL);
+    EXPECT_FALSE(HistogramBins::create(config).has_value());
+    bins->set_strategy(ValueMetric::HistogramBinConfig::GeneratedBins::LINEAR);
+    EXPECT_TRUE(HistogramBins::create(config).has_value());
+    bins->set_count(HistogramBins::kMaxBinCount);
+    EXPECT_FALSE(HistogramBins::create(config).has_value());
+    bins->set_count(10);
+    bins->set_max(0);
+    EXPECT_FALSE(HistogramBins::create(config).has_value());
+
+    ValueMetric::HistogramBinConfig::ExplicitBins* explicitBins = config.mutable_explicit_bins();
+    explicitBins->add_boundary(1);
+    explicitBins->add_boundary(5);
+    EXPECT_TRUE(HistogramBins::create(config).has_value());
+    explicitBins->add_boundary(5);
+    EXPECT_FALSE(HistogramBins::create(config).has_value());
+}
+
+TEST(HistogramValueMetricProducerTest, TestPushedEventsWithoutCondition) {
+    sp<HistogramValueMetricProducer> producer = createProducer(createMetric());
+
+    logEvent(producer, bucketStartTimeNs + 10, 5);
+    logEvent(producer, bucketStartTimeNs + 20, 25);
+    logEvent(producer, bucketStartTimeNs + 30, 29);
+    ASSERT_EQ(1UL, producer->mCurrentSlicedBucket.size());
+    const HistogramValueMetricProducer::Interval& curInterval =
+            producer->mCurrentSlicedBucket.begin()->second.intervals[0];
+    EXPECT_EQ(3, curInterval.sampleSize);
+    EXPECT_EQ("[0, 1, 0, 2, 0]", curInterval.aggregate.toString());
+
+    // The empty bins are compacted when the bucket closes.
+    producer->flushIfNeededLocked(bucket2StartTimeNs);
+    ASSERT_EQ(1UL, producer->mPastBuckets.size());
+    ASSERT_EQ(1UL, producer->mPastBucketAggregates.size());
+    EXPECT_EQ("compacted [-1, 1, -1, 2, -1]",
+              producer->mPastBucketAggregates.aggregates[0].toString());
+
+    logEvent(producer, bucket2StartTimeNs + 10, -1);
+    logEvent(producer, bucket2StartTimeNs + 20, 100);
+    ASSERT_EQ(1UL, producer->mCurrentSlicedBucket.size());
+    EXPECT_EQ("[1, 0, 0, 0, 1]",
+              producer->mCurrentSlicedBucket.begin()->second.intervals[0].aggregate.toString());
+}
+
+TEST(HistogramValueMetricProducerTest, TestPushedEventsWithCondition) {
+    sp<HistogramValueMetricProducer> producer =
+            createProducer(createMetric(), ConditionState::kFalse);
+
+    logEvent(producer, bucketStartTimeNs + 10, 5);
+    ASSERT_EQ(0UL, producer->mCurrentSlicedBucket.size());
+
+    producer->onConditionChangedLocked(true, bucketStartTimeNs + 15);
+    logEvent(producer, bucketStartTimeNs + 20, 15);
+    producer->onConditionChangedLocked(false, bucketStartTimeNs + 25);
+    logEvent(producer, bucketStartTimeNs + 30, 15);
+
+    ASSERT_EQ(1UL, producer->mCurrentSlicedBucket.size());
+    EXPECT_EQ("[0, 0, 1, 0, 0]",
+              producer->mCurrentSlicedBucket.begin()->second.intervals[0].aggregate.toString());
+}
+
+TEST(HistogramValueMetricProducerTest, TestDumpReport) {
+    ValueMetric metric = createMetric();
+    metric.set_include_sample_size(true);
+    sp<HistogramValueMetricProducer> producer = createProducer(metric);
+
+    logEvent(producer, bucketStartTimeNs + 10, 5);
+    logEvent(producer, bucketStartTimeNs + 20, 5);
+    logEvent(producer, bucketStartTimeNs + 30, 50);
+
+    ProtoOutputStream output;
+    StringSet strSet;
+    producer->onDumpReport(bucket2StartTimeNs + 10, /*includeCurrentPartialBucket=*/false,
+                           /*eraseData=*/true, FAST, &strSet, &output);
+    StatsLogReport report = outputStreamToProto(&output);
+    ASSERT_EQ(1, report.value_metrics().data_size());
+    ASSERT_EQ(1, report.value_metrics().data(0).bucket_info_size());
+    const ValueBucketInfo& bucketInfo = report.value_metrics().data(0).bucket_info(0);
+    ASSERT_EQ(1, bucketInfo.values_size());
+    EXPECT_EQ(3, bucketInfo.values(0).sample_size());
+    ASSERT_TRUE(bucketInfo.values(0).has_histogram());
+    EXPECT_THAT(bucketInfo.values(0).histogram().count(), ElementsAre(-1, 2, -2, 1));
+}
+
+TEST(HistogramValueMetricProducerTest, TestByteSize) {
+    sp<HistogramValueMetricProducer> producer = createProducer(createMetric());
+
+    logEvent(producer, bucketStartTimeNs + 10, 5);
+    logEvent(producer, bucketStartTimeNs + 20, 15);
+    producer->flushIfNeededLocked(bucket2StartTimeNs);
+
+    // The compacted histogram [-1, 1, 1, -2] only keeps 4 counts of the 5 bins.
+    const size_t expectedSize = producer->kBucketSize + sizeof(int) /* aggIndex entry */ +
+                                sizeof(HistogramValue) + 4 * sizeof(int32_t);
+    EXPECT_EQ(expectedSize, producer->byteSize());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -16,6 +16,7 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <kll-quantiles.pb.h>
 #include <math.h>
 #include <stdio.h>
 
@@ -38,6 +39,9 @@ using std::shared_ptr;
 using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
+using zetasketch::android::AggregatorStateProto;
+using zetasketch::android::kll_quantiles_state;
+using zetasketch::android::KllQuantilesStateProto;
 
 #ifdef __ANDROID__
 
@@ -63,6 +67,7 @@ const int64_t bucket6StartTimeNs = bucketStartTimeNs + 5 * bucketSizeNs;
 static void assertPastBucketsSingleKey(
         const std::unordered_map<MetricDimensionKey,
                                  std::vector<PastBucket<unique_ptr<KllQuantile>>>>& mPastBuckets,
+        const PastBucketAggregates<unique_ptr<KllQuantile>>& pastBucketAggregates,
         const std::initializer_list<int>& expectedKllCountsList,
         const std::initializer_list<int64_t>& expectedDurationNsList,
         const std::initializer_list<int64_t>& expectedStartTimeNsList,
@@ -86,7 +91,8 @@ static void assertPastBucketsSingleKey(
     ASSERT_EQ(expectedKllCounts.size(), buckets.size());
 
     for (int i = 0; i < expectedKllCounts.size(); i++) {
-        EXPECT_EQ(expectedKllCounts[i], buckets[i].aggregates[0]->num_values())
+        EXPECT_EQ(expectedKllCounts[i],
+                  pastBucketAggregates.aggregates[buckets[i].mAggregatesOffset]->num_values())
                 << "Number of entries in KLL sketch differ at index " << i;
         EXPECT_EQ(expectedDurationNs[i], buckets[i].mConditionTrueNs)
                 << "Condition duration value differ at index " << i;
@@ -192,7 +198,8 @@ TEST_P(KllMetricProducerTest_PartialBucket, TestPushedEventsMultipleBuckets) {
             kllProducer->onStatsdInitCompleted(partialBucketSplitTimeNs);
             break;
     }
-    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets, {1},
+    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets,
+               kllProducer->mPastBucketAggregates, {1},
                {partialBucketSplitTimeNs - bucketStartTimeNs}, {bucketStartTimeNs},
                {partialBucketSplitTimeNs});
     EXPECT_EQ(partialBucketSplitTimeNs, kllProducer->mCurrentBucketStartTimeNs);
@@ -203,7 +210,8 @@ TEST_P(KllMetricProducerTest_PartialBucket, TestPushedEventsMultipleBuckets) {
     CreateRepeatedValueLogEvent(&event2, atomId, bucketStartTimeNs + 59 * NS_PER_SEC, 20);
     kllProducer->onMatchedLogEvent(1 /*log matcher index*/, event2);
 
-    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets, {1},
+    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets,
+               kllProducer->mPastBucketAggregates, {1},
                {partialBucketSplitTimeNs - bucketStartTimeNs}, {bucketStartTimeNs},
                {partialBucketSplitTimeNs});
     EXPECT_EQ(partialBucketSplitTimeNs, kllProducer->mCurrentBucketStartTimeNs);
@@ -213,7 +221,8 @@ TEST_P(KllMetricProducerTest_PartialBucket, TestPushedEventsMultipleBuckets) {
     LogEvent event3(/*uid=*/0, /*pid=*/0);
     CreateRepeatedValueLogEvent(&event3, atomId, bucket2StartTimeNs + 5 * NS_PER_SEC, 10);
     kllProducer->onMatchedLogEvent(1 /*log matcher index*/, event3);
-    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets, {1, 1},
+    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets,
+               kllProducer->mPastBucketAggregates, {1, 1},
                {partialBucketSplitTimeNs - bucketStartTimeNs,
                 bucket2StartTimeNs - partialBucketSplitTimeNs},
                {bucketStartTimeNs, partialBucketSplitTimeNs},
@@ -248,8 +257,9 @@ TEST(KllMetricProducerTest, TestPushedEventsWithoutCondition) {
     EXPECT_EQ(2, curInterval0.aggregate->num_values());
 
     kllProducer->flushIfNeededLocked(bucket2StartTimeNs);
-    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets, {2}, {bucketSizeNs},
-               {bucketStartTimeNs}, {bucket2StartTimeNs});
+    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets,
+               kllProducer->mPastBucketAggregates, {2}, {bucketSizeNs}, {bucketStartTimeNs},
+               {bucket2StartTimeNs});
 }
 
 TEST(KllMetricProducerTest, TestPushedEventsWithCondition) {
@@ -294,8 +304,9 @@ TEST(KllMetricProducerTest, TestPushedEventsWithCondition) {
     EXPECT_EQ(2, curInterval0.aggregate->num_values());
 
     kllProducer->flushIfNeededLocked(bucket2StartTimeNs);
-    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets, {2}, {20},
-               {bucketStartTimeNs}, {bucket2StartTimeNs});
+    TRACE_CALL(assertPastBucketsSingleKey, kllProducer->mPastBuckets,
+               kllProducer->mPastBucketAggregates, {2}, {20}, {bucketStartTimeNs},
+               {bucket2StartTimeNs});
 }
 
 /*
@@ -312,7 +323,7 @@ TEST(KllMetricProducerTest_BucketDrop, TestInvalidBucketWhenConditionUnknown) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000;
     kllProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                               NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -350,7 +361,7 @@ TEST(KllMetricProducerTest_BucketDrop, TestBucketDropWhenBucketTooSmall) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 9000000;
     kllProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                               NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -382,7 +393,7 @@ TEST(KllMetricProducerTest_BucketDrop, TestBucketDropWhenDataUnavailable) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;  // 10 seconds
     kllProducer->onDumpReport(dumpReportTimeNs, true /* include current bucket */, true,
                               NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -418,7 +429,7 @@ TEST(KllMetricProducerTest, TestForcedBucketSplitWhenConditionUnknownSkipsBucket
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;  // 10 seconds
     kllProducer->onDumpReport(dumpReportTimeNs, false /* include current buckets */, true,
                               NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -439,6 +450,81 @@ TEST(KllMetricProducerTest, TestForcedBucketSplitWhenConditionUnknownSkipsBucket
     EXPECT_EQ(NanoToMillis(appUpdateTimeNs), dropEvent.drop_time_millis());
 }
 
+TEST(KllMetricProducerTest, TestSketchesShareBufferPool) {
+    const KllMetric& metric = KllMetricProducerTestHelper::createMetric();
+    sp<KllMetricProducer> kllProducer =
+            KllMetricProducerTestHelper::createKllProducerNoConditions(metric);
+    const shared_ptr<CompactorBufferPool> bufferPool =
+            kllProducer->mKllQuantileOptions.buffer_pool();
+    ASSERT_NE(nullptr, bufferPool);
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    CreateRepeatedValueLogEvent(&event1, atomId, bucketStartTimeNs + 10, 10);
+    kllProducer->onMatchedLogEvent(1 /*log matcher index*/, event1);
+    kllProducer->flushIfNeededLocked(bucket2StartTimeNs);
+    EXPECT_EQ(0u, bufferPool->size());
+
+    // Dropping the past bucket returns the buffer of its sketch to the pool.
+    kllProducer->mPastBucketAggregates.clear();
+    EXPECT_EQ(1u, bufferPool->size());
+
+    // The sketch of the next bucket picks it up again.
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    CreateRepeatedValueLogEvent(&event2, atomId, bucket2StartTimeNs + 10, 20);
+    kllProducer->onMatchedLogEvent(1 /*log matcher index*/, event2);
+    EXPECT_EQ(0u, bufferPool->size());
+}
+
+TEST(KllMetricProducerTest, TestCompactSketchEncoding) {
+    KllMetric metric = KllMetricProducerTestHelper::createMetric();
+    metric.set_compact_sketch_encoding(true);
+    metric.set_max_sketch_size(50);
+    sp<KllMetricProducer> kllProducer =
+            KllMetricProducerTestHelper::createKllProducerNoConditions(metric);
+
+    for (int i = 0; i < 1000; i++) {
+        LogEvent event(/*uid=*/0, /*pid=*/0);
+        CreateRepeatedValueLogEvent(&event, atomId, bucketStartTimeNs + 10 + i, i);
+        kllProducer->onMatchedLogEvent(1 /*log matcher index*/, event);
+    }
+
+    // The sketch is compacted when its bucket ends.
+    kllProducer->flushIfNeededLocked(bucket2StartTimeNs);
+    ASSERT_EQ(1u, kllProducer->mPastBucketAggregates.size());
+    const unique_ptr<KllQuantile>& kll = kllProducer->mPastBucketAggregates.aggregates[0];
+    EXPECT_EQ(1000, kll->num_values());
+    EXPECT_LE(kll->num_stored_values(), 50);
+    const int k = kll->k();
+
+    ProtoOutputStream output;
+    StringSet strSet;
+    kllProducer->onDumpReport(bucket2StartTimeNs + 10, false /* include recent buckets */, true,
+                              NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
+    StatsLogReport report = outputStreamToProto(&output);
+    ASSERT_TRUE(report.has_kll_metrics());
+    ASSERT_TRUE(report.kll_metrics().has_sketch_header());
+    EXPECT_EQ(k, report.kll_metrics().sketch_header().k());
+    EXPECT_EQ(1000, report.kll_metrics().sketch_header().inv_eps());
+
+    ASSERT_EQ(1, report.kll_metrics().data_size());
+    ASSERT_EQ(1, report.kll_metrics().data(0).bucket_info_size());
+    const KllBucketInfo& bucket = report.kll_metrics().data(0).bucket_info(0);
+    ASSERT_EQ(1, bucket.sketches_size());
+    AggregatorStateProto aggProto;
+    ASSERT_TRUE(aggProto.ParseFromString(bucket.sketches(0).kll_sketch()));
+    EXPECT_EQ(1000, aggProto.num_values());
+    EXPECT_FALSE(aggProto.has_type());
+
+    // The shared fields are only in the header, and the compactors are diff-encoded.
+    const KllQuantilesStateProto& quantilesState = aggProto.GetExtension(kll_quantiles_state);
+    EXPECT_FALSE(quantilesState.has_k());
+    EXPECT_FALSE(quantilesState.has_inv_eps());
+    ASSERT_GT(quantilesState.compactors_size(), 0);
+    for (const KllQuantilesStateProto::Compactor& compactor : quantilesState.compactors()) {
+        EXPECT_FALSE(compactor.has_packed_values());
+    }
+}
+
 TEST(KllMetricProducerTest, TestByteSize) {
     const KllMetric& metric = KllMetricProducerTestHelper::createMetric();
     sp<KllMetricProducer> kllProducer =
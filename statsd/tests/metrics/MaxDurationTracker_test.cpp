@@ -434,6 +434,61 @@ TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp_UpdatedOnStop) {
               (unsigned long long)(alarm->timestampSec * NS_PER_SEC));
 }
 
+TEST(MaxDurationTrackerTest, TestAnomalyPredictedTimestamp_UpdatedOnConditionChange) {
+    sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
+
+    /**
+     * Two sub-dimensions are started 2 seconds apart and paused together after 5 seconds. When
+     * the condition becomes true again, the first one has 5 seconds of duration, so there are
+     * 35 seconds remaining. When the first one stops 2 seconds later, the second one has 5
+     * seconds of duration.
+     */
+    int64_t bucketSizeNs = 30 * 1000 * 1000 * 1000LL;
+    int64_t bucketStartTimeNs = 10000000000;
+    int64_t bucketNum = 0;
+    int64_t eventStartTimeNs1 = bucketStartTimeNs + 1 * NS_PER_SEC;
+    int64_t eventStartTimeNs2 = bucketStartTimeNs + 3 * NS_PER_SEC;
+    int64_t conditionStopsNs = bucketStartTimeNs + 6 * NS_PER_SEC;
+    int64_t conditionStartsNs = bucketStartTimeNs + 10 * NS_PER_SEC;
+    int64_t eventStopTimeNs1 = bucketStartTimeNs + 12 * NS_PER_SEC;
+
+    int64_t metricId = 1;
+    Alert alert;
+    alert.set_id(101);
+    alert.set_metric_id(1);
+    alert.set_trigger_if_sum_gt(40 * NS_PER_SEC);
+    alert.set_num_buckets(2);
+    alert.set_refractory_period_secs(45);
+    sp<AlarmMonitor> alarmMonitor;
+    sp<DurationAnomalyTracker> anomalyTracker =
+            new DurationAnomalyTracker(alert, kConfigKey, alarmMonitor);
+    MaxDurationTracker tracker(kConfigKey, metricId, eventKey, wizard, 1, false, bucketStartTimeNs,
+                               bucketNum, bucketStartTimeNs, bucketSizeNs, false, false,
+                               {anomalyTracker});
+
+    tracker.noteStart(key1, true, eventStartTimeNs1, ConditionKey(),
+                      StatsdStats::kDimensionKeySizeHardLimitMin);
+    tracker.noteStart(key2, true, eventStartTimeNs2, ConditionKey(),
+                      StatsdStats::kDimensionKeySizeHardLimitMin);
+    EXPECT_EQ(2U, tracker.mStartedDurationOffsets.size());
+
+    tracker.onConditionChanged(false, conditionStopsNs);
+    EXPECT_FALSE(tracker.hasStartedDuration());
+    ASSERT_EQ(0U, anomalyTracker->mAlarms.size());
+
+    tracker.onConditionChanged(true, conditionStartsNs);
+    EXPECT_EQ(2U, tracker.mStartedDurationOffsets.size());
+    ASSERT_EQ(1U, anomalyTracker->mAlarms.size());
+    EXPECT_EQ(conditionStartsNs + 35 * NS_PER_SEC,
+              anomalyTracker->mAlarms.begin()->second->timestampSec * NS_PER_SEC);
+
+    tracker.noteStop(key1, eventStopTimeNs1, false);
+    EXPECT_EQ(1U, tracker.mStartedDurationOffsets.size());
+    ASSERT_EQ(1U, anomalyTracker->mAlarms.size());
+    EXPECT_EQ(eventStopTimeNs1 + 35 * NS_PER_SEC,
+              anomalyTracker->mAlarms.begin()->second->timestampSec * NS_PER_SEC);
+}
+
 TEST(MaxDurationTrackerTest, TestUploadThreshold) {
     sp<MockConditionWizard> wizard = new NaggyMock<MockConditionWizard>();
 
@@ -62,6 +62,7 @@ double epsilon = 0.001;
 
 static void assertPastBucketValuesSingleKey(
         const std::unordered_map<MetricDimensionKey, std::vector<PastBucket<Value>>>& mPastBuckets,
+        const PastBucketAggregates<Value>& pastBucketAggregates,
         const std::initializer_list<int>& expectedValuesList,
         const std::initializer_list<int64_t>& expectedDurationNsList,
         const std::initializer_list<int64_t>& expectedCorrectionNsList,
@@ -88,7 +89,8 @@ static void assertPastBucketValuesSingleKey(
 
     const vector<PastBucket<Value>>& buckets = mPastBuckets.begin()->second;
     for (int i = 0; i < expectedValues.size(); i++) {
-        EXPECT_EQ(expectedValues[i], buckets[i].aggregates[0].long_value)
+        EXPECT_EQ(expectedValues[i],
+                  pastBucketAggregates.aggregates[buckets[i].mAggregatesOffset].long_value)
                 << "Values differ at index " << i;
         EXPECT_EQ(expectedDurationNs[i], buckets[i].mConditionTrueNs)
                 << "Condition duration value differ at index " << i;
@@ -277,6 +279,41 @@ public:
         metric.set_aggregation_type(ValueMetric_AggregationType_SUM);
         return metric;
     }
+
+    // Applies the condition changes that a metric sliced by state records for its dimensions, as
+    // the metric used to do on every condition change.
+    static void applyConditionTimerChanges(const sp<NumericValueMetricProducer>& valueProducer) {
+        valueProducer->applyAllConditionTimerChangesLocked();
+    }
+
+    // Returns the condition true durations of the past buckets of a metric sliced by uid and by
+    // state, keyed by uid and state value.
+    static std::map<std::pair<int, int>, vector<int64_t>> getConditionTrueNs(
+            const sp<NumericValueMetricProducer>& valueProducer) {
+        std::map<std::pair<int, int>, vector<int64_t>> conditionTrueNs;
+        for (const auto& [metricDimensionKey, buckets] : valueProducer->mPastBuckets) {
+            const std::pair<int, int> key = {
+                    metricDimensionKey.getDimensionKeyInWhat().getValues()[0].mValue.int_value,
+                    metricDimensionKey.getStateValuesKey().getValues()[0].mValue.int_value};
+            for (const PastBucket<Value>& bucket : buckets) {
+                conditionTrueNs[key].push_back(bucket.mConditionTrueNs);
+            }
+        }
+        return conditionTrueNs;
+    }
+
+    // Creates a pushed metric sliced by uid and by battery saver mode, with its condition true.
+    static sp<NumericValueMetricProducer> createPushedValueProducerSlicedByState(
+            sp<MockStatsPullerManager>& pullerManager) {
+        ValueMetric metric = createMetricWithConditionAndState("BATTERY_SAVER_MODE_STATE");
+        *metric.mutable_dimensions_in_what() = CreateDimensions(tagId, {1 /* uid */});
+        sp<NumericValueMetricProducer> valueProducer = createValueProducerWithConditionAndState(
+                pullerManager, metric, {util::BATTERY_SAVER_MODE_STATE_CHANGED}, {},
+                ConditionState::kTrue, /*pullAtomId=*/-1);
+        StateManager::getInstance().registerListener(util::BATTERY_SAVER_MODE_STATE_CHANGED,
+                                                     valueProducer);
+        return valueProducer;
+    }
 };
 
 // Setup for parameterized tests.
@@ -366,8 +403,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsNoCondition) {
 
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(11, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket3StartTimeNs + 1, 23));
@@ -381,8 +419,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsNoCondition) {
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(23, curBase.value().long_value);
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {8, 12}, {bucketSizeNs, bucketSizeNs}, {0, 0},
-            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8, 12},
+            {bucketSizeNs, bucketSizeNs}, {0, 0}, {bucketStartTimeNs, bucket2StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket4StartTimeNs + 1, 36));
@@ -395,10 +434,11 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsNoCondition) {
 
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(36, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8, 12, 13},
-                                    {bucketSizeNs, bucketSizeNs, bucketSizeNs}, {0, 0, 0},
-                                    {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8, 12, 13},
+            {bucketSizeNs, bucketSizeNs, bucketSizeNs}, {0, 0, 0},
+            {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
 }
 
 TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPartialBucketCreated) {
@@ -447,10 +487,11 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPartialBucketCreated) {
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(1, valueProducer->getCurrentBucketNum());
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {1, 3},
-                                    {bucketSizeNs, partialBucketSplitTimeNs - bucket2StartTimeNs},
-                                    {0, 0}, {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {1, 3},
+            {bucketSizeNs, partialBucketSplitTimeNs - bucket2StartTimeNs}, {0, 0},
+            {bucketStartTimeNs, bucket2StartTimeNs},
+            {bucket2StartTimeNs, partialBucketSplitTimeNs});
 }
 
 /*
@@ -491,8 +532,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsWithFiltering) {
 
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(11, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateTwoValueLogEvent(tagId, bucket3StartTimeNs + 1, 4, 23));
@@ -511,8 +553,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsWithFiltering) {
     // the base was reset
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(36, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 /*
@@ -554,8 +597,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsTakeAbsoluteValueOnReset) {
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(10, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10}, {bucketSizeNs}, {0},
-                                    {bucket2StartTimeNs}, {bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10}, {bucketSizeNs},
+            {0}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket4StartTimeNs + 1, 36));
@@ -566,8 +610,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsTakeAbsoluteValueOnReset) {
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(36, curBase.value().long_value);
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {10, 26}, {bucketSizeNs, bucketSizeNs}, {0, 0},
-            {bucket2StartTimeNs, bucket3StartTimeNs}, {bucket3StartTimeNs, bucket4StartTimeNs});
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10, 26},
+            {bucketSizeNs, bucketSizeNs}, {0, 0}, {bucket2StartTimeNs, bucket3StartTimeNs},
+            {bucket3StartTimeNs, bucket4StartTimeNs});
 }
 
 /*
@@ -616,8 +661,9 @@ TEST(NumericValueMetricProducerTest, TestPulledEventsTakeZeroOnReset) {
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(36, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {26}, {bucketSizeNs}, {0},
-                                    {bucket3StartTimeNs}, {bucket4StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {26}, {bucketSizeNs},
+            {0}, {bucket3StartTimeNs}, {bucket4StartTimeNs});
 }
 
 /*
@@ -673,8 +719,9 @@ TEST(NumericValueMetricProducerTest, TestEventsWithNonSlicedCondition) {
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket2StartTimeNs + 1, 110));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10}, {bucketSizeNs - 8}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10},
+            {bucketSizeNs - 8}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
@@ -683,8 +730,9 @@ TEST(NumericValueMetricProducerTest, TestEventsWithNonSlicedCondition) {
     EXPECT_EQ(110, curBase.value().long_value);
 
     valueProducer->onConditionChanged(false, bucket2StartTimeNs + 1);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10}, {bucketSizeNs - 8}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10},
+            {bucketSizeNs - 8}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // has one slice
     ASSERT_EQ(1UL, valueProducer->mCurrentSlicedBucket.size());
@@ -696,9 +744,10 @@ TEST(NumericValueMetricProducerTest, TestEventsWithNonSlicedCondition) {
     EXPECT_EQ(false, curBase.has_value());
 
     valueProducer->onConditionChanged(true, bucket3StartTimeNs + 1);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10, 20}, {bucketSizeNs - 8, 1},
-                                    {0, 0}, {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10, 20},
+            {bucketSizeNs - 8, 1}, {0, 0}, {bucketStartTimeNs, bucket2StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
 TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPushedEvents) {
@@ -727,9 +776,10 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPushedEvents) {
             valueProducer->onStatsdInitCompleted(partialBucketSplitTimeNs);
             break;
     }
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10},
-                                    {partialBucketSplitTimeNs - bucketStartTimeNs}, {0},
-                                    {bucketStartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10},
+            {partialBucketSplitTimeNs - bucketStartTimeNs}, {0}, {bucketStartTimeNs},
+            {partialBucketSplitTimeNs});
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(0, valueProducer->getCurrentBucketNum());
 
@@ -738,9 +788,10 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPushedEvents) {
     CreateRepeatedValueLogEvent(&event2, tagId, bucketStartTimeNs + 59 * NS_PER_SEC, 20);
     valueProducer->onMatchedLogEvent(1 /*log matcher index*/, event2);
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10},
-                                    {partialBucketSplitTimeNs - bucketStartTimeNs}, {0},
-                                    {bucketStartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10},
+            {partialBucketSplitTimeNs - bucketStartTimeNs}, {0}, {bucketStartTimeNs},
+            {partialBucketSplitTimeNs});
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(0, valueProducer->getCurrentBucketNum());
 
@@ -748,12 +799,12 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPushedEvents) {
     LogEvent event3(/*uid=*/0, /*pid=*/0);
     CreateRepeatedValueLogEvent(&event3, tagId, bucket2StartTimeNs + 5 * NS_PER_SEC, 10);
     valueProducer->onMatchedLogEvent(1 /*log matcher index*/, event3);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10, 20},
-                                    {partialBucketSplitTimeNs - bucketStartTimeNs,
-                                     bucket2StartTimeNs - partialBucketSplitTimeNs},
-                                    {0, 5 * NS_PER_SEC},
-                                    {bucketStartTimeNs, partialBucketSplitTimeNs},
-                                    {partialBucketSplitTimeNs, bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10, 20},
+            {partialBucketSplitTimeNs - bucketStartTimeNs,
+             bucket2StartTimeNs - partialBucketSplitTimeNs},
+            {0, 5 * NS_PER_SEC}, {bucketStartTimeNs, partialBucketSplitTimeNs},
+            {partialBucketSplitTimeNs, bucket2StartTimeNs});
     EXPECT_EQ(bucketStartTimeNs + bucketSizeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(1, valueProducer->getCurrentBucketNum());
 }
@@ -798,18 +849,19 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPulledValue) {
     }
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(1, valueProducer->getCurrentBucketNum());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {150}, {0},
-                                    {bucket2StartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20}, {150}, {0},
+            {bucket2StartTimeNs}, {partialBucketSplitTimeNs});
 
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket3StartTimeNs + 1, 150));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
     EXPECT_EQ(bucket3StartTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(2, valueProducer->getCurrentBucketNum());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20, 30},
-                                    {150, bucketSizeNs - 150}, {0, 0},
-                                    {bucket2StartTimeNs, partialBucketSplitTimeNs},
-                                    {partialBucketSplitTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20, 30},
+            {150, bucketSizeNs - 150}, {0, 0}, {bucket2StartTimeNs, partialBucketSplitTimeNs},
+            {partialBucketSplitTimeNs, bucket3StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestPulledWithAppUpgradeDisabled) {
@@ -881,9 +933,10 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestPulledValueWhileConditi
     // Expect one full buckets already done and starting a partial bucket.
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(0, valueProducer->getCurrentBucketNum());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20},
-                                    {(bucket2StartTimeNs - 100) - (bucketStartTimeNs + 1)}, {0},
-                                    {bucketStartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {(bucket2StartTimeNs - 100) - (bucketStartTimeNs + 1)}, {0}, {bucketStartTimeNs},
+            {partialBucketSplitTimeNs});
     EXPECT_FALSE(valueProducer->mCondition);
 }
 
@@ -1171,8 +1224,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryNoCondition) {
     // tartUpdated:false sum:12
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(23, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {12}, {bucketSizeNs}, {0},
-                                    {bucket2StartTimeNs}, {bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {12}, {bucketSizeNs},
+            {0}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
 
     // pull 3 come late.
     // The previous bucket gets closed with error. (Has start value 23, no ending)
@@ -1187,8 +1241,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryNoCondition) {
     // startUpdated:false sum:12
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(36, curBase.value().long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {12}, {bucketSizeNs}, {0},
-                                    {bucket2StartTimeNs}, {bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {12}, {bucketSizeNs},
+            {0}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
     // The 1st bucket is dropped because of no data
     // The 3rd bucket is dropped due to multiple buckets being skipped.
     ASSERT_EQ(2, valueProducer->mSkippedBuckets.size());
@@ -1253,8 +1308,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryWithCondition) {
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs - 8}, {1},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {bucketSizeNs - 8}, {1}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     EXPECT_EQ(false, curBase.has_value());
 
     // Now the alarm is delivered.
@@ -1263,8 +1319,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryWithCondition) {
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket2StartTimeNs + 30, 110));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs - 8}, {1},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {bucketSizeNs - 8}, {1}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
@@ -1324,8 +1381,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryWithCondition2) {
 
     // pull on bucket boundary come late, condition change happens before it
     valueProducer->onConditionChanged(false, bucket2StartTimeNs + 1);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs - 8}, {1},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {bucketSizeNs - 8}, {1}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
@@ -1333,8 +1391,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryWithCondition2) {
 
     // condition changed to true again, before the pull alarm is delivered
     valueProducer->onConditionChanged(true, bucket2StartTimeNs + 25);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs - 8}, {1},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {bucketSizeNs - 8}, {1}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(1UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     curInterval = valueProducer->mCurrentSlicedBucket.begin()->second.intervals[0];
@@ -1357,16 +1416,18 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundaryWithCondition2) {
     EXPECT_EQ(140, curBase.value().long_value);
     EXPECT_TRUE(curInterval.hasValue());
     EXPECT_EQ(10, curInterval.aggregate.long_value);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs - 8}, {1},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20},
+            {bucketSizeNs - 8}, {1}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket3StartTimeNs, 160));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {20, 30}, {bucketSizeNs - 8, bucketSizeNs - 24}, {1, -1},
-            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20, 30},
+            {bucketSizeNs - 8, bucketSizeNs - 24}, {1, -1}, {bucketStartTimeNs, bucket2StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestPushedAggregateMin) {
@@ -1405,8 +1466,9 @@ TEST(NumericValueMetricProducerTest, TestPushedAggregateMin) {
 
     valueProducer->flushIfNeededLocked(bucket2StartTimeNs);
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestPushedAggregateMax) {
@@ -1443,8 +1505,9 @@ TEST(NumericValueMetricProducerTest, TestPushedAggregateMax) {
     EXPECT_EQ(20, curInterval.aggregate.long_value);
 
     valueProducer->flushIfNeededLocked(bucket2StartTimeNs);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestPushedAggregateAvg) {
@@ -1485,10 +1548,11 @@ TEST(NumericValueMetricProducerTest, TestPushedAggregateAvg) {
     ASSERT_EQ(1UL, valueProducer->mPastBuckets.size());
     ASSERT_EQ(1UL, valueProducer->mPastBuckets.begin()->second.size());
 
-    EXPECT_TRUE(
-            std::abs(valueProducer->mPastBuckets.begin()->second.back().aggregates[0].double_value -
-                     12.5) < epsilon);
-    EXPECT_EQ(2, valueProducer->mPastBuckets.begin()->second.back().sampleSizes[0]);
+    const PastBucket<Value>& bucket = valueProducer->mPastBuckets.begin()->second.back();
+    const PastBucketAggregates<Value>& aggregates = valueProducer->mPastBucketAggregates;
+    EXPECT_TRUE(std::abs(aggregates.aggregates[bucket.mAggregatesOffset].double_value - 12.5) <
+                epsilon);
+    EXPECT_EQ(2, aggregates.sampleSizes[bucket.mAggregatesOffset]);
 }
 
 TEST(NumericValueMetricProducerTest, TestPushedAggregateSum) {
@@ -1525,8 +1589,59 @@ TEST(NumericValueMetricProducerTest, TestPushedAggregateSum) {
     EXPECT_EQ(25, curInterval.aggregate.long_value);
 
     valueProducer->flushIfNeededLocked(bucket2StartTimeNs);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {25}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {25}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
+}
+
+TEST(NumericValueMetricProducerTest, TestPastBucketAggregatesDumpedByDimension) {
+    ValueMetric metric = NumericValueMetricProducerTestHelper::createMetric();
+    metric.mutable_dimensions_in_what()->set_field(tagId);
+    metric.mutable_dimensions_in_what()->add_child()->set_field(1);
+
+    sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+    sp<NumericValueMetricProducer> valueProducer =
+            NumericValueMetricProducerTestHelper::createValueProducerNoConditions(
+                    pullerManager, metric, /*pullAtomId=*/-1);
+
+    LogEvent event1(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event1, tagId, bucketStartTimeNs + 10, 1, 5);
+    LogEvent event2(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event2, tagId, bucketStartTimeNs + 20, 2, 7);
+    LogEvent event3(/*uid=*/0, /*pid=*/0);
+    CreateTwoValueLogEvent(&event3, tagId, bucket2StartTimeNs + 10, 1, 3);
+    valueProducer->onMatchedLogEvent(1 /*log matcher index*/, event1);
+    valueProducer->onMatchedLogEvent(1 /*log matcher index*/, event2);
+    valueProducer->onMatchedLogEvent(1 /*log matcher index*/, event3);
+    valueProducer->flushIfNeededLocked(bucket3StartTimeNs);
+
+    // The aggregates of all dimensions and buckets share one arena.
+    ASSERT_EQ(2UL, valueProducer->mPastBuckets.size());
+    ASSERT_EQ(3UL, valueProducer->mPastBucketAggregates.size());
+
+    ProtoOutputStream output;
+    StringSet strSet;
+    valueProducer->onDumpReport(bucket3StartTimeNs + 10, false /* include recent buckets */,
+                                true /* erase data */, FAST, &strSet, &output);
+    EXPECT_TRUE(valueProducer->mPastBuckets.empty());
+    EXPECT_EQ(0UL, valueProducer->mPastBucketAggregates.size());
+
+    StatsLogReport report = outputStreamToProto(&output);
+    backfillDimensionPath(&report);
+    StatsLogReport::ValueMetricDataWrapper valueMetrics;
+    sortMetricDataByDimensionsValue(report.value_metrics(), &valueMetrics);
+    ASSERT_EQ(2, valueMetrics.data_size());
+
+    const ValueMetricData& data1 = valueMetrics.data(0);
+    EXPECT_EQ(1, data1.dimensions_in_what().value_tuple().dimensions_value(0).value_int());
+    ASSERT_EQ(2, data1.bucket_info_size());
+    EXPECT_EQ(5, data1.bucket_info(0).values(0).value_long());
+    EXPECT_EQ(3, data1.bucket_info(1).values(0).value_long());
+
+    const ValueMetricData& data2 = valueMetrics.data(1);
+    EXPECT_EQ(2, data2.dimensions_in_what().value_tuple().dimensions_value(0).value_int());
+    ASSERT_EQ(1, data2.bucket_info_size());
+    EXPECT_EQ(7, data2.bucket_info(0).values(0).value_long());
 }
 
 TEST(NumericValueMetricProducerTest, TestSkipZeroDiffOutput) {
@@ -1598,8 +1713,9 @@ TEST(NumericValueMetricProducerTest, TestSkipZeroDiffOutput) {
     EXPECT_EQ(0, curInterval.aggregate.long_value);
 
     valueProducer->flushIfNeededLocked(bucket3StartTimeNs);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {10},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {10}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestSkipZeroDiffOutputMultiValue) {
@@ -1697,18 +1813,23 @@ TEST(NumericValueMetricProducerTest, TestSkipZeroDiffOutputMultiValue) {
 
     ASSERT_EQ(1UL, valueProducer->mPastBuckets.size());
     ASSERT_EQ(2UL, valueProducer->mPastBuckets.begin()->second.size());
-    ASSERT_EQ(2UL, valueProducer->mPastBuckets.begin()->second[0].aggregates.size());
-    ASSERT_EQ(1UL, valueProducer->mPastBuckets.begin()->second[1].aggregates.size());
+    ASSERT_EQ(2UL, valueProducer->mPastBuckets.begin()->second[0].mAggregatesCount);
+    ASSERT_EQ(1UL, valueProducer->mPastBuckets.begin()->second[1].mAggregatesCount);
+    // The aggregates of both buckets are stored one after the other.
+    const PastBucketAggregates<Value>& aggregates = valueProducer->mPastBucketAggregates;
+    ASSERT_EQ(3UL, aggregates.size());
+    EXPECT_EQ(0UL, valueProducer->mPastBuckets.begin()->second[0].mAggregatesOffset);
+    EXPECT_EQ(2UL, valueProducer->mPastBuckets.begin()->second[1].mAggregatesOffset);
 
     EXPECT_EQ(bucketSizeNs, valueProducer->mPastBuckets.begin()->second[0].mConditionTrueNs);
-    EXPECT_EQ(5, valueProducer->mPastBuckets.begin()->second[0].aggregates[0].long_value);
-    EXPECT_EQ(0, valueProducer->mPastBuckets.begin()->second[0].aggIndex[0]);
-    EXPECT_EQ(2, valueProducer->mPastBuckets.begin()->second[0].aggregates[1].long_value);
-    EXPECT_EQ(1, valueProducer->mPastBuckets.begin()->second[0].aggIndex[1]);
+    EXPECT_EQ(5, aggregates.aggregates[0].long_value);
+    EXPECT_EQ(0, aggregates.aggIndex[0]);
+    EXPECT_EQ(2, aggregates.aggregates[1].long_value);
+    EXPECT_EQ(1, aggregates.aggIndex[1]);
 
     EXPECT_EQ(bucketSizeNs, valueProducer->mPastBuckets.begin()->second[1].mConditionTrueNs);
-    EXPECT_EQ(3, valueProducer->mPastBuckets.begin()->second[1].aggregates[0].long_value);
-    EXPECT_EQ(1, valueProducer->mPastBuckets.begin()->second[1].aggIndex[0]);
+    EXPECT_EQ(3, aggregates.aggregates[2].long_value);
+    EXPECT_EQ(1, aggregates.aggIndex[2]);
 }
 
 /*
@@ -1769,12 +1890,13 @@ TEST(NumericValueMetricProducerTest, TestUseZeroDefaultBase) {
     EXPECT_EQ(4, base2.value().long_value);
 
     ASSERT_EQ(2UL, valueProducer->mPastBuckets.size());
+    const vector<Value>& aggregates = valueProducer->mPastBucketAggregates.aggregates;
     auto iterator = valueProducer->mPastBuckets.begin();
     EXPECT_EQ(bucketSizeNs, iterator->second[0].mConditionTrueNs);
-    EXPECT_EQ(8, iterator->second[0].aggregates[0].long_value);
+    EXPECT_EQ(8, aggregates[iterator->second[0].mAggregatesOffset].long_value);
     iterator++;
     EXPECT_EQ(bucketSizeNs, iterator->second[0].mConditionTrueNs);
-    EXPECT_EQ(4, iterator->second[0].aggregates[0].long_value);
+    EXPECT_EQ(4, aggregates[iterator->second[0].mAggregatesOffset].long_value);
 }
 
 /*
@@ -1914,8 +2036,9 @@ TEST(NumericValueMetricProducerTest, TestTrimUnusedDimensionKey) {
     EXPECT_EQ(true, base1.has_value());
     EXPECT_EQ(11, base1.value().long_value);
     EXPECT_FALSE(iterBase->second.seenNewData);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     auto itBase = valueProducer->mDimInfos.begin();
     for (; itBase != valueProducer->mDimInfos.end(); itBase++) {
@@ -1942,8 +2065,9 @@ TEST(NumericValueMetricProducerTest, TestTrimUnusedDimensionKey) {
     EXPECT_EQ(true, base2.has_value());
     EXPECT_EQ(5, base2.value().long_value);
     EXPECT_FALSE(valueProducer->mDimInfos.begin()->second.seenNewData);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {8}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {8}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     allData.clear();
     allData.push_back(CreateTwoValueLogEvent(tagId, bucket5StartTimeNs + 1, 2, 14));
@@ -1962,6 +2086,7 @@ TEST(NumericValueMetricProducerTest, TestTrimUnusedDimensionKey) {
     ASSERT_EQ(2UL, valueProducer->mDimInfos.size());
 
     ASSERT_EQ(2UL, valueProducer->mPastBuckets.size());
+    const vector<Value>& aggregates = valueProducer->mPastBucketAggregates.aggregates;
     // Dimension = 2
     auto iterator = valueProducer->mPastBuckets.begin();
     ASSERT_EQ(1, iterator->first.getDimensionKeyInWhat().getValues().size());
@@ -1969,11 +2094,11 @@ TEST(NumericValueMetricProducerTest, TestTrimUnusedDimensionKey) {
     ASSERT_EQ(2, iterator->second.size());
     EXPECT_EQ(bucket4StartTimeNs, iterator->second[0].mBucketStartNs);
     EXPECT_EQ(bucket5StartTimeNs, iterator->second[0].mBucketEndNs);
-    EXPECT_EQ(9, iterator->second[0].aggregates[0].long_value);
+    EXPECT_EQ(9, aggregates[iterator->second[0].mAggregatesOffset].long_value);
     EXPECT_EQ(bucketSizeNs, iterator->second[0].mConditionTrueNs);
     EXPECT_EQ(bucket5StartTimeNs, iterator->second[1].mBucketStartNs);
     EXPECT_EQ(bucket6StartTimeNs, iterator->second[1].mBucketEndNs);
-    EXPECT_EQ(6, iterator->second[1].aggregates[0].long_value);
+    EXPECT_EQ(6, aggregates[iterator->second[1].mAggregatesOffset].long_value);
     EXPECT_EQ(bucketSizeNs, iterator->second[1].mConditionTrueNs);
     iterator++;
     // Dimension = 1
@@ -1982,11 +2107,11 @@ TEST(NumericValueMetricProducerTest, TestTrimUnusedDimensionKey) {
     ASSERT_EQ(2, iterator->second.size());
     EXPECT_EQ(bucketStartTimeNs, iterator->second[0].mBucketStartNs);
     EXPECT_EQ(bucket2StartTimeNs, iterator->second[0].mBucketEndNs);
-    EXPECT_EQ(8, iterator->second[0].aggregates[0].long_value);
+    EXPECT_EQ(8, aggregates[iterator->second[0].mAggregatesOffset].long_value);
     EXPECT_EQ(bucketSizeNs, iterator->second[0].mConditionTrueNs);
     EXPECT_EQ(bucket5StartTimeNs, iterator->second[1].mBucketStartNs);
     EXPECT_EQ(bucket6StartTimeNs, iterator->second[1].mBucketEndNs);
-    EXPECT_EQ(5, iterator->second[1].aggregates[0].long_value);
+    EXPECT_EQ(5, aggregates[iterator->second[1].mAggregatesOffset].long_value);
     EXPECT_EQ(bucketSizeNs, iterator->second[1].mConditionTrueNs);
 }
 
@@ -2231,7 +2356,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenOneConditio
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 10, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -2293,7 +2418,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenGuardRailHi
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 10000, false /* include recent buckets */,
                                 true, FAST /* dumpLatency */, &strSet, &output);
     ASSERT_EQ(true, StatsdStats::getInstance().hasHitDimensionGuardrail(metricId));
@@ -2371,7 +2496,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenInitialPull
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 10000, false /* include recent buckets */,
                                 true, FAST /* dumpLatency */, &strSet, &output);
 
@@ -2447,7 +2572,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenLastPullFai
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 10000, false /* include recent buckets */,
                                 true, FAST /* dumpLatency */, &strSet, &output);
 
@@ -2518,8 +2643,9 @@ TEST(NumericValueMetricProducerTest, TestEmptyDataResetsBase_onDataPulled) {
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket5StartTimeNs + 1, 170));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket5StartTimeNs);
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {107, 20}, {bucketSizeNs, bucketSizeNs}, {0, 0},
-            {bucketStartTimeNs, bucket4StartTimeNs}, {bucket2StartTimeNs, bucket5StartTimeNs});
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {107, 20},
+            {bucketSizeNs, bucketSizeNs}, {0, 0}, {bucketStartTimeNs, bucket4StartTimeNs},
+            {bucket2StartTimeNs, bucket5StartTimeNs});
     ASSERT_EQ(2UL, valueProducer->mSkippedBuckets.size());
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
@@ -2594,8 +2720,9 @@ TEST(NumericValueMetricProducerTest, TestEmptyDataResetsBase_onConditionChanged)
     EXPECT_EQ(true, curBase.has_value());
     EXPECT_EQ(120, curBase.value().long_value);
     EXPECT_EQ(true, valueProducer->mHasGlobalBase);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {110}, {bucketSizeNs - 20}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {110},
+            {bucketSizeNs - 20}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestEmptyDataResetsBase_onBucketBoundary) {
@@ -2650,8 +2777,9 @@ TEST(NumericValueMetricProducerTest, TestEmptyDataResetsBase_onBucketBoundary) {
     ASSERT_EQ(0UL, valueProducer->mDimInfos.size());
 
     ASSERT_EQ(1UL, valueProducer->mPastBuckets.size());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {1}, {bucketSizeNs - 12 + 1}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {1},
+            {bucketSizeNs - 12 + 1}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestPartialResetOnBucketBoundaries) {
@@ -2742,18 +2870,20 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestFullBucketResetWhenLast
     }
     EXPECT_EQ(partialBucketSplitTimeNs, valueProducer->mCurrentBucketStartTimeNs);
     EXPECT_EQ(0, valueProducer->getCurrentBucketNum());
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {9},
-                                    {partialBucketSplitTimeNs - bucketStartTimeNs}, {0},
-                                    {bucketStartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {9},
+            {partialBucketSplitTimeNs - bucketStartTimeNs}, {0}, {bucketStartTimeNs},
+            {partialBucketSplitTimeNs});
     ASSERT_EQ(1UL, valueProducer->mCurrentFullBucket.size());
 
     vector<shared_ptr<LogEvent>> allData;
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket3StartTimeNs + 1, 4));
     // Pull fails and arrives late.
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_FAIL, bucket3StartTimeNs + 1);
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {9},
-                                    {partialBucketSplitTimeNs - bucketStartTimeNs}, {0},
-                                    {bucketStartTimeNs}, {partialBucketSplitTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {9},
+            {partialBucketSplitTimeNs - bucketStartTimeNs}, {0}, {bucketStartTimeNs},
+            {partialBucketSplitTimeNs});
     ASSERT_EQ(1, valueProducer->mSkippedBuckets.size());
     ASSERT_EQ(2, valueProducer->mSkippedBuckets[0].dropEvents.size());
     EXPECT_EQ(PULL_FAILED, valueProducer->mSkippedBuckets[0].dropEvents[0].reason);
@@ -2811,8 +2941,9 @@ TEST(NumericValueMetricProducerTest, TestBucketBoundariesOnConditionChange) {
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
 
     // Bucket should have been completed.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {2}, {bucketSizeNs - 10}, {10},
-                                    {bucket2StartTimeNs}, {bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {2},
+            {bucketSizeNs - 10}, {10}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithoutDiff) {
@@ -2833,8 +2964,9 @@ TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithoutDiff) {
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
     // Bucket should have been completed.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {30}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {30}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithDiff) {
@@ -2863,8 +2995,9 @@ TEST(NumericValueMetricProducerTest, TestLateOnDataPulledWithDiff) {
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
     // Bucket should have been completed.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {19}, {bucketSizeNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {19}, {bucketSizeNs},
+            {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST_P(NumericValueMetricProducerTest_PartialBucket, TestBucketBoundariesOnPartialBucket) {
@@ -2905,8 +3038,9 @@ TEST_P(NumericValueMetricProducerTest_PartialBucket, TestBucketBoundariesOnParti
     }
 
     // Bucket should have been completed.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {9}, {bucketSizeNs}, {2},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {9}, {bucketSizeNs},
+            {2}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 TEST(NumericValueMetricProducerTest, TestDataIsNotUpdatedWhenNoConditionChanged) {
@@ -2949,8 +3083,9 @@ TEST(NumericValueMetricProducerTest, TestDataIsNotUpdatedWhenNoConditionChanged)
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket2StartTimeNs + 1, 10));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs + 1);
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {2}, {2}, {0}, {bucketStartTimeNs},
-                                    {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {2}, {2}, {0},
+            {bucketStartTimeNs}, {bucket2StartTimeNs});
 }
 
 // TODO: b/145705635 fix or delete this test
@@ -3005,7 +3140,8 @@ TEST(NumericValueMetricProducerTest, TestBucketInvalidIfGlobalBaseIsNotSet) {
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
     // There was not global base available so all buckets are invalid.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {}, {}, {}, {}, {});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {}, {}, {}, {}, {});
 }
 
 TEST(NumericValueMetricProducerTest, TestFastDumpWithoutCurrentBucket) {
@@ -3034,7 +3170,7 @@ TEST(NumericValueMetricProducerTest, TestFastDumpWithoutCurrentBucket) {
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket4StartTimeNs, false /* include recent buckets */, true, FAST,
                                 &strSet, &output);
 
@@ -3075,7 +3211,7 @@ TEST(NumericValueMetricProducerTest, TestPullNeededNoTimeConstraints) {
                                                                                   metric);
 
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 10, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS, &strSet, &output);
 
@@ -3099,8 +3235,9 @@ TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_withoutCondition) {
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs + 30);
 
     // Bucket should have been completed.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {10}, {bucketSizeNs}, {30},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {10}, {bucketSizeNs},
+            {30}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(0, valueProducer->mCurrentSlicedBucket.size());
     // TODO: mDimInfos is not needed for non-diffed data, but an entry is still created.
     ASSERT_EQ(1, valueProducer->mDimInfos.size());
@@ -3149,8 +3286,9 @@ TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_withMultipleCondition
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket2StartTimeNs + 30, 110));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {20}, {50 - 8}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {20}, {50 - 8}, {0},
+            {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
@@ -3181,8 +3319,9 @@ TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_bucketBoundaryTrue) {
     allData.push_back(CreateRepeatedValueLogEvent(tagId, bucket2StartTimeNs + 30, 30));
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {30}, {bucketSizeNs - 8}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {30},
+            {bucketSizeNs - 8}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     optional<Value> curBase = valueProducer->mDimInfos.begin()->second.dimExtras[0];
@@ -3204,7 +3343,8 @@ TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_bucketBoundaryFalse)
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket2StartTimeNs);
 
     // Condition was always false.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {}, {}, {}, {}, {});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {}, {}, {}, {}, {});
 }
 
 TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_withFailure) {
@@ -3240,7 +3380,8 @@ TEST(NumericValueMetricProducerTest, TestPulledData_noDiff_withFailure) {
     ASSERT_EQ(0UL, valueProducer->mDimInfos.size());
 
     // No buckets, we had a failure.
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {}, {}, {}, {}, {});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {}, {}, {}, {}, {});
 }
 
 /*
@@ -3275,7 +3416,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenDumpReportR
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 40, true /* include recent buckets */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
     ASSERT_EQ(0UL, valueProducer->mCurrentSlicedBucket.size());
@@ -3331,7 +3472,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenConditionEv
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 100, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
 
@@ -3397,7 +3538,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenAccumulateE
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 100, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
 
@@ -3452,7 +3593,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenConditionUn
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3502,7 +3643,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenPullFailed)
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3566,7 +3707,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestInvalidBucketWhenMultipleBuc
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(dumpTimeNs, true /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
 
@@ -3636,7 +3777,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestBucketDropWhenBucketTooSmall
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 9000000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3671,7 +3812,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestBucketDropWhenDataUnavailabl
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;  // 10 seconds
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current bucket */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3739,7 +3880,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestConditionUnknownMultipleBuck
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 15 * NS_PER_SEC;  // 15 seconds
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current bucket */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3821,7 +3962,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop,
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 10000000000;  // 10 seconds
     valueProducer->onDumpReport(dumpReportTimeNs, false /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -3872,7 +4013,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestMultipleBucketDropEvents) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 1000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
@@ -3955,7 +4096,7 @@ TEST(NumericValueMetricProducerTest_BucketDrop, TestMaxBucketDropEvents) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 1000;
     // Because we already have 10 dump events in the current bucket,
     // this case should not be added to the list of dump events.
@@ -4224,7 +4365,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedState) {
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -4518,7 +4659,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithMap) {
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -4765,7 +4906,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithPrimaryField_WithDimensi
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 50 * NS_PER_SEC;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include recent buckets */, true,
                                 NO_TIME_CONSTRAINTS, &strSet, &output);
@@ -5019,7 +5160,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithMissingDataInStateChange
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -5124,7 +5265,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithMissingDataThenFlushBuck
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -5317,7 +5458,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithNoPullOnBucketBoundary)
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -5469,6 +5610,8 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithDataMissingInConditionCh
 
     // Bucket status after condition change to false.
     valueProducer->onConditionChanged(false, bucketStartTimeNs + 30 * NS_PER_SEC);
+    // The change is only recorded for the dimensions; apply it to the timers checked below.
+    valueProducer->applyAllConditionTimerChangesLocked();
     // Base for dimension key {}
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     ASSERT_EQ(2UL, valueProducer->mCurrentSlicedBucket.size());
@@ -5535,7 +5678,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithDataMissingInConditionCh
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucketStartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -5781,7 +5924,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithMultipleDimensions) {
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -5907,6 +6050,8 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithCondition) {
 
     // Bucket status after condition change to true.
     valueProducer->onConditionChanged(true, bucketStartTimeNs + 20 * NS_PER_SEC);
+    // The change is only recorded for the dimensions; apply it to the timers checked below.
+    valueProducer->applyAllConditionTimerChangesLocked();
     // Base for dimension key {}
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     std::unordered_map<HashableDimensionKey,
@@ -5995,6 +6140,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithCondition) {
 
     // Bucket 2 status after condition change to false.
     valueProducer->onConditionChanged(false, bucket2StartTimeNs + 10 * NS_PER_SEC);
+    valueProducer->applyAllConditionTimerChangesLocked();
     // Base for dimension key {}
     ASSERT_EQ(1UL, valueProducer->mDimInfos.size());
     itBase = valueProducer->mDimInfos.find(DEFAULT_DIMENSION_KEY);
@@ -6017,7 +6163,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithCondition) {
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -6165,7 +6311,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithConditionFalseMultipleBu
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs + 30 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -6199,6 +6345,166 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithConditionFalseMultipleBu
  * Test slicing by state for metric that slices by state with a primary field,
  * has multiple dimensions, and a pull that returns incomplete data.
  */
+/*
+ * Tests that the condition changes recorded for the dimensions of a metric sliced by state give
+ * the condition durations of applying them to every dimension as they happen, when the condition
+ * flips several times in a bucket and dimensions catch up on them at different times.
+ */
+TEST(NumericValueMetricProducerTest, TestSlicedStateConditionTimerChangesConditionFlips) {
+    StateManager::getInstance().clear();
+    auto run = [](bool eager) {
+        sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+        sp<NumericValueMetricProducer> valueProducer =
+                NumericValueMetricProducerTestHelper::createPushedValueProducerSlicedByState(
+                        pullerManager);
+        auto changeCondition = [&](bool condition, int64_t timestampNs) {
+            valueProducer->onConditionChanged(condition, timestampNs);
+            if (eager) {
+                NumericValueMetricProducerTestHelper::applyConditionTimerChanges(valueProducer);
+            }
+        };
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 5 * NS_PER_SEC, 1, 3));
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 8 * NS_PER_SEC, 2, 4));
+        changeCondition(false, bucketStartTimeNs + 10 * NS_PER_SEC);
+        changeCondition(true, bucketStartTimeNs + 20 * NS_PER_SEC);
+        changeCondition(false, bucketStartTimeNs + 30 * NS_PER_SEC);
+        changeCondition(true, bucketStartTimeNs + 40 * NS_PER_SEC);
+        if (!eager) {
+            EXPECT_EQ(4UL, valueProducer->mConditionTimerChanges.size());
+        }
+
+        // Uid 1 catches up on the changes before moving to the new state. Uid 2 only does when
+        // the bucket closes.
+        StateManager::getInstance().onLogEvent(
+                *CreateBatterySaverOnEvent(bucketStartTimeNs + 42 * NS_PER_SEC));
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 45 * NS_PER_SEC, 1, 5));
+        valueProducer->flushIfNeededLocked(bucket2StartTimeNs);
+        EXPECT_TRUE(valueProducer->mConditionTimerChanges.empty());
+
+        std::map<std::pair<int, int>, vector<int64_t>> conditionTrueNs =
+                NumericValueMetricProducerTestHelper::getConditionTrueNs(valueProducer);
+        StateManager::getInstance().clear();
+        return conditionTrueNs;
+    };
+
+    const std::map<std::pair<int, int>, vector<int64_t>> eagerConditionTrueNs = run(true);
+    const std::map<std::pair<int, int>, vector<int64_t>> lazyConditionTrueNs = run(false);
+    EXPECT_EQ(eagerConditionTrueNs, lazyConditionTrueNs);
+    const std::map<std::pair<int, int>, vector<int64_t>> expectedConditionTrueNs = {
+            // 5-10, 20-30 and 40-45 seconds, before uid 1 moved to the ON state.
+            {{1, -1 /* StateTracker::kUnknown */}, {20 * NS_PER_SEC}},
+            // 8-10, 20-30 and 40-60 seconds.
+            {{2, -1 /* StateTracker::kUnknown */}, {32 * NS_PER_SEC}},
+    };
+    EXPECT_EQ(expectedConditionTrueNs, lazyConditionTrueNs);
+}
+
+/*
+ * Tests that a dimension that first appears after some condition changes were recorded does not
+ * replay them.
+ */
+TEST(NumericValueMetricProducerTest, TestSlicedStateConditionTimerChangesNewDimension) {
+    StateManager::getInstance().clear();
+    auto run = [](bool eager) {
+        sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+        sp<NumericValueMetricProducer> valueProducer =
+                NumericValueMetricProducerTestHelper::createPushedValueProducerSlicedByState(
+                        pullerManager);
+        auto changeCondition = [&](bool condition, int64_t timestampNs) {
+            valueProducer->onConditionChanged(condition, timestampNs);
+            if (eager) {
+                NumericValueMetricProducerTestHelper::applyConditionTimerChanges(valueProducer);
+            }
+        };
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 5 * NS_PER_SEC, 1, 3));
+        changeCondition(false, bucketStartTimeNs + 10 * NS_PER_SEC);
+        changeCondition(true, bucketStartTimeNs + 20 * NS_PER_SEC);
+
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 25 * NS_PER_SEC, 2, 4));
+        for (const auto& [dimensionInWhatKey, dimensionInWhatInfo] : valueProducer->mDimInfos) {
+            if (dimensionInWhatKey.getValues()[0].mValue.int_value == 2) {
+                // The new dimension starts past the recorded changes.
+                EXPECT_EQ(valueProducer->mConditionTimerChanges.size(),
+                          dimensionInWhatInfo.conditionTimerEpoch);
+            }
+        }
+        changeCondition(false, bucketStartTimeNs + 30 * NS_PER_SEC);
+        valueProducer->flushIfNeededLocked(bucket2StartTimeNs);
+
+        std::map<std::pair<int, int>, vector<int64_t>> conditionTrueNs =
+                NumericValueMetricProducerTestHelper::getConditionTrueNs(valueProducer);
+        StateManager::getInstance().clear();
+        return conditionTrueNs;
+    };
+
+    const std::map<std::pair<int, int>, vector<int64_t>> eagerConditionTrueNs = run(true);
+    const std::map<std::pair<int, int>, vector<int64_t>> lazyConditionTrueNs = run(false);
+    EXPECT_EQ(eagerConditionTrueNs, lazyConditionTrueNs);
+    const std::map<std::pair<int, int>, vector<int64_t>> expectedConditionTrueNs = {
+            // 5-10 and 20-30 seconds.
+            {{1, -1 /* StateTracker::kUnknown */}, {15 * NS_PER_SEC}},
+            // 25-30 seconds.
+            {{2, -1 /* StateTracker::kUnknown */}, {5 * NS_PER_SEC}},
+    };
+    EXPECT_EQ(expectedConditionTrueNs, lazyConditionTrueNs);
+}
+
+/*
+ * Tests that the condition changes still pending when a bucket closes count in that bucket, and
+ * that the condition carried into the next bucket is the last one recorded.
+ */
+TEST(NumericValueMetricProducerTest, TestSlicedStateConditionTimerChangesPendingAtBucketEnd) {
+    StateManager::getInstance().clear();
+    auto run = [](bool eager) {
+        sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+        sp<NumericValueMetricProducer> valueProducer =
+                NumericValueMetricProducerTestHelper::createPushedValueProducerSlicedByState(
+                        pullerManager);
+        auto changeCondition = [&](bool condition, int64_t timestampNs) {
+            valueProducer->onConditionChanged(condition, timestampNs);
+            if (eager) {
+                NumericValueMetricProducerTestHelper::applyConditionTimerChanges(valueProducer);
+            }
+        };
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 5 * NS_PER_SEC, 1, 3));
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucketStartTimeNs + 6 * NS_PER_SEC, 2, 4));
+        changeCondition(false, bucketStartTimeNs + 10 * NS_PER_SEC);
+        changeCondition(true, bucketStartTimeNs + 20 * NS_PER_SEC);
+
+        // The first event of the next bucket closes the bucket with both changes pending.
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucket2StartTimeNs + 5 * NS_PER_SEC, 1, 5));
+        EXPECT_TRUE(valueProducer->mConditionTimerChanges.empty());
+        valueProducer->onMatchedLogEvent(
+                1, *CreateTwoValueLogEvent(tagId, bucket2StartTimeNs + 6 * NS_PER_SEC, 2, 6));
+        changeCondition(false, bucket2StartTimeNs + 10 * NS_PER_SEC);
+        valueProducer->flushIfNeededLocked(bucket3StartTimeNs);
+
+        std::map<std::pair<int, int>, vector<int64_t>> conditionTrueNs =
+                NumericValueMetricProducerTestHelper::getConditionTrueNs(valueProducer);
+        StateManager::getInstance().clear();
+        return conditionTrueNs;
+    };
+
+    const std::map<std::pair<int, int>, vector<int64_t>> eagerConditionTrueNs = run(true);
+    const std::map<std::pair<int, int>, vector<int64_t>> lazyConditionTrueNs = run(false);
+    EXPECT_EQ(eagerConditionTrueNs, lazyConditionTrueNs);
+    const std::map<std::pair<int, int>, vector<int64_t>> expectedConditionTrueNs = {
+            // 5-10 and 20-60 seconds, then the first 10 seconds of the second bucket.
+            {{1, -1 /* StateTracker::kUnknown */}, {45 * NS_PER_SEC, 10 * NS_PER_SEC}},
+            // 6-10 and 20-60 seconds, then the first 10 seconds of the second bucket.
+            {{2, -1 /* StateTracker::kUnknown */}, {44 * NS_PER_SEC, 10 * NS_PER_SEC}},
+    };
+    EXPECT_EQ(expectedConditionTrueNs, lazyConditionTrueNs);
+}
+
 TEST(NumericValueMetricProducerTest, TestSlicedStateWithMultipleDimensionsMissingDataInPull) {
     // Set up NumericValueMetricProducer.
     ValueMetric metric = NumericValueMetricProducerTestHelper::createMetricWithConditionAndState(
@@ -6365,7 +6671,7 @@ TEST(NumericValueMetricProducerTest, TestSlicedStateWithMultipleDimensionsMissin
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                 true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                 &strSet, &output);
@@ -6474,7 +6780,7 @@ TEST(NumericValueMetricProducerTest, TestForcedBucketSplitWhenConditionUnknownSk
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;  // 10 seconds
     valueProducer->onDumpReport(dumpReportTimeNs, false /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -6540,7 +6846,7 @@ TEST(NumericValueMetricProducerTest, TestUploadThreshold) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 10000000000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -6609,8 +6915,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWhileC
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // second pull on the bucket #2 boundary on time
     allData.clear();
@@ -6618,10 +6925,10 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWhileC
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
 
     // the second pull did close the second bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 5},
-                                    {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
-                                    {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
+            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
 /**
@@ -6661,8 +6968,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWhileC
 
     // first delayed pull on the bucket #1 edge
     // the delayed pull did close the first bucket with condition duration == conditionDurationNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {conditionDurationNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5},
+            {conditionDurationNs}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     valueProducer->onConditionChanged(true, bucket2StartTimeNs + 2 * delayNs);
 
@@ -6675,7 +6983,8 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWhileC
 
     // second pull on the bucket #2 edge is on time
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {5, 5}, {conditionDurationNs, conditionDurationNs}, {0, 0},
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {conditionDurationNs, conditionDurationNs}, {0, 0},
             {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
@@ -6714,8 +7023,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestLatePullOnCondition
 
     // first delayed pull on the bucket #1 edge
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // here arbitraryIntervalNs just an arbitrary interval after the delayed pull &
     // before the sequence of condition change events
@@ -6733,9 +7043,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestLatePullOnCondition
     // the pull did close the second bucket with condition where
     // duration == conditionDurationNs + carryover from first bucket due to delayed pull
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {5, 5}, {bucketSizeNs, pullDelayNs + conditionDurationNs},
-            {pullDelayNs, -pullDelayNs}, {bucketStartTimeNs, bucket2StartTimeNs},
-            {bucket2StartTimeNs, bucket3StartTimeNs});
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {bucketSizeNs, pullDelayNs + conditionDurationNs}, {pullDelayNs, -pullDelayNs},
+            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
 /**
@@ -6776,8 +7086,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestLatePullOnCondition
     valueProducer->onConditionChanged(true, bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {conditionDurationNs}, {0},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5},
+            {conditionDurationNs}, {0}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     valueProducer->onConditionChanged(false,
                                       bucket2StartTimeNs + pullDelayNs + conditionDurationNs);
@@ -6787,7 +7098,8 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestLatePullOnCondition
 
     // the delayed pull did close the second bucket with condition duration == conditionDurationNs
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {5, 5}, {conditionDurationNs, conditionDurationNs}, {0, 0},
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {conditionDurationNs, conditionDurationNs}, {0, 0},
             {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 }
 
@@ -6834,8 +7146,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWithCo
 
     // first delayed pull on the bucket #1 edge
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     valueProducer->onConditionChanged(false, bucket1LatePullNs + conditionSwitchIntervalNs);
 
@@ -6848,11 +7161,11 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWithCo
 
     // second delayed pull on the bucket #2 edge
     // the pull did close the second bucket with condition true
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 10},
-                                    {bucketSizeNs, bucketSizeNs - conditionSwitchIntervalNs},
-                                    {pullDelayNs, -pullDelayNs + bucket2DelayNs},
-                                    {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 10},
+            {bucketSizeNs, bucketSizeNs - conditionSwitchIntervalNs},
+            {pullDelayNs, -pullDelayNs + bucket2DelayNs}, {bucketStartTimeNs, bucket2StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs});
 
     valueProducer->onConditionChanged(false, bucket2LatePullNs + conditionSwitchIntervalNs);
 
@@ -6864,12 +7177,13 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullWithCo
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket4StartTimeNs);
 
     // the pull did close the third bucket with condition true
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 10, 15},
-                                    {bucketSizeNs, bucketSizeNs - conditionSwitchIntervalNs,
-                                     bucketSizeNs - 2 * conditionSwitchIntervalNs},
-                                    {pullDelayNs, -pullDelayNs + bucket2DelayNs, -bucket2DelayNs},
-                                    {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 10, 15},
+            {bucketSizeNs, bucketSizeNs - conditionSwitchIntervalNs,
+             bucketSizeNs - 2 * conditionSwitchIntervalNs},
+            {pullDelayNs, -pullDelayNs + bucket2DelayNs, -bucket2DelayNs},
+            {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
 }
 
 /**
@@ -6902,8 +7216,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullNoCond
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // second pull on the bucket #2 boundary on time
     allData.clear();
@@ -6911,10 +7226,10 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullNoCond
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
 
     // the second pull did close the second bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 5},
-                                    {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
-                                    {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
+            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 
     // third pull on the bucket #3 boundary on time
     allData.clear();
@@ -6922,11 +7237,11 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullNoCond
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket4StartTimeNs);
 
     // the third pull did close the third bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 5, 5},
-                                    {bucketSizeNs, bucketSizeNs, bucketSizeNs},
-                                    {pullDelayNs, -pullDelayNs, 0},
-                                    {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5, 5},
+            {bucketSizeNs, bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs, 0},
+            {bucketStartTimeNs, bucket2StartTimeNs, bucket3StartTimeNs},
+            {bucket2StartTimeNs, bucket3StartTimeNs, bucket4StartTimeNs});
 }
 
 /**
@@ -6965,8 +7280,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullNoCond
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
 
     // the second pull did close the second bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs},
-                                    {-pullDelayNs}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {-pullDelayNs}, {bucket2StartTimeNs}, {bucket3StartTimeNs});
 
     // third pull on the bucket #3 boundary on time
     allData.clear();
@@ -6975,7 +7291,8 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestAlarmLatePullNoCond
 
     // the third pull did close the third bucket with condition duration == bucketSizeNs
     assertPastBucketValuesSingleKey(
-            valueProducer->mPastBuckets, {5, 5}, {bucketSizeNs, bucketSizeNs}, {-pullDelayNs, 0},
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {bucketSizeNs, bucketSizeNs}, {-pullDelayNs, 0},
             {bucket2StartTimeNs, bucket3StartTimeNs}, {bucket3StartTimeNs, bucket4StartTimeNs});
 }
 
@@ -7017,12 +7334,13 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdNotDefined
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
     // and the condition correction == pull delay
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // generate dump report and validate correction value in the reported buckets
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -7073,12 +7391,13 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdDefinedZer
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // generate dump report and validate correction value in the reported buckets
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -7131,8 +7450,9 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdUploadPass
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // second pull on the bucket #2 boundary on time
     allData.clear();
@@ -7140,14 +7460,14 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdUploadPass
     valueProducer->onDataPulled(allData, PullResult::PULL_RESULT_SUCCESS, bucket3StartTimeNs);
 
     // the second pull did close the second bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5, 5},
-                                    {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
-                                    {bucketStartTimeNs, bucket2StartTimeNs},
-                                    {bucket2StartTimeNs, bucket3StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5, 5},
+            {bucketSizeNs, bucketSizeNs}, {pullDelayNs, -pullDelayNs},
+            {bucketStartTimeNs, bucket2StartTimeNs}, {bucket2StartTimeNs, bucket3StartTimeNs});
 
     // generate dump report and validate correction value in the reported buckets
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -7202,12 +7522,13 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdUploadPass
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // generate dump report and validate correction value in the reported buckets
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -7260,12 +7581,13 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestThresholdUploadSkip
                                 bucket2StartTimeNs + pullDelayNs);
 
     // the delayed pull did close the first bucket with condition duration == bucketSizeNs
-    assertPastBucketValuesSingleKey(valueProducer->mPastBuckets, {5}, {bucketSizeNs}, {pullDelayNs},
-                                    {bucketStartTimeNs}, {bucket2StartTimeNs});
+    assertPastBucketValuesSingleKey(
+            valueProducer->mPastBuckets, valueProducer->mPastBucketAggregates, {5}, {bucketSizeNs},
+            {pullDelayNs}, {bucketStartTimeNs}, {bucket2StartTimeNs});
 
     // generate dump report and validate correction value in the reported buckets
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket3StartTimeNs, false /* include partial bucket */, true,
                                 FAST /* dumpLatency */, &strSet, &output);
 
@@ -7360,7 +7682,7 @@ TEST(NumericValueMetricProducerTest_ConditionCorrection, TestLateStateChangeSlic
 
     // Start dump report and check output.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     valueProducer->onDumpReport(bucket4StartTimeNs + 10, false /* do not include partial buckets */,
                                 true, NO_TIME_CONSTRAINTS, &strSet, &output);
 
@@ -7446,7 +7768,7 @@ TEST(NumericValueMetricProducerTest, TestSubsetDimensions) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 10000000000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -7523,7 +7845,7 @@ TEST(NumericValueMetricProducerTest, TestRepeatedValueFieldAndDimensions) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucket2StartTimeNs + 10000000000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -7614,7 +7936,7 @@ TEST(NumericValueMetricProducerTest, TestSampleSize) {
 
     // Start dump report and check output.
     ProtoOutputStream outputAvg;
-    std::set<string> strSetAvg;
+    StringSet strSetAvg;
     valueProducerAvg->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                    true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                    &strSetAvg, &outputAvg);
@@ -7630,7 +7952,7 @@ TEST(NumericValueMetricProducerTest, TestSampleSize) {
 
     // Start dump report and check output.
     ProtoOutputStream outputSum;
-    std::set<string> strSetSum;
+    StringSet strSetSum;
     valueProducerSum->onDumpReport(bucket2StartTimeNs + 50 * NS_PER_SEC,
                                    true /* include recent buckets */, true, NO_TIME_CONSTRAINTS,
                                    &strSetSum, &outputSum);
@@ -7646,7 +7968,7 @@ TEST(NumericValueMetricProducerTest, TestSampleSize) {
 
     // Start dump report and check output.
     ProtoOutputStream outputSumWithSampleSize;
-    std::set<string> strSetSumWithSampleSize;
+    StringSet strSetSumWithSampleSize;
     valueProducerSumWithSampleSize->onDumpReport(
             bucket2StartTimeNs + 50 * NS_PER_SEC, true /* include recent buckets */, true,
             NO_TIME_CONSTRAINTS, &strSetSumWithSampleSize, &outputSumWithSampleSize);
@@ -7704,7 +8026,7 @@ TEST(NumericValueMetricProducerTest, TestDimensionalSampling) {
 
     // Check dump report.
     ProtoOutputStream output;
-    std::set<string> strSet;
+    StringSet strSet;
     int64_t dumpReportTimeNs = bucketStartTimeNs + 10000000000;
     valueProducer->onDumpReport(dumpReportTimeNs, true /* include current buckets */, true,
                                 NO_TIME_CONSTRAINTS /* dumpLatency */, &strSet, &output);
@@ -537,6 +537,71 @@ TEST_F(MetricsManagerUtilTest, TestCountMetricConditionlinkNoCondition) {
                                   StringToId("Count")));
 }
 
+TEST_F(MetricsManagerUtilTest, TestCountMetricInvalidTopKDimensions) {
+    StatsdConfig config;
+    CountMetric* metric = config.add_count_metric();
+    *metric = createCountMetric(/*name=*/"Count", /*what=*/StringToId("ScreenTurnedOn"),
+                                /*condition=*/nullopt, /*states=*/{});
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+
+    // Only sliced metrics have dimensions to keep the top of.
+    metric->set_top_k_dimensions(5);
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(INVALID_CONFIG_REASON_METRIC_INCORRECT_TOP_K_DIMENSIONS,
+                                  StringToId("Count")));
+
+    *metric->mutable_dimensions_in_what() =
+            CreateDimensions(util::SCREEN_STATE_CHANGED, {1 /* state */});
+    metric->set_top_k_dimensions(0);
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(INVALID_CONFIG_REASON_METRIC_INCORRECT_TOP_K_DIMENSIONS,
+                                  StringToId("Count")));
+
+    metric->set_top_k_dimensions(5);
+    EXPECT_EQ(initConfig(config), nullopt);
+}
+
+TEST_F(MetricsManagerUtilTest, TestValueMetricHistogramInvalidBinConfig) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    ValueMetric* metric = config.add_value_metric();
+    *metric = createValueMetric(/*name=*/"Value", config.atom_matcher(0), /*valueField=*/2,
+                                /*condition=*/nullopt, /*states=*/{});
+    metric->set_aggregation_type(ValueMetric::HISTOGRAM);
+
+    // A histogram needs bins.
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(INVALID_CONFIG_REASON_VALUE_METRIC_HISTOGRAM_INVALID_BIN_CONFIG,
+                                  StringToId("Value")));
+
+    ValueMetric::HistogramBinConfig::ExplicitBins* bins =
+            metric->mutable_histogram_bin_config()->mutable_explicit_bins();
+    bins->add_boundary(10);
+    bins->add_boundary(1);
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(INVALID_CONFIG_REASON_VALUE_METRIC_HISTOGRAM_INVALID_BIN_CONFIG,
+                                  StringToId("Value")));
+
+    bins->set_boundary(1, 100);
+    EXPECT_EQ(initConfig(config), nullopt);
+}
+
+TEST_F(MetricsManagerUtilTest, TestValueMetricHistogramWithDiff) {
+    StatsdConfig config;
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+    ValueMetric* metric = config.add_value_metric();
+    *metric = createValueMetric(/*name=*/"Value", config.atom_matcher(0), /*valueField=*/2,
+                                /*condition=*/nullopt, /*states=*/{});
+    metric->set_aggregation_type(ValueMetric::HISTOGRAM);
+    metric->mutable_histogram_bin_config()->mutable_explicit_bins()->add_boundary(10);
+    metric->set_use_diff(true);
+
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(
+                      INVALID_CONFIG_REASON_VALUE_METRIC_HISTOGRAM_WITH_PULLED_ATOM_OR_DIFF,
+                      StringToId("Value")));
+}
+
 TEST_F(MetricsManagerUtilTest, TestDurationMetricMissingIdOrWhat) {
     StatsdConfig config;
     int64_t metricId = 1;
@@ -641,6 +706,19 @@ TEST_F(MetricsManagerUtilTest, TestEventMetricInvalidSamplingPercentageZero) {
                                   StringToId("Event")));
 }
 
+TEST_F(MetricsManagerUtilTest, TestEventMetricInvalidMaxSampledEvents) {
+    StatsdConfig config;
+    EventMetric* metric = config.add_event_metric();
+    *metric = createEventMetric(/*name=*/"Event", /*what=*/StringToId("ScreenTurnedOn"),
+                                /*condition=*/nullopt);
+    metric->set_max_sampled_events(0);
+    *config.add_atom_matcher() = CreateScreenTurnedOnAtomMatcher();
+
+    EXPECT_EQ(initConfig(config),
+              InvalidConfigReason(INVALID_CONFIG_REASON_METRIC_INCORRECT_MAX_SAMPLED_EVENTS,
+                                  StringToId("Event")));
+}
+
 TEST_F(MetricsManagerUtilTest, TestEventMetricValidSamplingPercentage) {
     StatsdConfig config;
     EventMetric* metric = config.add_event_metric();
@@ -1353,6 +1431,56 @@ TEST_F(MetricsManagerUtilTest, TestCreateConditionTrackerCombination) {
     EXPECT_FALSE(tracker->IsSimpleCondition());
 }
 
+TEST_F(MetricsManagerUtilTest, TestGetSharedConditionKey) {
+    // Two configs with the same screen on predicate, under different ids.
+    auto makeConfig = [](const string& suffix) {
+        StatsdConfig config;
+        AtomMatcher screenOn = CreateScreenTurnedOnAtomMatcher();
+        screenOn.set_id(StringToId("ScreenOn" + suffix));
+        AtomMatcher screenOff = CreateScreenTurnedOffAtomMatcher();
+        screenOff.set_id(StringToId("ScreenOff" + suffix));
+        *config.add_atom_matcher() = screenOn;
+        *config.add_atom_matcher() = screenOff;
+        Predicate screenIsOn = CreateScreenIsOnPredicate();
+        screenIsOn.set_id(StringToId("ScreenIsOn" + suffix));
+        screenIsOn.mutable_simple_predicate()->set_start(screenOn.id());
+        screenIsOn.mutable_simple_predicate()->set_stop(screenOff.id());
+        *config.add_predicate() = screenIsOn;
+        config.add_allowed_log_source("AID_SYSTEM");
+        return config;
+    };
+    auto getKey = [](const StatsdConfig& config) {
+        unordered_map<int64_t, int> atomTrackerMap;
+        for (int i = 0; i < config.atom_matcher_size(); i++) {
+            atomTrackerMap[config.atom_matcher(i).id()] = i;
+        }
+        return getSharedConditionKey(config, config.predicate(0), atomTrackerMap);
+    };
+
+    StatsdConfig config1 = makeConfig("1");
+    StatsdConfig config2 = makeConfig("2");
+    ASSERT_NE(getKey(config1), nullopt);
+    EXPECT_EQ(getKey(config1), getKey(config2));
+
+    // Configs that accept events from other log sources do not see the same events.
+    config2.add_allowed_log_source("com.android.app");
+    EXPECT_NE(getKey(config1), getKey(config2));
+
+    config2 = makeConfig("2");
+    config2.mutable_predicate(0)->mutable_simple_predicate()->set_count_nesting(true);
+    EXPECT_NE(getKey(config1), getKey(config2));
+
+    // Combination matchers are not shared.
+    config2 = makeConfig("2");
+    AtomMatcher* combination = config2.add_atom_matcher();
+    combination->set_id(StringToId("ScreenOnOrOff"));
+    combination->mutable_combination()->set_operation(LogicalOperation::OR);
+    combination->mutable_combination()->add_matcher(config2.atom_matcher(0).id());
+    combination->mutable_combination()->add_matcher(config2.atom_matcher(1).id());
+    config2.mutable_predicate(0)->mutable_simple_predicate()->set_stop(combination->id());
+    EXPECT_EQ(getKey(config2), nullopt);
+}
+
 TEST_F(MetricsManagerUtilTest, TestCreateAnomalyTrackerInvalidMetric) {
     Alert alert;
     alert.set_id(123);
@@ -2292,6 +2420,35 @@ TEST_F(MetricsManagerUtilTest, TestCombinationMatcherWithStringReplace) {
     EXPECT_THAT(actualInvalidConfigReason->matcherIds, ElementsAre(222));
 }
 
+TEST(MetricsManagerUtilFieldMaskTest, TestComputeAtomFieldMasks) {
+    StatsdConfig config;
+    config.set_id(12345);
+
+    AtomMatcher* matcher = config.add_atom_matcher();
+    *matcher = CreateSimpleAtomMatcher("WakelockMatcher", util::WAKELOCK_STATE_CHANGED);
+    FieldValueMatcher* fvm = matcher->mutable_simple_atom_matcher()->add_field_value_matcher();
+    fvm->set_field(4);  // state
+    fvm->set_eq_int(1);
+    *config.add_atom_matcher() =
+            CreateSimpleAtomMatcher("AppCrashMatcher", util::APP_CRASH_OCCURRED);
+
+    CountMetric* countMetric = config.add_count_metric();
+    countMetric->set_id(1);
+    countMetric->set_what(StringToId("WakelockMatcher"));
+    *countMetric->mutable_dimensions_in_what() =
+            CreateDimensions(util::WAKELOCK_STATE_CHANGED, {3 /* tag */});
+
+    // Event metrics report the whole atom.
+    EventMetric* eventMetric = config.add_event_metric();
+    eventMetric->set_id(2);
+    eventMetric->set_what(StringToId("AppCrashMatcher"));
+
+    const AtomFieldMasks fieldMasks = computeAtomFieldMasks(config);
+    EXPECT_EQ((FieldMask(1) << 3) | (FieldMask(1) << 4),
+              fieldMasks.at(util::WAKELOCK_STATE_CHANGED));
+    EXPECT_EQ(kAllFieldsMask, fieldMasks.at(util::APP_CRASH_OCCURRED));
+}
+
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -46,6 +46,7 @@ using android::os::statsd::util::TEST_ATOM_REPORTED;
 using std::vector;
 using testing::_;
 using testing::A;
+using testing::AnyNumber;
 using testing::AtMost;
 using testing::ByMove;
 using testing::DoAll;
@@ -155,6 +156,32 @@ static ShellData readData(int fd) {
     return receivedAtom;
 }
 
+// Splits ShellData protos into one ShellData per atom, keeping the order of the atoms.
+static vector<ShellData> splitPerAtom(const vector<ShellData>& datas) {
+    vector<ShellData> atoms;
+    for (const ShellData& data : datas) {
+        for (int i = 0; i < data.atom_size(); i++) {
+            ShellData atom;
+            *atom.add_atom() = data.atom(i);
+            atom.add_elapsed_timestamp_nanos(data.elapsed_timestamp_nanos(i));
+            atoms.push_back(atom);
+        }
+    }
+    return atoms;
+}
+
+// Utility to read numAtoms atoms, which may come batched in fewer ShellData protos, returning
+// one ShellData per atom.
+static vector<ShellData> readAtoms(int fd, int numAtoms) {
+    vector<ShellData> datas;
+    int atomCount = 0;
+    while (atomCount < numAtoms) {
+        datas.push_back(readData(fd));
+        atomCount += datas.back().atom_size();
+    }
+    return splitPerAtom(datas);
+}
+
 void runShellTest(ShellSubscription config, sp<MockUidMap> uidMap,
                   sp<MockStatsPullerManager> pullerManager,
                   const vector<std::shared_ptr<LogEvent>>& pushedEvents,
@@ -189,13 +216,10 @@ void runShellTest(ShellSubscription config, sp<MockUidMap> uidMap,
         shellManager->onLogEvent(*event);
     }
 
+    const vector<ShellData> expectedAtoms = splitPerAtom(expectedData);
     for (int i = 0; i < numClients; i++) {
-        vector<ShellData> actualData;
-        for (int j = 1; j <= expectedData.size(); j++) {
-            actualData.push_back(readData(fds_datas[i][0]));
-        }
-
-        EXPECT_THAT(expectedData, UnorderedPointwise(EqShellData(), actualData));
+        const vector<ShellData> actualAtoms = readAtoms(fds_datas[i][0], expectedAtoms.size());
+        EXPECT_THAT(expectedAtoms, UnorderedPointwise(EqShellData(), actualAtoms));
     }
 
     // Not closing fds_datas[i][0] because this causes writes within ShellSubscriberClient to hang
@@ -493,6 +517,42 @@ TEST_F(ShellSubscriberCallbackTest, testFlushTrigger) {
     EXPECT_EQ(perSubscriptionStats.flush_count(), 1);
 }
 
+TEST_F(ShellSubscriberCallbackTest, testQueuedEventsAreDeliveredBeforeFlush) {
+    // Expect callback to be invoked once.
+    EXPECT_CALL(*callback, onSubscriptionData(_, _)).Times(Exactly(1)).RetiresOnSaturation();
+    EXPECT_CALL(
+            *mockLogEventFilter,
+            setAtomIds(CreateAtomIdSetFromShellSubscriptionBytes(configBytes), &shellSubscriber))
+            .Times(1);
+    shellSubscriber.startNewSubscription(configBytes, callback);
+
+    unique_ptr<LogEvent> event = CreateScreenStateChangedEvent(
+            1000 /*timestamp*/, ::android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    shellSubscriber.queueLogEvent(event);
+    EXPECT_EQ(event, nullptr);
+
+    // Events of atoms that no subscription wants stay with the caller.
+    unique_ptr<LogEvent> unsubscribedEvent = CreateBatteryStateChangedEvent(
+            2000 /*timestamp*/, BatteryPluggedStateEnum::BATTERY_PLUGGED_USB);
+    shellSubscriber.queueLogEvent(unsubscribedEvent);
+    EXPECT_NE(unsubscribedEvent, nullptr);
+
+    shellSubscriber.flushSubscription(callback);
+
+    EXPECT_THAT(reason, Eq(StatsSubscriptionCallbackReason::FLUSH_REQUESTED));
+
+    // Get ShellData proto from the bytes payload of the callback.
+    ShellData actualShellData;
+    ASSERT_TRUE(actualShellData.ParseFromArray(payload.data(), payload.size()));
+
+    ShellData expectedShellData;
+    expectedShellData.add_atom()->mutable_screen_state_changed()->set_state(
+            ::android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    expectedShellData.add_elapsed_timestamp_nanos(1000);
+
+    EXPECT_THAT(actualShellData, EqShellData(expectedShellData));
+}
+
 TEST_F(ShellSubscriberCallbackTest, testFlushTriggerEmptyCache) {
     // Expect callback to be invoked once.
     EXPECT_CALL(*callback, onSubscriptionData(_, _)).Times(Exactly(1)).RetiresOnSaturation();
@@ -520,6 +580,31 @@ TEST_F(ShellSubscriberCallbackTest, testFlushTriggerEmptyCache) {
     ASSERT_EQ(perSubscriptionStats.flush_count(), 1);
 }
 
+TEST_F(ShellSubscriberCallbackTest, testUnsubscribedAtomIsNotCached) {
+    // Expect callback to be invoked once.
+    EXPECT_CALL(*callback, onSubscriptionData(_, _)).Times(Exactly(1)).RetiresOnSaturation();
+    EXPECT_CALL(
+            *mockLogEventFilter,
+            setAtomIds(CreateAtomIdSetFromShellSubscriptionBytes(configBytes), &shellSubscriber))
+            .Times(1);
+    shellSubscriber.startNewSubscription(configBytes, callback);
+
+    // Log an event for an atom the subscription did not ask for.
+    shellSubscriber.onLogEvent(*CreateBatterySaverOnEvent(1000 /*timestamp*/));
+
+    shellSubscriber.flushSubscription(callback);
+
+    EXPECT_THAT(reason, Eq(StatsSubscriptionCallbackReason::FLUSH_REQUESTED));
+
+    // Get ShellData proto from the bytes payload of the callback.
+    ShellData actualShellData;
+    ASSERT_TRUE(actualShellData.ParseFromArray(payload.data(), payload.size()));
+
+    ShellData expectedShellData;
+
+    EXPECT_THAT(actualShellData, EqShellData(expectedShellData));
+}
+
 TEST_F(ShellSubscriberCallbackTest, testUnsubscribe) {
     // Expect callback to be invoked once.
     EXPECT_CALL(*callback, onSubscriptionData(_, _)).Times(Exactly(1));
@@ -705,6 +790,32 @@ TEST_F(ShellSubscriberCallbackPulledTest, testPullFrequencyTooShort) {
             shellSubscriberClient->pullAndSendHeartbeatsIfNeeded(2, 2000, 2'000'000'000);
 }
 
+TEST_F(ShellSubscriberCallbackPulledTest, testPullPackageUidsResolvedOnAppChange) {
+    const int32_t appUid = 10001;
+    ShellSubscription config = getPulledConfig();
+    config.mutable_pulled(0)->add_packages("com.app");
+    unique_ptr<ShellSubscriberClient> client = ShellSubscriberClient::create(
+            protoToBytes(config), callback, /* startTimeSec= */ 0, uidMap, pullerManager);
+
+    // The package is resolved for the first pull and again after the apps change.
+    EXPECT_CALL(*uidMap, getAppUid("com.app"))
+            .Times(Exactly(2))
+            .WillRepeatedly(Return(std::set<int32_t>{appUid}));
+    const vector<int32_t> uids{appUid, AID_SYSTEM};
+    EXPECT_CALL(*pullerManager, Pull(CPU_ACTIVE_TIME, uids, _, _)).Times(Exactly(3));
+    EXPECT_CALL(*callback, onSubscriptionData(_, _)).Times(AnyNumber());
+
+    client->pullAndSendHeartbeatsIfNeeded(/* nowSecs= */ 61, /* nowMillis= */ 61'000,
+                                          /* nowNanos= */ 61'000'000'000);
+    client->pullAndSendHeartbeatsIfNeeded(/* nowSecs= */ 122, /* nowMillis= */ 122'000,
+                                          /* nowNanos= */ 122'000'000'000);
+
+    uidMap->updateApp(/* timestamp= */ 123, "com.other", /* uid= */ 10002, /* versionCode= */ 1,
+                      "v1", /* installer= */ "", /* certificateHash= */ {});
+    client->pullAndSendHeartbeatsIfNeeded(/* nowSecs= */ 183, /* nowMillis= */ 183'000,
+                                          /* nowNanos= */ 183'000'000'000);
+}
+
 TEST_F(ShellSubscriberCallbackPulledTest, testMinSleep) {
     // Pull should NOT happen.
     EXPECT_CALL(*pullerManager, Pull(_, A<const vector<int32_t>&>(), _, _)).Times(Exactly(0));
@@ -934,14 +1045,15 @@ TEST(ShellSubscriberTest, testDifferentConfigs) {
     }
 
     // Validate Config 1
-    ShellData actual1 = readData(fds_datas[0][0]);
+    vector<ShellData> actualAtoms1 = readAtoms(fds_datas[0][0], /*numAtoms=*/2);
+    ShellData actual1 = actualAtoms1[0];
     ShellData expected1;
     expected1.add_atom()->mutable_screen_state_changed()->set_state(
             ::android::view::DisplayStateEnum::DISPLAY_STATE_ON);
     expected1.add_elapsed_timestamp_nanos(pushedList[0]->GetElapsedTimestampNs());
     EXPECT_THAT(expected1, EqShellData(actual1));
 
-    ShellData actual2 = readData(fds_datas[0][0]);
+    ShellData actual2 = actualAtoms1[1];
     ShellData expected2;
     expected2.add_atom()->mutable_screen_state_changed()->set_state(
             ::android::view::DisplayStateEnum::DISPLAY_STATE_OFF);
@@ -949,14 +1061,15 @@ TEST(ShellSubscriberTest, testDifferentConfigs) {
     EXPECT_THAT(expected2, EqShellData(actual2));
 
     // Validate Config 2, repeating the process
-    ShellData actual3 = readData(fds_datas[1][0]);
+    vector<ShellData> actualAtoms2 = readAtoms(fds_datas[1][0], /*numAtoms=*/2);
+    ShellData actual3 = actualAtoms2[0];
     ShellData expected3;
     expected3.add_atom()->mutable_plugged_state_changed()->set_state(
             BatteryPluggedStateEnum::BATTERY_PLUGGED_USB);
     expected3.add_elapsed_timestamp_nanos(pushedList[2]->GetElapsedTimestampNs());
     EXPECT_THAT(expected3, EqShellData(actual3));
 
-    ShellData actual4 = readData(fds_datas[1][0]);
+    ShellData actual4 = actualAtoms2[1];
     ShellData expected4;
     expected4.add_atom()->mutable_plugged_state_changed()->set_state(
             BatteryPluggedStateEnum::BATTERY_PLUGGED_NONE);
@@ -966,6 +1079,48 @@ TEST(ShellSubscriberTest, testDifferentConfigs) {
     // Not closing fds_datas[i][0] because this causes writes within ShellSubscriberClient to hang
 }
 
+TEST(ShellSubscriberTest, testPushedEventsAreBatched) {
+    sp<MockUidMap> uidMap = new NaggyMock<MockUidMap>();
+    sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
+    sp<ShellSubscriber> shellManager =
+            new ShellSubscriber(uidMap, pullerManager, std::make_shared<LogEventFilter>());
+
+    ShellSubscription config;
+    config.add_pushed()->set_atom_id(SCREEN_STATE_CHANGED);
+    const vector<uint8_t> buffer = protoToBytes(config);
+    const size_t bufferSize = buffer.size();
+
+    int fds_config[2];
+    int fds_data[2];
+    ASSERT_EQ(0, pipe2(fds_config, O_CLOEXEC));
+    ASSERT_EQ(0, pipe2(fds_data, O_CLOEXEC));
+    write(fds_config[1], &bufferSize, sizeof(bufferSize));
+    write(fds_config[1], buffer.data(), bufferSize);
+    close(fds_config[1]);
+    EXPECT_TRUE(shellManager->startNewSubscription(fds_config[0], fds_data[1],
+                                                   /*timeoutSec=*/-1));
+    close(fds_config[0]);
+    close(fds_data[1]);
+
+    vector<std::shared_ptr<LogEvent>> pushedList = getPushedEvents();
+    for (const auto& event : pushedList) {
+        shellManager->onLogEvent(*event);
+    }
+
+    // Both screen events are written together once the batch is due.
+    ShellData actual = readData(fds_data[0]);
+    ShellData expected;
+    expected.add_atom()->mutable_screen_state_changed()->set_state(
+            ::android::view::DisplayStateEnum::DISPLAY_STATE_ON);
+    expected.add_elapsed_timestamp_nanos(pushedList[0]->GetElapsedTimestampNs());
+    expected.add_atom()->mutable_screen_state_changed()->set_state(
+            ::android::view::DisplayStateEnum::DISPLAY_STATE_OFF);
+    expected.add_elapsed_timestamp_nanos(pushedList[1]->GetElapsedTimestampNs());
+    EXPECT_THAT(expected, EqShellData(actual));
+
+    // Not closing fds_data[0] because this causes writes within ShellSubscriberClient to hang
+}
+
 TEST(ShellSubscriberTest, testPushedSubscriptionRestrictedEvent) {
     sp<MockUidMap> uidMap = new NaggyMock<MockUidMap>();
     sp<MockStatsPullerManager> pullerManager = new StrictMock<MockStatsPullerManager>();
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "src/shell/SubscriptionRing.h"
+
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using android::base::unique_fd;
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const size_t kRingSize = SubscriptionRing::kMinSizeBytes;
+const size_t kCapacity = kRingSize - SubscriptionRing::kHeaderSize;
+
+unique_fd createRingFd(size_t size, int seals) {
+    unique_fd fd(memfd_create("subscription_ring_test", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    EXPECT_GE(fd.get(), 0);
+    EXPECT_EQ(0, ftruncate(fd.get(), size));
+    if (seals != 0) {
+        EXPECT_EQ(0, fcntl(fd.get(), F_ADD_SEALS, seals));
+    }
+    return fd;
+}
+
+// The subscriber's view of a ring.
+class RingReader {
+public:
+    explicit RingReader(int fd)
+        : mMemory(static_cast<uint8_t*>(
+                  mmap(nullptr, kRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))) {
+        EXPECT_NE(MAP_FAILED, mMemory);
+    }
+
+    ~RingReader() {
+        munmap(mMemory, kRingSize);
+    }
+
+    void setReadPosition(uint64_t position) {
+        reinterpret_cast<atomic<uint64_t>*>(mMemory)->store(position, memory_order_release);
+    }
+
+    vector<uint8_t> read(int64_t position, size_t numBytes) const {
+        const uint8_t* data = mMemory + SubscriptionRing::kHeaderSize;
+        vector<uint8_t> bytes;
+        for (size_t i = 0; i < numBytes; i++) {
+            bytes.push_back(data[(position + i) % kCapacity]);
+        }
+        return bytes;
+    }
+
+private:
+    uint8_t* const mMemory;
+};
+
+}  // anonymous namespace
+
+TEST(SubscriptionRingTest, TestCreateRequiresShrinkSeal) {
+    unique_fd unsealedFd = createRingFd(kRingSize, /*seals=*/0);
+    EXPECT_EQ(nullptr, SubscriptionRing::create(unsealedFd.get()));
+
+    unique_fd sealedFd = createRingFd(kRingSize, F_SEAL_SHRINK);
+    EXPECT_NE(nullptr, SubscriptionRing::create(sealedFd.get()));
+}
+
+TEST(SubscriptionRingTest, TestCreateRejectsSize) {
+    unique_fd smallFd = createRingFd(SubscriptionRing::kMinSizeBytes - 1, F_SEAL_SHRINK);
+    EXPECT_EQ(nullptr, SubscriptionRing::create(smallFd.get()));
+
+    unique_fd largeFd = createRingFd(SubscriptionRing::kMaxSizeBytes + 1, F_SEAL_SHRINK);
+    EXPECT_EQ(nullptr, SubscriptionRing::create(largeFd.get()));
+}
+
+TEST(SubscriptionRingTest, TestWriteWrapsAround) {
+    unique_fd fd = createRingFd(kRingSize, F_SEAL_SHRINK);
+    unique_ptr<SubscriptionRing> ring = SubscriptionRing::create(fd.get());
+    ASSERT_NE(nullptr, ring);
+    EXPECT_EQ(kCapacity, ring->getCapacity());
+    RingReader reader(fd.get());
+
+    const vector<uint8_t> first(kCapacity - 10, 1);
+    EXPECT_EQ(0, ring->write(first));
+    EXPECT_EQ(first, reader.read(0, first.size()));
+    reader.setReadPosition(first.size());
+
+    // Continues over the end of the ring into its start.
+    vector<uint8_t> second(20);
+    for (size_t i = 0; i < second.size(); i++) {
+        second[i] = i;
+    }
+    EXPECT_EQ((int64_t)first.size(), ring->write(second));
+    EXPECT_EQ(second, reader.read(first.size(), second.size()));
+}
+
+TEST(SubscriptionRingTest, TestWriteWaitsForReader) {
+    unique_fd fd = createRingFd(kRingSize, F_SEAL_SHRINK);
+    unique_ptr<SubscriptionRing> ring = SubscriptionRing::create(fd.get());
+    ASSERT_NE(nullptr, ring);
+    RingReader reader(fd.get());
+
+    const vector<uint8_t> payload(kCapacity / 2 + 1, 1);
+    EXPECT_EQ(0, ring->write(payload));
+
+    // The unread payload leaves no room for another one.
+    EXPECT_EQ(nullopt, ring->write(payload));
+
+    reader.setReadPosition(payload.size());
+    EXPECT_EQ((int64_t)payload.size(), ring->write(payload));
+}
+
+TEST(SubscriptionRingTest, TestInvalidReadPosition) {
+    unique_fd fd = createRingFd(kRingSize, F_SEAL_SHRINK);
+    unique_ptr<SubscriptionRing> ring = SubscriptionRing::create(fd.get());
+    ASSERT_NE(nullptr, ring);
+    RingReader reader(fd.get());
+
+    // The subscriber claims to have read data that was never written.
+    reader.setReadPosition(100);
+    EXPECT_EQ(nullopt, ring->write(vector<uint8_t>(10, 1)));
+}
+
+TEST(SubscriptionRingTest, TestContinuesAfterReadPosition) {
+    unique_fd fd = createRingFd(kRingSize, F_SEAL_SHRINK);
+    RingReader reader(fd.get());
+
+    // The subscriber read up to this position from a previous statsd.
+    reader.setReadPosition(1000);
+    unique_ptr<SubscriptionRing> ring = SubscriptionRing::create(fd.get());
+    ASSERT_NE(nullptr, ring);
+    EXPECT_EQ(1000, ring->write(vector<uint8_t>(10, 1)));
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
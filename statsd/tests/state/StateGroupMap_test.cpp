@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "state/StateGroupMap.h"
+
+#include <gtest/gtest.h>
+
+#include "state/StateTracker.h"
+
+#ifdef __ANDROID__
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int32_t kAtomId = 27;
+const int32_t kOtherAtomId = 29;
+
+Value mapState(const StateGroupMap& stateGroupMap, int32_t atomId, int32_t state) {
+    Value value(state);
+    stateGroupMap.mapStateValue(atomId, &value);
+    return value;
+}
+
+}  // anonymous namespace
+
+TEST(StateGroupMapTest, TestDenseStateValues) {
+    StateGroupMap stateGroupMap({{kAtomId, {{0, 100}, {1, 100}, {3, 200}}}});
+
+    EXPECT_EQ(Value((int64_t)100), mapState(stateGroupMap, kAtomId, 0));
+    EXPECT_EQ(Value((int64_t)100), mapState(stateGroupMap, kAtomId, 1));
+    EXPECT_EQ(Value((int64_t)200), mapState(stateGroupMap, kAtomId, 3));
+
+    // Values in no group, inside and outside the dense range.
+    EXPECT_EQ(Value(StateTracker::kStateUnknown), mapState(stateGroupMap, kAtomId, 2));
+    EXPECT_EQ(Value(StateTracker::kStateUnknown), mapState(stateGroupMap, kAtomId, 4));
+    EXPECT_EQ(Value(StateTracker::kStateUnknown),
+              mapState(stateGroupMap, kAtomId, StateTracker::kStateUnknown));
+}
+
+TEST(StateGroupMapTest, TestSparseStateValues) {
+    StateGroupMap stateGroupMap(
+            {{kAtomId, {{1, 100}, {-5, 200}, {StateGroupMap::kMaxDenseStateValue, 300}}}});
+
+    EXPECT_EQ(Value((int64_t)100), mapState(stateGroupMap, kAtomId, 1));
+    EXPECT_EQ(Value((int64_t)200), mapState(stateGroupMap, kAtomId, -5));
+    EXPECT_EQ(Value((int64_t)300),
+              mapState(stateGroupMap, kAtomId, StateGroupMap::kMaxDenseStateValue));
+    EXPECT_EQ(Value(StateTracker::kStateUnknown), mapState(stateGroupMap, kAtomId, 1000));
+}
+
+TEST(StateGroupMapTest, TestAtomWithoutStateGroups) {
+    StateGroupMap stateGroupMap({{kAtomId, {{1, 100}}}});
+
+    // The states of atoms without groups are kept as they are.
+    EXPECT_EQ(Value(1), mapState(stateGroupMap, kOtherAtomId, 1));
+    EXPECT_EQ(Value(7), mapState(StateGroupMap(), kAtomId, 7));
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -58,6 +58,14 @@ public:
     }
 };
 
+// A listener that only queries state values.
+class QueryOnlyStateListener : public TestStateListener {
+public:
+    bool needsStateChangeNotifications() const override {
+        return false;
+    }
+};
+
 int getStateInt(StateManager& mgr, int atomId, const HashableDimensionKey& queryKey) {
     FieldValue output;
     mgr.getStateValue(atomId, queryKey, &output);
@@ -239,6 +247,75 @@ TEST(StateTrackerTest, TestUnregisterListener) {
     EXPECT_EQ(-1, mgr.getListenersCount(util::SCREEN_STATE_CHANGED));
 }
 
+/**
+ * Test that the trackers generation changes exactly when StateTrackers are added or removed, so
+ * that cached results of findStateTracker() are refreshed.
+ */
+TEST(StateTrackerTest, TestTrackersGeneration) {
+    sp<TestStateListener> listener1 = new TestStateListener();
+    sp<TestStateListener> listener2 = new TestStateListener();
+    StateManager mgr;
+    EXPECT_EQ(nullptr, mgr.findStateTracker(util::SCREEN_STATE_CHANGED));
+
+    uint64_t generation = mgr.getTrackersGeneration();
+    mgr.registerListener(util::SCREEN_STATE_CHANGED, listener1);
+    EXPECT_NE(generation, mgr.getTrackersGeneration());
+    const StateTracker* stateTracker = mgr.findStateTracker(util::SCREEN_STATE_CHANGED);
+    ASSERT_NE(nullptr, stateTracker);
+
+    // Adding a listener to an existing tracker or removing one of several keeps the tracker.
+    generation = mgr.getTrackersGeneration();
+    mgr.registerListener(util::SCREEN_STATE_CHANGED, listener2);
+    mgr.unregisterListener(util::SCREEN_STATE_CHANGED, listener1);
+    EXPECT_EQ(generation, mgr.getTrackersGeneration());
+    EXPECT_EQ(stateTracker, mgr.findStateTracker(util::SCREEN_STATE_CHANGED));
+
+    mgr.unregisterListener(util::SCREEN_STATE_CHANGED, listener2);
+    EXPECT_NE(generation, mgr.getTrackersGeneration());
+    EXPECT_EQ(nullptr, mgr.findStateTracker(util::SCREEN_STATE_CHANGED));
+
+    mgr.registerListener(util::SCREEN_STATE_CHANGED, listener1);
+    generation = mgr.getTrackersGeneration();
+    mgr.clear();
+    EXPECT_NE(generation, mgr.getTrackersGeneration());
+}
+
+/**
+ * Test that listeners which only query state values keep the StateTracker alive, but are not
+ * notified of state changes.
+ */
+TEST(StateTrackerTest, TestQueryOnlyListener) {
+    sp<TestStateListener> listener = new TestStateListener();
+    sp<QueryOnlyStateListener> queryOnlyListener = new QueryOnlyStateListener();
+    StateManager mgr;
+    mgr.registerListener(util::UID_PROCESS_STATE_CHANGED, queryOnlyListener);
+    mgr.registerListener(util::UID_PROCESS_STATE_CHANGED, queryOnlyListener);
+    mgr.registerListener(util::UID_PROCESS_STATE_CHANGED, listener);
+    EXPECT_EQ(2, mgr.getListenersCount(util::UID_PROCESS_STATE_CHANGED));
+
+    std::unique_ptr<LogEvent> event = CreateUidProcessStateChangedEvent(
+            timestampNs, 1000 /*uid*/, android::app::ProcessStateEnum::PROCESS_STATE_TOP);
+    mgr.onLogEvent(*event);
+    EXPECT_EQ(1, listener->updates.size());
+    EXPECT_EQ(0, queryOnlyListener->updates.size());
+
+    // The state is tracked for the query-only listener alone as well.
+    mgr.unregisterListener(util::UID_PROCESS_STATE_CHANGED, listener);
+    EXPECT_EQ(1, mgr.getListenersCount(util::UID_PROCESS_STATE_CHANGED));
+    event = CreateUidProcessStateChangedEvent(
+            timestampNs + 1000, 1000 /*uid*/,
+            android::app::ProcessStateEnum::PROCESS_STATE_IMPORTANT_FOREGROUND);
+    mgr.onLogEvent(*event);
+    EXPECT_EQ(0, queryOnlyListener->updates.size());
+    HashableDimensionKey queryKey;
+    getUidProcessKey(1000 /* uid */, &queryKey);
+    EXPECT_EQ(android::app::ProcessStateEnum::PROCESS_STATE_IMPORTANT_FOREGROUND,
+              getStateInt(mgr, util::UID_PROCESS_STATE_CHANGED, queryKey));
+
+    mgr.unregisterListener(util::UID_PROCESS_STATE_CHANGED, queryOnlyListener);
+    EXPECT_EQ(0, mgr.getStateTrackersCount());
+}
+
 /**
  * Test a binary state atom with nested counting.
  *
@@ -84,6 +84,17 @@ class MockUidMap : public UidMap {
 public:
     MOCK_METHOD(int, getHostUidOrSelf, (int uid), (const));
     MOCK_METHOD(std::set<int32_t>, getAppUid, (const string& package), (const));
+
+    // Goes through the mocked getHostUidOrSelf for each uid.
+    void mapAttributionUidsToHostUids(vector<FieldValue>* values, size_t first,
+                                      size_t last) const override {
+        for (size_t i = first; i <= last; i++) {
+            FieldValue& fieldValue = (*values)[i];
+            if (isAttributionUidField(fieldValue)) {
+                fieldValue.mValue.setInt(getHostUidOrSelf(fieldValue.mValue.int_value));
+            }
+        }
+    }
 };
 
 class BasicMockLogEventFilter : public LogEventFilter {
@@ -119,6 +130,10 @@ public:
                 (StatsSubscriptionCallbackReason in_reason,
                  const std::vector<uint8_t>& in_subscriptionPayload),
                 (override));
+    MOCK_METHOD(Status, onSubscriptionDataInRing,
+                (StatsSubscriptionCallbackReason in_reason, int64_t in_position,
+                 int32_t in_numBytes),
+                (override));
 };
 
 class StatsServiceConfigTest : public ::testing::Test {
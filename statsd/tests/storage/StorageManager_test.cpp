@@ -15,6 +15,7 @@
 #include "src/storage/StorageManager.h"
 
 #include <android-base/unique_fd.h>
+#include <dirent.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <stdio.h>
@@ -203,6 +204,106 @@ TEST(StorageManagerTest, AppendConfigReportTest4) {
     clearLocalHistoryTestFiles();
 }
 
+TEST(StorageManagerTest, HasConfigMetricsReportFollowsFileChanges) {
+    const ConfigKey key(1066, 2);
+    const string file = StorageManager::getDataFileName(getWallClockSec(), key.GetUid(),
+                                                        key.GetId());
+    EXPECT_FALSE(StorageManager::hasConfigMetricsReport(key));
+
+    const string content = "content";
+    StorageManager::writeFile(file.c_str(), content.data(), content.size());
+    EXPECT_TRUE(StorageManager::hasConfigMetricsReport(key));
+    StorageManager::deleteFile(file.c_str());
+    EXPECT_FALSE(StorageManager::hasConfigMetricsReport(key));
+
+    // Changes made without StorageManager are picked up too.
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+            open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+    ASSERT_NE(fd, -1);
+    EXPECT_TRUE(StorageManager::hasConfigMetricsReport(key));
+    TEMP_FAILURE_RETRY(remove(file.c_str()));
+    EXPECT_FALSE(StorageManager::hasConfigMetricsReport(key));
+}
+
+TEST(StorageManagerTest, AppendConfigReportContent) {
+    const ConfigKey key(1066, 3);
+    ConfigMetricsReport report;
+    report.set_last_report_elapsed_nanos(7);
+    report.set_current_report_elapsed_nanos(123);
+    const string content = report.SerializeAsString();
+    const string file = StorageManager::getDataFileName(getWallClockSec(), key.GetUid(),
+                                                        key.GetId());
+    StorageManager::writeFile(file.c_str(), content.data(), content.size());
+
+    ProtoOutputStream out;
+    StorageManager::appendConfigMetricsReport(key, &out, true /*erase?*/, false /*isAdb?*/);
+
+    ConfigMetricsReportList reports;
+    ASSERT_TRUE(parseProtoOutputStream(out, &reports));
+    ASSERT_EQ(reports.reports_size(), 1);
+    EXPECT_EQ(reports.reports(0).last_report_elapsed_nanos(), 7);
+    EXPECT_EQ(reports.reports(0).current_report_elapsed_nanos(), 123);
+    EXPECT_FALSE(fileExist(file));
+}
+
+TEST(StorageManagerTest, AppendCompressedConfigReport) {
+    const ConfigKey key(1066, 6);
+    ConfigMetricsReport report;
+    report.set_last_report_elapsed_nanos(7);
+    report.set_current_report_elapsed_nanos(123);
+    for (int i = 0; i < 100; i++) {
+        report.add_strings("string");
+    }
+    const string content = report.SerializeAsString();
+    const string file = StorageManager::getDataFileName(getWallClockSec(), key.GetUid(),
+                                                        key.GetId());
+    StorageManager::setCompressReports(true);
+    StorageManager::writeFile(file.c_str(), content.data(), content.size());
+    StorageManager::setCompressReports(false);
+
+    string fileContent;
+    ASSERT_TRUE(StorageManager::readFileToString(file.c_str(), &fileContent));
+    EXPECT_LT(fileContent.size(), content.size());
+
+    ProtoOutputStream out;
+    StorageManager::appendConfigMetricsReport(key, &out, true /*erase?*/, false /*isAdb?*/);
+
+    ConfigMetricsReportList reports;
+    ASSERT_TRUE(parseProtoOutputStream(out, &reports));
+    ASSERT_EQ(reports.reports_size(), 1);
+    EXPECT_EQ(reports.reports(0).last_report_elapsed_nanos(), 7);
+    EXPECT_EQ(reports.reports(0).current_report_elapsed_nanos(), 123);
+    EXPECT_EQ(reports.reports(0).strings_size(), 100);
+    EXPECT_FALSE(fileExist(file));
+}
+
+TEST(StorageManagerTest, WriteFileAsyncReplacesFile) {
+    const string file = StorageManager::getDataFileName(getWallClockSec(), 1066, 4);
+    const string oldContent = "older and longer content";
+    StorageManager::writeFile(file.c_str(), oldContent.data(), oldContent.size());
+
+    for (int i = 0; i < 100; i++) {
+        const string content = "content" + std::to_string(i);
+        StorageManager::writeFileAsync(file, vector<uint8_t>(content.begin(), content.end()));
+    }
+    StorageManager::waitForPendingWrites();
+
+    string content;
+    ASSERT_TRUE(StorageManager::readFileToString(file.c_str(), &content));
+    EXPECT_EQ(content, "content99");
+    StorageManager::deleteFile(file.c_str());
+}
+
+TEST(StorageManagerTest, DeleteFileCancelsAsyncWrite) {
+    const string file = StorageManager::getDataFileName(getWallClockSec(), 1066, 5);
+    const string content = "content";
+    StorageManager::writeFileAsync(file, vector<uint8_t>(content.begin(), content.end()));
+    StorageManager::deleteFile(file.c_str());
+    StorageManager::waitForPendingWrites();
+
+    EXPECT_FALSE(fileExist(file));
+}
+
 TEST(StorageManagerTest, TrainInfoReadWrite32To64BitTest) {
     InstallTrainInfo trainInfo;
     trainInfo.trainVersionCode = 12345;
@@ -281,6 +382,53 @@ TEST(StorageManagerTest, TrainInfoReadWrite32To64BitTest) {
     EXPECT_EQ(trainInfo.experimentIds, trainInfoResult.experimentIds);
 }
 
+TEST(StorageManagerTest, TrainInfoRewriteKeepsOneFileTest) {
+    InstallTrainInfo trainInfo;
+    trainInfo.trainVersionCode = 1;
+    trainInfo.trainName = "rewritten_train";
+    trainInfo.status = 1;
+    trainInfo.experimentIds = {1, 2};
+    ASSERT_TRUE(StorageManager::writeTrainInfo(trainInfo));
+    trainInfo.trainVersionCode = 2;
+    trainInfo.experimentIds = {3};
+    ASSERT_TRUE(StorageManager::writeTrainInfo(trainInfo));
+
+    // The latest train info is read before it is written to disk.
+    InstallTrainInfo trainInfoResult;
+    ASSERT_TRUE(StorageManager::readTrainInfo(trainInfo.trainName, trainInfoResult));
+    EXPECT_EQ(2, trainInfoResult.trainVersionCode);
+    EXPECT_THAT(trainInfoResult.experimentIds, ElementsAre(3));
+
+    const vector<InstallTrainInfo> trainInfos = StorageManager::readAllTrainInfo();
+    EXPECT_EQ(1, std::count_if(trainInfos.begin(), trainInfos.end(),
+                               [&trainInfo](const InstallTrainInfo& info) {
+                                   return info.trainName == trainInfo.trainName;
+                               }));
+
+    StorageManager::waitForPendingWrites();
+    int numFiles = 0;
+    unique_ptr<DIR, decltype(&closedir)> dir(opendir(TRAIN_INFO_DIR), closedir);
+    ASSERT_NE(dir, nullptr);
+    while (dirent* de = readdir(dir.get())) {
+        const string name = de->d_name;
+        if (name.size() > trainInfo.trainName.size() &&
+            name.compare(name.size() - trainInfo.trainName.size(), string::npos,
+                         trainInfo.trainName) == 0) {
+            numFiles++;
+        }
+    }
+    EXPECT_EQ(1, numFiles);
+
+    // The train info is reloaded from its file.
+    StorageManager::deleteSuffixedFiles(TRAIN_INFO_DIR, "no_such_train");
+    trainInfoResult = InstallTrainInfo();
+    ASSERT_TRUE(StorageManager::readTrainInfo(trainInfo.trainName, trainInfoResult));
+    EXPECT_EQ(2, trainInfoResult.trainVersionCode);
+    EXPECT_THAT(trainInfoResult.experimentIds, ElementsAre(3));
+
+    StorageManager::deleteSuffixedFiles(TRAIN_INFO_DIR, trainInfo.trainName.c_str());
+}
+
 TEST(StorageManagerTest, DeleteUnmodifiedOldDbFiles) {
     if (!isAtLeastU()) {
         GTEST_SKIP();
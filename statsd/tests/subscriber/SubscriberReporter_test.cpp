@@ -99,6 +99,25 @@ TEST_F(SubscriberReporterTest, TestBroadcastSubscriberDeathKeepsReplacedPir) {
                                  {configKey2, {{subscriptionId1, pir3}}}};
     EXPECT_THAT(SubscriberReporter::getInstance().mIntentMap, ContainerEq(expectedIntentMap));
 }
+
+TEST_F(SubscriberReporterTest, TestAlertBroadcastSubscriberSendsParcel) {
+    Subscription subscription;
+    subscription.set_id(1);
+    subscription.set_rule_id(2);
+    subscription.mutable_broadcast_subscriber_details()->set_subscriber_id(subscriptionId2);
+    subscription.mutable_broadcast_subscriber_details()->add_cookie("cookie");
+
+    StatsDimensionsValueParcel dimensionsValueParcel;
+    dimensionsValueParcel.field = 10;
+    EXPECT_CALL(*pir2, sendSubscriberBroadcast(configKey1.GetUid(), configKey1.GetId(),
+                                               subscription.id(), subscription.rule_id(),
+                                               ElementsAre("cookie"), dimensionsValueParcel))
+            .Times(1)
+            .WillOnce(Return(ByMove(Status::ok())));
+
+    SubscriberReporter::getInstance().alertBroadcastSubscriber(configKey1, subscription,
+                                                               dimensionsValueParcel);
+}
 }  // namespace statsd
 }  // namespace os
 }  // namespace android
@@ -270,6 +270,109 @@ TEST_F(DbUtilsTest, TestInsertTwoEventsEnforceTtl) {
                 ElementsAre("atomId", "elapsedTimestampNs", "wallTimestampNs", "field_1"));
 }
 
+TEST_F(DbUtilsTest, TestInsertManyEventsReusesConnection) {
+    int64_t eventElapsedTimeNs = 10000000000;
+
+    // More rows than fit in one transaction.
+    vector<LogEvent> events;
+    for (int i = 0; i < 1001; ++i) {
+        AStatsEvent* statsEvent = makeAStatsEvent(tagId, eventElapsedTimeNs + i);
+        AStatsEvent_writeInt32(statsEvent, i);
+        events.push_back(makeLogEvent(statsEvent));
+    }
+
+    sqlite3* db = getDb(key);
+    ASSERT_NE(db, nullptr);
+    EXPECT_TRUE(createTableIfNeeded(db, metricId, events[0]));
+    string err;
+    EXPECT_TRUE(insert(db, metricId, events, err));
+    // The second insert reuses the statement prepared on this handle by the first.
+    EXPECT_TRUE(insert(db, metricId, events, err));
+    closeDb(db);
+
+    std::vector<int32_t> columnTypes;
+    std::vector<string> columnNames;
+    std::vector<std::vector<std::string>> rows;
+    string zSql = "SELECT COUNT(*), MAX(field_1) FROM metric_111";
+    EXPECT_TRUE(query(key, zSql, rows, columnTypes, columnNames, err));
+
+    ASSERT_EQ(rows.size(), 1);
+    EXPECT_THAT(rows[0], ElementsAre("2002", "1000"));
+}
+
+TEST_F(DbUtilsTest, TestInsertBufferedEvents) {
+    int64_t eventElapsedTimeNs = 10000000000;
+
+    AStatsEvent* statsEvent1 = makeAStatsEvent(tagId, eventElapsedTimeNs + 10);
+    AStatsEvent_writeInt64(statsEvent1, 111);
+    AStatsEvent_writeFloat(statsEvent1, 1.5);
+    AStatsEvent_writeString(statsEvent1, "111");
+    LogEvent logEvent1 = makeLogEvent(statsEvent1);
+
+    AStatsEvent* statsEvent2 = makeAStatsEvent(tagId, eventElapsedTimeNs + 20);
+    AStatsEvent_writeInt64(statsEvent2, 222);
+    AStatsEvent_writeFloat(statsEvent2, 2.5);
+    AStatsEvent_writeString(statsEvent2, "222");
+    LogEvent logEvent2 = makeLogEvent(statsEvent2);
+
+    RestrictedEventBuffer events;
+    events.append(logEvent1);
+    events.append(logEvent2);
+
+    sqlite3* db = getDb(key);
+    ASSERT_NE(db, nullptr);
+    EXPECT_TRUE(createTableIfNeeded(db, metricId, logEvent1));
+    string err;
+    EXPECT_TRUE(insert(db, metricId, events, err));
+    closeDb(db);
+
+    std::vector<int32_t> columnTypes;
+    std::vector<string> columnNames;
+    std::vector<std::vector<std::string>> rows;
+    string zSql = "SELECT * FROM metric_111 ORDER BY elapsedTimestampNs";
+    EXPECT_TRUE(query(key, zSql, rows, columnTypes, columnNames, err));
+
+    ASSERT_EQ(rows.size(), 2);
+    EXPECT_THAT(rows[0], ElementsAre("1", to_string(eventElapsedTimeNs + 10), _, "111", _, "111"));
+    EXPECT_THAT(rows[1], ElementsAre("1", to_string(eventElapsedTimeNs + 20), _, "222", _, "222"));
+    EXPECT_THAT(columnTypes, ElementsAre(SQLITE_INTEGER, SQLITE_INTEGER, SQLITE_INTEGER,
+                                         SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT));
+}
+
+TEST_F(DbUtilsTest, TestAcquireDbReusesPooledConnection) {
+    sqlite3* db = acquireDb(key);
+    ASSERT_NE(db, nullptr);
+    // The pooled connection is in use, so a second caller gets its own.
+    sqlite3* otherDb = acquireDb(key);
+    ASSERT_NE(otherDb, nullptr);
+    EXPECT_NE(db, otherDb);
+    releaseDb(otherDb);
+    releaseDb(db);
+
+    EXPECT_EQ(acquireDb(key), db);
+    releaseDb(db);
+
+    AStatsEvent* statsEvent = makeAStatsEvent(tagId, /*timestampNs=*/10000000000);
+    AStatsEvent_writeString(statsEvent, "111");
+    LogEvent logEvent = makeLogEvent(statsEvent);
+    vector<LogEvent> events{logEvent};
+    EXPECT_TRUE(createTableIfNeeded(key, metricId, logEvent));
+    string err;
+    EXPECT_TRUE(insert(key, metricId, events, err));
+
+    // Deleting the db closes the pooled connection, so the next insert recreates the file.
+    deleteDb(key);
+    EXPECT_TRUE(createTableIfNeeded(key, metricId, logEvent));
+    EXPECT_TRUE(insert(key, metricId, events, err));
+
+    std::vector<int32_t> columnTypes;
+    std::vector<string> columnNames;
+    std::vector<std::vector<std::string>> rows;
+    string zSql = "SELECT * FROM metric_111";
+    EXPECT_TRUE(query(key, zSql, rows, columnTypes, columnNames, err));
+    EXPECT_EQ(rows.size(), 1);
+}
+
 TEST_F(DbUtilsTest, TestMaliciousQuery) {
     int64_t eventElapsedTimeNs = 10000000000;
 
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/DeltaEncodedTimestamps.h"
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <random>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+vector<int64_t> decode(const DeltaEncodedTimestamps& timestamps) {
+    return vector<int64_t>(timestamps.begin(), timestamps.end());
+}
+
+}  // anonymous namespace
+
+TEST(DeltaEncodedTimestampsTest, TestEmpty) {
+    DeltaEncodedTimestamps timestamps;
+    EXPECT_TRUE(timestamps.empty());
+    EXPECT_EQ(0u, timestamps.size());
+    EXPECT_EQ(0u, timestamps.encodedByteSize());
+    EXPECT_TRUE(timestamps.begin() == timestamps.end());
+}
+
+TEST(DeltaEncodedTimestampsTest, TestCloseTimestampsAreCompact) {
+    DeltaEncodedTimestamps timestamps;
+    vector<int64_t> expected;
+    const int64_t startNs = 123456789012345LL;
+    for (int64_t i = 0; i < 100; i++) {
+        expected.push_back(startNs + i * 50);
+        timestamps.push_back(expected.back());
+    }
+    EXPECT_EQ(100u, timestamps.size());
+    EXPECT_EQ(expected, decode(timestamps));
+    // The first timestamp takes 7 bytes, each of the deltas 1.
+    EXPECT_EQ(7u + 99u, timestamps.encodedByteSize());
+}
+
+TEST(DeltaEncodedTimestampsTest, TestOutOfOrderAndExtremeTimestamps) {
+    const vector<int64_t> expected = {0,
+                                      5,
+                                      -5,
+                                      numeric_limits<int64_t>::max(),
+                                      numeric_limits<int64_t>::min(),
+                                      numeric_limits<int64_t>::max(),
+                                      1000,
+                                      999};
+    DeltaEncodedTimestamps timestamps;
+    for (int64_t timestamp : expected) {
+        timestamps.push_back(timestamp);
+    }
+    EXPECT_EQ(expected, decode(timestamps));
+}
+
+TEST(DeltaEncodedTimestampsTest, TestCopyAndAppendAfterIterating) {
+    mt19937_64 random(42);
+    DeltaEncodedTimestamps timestamps;
+    vector<int64_t> expected;
+    int64_t timestampNs = 1000000000LL;
+    for (int i = 0; i < 1000; i++) {
+        timestampNs += static_cast<int64_t>(random() % 10000000) - 1000000;
+        expected.push_back(timestampNs);
+        timestamps.push_back(timestampNs);
+        if (i % 100 == 0) {
+            ASSERT_EQ(expected, decode(timestamps));
+        }
+    }
+    DeltaEncodedTimestamps copy = timestamps;
+    copy.push_back(7);
+    EXPECT_EQ(expected, decode(timestamps));
+    expected.push_back(7);
+    EXPECT_EQ(expected, decode(copy));
+    EXPECT_EQ(1001u, copy.size());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/DumpBuffer.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+
+#ifdef __ANDROID__
+
+using android::base::ReadFdToString;
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+string readAll(int fd) {
+    string content;
+    lseek(fd, 0, SEEK_SET);
+    ReadFdToString(fd, &content);
+    return content;
+}
+
+}  // anonymous namespace
+
+TEST(DumpBufferTest, TestWrittenOnFlush) {
+    TemporaryFile out;
+    DumpBuffer buffer(out.fd);
+    ASSERT_NE(out.fd, buffer.fd());
+
+    dprintf(buffer.fd(), "count: %d\n", 1);
+    EXPECT_EQ("", readAll(out.fd));
+
+    EXPECT_TRUE(buffer.flush());
+    EXPECT_EQ("count: 1\n", readAll(out.fd));
+
+    // The buffer is emptied by the flush.
+    dprintf(buffer.fd(), "count: %d\n", 2);
+    EXPECT_TRUE(buffer.flush());
+    EXPECT_EQ("count: 1\ncount: 2\n", readAll(out.fd));
+}
+
+TEST(DumpBufferTest, TestLargeDump) {
+    TemporaryFile out;
+    DumpBuffer buffer(out.fd);
+    string expected;
+    for (int i = 0; i < 10000; i++) {
+        dprintf(buffer.fd(), "dimension %d\n", i);
+        expected += "dimension " + to_string(i) + "\n";
+    }
+    EXPECT_TRUE(buffer.flush());
+    EXPECT_EQ(expected, readAll(out.fd));
+}
+
+TEST(DumpBufferTest, TestFlushToInvalidOutput) {
+    DumpBuffer buffer(/* out */ -1);
+    dprintf(buffer.fd(), "lost\n");
+    EXPECT_FALSE(buffer.flush());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/FlatHashMap.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <unordered_map>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(FlatHashMapTest, TestInsertFindErase) {
+    FlatHashMap<int, string> map;
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(map.end(), map.find(1));
+
+    map[1] = "one";
+    EXPECT_TRUE(map.emplace(2, "two").second);
+    EXPECT_FALSE(map.emplace(2, "deux").second);
+    EXPECT_TRUE(map.insert({3, "three"}).second);
+    ASSERT_EQ(3u, map.size());
+    EXPECT_EQ("two", map.find(2)->second);
+    EXPECT_EQ(1u, map.count(3));
+
+    EXPECT_EQ(1u, map.erase(2));
+    EXPECT_EQ(0u, map.erase(2));
+    EXPECT_EQ(map.end(), map.find(2));
+    ASSERT_EQ(2u, map.size());
+
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(map.begin(), map.end());
+}
+
+TEST(FlatHashMapTest, TestMatchesUnorderedMap) {
+    FlatHashMap<int, int> map;
+    unordered_map<int, int> expected;
+    // Enough churn to grow the table several times and reuse tombstones.
+    for (int i = 0; i < 20000; i++) {
+        const int key = (i * 7919) % 3000;
+        if (i % 3 == 0) {
+            EXPECT_EQ(expected.erase(key), map.erase(key));
+        } else {
+            expected[key] += i;
+            map[key] += i;
+        }
+    }
+    ASSERT_EQ(expected.size(), map.size());
+    size_t visited = 0;
+    for (const auto& [key, value] : map) {
+        ASSERT_EQ(1u, expected.count(key));
+        EXPECT_EQ(expected[key], value);
+        visited++;
+    }
+    EXPECT_EQ(expected.size(), visited);
+}
+
+TEST(FlatHashMapTest, TestEraseWhileIterating) {
+    FlatHashMap<int, int> map;
+    for (int i = 0; i < 100; i++) {
+        map[i] = i;
+    }
+    for (auto it = map.begin(); it != map.end();) {
+        if (it->first % 2 == 0) {
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    ASSERT_EQ(50u, map.size());
+    for (const auto& [key, value] : map) {
+        EXPECT_EQ(1, key % 2);
+    }
+}
+
+TEST(FlatHashMapTest, TestCopyAndMove) {
+    FlatHashMap<string, int> map = {{"a", 1}, {"b", 2}};
+    FlatHashMap<string, int> copy(map);
+    EXPECT_EQ(map, copy);
+
+    copy["c"] = 3;
+    EXPECT_NE(map, copy);
+
+    FlatHashMap<string, int> moved(std::move(copy));
+    EXPECT_TRUE(copy.empty());
+    ASSERT_EQ(3u, moved.size());
+    EXPECT_EQ(3, moved.find("c")->second);
+
+    map = std::move(moved);
+    ASSERT_EQ(3u, map.size());
+    EXPECT_EQ(1, map.find("a")->second);
+}
+
+TEST(FlatHashMapTest, TestTableByteSize) {
+    FlatHashMap<int64_t, int64_t> map;
+    EXPECT_EQ(0u, map.tableByteSize());
+
+    map[1] = 1;
+    const size_t slotBytes = sizeof(std::pair<int64_t, int64_t>) + 1;
+    EXPECT_EQ(map.capacity() * slotBytes, map.tableByteSize());
+
+    // Erasing keeps the table, clearing it does too.
+    map.erase(1);
+    EXPECT_EQ(map.capacity() * slotBytes, map.tableByteSize());
+    map.clear();
+    EXPECT_GT(map.tableByteSize(), 0u);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
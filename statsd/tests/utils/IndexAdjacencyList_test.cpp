@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/IndexAdjacencyList.h"
+
+#include <gtest/gtest.h>
+
+#include <unordered_map>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+vector<int> toVector(const IndexAdjacencyList::Range& range) {
+    return vector<int>(range.begin(), range.end());
+}
+}  // anonymous namespace
+
+TEST(IndexAdjacencyListTest, TestEmpty) {
+    IndexAdjacencyList list;
+    EXPECT_EQ(0u, list.nodeCount());
+    EXPECT_EQ(0u, list.edgeCount());
+    EXPECT_TRUE(list.targets(0).empty());
+    EXPECT_FALSE(list.hasTargets(0));
+}
+
+TEST(IndexAdjacencyListTest, TestBuild) {
+    const unordered_map<int, vector<int>> edges = {{0, {3, 1}}, {2, {5}}, {4, {}}, {7, {8}}};
+    IndexAdjacencyList list;
+    list.build(edges, 5);
+
+    EXPECT_EQ(5u, list.nodeCount());
+    EXPECT_EQ(3u, list.edgeCount());
+    EXPECT_EQ(vector<int>({3, 1}), toVector(list.targets(0)));
+    EXPECT_TRUE(list.targets(1).empty());
+    EXPECT_EQ(vector<int>({5}), toVector(list.targets(2)));
+    EXPECT_TRUE(list.targets(3).empty());
+    EXPECT_TRUE(list.targets(4).empty());
+    EXPECT_TRUE(list.hasTargets(0));
+    EXPECT_FALSE(list.hasTargets(4));
+
+    // Nodes outside [0, nodeCount) are dropped.
+    EXPECT_TRUE(list.targets(7).empty());
+    EXPECT_TRUE(list.targets(-1).empty());
+}
+
+TEST(IndexAdjacencyListTest, TestRebuild) {
+    IndexAdjacencyList list;
+    list.build({{0, {1, 2, 3}}, {1, {4}}}, 2);
+    list.build({{1, {6}}}, 3);
+
+    EXPECT_EQ(3u, list.nodeCount());
+    EXPECT_EQ(1u, list.edgeCount());
+    EXPECT_TRUE(list.targets(0).empty());
+    EXPECT_EQ(vector<int>({6}), toVector(list.targets(1)));
+    EXPECT_TRUE(list.targets(2).empty());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/LaneExecutor.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(LaneExecutorTest, TestRunsEveryLaneOnce) {
+    LaneExecutor lanes(4);
+    ASSERT_EQ(4u, lanes.getNumLanes());
+
+    vector<atomic<int>> runs(lanes.getNumLanes());
+    for (int round = 1; round <= 50; round++) {
+        lanes.runOnEveryLane([&](size_t lane) { runs[lane]++; });
+        // Every lane is done by the time runOnEveryLane returns.
+        for (size_t lane = 0; lane < runs.size(); lane++) {
+            EXPECT_EQ(round, runs[lane]) << "Lane " << lane;
+        }
+    }
+}
+
+TEST(LaneExecutorTest, TestLanesKeepTheirThread) {
+    LaneExecutor lanes(3);
+    vector<thread::id> firstThreads(lanes.getNumLanes());
+    lanes.runOnEveryLane([&](size_t lane) { firstThreads[lane] = this_thread::get_id(); });
+
+    EXPECT_EQ(this_thread::get_id(), firstThreads[0]);
+    EXPECT_NE(firstThreads[0], firstThreads[1]);
+    EXPECT_NE(firstThreads[1], firstThreads[2]);
+
+    vector<thread::id> secondThreads(lanes.getNumLanes());
+    lanes.runOnEveryLane([&](size_t lane) { secondThreads[lane] = this_thread::get_id(); });
+    EXPECT_EQ(firstThreads, secondThreads);
+}
+
+TEST(LaneExecutorTest, TestSingleLaneRunsInline) {
+    LaneExecutor lanes(0);
+    ASSERT_EQ(1u, lanes.getNumLanes());
+
+    thread::id ranOn;
+    lanes.runOnEveryLane([&](size_t lane) {
+        EXPECT_EQ(0u, lane);
+        ranOn = this_thread::get_id();
+    });
+    EXPECT_EQ(this_thread::get_id(), ranOn);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
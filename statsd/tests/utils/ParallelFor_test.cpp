@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/ParallelFor.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(ParallelForTest, TestRunsEveryTaskOnce) {
+    vector<atomic<int>> runs(100);
+    parallelFor(runs.size(), 4, [&](size_t i) { runs[i]++; });
+    for (size_t i = 0; i < runs.size(); i++) {
+        EXPECT_EQ(1, runs[i]) << "Task " << i;
+    }
+}
+
+TEST(ParallelForTest, TestThreadCount) {
+    mutex lock;
+    set<thread::id> threadIds;
+    const auto recordThread = [&](size_t) {
+        lock_guard<mutex> guard(lock);
+        threadIds.insert(this_thread::get_id());
+    };
+
+    parallelFor(10, 1, recordThread);
+    EXPECT_EQ(set<thread::id>({this_thread::get_id()}), threadIds);
+
+    // Never more threads than tasks.
+    threadIds.clear();
+    parallelFor(1, 8, recordThread);
+    EXPECT_EQ(set<thread::id>({this_thread::get_id()}), threadIds);
+
+    threadIds.clear();
+    parallelFor(100, 3, recordThread);
+    EXPECT_LE(threadIds.size(), 3u);
+}
+
+TEST(ParallelForTest, TestNoTasks) {
+    int runs = 0;
+    parallelFor(0, 4, [&](size_t) { runs++; });
+    EXPECT_EQ(0, runs);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/ProtoOutputStreamPool.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#ifdef __ANDROID__
+
+using android::util::FIELD_TYPE_STRING;
+using android::util::ProtoOutputStream;
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+void writeBytes(ProtoOutputStream* proto, size_t bytes) {
+    const string data(bytes, 'a');
+    proto->write(FIELD_TYPE_STRING | 1, data);
+}
+
+}  // anonymous namespace
+
+TEST(ProtoOutputStreamPoolTest, TestStreamReusedCleared) {
+    ProtoOutputStreamPool pool(/* maxPooledBytes */ 1000);
+    const ConfigKey key(0, 1);
+
+    unique_ptr<ProtoOutputStream> proto = pool.acquire(key);
+    writeBytes(proto.get(), 100);
+    ProtoOutputStream* released = proto.get();
+    const size_t bytes = proto->size();
+    pool.release(key, std::move(proto));
+    EXPECT_EQ(bytes, pool.getPooledBytes());
+
+    proto = pool.acquire(key);
+    EXPECT_EQ(released, proto.get());
+    EXPECT_EQ(0, proto->size());
+    EXPECT_EQ(0, pool.getPooledBytes());
+
+    // The stream is handed out exclusively.
+    unique_ptr<ProtoOutputStream> other = pool.acquire(key);
+    EXPECT_NE(proto.get(), other.get());
+}
+
+TEST(ProtoOutputStreamPoolTest, TestStreamOverCapDropped) {
+    ProtoOutputStreamPool pool(/* maxPooledBytes */ 100);
+    const ConfigKey key(0, 1);
+
+    unique_ptr<ProtoOutputStream> proto = pool.acquire(key);
+    writeBytes(proto.get(), 200);
+    pool.release(key, std::move(proto));
+    EXPECT_EQ(0, pool.getPooledBytes());
+}
+
+TEST(ProtoOutputStreamPoolTest, TestOtherConfigsEvicted) {
+    ProtoOutputStreamPool pool(/* maxPooledBytes */ 300);
+    const ConfigKey key1(0, 1);
+    const ConfigKey key2(0, 2);
+
+    unique_ptr<ProtoOutputStream> proto1 = pool.acquire(key1);
+    writeBytes(proto1.get(), 200);
+    pool.release(key1, std::move(proto1));
+
+    unique_ptr<ProtoOutputStream> proto2 = pool.acquire(key2);
+    writeBytes(proto2.get(), 200);
+    ProtoOutputStream* released = proto2.get();
+    const size_t bytes = proto2->size();
+    pool.release(key2, std::move(proto2));
+    EXPECT_EQ(bytes, pool.getPooledBytes());
+
+    EXPECT_EQ(released, pool.acquire(key2).get());
+
+    pool.release(key1, pool.acquire(key1));
+    pool.erase(key1);
+    EXPECT_EQ(0, pool.getPooledBytes());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/ReaderPriorityBooster.h"
+
+#include <gtest/gtest.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+const int64_t kBoostThresholdNs = 1000;
+const int64_t kRestoreThresholdNs = 100;
+
+}  // anonymous namespace
+
+TEST(ReaderPriorityBoosterTest, TestBoostAndRestore) {
+    const int normalNice = getpriority(PRIO_PROCESS, gettid());
+    const int boostedNice = normalNice - 4;
+    vector<int> niceValues;
+    {
+        ReaderPriorityBooster booster(kBoostThresholdNs, kRestoreThresholdNs, boostedNice,
+                                      [&niceValues](int nice) {
+                                          niceValues.push_back(nice);
+                                          return true;
+                                      });
+        EXPECT_FALSE(booster.onBatch(kBoostThresholdNs));
+        EXPECT_FALSE(booster.isBoosted());
+
+        EXPECT_TRUE(booster.onBatch(kBoostThresholdNs + 1));
+        EXPECT_TRUE(booster.isBoosted());
+        EXPECT_FALSE(booster.onBatch(kBoostThresholdNs + 1));
+
+        // The reader stays boosted until the residency is under the restore threshold.
+        EXPECT_FALSE(booster.onBatch(kRestoreThresholdNs));
+        EXPECT_TRUE(booster.isBoosted());
+        EXPECT_FALSE(booster.onBatch(kRestoreThresholdNs - 1));
+        EXPECT_FALSE(booster.isBoosted());
+
+        EXPECT_TRUE(booster.onBatch(kBoostThresholdNs + 1));
+    }
+    // The booster restores the priority when destroyed.
+    EXPECT_EQ(vector<int>({boostedNice, normalNice, boostedNice, normalNice}), niceValues);
+}
+
+TEST(ReaderPriorityBoosterTest, TestBoostUnavailable) {
+    int attempts = 0;
+    ReaderPriorityBooster booster(kBoostThresholdNs, kRestoreThresholdNs,
+                                  getpriority(PRIO_PROCESS, gettid()) - 4, [&attempts](int) {
+                                      attempts++;
+                                      return false;
+                                  });
+    EXPECT_FALSE(booster.onBatch(kBoostThresholdNs + 1));
+    EXPECT_FALSE(booster.isBoosted());
+
+    // Boosting is not attempted again.
+    EXPECT_FALSE(booster.onBatch(kBoostThresholdNs + 1));
+    EXPECT_EQ(1, attempts);
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
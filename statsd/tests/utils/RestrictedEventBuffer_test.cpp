@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/RestrictedEventBuffer.h"
+
+#include <gtest/gtest.h>
+
+#include "tests/statsd_test_util.h"
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+namespace {
+
+LogEvent makeLogEvent(int32_t atomId, int64_t timestampNs, int32_t intValue, int64_t longValue,
+                      float floatValue, const string& strValue) {
+    AStatsEvent* statsEvent = AStatsEvent_obtain();
+    AStatsEvent_setAtomId(statsEvent, atomId);
+    AStatsEvent_overwriteTimestamp(statsEvent, timestampNs);
+    AStatsEvent_writeInt32(statsEvent, intValue);
+    AStatsEvent_writeInt64(statsEvent, longValue);
+    const uint8_t bytes[] = {1, 2, 3};
+    AStatsEvent_writeByteArray(statsEvent, bytes, sizeof(bytes));
+    AStatsEvent_writeFloat(statsEvent, floatValue);
+    AStatsEvent_writeString(statsEvent, strValue.c_str());
+    LogEvent event(/*uid=*/0, /*pid=*/0);
+    parseStatsEventToLogEvent(statsEvent, &event);
+    return event;
+}
+
+}  // anonymous namespace
+
+TEST(RestrictedEventBufferTest, TestAppend) {
+    RestrictedEventBuffer buffer;
+    EXPECT_TRUE(buffer.empty());
+
+    buffer.append(makeLogEvent(/*atomId=*/1, /*timestampNs=*/100, 7, 8, 1.5f, "first"));
+    buffer.append(makeLogEvent(/*atomId=*/2, /*timestampNs=*/200, -7, -8, 2.5f, "second"));
+    ASSERT_EQ(buffer.size(), 2);
+
+    const RestrictedEventBuffer::Row& row1 = buffer.getRow(0);
+    EXPECT_EQ(row1.atomId, 1);
+    EXPECT_EQ(row1.elapsedTimestampNs, 100);
+    // The byte array is not stored.
+    ASSERT_EQ(row1.valueCount, 4);
+    EXPECT_EQ(buffer.getValue(row1, 0).type, INT);
+    EXPECT_EQ(buffer.getValue(row1, 0).intValue, 7);
+    EXPECT_EQ(buffer.getValue(row1, 1).type, LONG);
+    EXPECT_EQ(buffer.getValue(row1, 1).longValue, 8);
+    EXPECT_EQ(buffer.getValue(row1, 2).type, FLOAT);
+    EXPECT_EQ(buffer.getValue(row1, 2).floatValue, 1.5f);
+    EXPECT_EQ(buffer.getValue(row1, 3).type, STRING);
+    EXPECT_STREQ(buffer.getString(buffer.getValue(row1, 3)), "first");
+
+    const RestrictedEventBuffer::Row& row2 = buffer.getRow(1);
+    EXPECT_EQ(row2.atomId, 2);
+    EXPECT_EQ(row2.elapsedTimestampNs, 200);
+    ASSERT_EQ(row2.valueCount, 4);
+    EXPECT_EQ(buffer.getValue(row2, 0).intValue, -7);
+    EXPECT_EQ(buffer.getValue(row2, 1).longValue, -8);
+    EXPECT_EQ(buffer.getValue(row2, 2).floatValue, 2.5f);
+    EXPECT_STREQ(buffer.getString(buffer.getValue(row2, 3)), "second");
+
+    EXPECT_EQ(buffer.byteSize(), 2 * sizeof(RestrictedEventBuffer::Row) +
+                                         8 * sizeof(RestrictedEventBuffer::Value) +
+                                         sizeof("first") + sizeof("second"));
+}
+
+TEST(RestrictedEventBufferTest, TestClear) {
+    RestrictedEventBuffer buffer;
+    buffer.append(makeLogEvent(/*atomId=*/1, /*timestampNs=*/100, 7, 8, 1.5f, "first"));
+    buffer.clear();
+    EXPECT_TRUE(buffer.empty());
+    EXPECT_EQ(buffer.byteSize(), 0);
+
+    buffer.append(makeLogEvent(/*atomId=*/2, /*timestampNs=*/200, 9, 10, 3.5f, "second"));
+    ASSERT_EQ(buffer.size(), 1);
+    const RestrictedEventBuffer::Row& row = buffer.getRow(0);
+    EXPECT_EQ(row.firstValue, 0);
+    EXPECT_STREQ(buffer.getString(buffer.getValue(row, 3)), "second");
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
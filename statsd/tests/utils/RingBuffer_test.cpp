@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/RingBuffer.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(RingBufferTest, TestPushPopInOrder) {
+    RingBuffer<int> buffer(3);
+    EXPECT_TRUE(buffer.empty());
+    EXPECT_EQ(3, buffer.capacity());
+
+    EXPECT_TRUE(buffer.push_back(1));
+    EXPECT_TRUE(buffer.push_back(2));
+    buffer.pop_front();
+    EXPECT_TRUE(buffer.push_back(3));
+    EXPECT_TRUE(buffer.push_back(4));
+    EXPECT_TRUE(buffer.full());
+
+    // The entries wrap around the end of the slots.
+    ASSERT_EQ(3, buffer.size());
+    EXPECT_EQ(2, buffer[0]);
+    EXPECT_EQ(3, buffer[1]);
+    EXPECT_EQ(4, buffer[2]);
+    EXPECT_EQ(2, buffer.front());
+}
+
+TEST(RingBufferTest, TestPushToFullOverwritesOldest) {
+    RingBuffer<int> buffer(2);
+    buffer.push_back(1);
+    buffer.push_back(2);
+    EXPECT_FALSE(buffer.push_back(3));
+
+    ASSERT_EQ(2, buffer.size());
+    EXPECT_EQ(2, buffer[0]);
+    EXPECT_EQ(3, buffer[1]);
+}
+
+TEST(RingBufferTest, TestEraseIfKeepsOrder) {
+    RingBuffer<int> buffer(4);
+    buffer.push_back(0);
+    buffer.pop_front();
+    for (int i = 1; i <= 4; i++) {
+        buffer.push_back(i);
+    }
+
+    EXPECT_EQ(2, buffer.eraseIf([](int i) { return i % 2 == 1; }));
+    ASSERT_EQ(2, buffer.size());
+    EXPECT_EQ(2, buffer[0]);
+    EXPECT_EQ(4, buffer[1]);
+
+    buffer.push_back(5);
+    ASSERT_EQ(3, buffer.size());
+    EXPECT_EQ(5, buffer[2]);
+}
+
+TEST(RingBufferTest, TestPoppedEntriesReleased) {
+    RingBuffer<shared_ptr<int>> buffer(2);
+    shared_ptr<int> item = make_shared<int>(1);
+    buffer.push_back(item);
+    EXPECT_EQ(2, item.use_count());
+
+    buffer.pop_front();
+    EXPECT_EQ(1, item.use_count());
+
+    buffer.push_back(item);
+    buffer.push_back(item);
+    buffer.clear();
+    EXPECT_TRUE(buffer.empty());
+    EXPECT_EQ(1, item.use_count());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "utils/StringPool.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __ANDROID__
+
+using namespace std;
+
+namespace android {
+namespace os {
+namespace statsd {
+
+TEST(StringPoolTest, TestEqualStringsShareEntry) {
+    StringPool& pool = StringPool::getInstance();
+    const size_t initialSize = pool.size();
+    {
+        InternedString a(string("com.android.test.pool"));
+        InternedString b(string("com.android.test.pool"));
+        InternedString c(string("com.android.test.other"));
+
+        EXPECT_EQ(a, b);
+        EXPECT_NE(a, c);
+        EXPECT_EQ(a.c_str(), b.c_str());
+        EXPECT_EQ(a.hash(), b.hash());
+        EXPECT_EQ("com.android.test.pool", a);
+        EXPECT_EQ(string("com.android.test.other"), c.str());
+        EXPECT_EQ(initialSize + 2, pool.size());
+
+        InternedString copy(a);
+        EXPECT_EQ(a, copy);
+        EXPECT_EQ(initialSize + 2, pool.size());
+    }
+    EXPECT_EQ(initialSize, pool.size());
+}
+
+TEST(StringPoolTest, TestEmptyString) {
+    const size_t initialSize = StringPool::getInstance().size();
+    InternedString empty;
+    InternedString alsoEmpty(string(""));
+    EXPECT_TRUE(empty.empty());
+    EXPECT_EQ(empty, alsoEmpty);
+    EXPECT_EQ("", empty);
+    EXPECT_EQ(0u, empty.size());
+    EXPECT_EQ(initialSize, StringPool::getInstance().size());
+}
+
+TEST(StringPoolTest, TestAssignAndOrdering) {
+    InternedString a(string("aaa"));
+    InternedString b(string("bbb"));
+    EXPECT_LT(a, b);
+    EXPECT_GT(b, a);
+    EXPECT_FALSE(a < a);
+
+    a = string("bbb");
+    EXPECT_EQ(a, b);
+    a = std::move(b);
+    EXPECT_EQ("bbb", a);
+    EXPECT_TRUE(b.empty());
+}
+
+TEST(StringPoolTest, TestConcurrentInternAndRelease) {
+    const size_t initialSize = StringPool::getInstance().size();
+    const int numThreads = 4;
+    const int numIterations = 10000;
+    vector<thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([] {
+            for (int i = 0; i < numIterations; i++) {
+                InternedString str(to_string(i % 10));
+                InternedString copy = str;
+                EXPECT_EQ(to_string(i % 10), copy);
+            }
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(initialSize, StringPool::getInstance().size());
+}
+
+}  // namespace statsd
+}  // namespace os
+}  // namespace android
+#else
+GTEST_LOG_(INFO) << "This test does nothing.\n";
+#endif